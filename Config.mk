@@ -14,13 +14,22 @@
          VFS=1
         S5FS=1
           VM=1
-     DYNAMIC=0
+     DYNAMIC=1
 # When you finish S5FS, first enable "VM"; once this is working, then enable
-# "DYNAMIC".
+# "DYNAMIC". With "DYNAMIC", programs are linked against /lib/libc.so and
+# loaded by /lib/ld-weenix.so, and every process shares the library's text;
+# set it to 0 to link every program statically.
 
 # Debug message behaviour: Edit `INIT_DBG_MODES` in kernel/util/debug.c to set
 # which messages are shown.
 
+# Kernel build profile, how much checking is compiled in (see kernel.h):
+# "debug" keeps the cheap assertions, the debug-level ones and the dbg()
+# messages; "release" keeps only the cheap assertions; "paranoid" adds the
+# expensive checks of hot paths, such as the page allocator's whole state on
+# every allocation. Run "make clean" after changing it.
+        PROFILE=debug
+
 # Switches for non-required components. If you wish to try implementing
 # some extra features in Weenix, there are some pre-designed features
 # you can add. Turn on one of these flags and re-compile Weenix. Please
@@ -34,16 +43,25 @@
 # first, and make sure to make a copy of your working Weenix before you
 # go breaking it, which we promise you will happen.
 
-         SHADOWD=0 # shadow page cleanup
-        MOUNTING=0 # be able to mount multiple file systems
+         SHADOWD=1 # shadow page cleanup
+        MOUNTING=1 # be able to mount multiple file systems
           GETCWD=0 # getcwd(3) syscall-like functionality
-        UPREEMPT=0 # userland preemption
-        KPREEMPT=0 # kernel space preemption
-             MTP=0 # multiple kernel threads per process
-           PIPES=0 # pipe(2) functionality
+        UPREEMPT=1 # userland preemption
+        KPREEMPT=0 # kernel space preemption (see cond_resched())
+             MTP=1 # multiple kernel threads per process
+             SMP=0 # start the other processors at boot
+           PIPES=1 # pipe(2) functionality
           VGABUF=0 # Use a rudimentary VGA buffers instead of VT support.
-	KPREEMPT=0
         RENAMEDIR=0
+     KMUTEX_STATS=1 # per-mutex contention statistics (kshell "lockstat")
+            SWAP=1 # page anonymous memory out to the last disk if NDISKS > 1
+     FAULT_TRACE=0 # keep the last page faults for proc_info()
+  KMALLOC_PROFILE=0 # count kmalloc memory by caller (kshell "kmallocstat")
+       IPL_TRACE=0 # time the windows with interrupts masked (kshell "ipltrace")
+             KSM=0 # merge identical anonymous pages (ksmd)
+
+# Scheduler time slice in APIC timer ticks (used when UPREEMPT=1)
+        QUANTUM=10
 
 # Set the number of terminals that we should be launching.
         NTERMS=3
@@ -51,6 +69,42 @@
 # Set the number of disks that we should be launching with
         NDISKS=1
 
+# Size of the swap area, in blocks, at the start of the swap disk (SWAP=1)
+        SWAP_BLOCKS=16384
+
+# Size of the RAM disk, /dev/ram0, in blocks, or 0 for none. A block only
+# takes up memory once it is written. s5fs formats it when it is mounted
+# (as "ram0").
+        RAMDISK_BLOCKS=2048
+
+# Boot from an initramfs: user/initrd.cpio, an archive of the disk's files
+# that GRUB loads with the kernel as a multiboot module. The root is then a
+# ramfs filled from it, and nothing is read from disk0 to boot. Making the
+# archive needs cpio (or CPIO=bsdcpio).
+        INITRD=0
+
+# Most pages of data a pipe holds before its writer has to wait (PIPES=1)
+        PIPE_PAGES=16
+
+# Number of disks, from disk 1 on, striped together into /dev/md0 (mounted as
+# "md0", and formatted then by s5fs), or 0 for none. Each takes part with its
+# first STRIPE_BLOCKS blocks, STRIPE_CHUNK blocks at a time; a chunk of
+# STRIPE_BLOCKS strings them together instead. NDISKS must cover them, and
+# the swap disk is only used if it is not one of them.
+        STRIPE_DISKS=0
+        STRIPE_BLOCKS=4096
+        STRIPE_CHUNK=16
+
+# Most pages each process may keep resident, or 0 for no limit, until it
+# changes its own with setrlimit(RLIMIT_RSS). Past it, its faults take back
+# its oldest pages; anonymous memory only leaves memory if there is swap.
+        RSS_LIMIT=0
+
+# Cores kept free of general work, as a mask of their ids (bit 0 for the
+# first), or 0 for none: threads only run on them once sched_setaffinity(2)
+# puts them there (SMP=1 brings up the cores past the first)
+        ISOLATED_CORES=0
+
 # terminal binary to use when opening a second terminal for gdb
         GDB_TERM=xterm
         GDB_PORT=1234
@@ -64,9 +118,10 @@
 # If the FS is too big for the disk, BAD things happen!
         DISK_BLOCKS=2048 # For fsmaker
         DISK_INODES=240  # For fsmaker
+        DISK_PACKED=1    # For fsmaker: lay files out for reading (format -p)
 
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES KPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP GETCWD RENAMEDIR UPREEMPT PIPES KPREEMPT KMUTEX_STATS SHADOWD SWAP FAULT_TRACE IPL_TRACE KMALLOC_PROFILE KSM SMP "
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE "
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE QUANTUM SWAP_BLOCKS RAMDISK_BLOCKS STRIPE_DISKS STRIPE_BLOCKS STRIPE_CHUNK PIPE_PAGES ISOLATED_CORES RSS_LIMIT "
@@ -43,3 +43,12 @@ CFLAGS	+= $(foreach bool,$(COMPILE_CONFIG_BOOLS), \
 
 CFLAGS	+= $(foreach def,$(COMPILE_CONFIG_DEFS), \
 				$(if $($(def)),-D__$(def)__=$(strip $($(def))),))
+
+# The assertion level of PROFILE, see Config.mk
+assert_level.release	:= 0
+assert_level.debug	:= 1
+assert_level.paranoid	:= 2
+ifeq ($(assert_level.$(strip $(PROFILE))),)
+    $(error PROFILE must be release, debug or paranoid, not "$(PROFILE)")
+endif
+CFLAGS	+= -D__ASSERT_LEVEL__=$(assert_level.$(strip $(PROFILE)))
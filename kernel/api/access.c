@@ -48,6 +48,20 @@ long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
     return vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
 }
 
+/*
+ * Check for permission to write [uaddr, uaddr + nbytes), then zero it,
+ * without a kernel buffer of zeros to copy from (see vmmap_write).
+ */
+long clear_user(void *uaddr, size_t nbytes)
+{
+    if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE))
+    {
+        return -EFAULT;
+    }
+    KASSERT(userland_address(uaddr));
+    return vmmap_write(curproc->p_vmmap, uaddr, NULL, nbytes);
+}
+
 /*
  * Duplicate the string identified by ustr into kernel memory.
  * The kernel memory string kstr should be allocated using kmalloc.
@@ -71,41 +85,74 @@ long user_strdup(argstr_t *ustr, char **kstrp)
 
 /*
  * Duplicate the string of vectors identified by uvec into kernel memory.
- * The vector itself (char**) and each string (char*) should be allocated
- * using kmalloc.
+ * The vector (char**) and every string it points to are laid out in a
+ * single kmalloc'd block, so that the whole copy costs one allocation and
+ * is freed with one kfree(*kvecp).
+ *
+ * The vectors are only for exec, whose initial stack must hold them, so
+ * one that would not fit in DEFAULT_STACK_SIZE is refused with -E2BIG.
  */
 long user_vecdup(argvec_t *uvec, char ***kvecp)
 {
     KASSERT(!userland_address(uvec));
     KASSERT(userland_address(uvec->av_vec));
 
-    char **kvec = kmalloc((uvec->av_len + 1) * sizeof(char *));
-    *kvecp = kvec;
-
-    if (!kvec)
+    *kvecp = NULL;
+    if (uvec->av_len >= DEFAULT_STACK_SIZE / sizeof(char *))
     {
-        return -ENOMEM;
+        return -E2BIG;
     }
-    memset(kvec, 0, (uvec->av_len + 1) * sizeof(char *));
 
-    long ret = 0;
-    for (size_t i = 0; i < uvec->av_len && !ret; i++)
+    /* The first pass only sizes the block */
+    size_t size = (uvec->av_len + 1) * sizeof(char *);
+    long ret;
+    for (size_t i = 0; i < uvec->av_len; i++)
     {
         argstr_t argstr;
-        copy_from_user(&argstr, uvec->av_vec + i, sizeof(argstr_t));
-        ret = user_strdup(&argstr, kvec + i);
+        if ((ret = copy_from_user(&argstr, uvec->av_vec + i, sizeof(argstr_t))))
+        {
+            return ret;
+        }
+        if (argstr.as_len >= DEFAULT_STACK_SIZE - size)
+        {
+            return -E2BIG;
+        }
+        size += argstr.as_len + 1;
     }
 
-    if (ret)
+    char **kvec = kmalloc(size);
+    if (!kvec)
     {
-        for (size_t i = 0; i < uvec->av_len; i++)
-            if (kvec[i])
-                kfree(kvec[i]);
-        kfree(kvec);
-        *kvecp = NULL;
+        return -ENOMEM;
+    }
+    char *kstr = (char *)(kvec + uvec->av_len + 1);
+    char *end = (char *)kvec + size;
+    for (size_t i = 0; i < uvec->av_len; i++)
+    {
+        argstr_t argstr;
+        ret = copy_from_user(&argstr, uvec->av_vec + i, sizeof(argstr_t));
+        /* The vector may have changed under us since it was sized */
+        if (!ret && argstr.as_len >= (size_t)(end - kstr))
+        {
+            ret = -EFAULT;
+        }
+        if (!ret)
+        {
+            ret = copy_from_user(kstr, argstr.as_str, argstr.as_len);
+        }
+        if (ret)
+        {
+            kfree(kvec);
+            return ret;
+        }
+        kstr[argstr.as_len] = '\0';
+        kvec[i] = kstr;
+        kstr += argstr.as_len + 1;
     }
+    kvec[uvec->av_len] = NULL;
 
-    return ret;
+    *kvecp = kvec;
+    return 0;
 }
 
 /*
@@ -122,14 +169,12 @@ long addr_perm(proc_t *p, const void *vaddr, int perm)
     size_t vfn = ADDR_TO_PN((uintptr_t)vaddr);
     
     // Find the vmarea that contains this virtual address
+    krwlock_read_lock(&p->p_vmmap->vmm_lock);
     vmarea_t *vma = vmmap_lookup(p->p_vmmap, vfn);
-    if (!vma) {
-        // No vmarea found for this address
-        return 0;
-    }
+    long ret = vma && (vma->vma_prot & perm) == perm;
+    krwlock_read_unlock(&p->p_vmmap->vmm_lock);
     
-    // Check if the vmarea has the required permissions
-    return (vma->vma_prot & perm) == perm;
+    return ret;
 }
 
 /*
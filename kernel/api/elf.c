@@ -39,6 +39,10 @@
 #include "fs/file.h"
 #include "fs/lseek.h"
 #include "fs/vfs_syscall.h"
+#include "proc/workqueue.h"
+
+#include "vm/pagefault.h"
+#include "vm/vdso.h"
 
 static long _elf64_platform_check(const Elf64_Ehdr *header)
 {
@@ -125,8 +129,13 @@ static long _elf64_map_segment(vmmap_t *map, vnode_t *file, int64_t memoff,
             dbg(DBG_ELF, "ERROR: ELF file contains overlapping segments\n");
             return -ENOEXEC;
         }
+        /* A segment that cannot be written is mapped shared, straight from
+         * the file's pages, so that every process running the program uses
+         * the same ones without even a shadow object in between; only
+         * writable segments need private copies */
+        int type = (perms & PROT_WRITE) ? MAP_PRIVATE : MAP_SHARED;
         long ret = vmmap_map(map, file, lopage, npages, perms,
-                             MAP_PRIVATE | MAP_FIXED, fileoff, 0, NULL);
+                             type | MAP_FIXED, fileoff, 0, NULL);
         if (ret)
             return ret;
         dbg(DBG_ELF,
@@ -178,7 +187,7 @@ static long _elf64_map_segment(vmmap_t *map, vnode_t *file, int64_t memoff,
             if (!buf)
                 return -ENOMEM;
 
-            vlock(file);
+            vlock_shared(file);
             ret = file->vn_ops->read(file,
                                      (size_t)PAGE_ALIGN_DOWN(off + filesz - 1),
                                      buf, PAGE_OFFSET(addr + filesz));
@@ -188,7 +197,7 @@ static long _elf64_map_segment(vmmap_t *map, vnode_t *file, int64_t memoff,
                 ret = vmmap_write(map, PAGE_ALIGN_DOWN(addr + filesz - 1), buf,
                                   PAGE_OFFSET(addr + filesz));
             }
-            vunlock(file);
+            vunlock_shared(file);
             page_free(buf);
             return ret;
         }
@@ -196,31 +205,158 @@ static long _elf64_map_segment(vmmap_t *map, vnode_t *file, int64_t memoff,
     return 0;
 }
 
-/* Read in the given fd's ELF header into the location pointed to by the given
- * argument and does some basic checks that it is a valid ELF file, is an
- * executable, and is for the correct platform
- * interp is 1 if we are loading an interpreter, 0 otherwise
- * Returns 0 on success, -errno on failure. Returns the ELF header in the header
- * argument. */
-static long _elf64_load_ehdr(int fd, Elf64_Ehdr *header, int interp)
+/*
+ * What exec needs of an executable's headers, kept on its vnode (vn_exec)
+ * from the first exec of it until it is next written to, so that exec of
+ * a program that is already running reads and parses nothing: the ELF
+ * header, the program header table and the name of the interpreter, if
+ * there is one, with the table and the name in the same allocation.
+ */
+typedef struct elf64_cache
+{
+    Elf64_Ehdr ec_header;
+    size_t ec_phtsize;
+    char *ec_pht;
+    char *ec_interp; /* NUL-terminated, or NULL */
+    size_t ec_interplen;
+} elf64_cache_t;
+
+/* Reads count bytes at pos of vn, with vn_rwlock held shared, into buf.
+ * Returns 0, or -ENOEXEC if the file ends first. */
+static long _elf64_read(vnode_t *vn, size_t pos, void *buf, size_t count)
 {
-    long ret;
-    memset(header, 0, sizeof(*header));
+    ssize_t ret = vn->vn_ops->read(vn, pos, buf, count);
+    if (ret < 0)
+        return ret;
+    return (size_t)ret < count ? -ENOEXEC : 0;
+}
+
+/* Reads in the headers of vn, with vn_rwlock held shared, and returns them
+ * in *ecp, in a new elf64_cache_t. Returns 0 on success, -errno on failure. */
+static long _elf64_read_headers(vnode_t *vn, elf64_cache_t **ecp)
+{
+    Elf64_Ehdr header;
+    memset(&header, 0, sizeof(header));
 
     /* Preliminary check that this is an ELF file */
-    ret = do_read(fd, header, sizeof(*header));
+    ssize_t ret = vn->vn_ops->read(vn, 0, &header, sizeof(header));
     if (ret < 0)
         return ret;
-    if ((ret < SELFMAG) || memcmp(&header->e_ident[0], ELFMAG, SELFMAG) != 0)
+    if ((ret < SELFMAG) || memcmp(&header.e_ident[0], ELFMAG, SELFMAG) != 0)
     {
         dbg(DBG_ELF, "ELF load failed: no magic number present\n");
         return -ENOEXEC;
     }
-    if (ret < header->e_ehsize)
+    if (ret < header.e_ehsize)
     {
         dbg(DBG_ELF, "ELF load failed: bad file size\n");
         return -ENOEXEC;
     }
+
+    size_t phtsize = header.e_phentsize * header.e_phnum;
+    char *pht = kmalloc(phtsize ? phtsize : 1);
+    if (!pht)
+        return -ENOMEM;
+    ret = _elf64_read(vn, header.e_phoff, pht, phtsize);
+    if (ret)
+    {
+        kfree(pht);
+        return ret;
+    }
+
+    /* An interpreter name is only looked for here; _elf64_find_phinterp
+     * checks there is just the one */
+    const Elf64_Phdr *phinterp = NULL;
+    for (uint32_t i = 0; i < header.e_phnum && !phinterp; i++)
+    {
+        const Elf64_Phdr *phtentry =
+            (const Elf64_Phdr *)(pht + i * header.e_phentsize);
+        if (phtentry->p_type == PT_INTERP)
+            phinterp = phtentry;
+    }
+    size_t interplen = phinterp ? phinterp->p_filesz : 0;
+    if (phinterp && (interplen < 2 || interplen > MAXPATHLEN))
+    {
+        dbg(DBG_ELF, "ELF load failed: bad interpreter name length\n");
+        kfree(pht);
+        return -ENOEXEC;
+    }
+
+    elf64_cache_t *ec = kmalloc(sizeof(*ec) + phtsize + interplen + 1);
+    if (!ec)
+    {
+        kfree(pht);
+        return -ENOMEM;
+    }
+    ec->ec_header = header;
+    ec->ec_phtsize = phtsize;
+    ec->ec_pht = (char *)(ec + 1);
+    memcpy(ec->ec_pht, pht, phtsize);
+    ec->ec_interp = NULL;
+    ec->ec_interplen = interplen;
+    if (phinterp)
+    {
+        ec->ec_interp = ec->ec_pht + phtsize;
+        ret = _elf64_read(vn, phinterp->p_offset, ec->ec_interp, interplen);
+        ec->ec_interp[interplen] = '\0';
+    }
+    kfree(pht);
+    if (ret)
+    {
+        kfree(ec);
+        return ret;
+    }
+    *ecp = ec;
+    return 0;
+}
+
+/* Gets the ELF header of the file vn into header, and a copy of its program
+ * header table, and of its interpreter's name if it has one (NULL if not),
+ * for the caller to free, into *phtp and *interpp, from the headers cached
+ * on vn, reading them in first if they are not.
+ * Checks that it is a valid ELF file, is an executable (a shared object if
+ * interp is 1, for an interpreter), and is for the correct platform.
+ * Returns 0 on success, -errno on failure. */
+static long _elf64_load_headers(vnode_t *vn, Elf64_Ehdr *header, char **phtp,
+                                char **interpp, int interp)
+{
+    long ret = 0;
+    *phtp = NULL;
+    *interpp = NULL;
+    if (!S_ISREG(vn->vn_mode) || !vn->vn_ops->read)
+        return -ENOEXEC;
+
+    vlock_shared(vn);
+    elf64_cache_t *ec = vn->vn_exec;
+    if (!ec)
+    {
+        ret = _elf64_read_headers(vn, &ec);
+        /* Another exec of it may have got there first */
+        if (!ret && !__sync_bool_compare_and_swap(&vn->vn_exec, NULL, ec))
+        {
+            kfree(ec);
+            ec = vn->vn_exec;
+        }
+    }
+    if (!ret)
+    {
+        *header = ec->ec_header;
+        *phtp = kmalloc(ec->ec_phtsize ? ec->ec_phtsize : 1);
+        if (*phtp)
+            memcpy(*phtp, ec->ec_pht, ec->ec_phtsize);
+        if (ec->ec_interp)
+        {
+            *interpp = kmalloc(ec->ec_interplen + 1);
+            if (*interpp)
+                memcpy(*interpp, ec->ec_interp, ec->ec_interplen + 1);
+        }
+        if (!*phtp || (ec->ec_interp && !*interpp))
+            ret = -ENOMEM;
+    }
+    vunlock_shared(vn);
+    if (ret)
+        goto fail;
+
     /* Log information about the file */
     dbg(DBG_ELF, "loading ELF file\n");
     dbgq(DBG_ELF, "ELF Header Information:\n");
@@ -236,52 +372,29 @@ static long _elf64_load_ehdr(int fd, Elf64_Ehdr *header, int interp)
     {
         dbg(DBG_ELF,
             "ELF load failed: interpreter is not a shared object file\n");
-        return -ENOEXEC;
+        ret = -ENOEXEC;
     }
-    if (!interp && header->e_type != ET_EXEC)
+    else if (!interp && header->e_type != ET_EXEC)
     {
         dbg(DBG_ELF, "ELF load failed: not executable ELF\n");
-        return -ENOEXEC;
+        ret = -ENOEXEC;
     }
-    if (!_elf64_platform_check(header))
+    else if (!_elf64_platform_check(header))
     {
         dbg(DBG_ELF, "ELF load failed: incorrect platform\n");
-        return -ENOEXEC;
+        ret = -ENOEXEC;
     }
-    return 0;
-}
-
-/* Loads the program header tables from from the ELF file specified by
- * the open file descriptor fd. header should point to the header information
- * for that ELF file. pht is a buffer of size size. It must be large enough
- * to hold the program header tables (whose size can be determined from
- * the ELF header).
- *
- * Returns 0 on success or -errno on error. */
-static long _elf64_load_phtable(int fd, Elf64_Ehdr *header, char *pht,
-                                size_t size)
-{
-    size_t phtsize = header->e_phentsize * header->e_phnum;
-    KASSERT(phtsize <= size);
-    /* header->e_phoff is a uint64_t cast to int.  since the max file size on
-     * s5fs is way smaller than uint32_t, offsets in practice should never
-     * cause this cast to behave badly, although if weenix ever adds support
-     * for very large (> 4GB) files, this will be a bug.
-     */
-    long ret = do_lseek(fd, (int)(header->e_phoff), SEEK_SET);
-    if (ret < 0)
-        return ret;
-
-    ret = do_read(fd, pht, phtsize);
-    if (ret < 0)
-        return ret;
-
-    KASSERT((size_t)ret <= phtsize);
-    if ((size_t)ret < phtsize)
-    {
-        return -ENOEXEC;
-    }
-    return 0;
+    if (!ret)
+        return 0;
+
+fail:
+    if (*phtp)
+        kfree(*phtp);
+    if (*interpp)
+        kfree(*interpp);
+    *phtp = NULL;
+    *interpp = NULL;
+    return ret;
 }
 
 /* Maps the PT_LOAD segments for an ELF file into the given address space.
@@ -319,32 +432,140 @@ static long _elf64_map_progsegs(vnode_t *vnode, vmmap_t *map,
     return loadcount;
 }
 
+/*
+ * Prefetch at exec: the file ranges of a program's PT_LOAD segments, up to
+ * ELF_PREFETCH_MAX_PAGES of them, are read into its page cache by a worker
+ * as soon as they are mapped, a run of contiguous blocks per request (see
+ * the readahead vnode operation), instead of by the program's first faults
+ * one page at a time. A fault on a page being read in waits for it on the
+ * vnode lock. Pages already cached cost a lookup.
+ */
+#define ELF_PREFETCH_MAX_PAGES 512
+
+typedef struct elf64_range
+{
+    size_t er_pagenum;
+    size_t er_npages;
+} elf64_range_t;
+
+typedef struct elf64_prefetch
+{
+    work_t ep_work;
+    vnode_t *ep_vnode;
+    size_t ep_nranges;
+    elf64_range_t ep_ranges[];
+} elf64_prefetch_t;
+
+static void _elf64_prefetch_run(work_t *work)
+{
+    elf64_prefetch_t *ep = CONTAINER_OF(work, elf64_prefetch_t, ep_work);
+    for (size_t i = 0; i < ep->ep_nranges; i++)
+    {
+        size_t pagenum = ep->ep_ranges[i].er_pagenum;
+        size_t end = pagenum + ep->ep_ranges[i].er_npages;
+        for (; pagenum < end; pagenum += FILE_RA_MAX_PAGES)
+        {
+            pagefault_readahead(ep->ep_vnode, pagenum,
+                                MIN(end - pagenum, (size_t)FILE_RA_MAX_PAGES));
+        }
+    }
+    vput(&ep->ep_vnode);
+    kfree(ep);
+}
+
+/* Queues the prefetch of the loadable segments of vnode, whose headers are
+ * header and pht. Nothing is prefetched if memory is short. */
+static void _elf64_prefetch(vnode_t *vnode, Elf64_Ehdr *header, char *pht)
+{
+    if (!vnode->vn_ops->readahead || !workqueue_running())
+        return;
+    elf64_prefetch_t *ep =
+        kmalloc(sizeof(elf64_prefetch_t) +
+                header->e_phnum * sizeof(elf64_range_t));
+    if (!ep)
+        return;
+    ep->ep_nranges = 0;
+    size_t left = ELF_PREFETCH_MAX_PAGES;
+    for (uint32_t i = 0; left && i < header->e_phnum; i++)
+    {
+        Elf64_Phdr *phtentry = (Elf64_Phdr *)(pht + i * header->e_phentsize);
+        if (phtentry->p_type != PT_LOAD || !phtentry->p_filesz)
+            continue;
+        size_t lo = ADDR_TO_PN(phtentry->p_offset);
+        size_t hi = ADDR_TO_PN(
+            PAGE_ALIGN_UP(phtentry->p_offset + phtentry->p_filesz));
+        if (ep->ep_nranges)
+        {
+            // segments usually follow each other in the file, sharing a page
+            elf64_range_t *last = &ep->ep_ranges[ep->ep_nranges - 1];
+            size_t end = last->er_pagenum + last->er_npages;
+            if (lo >= last->er_pagenum && lo <= end)
+            {
+                size_t grow = hi > end ? MIN(hi - end, left) : 0;
+                last->er_npages += grow;
+                left -= grow;
+                continue;
+            }
+        }
+        ep->ep_ranges[ep->ep_nranges].er_pagenum = lo;
+        ep->ep_ranges[ep->ep_nranges].er_npages = MIN(hi - lo, left);
+        left -= ep->ep_ranges[ep->ep_nranges++].er_npages;
+    }
+    if (!ep->ep_nranges)
+    {
+        kfree(ep);
+        return;
+    }
+    vref(vnode);
+    ep->ep_vnode = vnode;
+    work_init(&ep->ep_work, _elf64_prefetch_run);
+    queue_work(&ep->ep_work);
+}
+
 /* Locates the program header for the interpreter in the given list of program
  * headers through the phinterp out-argument. Returns 0 on success (even if
  * there is no interpreter) or -errno on error. If there is no interpreter
- * section then phinterp is set to NULL. If there is more than one interpreter
- * then -EINVAL is returned. */
+ * section then phinterp is set to NULL. If there is more than one interpreter,
+ * if one follows a loadable segment, or if interpname (the name read from it)
+ * is not a single NUL-terminated path filling the segment, -ENOEXEC is
+ * returned. */
 static long _elf64_find_phinterp(Elf64_Ehdr *header, char *pht,
-                                 Elf64_Phdr **phinterp)
+                                 const char *interpname, Elf64_Phdr **phinterp)
 {
     *phinterp = NULL;
 
+    long seenload = 0;
     for (uint32_t i = 0; i < header->e_phnum; i++)
     {
         Elf64_Phdr *phtentry = (Elf64_Phdr *)(pht + i * header->e_phentsize);
-        if (phtentry->p_type == PT_INTERP)
+        if (phtentry->p_type == PT_LOAD)
         {
-            if (!*phinterp)
+            seenload = 1;
+        }
+        else if (phtentry->p_type == PT_INTERP)
+        {
+            if (*phinterp)
             {
-                *phinterp = phtentry;
+                dbg(DBG_ELF, "ELF load failed: multiple interpreters\n");
+                return -ENOEXEC;
             }
-            else
+            if (seenload)
             {
-                dbg(DBG_ELF, "ELF load failed: multiple interpreters\n");
-                return -EINVAL;
+                dbg(DBG_ELF, "ELF load failed: interpreter after a segment\n");
+                return -ENOEXEC;
             }
+            *phinterp = phtentry;
         }
     }
+
+    if (*phinterp &&
+        (!interpname || strnlen(interpname, (*phinterp)->p_filesz) !=
+                            (*phinterp)->p_filesz - 1))
+    {
+        dbg(DBG_ELF, "ELF load failed: malformed interpreter name\n");
+        *phinterp = NULL;
+        return -ENOEXEC;
+    }
     return 0;
 }
 
@@ -448,51 +669,99 @@ static size_t _elf64_calc_argsize(char *const argv[], char *const envp[],
     return size;
 }
 
+/* Writes the initial stack in order of address, straight into the pages
+ * of the new stack's memory object, one page held at a time. */
+typedef struct elf64_argcursor
+{
+    mobj_t *ac_obj;
+    uint64_t ac_pagenum; /* of the page at the cursor, in ac_obj */
+    size_t ac_off;       /* of the cursor in that page */
+    pframe_t *ac_pf;     /* that page, once it has been got */
+} elf64_argcursor_t;
+
+static long _elf64_args_put(elf64_argcursor_t *ac, const void *src, size_t n)
+{
+    while (n)
+    {
+        if (!ac->ac_pf)
+        {
+            mobj_lock(ac->ac_obj);
+            long ret = mobj_get_pframe(ac->ac_obj, ac->ac_pagenum, 1, &ac->ac_pf);
+            mobj_unlock(ac->ac_obj);
+            if (ret < 0)
+                return ret;
+        }
+        size_t chunk = MIN(n, PAGE_SIZE - ac->ac_off);
+        memcpy((char *)ac->ac_pf->pf_addr + ac->ac_off, src, chunk);
+        src = (const char *)src + chunk;
+        n -= chunk;
+        ac->ac_off += chunk;
+        if (ac->ac_off == PAGE_SIZE)
+        {
+            pframe_release(&ac->ac_pf);
+            ac->ac_pagenum++;
+            ac->ac_off = 0;
+        }
+    }
+    return 0;
+}
+
+static long _elf64_args_putptr(elf64_argcursor_t *ac, const void *ptr)
+{
+    return _elf64_args_put(ac, &ptr, sizeof(ptr));
+}
+
 /* Copies the arguments that must be on the stack prior to execution onto the
- * user stack. This should never fail.
+ * user stack, writing them directly into the stack's pages rather than
+ * building the image in a kernel buffer first, in a single pass: the
+ * vectors' entries are worked out from the lengths of the strings they will
+ * point to, which follow them.
  * arglow:   low address on the user stack where we should start the copying
- * argsize:  total size of everything to go on the stack
- * buf:      a kernel buffer at least as big as argsize (for convenience)
  * argv, envp, auxv: various vectors of stuff (to go on the stack)
  * argc, envc, auxc: number of non-NULL entries in argv, envp, auxv,
  *                   respectively (to avoid recomputing them)
  * phtsize: the size of the program header table (to avoid recomputing)
+ * Returns 0, or -ENOMEM if a page of the stack cannot be had.
  * c.f. Intel i386 ELF supplement pp 54-59 and AMD64 ABI Draft 0.99.6 page 29
  */
-static void _elf64_load_args(vmmap_t *map, void *arglow, size_t argsize,
-                             char *buf, char *const argv[], char *const envp[],
-                             Elf64_auxv_t *auxv, size_t argc, size_t envc,
-                             size_t auxc, size_t phtsize)
+static long _elf64_load_args(vmmap_t *map, void *arglow, char *const argv[],
+                             char *const envp[], Elf64_auxv_t *auxv,
+                             size_t argc, size_t envc, size_t auxc,
+                             size_t phtsize)
 {
     dbg(DBG_ELF,
         "Loading initial stack contents at 0x%p, argc = %lu, envc = %lu, auxc "
         "= %lu\n",
         arglow, argc, envc, auxc);
 
-    size_t i;
+    vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(arglow));
+    KASSERT(vma && "the stack has not been mapped");
+    elf64_argcursor_t ac = {
+        .ac_obj = vma->vma_obj,
+        .ac_pagenum = ADDR_TO_PN(arglow) - vma->vma_start + vma->vma_off,
+        .ac_off = PAGE_OFFSET(arglow),
+        .ac_pf = NULL,
+    };
 
-    /* Copy argc: in x86-64, this is an eight-byte value, despite being treated
-     * as an int in a C main() function. See AMD64 ABI Draft 0.99.6 page 29 */
-    *((int64_t *)buf) = (int64_t)argc;
+    size_t i;
+    long ret = 0;
 
     /* Calculate where the strings / tables pointed to by the vectors start */
     size_t veclen = (argc + 1 + envc + 1) * sizeof(char *) +
                     (auxc + 1) * sizeof(Elf64_auxv_t);
 
-    char *vecstart =
-        buf + sizeof(int64_t) +
-        3 * sizeof(void *); /* Beginning of argv (in kernel buffer) */
-
     char *vvecstart =
         ((char *)arglow) + sizeof(int64_t) +
         3 * sizeof(void *); /* Beginning of argv (in user space) */
 
-    char *strstart = vecstart + veclen; /* Beginning of first string pointed to
-                                           by argv (in kernel buffer) */
-
     /* Beginning of first string pointed to by argv (in user space) */
     char *vstrstart = vvecstart + veclen;
 
+    /* argc: in x86-64, this is an eight-byte value, despite being treated as
+     * an int in a C main() function. See AMD64 ABI Draft 0.99.6 page 29 */
+    int64_t argc64 = (int64_t)argc;
+    ret = _elf64_args_put(&ac, &argc64, sizeof(argc64));
+
     /*
      * cjm5: since the first 6 arguments that can fit in registers are placed
      * there in x86-64, __libc_static_entry (and ld-weenix, if it is ever ported
@@ -500,66 +769,64 @@ static void _elf64_load_args(vmmap_t *map, void *arglow, size_t argsize,
      * them and argc into the first 4 argument registers before calling main().
      */
 
-    /* Copy over pointer to argv */
-    *(char **)(buf + 8) = vvecstart;
-    /* Copy over pointer to envp */
-    *(char **)(buf + 16) = vvecstart + (argc + 1) * sizeof(char *);
-    /* Copy over pointer to auxv */
-    *(char **)(buf + 24) = vvecstart + (argc + 1 + envc + 1) * sizeof(char *);
-
-    /* Copy over argv along with every string in it */
-    for (i = 0; i < argc; i++)
-    {
-        size_t len = strlen(argv[i]) + 1;
-        strcpy(strstart, argv[i]);
-        /* Remember that we need to use the virtual address of the string */
-        *(char **)vecstart = vstrstart;
-        strstart += len;
-        vstrstart += len;
-        vecstart += sizeof(char *);
-    }
-    /* null terminator of argv */
-    *(char **)vecstart = NULL;
-    vecstart += sizeof(char *);
-
-    /* Copy over envp along with every string in it */
-    for (i = 0; i < envc; i++)
-    {
-        size_t len = strlen(envp[i]) + 1;
-        strcpy(strstart, envp[i]);
-        /* Remember that we need to use the virtual address of the string */
-        *(char **)vecstart = vstrstart;
-        strstart += len;
-        vstrstart += len;
-        vecstart += sizeof(char *);
-    }
-    /* null terminator of envp */
-    *(char **)vecstart = NULL;
-    vecstart += sizeof(char *);
-
-    /* Copy over auxv along with the program header (if we find it) */
-    for (i = 0; i < auxc; i++)
-    {
-        /* Copy over the auxv entry */
-        memcpy(vecstart, &auxv[i], sizeof(Elf64_auxv_t));
-        /* Check if it points to the program header */
+    /* Pointers to argv, envp and auxv */
+    if (!ret)
+        ret = _elf64_args_putptr(&ac, vvecstart);
+    if (!ret)
+        ret = _elf64_args_putptr(&ac,
+                                 vvecstart + (argc + 1) * sizeof(char *));
+    if (!ret)
+        ret = _elf64_args_putptr(
+            &ac, vvecstart + (argc + 1 + envc + 1) * sizeof(char *));
+
+    /* argv and envp, each followed by a null terminator. Remember that we
+     * need to use the virtual address of each string */
+    for (i = 0; i < argc && !ret; i++)
+    {
+        ret = _elf64_args_putptr(&ac, vstrstart);
+        vstrstart += strlen(argv[i]) + 1;
+    }
+    if (!ret)
+        ret = _elf64_args_putptr(&ac, NULL);
+    for (i = 0; i < envc && !ret; i++)
+    {
+        ret = _elf64_args_putptr(&ac, vstrstart);
+        vstrstart += strlen(envp[i]) + 1;
+    }
+    if (!ret)
+        ret = _elf64_args_putptr(&ac, NULL);
+
+    /* auxv, pointing AT_PHDR at the copy of the program header table that
+     * follows the strings, then its null terminator */
+    for (i = 0; i < auxc && !ret; i++)
+    {
+        Elf64_auxv_t entry = auxv[i];
+        if (entry.a_type == AT_PHDR)
+            entry.a_un.a_ptr = vstrstart;
+        ret = _elf64_args_put(&ac, &entry, sizeof(entry));
+    }
+    if (!ret)
+    {
+        Elf64_auxv_t entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.a_type = AT_NULL;
+        ret = _elf64_args_put(&ac, &entry, sizeof(entry));
+    }
+
+    /* The strings, and the program header table */
+    for (i = 0; i < argc && !ret; i++)
+        ret = _elf64_args_put(&ac, argv[i], strlen(argv[i]) + 1);
+    for (i = 0; i < envc && !ret; i++)
+        ret = _elf64_args_put(&ac, envp[i], strlen(envp[i]) + 1);
+    for (i = 0; i < auxc && !ret; i++)
+    {
         if (auxv[i].a_type == AT_PHDR)
-        {
-            /* Copy over the program header table */
-            memcpy(strstart, auxv[i].a_un.a_ptr, (size_t)phtsize);
-            /* And modify the address */
-            ((Elf64_auxv_t *)vecstart)->a_un.a_ptr = vstrstart;
-        }
-        vecstart += sizeof(Elf64_auxv_t);
+            ret = _elf64_args_put(&ac, auxv[i].a_un.a_ptr, phtsize);
     }
-    /* null terminator of auxv */
-    ((Elf64_auxv_t *)vecstart)->a_type = NULL;
 
-    /* Finally, we're done copying into the kernel buffer. Now just copy the
-     * kernel buffer into user space */
-    long ret = vmmap_write(map, arglow, buf, argsize);
-    /* If this failed, we must have set up the address space wrong... */
-    KASSERT(!ret);
+    if (ac.ac_pf)
+        pframe_release(&ac.ac_pf);
+    return ret;
 }
 
 static long _elf64_load(const char *filename, int fd, char *const argv[],
@@ -578,7 +845,6 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     file_t *interpfile = NULL;
     char *interppht = NULL;
     Elf64_auxv_t *auxv = NULL;
-    char *argbuf = NULL;
 
     uintptr_t entry;
 
@@ -586,8 +852,9 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     if (!file)
         return -EBADF;
 
-    /* Load and verify the ELF header */
-    ret = _elf64_load_ehdr(fd, &header, 0);
+    /* Get the ELF header, program header table and interpreter name, and
+     * verify the header */
+    ret = _elf64_load_headers(file->f_vnode, &header, &pht, &interpname, 0);
     if (ret)
         goto done;
 
@@ -598,17 +865,18 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
         goto done;
     }
 
+    /* Map the vDSO pages first, before anything is put at the top */
+    ret = vdso_map(map);
+    if (ret < 0)
+        goto done;
+
     // Program header table entry size multiplied by
     // number of entries.
     size_t phtsize = header.e_phentsize * header.e_phnum;
-    pht = kmalloc(phtsize);
-    if (!pht)
-    {
-        ret = -ENOMEM;
-        goto done;
-    }
-    /* Read in the program header table */
-    ret = _elf64_load_phtable(fd, &header, pht, phtsize);
+
+    /* Check if program requires an interpreter, before mapping anything */
+    Elf64_Phdr *phinterp = NULL;
+    ret = _elf64_find_phinterp(&header, pht, interpname, &phinterp);
     if (ret)
         goto done;
 
@@ -616,12 +884,7 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     ret = _elf64_map_progsegs(file->f_vnode, map, &header, pht, 0);
     if (ret < 0)
         goto done;
-
-    /* Check if program requires an interpreter */
-    Elf64_Phdr *phinterp = NULL;
-    ret = _elf64_find_phinterp(&header, pht, &phinterp);
-    if (ret)
-        goto done;
+    _elf64_prefetch(file->f_vnode, &header, pht);
 
     /* Calculate program bounds for future reference */
     void *proglow;
@@ -633,27 +896,6 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     /* if an interpreter was requested load it */
     if (phinterp)
     {
-        /* read the file name of the interpreter from the binary */
-        ret = do_lseek(fd, (int)(phinterp->p_offset), SEEK_SET);
-        if (ret < 0)
-            goto done;
-
-        interpname = kmalloc(phinterp->p_filesz);
-        if (!interpname)
-        {
-            ret = -ENOMEM;
-            goto done;
-        }
-        ret = do_read(fd, interpname, phinterp->p_filesz);
-        if (ret < 0)
-            goto done;
-
-        if ((size_t)ret != phinterp->p_filesz)
-        {
-            ret = -ENOEXEC;
-            goto done;
-        }
-
         /* open the interpreter */
         dbgq(DBG_ELF, "ELF Interpreter: %*s\n", (int)phinterp->p_filesz,
              interpname);
@@ -669,31 +911,13 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
         interpfile = fget((int)interpfd);
         KASSERT(interpfile);
 
-        /* Load and verify the interpreter ELF header */
-        ret = _elf64_load_ehdr((int)interpfd, &interpheader, 1);
+        /* Get and verify the interpreter's headers. The interpreter
+         * shouldn't itself need an interpreter */
+        ret = _elf64_load_headers(interpfile->f_vnode, &interpheader,
+                                  &interppht, &interpname, 1);
         if (ret)
             goto done;
-
-        size_t interpphtsize = interpheader.e_phentsize * interpheader.e_phnum;
-        interppht = kmalloc(interpphtsize);
-        if (!interppht)
-        {
-            ret = -ENOMEM;
-            goto done;
-        }
-        /* Read in the program header table */
-        ret = _elf64_load_phtable((int)interpfd, &interpheader, interppht,
-                                  interpphtsize);
-        if (ret)
-            goto done;
-
-        /* Interpreter shouldn't itself need an interpreter */
-        Elf64_Phdr *interpphinterp;
-        ret = _elf64_find_phinterp(&interpheader, interppht, &interpphinterp);
-        if (ret)
-            goto done;
-
-        if (interpphinterp)
+        if (interpname)
         {
             ret = -EINVAL;
             goto done;
@@ -733,6 +957,7 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
                                   interppht, interpoff);
         if (ret < 0)
             goto done;
+        _elf64_prefetch(interpfile->f_vnode, &interpheader, interppht);
 
         /* Build the ELF aux table */
         /* Need to hold AT_PHDR, AT_PHENT, AT_PHNUM, AT_ENTRY, AT_BASE,
@@ -809,13 +1034,6 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
         ret = -E2BIG;
         goto done;
     }
-    /* Allocate kernel buffer for temporarily storing arguments */
-    argbuf = (char *)kmalloc(argsize);
-    if (!argbuf)
-    {
-        ret = -ENOMEM;
-        goto done;
-    }
     /* Calculate where in user space we start putting the args. */
     // the args go at the beginning (top) of the stack
     void *arglow =
@@ -826,8 +1044,10 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
 
     /* Copy everything into the user address space, modifying addresses in
      * argv, envp, and auxv to be user addresses as we go. */
-    _elf64_load_args(map, arglow, argsize, argbuf, argv, envp, auxv, argc, envc,
-                     auxc, phtsize);
+    ret = _elf64_load_args(map, arglow, argv, envp, auxv, argc, envc, auxc,
+                           phtsize);
+    if (ret)
+        goto done;
 
     dbg(DBG_ELF,
         "Past the point of no return. Swapping to map at 0x%p, setting brk to "
@@ -836,16 +1056,17 @@ static long _elf64_load(const char *filename, int fd, char *const argv[],
     /* the final threshold / What warm unspoken secrets will we learn? / Beyond
      * the point of no return ... */
 
+    /* Flush the process pagetables and TLB, before the old mappings' objects
+     * can free the pages */
+    pt_unmap_range(curproc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
+    tlb_flush_all();
+
     /* Give the process the new mappings. */
     vmmap_destroy(&curproc->p_vmmap);
     map->vmm_proc = curproc;
     curproc->p_vmmap = map;
     map = NULL; /* So it doesn't get cleaned up at the end */
 
-    /* Flush the process pagetables and TLB */
-    pt_unmap_range(curproc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
-    tlb_flush_all();
-
     /* Set the process break and starting break (immediately after the mapped-in
      * text/data/bss from the executable) */
     curproc->p_brk = proghigh;
@@ -895,10 +1116,6 @@ done:
     {
         kfree(auxv);
     }
-    if (argbuf)
-    {
-        kfree(argbuf);
-    }
     return ret;
 }
 
@@ -1,7 +1,10 @@
 #include "util/debug.h"
 #include <util/string.h>
 
+#include "main/boottime.h"
+#include "main/fpu.h"
 #include "main/gdt.h"
+#include "main/ipltrace.h"
 
 #include "api/binfmt.h"
 #include "api/exec.h"
@@ -23,6 +26,8 @@ void userland_entry(const regs_t regs)
     dbg(DBG_ELF, ">>>>>>>>>>>>>>>> intr_disable()\n");
     intr_setipl(IPL_LOW);
     dbg(DBG_ELF, ">>>>>>>>>>>>>>>> intr_setipl()\n");
+    /* The IRETQ below turns interrupts back on */
+    ipltrace_unmask((void *)userland_entry);
 
     __asm__ __volatile__(
         "movq %%rax, %%rsp\n\t" /* Move stack pointer up to regs */
@@ -46,6 +51,7 @@ void userland_entry(const regs_t regs)
                               * arguments automatically pushed by the processor
                               * on an interrupt
                               */
+        "swapgs\n\t"       /* Give userland its GS base (see main/smp.h) */
         "iretq\n"
         /* We're now in userland! */
         :            /* No outputs */
@@ -57,11 +63,24 @@ long do_execve(const char *filename, char *const *argv, char *const *envp,
                struct regs *regs)
 {
     uint64_t rip, rsp;
+#ifdef __MTP__
+    /* The other threads go first, as the address space they run in does. If
+     * the load fails, the process goes on with only this one. */
+    long ret = proc_kill_siblings(0);
+    if (ret < 0)
+    {
+        return ret;
+    }
+    ret = binfmt_load(filename, argv, envp, &rip, &rsp);
+#else
     long ret = binfmt_load(filename, argv, envp, &rip, &rsp);
+#endif
     if (ret < 0)
     {
         return ret;
     }
+    sched_set_tls(0);
+    fpu_thread_free(curthr); /* the new program starts with a clean FPU */
     /* Make sure we "return" into the start of the newly loaded binary */
     dbg(DBG_EXEC, "Executing binary with rip 0x%p, rsp 0x%p\n", (void *)rip,
         (void *)rsp);
@@ -90,7 +109,17 @@ void kernel_execve(const char *filename, char *const *argv, char *const *envp)
         dbg(DBG_EXEC, "Failed to load binary %s: %ld\n", filename, ret);
         return; // Return instead of panic
     }
+    boottime_done();
+    kernel_enter_userland(rip, rsp);
+}
 
+/*
+ * Starts userland execution at rip with stack rsp in a kernel-only process
+ * whose address space has already been loaded (see kernel_execve). Does not
+ * return.
+ */
+void kernel_enter_userland(uint64_t rip, uint64_t rsp)
+{
     dbg(DBG_EXEC, "Entering userland with rip 0x%p, rsp 0x%p\n", (void *)rip,
         (void *)rsp);
     /* To enter userland, we build a set of saved registers to "trick" the
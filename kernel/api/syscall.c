@@ -4,15 +4,29 @@
 #include <fs/vfs.h>
 #include <util/time.h>
 
+#include "main/entry.h"
 #include "main/inits.h"
 #include "main/interrupt.h"
+#include "main/pmu.h"
 
 #include "mm/kmalloc.h"
+#include "mm/mm.h"
 #include "mm/mman.h"
-
+#include "mm/page.h"
+
+#include "fs/aio.h"
+#include "fs/epoll.h"
+#include "fs/file.h"
+#include "fs/pipe.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
+#include "proc/futex.h"
+#include "proc/sched.h"
+
+#include "drivers/memdevs.h"
 #include "drivers/tty/tty.h"
 #include "test/kshell/kshell.h"
 
@@ -24,13 +38,16 @@
 #include "api/syscall.h"
 #include "api/utsname.h"
 
+#include "util/string.h"
+#include "util/trace.h"
+
 static long syscall_handler(regs_t *regs);
 
 static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs);
 
 extern size_t active_tty;
 
-static const char *syscall_strings[49] = {
+static const char *syscall_strings[] = {
     "syscall", "exit", "fork", "read", "write", "open",
     "close", "waitpid", "link", "unlink", "execve", "chdir",
     "sleep", "unknown", "lseek", "sync", "nuke", "dup",
@@ -38,7 +55,12 @@ static const char *syscall_strings[49] = {
     "mmap", "mprotect", "munmap", "rename", "uname", "thr_create",
     "thr_cancel", "thr_exit", "thr_yield", "thr_join", "gettid", "getpid",
     "unknown", "unkown", "unknown", "errno", "halt", "get_free_mem",
-    "set_errno", "dup2", "brk", "mount", "umount", "stat", "usleep"};
+    "set_errno", "dup2", "brk", "mount", "umount", "stat", "time", "usleep",
+    "nice", "spawn", "madvise", "readv", "writev", "pread", "pwrite",
+    "sendfile", "aio_submit", "aio_reap", "fsync", "fdatasync", "vmsplice", "poll",
+    "epoll_create", "epoll_ctl", "epoll_wait", "batch", "set_tls", "futex",
+    "perfctr", "mremap", "fstatat", "fstat", "fallocate", "sched_setaffinity",
+    "sched_getaffinity", "getrlimit", "setrlimit", "getcwd"};
 
 void syscall_init(void) { intr_register(INTR_SYSCALL, syscall_handler); }
 
@@ -54,110 +76,453 @@ void syscall_init(void) { intr_register(INTR_SYSCALL, syscall_handler); }
 #define ERROR_OUT_RET(ret) ERROR_OUT(ret < 0, -ret)
 
 /*
- * Be sure to look at other examples of implemented system calls to see how
- * this should be done - the general outline is as follows.
- * 
- * - Initialize a read_args_t struct locally in kernel space and copy from 
- *   userland args. 
- * - Allocate a temporary buffer (a page-aligned block of n pages that are 
- *   enough space to store the number of bytes to read)
- * - Call do_read() with the buffer and then copy the buffer to the userland 
- *   args after the system call 
- * - Make sure to free the temporary buffer allocated
- * - Return the number of bytes read, or return -1 and set the current thread's
- *   errno appropriately using ERROR_OUT_RET. 
+ * read(), write(), pread() and pwrite() move the data through a kernel
+ * buffer of at most SYSCALL_IO_CHUNK bytes, a chunk at a time, rather than
+ * one as large as the whole transfer: memory use stays bounded whatever the
+ * size asked for, and the buffer stays in the cache between the copy to or
+ * from the user and the transfer.
+ *
+ * A transfer stops at the first short chunk, and its error is only reported
+ * if nothing was moved before it. Reads only go on past the first chunk on
+ * regular files: a pipe or tty must return what it has rather than wait for
+ * more, so a read of one moves at most a chunk. off is -1 to use and move
+ * the file position.
+ *
+ * Files opened with O_DIRECT skip the kernel buffer: see do_direct_rw().
+ * So do the null and zero devices, which need no copy of the data at all:
+ * see memdev_user_rw().
  */
-static long sys_read(read_args_t *args)
+#define SYSCALL_IO_CHUNK (16 * PAGE_SIZE)
+
+static long _sys_rw(int fd, void *ubuf, size_t nbytes, off_t off, long write)
 {
-    read_args_t kernel_args;
-    
-    // Copy arguments from user space
-    if (copy_from_user(&kernel_args, args, sizeof(read_args_t)) < 0) {
-        return -1;
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        ERROR_OUT(1, EBADF);
     }
-    
-    // Validate arguments
-    if (kernel_args.fd < 0 || kernel_args.fd >= NFILES) {
+    ssize_t memdev_ret;
+    if (memdev_user_rw(file, ubuf, nbytes, write, &memdev_ret))
+    {
+        fput(&file);
+        ERROR_OUT_RET(memdev_ret);
+        return memdev_ret;
+    }
+    long more = write || S_ISREG(file->f_vnode->vn_mode);
+    long direct = file->f_mode & FMODE_DIRECT;
+    fput(&file);
+    if (direct)
+    {
+        ssize_t ret = do_direct_rw(fd, ubuf, nbytes, off, write);
+        ERROR_OUT_RET(ret);
+        return ret;
+    }
+
+    size_t chunk = MIN(nbytes, (size_t)SYSCALL_IO_CHUNK);
+    void *temp_buf = kmalloc(chunk ? chunk : 1);
+    if (!temp_buf)
+    {
+        ERROR_OUT(1, ENOMEM);
+    }
+
+    size_t done = 0;
+    long ret = 0;
+    do
+    {
+        size_t n = MIN(nbytes - done, chunk);
+        char *ucur = (char *)ubuf + done;
+        off_t ocur = off < 0 ? -1 : off + (off_t)done;
+        if (write)
+        {
+            ret = copy_from_user(temp_buf, ucur, n);
+            if (ret >= 0)
+            {
+                ret = ocur < 0 ? do_write(fd, temp_buf, n)
+                               : do_pwrite(fd, temp_buf, n, ocur);
+            }
+        }
+        else
+        {
+            ret = ocur < 0 ? do_read(fd, temp_buf, n)
+                           : do_pread(fd, temp_buf, n, ocur);
+            if (ret > 0)
+            {
+                long err = copy_to_user(ucur, temp_buf, (size_t)ret);
+                ret = err < 0 ? err : ret;
+            }
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        done += (size_t)ret;
+        if ((size_t)ret < n)
+        {
+            break;
+        }
+    } while (more && done < nbytes);
+    kfree(temp_buf);
+
+    if (done)
+    {
+        return (long)done;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * Each call that SYSCALL passes the arguments of in registers (see
+ * syscall_dispatch_regs()) is split in two: the sys_ function copies its
+ * arguments in for the trap, and the _sys_ one does the work, given them.
+ */
+static long _sys_read(const read_args_t *kargs)
+{
+    if (kargs->fd < 0 || kargs->fd >= NFILES)
+    {
         ERROR_OUT(1, EBADF);
     }
-    
-    if (!kernel_args.buf) {
+    if (!kargs->buf)
+    {
         ERROR_OUT(1, EINVAL);
     }
-    
-    // Allocate temporary buffer
-    size_t buf_size = kernel_args.nbytes;
-    void *temp_buf = kmalloc(buf_size);
-    if (!temp_buf) {
+    return _sys_rw(kargs->fd, kargs->buf, kargs->nbytes, -1, 0);
+}
+
+static long sys_read(read_args_t *args)
+{
+    read_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_read(&kargs);
+}
+
+static long _sys_write(const write_args_t *kargs)
+{
+    if (kargs->fd < 0 || kargs->fd >= NFILES)
+    {
+        ERROR_OUT(1, EBADF);
+    }
+    if (!kargs->buf)
+    {
+        ERROR_OUT(1, EINVAL);
+    }
+    return _sys_rw(kargs->fd, kargs->buf, kargs->nbytes, -1, 1);
+}
+
+static long sys_write(write_args_t *args)
+{
+    write_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_write(&kargs);
+}
+
+/*
+ * readv() and writev(): copies in the user's iovec array, then moves the
+ * data through one kernel buffer of the total length, carved into a kernel
+ * iovec per user one, so that do_readv()/do_writev() see the same buffer
+ * boundaries the caller gave (they end early on a short transfer into one).
+ * The user buffers are copied out of, or back into, in order.
+ */
+static long _sys_rwv(int fd, const struct iovec *uiov, int iovcnt, long write)
+{
+    if (iovcnt <= 0 || iovcnt > IOV_MAX)
+    {
+        ERROR_OUT(1, EINVAL);
+    }
+    iovec_t *iov = kmalloc(sizeof(iovec_t) * (size_t)iovcnt);
+    if (!iov)
+    {
         ERROR_OUT(1, ENOMEM);
     }
-    
-    // Call do_read with the temporary buffer
-    long bytes_read = do_read(kernel_args.fd, temp_buf, kernel_args.nbytes);
-    
-    if (bytes_read > 0) {
-        // Copy data back to user space
-        if (copy_to_user(kernel_args.buf, temp_buf, bytes_read) < 0) {
+    long ret = copy_from_user(iov, uiov, sizeof(iovec_t) * (size_t)iovcnt);
+    if (ret < 0)
+    {
+        kfree(iov);
+        ERROR_OUT_RET(ret);
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > ((size_t)-1 >> 1) - len)
+        {
+            kfree(iov);
+            ERROR_OUT(1, EINVAL);
+        }
+        len += iov[i].iov_len;
+    }
+
+    iovec_t *kiov = kmalloc(sizeof(iovec_t) * (size_t)iovcnt);
+    char *temp_buf = kmalloc(len ? len : 1);
+    if (!kiov || !temp_buf)
+    {
+        kfree(iov);
+        if (kiov)
+            kfree(kiov);
+        if (temp_buf)
             kfree(temp_buf);
-            ERROR_OUT(1, EFAULT);
+        ERROR_OUT(1, ENOMEM);
+    }
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; off += iov[i].iov_len, i++)
+    {
+        kiov[i].iov_base = temp_buf + off;
+        kiov[i].iov_len = iov[i].iov_len;
+        if (write && iov[i].iov_len &&
+            (ret = copy_from_user(kiov[i].iov_base, iov[i].iov_base,
+                                  iov[i].iov_len)) < 0)
+        {
+            goto out;
         }
     }
-    
-    // Free the temporary buffer
+
+    ret = write ? do_writev(fd, kiov, iovcnt) : do_readv(fd, kiov, iovcnt);
+
+    if (!write && ret > 0)
+    {
+        size_t left = (size_t)ret;
+        for (int i = 0; i < iovcnt && left; i++)
+        {
+            size_t n = MIN(left, iov[i].iov_len);
+            long err = copy_to_user(iov[i].iov_base, kiov[i].iov_base, n);
+            if (err < 0)
+            {
+                ret = err;
+                break;
+            }
+            left -= n;
+        }
+    }
+
+out:
     kfree(temp_buf);
-    
-    ERROR_OUT_RET(bytes_read);
-    return bytes_read;
+    kfree(kiov);
+    kfree(iov);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_readv(readv_args_t *args)
+{
+    readv_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_rwv(kargs.fd, kargs.iov, kargs.iovcnt, 0);
+}
+
+static long sys_writev(writev_args_t *args)
+{
+    writev_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_rwv(kargs.fd, kargs.iov, kargs.iovcnt, 1);
 }
 
 /*
- * Be sure to look at other examples of implemented system calls to see how
- * this should be done - the general outline is as follows.
- *
- * This function is very similar to sys_read - see above comments. You'll need
- * to use the functions copy_from_user() and do_write(). Make sure to
- * allocate a new temporary buffer for the data that is being written. This
- * is to ensure that pagefaults within kernel mode do not happen. 
+ * pread() and pwrite() go like sys_read() and sys_write(), with the offset
+ * passed down to do_pread()/do_pwrite(), which reject a negative one.
  */
-static long sys_write(write_args_t *args)
+static long _sys_pread(const pread_args_t *kargs)
 {
-    write_args_t kernel_args;
-    
-    // Copy arguments from user space
-    if (copy_from_user(&kernel_args, args, sizeof(write_args_t)) < 0) {
-        return -1;
+    if (kargs->offset < 0)
+    {
+        ERROR_OUT(1, EINVAL);
     }
-    
-    // Validate arguments
-    if (kernel_args.fd < 0 || kernel_args.fd >= NFILES) {
-        ERROR_OUT(1, EBADF);
+    return _sys_rw(kargs->fd, kargs->buf, kargs->nbytes, kargs->offset, 0);
+}
+
+static long sys_pread(pread_args_t *args)
+{
+    pread_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_pread(&kargs);
+}
+
+static long _sys_pwrite(const pwrite_args_t *kargs)
+{
+    if (kargs->offset < 0)
+    {
+        ERROR_OUT(1, EINVAL);
     }
-    
-    if (!kernel_args.buf) {
+    return _sys_rw(kargs->fd, kargs->buf, kargs->nbytes, kargs->offset, 1);
+}
+
+static long sys_pwrite(pwrite_args_t *args)
+{
+    pwrite_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    return _sys_pwrite(&kargs);
+}
+
+/*
+ * sendfile() only needs the offset, if there is one, copied in and back
+ * out: the data itself never comes up to user space.
+ */
+static long sys_sendfile(sendfile_args_t *args)
+{
+    sendfile_args_t kargs;
+    off_t offset;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.offset)
+    {
+        ret = copy_from_user(&offset, kargs.offset, sizeof(offset));
+        ERROR_OUT_RET(ret);
+    }
+
+    ret = do_sendfile(kargs.out_fd, kargs.in_fd,
+                      kargs.offset ? &offset : NULL, kargs.count);
+
+    if (ret > 0 && kargs.offset)
+    {
+        long err = copy_to_user(kargs.offset, &offset, sizeof(offset));
+        ret = err < 0 ? err : ret;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * aio_submit() and aio_reap() hand their user arrays straight to
+ * do_aio_submit() and do_aio_reap(), which copy each entry in or out as they
+ * go.
+ */
+static long sys_aio_submit(aio_submit_args_t *args)
+{
+    aio_submit_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_aio_submit(kargs.sqes, kargs.nr);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_aio_reap(aio_reap_args_t *args)
+{
+    aio_reap_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_aio_reap(kargs.cqes, kargs.min_nr, kargs.nr);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * vmsplice() copies in the user's iovec array and leaves the buffers it
+ * describes to do_vmsplice(), which moves them page by page, gifting or
+ * mapping pages where it can.
+ */
+static long sys_vmsplice(vmsplice_args_t *args)
+{
+    vmsplice_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.iovcnt <= 0 || kargs.iovcnt > IOV_MAX)
+    {
         ERROR_OUT(1, EINVAL);
     }
-    
-    // Allocate temporary buffer
-    size_t buf_size = kernel_args.nbytes;
-    void *temp_buf = kmalloc(buf_size);
-    if (!temp_buf) {
+    iovec_t *iov = kmalloc(sizeof(iovec_t) * (size_t)kargs.iovcnt);
+    if (!iov)
+    {
         ERROR_OUT(1, ENOMEM);
     }
-    
-    // Copy data from user space to temporary buffer
-    if (copy_from_user(temp_buf, kernel_args.buf, kernel_args.nbytes) < 0) {
-        kfree(temp_buf);
-        ERROR_OUT(1, EFAULT);
+    ret = copy_from_user(iov, kargs.iov, sizeof(iovec_t) * (size_t)kargs.iovcnt);
+    if (ret >= 0)
+    {
+        ret = do_vmsplice(kargs.fd, iov, kargs.iovcnt, kargs.flags);
     }
-    
-    // Call do_write with the temporary buffer
-    long bytes_written = do_write(kernel_args.fd, temp_buf, kernel_args.nbytes);
-    
-    // Free the temporary buffer
-    kfree(temp_buf);
-    
-    ERROR_OUT_RET(bytes_written);
-    return bytes_written;
+    kfree(iov);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * poll() works on a kernel copy of the user's array, which is copied back
+ * out, revents and all, once do_poll() returns.
+ */
+static long sys_poll(poll_args_t *args)
+{
+    poll_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.nfds < 0 || kargs.nfds > NFILES)
+    {
+        ERROR_OUT(1, EINVAL);
+    }
+    size_t size = sizeof(pollfd_t) * (size_t)kargs.nfds;
+    pollfd_t *fds = kmalloc(size ? size : 1);
+    if (!fds)
+    {
+        ERROR_OUT(1, ENOMEM);
+    }
+    ret = copy_from_user(fds, kargs.fds, size);
+    if (ret >= 0)
+    {
+        ret = do_poll(fds, kargs.nfds, kargs.timeout);
+    }
+    if (ret >= 0)
+    {
+        long err = copy_to_user(kargs.fds, fds, size);
+        ret = err < 0 ? err : ret;
+    }
+    kfree(fds);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_epoll_create(void)
+{
+    long ret = do_epoll_create();
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/* epoll_ctl() copies in the event the item is to have, if the op uses one. */
+static long sys_epoll_ctl(epoll_ctl_args_t *args)
+{
+    epoll_ctl_args_t kargs;
+    epoll_event_t event = {0};
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.op != EPOLL_CTL_DEL)
+    {
+        ret = copy_from_user(&event, kargs.event, sizeof(event));
+        ERROR_OUT_RET(ret);
+    }
+    ret = do_epoll_ctl(kargs.epfd, kargs.op, kargs.fd, &event);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/* epoll_wait() copies out the events do_epoll_wait() reports, and no more. */
+static long sys_epoll_wait(epoll_wait_args_t *args)
+{
+    epoll_wait_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.maxevents <= 0 || kargs.maxevents > NFILES)
+    {
+        ERROR_OUT(1, EINVAL);
+    }
+    size_t size = sizeof(epoll_event_t) * (size_t)kargs.maxevents;
+    epoll_event_t *events = kmalloc(size);
+    if (!events)
+    {
+        ERROR_OUT(1, ENOMEM);
+    }
+    ret = do_epoll_wait(kargs.epfd, events, kargs.maxevents, kargs.timeout);
+    if (ret > 0)
+    {
+        long err = copy_to_user(kargs.events, events,
+                                sizeof(epoll_event_t) * (size_t)ret);
+        ret = err < 0 ? err : ret;
+    }
+    kfree(events);
+    ERROR_OUT_RET(ret);
+    return ret;
 }
 
 /*
@@ -166,8 +531,8 @@ static long sys_write(write_args_t *args)
  * The general steps are as follows: 
  *  - Copy the arguments from user memory 
  *  - Check that the count field is at least the size of a dirent_t
- *  - Use a while loop to read count / sizeof(dirent_t) directory entries into 
- *    the provided dirp and call do_getdent
+ *  - Read as many directory entries as fit, up to a page's worth, with one
+ *    call to do_getdents
  *  - Return the number of bytes read
  */
 static long sys_getdents(getdents_args_t *args)
@@ -192,20 +557,16 @@ static long sys_getdents(getdents_args_t *args)
         ERROR_OUT(1, EINVAL);
     }
     
-    // Allocate temporary buffer
-    void *temp_buf = kmalloc(kernel_args.count);
+    // Allocate temporary buffer; callers loop until 0, so a page at a time
+    // is plenty
+    size_t count = MIN(kernel_args.count,
+                       PAGE_SIZE / sizeof(dirent_t) * sizeof(dirent_t));
+    void *temp_buf = kmalloc(count);
     if (!temp_buf) {
         ERROR_OUT(1, ENOMEM);
     }
     
-    // Call do_getdents with the temporary buffer
-    long bytes_read = 0;
-    size_t total = 0;
-    while (total < kernel_args.count) {
-        bytes_read = do_getdent(kernel_args.fd, (struct dirent *)((char *)temp_buf + total));
-        if (bytes_read <= 0) break;
-        total += bytes_read;
-    }
+    long bytes_read = do_getdents(kernel_args.fd, temp_buf, count);
     
     if (bytes_read > 0) {
         // Copy data back to user space
@@ -223,84 +584,159 @@ static long sys_getdents(getdents_args_t *args)
 }
 
 #ifdef __MOUNTING__
-static long sys_mount(mount_args_t *arg)
+/* The source may be NULL, for filesystems that are not on a device. */
+static long sys_mount(mount_args_t *args)
 {
-    mount_args_t kern_args;
-    char *source;
-    char *target;
-    char *type;
-    long ret;
-
-    if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0)
-    {
-        curthr->kt_errno = EFAULT;
-        return -1;
-    }
+    mount_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
 
-    /* null is okay only for the source */
-    source = user_strdup(&kern_args.spec);
-    if (NULL == (target = user_strdup(&kern_args.dir)))
+    char *source = NULL, *target = NULL, *type = NULL;
+    if ((!kargs.spec.as_str || !(ret = user_strdup(&kargs.spec, &source))) &&
+        !(ret = user_strdup(&kargs.dir, &target)) &&
+        !(ret = user_strdup(&kargs.fstype, &type)))
     {
-        kfree(source);
-        curthr->kt_errno = EINVAL;
-        return -1;
+        ret = do_mount(source, target, type);
     }
-    if (NULL == (type = user_strdup(&kern_args.fstype)))
-    {
+    if (source)
         kfree(source);
+    if (target)
         kfree(target);
-        curthr->kt_errno = EINVAL;
-        return -1;
-    }
+    if (type)
+        kfree(type);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
 
-    ret = do_mount(source, target, type);
-    kfree(source);
+static long sys_umount(argstr_t *args)
+{
+    argstr_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *target;
+    ret = user_strdup(&kargs, &target);
+    ERROR_OUT_RET(ret);
+
+    ret = do_umount(target);
     kfree(target);
-    kfree(type);
 
-    if (ret)
-    {
-        curthr->kt_errno = -ret;
-        return -1;
-    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+#endif
 
-    return 0;
+static long sys_close(int fd)
+{
+    long ret = do_close(fd);
+    ERROR_OUT_RET(ret);
+    return ret;
 }
 
-static long sys_umount(argstr_t *input)
+static long sys_fsync(int fd, long datasync)
 {
-    argstr_t kstr;
-    char *target;
-    long ret;
+    long ret = do_fsync(fd, datasync);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
 
-    if (copy_from_user(&kstr, input, sizeof(kstr)) < 0)
+static long sys_fallocate(fallocate_args_t *args)
+{
+    fallocate_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_fallocate(kargs.fd, kargs.mode, kargs.offset, kargs.len);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_sched_setaffinity(sched_affinity_args_t *args)
+{
+    sched_affinity_args_t kargs;
+    unsigned long mask;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.sa_len < sizeof(mask), EINVAL);
+    ret = copy_from_user(&mask, kargs.sa_mask, sizeof(mask));
+    ERROR_OUT_RET(ret);
+    ret = do_sched_setaffinity(kargs.sa_pid, mask);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_sched_getaffinity(sched_affinity_args_t *args)
+{
+    sched_affinity_args_t kargs;
+    uint64_t mask;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ERROR_OUT(kargs.sa_len < sizeof(unsigned long), EINVAL);
+    ret = do_sched_getaffinity(kargs.sa_pid, &mask);
+    ERROR_OUT_RET(ret);
+    ret = copy_to_user(kargs.sa_mask, &mask, sizeof(unsigned long));
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_getrlimit(rlimit_args_t *args)
+{
+    rlimit_args_t kargs;
+    rlimit_t rlim;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_getrlimit(kargs.ra_resource, &rlim);
+    ERROR_OUT_RET(ret);
+    ret = copy_to_user(kargs.ra_rlim, &rlim, sizeof(rlim));
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_setrlimit(rlimit_args_t *args)
+{
+    rlimit_args_t kargs;
+    rlimit_t rlim;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = copy_from_user(&rlim, kargs.ra_rlim, sizeof(rlim));
+    ERROR_OUT_RET(ret);
+    ret = do_setrlimit(kargs.ra_resource, &rlim);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+#ifdef __GETCWD__
+static long sys_getcwd(getcwd_args_t *args)
+{
+    getcwd_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (!kargs.size)
     {
-        curthr->kt_errno = EFAULT;
-        return -1;
+        ERROR_OUT(1, EINVAL);
     }
-
-    if (NULL == (target = user_strdup(&kstr)))
+    char *path = kmalloc(MAXPATHLEN);
+    if (!path)
     {
-        curthr->kt_errno = EINVAL;
-        return -1;
+        ERROR_OUT(1, ENOMEM);
     }
-
-    ret = do_umount(target);
-    kfree(target);
-
-    if (ret)
+    ret = do_getcwd(path, MIN(kargs.size, (size_t)MAXPATHLEN));
+    if (!ret)
     {
-        curthr->kt_errno = -ret;
-        return -1;
+        ret = copy_to_user(kargs.buf, path, strlen(path) + 1);
     }
-
-    return 0;
+    kfree(path);
+    ERROR_OUT_RET(ret);
+    return ret;
 }
-#endif
+#endif /* __GETCWD__ */
 
-static long sys_close(int fd)
+static long sys_ioctl(ioctl_args_t *args)
 {
-    long ret = do_close(fd);
+    ioctl_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_ioctl(kargs.fd, kargs.cmd, kargs.arg);
     ERROR_OUT_RET(ret);
     return ret;
 }
@@ -312,14 +748,19 @@ static long sys_dup(int fd)
     return ret;
 }
 
+static long _sys_dup2(const dup2_args_t *kargs)
+{
+    long ret = do_dup2(kargs->ofd, kargs->nfd);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static long sys_dup2(const dup2_args_t *args)
 {
     dup2_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
-    ret = do_dup2(kargs.ofd, kargs.nfd);
-    ERROR_OUT_RET(ret);
-    return ret;
+    return _sys_dup2(&kargs);
 }
 
 static long sys_mkdir(mkdir_args_t *args)
@@ -440,16 +881,19 @@ static long sys_chdir(argstr_t *args)
     return ret;
 }
 
+static long _sys_lseek(const lseek_args_t *kargs)
+{
+    long ret = do_lseek(kargs->fd, kargs->offset, kargs->whence);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
 static long sys_lseek(lseek_args_t *args)
 {
     lseek_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
-
-    ret = do_lseek(kargs.fd, kargs.offset, kargs.whence);
-
-    ERROR_OUT_RET(ret);
-    return ret;
+    return _sys_lseek(&kargs);
 }
 
 static long sys_open(open_args_t *args)
@@ -469,15 +913,56 @@ static long sys_open(open_args_t *args)
     return ret;
 }
 
-static long sys_munmap(munmap_args_t *args)
+static long sys_munmap(munmap_args_t *args)
+{
+    munmap_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    ret = do_munmap(kargs.addr, kargs.len);
+
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_mprotect(mprotect_args_t *args)
+{
+    mprotect_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    ret = do_mprotect(kargs.addr, kargs.len, kargs.prot);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_madvise(madvise_args_t *args)
 {
-    munmap_args_t kargs;
+    madvise_args_t kargs;
     long ret = copy_from_user(&kargs, args, sizeof(kargs));
     ERROR_OUT_RET(ret);
+    ret = do_madvise(kargs.addr, kargs.len, kargs.advice);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
 
-    ret = do_munmap(kargs.addr, kargs.len);
+static void *sys_mremap(mremap_args_t *arg)
+{
+    mremap_args_t kargs;
 
-    ERROR_OUT_RET(ret);
+    if (copy_from_user(&kargs, arg, sizeof(mremap_args_t)))
+    {
+        curthr->kt_errno = EFAULT;
+        return MAP_FAILED;
+    }
+
+    void *ret;
+    long err = do_mremap(kargs.addr, kargs.old_len, kargs.new_len, kargs.flags,
+                         &ret);
+    if (err)
+    {
+        curthr->kt_errno = -err;
+        return MAP_FAILED;
+    }
     return ret;
 }
 
@@ -512,7 +997,8 @@ static pid_t sys_waitpid(waitpid_args_t *args)
     pid_t pid = do_waitpid(kargs.wpa_pid, &status, kargs.wpa_options);
     ERROR_OUT_RET(pid);
 
-    if (kargs.wpa_status)
+    /* nothing was reaped under WNOHANG */
+    if (pid && kargs.wpa_status)
     {
         ret = copy_to_user(kargs.wpa_status, &status, sizeof(int));
         ERROR_OUT_RET(ret);
@@ -556,6 +1042,43 @@ static long sys_stat(stat_args_t *args)
     return ret;
 }
 
+static long sys_fstat(fstat_args_t *args)
+{
+    fstat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    stat_t stat_buf;
+    ret = do_fstat(kargs.fd, &stat_buf);
+    ERROR_OUT_RET(ret);
+
+    ret = copy_to_user(kargs.buf, &stat_buf, sizeof(stat_buf));
+    ERROR_OUT_RET(ret);
+
+    return ret;
+}
+
+static long sys_fstatat(fstatat_args_t *args)
+{
+    fstatat_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    char *path;
+    ret = user_strdup(&kargs.path, &path);
+    ERROR_OUT_RET(ret);
+
+    stat_t stat_buf;
+    ret = do_fstatat(kargs.dirfd, path, &stat_buf);
+    kfree(path);
+    ERROR_OUT_RET(ret);
+
+    ret = copy_to_user(kargs.buf, &stat_buf, sizeof(stat_buf));
+    ERROR_OUT_RET(ret);
+
+    return ret;
+}
+
 static long sys_pipe(int args[2])
 {
     int kargs[2];
@@ -609,16 +1132,6 @@ static long sys_fork(regs_t *regs)
     return ret;
 }
 
-static void free_vector(char **vect)
-{
-    char **temp;
-    for (temp = vect; *temp; temp++)
-    {
-        kfree(*temp);
-    }
-    kfree(vect);
-}
-
 static long sys_execve(execve_args_t *args, regs_t *regs)
 {
     execve_args_t kargs;
@@ -645,9 +1158,49 @@ cleanup:
     if (filename)
         kfree(filename);
     if (argv)
-        free_vector(argv);
+        kfree(argv);
+    if (envp)
+        kfree(envp);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_spawn(spawn_args_t *args)
+{
+    spawn_args_t kargs;
+    char *filename = NULL;
+    char **argv = NULL;
+    char **envp = NULL;
+
+    long ret;
+    if ((ret = copy_from_user(&kargs, args, sizeof(kargs))))
+        goto cleanup;
+
+    if (kargs.ndups < 0 || kargs.ndups > SPAWN_MAX_DUPS)
+    {
+        ret = -EINVAL;
+        goto cleanup;
+    }
+
+    if ((ret = user_strdup(&kargs.filename, &filename)))
+        goto cleanup;
+
+    if (kargs.argv.av_vec && (ret = user_vecdup(&kargs.argv, &argv)))
+        goto cleanup;
+
+    if (kargs.envp.av_vec && (ret = user_vecdup(&kargs.envp, &envp)))
+        goto cleanup;
+
+    ret = do_spawn(filename, argv, envp, (const int(*)[2])kargs.dups,
+                   (size_t)kargs.ndups);
+
+cleanup:
+    if (filename)
+        kfree(filename);
+    if (argv)
+        kfree(argv);
     if (envp)
-        free_vector(envp);
+        kfree(envp);
     ERROR_OUT_RET(ret);
     return ret;
 }
@@ -682,6 +1235,104 @@ static long sys_kshell(int ttyid)
     return ret;
 }
 
+static long sys_perfctr(perfctr_args_t *args)
+{
+    perfctr_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    switch (kargs.pa_op)
+    {
+    case PERFCTR_START:
+        ret = pmu_start((uint32_t)kargs.pa_events);
+        break;
+    case PERFCTR_READ:
+    {
+        uint64_t counts[PERFCTR_EVENTS];
+        pmu_read(counts);
+        ret = copy_to_user(kargs.pa_counts, counts, sizeof(counts));
+        break;
+    }
+    case PERFCTR_STOP:
+        pmu_stop();
+        ret = 0;
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_futex(futex_args_t *args)
+{
+    futex_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    switch (kargs.fa_op)
+    {
+    case FUTEX_WAIT:
+        ret = do_futex_wait(kargs.fa_addr, kargs.fa_val);
+        break;
+    case FUTEX_WAKE:
+        ret = do_futex_wake(kargs.fa_addr, kargs.fa_val);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+#ifdef __MTP__
+static long sys_thr_create(thr_create_args_t *args)
+{
+    thr_create_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    ret = do_thr_create((uintptr_t)kargs.tca_entry, (uintptr_t)kargs.tca_arg,
+                        (uintptr_t)kargs.tca_stack, (uintptr_t)kargs.tca_tls);
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+static long sys_thr_join(thr_join_args_t *args)
+{
+    thr_join_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+
+    void *retval;
+    ret = do_thr_join(kargs.tja_tid, &retval);
+    ERROR_OUT_RET(ret);
+    if (kargs.tja_retval)
+    {
+        ret = copy_to_user(kargs.tja_retval, &retval, sizeof(retval));
+        ERROR_OUT_RET(ret);
+    }
+    return 0;
+}
+
+/* A TLS pointer outside the user half would not be a canonical FS base */
+static long sys_set_tls(uintptr_t tls)
+{
+    ERROR_OUT(tls >= USER_MEM_HIGH, EINVAL);
+    sched_set_tls(tls);
+    return 0;
+}
+
+static long sys_thr_cancel(pid_t tid)
+{
+    long ret = do_thr_cancel(tid);
+    ERROR_OUT_RET(ret);
+    return 0;
+}
+#endif
+
 static long sys_usleep(usleep_args_t *args)
 {
     return do_usleep(args->usec);
@@ -701,13 +1352,133 @@ static inline void check_curthr_cancelled()
     }
 }
 
-static long syscall_handler(regs_t *regs)
+/*
+ * Each entry is copied in, made through syscall_dispatch(), and its result
+ * copied back out, one at a time. A fault on the array only fails the batch
+ * if it comes before any entry has been run.
+ */
+static long sys_batch(batch_args_t *args, regs_t *regs)
+{
+    batch_args_t kargs;
+    long ret = copy_from_user(&kargs, args, sizeof(kargs));
+    ERROR_OUT_RET(ret);
+    if (kargs.nentries <= 0 || kargs.nentries > BATCH_MAX ||
+        (kargs.flags & ~BATCH_STOP_ON_ERROR))
+    {
+        ERROR_OUT(1, EINVAL);
+    }
+
+    int i;
+    for (i = 0; i < kargs.nentries; i++)
+    {
+        batch_entry_t ent;
+        ret = copy_from_user(&ent, &kargs.entries[i], sizeof(ent));
+        if (ret < 0)
+        {
+            break;
+        }
+        switch (ent.be_sysnum)
+        {
+        case SYS_fork:
+        case SYS_execve:
+        case SYS_exit:
+        case SYS_thr_exit:
+        case SYS_batch:
+            curthr->kt_errno = EINVAL;
+            ent.be_ret = -1;
+            break;
+        default:
+            ent.be_ret = syscall_dispatch((size_t)ent.be_sysnum, ent.be_args,
+                                          regs);
+            break;
+        }
+        ent.be_errno = ent.be_ret == -1 ? curthr->kt_errno : 0;
+        ret = copy_to_user(&kargs.entries[i], &ent, sizeof(ent));
+        if (ret < 0)
+        {
+            break;
+        }
+        if (ent.be_ret == -1 && (kargs.flags & BATCH_STOP_ON_ERROR))
+        {
+            i++;
+            break;
+        }
+        check_curthr_cancelled();
+    }
+    if (i)
+    {
+        return i;
+    }
+    ERROR_OUT_RET(ret);
+    return ret;
+}
+
+/*
+ * The calls SYSCALL passes the arguments of in registers, in the order of
+ * the fields of their _args_t (see api/syscall.h). Return whether sysnum is
+ * one of them, with its result in *retp.
+ */
+static long syscall_dispatch_regs(size_t sysnum, regs_t *regs, long *retp)
 {
-    size_t sysnum = (size_t)regs->r_rax;
-    uintptr_t args = (uintptr_t)regs->r_rdx;
+    switch (sysnum)
+    {
+    case SYS_read:
+    {
+        read_args_t kargs = {(int)regs->r_rdi, (void *)regs->r_rsi,
+                             (size_t)regs->r_rdx};
+        *retp = _sys_read(&kargs);
+        return 1;
+    }
+
+    case SYS_write:
+    {
+        write_args_t kargs = {(int)regs->r_rdi, (void *)regs->r_rsi,
+                              (size_t)regs->r_rdx};
+        *retp = _sys_write(&kargs);
+        return 1;
+    }
+
+    case SYS_pread:
+    {
+        pread_args_t kargs = {(int)regs->r_rdi, (void *)regs->r_rsi,
+                              (size_t)regs->r_rdx, (off_t)regs->r_r10};
+        *retp = _sys_pread(&kargs);
+        return 1;
+    }
+
+    case SYS_pwrite:
+    {
+        pwrite_args_t kargs = {(int)regs->r_rdi, (void *)regs->r_rsi,
+                               (size_t)regs->r_rdx, (off_t)regs->r_r10};
+        *retp = _sys_pwrite(&kargs);
+        return 1;
+    }
+
+    case SYS_lseek:
+    {
+        lseek_args_t kargs = {(int)regs->r_rdi, (off_t)regs->r_rsi,
+                              (int)regs->r_rdx};
+        *retp = _sys_lseek(&kargs);
+        return 1;
+    }
+
+    case SYS_dup2:
+    {
+        dup2_args_t kargs = {(int)regs->r_rdi, (int)regs->r_rsi};
+        *retp = _sys_dup2(&kargs);
+        return 1;
+    }
+
+    default:
+        return 0;
+    }
+}
 
+/* Carries out system call sysnum with argument args, by either entry. */
+static long syscall_run(size_t sysnum, uintptr_t args, regs_t *regs, long fast)
+{
     const char *syscall_string;
-    if (sysnum <= 47)
+    if (sysnum < sizeof(syscall_strings) / sizeof(syscall_strings[0]))
     {
         syscall_string = syscall_strings[sysnum];
     }
@@ -731,18 +1502,50 @@ static long syscall_handler(regs_t *regs)
         dbg(DBG_SYSCALL, ">> pid %d, sysnum: %lu (%s), arg: %lu (0x%p)\n",
             curproc->p_pid, sysnum, syscall_string, args, (void *)args);
 
+    TRACE(TRACE_SYSCALL_ENTER, sysnum, args);
     check_curthr_cancelled();
-    long ret = syscall_dispatch(sysnum, args, regs);
+    long ret;
+    if (!fast || !syscall_dispatch_regs(sysnum, regs, &ret))
+    {
+        ret = syscall_dispatch(sysnum, args, regs);
+    }
     check_curthr_cancelled();
+    TRACE(TRACE_SYSCALL_EXIT, sysnum, ret);
 
     if (sysnum != SYS_errno)
         dbg(DBG_SYSCALL, "<< pid %d, sysnum: %lu (%s), returned: %lu (%#lx)\n",
             curproc->p_pid, sysnum, syscall_string, ret, ret);
 
-    regs->r_rax = (uint64_t)ret;
+    return ret;
+}
+
+static long syscall_handler(regs_t *regs)
+{
+    regs->r_rax = (uint64_t)syscall_run((size_t)regs->r_rax,
+                                        (uintptr_t)regs->r_rdx, regs, 0);
     return 0;
 }
 
+/*
+ * Called by syscall_entry (entry/syscall_entry.c) for the SYSCALL
+ * instruction. Does what interrupt_handler() does for a trap from userland
+ * once the call is done. Returns whether to go back by IRETQ rather than
+ * SYSRET, which is when the call (an execve()) is returning to an address
+ * SYSRET cannot.
+ */
+long syscall_fast_handler(regs_t *regs)
+{
+    regs->r_rax = (uint64_t)syscall_run((size_t)regs->r_rax,
+                                        (uintptr_t)regs->r_rdi, regs, 1);
+    regs->r_rdx = (uint64_t)curthr->kt_errno;
+
+    page_reclaim_point();
+#ifdef __UPREEMPT__
+    sched_preempt_point();
+#endif
+    return regs->r_rip >= USER_MEM_HIGH;
+}
+
 static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
 {
     switch (sysnum)
@@ -762,6 +1565,29 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
         sched_yield();
         return 0;
 
+#ifdef __MTP__
+    case SYS_thr_create:
+        return sys_thr_create((thr_create_args_t *)args);
+
+    case SYS_thr_join:
+        return sys_thr_join((thr_join_args_t *)args);
+
+    case SYS_thr_cancel:
+        return sys_thr_cancel((pid_t)args);
+
+    case SYS_gettid:
+        return curthr->kt_tid;
+
+    case SYS_set_tls:
+        return sys_set_tls(args);
+#endif
+
+    case SYS_futex:
+        return sys_futex((futex_args_t *)args);
+
+    case SYS_perfctr:
+        return sys_perfctr((perfctr_args_t *)args);
+
     case SYS_fork:
         return sys_fork(regs);
 
@@ -786,6 +1612,9 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_munmap:
         return sys_munmap((munmap_args_t *)args);
 
+    case SYS_mremap:
+        return (long)sys_mremap((mremap_args_t *)args);
+
     case SYS_open:
         return sys_open((open_args_t *)args);
 
@@ -848,6 +1677,12 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_stat:
         return sys_stat((stat_args_t *)args);
 
+    case SYS_fstat:
+        return sys_fstat((fstat_args_t *)args);
+
+    case SYS_fstatat:
+        return sys_fstatat((fstatat_args_t *)args);
+
     case SYS_pipe:
         return sys_pipe((int *)args);
 
@@ -866,6 +1701,86 @@ static long syscall_dispatch(size_t sysnum, uintptr_t args, regs_t *regs)
     case SYS_usleep:
         return sys_usleep((usleep_args_t *)args);
 
+    case SYS_nice:
+        return do_nice((long)args);
+
+    case SYS_spawn:
+        return sys_spawn((spawn_args_t *)args);
+
+    case SYS_madvise:
+        return sys_madvise((madvise_args_t *)args);
+
+    case SYS_mprotect:
+        return sys_mprotect((mprotect_args_t *)args);
+
+    case SYS_readv:
+        return sys_readv((readv_args_t *)args);
+
+    case SYS_writev:
+        return sys_writev((writev_args_t *)args);
+
+    case SYS_pread:
+        return sys_pread((pread_args_t *)args);
+
+    case SYS_pwrite:
+        return sys_pwrite((pwrite_args_t *)args);
+
+    case SYS_sendfile:
+        return sys_sendfile((sendfile_args_t *)args);
+
+    case SYS_aio_submit:
+        return sys_aio_submit((aio_submit_args_t *)args);
+
+    case SYS_aio_reap:
+        return sys_aio_reap((aio_reap_args_t *)args);
+
+    case SYS_fsync:
+        return sys_fsync((int)args, 0);
+
+    case SYS_fdatasync:
+        return sys_fsync((int)args, 1);
+
+    case SYS_fallocate:
+        return sys_fallocate((fallocate_args_t *)args);
+
+    case SYS_sched_setaffinity:
+        return sys_sched_setaffinity((sched_affinity_args_t *)args);
+
+    case SYS_sched_getaffinity:
+        return sys_sched_getaffinity((sched_affinity_args_t *)args);
+
+    case SYS_getrlimit:
+        return sys_getrlimit((rlimit_args_t *)args);
+
+    case SYS_setrlimit:
+        return sys_setrlimit((rlimit_args_t *)args);
+
+#ifdef __GETCWD__
+    case SYS_getcwd:
+        return sys_getcwd((getcwd_args_t *)args);
+#endif
+
+    case SYS_vmsplice:
+        return sys_vmsplice((vmsplice_args_t *)args);
+
+    case SYS_poll:
+        return sys_poll((poll_args_t *)args);
+
+    case SYS_ioctl:
+        return sys_ioctl((ioctl_args_t *)args);
+
+    case SYS_epoll_create:
+        return sys_epoll_create();
+
+    case SYS_epoll_ctl:
+        return sys_epoll_ctl((epoll_ctl_args_t *)args);
+
+    case SYS_epoll_wait:
+        return sys_epoll_wait((epoll_wait_args_t *)args);
+
+    case SYS_batch:
+        return sys_batch((batch_args_t *)args, regs);
+
     default:
         dbg(DBG_ERROR, "ERROR: unknown system call: %lu (args: 0x%p)\n",
             sysnum, (void *)args);
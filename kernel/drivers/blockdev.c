@@ -1,15 +1,72 @@
 #include "kernel.h"
 #include "util/debug.h"
+#include <drivers/disk/ramdisk.h>
 #include <drivers/disk/sata.h>
+#include <drivers/disk/stripe.h>
+#include <drivers/disk/virtio_blk.h>
 
 #include "drivers/blockdev.h"
 
+#include "errno.h"
 #include "fs/s5fs/s5fs.h"
+#include "main/boottime.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
 #include "mm/pframe.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+
+/*
+ * Every transfer to or from a block device goes through its request queue.
+ * A submitter adds its requests to bd_pending, which is kept sorted by
+ * block, and then starts them, with blockdev_unplug or blockdev_wait. That
+ * starts transfers for whichever requests are next, as long as the device
+ * has room for them: no more than bd_depth are under way at a time, as many
+ * as it can take commands, and the ones not under way wait on bd_idle.
+ * Requests made while the device is kept busy pile up behind them and can be
+ * merged, as can those submitted together before they are started.
+ *
+ * The next transfer starts with the request the elevator comes to next,
+ * going up from bd_head and then round from the lowest block (C-LOOK),
+ * unless one has been queued past its deadline, and takes the requests in
+ * the same direction for the blocks right after it along, up to
+ * BLOCKDEV_MAX_SEGS of them and BLOCKDEV_MAX_MERGE blocks, as one command.
+ * Reads get a shorter deadline than writes, since someone is waiting on
+ * them.
+ *
+ * Devices with a submit op carry out transfers without a thread waiting
+ * for each: they finish in interrupt context, in _blockdev_io_done, which
+ * starts the next ones. Otherwise, and when such a device happens to have
+ * no room, the thread in blockdev_wait carries out the transfer.
+ */
+
+/* A transfer of a device's queue */
+typedef struct blockdev_xfer
+{
+    blockdev_io_t bx_io;
+    blockdev_t *bx_bd;
+    list_link_t bx_link; /* on bd_idle while not under way */
+    uint64_t bx_started; /* jiffies */
+    size_t bx_nreqs;
+    blockdev_request_t *bx_reqs[BLOCKDEV_MAX_SEGS];
+} blockdev_xfer_t;
+
+static void _blockdev_io_done(blockdev_io_t *io);
 
 static list_t blockdevs = LIST_INITIALIZER(blockdevs);
 
-void blockdev_init() { sata_init(); }
+void blockdev_init()
+{
+    long mark = boottime_begin("sata_init");
+    sata_init();
+    boottime_end(mark);
+    mark = boottime_begin("virtio_blk_init");
+    virtio_blk_init();
+    boottime_end(mark);
+    ramdisk_init();
+    stripe_init();
+}
 
 long blockdev_register(blockdev_t *dev)
 {
@@ -26,6 +83,25 @@ long blockdev_register(blockdev_t *dev)
         }
     }
 
+    dev->bd_depth = dev->bd_depth ? dev->bd_depth : 1;
+    blockdev_xfer_t *xfers = kmalloc(sizeof(blockdev_xfer_t) * dev->bd_depth);
+    if (!xfers)
+    {
+        return -1;
+    }
+    spinlock_init(&dev->bd_lock);
+    list_init(&dev->bd_pending);
+    list_init(&dev->bd_idle);
+    for (size_t i = 0; i < dev->bd_depth; i++)
+    {
+        xfers[i].bx_bd = dev;
+        xfers[i].bx_io.bi_done = _blockdev_io_done;
+        list_link_init(&xfers[i].bx_link);
+        list_insert_tail(&dev->bd_idle, &xfers[i].bx_link);
+    }
+    dev->bd_head = 0;
+    sched_queue_init(&dev->bd_waitq);
+    memset(&dev->bd_stats, 0, sizeof(dev->bd_stats));
     list_insert_tail(&blockdevs, &dev->bd_link);
     return 0;
 }
@@ -42,12 +118,434 @@ blockdev_t *blockdev_lookup(devid_t id)
     return NULL;
 }
 
+/* Puts req on bd's queue, in order. bd_lock is held. */
+static void _blockdev_enqueue(blockdev_t *bd, blockdev_request_t *req)
+{
+    blockdev_stats_t *st = &bd->bd_stats;
+    st->bst_queued++;
+    st->bst_max_queued = MAX(st->bst_max_queued, st->bst_queued);
+    list_iterate_reverse(&bd->bd_pending, other, blockdev_request_t, br_link)
+    {
+        if (other->br_loc <= req->br_loc)
+        {
+            list_insert_before(other->br_link.l_next, &req->br_link);
+            return;
+        }
+    }
+    list_insert_head(&bd->bd_pending, &req->br_link);
+}
+
+/*
+ * Takes the requests for the next transfer off bd's queue, which is not
+ * empty, into xfer, and sets up its bx_io. bd_lock is held.
+ */
+static void _blockdev_next(blockdev_t *bd, blockdev_xfer_t *xfer)
+{
+    blockdev_request_t *first = NULL;
+    list_iterate(&bd->bd_pending, req, blockdev_request_t, br_link)
+    {
+        if (req->br_expires <= jiffies &&
+            (!first || req->br_expires < first->br_expires))
+        {
+            first = req;
+        }
+    }
+    if (!first)
+    {
+        first = list_head(&bd->bd_pending, blockdev_request_t, br_link);
+        list_iterate(&bd->bd_pending, req, blockdev_request_t, br_link)
+        {
+            if (req->br_loc >= bd->bd_head)
+            {
+                first = req;
+                break;
+            }
+        }
+    }
+
+    long merge = bd->bd_ops->transfer || bd->bd_ops->submit;
+    size_t n = 0;
+    size_t count = 0;
+    for (blockdev_request_t *req = first;
+         &req->br_link != &bd->bd_pending && n < BLOCKDEV_MAX_SEGS;
+         req = list_next(req, blockdev_request_t, br_link))
+    {
+        if (n && (!merge || req->br_write != first->br_write ||
+                  req->br_loc != first->br_loc + count ||
+                  count + req->br_count > BLOCKDEV_MAX_MERGE))
+        {
+            break;
+        }
+        xfer->bx_reqs[n] = req;
+        xfer->bx_io.bi_segs[n].bs_buf = req->br_buf;
+        xfer->bx_io.bi_segs[n].bs_count = req->br_count;
+        n++;
+        count += req->br_count;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        list_remove(&xfer->bx_reqs[i]->br_link);
+    }
+    bd->bd_stats.bst_queued -= n;
+    xfer->bx_nreqs = n;
+    xfer->bx_io.bi_nsegs = n;
+    xfer->bx_io.bi_loc = first->br_loc;
+    xfer->bx_io.bi_write = first->br_write;
+}
+
+/* Carries out io in the calling thread. A forced unit access write is a
+ * write followed by a flush. */
+static long _blockdev_transfer(blockdev_t *bd, blockdev_io_t *io)
+{
+    blockdev_seg_t *seg = &io->bi_segs[0];
+    long write = io->bi_write ? 1 : 0;
+    long ret;
+    if (io->bi_nsegs == 1)
+    {
+        ret = write ? bd->bd_ops->write_block(bd, seg->bs_buf, io->bi_loc,
+                                              seg->bs_count)
+                    : bd->bd_ops->read_block(bd, seg->bs_buf, io->bi_loc,
+                                             seg->bs_count);
+    }
+    else
+    {
+        ret = bd->bd_ops->transfer(bd, io->bi_segs, io->bi_nsegs, io->bi_loc,
+                                   write);
+    }
+    if (!ret && io->bi_write == BLOCKDEV_WRITE_FUA && bd->bd_ops->flush)
+    {
+        ret = bd->bd_ops->flush(bd);
+    }
+    return ret;
+}
+
+/* Returns the bst_latency bucket for a request that took the given time. */
+static inline long _blockdev_latency_bucket(uint64_t ticks)
+{
+    if (!ticks)
+        return 0;
+    long bucket = 64 - __builtin_clzll(ticks);
+    return MIN(bucket, BLOCKDEV_LAT_HIST_BUCKETS - 1);
+}
+
+/* Counts xfer, just started, as under way. bd_lock is held. */
+static void _blockdev_start(blockdev_t *bd, blockdev_xfer_t *xfer)
+{
+    xfer->bx_started = jiffies;
+    if (!bd->bd_stats.bst_inflight++)
+    {
+        bd->bd_stats.bst_busy_since = xfer->bx_started;
+    }
+}
+
+/*
+ * Finishes xfer, which is done with the result ret: marks its requests done
+ * and puts xfer back on bd_idle. Requests with a callback are put on done,
+ * for _blockdev_callbacks once bd_lock, which is held, is dropped.
+ */
+static void _blockdev_finish(blockdev_t *bd, blockdev_xfer_t *xfer, long ret,
+                             list_t *done)
+{
+    blockdev_stats_t *st = &bd->bd_stats;
+    uint64_t now = jiffies;
+    st->bst_transfers++;
+    st->bst_merged += xfer->bx_nreqs > 1 ? xfer->bx_nreqs : 0;
+    st->bst_inflight_ticks += now - xfer->bx_started;
+    if (!--st->bst_inflight)
+    {
+        st->bst_busy_ticks += now - st->bst_busy_since;
+    }
+
+    blockdev_request_t *last = xfer->bx_reqs[xfer->bx_nreqs - 1];
+    bd->bd_head = last->br_loc + (blocknum_t)last->br_count;
+    for (size_t i = 0; i < xfer->bx_nreqs; i++)
+    {
+        blockdev_request_t *req = xfer->bx_reqs[i];
+        if (req->br_write)
+        {
+            st->bst_writes++;
+            st->bst_write_blocks += req->br_count;
+        }
+        else
+        {
+            st->bst_reads++;
+            st->bst_read_blocks += req->br_count;
+        }
+        st->bst_errors += ret != 0;
+        st->bst_latency[_blockdev_latency_bucket(now - req->br_submitted)]++;
+        req->br_ret = ret;
+        if (req->br_callback)
+        {
+            list_insert_tail(done, &req->br_link);
+        }
+        req->br_done = 1;
+    }
+    list_insert_tail(&bd->bd_idle, &xfer->bx_link);
+    sched_broadcast_on(&bd->bd_waitq);
+}
+
+static void _blockdev_callbacks(list_t *done)
+{
+    list_iterate(done, req, blockdev_request_t, br_link)
+    {
+        list_remove(&req->br_link);
+        req->br_callback(req);
+    }
+}
+
+/*
+ * Starts transfers for bd's queue while it has requests and the device has
+ * room, if it can take transfers without a thread waiting for each, then
+ * tells the device of them together if it has a commit op. bd_lock is held.
+ */
+static void _blockdev_kick(blockdev_t *bd, list_t *done)
+{
+    long started = 0;
+    while (bd->bd_ops->submit && !list_empty(&bd->bd_pending) &&
+           !list_empty(&bd->bd_idle))
+    {
+        blockdev_xfer_t *xfer = list_head(&bd->bd_idle, blockdev_xfer_t, bx_link);
+        list_remove(&xfer->bx_link);
+        _blockdev_next(bd, xfer);
+        /* Bigger requests, which are never merged, may need more than one
+         * command, and are carried out by their waiters, as are forced unit
+         * access writes the device cannot do itself */
+        blockdev_request_t *first = xfer->bx_reqs[0];
+        long ret = first->br_count > BLOCKDEV_MAX_MERGE ||
+                           (first->br_write == BLOCKDEV_WRITE_FUA &&
+                            !bd->bd_fua)
+                       ? -EBUSY
+                       : bd->bd_ops->submit(bd, &xfer->bx_io);
+        if (ret == -EBUSY)
+        {
+            /* Someone is using the device around the queue, or see above */
+            for (size_t i = 0; i < xfer->bx_nreqs; i++)
+            {
+                _blockdev_enqueue(bd, xfer->bx_reqs[i]);
+            }
+            list_insert_head(&bd->bd_idle, &xfer->bx_link);
+            break;
+        }
+        _blockdev_start(bd, xfer);
+        if (ret)
+        {
+            _blockdev_finish(bd, xfer, ret, done);
+        }
+        else
+        {
+            started = 1;
+        }
+    }
+    if (started && bd->bd_ops->commit)
+    {
+        bd->bd_ops->commit(bd);
+    }
+}
+
+/* Called from interrupt context once a transfer started by _blockdev_kick is
+ * done. Since bd_lock is only taken at IPL_HIGH, no one holds it. */
+static void _blockdev_io_done(blockdev_io_t *io)
+{
+    blockdev_xfer_t *xfer = CONTAINER_OF(io, blockdev_xfer_t, bx_io);
+    blockdev_t *bd = xfer->bx_bd;
+    list_t done = LIST_INITIALIZER(done);
+    spinlock_lock(&bd->bd_lock);
+    _blockdev_finish(bd, xfer, io->bi_ret, &done);
+    _blockdev_kick(bd, &done);
+    spinlock_unlock(&bd->bd_lock);
+    _blockdev_callbacks(&done);
+}
+
+/*
+ * Queues req, whose buffer, block, count, direction and callback are set, on
+ * bd. It is only started by blockdev_unplug or blockdev_wait, so that the
+ * requests submitted before either can be merged, or when a transfer under
+ * way finishes. If req has no callback, the caller must blockdev_wait for it.
+ */
+void blockdev_submit(blockdev_t *bd, blockdev_request_t *req)
+{
+    KASSERT(req->br_buf && req->br_count);
+    KASSERT(!req->br_callback || req->br_count <= BLOCKDEV_MAX_MERGE);
+    KASSERT(!req->br_callback || req->br_write != BLOCKDEV_WRITE_FUA ||
+            bd->bd_fua);
+    list_link_init(&req->br_link);
+    req->br_submitted = jiffies;
+    req->br_expires = req->br_submitted + (req->br_write ? BLOCKDEV_WRITE_EXPIRE
+                                                         : BLOCKDEV_READ_EXPIRE);
+    req->br_done = 0;
+    req->br_ret = 0;
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bd->bd_lock);
+    _blockdev_enqueue(bd, req);
+    spinlock_unlock(&bd->bd_lock);
+    intr_setipl(ipl);
+}
+
+/* Starts as many of the requests on bd's queue as the device has room for. */
+void blockdev_unplug(blockdev_t *bd)
+{
+    list_t done = LIST_INITIALIZER(done);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bd->bd_lock);
+    _blockdev_kick(bd, &done);
+    spinlock_unlock(&bd->bd_lock);
+    intr_setipl(ipl);
+    _blockdev_callbacks(&done);
+}
+
+/*
+ * Waits for req, which was submitted to bd without a callback, to be done,
+ * starting what is on the queue first. While req is still queued and the
+ * device has room but did not take it, the transfer it goes in is carried out
+ * in this thread. Returns the result of that transfer.
+ */
+long blockdev_wait(blockdev_t *bd, blockdev_request_t *req)
+{
+    KASSERT(!req->br_callback);
+    list_t done = LIST_INITIALIZER(done);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    spinlock_lock(&bd->bd_lock);
+    _blockdev_kick(bd, &done);
+    while (!req->br_done)
+    {
+        if (!list_link_is_linked(&req->br_link) || list_empty(&bd->bd_idle))
+        {
+            sched_sleep_on_locked(&bd->bd_waitq, &bd->bd_lock);
+            spinlock_lock(&bd->bd_lock);
+            continue;
+        }
+        blockdev_xfer_t *xfer = list_head(&bd->bd_idle, blockdev_xfer_t, bx_link);
+        list_remove(&xfer->bx_link);
+        _blockdev_next(bd, xfer);
+        _blockdev_start(bd, xfer);
+        spinlock_unlock(&bd->bd_lock);
+        intr_setipl(ipl);
+
+        long ret = _blockdev_transfer(bd, &xfer->bx_io);
+
+        intr_setipl(IPL_HIGH);
+        spinlock_lock(&bd->bd_lock);
+        _blockdev_finish(bd, xfer, ret, &done);
+    }
+    spinlock_unlock(&bd->bd_lock);
+    intr_setipl(ipl);
+    _blockdev_callbacks(&done);
+    return req->br_ret;
+}
+
+/* Reads count blocks from bd, starting at loc, into buf, through its queue. */
+long blockdev_read(blockdev_t *bd, char *buf, blocknum_t loc, size_t count)
+{
+    blockdev_request_t req = {
+        .br_buf = buf, .br_loc = loc, .br_count = count, .br_write = 0,
+        .br_callback = NULL};
+    blockdev_submit(bd, &req);
+    return blockdev_wait(bd, &req);
+}
+
+/* Writes count blocks from buf to bd, starting at loc, through its queue. */
+long blockdev_write(blockdev_t *bd, const char *buf, blocknum_t loc,
+                    size_t count)
+{
+    blockdev_request_t req = {
+        .br_buf = (char *)buf, .br_loc = loc, .br_count = count, .br_write = 1,
+        .br_callback = NULL};
+    blockdev_submit(bd, &req);
+    return blockdev_wait(bd, &req);
+}
+
+/* Writes count blocks from buf to bd, starting at loc, and returns once they
+ * are durable. */
+long blockdev_write_fua(blockdev_t *bd, const char *buf, blocknum_t loc,
+                        size_t count)
+{
+    blockdev_request_t req = {
+        .br_buf = (char *)buf, .br_loc = loc, .br_count = count,
+        .br_write = BLOCKDEV_WRITE_FUA, .br_callback = NULL};
+    blockdev_submit(bd, &req);
+    return blockdev_wait(bd, &req);
+}
+
+/*
+ * Makes every write to bd that is done by now durable, by having the device
+ * write back its cache, so that no write submitted afterwards can reach the
+ * disk before any of them, however the device reorders what it caches. The
+ * queue only orders requests by block, so the caller must have waited for
+ * the writes it orders.
+ */
+long blockdev_barrier(blockdev_t *bd)
+{
+    if (!bd->bd_ops->flush)
+    {
+        return 0;
+    }
+    long ret = bd->bd_ops->flush(bd);
+    /* The device may have turned transfers away while it flushed */
+    blockdev_unplug(bd);
+    return ret;
+}
+
+/*
+ * Prints the counters of each block device's queue, then its request latency
+ * histogram. Times are in jiffies; BUSY is the time the device had anything
+ * under way, and INFLIGHT the time each transfer was, summed, so that
+ * INFLIGHT / BUSY is the average number of transfers under way.
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    list_iterate(&blockdevs, bd, blockdev_t, bd_link)
+    {
+        blockdev_stats_t st;
+        uint8_t ipl = intr_setipl(IPL_HIGH);
+        spinlock_lock(&bd->bd_lock);
+        st = bd->bd_stats;
+        if (st.bst_inflight)
+        {
+            st.bst_busy_ticks += jiffies - st.bst_busy_since;
+        }
+        spinlock_unlock(&bd->bd_lock);
+        intr_setipl(ipl);
+
+        iprintf(&buf, &size,
+                "disk %u:%u: %lu reads (%lu blocks), %lu writes (%lu blocks), "
+                "%lu errors\n",
+                MAJOR(bd->bd_id), MINOR(bd->bd_id), st.bst_reads,
+                st.bst_read_blocks, st.bst_writes, st.bst_write_blocks,
+                st.bst_errors);
+        iprintf(&buf, &size,
+                "  %lu transfers, %lu requests merged; queued %lu (max %lu), "
+                "%lu of %lu under way\n",
+                st.bst_transfers, st.bst_merged, st.bst_queued,
+                st.bst_max_queued, st.bst_inflight, bd->bd_depth);
+        iprintf(&buf, &size, "  busy %lu, inflight %lu\n", st.bst_busy_ticks,
+                st.bst_inflight_ticks);
+        iprintf(&buf, &size, "  request latency (jiffies):\n");
+        for (long i = 0; i < BLOCKDEV_LAT_HIST_BUCKETS; i++)
+        {
+            if (!i)
+                iprintf(&buf, &size, "%12s %10lu\n", "0", st.bst_latency[i]);
+            else if (i == BLOCKDEV_LAT_HIST_BUCKETS - 1)
+                iprintf(&buf, &size, "%10lu+  %10lu\n", 1UL << (i - 1),
+                        st.bst_latency[i]);
+            else
+                iprintf(&buf, &size, "%7lu-%-4lu %10lu\n", 1UL << (i - 1),
+                        (1UL << i) - 1, st.bst_latency[i]);
+        }
+    }
+    return size;
+}
+
 long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf)
 {
     KASSERT(mobj && pf);
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
     blockdev_t *bd = CONTAINER_OF(mobj, s5fs_t, s5f_mobj)->s5f_bdev;
-    return bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+    return blockdev_read(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
 }
 
 long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
@@ -56,5 +554,5 @@ long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf)
     KASSERT(pf->pf_pagenum <= (1UL << (8 * sizeof(blocknum_t))));
     dbg(DBG_S5FS, "writing disk block %lu\n", pf->pf_pagenum);
     blockdev_t *bd = CONTAINER_OF(mobj, s5fs_t, s5f_mobj)->s5f_bdev;
-    return bd->bd_ops->write_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+    return blockdev_write(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
 }
\ No newline at end of file
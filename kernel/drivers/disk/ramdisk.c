@@ -0,0 +1,127 @@
+#include <drivers/dev.h>
+#include <drivers/disk/ramdisk.h>
+#include <errno.h>
+#include <mm/kmalloc.h>
+#include <mm/page.h>
+#include <proc/spinlock.h>
+#include <util/debug.h>
+#include <util/string.h>
+
+/*
+ * A block device kept in memory, for scratch space and for measuring the
+ * filesystem without a disk underneath it. Its blocks read as zeros until
+ * they are first written, and only take up a page of memory from then on,
+ * so a big RAM disk that is mostly unused costs little more than its table
+ * of pages. Transfers are a memcpy to or from those pages and complete
+ * before the call returns; there is nothing to queue, merge or wait for.
+ *
+ * rd_lock protects rd_blocks, so that two writers of a block that is still
+ * all zeros do not both give it a page.
+ */
+typedef struct ramdisk
+{
+    blockdev_t rd_bdev;
+    size_t rd_nblocks;
+    char **rd_blocks; /* each block's page, or NULL while it is all zeros */
+    spinlock_t rd_lock;
+} ramdisk_t;
+
+#define bdev_to_ramdisk(bd) (CONTAINER_OF((bd), ramdisk_t, rd_bdev))
+
+static long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                               size_t block_count);
+static long ramdisk_write_block(blockdev_t *bdev, const char *buf,
+                                blocknum_t loc, size_t block_count);
+
+static blockdev_ops_t ramdisk_ops = {
+    .read_block = ramdisk_read_block,
+    .write_block = ramdisk_write_block,
+};
+
+static ramdisk_t ramdisk;
+
+/* Registers the RAM disk, as block device RAMDISK_MAJOR:0, if Config.mk asks
+ * for one. */
+void ramdisk_init()
+{
+    if (!__RAMDISK_BLOCKS__)
+    {
+        return;
+    }
+    ramdisk.rd_nblocks = __RAMDISK_BLOCKS__;
+    ramdisk.rd_blocks = kmalloc(sizeof(char *) * ramdisk.rd_nblocks);
+    KASSERT(ramdisk.rd_blocks && "failed to allocate the ramdisk");
+    memset(ramdisk.rd_blocks, 0, sizeof(char *) * ramdisk.rd_nblocks);
+    spinlock_init(&ramdisk.rd_lock);
+
+    ramdisk.rd_bdev.bd_id = MKDEVID(RAMDISK_MAJOR, 0);
+    ramdisk.rd_bdev.bd_ops = &ramdisk_ops;
+    ramdisk.rd_bdev.bd_depth = 1;
+    ramdisk.rd_bdev.bd_nblocks = ramdisk.rd_nblocks;
+    list_link_init(&ramdisk.rd_bdev.bd_link);
+    long ret = blockdev_register(&ramdisk.rd_bdev);
+    KASSERT(!ret);
+    dbg(DBG_DISK, "ramdisk of %lu blocks\n", ramdisk.rd_nblocks);
+}
+
+static long ramdisk_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                               size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (block_count > rd->rd_nblocks || loc > rd->rd_nblocks - block_count)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++, buf += BLOCK_SIZE)
+    {
+        spinlock_lock(&rd->rd_lock);
+        char *page = rd->rd_blocks[loc + i];
+        spinlock_unlock(&rd->rd_lock);
+        if (page)
+        {
+            memcpy(buf, page, BLOCK_SIZE);
+        }
+        else
+        {
+            memset(buf, 0, BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+static long ramdisk_write_block(blockdev_t *bdev, const char *buf,
+                                blocknum_t loc, size_t block_count)
+{
+    ramdisk_t *rd = bdev_to_ramdisk(bdev);
+    if (block_count > rd->rd_nblocks || loc > rd->rd_nblocks - block_count)
+    {
+        return -EINVAL;
+    }
+    for (size_t i = 0; i < block_count; i++, buf += BLOCK_SIZE)
+    {
+        spinlock_lock(&rd->rd_lock);
+        char *page = rd->rd_blocks[loc + i];
+        spinlock_unlock(&rd->rd_lock);
+        if (!page)
+        {
+            char *new = page_alloc();
+            if (!new)
+            {
+                return -ENOMEM;
+            }
+            spinlock_lock(&rd->rd_lock);
+            page = rd->rd_blocks[loc + i];
+            if (!page)
+            {
+                page = rd->rd_blocks[loc + i] = new;
+            }
+            spinlock_unlock(&rd->rd_lock);
+            if (page != new)
+            {
+                page_free(new);
+            }
+        }
+        memcpy(page, buf, BLOCK_SIZE);
+    }
+    return 0;
+}
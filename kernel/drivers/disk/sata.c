@@ -3,20 +3,58 @@
 #include <drivers/disk/sata.h>
 #include <drivers/pcie.h>
 #include <errno.h>
+#include <main/apic.h>
+#include <main/softirq.h>
 #include <mm/kmalloc.h>
 #include <mm/page.h>
 #include <util/debug.h>
 #include <util/string.h>
+#include <util/trace.h>
 
 #define ENABLE_NATIVE_COMMAND_QUEUING 1
+#define ENABLE_COMMAND_COMPLETION_COALESCING 1
 
 #define bdev_to_ata_disk(bd) (CONTAINER_OF((bd), ata_disk_t, bdev))
 #define SATA_SECTORS_PER_BLOCK (SATA_BLOCK_SIZE / ATA_SECTOR_SIZE)
 
+/* The sector count of a command is 16 bits wide, and its LBA 48. */
+#define AHCI_MAX_SECTORS 0xffff
+#define AHCI_MAX_LBA (1L << 48)
+#define SATA_MAX_BLOCKS_PER_COMMAND (AHCI_MAX_SECTORS / SATA_SECTORS_PER_BLOCK)
+
 #define SATA_PCI_CLASS 0x1      /* 0x1 = mass storage device */
 #define SATA_PCI_SUBCLASS 0x6   /* 0x6 = sata */
 #define SATA_AHCI_INTERFACE 0x1 /* 0x1 = ahci */
 
+#define QEMU_SUBSYSTEM_VENDOR_ID 0x1af4
+
+/* Where the HBA supports it, completions raise an interrupt once there are
+ * AHCI_CCC_COMPLETIONS of them, or AHCI_CCC_TIMEOUT milliseconds after the
+ * first, whichever comes first. */
+#define AHCI_CCC_COMPLETIONS 8
+#define AHCI_CCC_TIMEOUT 1
+
+/* By default, ahci_do_operation checks this many times whether a command of
+ * up to SATA_POLL_MAX_SECTORS is done before sleeping on it. */
+#define SATA_POLL_SPINS 1000
+#define SATA_POLL_MAX_SECTORS SATA_SECTORS_PER_BLOCK
+
+/* Times a command issued while a port is set up is checked on before it is
+ * given up on. */
+#define AHCI_SETUP_SPINS 1000000
+
+/* Words of IDENTIFY DEVICE data, and their bits, that say what the disk
+ * supports, see 7.12.7 of ATA Command Set 4. Words 82 to 84 are only valid
+ * if bits 15:14 of word 83 are 01. */
+#define ATA_ID_COMMAND_SET_1 82
+#define ATA_ID_COMMAND_SET_2 83
+#define ATA_ID_FEATURE_EXT 84
+#define ATA_ID_ENABLED_1 85
+#define ATA_ID_WRITE_CACHE (1U << 5)   /* in 82, enabled in 85 */
+#define ATA_ID_FLUSH_CACHE (1U << 12)  /* in 83 */
+#define ATA_ID_FLUSH_CACHE_EXT (1U << 13) /* in 83 */
+#define ATA_ID_FUA (1U << 6)           /* in 84 */
+
 static hba_t *hba; /* host bus adapter */
 
 /* If NCQ, this is an outstanding tag bitmap.
@@ -32,19 +70,76 @@ static ktqueue_t outstanding_request_queues[AHCI_MAX_NUM_PORTS]
  * up. */
 static ktqueue_t command_slot_queues[AHCI_MAX_NUM_PORTS];
 
+/* The command slots each port has, as a bitmap. */
+static uint32_t command_slots[AHCI_MAX_NUM_PORTS];
+
+/* The transfer started by sata_submit on each command slot of each port, or
+ * NULL if a thread is waiting for the command in ahci_do_operation. */
+static blockdev_io_t *outstanding_ios[AHCI_MAX_NUM_PORTS]
+                                     [AHCI_COMMAND_HEADERS_PER_LIST];
+
+/* Quirk: the HBA cannot be trusted with more than one command in flight per
+ * port. QEMU's, which advertises NCQ but does not emulate it correctly, is one
+ * of these. find_cmdslot then finds no slot free while a port has a command
+ * outstanding. Otherwise a port has as many in flight as it has slots. All of
+ * the per-port state is only touched at IPL_HIGH, or by ahci_softirq(), which
+ * does not run on a core while it is at IPL_HIGH. */
+static long ahci_quirk_one_command;
+
+/* For each port, how many times ahci_do_operation checks whether a small
+ * command is done before sleeping, see sata_set_polling(). */
+static size_t poll_spins[AHCI_MAX_NUM_PORTS];
+
+/* The bit of hba->ghc.is that stands for coalesced completions, or 0 if they
+ * are not coalesced. */
+static uint32_t ccc_interrupt;
+
+/* For each port, the command that writes back its disk's write cache, or 0
+ * if it has none. */
+static uint8_t flush_commands[AHCI_MAX_NUM_PORTS];
+
+/* For each port, whether a thread is flushing it. A flush is not an NCQ
+ * command, so the port must have nothing else outstanding while it is carried
+ * out: find_cmdslot finds no slot free meanwhile, and the flushing thread,
+ * and any other that wants to flush the port, wait on flush_queues for
+ * the commands issued before to be done. */
+static long flushing[AHCI_MAX_NUM_PORTS];
+static ktqueue_t flush_queues[AHCI_MAX_NUM_PORTS];
+
+/* The HBA's PCI device, whose MSI interrupt goes to the set of cores
+ * ahci_irq_dest (see APIC_CORE). */
+static pcie_device_t *ahci_dev;
+static uint8_t ahci_irq_dest;
+
+/* The cores the HBA's interrupt may go to, see sata_set_irq_affinity(); or 0
+ * to send it to the core that issues a command while none is outstanding, so
+ * that a thread's completions are handled where it runs. */
+static uint8_t ahci_irq_cores;
+
+/* The ports whose interrupts have been acknowledged and whose commands
+ * ahci_softirq() has yet to complete, as a bitmap. */
+static uint32_t ahci_reap_pending;
+
 long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
                      size_t block_count);
 long sata_write_block(blockdev_t *bdev, const char *buf, blocknum_t block,
                       size_t block_count);
+long sata_transfer(blockdev_t *bdev, const blockdev_seg_t *segs, size_t nsegs,
+                   blocknum_t block, long write);
+long sata_submit(blockdev_t *bdev, blockdev_io_t *io);
+long sata_flush(blockdev_t *bdev);
 
 /* sata_disk_ops - Block device operations for SATA devices. */
 static blockdev_ops_t sata_disk_ops = {
     .read_block = sata_read_block,
     .write_block = sata_write_block,
+    .transfer = sata_transfer,
+    .submit = sata_submit,
+    .flush = sata_flush,
 };
 
 /* find_cmdslot - Checks various bitmaps to find the lowest index command slot
- * that is free for a given port. */
+ * that is free for a given port, or -1 if they are all in use. */
 inline long find_cmdslot(hba_port_t *port)
 {
     /* From 1.3.1: Free command slot will have corresponding bit clear in both
@@ -52,8 +147,57 @@ inline long find_cmdslot(hba_port_t *port)
      * outstanding requests, in case a recently completed command is clear in
      * the port's actual descriptor, but has not been processed by Weenix yet.
      */
-    return __builtin_ctz(~(port->px_sact | port->px_ci |
-                           outstanding_requests[PORT_INDEX(hba, port)]));
+    size_t port_index = PORT_INDEX(hba, port);
+    if (flushing[port_index] ||
+        (ahci_quirk_one_command && outstanding_requests[port_index]))
+    {
+        return -1;
+    }
+    uint32_t free = command_slots[port_index] &
+                    ~(port->px_sact | port->px_ci |
+                      outstanding_requests[port_index]);
+    return free ? __builtin_ctz(free) : -1;
+}
+
+static long ahci_wait_command(size_t port_index, long command_slot);
+
+/* ahci_active - The commands a port has yet to complete, as a bitmap. An NCQ
+ * command is done once its bit of px_sact is clear, and any other once its
+ * bit of px_ci is; the HBA clears px_ci first for NCQ commands, and px_sact is
+ * only ever set for them. */
+static inline uint32_t ahci_active(hba_port_t *port)
+{
+    return port->px_sact | port->px_ci;
+}
+
+/* ahci_route_interrupt - Sends the HBA's interrupt to the given cores. */
+static void ahci_route_interrupt(uint8_t cores)
+{
+    if (!ahci_dev || cores == ahci_irq_dest)
+    {
+        return;
+    }
+    pcie_msi_set_cores(ahci_dev, cores);
+    ahci_irq_dest = cores;
+}
+
+/* ahci_follow_issuer - With no affinity set, sends the HBA's interrupt to the
+ * current core if no command is outstanding, so that none is in flight to
+ * another. Called at IPL_HIGH before a command is issued. */
+static void ahci_follow_issuer()
+{
+    if (ahci_irq_cores)
+    {
+        return;
+    }
+    for (size_t i = 0; i < AHCI_MAX_NUM_PORTS; i++)
+    {
+        if (outstanding_requests[i])
+        {
+            return;
+        }
+    }
+    ahci_route_interrupt(APIC_CORE(apic_current_id()));
 }
 
 /* ensure_mapped - Wrapper for pt_map_range(). */
@@ -65,42 +209,79 @@ void ensure_mapped(void *addr, size_t size)
                  PT_WRITE | PT_PRESENT, PT_WRITE | PT_PRESENT);
 }
 
-kmutex_t because_qemu_doesnt_emulate_ahci_ncq_correctly;
+/**
+ * ahci_fill_prdt - Fills in the physical region descriptor table of a command
+ * for a list of buffers. Each page of them is looked up on its own, so they
+ * need not be physically contiguous: pieces that are, within a buffer or
+ * across two, share an entry of up to AHCI_MAX_PRDT_SIZE bytes, and every
+ * other piece starts an entry of its own. None asks for an interrupt of its
+ * own; the one for the command's FIS is enough.
+ *
+ * @param  prdt        the command's table
+ * @param  segs        the buffers
+ * @param  nsegs       the number of buffers
+ * @return             the number of entries filled in, or -1 if there are
+ *                     more than ACHI_NUM_PRDTS_PER_COMMAND_TABLE
+ */
+static long ahci_fill_prdt(prd_t *prdt, const blockdev_seg_t *segs,
+                           size_t nsegs)
+{
+    long n = 0;
+    for (size_t i = 0; i < nsegs; i++)
+    {
+        uintptr_t addr = (uintptr_t)segs[i].bs_buf;
+        uintptr_t end = addr + segs[i].bs_count * SATA_BLOCK_SIZE;
+        while (addr < end)
+        {
+            size_t len = MIN(end, (uintptr_t)PAGE_ALIGN_DOWN(addr) + PAGE_SIZE) -
+                         addr;
+            uint64_t physbuf = pt_virt_to_phys(addr);
+            addr += len;
+            prd_t *last = n ? &prdt[n - 1] : NULL;
+            if (last && last->dba + last->dbc + 1 == physbuf &&
+                last->dbc + 1UL + len <= AHCI_MAX_PRDT_SIZE)
+            {
+                last->dbc += (uint32_t)len;
+                continue;
+            }
+            if (n == ACHI_NUM_PRDTS_PER_COMMAND_TABLE)
+            {
+                return -1;
+            }
+            prdt[n].dba = physbuf;
+            prdt[n].dbc = (uint32_t)(len - 1);
+            n++;
+        }
+    }
+    return n;
+}
 
 /**
- * ahci_do_operation - Sends a command to the HBA to initiate a disk operation.
+ * ahci_issue - Sets up a command in a free command slot of a port and hands it
+ * to the HBA. Called at IPL_HIGH.
  *
  * @param  port        the HBA port of the ATA disk to use
+ * @param  command_slot a free command slot of the port, see find_cmdslot()
  * @param  lba         the Linear Block Address, i.e., the sector number, to
  *                     start reading from / writing to on the disk
- * @param  count       the number of sectors to read / write
- * @param  buf         the buffer in memory to read from / write to
+ * @param  segs        the buffers in memory to read into / write from, in
+ *                     the order of the sectors; they need not be physically
+ *                     contiguous, see ahci_fill_prdt()
+ * @param  nsegs       the number of buffers
  * @param  write       should be set to 0 if this is a read operation, 1 if
  *                     write
- * @return             0 on success and <0 on error
+ * @return             the number of sectors the command transfers, or
+ *                     -EINVAL, in which case it is not issued, if that is
+ *                     more than AHCI_MAX_SECTORS, if they go past
+ *                     AHCI_MAX_LBA, or if the buffers are in more pieces than
+ *                     the command has room for
  */
-long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
-                       int write)
+static ssize_t ahci_issue(hba_port_t *port, long command_slot, ssize_t lba,
+                         const blockdev_seg_t *segs, size_t nsegs, int write)
 {
-    kmutex_lock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-    KASSERT(count && buf);
-    // KASSERT(lba >= 0 && lba < (1L << 48));
-    KASSERT(lba >= 0 && lba < 1L << 23); //8388608
-
-    /* Obtain the port and the physical system memory in question. */
+    KASSERT(nsegs && segs);
     size_t port_index = PORT_INDEX(hba, port);
 
-    uint8_t ipl = intr_setipl(IPL_HIGH);
-
-    uint64_t physbuf = pt_virt_to_phys((uintptr_t)buf);
-
-    /* Get an available command slot. */
-    long command_slot;
-    while ((command_slot = find_cmdslot(port)) == -1)
-    {
-        sched_sleep_on(command_slot_queues + port_index);
-    }
-
     /* Get corresponding command_header in the port's command_list. */
     command_list_t *command_list =
         (command_list_t *)(port->px_clb + PHYS_OFFSET);
@@ -108,33 +289,33 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
         command_list->command_headers + command_slot;
     memset(command_header, 0, sizeof(command_header_t));
 
-    /* Command setup: Header. */
-    command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
-    command_header->write = (uint8_t)write;
-    command_header->prdtl = (uint16_t)(
-        ALIGN_UP_POW_2(count, AHCI_SECTORS_PER_PRDT) / AHCI_SECTORS_PER_PRDT);
-    KASSERT(command_header->prdtl);
-
     /* Command setup: Table. */
     command_table_t *command_table =
         (command_table_t *)(command_header->ctba + PHYS_OFFSET);
     memset(command_table, 0, sizeof(command_table_t));
 
+    size_t count = 0;
+    for (size_t i = 0; i < nsegs; i++)
+    {
+        count += segs[i].bs_count * SATA_SECTORS_PER_BLOCK;
+    }
+    KASSERT(count && lba >= 0);
+    if (count > AHCI_MAX_SECTORS || lba + (ssize_t)count > AHCI_MAX_LBA)
+    {
+        return -EINVAL;
+    }
+
     /* Command setup: Physical region descriptor table. */
-    prd_t *prdt = command_table->prdt;
-    /* Note that this loop is only called when the size of the data transfer is
-     * REALLY big. */
-    for (unsigned i = 0; i < command_header->prdtl - 1U; i++)
+    long nprds = ahci_fill_prdt(command_table->prdt, segs, nsegs);
+    if (nprds < 0)
     {
-        prdt->dbc = AHCI_MAX_PRDT_SIZE - 1;
-        prdt->dba = physbuf; /* Data from physical buffer. */
-        prdt->i = 1;         /* Set interrupt on completion. */
-        physbuf +=
-            AHCI_MAX_PRDT_SIZE; /* Advance physical buffer for next prd. */
-        prdt++;
+        return -EINVAL;
     }
-    prdt->dbc = (uint32_t)(count % AHCI_SECTORS_PER_PRDT) * ATA_SECTOR_SIZE - 1;
-    prdt->dba = (uint64_t)physbuf;
+
+    /* Command setup: Header. */
+    command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
+    command_header->write = write != 0;
+    command_header->prdtl = (uint16_t)nprds;
 
     /* Set up the particular h2d_register_fis command (the only one we use). */
     h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
@@ -159,56 +340,212 @@ long ahci_do_operation(hba_port_t *port, ssize_t lba, uint16_t count, void *buf,
         /* Choose the appropriate NCQ read/write command. */
         command_fis->command = (uint8_t)(write ? ATA_WRITE_FPDMA_QUEUED_COMMAND
                                                : ATA_READ_FPDMA_QUEUED_COMMAND);
+        if (write == BLOCKDEV_WRITE_FUA)
+        {
+            command_fis->device |= ATA_DEVICE_FUA;
+        }
     }
     else
     {
-        command_fis->sector_count = count;
+        command_fis->sector_count = (uint16_t)count;
 
-        command_fis->command = (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND
-                                               : ATA_READ_DMA_EXT_COMMAND);
+        command_fis->command =
+            (uint8_t)(write == BLOCKDEV_WRITE_FUA ? ATA_WRITE_DMA_FUA_EXT_COMMAND
+                      : write                     ? ATA_WRITE_DMA_EXT_COMMAND
+                                                  : ATA_READ_DMA_EXT_COMMAND);
     }
 #else
     /* For regular commands, simply set the command type and the sector count.
      */
-    command_fis->sector_count = count;
+    command_fis->sector_count = (uint16_t)count;
     command_fis->command =
-        (uint8_t)(write ? ATA_WRITE_DMA_EXT_COMMAND : ATA_READ_DMA_EXT_COMMAND);
+        (uint8_t)(write == BLOCKDEV_WRITE_FUA ? ATA_WRITE_DMA_FUA_EXT_COMMAND
+                  : write                     ? ATA_WRITE_DMA_EXT_COMMAND
+                                              : ATA_READ_DMA_EXT_COMMAND);
 #endif
 
-    dbg(DBG_DISK, "initiating request on slot %ld to %s sectors [%lu, %lu)\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
+    TRACE(TRACE_DISK_ISSUE, command_slot, lba | ((uint64_t)!!write << 63));
 
     /* Locally mark that we sent out a command on the given command slot of the
      * given port. */
-    outstanding_requests[port_index] |= (1 << command_slot);
+    ahci_follow_issuer();
+    outstanding_requests[port_index] |= 1U << command_slot;
+
+    /* Explicitly notify the port that a command is available for execution.
+     * Both registers are write-1-to-set, so only our slot's bit is written;
+     * px_sact, which holds the NCQ tags, is only for NCQ. Without NCQ the
+     * port still takes commands in several slots, and carries them out one
+     * after the other. */
+#if ENABLE_NATIVE_COMMAND_QUEUING
+    if (hba->ghc.cap.sncq)
+    {
+        port->px_sact = 1U << command_slot;
+    }
+#endif
+    port->px_ci = 1U << command_slot;
+    return (ssize_t)count;
+}
+
+/**
+ * ahci_do_operation - Sends a command to the HBA to initiate a disk operation,
+ * and waits for it to complete.
+ *
+ * @param  port        the HBA port of the ATA disk to use
+ * @param  lba         the Linear Block Address, i.e., the sector number, to
+ *                     start reading from / writing to on the disk
+ * @param  segs        the buffers in memory to read into / write from, see
+ *                     ahci_issue()
+ * @param  nsegs       the number of buffers
+ * @param  write       should be set to 0 if this is a read operation, 1 if
+ *                     write
+ * @return             0 on success and <0 on error
+ */
+long ahci_do_operation(hba_port_t *port, ssize_t lba,
+                       const blockdev_seg_t *segs, size_t nsegs, int write)
+{
+    /* Obtain the port and the physical system memory in question. */
+    size_t port_index = PORT_INDEX(hba, port);
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
 
-    /* Explicitly notify the port that a command is available for execution. */
-    port->px_sact |= (1 << command_slot);
-    port->px_ci |= (1 << command_slot);
+    /* Get an available command slot. */
+    long command_slot;
+    while ((command_slot = find_cmdslot(port)) == -1)
+    {
+        sched_sleep_on_exclusive(command_slot_queues + port_index);
+    }
+    outstanding_ios[port_index][command_slot] = NULL;
+    ssize_t count = ahci_issue(port, command_slot, lba, segs, nsegs, write);
+    if (count < 0)
+    {
+        intr_setipl(ipl);
+        return count;
+    }
 
-    void *old_retval = 0;
-    if (curthr->kt_retval)
+    /* Polled completion: a small command may well be done sooner than the
+     * thread could sleep and be woken up, so spin on it for a while first.
+     * Its interrupt then finds nothing more to complete. */
+    if ((size_t)count <= SATA_POLL_MAX_SECTORS)
     {
-        old_retval = curthr->kt_retval;
-        curthr->kt_retval = 0;
+        for (size_t i = 0; i < poll_spins[port_index]; i++)
+        {
+            if (!(ahci_active(port) & (1U << command_slot)))
+            {
+                outstanding_requests[port_index] &= ~(1U << command_slot);
+                sched_wake_on(&command_slot_queues[port_index]);
+                intr_setipl(ipl);
+                TRACE(TRACE_DISK_COMPLETE, command_slot, lba);
+                return 0;
+            }
+        }
     }
-    /* Sleep until the command has been serviced. */
-    KASSERT(!curthr->kt_retval);
 
-    dbg(DBG_DISK,
-        "initiating request on slot %ld to %s sectors [%lu, %lu)...sleeping\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    sched_sleep_on(outstanding_request_queues[port_index] + command_slot);
+    long ret = ahci_wait_command(port_index, command_slot);
     intr_setipl(ipl);
-    dbg(DBG_DISK, "completed request on slot %ld to %s sectors [%lu, %lu)\n",
-        command_slot, write ? "write" : "read", lba, lba + count);
-    kmutex_unlock(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
+    TRACE(TRACE_DISK_COMPLETE, command_slot, lba);
+    return ret;
+}
+
+/**
+ * ahci_setup_command - Sets up a command that is neither a read nor a write
+ * in a command slot of a port, without issuing it.
+ *
+ * @param  port        the HBA port of the ATA disk to use
+ * @param  command_slot a free command slot of the port
+ * @param  command     the command, one of the ATA_*_COMMANDs
+ * @param  features    its features register
+ * @param  buf         a page the command reads data into, or NULL if it
+ *                     transfers none
+ */
+static void ahci_setup_command(hba_port_t *port, long command_slot,
+                               uint8_t command, uint8_t features, void *buf)
+{
+    command_list_t *command_list =
+        (command_list_t *)(port->px_clb + PHYS_OFFSET);
+    command_header_t *command_header =
+        command_list->command_headers + command_slot;
+    memset(command_header, 0, sizeof(command_header_t));
+    command_table_t *command_table =
+        (command_table_t *)(command_header->ctba + PHYS_OFFSET);
+    memset(command_table, 0, sizeof(command_table_t));
 
+    if (buf)
+    {
+        blockdev_seg_t seg = {.bs_buf = buf, .bs_count = 1};
+        command_header->prdtl = (uint16_t)ahci_fill_prdt(command_table->prdt,
+                                                         &seg, 1);
+    }
+    command_header->cfl = sizeof(h2d_register_fis_t) / sizeof(uint32_t);
+
+    h2d_register_fis_t *command_fis = &command_table->cfis.h2d_register_fis;
+    command_fis->fis_type = fis_type_h2d_register;
+    command_fis->c = 1;
+    command_fis->device = ATA_DEVICE_LBA_MODE;
+    command_fis->command = command;
+    command_fis->features = features;
+}
+
+/**
+ * ahci_wait_command - Sleeps until the command this thread issued on a
+ * command slot of a port is done. Called at IPL_HIGH.
+ *
+ * @param  port_index  the port
+ * @param  command_slot the command slot
+ * @return             0 on success and <0 on error
+ */
+static long ahci_wait_command(size_t port_index, long command_slot)
+{
+    void *old_retval = curthr->kt_retval;
+    curthr->kt_retval = 0;
+    sched_sleep_on(outstanding_request_queues[port_index] + command_slot);
     long ret = (long)curthr->kt_retval;
-    if (old_retval)
+    curthr->kt_retval = old_retval;
+    return ret;
+}
+
+/**
+ * ahci_flush - Has the disk on a port write back its cache, and waits for it
+ * to be done: every write done before then is durable once this returns.
+ * The flush waits for the port to be done with what it has outstanding, and
+ * nothing else is issued on the port until it is done, see flushing.
+ *
+ * @param  port        the HBA port of the ATA disk to flush
+ * @return             0 on success and <0 on error
+ */
+static long ahci_flush(hba_port_t *port)
+{
+    size_t port_index = PORT_INDEX(hba, port);
+    if (!flush_commands[port_index])
+    {
+        return 0;
+    }
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    while (flushing[port_index])
     {
-        curthr->kt_retval = old_retval;
+        sched_sleep_on(flush_queues + port_index);
     }
+    flushing[port_index] = 1;
+    while (outstanding_requests[port_index])
+    {
+        sched_sleep_on(flush_queues + port_index);
+    }
+    uint32_t free = command_slots[port_index] & ~ahci_active(port);
+    KASSERT(free);
+    long command_slot = __builtin_ctz(free);
+
+    outstanding_ios[port_index][command_slot] = NULL;
+    ahci_setup_command(port, command_slot, flush_commands[port_index], 0, NULL);
+    ahci_follow_issuer();
+    outstanding_requests[port_index] |= 1U << command_slot;
+    port->px_ci = 1U << command_slot;
+    dbg(DBG_DISK, "flushing port %lu on slot %ld\n", port_index, command_slot);
+    long ret = ahci_wait_command(port_index, command_slot);
+
+    flushing[port_index] = 0;
+    sched_broadcast_on(flush_queues + port_index);
+    sched_broadcast_on(command_slot_queues + port_index);
+    intr_setipl(ipl);
     return ret;
 }
 
@@ -232,6 +569,85 @@ static inline void stop_cmd(hba_port_t *port)
         ; /* Wait for FIS receive DMA to stop running. */
 }
 
+/**
+ * ahci_setup_poll - Issues a command while a port is being set up, when the
+ * HBA raises no interrupts, and spins until it is done. A command that is not
+ * done in time is given up on by restarting the port, which takes it back.
+ *
+ * @param  port        the HBA port of the ATA disk, whose DMA engines run
+ * @param  command     the command, one of the ATA_*_COMMANDs
+ * @param  features    its features register
+ * @param  buf         a page the command reads data into, or NULL
+ * @return             0 on success, or -ETIMEDOUT
+ */
+static long ahci_setup_poll(hba_port_t *port, uint8_t command,
+                            uint8_t features, void *buf)
+{
+    ahci_setup_command(port, 0, command, features, buf);
+    port->px_ci = 1;
+    long ret = -ETIMEDOUT;
+    for (size_t i = 0; i < AHCI_SETUP_SPINS; i++)
+    {
+        if (!(port->px_ci & 1))
+        {
+            ret = 0;
+            break;
+        }
+    }
+    if (ret)
+    {
+        stop_cmd(port);
+        start_cmd(port);
+    }
+    port->px_is = px_interrupt_status_clear;
+    return ret;
+}
+
+/**
+ * ahci_identify - Finds out whether the disk on a port has a write cache, and
+ * if so turns it on and picks the command that flushes it, and whether it
+ * does forced unit access writes. A disk that cannot be identified is taken
+ * to have a cache that FLUSH CACHE EXT flushes, and to do no FUA writes.
+ *
+ * @param  port        the HBA port of the ATA disk, whose DMA engines run
+ * @param  port_number its index
+ * @return             whether the disk does FUA writes
+ */
+static long ahci_identify(hba_port_t *port, unsigned int port_number)
+{
+    uint16_t *id = page_alloc();
+    KASSERT(id);
+    flush_commands[port_number] = ATA_FLUSH_CACHE_EXT_COMMAND;
+    long fua = 0;
+    if (!ahci_setup_poll(port, ATA_IDENTIFY_DEVICE_COMMAND, 0, id) &&
+        (id[ATA_ID_COMMAND_SET_2] >> 14) == 1)
+    {
+        if (!(id[ATA_ID_COMMAND_SET_1] & ATA_ID_WRITE_CACHE))
+        {
+            flush_commands[port_number] = 0;
+        }
+        else if (!(id[ATA_ID_COMMAND_SET_2] & ATA_ID_FLUSH_CACHE_EXT))
+        {
+            flush_commands[port_number] =
+                id[ATA_ID_COMMAND_SET_2] & ATA_ID_FLUSH_CACHE
+                    ? ATA_FLUSH_CACHE_COMMAND
+                    : 0;
+        }
+        if (flush_commands[port_number] &&
+            !(id[ATA_ID_ENABLED_1] & ATA_ID_WRITE_CACHE))
+        {
+            /* Writes are only cached once the cache can be flushed */
+            ahci_setup_poll(port, ATA_SET_FEATURES_COMMAND,
+                            ATA_FEATURE_ENABLE_WRITE_CACHE, NULL);
+        }
+        fua = !!(id[ATA_ID_FEATURE_EXT] & ATA_ID_FUA);
+    }
+    page_free(id);
+    dbg(DBG_DISK, "\tflush command 0x%x, fua %s\n", flush_commands[port_number],
+        fua ? "supported" : "unsupported");
+    return fua;
+}
+
 /* ahci_initialize_port */
 static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
                                  uintptr_t ahci_base)
@@ -280,6 +696,13 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
 
     /* Start the queue to wait for an open command slot. */
     sched_queue_init(command_slot_queues + port_number);
+    command_slots[port_number] =
+        (uint32_t)((2UL << hba->ghc.cap.ncs) - 1);
+    poll_spins[port_number] = SATA_POLL_SPINS;
+    sched_queue_init(flush_queues + port_number);
+
+    /* Start the port's DMA engines and allow it to start servicing commands. */
+    start_cmd(port);
 
     /* For SATA disks, allocate, setup, and register the disk / block device. */
     if (port->px_sig == SATA_SIG_ATA)
@@ -289,6 +712,10 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
         disk->port = port;
         disk->bdev.bd_id = MKDEVID(DISK_MAJOR, port_number);
         disk->bdev.bd_ops = &sata_disk_ops;
+        disk->bdev.bd_depth =
+            ahci_quirk_one_command ? 1 : hba->ghc.cap.ncs + 1UL;
+        disk->bdev.bd_nblocks = 0;
+        disk->bdev.bd_fua = ahci_identify(port, port_number);
         list_link_init(&disk->bdev.bd_link);
         long ret = blockdev_register(&disk->bdev);
         KASSERT(!ret);
@@ -300,64 +727,60 @@ static void ahci_initialize_port(hba_port_t *port, unsigned int port_number,
         dbg(DBG_DISK, "\tunknown device signature: 0x%x\n", port->px_sig);
     }
 
-    /* Start the port's DMA engines and allow it to start servicing commands. */
-    start_cmd(port);
-
     /* RWC: Write back to clear errors one more time. FLAG: WHY?! */
     // port->px_serr = port->px_serr;
 }
 
+/* ahci_enable_coalescing - Has completions on every port coalesced, and turns
+ * off the interrupts each of them would raise otherwise. See 11 of 1.3.1. */
+static void ahci_enable_coalescing()
+{
+    hba_ccc_ctl_t ctl = {.value = hba->ghc.ccc_ctl.value};
+    ctl.bits.en = 0;
+    hba->ghc.ccc_ctl.value = ctl.value;
+    ctl.bits.cc = AHCI_CCC_COMPLETIONS;
+    ctl.bits.tv = AHCI_CCC_TIMEOUT;
+    hba->ghc.ccc_ctl.value = ctl.value;
+
+    hba->ghc.ccc_ports = hba->ghc.pi;
+    for (uint32_t ports = hba->ghc.pi; ports; ports &= ports - 1)
+    {
+        hba->ports[__builtin_ctz(ports)].px_ie.value &=
+            ~(uint32_t)PX_INTERRUPT_ENABLE_COMPLETIONS;
+    }
+
+    ctl.bits.en = 1;
+    hba->ghc.ccc_ctl.value = ctl.value;
+    ccc_interrupt = 1U << hba->ghc.ccc_ctl.bits.intr;
+    dbg(DBG_DISK, "ahci coalescing %u completions or %ums, on bit %u\n",
+        AHCI_CCC_COMPLETIONS, AHCI_CCC_TIMEOUT, hba->ghc.ccc_ctl.bits.intr);
+}
+
 /* ahci_initialize_hba - Called at initialization to set up hba-related fields.
  */
 void ahci_initialize_hba()
 {
-    kmutex_init(&because_qemu_doesnt_emulate_ahci_ncq_correctly);
-
     /* Get the HBA controller for the SATA device. */
     pcie_device_t *dev =
         pcie_lookup(SATA_PCI_CLASS, SATA_PCI_SUBCLASS, SATA_AHCI_INTERFACE);
+    KASSERT(dev && "Could not find AHCI Controller");
+    ahci_quirk_one_command =
+        dev->standard.subsystem_vendor_id == QEMU_SUBSYSTEM_VENDOR_ID;
 
     /* Set bit 2 to enable memory and I/O requests.
      * This actually doesn't seem to be necessary...
      * See: 2.1.2, AHCI SATA 1.3.1. */
     // dev->standard.command |= 0x4;
 
-    /* Traverse the pcie_device_t's capabilities to look for an MSI capability.
-     */
-    KASSERT(dev->standard.capabilities_ptr & PCI_CAPABILITY_PTR_MASK);
-    pci_capability_t *cap =
-        (pci_capability_t *)((uintptr_t)dev + (dev->standard.capabilities_ptr &
-                                               PCI_CAPABILITY_PTR_MASK));
-    while (cap->id != PCI_MSI_CAPABILITY_ID)
-    {
-        KASSERT(cap->next_cap && "couldn't find msi control for ahci device");
-        cap = (pci_capability_t *)((uintptr_t)dev +
-                                   (cap->next_cap & PCI_CAPABILITY_PTR_MASK));
-    }
-    msi_capability_t *msi_cap = (msi_capability_t *)cap;
-
-    /* Set MSI Enable to turn on MSI. */
-    msi_cap->control.msie = 1;
-
-    /* For more info on MSI, consult Intel 3A 10.11.1, and also 2.3 of the 1.3.1
+    /* Set up MSI with interrupt vector INTR_DISK_PRIMARY, at first for the
+     * BSP; ahci_follow_issuer() moves it to the cores issuing commands. For
+     * more info on MSI, consult Intel 3A 10.11.1, and also 2.3 of the 1.3.1
      * spec. */
+    ahci_irq_dest = APIC_CORE(apic_current_id());
+    long ret = pcie_msi_enable(dev, INTR_DISK_PRIMARY, ahci_irq_dest);
+    KASSERT(!ret && "couldn't find msi control for ahci device");
+    ahci_dev = dev;
 
-    /* Set up MSI for processor 1, with interrupt vector INTR_DISK_PRIMARY.
-     * TODO: Check MSI setup details to determine if MSI can be handled more
-     * efficiently in SMP.
-     */
-    if (msi_cap->control.c64)
-    {
-        msi_cap->address_data.ad64.addr = MSI_ADDRESS_FOR(1);
-        msi_cap->address_data.ad64.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
-    }
-    else
-    {
-        msi_cap->address_data.ad32.addr = MSI_ADDRESS_FOR(1);
-        msi_cap->address_data.ad32.data = MSI_DATA_FOR(INTR_DISK_PRIMARY);
-    }
-
-    KASSERT(dev && "Could not find AHCI Controller");
     dbg(DBG_DISK, "Found AHCI Controller\n");
 
     /* bar = base address register. The last bar points to base memory for the
@@ -367,10 +790,6 @@ void ahci_initialize_hba()
     /* Create a page table mapping for the hba. */
     ensure_mapped(hba, sizeof(hba_t));
 
-    /* This seems to do nothing, because interrupt_line is never set, and MSIE
-     * is set. */
-    // intr_map(dev->standard.interrupt_line, INTR_DISK_PRIMARY);
-
     /* Allocate space for what will become the command lists and received FISs
      * for each port. */
     uintptr_t ahci_base = (uintptr_t)page_alloc_n(AHCI_SIZE_PAGES);
@@ -386,8 +805,9 @@ void ahci_initialize_hba()
     /* Temporarily clear Interrupt Enable bit before setting up ports. */
     hba->ghc.ghc.ie = 0;
 
-    dbg(DBG_DISK, "ahci ncq supported: %s\n",
-        hba->ghc.cap.sncq ? "true" : "false");
+    dbg(DBG_DISK, "ahci ncq supported: %s, %u command slots%s\n",
+        hba->ghc.cap.sncq ? "true" : "false", hba->ghc.cap.ncs + 1,
+        ahci_quirk_one_command ? ", one command at a time" : "");
 
     /* Initialize each of the available ports. */
     uint32_t ports_implemented = hba->ghc.pi;
@@ -399,6 +819,13 @@ void ahci_initialize_hba()
         ahci_initialize_port(hba->ports + port_number, port_number, ahci_base);
     }
 
+#if ENABLE_COMMAND_COMPLETION_COALESCING
+    if (hba->ghc.cap.cccs)
+    {
+        ahci_enable_coalescing();
+    }
+#endif
+
     /* Clear any outstanding interrupts from any ports. */
     hba->ghc.is = (uint32_t)-1;
 
@@ -406,7 +833,67 @@ void ahci_initialize_hba()
     hba->ghc.ghc.ie = 1;
 }
 
-/* ahci_interrupt_handler - Service an interrupt that was raised by the HBA.
+/* ahci_reap_port - Completes the commands that are done on a port. Called
+ * from ahci_softirq(), so only where the HBA's interrupt could come in. */
+static void ahci_reap_port(unsigned port_index)
+{
+    /* Compare the active commands against those we actually sent out to get
+     * completed commands. */
+    uint32_t active = ahci_active(hba->ports + port_index);
+    uint32_t completed = outstanding_requests[port_index] &
+                         ~(outstanding_requests[port_index] & active);
+    /* Handle each completed command: */
+    while (completed)
+    {
+        uint32_t slot = __builtin_ctz(completed);
+
+        /* Mark the command as available. */
+        completed &= ~(1U << slot);
+        outstanding_requests[port_index] &= ~(1U << slot);
+
+        /* Complete the transfer that was started on it, which may start
+         * another; or wake up the thread that was waiting on it. */
+        blockdev_io_t *io = outstanding_ios[port_index][slot];
+        if (io)
+        {
+            outstanding_ios[port_index][slot] = NULL;
+            io->bi_ret = 0;
+            io->bi_done(io);
+        }
+        else
+        {
+            kthread_t *thr;
+            sched_wakeup_on(&outstanding_request_queues[port_index][slot],
+                            &thr);
+        }
+
+        /* Wake up a thread that was waiting for a command slot to free up
+         * on the port; one freed slot can serve only one of them. */
+        sched_wake_on(&command_slot_queues[port_index]);
+    }
+
+    /* Wake up a thread that is waiting to flush the port once it is idle. */
+    if (flushing[port_index] && !outstanding_requests[port_index])
+    {
+        sched_broadcast_on(flush_queues + port_index);
+    }
+}
+
+/* ahci_softirq - Completes the commands on the ports the interrupt handler
+ * found done. */
+static void ahci_softirq()
+{
+    uint32_t ports = __sync_fetch_and_and(&ahci_reap_pending, 0);
+    while (ports)
+    {
+        unsigned port_index = __builtin_ctz(ports);
+        ports &= ports - 1;
+        ahci_reap_port(port_index);
+    }
+}
+
+/* ahci_interrupt_handler - Service an interrupt that was raised by the HBA:
+ * acknowledge it, and leave completing its commands to ahci_softirq().
  */
 static long ahci_interrupt_handler(regs_t *regs)
 {
@@ -416,6 +903,21 @@ static long ahci_interrupt_handler(regs_t *regs)
         /* Get a port from the global interrupt status bitmap. */
         unsigned port_index = __builtin_ctz(hba->ghc.is);
 
+        /* Coalesced completions, which may be on any of the ports covered. */
+        if (ccc_interrupt & (1U << port_index))
+        {
+            hba->ghc.is &= ccc_interrupt;
+            for (uint32_t ports = hba->ghc.ccc_ports; ports; ports &= ports - 1)
+            {
+                unsigned index = __builtin_ctz(ports);
+                hba->ports[index].px_is.bits.dhrs = 1;
+                hba->ports[index].px_is.bits.sdbs = 1;
+            }
+            __sync_fetch_and_or(&ahci_reap_pending, hba->ghc.ccc_ports);
+            softirq_raise(SOFTIRQ_DISK);
+            continue;
+        }
+
         /* Get the port descriptor from the HBA's ports array. */
         hba_port_t *port = hba->ports + port_index;
 
@@ -431,8 +933,11 @@ static long ahci_interrupt_handler(regs_t *regs)
 #if ENABLE_NATIVE_COMMAND_QUEUING
         if (hba->ghc.cap.sncq)
         {
-            KASSERT(port->px_is.bits.sdbs);
+            /* A flush, which is not an NCQ command, completes with a
+             * device-to-host FIS all the same. */
+            KASSERT(port->px_is.bits.sdbs || port->px_is.bits.dhrs);
             port->px_is.bits.sdbs = 1;
+            port->px_is.bits.dhrs = 1;
         }
         else
         {
@@ -449,46 +954,72 @@ static long ahci_interrupt_handler(regs_t *regs)
         /* Note: Changed from ~ to regular, because this register is RWC. */
         hba->ghc.is &= (1 << port_index);
 
-        /* Get the list of commands still outstanding. */
-#if ENABLE_NATIVE_COMMAND_QUEUING
-        /* If NCQ, use SACT register. */
-        uint32_t active = hba->ghc.cap.sncq ? port->px_sact : port->px_ci;
-#else
-        /* If not NCQ, use CI register. */
-        uint32_t active = port->px_ci;
-#endif
-
-        /* Compare the active commands against those we actually sent out to get
-         * completed commands. */
-        uint32_t completed = outstanding_requests[port_index] &
-                             ~(outstanding_requests[port_index] & active);
-        /* Handle each completed command: */
-        while (completed)
-        {
-            uint32_t slot = __builtin_ctz(completed);
-
-            /* Wake up the thread that was waiting on that command. */
-            kthread_t *thr;
-            sched_wakeup_on(&outstanding_request_queues[port_index][slot],
-                            &thr);
+        __sync_fetch_and_or(&ahci_reap_pending, 1U << port_index);
+        softirq_raise(SOFTIRQ_DISK);
+    }
+    return 0;
+}
 
-            /* Mark the command as available. */
-            completed &= ~(1 << slot);
-            outstanding_requests[port_index] &= ~(1 << slot);
+/*
+ * Sets how many times a command of up to SATA_POLL_MAX_SECTORS that a thread
+ * waits for on bdev is checked on before the thread sleeps: polling saves the
+ * small reads a workload is waiting on the cost of a sleep and a wakeup, at
+ * the cost of spinning, at IPL_HIGH, on commands that take longer. 0 always
+ * sleeps.
+ */
+void sata_set_polling(blockdev_t *bdev, size_t spins)
+{
+    poll_spins[PORT_INDEX(hba, bdev_to_ata_disk(bdev)->port)] = spins;
+}
 
-            /* TODO: Wake up threads that were waiting for a command slot to
-             * free up on the port. */
-        }
+/*
+ * Sends the HBA's interrupt only to the given set of cores, a mask of
+ * APIC_CORE() bits, the one at the lowest priority of them taking each; or,
+ * if cores is 0, to the core that issues a command while the HBA is idle, so
+ * that each thread's completions are handled on its own core.
+ */
+void sata_set_irq_affinity(uint8_t cores)
+{
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    ahci_irq_cores = cores;
+    if (cores)
+    {
+        ahci_route_interrupt(cores);
     }
-    return 0;
+    intr_setipl(ipl);
 }
 
 void sata_init()
 {
+    softirq_register(SOFTIRQ_DISK, ahci_softirq);
     intr_register(INTR_DISK_PRIMARY, ahci_interrupt_handler);
     ahci_initialize_hba();
 }
 
+/*
+ * Reads or writes block_count blocks at block with as many commands as it
+ * takes, each of up to SATA_MAX_BLOCKS_PER_COMMAND.
+ */
+static long sata_rw(blockdev_t *bdev, char *buf, blocknum_t block,
+                    size_t block_count, int write)
+{
+    ata_disk_t *disk = bdev_to_ata_disk(bdev);
+    for (size_t done = 0; done < block_count;)
+    {
+        blockdev_seg_t seg = {
+            .bs_buf = buf + done * SATA_BLOCK_SIZE,
+            .bs_count = MIN(block_count - done, SATA_MAX_BLOCKS_PER_COMMAND)};
+        ssize_t lba = ((ssize_t)block + (ssize_t)done) * SATA_SECTORS_PER_BLOCK;
+        long ret = ahci_do_operation(disk->port, lba, &seg, 1, write);
+        if (ret)
+        {
+            return ret;
+        }
+        done += seg.bs_count;
+    }
+    return 0;
+}
+
 /**
  * Read the given number of blocks from a block device starting at
  * a given block number into a buffer.
@@ -507,15 +1038,8 @@ void sata_init()
 long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
                      size_t block_count)
 {
-    // Get the ata_disk_t from the blockdev_t
-    ata_disk_t *disk = bdev_to_ata_disk(bdev);
-    
-    // Convert blocks to sectors
-    ssize_t lba = block * SATA_SECTORS_PER_BLOCK;
-    uint16_t sector_count = block_count * SATA_SECTORS_PER_BLOCK;
-    
-    // Call ahci_do_operation with write = 0 for read
-    return ahci_do_operation(disk->port, lba, sector_count, buf, 0);
+    // Split into commands, converting blocks to sectors, with write = 0
+    return sata_rw(bdev, buf, block, block_count, 0);
 }
 
 /**
@@ -533,13 +1057,65 @@ long sata_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
 long sata_write_block(blockdev_t *bdev, const char *buf, blocknum_t block,
                       size_t block_count)
 {
-    // Get the ata_disk_t from the blockdev_t
+    // Split into commands, converting blocks to sectors, with write = 1
+    return sata_rw(bdev, (char *)buf, block, block_count, 1);
+}
+
+/**
+ * Reads or writes consecutive blocks, starting at a given block, to or from
+ * several buffers with a single command; the block device request queue
+ * merges requests into these. Unlike sata_read_block(), this does not split
+ * the transfer: it fails with -EINVAL if it needs more than one command.
+ *
+ * @param  bdev        block device to transfer to or from
+ * @param  segs        the buffers, in the order of the blocks
+ * @param  nsegs       the number of buffers
+ * @param  block       block number to start at
+ * @param  write       whether to write rather than read
+ * @return             0 on success and <0 on error
+ */
+long sata_transfer(blockdev_t *bdev, const blockdev_seg_t *segs, size_t nsegs,
+                   blocknum_t block, long write)
+{
     ata_disk_t *disk = bdev_to_ata_disk(bdev);
-    
-    // Convert blocks to sectors
-    ssize_t lba = block * SATA_SECTORS_PER_BLOCK;
-    uint16_t sector_count = block_count * SATA_SECTORS_PER_BLOCK;
-    
-    // Call ahci_do_operation with write = 1 for write
-    return ahci_do_operation(disk->port, lba, sector_count, (void *)buf, 1);
+    ssize_t lba = (ssize_t)block * SATA_SECTORS_PER_BLOCK;
+    return ahci_do_operation(disk->port, lba, segs, nsegs, (int)write);
+}
+
+/**
+ * Starts the transfer io describes on a free command slot, without waiting
+ * for it; ahci_interrupt_handler() calls io->bi_done once it is done.
+ *
+ * @param  bdev        block device to transfer to or from
+ * @param  io          the transfer
+ * @return             0 if it was started, -EBUSY if every command slot is
+ *                     in use, or -EINVAL if it needs more than one command
+ */
+long sata_submit(blockdev_t *bdev, blockdev_io_t *io)
+{
+    ata_disk_t *disk = bdev_to_ata_disk(bdev);
+    size_t port_index = PORT_INDEX(hba, disk->port);
+    ssize_t lba = (ssize_t)io->bi_loc * SATA_SECTORS_PER_BLOCK;
+
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    long ret = find_cmdslot(disk->port);
+    if (ret >= 0)
+    {
+        outstanding_ios[port_index][ret] = io;
+        ret = ahci_issue(disk->port, ret, lba, io->bi_segs, io->bi_nsegs,
+                         (int)io->bi_write);
+    }
+    intr_setipl(ipl);
+    return ret < 0 ? (ret == -1 ? -EBUSY : ret) : 0;
+}
+
+/**
+ * Writes back the disk's write cache; see ahci_flush().
+ *
+ * @param  bdev        block device to flush
+ * @return             0 on success and <0 on error
+ */
+long sata_flush(blockdev_t *bdev)
+{
+    return ahci_flush(bdev_to_ata_disk(bdev)->port);
 }
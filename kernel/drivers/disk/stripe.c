@@ -0,0 +1,187 @@
+#include <drivers/dev.h>
+#include <drivers/disk/stripe.h>
+#include <errno.h>
+#include <util/debug.h>
+
+/*
+ * A block device made of __STRIPE_DISKS__ disks (RAID 0): its blocks go
+ * round them a chunk of __STRIPE_CHUNK__ at a time, so block b is block
+ * (b / chunk / n) * chunk + b % chunk of disk 1 + (b / chunk) % n. A chunk
+ * of __STRIPE_BLOCKS__ strings the disks together one after another instead.
+ *
+ * A transfer is split into a request to a disk for each piece of a chunk,
+ * which are all queued on the disks before any is waited for, so that each
+ * disk carries out its own share at the same time as the others; the pieces
+ * of one disk are for consecutive blocks of it, and its queue merges them.
+ * The device has no queue of its own to speak of: its transfers are carried
+ * out by their waiters, as many at a time as it has disks.
+ */
+typedef struct stripe
+{
+    blockdev_t sd_bdev;
+    size_t sd_ndisks;
+    blockdev_t *sd_disks[__STRIPE_DISKS__ ? __STRIPE_DISKS__ : 1];
+} stripe_t;
+
+/* Most pieces of a transfer queued on the disks at a time */
+#define STRIPE_MAX_PIECES 16
+
+#define bdev_to_stripe(bd) (CONTAINER_OF((bd), stripe_t, sd_bdev))
+
+static long stripe_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                              size_t block_count);
+static long stripe_write_block(blockdev_t *bdev, const char *buf,
+                               blocknum_t loc, size_t block_count);
+static long stripe_transfer(blockdev_t *bdev, const blockdev_seg_t *segs,
+                            size_t nsegs, blocknum_t loc, long write);
+static long stripe_flush(blockdev_t *bdev);
+
+static blockdev_ops_t stripe_ops = {
+    .read_block = stripe_read_block,
+    .write_block = stripe_write_block,
+    .transfer = stripe_transfer,
+    .flush = stripe_flush,
+};
+
+static stripe_t stripe;
+
+/* Registers the striped device, as block device STRIPE_MAJOR:0, if Config.mk
+ * asks for one and its disks are there. */
+void stripe_init()
+{
+    if (!__STRIPE_DISKS__)
+    {
+        return;
+    }
+    for (long i = 0; i < __STRIPE_DISKS__; i++)
+    {
+        stripe.sd_disks[i] = blockdev_lookup(MKDEVID(DISK_MAJOR, 1 + i));
+        if (!stripe.sd_disks[i])
+        {
+            dbg(DBG_DISK, "no disk %ld, nothing to stripe\n", 1 + i);
+            return;
+        }
+    }
+    stripe.sd_ndisks = __STRIPE_DISKS__;
+
+    stripe.sd_bdev.bd_id = MKDEVID(STRIPE_MAJOR, 0);
+    stripe.sd_bdev.bd_ops = &stripe_ops;
+    stripe.sd_bdev.bd_depth = stripe.sd_ndisks;
+    stripe.sd_bdev.bd_nblocks =
+        stripe.sd_ndisks * (__STRIPE_BLOCKS__ / __STRIPE_CHUNK__) *
+        __STRIPE_CHUNK__;
+    list_link_init(&stripe.sd_bdev.bd_link);
+    long ret = blockdev_register(&stripe.sd_bdev);
+    KASSERT(!ret);
+    dbg(DBG_DISK, "striped device of %lu blocks over %lu disks\n",
+        stripe.sd_bdev.bd_nblocks, stripe.sd_ndisks);
+}
+
+/*
+ * Waits for the n pieces queued on sd's disks, once each disk has had its
+ * share started, and returns the first error of theirs, or 0.
+ */
+static long stripe_wait(stripe_t *sd, blockdev_request_t *reqs,
+                        blockdev_t **disks, size_t n)
+{
+    for (size_t d = 0; d < sd->sd_ndisks; d++)
+    {
+        blockdev_unplug(sd->sd_disks[d]);
+    }
+    long ret = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        long err = blockdev_wait(disks[i], &reqs[i]);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
+
+/*
+ * Carries out a transfer to or from sd's blocks [loc, loc + the blocks of
+ * segs), STRIPE_MAX_PIECES pieces at a time.
+ */
+static long stripe_rw(stripe_t *sd, const blockdev_seg_t *segs, size_t nsegs,
+                      blocknum_t loc, long write)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < nsegs; i++)
+    {
+        count += segs[i].bs_count;
+    }
+    if (count > sd->sd_bdev.bd_nblocks ||
+        loc > sd->sd_bdev.bd_nblocks - count)
+    {
+        return -EINVAL;
+    }
+
+    blockdev_request_t reqs[STRIPE_MAX_PIECES];
+    blockdev_t *disks[STRIPE_MAX_PIECES];
+    size_t n = 0;
+    long ret = 0;
+    size_t b = loc;
+    for (size_t i = 0; !ret && i < nsegs; i++)
+    {
+        char *buf = segs[i].bs_buf;
+        size_t left = segs[i].bs_count;
+        while (!ret && left)
+        {
+            size_t chunk = b / __STRIPE_CHUNK__;
+            size_t off = b % __STRIPE_CHUNK__;
+            size_t piece = MIN(left, __STRIPE_CHUNK__ - off);
+            disks[n] = sd->sd_disks[chunk % sd->sd_ndisks];
+            reqs[n] = (blockdev_request_t){
+                .br_buf = buf,
+                .br_loc = (blocknum_t)(chunk / sd->sd_ndisks *
+                                           __STRIPE_CHUNK__ +
+                                       off),
+                .br_count = piece,
+                .br_write = write,
+                .br_callback = NULL};
+            blockdev_submit(disks[n], &reqs[n]);
+            if (++n == STRIPE_MAX_PIECES)
+            {
+                ret = stripe_wait(sd, reqs, disks, n);
+                n = 0;
+            }
+            buf += piece * BLOCK_SIZE;
+            left -= piece;
+            b += piece;
+        }
+    }
+    long err = stripe_wait(sd, reqs, disks, n);
+    return ret ? ret : err;
+}
+
+static long stripe_read_block(blockdev_t *bdev, char *buf, blocknum_t loc,
+                              size_t block_count)
+{
+    blockdev_seg_t seg = {.bs_buf = buf, .bs_count = block_count};
+    return stripe_rw(bdev_to_stripe(bdev), &seg, 1, loc, 0);
+}
+
+static long stripe_write_block(blockdev_t *bdev, const char *buf,
+                               blocknum_t loc, size_t block_count)
+{
+    blockdev_seg_t seg = {.bs_buf = (char *)buf, .bs_count = block_count};
+    return stripe_rw(bdev_to_stripe(bdev), &seg, 1, loc, 1);
+}
+
+static long stripe_transfer(blockdev_t *bdev, const blockdev_seg_t *segs,
+                            size_t nsegs, blocknum_t loc, long write)
+{
+    return stripe_rw(bdev_to_stripe(bdev), segs, nsegs, loc, write);
+}
+
+/* Flushes every disk, and returns the first error of theirs, or 0. */
+static long stripe_flush(blockdev_t *bdev)
+{
+    stripe_t *sd = bdev_to_stripe(bdev);
+    long ret = 0;
+    for (size_t d = 0; d < sd->sd_ndisks; d++)
+    {
+        long err = blockdev_barrier(sd->sd_disks[d]);
+        ret = ret ? ret : err;
+    }
+    return ret;
+}
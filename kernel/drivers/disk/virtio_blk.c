@@ -0,0 +1,868 @@
+#include <drivers/blockdev.h>
+#include <drivers/disk/virtio_blk.h>
+#include <drivers/pcie.h>
+#include <errno.h>
+#include <main/apic.h>
+#include <main/softirq.h>
+#include <mm/kmalloc.h>
+#include <mm/page.h>
+#include <mm/pagetable.h>
+#include <util/debug.h>
+#include <util/string.h>
+
+/*
+ * The virtio-blk paravirtual disk, see drivers/disk/virtio.h. Where the
+ * emulated AHCI HBA of sata.c costs the hypervisor several register accesses
+ * for each command, and takes one command at a time, a virtio-blk request is
+ * a chain of descriptors in memory that the device reads by itself once it is
+ * notified, with a single register write that any number of requests can
+ * share, and a disk takes as many requests at once as its virtqueues have
+ * room for.
+ *
+ * A disk that offers VIRTIO_BLK_F_MQ gets up to one request virtqueue per
+ * core. Each core submits to queue (its APIC ID mod their number), so cores
+ * do not contend for a queue, and queue q interrupts with the MSI-X vector
+ * INTR_VIRTIO_BLK + q, sent to the cores that submit to it. The interrupt
+ * handler only notes the queue; virtio_blk_softirq() completes the requests
+ * the device is done with.
+ *
+ * Notifications are batched: virtio_blk_submit() only makes its request
+ * available, and virtio_blk_commit(), which the request queue calls once it
+ * has started what it can, notifies the device of all of them at once. With
+ * VIRTIO_RING_F_EVENT_IDX not even that is done while the device is still
+ * working through the queue, see vblk_notify().
+ */
+
+#define VIRTIO_BLK_PCI_CLASS 0x1    /* mass storage device */
+#define VIRTIO_BLK_PCI_SUBCLASS 0x0 /* SCSI, as virtio-blk reports itself */
+
+#define VIRTIO_BLK_SECTORS_PER_BLOCK (BLOCK_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+
+/* The features the driver takes, if the device offers them */
+#define VIRTIO_BLK_FEATURES                                                 \
+    ((1UL << VIRTIO_BLK_F_SIZE_MAX) | (1UL << VIRTIO_BLK_F_SEG_MAX) |       \
+     (1UL << VIRTIO_BLK_F_RO) | (1UL << VIRTIO_BLK_F_FLUSH) |               \
+     (1UL << VIRTIO_BLK_F_MQ) | (1UL << VIRTIO_RING_F_EVENT_IDX) |          \
+     (1UL << VIRTIO_F_VERSION_1))
+
+/* Times the device status is checked on after a reset before the device is
+ * given up on. */
+#define VIRTIO_RESET_SPINS 1000000
+
+#define VQ_ALIGN(x, align) (((x) + (align)-1) & ~((size_t)(align)-1))
+
+#define bdev_to_vblk_disk(bd) (CONTAINER_OF((bd), virtio_blk_disk_t, vd_bdev))
+#define VBLK_HAS(disk, feature) (((disk)->vd_features >> (feature)) & 1)
+
+static virtio_blk_disk_t *vblk_disks[VIRTIO_BLK_MAX_DISKS];
+static size_t vblk_ndisks;
+
+/* The queue indices whose interrupts have come in, and whose requests
+ * virtio_blk_softirq() has yet to complete on every disk, as a bitmap. */
+static uint32_t vblk_reap_pending;
+
+long virtio_blk_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
+                           size_t block_count);
+long virtio_blk_write_block(blockdev_t *bdev, const char *buf,
+                            blocknum_t block, size_t block_count);
+long virtio_blk_transfer(blockdev_t *bdev, const blockdev_seg_t *segs,
+                         size_t nsegs, blocknum_t block, long write);
+long virtio_blk_submit(blockdev_t *bdev, blockdev_io_t *io);
+void virtio_blk_commit(blockdev_t *bdev);
+long virtio_blk_flush(blockdev_t *bdev);
+
+static blockdev_ops_t virtio_blk_ops = {
+    .read_block = virtio_blk_read_block,
+    .write_block = virtio_blk_write_block,
+    .transfer = virtio_blk_transfer,
+    .submit = virtio_blk_submit,
+    .commit = virtio_blk_commit,
+    .flush = virtio_blk_flush,
+};
+
+/* The physical address of memory from page_alloc */
+static inline uint64_t vblk_phys(void *addr)
+{
+    return (uintptr_t)addr - PHYS_OFFSET;
+}
+
+/* The queue the current core submits to, the one whose interrupt it takes.
+ * Called at IPL_HIGH. */
+static inline virtio_blk_queue_t *vblk_queue(virtio_blk_disk_t *disk)
+{
+    return &disk->vd_queues[(size_t)apic_current_id() % disk->vd_nqueues];
+}
+
+/**
+ * vblk_desc_take - Takes a descriptor off vq's free list for a buffer, and
+ * links it after last, if last is not -1. Called with vq_lock held, while
+ * vq_nfree is not 0.
+ *
+ * @param  vq          the queue
+ * @param  last        the last descriptor of the chain being made, or -1
+ * @param  addr        the physical address of the buffer
+ * @param  len         its length in bytes
+ * @param  flags       VIRTQ_DESC_F_WRITE if the device is to write it
+ * @return             the descriptor
+ */
+static long vblk_desc_take(virtio_blk_queue_t *vq, long last, uint64_t addr,
+                           uint32_t len, uint16_t flags)
+{
+    KASSERT(vq->vq_nfree);
+    uint16_t index = vq->vq_free_head;
+    virtq_desc_t *desc = &vq->vq_desc[index];
+    vq->vq_free_head = desc->next;
+    vq->vq_nfree--;
+    desc->addr = addr;
+    desc->len = len;
+    desc->flags = flags;
+    if (last >= 0)
+    {
+        vq->vq_desc[last].next = index;
+        vq->vq_desc[last].flags |= VIRTQ_DESC_F_NEXT;
+    }
+    return index;
+}
+
+/* Puts the chain headed by head back on vq's free list. Called with vq_lock
+ * held. */
+static void vblk_chain_free(virtio_blk_queue_t *vq, uint16_t head)
+{
+    uint16_t last = head;
+    vq->vq_nfree++;
+    while (vq->vq_desc[last].flags & VIRTQ_DESC_F_NEXT)
+    {
+        last = vq->vq_desc[last].next;
+        vq->vq_nfree++;
+    }
+    vq->vq_desc[last].next = vq->vq_free_head;
+    vq->vq_free_head = head;
+}
+
+/**
+ * vblk_issue - Makes the chain of a request in a free slot of a queue and
+ * makes it available to the device, without notifying the device; see
+ * vblk_notify(). The data buffers are looked up page by page, so they need
+ * not be physically contiguous: pieces that are, within a buffer or across
+ * two, share a descriptor of up to vd_size_max bytes. Called with vq_lock
+ * held.
+ *
+ * @param  disk        the disk
+ * @param  vq          one of its queues
+ * @param  type        VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT or VIRTIO_BLK_T_FLUSH
+ * @param  block       the block to start at
+ * @param  segs        the buffers, in the order of the blocks
+ * @param  nsegs       the number of buffers, 0 for a flush
+ * @param  io          the transfer the request carries out, or NULL if the
+ *                     caller waits for the request
+ * @param  reqp        set to the request
+ * @return             0 on success, -EBUSY if the queue has no free slot or
+ *                     too few free descriptors right now, or -EINVAL if the
+ *                     buffers are in more than vd_seg_max pieces
+ */
+static long vblk_issue(virtio_blk_disk_t *disk, virtio_blk_queue_t *vq,
+                       uint32_t type, blocknum_t block,
+                       const blockdev_seg_t *segs, size_t nsegs,
+                       blockdev_io_t *io, virtio_blk_req_t **reqp)
+{
+    /* The header and the status, at least */
+    if (list_empty(&vq->vq_idle) || vq->vq_nfree < 2)
+    {
+        return -EBUSY;
+    }
+    virtio_blk_req_t *req = list_head(&vq->vq_idle, virtio_blk_req_t, vr_link);
+    virtio_blk_dma_t *dma = req->vr_dma;
+    dma->vm_hdr.type = type;
+    dma->vm_hdr.reserved = 0;
+    dma->vm_hdr.sector = (uint64_t)block * VIRTIO_BLK_SECTORS_PER_BLOCK;
+    dma->vm_status = VIRTIO_BLK_S_IOERR;
+
+    long head = vblk_desc_take(vq, -1, vblk_phys(&dma->vm_hdr),
+                               sizeof(dma->vm_hdr), 0);
+    long last = head;
+    uint16_t flags = type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+    size_t npieces = 0;
+    long ret = 0;
+    for (size_t i = 0; i < nsegs && !ret; i++)
+    {
+        uintptr_t addr = (uintptr_t)segs[i].bs_buf;
+        uintptr_t end = addr + segs[i].bs_count * BLOCK_SIZE;
+        while (addr < end)
+        {
+            size_t len = MIN(end, (uintptr_t)PAGE_ALIGN_DOWN(addr) + PAGE_SIZE) -
+                         addr;
+            uint64_t phys = pt_virt_to_phys(addr);
+            addr += len;
+            virtq_desc_t *prev = &vq->vq_desc[last];
+            if (npieces && prev->addr + prev->len == phys &&
+                prev->len + len <= disk->vd_size_max)
+            {
+                prev->len += (uint32_t)len;
+                continue;
+            }
+            if (npieces == disk->vd_seg_max)
+            {
+                ret = -EINVAL;
+                break;
+            }
+            /* Leaving one for the status */
+            if (vq->vq_nfree < 2)
+            {
+                ret = -EBUSY;
+                break;
+            }
+            last = vblk_desc_take(vq, last, phys, (uint32_t)len, flags);
+            npieces++;
+        }
+    }
+    if (ret)
+    {
+        vblk_chain_free(vq, (uint16_t)head);
+        return ret;
+    }
+    vblk_desc_take(vq, last, vblk_phys(&dma->vm_status),
+                   sizeof(dma->vm_status), VIRTQ_DESC_F_WRITE);
+
+    list_remove(&req->vr_link);
+    req->vr_head = (uint16_t)head;
+    req->vr_io = io;
+    req->vr_done = 0;
+    vq->vq_heads[head] = req;
+
+    volatile virtq_avail_t *avail = vq->vq_avail;
+    avail->ring[avail->idx & (vq->vq_size - 1)] = (uint16_t)head;
+    /* The device must not see the new index before the chain and entry */
+    __sync_synchronize();
+    avail->idx++;
+    *reqp = req;
+    return 0;
+}
+
+/**
+ * vblk_notify - Tells the device of the requests made available on a queue
+ * since it was last told, unless it has said it does not need to be: with
+ * VIRTIO_RING_F_EVENT_IDX, unless one of them is past the avail_event after
+ * which it last asked to be told, so that a device still working through the
+ * queue is not told again; and otherwise unless it has
+ * VIRTQ_USED_F_NO_NOTIFY set. Called with vq_lock held.
+ *
+ * @param  disk        the disk
+ * @param  vq          one of its queues
+ */
+static void vblk_notify(virtio_blk_disk_t *disk, virtio_blk_queue_t *vq)
+{
+    uint16_t new_idx = vq->vq_avail->idx;
+    uint16_t old = vq->vq_notified;
+    if (new_idx == old)
+    {
+        return;
+    }
+    vq->vq_notified = new_idx;
+    /* What the device asked for is only read once it can see the new index,
+     * or it could have stopped looking in between */
+    __sync_synchronize();
+    long needed = VBLK_HAS(disk, VIRTIO_RING_F_EVENT_IDX)
+                      ? virtq_need_event(
+                            VIRTQ_AVAIL_EVENT(vq->vq_used, vq->vq_size),
+                            new_idx, old)
+                      : !(vq->vq_used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if (needed)
+    {
+        *vq->vq_notify = vq->vq_index;
+    }
+}
+
+/**
+ * vblk_reap - Completes the requests the device is done with on a queue:
+ * wakes up the threads waiting for theirs, and puts back the slots of those
+ * started by virtio_blk_submit(), whose transfers it puts in done, for their
+ * bi_done once vq_lock, which is held, is dropped.
+ *
+ * @param  disk        the disk
+ * @param  vq          one of its queues
+ * @param  done        room for VIRTIO_BLK_QUEUE_DEPTH transfers
+ * @return             the number of transfers put in done
+ */
+static size_t vblk_reap(virtio_blk_disk_t *disk, virtio_blk_queue_t *vq,
+                        blockdev_io_t **done)
+{
+    size_t ndone = 0;
+    long reaped = 0;
+    while (1)
+    {
+        while (vq->vq_last_used != vq->vq_used->idx)
+        {
+            /* The entry is only read once the index says it is there */
+            __sync_synchronize();
+            uint32_t id =
+                vq->vq_used->ring[vq->vq_last_used & (vq->vq_size - 1)].id;
+            vq->vq_last_used++;
+            KASSERT(id < vq->vq_size && vq->vq_heads[id]);
+            virtio_blk_req_t *req = vq->vq_heads[id];
+            vq->vq_heads[id] = NULL;
+            vblk_chain_free(vq, req->vr_head);
+
+            uint8_t status = req->vr_dma->vm_status;
+            req->vr_ret = status == VIRTIO_BLK_S_OK       ? 0
+                          : status == VIRTIO_BLK_S_UNSUPP ? -ENOTSUP
+                                                          : -EIO;
+            if (req->vr_io)
+            {
+                req->vr_io->bi_ret = req->vr_ret;
+                done[ndone++] = req->vr_io;
+                list_insert_head(&vq->vq_idle, &req->vr_link);
+            }
+            else
+            {
+                req->vr_done = 1;
+                sched_broadcast_on(&req->vr_waitq);
+            }
+            reaped = 1;
+        }
+        if (!VBLK_HAS(disk, VIRTIO_RING_F_EVENT_IDX))
+        {
+            break;
+        }
+        /* Ask for an interrupt for the next request to be done, then look
+         * again, in case it was done before the device could see that */
+        VIRTQ_USED_EVENT(vq->vq_avail, vq->vq_size) = vq->vq_last_used;
+        __sync_synchronize();
+        if (vq->vq_last_used == vq->vq_used->idx)
+        {
+            break;
+        }
+    }
+    if (reaped)
+    {
+        sched_broadcast_on(&vq->vq_slotq);
+    }
+    return ndone;
+}
+
+/* virtio_blk_softirq - Completes the requests on the queues whose interrupts
+ * came in, on every disk. */
+static void virtio_blk_softirq()
+{
+    uint32_t queues = __sync_fetch_and_and(&vblk_reap_pending, 0);
+    while (queues)
+    {
+        size_t q = __builtin_ctz(queues);
+        queues &= queues - 1;
+        for (size_t i = 0; i < vblk_ndisks; i++)
+        {
+            virtio_blk_disk_t *disk = vblk_disks[i];
+            if (q >= disk->vd_nqueues)
+            {
+                continue;
+            }
+            virtio_blk_queue_t *vq = &disk->vd_queues[q];
+            blockdev_io_t *done[VIRTIO_BLK_QUEUE_DEPTH];
+            uint8_t ipl = intr_setipl(IPL_HIGH);
+            spinlock_lock(&vq->vq_lock);
+            size_t ndone = vblk_reap(disk, vq, done);
+            spinlock_unlock(&vq->vq_lock);
+            intr_setipl(ipl);
+
+            /* Which may start more transfers, on this core's queue */
+            for (size_t j = 0; j < ndone; j++)
+            {
+                done[j]->bi_done(done[j]);
+            }
+        }
+    }
+}
+
+/* virtio_blk_interrupt_handler - Notes that a queue has requests done, for
+ * virtio_blk_softirq(). With MSI-X there is nothing to acknowledge. */
+static long virtio_blk_interrupt_handler(regs_t *regs)
+{
+    __sync_fetch_and_or(&vblk_reap_pending,
+                        1U << (regs->r_intr - INTR_VIRTIO_BLK));
+    softirq_raise(SOFTIRQ_VIRTIO_BLK);
+    return 0;
+}
+
+/**
+ * vblk_do - Carries out a request on the current core's queue, and waits for
+ * it: for a slot and descriptors to be free, if need be, then for the
+ * request to be done.
+ *
+ * @param  disk        the disk
+ * @param  type        VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT or VIRTIO_BLK_T_FLUSH
+ * @param  block       the block to start at
+ * @param  segs        the buffers, see vblk_issue()
+ * @param  nsegs       the number of buffers
+ * @return             0 on success and <0 on error
+ */
+static long vblk_do(virtio_blk_disk_t *disk, uint32_t type, blocknum_t block,
+                    const blockdev_seg_t *segs, size_t nsegs)
+{
+    if (type == VIRTIO_BLK_T_OUT && VBLK_HAS(disk, VIRTIO_BLK_F_RO))
+    {
+        return -EROFS;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    virtio_blk_queue_t *vq = vblk_queue(disk);
+    spinlock_lock(&vq->vq_lock);
+    virtio_blk_req_t *req;
+    long ret;
+    while ((ret = vblk_issue(disk, vq, type, block, segs, nsegs, NULL,
+                             &req)) == -EBUSY)
+    {
+        sched_sleep_on_locked(&vq->vq_slotq, &vq->vq_lock);
+        spinlock_lock(&vq->vq_lock);
+    }
+    if (!ret)
+    {
+        vblk_notify(disk, vq);
+        while (!req->vr_done)
+        {
+            sched_sleep_on_locked(&req->vr_waitq, &vq->vq_lock);
+            spinlock_lock(&vq->vq_lock);
+        }
+        ret = req->vr_ret;
+        list_insert_head(&vq->vq_idle, &req->vr_link);
+        sched_broadcast_on(&vq->vq_slotq);
+    }
+    spinlock_unlock(&vq->vq_lock);
+    intr_setipl(ipl);
+    return ret;
+}
+
+/*
+ * Reads or writes block_count blocks at block with as many requests as it
+ * takes, each of up to vd_seg_max blocks, which always fit in one.
+ */
+static long vblk_rw(blockdev_t *bdev, char *buf, blocknum_t block,
+                    size_t block_count, uint32_t type)
+{
+    virtio_blk_disk_t *disk = bdev_to_vblk_disk(bdev);
+    for (size_t done = 0; done < block_count;)
+    {
+        blockdev_seg_t seg = {
+            .bs_buf = buf + done * BLOCK_SIZE,
+            .bs_count = MIN(block_count - done, disk->vd_seg_max)};
+        long ret = vblk_do(disk, type, (blocknum_t)(block + done), &seg, 1);
+        if (ret)
+        {
+            return ret;
+        }
+        done += seg.bs_count;
+    }
+    return 0;
+}
+
+long virtio_blk_read_block(blockdev_t *bdev, char *buf, blocknum_t block,
+                           size_t block_count)
+{
+    return vblk_rw(bdev, buf, block, block_count, VIRTIO_BLK_T_IN);
+}
+
+long virtio_blk_write_block(blockdev_t *bdev, const char *buf,
+                            blocknum_t block, size_t block_count)
+{
+    return vblk_rw(bdev, (char *)buf, block, block_count, VIRTIO_BLK_T_OUT);
+}
+
+/**
+ * Reads or writes consecutive blocks, starting at a given block, to or from
+ * several buffers with a single request; see vblk_issue(). It fails with
+ * -EINVAL if they are in more pieces than a request may have.
+ */
+long virtio_blk_transfer(blockdev_t *bdev, const blockdev_seg_t *segs,
+                         size_t nsegs, blocknum_t block, long write)
+{
+    return vblk_do(bdev_to_vblk_disk(bdev),
+                   write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, block, segs,
+                   nsegs);
+}
+
+/**
+ * Starts the transfer io describes on the current core's queue, without
+ * waiting for it, or for the device to be told of it: see
+ * virtio_blk_commit(). virtio_blk_softirq() calls io->bi_done once it is
+ * done.
+ *
+ * @param  bdev        block device to transfer to or from
+ * @param  io          the transfer
+ * @return             0 if it was started, -EBUSY if the queue has no room
+ *                     for it right now, -EINVAL if it is in more pieces than
+ *                     a request may have, or -EROFS
+ */
+long virtio_blk_submit(blockdev_t *bdev, blockdev_io_t *io)
+{
+    virtio_blk_disk_t *disk = bdev_to_vblk_disk(bdev);
+    if (io->bi_write && VBLK_HAS(disk, VIRTIO_BLK_F_RO))
+    {
+        return -EROFS;
+    }
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    virtio_blk_queue_t *vq = vblk_queue(disk);
+    spinlock_lock(&vq->vq_lock);
+    virtio_blk_req_t *req;
+    long ret = vblk_issue(disk, vq,
+                          io->bi_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                          io->bi_loc, io->bi_segs, io->bi_nsegs, io, &req);
+    spinlock_unlock(&vq->vq_lock);
+    intr_setipl(ipl);
+    return ret;
+}
+
+/**
+ * Tells the device of the transfers virtio_blk_submit() has started, on
+ * whichever queues they went on; see vblk_notify().
+ *
+ * @param  bdev        block device
+ */
+void virtio_blk_commit(blockdev_t *bdev)
+{
+    virtio_blk_disk_t *disk = bdev_to_vblk_disk(bdev);
+    uint8_t ipl = intr_setipl(IPL_HIGH);
+    for (size_t i = 0; i < disk->vd_nqueues; i++)
+    {
+        virtio_blk_queue_t *vq = &disk->vd_queues[i];
+        spinlock_lock(&vq->vq_lock);
+        vblk_notify(disk, vq);
+        spinlock_unlock(&vq->vq_lock);
+    }
+    intr_setipl(ipl);
+}
+
+/**
+ * Has the device write back its cache, if it has one it says can be flushed,
+ * so that every write done before is durable.
+ *
+ * @param  bdev        block device to flush
+ * @return             0 on success and <0 on error
+ */
+long virtio_blk_flush(blockdev_t *bdev)
+{
+    virtio_blk_disk_t *disk = bdev_to_vblk_disk(bdev);
+    if (!VBLK_HAS(disk, VIRTIO_BLK_F_FLUSH))
+    {
+        return 0;
+    }
+    return vblk_do(disk, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+}
+
+/* The cores that submit to queue q of nqueues, as a mask of APIC_CORE()
+ * bits. Only the boot core submits without SMP. */
+static uint8_t vblk_queue_cores(size_t q, size_t nqueues)
+{
+    uint8_t cores = 0;
+#ifdef __SMP__
+    for (long id = 0; id <= apic_max_id(); id++)
+    {
+        if (apic_processor_enabled(id) && (size_t)id % nqueues == q)
+        {
+            cores |= APIC_CORE(id);
+        }
+    }
+#endif
+    return cores ? cores : APIC_CORE(apic_current_id());
+}
+
+/* The cores there are to submit, see vblk_queue_cores() */
+static size_t vblk_ncores()
+{
+#ifdef __SMP__
+    return (size_t)apic_max_id() + 1;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * vblk_setup_queue - Sets up a disk's request virtqueue q, with up to
+ * VIRTIO_BLK_MAX_QUEUE_SIZE descriptors, and MSI-X vector q.
+ *
+ * @param  disk        the disk, whose vd_queues are allocated
+ * @param  common      its common configuration structure
+ * @param  notify      its notification structure
+ * @param  notify_mult its notify_off_multiplier
+ * @param  q           the queue
+ * @return             0 on success, or -ENODEV if the device has no such
+ *                     queue, -ENOMEM, or -EBUSY if it could not give the
+ *                     queue its vector
+ */
+static long vblk_setup_queue(virtio_blk_disk_t *disk,
+                             volatile virtio_pci_common_cfg_t *common,
+                             uintptr_t notify, uint32_t notify_mult,
+                             uint16_t q)
+{
+    common->queue_select = q;
+    size_t size = MIN(common->queue_size, VIRTIO_BLK_MAX_QUEUE_SIZE);
+    /* Room for a request with one piece of data, at least */
+    if (size < 4)
+    {
+        return -ENODEV;
+    }
+    size = 1UL << (63 - __builtin_clzl(size));
+
+    size_t avail_off = sizeof(virtq_desc_t) * size;
+    size_t used_off = VQ_ALIGN(avail_off + sizeof(virtq_avail_t) +
+                                   sizeof(uint16_t) * (size + 1),
+                               4);
+    size_t dma_off = VQ_ALIGN(used_off + sizeof(virtq_used_t) +
+                                  sizeof(virtq_used_elem_t) * size +
+                                  sizeof(uint16_t),
+                              sizeof(virtio_blk_dma_t));
+    size_t npages =
+        VQ_ALIGN(dma_off + sizeof(virtio_blk_dma_t) * VIRTIO_BLK_QUEUE_DEPTH,
+                 PAGE_SIZE) /
+        PAGE_SIZE;
+    char *mem = page_alloc_n(npages);
+    if (!mem)
+    {
+        return -ENOMEM;
+    }
+    memset(mem, 0, npages * PAGE_SIZE);
+
+    virtio_blk_queue_t *vq = &disk->vd_queues[q];
+    spinlock_init(&vq->vq_lock);
+    vq->vq_index = q;
+    vq->vq_size = (uint16_t)size;
+    vq->vq_desc = (virtq_desc_t *)mem;
+    vq->vq_avail = (virtq_avail_t *)(mem + avail_off);
+    vq->vq_used = (virtq_used_t *)(mem + used_off);
+    for (size_t i = 0; i < size; i++)
+    {
+        vq->vq_desc[i].next = (uint16_t)(i + 1);
+    }
+    vq->vq_free_head = 0;
+    vq->vq_nfree = (uint16_t)size;
+    vq->vq_last_used = 0;
+    vq->vq_notified = 0;
+    list_init(&vq->vq_idle);
+    sched_queue_init(&vq->vq_slotq);
+    virtio_blk_dma_t *dma = (virtio_blk_dma_t *)(mem + dma_off);
+    for (size_t i = 0; i < VIRTIO_BLK_QUEUE_DEPTH; i++)
+    {
+        virtio_blk_req_t *req = &vq->vq_reqs[i];
+        req->vr_dma = &dma[i];
+        req->vr_io = NULL;
+        sched_queue_init(&req->vr_waitq);
+        list_link_init(&req->vr_link);
+        list_insert_tail(&vq->vq_idle, &req->vr_link);
+    }
+    memset(vq->vq_heads, 0, sizeof(vq->vq_heads));
+
+    common->queue_size = (uint16_t)size;
+    common->queue_msix_vector = q;
+    if (common->queue_msix_vector != q)
+    {
+        page_free_n(mem, npages);
+        return -EBUSY;
+    }
+    uint64_t phys = vblk_phys(mem);
+    common->queue_desc_lo = (uint32_t)phys;
+    common->queue_desc_hi = (uint32_t)(phys >> 32);
+    common->queue_driver_lo = (uint32_t)(phys + avail_off);
+    common->queue_driver_hi = (uint32_t)((phys + avail_off) >> 32);
+    common->queue_device_lo = (uint32_t)(phys + used_off);
+    common->queue_device_hi = (uint32_t)((phys + used_off) >> 32);
+    vq->vq_notify = (volatile uint16_t *)(notify + (uintptr_t)notify_mult *
+                                                       common->queue_notify_off);
+    common->queue_enable = 1;
+    return 0;
+}
+
+/**
+ * vblk_probe - Sets up a virtio-blk device found by virtio_blk_init(), as in
+ * 3.1.1 of the spec, and registers it as the next VIRTIO_BLK_MAJOR block
+ * device. Devices without the modern interface, or without MSI-X, are left
+ * alone.
+ *
+ * @param  dev         the device
+ */
+static void vblk_probe(pcie_device_t *dev)
+{
+    if (vblk_ndisks == VIRTIO_BLK_MAX_DISKS)
+    {
+        dbg(DBG_DISK, "virtio-blk: more than %d disks\n", VIRTIO_BLK_MAX_DISKS);
+        return;
+    }
+    dev->standard.command |= PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER;
+
+    /* Find the device's structures: the first of each type is the one to
+     * use, see 4.1.4. */
+    volatile virtio_pci_common_cfg_t *common = NULL;
+    volatile virtio_blk_config_t *config = NULL;
+    uintptr_t notify = 0;
+    uint32_t notify_mult = 0;
+    pci_capability_t *cap = NULL;
+    while ((cap = pcie_capability(dev, PCI_VENDOR_CAPABILITY_ID, cap)))
+    {
+        virtio_pci_cap_t *vcap = (virtio_pci_cap_t *)cap;
+        if (vcap->cfg_type == VIRTIO_PCI_CAP_COMMON_CFG && !common)
+        {
+            common = (virtio_pci_common_cfg_t *)pcie_map_bar(
+                dev, vcap->bar, vcap->offset, vcap->length);
+        }
+        else if (vcap->cfg_type == VIRTIO_PCI_CAP_NOTIFY_CFG && !notify)
+        {
+            notify = pcie_map_bar(dev, vcap->bar, vcap->offset, vcap->length);
+            notify_mult =
+                ((virtio_pci_notify_cap_t *)vcap)->notify_off_multiplier;
+        }
+        else if (vcap->cfg_type == VIRTIO_PCI_CAP_DEVICE_CFG && !config)
+        {
+            config = (virtio_blk_config_t *)pcie_map_bar(
+                dev, vcap->bar, vcap->offset, vcap->length);
+        }
+    }
+    long nvectors = common && notify && config ? pcie_msix_enable(dev) : 0;
+    if (nvectors <= 0)
+    {
+        dbg(DBG_DISK, "virtio-blk: no modern interface or MSI-X, skipped\n");
+        return;
+    }
+
+    /* Reset it, and say it has a driver */
+    common->device_status = 0;
+    for (size_t i = 0; common->device_status && i < VIRTIO_RESET_SPINS; i++)
+        ;
+    if (common->device_status)
+    {
+        dbg(DBG_DISK, "virtio-blk: reset timed out\n");
+        return;
+    }
+    common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    common->device_status |= VIRTIO_STATUS_DRIVER;
+
+    common->device_feature_select = 0;
+    uint64_t features = common->device_feature;
+    common->device_feature_select = 1;
+    features |= (uint64_t)common->device_feature << 32;
+    features &= VIRTIO_BLK_FEATURES;
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t)features;
+    common->driver_feature_select = 1;
+    common->driver_feature = (uint32_t)(features >> 32);
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!((features >> VIRTIO_F_VERSION_1) & 1) ||
+        !(common->device_status & VIRTIO_STATUS_FEATURES_OK))
+    {
+        dbg(DBG_DISK, "virtio-blk: features 0x%lx not taken\n", features);
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        return;
+    }
+
+    /* Read the configuration until it has not changed meanwhile, see
+     * 4.1.4.3.1 */
+    uint8_t generation;
+    uint64_t capacity;
+    uint32_t seg_max, size_max;
+    uint16_t num_queues;
+    do
+    {
+        generation = common->config_generation;
+        capacity = config->capacity;
+        seg_max = config->seg_max;
+        size_max = config->size_max;
+        num_queues = config->num_queues;
+    } while (generation != common->config_generation);
+
+    size_t nqueues = (features >> VIRTIO_BLK_F_MQ) & 1 ? num_queues : 1;
+    nqueues = MIN(nqueues, common->num_queues);
+    nqueues = MIN(nqueues, (size_t)nvectors);
+    nqueues = MIN(nqueues, vblk_ncores());
+    nqueues = MIN(nqueues, VIRTIO_BLK_MAX_QUEUES);
+    nqueues = nqueues ? nqueues : 1;
+    if ((features >> VIRTIO_BLK_F_SIZE_MAX) & 1 && size_max &&
+        size_max < BLOCK_SIZE)
+    {
+        dbg(DBG_DISK, "virtio-blk: segments of %u bytes, skipped\n", size_max);
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        return;
+    }
+
+    virtio_blk_disk_t *disk = kmalloc(sizeof(virtio_blk_disk_t));
+    virtio_blk_queue_t *queues = kmalloc(sizeof(virtio_blk_queue_t) * nqueues);
+    KASSERT(disk && queues);
+    memset(disk, 0, sizeof(virtio_blk_disk_t));
+    disk->vd_features = features;
+    disk->vd_queues = queues;
+    disk->vd_size_max =
+        (features >> VIRTIO_BLK_F_SIZE_MAX) & 1 && size_max ? size_max
+                                                             : (uint32_t)-1;
+
+    /* Each queue's interrupt; the device's own, for configuration changes,
+     * is not used */
+    common->msix_config = VIRTIO_MSI_NO_VECTOR;
+    for (size_t q = 0; q < nqueues; q++)
+    {
+        pcie_msix_set(dev, q, (uint8_t)(INTR_VIRTIO_BLK + q),
+                      vblk_queue_cores(q, nqueues));
+    }
+
+    /* However many queues could be set up are used */
+    size_t min_size = VIRTIO_BLK_MAX_QUEUE_SIZE;
+    for (disk->vd_nqueues = 0; disk->vd_nqueues < nqueues; disk->vd_nqueues++)
+    {
+        if (vblk_setup_queue(disk, common, notify, notify_mult,
+                             (uint16_t)disk->vd_nqueues))
+        {
+            break;
+        }
+        min_size = MIN(min_size, queues[disk->vd_nqueues].vq_size);
+    }
+    if (!disk->vd_nqueues)
+    {
+        dbg(DBG_DISK, "virtio-blk: could not set up its queues\n");
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        kfree(queues);
+        kfree(disk);
+        return;
+    }
+    /* A request has its header and status besides its data */
+    disk->vd_seg_max = min_size - 2;
+    if ((features >> VIRTIO_BLK_F_SEG_MAX) & 1 && seg_max)
+    {
+        disk->vd_seg_max = MIN(disk->vd_seg_max, seg_max);
+    }
+    common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+
+    disk->vd_bdev.bd_id = MKDEVID(VIRTIO_BLK_MAJOR, vblk_ndisks);
+    disk->vd_bdev.bd_ops = &virtio_blk_ops;
+    disk->vd_bdev.bd_depth = disk->vd_nqueues * VIRTIO_BLK_QUEUE_DEPTH;
+    disk->vd_bdev.bd_nblocks = capacity / VIRTIO_BLK_SECTORS_PER_BLOCK;
+    disk->vd_bdev.bd_fua = 0;
+    list_link_init(&disk->vd_bdev.bd_link);
+    vblk_disks[vblk_ndisks++] = disk;
+    long ret = blockdev_register(&disk->vd_bdev);
+    KASSERT(!ret);
+
+    dbg(DBG_DISK,
+        "virtio-blk %lu: %lu blocks, %lu queues of %lu, %lu segments, "
+        "features 0x%lx\n",
+        vblk_ndisks - 1, disk->vd_bdev.bd_nblocks, disk->vd_nqueues, min_size,
+        disk->vd_seg_max, features);
+}
+
+/*
+ * Finds the virtio-blk disks among the PCI devices and sets each up.
+ */
+void virtio_blk_init()
+{
+    softirq_register(SOFTIRQ_VIRTIO_BLK, virtio_blk_softirq);
+    for (size_t q = 0; q < VIRTIO_BLK_MAX_QUEUES; q++)
+    {
+        intr_register((uint8_t)(INTR_VIRTIO_BLK + q),
+                      virtio_blk_interrupt_handler);
+    }
+
+    pcie_device_t *dev = NULL;
+    while ((dev = pcie_lookup_next(dev, VIRTIO_BLK_PCI_CLASS,
+                                   VIRTIO_BLK_PCI_SUBCLASS,
+                                   PCI_LOOKUP_WILDCARD)))
+    {
+        uint16_t id = dev->standard.device_id;
+        if (dev->standard.vendor_id == VIRTIO_PCI_VENDOR_ID &&
+            (id == VIRTIO_PCI_DEVICE_ID_MODERN(VIRTIO_ID_BLOCK) ||
+             id == VIRTIO_PCI_DEVICE_ID_TRANSITIONAL_BLOCK))
+        {
+            vblk_probe(dev);
+        }
+    }
+}
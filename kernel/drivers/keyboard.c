@@ -2,8 +2,10 @@
 
 #include "drivers/tty/tty.h"
 
+#include "main/apic.h"
 #include "main/interrupt.h"
 #include "main/io.h"
+#include "main/softirq.h"
 
 #define IRQ_KEYBOARD 1
 
@@ -76,8 +78,27 @@ static const char *shift_scancodes =
 
 static keyboard_char_handler_t keyboard_handler = NULL;
 
+/* Characters read by the interrupt handler for keyboard_softirq() to hand to
+ * keyboard_handler. The keyboard interrupt goes to one core, which is the
+ * only one to raise the softirq, so each end has a single user. */
+#define KEYBOARD_RING_SIZE 64
+static uint8_t keyboard_ring[KEYBOARD_RING_SIZE];
+static volatile size_t keyboard_ring_head; /* next to hand on */
+static volatile size_t keyboard_ring_tail; /* next to fill */
+
+static void keyboard_softirq()
+{
+    while (keyboard_ring_head != keyboard_ring_tail)
+    {
+        uint8_t c = keyboard_ring[keyboard_ring_head % KEYBOARD_RING_SIZE];
+        keyboard_ring_head++;
+        keyboard_handler(c);
+    }
+}
+
 /* This is the function we register with the interrupt handler - it reads the
- * scancode and, if appropriate, call's the tty's receive_char function */
+ * scancode and, if appropriate, queues the character for the tty's
+ * receive_char function */
 static long keyboard_intr_handler(regs_t *regs)
 {
     uint8_t sc;     /* The scancode we receive */
@@ -190,7 +211,16 @@ static long keyboard_intr_handler(regs_t *regs)
 
     if (c != NO_CHAR)
     {
-        keyboard_handler(c);
+        if (keyboard_ring_tail - keyboard_ring_head < KEYBOARD_RING_SIZE)
+        {
+            keyboard_ring[keyboard_ring_tail % KEYBOARD_RING_SIZE] = c;
+            keyboard_ring_tail++;
+            softirq_raise(SOFTIRQ_KEYBOARD);
+        }
+        else
+        {
+            dbg(DBG_KB, "dropped char 0x%x: ring full\n", c);
+        }
     }
     else
     {
@@ -202,7 +232,9 @@ static long keyboard_intr_handler(regs_t *regs)
 
 void keyboard_init(keyboard_char_handler_t handler)
 {
+    keyboard_handler = handler;
+    softirq_register(SOFTIRQ_KEYBOARD, keyboard_softirq);
     intr_map(IRQ_KEYBOARD, INTR_KEYBOARD);
+    intr_set_affinity(INTR_KEYBOARD, APIC_CORE(apic_current_id()));
     intr_register(INTR_KEYBOARD, keyboard_intr_handler);
-    keyboard_handler = handler;
 }
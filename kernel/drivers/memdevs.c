@@ -6,13 +6,22 @@
 
 #include "mm/kmalloc.h"
 #include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/swap.h"
 
 #include "drivers/chardev.h"
+#include "drivers/memdevs.h"
 
 #include "vm/anon.h"
+#include "vm/ksm.h"
 
+#include "fs/file.h"
+#include "fs/stat.h"
 #include "fs/vnode.h"
 
+#include "api/access.h"
+
 static ssize_t null_read(chardev_t *dev, size_t pos, void *buf, size_t count);
 
 static ssize_t null_write(chardev_t *dev, size_t pos, const void *buf,
@@ -22,6 +31,12 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count);
 
 static long zero_mmap(vnode_t *file, mobj_t **ret);
 
+static ssize_t meminfo_read(chardev_t *dev, size_t pos, void *buf,
+                            size_t count);
+
+static ssize_t meminfo_write(chardev_t *dev, size_t pos, const void *buf,
+                             size_t count);
+
 chardev_ops_t null_dev_ops = {.read = null_read,
                               .write = null_write,
                               .mmap = NULL,
@@ -34,6 +49,15 @@ chardev_ops_t zero_dev_ops = {.read = zero_read,
                               .fill_pframe = NULL,
                               .flush_pframe = NULL};
 
+chardev_ops_t meminfo_dev_ops = {.read = meminfo_read,
+                                 .write = meminfo_write,
+                                 .mmap = NULL,
+                                 .fill_pframe = NULL,
+                                 .flush_pframe = NULL};
+
+/* Size of the buffer the meminfo device formats its report into. */
+#define MEMINFO_BUF_SIZE (4 * PAGE_SIZE)
+
 /**
  * The char device code needs to know about these mem devices, so create
  * chardev_t's for null and zero, fill them in, and register them.
@@ -56,6 +80,13 @@ void memdevs_init()
     zero_dev->cd_ops = &zero_dev_ops;
     list_link_init(&zero_dev->cd_link);
     chardev_register(zero_dev);
+
+    // Create and initialize meminfo device
+    chardev_t *meminfo_dev = kmalloc(sizeof(chardev_t));
+    meminfo_dev->cd_id = MEM_INFO_DEVID;
+    meminfo_dev->cd_ops = &meminfo_dev_ops;
+    list_link_init(&meminfo_dev->cd_link);
+    chardev_register(meminfo_dev);
 }
 
 /**
@@ -114,6 +145,10 @@ static ssize_t zero_read(chardev_t *dev, size_t pos, void *buf, size_t count)
  * Unlike in s5fs_mmap(), you can't necessarily use the file's underlying mobj.
  * Instead, you should simply provide an anonymous object to ret. Keep the
  * anonymous object locked when this function returns.
+ *
+ * Since the object is not a file's, private mappings of it are not shadowed
+ * (see vmmap_map), so reads of pages not yet written map the shared zero
+ * page, as they do in anonymous mappings, rather than each taking a page.
  */
 static long zero_mmap(vnode_t *file, mobj_t **ret)
 {
@@ -128,3 +163,87 @@ static long zero_mmap(vnode_t *file, mobj_t **ret)
     *ret = anon_obj;
     return 0;
 }
+
+long memdev_user_rw(file_t *file, void *ubuf, size_t count, long write,
+                    ssize_t *ret)
+{
+    vnode_t *vn = file->f_vnode;
+    if (!S_ISCHR(vn->vn_mode) ||
+        (vn->vn_devid != MEM_NULL_DEVID && vn->vn_devid != MEM_ZERO_DEVID))
+    {
+        return 0;
+    }
+    if (!(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        *ret = -EBADF;
+    }
+    else if ((ssize_t)count < 0)
+    {
+        *ret = -EINVAL;
+    }
+    else if (write)
+    {
+        *ret = (ssize_t)count;
+    }
+    else if (vn->vn_devid == MEM_NULL_DEVID)
+    {
+        *ret = 0;
+    }
+    else
+    {
+        long err = clear_user(ubuf, count);
+        *ret = err < 0 ? err : (ssize_t)count;
+    }
+    return 1;
+}
+
+/**
+ * Reads from the meminfo device: the page allocator's and the slab
+ * allocators' statistics, the page cache counters, swap usage and merged
+ * pages (see page_info(), slab_info(), mobj_stats_info(), swap_info() and
+ * ksm_info()) as text. The
+ * report is generated anew on every read, so a reader that takes it in
+ * several pieces may see them come from different moments.
+ *
+ * @param  dev   the meminfo device
+ * @param  pos   the offset into the report to start reading from
+ * @param  buf   the buffer to write to
+ * @param  count the maximum number of bytes to read
+ * @return       the number of bytes read, 0 past the end of the report, or
+ *               -ENOMEM
+ */
+static ssize_t meminfo_read(chardev_t *dev, size_t pos, void *buf,
+                            size_t count)
+{
+    char *info = kmalloc(MEMINFO_BUF_SIZE);
+    if (!info)
+    {
+        return -ENOMEM;
+    }
+    size_t left = page_info(NULL, info, MEMINFO_BUF_SIZE);
+    left = slab_info(NULL, info + (MEMINFO_BUF_SIZE - left), left);
+    left = mobj_stats_info(NULL, info + (MEMINFO_BUF_SIZE - left), left);
+    left = swap_info(NULL, info + (MEMINFO_BUF_SIZE - left), left);
+    left = ksm_info(NULL, info + (MEMINFO_BUF_SIZE - left), left);
+    size_t len = MEMINFO_BUF_SIZE - left;
+
+    ssize_t ret = 0;
+    if (pos < len)
+    {
+        ret = (ssize_t)MIN(count, len - pos);
+        memcpy(buf, info + pos, (size_t)ret);
+    }
+    kfree(info);
+    return ret;
+}
+
+/**
+ * The meminfo device is read-only.
+ *
+ * @return -EINVAL
+ */
+static ssize_t meminfo_write(chardev_t *dev, size_t pos, const void *buf,
+                             size_t count)
+{
+    return -EINVAL;
+}
@@ -3,6 +3,7 @@
 #include <main/acpi.h>
 #include <mm/kmalloc.h>
 #include <mm/pagetable.h>
+#include <errno.h>
 #include <util/debug.h>
 
 #define MCFG_SIGNATURE (*(uint32_t *)"MCFG")
@@ -52,6 +53,9 @@ void pci_init(void)
                 wrapper->class = dev->standard.class;
                 wrapper->subclass = dev->standard.subclass;
                 wrapper->interface = dev->standard.prog_if;
+                wrapper->msi = NULL;
+                wrapper->msix = NULL;
+                wrapper->msix_table = NULL;
                 list_link_init(&wrapper->link);
                 list_insert_tail(&pcie_wrapper_list, &wrapper->link);
             }
@@ -61,8 +65,22 @@ void pci_init(void)
 
 pcie_device_t *pcie_lookup(uint8_t class, uint8_t subclass, uint8_t interface)
 {
+    return pcie_lookup_next(NULL, class, subclass, interface);
+}
+
+/* Like pcie_lookup, but finds the next device after prev that matches, or
+ * the first if prev is NULL, so that a driver can find each of its devices. */
+pcie_device_t *pcie_lookup_next(pcie_device_t *prev, uint8_t class,
+                                uint8_t subclass, uint8_t interface)
+{
+    long past = prev == NULL;
     list_iterate(&pcie_wrapper_list, wrapper, pcie_device_wrapper_t, link)
     {
+        if (!past)
+        {
+            past = wrapper->dev == prev;
+            continue;
+        }
         /* verify the class subclass and interface are correct */
         if (((class == PCI_LOOKUP_WILDCARD) || (wrapper->class == class)) &&
             ((subclass == PCI_LOOKUP_WILDCARD) ||
@@ -75,3 +93,191 @@ pcie_device_t *pcie_lookup(uint8_t class, uint8_t subclass, uint8_t interface)
     }
     return NULL;
 }
+
+/* Finds the next capability of dev with the given id after prev, or the
+ * first if prev is NULL; NULL if it has no more. */
+pci_capability_t *pcie_capability(pcie_device_t *dev, uint8_t id,
+                                  pci_capability_t *prev)
+{
+    uint8_t next = prev ? prev->next_cap : dev->standard.capabilities_ptr;
+    while (next & PCI_CAPABILITY_PTR_MASK)
+    {
+        pci_capability_t *cap =
+            (pci_capability_t *)((uintptr_t)dev +
+                                 (next & PCI_CAPABILITY_PTR_MASK));
+        if (cap->id == id)
+        {
+            return cap;
+        }
+        next = cap->next_cap;
+    }
+    return NULL;
+}
+
+/**
+ * Maps a range of one of a device's memory BARs.
+ *
+ * @param dev the device
+ * @param bar the BAR
+ * @param offset where the range starts in it
+ * @param length its length
+ * @return the virtual address of the range, or 0 if the BAR is not a memory
+ * BAR, or is not assigned
+ */
+uintptr_t pcie_map_bar(pcie_device_t *dev, uint8_t bar, uint32_t offset,
+                       uint32_t length)
+{
+    if (bar >= 6 || (dev->standard.bar[bar] & 0x1))
+    {
+        return 0;
+    }
+    uint64_t phys = dev->standard.bar[bar] & ~0xfUL;
+    /* A 64-bit BAR takes the next one for its upper half */
+    if (((dev->standard.bar[bar] >> 1) & 0x3) == 0x2 && bar < 5)
+    {
+        phys |= (uint64_t)dev->standard.bar[bar + 1] << 32;
+    }
+    if (!phys)
+    {
+        return 0;
+    }
+    uintptr_t addr = phys + offset + PHYS_OFFSET;
+    pt_map_range(pt_get(), (uintptr_t)PAGE_ALIGN_DOWN(addr) - PHYS_OFFSET,
+                 (uintptr_t)PAGE_ALIGN_DOWN(addr),
+                 (uintptr_t)PAGE_ALIGN_UP(addr + length),
+                 PT_WRITE | PT_PRESENT, PT_WRITE | PT_PRESENT);
+    return addr;
+}
+
+static pcie_device_wrapper_t *pcie_wrapper(pcie_device_t *dev)
+{
+    list_iterate(&pcie_wrapper_list, wrapper, pcie_device_wrapper_t, link)
+    {
+        if (wrapper->dev == dev)
+        {
+            return wrapper;
+        }
+    }
+    panic("not a device pci_init found\n");
+}
+
+/**
+ * Has dev raise interrupt intr, through MSI, on the given cores, with a
+ * single vector, rather than on its legacy line.
+ *
+ * @param dev the device
+ * @param intr the interrupt
+ * @param cores the cores it goes to, see pcie_msi_set_cores
+ * @return 0 on success, or -ENODEV if the device has no MSI capability
+ */
+long pcie_msi_enable(pcie_device_t *dev, uint8_t intr, uint8_t cores)
+{
+    pcie_device_wrapper_t *wrapper = pcie_wrapper(dev);
+    msi_capability_t *msi =
+        (msi_capability_t *)pcie_capability(dev, PCI_MSI_CAPABILITY_ID, NULL);
+    if (!msi)
+    {
+        return -ENODEV;
+    }
+    if (msi->control.c64)
+    {
+        msi->address_data.ad64.data = MSI_DATA_FOR(intr);
+    }
+    else
+    {
+        msi->address_data.ad32.data = MSI_DATA_FOR(intr);
+    }
+    wrapper->msi = msi;
+    pcie_msi_set_cores(dev, cores);
+    msi->control.mme = 0;
+    msi->control.msie = 1;
+    dev->standard.command |= PCI_COMMAND_INTX_DISABLE;
+    return 0;
+}
+
+/* Sends the interrupt dev raises through MSI, see pcie_msi_enable, to the
+ * given cores instead. */
+void pcie_msi_set_cores(pcie_device_t *dev, uint8_t cores)
+{
+    msi_capability_t *msi = pcie_wrapper(dev)->msi;
+    KASSERT(msi && cores);
+    if (msi->control.c64)
+    {
+        msi->address_data.ad64.addr = MSI_ADDRESS_FOR(cores);
+    }
+    else
+    {
+        msi->address_data.ad32.addr = MSI_ADDRESS_FOR(cores);
+    }
+}
+
+/**
+ * Turns on MSI-X for dev, with every entry of its table masked; each is
+ * then given its interrupt and cores with pcie_msix_set.
+ *
+ * @param dev the device
+ * @return the number of entries in its table, or -ENODEV if it has no MSI-X
+ * capability, or its table is not in a memory BAR
+ */
+long pcie_msix_enable(pcie_device_t *dev)
+{
+    pcie_device_wrapper_t *wrapper = pcie_wrapper(dev);
+    msix_capability_t *msix =
+        (msix_capability_t *)pcie_capability(dev, PCI_MSIX_CAPABILITY_ID, NULL);
+    if (!msix)
+    {
+        return -ENODEV;
+    }
+    size_t nentries = MSIX_TABLE_SIZE(msix->control);
+    volatile msix_table_entry_t *table = (msix_table_entry_t *)pcie_map_bar(
+        dev, (uint8_t)(msix->table & MSIX_BIR_MASK),
+        msix->table & ~MSIX_BIR_MASK,
+        (uint32_t)(nentries * sizeof(msix_table_entry_t)));
+    if (!table)
+    {
+        return -ENODEV;
+    }
+    dev->standard.command |= PCI_COMMAND_MEMORY;
+    for (size_t i = 0; i < nentries; i++)
+    {
+        table[i].control |= MSIX_ENTRY_MASKED;
+    }
+    wrapper->msix = msix;
+    wrapper->msix_table = table;
+    msix->control = (uint16_t)((msix->control | MSIX_CONTROL_ENABLE) &
+                               ~MSIX_CONTROL_MASK_ALL);
+    dev->standard.command |= PCI_COMMAND_INTX_DISABLE;
+    return (long)nentries;
+}
+
+/**
+ * Has entry of dev's MSI-X table, see pcie_msix_enable, raise interrupt intr
+ * on the given cores, and unmasks it. Entries may be moved to other cores
+ * this way at any time.
+ *
+ * @param dev the device
+ * @param entry the entry
+ * @param intr the interrupt
+ * @param cores the cores it goes to
+ * @return 0 on success, or -EINVAL if the table has no such entry
+ */
+long pcie_msix_set(pcie_device_t *dev, size_t entry, uint8_t intr,
+                   uint8_t cores)
+{
+    pcie_device_wrapper_t *wrapper = pcie_wrapper(dev);
+    KASSERT(wrapper->msix && cores);
+    if (entry >= MSIX_TABLE_SIZE(wrapper->msix->control))
+    {
+        return -EINVAL;
+    }
+    volatile msix_table_entry_t *e = &wrapper->msix_table[entry];
+    /* Masked while it is half written, so that no interrupt is sent to a
+     * mix of the old and the new */
+    e->control |= MSIX_ENTRY_MASKED;
+    e->addr_lo = MSI_ADDRESS_FOR(cores);
+    e->addr_hi = 0;
+    e->data = MSI_DATA_FOR(intr);
+    e->control &= ~MSIX_ENTRY_MASKED;
+    return 0;
+}
+
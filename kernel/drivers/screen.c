@@ -1,6 +1,8 @@
 #include <boot/config.h>
 #include <boot/multiboot_macros.h>
 #include <drivers/screen.h>
+#include <main/interrupt.h>
+#include <mm/page.h>
 #include <multiboot.h>
 #include <types.h>
 #include <util/debug.h>
@@ -204,11 +206,29 @@ unsigned const char bitmap_letters[95][BITMAP_HEIGHT] = {
      0x00},
 };
 
-#define DOUBLE_BUFFERING 0
+/*
+ * With DOUBLE_BUFFERING, everything is drawn into fb_buffer, a copy of the
+ * framebuffer in ordinary memory, and screen_flush() (from the timer) copies
+ * what changed to the framebuffer itself. Reading the framebuffer, as
+ * screen_draw_string() and screen_copy_rect() do, is very slow, and drawing
+ * into it directly is too when it is done a pixel at a time.
+ *
+ * What changed is kept as a span of pixels for each scanline, [lo, hi) in
+ * fb_damage, and the scanlines [fb_damage_top, fb_damage_bottom) that may
+ * have one. The timer can flush in the middle of a drawing operation, so the
+ * damage is recorded after the pixels are drawn, at IPL_HIGH.
+ */
+#define DOUBLE_BUFFERING 1
 
 #define BITWISE_TERNARY(condition, x, y) \
     (!!(condition) * (x) + !(condition) * (y))
 
+typedef struct screen_span
+{
+    uint32_t lo;
+    uint32_t hi;
+} screen_span_t;
+
 static uint32_t *fb;
 static uint32_t fb_width;
 static uint32_t fb_height;
@@ -216,6 +236,35 @@ static uint32_t fb_pitch;
 
 static uint32_t *fb_buffer;
 
+#if DOUBLE_BUFFERING
+static screen_span_t *fb_damage;
+static uint32_t fb_damage_top;
+static uint32_t fb_damage_bottom;
+#endif
+
+/* Records that the given rectangle of fb_buffer has been drawn on. */
+static void screen_damage(size_t x, size_t y, size_t width, size_t height)
+{
+#if DOUBLE_BUFFERING
+    if (x >= fb_width || y >= fb_height || !width || !height)
+        return;
+    uint32_t lo = x;
+    uint32_t hi = MIN(x + width, fb_width);
+    uint32_t bottom = MIN(y + height, fb_height);
+
+    uint8_t oldipl = intr_setipl(IPL_HIGH);
+    for (uint32_t line = y; line < bottom; line++)
+    {
+        screen_span_t *span = &fb_damage[line];
+        span->lo = MIN(span->lo, lo);
+        span->hi = MAX(span->hi, hi);
+    }
+    fb_damage_top = MIN(fb_damage_top, (uint32_t)y);
+    fb_damage_bottom = MAX(fb_damage_bottom, bottom);
+    intr_setipl(oldipl);
+#endif
+}
+
 void screen_init()
 {
     static long inited = 0;
@@ -277,6 +326,16 @@ void screen_init()
 #if DOUBLE_BUFFERING
     fb_buffer = page_alloc_n(npages);
     KASSERT(fb_buffer && "couldn't allocate double buffer for screen");
+    size_t damage_pages =
+        ADDR_TO_PN(PAGE_ALIGN_UP(fb_height * sizeof(screen_span_t)));
+    fb_damage = page_alloc_n(damage_pages);
+    KASSERT(fb_damage && "couldn't allocate damage spans for screen");
+    for (uint32_t line = 0; line < fb_height; line++)
+    {
+        fb_damage[line] = (screen_span_t){fb_width, 0};
+    }
+    fb_damage_top = fb_height;
+    fb_damage_bottom = 0;
 #else
     fb_buffer = fb;
 #endif
@@ -286,6 +345,7 @@ void screen_init()
     pt_set(pt_get());
     for (uint32_t i = 0; i < fb_width * fb_height; i++)
         fb_buffer[i] = 0x008A2BE2;
+    screen_damage(0, 0, fb_width, fb_height);
     screen_flush();
 }
 
@@ -301,6 +361,7 @@ inline void screen_draw_string(size_t x, size_t y, const char *s, size_t len,
                                color_t color)
 {
     uint32_t *pos = fb_buffer + y * fb_width + x;
+    size_t width = len * SCREEN_CHARACTER_WIDTH;
     while (len--)
     {
         const char c = *s++;
@@ -332,6 +393,7 @@ inline void screen_draw_string(size_t x, size_t y, const char *s, size_t len,
         }
         pos = pos - fb_width * BITMAP_HEIGHT + SCREEN_CHARACTER_WIDTH;
     }
+    screen_damage(x, y, width, BITMAP_HEIGHT);
 }
 
 inline void screen_draw_horizontal(uint32_t *pos, size_t count, color_t color)
@@ -347,10 +409,23 @@ inline void screen_copy_horizontal(uint32_t *from, uint32_t *to, size_t count)
                      : "cc");
 }
 
+/* Like screen_copy_horizontal, but from the end backwards, for a copy to
+ * a higher address that overlaps its source. */
+static inline void screen_copy_horizontal_backward(uint32_t *from, uint32_t *to,
+                                                   size_t count)
+{
+    if (!count)
+        return;
+    __asm__ volatile("std; rep movsl; cld;" ::"S"(from + count - 1),
+                     "D"(to + count - 1), "c"(count)
+                     : "cc", "memory");
+}
+
 inline void screen_draw_rect(size_t x, size_t y, size_t width, size_t height,
                              color_t color)
 {
     uint32_t *top = fb_buffer + y * fb_width + x;
+    size_t lines = height;
     screen_draw_horizontal(top, width, color);
     screen_draw_horizontal(top + height * fb_width, width, color);
     while (height--)
@@ -358,6 +433,7 @@ inline void screen_draw_rect(size_t x, size_t y, size_t width, size_t height,
         *top = *(top + width) = color.value;
         top += fb_width;
     }
+    screen_damage(x, y, width + 1, lines + 1);
 }
 
 inline void screen_fill(color_t color)
@@ -365,38 +441,86 @@ inline void screen_fill(color_t color)
     __asm__ volatile("cld; rep stosl;" ::"a"(color.value), "D"(fb_buffer),
                      "c"(fb_width * fb_height)
                      : "cc");
+    screen_damage(0, 0, fb_width, fb_height);
 }
 
 inline void screen_fill_rect(size_t x, size_t y, size_t width, size_t height,
                              color_t color)
 {
     uint32_t *top = fb_buffer + y * fb_width + x;
+    size_t lines = height;
     while (height--)
     {
         screen_draw_horizontal(top, width, color);
         top += fb_width;
     }
+    screen_damage(x, y, width, lines);
 }
 
+/*
+ * The source and destination may overlap, as they do when a terminal
+ * scrolls. A copy of whole scanlines is a single move of a contiguous block
+ * (fb_pitch is fb_width pixels); otherwise it goes a scanline at a time,
+ * from the bottom up when moving down.
+ */
 inline void screen_copy_rect(size_t fromx, size_t fromy, size_t width,
                              size_t height, size_t tox, size_t toy)
 {
     uint32_t *from = fb_buffer + fromy * fb_width + fromx;
     uint32_t *to = fb_buffer + toy * fb_width + tox;
-    while (height--)
+    long backward = to > from;
+    if (fromx == 0 && tox == 0 && width == fb_width)
     {
-        screen_copy_horizontal(from, to, width);
-        from += fb_width;
-        to += fb_width;
+        if (backward)
+            screen_copy_horizontal_backward(from, to, width * height);
+        else
+            screen_copy_horizontal(from, to, width * height);
     }
+    else if (backward)
+    {
+        from += (height - 1) * fb_width;
+        to += (height - 1) * fb_width;
+        for (size_t lines = height; lines--;)
+        {
+            screen_copy_horizontal_backward(from, to, width);
+            from -= fb_width;
+            to -= fb_width;
+        }
+    }
+    else
+    {
+        for (size_t lines = height; lines--;)
+        {
+            screen_copy_horizontal(from, to, width);
+            from += fb_width;
+            to += fb_width;
+        }
+    }
+    screen_damage(tox, toy, width, height);
 }
 
+/*
+ * Copies the damaged spans of fb_buffer to the framebuffer with memcpy(),
+ * which moves whole words, and bypasses the cache for long spans.
+ */
 inline void screen_flush()
 {
 #if DOUBLE_BUFFERING
-    __asm__ volatile("cld; rep movsl;" ::"S"(fb_buffer), "D"(fb),
-                     "c"(fb_width * fb_height)
-                     : "cc");
+    uint8_t oldipl = intr_setipl(IPL_HIGH);
+    for (uint32_t line = fb_damage_top; line < fb_damage_bottom; line++)
+    {
+        screen_span_t *span = &fb_damage[line];
+        if (span->lo < span->hi)
+        {
+            size_t start = line * fb_width + span->lo;
+            memcpy(fb + start, fb_buffer + start,
+                   (span->hi - span->lo) * sizeof(uint32_t));
+        }
+        *span = (screen_span_t){fb_width, 0};
+    }
+    fb_damage_top = fb_height;
+    fb_damage_bottom = 0;
+    intr_setipl(oldipl);
 #endif
 }
 
@@ -1,13 +1,25 @@
 #include "drivers/tty/ldisc.h"
+#include <api/syscall.h>
 #include <drivers/keyboard.h>
 #include <drivers/tty/tty.h>
 #include <errno.h>
+#include <main/interrupt.h>
 #include <util/bits.h>
 #include <util/debug.h>
 #include <util/string.h>
+#include <util/time.h>
+#include <util/timer.h>
 
 #define ldisc_to_tty(ldisc) CONTAINER_OF((ldisc), tty_t, tty_ldisc)
 
+/* The halves of the ring's protocol, see ldisc.h */
+#define LDISC_LOAD(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define LDISC_STORE(index, value) \
+    __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+
+/* Characters in the ring, cooked or not */
+#define LDISC_USED(head, tail) MOD_POW_2((head) - (tail), LDISC_BUFFER_SIZE)
+
 /**
  * Initialize the line discipline. Don't forget to wipe the buffer associated
  * with the line discipline clean.
@@ -20,17 +32,32 @@ void ldisc_init(ldisc_t *ldisc)
     ldisc->ldisc_head = 0;
     ldisc->ldisc_tail = 0;
     ldisc->ldisc_cooked = 0;
-    
-    // Initialize the buffer to be empty
-    ldisc->ldisc_full = 0;
+
+    // Start out canonical, echoing, as a terminal does
+    ldisc->ldisc_lflag = ICANON | ECHO;
+    ldisc->ldisc_vmin = 1;
+    ldisc->ldisc_vtime = 0;
     
     // Initialize the read queue for threads waiting for data
     sched_queue_init(&ldisc->ldisc_read_queue);
+    pollq_init(&ldisc->ldisc_pollq);
     
     // Clear the buffer
     memset(ldisc->ldisc_buffer, 0, LDISC_BUFFER_SIZE);
 }
 
+/**
+ * Whether there are new characters to be read from the line discipline's
+ * buffer, so that a read would not wait.
+ *
+ * @param  ldisc the line discipline
+ * @return       1 if a read would not wait, 0 otherwise
+ */
+long ldisc_readable(ldisc_t *ldisc)
+{
+    return LDISC_LOAD(ldisc->ldisc_tail) != LDISC_LOAD(ldisc->ldisc_cooked);
+}
+
 /**
  * While there are no new characters to be read from the line discipline's
  * buffer, you should make the current thread to sleep on the line discipline's
@@ -38,7 +65,7 @@ void ldisc_init(ldisc_t *ldisc)
  * for there to be no characters to be read?
  *
  * @param  ldisc the line discipline
- * @return       0 if there are new characters to be read or the ldisc is full.
+ * @return       0 if there are new characters to be read.
  *               If the sleep was interrupted, return what
  *               `sched_cancellable_sleep_on` returned (i.e. -EINTR)
  */
@@ -47,8 +74,7 @@ long ldisc_wait_read(ldisc_t *ldisc)
     long ret = 0;
     
     // Sleep until there are new characters to be read or the ldisc is full
-    while (!ret && ldisc->ldisc_tail == ldisc->ldisc_cooked && 
-           !ldisc->ldisc_full)
+    while (!ret && !ldisc_readable(ldisc))
     {
         ret = sched_cancellable_sleep_on(&ldisc->ldisc_read_queue);
         if (ret == -EINTR){
@@ -63,11 +89,13 @@ long ldisc_wait_read(ldisc_t *ldisc)
  * Reads `count` bytes (at max) from the line discipline's buffer into the
  * provided buffer. Keep in mind the the ldisc's buffer is circular.
  *
- * If you encounter a new line symbol before you have read `count` bytes, you
- * should stop copying and return the bytes read until now.
- * 
  * If you encounter an `EOT` you should stop reading and you should NOT include 
- * the `EOT` in the count of the number of bytes read
+ * the `EOT` in the count of the number of bytes read. In raw mode `EOT` is
+ * just another character.
+ *
+ * This is the consumer's half of the ring, and needs neither a lock nor the
+ * IPL raised: only the cooked characters are touched, and the tail is
+ * published once they have been copied.
  *
  * @param  ldisc the line discipline
  * @param  buf   the buffer to read into.
@@ -76,35 +104,139 @@ long ldisc_wait_read(ldisc_t *ldisc)
  */
 size_t ldisc_read(ldisc_t *ldisc, char *buf, size_t count)
 {
-    // If no characters available to read, return 0
-    if (ldisc->ldisc_tail == ldisc->ldisc_cooked && !ldisc->ldisc_full){
-        return 0;
-    }
-    
+    size_t cooked = LDISC_LOAD(ldisc->ldisc_cooked);
+    size_t tail = ldisc->ldisc_tail;
+    long canonical = ldisc->ldisc_lflag & ICANON;
+
     size_t read = 0;
-    while (read < count){
+    while (read < count && tail != cooked)
+    {
         // Copy character from ldisc buffer to output buffer
-        buf[read++] = ldisc->ldisc_buffer[ldisc->ldisc_tail];
-        ldisc->ldisc_tail = MOD_POW_2(ldisc->ldisc_tail + 1, LDISC_BUFFER_SIZE);
-        // if (buf[read - 1] == LF) {
-        //     break;
-        // }
+        char c = ldisc->ldisc_buffer[tail];
+        tail = MOD_POW_2(tail + 1, LDISC_BUFFER_SIZE);
 
         // Case for EOT
-        if (buf[read - 1] == EOT){
-            read--;
+        if (canonical && c == EOT)
+        {
             break;
         }
-        
-        // Case for cooked buffer being full
-        if (ldisc->ldisc_tail == ldisc->ldisc_cooked)        {
+        buf[read++] = c;
+    }
+
+    LDISC_STORE(ldisc->ldisc_tail, tail);
+    return read;
+}
+
+typedef struct ldisc_timeout
+{
+    ldisc_t *lt_ldisc;
+    long lt_expired;
+} ldisc_timeout_t;
+
+static void ldisc_timer_fire(uint64_t data)
+{
+    ldisc_timeout_t *lt = (ldisc_timeout_t *)data;
+    lt->lt_expired = 1;
+    sched_broadcast_on(&lt->lt_ldisc->ldisc_read_queue);
+}
+
+/* (Re)starts timer to expire ldisc_vtime tenths of a second from now. */
+static void ldisc_timer_start(ldisc_t *ldisc, timer_t *timer,
+                              ldisc_timeout_t *lt)
+{
+    timer_del(timer);
+    lt->lt_expired = 0;
+    // jiffies are roughly milliseconds, see util/time.c
+    timer->expires = jiffies + (uint64_t)ldisc->ldisc_vtime * 100;
+    timer_add(timer);
+}
+
+/**
+ * Reads up to `count` bytes in raw mode, waiting as ldisc_vmin and
+ * ldisc_vtime say (see termio_t):
+ *  - vmin > 0, vtime == 0: until vmin bytes have arrived
+ *  - vmin > 0, vtime > 0: as above, or until vtime passes between two bytes
+ *    once the first has arrived
+ *  - vmin == 0, vtime > 0: until a byte arrives, or vtime passes
+ *  - vmin == 0, vtime == 0: not at all
+ * Called with the tty's read mutex held.
+ *
+ * @param  ldisc the line discipline
+ * @param  buf   the buffer to read into.
+ * @param  count the maximum number of bytes to read from ldisc.
+ * @return       the number of bytes read, or -EINTR if the thread was
+ *               cancelled before any arrived
+ */
+ssize_t ldisc_read_raw(ldisc_t *ldisc, char *buf, size_t count)
+{
+    size_t vmin = MIN((size_t)ldisc->ldisc_vmin, count);
+    long vtime = ldisc->ldisc_vtime;
+
+    ldisc_timeout_t lt = {.lt_ldisc = ldisc, .lt_expired = 0};
+    timer_t timer;
+    timer_init(&timer);
+    timer.function = ldisc_timer_fire;
+    timer.data = (uint64_t)&lt;
+    if (vtime && !vmin)
+    {
+        ldisc_timer_start(ldisc, &timer, &lt);
+    }
+
+    size_t got = 0;
+    long ret = 0;
+    while (1)
+    {
+        size_t n = ldisc_read(ldisc, buf + got, count - got);
+        got += n;
+        if (got == count || (vmin && got >= vmin) || (!vmin && got) ||
+            (!vmin && !vtime) || lt.lt_expired)
+        {
+            break;
+        }
+        if (n && vtime)
+        {
+            // The inter-byte timer starts over with each byte
+            ldisc_timer_start(ldisc, &timer, &lt);
+        }
+
+        uint8_t old_ipl = intr_setipl(IPL_HIGH);
+        while (!ldisc_readable(ldisc) && !lt.lt_expired && !ret)
+        {
+            ret = sched_cancellable_sleep_on(&ldisc->ldisc_read_queue);
+        }
+        intr_setipl(old_ipl);
+        if (ret)
+        {
             break;
         }
     }
-    
-    // Update full flag
-    ldisc->ldisc_full = 0;
-    return read;
+
+    if (vtime)
+    {
+        timer_del(&timer);
+    }
+    return got ? (ssize_t)got : ret;
+}
+
+/**
+ * Switches the line discipline between canonical and raw mode, and sets how
+ * raw reads wait. Going raw cooks whatever has been typed so far on the
+ * current line. Readers are woken, to wait again under the new rules.
+ */
+void ldisc_set_mode(ldisc_t *ldisc, unsigned int lflag, unsigned char vmin,
+                    unsigned char vtime)
+{
+    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
+    ldisc->ldisc_lflag = lflag;
+    ldisc->ldisc_vmin = vmin;
+    ldisc->ldisc_vtime = vtime;
+    if (!(lflag & ICANON))
+    {
+        LDISC_STORE(ldisc->ldisc_cooked, ldisc->ldisc_head);
+    }
+    sched_broadcast_on(&ldisc->ldisc_read_queue);
+    pollq_wakeup(&ldisc->ldisc_pollq);
+    intr_setipl(old_ipl);
 }
 
 /**
@@ -157,50 +289,79 @@ void ldisc_key_pressed(ldisc_t *ldisc, char c)
 {
     // Get the vterminal for this line discipline
     vterminal_t *vt = &ldisc_to_tty(ldisc)->tty_vterminal;
-    
+    long echo = ldisc->ldisc_lflag & ECHO;
+    size_t used = LDISC_USED(ldisc->ldisc_head, LDISC_LOAD(ldisc->ldisc_tail));
+
+    // Raw mode: every character is cooked as it comes
+    if (!(ldisc->ldisc_lflag & ICANON))
+    {
+        if (used == LDISC_BUFFER_SIZE - 1)
+        {
+            return;
+        }
+        ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
+        ldisc->ldisc_head = MOD_POW_2(ldisc->ldisc_head + 1, LDISC_BUFFER_SIZE);
+        LDISC_STORE(ldisc->ldisc_cooked, ldisc->ldisc_head);
+        sched_wakeup_on(&ldisc->ldisc_read_queue, NULL);
+        pollq_wakeup(&ldisc->ldisc_pollq);
+        if (echo)
+        {
+            vterminal_write(vt, &c, 1);
+        }
+        return;
+    }
+
     // Handle backspace
     if (c == BS){
         if (ldisc->ldisc_cooked != ldisc->ldisc_head){
             ldisc->ldisc_head = MOD_POW_2(ldisc->ldisc_head - 1, LDISC_BUFFER_SIZE);
-            vterminal_write(vt, "\b", 1);
+            if (echo)
+            {
+                vterminal_write(vt, "\b", 1);
+            }
         }
         return;
     }
     
     // Handle Ctrl-C
     if (c == ETX){
+        used -= LDISC_USED(ldisc->ldisc_head, ldisc->ldisc_cooked);
         ldisc->ldisc_head = ldisc->ldisc_cooked;
         c = LF;
-        vterminal_write(vt, "^C", 2);
+        if (echo)
+        {
+            vterminal_write(vt, "^C", 2);
+        }
     }
     
     // Case for buffer being full
-    if (ldisc->ldisc_full){
+    if (used == LDISC_BUFFER_SIZE - 1){
         return;
     }
     
-    // Case for buffer being almost full
-    if ((MOD_POW_2(ldisc->ldisc_head + 1, LDISC_BUFFER_SIZE) == ldisc->ldisc_tail) &&
+    // Case for buffer, or the line, being almost full
+    if ((used == LDISC_BUFFER_SIZE - 2 ||
+         LDISC_USED(ldisc->ldisc_head, ldisc->ldisc_cooked) == LDISC_LINE_MAX) &&
         (c != LF && c != EOT)){
         return;
     }
     
-    // Add character to buffer and update head and full flag
+    // Add character to buffer and update head
     ldisc->ldisc_buffer[ldisc->ldisc_head] = c;
     ldisc->ldisc_head = MOD_POW_2(ldisc->ldisc_head + 1, LDISC_BUFFER_SIZE);
-    ldisc->ldisc_full = (ldisc->ldisc_head == ldisc->ldisc_tail);
     
     // Case for new line or EOT
     if (c == LF || c == EOT){
-        ldisc->ldisc_cooked = ldisc->ldisc_head;
+        LDISC_STORE(ldisc->ldisc_cooked, ldisc->ldisc_head);
         sched_wakeup_on(&ldisc->ldisc_read_queue, NULL);
+        pollq_wakeup(&ldisc->ldisc_pollq);
         
-        if (c == LF)
+        if (c == LF && echo)
         {
             vterminal_write(vt, "\n", 1);
         }
     }
-    else{
+    else if (echo){
         vterminal_key_pressed(vt);
     }
 }
@@ -1,4 +1,6 @@
 #include "drivers/tty/tty.h"
+#include "api/access.h"
+#include "api/syscall.h"
 #include "drivers/chardev.h"
 #include "drivers/dev.h"
 #include "drivers/keyboard.h"
@@ -13,12 +15,16 @@
 
 ssize_t tty_read(chardev_t *cdev, size_t pos, void *buf, size_t count);
 ssize_t tty_write(chardev_t *cdev, size_t pos, const void *buf, size_t count);
+long tty_poll(chardev_t *cdev, long events, struct poll_table *pt);
+long tty_ioctl(chardev_t *cdev, unsigned long cmd, void *arg);
 
 chardev_ops_t tty_cdev_ops = {.read = tty_read,
                               .write = tty_write,
                               .mmap = NULL,
                               .fill_pframe = NULL,
-                              .flush_pframe = NULL};
+                              .flush_pframe = NULL,
+                              .poll = tty_poll,
+                              .ioctl = tty_ioctl};
 
 tty_t *ttys[NTERMS] = {NULL};
 
@@ -40,6 +46,8 @@ void tty_init()
 
         kmutex_init(&tty->tty_write_mutex);
         kmutex_init(&tty->tty_read_mutex);
+        kmutex_set_name(&tty->tty_write_mutex, "tty_write");
+        kmutex_set_name(&tty->tty_read_mutex, "tty_read");
 
         long ret = chardev_register(&tty->tty_cdev);
         KASSERT(!ret);
@@ -54,12 +62,11 @@ void tty_init()
 /**
  * Reads from the tty to the buffer.
  *
- * You should first lock the read mutex of the tty. You should
- * then wait until there is something in the line discipline's buffer and only
- * read from the ldisc's buffer if there are new characters.
- *
- * To prevent being preempted, you should set IPL using INTR_KEYBOARD
- * correctly and revert it once you are done.
+ * You should first lock the read mutex of the tty. In canonical mode you
+ * should then wait until there is a line in the line discipline's buffer,
+ * with IPL set to INTR_KEYBOARD so that the keyboard cannot cook one between
+ * the check and the sleep, and only then read it. Reading itself needs no
+ * IPL, see ldisc.h. In raw mode ldisc_read_raw() does both.
  *
  * @param  cdev  the character device that represents tty
  * @param  pos   the position to start reading from; should be ignored
@@ -70,22 +77,26 @@ void tty_init()
 ssize_t tty_read(chardev_t *cdev, size_t pos, void *buf, size_t count)
 {
     tty_t *tty = cd_to_tty(cdev);
+    ldisc_t *ldisc = &tty->tty_ldisc;
     
-    // Lock the read mutex and set interrupt level to prevent preemption
     kmutex_lock(&tty->tty_read_mutex);
-    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
-    
+    if (!(ldisc->ldisc_lflag & ICANON))
+    {
+        ssize_t ret = ldisc_read_raw(ldisc, (char *)buf, count);
+        kmutex_unlock(&tty->tty_read_mutex);
+        return ret;
+    }
+
     // Wait until there are characters available to read
-    long ret = ldisc_wait_read(&tty->tty_ldisc);
+    uint8_t old_ipl = intr_setipl(INTR_KEYBOARD);
+    long ret = ldisc_wait_read(ldisc);
+    intr_setipl(old_ipl);
     if (ret < 0){
-        intr_setipl(old_ipl);
         kmutex_unlock(&tty->tty_read_mutex);
         return ret;
     }
     
-    // Read from the line discipline buffer and restore interrupt level
-    size_t bytes_read = ldisc_read(&tty->tty_ldisc, (char *)buf, count);
-    intr_setipl(old_ipl);
+    size_t bytes_read = ldisc_read(ldisc, (char *)buf, count);
     kmutex_unlock(&tty->tty_read_mutex);
     return bytes_read;
 }
@@ -118,6 +129,60 @@ ssize_t tty_write(chardev_t *cdev, size_t pos, const void *buf, size_t count)
     return bytes_written;
 }
 
+/**
+ * Polls the tty: it is readable when tty_read would not wait in
+ * ldisc_wait_read, and always writable. Called at IPL_HIGH, so the line
+ * discipline cannot change underneath.
+ *
+ * @param  cdev   the character device that represents tty
+ * @param  events the events asked for; ignored
+ * @param  pt     the poll table to register on the ldisc with, or NULL
+ * @return        POLLOUT, and POLLIN if there is a line to read
+ */
+long tty_poll(chardev_t *cdev, long events, struct poll_table *pt)
+{
+    tty_t *tty = cd_to_tty(cdev);
+    poll_wait(pt, &tty->tty_ldisc.ldisc_pollq);
+    return POLLOUT | (ldisc_readable(&tty->tty_ldisc) ? POLLIN : 0);
+}
+
+/**
+ * Gets (TCGETA) or sets (TCSETA) the tty's termio_t, which arg points to in
+ * user memory; see api/syscall.h.
+ *
+ * @param  cdev the character device that represents tty
+ * @param  cmd  TCGETA or TCSETA
+ * @param  arg  the user's termio_t
+ * @return      0 on success, -EFAULT if arg cannot be copied, or -ENOTTY
+ *              for any other cmd
+ */
+long tty_ioctl(chardev_t *cdev, unsigned long cmd, void *arg)
+{
+    ldisc_t *ldisc = &cd_to_tty(cdev)->tty_ldisc;
+    termio_t tio;
+    switch (cmd)
+    {
+    case TCGETA:
+        tio.c_lflag = ldisc->ldisc_lflag;
+        tio.c_vmin = ldisc->ldisc_vmin;
+        tio.c_vtime = ldisc->ldisc_vtime;
+        return copy_to_user(arg, &tio, sizeof(tio));
+    case TCSETA:
+    {
+        long ret = copy_from_user(&tio, arg, sizeof(tio));
+        if (ret < 0)
+        {
+            return ret;
+        }
+        ldisc_set_mode(ldisc, tio.c_lflag & (ICANON | ECHO), tio.c_vmin,
+                       tio.c_vtime);
+        return 0;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
 static void tty_receive_char_multiplexer(uint8_t c)
 {
     tty_t *tty = ttys[active_tty];
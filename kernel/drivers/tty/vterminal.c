@@ -312,46 +312,50 @@ void vterminal_scroll_to_bottom(vterminal_t *vt)
     }
 }
 
+/*
+ * Moves the lines that stay on the screen in one screen_copy_rect(), as wide
+ * as the widest of them, or the whole screen if that is a full line, so that
+ * the back buffer is moved as one block, and redraws the lines that scrolled
+ * in.
+ */
 void vterminal_scroll_draw(vterminal_t *vt, long count)
 {
+    size_t n = (size_t)(count < 0 ? -count : count);
+    if (!n)
+        return;
+    if (n > vt->vt_height)
+        n = vt->vt_height;
+
+    size_t widest = 0;
+    for (size_t line = 0; line < vt->vt_height; line++)
+    {
+        widest = MAX(widest, vt->vt_line_widths[line]);
+    }
+    size_t copy_width = widest >= vt->vt_width
+                            ? screen_get_width()
+                            : widest * screen_get_character_width();
+    size_t copy_distance = n * screen_get_character_height();
+    size_t copy_height = (vt->vt_height - n) * screen_get_character_height();
+
     if (count > 0)
     {
-        if ((size_t)count > vt->vt_height)
-            count = vt->vt_height;
-        size_t copy_distance = count * screen_get_character_height();
-        size_t screen_y = 0;
-        for (size_t line = 0; line < vt->vt_height - count; line++)
+        if (copy_height && copy_width)
+            screen_copy_rect(0, copy_distance, copy_width, copy_height, 0, 0);
+        for (size_t line = 0; line < vt->vt_height - n; line++)
         {
-            screen_copy_rect(0, screen_y + copy_distance,
-                             MAX(vt->vt_line_widths[line],
-                                 vt->vt_line_widths[line + count]) *
-                                 screen_get_character_width(),
-                             screen_get_character_height(), 0, screen_y);
-            vt->vt_line_widths[line] = vt->vt_line_widths[line + count];
-            screen_y += screen_get_character_height();
+            vt->vt_line_widths[line] = vt->vt_line_widths[line + n];
         }
-        vterminal_redraw_lines(vt, vt->vt_height - count, vt->vt_height);
-    }
-    else if (count < 0)
-    {
-        count *= -1;
-        if ((size_t)count > vt->vt_height)
-            count = vt->vt_height;
-        size_t copy_distance = count * screen_get_character_height();
-        size_t screen_y =
-            (vt->vt_height - count) * screen_get_character_height();
-        for (size_t line = vt->vt_height - count; line >= (size_t)count;
-             line--)
+        vterminal_redraw_lines(vt, vt->vt_height - n, vt->vt_height);
+    }
+    else
+    {
+        if (copy_height && copy_width)
+            screen_copy_rect(0, 0, copy_width, copy_height, 0, copy_distance);
+        for (size_t line = vt->vt_height - 1; line >= n; line--)
         {
-            screen_copy_rect(0, screen_y - copy_distance,
-                             MAX(vt->vt_line_widths[line],
-                                 vt->vt_line_widths[line - count]) *
-                                 screen_get_character_width(),
-                             screen_get_character_height(), 0, screen_y);
-            vt->vt_line_widths[line] = vt->vt_line_widths[line - count];
-            screen_y -= screen_get_character_height();
+            vt->vt_line_widths[line] = vt->vt_line_widths[line - n];
         }
-        vterminal_redraw_lines(vt, 0, (size_t)count);
+        vterminal_redraw_lines(vt, 0, n);
     }
 }
 
@@ -607,7 +611,7 @@ void vterminal_key_pressed(vterminal_t *vt)
 {
     KASSERT(active_vt == vt);
     vterminal_scroll_to_bottom(vt);
-    char buf[LDISC_BUFFER_SIZE];
+    char buf[LDISC_LINE_MAX];
     size_t len =
         ldisc_get_current_line_raw(&vterminal_to_tty(vt)->tty_ldisc, buf);
     size_t initial_input_pos = vt->vt_input_pos;
@@ -661,7 +665,7 @@ vtconsole_t *vtconsole(vtconsole_t *vtc, int width, int height,
 
     vtc->buffer = kmalloc(width * height * sizeof(vtcell_t));
 
-    vtc->tabs = kmalloc(LDISC_BUFFER_SIZE * sizeof(int));
+    vtc->tabs = kmalloc(LDISC_LINE_MAX * sizeof(int));
     vtc->tab_index = 0;
 
     vtc->cursor = (vtcursor_t){0, 0};
@@ -669,6 +673,10 @@ vtconsole_t *vtconsole(vtconsole_t *vtc, int width, int height,
     vtc->on_paint = on_paint;
     vtc->on_move = on_move;
 
+    vtc->deferred = 0;
+    vtc->dirty_start = vtc->dirty_end = 0;
+    vtc->cursor_moved = 0;
+
     vtconsole_clear(vtc, 0, 0, width, height - 1);
 
     return vtc;
@@ -684,21 +692,81 @@ void vtconsole_delete(vtconsole_t *vtc)
 
 /* --- Internal methods ---------------------------------------------------- */
 
+// Repaints cells [start, end), or, inside vtconsole_write, adds them to the
+// region vtconsole_flush repaints once the write is done.
+static void vtconsole_paint_range(vtconsole_t *vtc, int start, int end)
+{
+    if (start >= end)
+        return;
+
+    if (vtc->deferred)
+    {
+        if (vtc->dirty_start >= vtc->dirty_end)
+        {
+            vtc->dirty_start = start;
+            vtc->dirty_end = end;
+        }
+        else
+        {
+            vtc->dirty_start = MIN(vtc->dirty_start, start);
+            vtc->dirty_end = MAX(vtc->dirty_end, end);
+        }
+        return;
+    }
+
+    if (vtc->on_paint)
+    {
+        for (int i = start; i < end; i++)
+        {
+            vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
+        }
+    }
+}
+
+// Moves the hardware cursor to vtc->cursor, or, inside vtconsole_write, has
+// vtconsole_flush do it once the write is done.
+static void vtconsole_move(vtconsole_t *vtc)
+{
+    if (vtc->deferred)
+    {
+        vtc->cursor_moved = 1;
+    }
+    else if (vtc->on_move)
+    {
+        vtc->on_move(vtc, &vtc->cursor);
+    }
+}
+
+// Carries out the painting and cursor movement vtconsole_write put off.
+static void vtconsole_flush(vtconsole_t *vtc)
+{
+    vtc->deferred = 0;
+
+    vtconsole_paint_range(vtc, vtc->dirty_start, vtc->dirty_end);
+    vtc->dirty_start = vtc->dirty_end = 0;
+
+    if (vtc->cursor_moved)
+    {
+        vtc->cursor_moved = 0;
+        vtconsole_move(vtc);
+    }
+}
+
 // function to clear everything on the vterminal
 void vtconsole_clear(vtconsole_t *vtc, int fromx, int fromy, int tox, int toy)
 {
-    for (int i = fromx + fromy * vtc->width; i < tox + toy * vtc->width; i++)
+    int start = fromx + fromy * vtc->width;
+    int end = tox + toy * vtc->width;
+
+    for (int i = start; i < end; i++)
     {
         vtcell_t *cell = &vtc->buffer[i];
 
         cell->attr = VTC_DEFAULT_ATTR;
         cell->c = ' ';
-
-        if (vtc->on_paint)
-        {
-            vtc->on_paint(vtc, cell, i % vtc->width, i / vtc->width);
-        }
     }
+
+    vtconsole_paint_range(vtc, start, end);
 }
 
 // helper function for vtconsole_newline to scroll down the screen.
@@ -710,31 +778,23 @@ void vtconsole_scroll(vtconsole_t *vtc, int lines)
     lines = lines > vtc->height ? vtc->height : lines;
 
     // Scroll the screen by number of $lines.
-    for (int i = 0; i < ((vtc->width * vtc->height) - (vtc->width * lines));
-         i++)
+    int area = vtc->width * vtc->height;
+    int kept = area - vtc->width * lines;
+    for (int i = 0; i < kept; i++)
     {
         vtc->buffer[i] = vtc->buffer[i + (vtc->width * lines)];
-
-        if (vtc->on_paint)
-        {
-            vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
-        }
     }
 
     // Clear the last $lines.
-    for (int i = ((vtc->width * vtc->height) - (vtc->width * lines));
-         i < vtc->width * vtc->height; i++)
+    for (int i = kept; i < area; i++)
     {
         vtcell_t *cell = &vtc->buffer[i];
         cell->attr = VTC_DEFAULT_ATTR;
         cell->c = ' ';
-
-        if (vtc->on_paint)
-        {
-            vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
-        }
     }
 
+    vtconsole_paint_range(vtc, 0, area);
+
     // Move the cursor up $lines
     if (vtc->cursor.y > 0)
     {
@@ -743,10 +803,7 @@ void vtconsole_scroll(vtconsole_t *vtc, int lines)
         if (vtc->cursor.y < 0)
             vtc->cursor.y = 0;
 
-        if (vtc->on_move)
-        {
-            vtc->on_move(vtc, &vtc->cursor);
-        }
+        vtconsole_move(vtc);
     }
 }
 
@@ -761,10 +818,7 @@ void vtconsole_newline(vtconsole_t *vtc)
         vtconsole_scroll(vtc, 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Append character to the console buffer.
@@ -778,16 +832,13 @@ void vtconsole_append(vtconsole_t *vtc, char c)
     {
         vtc->cursor.x = 0;
 
-        if (vtc->on_move)
-        {
-            vtc->on_move(vtc, &vtc->cursor);
-        }
+        vtconsole_move(vtc);
     }
     else if (c == '\t')
     {
         int n = 8 - (vtc->cursor.x % 8);
         // storing all the tabs and their size encountered.
-        vtc->tabs[vtc->tab_index % LDISC_BUFFER_SIZE] = n;
+        vtc->tabs[vtc->tab_index % LDISC_LINE_MAX] = n;
         vtc->tab_index++;
 
         for (int i = 0; i < n; i++)
@@ -807,38 +858,29 @@ void vtconsole_append(vtconsole_t *vtc, char c)
             vtc->cursor.x = vtc->width - 1;
         }
 
-        if (vtc->on_move)
-        {
-            vtc->on_move(vtc, &vtc->cursor);
-        }
+        vtconsole_move(vtc);
 
         int i = (vtc->width * vtc->cursor.y) + vtc->cursor.x;
         vtcell_t *cell = &vtc->buffer[i];
         cell->attr = VTC_DEFAULT_ATTR;
         cell->c = ' ';
-        vtc->on_paint(vtc, &vtc->buffer[i], i % vtc->width, i / vtc->width);
+        vtconsole_paint_range(vtc, i, i + 1);
     }
     else
     {
         if (vtc->cursor.x >= vtc->width)
             vtconsole_newline(vtc);
 
-        vtcell_t *cell =
-            &vtc->buffer[vtc->cursor.x + vtc->cursor.y * vtc->width];
+        int i = vtc->cursor.x + vtc->cursor.y * vtc->width;
+        vtcell_t *cell = &vtc->buffer[i];
         cell->c = c;
         cell->attr = vtc->attr;
 
-        if (vtc->on_paint)
-        {
-            vtc->on_paint(vtc, cell, vtc->cursor.x, vtc->cursor.y);
-        }
+        vtconsole_paint_range(vtc, i, i + 1);
 
         vtc->cursor.x++;
 
-        if (vtc->on_move)
-        {
-            vtc->on_move(vtc, &vtc->cursor);
-        }
+        vtconsole_move(vtc);
     }
 }
 
@@ -851,10 +893,7 @@ void vtconsole_csi_cuu(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.y = MAX(MIN(vtc->cursor.y - attr, vtc->height - 1), 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function for vtconsole_process to move the cursor P1 columns left
@@ -866,10 +905,7 @@ void vtconsole_csi_cud(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.y = MAX(MIN(vtc->cursor.y + attr, vtc->height - 1), 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function for vtconsole_process to move the cursor P1 columns right
@@ -881,10 +917,7 @@ void vtconsole_csi_cuf(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.x = MAX(MIN(vtc->cursor.x + attr, vtc->width - 1), 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function for vtconsole_process to move the cursor P1 rows down
@@ -896,10 +929,7 @@ void vtconsole_csi_cub(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.x = MAX(MIN(vtc->cursor.x - attr, vtc->width - 1), 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function for vtconsole_process to place the cursor to the first
@@ -913,10 +943,7 @@ void vtconsole_csi_cnl(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.x = 0;
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function for vtconsole_process to place the cursor to the first
@@ -930,10 +957,7 @@ void vtconsole_csi_cpl(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.x = 0;
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Helper function of vtconsole_process to move the cursor to column P1
@@ -945,10 +969,7 @@ void vtconsole_csi_cha(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         vtc->cursor.y = MAX(MIN(attr, vtc->height - 1), 1);
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Moves the cursor to row n, column m. The values are 1-based,
@@ -980,10 +1001,7 @@ void vtconsole_csi_cup(vtconsole_t *vtc, vtansi_arg_t *stack, int count)
         }
     }
 
-    if (vtc->on_move)
-    {
-        vtc->on_move(vtc, &vtc->cursor);
-    }
+    vtconsole_move(vtc);
 }
 
 // Clears part of the screen.
@@ -1232,21 +1250,68 @@ void vtconsole_process(vtconsole_t *vtc, char c)
 // vtconosle_putchar is called from vterminal_key_pressed
 void vtconsole_putchar(vtconsole_t *vtc, char c) { vtconsole_process(vtc, c); }
 
-// vtconsole_write is called from vterminal_write
+// Writes the run of printable characters at the start of buffer straight into
+// the cells, a row at a time, wrapping as vtconsole_append would. Returns the
+// length of the run.
+static uint32_t vtconsole_write_run(vtconsole_t *vtc, const char *buffer,
+                                    uint32_t size)
+{
+    uint32_t n = 0;
+    while (n < size && buffer[n] >= ' ' && buffer[n] <= '~')
+    {
+        if (vtc->cursor.x >= vtc->width)
+            vtconsole_newline(vtc);
+
+        int start = vtc->cursor.x + vtc->cursor.y * vtc->width;
+        int room = vtc->width - vtc->cursor.x;
+        int i = start;
+        for (; n < size && i < start + room && buffer[n] >= ' ' &&
+               buffer[n] <= '~';
+             n++, i++)
+        {
+            vtc->buffer[i].c = buffer[n];
+            vtc->buffer[i].attr = vtc->attr;
+        }
+
+        vtconsole_paint_range(vtc, start, i);
+        vtc->cursor.x += i - start;
+    }
+    if (n)
+        vtconsole_move(vtc);
+    return n;
+}
+
+// vtconsole_write is called from vterminal_write. Painting and moving the
+// cursor are put off until the whole buffer has been processed, so that each
+// cell that changed is painted once, and runs of printable characters outside
+// of escape sequences skip vtconsole_process.
 void vtconsole_write(vtconsole_t *vtc, const char *buffer, uint32_t size)
 {
+    // acquiting the ldisc associated with the vtconsole/vterminal
+    ldisc_t *new_ldisc = &vterminal_to_tty(vtc)->tty_ldisc;
+
+    vtc->deferred = 1;
+
     // looping through the whole size of the buffer
-    for (uint32_t i = 0; i < size; i++)
+    uint32_t i = 0;
+    while (i < size)
     {
-        // acquiting the ldisc associated with the vtconsole/vterminal
-        ldisc_t *new_ldisc = &vterminal_to_tty(vtc)->tty_ldisc;
+        if (vtc->ansiparser.state == VTSTATE_ESC)
+        {
+            uint32_t n = vtconsole_write_run(vtc, &buffer[i], size - i);
+            if (n)
+            {
+                i += n;
+                continue;
+            }
+        }
 
         // checking if the buffer is a backspsace and the last entered character was a tab
         if (buffer[i] == '\b' && new_ldisc->ldisc_buffer[(new_ldisc->ldisc_head)] == '\t')
         {
             // calling vtcomsole_process 'n' number of times.
             // where 'n' is the size of the tab.
-            for (int j = 0; j < vtc->tabs[(vtc->tab_index - 1) % LDISC_BUFFER_SIZE]; j++)
+            for (int j = 0; j < vtc->tabs[(vtc->tab_index - 1) % LDISC_LINE_MAX]; j++)
             {
                 vtconsole_process(vtc, buffer[i]);
             }
@@ -1256,7 +1321,10 @@ void vtconsole_write(vtconsole_t *vtc, const char *buffer, uint32_t size)
         {
             vtconsole_process(vtc, buffer[i]);
         }
+        i++;
     }
+
+    vtconsole_flush(vtc);
 }
 
 // called by vterminal_make_active to redraw the console.
@@ -1361,7 +1429,7 @@ void vterminal_make_active(vterminal_t *vt)
 // called by ldisc_key_pressed from ldisc.c
 void vterminal_key_pressed(vterminal_t *vt)
 {
-    char buf[LDISC_BUFFER_SIZE];
+    char buf[LDISC_LINE_MAX];
     size_t len =
         ldisc_get_current_line_raw(&vterminal_to_tty(vt)->tty_ldisc, buf);
     vtconsole_putchar(vt, buf[len - 1]);
@@ -0,0 +1,86 @@
+#include "kernel.h"
+#include "main/entry.h"
+#include "main/gdt.h"
+#include "main/smp.h"
+
+#include "api/syscall.h"
+
+/*
+ * The SYSCALL entry, the fast way into the kernel next to the int $0x2e
+ * trap (see api/syscall.h).
+ *
+ * SYSCALL leaves the stack alone, puts the return address in %rcx and the
+ * flags in %r11, and clears IF (see gdt_init). syscall_entry switches to the
+ * thread's kernel stack and builds a regs_t just like the one the interrupt
+ * stubs build, with the segments and stack the CPU would have pushed, so
+ * that fork() and execve() see the same frame whichever way they came in.
+ *
+ * The way back is SYSRET, unless syscall_fast_handler() asks for IRETQ: a
+ * SYSRET to a non-canonical address faults in the kernel, on the user's
+ * stack. Interrupts are off from before the registers are restored until
+ * the user's stack is back.
+ *
+ * The stacks are kept in this core's csd_head_t (see main/smp.h), which the
+ * SWAPGS first thing brings in; the one last thing before either return
+ * gives the user back its GS base.
+ */
+__asm__(".global syscall_entry\n"
+        "syscall_entry:\n\t"
+        "swapgs\n\t"
+        "movq %rsp, %gs:" QUOTE(CSD_HEAD_USER_RSP) "\n\t"
+        "movq %gs:" QUOTE(CSD_HEAD_KERNEL_RSP) ", %rsp\n\t"
+        "pushq $" QUOTE(GDT_USER_DATA | 0x3) "\n\t"
+        "pushq %gs:" QUOTE(CSD_HEAD_USER_RSP) "\n\t"
+        "pushq %r11\n\t"
+        "pushq $" QUOTE(GDT_USER_TEXT | 0x3) "\n\t"
+        "pushq %rcx\n\t"
+        "pushq $0x0\n\t"
+        "pushq $" QUOTE(INTR_SYSCALL) "\n\t"
+        "pushq %rdi\n\t"
+        "pushq %rsi\n\t"
+        "pushq %rdx\n\t"
+        "pushq %rcx\n\t"
+        "pushq %rax\n\t"
+        "pushq %r8\n\t"
+        "pushq %r9\n\t"
+        "pushq %r10\n\t"
+        "pushq %r11\n\t"
+        "pushq %rbx\n\t"
+        "pushq %rbp\n\t"
+        "pushq %r12\n\t"
+        "pushq %r13\n\t"
+        "pushq %r14\n\t"
+        "pushq %r15\n\t"
+        "movq %rsp, %rdi\n\t"
+        "call syscall_fast_handler\n\t"
+        "cli\n\t"
+        "movq %rax, %rcx\n\t"
+        "popq %r15\n\t"
+        "popq %r14\n\t"
+        "popq %r13\n\t"
+        "popq %r12\n\t"
+        "popq %rbp\n\t"
+        "popq %rbx\n\t"
+        "popq %r11\n\t"
+        "popq %r10\n\t"
+        "popq %r9\n\t"
+        "popq %r8\n\t"
+        "popq %rax\n\t"
+        "jrcxz 1f\n\t"
+        "popq %rcx\n\t"
+        "popq %rdx\n\t"
+        "popq %rsi\n\t"
+        "popq %rdi\n\t"
+        "add $16, %rsp\n\t"
+        "swapgs\n\t"
+        "iretq\n"
+        "1:\n\t"
+        "popq %rcx\n\t"
+        "popq %rdx\n\t"
+        "popq %rsi\n\t"
+        "popq %rdi\n\t"
+        "movq 16(%rsp), %rcx\n\t"
+        "movq 32(%rsp), %r11\n\t"
+        "movq 40(%rsp), %rsp\n\t"
+        "swapgs\n\t"
+        "sysretq\n");
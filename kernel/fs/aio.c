@@ -0,0 +1,329 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/access.h"
+#include "api/syscall.h"
+#include "fs/aio.h"
+#include "fs/file.h"
+#include "fs/uio.h"
+#include "fs/vfs_syscall.h"
+#include "mm/kmalloc.h"
+#include "mm/slab.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "util/debug.h"
+
+/*
+ * Asynchronous I/O: aio_submit(2) hands reads and writes to AIO_WORKERS
+ * kernel threads and returns at once, and aio_reap(2) collects the results,
+ * so that a single thread can keep many requests in flight, each sleeping
+ * on the disk in a worker instead of in the caller.
+ *
+ * A request carries a reference on its file and a kernel buffer: a write's
+ * data is copied in when it is submitted, and a read's is copied out to the
+ * caller's buffer when it is reaped, by the process itself, since the
+ * workers do not run in its address space. The workers go through
+ * file_rw(), just as read(2) and write(2) do.
+ *
+ * Each process that submits anything gets an aio_ctx_t (p_aio) that
+ * counts its requests and collects the finished ones. aio_lock protects
+ * aio_queue and every context; it is only taken in thread context.
+ */
+
+typedef struct aio_ctx
+{
+    size_t ac_inflight; /* submitted and not yet reaped */
+    size_t ac_running;  /* taken by a worker and not yet finished */
+    list_t ac_done;     /* finished, in the order they finished */
+    ktqueue_t ac_waitq; /* the process, waiting for something to finish */
+} aio_ctx_t;
+
+typedef struct aio_req
+{
+    list_link_t ar_link; /* on aio_queue, then on its context's ac_done */
+    aio_ctx_t *ar_ctx;
+    file_t *ar_file; /* dropped once the transfer is done */
+    long ar_write;
+    void *ar_ubuf;
+    void *ar_kbuf;
+    size_t ar_nbytes;
+    off_t ar_offset;
+    uint64_t ar_user_data;
+    ssize_t ar_res;
+} aio_req_t;
+
+static list_t aio_queue = LIST_INITIALIZER(aio_queue);
+static ktqueue_t aio_workq;
+static spinlock_t aio_lock = SPINLOCK_INITIALIZER(aio_lock);
+static slab_allocator_t *aio_req_allocator;
+
+static void *aio_worker_run(long arg1, void *arg2)
+{
+    while (1)
+    {
+        spinlock_lock(&aio_lock);
+        while (list_empty(&aio_queue))
+        {
+            sched_sleep_on_locked(&aio_workq, &aio_lock);
+            spinlock_lock(&aio_lock);
+        }
+        aio_req_t *req = list_head(&aio_queue, aio_req_t, ar_link);
+        list_remove(&req->ar_link);
+        req->ar_ctx->ac_running++;
+        spinlock_unlock(&aio_lock);
+
+        iovec_t iov = {.iov_base = req->ar_kbuf, .iov_len = req->ar_nbytes};
+        req->ar_res =
+            file_rw(req->ar_file, &iov, 1, req->ar_offset, req->ar_write);
+        fput(&req->ar_file);
+
+        spinlock_lock(&aio_lock);
+        aio_ctx_t *ctx = req->ar_ctx;
+        ctx->ac_running--;
+        list_insert_tail(&ctx->ac_done, &req->ar_link);
+        sched_broadcast_on(&ctx->ac_waitq);
+        spinlock_unlock(&aio_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Starts the workers. Like the writeback daemon's, their process is a child
+ * of the idle process.
+ */
+void aio_init()
+{
+    sched_queue_init(&aio_workq);
+    aio_req_allocator = slab_allocator_create("aioreq", sizeof(aio_req_t));
+    KASSERT(aio_req_allocator);
+
+    proc_t *proc = proc_create("aio");
+    KASSERT(proc && "failed to create the aio process");
+    for (long i = 0; i < AIO_WORKERS; i++)
+    {
+        kthread_t *thr = kthread_create_daemon(proc, aio_worker_run, i, NULL);
+        KASSERT(thr && "failed to create an aio worker");
+        sched_make_runnable(thr);
+    }
+}
+
+static void aio_req_free(aio_req_t *req)
+{
+    if (req->ar_file)
+    {
+        fput(&req->ar_file);
+    }
+    kfree(req->ar_kbuf);
+    slab_obj_free(aio_req_allocator, req);
+}
+
+/* Makes the request sqe describes, for curproc. */
+static long aio_req_create(const aio_sqe_t *sqe, aio_req_t **reqp)
+{
+    if ((sqe->op != AIO_READ && sqe->op != AIO_WRITE) || sqe->offset < -1 ||
+        sqe->nbytes > ((size_t)-1 >> 1))
+    {
+        return -EINVAL;
+    }
+    aio_req_t *req = slab_obj_alloc(aio_req_allocator);
+    if (!req)
+    {
+        return -ENOMEM;
+    }
+    list_link_init(&req->ar_link);
+    req->ar_ctx = curproc->p_aio;
+    req->ar_write = sqe->op == AIO_WRITE;
+    req->ar_ubuf = sqe->buf;
+    req->ar_nbytes = sqe->nbytes;
+    req->ar_offset = sqe->offset;
+    req->ar_user_data = sqe->user_data;
+    req->ar_res = 0;
+    req->ar_kbuf = kmalloc(sqe->nbytes ? sqe->nbytes : 1);
+    req->ar_file = req->ar_kbuf ? fget(sqe->fd) : NULL;
+    long ret = !req->ar_kbuf ? -ENOMEM : !req->ar_file ? -EBADF : 0;
+    if (!ret && req->ar_write)
+    {
+        ret = copy_from_user(req->ar_kbuf, sqe->buf, sqe->nbytes);
+    }
+    if (ret < 0)
+    {
+        if (req->ar_kbuf)
+        {
+            aio_req_free(req);
+        }
+        else
+        {
+            slab_obj_free(aio_req_allocator, req);
+        }
+        return ret;
+    }
+    *reqp = req;
+    return 0;
+}
+
+/*
+ * Queue the nr requests described by the user array sqes for the workers.
+ *
+ * Return the number of requests queued, which is less than nr if one of them
+ * could not be (its error is then lost unless it was the first), or:
+ *  - EINVAL: nr is not positive, or a request has an unknown op, an offset
+ *    below -1, or a length that overflows an ssize_t
+ *  - EAGAIN: AIO_MAX_INFLIGHT requests are already in flight
+ *  - EBADF: a request's fd is not open
+ *  - EFAULT: sqes, or a write's buffer, cannot be read
+ *  - ENOMEM: a request could not be allocated
+ *  - ENOSYS: there are no workers
+ * Errors of the transfers themselves are reported by do_aio_reap().
+ */
+long do_aio_submit(const aio_sqe_t *sqes, int nr)
+{
+    if (!aio_req_allocator)
+    {
+        return -ENOSYS; /* no workers without the VFS */
+    }
+    if (nr <= 0)
+    {
+        return -EINVAL;
+    }
+    if (!curproc->p_aio)
+    {
+        aio_ctx_t *ctx = kmalloc(sizeof(aio_ctx_t));
+        if (!ctx)
+        {
+            return -ENOMEM;
+        }
+        ctx->ac_inflight = ctx->ac_running = 0;
+        list_init(&ctx->ac_done);
+        sched_queue_init(&ctx->ac_waitq);
+        curproc->p_aio = ctx;
+    }
+    aio_ctx_t *ctx = curproc->p_aio;
+
+    long ret = 0;
+    int i;
+    for (i = 0; i < nr; i++)
+    {
+        aio_sqe_t sqe;
+        aio_req_t *req;
+        if (ctx->ac_inflight >= AIO_MAX_INFLIGHT)
+        {
+            ret = -EAGAIN;
+            break;
+        }
+        if ((ret = copy_from_user(&sqe, &sqes[i], sizeof(sqe))) < 0 ||
+            (ret = aio_req_create(&sqe, &req)) < 0)
+        {
+            break;
+        }
+        spinlock_lock(&aio_lock);
+        ctx->ac_inflight++;
+        list_insert_tail(&aio_queue, &req->ar_link);
+        sched_wakeup_on(&aio_workq, NULL);
+        spinlock_unlock(&aio_lock);
+    }
+    return i ? i : ret;
+}
+
+/*
+ * Wait until at least min_nr of curproc's requests have finished (fewer if
+ * fewer are in flight), then report up to nr of the finished ones into the
+ * user array cqes, in the order they finished. A read's data is copied out
+ * to its buffer here.
+ *
+ * Return the number of completions reported, or:
+ *  - EINVAL: nr is not positive, or min_nr is negative or more than nr
+ *  - EFAULT: cqes cannot be written, for the first completion
+ */
+long do_aio_reap(aio_cqe_t *cqes, int min_nr, int nr)
+{
+    if (nr <= 0 || min_nr < 0 || min_nr > nr)
+    {
+        return -EINVAL;
+    }
+    aio_ctx_t *ctx = curproc->p_aio;
+    if (!ctx)
+    {
+        return 0;
+    }
+
+    int got = 0;
+    while (got < nr)
+    {
+        spinlock_lock(&aio_lock);
+        while (list_empty(&ctx->ac_done) && got < min_nr && ctx->ac_inflight)
+        {
+            sched_sleep_on_locked(&ctx->ac_waitq, &aio_lock);
+            spinlock_lock(&aio_lock);
+        }
+        if (list_empty(&ctx->ac_done))
+        {
+            spinlock_unlock(&aio_lock);
+            break;
+        }
+        aio_req_t *req = list_head(&ctx->ac_done, aio_req_t, ar_link);
+        list_remove(&req->ar_link);
+        ctx->ac_inflight--;
+        spinlock_unlock(&aio_lock);
+
+        aio_cqe_t cqe = {.user_data = req->ar_user_data, .res = req->ar_res};
+        if (!req->ar_write && cqe.res > 0)
+        {
+            long err = copy_to_user(req->ar_ubuf, req->ar_kbuf, (size_t)cqe.res);
+            cqe.res = err < 0 ? err : cqe.res;
+        }
+        aio_req_free(req);
+        long ret = copy_to_user(&cqes[got], &cqe, sizeof(cqe));
+        if (ret < 0)
+        {
+            return got ? got : ret;
+        }
+        got++;
+    }
+    return got;
+}
+
+/*
+ * Called as proc exits, by proc itself. Requests the workers have not got to
+ * are dropped, those they are carrying out are waited for, and everything
+ * is freed.
+ */
+void aio_proc_exit(proc_t *proc)
+{
+    aio_ctx_t *ctx = proc->p_aio;
+    if (!ctx)
+    {
+        return;
+    }
+    list_t dropped = LIST_INITIALIZER(dropped);
+    spinlock_lock(&aio_lock);
+    list_iterate(&aio_queue, req, aio_req_t, ar_link)
+    {
+        if (req->ar_ctx == ctx)
+        {
+            list_remove(&req->ar_link);
+            list_insert_tail(&dropped, &req->ar_link);
+        }
+    }
+    while (ctx->ac_running)
+    {
+        sched_sleep_on_locked(&ctx->ac_waitq, &aio_lock);
+        spinlock_lock(&aio_lock);
+    }
+    spinlock_unlock(&aio_lock);
+
+    list_iterate(&dropped, req, aio_req_t, ar_link)
+    {
+        list_remove(&req->ar_link);
+        aio_req_free(req);
+    }
+    list_iterate(&ctx->ac_done, req, aio_req_t, ar_link)
+    {
+        list_remove(&req->ar_link);
+        aio_req_free(req);
+    }
+    kfree(ctx);
+    proc->p_aio = NULL;
+}
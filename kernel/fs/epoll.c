@@ -0,0 +1,528 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+#include "fs/epoll.h"
+#include "fs/fdtable.h"
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "mm/slab.h"
+#include "proc/sched.h"
+#include "util/debug.h"
+#include "util/rbtree.h"
+#include "util/string.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/*
+ * epoll: unlike poll(2), which registers on every file it is given and
+ * checks them all on every call, an epoll instance registers on each file
+ * it watches once, when the file is added, through the same vn_ops->poll
+ * and pollq_t (see fs/poll.h). A wakeup of the file's pollq puts its item
+ * on the instance's ready list, so that epoll_wait(2) only looks at the
+ * files that may be ready, however many are watched.
+ *
+ * A ready item is checked again by epoll_wait, and reported if it is still
+ * ready for an event it is watched for. A level-triggered item that is
+ * goes back on the ready list, and is checked again by the next wait; one
+ * that is not waits for its next wakeup.
+ *
+ * Items do not hold a reference on their file: a file that is closed for
+ * the last time takes itself out of every instance watching it (see
+ * epoll_file_closed), through the items on its f_epitems. Instances cannot
+ * watch each other.
+ *
+ * The ready lists are changed by wakeups, which may come from interrupt
+ * context, so they are only touched at IPL_HIGH, which is also held while
+ * ready items are checked, as vn_ops->poll expects. Everything else about
+ * every instance is protected by epoll_mutex, which is not held while
+ * waiting. One mutex for all of them lets a file being closed find the
+ * instances watching it without their going away underneath.
+ */
+
+typedef struct eventpoll
+{
+    rbtree_t ep_items;  /* epitem_t, by fd and then file */
+    list_t ep_ready;    /* epitem_t that may be ready */
+    ktqueue_t ep_waitq; /* threads in epoll_wait */
+    pollq_t ep_pollq;   /* callers of poll(2) on the instance itself */
+} eventpoll_t;
+
+typedef struct epitem
+{
+    rb_node_t ei_node;
+    int ei_fd;
+    file_t *ei_file;
+    uint32_t ei_events; /* watched, with EPOLLET and EPOLLONESHOT */
+    uint64_t ei_data;
+    eventpoll_t *ei_ep;
+    poll_table_t ei_table;    /* what the file's poll registers through */
+    poll_entry_t ei_entry;    /* on ei_pollq, if the file has one */
+    pollq_t *ei_pollq;
+    list_link_t ei_ready_link; /* on ep_ready */
+    list_link_t ei_file_link;  /* on the file's f_epitems */
+} epitem_t;
+
+/* The events an item is checked for: those poll knows */
+#define EPOLL_EVENTS(ei) ((short)((ei)->ei_events & 0xffff))
+
+static void epoll_read_vnode(fs_t *fs, vnode_t *vnode);
+
+static void epoll_delete_vnode(fs_t *fs, vnode_t *vnode);
+
+static fs_ops_t epoll_fsops = {.read_vnode = epoll_read_vnode,
+                               .delete_vnode = epoll_delete_vnode,
+                               .umount = NULL};
+
+/* Like pipes, instances go away with their last file */
+static fs_t epoll_fs = {.fs_dev = "epoll",
+                        .fs_type = "epoll",
+                        .fs_ops = &epoll_fsops,
+                        .fs_root = NULL,
+                        .fs_i = NULL,
+                        .vnode_list = LIST_INITIALIZER(epoll_fs.vnode_list),
+                        .vnode_list_mutex =
+                            KMUTEX_INITIALIZER(epoll_fs.vnode_list_mutex),
+                        .fs_vnode_nocache = 1};
+
+static long epoll_stat(vnode_t *vnode, stat_t *ss);
+
+static long epoll_poll(vnode_t *vnode, file_t *file, long events,
+                       poll_table_t *pt);
+
+static vnode_ops_t epoll_vops = {
+    .read = NULL,
+    .write = NULL,
+    .mmap = NULL,
+    .stat = epoll_stat,
+    .poll = epoll_poll,
+};
+
+#define VNODE_TO_EP(vn) ((eventpoll_t *)((vn)->vn_i))
+
+static kmutex_t epoll_mutex = KMUTEX_INITIALIZER(epoll_mutex);
+static slab_allocator_t *epoll_allocator;
+static slab_allocator_t *epitem_allocator;
+static int next_epno = 0;
+
+void epoll_init()
+{
+    epoll_allocator = slab_allocator_create("eventpoll", sizeof(eventpoll_t));
+    epitem_allocator = slab_allocator_create("epitem", sizeof(epitem_t));
+    KASSERT(epoll_allocator && epitem_allocator);
+    epoll_fs.fs_vnode_allocator = slab_allocator_create_ctor(
+        "epoll_vnode", sizeof(vnode_t), vnode_ctor, NULL);
+    KASSERT(epoll_fs.fs_vnode_allocator);
+}
+
+static void epoll_read_vnode(fs_t *fs, vnode_t *vnode)
+{
+    vnode->vn_ops = &epoll_vops;
+    vnode->vn_mode = 0;
+    vnode->vn_len = 0;
+    vnode->vn_i = NULL;
+}
+
+/* Finds the item for fd and file in ep, or returns NULL and, if parentp is
+ * set, where one would be inserted (see rbtree.h). */
+static epitem_t *_ep_find(eventpoll_t *ep, int fd, file_t *file,
+                          rb_node_t **parentp, rb_node_t ***linkp)
+{
+    rb_node_t *parent = NULL, **link = &ep->ep_items.rbt_root;
+    while (*link)
+    {
+        parent = *link;
+        epitem_t *ei = rb_entry(parent, epitem_t, ei_node);
+        if (fd == ei->ei_fd && file == ei->ei_file)
+        {
+            return ei;
+        }
+        long left = fd != ei->ei_fd ? fd < ei->ei_fd
+                                    : (uintptr_t)file < (uintptr_t)ei->ei_file;
+        link = left ? &parent->rb_left : &parent->rb_right;
+    }
+    if (parentp)
+    {
+        *parentp = parent;
+        *linkp = link;
+    }
+    return NULL;
+}
+
+/* Puts ei on the ready list, if it is not there, and wakes the waiters.
+ * Called at IPL_HIGH. */
+static void _ep_make_ready(epitem_t *ei)
+{
+    eventpoll_t *ep = ei->ei_ep;
+    if (!list_link_is_linked(&ei->ei_ready_link) && EPOLL_EVENTS(ei))
+    {
+        list_insert_tail(&ep->ep_ready, &ei->ei_ready_link);
+        sched_broadcast_on(&ep->ep_waitq);
+        pollq_wakeup(&ep->ep_pollq);
+    }
+}
+
+static void _ep_wake(poll_entry_t *pe)
+{
+    _ep_make_ready(CONTAINER_OF(pe, epitem_t, ei_entry));
+}
+
+/* The pt_register of an item: entered on the first pollq it is given */
+static void _ep_register(poll_table_t *pt, pollq_t *pq)
+{
+    epitem_t *ei = CONTAINER_OF(pt, epitem_t, ei_table);
+    if (!ei->ei_pollq)
+    {
+        ei->ei_pollq = pq;
+        ei->ei_entry.pe_wake = _ep_wake;
+        pollq_add(pq, &ei->ei_entry);
+    }
+}
+
+/* Checks ei, registering on its file if pt is set, and puts it on the
+ * ready list if the file is ready. */
+static void _ep_check(epitem_t *ei, poll_table_t *pt)
+{
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    if (poll_file(ei->ei_file, EPOLL_EVENTS(ei), pt))
+    {
+        _ep_make_ready(ei);
+    }
+    intr_setipl(old_ipl);
+}
+
+/* Takes ei out of ep and off its file, and frees it. epoll_mutex is
+ * held. */
+static void _ep_remove(eventpoll_t *ep, epitem_t *ei)
+{
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    if (ei->ei_pollq)
+    {
+        pollq_remove(&ei->ei_entry);
+    }
+    if (list_link_is_linked(&ei->ei_ready_link))
+    {
+        list_remove(&ei->ei_ready_link);
+    }
+    intr_setipl(old_ipl);
+    rbtree_remove(&ep->ep_items, &ei->ei_node);
+    list_remove(&ei->ei_file_link);
+    slab_obj_free(epitem_allocator, ei);
+}
+
+static void epoll_delete_vnode(fs_t *fs, vnode_t *vnode)
+{
+    eventpoll_t *ep = VNODE_TO_EP(vnode);
+    if (!ep)
+    {
+        return;
+    }
+    kmutex_lock(&epoll_mutex);
+    while (ep->ep_items.rbt_root)
+    {
+        _ep_remove(ep, rb_entry(ep->ep_items.rbt_root, epitem_t, ei_node));
+    }
+    kmutex_unlock(&epoll_mutex);
+    slab_obj_free(epoll_allocator, ep);
+}
+
+/*
+ * Called by fput as the last reference on file goes: takes it out of every
+ * instance watching it.
+ */
+void epoll_file_closed(file_t *file)
+{
+    if (list_empty(&file->f_epitems))
+    {
+        return;
+    }
+    kmutex_lock(&epoll_mutex);
+    list_iterate(&file->f_epitems, ei, epitem_t, ei_file_link)
+    {
+        _ep_remove(ei->ei_ep, ei);
+    }
+    kmutex_unlock(&epoll_mutex);
+}
+
+/*
+ * An implementation of the epoll_create(2) system call: makes an instance
+ * watching nothing, and opens it as the lowest free descriptor.
+ *
+ * Returns the descriptor, or:
+ *  - EMFILE: all descriptors are open
+ *  - ENOMEM: out of memory
+ */
+int do_epoll_create(void)
+{
+    int fd;
+    long ret = fdtable_alloc(&curproc->p_fdtable, &fd);
+    if (ret)
+    {
+        return (int)ret;
+    }
+    eventpoll_t *ep = slab_obj_alloc(epoll_allocator);
+    if (!ep)
+    {
+        return -ENOMEM;
+    }
+    rbtree_init(&ep->ep_items, NULL);
+    list_init(&ep->ep_ready);
+    sched_queue_init(&ep->ep_waitq);
+    pollq_init(&ep->ep_pollq);
+
+    vnode_t *vnode = vget(&epoll_fs, next_epno++);
+    KASSERT(!vnode->vn_i);
+    vnode->vn_i = ep;
+    // As with pipes, the descriptor table holds the file's reference, and
+    // the file the vnode's
+    ret = fcreate(fd, vnode, FMODE_READ) ? fd : -ENOMEM;
+    vput(&vnode);
+    return (int)ret;
+}
+
+/* Gets the instance open as epfd in *epp, with a reference on its file in
+ * *filep. Returns 0, -EBADF if epfd is not open, or -EINVAL if it is not an
+ * epoll instance. */
+static long _ep_get(int epfd, eventpoll_t **epp, file_t **filep)
+{
+    file_t *file = fget(epfd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    if (file->f_vnode->vn_fs != &epoll_fs)
+    {
+        fput(&file);
+        return -EINVAL;
+    }
+    *filep = file;
+    *epp = VNODE_TO_EP(file->f_vnode);
+    return 0;
+}
+
+/*
+ * An implementation of the epoll_ctl(2) system call: adds (EPOLL_CTL_ADD)
+ * the file open as fd to the instance open as epfd, watched for the events
+ * of *event and reported with its data, changes what it is watched for
+ * (EPOLL_CTL_MOD), or removes it (EPOLL_CTL_DEL). event is a kernel copy,
+ * unused by EPOLL_CTL_DEL.
+ *
+ * Returns 0, or:
+ *  - EBADF: epfd or fd is not open
+ *  - EINVAL: epfd is not an epoll instance, fd is one, or op is unknown
+ *  - EEXIST: EPOLL_CTL_ADD, and fd is watched already
+ *  - ENOENT: EPOLL_CTL_MOD or EPOLL_CTL_DEL, and fd is not watched
+ *  - ENOMEM: out of memory
+ */
+long do_epoll_ctl(int epfd, int op, int fd, const epoll_event_t *event)
+{
+    file_t *epfile, *file;
+    eventpoll_t *ep;
+    long ret = _ep_get(epfd, &ep, &epfile);
+    if (ret)
+    {
+        return ret;
+    }
+    if (!(file = fget(fd)))
+    {
+        fput(&epfile);
+        return -EBADF;
+    }
+
+    rb_node_t *parent, **link;
+    kmutex_lock(&epoll_mutex);
+    epitem_t *ei = _ep_find(ep, fd, file, &parent, &link);
+    if (file->f_vnode->vn_fs == &epoll_fs ||
+        (op != EPOLL_CTL_ADD && op != EPOLL_CTL_MOD && op != EPOLL_CTL_DEL))
+    {
+        ret = -EINVAL;
+    }
+    else if (op == EPOLL_CTL_ADD && ei)
+    {
+        ret = -EEXIST;
+    }
+    else if (op != EPOLL_CTL_ADD && !ei)
+    {
+        ret = -ENOENT;
+    }
+    else if (op == EPOLL_CTL_DEL)
+    {
+        _ep_remove(ep, ei);
+    }
+    else if (op == EPOLL_CTL_MOD)
+    {
+        ei->ei_events = event->events;
+        ei->ei_data = event->data;
+        _ep_check(ei, NULL);
+    }
+    else if (!(ei = slab_obj_alloc(epitem_allocator)))
+    {
+        ret = -ENOMEM;
+    }
+    else
+    {
+        memset(ei, 0, sizeof(*ei));
+        ei->ei_fd = fd;
+        ei->ei_file = file;
+        ei->ei_events = event->events;
+        ei->ei_data = event->data;
+        ei->ei_ep = ep;
+        ei->ei_table.pt_register = _ep_register;
+        list_link_init(&ei->ei_ready_link);
+        list_link_init(&ei->ei_file_link);
+        rbtree_insert(&ep->ep_items, parent, link, &ei->ei_node);
+        list_insert_tail(&file->f_epitems, &ei->ei_file_link);
+        _ep_check(ei, &ei->ei_table);
+    }
+    kmutex_unlock(&epoll_mutex);
+    // With the mutex dropped, in case these are the last references
+    fput(&file);
+    fput(&epfile);
+    return ret;
+}
+
+/*
+ * Reports up to max of the items on ep's ready list that are ready into
+ * events, putting the level-triggered ones back on the list. epoll_mutex
+ * is held. Returns the number reported.
+ */
+static int _ep_collect(eventpoll_t *ep, epoll_event_t *events, int max)
+{
+    int n = 0;
+    list_t again = LIST_INITIALIZER(again);
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    while (n < max && !list_empty(&ep->ep_ready))
+    {
+        epitem_t *ei = list_head(&ep->ep_ready, epitem_t, ei_ready_link);
+        list_remove(&ei->ei_ready_link);
+        short revents = poll_file(ei->ei_file, EPOLL_EVENTS(ei), NULL);
+        if (!revents)
+        {
+            continue;
+        }
+        events[n].events = (uint32_t)revents;
+        events[n].data = ei->ei_data;
+        n++;
+        if (ei->ei_events & EPOLLONESHOT)
+        {
+            ei->ei_events &= EPOLLONESHOT | EPOLLET;
+        }
+        else if (!(ei->ei_events & EPOLLET))
+        {
+            list_insert_tail(&again, &ei->ei_ready_link);
+        }
+    }
+    list_iterate(&again, ei, epitem_t, ei_ready_link)
+    {
+        list_remove(&ei->ei_ready_link);
+        list_insert_tail(&ep->ep_ready, &ei->ei_ready_link);
+    }
+    intr_setipl(old_ipl);
+    return n;
+}
+
+/* A timeout of epoll_wait; waking every waiter on the instance is harmless,
+ * since they all look for themselves */
+typedef struct epoll_timeout
+{
+    eventpoll_t *et_ep;
+    long et_expired;
+} epoll_timeout_t;
+
+static void epoll_timer_fire(uint64_t data)
+{
+    epoll_timeout_t *et = (epoll_timeout_t *)data;
+    et->et_expired = 1;
+    sched_broadcast_on(&et->et_ep->ep_waitq);
+}
+
+/*
+ * An implementation of the epoll_wait(2) system call: waits until some of
+ * the files the instance open as epfd watches are ready, or timeout
+ * milliseconds have passed (forever if timeout is negative), and reports up
+ * to maxevents of them into events, a kernel buffer.
+ *
+ * Returns the number of events reported, 0 on timeout, or:
+ *  - EBADF: epfd is not open
+ *  - EINVAL: epfd is not an epoll instance, or maxevents is not positive
+ *  - EINTR: the thread was cancelled while waiting
+ */
+long do_epoll_wait(int epfd, epoll_event_t *events, int maxevents,
+                   int timeout)
+{
+    file_t *file;
+    eventpoll_t *ep;
+    long ret = _ep_get(epfd, &ep, &file);
+    if (ret)
+    {
+        return ret;
+    }
+    if (maxevents <= 0)
+    {
+        fput(&file);
+        return -EINVAL;
+    }
+
+    epoll_timeout_t et = {.et_ep = ep, .et_expired = 0};
+    timer_t timer;
+    timer_init(&timer);
+    if (timeout > 0)
+    {
+        // jiffies are roughly milliseconds, see util/time.c
+        timer.function = epoll_timer_fire;
+        timer.data = (uint64_t)&et;
+        timer.expires = jiffies + (uint64_t)timeout;
+        timer_add(&timer);
+    }
+
+    kmutex_lock(&epoll_mutex);
+    while (!(ret = _ep_collect(ep, events, maxevents)) && timeout &&
+           !et.et_expired)
+    {
+        // Nothing can be made ready between the check and the sleep
+        uint8_t old_ipl = intr_setipl(IPL_HIGH);
+        kmutex_unlock(&epoll_mutex);
+        long err = list_empty(&ep->ep_ready) && !et.et_expired
+                       ? sched_cancellable_sleep_on(&ep->ep_waitq)
+                       : 0;
+        intr_setipl(old_ipl);
+        kmutex_lock(&epoll_mutex);
+        if (err)
+        {
+            ret = err;
+            break;
+        }
+    }
+    kmutex_unlock(&epoll_mutex);
+
+    if (timeout > 0)
+    {
+        timer_del(&timer);
+    }
+    fput(&file);
+    return ret;
+}
+
+static long epoll_stat(vnode_t *vnode, stat_t *ss)
+{
+    memset(ss, 0, sizeof(stat_t));
+    ss->st_mode = vnode->vn_mode;
+    ss->st_ino = (int)vnode->vn_vno;
+    ss->st_nlink = 1;
+    return 0;
+}
+
+/* An instance is readable while it has items that may be ready. */
+static long epoll_poll(vnode_t *vnode, file_t *file, long events,
+                       poll_table_t *pt)
+{
+    eventpoll_t *ep = VNODE_TO_EP(vnode);
+    poll_wait(pt, &ep->ep_pollq);
+    return list_empty(&ep->ep_ready) ? 0 : POLLIN;
+}
@@ -0,0 +1,205 @@
+#include "fs/fdtable.h"
+#include "config.h"
+#include "errno.h"
+#include "fs/file.h"
+#include "kernel.h"
+#include "mm/kmalloc.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+#define FDT_WORD_BITS 64
+#define FDT_WORDS(size) (((size) + FDT_WORD_BITS - 1) / FDT_WORD_BITS)
+
+static fdtable_t *_fdtable_new(int size)
+{
+    fdtable_t *fdt = kmalloc(sizeof(fdtable_t));
+    if (!fdt)
+    {
+        return NULL;
+    }
+    fdt->fdt_refcount = 1;
+    fdt->fdt_size = size;
+    fdt->fdt_files = kmalloc(sizeof(file_t *) * (size_t)size);
+    fdt->fdt_used = kmalloc(sizeof(uint64_t) * FDT_WORDS(size));
+    if (!fdt->fdt_files || !fdt->fdt_used)
+    {
+        if (fdt->fdt_files)
+            kfree(fdt->fdt_files);
+        if (fdt->fdt_used)
+            kfree(fdt->fdt_used);
+        kfree(fdt);
+        return NULL;
+    }
+    memset(fdt->fdt_files, 0, sizeof(file_t *) * (size_t)size);
+    memset(fdt->fdt_used, 0, sizeof(uint64_t) * FDT_WORDS(size));
+    return fdt;
+}
+
+static void _fdtable_free(fdtable_t *fdt)
+{
+    kfree(fdt->fdt_files);
+    kfree(fdt->fdt_used);
+    kfree(fdt);
+}
+
+/*
+ * Returns the file open as fd in fdt, which may be NULL for a process that
+ * has never opened anything, or NULL if there is none. No reference is
+ * taken; see fget().
+ */
+file_t *fdtable_lookup(fdtable_t *fdt, int fd)
+{
+    if (!fdt || fd < 0 || fd >= fdt->fdt_size)
+    {
+        return NULL;
+    }
+    return fdt->fdt_files[fd];
+}
+
+/*
+ * Gets *fdtp ready to be changed at descriptor fd, which is less than
+ * NFILES: makes the table if there is none yet, copies it if it is shared
+ * (taking a reference on each file for the copy), and grows it, doubling,
+ * until fd fits. Afterwards *fdtp is the process's own, and fdtable_install
+ * can put a file at fd.
+ *
+ * Returns 0, or -ENOMEM with *fdtp as it was.
+ */
+long fdtable_reserve(fdtable_t **fdtp, int fd)
+{
+    KASSERT(fd >= 0 && fd < NFILES);
+    fdtable_t *old = *fdtp;
+    int size = old ? old->fdt_size : FDTABLE_INIT_SIZE;
+    while (size <= fd)
+    {
+        size = MIN(2 * size, NFILES);
+    }
+    if (old && old->fdt_refcount == 1 && size == old->fdt_size)
+    {
+        return 0;
+    }
+
+    fdtable_t *fdt = _fdtable_new(size);
+    if (!fdt)
+    {
+        return -ENOMEM;
+    }
+    if (old)
+    {
+        memcpy(fdt->fdt_files, old->fdt_files,
+               sizeof(file_t *) * (size_t)old->fdt_size);
+        memcpy(fdt->fdt_used, old->fdt_used,
+               sizeof(uint64_t) * FDT_WORDS(old->fdt_size));
+        if (old->fdt_refcount > 1)
+        {
+            for (int i = 0; i < old->fdt_size; i++)
+            {
+                if (old->fdt_files[i])
+                {
+                    fref(old->fdt_files[i]);
+                }
+            }
+            old->fdt_refcount--;
+        }
+        else
+        {
+            // The references move over with the entries
+            _fdtable_free(old);
+        }
+    }
+    *fdtp = fdt;
+    return 0;
+}
+
+/*
+ * Finds the lowest descriptor that is not open and reserves it (see
+ * fdtable_reserve). Returns 0 with *fd set to it, or, with *fd -1:
+ *  - EMFILE: all NFILES descriptors are open
+ *  - ENOMEM: the table could not be copied or grown
+ */
+long fdtable_alloc(fdtable_t **fdtp, int *fd)
+{
+    fdtable_t *fdt = *fdtp;
+    int free = fdt ? fdt->fdt_size : 0;
+    for (int w = 0; fdt && w < FDT_WORDS(fdt->fdt_size); w++)
+    {
+        if (~fdt->fdt_used[w])
+        {
+            free = w * FDT_WORD_BITS + __builtin_ctzll(~fdt->fdt_used[w]);
+            break;
+        }
+    }
+    long ret = free < NFILES ? fdtable_reserve(fdtp, free) : -EMFILE;
+    *fd = ret ? -1 : free;
+    return ret;
+}
+
+/*
+ * Puts file, whose reference the table takes over, at descriptor fd of fdt,
+ * which must have been reserved and must not be open.
+ */
+void fdtable_install(fdtable_t *fdt, int fd, file_t *file)
+{
+    KASSERT(fdt && fdt->fdt_refcount == 1);
+    KASSERT(fd >= 0 && fd < fdt->fdt_size && !fdt->fdt_files[fd]);
+    fdt->fdt_files[fd] = file;
+    fdt->fdt_used[fd / FDT_WORD_BITS] |= 1UL << (fd % FDT_WORD_BITS);
+}
+
+/*
+ * Closes descriptor fd of *fdtp, copying the table first if it is shared.
+ * On success, *filep is set to the file that was open there, whose reference
+ * passes to the caller.
+ *
+ * Returns 0, or:
+ *  - EBADF: fd is not open
+ *  - ENOMEM: the table could not be copied
+ */
+long fdtable_remove(fdtable_t **fdtp, int fd, file_t **filep)
+{
+    if (!fdtable_lookup(*fdtp, fd))
+    {
+        return -EBADF;
+    }
+    long ret = fdtable_reserve(fdtp, fd);
+    if (ret)
+    {
+        return ret;
+    }
+    fdtable_t *fdt = *fdtp;
+    *filep = fdt->fdt_files[fd];
+    fdt->fdt_files[fd] = NULL;
+    fdt->fdt_used[fd / FDT_WORD_BITS] &= ~(1UL << (fd % FDT_WORD_BITS));
+    return 0;
+}
+
+/* Takes a reference on fdt, if there is one, for a new process to share it,
+ * and returns it. */
+fdtable_t *fdtable_share(fdtable_t *fdt)
+{
+    if (fdt)
+    {
+        fdt->fdt_refcount++;
+    }
+    return fdt;
+}
+
+/* Drops the reference on *fdtp, if there is one, setting it to NULL. The last
+ * puts every file that is still open in the table. */
+void fdtable_put(fdtable_t **fdtp)
+{
+    fdtable_t *fdt = *fdtp;
+    *fdtp = NULL;
+    if (!fdt || --fdt->fdt_refcount)
+    {
+        return;
+    }
+    for (int i = 0; i < fdt->fdt_size; i++)
+    {
+        if (fdt->fdt_files[i])
+        {
+            fput(&fdt->fdt_files[i]);
+        }
+    }
+    _fdtable_free(fdt);
+}
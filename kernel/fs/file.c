@@ -1,3 +1,5 @@
+#include "fs/epoll.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -32,40 +34,43 @@ void fref(file_t *f)
 
 /*
  * Create a file, initialize its members, vref the vnode, call acquire() on the
- * vnode if the function pointer is non-NULL, and set the file descriptor in
- * curproc->p_files.
+ * vnode if the function pointer is non-NULL, and install it as fd in
+ * curproc's descriptor table, where fd must have been reserved (see
+ * get_empty_fd).
  *
  * On successful return, the vnode's refcount should be incremented by one,
- * the file's refcount should be 1, and curproc->p_files[fd] should point to
- * the file being returned.
+ * the file's refcount should be 1, and fd should refer to the file being
+ * returned.
  */
 file_t *fcreate(int fd, vnode_t *vnode, unsigned int mode)
 {
-    KASSERT(!curproc->p_files[fd]);
+    KASSERT(!fdtable_lookup(curproc->p_fdtable, fd));
     file_t *file = slab_obj_alloc(file_allocator);
     if (!file)
         return NULL;
     memset(file, 0, sizeof(file_t));
     file->f_mode = mode;
+    kmutex_init(&file->f_pos_mutex);
+    list_init(&file->f_epitems);
 
     vref(file->f_vnode = vnode);
     if (vnode->vn_ops->acquire)
         vnode->vn_ops->acquire(vnode, file);
 
-    curproc->p_files[fd] = file;
+    fdtable_install(curproc->p_fdtable, fd, file);
     fref(file);
     return file;
 }
 
 /*
- * Perform bounds checking on the fd, use curproc->p_files to get the file,
+ * Perform bounds checking on the fd, use curproc->p_fdtable to get the file,
  * fref it if it exists, and return.
  */
 file_t *fget(int fd)
 {
     if (fd < 0 || fd >= NFILES)
         return NULL;
-    file_t *file = curproc->p_files[fd];
+    file_t *file = fdtable_lookup(curproc->p_fdtable, fd);
     if (file)
         fref(file);
     return file;
@@ -103,6 +108,7 @@ void fput(file_t **filep)
 
     if (!file->f_refcount)
     {
+        epoll_file_closed(file);
         if (file->f_vnode)
         {
             vlock(file->f_vnode);
@@ -113,3 +119,32 @@ void fput(file_t **filep)
         slab_obj_free(file_allocator, file);
     }
 }
+
+/*
+ * Called by read(2) before it reads len bytes from file's current position.
+ * If the read continues the previous one, widens the read-ahead window and
+ * asks the vnode to prefetch the pages the read covers plus the window, so
+ * that consecutive blocks come in together rather than one per read. Any
+ * other read closes the window.
+ *
+ * The caller holds file's f_pos_mutex and the vnode's vn_rwlock shared.
+ */
+void file_readahead(file_t *file, size_t len)
+{
+    vnode_t *vn = file->f_vnode;
+    if (file->f_pos != file->f_ra_next)
+    {
+        file->f_ra_pages = 0;
+        return;
+    }
+    file->f_ra_pages = file->f_ra_pages
+                           ? MIN(2 * file->f_ra_pages, FILE_RA_MAX_PAGES)
+                           : FILE_RA_INIT_PAGES;
+    if (!len || !vn->vn_ops->readahead || file->f_pos >= vn->vn_len)
+    {
+        return;
+    }
+    size_t first = ADDR_TO_PN(file->f_pos);
+    size_t last = ADDR_TO_PN(file->f_pos + len - 1) + file->f_ra_pages;
+    vn->vn_ops->readahead(vn, first, last - first + 1);
+}
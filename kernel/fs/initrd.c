@@ -0,0 +1,173 @@
+#include "fs/initrd.h"
+#include "boot/config.h"
+#include "errno.h"
+#include "fs/fcntl.h"
+#include "fs/vfs_syscall.h"
+#include "kernel.h"
+#include "mm/page.h"
+#include "multiboot.h"
+#include "util/debug.h"
+#include "util/string.h"
+#include <boot/multiboot_macros.h>
+
+#define CPIO_MAGIC "070701"
+#define CPIO_HEADER_LEN 110
+#define CPIO_TRAILER "TRAILER!!!"
+#define CPIO_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+/* cpio mode bits */
+#define CPIO_S_IFMT 0170000
+#define CPIO_S_IFDIR 0040000
+#define CPIO_S_IFREG 0100000
+
+/* The header's fields, each eight hex digits after the magic */
+#define CPIO_MODE 1
+#define CPIO_FILESIZE 6
+#define CPIO_NAMESIZE 11
+
+/* Returns the first module the boot loader passed, or NULL */
+static struct multiboot_tag_module *initrd_module()
+{
+    for (struct multiboot_tag *tag =
+             (struct multiboot_tag *)((uintptr_t)(mb_tag + 1) + PHYS_OFFSET);
+         tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
+    {
+        if (tag->type == MULTIBOOT_TAG_TYPE_MODULE)
+        {
+            return (struct multiboot_tag_module *)tag;
+        }
+    }
+    return NULL;
+}
+
+long initrd_present() { return initrd_module() != NULL; }
+
+/* Returns field i of the header at hdr */
+static size_t initrd_field(const char *hdr, long i)
+{
+    const char *p = hdr + sizeof(CPIO_MAGIC) - 1 + 8 * i;
+    size_t val = 0;
+    for (long j = 0; j < 8; j++)
+    {
+        char c = p[j];
+        val = val * 16 + (c >= 'a' ? c - 'a' + 10
+                          : c >= 'A' ? c - 'A' + 10
+                                     : c - '0');
+    }
+    return val;
+}
+
+/* Makes the regular file path holding the len bytes at data */
+static long initrd_write_file(const char *path, const char *data, size_t len)
+{
+    long fd = do_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0)
+    {
+        return fd;
+    }
+    long ret = 0;
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = do_write((int)fd, data + done, len - done);
+        if (n <= 0)
+        {
+            ret = n ? n : -ENOSPC;
+            break;
+        }
+        done += n;
+    }
+    do_close((int)fd);
+    return ret;
+}
+
+long initrd_unpack()
+{
+    static long unpacked;
+    struct multiboot_tag_module *mod = initrd_module();
+    if (!mod || unpacked)
+    {
+        return -ENOENT;
+    }
+    unpacked = 1;
+    const char *start = (const char *)(PHYS_OFFSET + mod->mod_start);
+    const char *end = (const char *)(PHYS_OFFSET + mod->mod_end);
+
+    long made = 0;
+    const char *p = start;
+    char path[MAXPATHLEN];
+    while (1)
+    {
+        if (end - p < CPIO_HEADER_LEN ||
+            memcmp(p, CPIO_MAGIC, sizeof(CPIO_MAGIC) - 1))
+        {
+            dbg(DBG_VFS, "initrd: bad header at offset %lu\n",
+                (size_t)(p - start));
+            return -EINVAL;
+        }
+        size_t mode = initrd_field(p, CPIO_MODE);
+        size_t filesize = initrd_field(p, CPIO_FILESIZE);
+        size_t namesize = initrd_field(p, CPIO_NAMESIZE);
+        const char *name = p + CPIO_HEADER_LEN;
+        /* the name and the data are each padded to four bytes */
+        const char *data = start + CPIO_ALIGN((size_t)(name + namesize - start));
+        p = start + CPIO_ALIGN((size_t)(data + filesize - start));
+        if (!namesize || data > end || (size_t)(end - data) < filesize ||
+            name[namesize - 1])
+        {
+            return -EINVAL;
+        }
+        if (!strcmp(name, CPIO_TRAILER))
+        {
+            break;
+        }
+
+        /* "./bin/sh", "bin/sh" and "/bin/sh" are all /bin/sh */
+        while (name[0] == '.' && name[1] == '/')
+        {
+            name += 2;
+        }
+        while (name[0] == '/')
+        {
+            name++;
+        }
+        if (!name[0] || !strcmp(name, ".") || namesize + 1 > sizeof(path))
+        {
+            continue;
+        }
+        path[0] = '/';
+        strcpy(path + 1, name);
+
+        long ret = 0;
+        switch (mode & CPIO_S_IFMT)
+        {
+        case CPIO_S_IFDIR:
+            ret = do_mkdir(path);
+            ret = ret == -EEXIST ? 0 : ret;
+            break;
+        case CPIO_S_IFREG:
+            ret = initrd_write_file(path, data, filesize);
+            break;
+        default:
+            /* devices come from make_devices() and there are no links */
+            continue;
+        }
+        if (ret)
+        {
+            dbg(DBG_VFS, "initrd: could not make %s: %ld\n", path, ret);
+            continue;
+        }
+        made++;
+    }
+    dbg(DBG_VFS, "initrd: made %ld files from %lu bytes\n", made,
+        (size_t)(end - start));
+
+    /* Unless the allocator could not reach that far, the archive's whole
+     * pages are free memory now */
+    uintptr_t first = (uintptr_t)PAGE_ALIGN_UP(mod->mod_start);
+    uintptr_t last = (uintptr_t)PAGE_ALIGN_DOWN(mod->mod_end);
+    if (first < last && last <= (uintptr_t)physmap_end() - PHYS_OFFSET)
+    {
+        page_add_range((void *)first, (void *)last);
+    }
+    return made;
+}
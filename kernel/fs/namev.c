@@ -3,6 +3,9 @@
 #include "kernel.h"
 #include <fs/dirent.h>
 
+#include "main/interrupt.h"
+#include "mm/slab.h"
+#include "proc/spinlock.h"
 #include "util/debug.h"
 #include "util/string.h"
 
@@ -11,6 +14,270 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 
+/*
+ * The name cache remembers what namev_lookup found for a (directory, name)
+ * pair: the inode number of the file, or that there was none (a negative
+ * entry). A hit is answered with vget, without asking the filesystem to
+ * search the directory again. Entries are only added and looked up with
+ * the directory locked, and every operation that changes a directory
+ * removes the entries for the names it changes (see namev_cache_invalidate)
+ * while still holding it, so an entry is never stale. Those for a
+ * directory go away with its vnode (see namev_cache_purge), which is what
+ * keeps an inode number that is reused from inheriting them. "." and ".."
+ * are left to the filesystem.
+ *
+ * The entries are in a hash table of NAMEV_CACHE_BUCKETS buckets, on their
+ * directory's vn_namecache, and on an LRU from which the oldest is taken
+ * for reuse once there are NAMEV_CACHE_MAX. All of it is protected by
+ * namev_cache_lock, taken with interrupts disabled.
+ *
+ * A positive entry also points at the vnode it resolved to, without a
+ * reference, and is on that vnode's vn_nameref; namev_cache_purge drops
+ * these too, so the pointer is good for as long as the entry is there. It
+ * lets namev_dir walk the directories of a path through the cache alone
+ * (see namev_walk_cached).
+ */
+#define NAMEV_CACHE_BUCKETS 256
+#define NAMEV_CACHE_MAX 1024
+#define NAMEV_CACHE_NEGATIVE ((ino_t)-1)
+
+typedef struct namev_cache_entry
+{
+    list_link_t nc_hash_link;
+    list_link_t nc_dir_link;
+    list_link_t nc_lru_link;
+    list_link_t nc_vnode_link;
+    vnode_t *nc_dir;
+    vnode_t *nc_vnode; /* NULL if negative */
+    ino_t nc_ino;      /* or NAMEV_CACHE_NEGATIVE */
+    size_t nc_namelen;
+    char nc_name[NAME_LEN];
+} namev_cache_entry_t;
+
+static list_t namev_cache_hash[NAMEV_CACHE_BUCKETS];
+static list_t namev_cache_lru = LIST_INITIALIZER(namev_cache_lru);
+static size_t namev_cache_count;
+static spinlock_t namev_cache_lock = SPINLOCK_INITIALIZER(namev_cache_lock);
+static slab_allocator_t *namev_cache_allocator;
+
+void namev_cache_init()
+{
+    for (size_t i = 0; i < NAMEV_CACHE_BUCKETS; i++)
+    {
+        list_init(&namev_cache_hash[i]);
+    }
+    namev_cache_allocator =
+        slab_allocator_create("namecache", sizeof(namev_cache_entry_t));
+    KASSERT(namev_cache_allocator);
+}
+
+static list_t *namev_cache_bucket(vnode_t *dir, const char *name,
+                                  size_t namelen)
+{
+    uint64_t hash = (uintptr_t)dir >> 4;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3UL;
+    }
+    return &namev_cache_hash[(hash >> 32) % NAMEV_CACHE_BUCKETS];
+}
+
+/* Returns the entry for (dir, name), or NULL. namev_cache_lock is held. */
+static namev_cache_entry_t *namev_cache_find(vnode_t *dir, const char *name,
+                                             size_t namelen)
+{
+    list_iterate(namev_cache_bucket(dir, name, namelen), nc,
+                 namev_cache_entry_t, nc_hash_link)
+    {
+        if (nc->nc_dir == dir && nc->nc_namelen == namelen &&
+            !strncmp(nc->nc_name, name, namelen))
+        {
+            return nc;
+        }
+    }
+    return NULL;
+}
+
+/* Unlinks nc from everything. namev_cache_lock is held. */
+static void namev_cache_unlink(namev_cache_entry_t *nc)
+{
+    list_remove(&nc->nc_hash_link);
+    list_remove(&nc->nc_dir_link);
+    list_remove(&nc->nc_lru_link);
+    if (nc->nc_vnode)
+    {
+        list_remove(&nc->nc_vnode_link);
+    }
+    namev_cache_count--;
+}
+
+static long namev_cache_cacheable(const char *name, size_t namelen)
+{
+    return namelen && namelen < NAME_LEN && !name_match(".", name, namelen) &&
+           !name_match("..", name, namelen);
+}
+
+/* Remembers that name in dir, which is locked, is vn, or that there is no
+ * such name if vn is NULL. */
+static void namev_cache_add(vnode_t *dir, const char *name, size_t namelen,
+                            vnode_t *vn)
+{
+    namev_cache_entry_t *nc = NULL;
+    if (namev_cache_count < NAMEV_CACHE_MAX)
+    {
+        nc = slab_obj_alloc(namev_cache_allocator);
+    }
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&namev_cache_lock);
+    namev_cache_entry_t *old = namev_cache_find(dir, name, namelen);
+    if (old)
+    {
+        namev_cache_unlink(old);
+    }
+    else if (!nc && !list_empty(&namev_cache_lru))
+    {
+        old = list_tail(&namev_cache_lru, namev_cache_entry_t, nc_lru_link);
+        namev_cache_unlink(old);
+    }
+    if (!nc)
+    {
+        nc = old;
+        old = NULL;
+    }
+    if (nc)
+    {
+        nc->nc_dir = dir;
+        nc->nc_vnode = vn;
+        nc->nc_ino = vn ? vn->vn_vno : NAMEV_CACHE_NEGATIVE;
+        if (vn)
+        {
+            list_insert_head(&vn->vn_nameref, &nc->nc_vnode_link);
+        }
+        nc->nc_namelen = namelen;
+        memcpy(nc->nc_name, name, namelen);
+        list_insert_head(namev_cache_bucket(dir, name, namelen),
+                         &nc->nc_hash_link);
+        list_insert_head(&dir->vn_namecache, &nc->nc_dir_link);
+        list_insert_head(&namev_cache_lru, &nc->nc_lru_link);
+        namev_cache_count++;
+    }
+    spinlock_unlock(&namev_cache_lock);
+    if (enabled)
+        intr_enable();
+
+    if (old)
+    {
+        slab_obj_free(namev_cache_allocator, old);
+    }
+}
+
+void namev_cache_invalidate(vnode_t *dir, const char *name, size_t namelen)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&namev_cache_lock);
+    namev_cache_entry_t *nc = namev_cache_find(dir, name, namelen);
+    if (nc)
+    {
+        namev_cache_unlink(nc);
+    }
+    spinlock_unlock(&namev_cache_lock);
+    if (enabled)
+        intr_enable();
+
+    if (nc)
+    {
+        slab_obj_free(namev_cache_allocator, nc);
+    }
+}
+
+/*
+ * Bumped by namev_cache_moved(): paths worked out before it last was, like
+ * the working directory paths processes keep (see do_getcwd), may no
+ * longer lead where they did.
+ */
+static volatile uint64_t namev_path_gen;
+
+void namev_cache_moved(vnode_t *dir, const char *name, size_t namelen)
+{
+    namev_cache_invalidate(dir, name, namelen);
+    __sync_fetch_and_add(&namev_path_gen, 1);
+}
+
+uint64_t namev_path_generation() { return namev_path_gen; }
+
+void namev_cache_purge(vnode_t *dir)
+{
+    if (!namev_cache_allocator)
+    {
+        return;
+    }
+    while (1)
+    {
+        long enabled = intr_enabled() != 0;
+        intr_disable();
+        spinlock_lock(&namev_cache_lock);
+        namev_cache_entry_t *nc = NULL;
+        if (!list_empty(&dir->vn_namecache))
+        {
+            nc = list_head(&dir->vn_namecache, namev_cache_entry_t,
+                           nc_dir_link);
+            namev_cache_unlink(nc);
+        }
+        else if (!list_empty(&dir->vn_nameref))
+        {
+            nc = list_head(&dir->vn_nameref, namev_cache_entry_t,
+                           nc_vnode_link);
+            namev_cache_unlink(nc);
+        }
+        spinlock_unlock(&namev_cache_lock);
+        if (enabled)
+            intr_enable();
+
+        if (!nc)
+        {
+            return;
+        }
+        slab_obj_free(namev_cache_allocator, nc);
+    }
+}
+
+/*
+ * Answers a lookup from the cache. Returns 0 with *res_vnode set for a
+ * positive entry, -ENOENT for a negative one, and -EAGAIN on a miss.
+ */
+static long namev_cache_lookup(vnode_t *dir, const char *name, size_t namelen,
+                               vnode_t **res_vnode)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&namev_cache_lock);
+    namev_cache_entry_t *nc = namev_cache_find(dir, name, namelen);
+    ino_t ino = 0;
+    if (nc)
+    {
+        ino = nc->nc_ino;
+        list_remove(&nc->nc_lru_link);
+        list_insert_head(&namev_cache_lru, &nc->nc_lru_link);
+    }
+    spinlock_unlock(&namev_cache_lock);
+    if (enabled)
+        intr_enable();
+
+    if (!nc)
+    {
+        return -EAGAIN;
+    }
+    if (ino == NAMEV_CACHE_NEGATIVE)
+    {
+        return -ENOENT;
+    }
+    *res_vnode = vget(dir->vn_fs, ino);
+    return 0;
+}
+
 /* Wrapper around dir's vnode operation lookup. dir must be locked on entry and
  *  upon return.
  *
@@ -47,8 +314,48 @@ long namev_lookup(vnode_t *dir, const char *name, size_t namelen,
         return -ENOTDIR;
     }
     
-    // Call the directory's lookup operation
-    return dir->vn_ops->lookup(dir, name, namelen, res_vnode);
+#ifdef __MOUNTING__
+    // ".." of the root of a mounted filesystem is ".." of its mount point,
+    // which is never locked while one of the vnodes above it is
+    if (dir->vn_fs != &vfs_root_fs && dir == dir->vn_fs->fs_root &&
+        name_match("..", name, namelen))
+    {
+        vnode_t *mtpt = dir->vn_fs->fs_mtpt;
+        vlock(mtpt);
+        long ret = namev_lookup(mtpt, name, namelen, res_vnode);
+        vunlock(mtpt);
+        return ret;
+    }
+#endif
+
+    long cacheable = !dir->vn_fs->fs_namev_nocache &&
+                     namev_cache_cacheable(name, namelen);
+    long ret = cacheable ? namev_cache_lookup(dir, name, namelen, res_vnode)
+                         : -EAGAIN;
+    if (ret == -EAGAIN)
+    {
+        // Call the directory's lookup operation
+        ret = dir->vn_ops->lookup(dir, name, namelen, res_vnode);
+        if (cacheable && !ret && (*res_vnode)->vn_fs == dir->vn_fs)
+        {
+            namev_cache_add(dir, name, namelen, *res_vnode);
+        }
+        else if (cacheable && ret == -ENOENT)
+        {
+            namev_cache_add(dir, name, namelen, NULL);
+        }
+    }
+
+#ifdef __MOUNTING__
+    // A mount point is replaced by the root of what is mounted on it
+    if (!ret && (*res_vnode)->vn_mount != *res_vnode)
+    {
+        vnode_t *mtpt = *res_vnode;
+        vref(*res_vnode = mtpt->vn_mount);
+        vput(&mtpt);
+    }
+#endif
+    return ret;
 }
 
 /*
@@ -114,6 +421,74 @@ static const char *namev_tokenize(const char **search, size_t *len)
     return begin;
 }
 
+/*
+ * The fast path of namev_dir: follows the directories of *search from dir,
+ * which the caller holds a reference on, as far as the name cache knows
+ * them, without locking or taking a reference on any of them on the way.
+ * The whole walk is done under namev_cache_lock, so it sees the entries as
+ * they were at one moment, and a vnode named by one cannot be freed in the
+ * meantime; no other check is needed afterwards.
+ *
+ * The walk stops at the last component, which is namev_dir's to handle, and
+ * at anything the cache cannot answer: a miss, a negative entry, "." or
+ * "..", something that is not a directory, or a mount point. Returns the
+ * directory reached, referenced (dir itself, with no new reference, if it
+ * got nowhere), with *search moved past the components it went through.
+ */
+static vnode_t *namev_walk_cached(vnode_t *dir, const char **search)
+{
+    vnode_t *cur = dir;
+    const char *s = *search;
+    const char *done = s;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&namev_cache_lock);
+    while (1)
+    {
+        size_t len, next_len = 0;
+        const char *name = namev_tokenize(&s, &len);
+        const char *peek = s;
+        if (peek)
+        {
+            namev_tokenize(&peek, &next_len);
+        }
+        // The last component, if this is it, is left to the caller
+        if (!len || !next_len || !namev_cache_cacheable(name, len))
+        {
+            break;
+        }
+        namev_cache_entry_t *nc = namev_cache_find(cur, name, len);
+        if (!nc || !nc->nc_vnode || !S_ISDIR(nc->nc_vnode->vn_mode))
+        {
+            break;
+        }
+        cur = nc->nc_vnode;
+#ifdef __MOUNTING__
+        // Mount points are crossed here too: the root of what is mounted
+        // is referenced by its fs for as long as it is mounted
+        cur = cur->vn_mount;
+#endif
+        done = s;
+    }
+    if (cur != dir && !vnode_tryref(cur))
+    {
+        // Being freed, which the purge will show the next walk
+        cur = dir;
+        done = *search;
+    }
+    spinlock_unlock(&namev_cache_lock);
+    if (enabled)
+        intr_enable();
+
+    if (cur != dir)
+    {
+        vput(&dir);
+        *search = done;
+    }
+    return cur;
+}
+
 /*
  * Parse path and return in `res_vnode` the vnode corresponding to the directory
  * containing the basename (last element) of path. `base` must not be locked on
@@ -193,11 +568,13 @@ long namev_dir(vnode_t *base, const char *path, vnode_t **res_vnode,
         return -ENOENT;
     }
     
-    // Lock and reference the starting vnode
+    // Reference the starting vnode, go as far down the path as the name
+    // cache can take us without locking anything, and lock where that is
     vref(current_dir);
+    const char *search = path;
+    current_dir = namev_walk_cached(current_dir, &search);
     vlock(current_dir);
     
-    const char *search = path;
     const char *token;
     size_t token_len;
     const char *last_token = NULL;
@@ -399,6 +776,7 @@ long namev_open(vnode_t *base, const char *path, int oflags, int mode,
         // Create the file using parent's mknod operation
         ret = parent_dir->vn_ops->mknod(parent_dir, null_term_name, basename_len, 
                                         mode, devid, &target_vnode);
+        namev_cache_invalidate(parent_dir, basename, basename_len);
         
         vunlock(parent_dir);
         vput(&parent_dir);
@@ -475,6 +853,47 @@ long namev_is_descendant(vnode_t *a, vnode_t *b)
  */
 
 #ifdef __GETCWD__
+/* Copies name, of namelen characters, and a null terminator into buf, of
+ * size bytes: as much of it as fits, and -ERANGE, if it does not. */
+static long lookup_copy_name(const char *name, size_t namelen, char *buf,
+                             size_t size)
+{
+    if (!size)
+    {
+        return -ERANGE;
+    }
+    size_t n = MIN(namelen, size - 1);
+    memcpy(buf, name, n);
+    buf[n] = '\0';
+    return n < namelen ? -ERANGE : 0;
+}
+
+/* Finds a name of entry in dir among dir's name cache entries that resolve
+ * to it (see vn_nameref), as lookup_name() does. Returns -EAGAIN if there
+ * is none. */
+static long namev_cache_name(vnode_t *dir, vnode_t *entry, char *buf,
+                             size_t size)
+{
+    char name[NAME_LEN];
+    size_t namelen = 0;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&namev_cache_lock);
+    list_iterate(&entry->vn_nameref, nc, namev_cache_entry_t, nc_vnode_link)
+    {
+        if (nc->nc_dir == dir)
+        {
+            namelen = nc->nc_namelen;
+            memcpy(name, nc->nc_name, namelen);
+            break;
+        }
+    }
+    spinlock_unlock(&namev_cache_lock);
+    if (enabled)
+        intr_enable();
+    return namelen ? lookup_copy_name(name, namelen, buf, size) : -EAGAIN;
+}
+
 /* Finds the name of 'entry' in the directory 'dir'. The name is writen
  * to the given buffer. On success 0 is returned. If 'dir' does not
  * contain 'entry' then -ENOENT is returned. If the given buffer cannot
@@ -482,15 +901,44 @@ long namev_is_descendant(vnode_t *a, vnode_t *b)
  * and a null terminator, -ERANGE is returned.
  *
  * Files can be uniquely identified within a file system by their
- * inode numbers. 
+ * inode numbers. The name cache is asked first; the directory is only
+ * read, an entry at a time, when it does not know. dir must not be
+ * locked.
  */
-int lookup_name(vnode_t *dir, vnode_t *entry, char *buf, size_t size)
+long lookup_name(vnode_t *dir, vnode_t *entry, char *buf, size_t size)
 {
-    NOT_YET_IMPLEMENTED("GETCWD: lookup_name");
-    return -ENOENT;
-}
+    if (!dir->vn_ops || !dir->vn_ops->readdir)
+    {
+        return -ENOTDIR;
+    }
+    if (entry->vn_fs != dir->vn_fs)
+    {
+        return -ENOENT;
+    }
+    long ret = namev_cache_name(dir, entry, buf, size);
+    if (ret != -EAGAIN)
+    {
+        return ret;
+    }
 
-NOT_YET_IMPLEMENTED("GETCWD: vput");
+    ret = -ENOENT;
+    vlock(dir);
+    dirent_t d;
+    size_t pos = 0;
+    ssize_t n;
+    while ((n = dir->vn_ops->readdir(dir, pos, &d)) > 0)
+    {
+        pos += (size_t)n;
+        if (d.d_ino == entry->vn_vno && strcmp(d.d_name, ".") &&
+            strcmp(d.d_name, ".."))
+        {
+            ret = lookup_copy_name(d.d_name, strlen(d.d_name), buf, size);
+            break;
+        }
+    }
+    vunlock(dir);
+    return n < 0 ? n : ret;
+}
 
 /* Used to find the absolute path of the directory 'dir'. Since
  * directories cannot have more than one link there is always
@@ -499,12 +947,79 @@ NOT_YET_IMPLEMENTED("GETCWD: vput");
  * negative error code. See the man page for getcwd(3) for
  * possible errors. Even if an error code is returned the buffer
  * will be filled with a valid string which has some partial
- * information about the wanted path. 
+ * information about the wanted path: as much of its end as was found.
+ *
+ * The path is put together from its last component back, walking ".." up
+ * to the root and finding each directory's name in its parent with
+ * lookup_name(). The root of a mounted filesystem goes by the name of its
+ * mount point.
  */
-ssize_t lookup_dirpath(vnode_t *dir, char *buf, size_t osize)
+long lookup_dirpath(vnode_t *dir, char *buf, size_t osize)
 {
-    NOT_YET_IMPLEMENTED("GETCWD: lookup_dirpath");
+    if (!osize)
+    {
+        return -EINVAL;
+    }
+    // The path is built at the end of buf, then moved to its start
+    char *start = buf + osize - 1;
+    *start = '\0';
+    long ret = 0;
+    vnode_t *cur = dir;
+    vref(cur);
+    while (cur != vfs_root_fs.fs_root)
+    {
+        vnode_t *named = cur;
+#ifdef __MOUNTING__
+        if (cur == cur->vn_fs->fs_root)
+        {
+            named = cur->vn_fs->fs_mtpt;
+        }
+#endif
+        vnode_t *parent;
+        ret = namev_get_parent(cur, &parent);
+        if (ret < 0)
+        {
+            break;
+        }
+        if (parent == cur)
+        {
+            vput(&parent);
+            ret = -ENOENT; // a root, but not the root
+            break;
+        }
+        char name[NAME_LEN];
+        ret = lookup_name(parent, named, name, sizeof(name));
+        vput(&cur);
+        cur = parent;
+        if (ret < 0)
+        {
+            break;
+        }
+        size_t namelen = strlen(name);
+        if ((size_t)(start - buf) < namelen + 1)
+        {
+            ret = -ERANGE;
+            break;
+        }
+        start -= namelen;
+        memcpy(start, name, namelen);
+        *--start = '/';
+    }
+    vput(&cur);
 
-    return -ENOENT;
+    if (!*start && start > buf)
+    {
+        *--start = '/';
+    }
+    size_t len = strlen(start) + 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        buf[i] = start[i]; // forwards, as start is not before buf
+    }
+    if (!ret && *buf != '/')
+    {
+        ret = -ERANGE; // not even "/" fit
+    }
+    return ret;
 }
 #endif /* __GETCWD__ */
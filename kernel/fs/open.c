@@ -1,5 +1,6 @@
 #include "errno.h"
 #include "fs/fcntl.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
@@ -10,33 +11,27 @@
 #include "drivers/blockdev.h"
 
 // NOTE: IF DOING MULTI-THREADED PROCS, NEED TO SYNCHRONIZE ACCESS TO FILE
-// DESCRIPTORS, AND, MORE GENERALLY SPEAKING, p_files, IN PARTICULAR IN THIS
+// DESCRIPTORS, AND, MORE GENERALLY SPEAKING, p_fdtable, IN PARTICULAR IN THIS
 // FUNCTION AND ITS CALLERS.
 /*
- * Go through curproc->p_files and find the first null entry.
- * If one exists, set fd to that index and return 0.
+ * Find the lowest descriptor curproc does not have open, set fd to it and
+ * return 0. The descriptor table is made ready for that descriptor to be
+ * installed (see fdtable_alloc).
  *
  * Error cases get_empty_fd is responsible for generating:
  *  - EMFILE: no empty file descriptor
+ *  - ENOMEM: the descriptor table could not be copied or grown
  */
 long get_empty_fd(int *fd)
 {
-    for (*fd = 0; *fd < NFILES; (*fd)++)
-    {
-        if (!curproc->p_files[*fd])
-        {
-            return 0;
-        }
-    }
-    *fd = -1;
-    return -EMFILE;
+    return fdtable_alloc(&curproc->p_fdtable, fd);
 }
 
 /*
  * Open the file at the provided path with the specified flags.
  *
  * Returns the file descriptor on success, or error cases:
- *  - EINVAL: Invalid oflags
+ *  - EINVAL: Invalid oflags, or O_DIRECT for a file that cannot do it
  *  - EISDIR: Trying to open a directory with write access
  *  - ENXIO: Blockdev or chardev vnode does not have an actual underlying device
  *  - ENOMEM: Not enough kernel memory (if fcreate() fails)
@@ -125,13 +120,23 @@ long do_open(const char *filename, int oflags)
     if (oflags & O_APPEND) {
         fmode |= FMODE_APPEND;
     }
+
+    // Only files whose filesystem can do direct I/O may be opened for it
+    if (oflags & O_DIRECT) {
+        if (!S_ISREG(vnode->vn_mode) || !vnode->vn_ops ||
+            !vnode->vn_ops->direct_io) {
+            vput(&vnode);
+            return -EINVAL;
+        }
+        fmode |= FMODE_DIRECT;
+    }
     
     // Handle case for regular files
     if ((oflags & O_TRUNC) && S_ISREG(vnode->vn_mode) && 
         (fmode & FMODE_WRITE) && vnode->vn_ops && vnode->vn_ops->truncate_file) {
-        vlock(vnode);
+        vlock_exclusive(vnode);
         vnode->vn_ops->truncate_file(vnode);
-        vunlock(vnode);
+        vunlock_exclusive(vnode);
     }
     
     // Create the file descriptor
@@ -8,20 +8,50 @@
 #include "errno.h"
 #include "globals.h"
 
+#include "api/access.h"
+#include "api/syscall.h"
+
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/pipe.h"
+#include "fs/poll.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
 #include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 
+#include "vm/ksm.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 
-#define PIPE_BUF_SIZE 4096
+/*
+ * A pipe's data is kept in a ring of up to __PIPE_PAGES__ pages, which a
+ * writer gives pages as it gets ahead of the reader: a pipe that never holds
+ * more than a few bytes takes up a single page, and one a producer keeps
+ * full can have __PIPE_PAGES__ pages in it between two context switches
+ * rather than one. Pages are kept once they have been used, until the pipe
+ * goes away.
+ *
+ * Reads and writes are not carried out under the vnode lock (see file_rw):
+ * a reader and a writer each take their end's mutex for the whole call, so
+ * that only one of each is ever in the pipe, and the one that is waits on
+ * its end's queue alone, to be woken by the other end.
+ *
+ * vmsplice(2) with SPLICE_F_GIFT can also fill a page of the ring with a
+ * page of the writer's memory, which is not copied but gifted to the pipe
+ * through the same shared pages same-page merging uses (see vm/ksm.c): the
+ * writer's page stays readable, and its next write to it takes a copy. A
+ * reader splicing a gifted page out to a page of its own memory has the
+ * shared page mapped there, again without a copy; any other read copies out
+ * of it. Only a page the ring is filled from the start of can be gifted,
+ * and only one read from the start of can be mapped.
+ */
+#define PIPE_CAPACITY ((size_t)__PIPE_PAGES__ * PAGE_SIZE)
 
 static void pipe_read_vnode(fs_t *fs, vnode_t *vnode);
 
@@ -31,11 +61,17 @@ static fs_ops_t pipe_fsops = {.read_vnode = pipe_read_vnode,
                               .delete_vnode = pipe_delete_vnode,
                               .umount = NULL};
 
+/* Pipe vnodes are freed as soon as their last file is closed, since nothing
+ * can ever look them up again */
 static fs_t pipe_fs = {.fs_dev = "pipe",
                        .fs_type = "pipe",
                        .fs_ops = &pipe_fsops,
                        .fs_root = NULL,
-                       .fs_i = NULL};
+                       .fs_i = NULL,
+                       .vnode_list = LIST_INITIALIZER(pipe_fs.vnode_list),
+                       .vnode_list_mutex =
+                           KMUTEX_INITIALIZER(pipe_fs.vnode_list_mutex),
+                       .fs_vnode_nocache = 1};
 
 static long pipe_read(vnode_t *vnode, size_t pos, void *buf, size_t count);
 
@@ -48,6 +84,9 @@ static long pipe_acquire(vnode_t *vnode, file_t *file);
 
 static long pipe_release(vnode_t *vnode, file_t *file);
 
+static long pipe_poll(vnode_t *vnode, file_t *file, long events,
+                      struct poll_table *pt);
+
 static vnode_ops_t pipe_vops = {
     .read = pipe_read,
     .write = pipe_write,
@@ -65,20 +104,31 @@ static vnode_ops_t pipe_vops = {
     .get_pframe = NULL,
     .fill_pframe = NULL,
     .flush_pframe = NULL,
+    .poll = pipe_poll,
 };
 
 /* struct pipe defines some data specific to pipes. One of these
    should be present in the vn_i field of each pipe vnode. */
 typedef struct pipe
 {
-    /* Buffer for data in the pipe, which has been written but not yet read. */
-    char *pv_buf;
     /*
-     * Position of the head and number of characters in the buffer. You can
-     * write in characters at position head so long as size does not grow beyond
-     * the pipe buffer size.
+     * The ring data that has been written but not yet read is kept in, of
+     * PIPE_CAPACITY bytes: page i holds bytes [i * PAGE_SIZE, (i + 1) *
+     * PAGE_SIZE) of it, and is NULL until a writer first gets to them.
      */
-    off_t pv_head;
+    char *pv_pages[__PIPE_PAGES__];
+    /*
+     * The shared page holding the data of page i of the ring instead, with
+     * a reference for the pipe, while it is a gift. A gifted page is always
+     * written whole, and goes once all of it has been read.
+     */
+    struct ksm_page *pv_gifts[__PIPE_PAGES__];
+    /*
+     * Position of the head and number of characters in the ring. You can
+     * write in characters at position head + size (wrapping around) so long
+     * as size does not grow beyond PIPE_CAPACITY.
+     */
+    size_t pv_head;
     size_t pv_size;
     /* Number of file descriptors using this pipe for read and write. */
     int pv_readers;
@@ -93,12 +143,15 @@ typedef struct pipe
     kmutex_t pv_wrlock;
     /*
      * Waitqueues for threads attempting to read from an empty buffer, or
-     * write to a full buffer. When the pipe becomes non-empty (or non-full)
-     * then the corresponding waitq should be broadcasted on to make sure all
-     * of the threads get a chance to go.
+     * write to a full buffer. Only the holder of pv_rdlock (pv_wrlock) ever
+     * waits here, so waiters sleep with sched_sleep_on_exclusive() and are
+     * woken with sched_wake_on() when the pipe becomes non-empty (or
+     * non-full), and with sched_broadcast_on() when the other end closes.
      */
     ktqueue_t pv_read_waitq;
     ktqueue_t pv_write_waitq;
+    /* Callers of poll(2) on either end, woken whenever either queue is */
+    pollq_t pv_pollq;
 } pipe_t;
 
 #define VNODE_TO_PIPE(vn) ((pipe_t *)((vn)->vn_i))
@@ -110,18 +163,34 @@ void pipe_init(void)
 {
     pipe_allocator = slab_allocator_create("pipe", sizeof(pipe_t));
     KASSERT(pipe_allocator);
+    pipe_fs.fs_vnode_allocator =
+        slab_allocator_create_ctor("pipe_vnode", sizeof(vnode_t), vnode_ctor,
+                                   NULL);
+    KASSERT(pipe_fs.fs_vnode_allocator);
 }
 
 /*
- * Create a pipe struct here. You are going to need to allocate all
- * of the necessary structs and buffers, and then initialize all of
- * the necessary fields (head, size, readers, writers, and the locks
- * and queues.)
+ * Create a pipe struct, with no pages yet: the first write gives it one.
  */
 static pipe_t *pipe_create(void)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_create");
-    return NULL;
+    pipe_t *pipe = slab_obj_alloc(pipe_allocator);
+    if (!pipe)
+    {
+        return NULL;
+    }
+    memset(pipe->pv_pages, 0, sizeof(pipe->pv_pages));
+    memset(pipe->pv_gifts, 0, sizeof(pipe->pv_gifts));
+    pipe->pv_head = 0;
+    pipe->pv_size = 0;
+    pipe->pv_readers = 0;
+    pipe->pv_writers = 0;
+    kmutex_init(&pipe->pv_rdlock);
+    kmutex_init(&pipe->pv_wrlock);
+    sched_queue_init(&pipe->pv_read_waitq);
+    sched_queue_init(&pipe->pv_write_waitq);
+    pollq_init(&pipe->pv_pollq);
+    return pipe;
 }
 
 /*
@@ -129,7 +198,19 @@ static pipe_t *pipe_create(void)
  */
 static void pipe_destroy(pipe_t *pipe)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_destroy");
+    KASSERT(!pipe->pv_readers && !pipe->pv_writers);
+    for (size_t i = 0; i < __PIPE_PAGES__; i++)
+    {
+        if (pipe->pv_pages[i])
+        {
+            page_free(pipe->pv_pages[i]);
+        }
+        if (pipe->pv_gifts[i])
+        {
+            ksm_page_release(pipe->pv_gifts[i]);
+        }
+    }
+    slab_obj_free(pipe_allocator, pipe);
 }
 
 /* pipefs vnode operations */
@@ -162,8 +243,16 @@ static void pipe_delete_vnode(fs_t *fs, vnode_t *vnode)
  */
 static vnode_t *pget(void)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pget");
-    return NULL;
+    vnode_t *vnode = vget(&pipe_fs, next_pno++);
+    KASSERT(!vnode->vn_i);
+    pipe_t *pipe = pipe_create();
+    if (!pipe)
+    {
+        vput(&vnode);
+        return NULL;
+    }
+    vnode->vn_i = pipe;
+    return vnode;
 }
 
 /*
@@ -179,56 +268,217 @@ static vnode_t *pget(void)
  */
 int do_pipe(int pipefd[2])
 {
-    NOT_YET_IMPLEMENTED("PIPES: do_pipe");
-    return -ENOTSUP;
+    int rfd, wfd;
+    long ret = fdtable_alloc(&curproc->p_fdtable, &rfd);
+    if (ret)
+    {
+        return (int)ret;
+    }
+    vnode_t *vnode = pget();
+    if (!vnode)
+    {
+        return -ENOMEM;
+    }
+    // The descriptor table holds the files' references, and they hold the
+    // vnode's
+    if (!fcreate(rfd, vnode, FMODE_READ))
+    {
+        vput(&vnode);
+        return -ENOMEM;
+    }
+    ret = fdtable_alloc(&curproc->p_fdtable, &wfd);
+    if (!ret && !fcreate(wfd, vnode, FMODE_WRITE))
+    {
+        ret = -ENOMEM;
+    }
+    vput(&vnode);
+    if (ret)
+    {
+        file_t *file;
+        fdtable_remove(&curproc->p_fdtable, rfd, &file);
+        fput(&file);
+        return (int)ret;
+    }
+    pipefd[0] = rfd;
+    pipefd[1] = wfd;
+    return 0;
+}
+
+/*
+ * Copies n bytes between buf and the ring at off, which wraps around, where
+ * the pages are there. A read that gets to the end of a gifted page lets go
+ * of it. Returns n, or, if a gifted page cannot be read back in from swap,
+ * how many bytes were copied before it, or the error if none were.
+ */
+static long pipe_copy(pipe_t *pipe, size_t off, char *buf, size_t n,
+                      long write)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        off %= PIPE_CAPACITY;
+        size_t i = off / PAGE_SIZE, at = off % PAGE_SIZE;
+        size_t chunk = MIN(n - done, PAGE_SIZE - at);
+        struct ksm_page *gift = pipe->pv_gifts[i];
+        if (write)
+        {
+            KASSERT(!gift);
+            memcpy(pipe->pv_pages[i] + at, buf + done, chunk);
+        }
+        else if (gift)
+        {
+            long ret = ksm_page_read(gift, at, buf + done, chunk);
+            if (ret)
+            {
+                return done ? (long)done : ret;
+            }
+            if (at + chunk == PAGE_SIZE)
+            {
+                ksm_page_release(gift);
+                pipe->pv_gifts[i] = NULL;
+            }
+        }
+        else
+        {
+            memcpy(buf + done, pipe->pv_pages[i] + at, chunk);
+        }
+        done += chunk;
+        off += chunk;
+    }
+    return (long)done;
+}
+
+/* Moves the head past n characters a reader has taken, and wakes the
+ * writer if they made room. */
+static void pipe_consume(pipe_t *pipe, size_t n)
+{
+    pipe->pv_head = (pipe->pv_head + n) % PIPE_CAPACITY;
+    pipe->pv_size -= n;
+    if (!pipe->pv_size)
+    {
+        // Start over from the first page, which is the likeliest to be
+        // there already
+        pipe->pv_head = 0;
+    }
+    if (n)
+    {
+        sched_wake_on(&pipe->pv_write_waitq);
+        pollq_wakeup(&pipe->pv_pollq);
+    }
+}
+
+/*
+ * Makes sure the ring has pages for the n bytes at off. Returns how many of
+ * them it has pages for, which is less than n only if there is no memory
+ * for the rest.
+ */
+static size_t pipe_fill_pages(pipe_t *pipe, size_t off, size_t n)
+{
+    size_t have = 0;
+    while (have < n)
+    {
+        size_t at = (off + have) % PIPE_CAPACITY;
+        char **page = &pipe->pv_pages[at / PAGE_SIZE];
+        if (!*page && !(*page = page_alloc()))
+        {
+            break;
+        }
+        have += MIN(n - have, PAGE_SIZE - at % PAGE_SIZE);
+    }
+    return have;
 }
 
 /*
- * When reading from a pipe, you should make sure there are enough characters in
- * the buffer to read. If there are, grab them and move up the tail by
- * subtracting from size. offset is ignored. Also, remember to take the reader
- * lock to prevent other threads from reading while you are waiting for more
- * characters.
+ * Reads from the pipe, waiting while it is empty and there are still
+ * writers, then takes as many characters as there are, up to count, moving
+ * up the head. offset is ignored. The reader lock is held throughout, so
+ * that other readers wait their turn rather than get part of the same data.
  *
- * This might block, e.g. if there are no or not enough characters to read.
- * It might be the case that there are no more writers and we aren't done
- * reading. However, in situations like this, there is no way to open the pipe
- * for writing again so no more writers will ever put characters in the pipe.
- * The reader should just take as much as it needs (or barring that, as much as
- * it can get) and return with a partial buffer.
+ * Once there are no more writers, there is no way to open the pipe for
+ * writing again, so no more characters will ever be put in it: a reader
+ * that finds it empty then returns 0, the end of the file.
  */
 static long pipe_read(vnode_t *vnode, size_t pos, void *buf, size_t count)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_read");
-    return -EINVAL;
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    kmutex_lock(&pipe->pv_rdlock);
+    while (!pipe->pv_size && pipe->pv_writers)
+    {
+        sched_sleep_on_exclusive(&pipe->pv_read_waitq);
+    }
+    long n = pipe_copy(pipe, pipe->pv_head, buf, MIN(count, pipe->pv_size), 0);
+    if (n > 0)
+    {
+        pipe_consume(pipe, (size_t)n);
+    }
+    kmutex_unlock(&pipe->pv_rdlock);
+    return n;
 }
 
 /*
  * Writing to a pipe is the dual of reading: if there is room, we can write our
  * data and go, but if not, we have to wait until there is more room and alert
- * any potential readers. Like above, you should take the writer lock to make
- * sure your write is contiguous.
+ * any potential readers. The writer lock is held throughout, so that the
+ * whole write is contiguous. A write of up to PIPE_BUF bytes waits until
+ * there is room for all of it, so that a reader sees it all at once.
  *
  * If there are no more readers, we have a broken pipe, and should fail with
- * the EPIPE error number.
+ * the EPIPE error number; a write that was under way returns what it had
+ * written. A write that cannot get a page for any of its data fails with
+ * ENOMEM.
  */
 static long pipe_write(vnode_t *vnode, size_t pos, const void *buf,
                        size_t count)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_write");
-    return -EINVAL;
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    size_t done = 0;
+    long ret = 0;
+    kmutex_lock(&pipe->pv_wrlock);
+    while (done < count)
+    {
+        size_t want = count <= PIPE_BUF ? count : 1;
+        while (pipe->pv_readers && PIPE_CAPACITY - pipe->pv_size < want)
+        {
+            sched_sleep_on_exclusive(&pipe->pv_write_waitq);
+        }
+        if (!pipe->pv_readers)
+        {
+            ret = -EPIPE;
+            break;
+        }
+        size_t off = pipe->pv_head + pipe->pv_size;
+        size_t n = MIN(count - done, PIPE_CAPACITY - pipe->pv_size);
+        n = pipe_fill_pages(pipe, off, n);
+        if (!n)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        (void)pipe_copy(pipe, off, (char *)buf + done, n, 1);
+        pipe->pv_size += n;
+        done += n;
+        sched_wake_on(&pipe->pv_read_waitq);
+        pollq_wakeup(&pipe->pv_pollq);
+    }
+    kmutex_unlock(&pipe->pv_wrlock);
+    return done ? (long)done : ret;
 }
 
 /*
  * It's still possible to stat a pipe using the fstat call, which takes a file
  * descriptor. Pipes don't have too much information, though. The only ones that
  * matter here are st_mode and st_ino, though you want to zero out some of the
- * others.
+ * others. st_size is what it holds, waiting to be read.
  */
 static long pipe_stat(vnode_t *vnode, stat_t *ss)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_stat");
-    return -EINVAL;
+    memset(ss, 0, sizeof(stat_t));
+    ss->st_mode = vnode->vn_mode;
+    ss->st_ino = (int)vnode->vn_vno;
+    ss->st_nlink = 1;
+    ss->st_size = (int)VNODE_TO_PIPE(vnode)->pv_size;
+    ss->st_blksize = PAGE_SIZE;
+    return 0;
 }
 
 /*
@@ -239,7 +489,15 @@ static long pipe_stat(vnode_t *vnode, stat_t *ss)
  */
 static long pipe_acquire(vnode_t *vnode, file_t *file)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_acquire");
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    if (file->f_mode & FMODE_READ)
+    {
+        pipe->pv_readers++;
+    }
+    if (file->f_mode & FMODE_WRITE)
+    {
+        pipe->pv_writers++;
+    }
     return 0;
 }
 
@@ -251,6 +509,234 @@ static long pipe_acquire(vnode_t *vnode, file_t *file)
  */
 static long pipe_release(vnode_t *vnode, file_t *file)
 {
-    NOT_YET_IMPLEMENTED("PIPES: pipe_release");
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    if ((file->f_mode & FMODE_READ) && !--pipe->pv_readers)
+    {
+        sched_broadcast_on(&pipe->pv_write_waitq);
+        pollq_wakeup(&pipe->pv_pollq);
+    }
+    if ((file->f_mode & FMODE_WRITE) && !--pipe->pv_writers)
+    {
+        sched_broadcast_on(&pipe->pv_read_waitq);
+        pollq_wakeup(&pipe->pv_pollq);
+    }
     return 0;
 }
+
+/*
+ * The read end is readable while there is data, and once there are no
+ * writers (a read returns the end of the file then), which is also a
+ * hang-up. The write end is writable while there is room for PIPE_BUF
+ * bytes, so that a write that size does not wait, and has an error once
+ * there are no readers.
+ */
+static long pipe_poll(vnode_t *vnode, file_t *file, long events,
+                      struct poll_table *pt)
+{
+    pipe_t *pipe = VNODE_TO_PIPE(vnode);
+    poll_wait(pt, &pipe->pv_pollq);
+    long revents = 0;
+    if (file->f_mode & FMODE_READ)
+    {
+        revents |= pipe->pv_size || !pipe->pv_writers ? POLLIN : 0;
+        revents |= !pipe->pv_writers ? POLLHUP : 0;
+    }
+    if (file->f_mode & FMODE_WRITE)
+    {
+        revents |= !pipe->pv_readers ? POLLERR
+                   : PIPE_CAPACITY - pipe->pv_size >= PIPE_BUF ? POLLOUT
+                                                               : 0;
+    }
+    return revents;
+}
+
+/*
+ * vmsplice(2) into the write end of pipe: writes the user buffers of iov as
+ * pipe_write does, except that with gift set, a whole page of them that
+ * fills a page of the ring from its start is gifted to the pipe rather than
+ * copied, if it is private anonymous memory (see ksm_gift_page); any other
+ * data goes through bounce, a page. Writes are not kept whole.
+ */
+static long pipe_vmsplice_write(pipe_t *pipe, const iovec_t *iov, int iovcnt,
+                                long gift, char *bounce)
+{
+    size_t done = 0;
+    long ret = 0;
+    kmutex_lock(&pipe->pv_wrlock);
+    for (int i = 0; i < iovcnt && !ret; i++)
+    {
+        uintptr_t addr = (uintptr_t)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left)
+        {
+            // Readers keep head + size where it is, or move it to 0 as the
+            // pipe empties, so the fill point stays page-aligned if it was
+            long whole = gift && PAGE_ALIGNED(addr) && left >= PAGE_SIZE &&
+                         PAGE_ALIGNED(pipe->pv_head + pipe->pv_size);
+            size_t want = whole ? PAGE_SIZE : 1;
+            while (pipe->pv_readers && PIPE_CAPACITY - pipe->pv_size < want)
+            {
+                sched_sleep_on_exclusive(&pipe->pv_write_waitq);
+            }
+            if (!pipe->pv_readers)
+            {
+                ret = -EPIPE;
+                break;
+            }
+            size_t off = (pipe->pv_head + pipe->pv_size) % PIPE_CAPACITY;
+            size_t n;
+            struct ksm_page *kp;
+            if (whole && !ksm_gift_page(curproc->p_vmmap, addr, &kp))
+            {
+                pipe->pv_gifts[off / PAGE_SIZE] = kp;
+                n = PAGE_SIZE;
+            }
+            else
+            {
+                n = MIN(left, PAGE_SIZE - addr % PAGE_SIZE);
+                n = pipe_fill_pages(pipe, off,
+                                    MIN(n, PIPE_CAPACITY - pipe->pv_size));
+                if (!n)
+                {
+                    ret = -ENOMEM;
+                    break;
+                }
+                if ((ret = copy_from_user(bounce, (void *)addr, n)) < 0)
+                {
+                    break;
+                }
+                (void)pipe_copy(pipe, off, bounce, n, 1);
+            }
+            pipe->pv_size += n;
+            addr += n;
+            left -= n;
+            done += n;
+            sched_wake_on(&pipe->pv_read_waitq);
+            pollq_wakeup(&pipe->pv_pollq);
+        }
+    }
+    kmutex_unlock(&pipe->pv_wrlock);
+    return done ? (long)done : ret;
+}
+
+/*
+ * vmsplice(2) out of the read end of pipe: reads into the user buffers of
+ * iov as pipe_read does, except that with gift set, a gifted page of the
+ * ring read from its start into a whole page of private anonymous memory is
+ * mapped there rather than copied (see ksm_map_page); any other data goes
+ * through bounce, a page. Data that cannot be copied out is lost.
+ */
+static long pipe_vmsplice_read(pipe_t *pipe, const iovec_t *iov, int iovcnt,
+                               long gift, char *bounce)
+{
+    size_t done = 0;
+    long ret = 0;
+    kmutex_lock(&pipe->pv_rdlock);
+    while (!pipe->pv_size && pipe->pv_writers)
+    {
+        sched_sleep_on_exclusive(&pipe->pv_read_waitq);
+    }
+    for (int i = 0; i < iovcnt && !ret && pipe->pv_size; i++)
+    {
+        uintptr_t addr = (uintptr_t)iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left && pipe->pv_size)
+        {
+            size_t head = pipe->pv_head;
+            struct ksm_page *kp = pipe->pv_gifts[head / PAGE_SIZE];
+            size_t n;
+            if (gift && kp && PAGE_ALIGNED(head) && PAGE_ALIGNED(addr) &&
+                left >= PAGE_SIZE &&
+                !ksm_map_page(curproc->p_vmmap, addr, kp))
+            {
+                pipe->pv_gifts[head / PAGE_SIZE] = NULL;
+                n = PAGE_SIZE;
+            }
+            else
+            {
+                long got = pipe_copy(pipe, head, bounce,
+                                     MIN(MIN(left, pipe->pv_size), PAGE_SIZE),
+                                     0);
+                if (got < 0)
+                {
+                    ret = got;
+                    break;
+                }
+                n = (size_t)got;
+                ret = copy_to_user((void *)addr, bounce, n);
+            }
+            pipe_consume(pipe, n);
+            if (ret < 0)
+            {
+                break;
+            }
+            addr += n;
+            left -= n;
+            done += n;
+        }
+    }
+    kmutex_unlock(&pipe->pv_rdlock);
+    return done ? (long)done : ret;
+}
+
+/*
+ * An implementation of the vmsplice(2) system call: moves data between the
+ * buffers the kernel array iov describes, which are in the caller's address
+ * space, and the pipe open as fd, into it if fd is its write end and out of
+ * it if fd is its read end. flags may be SPLICE_F_GIFT, to gift whole pages
+ * to the pipe and map gifted ones back out, or 0 to copy everything.
+ *
+ * Returns the number of bytes moved, or:
+ *  - EBADF: fd is not open, or is not a pipe
+ *  - EINVAL: flags has bits other than SPLICE_F_GIFT, or a buffer length
+ *    overflows an ssize_t
+ *  - EPIPE: nothing was written, and there are no readers
+ *  - EFAULT: nothing was moved, and the first buffer is bad
+ *  - ENOMEM: nothing was moved, and there is no memory
+ */
+long do_vmsplice(int fd, const iovec_t *iov, int iovcnt, unsigned int flags)
+{
+    if (flags & ~SPLICE_F_GIFT)
+    {
+        return -EINVAL;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > ((size_t)-1 >> 1) - len)
+        {
+            return -EINVAL;
+        }
+        len += iov[i].iov_len;
+    }
+    file_t *file = fget(fd);
+    if (!file)
+    {
+        return -EBADF;
+    }
+    long ret = -EBADF;
+    if (file->f_vnode->vn_fs == &pipe_fs)
+    {
+        char *bounce = page_alloc();
+        pipe_t *pipe = VNODE_TO_PIPE(file->f_vnode);
+        long gift = (flags & SPLICE_F_GIFT) != 0;
+        if (!bounce)
+        {
+            ret = -ENOMEM;
+        }
+        else if (file->f_mode & FMODE_WRITE)
+        {
+            ret = pipe_vmsplice_write(pipe, iov, iovcnt, gift, bounce);
+        }
+        else
+        {
+            ret = pipe_vmsplice_read(pipe, iov, iovcnt, gift, bounce);
+        }
+        if (bounce)
+        {
+            page_free(bounce);
+        }
+    }
+    fput(&file);
+    return ret;
+}
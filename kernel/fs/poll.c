@@ -0,0 +1,224 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "api/syscall.h"
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/vnode.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "proc/sched.h"
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/*
+ * poll(2): a thread waits for any of several files to become ready by
+ * registering, once, on the pollq_t of each (see vn_ops->poll), then
+ * sleeping on a queue of its own, which pollq_wakeup() wakes it on.
+ *
+ * A call's poll_call_t holds an entry for each file's pollq, since a
+ * vnode's poll registers on at most one. IPL_HIGH is held while the files
+ * are checked and until the caller is asleep, so that a wakeup cannot slip
+ * in between (a tty's comes from the keyboard interrupt).
+ */
+
+struct poll_call;
+
+/* An entry of a call on the pollq of one of its files */
+typedef struct poll_call_entry
+{
+    poll_entry_t pce_entry;
+    struct poll_call *pce_call;
+} poll_call_entry_t;
+
+typedef struct poll_call
+{
+    poll_table_t pc_table;
+    ktqueue_t pc_waitq; /* the caller, waiting for a file or the timeout */
+    long pc_woken;      /* a pollq was woken since the files were checked */
+    long pc_expired;    /* the timeout has passed */
+    int pc_nentries;
+    int pc_max;
+    poll_call_entry_t *pc_entries; /* pc_max of them */
+} poll_call_t;
+
+void pollq_init(pollq_t *pq) { list_init(&pq->pq_entries); }
+
+/*
+ * For a vnode's poll: registers the owner of pt on pq, to be woken when it
+ * is. pt is NULL once the caller is registered, and for checks that do not
+ * wait.
+ */
+void poll_wait(poll_table_t *pt, pollq_t *pq)
+{
+    if (pt)
+    {
+        pt->pt_register(pt, pq);
+    }
+}
+
+/* Adds pe, whose pe_wake is set, to pq. */
+void pollq_add(pollq_t *pq, poll_entry_t *pe)
+{
+    list_link_init(&pe->pe_link);
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    list_insert_tail(&pq->pq_entries, &pe->pe_link);
+    intr_setipl(old_ipl);
+}
+
+/* Takes pe off the pollq it was added to. */
+void pollq_remove(poll_entry_t *pe)
+{
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    list_remove(&pe->pe_link);
+    intr_setipl(old_ipl);
+}
+
+/* Calls back every entry on pq. */
+void pollq_wakeup(pollq_t *pq)
+{
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    list_iterate(&pq->pq_entries, pe, poll_entry_t, pe_link)
+    {
+        pe->pe_wake(pe);
+    }
+    intr_setipl(old_ipl);
+}
+
+static void poll_call_wake(poll_entry_t *pe)
+{
+    poll_call_t *pc = CONTAINER_OF(pe, poll_call_entry_t, pce_entry)->pce_call;
+    pc->pc_woken = 1;
+    sched_wakeup_on(&pc->pc_waitq, NULL);
+}
+
+static void poll_call_register(poll_table_t *pt, pollq_t *pq)
+{
+    poll_call_t *pc = CONTAINER_OF(pt, poll_call_t, pc_table);
+    KASSERT(pc->pc_nentries < pc->pc_max && "one pollq per file");
+    poll_call_entry_t *pce = &pc->pc_entries[pc->pc_nentries++];
+    pce->pce_call = pc;
+    pce->pce_entry.pe_wake = poll_call_wake;
+    pollq_add(pq, &pce->pce_entry);
+}
+
+static void poll_timer_fire(uint64_t data)
+{
+    poll_call_t *pc = (poll_call_t *)data;
+    pc->pc_expired = 1;
+    sched_wakeup_on(&pc->pc_waitq, NULL);
+}
+
+/* The events of events, and the errors, file is ready for, registering on
+ * it if pt is set. Files that never block, such as regular files, have no
+ * poll and are always ready. */
+short poll_file(file_t *file, short events, poll_table_t *pt)
+{
+    vnode_t *vn = file->f_vnode;
+    long revents = vn->vn_ops->poll ? vn->vn_ops->poll(vn, file, events, pt)
+                                    : POLLIN | POLLOUT;
+    return (short)(revents & (events | POLLERR | POLLHUP));
+}
+
+/*
+ * Implements poll(2) on fds, a kernel copy of the caller's array of nfds
+ * entries: waits until at least one of the files is ready for an event it
+ * asks for, or has an error or hang-up to report, or timeout milliseconds
+ * have passed (forever if timeout is negative), and sets every revents.
+ * Entries with a negative fd are skipped, and those whose fd is not open
+ * get POLLNVAL.
+ *
+ * Returns the number of entries with revents set, 0 on timeout, or:
+ *  - EINVAL: nfds is negative or more than NFILES
+ *  - ENOMEM: the poll table could not be allocated
+ *  - EINTR: the thread was cancelled while waiting
+ */
+long do_poll(pollfd_t *fds, int nfds, int timeout)
+{
+    if (nfds < 0 || nfds > NFILES)
+    {
+        return -EINVAL;
+    }
+    poll_call_t pc;
+    pc.pc_table.pt_register = poll_call_register;
+    sched_queue_init(&pc.pc_waitq);
+    pc.pc_woken = pc.pc_expired = 0;
+    pc.pc_nentries = 0;
+    pc.pc_max = nfds;
+    pc.pc_entries =
+        kmalloc(sizeof(poll_call_entry_t) * (size_t)(nfds ? nfds : 1));
+    file_t **files = kmalloc(sizeof(file_t *) * (size_t)(nfds ? nfds : 1));
+    if (!pc.pc_entries || !files)
+    {
+        if (pc.pc_entries)
+            kfree(pc.pc_entries);
+        if (files)
+            kfree(files);
+        return -ENOMEM;
+    }
+    // The references keep the vnodes, and their pollqs, around until the
+    // entries are taken off them
+    for (int i = 0; i < nfds; i++)
+    {
+        files[i] = fds[i].fd >= 0 ? fget(fds[i].fd) : NULL;
+    }
+
+    timer_t timer;
+    timer_init(&timer);
+    if (timeout > 0)
+    {
+        // jiffies are roughly milliseconds, see util/time.c
+        timer.function = poll_timer_fire;
+        timer.data = (uint64_t)&pc;
+        timer.expires = jiffies + (uint64_t)timeout;
+        timer_add(&timer);
+    }
+
+    long ready, ret = 0;
+    poll_table_t *reg = &pc.pc_table;
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    while (1)
+    {
+        pc.pc_woken = 0;
+        ready = 0;
+        for (int i = 0; i < nfds; i++)
+        {
+            fds[i].revents = fds[i].fd < 0 ? 0
+                             : !files[i]   ? POLLNVAL
+                                           : poll_file(files[i], fds[i].events,
+                                                       reg);
+            ready += fds[i].revents != 0;
+        }
+        reg = NULL;
+        if (ready || !timeout || pc.pc_expired)
+        {
+            break;
+        }
+        if (!pc.pc_woken && (ret = sched_cancellable_sleep_on(&pc.pc_waitq)))
+        {
+            break;
+        }
+    }
+    for (int i = 0; i < pc.pc_nentries; i++)
+    {
+        pollq_remove(&pc.pc_entries[i].pce_entry);
+    }
+    intr_setipl(old_ipl);
+
+    if (timeout > 0)
+    {
+        timer_del(&timer);
+    }
+    for (int i = 0; i < nfds; i++)
+    {
+        if (files[i])
+        {
+            fput(&files[i]);
+        }
+    }
+    kfree(files);
+    kfree(pc.pc_entries);
+    return ret ? ret : ready;
+}
@@ -0,0 +1,461 @@
+/*
+ * procfs: the kernel's statistics as text files, for programs to read
+ * instead of asking the debugger or the kshell. Nothing is stored: each file
+ * is one of the info functions the kernel already prints with
+ * dbg_printinfo(), and its text is made by calling it. The root has
+ *
+ *    o a file for each of the global statistics (procfs_global below), and
+ *
+ *    o a directory for each process, named by its pid, with a file for each
+ *      of its own (procfs_pid below).
+ *
+ * A read from offset 0 makes the file's text; reads further on see the
+ * same text until the next read from 0, so that reading a file from start
+ * to end gives a consistent picture however small the reads are. The text
+ * is cut off at PROCFS_TEXT_PAGES pages. Files are read-only and have no
+ * length: read them until read() returns 0.
+ *
+ * The inode number says what a vnode is: 0 is the root, numbers below
+ * PROCFS_PID_BASE are the global files, and from there on the pid plus one
+ * is shifted over by PROCFS_FILE_BITS, the low bits being 0 for the
+ * process's directory and the index of the file plus one for its files.
+ * Processes come and go without procfs hearing of it, so its names are kept
+ * out of the name cache and its vnodes out of the vnode cache; a process's
+ * directory that is still open after it has been reaped is empty.
+ */
+
+#include "fs/procfs/procfs.h"
+#include "errno.h"
+#include "fs/dirent.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "globals.h"
+#include "kernel.h"
+#include "main/boottime.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/swap.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
+#include "vm/ksm.h"
+#include "vm/pagefault.h"
+#include "vm/vmmap.h"
+
+#define PROCFS_TEXT_PAGES 4
+#define PROCFS_TEXT_SIZE (PROCFS_TEXT_PAGES * PAGE_SIZE)
+
+#define PROCFS_FILE_BITS 4
+#define PROCFS_PID_BASE (1 << PROCFS_FILE_BITS)
+#define PROCFS_VNO(pid, file) \
+    ((ino_t)(((pid) + 1) << PROCFS_FILE_BITS | (file)))
+#define PROCFS_VNO_PID(vno) ((pid_t)((vno) >> PROCFS_FILE_BITS) - 1)
+#define PROCFS_VNO_FILE(vno) ((vno) & (PROCFS_PID_BASE - 1))
+
+/* Directory entries before the files: "." and ".." */
+#define PROCFS_DOTS 2
+
+typedef struct procfs_entry
+{
+    const char *pe_name;
+    dbg_infofunc_t pe_info; /* given NULL, or the process for its files */
+} procfs_entry_t;
+
+/* A file's text, as of the last read from offset 0 */
+typedef struct procfs_text
+{
+    kmutex_t pt_mutex;
+    char *pt_buf; /* PROCFS_TEXT_SIZE bytes, or NULL until the first read */
+    size_t pt_len;
+} procfs_text_t;
+
+static size_t procfs_meminfo(const void *arg, char *buf, size_t osize)
+{
+    size_t size = page_info(NULL, buf, osize);
+    size = slab_info(NULL, buf + (osize - size), size);
+    size = swap_info(NULL, buf + (osize - size), size);
+    return ksm_info(NULL, buf + (osize - size), size);
+}
+
+static size_t procfs_time(const void *arg, char *buf, size_t osize)
+{
+    size_t len = time_stats(buf, osize);
+    return osize - MIN(len, osize - 1);
+}
+
+#ifdef __VM__
+
+static size_t procfs_maps(const void *arg, char *buf, size_t osize)
+{
+    const proc_t *p = arg;
+    return p->p_vmmap ? vmmap_mapping_info(p->p_vmmap, buf, osize) : osize;
+}
+
+static size_t procfs_faults(const void *arg, char *buf, size_t osize)
+{
+    return pagefault_info(arg, buf, osize);
+}
+
+#endif
+
+static const procfs_entry_t procfs_global[] = {
+    {"procs", proc_list_info},
+    {"sched", sched_info},
+    {"meminfo", procfs_meminfo},
+    {"cacheinfo", mobj_stats_info},
+    {"diskinfo", blockdev_info},
+    {"time", procfs_time},
+    {"boot", boottime_info},
+};
+
+static const procfs_entry_t procfs_pid[] = {
+    {"status", proc_info},
+#ifdef __VM__
+    {"maps", procfs_maps},
+    {"faults", procfs_faults},
+#endif
+};
+
+#define PROCFS_NGLOBAL (sizeof(procfs_global) / sizeof(procfs_global[0]))
+#define PROCFS_NPID (sizeof(procfs_pid) / sizeof(procfs_pid[0]))
+
+/*
+ * Filesystem operations
+ */
+static void procfs_read_vnode(fs_t *fs, vnode_t *vn);
+
+static void procfs_delete_vnode(fs_t *fs, vnode_t *vn);
+
+static long procfs_cache_vnode(fs_t *fs, vnode_t *vn);
+
+static fs_ops_t procfs_ops = {.read_vnode = procfs_read_vnode,
+                              .delete_vnode = procfs_delete_vnode,
+                              .cache_vnode = procfs_cache_vnode,
+                              .umount = NULL};
+
+/*
+ * vnode operations
+ */
+static ssize_t procfs_read(vnode_t *file, size_t pos, void *buf,
+                           size_t count);
+
+static long procfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                          vnode_t **out);
+
+static ssize_t procfs_readdir(vnode_t *dir, size_t pos, struct dirent *d);
+
+static long procfs_stat(vnode_t *vn, stat_t *buf);
+
+/* What would change a directory fails, the VFS calling these unchecked */
+static long procfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                         int mode, devid_t devid, vnode_t **out);
+
+static long procfs_link(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t *target);
+
+static long procfs_unlink(vnode_t *dir, const char *name, size_t namelen);
+
+static long procfs_rename(vnode_t *olddir, const char *oldname,
+                          size_t oldnamelen, vnode_t *newdir,
+                          const char *newname, size_t newnamelen);
+
+static long procfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out);
+
+static vnode_ops_t procfs_dir_vops = {.mknod = procfs_mknod,
+                                      .lookup = procfs_lookup,
+                                      .link = procfs_link,
+                                      .unlink = procfs_unlink,
+                                      .rename = procfs_rename,
+                                      .mkdir = procfs_mkdir,
+                                      .rmdir = procfs_unlink,
+                                      .readdir = procfs_readdir,
+                                      .stat = procfs_stat};
+
+static vnode_ops_t procfs_file_vops = {.read = procfs_read,
+                                       .stat = procfs_stat};
+
+static slab_allocator_t *procfs_vnode_allocator;
+
+long procfs_mount(struct fs *fs)
+{
+    if (!procfs_vnode_allocator &&
+        !(procfs_vnode_allocator = slab_allocator_create_ctor(
+              "procfs_node", sizeof(vnode_t), vnode_ctor, NULL)))
+    {
+        return -ENOMEM;
+    }
+    fs->fs_i = NULL;
+    fs->fs_ops = &procfs_ops;
+    fs->fs_vnode_allocator = procfs_vnode_allocator;
+    fs->fs_namev_nocache = 1;
+    fs->fs_root = vget(fs, 0);
+    KASSERT(fs->fs_root);
+    return 0;
+}
+
+/* The entry for the file vno, or NULL if it is a directory */
+static const procfs_entry_t *procfs_entry(ino_t vno)
+{
+    if (!vno)
+    {
+        return NULL;
+    }
+    if (vno < PROCFS_PID_BASE)
+    {
+        KASSERT(vno <= PROCFS_NGLOBAL);
+        return &procfs_global[vno - 1];
+    }
+    ino_t file = PROCFS_VNO_FILE(vno);
+    KASSERT(file <= PROCFS_NPID);
+    return file ? &procfs_pid[file - 1] : NULL;
+}
+
+static void procfs_read_vnode(fs_t *fs, vnode_t *vn)
+{
+    vn->vn_len = 0;
+    if (!procfs_entry(vn->vn_vno))
+    {
+        vn->vn_mode = S_IFDIR;
+        vn->vn_ops = &procfs_dir_vops;
+        return;
+    }
+    vn->vn_mode = S_IFREG;
+    vn->vn_ops = &procfs_file_vops;
+    /* If this fails, reads of the file fail with ENOMEM */
+    procfs_text_t *text = kmalloc(sizeof(procfs_text_t));
+    if (text)
+    {
+        kmutex_init(&text->pt_mutex);
+        text->pt_buf = NULL;
+        text->pt_len = 0;
+    }
+    vn->vn_i = text;
+}
+
+static void procfs_delete_vnode(fs_t *fs, vnode_t *vn)
+{
+    procfs_text_t *text = vn->vn_i;
+    if (!text)
+    {
+        return;
+    }
+    if (text->pt_buf)
+    {
+        page_free_n(text->pt_buf, PROCFS_TEXT_PAGES);
+    }
+    kfree(text);
+    vn->vn_i = NULL;
+}
+
+/* Nothing is worth keeping once it is closed, and a process's vnodes must
+ * not outlive it where a later process with its pid would find them */
+static long procfs_cache_vnode(fs_t *fs, vnode_t *vn) { return 0; }
+
+/* Makes the text of file, which is locked. */
+static long procfs_fill(vnode_t *file, procfs_text_t *text)
+{
+    const void *arg = NULL;
+    if (file->vn_vno >= PROCFS_PID_BASE &&
+        !(arg = proc_lookup(PROCFS_VNO_PID(file->vn_vno))))
+    {
+        return -ENOENT;
+    }
+    if (!text->pt_buf && !(text->pt_buf = page_alloc_n(PROCFS_TEXT_PAGES)))
+    {
+        return -ENOMEM;
+    }
+    size_t left = procfs_entry(file->vn_vno)->pe_info(arg, text->pt_buf,
+                                                      PROCFS_TEXT_SIZE);
+    text->pt_len = PROCFS_TEXT_SIZE - left;
+    return 0;
+}
+
+static ssize_t procfs_read(vnode_t *file, size_t pos, void *buf,
+                           size_t count)
+{
+    procfs_text_t *text = file->vn_i;
+    if (!text)
+    {
+        return -ENOMEM;
+    }
+    kmutex_lock(&text->pt_mutex);
+    ssize_t ret = 0;
+    if (!pos || !text->pt_buf)
+    {
+        ret = procfs_fill(file, text);
+    }
+    if (!ret && pos < text->pt_len)
+    {
+        ret = (ssize_t)MIN(count, text->pt_len - pos);
+        memcpy(buf, text->pt_buf + pos, (size_t)ret);
+    }
+    kmutex_unlock(&text->pt_mutex);
+    return ret;
+}
+
+/* The pid that name, namelen long, is in decimal, or -1 if it is not one */
+static pid_t procfs_parse_pid(const char *name, size_t namelen)
+{
+    if (!namelen || namelen > 5 || (name[0] == '0' && namelen > 1))
+    {
+        return -1;
+    }
+    pid_t pid = 0;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        if (name[i] < '0' || name[i] > '9')
+        {
+            return -1;
+        }
+        pid = pid * 10 + (name[i] - '0');
+    }
+    return pid < PROC_MAX_COUNT ? pid : -1;
+}
+
+static long procfs_lookup(vnode_t *dir, const char *name, size_t namelen,
+                          vnode_t **out)
+{
+    ino_t vno = dir->vn_vno;
+    if (name_match(".", name, namelen))
+    {
+        vref(dir);
+        *out = dir;
+        return 0;
+    }
+    if (name_match("..", name, namelen))
+    {
+        /* The root's is the mount point's, which namev_lookup() sees to */
+        *out = vget(dir->vn_fs, 0);
+        return 0;
+    }
+
+    const procfs_entry_t *entries = vno ? procfs_pid : procfs_global;
+    size_t nentries = vno ? PROCFS_NPID : PROCFS_NGLOBAL;
+    pid_t pid = vno ? PROCFS_VNO_PID(vno) : -1;
+    for (size_t i = 0; i < nentries; i++)
+    {
+        if (name_match(entries[i].pe_name, name, namelen))
+        {
+            if (vno && !proc_lookup(pid))
+            {
+                return -ENOENT;
+            }
+            *out = vget(dir->vn_fs, vno ? PROCFS_VNO(pid, i + 1) : i + 1);
+            return 0;
+        }
+    }
+
+    if (!vno && (pid = procfs_parse_pid(name, namelen)) >= 0 &&
+        proc_lookup(pid))
+    {
+        *out = vget(dir->vn_fs, PROCFS_VNO(pid, 0));
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static void procfs_dirent(struct dirent *d, ino_t ino, const char *name)
+{
+    d->d_ino = ino;
+    d->d_off = 0; /* unused */
+    strncpy(d->d_name, name, NAME_LEN - 1);
+    d->d_name[NAME_LEN - 1] = '\0';
+}
+
+/*
+ * The offset of an entry is its index, except that a process's directory
+ * in the root is at PROCFS_DOTS + PROCFS_NGLOBAL plus its pid, so that
+ * processes coming and going do not move the others.
+ */
+static ssize_t procfs_readdir(vnode_t *dir, size_t pos, struct dirent *d)
+{
+    ino_t vno = dir->vn_vno;
+    if (pos < PROCFS_DOTS)
+    {
+        procfs_dirent(d, pos ? 0 : vno, pos ? ".." : ".");
+        return 1;
+    }
+    size_t i = pos - PROCFS_DOTS;
+
+    if (vno)
+    {
+        pid_t pid = PROCFS_VNO_PID(vno);
+        if (i >= PROCFS_NPID || !proc_lookup(pid))
+        {
+            return 0;
+        }
+        procfs_dirent(d, PROCFS_VNO(pid, i + 1), procfs_pid[i].pe_name);
+        return 1;
+    }
+
+    if (i < PROCFS_NGLOBAL)
+    {
+        procfs_dirent(d, (ino_t)(i + 1), procfs_global[i].pe_name);
+        return 1;
+    }
+    /* The process with the lowest pid from there on */
+    pid_t from = (pid_t)(i - PROCFS_NGLOBAL);
+    pid_t next = -1;
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        if (p->p_pid >= from && (next < 0 || p->p_pid < next))
+        {
+            next = p->p_pid;
+        }
+    }
+    if (next < 0)
+    {
+        return 0;
+    }
+    char name[NAME_LEN];
+    snprintf(name, sizeof(name), "%d", next);
+    procfs_dirent(d, PROCFS_VNO(next, 0), name);
+    return (ssize_t)(next - from) + 1;
+}
+
+static long procfs_stat(vnode_t *vn, stat_t *buf)
+{
+    memset(buf, 0, sizeof(stat_t));
+    buf->st_mode = vn->vn_mode;
+    buf->st_ino = (int)vn->vn_vno;
+    buf->st_nlink = S_ISDIR(vn->vn_mode) ? 2 : 1;
+    buf->st_blksize = (int)PAGE_SIZE;
+    return 0;
+}
+
+static long procfs_mknod(vnode_t *dir, const char *name, size_t namelen,
+                         int mode, devid_t devid, vnode_t **out)
+{
+    return -EROFS;
+}
+
+static long procfs_link(vnode_t *dir, const char *name, size_t namelen,
+                        vnode_t *target)
+{
+    return -EROFS;
+}
+
+static long procfs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+    return -EROFS;
+}
+
+static long procfs_rename(vnode_t *olddir, const char *oldname,
+                          size_t oldnamelen, vnode_t *newdir,
+                          const char *newname, size_t newnamelen)
+{
+    return -EROFS;
+}
+
+static long procfs_mkdir(vnode_t *dir, const char *name, size_t namelen,
+                         vnode_t **out)
+{
+    return -EROFS;
+}
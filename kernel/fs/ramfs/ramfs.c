@@ -3,10 +3,13 @@
  * been written.  It is an in-memory filesystem that supports almost all of the
  * vnode operations.  It has the following restrictions:
  *
- *    o File sizes are limited to a single page (4096 bytes) in order
+ *    o Directories are limited to a single page (4096 bytes) in order
  *      to keep the code simple.
  *
- *    o There is no support for fill_pframe, etc. 
+ *    o There is no support for fill_pframe, etc.: the contents of a regular
+ *      file are the pages of an anonymous memory object of its own, so that
+ *      files grow as large as memory (and swap) allow, and mmap() maps the
+ *      very pages read() and write() copy to and from.
  *
  *    o There is a maximum directory size limit
  *
@@ -22,9 +25,12 @@
 #include "globals.h"
 #include "kernel.h"
 #include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/pframe.h"
 #include "mm/slab.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "vm/anon.h"
 
 /*
  * Filesystem operations
@@ -74,10 +80,18 @@ static ssize_t ramfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
 
 static ssize_t ramfs_readdir(vnode_t *dir, size_t offset, struct dirent *d);
 
+static ssize_t ramfs_getdents(vnode_t *dir, size_t offset, struct dirent *d,
+                              size_t count, size_t *nread);
+
 static ssize_t ramfs_stat(vnode_t *file, stat_t *buf);
 
+static long ramfs_mmap(vnode_t *file, mobj_t **ret);
+
 static void ramfs_truncate_file(vnode_t *file);
 
+static long ramfs_fallocate(vnode_t *file, size_t pos, size_t len,
+                            long keep_size);
+
 static vnode_ops_t ramfs_dir_vops = {.read = NULL,
                                      .write = NULL,
                                      .mmap = NULL,
@@ -89,17 +103,20 @@ static vnode_ops_t ramfs_dir_vops = {.read = NULL,
                                      .mkdir = ramfs_mkdir,
                                      .rmdir = ramfs_rmdir,
                                      .readdir = ramfs_readdir,
+                                     .getdents = ramfs_getdents,
                                      .stat = ramfs_stat,
                                      .acquire = NULL,
                                      .release = NULL,
                                      .get_pframe = NULL,
                                      .fill_pframe = NULL,
                                      .flush_pframe = NULL,
-                                     .truncate_file = NULL};
+                                     .truncate_file = NULL,
+                                     .readahead = NULL,
+                                     .page_is_hole = NULL};
 
 static vnode_ops_t ramfs_file_vops = {.read = ramfs_read,
                                       .write = ramfs_write,
-                                      .mmap = NULL,
+                                      .mmap = ramfs_mmap,
                                       .mknod = NULL,
                                       .lookup = NULL,
                                       .link = NULL,
@@ -112,18 +129,28 @@ static vnode_ops_t ramfs_file_vops = {.read = ramfs_read,
                                       .get_pframe = NULL,
                                       .fill_pframe = NULL,
                                       .flush_pframe = NULL,
-                                      .truncate_file = ramfs_truncate_file};
+                                      .truncate_file = ramfs_truncate_file,
+                                      .readahead = NULL,
+                                      .page_is_hole = NULL,
+                                      .fallocate = ramfs_fallocate};
 
 /*
  * The ramfs 'inode' structure
  */
+typedef struct ramfs_dirhash ramfs_dirhash_t;
+
 typedef struct ramfs_inode
 {
     size_t rf_size;       /* Total file size */
     ino_t rf_ino;         /* Inode number */
-    char *rf_mem;         /* Memory for this file (1 page) */
+    char *rf_mem;         /* Entries of a directory (rf_dirslots of them) */
+    mobj_t *rf_mobj;      /* Pages of a regular file, see ramfs_write */
     ssize_t rf_mode;      /* Type of file */
     ssize_t rf_linkcount; /* Number of links to this file */
+
+    size_t rf_dirslots;         /* Entries a directory has room for */
+    size_t rf_dirfree;          /* No free entry comes before this one */
+    ramfs_dirhash_t *rf_dirhash; /* Index of a big directory, or NULL */
 } ramfs_inode_t;
 
 #define RAMFS_TYPE_DATA 0
@@ -136,18 +163,22 @@ typedef struct ramfs_inode
 #define VNODE_TO_DIRENT(vn) ((ramfs_dirent_t *)VNODE_TO_RAMFSINODE(vn)->rf_mem)
 
 /*
- * ramfs filesystem structure
+ * ramfs filesystem structure. The inode table starts out RAMFS_INIT_FILES
+ * long and doubles whenever it is full.
  */
-#define RAMFS_MAX_FILES 64
+#define RAMFS_INIT_FILES 64
 
 typedef struct ramfs
 {
-    ramfs_inode_t *rfs_inodes[RAMFS_MAX_FILES]; /* Array of all files */
+    ramfs_inode_t **rfs_inodes; /* Array of all files */
+    size_t rfs_ninodes;         /* Length of rfs_inodes */
+    size_t rfs_free;            /* No free inode comes before this one */
 } ramfs_t;
 
 /*
  * For directories, we simply store an array of (ino, name) pairs in the
- * memory portion of the inode.
+ * memory portion of the inode. The array starts out a page long and doubles
+ * whenever it is full.
  */
 typedef struct ramfs_dirent
 {
@@ -155,7 +186,290 @@ typedef struct ramfs_dirent
     char rd_name[NAME_LEN]; /* Name of this entry */
 } ramfs_dirent_t;
 
-#define RAMFS_MAX_DIRENT ((size_t)(PAGE_SIZE / sizeof(ramfs_dirent_t)))
+#define RAMFS_DIR_INIT_SLOTS ((size_t)(PAGE_SIZE / sizeof(ramfs_dirent_t)))
+
+/*
+ * Directory index: once a directory outgrows its first page it gets a hash
+ * table from the hash of each name to the slot of its entry, so that
+ * looking a name up, adding one and removing one do not walk the array.
+ * It works like the s5fs one (see s5fs_subr.c): open addressing with
+ * linear probing, at most half full, each entry holding the hash and the
+ * slot plus one, 0 marking an empty entry. A directory whose index could
+ * not be allocated is searched linearly.
+ */
+#define RAMFS_DIRHASH_INIT_SIZE 512
+
+struct ramfs_dirhash
+{
+    size_t dh_size;  /* entries in dh_ents, a power of two */
+    size_t dh_count; /* entries in use */
+    struct
+    {
+        uint32_t de_hash;
+        uint32_t de_slot; /* slot plus one, 0 if the entry is empty */
+    } dh_ents[];
+};
+
+static uint32_t ramfs_name_hash(const char *name, size_t namelen)
+{
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i < namelen && name[i]; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3UL;
+    }
+    return (uint32_t)(hash >> 32);
+}
+
+static ramfs_dirhash_t *ramfs_dirhash_alloc(size_t size)
+{
+    size_t bytes = sizeof(ramfs_dirhash_t) + size * sizeof(uint32_t[2]);
+    ramfs_dirhash_t *dh = kmalloc(bytes);
+    if (dh)
+    {
+        memset(dh, 0, bytes);
+        dh->dh_size = size;
+    }
+    return dh;
+}
+
+static void ramfs_dirhash_add(ramfs_dirhash_t *dh, uint32_t hash,
+                              uint32_t slot)
+{
+    KASSERT(2 * (dh->dh_count + 1) <= dh->dh_size);
+    size_t i = hash & (dh->dh_size - 1);
+    while (dh->dh_ents[i].de_slot)
+    {
+        i = (i + 1) & (dh->dh_size - 1);
+    }
+    dh->dh_ents[i].de_hash = hash;
+    dh->dh_ents[i].de_slot = slot + 1;
+    dh->dh_count++;
+}
+
+static void ramfs_dirhash_free(ramfs_inode_t *dir)
+{
+    if (dir->rf_dirhash)
+    {
+        kfree(dir->rf_dirhash);
+        dir->rf_dirhash = NULL;
+    }
+}
+
+/*
+ * Rebuilds the index of dir from its entries, a quarter full at most, so
+ * that it can take as many again before it is rebuilt. Without the memory
+ * for it the directory goes without.
+ */
+static void ramfs_dirhash_build(ramfs_inode_t *dir)
+{
+    size_t count = dir->rf_size / sizeof(ramfs_dirent_t) + 1;
+    size_t size = RAMFS_DIRHASH_INIT_SIZE;
+    while (size < 4 * count)
+    {
+        size *= 2;
+    }
+    ramfs_dirhash_free(dir);
+    if (!(dir->rf_dirhash = ramfs_dirhash_alloc(size)))
+    {
+        return;
+    }
+    ramfs_dirent_t *entries = (ramfs_dirent_t *)dir->rf_mem;
+    for (size_t i = 0; i < dir->rf_dirslots; i++)
+    {
+        if (entries[i].rd_name[0])
+        {
+            ramfs_dirhash_add(dir->rf_dirhash,
+                              ramfs_name_hash(entries[i].rd_name, NAME_LEN),
+                              (uint32_t)i);
+        }
+    }
+}
+
+/* Removes slot, whose name has the given hash, from dh, moving the entries
+ * after it back so that no probe sequence is broken. */
+static void ramfs_dirhash_remove(ramfs_dirhash_t *dh, uint32_t hash,
+                                 uint32_t slot)
+{
+    size_t mask = dh->dh_size - 1;
+    size_t hole = hash & mask;
+    while (dh->dh_ents[hole].de_slot != slot + 1)
+    {
+        KASSERT(dh->dh_ents[hole].de_slot && "ramfs index is missing a name");
+        hole = (hole + 1) & mask;
+    }
+    for (size_t i = (hole + 1) & mask; dh->dh_ents[i].de_slot;
+         i = (i + 1) & mask)
+    {
+        // An entry may fill the hole if its home is not between the two
+        size_t home = dh->dh_ents[i].de_hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            dh->dh_ents[hole] = dh->dh_ents[i];
+            hole = i;
+        }
+    }
+    dh->dh_ents[hole].de_slot = 0;
+    dh->dh_count--;
+}
+
+/* Returns the slot of the entry of dir named name, or -ENOENT. */
+static ssize_t ramfs_dir_search(ramfs_inode_t *dir, const char *name,
+                                size_t namelen)
+{
+    ramfs_dirent_t *entries = (ramfs_dirent_t *)dir->rf_mem;
+    ramfs_dirhash_t *dh = dir->rf_dirhash;
+    if (!dh)
+    {
+        for (size_t i = 0; i < dir->rf_dirslots; i++)
+        {
+            if (name_match(entries[i].rd_name, name, namelen))
+            {
+                return (ssize_t)i;
+            }
+        }
+        return -ENOENT;
+    }
+    uint32_t hash = ramfs_name_hash(name, MIN(namelen, NAME_LEN - 1));
+    for (size_t i = hash & (dh->dh_size - 1); dh->dh_ents[i].de_slot;
+         i = (i + 1) & (dh->dh_size - 1))
+    {
+        size_t slot = dh->dh_ents[i].de_slot - 1;
+        if (dh->dh_ents[i].de_hash == hash &&
+            name_match(entries[slot].rd_name, name, namelen))
+        {
+            return (ssize_t)slot;
+        }
+    }
+    return -ENOENT;
+}
+
+/*
+ * Returns a free slot of dir, growing it if it is full, or -ENOSPC. The
+ * slot stays free until ramfs_dir_fill fills it.
+ */
+static ssize_t ramfs_dir_alloc_slot(ramfs_inode_t *dir)
+{
+    ramfs_dirent_t *entries = (ramfs_dirent_t *)dir->rf_mem;
+    while (dir->rf_dirfree < dir->rf_dirslots &&
+           entries[dir->rf_dirfree].rd_name[0])
+    {
+        dir->rf_dirfree++;
+    }
+    if (dir->rf_dirfree < dir->rf_dirslots)
+    {
+        return (ssize_t)dir->rf_dirfree;
+    }
+
+    size_t slots = 2 * dir->rf_dirslots;
+    if (slots > (uint32_t)-1)
+    {
+        return -ENOSPC;
+    }
+    ramfs_dirent_t *bigger = kmalloc(slots * sizeof(ramfs_dirent_t));
+    if (!bigger)
+    {
+        return -ENOSPC;
+    }
+    memcpy(bigger, entries, dir->rf_dirslots * sizeof(ramfs_dirent_t));
+    memset(bigger + dir->rf_dirslots, 0,
+           (slots - dir->rf_dirslots) * sizeof(ramfs_dirent_t));
+    kfree(dir->rf_mem);
+    dir->rf_mem = (char *)bigger;
+    dir->rf_dirslots = slots;
+    if (!dir->rf_dirhash)
+    {
+        /* The first time the directory grows, and whenever the index has
+         * been dropped for want of memory */
+        ramfs_dirhash_build(dir);
+    }
+    return (ssize_t)dir->rf_dirfree;
+}
+
+/* Fills slot of dir, which ramfs_dir_alloc_slot returned, with name and
+ * ino. */
+static void ramfs_dir_fill(ramfs_inode_t *dir, size_t slot, const char *name,
+                           size_t namelen, ssize_t ino)
+{
+    ramfs_dirent_t *entry = (ramfs_dirent_t *)dir->rf_mem + slot;
+    KASSERT(slot < dir->rf_dirslots && !entry->rd_name[0]);
+    entry->rd_ino = ino;
+    strncpy(entry->rd_name, name, MIN(namelen, NAME_LEN - 1));
+    entry->rd_name[MIN(namelen, NAME_LEN - 1)] = '\0';
+    dir->rf_size += sizeof(ramfs_dirent_t);
+
+    ramfs_dirhash_t *dh = dir->rf_dirhash;
+    if (dh && 2 * (dh->dh_count + 1) > dh->dh_size)
+    {
+        ramfs_dirhash_build(dir);
+    }
+    else if (dh)
+    {
+        ramfs_dirhash_add(dh, ramfs_name_hash(entry->rd_name, NAME_LEN),
+                          (uint32_t)slot);
+    }
+}
+
+/* Empties slot of dir. */
+static void ramfs_dir_clear(ramfs_inode_t *dir, size_t slot)
+{
+    ramfs_dirent_t *entry = (ramfs_dirent_t *)dir->rf_mem + slot;
+    KASSERT(slot < dir->rf_dirslots && entry->rd_name[0]);
+    if (dir->rf_dirhash)
+    {
+        ramfs_dirhash_remove(dir->rf_dirhash,
+                             ramfs_name_hash(entry->rd_name, NAME_LEN),
+                             (uint32_t)slot);
+    }
+    entry->rd_name[0] = '\0';
+    dir->rf_size -= sizeof(ramfs_dirent_t);
+    dir->rf_dirfree = MIN(dir->rf_dirfree, slot);
+}
+
+/* Frees what inode holds, and inode itself. */
+static void ramfs_free_inode(ramfs_inode_t *inode)
+{
+    if (inode->rf_mode == RAMFS_TYPE_DATA)
+    {
+        /* Mappings of the file keep its pages until they go */
+        mobj_put(&inode->rf_mobj);
+    }
+    else if (inode->rf_mode == RAMFS_TYPE_DIR)
+    {
+        ramfs_dirhash_free(inode);
+        kfree(inode->rf_mem);
+    }
+    /* otherwise, inode->rf_mem is a devid */
+    kfree(inode);
+}
+
+/* Returns a free inode number of rfs, growing its table if it is full, or
+ * -ENOSPC. */
+static ssize_t ramfs_alloc_ino(ramfs_t *rfs)
+{
+    while (rfs->rfs_free < rfs->rfs_ninodes && rfs->rfs_inodes[rfs->rfs_free])
+    {
+        rfs->rfs_free++;
+    }
+    if (rfs->rfs_free == rfs->rfs_ninodes)
+    {
+        size_t n = rfs->rfs_ninodes ? 2 * rfs->rfs_ninodes : RAMFS_INIT_FILES;
+        ramfs_inode_t **bigger = kmalloc(n * sizeof(ramfs_inode_t *));
+        if (!bigger)
+        {
+            return -ENOSPC;
+        }
+        memset(bigger, 0, n * sizeof(ramfs_inode_t *));
+        if (rfs->rfs_inodes)
+        {
+            memcpy(bigger, rfs->rfs_inodes,
+                   rfs->rfs_ninodes * sizeof(ramfs_inode_t *));
+            kfree(rfs->rfs_inodes);
+        }
+        rfs->rfs_inodes = bigger;
+        rfs->rfs_ninodes = n;
+    }
+    return (ssize_t)rfs->rfs_free;
+}
 
 /* Helper functions */
 static ssize_t ramfs_alloc_inode(fs_t *fs, ssize_t type, devid_t devid)
@@ -164,43 +478,56 @@ static ssize_t ramfs_alloc_inode(fs_t *fs, ssize_t type, devid_t devid)
     KASSERT((RAMFS_TYPE_DATA == type) || (RAMFS_TYPE_DIR == type) ||
             (RAMFS_TYPE_CHR == type) || (RAMFS_TYPE_BLK == type));
     /* Find a free inode */
-    ssize_t i;
-    for (i = 0; i < RAMFS_MAX_FILES; i++)
+    ssize_t i = ramfs_alloc_ino(rfs);
+    if (i < 0)
     {
-        if (NULL == rfs->rfs_inodes[i])
-        {
-            ramfs_inode_t *inode;
-            if (NULL == (inode = kmalloc(sizeof(ramfs_inode_t))))
-            {
-                return -ENOSPC;
-            }
+        return i;
+    }
 
-            if (RAMFS_TYPE_CHR == type || RAMFS_TYPE_BLK == type)
-            {
-                /* Don't need any space in memory, so put devid in here */
-                inode->rf_mem = (char *)(uint64_t)devid;
-            }
-            else
-            {
-                /* We allocate space for the file's contents immediately */
-                if (NULL == (inode->rf_mem = page_alloc()))
-                {
-                    kfree(inode);
-                    return -ENOSPC;
-                }
-                memset(inode->rf_mem, 0, PAGE_SIZE);
-            }
-            inode->rf_size = 0;
-            inode->rf_ino = i;
-            inode->rf_mode = type;
-            inode->rf_linkcount = 1;
-
-            /* Install in table and return */
-            rfs->rfs_inodes[i] = inode;
-            return i;
+    ramfs_inode_t *inode;
+    if (NULL == (inode = kmalloc(sizeof(ramfs_inode_t))))
+    {
+        return -ENOSPC;
+    }
+
+    inode->rf_mobj = NULL;
+    inode->rf_dirslots = inode->rf_dirfree = 0;
+    inode->rf_dirhash = NULL;
+    if (RAMFS_TYPE_CHR == type || RAMFS_TYPE_BLK == type)
+    {
+        /* Don't need any space in memory, so put devid in here */
+        inode->rf_mem = (char *)(uint64_t)devid;
+    }
+    else if (RAMFS_TYPE_DATA == type)
+    {
+        /* Pages are only allocated as the file is written */
+        if (NULL == (inode->rf_mobj = anon_create()))
+        {
+            kfree(inode);
+            return -ENOSPC;
         }
+        mobj_unlock(inode->rf_mobj);
+        inode->rf_mem = NULL;
     }
-    return -ENOSPC;
+    else
+    {
+        /* We allocate the directory's first page of entries immediately */
+        if (NULL == (inode->rf_mem = kmalloc(PAGE_SIZE)))
+        {
+            kfree(inode);
+            return -ENOSPC;
+        }
+        memset(inode->rf_mem, 0, PAGE_SIZE);
+        inode->rf_dirslots = RAMFS_DIR_INIT_SLOTS;
+    }
+    inode->rf_size = 0;
+    inode->rf_ino = i;
+    inode->rf_mode = type;
+    inode->rf_linkcount = 1;
+
+    /* Install in table and return */
+    rfs->rfs_inodes[i] = inode;
+    return i;
 }
 
 /*
@@ -216,7 +543,8 @@ long ramfs_mount(struct fs *fs)
         return -ENOMEM;
     }
 
-    memset(rfs->rfs_inodes, 0, sizeof(rfs->rfs_inodes));
+    rfs->rfs_inodes = NULL;
+    rfs->rfs_ninodes = rfs->rfs_free = 0;
 
     fs->fs_i = rfs;
     fs->fs_ops = &ramfs_ops;
@@ -229,7 +557,8 @@ long ramfs_mount(struct fs *fs)
     }
 
     slab_allocator_t *allocator =
-        slab_allocator_create("ramfs_node", sizeof(vnode_t));
+        slab_allocator_create_ctor("ramfs_node", sizeof(vnode_t), vnode_ctor,
+                                   NULL);
     fs->fs_vnode_allocator = allocator;
     KASSERT(allocator);
 
@@ -237,18 +566,8 @@ long ramfs_mount(struct fs *fs)
     ramfs_inode_t *root = rfs->rfs_inodes[root_ino];
 
     /* Set up '.' and '..' in the root directory */
-    ramfs_dirent_t *rootdent = (ramfs_dirent_t *)root->rf_mem;
-    rootdent->rd_ino = 0;
-    strcpy(rootdent->rd_name, ".");
-    rootdent++;
-    rootdent->rd_ino = 0;
-    strcpy(rootdent->rd_name, "..");
-
-    /* Increase root inode size accordingly */
-    root->rf_size = 2 * sizeof(ramfs_dirent_t);
-
-    /* Put the root in the inode table */
-    rfs->rfs_inodes[0] = root;
+    ramfs_dir_fill(root, 0, ".", 1, 0);
+    ramfs_dir_fill(root, 1, "..", 2, 0);
 
     /* And vget the root vnode */
     fs->fs_root = vget(fs, 0);
@@ -305,14 +624,8 @@ static void ramfs_delete_vnode(fs_t *fs, vnode_t *vn)
         KASSERT(rfs->rfs_inodes[vn->vn_vno] == inode);
 
         rfs->rfs_inodes[vn->vn_vno] = NULL;
-        if (inode->rf_mode == RAMFS_TYPE_DATA ||
-            inode->rf_mode == RAMFS_TYPE_DIR)
-        {
-            page_free(inode->rf_mem);
-        }
-        /* otherwise, inode->rf_mem is a devid */
-
-        kfree(inode);
+        rfs->rfs_free = MIN(rfs->rfs_free, (size_t)vn->vn_vno);
+        ramfs_free_inode(inode);
     }
 }
 
@@ -325,20 +638,15 @@ static ssize_t ramfs_umount(fs_t *fs)
     vput(&fs->fs_root);
 
     /* Free all the inodes */
-    ssize_t i;
-    for (i = 0; i < RAMFS_MAX_FILES; i++)
+    size_t i;
+    for (i = 0; i < rfs->rfs_ninodes; i++)
     {
         if (NULL != rfs->rfs_inodes[i])
         {
-            if (NULL != rfs->rfs_inodes[i]->rf_mem &&
-                (rfs->rfs_inodes[i]->rf_mode == RAMFS_TYPE_DATA ||
-                 rfs->rfs_inodes[i]->rf_mode == RAMFS_TYPE_DIR))
-            {
-                page_free(rfs->rfs_inodes[i]->rf_mem);
-            }
-            kfree(rfs->rfs_inodes[i]);
+            ramfs_free_inode(rfs->rfs_inodes[i]);
         }
     }
+    kfree(rfs->rfs_inodes);
 
     return 0;
 }
@@ -347,22 +655,13 @@ static ssize_t ramfs_create(vnode_t *dir, const char *name, size_t name_len,
                             vnode_t **result)
 {
     vnode_t *vn;
-    size_t i;
-    ramfs_dirent_t *entry;
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
 
     /* Look for space in the directory */
-    entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
+    ssize_t slot = ramfs_dir_alloc_slot(dinode);
+    if (slot < 0)
     {
-        if (!entry->rd_name[0])
-        {
-            break;
-        }
-    }
-
-    if (i == RAMFS_MAX_DIRENT)
-    {
-        return -ENOSPC;
+        return slot;
     }
 
     /* Allocate an inode */
@@ -375,11 +674,7 @@ static ssize_t ramfs_create(vnode_t *dir, const char *name, size_t name_len,
     /* Get a vnode, set entry in directory */
     vn = vget(dir->vn_fs, (ino_t)ino);
 
-    entry->rd_ino = vn->vn_vno;
-    strncpy(entry->rd_name, name, MIN(name_len, NAME_LEN - 1));
-    entry->rd_name[MIN(name_len, NAME_LEN - 1)] = '\0';
-
-    VNODE_TO_RAMFSINODE(dir)->rf_size += sizeof(ramfs_dirent_t);
+    ramfs_dir_fill(dinode, (size_t)slot, name, name_len, vn->vn_vno);
 
     *result = vn;
 
@@ -389,22 +684,13 @@ static ssize_t ramfs_create(vnode_t *dir, const char *name, size_t name_len,
 static ssize_t ramfs_mknod(struct vnode *dir, const char *name, size_t name_len,
                            int mode, devid_t devid, struct vnode **out)
 {
-    size_t i;
-    ramfs_dirent_t *entry;
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
 
     /* Look for space in the directory */
-    entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
-    {
-        if (!entry->rd_name[0])
-        {
-            break;
-        }
-    }
-
-    if (i == RAMFS_MAX_DIRENT)
+    ssize_t slot = ramfs_dir_alloc_slot(dinode);
+    if (slot < 0)
     {
-        return -ENOSPC;
+        return slot;
     }
 
     ssize_t ino;
@@ -431,16 +717,12 @@ static ssize_t ramfs_mknod(struct vnode *dir, const char *name, size_t name_len,
     }
 
     /* Set entry in directory */
-    entry->rd_ino = ino;
-    strncpy(entry->rd_name, name, MIN(name_len, NAME_LEN - 1));
-    entry->rd_name[MIN(name_len, NAME_LEN - 1)] = '\0';
-
-    VNODE_TO_RAMFSINODE(dir)->rf_size += sizeof(ramfs_dirent_t);
+    ramfs_dir_fill(dinode, (size_t)slot, name, name_len, ino);
 
     vnode_t *child = vget(dir->vn_fs, ino);
 
     dbg(DBG_VFS, "creating ino(%ld), vno(%d) with path: %s\n", ino,
-        child->vn_vno, entry->rd_name);
+        child->vn_vno, VNODE_TO_DIRENT(dir)[slot].rd_name);
 
     KASSERT(child);
     *out = child;
@@ -450,84 +732,54 @@ static ssize_t ramfs_mknod(struct vnode *dir, const char *name, size_t name_len,
 static ssize_t ramfs_lookup(vnode_t *dir, const char *name, size_t namelen,
                             vnode_t **out)
 {
-    size_t i;
-    ramfs_inode_t *inode = VNODE_TO_RAMFSINODE(dir);
-    ramfs_dirent_t *entry = (ramfs_dirent_t *)inode->rf_mem;
-
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
+    ssize_t slot = ramfs_dir_search(VNODE_TO_RAMFSINODE(dir), name, namelen);
+    if (slot < 0)
     {
-        if (name_match(entry->rd_name, name, namelen))
-        {
-            if (dir->vn_vno != entry->rd_ino)
-            {
-                fs_t *fs = (dir)->vn_fs;
-                *out = vget(fs, entry->rd_ino);
-            }
-            else
-            {
-                vref(dir);
-                *out = dir;
-            }
-            return 0;
-        }
+        return slot;
     }
 
-    return -ENOENT;
+    ramfs_dirent_t *entry = VNODE_TO_DIRENT(dir) + slot;
+    if (dir->vn_vno != entry->rd_ino)
+    {
+        fs_t *fs = (dir)->vn_fs;
+        *out = vget(fs, entry->rd_ino);
+    }
+    else
+    {
+        vref(dir);
+        *out = dir;
+    }
+    return 0;
 }
 
 static ssize_t ramfs_find_dirent(vnode_t *dir, const char *name,
                                  size_t namelen)
 {
-    size_t i;
-    ramfs_inode_t *inode = VNODE_TO_RAMFSINODE(dir);
-    ramfs_dirent_t *entry = (ramfs_dirent_t *)inode->rf_mem;
-
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
-    {
-        if (name_match(entry->rd_name, name, namelen))
-        {
-            return entry->rd_ino;
-        }
-    }
-
-    return -ENOENT;
+    ssize_t slot = ramfs_dir_search(VNODE_TO_RAMFSINODE(dir), name, namelen);
+    return slot < 0 ? slot : VNODE_TO_DIRENT(dir)[slot].rd_ino;
 }
 
 static ssize_t ramfs_append_dirent(vnode_t *dir, const char *name,
                                    size_t namelen, vnode_t *child)
 {
-    vnode_t *vn;
-    size_t i;
-    ramfs_dirent_t *entry;
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
 
     KASSERT(child->vn_fs == dir->vn_fs);
 
-    /* Look for space in the directory */
-    entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
+    if (ramfs_dir_search(dinode, name, namelen) >= 0)
     {
-        if (name_match(entry->rd_name, name, namelen))
-        {
-            return -EEXIST;
-        }
-
-        if (!entry->rd_name[0])
-        {
-            break;
-        }
+        return -EEXIST;
     }
 
-    if (i == RAMFS_MAX_DIRENT)
+    /* Look for space in the directory */
+    ssize_t slot = ramfs_dir_alloc_slot(dinode);
+    if (slot < 0)
     {
-        return -ENOSPC;
+        return slot;
     }
 
     /* Set entry in parent */
-    entry->rd_ino = child->vn_vno;
-    strncpy(entry->rd_name, name, MIN(namelen, NAME_LEN - 1));
-    entry->rd_name[MIN(namelen, NAME_LEN - 1)] = '\0';
-
-    VNODE_TO_RAMFSINODE(dir)->rf_size += sizeof(ramfs_dirent_t);
+    ramfs_dir_fill(dinode, (size_t)slot, name, namelen, child->vn_vno);
 
     /* Increase linkcount */
     VNODE_TO_RAMFSINODE(child)->rf_linkcount++;
@@ -538,25 +790,14 @@ static ssize_t ramfs_append_dirent(vnode_t *dir, const char *name,
 static ssize_t ramfs_delete_dirent(vnode_t *dir, const char *name,
                                    size_t namelen, vnode_t *child)
 {
-    int found = 0;
-    size_t i;
-    ramfs_dirent_t *entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
-    {
-        if (name_match(entry->rd_name, name, namelen))
-        {
-            found = 1;
-            entry->rd_name[0] = '\0';
-            break;
-        }
-    }
-
-    if (!found)
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
+    ssize_t slot = ramfs_dir_search(dinode, name, namelen);
+    if (slot < 0)
     {
         return -EEXIST;
     }
 
-    VNODE_TO_RAMFSINODE(dir)->rf_size -= sizeof(ramfs_dirent_t);
+    ramfs_dir_clear(dinode, (size_t)slot);
     VNODE_TO_RAMFSINODE(child)->rf_linkcount--;
 
     return 0;
@@ -642,23 +883,13 @@ static ssize_t ramfs_rename(vnode_t *olddir, const char *oldname,
 static ssize_t ramfs_mkdir(vnode_t *dir, const char *name, size_t name_len,
                            struct vnode **out)
 {
-    vnode_t *vn;
-    size_t i;
-    ramfs_dirent_t *entry;
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
 
     /* Look for space in the directory */
-    entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
-    {
-        if (!entry->rd_name[0])
-        {
-            break;
-        }
-    }
-
-    if (i == RAMFS_MAX_DIRENT)
+    ssize_t slot = ramfs_dir_alloc_slot(dinode);
+    if (slot < 0)
     {
-        return -ENOSPC;
+        return slot;
     }
 
     /* Allocate an inode */
@@ -669,22 +900,12 @@ static ssize_t ramfs_mkdir(vnode_t *dir, const char *name, size_t name_len,
     }
 
     /* Set entry in parent */
-    entry->rd_ino = ino;
-    strncpy(entry->rd_name, name, MIN(name_len, NAME_LEN - 1));
-    entry->rd_name[MIN(name_len, NAME_LEN - 1)] = '\0';
-
-    VNODE_TO_RAMFSINODE(dir)->rf_size += sizeof(ramfs_dirent_t);
+    ramfs_dir_fill(dinode, (size_t)slot, name, name_len, ino);
 
     /* Set up '.' and '..' in the directory */
-    entry = (ramfs_dirent_t *)VNODE_TO_RAMFS(dir)->rfs_inodes[ino]->rf_mem;
-    entry->rd_ino = ino;
-    strcpy(entry->rd_name, ".");
-    entry++;
-    entry->rd_ino = dir->vn_vno;
-    strcpy(entry->rd_name, "..");
-
-    /* Increase inode size accordingly */
-    VNODE_TO_RAMFS(dir)->rfs_inodes[ino]->rf_size = 2 * sizeof(ramfs_dirent_t);
+    ramfs_inode_t *child = VNODE_TO_RAMFS(dir)->rfs_inodes[ino];
+    ramfs_dir_fill(child, 0, ".", 1, ino);
+    ramfs_dir_fill(child, 1, "..", 2, dir->vn_vno);
 
     /* This probably can't fail... (unless OOM :/) */
     *out = vget(dir->vn_fs, ino);
@@ -694,53 +915,35 @@ static ssize_t ramfs_mkdir(vnode_t *dir, const char *name, size_t name_len,
 
 static ssize_t ramfs_rmdir(vnode_t *dir, const char *name, size_t name_len)
 {
-    ssize_t ret;
-    size_t i;
-    ramfs_dirent_t *entry;
+    ramfs_inode_t *dinode = VNODE_TO_RAMFSINODE(dir);
 
     KASSERT(!name_match(".", name, name_len) &&
             !name_match("..", name, name_len));
 
-    long ino = ramfs_find_dirent(dir, name, name_len);
-    if (ino < 0)
+    ssize_t slot = ramfs_dir_search(dinode, name, name_len);
+    if (slot < 0)
     {
-        return ino;
+        return slot;
     }
 
-    vnode_t *child = vget_locked(dir->vn_fs, (ino_t)ino);
+    vnode_t *child =
+        vget_locked(dir->vn_fs, (ino_t)VNODE_TO_DIRENT(dir)[slot].rd_ino);
     if (!S_ISDIR(child->vn_mode))
     {
         vput_locked(&child);
         return -ENOTDIR;
     }
 
-    /* We have to make sure that this directory is empty */
-    entry = VNODE_TO_DIRENT(child);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
+    /* We have to make sure that this directory is empty: all it may hold
+     * are '.' and '..' */
+    if (VNODE_TO_RAMFSINODE(child)->rf_size > 2 * sizeof(ramfs_dirent_t))
     {
-        if (!strcmp(entry->rd_name, ".") || !strcmp(entry->rd_name, ".."))
-        {
-            continue;
-        }
-
-        if (entry->rd_name[0])
-        {
-            vput_locked(&child);
-            return -ENOTEMPTY;
-        }
+        vput_locked(&child);
+        return -ENOTEMPTY;
     }
 
     /* Finally, remove the entry from the parent directory */
-    entry = VNODE_TO_DIRENT(dir);
-    for (i = 0; i < RAMFS_MAX_DIRENT; i++, entry++)
-    {
-        if (name_match(entry->rd_name, name, name_len))
-        {
-            entry->rd_name[0] = '\0';
-            break;
-        }
-    }
-    VNODE_TO_RAMFSINODE(dir)->rf_size -= sizeof(ramfs_dirent_t);
+    ramfs_dir_clear(dinode, (size_t)slot);
 
     VNODE_TO_RAMFSINODE(child)->rf_linkcount--;
     vput_locked(&child);
@@ -751,44 +954,139 @@ static ssize_t ramfs_rmdir(vnode_t *dir, const char *name, size_t name_len)
 static ssize_t ramfs_read(vnode_t *file, size_t offset, void *buf,
                           size_t count)
 {
-    ssize_t ret;
     ramfs_inode_t *inode = VNODE_TO_RAMFSINODE(file);
+    mobj_t *o = inode->rf_mobj;
 
     KASSERT(!S_ISDIR(file->vn_mode));
 
-    if (offset > inode->rf_size)
-    {
-        ret = 0;
-    }
-    else if (offset + count > inode->rf_size)
+    if (offset >= inode->rf_size)
     {
-        ret = inode->rf_size - offset;
+        return 0;
     }
-    else
+    count = MIN(count, inode->rf_size - offset);
+
+    size_t done = 0;
+    long ret = 0;
+    mobj_lock(o);
+    while (done < count)
     {
-        ret = count;
+        size_t pagenum = (offset + done) / PAGE_SIZE;
+        size_t off = (offset + done) % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - off, count - done);
+        /* Pages never written read as zeros without being allocated */
+        pframe_t *pf = NULL;
+        if (!mobj_page_is_zero(o, pagenum) &&
+            (ret = mobj_get_pframe(o, pagenum, 0, &pf)) < 0)
+        {
+            break;
+        }
+        memcpy((char *)buf + done,
+               (char *)(pf ? pf->pf_addr : pframe_zero_page) + off, n);
+        if (pf)
+        {
+            pframe_release(&pf);
+        }
+        done += n;
     }
-
-    memcpy(buf, inode->rf_mem + offset, ret);
-    return ret;
+    mobj_unlock(o);
+    return ret < 0 ? ret : (ssize_t)done;
 }
 
+/*
+ * Writes go straight into the pages of the file's memory object, which are
+ * allocated (zeroed) the first time they are written. Running out of memory
+ * ends the write short, or with ENOSPC if nothing was written.
+ */
 static ssize_t ramfs_write(vnode_t *file, size_t offset, const void *buf,
                            size_t count)
 {
-    ssize_t ret;
     ramfs_inode_t *inode = VNODE_TO_RAMFSINODE(file);
+    mobj_t *o = inode->rf_mobj;
 
     KASSERT(!S_ISDIR(file->vn_mode));
 
-    ret = MIN((size_t)count, (size_t)PAGE_SIZE - offset);
-    memcpy(inode->rf_mem + offset, buf, ret);
+    size_t done = 0;
+    long ret = 0;
+    mobj_lock(o);
+    while (done < count)
+    {
+        size_t pagenum = (offset + done) / PAGE_SIZE;
+        size_t off = (offset + done) % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - off, count - done);
+        pframe_t *pf;
+        if ((ret = mobj_get_pframe(o, pagenum, 1, &pf)) < 0)
+        {
+            break;
+        }
+        memcpy((char *)pf->pf_addr + off, (const char *)buf + done, n);
+        pframe_release(&pf);
+        done += n;
+    }
+    mobj_unlock(o);
 
     KASSERT(file->vn_len == inode->rf_size);
-    file->vn_len = MAX(file->vn_len, offset + ret);
+    file->vn_len = MAX(file->vn_len, offset + done);
     inode->rf_size = file->vn_len;
 
-    return ret;
+    if (!done && ret < 0)
+    {
+        return ret == -ENOMEM ? -ENOSPC : ret;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * See fallocate in vnode.h: the pages of [pos, pos + len) are allocated
+ * (zeroed) as a write would, so that memory for them is committed now. This
+ * is also how a file, such as a shared memory object under /dev/shm, is
+ * given a size without writing it. Running out of memory fails with ENOSPC;
+ * the pages allocated by then stay.
+ */
+static long ramfs_fallocate(vnode_t *file, size_t pos, size_t len,
+                            long keep_size)
+{
+    ramfs_inode_t *inode = VNODE_TO_RAMFSINODE(file);
+    mobj_t *o = inode->rf_mobj;
+
+    long ret = 0;
+    mobj_lock(o);
+    for (size_t pagenum = pos / PAGE_SIZE;
+         pagenum < ADDR_TO_PN(PAGE_ALIGN_UP(pos + len)); pagenum++)
+    {
+        pframe_t *pf;
+        if ((ret = mobj_get_pframe(o, pagenum, 1, &pf)) < 0)
+        {
+            break;
+        }
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+    if (ret < 0)
+    {
+        return ret == -ENOMEM ? -ENOSPC : ret;
+    }
+
+    if (!keep_size && pos + len > file->vn_len)
+    {
+        file->vn_len = pos + len;
+        inode->rf_size = file->vn_len;
+    }
+    return 0;
+}
+
+/*
+ * Like s5fs_mmap, except that what is mapped is the file's memory object
+ * rather than the vnode's; a private mapping gets a shadow object on top of
+ * it (see vmmap_map).
+ */
+static long ramfs_mmap(vnode_t *file, mobj_t **ret)
+{
+    KASSERT(file && ret);
+
+    mobj_t *o = VNODE_TO_RAMFSINODE(file)->rf_mobj;
+    mobj_ref(o);
+    *ret = o;
+    return 0;
 }
 
 static ssize_t ramfs_readdir(vnode_t *dir, size_t offset, struct dirent *d)
@@ -799,18 +1097,18 @@ static ssize_t ramfs_readdir(vnode_t *dir, size_t offset, struct dirent *d)
     KASSERT(S_ISDIR(dir->vn_mode));
     KASSERT(0 == offset % sizeof(ramfs_dirent_t));
 
+    size_t end = VNODE_TO_RAMFSINODE(dir)->rf_dirslots * sizeof(ramfs_dirent_t);
     dir_entry = VNODE_TO_DIRENT(dir);
     dir_entry = (ramfs_dirent_t *)(((char *)dir_entry) + offset);
     targ_entry = dir_entry;
 
-    while ((offset < (size_t)(RAMFS_MAX_DIRENT * sizeof(ramfs_dirent_t))) &&
-           (!targ_entry->rd_name[0]))
+    while ((offset < end) && (!targ_entry->rd_name[0]))
     {
         ++targ_entry;
         offset += sizeof(ramfs_dirent_t);
     }
 
-    if (offset >= (size_t)(RAMFS_MAX_DIRENT * sizeof(ramfs_dirent_t)))
+    if (offset >= end)
     {
         return 0;
     }
@@ -825,6 +1123,34 @@ static ssize_t ramfs_readdir(vnode_t *dir, size_t offset, struct dirent *d)
     return ret;
 }
 
+/* Fills d with the used entries from offset on, in one walk of the array */
+static ssize_t ramfs_getdents(vnode_t *dir, size_t offset, struct dirent *d,
+                              size_t count, size_t *nread)
+{
+    KASSERT(S_ISDIR(dir->vn_mode));
+    KASSERT(0 == offset % sizeof(ramfs_dirent_t));
+
+    ramfs_dirent_t *entries = VNODE_TO_DIRENT(dir);
+    size_t i = offset / sizeof(ramfs_dirent_t);
+    size_t last = i;
+    *nread = 0;
+    size_t slots = VNODE_TO_RAMFSINODE(dir)->rf_dirslots;
+    for (; i < slots && *nread < count; i++)
+    {
+        if (!entries[i].rd_name[0])
+        {
+            continue;
+        }
+        d[*nread].d_ino = entries[i].rd_ino;
+        d[*nread].d_off = 0; /* unused */
+        strncpy(d[*nread].d_name, entries[i].rd_name, NAME_LEN - 1);
+        d[*nread].d_name[NAME_LEN - 1] = '\0';
+        (*nread)++;
+        last = i + 1;
+    }
+    return (last - offset / sizeof(ramfs_dirent_t)) * sizeof(ramfs_dirent_t);
+}
+
 static ssize_t ramfs_stat(vnode_t *file, stat_t *buf)
 {
     ramfs_inode_t *i = VNODE_TO_RAMFSINODE(file);
@@ -839,7 +1165,8 @@ static ssize_t ramfs_stat(vnode_t *file, stat_t *buf)
     buf->st_nlink = i->rf_linkcount - 1;
     buf->st_size = (ssize_t)i->rf_size;
     buf->st_blksize = (ssize_t)PAGE_SIZE;
-    buf->st_blocks = 1;
+    buf->st_blocks = i->rf_mobj ? (ssize_t)ADDR_TO_PN(PAGE_ALIGN_UP(i->rf_size))
+                                : 1;
 
     return 0;
 }
@@ -848,7 +1175,22 @@ static void ramfs_truncate_file(vnode_t *file)
 {
     KASSERT(S_ISREG(file->vn_mode) && "This routine should only be called for regular files");
     ramfs_inode_t *i = VNODE_TO_RAMFSINODE(file);
+    mobj_t *o = i->rf_mobj;
     i->rf_size = 0;
     file->vn_len = 0;
-    memset(i->rf_mem, 0, PAGE_SIZE);
+
+    /* Pages that are mapped or in use cannot be discarded, so they are
+     * zeroed instead, as if never written */
+    mobj_lock(o);
+    mobj_discard_range(o, 0, (uint64_t)-1);
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    {
+        kmutex_lock(&pf->pf_mutex);
+        if (pf->pf_addr)
+        {
+            memset(pf->pf_addr, 0, PAGE_SIZE);
+        }
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
 }
\ No newline at end of file
@@ -8,12 +8,19 @@
 #include "util/string.h"
 
 #include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "proc/workqueue.h"
 
 #include "fs/dirent.h"
 #include "fs/file.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/stat.h"
+#include "fs/writeback.h"
 
 #include "mm/kmalloc.h"
 
@@ -21,10 +28,14 @@ static long s5_check_super(s5_super_t *super);
 
 static long s5fs_check_refcounts(fs_t *fs);
 
+static void s5_reaper_drain(s5fs_t *s5fs);
+
 static void s5fs_read_vnode(fs_t *fs, vnode_t *vn);
 
 static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn);
 
+static long s5fs_cache_vnode(fs_t *fs, vnode_t *vn);
+
 static long s5fs_umount(fs_t *fs);
 
 static void s5fs_sync(fs_t *fs);
@@ -58,6 +69,9 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 
 static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d);
 
+static ssize_t s5fs_getdents(vnode_t *vnode, size_t pos, struct dirent *d,
+                             size_t count, size_t *nread);
+
 static long s5fs_stat(vnode_t *vnode, stat_t *ss);
 
 static void s5fs_truncate_file(vnode_t *vnode);
@@ -67,12 +81,28 @@ static long s5fs_release(vnode_t *vnode, file_t *file);
 static long s5fs_get_pframe(vnode_t *vnode, size_t pagenum, long forwrite,
                             pframe_t **pfp);
 
+static long s5fs_dir_get_pframe(vnode_t *vnode, size_t pagenum, long forwrite,
+                                pframe_t **pfp);
+
 static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf);
 
 static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf);
 
+static void s5fs_readahead(vnode_t *vnode, size_t pagenum, size_t npages);
+
+static ssize_t s5fs_direct_io(vnode_t *vnode, size_t pos, char **pages,
+                              size_t npages, long write);
+
+static long s5fs_page_is_hole(vnode_t *vnode, size_t pagenum);
+
+static long s5fs_fsync(vnode_t *vnode, long datasync);
+
+static long s5fs_fallocate(vnode_t *vnode, size_t pos, size_t len,
+                           long keep_size);
+
 fs_ops_t s5fs_fsops = {.read_vnode = s5fs_read_vnode,
                        .delete_vnode = s5fs_delete_vnode,
+                       .cache_vnode = s5fs_cache_vnode,
                        .umount = s5fs_umount,
                        .sync = s5fs_sync};
 
@@ -87,13 +117,17 @@ static vnode_ops_t s5fs_dir_vops = {.read = NULL,
                                     .mkdir = s5fs_mkdir,
                                     .rmdir = s5fs_rmdir,
                                     .readdir = s5fs_readdir,
+                                    .getdents = s5fs_getdents,
                                     .stat = s5fs_stat,
                                     .acquire = NULL,
                                     .release = NULL,
-                                    .get_pframe = s5fs_get_pframe,
+                                    .get_pframe = s5fs_dir_get_pframe,
                                     .fill_pframe = s5fs_fill_pframe,
                                     .flush_pframe = s5fs_flush_pframe,
-                                    .truncate_file = NULL};
+                                    .truncate_file = NULL,
+                                    .readahead = NULL,
+                                    .page_is_hole = s5fs_page_is_hole,
+                                    .fsync = s5fs_fsync};
 
 static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .write = s5fs_write,
@@ -111,39 +145,190 @@ static vnode_ops_t s5fs_file_vops = {.read = s5fs_read,
                                      .get_pframe = s5fs_get_pframe,
                                      .fill_pframe = s5fs_fill_pframe,
                                      .flush_pframe = s5fs_flush_pframe,
-                                     .truncate_file = s5fs_truncate_file};
+                                     .truncate_file = s5fs_truncate_file,
+                                     .readahead = s5fs_readahead,
+                                     .direct_io = s5fs_direct_io,
+                                     .page_is_hole = s5fs_page_is_hole,
+                                     .fsync = s5fs_fsync,
+                                     .fallocate = s5fs_fallocate};
 
 
 static mobj_ops_t s5fs_mobj_ops = {.get_pframe = NULL,
                                    .fill_pframe = blockdev_fill_pframe,
-                                   .flush_pframe = blockdev_flush_pframe,
+                                   .flush_pframe = s5_journal_flush_pframe,
                                    .destructor = NULL};
 
+/* Inodes s5_format gives a filesystem, one per this many blocks */
+#define S5_FORMAT_BLOCKS_PER_INODE 8
+/* Most blocks, header included, of the journal s5_format gives one */
+#define S5_FORMAT_JOURNAL_NBLOCKS 64
+
+/*
+ * Makes an empty filesystem on dev, laid out as fsmaker's format does,
+ * unless its first block already holds an s5fs super block. The root
+ * directory, inode 0, holds only "." and "..", inline. The super block is
+ * written last, so that a filesystem that was not made all the way is not
+ * mistaken for one.
+ *
+ * Only devices that know their size, like the RAM disk, which starts out as
+ * all zeros, are formatted; nothing a disk holds is ever written over.
+ *
+ * Returns 0, or:
+ *  - ENOMEM: there is no page to write from
+ *  - ENOSPC: dev is too small
+ *  - or an error reading or writing dev
+ */
+static long s5_format(blockdev_t *dev)
+{
+    char *buf = page_alloc();
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+    long ret = blockdev_read(dev, buf, S5_SUPER_BLOCK, 1);
+    if (ret || ((s5_super_t *)buf)->s5s_magic == S5_MAGIC)
+    {
+        page_free(buf);
+        return ret;
+    }
+
+    uint32_t nblocks = (uint32_t)MIN(dev->bd_nblocks, (uint32_t)-1);
+    uint32_t ninodes = MAX(nblocks / S5_FORMAT_BLOCKS_PER_INODE, 1U);
+    uint32_t iblocks = (ninodes - 1) / S5_INODES_PER_BLOCK + 1;
+    uint32_t bblocks = (nblocks - 1) / S5_BITS_PER_BLOCK + 1;
+    uint32_t ibblocks = (ninodes - 1) / S5_BITS_PER_BLOCK + 1;
+    uint32_t first = 1 + iblocks + bblocks + ibblocks;
+    if (first + 1 >= nblocks)
+    {
+        page_free(buf);
+        return -ENOSPC;
+    }
+    uint32_t jblocks = MIN(S5_FORMAT_JOURNAL_NBLOCKS, (nblocks - first) / 4);
+    jblocks = jblocks >= 2 ? jblocks : 0;
+    uint32_t used = first + jblocks;
+
+    for (uint32_t b = 0; !ret && b < iblocks; b++)
+    {
+        memset(buf, 0, S5_BLOCK_SIZE);
+        s5_inode_t *inodes = (s5_inode_t *)buf;
+        for (uint32_t i = 0; i < S5_INODES_PER_BLOCK; i++)
+        {
+            inodes[i].s5_number = b * (uint32_t)S5_INODES_PER_BLOCK + i;
+        }
+        if (!b)
+        {
+            s5_inode_t *root = &inodes[0];
+            s5_dirent_t *dirents = (s5_dirent_t *)root->s5_inline;
+            root->s5_type = S5_TYPE_DIR;
+            root->s5_linkcount = 2;
+            root->s5_flags = S5_INODE_INLINE;
+            root->s5_un.s5_size = 2 * sizeof(s5_dirent_t);
+            strcpy(dirents[0].s5d_name, ".");
+            strcpy(dirents[1].s5d_name, "..");
+        }
+        ret = blockdev_write(dev, buf, 1 + b, 1);
+    }
+    /* The bits of the blocks before the data blocks, and of the blocks and
+     * inodes past the end, are set */
+    for (uint32_t b = 0; !ret && b < bblocks + ibblocks; b++)
+    {
+        uint64_t start = (uint64_t)(b < bblocks ? b : b - bblocks) *
+                         S5_BITS_PER_BLOCK;
+        uint64_t lo = b < bblocks ? used : 1;
+        uint64_t hi = b < bblocks ? nblocks : ninodes;
+        memset(buf, 0, S5_BLOCK_SIZE);
+        for (uint64_t num = start; num < start + S5_BITS_PER_BLOCK; num++)
+        {
+            if (num < lo || num >= hi)
+            {
+                buf[S5_BITMAP_BYTE(num)] |= (char)S5_BITMAP_MASK(num);
+            }
+        }
+        ret = blockdev_write(dev, buf, 1 + iblocks + b, 1);
+    }
+    memset(buf, 0, S5_BLOCK_SIZE);
+    for (uint32_t b = first; !ret && b < used; b++)
+    {
+        ret = blockdev_write(dev, buf, b, 1);
+    }
+
+    s5_super_t *super = (s5_super_t *)buf;
+    super->s5s_magic = S5_MAGIC;
+    super->s5s_version = S5_CURRENT_VERSION;
+    super->s5s_num_blocks = nblocks;
+    super->s5s_nfree = nblocks - used;
+    super->s5s_num_inodes = ninodes;
+    super->s5s_nfree_inodes = ninodes - 1;
+    super->s5s_root_inode = 0;
+    super->s5s_bitmap_block = 1 + iblocks;
+    super->s5s_bitmap_nblocks = bblocks;
+    super->s5s_ibitmap_block = 1 + iblocks + bblocks;
+    super->s5s_ibitmap_nblocks = ibblocks;
+    super->s5s_journal_block = jblocks ? first : 0;
+    super->s5s_journal_nblocks = jblocks;
+    if (!ret)
+    {
+        ret = blockdev_write(dev, buf, S5_SUPER_BLOCK, 1);
+        dbg(DBG_S5FS, "made a filesystem of %u blocks and %u inodes\n",
+            nblocks, ninodes);
+    }
+    page_free(buf);
+    return ret;
+}
+
 /*
  * Initialize the passed-in fs_t. The only members of fs_t that are initialized
  * before the call to s5fs_mount are fs_dev and fs_type ("s5fs"). You must
  * initialize everything else: fs_vnode_allocator, fs_i, fs_ops, fs_root.
  *
  * Initialize the block device for the s5fs_t that is created, and copy
- * the super block from disk into memory.
+ * the super block from disk into memory. fs_dev is "diskN" for disk N, or
+ * "ramN" for a RAM disk, "mdN" for a striped device or "vdN" for a virtio-blk
+ * disk, which are formatted first if they are still blank (see s5_format).
  */
 long s5fs_mount(fs_t *fs)
 {
     int num;
+    devid_t devid;
 
     KASSERT(fs);
 
-    if (sscanf(fs->fs_dev, "disk%d", &num) != 1)
+    if (sscanf(fs->fs_dev, "disk%d", &num) == 1)
+    {
+        devid = MKDEVID(DISK_MAJOR, num);
+    }
+    else if (sscanf(fs->fs_dev, "ram%d", &num) == 1)
+    {
+        devid = MKDEVID(RAMDISK_MAJOR, num);
+    }
+    else if (sscanf(fs->fs_dev, "md%d", &num) == 1)
+    {
+        devid = MKDEVID(STRIPE_MAJOR, num);
+    }
+    else if (sscanf(fs->fs_dev, "vd%d", &num) == 1)
+    {
+        devid = MKDEVID(VIRTIO_BLK_MAJOR, num);
+    }
+    else
     {
         return -EINVAL;
     }
 
-    blockdev_t *dev = blockdev_lookup(MKDEVID(DISK_MAJOR, num));
+    blockdev_t *dev = blockdev_lookup(devid);
     if (!dev)
         return -EINVAL;
+    if (dev->bd_nblocks)
+    {
+        long ret = s5_format(dev);
+        if (ret)
+        {
+            return ret;
+        }
+    }
 
     slab_allocator_t *allocator =
-        slab_allocator_create("s5_node", sizeof(s5_node_t));
+        slab_allocator_create_ctor("s5_node", sizeof(s5_node_t), vnode_ctor,
+                                   NULL);
     fs->fs_vnode_allocator = allocator;
 
     s5fs_t *s5fs = (s5fs_t *)kmalloc(sizeof(s5fs_t));
@@ -172,8 +357,31 @@ long s5fs_mount(fs_t *fs)
     }
 
     kmutex_init(&s5fs->s5f_mutex);
+    kmutex_set_name(&s5fs->s5f_mutex, "s5fs");
+
+    long ret = s5_journal_init(s5fs);
+    if (!ret && (ret = s5_journal_replay(s5fs)) == 0 &&
+        s5_check_super(&s5fs->s5f_super))
+    {
+        ret = -EINVAL;
+    }
+    if (!ret)
+    {
+        ret = s5_groups_init(s5fs);
+    }
+    if (ret)
+    {
+        s5_journal_destroy(s5fs);
+        kfree(s5fs);
+        slab_allocator_destroy(fs->fs_vnode_allocator);
+        fs->fs_vnode_allocator = NULL;
+        return ret;
+    }
 
     s5fs->s5f_fs = fs;
+    s5fs->s5f_ndelayed = 0;
+    s5fs->s5f_nreserved = 0;
+    s5fs->s5f_nreaping = 0;
 
     fs->fs_i = s5fs;
     fs->fs_ops = &s5fs_fsops;
@@ -213,27 +421,39 @@ static long s5fs_umount(fs_t *fs)
     }
 
     vput(&fs->fs_root);
+    s5_reaper_drain(s5fs);
 
+    writeback_pause();
     s5fs_sync(fs);
+
+    /* The cached blocks are on the page cache LRU, so they must not
+     * outlive s5f_mobj. */
+    mobj_t *mobj = &s5fs->s5f_mobj;
+    mobj_lock(mobj);
+    list_iterate(&mobj->mo_pframes, pf, pframe_t, pf_link)
+    {
+        kmutex_lock(&pf->pf_mutex);
+        size_t pagenum = pf->pf_pagenum;
+        if (mobj_free_pframe(mobj, &pf))
+        {
+            pframe_release(&pf);
+            mobj_delete_pframe(mobj, pagenum);
+        }
+    }
+    mobj_unlock(mobj);
+    /* Gone before the daemon, which commits the root filesystem's journal
+     * (see writeback_pass), is let go again */
+    s5_journal_destroy(s5fs);
+    s5_groups_destroy(s5fs);
     kfree(s5fs);
+    fs->fs_i = NULL;
+    writeback_resume();
     return 0;
 }
 
-static void s5fs_sync(fs_t *fs)
-{
-    s5fs_t *s5fs = FS_TO_S5FS(fs);
-    mobj_t *mobj = &s5fs->s5f_mobj;
-
-    
-    pframe_t *pf;
-    s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 1, &pf);
-    memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
-    s5_release_disk_block(&pf);
-
-    mobj_lock(&s5fs->s5f_mobj);
-    mobj_flush(mobj);
-    mobj_unlock(&s5fs->s5f_mobj);
-}
+/* Writes the super block and every cached metadata block, see
+ * s5_journal_commit. */
+static void s5fs_sync(fs_t *fs) { s5_journal_commit(FS_TO_S5FS(fs)); }
 
 /* Initialize a vnode and inode by reading its corresponding inode info from
  * disk.
@@ -272,6 +492,9 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn)
     
     // Initialize dirtied_inode field
     sn->dirtied_inode = 0;
+    sn->resv.s5e_len = 0;
+    sn->ndelayed = 0;
+    sn->dirhash = NULL;
     
     // Release the disk block
     s5_release_disk_block(&pf);
@@ -311,6 +534,111 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn)
     }
 }
 
+/*
+ * The reaper: work that frees big files once they are gone, for
+ * s5fs_put_inode, so that the unlink or close that drops the last
+ * reference to one does not wait for all of its blocks to be freed. The
+ * inode keeps its blocks, and stays allocated with no links, until then.
+ *
+ * s5_reap_lock protects the s5f_nreaping of each filesystem; it is only
+ * taken in thread context.
+ */
+typedef struct s5_reap
+{
+    work_t sr_work;
+    s5fs_t *sr_s5fs;
+    ino_t sr_ino;
+} s5_reap_t;
+
+static spinlock_t s5_reap_lock = SPINLOCK_INITIALIZER(s5_reap_lock);
+static ktqueue_t s5_reap_doneq = KTQUEUE_INITIALIZER(s5_reap_doneq);
+
+static void s5_reap_run(work_t *work)
+{
+    s5_reap_t *reap = CONTAINER_OF(work, s5_reap_t, sr_work);
+    s5fs_t *s5fs = reap->sr_s5fs;
+    s5_journal_start(s5fs);
+    s5_free_inode(s5fs, reap->sr_ino);
+    s5_journal_stop(s5fs);
+    kfree(reap);
+
+    spinlock_lock(&s5_reap_lock);
+    s5fs->s5f_nreaping--;
+    sched_broadcast_on(&s5_reap_doneq);
+    spinlock_unlock(&s5_reap_lock);
+}
+
+/* Queues inode ino of s5fs for the reaper. Returns 0 if it cannot be, and
+ * the inode must be freed right away. */
+static long s5_reap_later(s5fs_t *s5fs, ino_t ino)
+{
+    s5_reap_t *reap = workqueue_running() ? kmalloc(sizeof(s5_reap_t)) : NULL;
+    if (!reap)
+    {
+        return 0;
+    }
+    work_init(&reap->sr_work, s5_reap_run);
+    reap->sr_s5fs = s5fs;
+    reap->sr_ino = ino;
+    spinlock_lock(&s5_reap_lock);
+    s5fs->s5f_nreaping++;
+    spinlock_unlock(&s5_reap_lock);
+    queue_work(&reap->sr_work);
+    return 1;
+}
+
+/* Waits for the reaper to be done with s5fs, which is being unmounted. */
+static void s5_reaper_drain(s5fs_t *s5fs)
+{
+    spinlock_lock(&s5_reap_lock);
+    while (s5fs->s5f_nreaping)
+    {
+        sched_sleep_on_locked(&s5_reap_doneq, &s5_reap_lock);
+        spinlock_lock(&s5_reap_lock);
+    }
+    spinlock_unlock(&s5_reap_lock);
+}
+
+/* Copies the inode of sn into its block. */
+static void s5_write_inode(s5fs_t *s5fs, s5_node_t *sn)
+{
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, S5_INODE_BLOCK(sn->vnode.vn_vno), 1, &pf);
+    s5_inode_t *disk_inode =
+        (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(sn->vnode.vn_vno);
+    memcpy(disk_inode, &sn->inode, sizeof(s5_inode_t));
+    s5_release_disk_block(&pf);
+    sn->dirtied_inode = 0;
+}
+
+/*
+ * Clean up the inode corresponding to the given vnode: write it back if it
+ * is dirty, and free it if it has no links left, or have the reaper free it
+ * if it is big. Called as the vnode goes, and as it is cached.
+ */
+static void s5fs_put_inode(fs_t *fs, vnode_t *vn)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vn);
+    s5_inode_t *inode = &sn->inode;
+    s5fs_t *s5fs = FS_TO_S5FS(fs);
+    s5_journal_start(s5fs);
+    s5_unreserve_blocks(sn);
+    
+    // The case where the inode is dirty; an inode that is being freed is
+    // written too, since the blocks it is freed with are those on disk
+    if (sn->dirtied_inode) {
+        s5_write_inode(s5fs, sn);
+    }
+
+    // The case where the inode is no longer in use
+    if (inode->s5_linkcount == 0 &&
+        (vn->vn_len < S5_REAP_MIN_BLOCKS * S5_BLOCK_SIZE ||
+         !s5_reap_later(s5fs, vn->vn_vno))) {
+        s5_free_inode(s5fs, vn->vn_vno);
+    }
+    s5_journal_stop(s5fs);
+}
+
 /* Clean up the inode corresponding to the given vnode.
  *
  * Hints:
@@ -321,45 +649,38 @@ static void s5fs_read_vnode(fs_t *fs, vnode_t *vn)
  *       s5_free_inode.
  *    2) The inode is dirty, so write it back to disk.
  *    3) The inode is unchanged, so do nothing.
+ *  - A directory's index only goes here, so that it outlives caching.
  */
 static void s5fs_delete_vnode(fs_t *fs, vnode_t *vn)
 {
-    s5_node_t *sn = VNODE_TO_S5NODE(vn);
-    s5_inode_t *inode = &sn->inode;
-    s5fs_t *s5fs = FS_TO_S5FS(fs);
-    
-    // The case where the inode is no longer in use
-    if (inode->s5_linkcount == 0) {
-        s5_free_inode(s5fs, vn->vn_vno);
-        return;
-    }
-    
-    // The case where the inode is dirty
-    if (sn->dirtied_inode) {
-        pframe_t *pf;
-        s5_inode_t *disk_inode;
-        
-        s5_get_meta_disk_block(s5fs, S5_INODE_BLOCK(vn->vn_vno), 1, &pf);
-        
-        disk_inode = (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(vn->vn_vno);
-        
-        memcpy(disk_inode, inode, sizeof(s5_inode_t));
-        
-        s5_release_disk_block(&pf);
-        
-        sn->dirtied_inode = 0;
-        return;
+    s5_dirhash_free(VNODE_TO_S5NODE(vn));
+    s5fs_put_inode(fs, vn);
+}
+
+/*
+ * See cache_vnode in vfs.h
+ *
+ * An inode with no links left goes right away, to give back its blocks. The
+ * others may stay cached, with their directory index, once a dirty inode is
+ * written back.
+ */
+static long s5fs_cache_vnode(fs_t *fs, vnode_t *vn)
+{
+    if (!VNODE_TO_S5NODE(vn)->inode.s5_linkcount)
+    {
+        return 0;
     }
-    
+    s5fs_put_inode(fs, vn);
+    return 1;
 }
 
-/* Wrapper around s5_read_file. */
+/* Wrapper around s5_read_file_shared; the VFS holds only vn_rwlock here. */
 static ssize_t s5fs_read(vnode_t *vnode, size_t pos, void *buf, size_t len)
 {
     KASSERT(!S_ISDIR(vnode->vn_mode) && "should be handled at the VFS level");
     
     s5_node_t *sn = VNODE_TO_S5NODE(vnode);
-    return s5_read_file(sn, pos, (char *)buf, len);
+    return s5_read_file_shared(sn, pos, (char *)buf, len);
 }
 
 /* Wrapper around s5_write_file. */
@@ -379,15 +700,9 @@ static ssize_t s5fs_write(vnode_t *vnode, size_t pos, const void *buf,
 static long s5fs_mmap(vnode_t *file, mobj_t **ret)
 {
     KASSERT(file && ret);
-    
-    // Create a file-backed memory object using mobj_create_pframe
-    // For now, we'll create a simple anonymous object as a placeholder
-    mobj_t *mobj = anon_create();
-    if (!mobj) {
-        return -ENOMEM;
-    }
-    
-    *ret = mobj;
+
+    vref(file);
+    *ret = &file->vn_mobj;
     return 0;
 }
 
@@ -434,8 +749,10 @@ static long s5fs_mknod(struct vnode *dir, const char *name, size_t namelen,
     }
     
     // Allocate a new inode
-    long new_ino = s5_alloc_inode(s5fs, s5_type, devid);
+    s5_journal_start(s5fs);
+    long new_ino = s5_alloc_inode(s5fs, dir->vn_vno, s5_type, devid);
     if (new_ino < 0) {
+        s5_journal_stop(s5fs);
         return new_ino;
     }
     
@@ -448,9 +765,11 @@ static long s5fs_mknod(struct vnode *dir, const char *name, size_t namelen,
     long ret = s5_link(dir_sn, name, namelen, VNODE_TO_S5NODE(new_vnode));
     if (ret < 0) {
         vput(&new_vnode);
+        s5_journal_stop(s5fs);
         return ret;
     }
     
+    s5_journal_stop(s5fs);
     *out = new_vnode;
     return 0;
 }
@@ -519,7 +838,10 @@ static long s5fs_link(vnode_t *dir, const char *name, size_t namelen,
     
     // Create the hard link using s5_link
     // Note: VFS already locks dir, so no additional locking needed
-    return s5_link(dir_sn, name, namelen, child_sn);
+    s5_journal_start(VNODE_TO_S5FS(dir));
+    long ret = s5_link(dir_sn, name, namelen, child_sn);
+    s5_journal_stop(VNODE_TO_S5FS(dir));
+    return ret;
 }
 
 /* Remove the directory entry in dir corresponding to name and namelen.
@@ -553,10 +875,12 @@ static long s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
     s5_node_t *child_sn = VNODE_TO_S5NODE(child_vnode);
     
     // Remove the directory entry
+    s5_journal_start(VNODE_TO_S5FS(dir));
     s5_remove_dirent(dir_sn, name, namelen, child_sn);
     
     // Release the vnode reference
     vput_locked(&child_vnode);
+    s5_journal_stop(VNODE_TO_S5FS(dir));
     
     return 0;
 }
@@ -619,6 +943,7 @@ static long s5fs_rename(vnode_t *olddir, const char *oldname, size_t oldnamelen,
         return -ENOTDIR;
     }
     
+    s5fs_t *s5fs = VNODE_TO_S5FS(olddir);
     s5_node_t *olddir_sn = VNODE_TO_S5NODE(olddir);
     s5_node_t *newdir_sn = VNODE_TO_S5NODE(newdir);
     
@@ -655,25 +980,21 @@ static long s5fs_rename(vnode_t *olddir, const char *oldname, size_t oldnamelen,
             return -EISDIR;
         }
         
-        // Lock newdir before calling s5_remove_dirent
-        
-        // Remove the previously existing entry for new name
-        s5_remove_dirent(newdir_sn, newname, newnamelen, VNODE_TO_S5NODE(new_vnode));
-        
-        // Link the new directory entry (VFS already locks newdir)
-        long ret = s5_link(newdir_sn, newname, newnamelen, old_sn);
+        // Point the existing entry for new name at the old file, in place,
+        // so that nothing can fail between dropping one link and adding the
+        // other (VFS already locks newdir)
+        s5_journal_start(s5fs);
+        s5_replace_dirent(newdir_sn, newname, newnamelen,
+                          VNODE_TO_S5NODE(new_vnode), old_sn);
         
         vput_locked(&new_vnode);
-        
-        if (ret < 0) {
-            vput_locked(&old_vnode);
-            return ret;
-        }
     } else if (new_ino == -ENOENT) {
         // No entry for newname, create new link
+        s5_journal_start(s5fs);
         long ret = s5_link(newdir_sn, newname, newnamelen, old_sn);
         
         if (ret < 0) {
+            s5_journal_stop(s5fs);
             vput_locked(&old_vnode);
             return ret;
         }
@@ -687,6 +1008,7 @@ static long s5fs_rename(vnode_t *olddir, const char *oldname, size_t oldnamelen,
     s5_remove_dirent(olddir_sn, oldname, oldnamelen, old_sn);
     
     vput_locked(&old_vnode);
+    s5_journal_stop(s5fs);
     return 0;
 }
 
@@ -723,8 +1045,10 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
     s5_node_t *parent_sn = VNODE_TO_S5NODE(dir);
     
     // Create a new inode for the directory
-    long new_ino = s5_alloc_inode(s5fs, S5_TYPE_DIR, 0);
+    s5_journal_start(s5fs);
+    long new_ino = s5_alloc_inode(s5fs, dir->vn_vno, S5_TYPE_DIR, 0);
     if (new_ino < 0) {
+        s5_journal_stop(s5fs);
         return new_ino;
     }
     
@@ -742,10 +1066,11 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
     memcpy(dot_entry.s5d_name, ".", 1);
     memset(dot_entry.s5d_name + 1, 0, S5_NAME_LEN - 1);
     
-    long ret = s5_write_file(child_sn, 0, (const char *)&dot_entry, sizeof(s5_dirent_t));
+    long ret = s5_append_dirent(child_sn, &dot_entry);
     if (ret < 0) {
         vunlock(child_vnode);
         vput(&child_vnode);
+        s5_journal_stop(s5fs);
         return ret;
     }
     child_sn->inode.s5_linkcount++;
@@ -757,7 +1082,7 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
     memcpy(dotdot_entry.s5d_name, "..", 2);
     memset(dotdot_entry.s5d_name + 2, 0, S5_NAME_LEN - 2);
     
-    ret = s5_write_file(child_sn, sizeof(s5_dirent_t), (const char *)&dotdot_entry, sizeof(s5_dirent_t));
+    ret = s5_append_dirent(child_sn, &dotdot_entry);
     if (ret < 0) {
         // Clean up: reset directory length and linkcount
         child_vnode->vn_len = 0;
@@ -766,6 +1091,7 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
         child_sn->dirtied_inode = 1;
         vunlock(child_vnode);
         vput(&child_vnode);
+        s5_journal_stop(s5fs);
         return ret;
     }
     parent_sn->inode.s5_linkcount++;
@@ -786,12 +1112,14 @@ static long s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen,
         child_sn->dirtied_inode = 1;
         parent_sn->dirtied_inode = 1;
         vput(&child_vnode);
+        s5_journal_stop(s5fs);
         return ret;
     }
     
     KASSERT(child_sn->inode.s5_linkcount == 2);
     KASSERT(parent_sn->inode.s5_linkcount >= 2);
     
+    s5_journal_stop(s5fs);
     *out = child_vnode;
     return 0;
 }
@@ -827,6 +1155,7 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
     vnode_t *child_vnode = vget_locked(parent->vn_fs, child_ino);
     KASSERT(child_vnode != NULL);
     s5_node_t *child_sn = VNODE_TO_S5NODE(child_vnode);
+    s5fs_t *s5fs = VNODE_TO_S5FS(parent);
     
     // Check if the found entry is a directory
     if (!S_ISDIR(child_vnode->vn_mode)) {
@@ -841,16 +1170,54 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
     }
     
     // Remove the three entries created in s5fs_mkdir
+    s5_journal_start(s5fs);
     s5_remove_dirent(parent_sn, name, namelen, child_sn);
     s5_remove_dirent(child_sn, "..", 2, parent_sn);
     s5_remove_dirent(child_sn, ".", 1, child_sn);
 
     // Release the child vnode
     vput_locked(&child_vnode);
+    s5_journal_stop(s5fs);
     
     return 0;
 }
 
+/*
+ * Of the n entries of a directory at dirents, tells the first and the last
+ * inode block that their inodes are in, for s5fs_prefetch_inodes.
+ */
+static void s5fs_dirent_inode_blocks(s5fs_t *s5fs, const s5_dirent_t *dirents,
+                                     long n, uint32_t *lo, uint32_t *hi)
+{
+    *lo = (uint32_t)-1;
+    *hi = 0;
+    for (long i = 0; i < n; i++)
+    {
+        if (dirents[i].s5d_inode < s5fs->s5f_super.s5s_num_inodes)
+        {
+            uint32_t block = S5_INODE_BLOCK(dirents[i].s5d_inode);
+            *lo = MIN(*lo, block);
+            *hi = MAX(*hi, block);
+        }
+    }
+}
+
+/*
+ * Reads the inode blocks from lo to hi, at most S5_INODE_RA_BLOCKS of them,
+ * into the cache ahead of the vgets that follow a directory listing, such
+ * as ls -l's stats: since inodes are allocated near their directory's (see
+ * s5_alloc_inode), a block of entries usually needs only a few, and they
+ * are read together.
+ */
+static void s5fs_prefetch_inodes(s5fs_t *s5fs, uint32_t lo, uint32_t hi)
+{
+    if (lo <= hi)
+    {
+        s5_readahead_meta_blocks(s5fs, lo,
+                                 MIN(hi - lo + 1, S5_INODE_RA_BLOCKS));
+    }
+}
+
 /* Read a directory entry.
  *
  *  vnode - The directory from which to read an entry
@@ -859,12 +1226,12 @@ static long s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
  *          successful return
  *
  * Return bytes read on success, or:
- *  - Propagate errors from s5_read_file
+ *  - Propagate errors from s5_get_dirents
  *
  * Hints:
- *  - Use s5_read_file to read an s5_dirent_t. To do so, you can create a local 
- *    s5_dirent_t variable and use that as the buffer to pass into s5_read_file. 
- *  - Be careful that you read into an s5_dirent_t and populate the provided
+ *  - Use s5_get_dirents to map the s5_dirent_t at pos in place rather than
+ *    reading a copy of it.
+ *  - Be careful that you read an s5_dirent_t and populate the provided
  *    dirent_t properly.
  */
 static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d)
@@ -872,38 +1239,83 @@ static long s5fs_readdir(vnode_t *vnode, size_t pos, struct dirent *d)
     KASSERT(S_ISDIR(vnode->vn_mode) && "should be handled at the VFS level");
     
     s5_node_t *dir_sn = VNODE_TO_S5NODE(vnode);
-    s5_dirent_t s5_dirent;
-    
-    // Read a single s5_dirent_t structure
-    ssize_t bytes_read = s5_read_file(dir_sn, pos, (char *)&s5_dirent, sizeof(s5_dirent_t));
-
-    if (bytes_read < 0) {
-        return bytes_read;
-    }
+    pframe_t *pf;
+    s5_dirent_t *s5_dirent;
     
-    // Check for end of directory
-    if (bytes_read == 0) {
-        return 0;
+    // Map the block holding the entry; 0 entries is the end of the directory
+    long n = s5_get_dirents(dir_sn, pos, 0, &pf, &s5_dirent);
+    if (n <= 0) {
+        return n;
     }
-    
-    // Verify we read a complete directory entry
-    if (bytes_read != sizeof(s5_dirent_t)) {
-        return 0;
+    uint32_t lo = (uint32_t)-1, hi = 0;
+    if (pos % S5_BLOCK_SIZE == 0) {
+        // The first entry of a block: read its entries' inodes ahead
+        s5fs_dirent_inode_blocks(VNODE_TO_S5FS(vnode), s5_dirent, n, &lo, &hi);
     }
     
     // Populate the provided dirent structure
-    d->d_ino = s5_dirent.s5d_inode;
+    d->d_ino = s5_dirent->s5d_inode;
     d->d_off = pos + sizeof(s5_dirent_t);
     
     // Copy the name
-    size_t name_len = strnlen(s5_dirent.s5d_name, S5_NAME_LEN);
-    memcpy(d->d_name, s5_dirent.s5d_name, name_len);
+    size_t name_len = strnlen(s5_dirent->s5d_name, S5_NAME_LEN);
+    memcpy(d->d_name, s5_dirent->s5d_name, name_len);
     d->d_name[name_len] = '\0';
+    s5_release_dirents(&pf);
+    s5fs_prefetch_inodes(VNODE_TO_S5FS(vnode), lo, hi);
     
     // Return the number of bytes that should be added to pos
     return sizeof(s5_dirent_t);
 }
 
+/*
+ * See getdents in vnode.h
+ *
+ * Maps the directory a block at a time, with s5_get_dirents, converting the
+ * entries in place the way s5fs_readdir does, and reading the inode blocks
+ * of each block's entries ahead.
+ */
+static ssize_t s5fs_getdents(vnode_t *vnode, size_t pos, struct dirent *d,
+                             size_t count, size_t *nread)
+{
+    KASSERT(S_ISDIR(vnode->vn_mode) && "should be handled at the VFS level");
+
+    s5_node_t *dir_sn = VNODE_TO_S5NODE(vnode);
+    size_t start = pos;
+    *nread = 0;
+
+    while (*nread < count)
+    {
+        pframe_t *pf;
+        s5_dirent_t *s5_dirents;
+        long n = s5_get_dirents(dir_sn, pos, 0, &pf, &s5_dirents);
+        if (n < 0)
+        {
+            return *nread ? (ssize_t)(pos - start) : n;
+        }
+        if (!n)
+        {
+            break; /* the end of the directory */
+        }
+        n = (long)MIN((size_t)n, count - *nread);
+        uint32_t lo, hi;
+        s5fs_dirent_inode_blocks(VNODE_TO_S5FS(vnode), s5_dirents, n, &lo, &hi);
+        for (long i = 0; i < n; i++)
+        {
+            struct dirent *out = &d[(*nread)++];
+            pos += sizeof(s5_dirent_t);
+            out->d_ino = s5_dirents[i].s5d_inode;
+            out->d_off = pos;
+            size_t name_len = strnlen(s5_dirents[i].s5d_name, S5_NAME_LEN);
+            memcpy(out->d_name, s5_dirents[i].s5d_name, name_len);
+            out->d_name[name_len] = '\0';
+        }
+        s5_release_dirents(&pf);
+        s5fs_prefetch_inodes(VNODE_TO_S5FS(vnode), lo, hi);
+    }
+    return pos - start;
+}
+
 /* Get file status.
  *
  *  vnode - The vnode of the file in question
@@ -962,6 +1374,7 @@ static long s5fs_stat(vnode_t *vnode, stat_t *ss)
 static void s5fs_truncate_file(vnode_t *file)
 {
     KASSERT(S_ISREG(file->vn_mode) && "This routine should only be called for regular files");
+    s5_journal_start(VNODE_TO_S5FS(file));
     file->vn_len = 0;
     s5_node_t* s5_node = VNODE_TO_S5NODE(file); 
     s5_inode_t* s5_inode = &s5_node->inode; 
@@ -972,6 +1385,7 @@ static void s5fs_truncate_file(vnode_t *file)
     // Call subroutine to free the blocks that were used 
     // VFS has already locked the file vnode before calling this function
     s5_remove_blocks(s5_node);  
+    s5_journal_stop(VNODE_TO_S5FS(file));
 }
 
 /*
@@ -987,27 +1401,82 @@ inline void s5_get_meta_disk_block(s5fs_t *s5fs, uint64_t blocknum, long forwrit
     if (*pfp)
     {
         // block is cached
-        (*pfp)->pf_dirty |= forwrite;
+        MOBJ_STAT_INC(&s5fs->s5f_mobj, ms_hits);
+        if (forwrite)
+            pframe_set_dirty(*pfp);
         mobj_unlock(&s5fs->s5f_mobj);
         return;
     }
+    MOBJ_STAT_INC(&s5fs->s5f_mobj, ms_misses);
+    MOBJ_STAT_INC(&s5fs->s5f_mobj, ms_fills);
     mobj_create_pframe(&s5fs->s5f_mobj, blocknum, blocknum, pfp);
     pframe_t *pf = *pfp;
     pf->pf_addr = page_alloc();
     KASSERT(pf->pf_addr);
 
     blockdev_t *bd = s5fs->s5f_bdev;
-    long ret = bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
-    pf->pf_dirty |= forwrite;  // yes, needed
+    long ret = blockdev_read(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+    if (forwrite)
+        pframe_set_dirty(pf);  // yes, needed
     KASSERT (!ret);
     mobj_unlock(&s5fs->s5f_mobj);
     KASSERT(!ret && *pfp);
 }
 
+/*
+ * Reads the n metadata blocks from blocknum that are not cached yet into
+ * the cache, each run of them with a single request to the block device,
+ * the way s5_readahead_run reads file pages. Gives up quietly if memory is
+ * short or a read fails; the blocks are then read on demand.
+ */
+void s5_readahead_meta_blocks(s5fs_t *s5fs, uint64_t blocknum, size_t n)
+{
+    mobj_t *mobj = &s5fs->s5f_mobj;
+    blockdev_t *bd = s5fs->s5f_bdev;
+    char *buf = page_alloc_n(n);
+    if (!buf)
+        return;
+    mobj_lock(mobj);
+    for (size_t start = 0, end; start < n; start = end)
+    {
+        if (radix_tree_lookup(&mobj->mo_index, blocknum + start))
+        {
+            end = start + 1;
+            continue;
+        }
+        for (end = start + 1;
+             end < n && !radix_tree_lookup(&mobj->mo_index, blocknum + end);
+             end++)
+            ;
+        if (blockdev_read(bd, buf, (blocknum_t)(blocknum + start),
+                          (blocknum_t)(end - start)))
+            break;
+        for (size_t i = start; i < end; i++)
+        {
+            pframe_t *pf;
+            mobj_create_pframe(mobj, blocknum + i, blocknum + i, &pf);
+            if (!pf)
+                break;
+            if (!(pf->pf_addr = page_alloc()))
+            {
+                pframe_release(&pf);
+                mobj_delete_pframe(mobj, blocknum + i);
+                break;
+            }
+            memcpy(pf->pf_addr, buf + (i - start) * PAGE_SIZE, PAGE_SIZE);
+            MOBJ_STAT_INC(mobj, ms_fills);
+            pframe_release(&pf);
+        }
+    }
+    mobj_unlock(mobj);
+    page_free_n(buf, n);
+}
+
 /*
  * Wrapper around device's read_block function; allocates and fills a page frame.
  * Assumes cache has already been searched.
  * Used for file blocks, thus file block number is supplied.
+ * A page about to be overwritten (MOBJ_OVERWRITE) is cleared instead.
  */
 static inline void s5_get_file_disk_block(vnode_t *vnode, uint64_t blocknum, uint64_t loc, long forwrite,
                               pframe_t **pfp)
@@ -1016,10 +1485,20 @@ static inline void s5_get_file_disk_block(vnode_t *vnode, uint64_t blocknum, uin
     pframe_t *pf = *pfp;
     pf->pf_addr = page_alloc();
     KASSERT(pf->pf_addr);
-    blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
-    long ret = bd->bd_ops->read_block(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
-    pf->pf_dirty |= forwrite;
-    KASSERT (!ret);
+    if (forwrite == MOBJ_OVERWRITE)
+    {
+        // all of it is about to be written; the rest of a last page past
+        // the end of the file must still be zeros
+        memset(pf->pf_addr, 0, PAGE_SIZE);
+    }
+    else
+    {
+        blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        long ret = blockdev_read(bd, pf->pf_addr, (blocknum_t)pf->pf_loc, 1);
+        KASSERT(!ret);
+    }
+    if (forwrite)
+        pframe_set_dirty(pf);
 }
 
 /* Wrapper around pframe_release.
@@ -1038,88 +1517,536 @@ inline void s5_release_disk_block(pframe_t **pfp) { pframe_release(pfp); }
  * This is where the abstraction of vnode file block/page --> disk block is
  * finally implemented. Check that the requested page lies within vnode->vn_len.
  *
- * Of course, you will want to use s5_file_block_to_disk_block. Pay attention
- * to what the forwrite argument to s5fs_get_pframe means for the alloc argument
- * in s5_file_block_to_disk_block.
- *
- * If the disk block for the corresponding file block is sparse, you should use
- * mobj_default_get_pframe on the vnode's own memory object. This will trickle
- * down to s5fs_fill_pframe if the pframe is not already resident.
- *
- * Otherwise, if the disk block is NOT sparse, you will want to simply use
- * s5_get_disk_block. NOTE: in this case, you also need to make sure you free
- * the pframe that resides in the vnode itself for the requested pagenum. To
- * do so, you will want to use mobj_find_pframe and mobj_free_pframe.
+ * s5_file_block_to_disk_block finds the page's disk block, without
+ * allocating one even for a write: a page written where the block is sparse
+ * is made with mobj_default_get_pframe, which fills it with zeros through
+ * s5fs_fill_pframe, and only gets a block when it is written back, see
+ * s5_delay_block and s5fs_flush_pframe. Writes fail with ENOSPC once the
+ * disk has no room for such pages.
  *
- * Given the above design, we s5fs itself does not need to implement
- * flush_pframe. Any pframe that will be written to (forwrite = 1) should always
- * have a disk block backing it on successful return. Thus, the page frame will
- * reside in the block device of the filesystem, where the flush_pframe is
- * already implemented. We do, however, need to implement fill_pframe for sparse
- * blocks.
+ * Otherwise the page is read from its disk block into a pframe of the
+ * vnode that records the block in pf_loc; s5fs_flush_pframe writes it
+ * back there.
  */
 static long s5fs_get_pframe(vnode_t *vnode, uint64_t pagenum, long forwrite,
                             pframe_t **pfp)
 {
     if (vnode->vn_len <= pagenum * PAGE_SIZE)
         return -EINVAL;
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
     mobj_find_pframe(&vnode->vn_mobj, pagenum, pfp);
     if (*pfp)
     {
         // block is cached
-        (*pfp)->pf_dirty |= forwrite;
+        MOBJ_STAT_INC(&vnode->vn_mobj, ms_hits);
+        if (forwrite && !(*pfp)->pf_loc && !(*pfp)->pf_dirty)
+        {
+            // a sparse page that was read, and now waits for a block
+            long ret = s5_delay_block(sn);
+            if (ret)
+            {
+                pframe_release(pfp);
+                return ret;
+            }
+        }
+        if (forwrite)
+            pframe_set_dirty(*pfp);
         return 0;
     }
     int new;
-    long loc = s5_file_block_to_disk_block(VNODE_TO_S5NODE(vnode), pagenum, forwrite, &new);
+    long loc = s5_file_block_to_disk_block(sn, pagenum, 0, &new);
     if (loc < 0)
         return loc;
     if (loc) {
-        // block is mapped 
-        if (new) {
-            // block didn't previously exist, thus its current contents are meaningless
-            *pfp = s5_cache_and_clear_block(&vnode->vn_mobj, pagenum, loc);
-        } else {
-            // block must be read from disk
-            s5_get_file_disk_block(vnode, pagenum, loc, forwrite, pfp);
-        }
+        // (sparse blocks are counted by mobj_default_get_pframe)
+        MOBJ_STAT_INC(&vnode->vn_mobj, ms_misses);
+        MOBJ_STAT_INC(&vnode->vn_mobj, ms_fills);
+        // block must be read from disk
+        s5_get_file_disk_block(vnode, pagenum, loc, forwrite, pfp);
         return 0;
     }
-    else
+
+    // block is in a sparse region of the file
+    if (forwrite)
     {
-        // block is in a sparse region of the file
-        KASSERT(!forwrite);
-        return mobj_default_get_pframe(&vnode->vn_mobj, pagenum, forwrite, pfp);
+        long ret = s5_delay_block(sn);
+        if (ret)
+            return ret;
+    }
+    long ret = mobj_default_get_pframe(&vnode->vn_mobj, pagenum, forwrite, pfp);
+    if (ret && forwrite)
+        s5_undelay_blocks(sn, 1);
+    return ret;
+}
+
+/*
+ * The get_pframe of directories, whose blocks are metadata: they are cached
+ * in s5f_mobj by disk block, like indirect blocks, rather than in the
+ * vnode, so that the journal has them (see s5fs_journal.c). A block is
+ * allocated as soon as a write needs it, cleared, since a directory is
+ * only ever grown by an entry at a time.
+ */
+static long s5fs_dir_get_pframe(vnode_t *vnode, uint64_t pagenum,
+                                long forwrite, pframe_t **pfp)
+{
+    if (vnode->vn_len <= pagenum * PAGE_SIZE)
+        return -EINVAL;
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    int new;
+    // (counted as delayed while it is allocated, so that the blocks that
+    // are set aside for pages being written back are left alone)
+    long ret = forwrite ? s5_delay_block(sn) : 0;
+    if (ret)
+        return ret;
+    long loc = s5_file_block_to_disk_block(sn, pagenum, forwrite, &new);
+    if (forwrite)
+        s5_undelay_blocks(sn, 1);
+    if (loc <= 0)
+        return loc ? loc : -EIO; // directories have no holes
+    if (new) {
+        mobj_lock(&s5fs->s5f_mobj);
+        *pfp = s5_cache_and_clear_block(&s5fs->s5f_mobj, loc, loc);
+        mobj_unlock(&s5fs->s5f_mobj);
+        return 0;
     }
+    s5_get_meta_disk_block(s5fs, (uint64_t)loc, forwrite, pfp);
+    return 0;
 }
 
 /*
  * According the documentation for s5fs_get_pframe, this only gets called when
  * the file block for a given page number is sparse. In other words, pf
- * corresponds to a sparse block.
+ * corresponds to a sparse block, or to the first block of an inline file,
+ * which is filled from the inode.
  */
 static long s5fs_fill_pframe(vnode_t *vnode, pframe_t *pf)
 {
+    s5_inode_t *inode = &VNODE_TO_S5NODE(vnode)->inode;
     memset(pf->pf_addr, 0, PAGE_SIZE);
+    if (!pf->pf_pagenum && (inode->s5_flags & S5_INODE_INLINE))
+        memcpy(pf->pf_addr, inode->s5_inline, S5_INLINE_SIZE);
     return 0;
 }
 
+/*
+ * Writes pf back to its disk block, allocating the block first if the page
+ * was written without one (see s5_alloc_delayed_block). The pages of a file
+ * that is gone, with no links and no references left, are dropped instead,
+ * so a file removed soon enough never takes any blocks. The first page of a
+ * file no bigger than S5_INLINE_SIZE goes into the inode instead of a block,
+ * and is written with it.
+ */
 static long s5fs_flush_pframe(vnode_t *vnode, pframe_t *pf) {
+    if (!pf->pf_loc) {
+        s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+        s5_inode_t *inode = &sn->inode;
+        if (!inode->s5_linkcount && !vnode->vn_mobj.mo_refcount) {
+            s5_undelay_blocks(sn, 1);
+            return 0;
+        }
+        if (!pf->pf_pagenum && vnode->vn_len <= S5_INLINE_SIZE) {
+            memset(inode->s5_inline, 0, S5_INLINE_SIZE);
+            memcpy(inode->s5_inline, pf->pf_addr, vnode->vn_len);
+            inode->s5_flags |= S5_INODE_INLINE;
+            sn->dirtied_inode = 1;
+            s5_undelay_blocks(sn, 1);
+            return 0;
+        }
+        s5_journal_start(VNODE_TO_S5FS(vnode));
+        long loc = s5_alloc_delayed_block(sn, pf->pf_pagenum);
+        s5_journal_stop(VNODE_TO_S5FS(vnode));
+        if (loc < 0)
+            return loc;
+        pf->pf_loc = (size_t)loc;
+        if (!pf->pf_pagenum && (inode->s5_flags & S5_INODE_INLINE)) {
+            // the file outgrew its inode
+            inode->s5_flags &= ~S5_INODE_INLINE;
+            memset(inode->s5_inline, 0, S5_INLINE_SIZE);
+            sn->dirtied_inode = 1;
+        }
+    }
     return blockdev_flush_pframe(&VNODE_TO_S5FS(vnode)->s5f_mobj, pf);
 }
 
+/*
+ * Read the npages file pages at pagenum, whose disk blocks start at loc and
+ * are contiguous, with a single request to the block device, and cache each
+ * of them in the vnode as s5fs_get_pframe would have. Gives up quietly if
+ * memory is short or the read fails; the pages are then simply read on
+ * demand.
+ */
+static void s5_readahead_run(vnode_t *vnode, size_t pagenum, blocknum_t loc,
+                             size_t npages)
+{
+    blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+    char *buf = page_alloc_n(npages);
+    if (!buf)
+        return;
+    if (!blockdev_read(bd, buf, loc, npages))
+    {
+        for (size_t i = 0; i < npages; i++)
+        {
+            pframe_t *pf;
+            mobj_create_pframe(&vnode->vn_mobj, pagenum + i, loc + i, &pf);
+            if (!pf)
+                break;
+            if (!(pf->pf_addr = page_alloc()))
+            {
+                pframe_release(&pf);
+                mobj_delete_pframe(&vnode->vn_mobj, pagenum + i);
+                break;
+            }
+            memcpy(pf->pf_addr, buf + i * PAGE_SIZE, PAGE_SIZE);
+            pframe_release(&pf);
+        }
+    }
+    page_free_n(buf, npages);
+}
+
+/*
+ * Bring the given pages of a regular file into its page cache. Pages already
+ * cached, sparse pages, and pages past the end of the file are skipped; the
+ * rest are grouped into runs of consecutive disk blocks so that each run
+ * costs one device request rather than one per page.
+ */
+static void s5fs_readahead(vnode_t *vnode, size_t pagenum, size_t npages)
+{
+    npages = MIN(npages, (size_t)FILE_RA_MAX_PAGES);
+    vlock(vnode);
+    size_t end = MIN(pagenum + npages, ADDR_TO_PN(PAGE_ALIGN_UP(vnode->vn_len)));
+    size_t run_start = 0, run_len = 0;
+    blocknum_t run_loc = 0;
+    /* Where page p is on the disk, and for how many pages on that holds,
+     * from one lookup for each extent */
+    long map_loc = 0;
+    size_t map_len = 0;
+    for (size_t p = pagenum; p < end; p++)
+    {
+        if (!map_len)
+            map_loc = s5_file_block_run(VNODE_TO_S5NODE(vnode), p, &map_len);
+        long loc = radix_tree_lookup(&vnode->vn_mobj.mo_index, p) ? 0 : map_loc;
+        map_len--;
+        if (map_loc > 0)
+            map_loc++;
+        if (run_len && (loc <= 0 || (blocknum_t)loc != run_loc + run_len))
+        {
+            s5_readahead_run(vnode, run_start, run_loc, run_len);
+            run_len = 0;
+        }
+        if (loc > 0)
+        {
+            if (!run_len)
+            {
+                run_start = p;
+                run_loc = (blocknum_t)loc;
+            }
+            run_len++;
+        }
+    }
+    if (run_len)
+        s5_readahead_run(vnode, run_start, run_loc, run_len);
+    vunlock(vnode);
+}
+
+/*
+ * Writes back the cached pages of vnode in [pagenum, pagenum + npages), so
+ * that the disk has what they hold, and for a write then drops them. Pages
+ * that are pinned or mapped stay, and are updated by s5_direct_update. The
+ * vnode must be locked.
+ */
+static long s5_direct_sync(vnode_t *vnode, size_t pagenum, size_t npages,
+                           long write)
+{
+    mobj_t *o = &vnode->vn_mobj;
+    long ret = 0;
+    for (size_t i = 0; !ret && i < npages; i++)
+    {
+        pframe_t *pf;
+        mobj_find_pframe(o, pagenum + i, &pf);
+        if (!pf)
+            continue;
+        if (pf->pf_addr)
+            ret = mobj_flush_pframe(o, pf);
+        pframe_release(&pf);
+    }
+    if (!ret && write)
+        mobj_discard_range(o, pagenum, pagenum + npages);
+    return ret;
+}
+
+/*
+ * Copies what a direct write put in blocks locs of pages into the pages of
+ * vnode that s5_direct_sync could not drop. The vnode must be locked.
+ */
+static void s5_direct_update(vnode_t *vnode, size_t pagenum, char **pages,
+                             blocknum_t *locs, size_t npages)
+{
+    mobj_t *o = &vnode->vn_mobj;
+    for (size_t i = 0; i < npages; i++)
+    {
+        pframe_t *pf;
+        mobj_find_pframe(o, pagenum + i, &pf);
+        if (!pf)
+            continue;
+        if (pf->pf_addr)
+            memcpy(pf->pf_addr, pages[i], PAGE_SIZE);
+        pf->pf_loc = locs[i];
+        pframe_release(&pf);
+    }
+}
+
+/*
+ * See direct_io in vnode.h. The blocks of a write are allocated up front,
+ * one transaction each as s5fs_flush_pframe would, and the file then grows
+ * over the pages that reached the disk. Holes read as zeros, and the first
+ * page of an inline file comes from the inode; a write moves it out.
+ */
+static ssize_t s5fs_direct_io(vnode_t *vnode, size_t pos, char **pages,
+                              size_t npages, long write)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    blockdev_t *bd = s5fs->s5f_bdev;
+    s5_inode_t *inode = &sn->inode;
+    size_t pagenum = ADDR_TO_PN(pos);
+    KASSERT(PAGE_ALIGNED(pos) && npages <= BLOCKDEV_MAX_SEGS);
+
+    if (!write)
+    {
+        if (pos >= vnode->vn_len)
+            return 0;
+        npages = MIN(npages, ADDR_TO_PN(PAGE_ALIGN_UP(vnode->vn_len)) - pagenum);
+    }
+    else
+    {
+        if (pos >= S5_MAX_FILE_SIZE)
+            return -EFBIG;
+        npages = MIN(npages, (S5_MAX_FILE_SIZE - pos) / PAGE_SIZE);
+        if (!npages)
+            return -EFBIG;
+    }
+    // a write holds the vnode lock already (see vlock_exclusive); a read
+    // takes it just to find its blocks
+    if (!write)
+        vlock(vnode);
+    long ret = s5_direct_sync(vnode, pagenum, npages, write);
+    if (ret)
+    {
+        if (!write)
+            vunlock(vnode);
+        return ret;
+    }
+    if (write && pos > vnode->vn_len)
+        s5_clear_unwritten(sn, vnode->vn_len, pos);
+
+    blocknum_t locs[BLOCKDEV_MAX_SEGS];
+    size_t n = 0;
+    for (; n < npages; n++)
+    {
+        int new;
+        if (write)
+        {
+            s5_journal_start(s5fs);
+            ret = s5_delay_block(sn);
+            if (!ret)
+            {
+                ret = s5_file_block_to_disk_block(sn, pagenum + n, 1, &new);
+                s5_undelay_blocks(sn, 1);
+            }
+            s5_journal_stop(s5fs);
+            if (ret > 0 && !(pagenum + n) &&
+                (inode->s5_flags & S5_INODE_INLINE))
+            {
+                // the file outgrows its inode
+                inode->s5_flags &= ~S5_INODE_INLINE;
+                memset(inode->s5_inline, 0, S5_INLINE_SIZE);
+                sn->dirtied_inode = 1;
+            }
+        }
+        else
+        {
+            ret = s5_file_block_to_disk_block(sn, pagenum + n, 0, &new);
+            if (!ret)
+            {
+                memset(pages[n], 0, PAGE_SIZE);
+                if (!(pagenum + n) && (inode->s5_flags & S5_INODE_INLINE))
+                    memcpy(pages[n], inode->s5_inline, S5_INLINE_SIZE);
+            }
+        }
+        if (ret < 0)
+            break;
+        locs[n] = (blocknum_t)ret;
+    }
+    if (!write)
+        vunlock(vnode);
+
+    blockdev_request_t reqs[BLOCKDEV_MAX_SEGS];
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!locs[i])
+            continue;
+        reqs[i].br_buf = pages[i];
+        reqs[i].br_loc = locs[i];
+        reqs[i].br_count = 1;
+        reqs[i].br_write = write;
+        reqs[i].br_callback = NULL;
+        blockdev_submit(bd, &reqs[i]);
+    }
+    size_t done = n;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!locs[i])
+            continue;
+        long err = blockdev_wait(bd, &reqs[i]);
+        if (err && i < done)
+        {
+            done = i;
+            ret = err;
+        }
+    }
+    if (!done)
+        return ret < 0 ? ret : -EIO;
+
+    size_t len = done * PAGE_SIZE;
+    if (!write)
+        return (ssize_t)MIN(len, vnode->vn_len - pos);
+    s5_direct_update(vnode, pagenum, pages, locs, done);
+    if (pos + len > vnode->vn_len)
+    {
+        vnode->vn_len = pos + len;
+        inode->s5_un.s5_size = (uint32_t)(pos + len);
+        sn->dirtied_inode = 1;
+    }
+    return (ssize_t)len;
+}
+
+/*
+ * Whether page pagenum of vnode, which must be locked, is a sparse block
+ * with no page cached for it. The first page of an inline file is not.
+ */
+static long s5fs_page_is_hole(vnode_t *vnode, size_t pagenum)
+{
+    int new;
+    s5_inode_t *inode = &VNODE_TO_S5NODE(vnode)->inode;
+    return !radix_tree_lookup(&vnode->vn_mobj.mo_index, pagenum) &&
+           (pagenum || !(inode->s5_flags & S5_INODE_INLINE)) &&
+           !s5_file_block_to_disk_block(VNODE_TO_S5NODE(vnode), pagenum, 0,
+                                        &new);
+}
+
+/*
+ * See fsync in vnode.h. A file's pages are written straight to their blocks.
+ * The inode is copied into its block, if it has changed, and the metadata
+ * is committed, which writes that block along with the indirect blocks and
+ * the bitmap blocks its blocks were allocated in (see s5_journal_commit).
+ * For datasync the inode is left alone when the block on disk already has
+ * the file's size and blocks, and inline data, so that only a change of link count is not
+ * written.
+ */
+static long s5fs_fsync(vnode_t *vnode, long datasync)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    s5_inode_t *inode = &sn->inode;
+
+    long ret = mobj_flush(&vnode->vn_mobj);
+    s5_journal_start(s5fs);
+    s5_unreserve_blocks(sn);
+    if (sn->dirtied_inode)
+    {
+        pframe_t *pf;
+        s5_get_meta_disk_block(s5fs, S5_INODE_BLOCK(vnode->vn_vno), 0, &pf);
+        s5_inode_t *disk_inode =
+            (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(vnode->vn_vno);
+        long stale =
+            disk_inode->s5_un.s5_size != inode->s5_un.s5_size ||
+            disk_inode->s5_indirect_block != inode->s5_indirect_block ||
+            disk_inode->s5_dindirect_block != inode->s5_dindirect_block ||
+            disk_inode->s5_flags != inode->s5_flags ||
+            memcmp(disk_inode->s5_extents, inode->s5_extents,
+                   sizeof(inode->s5_extents)) ||
+            memcmp(disk_inode->s5_inline, inode->s5_inline,
+                   sizeof(inode->s5_inline));
+        s5_release_disk_block(&pf);
+        if (!datasync || stale)
+        {
+            s5_get_meta_disk_block(s5fs, S5_INODE_BLOCK(vnode->vn_vno), 1, &pf);
+            disk_inode =
+                (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(vnode->vn_vno);
+            memcpy(disk_inode, inode, sizeof(s5_inode_t));
+            s5_release_disk_block(&pf);
+            sn->dirtied_inode = 0;
+        }
+    }
+    s5_journal_stop(s5fs);
+    ret |= s5_journal_commit(s5fs);
+    return ret ? -EIO : 0;
+}
+
+/*
+ * See fallocate in vnode.h. The blocks are found and mapped, a contiguous
+ * run at a time, by s5_prealloc_blocks. Those past the end of the file cost
+ * no I/O at all: they are only zeroed, in the page cache, once the file
+ * grows over them (see s5_clear_unwritten), which happens here at once
+ * unless keep_size is set.
+ */
+static long s5fs_fallocate(vnode_t *vnode, size_t pos, size_t len,
+                           long keep_size)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(vnode);
+    s5fs_t *s5fs = VNODE_TO_S5FS(vnode);
+    if (pos >= S5_MAX_FILE_SIZE || len > S5_MAX_FILE_SIZE - pos)
+        return -EFBIG;
+
+    size_t first = S5_DATA_BLOCK(pos);
+    size_t end = S5_DATA_BLOCK(pos + len + S5_BLOCK_SIZE - 1);
+    s5_journal_start(s5fs);
+    long ret = s5_prealloc_blocks(sn, first, end - first);
+    s5_journal_stop(s5fs);
+    if (!ret && !keep_size && pos + len > vnode->vn_len)
+    {
+        s5_clear_unwritten(sn, vnode->vn_len, pos + len);
+        vnode->vn_len = pos + len;
+        sn->inode.s5_un.s5_size = (uint32_t)(pos + len);
+        sn->dirtied_inode = 1;
+    }
+    return ret;
+}
+
 /*
  * Verify the superblock. 0 on success; -1 on failure.
  */
 static long s5_check_super(s5_super_t *super)
 {
     if (!(super->s5s_magic == S5_MAGIC &&
-          (super->s5s_free_inode < super->s5s_num_inodes ||
-           super->s5s_free_inode == (uint32_t)-1) &&
+          super->s5s_nfree_inodes < super->s5s_num_inodes &&
           super->s5s_root_inode < super->s5s_num_inodes))
     {
         return -1;
     }
+    if (super->s5s_version == S5_CURRENT_VERSION &&
+        !(super->s5s_bitmap_block > S5_INODE_BLOCK(super->s5s_num_inodes - 1) &&
+          (uint64_t)super->s5s_bitmap_nblocks * S5_BITS_PER_BLOCK >=
+              super->s5s_num_blocks &&
+          super->s5s_bitmap_block + super->s5s_bitmap_nblocks <
+              super->s5s_num_blocks &&
+          super->s5s_nfree < super->s5s_num_blocks &&
+          super->s5s_ibitmap_block >=
+              super->s5s_bitmap_block + super->s5s_bitmap_nblocks &&
+          (uint64_t)super->s5s_ibitmap_nblocks * S5_BITS_PER_BLOCK >=
+              super->s5s_num_inodes &&
+          (uint64_t)super->s5s_ibitmap_block + super->s5s_ibitmap_nblocks <
+              super->s5s_num_blocks &&
+          (!super->s5s_journal_nblocks ||
+           (super->s5s_journal_nblocks >= 2 &&
+            super->s5s_journal_block >=
+                super->s5s_ibitmap_block + super->s5s_ibitmap_nblocks &&
+            (uint64_t)super->s5s_journal_block + super->s5s_journal_nblocks <=
+                super->s5s_num_blocks))))
+    {
+        return -1;
+    }
     if (super->s5s_version != S5_CURRENT_VERSION)
     {
         dbg(DBG_PRINT,
@@ -1132,87 +2059,270 @@ static long s5_check_super(s5_super_t *super)
 }
 
 /*
- * Calculate refcounts on the filesystem.
+ * The check of the directory tree, for s5fs_fsck: the link count of every
+ * inode the tree reaches must be the number of entries naming it. The
+ * caller and S5_FSCK_WORKERS more threads, each in a process of its own,
+ * walk the tree together: the directories yet to be read are queued in
+ * sf_queue, and each worker takes one at a time, reading it a block of
+ * entries at a time and prefetching the inodes of each block (see
+ * s5fs_prefetch_inodes).
+ *
+ * The worker that is the first to find an entry for an inode vgets it,
+ * while the directory is locked so that the inode cannot go, and queues it
+ * if it is a directory. The reference is kept in sf_vnodes until the link
+ * counts are compared, so that the check can be made while the filesystem
+ * is in use.
  */
-static void calculate_refcounts(int *counts, vnode_t *vnode)
+typedef struct s5_fsck
 {
-    long ret;
+    fs_t *sf_fs;
+    spinlock_t sf_lock;  /* protects the rest */
+    ktqueue_t sf_waitq;  /* workers waiting for a directory to read */
+    vnode_t **sf_queue;  /* the directories to read */
+    size_t sf_nqueued;
+    size_t sf_busy;      /* workers reading a directory */
+    int *sf_counts;      /* the entries found for each inode */
+    vnode_t **sf_vnodes; /* each inode found, referenced */
+    long sf_problems;    /* entries for inodes that do not exist */
+} s5_fsck_t;
+
+/* Counts an entry for inode ino, which is a "." or ".." entry if dot is set,
+ * found in a directory that is locked. */
+static void s5_fsck_found(s5_fsck_t *fsck, uint32_t ino, long dot)
+{
+    fs_t *fs = fsck->sf_fs;
+    if (ino >= FS_TO_S5FS(fs)->s5f_super.s5s_num_inodes)
+    {
+        dbg(DBG_PRINT, "   Entry for inode %u, which does not exist\n", ino);
+        spinlock_lock(&fsck->sf_lock);
+        fsck->sf_problems++;
+        spinlock_unlock(&fsck->sf_lock);
+        return;
+    }
+    spinlock_lock(&fsck->sf_lock);
+    long first = !fsck->sf_counts[ino]++ && !dot;
+    spinlock_unlock(&fsck->sf_lock);
+    if (!first)
+    {
+        return;
+    }
 
+    vnode_t *vn = vget(fs, ino);
+    spinlock_lock(&fsck->sf_lock);
+    fsck->sf_vnodes[ino] = vn;
+    if (S_ISDIR(vn->vn_mode))
+    {
+        fsck->sf_queue[fsck->sf_nqueued++] = vn;
+        sched_wakeup_on(&fsck->sf_waitq, NULL);
+    }
+    spinlock_unlock(&fsck->sf_lock);
+}
+
+/* Counts the entries of directory dir. */
+static void s5_fsck_dir(s5_fsck_t *fsck, vnode_t *dir)
+{
+    s5_node_t *sn = VNODE_TO_S5NODE(dir);
+    s5fs_t *s5fs = VNODE_TO_S5FS(dir);
+    uint32_t inos[S5_DIRENTS_PER_BLOCK];
+    uint8_t dots[S5_DIRENTS_PER_BLOCK];
+
+    vlock(dir);
     size_t pos = 0;
-    dirent_t dirent;
-    vnode_t *child;
+    long n;
+    pframe_t *pf;
+    s5_dirent_t *dirents;
+    while ((n = s5_get_dirents(sn, pos, 0, &pf, &dirents)) > 0)
+    {
+        uint32_t lo, hi;
+        s5fs_dirent_inode_blocks(s5fs, dirents, n, &lo, &hi);
+        for (long i = 0; i < n; i++)
+        {
+            inos[i] = dirents[i].s5d_inode;
+            dots[i] = !strncmp(dirents[i].s5d_name, ".", S5_NAME_LEN) ||
+                      !strncmp(dirents[i].s5d_name, "..", S5_NAME_LEN);
+        }
+        // The vgets read inode blocks, which must not be done holding one
+        // of the directory's
+        s5_release_dirents(&pf);
+        s5fs_prefetch_inodes(s5fs, lo, hi);
+        for (long i = 0; i < n; i++)
+        {
+            s5_fsck_found(fsck, inos[i], dots[i]);
+        }
+        pos += (size_t)n * sizeof(s5_dirent_t);
+    }
+    if (n < 0)
+    {
+        dbg(DBG_PRINT, "   Directory %d could not be read: %ld\n",
+            dir->vn_vno, n);
+        spinlock_lock(&fsck->sf_lock);
+        fsck->sf_problems++;
+        spinlock_unlock(&fsck->sf_lock);
+    }
+    vunlock(dir);
+}
 
-    while ((ret = s5fs_readdir(vnode, pos, &dirent)) > 0)
+/* Reads the directories queued in fsck until there are none left, nor any
+ * being read that might queue more. */
+static void s5_fsck_run(s5_fsck_t *fsck)
+{
+    spinlock_lock(&fsck->sf_lock);
+    while (fsck->sf_nqueued || fsck->sf_busy)
     {
-        counts[dirent.d_ino]++;
-        dbg(DBG_S5FS, "incrementing count of inode %d to %d\n", dirent.d_ino,
-            counts[dirent.d_ino]);
-        if (counts[dirent.d_ino] == 1)
+        if (!fsck->sf_nqueued)
         {
-            child = vget_locked(vnode->vn_fs, dirent.d_ino);
-            if (S_ISDIR(child->vn_mode))
-            {
-                calculate_refcounts(counts, child);
-            }
-            vput_locked(&child);
+            sched_sleep_on_locked(&fsck->sf_waitq, &fsck->sf_lock);
+            spinlock_lock(&fsck->sf_lock);
+            continue;
+        }
+        vnode_t *dir = fsck->sf_queue[--fsck->sf_nqueued];
+        fsck->sf_busy++;
+        spinlock_unlock(&fsck->sf_lock);
+        s5_fsck_dir(fsck, dir);
+        spinlock_lock(&fsck->sf_lock);
+        if (!--fsck->sf_busy && !fsck->sf_nqueued)
+        {
+            sched_broadcast_on(&fsck->sf_waitq); // the walk is over
         }
-        pos += ret;
     }
+    spinlock_unlock(&fsck->sf_lock);
+}
 
-    KASSERT(!ret);
+static void *s5_fsck_worker(long arg1, void *arg2)
+{
+    // (the working directory would only keep a vnode of some filesystem
+    // referenced until the process is gone)
+    if (curproc->p_cwd)
+    {
+        vput(&curproc->p_cwd);
+    }
+    s5_fsck_run(arg2);
+    return NULL;
 }
 
 /*
- * Verify refcounts on the filesystem. 0 on success; -1 on failure.
+ * Checks the filesystem fs, which is mounted and may be in use: the link
+ * counts of the inodes against the directory tree, with the tree walked by
+ * several threads at once, then the inode bitmap against the inodes (see
+ * s5_fsck_inodes). Problems are reported with dbg. If repair is set, the
+ * link counts, the bitmap and the super block are set to what was found,
+ * and committed.
+ *
+ * Since the filesystem goes on changing, what an online check reports may
+ * be out of date by the time it returns, and a link or unlink made while
+ * the tree is walked may be reported as a problem.
+ *
+ * Return the number of problems found, or:
+ *  - ENOMEM: there is no memory for the check
  */
-long s5fs_check_refcounts(fs_t *fs)
+long s5fs_fsck(fs_t *fs, long repair)
 {
-    s5fs_t *s5fs = (s5fs_t *)fs->fs_i;
-    int *refcounts;
-    long ret = 0;
-
-    refcounts = kmalloc(s5fs->s5f_super.s5s_num_inodes * sizeof(int));
-    KASSERT(refcounts);
-    memset(refcounts, 0, s5fs->s5f_super.s5s_num_inodes * sizeof(int));
-
-    vlock(fs->fs_root);
-    refcounts[fs->fs_root->vn_vno]++;
-    calculate_refcounts(refcounts, fs->fs_root);
-    refcounts[fs->fs_root->vn_vno]--;
-
-    vunlock(fs->fs_root);
+    s5fs_t *s5fs = FS_TO_S5FS(fs);
+    uint32_t n = s5fs->s5f_super.s5s_num_inodes;
+    s5_fsck_t fsck = {.sf_fs = fs,
+                      .sf_nqueued = 0,
+                      .sf_busy = 0,
+                      .sf_problems = 0};
+    spinlock_init(&fsck.sf_lock);
+    sched_queue_init(&fsck.sf_waitq);
+    fsck.sf_queue = kmalloc(n * sizeof(vnode_t *));
+    fsck.sf_vnodes = kmalloc(n * sizeof(vnode_t *));
+    fsck.sf_counts = kmalloc(n * sizeof(int));
+    if (!fsck.sf_queue || !fsck.sf_vnodes || !fsck.sf_counts)
+    {
+        if (fsck.sf_queue)
+            kfree(fsck.sf_queue);
+        if (fsck.sf_vnodes)
+            kfree(fsck.sf_vnodes);
+        if (fsck.sf_counts)
+            kfree(fsck.sf_counts);
+        return -ENOMEM;
+    }
+    memset(fsck.sf_vnodes, 0, n * sizeof(vnode_t *));
+    memset(fsck.sf_counts, 0, n * sizeof(int));
 
     dbg(DBG_PRINT,
-        "Checking refcounts of s5fs filesystem on block "
-        "device with major %d, minor %d\n",
+        "Checking s5fs filesystem on block device with major %d, minor %d\n",
         MAJOR(s5fs->s5f_bdev->bd_id), MINOR(s5fs->s5f_bdev->bd_id));
 
-    for (uint32_t i = 0; i < s5fs->s5f_super.s5s_num_inodes; i++)
+    vref(fs->fs_root);
+    fsck.sf_vnodes[fs->fs_root->vn_vno] = fs->fs_root;
+    fsck.sf_queue[fsck.sf_nqueued++] = fs->fs_root;
+    pid_t workers[S5_FSCK_WORKERS];
+    size_t nworkers = 0;
+    while (nworkers < S5_FSCK_WORKERS)
     {
-        if (!refcounts[i])
+        proc_t *proc = proc_create("s5fsck");
+        if (!proc)
         {
-            continue;
+            break; // one fewer to help
         }
+        kthread_t *thr = kthread_create(proc, s5_fsck_worker, 0, &fsck);
+        KASSERT(thr && "failed to create an s5fsck thread");
+        sched_make_runnable(thr);
+        workers[nworkers++] = proc->p_pid;
+    }
+    s5_fsck_run(&fsck);
+    for (size_t i = 0; i < nworkers; i++)
+    {
+        do_waitpid(workers[i], NULL, 0);
+    }
 
-        vnode_t *vn = vget(fs, i);
-        KASSERT(vn);
+    long problems = fsck.sf_problems;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        vnode_t *vn = fsck.sf_vnodes[i];
+        if (!vn)
+        {
+            continue;
+        }
+        vlock(vn);
         s5_node_t *sn = VNODE_TO_S5NODE(vn);
-
-        if (refcounts[i] != sn->inode.s5_linkcount)
+        if (fsck.sf_counts[i] != sn->inode.s5_linkcount)
         {
             dbg(DBG_PRINT, "   Inode %d, expecting %d, found %d\n", i,
-                refcounts[i], sn->inode.s5_linkcount);
-            ret = -1;
+                fsck.sf_counts[i], sn->inode.s5_linkcount);
+            problems++;
+            if (repair)
+            {
+                s5_journal_start(s5fs);
+                sn->inode.s5_linkcount = (int16_t)fsck.sf_counts[i];
+                s5_write_inode(s5fs, sn);
+                s5_journal_stop(s5fs);
+            }
         }
+        vunlock(vn);
         vput(&vn);
+        cond_resched();
+    }
+    kfree(fsck.sf_queue);
+    kfree(fsck.sf_vnodes);
+    kfree(fsck.sf_counts);
+
+    if (repair)
+        s5_journal_start(s5fs);
+    problems += s5_fsck_inodes(s5fs, repair);
+    if (repair)
+    {
+        s5_journal_stop(s5fs);
+        s5_journal_commit(s5fs);
     }
 
     dbg(DBG_PRINT,
-        "Refcount check of s5fs filesystem on block "
-        "device with major %d, minor %d completed %s.\n",
-        MAJOR(s5fs->s5f_bdev->bd_id), MINOR(s5fs->s5f_bdev->bd_id),
-        (ret ? "UNSUCCESSFULLY" : "successfully"));
+        "Check of s5fs filesystem on block device with major %d, minor %d "
+        "found %ld problems%s\n",
+        MAJOR(s5fs->s5f_bdev->bd_id), MINOR(s5fs->s5f_bdev->bd_id), problems,
+        problems && repair ? ", repaired" : "");
+    return problems;
+}
 
-    kfree(refcounts);
-    return ret;
+/*
+ * Verify refcounts on the filesystem, and the rest of what s5fs_fsck
+ * checks. 0 on success; -1 on failure.
+ */
+long s5fs_check_refcounts(fs_t *fs)
+{
+    long ret = s5fs_fsck(fs, 0);
+    KASSERT(ret != -ENOMEM);
+    return ret ? -1 : 0;
 }
@@ -0,0 +1,449 @@
+#include "errno.h"
+#include "globals.h"
+#include "kernel.h"
+
+#include "drivers/blockdev.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * The metadata journal. Every block of s5f_mobj, the cache of the blocks
+ * that are not file data, is only written by s5_journal_commit, which
+ * writes all of the dirty ones as one transaction (see s5_journal_header_t
+ * for the layout): a crash leaves the disk as it was either before or after
+ * each commit, once the journal is replayed at mount, rather than with an
+ * inode pointing at blocks the bitmap says are free, or a directory entry
+ * for an inode that was never written.
+ *
+ * An operation that changes metadata holds a handle, from s5_journal_start
+ * to s5_journal_stop, so that every commit has either all of its changes or
+ * none. A commit waits for the handles to go and keeps new ones from being
+ * started until it is done; operations started in the meantime all go in
+ * the next, which is how commits are grouped. They happen when the
+ * filesystem is synced, when a file is fsynced, and on each pass of the
+ * writeback daemon. A handle is started once the operation has locked every
+ * vnode it is going to, and with no block of s5f_mobj held, since the
+ * commit locks them; the handles of a thread nest, for the operations that
+ * call others, like vput from an unlink.
+ *
+ * Blocks freed since the last commit are kept from being reused until the
+ * commit that frees them (see s5_free_blocks), which would otherwise let a
+ * new file's data overwrite a block the disk still says belongs to the old
+ * one. File data itself is not journaled.
+ *
+ * A filesystem made without a journal (s5s_journal_nblocks 0) writes its
+ * blocks back at sync and from the writeback daemon, as it always has.
+ */
+
+/* FNV-1a */
+static uint32_t s5_journal_checksum(uint32_t hash, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ p[i]) * 0x01000193U;
+    }
+    return hash;
+}
+
+/* The most blocks one transaction of s5fs's journal can hold */
+static size_t s5_journal_max(s5fs_t *s5fs)
+{
+    return MIN(s5fs->s5f_super.s5s_journal_nblocks - 1,
+               (uint32_t)S5_JOURNAL_MAX_BLOCKS);
+}
+
+long s5_journal_enabled(s5fs_t *s5fs)
+{
+    return s5fs->s5f_super.s5s_journal_nblocks != 0;
+}
+
+/* Sets up s5fs's journal state, once its super block has been read. */
+long s5_journal_init(s5fs_t *s5fs)
+{
+    spinlock_init(&s5fs->s5f_jlock);
+    sched_queue_init(&s5fs->s5f_jwaitq);
+    s5fs->s5f_jhandles = 0;
+    s5fs->s5f_jcommitting = 0;
+    s5fs->s5f_jwanted = 0;
+    s5fs->s5f_jseq = 1;
+    s5fs->s5f_jhdr = NULL;
+    s5fs->s5f_jpfs = NULL;
+    s5fs->s5f_jfree = NULL;
+    s5fs->s5f_jnfree = 0;
+    s5fs->s5f_jfree_size = 0;
+    if (!s5_journal_enabled(s5fs))
+    {
+        return 0;
+    }
+    s5fs->s5f_jhdr = page_alloc();
+    s5fs->s5f_jpfs = kmalloc(s5_journal_max(s5fs) * sizeof(pframe_t *));
+    if (!s5fs->s5f_jhdr || !s5fs->s5f_jpfs)
+    {
+        s5_journal_destroy(s5fs);
+        return -ENOMEM;
+    }
+    memset(s5fs->s5f_jhdr, 0, S5_BLOCK_SIZE);
+    return 0;
+}
+
+void s5_journal_destroy(s5fs_t *s5fs)
+{
+    if (s5fs->s5f_jhdr)
+    {
+        page_free(s5fs->s5f_jhdr);
+        s5fs->s5f_jhdr = NULL;
+    }
+    if (s5fs->s5f_jpfs)
+    {
+        kfree(s5fs->s5f_jpfs);
+        s5fs->s5f_jpfs = NULL;
+    }
+    if (s5fs->s5f_jfree)
+    {
+        kfree(s5fs->s5f_jfree);
+        s5fs->s5f_jfree = NULL;
+    }
+}
+
+/*
+ * Replays the transaction the journal of s5fs was interrupted in the middle
+ * of, if there is one and all of it made it to the disk, and clears it.
+ * Called as s5fs is mounted, before anything is cached but the super block,
+ * which is read again if it was replayed.
+ *
+ * Returns 0, or:
+ *  - EINVAL: the header is not one s5_journal_commit would have written
+ *  - ENOMEM: there is no memory to read the journal into
+ *  - EIO: the journal could not be read or written
+ */
+long s5_journal_replay(s5fs_t *s5fs)
+{
+    if (!s5_journal_enabled(s5fs))
+    {
+        return 0;
+    }
+    s5_super_t *super = &s5fs->s5f_super;
+    blockdev_t *bd = s5fs->s5f_bdev;
+    s5_journal_header_t *hdr = s5fs->s5f_jhdr;
+    blocknum_t jblock = super->s5s_journal_block;
+    if (blockdev_read(bd, (char *)hdr, jblock, 1))
+    {
+        return -EIO;
+    }
+    if (hdr->s5j_magic != S5_JOURNAL_MAGIC)
+    {
+        memset(hdr, 0, S5_BLOCK_SIZE);
+        return 0;
+    }
+    s5fs->s5f_jseq = hdr->s5j_seq + 1;
+    uint32_t n = hdr->s5j_nblocks;
+    if (!n)
+    {
+        return 0;
+    }
+    if (n > s5_journal_max(s5fs))
+    {
+        return -EINVAL;
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t home = hdr->s5j_blocks[i];
+        if (home >= super->s5s_num_blocks ||
+            (home >= jblock && home < jblock + super->s5s_journal_nblocks))
+        {
+            return -EINVAL;
+        }
+    }
+
+    char *buf = page_alloc();
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+    long ret = 0;
+    uint32_t sum = s5_journal_checksum(0x811c9dc5U, &hdr->s5j_seq,
+                                       sizeof(hdr->s5j_seq));
+    for (uint32_t i = 0; !ret && i < n; i++)
+    {
+        ret = blockdev_read(bd, buf, jblock + 1 + i, 1);
+        sum = s5_journal_checksum(sum, buf, S5_BLOCK_SIZE);
+    }
+    if (!ret && sum == hdr->s5j_checksum)
+    {
+        dbg(DBG_S5FS, "replaying %u blocks of transaction %u\n", n,
+            hdr->s5j_seq);
+        for (uint32_t i = 0; !ret && i < n; i++)
+        {
+            ret = blockdev_read(bd, buf, jblock + 1 + i, 1);
+            ret = ret ? ret : blockdev_write(bd, buf, hdr->s5j_blocks[i], 1);
+        }
+    }
+    else if (!ret)
+    {
+        // The copies never all made it, so the blocks were not touched
+        dbg(DBG_S5FS, "dropping incomplete transaction %u\n", hdr->s5j_seq);
+        n = 0;
+    }
+    page_free(buf);
+    if (ret)
+    {
+        return -EIO;
+    }
+
+    // The blocks must be home for good before the header stops saying to
+    // put them there
+    hdr->s5j_nblocks = 0;
+    if ((n && blockdev_barrier(bd)) ||
+        blockdev_write(bd, (char *)hdr, jblock, 1))
+    {
+        return -EIO;
+    }
+    if (n)
+    {
+        // The super block may have been one of them
+        pframe_t *pf;
+        mobj_lock(&s5fs->s5f_mobj);
+        mobj_delete_pframe(&s5fs->s5f_mobj, S5_SUPER_BLOCK);
+        mobj_unlock(&s5fs->s5f_mobj);
+        s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 0, &pf);
+        memcpy(super, pf->pf_addr, sizeof(s5_super_t));
+        s5_release_disk_block(&pf);
+    }
+    return 0;
+}
+
+/*
+ * Marks the start of an operation that changes s5fs's metadata, waiting
+ * for the commit in progress, or one that is waiting, to be done.
+ */
+void s5_journal_start(s5fs_t *s5fs)
+{
+    if (curthr->kt_fs_handles++ || !s5_journal_enabled(s5fs))
+    {
+        return;
+    }
+    spinlock_lock(&s5fs->s5f_jlock);
+    while (s5fs->s5f_jcommitting || s5fs->s5f_jwanted)
+    {
+        sched_sleep_on_locked(&s5fs->s5f_jwaitq, &s5fs->s5f_jlock);
+        spinlock_lock(&s5fs->s5f_jlock);
+    }
+    s5fs->s5f_jhandles++;
+    spinlock_unlock(&s5fs->s5f_jlock);
+}
+
+/* Marks the end of the operation s5_journal_start started. */
+void s5_journal_stop(s5fs_t *s5fs)
+{
+    KASSERT(curthr->kt_fs_handles > 0);
+    if (--curthr->kt_fs_handles || !s5_journal_enabled(s5fs))
+    {
+        return;
+    }
+    spinlock_lock(&s5fs->s5f_jlock);
+    KASSERT(s5fs->s5f_jhandles > 0);
+    if (!--s5fs->s5f_jhandles)
+    {
+        sched_broadcast_on(&s5fs->s5f_jwaitq);
+    }
+    spinlock_unlock(&s5fs->s5f_jlock);
+}
+
+/*
+ * The flush_pframe of s5f_mobj: with a journal, only s5_journal_commit
+ * writes its blocks, so that a block is never written home before its copy.
+ */
+long s5_journal_flush_pframe(mobj_t *mobj, pframe_t *pf)
+{
+    if (s5_journal_enabled(CONTAINER_OF(mobj, s5fs_t, s5f_mobj)))
+    {
+        return -EAGAIN;
+    }
+    return blockdev_flush_pframe(mobj, pf);
+}
+
+/*
+ * Writes the n blocks of pfs to the blocks of the log from log on or, if log
+ * is 0, to their homes. They are queued BLOCKDEV_MAX_SEGS at a time, so that
+ * each lot goes out in as few transfers as it is consecutive.
+ */
+static long s5_journal_write_blocks(blockdev_t *bd, pframe_t **pfs, size_t n,
+                                    blocknum_t log)
+{
+    long ret = 0;
+    for (size_t start = 0; !ret && start < n; start += BLOCKDEV_MAX_SEGS)
+    {
+        blockdev_request_t reqs[BLOCKDEV_MAX_SEGS];
+        size_t m = MIN(n - start, BLOCKDEV_MAX_SEGS);
+        for (size_t i = 0; i < m; i++)
+        {
+            pframe_t *pf = pfs[start + i];
+            reqs[i].br_buf = pf->pf_addr;
+            reqs[i].br_loc = log ? log + (blocknum_t)(start + i)
+                                 : (blocknum_t)pf->pf_loc;
+            reqs[i].br_count = 1;
+            reqs[i].br_write = 1;
+            reqs[i].br_callback = NULL;
+            blockdev_submit(bd, &reqs[i]);
+        }
+        for (size_t i = 0; i < m; i++)
+        {
+            long err = blockdev_wait(bd, &reqs[i]);
+            ret = ret ? ret : err;
+        }
+    }
+    return ret;
+}
+
+/*
+ * Writes the n blocks in s5f_jpfs as one transaction: their copies, then
+ * the header that commits them, then the blocks themselves, then the header
+ * again, to say there is nothing to replay. On success they are marked
+ * clean. s5f_mobj and the blocks are locked.
+ *
+ * The disk may keep writes in its cache and put them on the platter in any
+ * order, so the copies are flushed before the header is written, through
+ * the cache, and the blocks are flushed before the header is cleared. A
+ * header that is lost once cleared only has the blocks written again.
+ */
+static long s5_journal_write(s5fs_t *s5fs, size_t n)
+{
+    blockdev_t *bd = s5fs->s5f_bdev;
+    blocknum_t jblock = s5fs->s5f_super.s5s_journal_block;
+    s5_journal_header_t *hdr = s5fs->s5f_jhdr;
+    pframe_t **pfs = s5fs->s5f_jpfs;
+    long ret = 0;
+
+    hdr->s5j_magic = S5_JOURNAL_MAGIC;
+    hdr->s5j_seq = s5fs->s5f_jseq++;
+    hdr->s5j_nblocks = (uint32_t)n;
+    uint32_t sum = s5_journal_checksum(0x811c9dc5U, &hdr->s5j_seq,
+                                       sizeof(hdr->s5j_seq));
+    for (size_t i = 0; i < n; i++)
+    {
+        hdr->s5j_blocks[i] = (uint32_t)pfs[i]->pf_loc;
+        sum = s5_journal_checksum(sum, pfs[i]->pf_addr, S5_BLOCK_SIZE);
+    }
+    hdr->s5j_checksum = sum;
+    ret = s5_journal_write_blocks(bd, pfs, n, jblock + 1);
+    ret = ret ? ret : blockdev_barrier(bd);
+    ret = ret ? ret : blockdev_write_fua(bd, (char *)hdr, jblock, 1);
+    ret = ret ? ret : s5_journal_write_blocks(bd, pfs, n, 0);
+    ret = ret ? ret : blockdev_barrier(bd);
+    if (ret)
+    {
+        // Whatever made it is replayed, or not, at the next mount; the
+        // blocks stay dirty for the next commit
+        dbg(DBG_S5FS, "commit of transaction %u failed: %ld\n", hdr->s5j_seq,
+            ret);
+        return -EIO;
+    }
+    hdr->s5j_nblocks = 0;
+    if (blockdev_write(bd, (char *)hdr, jblock, 1))
+    {
+        return -EIO;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_clear_dirty(pfs[i]);
+        MOBJ_STAT_INC(&s5fs->s5f_mobj, ms_flushes);
+    }
+    return 0;
+}
+
+/* Copies the super block into its block, if it is not in there already. */
+static void s5_journal_copy_super(s5fs_t *s5fs)
+{
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 0, &pf);
+    long changed = memcmp(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
+    s5_release_disk_block(&pf);
+    if (changed)
+    {
+        s5_get_meta_disk_block(s5fs, S5_SUPER_BLOCK, 1, &pf);
+        memcpy(pf->pf_addr, &s5fs->s5f_super, sizeof(s5_super_t));
+        s5_release_disk_block(&pf);
+    }
+}
+
+/*
+ * Writes every change made to s5fs's metadata so far to the disk, once the
+ * operations in progress are done. A change that does not fit in the
+ * journal goes in more than one transaction.
+ *
+ * Returns 0, or:
+ *  - EIO: a block could not be written; what was not is still dirty
+ */
+long s5_journal_commit(s5fs_t *s5fs)
+{
+    KASSERT(!curthr->kt_fs_handles && "committing inside an operation");
+    mobj_t *mobj = &s5fs->s5f_mobj;
+    if (!s5_journal_enabled(s5fs))
+    {
+        s5_journal_copy_super(s5fs);
+        mobj_lock(mobj);
+        long ret = mobj_flush(mobj);
+        mobj_unlock(mobj);
+        return ret ? ret : blockdev_barrier(s5fs->s5f_bdev);
+    }
+
+    spinlock_lock(&s5fs->s5f_jlock);
+    s5fs->s5f_jwanted++;
+    while (s5fs->s5f_jcommitting || s5fs->s5f_jhandles)
+    {
+        sched_sleep_on_locked(&s5fs->s5f_jwaitq, &s5fs->s5f_jlock);
+        spinlock_lock(&s5fs->s5f_jlock);
+    }
+    s5fs->s5f_jwanted--;
+    s5fs->s5f_jcommitting = 1;
+    spinlock_unlock(&s5fs->s5f_jlock);
+
+    s5_release_freed_blocks(s5fs);
+    s5_journal_copy_super(s5fs);
+
+    long ret = 0;
+    long written = 0;
+    size_t max = s5_journal_max(s5fs);
+    mobj_lock(mobj);
+    while (!ret && radix_tree_tagged(&mobj->mo_index, MOBJ_TAG_DIRTY))
+    {
+        pframe_t **pfs = s5fs->s5f_jpfs;
+        size_t n = radix_tree_gang_lookup_tag(&mobj->mo_index, (void **)pfs,
+                                              0, max, MOBJ_TAG_DIRTY);
+        for (size_t i = 0; i < n; i++)
+        {
+            kmutex_lock(&pfs[i]->pf_mutex);
+            KASSERT(pfs[i]->pf_addr && pfs[i]->pf_dirty);
+        }
+        ret = s5_journal_write(s5fs, n);
+        written = 1;
+        for (size_t i = 0; i < n; i++)
+        {
+            pframe_release(&pfs[i]);
+        }
+    }
+    mobj_unlock(mobj);
+    if (!ret && !written)
+    {
+        // Data written since the last transaction is only durable once the
+        // disk's cache is flushed
+        ret = blockdev_barrier(s5fs->s5f_bdev);
+    }
+
+    spinlock_lock(&s5fs->s5f_jlock);
+    s5fs->s5f_jcommitting = 0;
+    sched_broadcast_on(&s5fs->s5f_jwaitq);
+    spinlock_unlock(&s5fs->s5f_jlock);
+    return ret;
+}
@@ -1,3 +1,4 @@
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "drivers/blockdev.h"
 #include "errno.h"
@@ -6,6 +7,7 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
 #include "mm/pframe.h"
 #include "proc/kmutex.h"
 #include "util/debug.h"
@@ -14,7 +16,12 @@
 
 static void s5_free_block(s5fs_t *s5fs, blocknum_t block);
 
-static long s5_alloc_block(s5fs_t *s5fs);
+static void s5_free_blocks(s5fs_t *s5fs, blocknum_t start, size_t len);
+
+static long s5_alloc_blocks(s5fs_t *s5fs, ino_t ino, uint32_t goal,
+                            uint32_t want, uint32_t *startp);
+
+static long s5_alloc_block(s5fs_t *s5fs, ino_t ino, uint32_t goal);
 
 static inline void s5_lock_super(s5fs_t *s5fs)
 {
@@ -26,6 +33,19 @@ static inline void s5_unlock_super(s5fs_t *s5fs)
     kmutex_unlock(&s5fs->s5f_mutex);
 }
 
+/* Returns the allocation group of inode ino, see s5_group_t. */
+static inline uint32_t s5_inode_group(s5fs_t *s5fs, ino_t ino)
+{
+    return (uint32_t)ino < s5fs->s5f_super.s5s_num_inodes
+               ? (uint32_t)ino / s5fs->s5f_group_inodes
+               : 0;
+}
+
+static inline s5_group_t *s5_block_group(s5fs_t *s5fs, uint32_t blockno)
+{
+    return &s5fs->s5f_groups[blockno / S5_GROUP_BLOCKS];
+}
+
 /* Helper function to obtain inode info from disk given an inode number.
  *
  *  s5fs     - The file system (it will usually be obvious what to pass for this
@@ -91,167 +111,226 @@ static inline void s5_release_file_block(pframe_t **pfp)
     pframe_release(pfp);
 }
 
+/*
+ * Gets the indirect block that *ptrp, an entry of inode ino or of one of
+ * its indirect blocks, points to. If there is none and alloc is set, one is
+ * allocated, cleared and stored in *ptrp; the caller marks whatever holds
+ * *ptrp as dirty.
+ *
+ * Returns 0 with *pfp the block's pframe, which is dirtied if alloc is set,
+ * or with *pfp NULL if there is no block and alloc is clear, or propagates
+ * errors from s5_alloc_block.
+ */
+static long s5_get_indirect_block(s5fs_t *s5fs, ino_t ino, uint32_t *ptrp,
+                                  int alloc, pframe_t **pfp)
+{
+    *pfp = NULL;
+    if (*ptrp)
+    {
+        s5_get_meta_disk_block(s5fs, *ptrp, alloc, pfp);
+        return 0;
+    }
+    if (!alloc)
+    {
+        return 0;
+    }
+    long block = s5_alloc_block(s5fs, ino, 0);
+    if (block < 0)
+    {
+        return block;
+    }
+    mobj_lock(&s5fs->s5f_mobj);
+    *pfp = s5_cache_and_clear_block(&s5fs->s5f_mobj, block, block);
+    mobj_unlock(&s5fs->s5f_mobj);
+    *ptrp = (uint32_t)block;
+    return 0;
+}
+
+/*
+ * Looks up file block file_blocknum of sn in its indirect blocks, see
+ * s5_inode_t. If block is not 0 and the file block is not mapped there yet,
+ * maps it to block, allocating the indirect blocks needed on the way.
+ *
+ * Returns the disk block the file block is mapped to, 0 if it is not mapped
+ * (and block is 0), or propagates errors from s5_alloc_block, in which case
+ * block is not mapped.
+ */
+static long s5_indirect_map(s5_node_t *sn, size_t file_blocknum,
+                            uint32_t block)
+{
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *inode = &sn->inode;
+    int alloc = block != 0;
+    uint32_t *ptrp = &inode->s5_indirect_block;
+    size_t index = file_blocknum;
+    pframe_t *dpf = NULL;
+    long ret;
+
+    if (file_blocknum >= S5_NIDIRECT_BLOCKS)
+    {
+        index = file_blocknum - S5_NIDIRECT_BLOCKS;
+        KASSERT(index / S5_NIDIRECT_BLOCKS < S5_NIDIRECT_BLOCKS);
+        uint32_t old = inode->s5_dindirect_block;
+        ret = s5_get_indirect_block(s5fs, sn->vnode.vn_vno,
+                                    &inode->s5_dindirect_block, alloc, &dpf);
+        sn->dirtied_inode |= inode->s5_dindirect_block != old;
+        if (ret < 0 || !dpf)
+        {
+            return ret;
+        }
+        ptrp = (uint32_t *)dpf->pf_addr + index / S5_NIDIRECT_BLOCKS;
+        index %= S5_NIDIRECT_BLOCKS;
+    }
+
+    pframe_t *pf;
+    uint32_t old = *ptrp;
+    ret = s5_get_indirect_block(s5fs, sn->vnode.vn_vno, ptrp, alloc, &pf);
+    if (!dpf)
+    {
+        sn->dirtied_inode |= *ptrp != old;
+    }
+    else
+    {
+        s5_release_disk_block(&dpf);
+    }
+    if (ret < 0 || !pf)
+    {
+        return ret;
+    }
+    uint32_t *blocks = (uint32_t *)pf->pf_addr;
+    if (alloc)
+    {
+        KASSERT(!blocks[index]);
+        blocks[index] = block;
+    }
+    ret = blocks[index];
+    s5_release_disk_block(&pf);
+    return ret;
+}
+
 /* Given a file and a file block number, return the disk block number of the
  * desired file block.
  *
  *  sn            - The s5_node representing the file
  *  file_blocknum - The offset of the desired block relative to the beginning of
  *                  the file
- *  alloc         - If set, allocate the block / indirect block as necessary
+ *  alloc         - If set, allocate the block / indirect blocks as necessary
  *                  If clear, don't allocate sparse blocks
  *  newp          - Set *newp = 1 if a block is allocated, otherwise 0
+ *  runp          - If not NULL, set to the number of file blocks, starting
+ *                  with this one, known to be in consecutive disk blocks: the
+ *                  rest of an extent, or 1
  *
  * Return a disk block number on success, or:
- *  - 0: The block is sparse, and alloc is clear, OR
- *       The indirect block would contain the block, but the indirect block is
- *       sparse, and alloc is clear
- *  - EINVAL: The specified block number is greater than or equal to 
+ *  - 0: The block is sparse, and alloc is clear
+ *  - EINVAL: The specified block number is greater than or equal to
  *            S5_MAX_FILE_BLOCKS
  *  - Propagate errors from s5_alloc_block.
  *
- * Hints:
- *  - Use the file inode's s5_direct_blocks and s5_indirect_block to perform the
- *    translation.
- *  - Use s5_alloc_block to allocate blocks.
- *  - An indirect block should be allocated with all 0s (none of its direct blocks
- *    are allocated yet).
- *      - Hint: Use s5_cache_and_clear_block.
- *  - Be sure to mark the inode as dirty when appropriate, i.e. when you are
- *    making changes to the actual s5_inode_t struct. Hint: Does allocating a
- *    direct block dirty the inode? What about allocating the indirect block?
- *    Finally, what about allocating a block pointed to by the indirect block?
- *  - Cases to consider:
- *    1) file_blocknum < S_NDIRECT_BLOCKS
- *    2) Indirect block is not allocated but alloc is set. Be careful not to
- *       leak a block in an error case!
- *    3) Indirect block is allocated. The desired block may be sparse, and you
- *       may have to allocate it.
- *    4) The indirect block has not been allocated and alloc is clear.
+ * The extents are searched first, then the indirect blocks (see s5_inode_t).
+ * A block that is allocated is the next of those reserved for the file,
+ * if they were reserved for it (see s5_reserve_blocks), or otherwise the
+ * disk block after the extent that ends just before it if that is free. It
+ * goes at the end of that extent if that is where it is, in a new extent if
+ * one is unused, and in the indirect blocks otherwise.
  */
-long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
-                                 int alloc, int *newp)
+static long s5_file_block_map(s5_node_t *sn, size_t file_blocknum, int alloc,
+                              int *newp, size_t *runp)
 {
-    // Initialize the new block flag
     *newp = 0;
-    
-    // Validate block number range
-    if (file_blocknum >= S5_MAX_FILE_BLOCKS) {
+    if (runp)
+    {
+        *runp = 1;
+    }
+    if (file_blocknum >= S5_MAX_FILE_BLOCKS)
+    {
         return -EINVAL;
     }
-    
+
     s5_inode_t *inode = &sn->inode;
-    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
-    
-    // Handle direct blocks
-    if (file_blocknum < S5_NDIRECT_BLOCKS) {
-        uint32_t direct_block = inode->s5_direct_blocks[file_blocknum];
-        
-        if (direct_block != 0) {
-            // Block already exists
-            return direct_block;
+    s5_extent_t *prev = NULL;
+    s5_extent_t *unused = NULL;
+    for (unsigned i = 0; i < S5_NEXTENTS; i++)
+    {
+        s5_extent_t *ext = &inode->s5_extents[i];
+        size_t off = file_blocknum - ext->s5e_block;
+        if (!ext->s5e_len)
+        {
+            unused = unused ? unused : ext;
         }
-        
-        // Handle sparse block
-        if (!alloc) {
-            return 0;
+        else if (file_blocknum >= ext->s5e_block && off < ext->s5e_len)
+        {
+            if (runp)
+            {
+                *runp = ext->s5e_len - off;
+            }
+            return ext->s5e_start + off;
         }
-        
-        // Allocate a new direct block
-        long new_block = s5_alloc_block(s5fs);
-        if (new_block < 0) {
-            return new_block;
+        else if (off == ext->s5e_len)
+        {
+            prev = ext;
         }
-        
-        // Store the new block in inode
-        inode->s5_direct_blocks[file_blocknum] = new_block;
-        sn->dirtied_inode = 1;
-        *newp = 1;
-        
-        return new_block;
     }
-    
-    // Block number is greater than the number of direct blocks
-    size_t indirect_index = file_blocknum - S5_NDIRECT_BLOCKS;
-    KASSERT(indirect_index < S5_NIDIRECT_BLOCKS);
-    
-    uint32_t indirect_block = inode->s5_indirect_block;
-    
-    if (indirect_block == 0) {
-        // Indirect block is not allocated
-        if (!alloc) {
-            return 0;
-        }
-        
-        // Allocate the indirect block
-        long new_indirect_block = s5_alloc_block(s5fs);
-        if (new_indirect_block < 0) {
-            return new_indirect_block;
-        }
-        
-        // Update inode with the new indirect block
-        inode->s5_indirect_block = new_indirect_block;
-        sn->dirtied_inode = 1;
-        
-        // Create and clear the indirect block
-        // Lock the filesystem memory object before calling s5_cache_and_clear_block
-        mobj_lock(&s5fs->s5f_mobj);
-        pframe_t *indirect_pf = s5_cache_and_clear_block(&s5fs->s5f_mobj, 
-                                                         new_indirect_block, 
-                                                         new_indirect_block);
-        mobj_unlock(&s5fs->s5f_mobj);
-        
-        // Allocate the data block
-        long new_data_block = s5_alloc_block(s5fs);
-        if (new_data_block < 0) {
-            // Free the indirect block
-            s5_release_disk_block(&indirect_pf);
-            s5_free_block(s5fs, new_indirect_block);
-            inode->s5_indirect_block = 0;
-            sn->dirtied_inode = 1;
-            return new_data_block;
-        }
-
-        // Update the indirect block
-        uint32_t *indirect_blocks = (uint32_t *)indirect_pf->pf_addr;
-        indirect_blocks[indirect_index] = new_data_block;
-        s5_release_disk_block(&indirect_pf);
-        
-        *newp = 1;
-        return new_data_block;
+
+    long block = s5_indirect_map(sn, file_blocknum, 0);
+    if (block || !alloc)
+    {
+        return block;
     }
-    
-    // Indirect block is allocated, check if the desired block is allocated
-    pframe_t *indirect_pf;
-    s5_get_meta_disk_block(s5fs, indirect_block, alloc, &indirect_pf);
-    
-    uint32_t *indirect_blocks = (uint32_t *)indirect_pf->pf_addr;
-    uint32_t data_block = indirect_blocks[indirect_index];
-    
-    if (data_block != 0) {
-        // Data block is already allocated
-        s5_release_disk_block(&indirect_pf);
-        return data_block;
+
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    uint32_t goal = prev ? prev->s5e_start + prev->s5e_len : 0;
+    if (sn->resv.s5e_len && sn->resv.s5e_block == file_blocknum)
+    {
+        block = sn->resv.s5e_start++;
+        sn->resv.s5e_block++;
+        sn->resv.s5e_len--;
     }
-    
-    // Data block is sparse
-    if (!alloc) {
-        s5_release_disk_block(&indirect_pf);
-        return 0;
+    else if ((block = s5_alloc_block(s5fs, sn->vnode.vn_vno, goal)) < 0)
+    {
+        return block;
     }
-    
-    // Allocate the data block
-    long new_data_block = s5_alloc_block(s5fs);
-    if (new_data_block < 0) {
-        s5_release_disk_block(&indirect_pf);
-        return new_data_block;
+    if (prev && block == goal)
+    {
+        prev->s5e_len++;
+        sn->dirtied_inode = 1;
+    }
+    else if (unused)
+    {
+        unused->s5e_block = (uint32_t)file_blocknum;
+        unused->s5e_start = (uint32_t)block;
+        unused->s5e_len = 1;
+        sn->dirtied_inode = 1;
+    }
+    else
+    {
+        long ret = s5_indirect_map(sn, file_blocknum, (uint32_t)block);
+        if (ret < 0)
+        {
+            s5_free_block(s5fs, (blocknum_t)block);
+            return ret;
+        }
     }
-    
-    // Update the indirect block
-    indirect_blocks[indirect_index] = new_data_block;
-    s5_release_disk_block(&indirect_pf);
-    
     *newp = 1;
-    return new_data_block;
+    return block;
+}
+
+long s5_file_block_to_disk_block(s5_node_t *sn, size_t file_blocknum,
+                                 int alloc, int *newp)
+{
+    return s5_file_block_map(sn, file_blocknum, alloc, newp, NULL);
+}
+
+/*
+ * Like s5_file_block_to_disk_block without alloc, but also sets *runp to
+ * the number of file blocks from file_blocknum on that are known to follow
+ * the returned block on the disk, so that a sequential reader can map a
+ * whole extent with one lookup.
+ */
+long s5_file_block_run(s5_node_t *sn, size_t file_blocknum, size_t *runp)
+{
+    int new;
+    return s5_file_block_map(sn, file_blocknum, 0, &new, runp);
 }
 
 /* Given a mobj and a block, clear any data in the block and store a newly
@@ -271,7 +350,7 @@ pframe_t *s5_cache_and_clear_block(mobj_t *mo, long block, long loc) {
     pf->pf_addr = page_alloc();
     KASSERT(pf->pf_addr);
     memset(pf->pf_addr, 0, PAGE_SIZE);
-    pf->pf_dirty = 1;  // XXX do this later --I think it's okay here -mgyee
+    pframe_set_dirty(pf);  // XXX do this later --I think it's okay here -mgyee
     return pf;
 }
 
@@ -296,385 +375,1584 @@ pframe_t *s5_cache_and_clear_block(mobj_t *mo, long block, long loc) {
  *    length of the actual file. (If pos is greater than or equal to the length
  *    of the file, then s5_read_file should return 0). 
  *  - The portion of the file you want to read may be split up between file blocks
+ *
+ * If shared is set, the caller holds only the vnode's vn_rwlock (shared) and
+ * the vnode is locked just for each page cache lookup. Otherwise the caller
+ * holds the vnode lock throughout.
  */
+static ssize_t s5_read_file_common(s5_node_t *sn, size_t pos, char *buf,
+                                   size_t len, long shared)
+{
+    // Pages are copied straight out of the page cache, a batch at a time;
+    // uncached holes are read from the zero page (see s5fs_page_is_hole)
+    return vnode_read_cached(&sn->vnode, pos, buf, len, !shared);
+}
+
 ssize_t s5_read_file(s5_node_t *sn, size_t pos, char *buf, size_t len)
 {
-    // Validate position is within file bounds
-    if (pos >= sn->vnode.vn_len) {
-        return 0; // End of file
-    }
-    
-    // Calculate actual read length
-    size_t actual_len = len;
-    if (pos + len > sn->vnode.vn_len) {
-        actual_len = sn->vnode.vn_len - pos;
-    }
-    
-    size_t bytes_read = 0;
-    size_t current_pos = pos;
-    
-    while (bytes_read < actual_len) {
-        // Determine file block and offset
-        size_t file_block = current_pos / S5_BLOCK_SIZE;
-        size_t block_offset = current_pos % S5_BLOCK_SIZE;
-        
-        // Acquire the file block
-        pframe_t *pf;
-        long ret = s5_get_file_block(sn, file_block, 0, &pf);
-        if (ret < 0) {
-            return ret;
-        }
-        
-        // Calculate bytes to read from current block
-        size_t bytes_in_block = S5_BLOCK_SIZE - block_offset;
-        size_t bytes_to_read = actual_len - bytes_read;
-        if (bytes_to_read > bytes_in_block) {
-            bytes_to_read = bytes_in_block;
-        }
-        
-        // Transfer data from block to buffer
-        char *block_data = (char *)pf->pf_addr + block_offset;
-        memcpy(buf + bytes_read, block_data, bytes_to_read);
-        
-        // Release the block
-        s5_release_file_block(&pf);
-        
-        // Update progress
-        bytes_read += bytes_to_read;
-        current_pos += bytes_to_read;
-    }
-    
-    return bytes_read;
+    return s5_read_file_common(sn, pos, buf, len, 0);
 }
 
-/* Write to a file.
- *
- *  sn  - The s5_node representing the file to write to
- *  pos - The position to start writing to
- *  buf - The buffer to write from
- *  len - The number of bytes to write
- *
- * Return the number of bytes written, or:
- *  - EFBIG: pos was beyond S5_MAX_FILE_SIZE
- *  - Propagate errors from s5_get_file_block (that is, do not return a partial
- *    write) Thus, only return the number of bytes that were actually written if 
- *    the function doesn't fail. For example, if 10k bytes were requested, 
- *    but you only wrote 5k, only return 5k
- *
- * Hints:
- *  - You should return -EFBIG only if the provided pos was invalid. Otherwise,
- *    it is okay to make a partial write up to the maximum file size.
- *  - Use s5_get_file_block and s5_release_file_block to obtain pframes with
- *    the desired blocks.
- *  - Because s5_get_file_block calls s5fs_get_pframe, which checks the length
- *    of the vnode, you may have to update the vnode's length before you call
- *    s5_get_file_block. In this case, you should also update the inode's
- *    s5_size and mark the inode dirty.
- *  - If, midway through writing, you run into an error with s5_get_file_block,
- *    it is okay to merely undo your most recent changes while leaving behind
- *    writes you've already made to other blocks, before returning the error.
- *    That is, it is okay to make a partial write that the caller does not know
- *    about, as long as the file's length is consistent with what you've
- *    actually written so far.
- *  - You should maintain the vn_len of the vnode and the s5_un.s5_size field of the 
- *    inode to be the same. 
+/* Like s5_read_file, but for callers that hold vn_rwlock shared rather than
+ * the vnode lock. */
+ssize_t s5_read_file_shared(s5_node_t *sn, size_t pos, char *buf, size_t len)
+{
+    return s5_read_file_common(sn, pos, buf, len, 1);
+}
+
+/*
+ * Sets aside, in sn->resv, a run of free disk blocks for the first sparse
+ * blocks among the nblocks file blocks from file_blocknum, whose pages are
+ * about to be written back in order, so that they are allocated with one
+ * search of the bitmap and, as far as the disk allows, next to each other
+ * and to the block before them. s5_file_block_map hands them out as the
+ * pages are written. Nothing is reserved if there is no room.
  */
-ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
+static void s5_reserve_blocks(s5_node_t *sn, size_t file_blocknum,
+                              size_t nblocks)
 {
-    // Check if starting position is beyond the maximum file size
-    if (pos >= S5_MAX_FILE_SIZE) {
-        return -EFBIG;
+    KASSERT(!sn->resv.s5e_len);
+    size_t end = MIN(file_blocknum + nblocks, S5_MAX_FILE_BLOCKS);
+    int new;
+    size_t run;
+    long loc;
+    while (file_blocknum < end &&
+           (loc = s5_file_block_map(sn, file_blocknum, 0, &new, &run)))
+    {
+        if (loc < 0)
+        {
+            return;
+        }
+        file_blocknum += run;
     }
-    
-    // Adjust write length if it would extend beyond the maximum file size
-    size_t actual_len = len;
-    if (pos + len > S5_MAX_FILE_SIZE) {
-        actual_len = S5_MAX_FILE_SIZE - pos;
+    size_t count = 0;
+    while (file_blocknum + count < end &&
+           !s5_file_block_map(sn, file_blocknum + count, 0, &new, NULL))
+    {
+        count++;
     }
-    
-    // Track the original file length for error recovery
-    size_t original_len = sn->vnode.vn_len;
-    size_t bytes_written = 0;
-    size_t current_pos = pos;
-    
-    while (bytes_written < actual_len) {
-        // Calculate which file block we're writing to
-        size_t file_block = current_pos / S5_BLOCK_SIZE;
-        size_t block_offset = current_pos % S5_BLOCK_SIZE;
-        
-        // Calculate how much to write to the block
-        size_t bytes_in_block = S5_BLOCK_SIZE - block_offset;
-        size_t bytes_to_write = actual_len - bytes_written;
-        if (bytes_to_write > bytes_in_block) {
-            bytes_to_write = bytes_in_block;
-        }
-        
-        // Check if we need to extend the file length
-        size_t new_pos = current_pos + bytes_to_write;
-        if (new_pos > sn->vnode.vn_len) { 
-            // Update the file length in both vnode and inode
-            sn->vnode.vn_len = new_pos;
-            sn->inode.s5_un.s5_size = new_pos;
-            sn->dirtied_inode = 1;
-        }
-        
-        // Get the file block for writing
-        pframe_t *pf;
-        long ret = s5_get_file_block(sn, file_block, 1, &pf);
-        if (ret < 0) {
-            // Restore the original file length and return error
-            sn->vnode.vn_len = original_len;
-            sn->inode.s5_un.s5_size = original_len;
-            sn->dirtied_inode = 1;
-            return ret;
-        }
-        
-        // Copy data from the buffer to the block
-        char *block_data = (char *)pf->pf_addr + block_offset;
-        memcpy(block_data, buf + bytes_written, bytes_to_write);
-        
-        // Release the file block
-        s5_release_file_block(&pf);
-        
-        // Update counters
-        bytes_written += bytes_to_write;
-        current_pos += bytes_to_write;
+    if (count < 2)
+    {
+        return; // a single block is better allocated when it is written
+    }
+
+    loc = file_blocknum ? s5_file_block_map(sn, file_blocknum - 1, 0, &new,
+                                            NULL)
+                        : 0;
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    uint32_t start;
+    long got = s5_alloc_blocks(s5fs, sn->vnode.vn_vno,
+                               loc > 0 ? (uint32_t)loc + 1 : 0,
+                               (uint32_t)count, &start);
+    if (got > 0)
+    {
+        sn->resv.s5e_block = (uint32_t)file_blocknum;
+        sn->resv.s5e_start = start;
+        sn->resv.s5e_len = (uint32_t)got;
+        s5_lock_super(s5fs);
+        s5fs->s5f_nreserved += got;
+        s5_unlock_super(s5fs);
     }
-    
-    return bytes_written;
 }
 
-/* Allocate one block from the filesystem.
- *
- * Return the block number of the newly allocated block, or:
- *  - ENOSPC: There are no more free blocks
- *
- * Hints:
- *  - Protect access to the super block using s5_lock_super and s5_unlock super.
- *  - Recall that the free block list is a linked list of blocks containing disk
- *    block numbers of free blocks. Each node contains S5_NBLKS_PER_FNODE block
- *    numbers, where the last entry is a pointer to the next node in the linked
- *    list, or -1 if there are no more free blocks remaining. The super block's
- *    s5s_free_blocks is the first node of this linked list.
- *  - The super block's s5s_nfree member is the number of blocks that are free
- *    within s5s_free_blocks. You could use it as an index into the
- *    s5s_free_blocks array. Be sure to update the field appropriately.
- *  - When s5s_free_blocks runs out (i.e. s5s_nfree == 0), refill it by
- *    collapsing the next node of the free list into the super block. Exactly
- *    when you do this is up to you.
- *  - You may find it helpful to take a look at the implementation of
- *    s5_free_block below.
- *  - You may assume/assert that any pframe calls succeed.
- */
-static long s5_alloc_block(s5fs_t *s5fs)
+/* Frees whatever s5_reserve_blocks set aside for sn and was not used. */
+void s5_unreserve_blocks(s5_node_t *sn)
 {
-    s5_lock_super(s5fs);
-    s5_super_t *s = &s5fs->s5f_super;
-    
-    // Check if we need to refill from the next node in the free list
-    if (s->s5s_nfree == 0) {
-        if (s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] == (uint32_t)-1) {
-            s5_unlock_super(s5fs);
-            return -ENOSPC;
-        }
-        
-        // Load the next node from disk
-        uint32_t next_node_block = s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1];
-        pframe_t *pf;
-        s5_get_meta_disk_block(s5fs, next_node_block, 0, &pf);
-        
-        // Copy the free block list from the next node
-        memcpy(s->s5s_free_blocks, pf->pf_addr, sizeof(s->s5s_free_blocks));
-        s5_release_disk_block(&pf);
-        
-        s->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
-        
+    if (sn->resv.s5e_len)
+    {
+        s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+        s5_free_blocks(s5fs, sn->resv.s5e_start, sn->resv.s5e_len);
+        s5_lock_super(s5fs);
+        s5fs->s5f_nreserved -= sn->resv.s5e_len;
         s5_unlock_super(s5fs);
-        dbg(DBG_S5FS, "allocated disk block %d\n", next_node_block);
-        return next_node_block;
+        sn->resv.s5e_len = 0;
     }
-    
-    // Allocate from the current free list
-    KASSERT(s->s5s_nfree > 0);
-    
-    // Get a block from the free list
-    uint32_t allocated_block = s->s5s_free_blocks[--s->s5s_nfree];
-    
-    s5_unlock_super(s5fs);
-    
-    dbg(DBG_S5FS, "allocated disk block %d\n", allocated_block);
-    return allocated_block;
 }
 
 /*
- * The exact opposite of s5_alloc_block: add blockno to the free list of the
- * filesystem. This should never fail. You may assert that any pframe calls
- * succeed.
+ * Delayed allocation: a page written where its file block is sparse gets
+ * no disk block (see s5fs_get_pframe) until it is written back, when the
+ * file has usually reached its final size and the pages after it are ready
+ * too; those then get a single run of blocks. A file removed before then
+ * never gets any.
  *
- * Don't forget to protect access to the super block, update s5s_nfree, and
- * expand the linked list correctly if the super block can no longer hold any
- * more free blocks in its s5s_free_blocks array according to s5s_nfree.
+ * So that write(2) still fails with ENOSPC rather than writeback failing
+ * later, such pages are counted, in sn->ndelayed and, for all the files,
+ * in s5f_ndelayed, and a page is only let in while there are enough free
+ * blocks, reserved ones included, for all of them and for the indirect
+ * blocks they may need. A page is counted while it is dirty and has no
+ * block, that is while its pf_loc is 0.
  */
-static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
+
+/*
+ * Counts one more page of sn as written without a block. The vnode must be
+ * locked. Returns 0, or:
+ *  - ENOSPC: the disk has no room for another such page
+ */
+long s5_delay_block(s5_node_t *sn)
 {
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
     s5_lock_super(s5fs);
-    s5_super_t *s = &s5fs->s5f_super;
-    dbg(DBG_S5FS, "freeing disk block %d\n", blockno);
-    KASSERT(blockno);
-    KASSERT(s->s5s_nfree < S5_NBLKS_PER_FNODE);
-
-    // Don't need to remove pframe from file mobj, since
-    // remove_vnode is called after the file's mobj is flushed
-    // Edge case: s5_remove_blocks, called from truncate file
-
-    if (s->s5s_nfree == S5_NBLKS_PER_FNODE - 1)
+    size_t need = s5fs->s5f_ndelayed + 1;
+    need += need / S5_NIDIRECT_BLOCKS + 2;
+    if (s5fs->s5f_super.s5s_nfree + s5fs->s5f_nreserved < need)
     {
-        // FIX THIS! Don't need to read prior contents --I think this is ok, allows us to
-        // cache the block. Also can't think of any better way to write to the block -mgyee
-        pframe_t *pf;
-        s5_get_meta_disk_block(s5fs, blockno, 1, &pf);
-        memcpy(pf->pf_addr, s->s5s_free_blocks, sizeof(s->s5s_free_blocks));
-        s5_release_disk_block(&pf);
-
-        s->s5s_nfree = 0;
-        s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = blockno;
-    }
-    else
-    {
-        s->s5s_free_blocks[s->s5s_nfree++] = blockno;
-        // only delete in this case b/c in first case we're still using that
-        // block as a "meta" block, just to store free block numbers
-        mobj_delete_pframe(&s5fs->s5f_mobj, blockno);
+        s5_unlock_super(s5fs);
+        return -ENOSPC;
     }
+    s5fs->s5f_ndelayed++;
+    s5_unlock_super(s5fs);
+    sn->ndelayed++;
+    return 0;
+}
 
+/* Stops counting n pages of sn, which have blocks now or are gone. */
+void s5_undelay_blocks(s5_node_t *sn, size_t n)
+{
+    KASSERT(n <= sn->ndelayed);
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_lock_super(s5fs);
+    s5fs->s5f_ndelayed -= n;
     s5_unlock_super(s5fs);
+    sn->ndelayed -= n;
 }
 
 /*
- * Allocate one inode from the filesystem. You will need to use the super block
- * s5s_free_inode member. You must initialize the on-disk contents of the
- * allocated inode according to the arguments type and devid.
+ * Allocates the disk block of file block file_blocknum of sn, whose page is
+ * being written back without one. The run of dirty pages without blocks
+ * that follows it, which mobj_flush and the writeback daemon get to next,
+ * is reserved blocks right after it first. The vnode must be locked.
  *
- * Recall that the free inode list is a linked list. Each free inode contains a
- * link to the next free inode. The super block s5s_free_inode must always point
- * to the next free inode, or contain -1 to indicate no more inodes are
- * available.
- *
- * Don't forget to protect access to the super block and update s5s_free_inode.
+ * Returns the disk block, or propagates errors from s5_file_block_map.
+ */
+long s5_alloc_delayed_block(s5_node_t *sn, size_t file_blocknum)
+{
+    mobj_t *o = &sn->vnode.vn_mobj;
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    if (sn->resv.s5e_len && sn->resv.s5e_block != file_blocknum)
+    {
+        s5_unreserve_blocks(sn);
+    }
+    if (!sn->resv.s5e_len)
+    {
+        size_t n = 1;
+        pframe_t *next;
+        while (n < S5_NIDIRECT_BLOCKS &&
+               (next = radix_tree_lookup(&o->mo_index, file_blocknum + n)) &&
+               next->pf_dirty && !next->pf_loc)
+        {
+            n++;
+        }
+        s5_reserve_blocks(sn, file_blocknum, n);
+    }
+
+    uint32_t reserved = sn->resv.s5e_len;
+    int new;
+    long loc = s5_file_block_map(sn, file_blocknum, 1, &new, NULL);
+    if (loc > 0)
+    {
+        s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+        s5_lock_super(s5fs);
+        s5fs->s5f_nreserved -= reserved - sn->resv.s5e_len;
+        s5fs->s5f_ndelayed--;
+        s5_unlock_super(s5fs);
+        sn->ndelayed--;
+    }
+    return loc;
+}
+
+/*
+ * Makes file block file_blocknum of sn, mapped to disk block loc that holds
+ * nothing of the file's, read as zeros: a zeroed page, dirty so that the
+ * zeros reach the block, is cached for it. A hole that is cached already
+ * is zeros, and is given the block; a page written since is left dirty,
+ * to find the block when it is written back. The vnode must be locked.
+ */
+static void s5_cache_zero_block(s5_node_t *sn, size_t file_blocknum,
+                                long loc)
+{
+    mobj_t *o = &sn->vnode.vn_mobj;
+    pframe_t *pf;
+    mobj_find_pframe(o, file_blocknum, &pf);
+    if (!pf)
+    {
+        pf = s5_cache_and_clear_block(o, (long)file_blocknum, loc);
+    }
+    else if (!pf->pf_loc && !pf->pf_dirty)
+    {
+        pf->pf_loc = (size_t)loc;
+        pframe_set_dirty(pf);
+    }
+    pframe_release(&pf);
+}
+
+/*
+ * Preallocation: s5fs_fallocate gives a file blocks before it has written
+ * them, usually past its end, for it to grow into. Blocks past the end of
+ * a file hold nothing of it, so no more is recorded: they are the
+ * preallocated ones, and are neither read nor written until the file grows
+ * over them, when s5_clear_unwritten makes them zeros. A sparse block
+ * inside the file that is preallocated is zeroed with s5_cache_zero_block
+ * straight away, as it is read from then on.
+ */
+
+/*
+ * Preallocates the sparse blocks among the nblocks file blocks of sn from
+ * file_blocknum. Each run of them gets a run of free disk blocks from one
+ * search of the bitmap, next to the block before it where that is free,
+ * which is set aside in sn->resv and handed out by s5_file_block_map, so
+ * that the run lands in one extent where one is unused or can be extended.
+ * The first block of an inline file is left alone. The vnode must be
+ * locked, and a journal handle held.
+ *
+ * Returns 0, or:
+ *  - ENOSPC: the free blocks, less those needed by pages written without
+ *    blocks (see s5_delay_block), are too few; nothing is allocated
+ *  - Propagate errors from s5_file_block_map, once some blocks may have
+ *    been
+ */
+long s5_prealloc_blocks(s5_node_t *sn, size_t file_blocknum, size_t nblocks)
+{
+    KASSERT(kmutex_owns_mutex(&sn->vnode.vn_mobj.mo_mutex));
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    size_t end = MIN(file_blocknum + nblocks, S5_MAX_FILE_BLOCKS);
+    if (!file_blocknum && (sn->inode.s5_flags & S5_INODE_INLINE))
+    {
+        file_blocknum = 1;
+    }
+    int new;
+    size_t run;
+    long loc;
+
+    size_t want = 0;
+    for (size_t b = file_blocknum; b < end; b += loc ? MIN(run, end - b) : 1)
+    {
+        if ((loc = s5_file_block_map(sn, b, 0, &new, &run)) < 0)
+        {
+            return loc;
+        }
+        want += !loc;
+    }
+    if (!want)
+    {
+        return 0;
+    }
+    s5_lock_super(s5fs);
+    size_t need = s5fs->s5f_ndelayed + want;
+    need += need / S5_NIDIRECT_BLOCKS + 2;
+    long room = s5fs->s5f_super.s5s_nfree + s5fs->s5f_nreserved >= need;
+    s5_unlock_super(s5fs);
+    if (!room)
+    {
+        return -ENOSPC;
+    }
+
+    s5_unreserve_blocks(sn);
+    long ret = 0;
+    size_t b = file_blocknum;
+    while (!ret && b < end)
+    {
+        if ((loc = s5_file_block_map(sn, b, 0, &new, &run)))
+        {
+            ret = loc < 0 ? loc : 0;
+            b += MIN(run, end - b);
+            continue;
+        }
+        size_t count = 1;
+        while (b + count < end && count < S5_NIDIRECT_BLOCKS &&
+               !s5_file_block_map(sn, b + count, 0, &new, NULL))
+        {
+            count++;
+        }
+        loc = b ? s5_file_block_map(sn, b - 1, 0, &new, NULL) : 0;
+        uint32_t start;
+        long got = s5_alloc_blocks(s5fs, sn->vnode.vn_vno,
+                                   loc > 0 ? (uint32_t)loc + 1 : 0,
+                                   (uint32_t)count, &start);
+        if (got < 0)
+        {
+            return got;
+        }
+        sn->resv.s5e_block = (uint32_t)b;
+        sn->resv.s5e_start = start;
+        sn->resv.s5e_len = (uint32_t)got;
+        s5_lock_super(s5fs);
+        s5fs->s5f_nreserved += got;
+        s5_unlock_super(s5fs);
+        for (long i = 0; !ret && i < got; i++, b++)
+        {
+            if ((loc = s5_file_block_map(sn, b, 1, &new, NULL)) < 0)
+            {
+                ret = loc;
+            }
+            else if (b * S5_BLOCK_SIZE < sn->vnode.vn_len)
+            {
+                s5_cache_zero_block(sn, b, loc);
+            }
+        }
+        s5_lock_super(s5fs);
+        s5fs->s5f_nreserved -= got - sn->resv.s5e_len;
+        s5_unlock_super(s5fs);
+        s5_unreserve_blocks(sn);
+    }
+    return ret;
+}
+
+/*
+ * Before sn grows from oldlen to newlen bytes, caches zeroed, dirty pages
+ * for the preallocated blocks it grows over, so that they are neither read
+ * from the disk nor left to show what the disk held there. The vnode must
+ * be locked.
+ */
+void s5_clear_unwritten(s5_node_t *sn, size_t oldlen, size_t newlen)
+{
+    size_t end = S5_DATA_BLOCK(newlen + S5_BLOCK_SIZE - 1);
+    size_t b = S5_DATA_BLOCK(oldlen + S5_BLOCK_SIZE - 1);
+    while (b < end)
+    {
+        int new;
+        size_t run;
+        long loc = s5_file_block_map(sn, b, 0, &new, &run);
+        if (loc <= 0)
+        {
+            b++;
+            continue;
+        }
+        for (size_t i = 0; i < run && b < end; i++, b++)
+        {
+            s5_cache_zero_block(sn, b, loc + (long)i);
+        }
+    }
+}
+
+/* Write to a file.
+ *
+ *  sn  - The s5_node representing the file to write to
+ *  pos - The position to start writing to
+ *  buf - The buffer to write from
+ *  len - The number of bytes to write
+ *
+ * Return the number of bytes written, or:
+ *  - EFBIG: pos was beyond S5_MAX_FILE_SIZE
+ *  - Propagate errors from s5_get_file_block (that is, do not return a partial
+ *    write) Thus, only return the number of bytes that were actually written if 
+ *    the function doesn't fail. For example, if 10k bytes were requested, 
+ *    but you only wrote 5k, only return 5k
+ *
+ * Hints:
+ *  - You should return -EFBIG only if the provided pos was invalid. Otherwise,
+ *    it is okay to make a partial write up to the maximum file size.
+ *  - Use s5_get_file_block and s5_release_file_block to obtain pframes with
+ *    the desired blocks.
+ *  - Because s5_get_file_block calls s5fs_get_pframe, which checks the length
+ *    of the vnode, you may have to update the vnode's length before you call
+ *    s5_get_file_block. In this case, you should also update the inode's
+ *    s5_size and mark the inode dirty.
+ *  - If, midway through writing, you run into an error with s5_get_file_block,
+ *    it is okay to merely undo your most recent changes while leaving behind
+ *    writes you've already made to other blocks, before returning the error.
+ *    That is, it is okay to make a partial write that the caller does not know
+ *    about, as long as the file's length is consistent with what you've
+ *    actually written so far.
+ *  - You should maintain the vn_len of the vnode and the s5_un.s5_size field of the 
+ *    inode to be the same. 
+ */
+ssize_t s5_write_file(s5_node_t *sn, size_t pos, const char *buf, size_t len)
+{
+    // Check if starting position is beyond the maximum file size
+    if (pos >= S5_MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+    
+    // Adjust write length if it would extend beyond the maximum file size
+    size_t actual_len = len;
+    if (pos + len > S5_MAX_FILE_SIZE) {
+        actual_len = S5_MAX_FILE_SIZE - pos;
+    }
+    
+    // Extend the file up front: s5fs_get_pframe refuses pages past vn_len.
+    // The original length is kept for error recovery.
+    size_t original_len = sn->vnode.vn_len;
+    if (pos + actual_len > original_len) {
+        s5_clear_unwritten(sn, original_len, pos + actual_len);
+        sn->vnode.vn_len = pos + actual_len;
+        sn->inode.s5_un.s5_size = pos + actual_len;
+        sn->dirtied_inode = 1;
+    }
+    
+    ssize_t ret = vnode_write_cached(&sn->vnode, pos, buf, actual_len);
+    if (ret < 0 && sn->vnode.vn_len != original_len) {
+        // Restore the original file length and return error
+        sn->vnode.vn_len = original_len;
+        sn->inode.s5_un.s5_size = original_len;
+        sn->dirtied_inode = 1;
+    }
+    return ret;
+}
+
+/*
+ * Returns the byte of the free block bitmap that holds the bit of disk block
+ * blockno. *pfp is the bitmap block the last byte came from, or NULL; it is
+ * swapped for the right one if blockno's bit is in another, or if forwrite
+ * is set and it is not dirty: a block is only dirtied as it is looked up,
+ * with its object locked. The caller releases the last one. The group of
+ * blockno must be locked.
+ */
+static uint8_t *s5_bitmap_byte(s5fs_t *s5fs, uint32_t blockno, long forwrite,
+                               pframe_t **pfp)
+{
+    KASSERT(blockno < s5fs->s5f_super.s5s_num_blocks);
+    KASSERT(kmutex_owns_mutex(&s5_block_group(s5fs, blockno)->sg_mutex));
+    uint64_t bitmap_block = S5_BITMAP_BLOCK(&s5fs->s5f_super, blockno);
+    if (*pfp && ((*pfp)->pf_pagenum != bitmap_block ||
+                 (forwrite && !(*pfp)->pf_dirty)))
+    {
+        s5_release_disk_block(pfp);
+    }
+    if (!*pfp)
+    {
+        s5_get_meta_disk_block(s5fs, bitmap_block, forwrite, pfp);
+    }
+    return (uint8_t *)(*pfp)->pf_addr + S5_BITMAP_BYTE(blockno);
+}
+
+/*
+ * Marks the len disk blocks from start, which are in one group, as in use if
+ * used is set, and as free otherwise, and updates the counts of free blocks.
+ * They must all be free, or all in use, beforehand. The group must be
+ * locked.
+ */
+static void s5_bitmap_mark(s5fs_t *s5fs, uint32_t start, uint32_t len,
+                           long used)
+{
+    s5_group_t *group = s5_block_group(s5fs, start);
+    KASSERT(group == s5_block_group(s5fs, start + len - 1));
+    pframe_t *pf = NULL;
+    for (uint32_t b = start; b < start + len; b++)
+    {
+        uint8_t *byte = s5_bitmap_byte(s5fs, b, 1, &pf);
+        if (b % 8 == 0 && b + 8 <= start + len)
+        {
+            // a whole byte at once
+            KASSERT(*byte == (used ? 0 : 0xff));
+            *byte = used ? 0xff : 0;
+            b += 7;
+            continue;
+        }
+        KASSERT(used ? !(*byte & S5_BITMAP_MASK(b))
+                     : (*byte & S5_BITMAP_MASK(b)));
+        *byte ^= S5_BITMAP_MASK(b);
+    }
+    if (pf)
+    {
+        s5_release_disk_block(&pf);
+    }
+    if (used)
+    {
+        group->sg_nfree -= len;
+        __sync_fetch_and_sub(&s5fs->s5f_super.s5s_nfree, len);
+    }
+    else
+    {
+        group->sg_nfree += len;
+        __sync_fetch_and_add(&s5fs->s5f_super.s5s_nfree, len);
+    }
+}
+
+/* Marks the len disk blocks from start, which are in use, as free, taking
+ * the lock of each group they are in in turn. */
+static void s5_bitmap_free(s5fs_t *s5fs, uint32_t start, uint32_t len)
+{
+    while (len)
+    {
+        s5_group_t *group = s5_block_group(s5fs, start);
+        uint32_t n = MIN(len, S5_GROUP_BLOCKS - start % S5_GROUP_BLOCKS);
+        kmutex_lock(&group->sg_mutex);
+        s5_bitmap_mark(s5fs, start, n, 0);
+        kmutex_unlock(&group->sg_mutex);
+        start += n;
+        len -= n;
+    }
+}
+
+/*
+ * Searches the data blocks of group g, from from to the end of the group and
+ * then from its start, for the first run of want free blocks, or failing
+ * that the longest; a run at goal, if goal is free, is taken however short
+ * it is. Marks the run in use and returns its length, with *startp set to
+ * its first block, or returns 0 if the group is full. The group must be
+ * locked.
+ */
+static uint32_t s5_group_alloc(s5fs_t *s5fs, uint32_t g, uint32_t from,
+                               uint32_t goal, uint32_t want, uint32_t *startp)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    s5_group_t *group = &s5fs->s5f_groups[g];
+    uint32_t first = MAX(g * S5_GROUP_BLOCKS,
+                         s->s5s_bitmap_block + s->s5s_bitmap_nblocks);
+    uint32_t end = MIN((g + 1) * S5_GROUP_BLOCKS, s->s5s_num_blocks);
+    if (first >= end)
+    {
+        return 0;
+    }
+    uint32_t ndata = end - first;
+    if (from < first || from >= end)
+    {
+        from = first;
+    }
+
+    uint32_t best = 0, best_len = 0, run = 0, run_len = 0;
+    pframe_t *pf = NULL;
+    for (uint32_t i = 0; group->sg_nfree && i < ndata && best_len < want; i++)
+    {
+        uint32_t b = first + (from - first + i) % ndata;
+        if (b == first)
+        {
+            run_len = 0; // runs do not wrap around the end of the group
+        }
+        uint8_t *byte = s5_bitmap_byte(s5fs, b, 0, &pf);
+        if (*byte & S5_BITMAP_MASK(b))
+        {
+            run_len = 0;
+            if (best_len && best == goal)
+            {
+                break;
+            }
+            if (b % 8 == 0 && *byte == 0xff && b + 8 <= end)
+            {
+                i += 7; // skip the rest of a byte that is all in use
+            }
+            continue;
+        }
+        if (!run_len++)
+        {
+            run = b;
+        }
+        if (run_len > best_len)
+        {
+            best = run;
+            best_len = run_len;
+        }
+    }
+    if (pf)
+    {
+        s5_release_disk_block(&pf);
+    }
+    if (best_len)
+    {
+        s5_bitmap_mark(s5fs, best, best_len, 1);
+        group->sg_alloc_next = best + best_len;
+        *startp = best;
+    }
+    return best_len;
+}
+
+/*
+ * Allocate up to want consecutive blocks from the filesystem, for inode ino.
+ *
+ * If goal is a free data block, the run starts there, however short it is:
+ * that is what keeps a file that grows a block at a time in one extent.
+ * Otherwise goal's group is searched from goal, or, if goal is 0, ino's
+ * group from where its last allocation ended, for the first run of want
+ * free blocks, or failing that the longest (see s5_group_alloc). A group
+ * that is full is passed over for the groups after it, so runs never span
+ * two groups, and a file keeps near its inode until its group fills up.
+ *
+ * Return the number of blocks allocated, with *startp set to the first, or:
+ *  - ENOSPC: There are no more free blocks
+ */
+static long s5_alloc_blocks(s5fs_t *s5fs, ino_t ino, uint32_t goal,
+                            uint32_t want, uint32_t *startp)
+{
+    KASSERT(want > 0);
+    s5_super_t *s = &s5fs->s5f_super;
+    long at_goal = goal >= s->s5s_bitmap_block + s->s5s_bitmap_nblocks &&
+                   goal < s->s5s_num_blocks;
+    uint32_t g0 = at_goal ? goal / S5_GROUP_BLOCKS : s5_inode_group(s5fs, ino);
+    for (uint32_t i = 0; i < s5fs->s5f_ngroups; i++)
+    {
+        uint32_t g = (g0 + i) % s5fs->s5f_ngroups;
+        s5_group_t *group = &s5fs->s5f_groups[g];
+        if (!group->sg_nfree)
+        {
+            continue;
+        }
+        kmutex_lock(&group->sg_mutex);
+        uint32_t from = at_goal && !i ? goal : group->sg_alloc_next;
+        uint32_t got = s5_group_alloc(s5fs, g, from, at_goal && !i ? goal : 0,
+                                      want, startp);
+        kmutex_unlock(&group->sg_mutex);
+        if (got)
+        {
+            dbg(DBG_S5FS, "allocated disk blocks %u-%u\n", *startp,
+                *startp + got - 1);
+            return got;
+        }
+    }
+    return -ENOSPC;
+}
+
+/*
+ * Allocate one block from the filesystem for inode ino, at goal if it is
+ * free, see s5_alloc_blocks.
+ *
+ * Return the block number of the newly allocated block, or:
+ *  - ENOSPC: There are no more free blocks
+ */
+static long s5_alloc_block(s5fs_t *s5fs, ino_t ino, uint32_t goal)
+{
+    uint32_t block;
+    long ret = s5_alloc_blocks(s5fs, ino, goal, 1, &block);
+    return ret < 0 ? ret : block;
+}
+
+/*
+ * Records that the len blocks from start are free as of the next commit, in
+ * s5f_jfree. Returns 0 if there is no room for that, and the blocks must be
+ * freed right away. The super block must be locked.
+ */
+static long s5_defer_free_blocks(s5fs_t *s5fs, uint32_t start, uint32_t len)
+{
+    KASSERT(kmutex_owns_mutex(&s5fs->s5f_mutex));
+    s5_extent_t *last =
+        s5fs->s5f_jnfree ? &s5fs->s5f_jfree[s5fs->s5f_jnfree - 1] : NULL;
+    if (last && last->s5e_start + last->s5e_len == start)
+    {
+        last->s5e_len += len;
+        return 1;
+    }
+    if (s5fs->s5f_jnfree == s5fs->s5f_jfree_size)
+    {
+        size_t size = s5fs->s5f_jfree_size ? 2 * s5fs->s5f_jfree_size : 16;
+        s5_extent_t *jfree = kmalloc(size * sizeof(s5_extent_t));
+        if (!jfree)
+        {
+            return 0;
+        }
+        if (s5fs->s5f_jfree)
+        {
+            memcpy(jfree, s5fs->s5f_jfree,
+                   s5fs->s5f_jnfree * sizeof(s5_extent_t));
+            kfree(s5fs->s5f_jfree);
+        }
+        s5fs->s5f_jfree = jfree;
+        s5fs->s5f_jfree_size = size;
+    }
+    s5_extent_t *ext = &s5fs->s5f_jfree[s5fs->s5f_jnfree++];
+    ext->s5e_block = 0;
+    ext->s5e_start = start;
+    ext->s5e_len = len;
+    return 1;
+}
+
+/*
+ * Blocks to be freed, gathered into runs of consecutive blocks so that
+ * freeing a whole file takes s5f_mobj's lock and the super block lock once
+ * for every S5_FREE_BATCH runs, and a group's lock once for each run,
+ * rather than once for each block.
+ */
+#define S5_FREE_BATCH 32
+
+typedef struct s5_free_batch
+{
+    size_t fb_nruns;
+    s5_extent_t fb_runs[S5_FREE_BATCH]; /* s5e_start and s5e_len are used */
+} s5_free_batch_t;
+
+/*
+ * The exact opposite of s5_alloc_blocks: mark the blocks of batch's runs as
+ * free, and empty it. Whatever they were cached as has already been dropped
+ * (see s5_remove_blocks), except for metadata blocks, whose copies go here:
+ * a disk block is cached in one place at a time, and the next owner caches
+ * it afresh.
+ *
+ * With a journal the bits are only cleared by the next commit, see
+ * s5_release_freed_blocks: until the blocks that pointed at them are
+ * committed, they must not be handed out again and written as file data.
+ */
+static void s5_free_batch_flush(s5fs_t *s5fs, s5_free_batch_t *batch)
+{
+    if (!batch->fb_nruns)
+    {
+        return;
+    }
+    mobj_lock(&s5fs->s5f_mobj);
+    for (size_t r = 0; r < batch->fb_nruns; r++)
+    {
+        s5_extent_t *run = &batch->fb_runs[r];
+        dbg(DBG_S5FS, "freeing disk blocks %u-%u\n", run->s5e_start,
+            run->s5e_start + run->s5e_len - 1);
+        for (uint32_t i = 0; i < run->s5e_len; i++)
+        {
+            mobj_delete_pframe(&s5fs->s5f_mobj, run->s5e_start + i);
+        }
+    }
+    mobj_unlock(&s5fs->s5f_mobj);
+
+    if (s5_journal_enabled(s5fs))
+    {
+        s5_lock_super(s5fs);
+        for (size_t r = 0; r < batch->fb_nruns; r++)
+        {
+            s5_extent_t *run = &batch->fb_runs[r];
+            if (s5_defer_free_blocks(s5fs, run->s5e_start, run->s5e_len))
+            {
+                run->s5e_len = 0;
+            }
+        }
+        s5_unlock_super(s5fs);
+    }
+    for (size_t r = 0; r < batch->fb_nruns; r++)
+    {
+        s5_extent_t *run = &batch->fb_runs[r];
+        if (run->s5e_len)
+        {
+            s5_bitmap_free(s5fs, run->s5e_start, run->s5e_len);
+        }
+    }
+    batch->fb_nruns = 0;
+}
+
+/* Adds the len blocks from start to batch, freeing what it has first if it
+ * is full. */
+static void s5_free_batch_add(s5fs_t *s5fs, s5_free_batch_t *batch,
+                              blocknum_t start, size_t len)
+{
+    KASSERT(start);
+    s5_extent_t *last =
+        batch->fb_nruns ? &batch->fb_runs[batch->fb_nruns - 1] : NULL;
+    if (last && last->s5e_start + last->s5e_len == start)
+    {
+        last->s5e_len += (uint32_t)len;
+        return;
+    }
+    if (batch->fb_nruns == S5_FREE_BATCH)
+    {
+        s5_free_batch_flush(s5fs, batch);
+    }
+    last = &batch->fb_runs[batch->fb_nruns++];
+    last->s5e_start = start;
+    last->s5e_len = (uint32_t)len;
+}
+
+/* Frees the len blocks from start, see s5_free_batch_flush. */
+static void s5_free_blocks(s5fs_t *s5fs, blocknum_t start, size_t len)
+{
+    s5_free_batch_t batch = {.fb_nruns = 0};
+    s5_free_batch_add(s5fs, &batch, start, len);
+    s5_free_batch_flush(s5fs, &batch);
+}
+
+/* Frees the blocks s5_free_blocks set aside, for a commit. */
+void s5_release_freed_blocks(s5fs_t *s5fs)
+{
+    s5_lock_super(s5fs);
+    for (size_t i = 0; i < s5fs->s5f_jnfree; i++)
+    {
+        s5_bitmap_free(s5fs, s5fs->s5f_jfree[i].s5e_start,
+                       s5fs->s5f_jfree[i].s5e_len);
+    }
+    s5fs->s5f_jnfree = 0;
+    s5_unlock_super(s5fs);
+}
+
+static void s5_free_block(s5fs_t *s5fs, blocknum_t blockno)
+{
+    s5_free_blocks(s5fs, blockno, 1);
+}
+
+/*
+ * Finds a free inode of group g, starting with the inodes of near's block if
+ * near is in the group, and going on in order from there, wrapping around
+ * to the group's first inode, and marks it in use in the inode bitmap.
+ * Returns it, or -1 if there is none. The group must be locked.
+ */
+static uint32_t s5_ibitmap_alloc(s5fs_t *s5fs, uint32_t g, ino_t near)
+{
+    s5_group_t *group = &s5fs->s5f_groups[g];
+    KASSERT(kmutex_owns_mutex(&group->sg_mutex));
+    if (!group->sg_nfree_inodes)
+    {
+        return (uint32_t)-1;
+    }
+    s5_super_t *s = &s5fs->s5f_super;
+    uint32_t first = g * s5fs->s5f_group_inodes;
+    uint32_t n = MIN(s5fs->s5f_group_inodes, s->s5s_num_inodes - first);
+    uint32_t from = s5_inode_group(s5fs, near) == g ? (uint32_t)near - first
+                                                    : 0;
+    from -= from % S5_INODES_PER_BLOCK;
+
+    pframe_t *pf = NULL;
+    uint32_t found = (uint32_t)-1;
+    for (uint32_t i = 0; i < n;)
+    {
+        uint32_t ino = first + (from + i) % n;
+        uint64_t block = S5_IBITMAP_BLOCK(s, ino);
+        if (pf && pf->pf_pagenum != block)
+        {
+            s5_release_disk_block(&pf);
+        }
+        if (!pf)
+        {
+            s5_get_meta_disk_block(s5fs, block, 0, &pf);
+        }
+        uint8_t byte = ((uint8_t *)pf->pf_addr)[S5_BITMAP_BYTE(ino)];
+        if (byte == 0xff && ino % 8 == 0 && ino + 8 <= first + n)
+        {
+            i += 8; /* a whole byte in use */
+            continue;
+        }
+        if (!(byte & S5_BITMAP_MASK(ino)))
+        {
+            found = ino;
+            break;
+        }
+        i++;
+    }
+    KASSERT(found != (uint32_t)-1 && "sg_nfree_inodes is off");
+    if (!pf->pf_dirty)
+    {
+        // Dirtied as it is looked up, see s5_bitmap_byte
+        s5_release_disk_block(&pf);
+        s5_get_meta_disk_block(s5fs, S5_IBITMAP_BLOCK(s, found), 1, &pf);
+    }
+    ((uint8_t *)pf->pf_addr)[S5_BITMAP_BYTE(found)] |= S5_BITMAP_MASK(found);
+    s5_release_disk_block(&pf);
+    group->sg_nfree_inodes--;
+    __sync_fetch_and_sub(&s->s5s_nfree_inodes, 1);
+    return found;
+}
+
+/* Marks inode ino, which is in use, as free in the inode bitmap. Its group
+ * must be locked. */
+static void s5_ibitmap_free(s5fs_t *s5fs, ino_t ino)
+{
+    s5_group_t *group = &s5fs->s5f_groups[s5_inode_group(s5fs, ino)];
+    KASSERT(kmutex_owns_mutex(&group->sg_mutex));
+    s5_super_t *s = &s5fs->s5f_super;
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, S5_IBITMAP_BLOCK(s, ino), 1, &pf);
+    uint8_t *byte = (uint8_t *)pf->pf_addr + S5_BITMAP_BYTE(ino);
+    KASSERT(*byte & S5_BITMAP_MASK(ino));
+    *byte &= ~S5_BITMAP_MASK(ino);
+    s5_release_disk_block(&pf);
+    group->sg_nfree_inodes++;
+    __sync_fetch_and_add(&s->s5s_nfree_inodes, 1);
+}
+
+/*
+ * Returns how many of the bits from first to end of the bitmap that starts
+ * at disk block bitmap are clear.
+ */
+static uint32_t s5_count_clear_bits(s5fs_t *s5fs, uint32_t bitmap,
+                                    uint32_t first, uint32_t end)
+{
+    pframe_t *pf = NULL;
+    uint32_t n = 0;
+    for (uint32_t bit = first; bit < end; bit++)
+    {
+        uint64_t block = bitmap + bit / S5_BITS_PER_BLOCK;
+        if (pf && pf->pf_pagenum != block)
+        {
+            s5_release_disk_block(&pf);
+        }
+        if (!pf)
+        {
+            s5_get_meta_disk_block(s5fs, block, 0, &pf);
+        }
+        uint8_t byte = ((uint8_t *)pf->pf_addr)[S5_BITMAP_BYTE(bit)];
+        n += !(byte & S5_BITMAP_MASK(bit));
+    }
+    if (pf)
+    {
+        s5_release_disk_block(&pf);
+    }
+    return n;
+}
+
+/*
+ * Sets up s5fs's allocation groups, see s5_group_t, counting their free
+ * blocks and inodes in the bitmaps. There are as many groups of inodes as
+ * of blocks, so the inodes are divided evenly, a block of them at a time.
+ *
+ * Returns 0, or:
+ *  - ENOMEM: there is no memory for the groups
+ */
+long s5_groups_init(s5fs_t *s5fs)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    uint32_t n = (s->s5s_num_blocks + S5_GROUP_BLOCKS - 1) / S5_GROUP_BLOCKS;
+    s5_group_t *groups = kmalloc(n * sizeof(s5_group_t));
+    if (!groups)
+    {
+        return -ENOMEM;
+    }
+    uint32_t per = (s->s5s_num_inodes + n - 1) / n;
+    per = (uint32_t)((per + S5_INODES_PER_BLOCK - 1) / S5_INODES_PER_BLOCK *
+                     S5_INODES_PER_BLOCK);
+
+    s5fs->s5f_groups = groups;
+    s5fs->s5f_ngroups = n;
+    s5fs->s5f_group_inodes = per;
+    for (uint32_t g = 0; g < n; g++)
+    {
+        s5_group_t *group = &groups[g];
+        kmutex_init(&group->sg_mutex);
+        group->sg_nfree = s5_count_clear_bits(
+            s5fs, s->s5s_bitmap_block, g * S5_GROUP_BLOCKS,
+            MIN((g + 1) * S5_GROUP_BLOCKS, s->s5s_num_blocks));
+        group->sg_nfree_inodes = s5_count_clear_bits(
+            s5fs, s->s5s_ibitmap_block, MIN(g * per, s->s5s_num_inodes),
+            MIN((g + 1) * per, s->s5s_num_inodes));
+        group->sg_alloc_next = 0;
+    }
+    return 0;
+}
+
+/* Frees what s5_groups_init set up. */
+void s5_groups_destroy(s5fs_t *s5fs)
+{
+    kfree(s5fs->s5f_groups);
+    s5fs->s5f_groups = NULL;
+}
+
+/*
+ * Checks the inode bitmap against the inodes, an inode being free if its
+ * type is S5_TYPE_FREE, and s5s_nfree_inodes against the inodes, for
+ * s5fs_fsck. If repair is set, the bitmap and the counts, the groups'
+ * included, are made to agree with the inodes; the caller then holds a
+ * journal handle. The inode blocks are read S5_INODE_RA_BLOCKS at a time.
+ * Every group is locked throughout, so the inodes are not changing as they
+ * are checked.
+ *
+ * Returns the number of problems found.
+ */
+long s5_fsck_inodes(s5fs_t *s5fs, long repair)
+{
+    s5_super_t *s = &s5fs->s5f_super;
+    uint32_t n = s->s5s_num_inodes;
+    uint32_t nblocks = (n + S5_INODES_PER_BLOCK - 1) / S5_INODES_PER_BLOCK;
+    uint32_t nfree = 0, gfree = 0;
+    long problems = 0;
+    for (uint32_t g = 0; g < s5fs->s5f_ngroups; g++)
+    {
+        kmutex_lock(&s5fs->s5f_groups[g].sg_mutex);
+    }
+    for (uint32_t b = 0; b < nblocks; b++)
+    {
+        if (b % S5_INODE_RA_BLOCKS == 0)
+        {
+            s5_readahead_meta_blocks(s5fs, S5_INODE_BLOCK(b * S5_INODES_PER_BLOCK),
+                                     MIN(S5_INODE_RA_BLOCKS, nblocks - b));
+        }
+        uint16_t types[S5_INODES_PER_BLOCK];
+        pframe_t *pf;
+        s5_get_meta_disk_block(s5fs, S5_INODE_BLOCK(b * S5_INODES_PER_BLOCK), 0,
+                               &pf);
+        for (uint32_t i = 0; i < S5_INODES_PER_BLOCK; i++)
+        {
+            types[i] = ((s5_inode_t *)pf->pf_addr)[i].s5_type;
+        }
+        s5_release_disk_block(&pf);
+
+        for (uint32_t i = 0; i < S5_INODES_PER_BLOCK; i++)
+        {
+            uint32_t ino = b * (uint32_t)S5_INODES_PER_BLOCK + i;
+            if (ino >= n)
+            {
+                break;
+            }
+            long used = types[i] != S5_TYPE_FREE;
+            nfree += !used;
+            gfree += !used;
+            if ((ino + 1) % s5fs->s5f_group_inodes == 0 || ino + 1 == n)
+            {
+                if (repair)
+                {
+                    s5fs->s5f_groups[s5_inode_group(s5fs, ino)]
+                        .sg_nfree_inodes = gfree;
+                }
+                gfree = 0;
+            }
+            s5_get_meta_disk_block(s5fs, S5_IBITMAP_BLOCK(s, ino), 0, &pf);
+            uint8_t *byte = (uint8_t *)pf->pf_addr + S5_BITMAP_BYTE(ino);
+            long marked = (*byte & S5_BITMAP_MASK(ino)) != 0;
+            s5_release_disk_block(&pf);
+            if (used == marked)
+            {
+                continue;
+            }
+            dbg(DBG_PRINT, "   Inode %u is %s, but marked %s\n", ino,
+                used ? "in use" : "free", marked ? "in use" : "free");
+            problems++;
+            if (repair)
+            {
+                s5_get_meta_disk_block(s5fs, S5_IBITMAP_BLOCK(s, ino), 1, &pf);
+                byte = (uint8_t *)pf->pf_addr + S5_BITMAP_BYTE(ino);
+                *byte ^= S5_BITMAP_MASK(ino);
+                s5_release_disk_block(&pf);
+            }
+        }
+        cond_resched();
+    }
+    if (nfree != s->s5s_nfree_inodes)
+    {
+        dbg(DBG_PRINT, "   %u inodes are free, the super block says %u\n",
+            nfree, s->s5s_nfree_inodes);
+        problems++;
+        if (repair)
+        {
+            s->s5s_nfree_inodes = nfree;
+        }
+    }
+    for (uint32_t g = s5fs->s5f_ngroups; g > 0; g--)
+    {
+        kmutex_unlock(&s5fs->s5f_groups[g - 1].sg_mutex);
+    }
+    return problems;
+}
+
+/*
+ * Returns the group for a new directory in directory parent: of the groups
+ * with at least the average number of free blocks, the one with the most
+ * free inodes, or parent's group if that has as many. The counts are read
+ * without the groups' locks, as a hint.
+ */
+static uint32_t s5_dir_group(s5fs_t *s5fs, ino_t parent)
+{
+    uint32_t avg = s5fs->s5f_super.s5s_nfree / s5fs->s5f_ngroups;
+    uint32_t best = s5_inode_group(s5fs, parent);
+    for (uint32_t g = 0; g < s5fs->s5f_ngroups; g++)
+    {
+        s5_group_t *group = &s5fs->s5f_groups[g];
+        if (group->sg_nfree >= avg &&
+            group->sg_nfree_inodes > s5fs->s5f_groups[best].sg_nfree_inodes)
+        {
+            best = g;
+        }
+    }
+    return best;
+}
+
+/*
+ * Allocate one inode from the filesystem, from the inode bitmap, and
+ * initialize its on-disk contents according to the arguments type and devid.
  *
- * You should use s5_get_inode and s5_release_inode.
+ * near is the inode the new one is to be close to, the directory it is
+ * created in: inodes are taken from near's inode block first, then from the
+ * blocks after it, so that the inodes of a directory tend to share blocks,
+ * and listing it with stat reads few of them (see s5fs_prefetch_inodes).
+ * They come from near's group, or the groups after it once that is full,
+ * and the file's blocks then follow (see s5_alloc_blocks). A directory is
+ * instead put in the group chosen by s5_dir_group, so that directories,
+ * and the files created in them, spread over the groups.
  *
  * On success, return the newly allocated inode number.
  * On failure, return -ENOSPC.
  */
-long s5_alloc_inode(s5fs_t *s5fs, uint16_t type, devid_t devid)
+long s5_alloc_inode(s5fs_t *s5fs, ino_t near, uint16_t type, devid_t devid)
 {
     KASSERT((S5_TYPE_DATA == type) || (S5_TYPE_DIR == type) ||
             (S5_TYPE_CHR == type) || (S5_TYPE_BLK == type));
 
-    s5_lock_super(s5fs);
-    uint32_t new_ino = s5fs->s5f_super.s5s_free_inode;
+    uint32_t g0 = type == S5_TYPE_DIR ? s5_dir_group(s5fs, near)
+                                      : s5_inode_group(s5fs, near);
+    s5_group_t *group = NULL;
+    uint32_t new_ino = (uint32_t)-1;
+    for (uint32_t i = 0; new_ino == (uint32_t)-1 && i < s5fs->s5f_ngroups;
+         i++)
+    {
+        uint32_t g = (g0 + i) % s5fs->s5f_ngroups;
+        group = &s5fs->s5f_groups[g];
+        if (!group->sg_nfree_inodes)
+        {
+            continue;
+        }
+        kmutex_lock(&group->sg_mutex);
+        if ((new_ino = s5_ibitmap_alloc(s5fs, g, near)) == (uint32_t)-1)
+        {
+            kmutex_unlock(&group->sg_mutex);
+        }
+    }
     if (new_ino == (uint32_t)-1)
     {
-        s5_unlock_super(s5fs);
         return -ENOSPC;
     }
 
     pframe_t *pf;
     s5_inode_t *inode;
     s5_get_inode(s5fs, new_ino, 1, &pf, &inode);
-
-    s5fs->s5f_super.s5s_free_inode = inode->s5_un.s5_next_free;
-    KASSERT(inode->s5_un.s5_next_free != inode->s5_number);
+    KASSERT(inode->s5_type == S5_TYPE_FREE);
 
     inode->s5_un.s5_size = 0;
     inode->s5_type = type;
     inode->s5_linkcount = 0;
-    memset(inode->s5_direct_blocks, 0, sizeof(inode->s5_direct_blocks));
+    memset(inode->s5_extents, 0, sizeof(inode->s5_extents));
     inode->s5_indirect_block =
         (S5_TYPE_CHR == type || S5_TYPE_BLK == type) ? devid : 0;
+    inode->s5_dindirect_block = 0;
+    inode->s5_flags = 0;
+    memset(inode->s5_inline, 0, sizeof(inode->s5_inline));
 
     s5_release_inode(&pf, &inode);
-    s5_unlock_super(s5fs);
+    kmutex_unlock(&group->sg_mutex);
 
     dbg(DBG_S5FS, "allocated inode %d\n", new_ino);
     return new_ino;
 }
 
+/*
+ * Adds indirect block indirect and the blocks it lists, which are file
+ * blocks from base on, to batch. If o is not NULL their pages are dropped
+ * from it first: once freed, a block may be cached again by its next owner.
+ */
+static void s5_free_indirect(s5fs_t *s5fs, s5_free_batch_t *batch,
+                             uint32_t indirect, size_t base, mobj_t *o)
+{
+    uint32_t blocks[S5_NIDIRECT_BLOCKS];
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, indirect, 0, &pf);
+    KASSERT(S5_BLOCK_SIZE == PAGE_SIZE);
+    memcpy(blocks, pf->pf_addr, S5_BLOCK_SIZE);
+    s5_release_disk_block(&pf);
+
+    for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+    {
+        if (blocks[i])
+        {
+            if (o)
+            {
+                mobj_delete_pframe(o, base + i);
+            }
+            s5_free_batch_add(s5fs, batch, blocks[i], 1);
+        }
+    }
+    s5_free_batch_add(s5fs, batch, indirect, 1);
+}
+
+/*
+ * Frees every block of a file whose map (see s5_inode_t) is given by
+ * extents, indirect and dindirect, dropping its pages from o first if o is
+ * not NULL.
+ */
+static void s5_free_file_blocks(s5fs_t *s5fs, const s5_extent_t *extents,
+                                uint32_t indirect, uint32_t dindirect,
+                                mobj_t *o)
+{
+    s5_free_batch_t batch = {.fb_nruns = 0};
+    for (unsigned i = 0; i < S5_NEXTENTS; i++)
+    {
+        for (uint32_t j = 0; o && j < extents[i].s5e_len; j++)
+        {
+            mobj_delete_pframe(o, extents[i].s5e_block + j);
+        }
+        if (extents[i].s5e_len)
+        {
+            s5_free_batch_add(s5fs, &batch, extents[i].s5e_start,
+                              extents[i].s5e_len);
+        }
+        cond_resched();
+    }
+    if (indirect)
+    {
+        s5_free_indirect(s5fs, &batch, indirect, 0, o);
+    }
+    if (dindirect)
+    {
+        for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+        {
+            // Read an entry at a time, the block stays cached throughout
+            pframe_t *pf;
+            s5_get_meta_disk_block(s5fs, dindirect, 0, &pf);
+            uint32_t block = ((uint32_t *)pf->pf_addr)[i];
+            s5_release_disk_block(&pf);
+            if (block)
+            {
+                s5_free_indirect(s5fs, &batch, block,
+                                 S5_NIDIRECT_BLOCKS * (i + 1), o);
+            }
+            cond_resched();
+        }
+        s5_free_batch_add(s5fs, &batch, dindirect, 1);
+    }
+    s5_free_batch_flush(s5fs, &batch);
+}
+
 /*
  * Free the inode by:
- *  1) adding the inode to the free inode linked list (opposite of
- * s5_alloc_inode), and 2) freeing all blocks being used by the inode.
+ *  1) clearing its bit in the inode bitmap (opposite of s5_alloc_inode),
+ *     and 2) freeing all blocks being used by the inode.
  *
  * The suggested order of operations to avoid deadlock, is:
- *  1) lock the super block
+ *  1) lock the inode's group
  *  2) get the inode to be freed
- *  3) update the free inode linked list
- *  4) copy the blocks to be freed from the inode onto the stack
+ *  3) update the inode bitmap
+ *  4) copy the block map of the inode onto the stack
  *  5) release the inode
- *  6) unlock the super block
- *  7) free all direct blocks
- *  8) get the indirect block
- *  9) copy the indirect block array onto the stack
- *  10) release the indirect block
- *  11) free the indirect blocks
- *  12) free the indirect block itself
+ *  6) unlock the group
+ *  7) free the blocks of the extents, then those the indirect blocks list,
+ *     and the indirect blocks themselves
  */
 void s5_free_inode(s5fs_t *s5fs, ino_t ino)
 {
     pframe_t *pf;
     s5_inode_t *inode;
-    s5_lock_super(s5fs);
+    s5_group_t *group = &s5fs->s5f_groups[s5_inode_group(s5fs, ino)];
+    kmutex_lock(&group->sg_mutex);
     s5_get_inode(s5fs, ino, 1, &pf, &inode);
 
-    uint32_t direct_blocks_to_free[S5_NDIRECT_BLOCKS];
+    s5_extent_t extents_to_free[S5_NEXTENTS];
     uint32_t indirect_block_to_free;
+    uint32_t dindirect_block_to_free;
     if (inode->s5_type == S5_TYPE_DATA || inode->s5_type == S5_TYPE_DIR)
     {
         indirect_block_to_free = inode->s5_indirect_block;
-        memcpy(direct_blocks_to_free, inode->s5_direct_blocks,
-               sizeof(direct_blocks_to_free));
+        dindirect_block_to_free = inode->s5_dindirect_block;
+        memcpy(extents_to_free, inode->s5_extents, sizeof(extents_to_free));
     }
     else
     {
         KASSERT(inode->s5_type == S5_TYPE_BLK || inode->s5_type == S5_TYPE_CHR);
         indirect_block_to_free = 0;
-        memset(direct_blocks_to_free, 0, sizeof(direct_blocks_to_free));
+        dindirect_block_to_free = 0;
+        memset(extents_to_free, 0, sizeof(extents_to_free));
     }
 
-    inode->s5_un.s5_next_free = s5fs->s5f_super.s5s_free_inode;
+    inode->s5_un.s5_size = 0;
     inode->s5_type = S5_TYPE_FREE;
-    s5fs->s5f_super.s5s_free_inode = inode->s5_number;
 
     s5_release_inode(&pf, &inode);
-    s5_unlock_super(s5fs);
+    s5_ibitmap_free(s5fs, ino);
+    kmutex_unlock(&group->sg_mutex);
+
+    s5_free_file_blocks(s5fs, extents_to_free, indirect_block_to_free,
+                        dindirect_block_to_free, NULL);
+    dbg(DBG_S5FS, "freed inode %d\n", ino);
+}
+
+/*
+ * Maps the block of the directory sn that holds the entry at pos, a multiple
+ * of sizeof(s5_dirent_t), so that its entries can be used in place instead
+ * of being read one s5_read_file at a time. On success *pfp is the block's
+ * pframe, for s5_release_dirents, and *direntsp the entry at pos. The
+ * entries of an inline directory are in its inode: *pfp is then NULL, and
+ * the inode is marked dirty for a write.
+ *
+ * Return the number of entries from pos to the end of the block or of the
+ * directory, whichever comes first (0 at the end, with nothing mapped), or:
+ *  - Propagate errors from s5_get_file_block
+ */
+long s5_get_dirents(s5_node_t *sn, size_t pos, long forwrite, pframe_t **pfp,
+                    s5_dirent_t **direntsp)
+{
+    KASSERT(S_ISDIR(sn->vnode.vn_mode));
+    KASSERT(pos % sizeof(s5_dirent_t) == 0);
+    if (pos >= sn->vnode.vn_len)
+    {
+        return 0;
+    }
+    size_t slot = pos / sizeof(s5_dirent_t);
+    if (sn->inode.s5_flags & S5_INODE_INLINE)
+    {
+        KASSERT(sn->vnode.vn_len <= S5_INLINE_SIZE);
+        *pfp = NULL;
+        *direntsp = (s5_dirent_t *)sn->inode.s5_inline + slot;
+        sn->dirtied_inode |= forwrite;
+        return (long)((sn->vnode.vn_len - pos) / sizeof(s5_dirent_t));
+    }
+    long ret = s5_get_file_block(sn, slot / S5_DIRENTS_PER_BLOCK, forwrite, pfp);
+    if (ret)
+    {
+        return ret;
+    }
+    *direntsp = (s5_dirent_t *)(*pfp)->pf_addr + slot % S5_DIRENTS_PER_BLOCK;
+    return (long)MIN(S5_DIRENTS_PER_BLOCK - slot % S5_DIRENTS_PER_BLOCK,
+                     (sn->vnode.vn_len - pos) / sizeof(s5_dirent_t));
+}
 
-    for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++)
+/* Releases the block mapped by s5_get_dirents. */
+void s5_release_dirents(pframe_t **pfp)
+{
+    if (*pfp)
+    {
+        s5_release_file_block(pfp);
+    }
+}
+
+/*
+ * Moves the entries of the inline directory sn out of its inode into its
+ * first block, which is allocated for them.
+ *
+ * Return 0 on success, or, with the directory still inline:
+ *  - Propagate errors from s5_get_file_block
+ */
+static long s5_uninline_dir(s5_node_t *sn)
+{
+    s5_inode_t *inode = &sn->inode;
+    char saved[S5_INLINE_SIZE];
+    memcpy(saved, inode->s5_inline, sizeof(saved));
+    inode->s5_flags &= ~S5_INODE_INLINE;
+    pframe_t *pf;
+    long ret = s5_get_file_block(sn, 0, 1, &pf);
+    if (ret)
+    {
+        inode->s5_flags |= S5_INODE_INLINE;
+        return ret;
+    }
+    memcpy(pf->pf_addr, saved, sn->vnode.vn_len);
+    s5_release_file_block(&pf);
+    memset(inode->s5_inline, 0, sizeof(inode->s5_inline));
+    sn->dirtied_inode = 1;
+    return 0;
+}
+
+/*
+ * Adds dirent at the end of the directory sn, in place, growing it by a
+ * block if need be. An empty directory, or an inline one, is kept inline
+ * while its entries fit in the inode.
+ *
+ * Return 0 on success, or:
+ *  - Propagate errors from s5_get_dirents
+ */
+long s5_append_dirent(s5_node_t *sn, const s5_dirent_t *dirent)
+{
+    size_t pos = sn->vnode.vn_len;
+    pframe_t *pf;
+    s5_dirent_t *slot;
+    if (!pos)
     {
-        if (direct_blocks_to_free[i])
+        sn->inode.s5_flags |= S5_INODE_INLINE;
+    }
+    else if ((sn->inode.s5_flags & S5_INODE_INLINE) &&
+             pos + sizeof(s5_dirent_t) > S5_INLINE_SIZE)
+    {
+        long ret = s5_uninline_dir(sn);
+        if (ret)
         {
-            s5_free_block(s5fs, direct_blocks_to_free[i]);
+            return ret;
         }
     }
-    if (indirect_block_to_free)
+    // s5fs_get_pframe refuses blocks past vn_len
+    sn->vnode.vn_len += sizeof(s5_dirent_t);
+    long ret = s5_get_dirents(sn, pos, 1, &pf, &slot);
+    if (ret < 0)
+    {
+        sn->vnode.vn_len = pos;
+        return ret;
+    }
+    *slot = *dirent;
+    s5_release_dirents(&pf);
+    sn->inode.s5_un.s5_size = (uint32_t)sn->vnode.vn_len;
+    sn->dirtied_inode = 1;
+    return 0;
+}
+
+/*
+ * Directory index: a directory of more than S5_DIRHASH_MIN entries gets a
+ * hash table, in memory, from the hash of each name to the slot of its entry
+ * (its position over sizeof(s5_dirent_t)), built by the first search and
+ * kept up to date by s5_link and s5_remove_dirent for as long as the vnode
+ * lives. The entries on disk are laid out as they always were, so the table
+ * is only a cache: a directory without one, because it is small or memory
+ * was short, is searched linearly, a block at a time.
+ *
+ * The table is open addressed with linear probing. Its entries hold the
+ * hash as well as the slot plus one, 0 marking an empty entry, so names
+ * are only compared when the hashes match. It is protected by the vnode
+ * lock.
+ */
+#define S5_DIRHASH_MIN S5_DIRENTS_PER_BLOCK
+
+typedef struct s5_dirhash_ent
+{
+    uint32_t de_hash;
+    uint32_t de_slot; /* slot plus one, 0 if the entry is empty */
+} s5_dirhash_ent_t;
+
+typedef struct s5_dirhash
+{
+    size_t dh_size;  /* entries in dh_ents, a power of two */
+    size_t dh_count; /* entries in use, at most half of them */
+    s5_dirhash_ent_t dh_ents[];
+} s5_dirhash_t;
+
+static uint32_t s5_name_hash(const char *name, size_t namelen)
+{
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3UL;
+    }
+    return (uint32_t)(hash >> 32);
+}
+
+/* The length of the name of dirent, which is only terminated if it is
+ * shorter than S5_NAME_LEN. */
+static size_t s5_dirent_namelen(const s5_dirent_t *dirent)
+{
+    size_t len = 0;
+    while (len < S5_NAME_LEN && dirent->s5d_name[len])
+    {
+        len++;
+    }
+    return len;
+}
+
+static long s5_dirent_match(const s5_dirent_t *dirent, const char *name,
+                            size_t namelen)
+{
+    return s5_dirent_namelen(dirent) == namelen &&
+           !strncmp(dirent->s5d_name, name, namelen);
+}
+
+static s5_dirhash_t *s5_dirhash_alloc(size_t size)
+{
+    s5_dirhash_t *dh =
+        kmalloc(sizeof(s5_dirhash_t) + size * sizeof(s5_dirhash_ent_t));
+    if (dh)
     {
-        uint32_t indirect_blocks_to_free[S5_NIDIRECT_BLOCKS];
+        dh->dh_size = size;
+        dh->dh_count = 0;
+        memset(dh->dh_ents, 0, size * sizeof(s5_dirhash_ent_t));
+    }
+    return dh;
+}
 
-        s5_get_meta_disk_block(s5fs, indirect_block_to_free, 0, &pf);
-        KASSERT(S5_BLOCK_SIZE == PAGE_SIZE);
-        memcpy(indirect_blocks_to_free, pf->pf_addr, S5_BLOCK_SIZE);
-        s5_release_disk_block(&pf);
+static void s5_dirhash_add(s5_dirhash_t *dh, uint32_t hash, uint32_t slot)
+{
+    KASSERT(2 * (dh->dh_count + 1) <= dh->dh_size);
+    size_t i = hash & (dh->dh_size - 1);
+    while (dh->dh_ents[i].de_slot)
+    {
+        i = (i + 1) & (dh->dh_size - 1);
+    }
+    dh->dh_ents[i].de_hash = hash;
+    dh->dh_ents[i].de_slot = slot + 1;
+    dh->dh_count++;
+}
 
-        for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+/* Returns the entry of dh for the name with the given hash at slot. */
+static s5_dirhash_ent_t *s5_dirhash_entry(s5_dirhash_t *dh, uint32_t hash,
+                                          uint32_t slot)
+{
+    size_t i = hash & (dh->dh_size - 1);
+    while (dh->dh_ents[i].de_slot != slot + 1 || dh->dh_ents[i].de_hash != hash)
+    {
+        KASSERT(dh->dh_ents[i].de_slot && "directory index is missing a name");
+        i = (i + 1) & (dh->dh_size - 1);
+    }
+    return &dh->dh_ents[i];
+}
+
+/* Removes the entry for the name with the given hash at slot, moving the
+ * ones after it back so that no probe sequence is broken. */
+static void s5_dirhash_remove(s5_dirhash_t *dh, uint32_t hash, uint32_t slot)
+{
+    size_t mask = dh->dh_size - 1;
+    size_t hole = (size_t)(s5_dirhash_entry(dh, hash, slot) - dh->dh_ents);
+    for (size_t i = (hole + 1) & mask; dh->dh_ents[i].de_slot;
+         i = (i + 1) & mask)
+    {
+        // An entry may fill the hole if its home is not between the two
+        size_t home = dh->dh_ents[i].de_hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            dh->dh_ents[hole] = dh->dh_ents[i];
+            hole = i;
+        }
+    }
+    dh->dh_ents[hole].de_slot = 0;
+    dh->dh_count--;
+}
+
+/* Drops the index of sn, if it has one. */
+void s5_dirhash_free(s5_node_t *sn)
+{
+    if (sn->dirhash)
+    {
+        kfree(sn->dirhash);
+        sn->dirhash = NULL;
+    }
+}
+
+/*
+ * Adds the name with the given hash at slot to the index of sn, if it has
+ * one, doubling the table when it is half full. If there is no memory for
+ * that the index is dropped.
+ */
+static void s5_dirhash_insert(s5_node_t *sn, uint32_t hash, uint32_t slot)
+{
+    s5_dirhash_t *dh = sn->dirhash;
+    if (!dh)
+    {
+        return;
+    }
+    if (2 * (dh->dh_count + 1) > dh->dh_size)
+    {
+        s5_dirhash_t *bigger = s5_dirhash_alloc(2 * dh->dh_size);
+        if (!bigger)
+        {
+            s5_dirhash_free(sn);
+            return;
+        }
+        for (size_t i = 0; i < dh->dh_size; i++)
         {
-            if (indirect_blocks_to_free[i])
+            if (dh->dh_ents[i].de_slot)
             {
-                s5_free_block(s5fs, indirect_blocks_to_free[i]);
+                s5_dirhash_add(bigger, dh->dh_ents[i].de_hash,
+                               dh->dh_ents[i].de_slot - 1);
             }
         }
-        s5_free_block(s5fs, indirect_block_to_free);
+        kfree(dh);
+        sn->dirhash = dh = bigger;
     }
-    dbg(DBG_S5FS, "freed inode %d\n", ino);
+    s5_dirhash_add(dh, hash, slot);
+}
+
+/*
+ * Builds the index of sn, a directory with no index, if it is big enough to
+ * need one. The directory is read a block at a time. Failing quietly is
+ * fine: the directory is then searched linearly.
+ */
+static void s5_dirhash_build(s5_node_t *sn)
+{
+    size_t count = sn->vnode.vn_len / sizeof(s5_dirent_t);
+    if (count <= S5_DIRHASH_MIN)
+    {
+        return;
+    }
+    size_t size = 2 * S5_DIRHASH_MIN;
+    while (size < 4 * count)
+    {
+        size *= 2;
+    }
+    s5_dirhash_t *dh = s5_dirhash_alloc(size);
+    if (!dh)
+    {
+        return;
+    }
+    size_t slot = 0;
+    while (slot < count)
+    {
+        pframe_t *pf;
+        s5_dirent_t *dirents;
+        long n = s5_get_dirents(sn, slot * sizeof(s5_dirent_t), 0, &pf,
+                                &dirents);
+        if (n <= 0)
+        {
+            kfree(dh);
+            return;
+        }
+        for (long i = 0; i < n; i++, slot++)
+        {
+            s5_dirhash_add(dh,
+                           s5_name_hash(dirents[i].s5d_name,
+                                        s5_dirent_namelen(&dirents[i])),
+                           (uint32_t)slot);
+        }
+        s5_release_dirents(&pf);
+    }
+    sn->dirhash = dh;
 }
 
 /* Return the inode number corresponding to the directory entry specified by
@@ -688,16 +1966,10 @@ void s5_free_inode(s5fs_t *s5fs, ino_t ino)
  *
  * Return the desired inode number, or:
  *  - ENOENT: Could not find a directory entry with the specified name
+ *  - Propagate errors from s5_get_dirents
  *
- * Hints:
- *  - Use s5_read_file in increments of sizeof(s5_dirent_t) to read successive
- *    directory entries and compare them against name and namelen (check out 
- *    the name_match macro in vfs.h).
- *  - To avoid reading beyond the end of the directory, check if the return 
- *    value of s5_read_file is 0
- *  - You could optimize this function by using s5_get_file_block (rather than
- *    s5_read_file) to ensure you do not read beyond the length of the file,
- *    but doing so is optional.
+ * Large directories are searched through their index (see s5_dirhash_t),
+ * the rest a block at a time.
  */
 long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
                     size_t *filepos)
@@ -705,37 +1977,65 @@ long s5_find_dirent(s5_node_t *sn, const char *name, size_t namelen,
     KASSERT(S_ISDIR(sn->vnode.vn_mode) && "should be handled at the VFS level");
     KASSERT(S5_BLOCK_SIZE == PAGE_SIZE && "be wary, thee");
     
-    size_t pos = 0;
-    s5_dirent_t dirent;
-    
-    // Read directory entries
-    while (pos < sn->vnode.vn_len) {
-        ssize_t bytes_read = s5_read_file(sn, pos, (char *)&dirent, sizeof(s5_dirent_t));
-        
-        // Check if we reached end of directory
-        if (bytes_read == 0) {
-            break;
-        }
-        
-        if (bytes_read < 0) {
-            return bytes_read;
+    pframe_t *pf;
+    s5_dirent_t *dirents;
+    if (!sn->dirhash)
+    {
+        s5_dirhash_build(sn);
+    }
+    s5_dirhash_t *dh = sn->dirhash;
+    if (dh)
+    {
+        uint32_t hash = s5_name_hash(name, namelen);
+        for (size_t i = hash & (dh->dh_size - 1); dh->dh_ents[i].de_slot;
+             i = (i + 1) & (dh->dh_size - 1))
+        {
+            if (dh->dh_ents[i].de_hash != hash)
+            {
+                continue;
+            }
+            size_t pos = (dh->dh_ents[i].de_slot - 1) * sizeof(s5_dirent_t);
+            long ret = s5_get_dirents(sn, pos, 0, &pf, &dirents);
+            if (ret < 0)
+            {
+                return ret;
+            }
+            KASSERT(ret > 0);
+            long ino = s5_dirent_match(dirents, name, namelen)
+                           ? (long)dirents->s5d_inode
+                           : -ENOENT;
+            s5_release_dirents(&pf);
+            if (ino >= 0)
+            {
+                if (filepos != NULL) {
+                    *filepos = pos;
+                }
+                return ino;
+            }
         }
-        
-        // Check if we read a complete directory entry
-        if (bytes_read != sizeof(s5_dirent_t)) {
-            break;
+        return -ENOENT;
+    }
+
+    for (size_t pos = 0; pos < sn->vnode.vn_len;)
+    {
+        long n = s5_get_dirents(sn, pos, 0, &pf, &dirents);
+        if (n < 0)
+        {
+            return n;
         }
-        
-        // Compare the directory entry name with the target name
-        if (name_match(dirent.s5d_name, name, namelen)) {
-            if (filepos != NULL) {
-                *filepos = pos;
+        for (long i = 0; i < n; i++, pos += sizeof(s5_dirent_t))
+        {
+            if (s5_dirent_match(&dirents[i], name, namelen))
+            {
+                long ino = dirents[i].s5d_inode;
+                s5_release_dirents(&pf);
+                if (filepos != NULL) {
+                    *filepos = pos;
+                }
+                return ino;
             }
-            return dirent.s5d_inode;
         }
-        
-        // Move to the next directory entry
-        pos += sizeof(s5_dirent_t);
+        s5_release_dirents(&pf);
     }
     
     // Directory entry not found
@@ -783,16 +2083,34 @@ void s5_remove_dirent(s5_node_t *sn, const char *name, size_t namelen,
     KASSERT(dir->vn_len % sizeof(s5_dirent_t) == 0);
     size_t last_entry_pos = dir->vn_len - sizeof(s5_dirent_t);
     
+    uint32_t entry_slot = (uint32_t)(entry_pos / sizeof(s5_dirent_t));
+    if (sn->dirhash) {
+        s5_dirhash_remove(sn->dirhash, s5_name_hash(name, namelen), entry_slot);
+    }
     if (entry_pos != last_entry_pos) {
+        pframe_t *pf;
+        s5_dirent_t *dirent;
         s5_dirent_t last_entry;
         
-        // Read the last directory entry
-        ssize_t bytes_read = s5_read_file(sn, last_entry_pos, (char *)&last_entry, sizeof(s5_dirent_t));
-        KASSERT(bytes_read == sizeof(s5_dirent_t));
+        // Copy out the last directory entry
+        long ret = s5_get_dirents(sn, last_entry_pos, 0, &pf, &dirent);
+        KASSERT(ret == 1);
+        last_entry = *dirent;
+        s5_release_dirents(&pf);
         
-        // Overwrite the removed entry with the last entry
-        ssize_t bytes_written = s5_write_file(sn, entry_pos, (const char *)&last_entry, sizeof(s5_dirent_t));
-        KASSERT(bytes_written == sizeof(s5_dirent_t));
+        // Overwrite the removed entry with the last entry, in place
+        ret = s5_get_dirents(sn, entry_pos, 1, &pf, &dirent);
+        KASSERT(ret > 0);
+        *dirent = last_entry;
+        s5_release_dirents(&pf);
+
+        if (sn->dirhash) {
+            uint32_t hash = s5_name_hash(last_entry.s5d_name,
+                                         s5_dirent_namelen(&last_entry));
+            s5_dirhash_entry(sn->dirhash, hash,
+                             (uint32_t)(last_entry_pos / sizeof(s5_dirent_t)))
+                ->de_slot = entry_slot + 1;
+        }
     }
     
     // Truncate the length of the directory
@@ -823,16 +2141,30 @@ void s5_remove_dirent(s5_node_t *sn, const char *name, size_t namelen,
  *    before, but use the inode number from the new s5_node.
  *  - Update linkcounts and dirty inodes appropriately.
  *
- * s5_replace_dirent is NOT necessary to implement. It's only useful if 
- * you're planning on implementing the renaming of directories (which you shouldn't 
- * attempt until after the rest of S5FS is done).
+ * s5fs_rename uses it to replace an existing target, rewriting the entry in
+ * place; the directory index (see s5_dirhash_t) is unaffected.
  */
 void s5_replace_dirent(s5_node_t *sn, const char *name, size_t namelen,
                        s5_node_t *old, s5_node_t *new)
 {
-    vnode_t *dir = &sn->vnode;
-    s5_inode_t *inode = &sn->inode;
-    NOT_YET_IMPLEMENTED("RENAMEDIR: s5_replace_dirent");
+    KASSERT(S_ISDIR(sn->vnode.vn_mode));
+    
+    size_t entry_pos;
+    long found_ino = s5_find_dirent(sn, name, namelen, &entry_pos);
+    KASSERT(found_ino >= 0 && found_ino == old->inode.s5_number);
+    
+    // Point the entry at new, in place; its name and slot stay the same
+    pframe_t *pf;
+    s5_dirent_t *dirent;
+    long ret = s5_get_dirents(sn, entry_pos, 1, &pf, &dirent);
+    KASSERT(ret > 0);
+    dirent->s5d_inode = new->inode.s5_number;
+    s5_release_dirents(&pf);
+    
+    old->inode.s5_linkcount--;
+    old->dirtied_inode = 1;
+    new->inode.s5_linkcount++;
+    new->dirtied_inode = 1;
 }
 
 /* Create a directory entry.
@@ -883,10 +2215,13 @@ long s5_link(s5_node_t *dir, const char *name, size_t namelen,
     }
     
     // Write the directory entry to the end of the directory file
-    ssize_t ret = s5_write_file(dir, dir->vnode.vn_len, (const char *)&new_dirent, sizeof(s5_dirent_t));
+    size_t pos = dir->vnode.vn_len;
+    long ret = s5_append_dirent(dir, &new_dirent);
     if (ret < 0) {
         return ret;
     }
+    s5_dirhash_insert(dir, s5_name_hash(name, copy_len),
+                      (uint32_t)(pos / sizeof(s5_dirent_t)));
     
     // Update the linkcounts and mark the inodes dirty
     child->inode.s5_linkcount++;
@@ -899,106 +2234,91 @@ long s5_link(s5_node_t *dir, const char *name, size_t namelen,
     return 0;
 }
 
+/* The number of blocks indirect block indirect lists, plus itself, or 0 if
+ * indirect is 0. */
+static long s5_indirect_blocks(s5fs_t *s5fs, uint32_t indirect)
+{
+    if (!indirect)
+    {
+        return 0;
+    }
+    long count = 1;
+    pframe_t *pf;
+    s5_get_meta_disk_block(s5fs, indirect, 0, &pf);
+    uint32_t *blocks = (uint32_t *)pf->pf_addr;
+    for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
+    {
+        count += blocks[i] != 0;
+    }
+    s5_release_disk_block(&pf);
+    return count;
+}
+
 /* Return the number of file blocks allocated for sn. This means any
- * file blocks that are not sparse, direct or indirect. If the indirect
- * block itself is allocated, that must also count. This function should not
- * fail.
+ * file blocks that are not sparse, in extents or indirect. The indirect
+ * blocks themselves count too. This function should not fail.
  *
- * Hint:
- *  - You may wish to assert that the special character / block files do not
- *    have any blocks allocated to them. Remember, the s5_indirect_block for
- *    these special files is actually the device id.
+ * Special character / block files have no blocks; their s5_indirect_block
+ * is actually the device id.
  */
 long s5_inode_blocks(s5_node_t *sn)
 {
     s5_inode_t *inode = &sn->inode;
-    
+
     if (inode->s5_type == S5_TYPE_CHR || inode->s5_type == S5_TYPE_BLK) {
         KASSERT(inode->s5_indirect_block != 0);
-        // Check if no direct blocks are allocated
-        for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++) {
-            KASSERT(inode->s5_direct_blocks[i] == 0);
+        for (unsigned i = 0; i < S5_NEXTENTS; i++) {
+            KASSERT(inode->s5_extents[i].s5e_len == 0);
         }
         return 0;
     }
-    
-    long block_count = 0;
-    
-    // Count allocated direct blocks
-    for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++) {
-        if (inode->s5_direct_blocks[i] != 0) {
-            block_count++;
-        }
+
+    // Pages waiting for blocks are counted as if they had them
+    long block_count = (long)sn->ndelayed;
+    for (unsigned i = 0; i < S5_NEXTENTS; i++) {
+        block_count += inode->s5_extents[i].s5e_len;
     }
-    
-    // Count the indirect block if allocated
-    if (inode->s5_indirect_block != 0) {
-        block_count++; 
-        
-        // Count blocks pointed to by the indirect block
-        s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
-        pframe_t *pf;
-        s5_get_meta_disk_block(s5fs, inode->s5_indirect_block, 0, &pf);
-        
-        uint32_t *indirect_blocks = (uint32_t *)pf->pf_addr;
+
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    block_count += s5_indirect_blocks(s5fs, inode->s5_indirect_block);
+    if (inode->s5_dindirect_block) {
+        block_count++;
         for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++) {
-            if (indirect_blocks[i] != 0) {
-                block_count++;
-            }
+            pframe_t *pf;
+            s5_get_meta_disk_block(s5fs, inode->s5_dindirect_block, 0, &pf);
+            uint32_t indirect = ((uint32_t *)pf->pf_addr)[i];
+            s5_release_disk_block(&pf);
+            block_count += s5_indirect_blocks(s5fs, indirect);
         }
-        
-        s5_release_disk_block(&pf);
     }
-    
+
     return block_count;
 }
 
 /**
- * Given a s5_node_t, frees the associated direct blocks and 
- * the indirect blocks if they exist. 
- * 
- * Should only be called from the truncate_file routine. 
+ * Given a s5_node_t, frees all of its blocks, those of the extents and those
+ * the indirect blocks list, and the indirect blocks too.
+ *
+ * Should only be called from the truncate_file routine.
  */
 void s5_remove_blocks(s5_node_t *sn)
 {
-    // Free the blocks used by the node
-    // First, free the the direct blocks
-    s5fs_t* s5fs = VNODE_TO_S5FS(&sn->vnode);
-    s5_inode_t* s5_inode = &sn->inode; 
-    mobj_t *o = &sn->vnode.vn_mobj;
-    for (unsigned i = 0; i < S5_NDIRECT_BLOCKS; i++) 
-    {
-        if (s5_inode->s5_direct_blocks[i])
-        {
-            s5_free_block(s5fs, s5_inode->s5_direct_blocks[i]);
-            mobj_delete_pframe(o, i);
-            // should remove the pframes from the file
-            // Called from do_open, but the vnode could be
-            // present somewhere else, with pframes cached
-        }
-    }
-
-    memset(s5_inode->s5_direct_blocks, 0, sizeof(s5_inode->s5_direct_blocks));
+    s5fs_t *s5fs = VNODE_TO_S5FS(&sn->vnode);
+    s5_inode_t *s5_inode = &sn->inode;
+    s5_free_file_blocks(s5fs, s5_inode->s5_extents, s5_inode->s5_indirect_block,
+                        s5_inode->s5_dindirect_block, &sn->vnode.vn_mobj);
+    memset(s5_inode->s5_extents, 0, sizeof(s5_inode->s5_extents));
+    s5_inode->s5_indirect_block = 0;
+    s5_inode->s5_dindirect_block = 0;
+    s5_inode->s5_flags &= ~S5_INODE_INLINE;
+    memset(s5_inode->s5_inline, 0, sizeof(s5_inode->s5_inline));
+    s5_unreserve_blocks(sn);
 
-    // Get the indirect blocks and free them, if they exist
-    if (s5_inode->s5_indirect_block)
+    // The pages that never got blocks go too, written or not
+    mobj_t *o = &sn->vnode.vn_mobj;
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
     {
-        pframe_t *pf;
-        s5_get_meta_disk_block(s5fs, s5_inode->s5_indirect_block, 0, &pf);
-        uint32_t *blocknum_ptr = pf->pf_addr;
-
-        for (unsigned i = 0; i < S5_NIDIRECT_BLOCKS; i++)
-        {
-            if (blocknum_ptr[i])
-            {
-                s5_free_block(s5fs, blocknum_ptr[i]);
-                mobj_delete_pframe(o, S5_NDIRECT_BLOCKS + i);
-            }
-        }
-
-        s5_release_disk_block(&pf);
-        // Free the indirect block itself
-        s5_free_block(s5fs, s5_inode->s5_indirect_block);
-        s5_inode->s5_indirect_block = 0;
+        mobj_delete_pframe(o, pf->pf_pagenum);
     }
+    s5_undelay_blocks(sn, sn->ndelayed);
 }
@@ -6,7 +6,10 @@
 #include <fs/vnode.h>
 
 #include "fs/file.h"
+#include "fs/initrd.h"
+#include "fs/procfs/procfs.h"
 #include "fs/ramfs/ramfs.h"
+#include "fs/stat.h"
 
 #include "mm/kmalloc.h"
 #include "mm/slab.h"
@@ -17,52 +20,83 @@
 #endif
 
 #ifdef __MOUNTING__
-/* The fs listed here are only the non-root file systems */
-list_t mounted_fs_list;
+/* The fs listed here are only the non-root file systems, in the order they
+ * were mounted */
+list_t mounted_fs_list = LIST_INITIALIZER(mounted_fs_list);
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Mounts fs, which mountfunc() has set up, on mtpt, a directory that is
+ * neither a mount point nor the root of a filesystem itself. fs takes over
+ * the caller's reference on mtpt, which is kept until it is unmounted.
+ * mtpt->vn_mount does not hold a reference on fs's root: fs_root already
+ * does, for as long as fs is mounted (see vfs_is_in_use()).
  *
- * The purpose of this function is to set up the pointers between the file
- * system struct and the vnode of the mount point. Remember to watch your
- * reference counts. (The exception here is when the vnode's vn_mount field
- * points to the mounted file system's root we do not increment the reference
- * count on the file system's root vnode. The file system is already keeping
- * a reference to the vnode which will not go away until the file system is
- * unmounted. If we kept a second such reference it would conflict with the
- * behavior of vfs_is_in_use(), make sure you understand why.)
- *
- * Once everything is set up add the file system to the list of mounted file
- * systems.
- *
- * Remember proper error handling.
- *
- * This function is not meant to mount the root file system.
+ * Returns 0, or:
+ *  - ENOTDIR: mtpt is not a directory
+ *  - EBUSY: mtpt is a mount point or the root of a filesystem
  */
 int vfs_mount(struct vnode *mtpt, fs_t *fs)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: vfs_mount");
-    return -EINVAL;
+    KASSERT(fs != &vfs_root_fs && fs->fs_root);
+    if (!S_ISDIR(mtpt->vn_mode))
+    {
+        return -ENOTDIR;
+    }
+    if (mtpt->vn_mount != mtpt || mtpt == mtpt->vn_fs->fs_root)
+    {
+        return -EBUSY;
+    }
+    fs->fs_mtpt = mtpt;
+    fs->fs_root->vn_mount = fs->fs_root;
+    // Lookups cross from here on; the name cache is not told, since it
+    // maps names to mtpt itself, which namev_lookup() crosses from
+    mtpt->vn_mount = fs->fs_root;
+    list_insert_tail(&mounted_fs_list, &fs->fs_link);
+    dbg(DBG_VFS, "mounted %s (%s) on vnode %d\n", fs->fs_type, fs->fs_dev,
+        mtpt->vn_vno);
+    return 0;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
- *
- * The purpose of this function is to undo the setup done in vfs_mount(). Also
- * you should call the underlying file system's umount() function. Make sure
- * to keep track of reference counts. You should also kfree the fs struct at
- * the end of this method.
+ * Unmounts fs, mounted by vfs_mount(), and frees it. Lookups stop crossing
+ * into it first, so that no new reference can be taken while the vnodes
+ * are checked; if one of them is still in use (including the mount point
+ * of another filesystem), it is mounted back and nothing else is done.
  *
- * Remember proper error handling. You might want to make sure that you do not
- * try to call this function on the root file system (this function is not meant
- * to unmount the root file system).
+ * Returns 0, or:
+ *  - EBUSY: a vnode of fs is in use
+ *  - Propagate errors from the filesystem's umount
  */
 int vfs_umount(fs_t *fs)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: vfs_umount");
-    return -EINVAL;
+    KASSERT(fs != &vfs_root_fs && "vfs_umount cannot unmount the root");
+    vnode_t *mtpt = fs->fs_mtpt;
+    KASSERT(mtpt->vn_mount == fs->fs_root);
+    /* The areas of a process that has been waited for may still hold files
+     * of fs until the reaper gets to them */
+    proc_reaper_drain();
+    mtpt->vn_mount = mtpt;
+
+    long ret = vfs_is_in_use(fs);
+    if (ret)
+    {
+        mtpt->vn_mount = fs->fs_root;
+        return (int)ret;
+    }
+    vnode_cache_purge(fs);
+
+    if (fs->fs_ops->umount)
+    {
+        ret = fs->fs_ops->umount(fs);
+    }
+    else
+    {
+        vput(&fs->fs_root);
+    }
+    list_remove(&fs->fs_link);
+    vput(&fs->fs_mtpt);
+    kfree(fs);
+    return (int)ret;
 }
 #endif /* __MOUNTING__ */
 
@@ -79,9 +113,19 @@ fs_t vfs_root_fs = {
 
 /*
  * Call mountfunc on vfs_root_fs and set curproc->p_cwd (reference count!)
+ *
+ * With an initramfs the root is a ramfs, whatever VFS_ROOTFS_TYPE says, for
+ * initproc to unpack the archive into.
  */
 void vfs_init()
 {
+    kmutex_set_name(&vfs_root_fs.vnode_list_mutex, "vnode_list");
+    if (initrd_present())
+    {
+        strcpy(vfs_root_fs.fs_type, "ramfs");
+    }
+    vnode_cache_init();
+    namev_cache_init();
     long err = mountfunc(&vfs_root_fs);
     if (err)
     {
@@ -96,19 +140,71 @@ void vfs_init()
     vunlock(vfs_root_fs.fs_root);
 
 #ifdef __MOUNTING__
-    list_init(&mounted_fs_list);
-    fs->fs_mtpt = vfs_root_fs.fs_root;
+    vfs_root_fs.fs_mtpt = vfs_root_fs.fs_root;
+    vfs_root_fs.fs_root->vn_mount = vfs_root_fs.fs_root;
 #endif
 }
 
 /*
- * Wrapper around the sync call() to vfs_root_fs using fs_ops
+ * fsyncs every vnode of fs that is in use. Those only in the vnode cache
+ * were written back when their last reference went, see vnode_destructor.
+ * The vnodes are gathered and referenced first, since vnode_list_mutex
+ * cannot be held while one of them is locked or put.
  */
+static void vfs_sync_vnodes(fs_t *fs)
+{
+    size_t n = vfs_count_active_vnodes(fs);
+    vnode_t **vns = n ? kmalloc(sizeof(vnode_t *) * n) : NULL;
+    if (!vns)
+    {
+        return;
+    }
+    size_t nvns = 0;
+    kmutex_lock(&fs->vnode_list_mutex);
+    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link)
+    {
+        if (nvns < n && atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+        {
+            vns[nvns++] = vn;
+        }
+    }
+    kmutex_unlock(&fs->vnode_list_mutex);
+
+    for (size_t i = 0; i < nvns; i++)
+    {
+        vnode_t *vn = vns[i];
+        vlock(vn);
+        if (vn->vn_ops && vn->vn_ops->fsync)
+        {
+            vn->vn_ops->fsync(vn, 0);
+        }
+        vput_locked(&vn);
+    }
+    kfree(vns);
+}
+
+/*
+ * Writes back every file of fs that is in use, then has the filesystem
+ * write the rest (see sync in vfs.h)
+ */
+static void vfs_sync_fs(fs_t *fs)
+{
+    vfs_sync_vnodes(fs);
+    if (fs->fs_ops->sync)
+    {
+        fs->fs_ops->sync(fs);
+    }
+}
+
+/* Syncs vfs_root_fs, and every filesystem mounted on it */
 void do_sync()
 {
-    vfs_root_fs.fs_ops->sync(&vfs_root_fs);
+    vfs_sync_fs(&vfs_root_fs);
 #ifdef __MOUNTING__
-    // if implementing mounting, just sync() all the mounted FS's as well
+    list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+    {
+        vfs_sync_fs(mtfs);
+    }
 #endif
 }
 
@@ -121,7 +217,8 @@ long vfs_shutdown()
     long ret = 0;
 
 #ifdef __MOUNTING__
-    list_iterate(&mounted_fs_list, mtfs, fs_t, fs_link)
+    // Bottom up: a filesystem mounted on another was mounted after it
+    list_iterate_reverse(&mounted_fs_list, mtfs, fs_t, fs_link)
     {
         ret = vfs_umount(mtfs);
         KASSERT(!ret);
@@ -132,6 +229,7 @@ long vfs_shutdown()
     {
         panic("vfs_shutdown: found active vnodes in root filesystem");
     }
+    vnode_cache_purge(&vfs_root_fs);
 
     if (vfs_root_fs.fs_ops->umount)
     {
@@ -164,6 +262,7 @@ long mountfunc(fs_t *fs)
         {"s5fs", s5fs_mount},
 #endif
         {"ramfs", ramfs_mount},
+        {"procfs", procfs_mount},
     };
 
     for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
@@ -1,16 +1,225 @@
 #include "fs/vfs_syscall.h"
 #include "errno.h"
 #include "fs/fcntl.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/lseek.h"
+#include "fs/uio.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "vm/pagefault.h"
 #include <limits.h>
 
+/* Lock and unlock vn around a transfer, shared for a read and exclusive for
+ * a write, unless it is a pipe (see file_rw) */
+static void _rw_lock(vnode_t *vn, long write)
+{
+    if (S_ISFIFO(vn->vn_mode))
+    {
+        return;
+    }
+    if (write)
+    {
+        vlock_exclusive(vn);
+    }
+    else
+    {
+        vlock_shared(vn);
+    }
+}
+
+static void _rw_unlock(vnode_t *vn, long write)
+{
+    if (S_ISFIFO(vn->vn_mode))
+    {
+        return;
+    }
+    if (write)
+    {
+        vunlock_exclusive(vn);
+    }
+    else
+    {
+        vunlock_shared(vn);
+    }
+}
+
+/*
+ * The one place file data moves through: do_read(), do_write() and their
+ * vector and positional forms all come here. The iovcnt buffers of iov,
+ * which are kernel memory, are read into or written from in turn, under a
+ * single vlock, so no other write lands between them.
+ *
+ * With off -1 the transfer starts at f_pos (or, for a write to a file opened
+ * with O_APPEND, at the end of the file) and moves f_pos past what it did;
+ * otherwise it starts at off and f_pos is left alone, which makes no sense
+ * for a pipe (ESPIPE). f_pos is looked after under the file's f_pos_mutex,
+ * outside the vnode lock.
+ *
+ * A short transfer into one buffer ends the whole call, as does an error
+ * after anything was transferred, so that the caller learns how much was.
+ *
+ * Pipes are not locked here: a reader or writer may have to wait in one for
+ * the other end, which could not get in while it held the vnode, and they
+ * keep their ends to one reader and one writer at a time by themselves.
+ *
+ * Works on the open file itself, for callers such as the asynchronous I/O
+ * workers that have no descriptor for it; see _do_rw() for the errors.
+ */
+ssize_t file_rw(file_t *file_obj, const iovec_t *iov, int iovcnt, off_t off,
+                long write)
+{
+    if (iovcnt < 0 || iovcnt > IOV_MAX)
+    {
+        return -EINVAL;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        // The total has to fit in the ssize_t that is returned
+        if (iov[i].iov_len > ((size_t)-1 >> 1) - len)
+        {
+            return -EINVAL;
+        }
+        len += iov[i].iov_len;
+    }
+
+    vnode_t *target_vnode = file_obj->f_vnode;
+    ssize_t result = 0;
+    if (!(file_obj->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        result = -EBADF;
+    }
+    else if (!write && S_ISDIR(target_vnode->vn_mode))
+    {
+        result = -EISDIR;
+    }
+    else if (!target_vnode->vn_ops ||
+             (write ? !target_vnode->vn_ops->write
+                    : !target_vnode->vn_ops->read))
+    {
+        result = -EBADF;
+    }
+    else if (off != -1 && S_ISFIFO(target_vnode->vn_mode))
+    {
+        result = -ESPIPE;
+    }
+    if (result)
+    {
+        return result;
+    }
+
+    // The position is the file's own business; concurrent readers share the
+    // vnode, and a writer excludes everyone
+    if (off == -1)
+    {
+        kmutex_lock(&file_obj->f_pos_mutex);
+    }
+    size_t pos;
+    _rw_lock(target_vnode, write);
+    if (write)
+    {
+        if (off != -1)
+        {
+            pos = (size_t)off;
+        }
+        else if (file_obj->f_mode & FMODE_APPEND)
+        {
+            pos = target_vnode->vn_len;
+        }
+        else
+        {
+            pos = file_obj->f_pos;
+        }
+    }
+    else
+    {
+        if (off != -1)
+        {
+            pos = (size_t)off;
+        }
+        else
+        {
+            file_readahead(file_obj, len);
+            pos = file_obj->f_pos;
+        }
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (!iov[i].iov_len)
+        {
+            continue;
+        }
+        ssize_t ret;
+        if (write)
+        {
+            ret = target_vnode->vn_ops->write(target_vnode, pos,
+                                              iov[i].iov_base, iov[i].iov_len);
+        }
+        else
+        {
+            ret = target_vnode->vn_ops->read(target_vnode, pos, iov[i].iov_base,
+                                             iov[i].iov_len);
+        }
+        if (ret < 0)
+        {
+            result = result ? result : ret;
+            break;
+        }
+        result += ret;
+        pos += (size_t)ret;
+        if ((size_t)ret < iov[i].iov_len)
+        {
+            break;
+        }
+    }
+
+    _rw_unlock(target_vnode, write);
+    if (off == -1)
+    {
+        if (result > 0)
+        {
+            file_obj->f_pos = pos;
+        }
+        if (!write)
+        {
+            file_obj->f_ra_next = file_obj->f_pos;
+        }
+        kmutex_unlock(&file_obj->f_pos_mutex);
+    }
+    return result;
+}
+
+/*
+ * file_rw() on the fd's file. Returns what it does, or:
+ *  - EBADF: fd is invalid or is not open for the transfer
+ *  - EISDIR: reading a directory
+ *  - EINVAL: iovcnt is negative or more than IOV_MAX, or the total length
+ *    overflows an ssize_t
+ *  - ESPIPE: an offset is given for a pipe
+ *  - Propagate errors from the vnode operation, if nothing was transferred
+ */
+static ssize_t _do_rw(int fd, const iovec_t *iov, int iovcnt, off_t off,
+                      long write)
+{
+    file_t *file_obj = fget(fd);
+    if (!file_obj)
+    {
+        return -EBADF;
+    }
+    ssize_t result = file_rw(file_obj, iov, iovcnt, off, write);
+    fput(&file_obj);
+    return result;
+}
+
 /*
  * Read len bytes into buf from the fd's file using the file's vnode operation
  * read.
@@ -26,52 +235,8 @@
  */
 ssize_t do_read(int fd, void *buf, size_t len)
 {
-    // Validate file descriptor
-    if (fd < 0 || fd >= NFILES) {
-        return -EBADF;
-    }
-    
-    // Retrieve file object using fget
-    file_t *file_obj = fget(fd);
-    if (!file_obj) {
-        return -EBADF;
-    }
-    
-    // Verify read permissions
-    if (!(file_obj->f_mode & FMODE_READ)) {
-        fput(&file_obj);
-        return -EBADF;
-    }
-    
-    vnode_t *target_vnode = file_obj->f_vnode;
-    
-    // Prevent reading from directories
-    if (S_ISDIR(target_vnode->vn_mode)) {
-        fput(&file_obj);
-        return -EISDIR;
-    }
-    
-    // Ensure vnode has read capability
-    if (!target_vnode->vn_ops || !target_vnode->vn_ops->read) {
-        fput(&file_obj);
-        return -EBADF;
-    }
-    
-    // Perform read operation with proper locking
-    vlock(target_vnode);
-    ssize_t result = target_vnode->vn_ops->read(target_vnode, file_obj->f_pos, buf, len);
-    
-    // Update position on successful read
-    if (result > 0) {
-        file_obj->f_pos += result;
-    }
-    
-    vunlock(target_vnode);
-    
-    // Clean up file reference
-    fput(&file_obj);
-    
-    return result;
+    iovec_t iov = {.iov_base = buf, .iov_len = len};
+    return _do_rw(fd, &iov, 1, -1, 0);
 }
 
 /*
@@ -90,63 +255,445 @@ ssize_t do_read(int fd, void *buf, size_t len)
  */
 ssize_t do_write(int fd, const void *buf, size_t len)
 {
-    // Validate file descriptor
-    if (fd < 0 || fd >= NFILES) {
-        return -EBADF;
+    iovec_t iov = {.iov_base = (void *)buf, .iov_len = len};
+    return _do_rw(fd, &iov, 1, -1, 1);
+}
+
+/*
+ * Read into each of the iovcnt buffers of iov in turn, as one do_read()
+ * would into a single buffer of their total length. The buffers are kernel
+ * memory.
+ *
+ * Return the number of bytes read on success, or, in addition to the errors
+ * of do_read():
+ *  - EINVAL: iovcnt is negative or more than IOV_MAX, or the total length
+ *    overflows an ssize_t
+ */
+ssize_t do_readv(int fd, const iovec_t *iov, int iovcnt)
+{
+    return _do_rw(fd, iov, iovcnt, -1, 0);
+}
+
+/*
+ * Write each of the iovcnt buffers of iov in turn, as one do_write() would
+ * from a single buffer; nothing else written to the file comes between
+ * them. The errors are those of do_readv().
+ */
+ssize_t do_writev(int fd, const iovec_t *iov, int iovcnt)
+{
+    return _do_rw(fd, iov, iovcnt, -1, 1);
+}
+
+/*
+ * Read len bytes into buf starting at offset off of the fd's file, leaving
+ * the file's position where it is.
+ *
+ * Return the number of bytes read on success, or, in addition to the errors
+ * of do_read():
+ *  - EINVAL: off is negative
+ *  - ESPIPE: fd refers to a pipe
+ */
+ssize_t do_pread(int fd, void *buf, size_t len, off_t off)
+{
+    if (off < 0)
+    {
+        return -EINVAL;
     }
-    
-    // Retrieve file object using fget
-    file_t *file_obj = fget(fd);
-    if (!file_obj) {
+    iovec_t iov = {.iov_base = buf, .iov_len = len};
+    return _do_rw(fd, &iov, 1, off, 0);
+}
+
+/*
+ * Write len bytes from buf starting at offset off of the fd's file, even if
+ * it was opened with O_APPEND, leaving the file's position where it is. The
+ * errors are those of do_pread(), for writing.
+ */
+ssize_t do_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+    if (off < 0)
+    {
+        return -EINVAL;
+    }
+    iovec_t iov = {.iov_base = (void *)buf, .iov_len = len};
+    return _do_rw(fd, &iov, 1, off, 1);
+}
+
+/* The most pages a direct transfer pins, and hands the filesystem, at once */
+#define DIRECT_IO_PAGES 32
+
+/*
+ * read(2), write(2), pread(2) and pwrite(2) of a file opened with O_DIRECT:
+ * moves the data between the disk and the user's buffer at ubuf, which is
+ * a user address, without going through the page cache (see
+ * vnode_ops_t.direct_io), so that streaming a big file does not push
+ * everything else out of the cache. The buffer's pages are faulted in and
+ * pinned before the vnode is locked, DIRECT_IO_PAGES at a time. off is as
+ * for file_rw().
+ *
+ * Returns the number of bytes transferred, or:
+ *  - EBADF: fd is invalid or is not open for the transfer
+ *  - EINVAL: ubuf or the position is not page-aligned, or len is not a
+ *    multiple of the page size
+ *  - EFAULT: ubuf is not mapped for the transfer
+ *  - Propagate errors from direct_io, if nothing was transferred
+ */
+ssize_t do_direct_rw(int fd, void *ubuf, size_t len, off_t off, long write)
+{
+    file_t *file = fget(fd);
+    if (!file)
+    {
         return -EBADF;
     }
-    
-    // Verify write permissions
-    if (!(file_obj->f_mode & FMODE_WRITE)) {
-        fput(&file_obj);
+    vnode_t *vn = file->f_vnode;
+    ssize_t result = 0;
+    if (!(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+    {
+        result = -EBADF;
+    }
+    else if (!PAGE_ALIGNED(ubuf) || !PAGE_ALIGNED(len) ||
+             (off != -1 && !PAGE_ALIGNED(off)) || (ssize_t)len < 0)
+    {
+        result = -EINVAL;
+    }
+    if (result)
+    {
+        fput(&file);
+        return result;
+    }
+
+    if (off == -1)
+    {
+        kmutex_lock(&file->f_pos_mutex);
+    }
+    size_t pos = off != -1 ? (size_t)off : file->f_pos;
+    while ((size_t)result < len)
+    {
+        size_t npages = MIN((len - (size_t)result) / PAGE_SIZE,
+                            (size_t)DIRECT_IO_PAGES);
+        pframe_t *pfs[DIRECT_IO_PAGES];
+        char *pages[DIRECT_IO_PAGES];
+        ssize_t ret = pagefault_pin((uintptr_t)ubuf + (size_t)result, npages,
+                                    !write, pfs);
+        if (ret >= 0)
+        {
+            for (size_t i = 0; i < npages; i++)
+            {
+                pages[i] = pfs[i]->pf_addr;
+            }
+            _rw_lock(vn, write);
+            if (write && off == -1 && (file->f_mode & FMODE_APPEND))
+            {
+                pos = vn->vn_len;
+            }
+            ret = PAGE_ALIGNED(pos)
+                      ? vn->vn_ops->direct_io(vn, pos, pages, npages, write)
+                      : -EINVAL;
+            _rw_unlock(vn, write);
+            for (size_t i = 0; i < npages; i++)
+            {
+                pframe_put(&pfs[i]);
+            }
+        }
+        if (ret < 0)
+        {
+            result = result ? result : ret;
+            break;
+        }
+        result += ret;
+        pos += (size_t)ret;
+        if ((size_t)ret < npages * PAGE_SIZE)
+        {
+            break;
+        }
+    }
+    if (off == -1)
+    {
+        if (result > 0)
+        {
+            file->f_pos = pos;
+        }
+        kmutex_unlock(&file->f_pos_mutex);
+    }
+    fput(&file);
+    return result;
+}
+
+/*
+ * Copy up to count bytes from the in_fd's file to the out_fd's, without
+ * bringing them out to a user buffer and back. When the input file is kept
+ * in the page cache, its pages are written out from where they are cached;
+ * anything else (a pipe, a device) is read through one kernel page.
+ *
+ * If offset is NULL, reading starts at in_fd's position, which is moved past
+ * what was copied; otherwise it starts at *offset, which is moved instead.
+ * The output goes where a write to out_fd would, and moves its position.
+ *
+ * The input vnode is held shared only while a page is got, and the output
+ * exclusive only while it is written, a page at a time, so that two
+ * transfers in opposite directions cannot deadlock.
+ *
+ * Return the number of bytes copied on success, or:
+ *  - EBADF: in_fd is not open for reading or out_fd for writing
+ *  - EISDIR: in_fd refers to a directory
+ *  - EINVAL: *offset is negative, or both refer to the same file
+ *  - ESPIPE: offset is given for a pipe
+ *  - ENOMEM: no page could be allocated to read through
+ *  - Propagate errors from the vnode operations, if nothing was copied
+ */
+ssize_t do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    file_t *in = fget(in_fd);
+    if (!in)
+    {
         return -EBADF;
     }
-    
-    vnode_t *target_vnode = file_obj->f_vnode;
-    
-    // Ensure vnode has write capability
-    if (!target_vnode->vn_ops || !target_vnode->vn_ops->write) {
-        fput(&file_obj);
+    file_t *out = fget(out_fd);
+    if (!out)
+    {
+        fput(&in);
         return -EBADF;
     }
-    
-    // Acquire vnode lock for write operation
-    vlock(target_vnode);
-    
-    size_t write_position;
-    
-    // Handle append mode
-    if (file_obj->f_mode & FMODE_APPEND) {
-        write_position = target_vnode->vn_len;
-    } else {
-        write_position = file_obj->f_pos;
+    vnode_t *in_vn = in->f_vnode;
+    vnode_t *out_vn = out->f_vnode;
+    ssize_t result = 0;
+    if (!(in->f_mode & FMODE_READ) || !(out->f_mode & FMODE_WRITE) ||
+        !in_vn->vn_ops || !in_vn->vn_ops->read || !out_vn->vn_ops ||
+        !out_vn->vn_ops->write)
+    {
+        result = -EBADF;
     }
-    
-    // Execute write operation
-    ssize_t result = target_vnode->vn_ops->write(target_vnode, write_position, buf, len);
-    
-    // Update position on successful write
-    if (result > 0) {
-        if (file_obj->f_mode & FMODE_APPEND) {
-            file_obj->f_pos = write_position + result;
-        } else {
-            file_obj->f_pos += result;
+    else if (S_ISDIR(in_vn->vn_mode))
+    {
+        result = -EISDIR;
+    }
+    else if (in_vn == out_vn || (offset && *offset < 0))
+    {
+        result = -EINVAL;
+    }
+    else if (offset && S_ISFIFO(in_vn->vn_mode))
+    {
+        result = -ESPIPE;
+    }
+    if (result)
+    {
+        goto out;
+    }
+
+    // Files whose get_pframe is set are cached in their vn_mobj
+    long cached = in_vn->vn_ops->get_pframe != NULL;
+    void *bounce = NULL;
+    if (!cached && !(bounce = page_alloc()))
+    {
+        result = -ENOMEM;
+        goto out;
+    }
+
+    // No two f_pos_mutexes are held at once, as two transfers in opposite
+    // directions would take them in opposite orders
+    size_t pos;
+    if (offset)
+    {
+        pos = (size_t)*offset;
+    }
+    else
+    {
+        kmutex_lock(&in->f_pos_mutex);
+        pos = in->f_pos;
+        kmutex_unlock(&in->f_pos_mutex);
+    }
+    while ((size_t)result < count)
+    {
+        size_t n = MIN(PAGE_SIZE - pos % PAGE_SIZE, count - (size_t)result);
+        pframe_t *pf = NULL;
+        const char *src = bounce;
+        long ret;
+
+        _rw_lock(in_vn, 0);
+        if (!cached)
+        {
+            ret = in_vn->vn_ops->read(in_vn, pos, bounce, n);
+        }
+        else if (pos >= in_vn->vn_len)
+        {
+            ret = 0;
+        }
+        else
+        {
+            if (!result && in_vn->vn_ops->readahead)
+            {
+                size_t last = ADDR_TO_PN(MIN(pos + count, in_vn->vn_len) - 1);
+                in_vn->vn_ops->readahead(in_vn, ADDR_TO_PN(pos),
+                                         last - ADDR_TO_PN(pos) + 1);
+            }
+            n = MIN(n, in_vn->vn_len - pos);
+            ret = vnode_get_cached_page(in_vn, ADDR_TO_PN(pos), &pf);
+            src = (const char *)(pf ? pf->pf_addr : pframe_zero_page) +
+                  pos % PAGE_SIZE;
+            ret = ret < 0 ? ret : (long)n;
+        }
+        _rw_unlock(in_vn, 0);
+        if (ret <= 0)
+        {
+            result = result ? result : ret;
+            break;
+        }
+
+        kmutex_lock(&out->f_pos_mutex);
+        _rw_lock(out_vn, 1);
+        size_t out_pos =
+            (out->f_mode & FMODE_APPEND) ? out_vn->vn_len : out->f_pos;
+        long written = out_vn->vn_ops->write(out_vn, out_pos, src, (size_t)ret);
+        _rw_unlock(out_vn, 1);
+        if (written > 0)
+        {
+            out->f_pos = out_pos + (size_t)written;
+        }
+        kmutex_unlock(&out->f_pos_mutex);
+        if (pf)
+        {
+            pframe_put(&pf);
+        }
+        if (written <= 0)
+        {
+            result = result ? result : written;
+            break;
+        }
+        result += written;
+        pos += (size_t)written;
+        if (written < ret)
+        {
+            break;
         }
     }
-    
-    vunlock(target_vnode);
-    
-    // Clean up file reference
-    fput(&file_obj);
-    
+
+    if (result > 0)
+    {
+        if (offset)
+        {
+            *offset = (off_t)pos;
+        }
+        else
+        {
+            kmutex_lock(&in->f_pos_mutex);
+            in->f_pos = pos;
+            kmutex_unlock(&in->f_pos_mutex);
+        }
+    }
+    if (bounce)
+    {
+        page_free(bounce);
+    }
+out:
+    fput(&out);
+    fput(&in);
     return result;
 }
 
+/*
+ * Write what fd's file has cached to the disk; see fsync in vnode.h. Only
+ * the one file is written, not the whole filesystem as with sync(2).
+ *
+ * Return 0 on success, or:
+ *  - EBADF: fd is not open
+ *  - Propagate errors from the vnode operation fsync
+ */
+long do_fsync(int fd, long datasync)
+{
+    file_t *file_obj = fget(fd);
+    if (!file_obj)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file_obj->f_vnode;
+    long ret = 0;
+    vlock(vn);
+    if (vn->vn_ops && vn->vn_ops->fsync)
+    {
+        ret = vn->vn_ops->fsync(vn, datasync);
+    }
+    vunlock(vn);
+    fput(&file_obj);
+    return ret;
+}
+
+/*
+ * Give fd's file disk blocks for the len bytes from off, so that writing
+ * them later allocates nothing; see fallocate in vnode.h. With
+ * FALLOC_FL_KEEP_SIZE in mode the file's size is left alone, and blocks
+ * past its end are set aside for it to grow into.
+ *
+ * Return 0 on success, or:
+ *  - EBADF: fd is not open for writing
+ *  - EINVAL: off is negative, len is not positive, or mode has bits other
+ *    than FALLOC_FL_KEEP_SIZE
+ *  - ENODEV: fd is not a regular file
+ *  - EOPNOTSUPP: the file's filesystem cannot preallocate
+ *  - EFBIG: off + len is past the largest file the filesystem can hold
+ *  - Propagate errors from the vnode operation fallocate
+ */
+long do_fallocate(int fd, int mode, off_t off, off_t len)
+{
+    if (off < 0 || len <= 0 || (mode & ~FALLOC_FL_KEEP_SIZE))
+    {
+        return -EINVAL;
+    }
+    if ((size_t)off + (size_t)len < (size_t)off)
+    {
+        return -EFBIG;
+    }
+    file_t *file_obj = fget(fd);
+    if (!file_obj)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file_obj->f_vnode;
+    long ret;
+    if (!(file_obj->f_mode & FMODE_WRITE))
+    {
+        ret = -EBADF;
+    }
+    else if (!S_ISREG(vn->vn_mode))
+    {
+        ret = -ENODEV;
+    }
+    else if (!vn->vn_ops || !vn->vn_ops->fallocate)
+    {
+        ret = -EOPNOTSUPP;
+    }
+    else
+    {
+        vlock_exclusive(vn);
+        ret = vn->vn_ops->fallocate(vn, (size_t)off, (size_t)len,
+                                    mode & FALLOC_FL_KEEP_SIZE);
+        vunlock_exclusive(vn);
+    }
+    fput(&file_obj);
+    return ret;
+}
+
+/*
+ * Carry out device request cmd on fd's file, with arg, a pointer into the
+ * caller's memory; see ioctl in vnode.h.
+ *
+ * Return what the vnode operation ioctl returns, or:
+ *  - EBADF: fd is not open
+ *  - ENOTTY: the file is not a device with requests
+ */
+long do_ioctl(int fd, unsigned long cmd, void *arg)
+{
+    file_t *file_obj = fget(fd);
+    if (!file_obj)
+    {
+        return -EBADF;
+    }
+    vnode_t *vn = file_obj->f_vnode;
+    long ret = vn->vn_ops && vn->vn_ops->ioctl
+                   ? vn->vn_ops->ioctl(vn, cmd, arg)
+                   : -ENOTTY;
+    fput(&file_obj);
+    return ret;
+}
+
 /*
  * Close the file descriptor fd.
  *
@@ -165,15 +712,13 @@ long do_close(int fd)
         return -EBADF;
     }
     
-    // Check if file is currently open
-    file_t *file_obj = curproc->p_files[fd];
-    if (!file_obj) {
-        return -EBADF;
+    // Remove file from process file table, if it is open there
+    file_t *file_obj;
+    long status = fdtable_remove(&curproc->p_fdtable, fd, &file_obj);
+    if (status < 0) {
+        return status;
     }
     
-    // Remove file from process file table
-    curproc->p_files[fd] = NULL;
-    
     // Release file reference
     fput(&file_obj);
     
@@ -197,7 +742,7 @@ long do_dup(int fd)
     }
     
     // Get original file object
-    file_t *original_file = curproc->p_files[fd];
+    file_t *original_file = fdtable_lookup(curproc->p_fdtable, fd);
     if (!original_file) {
         return -EBADF;
     }
@@ -211,7 +756,7 @@ long do_dup(int fd)
     
     // Create duplicate reference
     fref(original_file);
-    curproc->p_files[new_fd] = original_file;
+    fdtable_install(curproc->p_fdtable, new_fd, original_file);
     
     return new_fd;
 }
@@ -222,6 +767,7 @@ long do_dup(int fd)
  *
  * Return nfd on success, or:
  *  - EBADF: ofd is invalid or not open, or nfd is invalid
+ *  - ENOMEM: the descriptor table could not be copied or grown
  *
  * Hint: You don't need to do anything if ofd and nfd are the same.
  * (If supporting MTP, this action must be atomic)
@@ -239,7 +785,7 @@ long do_dup2(int ofd, int nfd)
     }
     
     // Get original file object
-    file_t *original_file = curproc->p_files[ofd];
+    file_t *original_file = fdtable_lookup(curproc->p_fdtable, ofd);
     if (!original_file) {
         return -EBADF;
     }
@@ -249,14 +795,20 @@ long do_dup2(int ofd, int nfd)
         return nfd;
     }
     
+    // Make room for nfd first, so that a failure leaves it open
+    long status = fdtable_reserve(&curproc->p_fdtable, nfd);
+    if (status < 0) {
+        return status;
+    }
+    
     // Close existing file if nfd is open
-    if (curproc->p_files[nfd]) {
+    if (fdtable_lookup(curproc->p_fdtable, nfd)) {
         do_close(nfd);
     }
     
     // Create duplicate reference
     fref(original_file);
-    curproc->p_files[nfd] = original_file;
+    fdtable_install(curproc->p_fdtable, nfd, original_file);
     
     return nfd;
 }
@@ -387,6 +939,7 @@ long do_mkdir(const char *path)
     // Create directory
     vnode_t *new_directory;
     status = parent_directory->vn_ops->mkdir(parent_directory, null_terminated_name, name_length, &new_directory);
+    namev_cache_invalidate(parent_directory, directory_name, name_length);
     
     vunlock(parent_directory);
     vput(&parent_directory);
@@ -468,8 +1021,24 @@ long do_rmdir(const char *path)
         return -ENOTDIR;
     }
     
+#ifdef __MOUNTING__
+    // A mount point cannot be removed: looking it up crosses into what is
+    // mounted on it
+    vnode_t *victim;
+    if (!namev_lookup(parent_directory, null_terminated_name, name_length, &victim)) {
+        long busy = victim->vn_fs != parent_directory->vn_fs;
+        vput(&victim);
+        if (busy) {
+            vunlock(parent_directory);
+            vput(&parent_directory);
+            return -EBUSY;
+        }
+    }
+#endif
+
     // Remove directory
     status = parent_directory->vn_ops->rmdir(parent_directory, null_terminated_name, name_length);
+    namev_cache_moved(parent_directory, directory_name, name_length);
     
     vunlock(parent_directory);
     vput(&parent_directory);
@@ -551,6 +1120,7 @@ long do_unlink(const char *path)
     
     // Remove file
     status = parent_directory->vn_ops->unlink(parent_directory, null_terminated_name, name_length);
+    namev_cache_invalidate(parent_directory, null_terminated_name, name_length);
     
     vunlock(parent_directory);
     
@@ -602,6 +1172,13 @@ long do_link(const char *oldpath, const char *newpath)
         vput(&target_vnode);
         return status;
     }
+
+    // Links cannot cross mount points
+    if (parent_directory->vn_fs != target_vnode->vn_fs) {
+        vput(&target_vnode);
+        vput(&parent_directory);
+        return -EXDEV;
+    }
     
     // Check name length limit
     if (name_length >= NAME_LEN) {
@@ -634,6 +1211,7 @@ long do_link(const char *oldpath, const char *newpath)
     
     // Create link
     status = parent_directory->vn_ops->link(parent_directory, null_terminated_name, name_length, target_vnode);
+    namev_cache_invalidate(parent_directory, null_terminated_name, name_length);
     
     // Unlock vnodes
     vunlock_in_order(parent_directory, target_vnode);
@@ -726,6 +1304,13 @@ long do_rename(const char *oldpath, const char *newpath)
         return -ENOTDIR;
     }
     
+    // Renames cannot cross mount points
+    if (old_directory->vn_fs != new_directory->vn_fs) {
+        vput(&old_directory);
+        vput(&new_directory);
+        return -EXDEV;
+    }
+
     // Verify rename operation exists
     if (!old_directory->vn_ops || !old_directory->vn_ops->rename) {
         vput(&old_directory);
@@ -747,6 +1332,8 @@ long do_rename(const char *oldpath, const char *newpath)
     // Perform rename operation
     status = old_directory->vn_ops->rename(old_directory, null_terminated_old_name, old_name_length,
                                          new_directory, null_terminated_new_name, new_name_length);
+    namev_cache_moved(old_directory, old_name, old_name_length);
+    namev_cache_moved(new_directory, new_name, new_name_length);
     
     // Unlock directories
     vunlock_in_order(old_directory, new_directory);
@@ -770,6 +1357,106 @@ long do_rename(const char *oldpath, const char *newpath)
  *  - Remember that p_cwd should not be locked upon return from this function.
  *  - (If doing MTP, must protect access to p_cwd)
  */
+#ifdef __GETCWD__
+/*
+ * Makes path, a MAXPATHLEN buffer that is freed, or NULL, the known path of
+ * curproc's working directory as of path generation gen (see
+ * namev_path_generation()). p_cwd_mutex is held.
+ */
+static void _cwd_path_set(char *path, uint64_t gen)
+{
+    if (curproc->p_cwd_path)
+    {
+        kfree(curproc->p_cwd_path);
+        curproc->p_cwd_path = NULL;
+    }
+    if (!path)
+    {
+        return;
+    }
+    size_t len = strlen(path) + 1;
+    curproc->p_cwd_path = kmalloc(len);
+    if (curproc->p_cwd_path)
+    {
+        memcpy(curproc->p_cwd_path, path, len);
+        curproc->p_cwd_gen = gen;
+    }
+    kfree(path);
+}
+
+/*
+ * Returns, in a MAXPATHLEN buffer, the path of the directory that path,
+ * which was resolved from the directory whose path is base, leads to, or
+ * NULL if base is NULL and path is relative, the result would not fit, or
+ * there is no memory. It is worked out from the names alone, which is
+ * right as there are no symbolic links to follow: "." stays where it is
+ * and ".." goes back a component, even across a mount point.
+ */
+static char *_cwd_path_join(const char *base, const char *path)
+{
+    if (*path != '/' && !base)
+    {
+        return NULL;
+    }
+    char *out = kmalloc(MAXPATHLEN);
+    if (!out)
+    {
+        return NULL;
+    }
+    // out holds "/a/b", with no trailing '/', and the root as ""
+    size_t len = 0;
+    if (*path != '/')
+    {
+        len = strlen(base);
+        KASSERT(len && len < MAXPATHLEN);
+        memcpy(out, base, len);
+        len = len == 1 ? 0 : len;
+    }
+    while (*path)
+    {
+        while (*path == '/')
+        {
+            path++;
+        }
+        const char *name = path;
+        while (*path && *path != '/')
+        {
+            path++;
+        }
+        size_t namelen = (size_t)(path - name);
+        if (!namelen || name_match(".", name, namelen))
+        {
+            continue;
+        }
+        if (name_match("..", name, namelen))
+        {
+            while (len && out[--len] != '/')
+                ;
+            continue;
+        }
+        if (len + 1 + namelen >= MAXPATHLEN)
+        {
+            kfree(out);
+            return NULL;
+        }
+        out[len++] = '/';
+        memcpy(out + len, name, namelen);
+        len += namelen;
+    }
+    if (!len)
+    {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return out;
+}
+#endif /* __GETCWD__ */
+
+/*
+ * With __GETCWD__, the path of the new working directory is worked out
+ * from path and the old one's, when that is known, so that do_getcwd()
+ * need not look for it.
+ */
 long do_chdir(const char *path)
 {
     vnode_t *new_working_directory;
@@ -779,18 +1466,32 @@ long do_chdir(const char *path)
     if (!curproc) {
         return -ENOENT;
     }
+
+#ifdef __GETCWD__
+    // Before the lookup, so that a rename made during it is not missed
+    kmutex_lock(&curproc->p_cwd_mutex);
+    uint64_t gen = namev_path_generation();
+#endif
     
     // Resolve path to vnode
     status = namev_resolve(curproc->p_cwd, path, &new_working_directory);
+    if (status >= 0 && !S_ISDIR(new_working_directory->vn_mode)) {
+        // Verify it's a directory
+        vput(&new_working_directory);
+        status = -ENOTDIR;
+    }
     if (status < 0) {
+#ifdef __GETCWD__
+        kmutex_unlock(&curproc->p_cwd_mutex);
+#endif
         return status;
     }
-    
-    // Verify it's a directory
-    if (!S_ISDIR(new_working_directory->vn_mode)) {
-        vput(&new_working_directory);
-        return -ENOTDIR;
-    }
+
+#ifdef __GETCWD__
+    long known = curproc->p_cwd_path && curproc->p_cwd_gen == gen;
+    _cwd_path_set(_cwd_path_join(known ? curproc->p_cwd_path : NULL, path),
+                  gen);
+#endif
     
     // Update current working directory
     vnode_t *old_working_directory = curproc->p_cwd;
@@ -800,10 +1501,69 @@ long do_chdir(const char *path)
     
     // Release old working directory reference
     vput(&old_working_directory);
-    
+
+#ifdef __GETCWD__
+    kmutex_unlock(&curproc->p_cwd_mutex);
+#endif
     return 0;
 }
 
+#ifdef __GETCWD__
+/*
+ * Copies the path of curproc's working directory, and a null terminator,
+ * into buf, of size bytes. The path kept since the last do_chdir() or
+ * do_getcwd() is used as long as no directory has been renamed or removed
+ * since (see namev_cache_moved()); otherwise it is looked up again with
+ * lookup_dirpath(), which walks ".." to the root.
+ *
+ * Return 0 on success, or:
+ *  - ERANGE: the path does not fit in size bytes
+ *  - ENOENT: the working directory has been removed
+ *  - ENOMEM: there is no memory to look the path up
+ *  - Propagate errors from lookup_dirpath
+ */
+long do_getcwd(char *buf, size_t size)
+{
+    long ret = 0;
+    kmutex_lock(&curproc->p_cwd_mutex);
+    uint64_t gen = namev_path_generation();
+    if (!curproc->p_cwd)
+    {
+        ret = -ENOENT;
+    }
+    else if (!curproc->p_cwd_path || curproc->p_cwd_gen != gen)
+    {
+        char *path = kmalloc(MAXPATHLEN);
+        ret = path ? lookup_dirpath(curproc->p_cwd, path, MAXPATHLEN)
+                   : -ENOMEM;
+        if (ret < 0 && path)
+        {
+            kfree(path);
+            path = NULL;
+        }
+        _cwd_path_set(path, gen);
+        if (!ret && !curproc->p_cwd_path)
+        {
+            ret = -ENOMEM;
+        }
+    }
+    if (!ret)
+    {
+        size_t len = strlen(curproc->p_cwd_path) + 1;
+        if (len > size)
+        {
+            ret = -ERANGE;
+        }
+        else
+        {
+            memcpy(buf, curproc->p_cwd_path, len);
+        }
+    }
+    kmutex_unlock(&curproc->p_cwd_mutex);
+    return ret;
+}
+#endif /* __GETCWD__ */
+
 /*
  * Read a directory entry from the file specified by fd into dirp.
  *
@@ -819,6 +1579,24 @@ long do_chdir(const char *path)
  *    sizeof(dirent_t).
  */
 ssize_t do_getdent(int fd, struct dirent *dirp)
+{
+    return do_getdents(fd, dirp, sizeof(dirent_t));
+}
+
+/*
+ * Read as many directory entries as fit in count bytes from the file
+ * specified by fd into dirp, with the vnode operation getdents if there is
+ * one and otherwise readdir for each, all with the vnode locked once.
+ *
+ * Return the number of bytes read, a multiple of sizeof(dirent_t) that is
+ * 0 at the end of the directory, or:
+ *  - EBADF: fd is invalid or is not open
+ *  - ENOTDIR: fd does not refer to a directory
+ *  - EINVAL: count is less than sizeof(dirent_t)
+ *  - Propagate errors from the vnode operations, unless some entries were
+ *    read first
+ */
+ssize_t do_getdents(int fd, struct dirent *dirp, size_t count)
 {
     // Validate file descriptor
     if (fd < 0 || fd >= NFILES) {
@@ -826,7 +1604,7 @@ ssize_t do_getdent(int fd, struct dirent *dirp)
     }
     
     // Get file object
-    file_t *file_obj = curproc->p_files[fd];
+    file_t *file_obj = fdtable_lookup(curproc->p_fdtable, fd);
     if (!file_obj) {
         return -EBADF;
     }
@@ -842,20 +1620,42 @@ ssize_t do_getdent(int fd, struct dirent *dirp)
     if (!target_vnode->vn_ops || !target_vnode->vn_ops->readdir) {
         return -EBADF;
     }
+
+    size_t max = count / sizeof(dirent_t);
+    if (!max) {
+        return -EINVAL;
+    }
     
-    // Perform readdir operation with proper locking
+    // Perform the reads with proper locking
+    kmutex_lock(&file_obj->f_pos_mutex);
     vlock(target_vnode);
-    ssize_t result = target_vnode->vn_ops->readdir(target_vnode, file_obj->f_pos, dirp);
-    
-    // Update position on success
-    if (result > 0) {
-        file_obj->f_pos += result;
-        result = sizeof(dirent_t);
+    size_t nread = 0;
+    ssize_t result;
+    if (target_vnode->vn_ops->getdents) {
+        result = target_vnode->vn_ops->getdents(target_vnode, file_obj->f_pos,
+                                                dirp, max, &nread);
+        if (result > 0) {
+            file_obj->f_pos += result;
+        }
+    } else {
+        do {
+            result = target_vnode->vn_ops->readdir(target_vnode,
+                                                   file_obj->f_pos,
+                                                   &dirp[nread]);
+            if (result > 0) {
+                file_obj->f_pos += result;
+                nread++;
+            }
+        } while (result > 0 && nread < max);
     }
     
     vunlock(target_vnode);
+    kmutex_unlock(&file_obj->f_pos_mutex);
     
-    return result;
+    if (result < 0 && !nread) {
+        return result;
+    }
+    return nread * sizeof(dirent_t);
 }
 
 /*
@@ -879,7 +1679,7 @@ off_t do_lseek(int fd, off_t offset, int whence)
     }
     
     // Get file object
-    file_t *file_obj = curproc->p_files[fd];
+    file_t *file_obj = fdtable_lookup(curproc->p_fdtable, fd);
     if (!file_obj) {
         return -EBADF;
     }
@@ -888,6 +1688,7 @@ off_t do_lseek(int fd, off_t offset, int whence)
     off_t new_position;
     
     // Calculate new position based on whence
+    kmutex_lock(&file_obj->f_pos_mutex);
     switch (whence) {
         case SEEK_SET:
             new_position = offset;
@@ -904,16 +1705,19 @@ off_t do_lseek(int fd, off_t offset, int whence)
             break;
             
         default:
-            return -EINVAL;
+            new_position = -1;
+            break;
     }
     
-    // Check for negative position
+    // Check for negative position (or a bad whence)
     if (new_position < 0) {
+        kmutex_unlock(&file_obj->f_pos_mutex);
         return -EINVAL;
     }
     
     // Update file position
     file_obj->f_pos = (size_t)new_position;
+    kmutex_unlock(&file_obj->f_pos_mutex);
     
     return new_position;
 }
@@ -921,76 +1725,184 @@ off_t do_lseek(int fd, off_t offset, int whence)
 /* Use buf to return the status of the file represented by path.
  *
  * Return 0 on success, or:
- *  - Propagate errors from namev_resolve() and the vnode operation stat.
+ *  - Propagate errors from do_fstatat()
  */
 long do_stat(const char *path, stat_t *buf)
+{
+    return do_fstatat(AT_FDCWD, path, buf);
+}
+
+/* Use buf to return the status of the file open as fd.
+ *
+ * Return 0 on success, or:
+ *  - EBADF: fd is invalid or is not open
+ *  - Propagate errors from the vnode operation stat.
+ */
+long do_fstat(int fd, stat_t *buf)
+{
+    file_t *file_obj = fget(fd);
+    if (!file_obj) {
+        return -EBADF;
+    }
+    vnode_t *target_vnode = file_obj->f_vnode;
+
+    long status = -EBADF;
+    if (target_vnode->vn_ops && target_vnode->vn_ops->stat) {
+        vlock(target_vnode);
+        status = target_vnode->vn_ops->stat(target_vnode, buf);
+        vunlock(target_vnode);
+    }
+
+    fput(&file_obj);
+    return status;
+}
+
+/* Use buf to return the status of the file represented by path, which is
+ * looked up from the directory open as dirfd if it is relative, or from
+ * the working directory if dirfd is AT_FDCWD. An empty path names dirfd
+ * itself, as with do_fstat(). ls stats every entry of a directory this way
+ * without walking the directory's own path again for each.
+ *
+ * Return 0 on success, or:
+ *  - EBADF: dirfd is not AT_FDCWD and is not open
+ *  - ENOTDIR: path is relative and not empty, and dirfd is not a directory
+ *  - Propagate errors from namev_resolve() and the vnode operation stat.
+ */
+long do_fstatat(int dirfd, const char *path, stat_t *buf)
 {
     vnode_t *target_vnode;
     long status;
-    
+
     // Ensure current process exists
     if (!curproc) {
         return -ENOENT;
     }
-    
-    // Resolve path to vnode
-    status = namev_resolve(curproc->p_cwd, path, &target_vnode);
+    if (dirfd != AT_FDCWD && !*path) {
+        return do_fstat(dirfd, buf);
+    }
+
+    // Resolve path to vnode, from dirfd's vnode if there is one
+    file_t *dir_file = NULL;
+    vnode_t *base = curproc->p_cwd;
+    if (dirfd != AT_FDCWD && path[0] != '/') {
+        dir_file = fget(dirfd);
+        if (!dir_file) {
+            return -EBADF;
+        }
+        base = dir_file->f_vnode;
+    }
+    if (dir_file && !S_ISDIR(base->vn_mode)) {
+        status = -ENOTDIR;
+    } else {
+        status = namev_resolve(base, path, &target_vnode);
+    }
+    if (dir_file) {
+        fput(&dir_file);
+    }
     if (status < 0) {
         return status;
     }
-    
+
     // Verify stat operation exists
     if (!target_vnode->vn_ops || !target_vnode->vn_ops->stat) {
         vput(&target_vnode);
         return -EBADF;
     }
-    
+
     // Perform stat operation with proper locking
     vlock(target_vnode);
     status = target_vnode->vn_ops->stat(target_vnode, buf);
     vunlock(target_vnode);
-    
+
     // Release reference
     vput(&target_vnode);
-    
+
     return status;
 }
 
 #ifdef __MOUNTING__
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutely sure your Weenix is perfect.
+ * This is the syscall entry point into vfs for mounting: makes a filesystem
+ * of the given type from source (a device name; a memory filesystem such as
+ * ramfs takes none) and mounts it on the directory target.
  *
- * This is the syscall entry point into vfs for mounting. You will need to
- * create the fs_t struct and populate its fs_dev and fs_type fields before
- * calling vfs's mountfunc(). mountfunc() will use the fields you populated
- * in order to determine which underlying filesystem's mount function should
- * be run, then it will finish setting up the fs_t struct. At this point you
- * have a fully functioning file system, however it is not mounted on the
- * virtual file system, you will need to call vfs_mount to do this.
- *
- * There are lots of things which can go wrong here. Make sure you have good
- * error handling. Remember the fs_dev and fs_type buffers have limited size
- * so you should not write arbitrary length strings to them.
+ * Returns 0, or:
+ *  - ENAMETOOLONG: source or type does not fit in an fs_t
+ *  - ENOMEM: the fs_t could not be allocated
+ *  - EINVAL: type is not a known filesystem
+ *  - Propagate errors from namev_resolve(), mountfunc() and vfs_mount()
  */
 int do_mount(const char *source, const char *target, const char *type)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: do_mount");
-    return -EINVAL;
+    if (!source)
+    {
+        source = "";
+    }
+    if (strlen(source) >= STR_MAX || strlen(type) >= STR_MAX)
+    {
+        return -ENAMETOOLONG;
+    }
+    vnode_t *mtpt;
+    long ret = namev_resolve(curproc->p_cwd, target, &mtpt);
+    if (ret)
+    {
+        return (int)ret;
+    }
+    fs_t *fs = kmalloc(sizeof(fs_t));
+    if (!fs)
+    {
+        vput(&mtpt);
+        return -ENOMEM;
+    }
+    memset(fs, 0, sizeof(fs_t));
+    strcpy(fs->fs_dev, source);
+    strcpy(fs->fs_type, type);
+    list_init(&fs->vnode_list);
+    kmutex_init(&fs->vnode_list_mutex);
+    kmutex_init(&fs->vnode_rename_mutex);
+    list_link_init(&fs->fs_link);
+
+    if ((ret = mountfunc(fs)))
+    {
+        kfree(fs);
+        vput(&mtpt);
+        return (int)ret;
+    }
+    if ((ret = vfs_mount(mtpt, fs)))
+    {
+        if (fs->fs_ops->umount)
+        {
+            fs->fs_ops->umount(fs);
+        }
+        else
+        {
+            vput(&fs->fs_root);
+        }
+        kfree(fs);
+        vput(&mtpt);
+    }
+    return (int)ret;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Unmounts the filesystem whose root target is (which, since lookups cross
+ * into it, is where it is mounted).
  *
- * This function delegates all of the real work to vfs_umount. You should not
- * worry about freeing the fs_t struct here, that is done in vfs_umount. All
- * this function does is figure out which file system to pass to vfs_umount and
- * do good error checking.
+ * Returns 0, or:
+ *  - EINVAL: target is not the root of a mounted filesystem
+ *  - Propagate errors from namev_resolve() and vfs_umount()
  */
 int do_umount(const char *target)
 {
-    NOT_YET_IMPLEMENTED("MOUNTING: do_umount");
-    return -EINVAL;
+    vnode_t *root;
+    long ret = namev_resolve(curproc->p_cwd, target, &root);
+    if (ret)
+    {
+        return (int)ret;
+    }
+    fs_t *fs = root->vn_fs;
+    long mounted = fs != &vfs_root_fs && root == fs->fs_root;
+    vput(&root);
+    return mounted ? vfs_umount(fs) : -EINVAL;
 }
 #endif
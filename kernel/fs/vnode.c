@@ -2,14 +2,23 @@
 #include "errno.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
+#include "fs/writeback.h"
 #include "kernel.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "mm/slab.h"
+#include "proc/spinlock.h"
 #include "util/debug.h"
 #include "util/string.h"
 #include <fs/vnode_specials.h>
 
 #define MOBJ_TO_VNODE(o) CONTAINER_OF((o), vnode_t, vn_mobj)
 
+STATIC_ASSERT(offsetof(vnode_t, vn_mobj.mo_refcount) + sizeof(atomic_t) <=
+                  CACHE_LINE_SIZE,
+              "a vnode's reference count left its first cache line");
+
 static long vnode_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              pframe_t **pfp);
 static long vnode_fill_pframe(mobj_t *o, pframe_t *pf);
@@ -21,6 +30,56 @@ static mobj_ops_t vnode_mobj_ops = {.get_pframe = vnode_get_pframe,
                                     .flush_pframe = vnode_flush_pframe,
                                     .destructor = vnode_destructor};
 
+/*
+ * vget finds vnodes by (fs, ino) in vnode_hash, whose buckets each have a
+ * mutex of their own; fs->vnode_list still has every vnode of fs, for the
+ * walks in vfs.c. When the last reference to a vnode goes away it is not
+ * freed but kept on vnode_lru, still in its bucket, so that a file used
+ * again soon does not have to be read in again, together with its pages.
+ * The least recently used are freed once there are more than
+ * VNODE_CACHE_MAX, or when reclaim asks (see vnode_shrinker).
+ *
+ * A cached vnode has a reference count of 0, so that nothing else can get
+ * at it. vget takes it off vnode_lru and gives it its reference back under
+ * vnode_lru_lock, the same lock that has to be held to take it off to be
+ * freed; a vnode with no references that is not on the list is on its way
+ * out, and vget waits for it to be gone, as it always has. vnode_lru_lock
+ * is taken with interrupts disabled, inside a bucket mutex if at all.
+ */
+#define VNODE_HASH_BUCKETS 256
+
+typedef struct vnode_bucket
+{
+    list_t vb_vnodes;
+    kmutex_t vb_mutex;
+} vnode_bucket_t;
+
+static vnode_bucket_t vnode_hash[VNODE_HASH_BUCKETS];
+static list_t vnode_lru = LIST_INITIALIZER(vnode_lru); /* most recent first */
+static size_t vnode_ncached;
+static spinlock_t vnode_lru_lock = SPINLOCK_INITIALIZER(vnode_lru_lock);
+
+static size_t vnode_cache_shrink(page_shrinker_t *shrinker, size_t target);
+
+static page_shrinker_t vnode_shrinker = {.ps_shrink = vnode_cache_shrink};
+
+void vnode_cache_init()
+{
+    for (size_t i = 0; i < VNODE_HASH_BUCKETS; i++)
+    {
+        list_init(&vnode_hash[i].vb_vnodes);
+        kmutex_init(&vnode_hash[i].vb_mutex);
+    }
+    page_shrinker_register(&vnode_shrinker);
+}
+
+static vnode_bucket_t *vnode_bucket(fs_t *fs, ino_t ino)
+{
+    uint64_t key = ((uintptr_t)fs >> 4) ^ ((uint64_t)ino << 1);
+    key *= 0x9e3779b97f4a7c15UL;
+    return &vnode_hash[(key >> 32) % VNODE_HASH_BUCKETS];
+}
+
 /**
  * locks the vnodes in the order of their inode number,
  * in the case that they are the same vnode, then only one vnode is locked.
@@ -107,28 +166,100 @@ void notify_vnode_loaded(vnode_t *vn)
     sched_broadcast_on(&vn->vn_waitq);
 }
 
+void vnode_ctor(void *obj)
+{
+    vnode_t *vn = obj;
+    memset(vn, 0, sizeof(vnode_t));
+    sched_queue_init(&vn->vn_waitq);
+    krwlock_init(&vn->vn_rwlock);
+    mobj_ctor(&vn->vn_mobj);
+    list_link_init(&vn->vn_link);
+    list_link_init(&vn->vn_hash_link);
+    list_link_init(&vn->vn_lru_link);
+    list_init(&vn->vn_namecache);
+    list_init(&vn->vn_nameref);
+}
+
+/*
+ * Initializes a vnode fresh out of its fs_vnode_allocator. The wait queue,
+ * locks and links were left as vnode_ctor made them by the vnode's previous
+ * user, so only the rest is reset here.
+ */
 void vnode_init(vnode_t *vn, fs_t *fs, ino_t ino, int state)
 {
+    KASSERT(sched_queue_empty(&vn->vn_waitq));
+    KASSERT(!list_link_is_linked(&vn->vn_link));
+    KASSERT(!list_link_is_linked(&vn->vn_hash_link));
+    KASSERT(!list_link_is_linked(&vn->vn_lru_link));
+    KASSERT(list_empty(&vn->vn_namecache));
+    KASSERT(list_empty(&vn->vn_nameref));
+    vn->vn_ops = NULL;
+#ifdef __MOUNTING__
+    vn->vn_mount = vn;
+#endif
+    vn->vn_mode = 0;
+    vn->vn_len = 0;
+    vn->vn_i = NULL;
+    vn->vn_exec = NULL;
+    vn->vn_devid = 0;
+    memset(&vn->vn_dev, 0, sizeof(vn->vn_dev));
     vn->vn_state = VNODE_LOADING;
     vn->vn_fs = fs;
     vn->vn_vno = ino;
-    sched_queue_init(&vn->vn_waitq);
-    mobj_init(&vn->vn_mobj, MOBJ_VNODE, &vnode_mobj_ops);
+    mobj_init_constructed(&vn->vn_mobj, MOBJ_VNODE, &vnode_mobj_ops);
     KASSERT(vn->vn_mobj.mo_refcount);
 }
 
+/*
+ * Gives a cached vnode its reference back. Returns 0 if vn has no references
+ * and is not cached either, because it is being freed.
+ */
+static long vnode_cache_revive(vnode_t *vn)
+{
+    long revived = 0;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vnode_lru_lock);
+    if (list_link_is_linked(&vn->vn_lru_link))
+    {
+        KASSERT(!vn->vn_mobj.mo_refcount);
+        list_remove(&vn->vn_lru_link);
+        vnode_ncached--;
+        atomic_set(&vn->vn_mobj.mo_refcount, 1);
+        revived = 1;
+    }
+    spinlock_unlock(&vnode_lru_lock);
+    if (enabled)
+        intr_enable();
+    return revived;
+}
+
+/*
+ * Takes a reference on vn, which the caller knows to be allocated and
+ * loaded but may hold no reference on: it may be unreferenced in the vnode
+ * cache. For the lookup fast path of namev_dir, which finds vnodes through
+ * the name cache. Returns 0 if vn is being freed.
+ */
+long vnode_tryref(vnode_t *vn)
+{
+    return atomic_inc_not_zero(&vn->vn_mobj.mo_refcount) ||
+           vnode_cache_revive(vn);
+}
+
 vnode_t *__vget(fs_t *fs, ino_t ino, int get_locked)
 {
+    vnode_bucket_t *bucket = vnode_bucket(fs, ino);
 find:
-    kmutex_lock(&fs->vnode_list_mutex);
-    list_iterate(&fs->vnode_list, vn, vnode_t, vn_link)
+    kmutex_lock(&bucket->vb_mutex);
+    list_iterate(&bucket->vb_vnodes, vn, vnode_t, vn_hash_link)
     {
-        if (vn->vn_vno == ino)
+        if (vn->vn_fs == fs && vn->vn_vno == ino)
         {
-            if (atomic_inc_not_zero(&vn->vn_mobj.mo_refcount))
+            if (atomic_inc_not_zero(&vn->vn_mobj.mo_refcount) ||
+                vnode_cache_revive(vn))
             {
-                /* reference acquired, we can release the per-FS list */
-                kmutex_unlock(&fs->vnode_list_mutex);
+                /* reference acquired, we can release the bucket */
+                kmutex_unlock(&bucket->vb_mutex);
                 await_vnode_loaded(vn);
                 if (get_locked)
                 {
@@ -139,7 +270,7 @@ find:
             else
             {
                 /* count must be 0, wait and try again later */
-                kmutex_unlock(&fs->vnode_list_mutex);
+                kmutex_unlock(&bucket->vb_mutex);
                 sched_yield();
                 goto find;
             }
@@ -150,16 +281,18 @@ find:
     dbg(DBG_VFS, "creating vnode %d\n", ino);
     vnode_t *vn = slab_obj_alloc(fs->fs_vnode_allocator);
     KASSERT(vn);
-    memset(vn, 0, sizeof(vnode_t));
 
     /* initialize the vnode state */
     vnode_init(vn, fs, ino, VNODE_LOADING);
 
-    /* add the vnode to the per-FS list, lock the vnode, and release the list
-     * (unblocking other `vget` calls) */
+    /* add the vnode to its bucket and the per-FS list, lock the vnode, and
+     * release the bucket (unblocking other `vget` calls) */
+    list_insert_tail(&bucket->vb_vnodes, &vn->vn_hash_link);
+    kmutex_lock(&fs->vnode_list_mutex);
     list_insert_tail(&fs->vnode_list, &vn->vn_link);
-    vlock(vn);
     kmutex_unlock(&fs->vnode_list_mutex);
+    vlock(vn);
+    kmutex_unlock(&bucket->vb_mutex);
 
     /* load the vnode */
     vn->vn_fs->fs_ops->read_vnode(vn->vn_fs, vn);
@@ -187,6 +320,27 @@ inline void vlock(vnode_t *vn) { mobj_lock(&vn->vn_mobj); }
 
 inline void vunlock(vnode_t *vn) { mobj_unlock(&vn->vn_mobj); }
 
+inline void vlock_shared(vnode_t *vn) { krwlock_read_lock(&vn->vn_rwlock); }
+
+inline void vunlock_shared(vnode_t *vn) { krwlock_read_unlock(&vn->vn_rwlock); }
+
+inline void vlock_exclusive(vnode_t *vn)
+{
+    krwlock_write_lock(&vn->vn_rwlock);
+    vlock(vn);
+    if (vn->vn_exec)
+    {
+        kfree(vn->vn_exec);
+        vn->vn_exec = NULL;
+    }
+}
+
+inline void vunlock_exclusive(vnode_t *vn)
+{
+    vunlock(vn);
+    krwlock_write_unlock(&vn->vn_rwlock);
+}
+
 inline void vput(struct vnode **vnp)
 {
     vnode_t *vn = *vnp;
@@ -201,6 +355,166 @@ inline void vput_locked(struct vnode **vnp)
     vput(vnp);
 }
 
+/*
+ * Copies len bytes of vn's page cache starting at byte pos into buf, for the
+ * read operations of filesystems whose files are cached in their vn_mobj.
+ * Stops at the end of the file. Pages the filesystem reports as holes (see
+ * page_is_hole) read as zeros without being cached.
+ *
+ * If locked is set, the caller holds the vnode lock throughout. Otherwise
+ * it holds only vn_rwlock shared: cached pages are then copied without the
+ * vnode lock, and a page that is not is read in, together with up to
+ * VNODE_IO_BATCH - 1 pages after it, with one acquisition of it.
+ *
+ * Returns the number of bytes read, or the error getting a page (a read is
+ * never partial).
+ */
+ssize_t vnode_read_cached(vnode_t *vn, size_t pos, void *buf, size_t len,
+                          long locked)
+{
+    if (pos >= vn->vn_len)
+    {
+        return 0;
+    }
+    len = MIN(len, vn->vn_len - pos);
+
+    size_t done = 0;
+    while (done < len)
+    {
+        pframe_t *pf = NULL;
+        if (!locked &&
+            !mobj_find_pframe_lockless(&vn->vn_mobj, pos / PAGE_SIZE, &pf))
+        {
+            size_t off = pos % PAGE_SIZE;
+            size_t n = MIN(PAGE_SIZE - off, len - done);
+            memcpy((char *)buf + done, (char *)pf->pf_addr + off, n);
+            pframe_release(&pf);
+            done += n;
+            pos += n;
+            continue;
+        }
+
+        if (!locked)
+        {
+            vlock(vn);
+        }
+        long ret = 0;
+        for (size_t i = 0; !ret && done < len && (locked || i < VNODE_IO_BATCH);
+             i++)
+        {
+            size_t pagenum = pos / PAGE_SIZE;
+            if (!vn->vn_ops->page_is_hole ||
+                !vn->vn_ops->page_is_hole(vn, pagenum))
+            {
+                ret = mobj_get_pframe(&vn->vn_mobj, pagenum, 0, &pf);
+                if (ret < 0)
+                {
+                    break;
+                }
+            }
+            size_t off = pos % PAGE_SIZE;
+            size_t n = MIN(PAGE_SIZE - off, len - done);
+            memcpy((char *)buf + done,
+                   (char *)(pf ? pf->pf_addr : pframe_zero_page) + off, n);
+            if (pf)
+            {
+                pframe_release(&pf);
+            }
+            done += n;
+            pos += n;
+        }
+        if (!locked)
+        {
+            vunlock(vn);
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+    return done;
+}
+
+/*
+ * Gets page pagenum of vn's page cache for sendfile, which copies out of it
+ * without a buffer in between. The caller holds vn_rwlock shared, and the
+ * page must lie within the file. *pfp is set to the pframe, pinned (see
+ * pframe_get) but not locked, so that the caller can go on to lock other
+ * vnodes while it holds the page; drop it with pframe_put. A hole sets
+ * *pfp to NULL, to be read as pframe_zero_page.
+ *
+ * Returns 0, or the error getting the page.
+ */
+long vnode_get_cached_page(vnode_t *vn, size_t pagenum, pframe_t **pfp)
+{
+    pframe_t *pf = NULL;
+    if (!mobj_find_pframe_lockless(&vn->vn_mobj, pagenum, &pf))
+    {
+        *pfp = pframe_get(pf);
+        pframe_release(&pf);
+        return 0;
+    }
+
+    long ret = 0;
+    vlock(vn);
+    if (!vn->vn_ops->page_is_hole || !vn->vn_ops->page_is_hole(vn, pagenum))
+    {
+        ret = mobj_get_pframe(&vn->vn_mobj, pagenum, 0, &pf);
+    }
+    *pfp = NULL;
+    if (pf)
+    {
+        *pfp = pframe_get(pf);
+        pframe_release(&pf);
+    }
+    vunlock(vn);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Copies len bytes from buf into vn's page cache starting at byte pos, for
+ * the write operations of filesystems whose files are cached in their
+ * vn_mobj. The caller holds the vnode lock and has made vn_len cover the
+ * whole range. writeback_throttle is given a chance to catch up with the
+ * dirty pages every VNODE_IO_BATCH pages.
+ *
+ * Returns len, or the error getting a page, in which case some of the
+ * range may have been written.
+ */
+ssize_t vnode_write_cached(vnode_t *vn, size_t pos, const void *buf,
+                           size_t len)
+{
+    KASSERT(kmutex_owns_mutex(&vn->vn_mobj.mo_mutex));
+    KASSERT(pos + len <= vn->vn_len);
+
+    size_t done = 0;
+    for (size_t i = 0; done < len; i++)
+    {
+        if (!(i % VNODE_IO_BATCH))
+        {
+            writeback_throttle(&vn->vn_mobj);
+        }
+        size_t off = pos % PAGE_SIZE;
+        size_t n = MIN(PAGE_SIZE - off, len - done);
+        // a page written from its start to its end, or to the end of the
+        // file, keeps nothing of what it held
+        long forwrite =
+            !off && (n == PAGE_SIZE || pos + n >= vn->vn_len) ? MOBJ_OVERWRITE
+                                                              : 1;
+        pframe_t *pf;
+        long ret = mobj_get_pframe(&vn->vn_mobj, pos / PAGE_SIZE, forwrite, &pf);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        memcpy((char *)pf->pf_addr + off, (const char *)buf + done, n);
+        pframe_release(&pf);
+        done += n;
+        pos += n;
+    }
+    return done;
+}
+
 static long vnode_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              pframe_t **pfp)
 {
@@ -223,28 +537,142 @@ static long vnode_flush_pframe(mobj_t *o, pframe_t *pf)
     return vnode->vn_ops->flush_pframe(vnode, pf);
 }
 
-static void vnode_destructor(mobj_t *o)
+/*
+ * Frees vn, which has no references and is neither cached nor about to be.
+ * vn is locked on entry.
+ */
+static void vnode_free(vnode_t *vn)
 {
-    vnode_t *vn = MOBJ_TO_VNODE(o);
-    dbg(DBG_VFS, "destroying vnode %d\n", vn->vn_vno);
-
-    /* lock, flush, and delete the vnode */
+    mobj_t *o = &vn->vn_mobj;
     KASSERT(!o->mo_refcount);
-    vlock(vn);
-    KASSERT(!o->mo_refcount);
-    KASSERT(!kmutex_has_waiters(&o->mo_mutex));
-    mobj_flush(o);
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(!list_link_is_linked(&vn->vn_lru_link));
+
+    /* drop the cached pages too, the vnode must go back to the allocator the
+     * way vnode_ctor left it */
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    {
+        kmutex_lock(&pf->pf_mutex);
+        if (mobj_free_pframe(o, &pf))
+        {
+            dbg(DBG_VFS, "WARNING: leaking a pframe of vnode %d\n", vn->vn_vno);
+            list_remove(&pf->pf_link);
+            pframe_release(&pf);
+        }
+    }
     if (vn->vn_fs->fs_ops->delete_vnode)
     {
         vn->vn_fs->fs_ops->delete_vnode(vn->vn_fs, vn);
     }
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
+    namev_cache_purge(vn);
+    if (vn->vn_exec)
+    {
+        kfree(vn->vn_exec);
+        vn->vn_exec = NULL;
+    }
     vunlock(vn);
 
-    /* remove the vnode from the list and free it*/
+    /* remove the vnode from its bucket and the list and free it */
+    vnode_bucket_t *bucket = vnode_bucket(vn->vn_fs, vn->vn_vno);
+    kmutex_lock(&bucket->vb_mutex);
+    KASSERT(list_link_is_linked(&vn->vn_hash_link));
+    list_remove(&vn->vn_hash_link);
+    kmutex_unlock(&bucket->vb_mutex);
     kmutex_lock(&vn->vn_fs->vnode_list_mutex);
     KASSERT(list_link_is_linked(&vn->vn_link));
     list_remove(&vn->vn_link);
     kmutex_unlock(&vn->vn_fs->vnode_list_mutex);
     slab_obj_free(vn->vn_fs->fs_vnode_allocator, vn);
 }
+
+/*
+ * Takes the least recently used cached vnode (of fs, unless it is NULL) off
+ * the cache and frees it. Returns 0 if there was none.
+ */
+static long vnode_cache_evict(fs_t *fs)
+{
+    vnode_t *victim = NULL;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vnode_lru_lock);
+    list_iterate_reverse(&vnode_lru, vn, vnode_t, vn_lru_link)
+    {
+        if (!fs || vn->vn_fs == fs)
+        {
+            list_remove(&vn->vn_lru_link);
+            vnode_ncached--;
+            victim = vn;
+            break;
+        }
+    }
+    spinlock_unlock(&vnode_lru_lock);
+    if (enabled)
+        intr_enable();
+
+    if (!victim)
+    {
+        return 0;
+    }
+    dbg(DBG_VFS, "evicting vnode %d\n", victim->vn_vno);
+    vlock(victim);
+    vnode_free(victim);
+    return 1;
+}
+
+/* Evicts cached vnodes, and the pages they hold, until target pages are
+ * free again. */
+static size_t vnode_cache_shrink(page_shrinker_t *shrinker, size_t target)
+{
+    size_t before = page_free_count();
+    size_t freed = 0;
+    while (freed < target && vnode_cache_evict(NULL))
+    {
+        size_t now = page_free_count();
+        freed = now > before ? now - before : 0;
+    }
+    return freed;
+}
+
+void vnode_cache_purge(fs_t *fs)
+{
+    fs->fs_vnode_nocache = 1;
+    while (vnode_cache_evict(fs))
+        ;
+}
+
+static void vnode_destructor(mobj_t *o)
+{
+    vnode_t *vn = MOBJ_TO_VNODE(o);
+    fs_t *fs = vn->vn_fs;
+    dbg(DBG_VFS, "releasing vnode %d\n", vn->vn_vno);
+
+    /* lock and flush the vnode */
+    KASSERT(!o->mo_refcount);
+    vlock(vn);
+    KASSERT(!o->mo_refcount);
+    KASSERT(!kmutex_has_waiters(&o->mo_mutex));
+    mobj_flush(o);
+
+    if (fs->fs_vnode_nocache ||
+        (fs->fs_ops->cache_vnode && !fs->fs_ops->cache_vnode(fs, vn)))
+    {
+        dbg(DBG_VFS, "destroying vnode %d\n", vn->vn_vno);
+        vnode_free(vn);
+        return;
+    }
+    vunlock(vn);
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vnode_lru_lock);
+    list_insert_head(&vnode_lru, &vn->vn_lru_link);
+    long excess = ++vnode_ncached > VNODE_CACHE_MAX;
+    spinlock_unlock(&vnode_lru_lock);
+    if (enabled)
+        intr_enable();
+    if (excess)
+    {
+        vnode_cache_evict(NULL);
+    }
+}
@@ -1,3 +1,4 @@
+#include <api/syscall.h>
 #include <errno.h>
 #include <fs/stat.h>
 #include <fs/vfs.h>
@@ -18,6 +19,11 @@ static long chardev_file_fill_pframe(vnode_t *file, pframe_t *pf);
 
 static long chardev_file_flush_pframe(vnode_t *file, pframe_t *pf);
 
+static long chardev_file_poll(vnode_t *file, struct file *f, long events,
+                              struct poll_table *pt);
+
+static long chardev_file_ioctl(vnode_t *file, unsigned long cmd, void *arg);
+
 static vnode_ops_t chardev_spec_vops = {
     .read = chardev_file_read,
     .write = chardev_file_write,
@@ -33,6 +39,8 @@ static vnode_ops_t chardev_spec_vops = {
     .get_pframe = NULL,
     .fill_pframe = chardev_file_fill_pframe,
     .flush_pframe = chardev_file_flush_pframe,
+    .poll = chardev_file_poll,
+    .ioctl = chardev_file_ioctl,
 };
 
 static ssize_t blockdev_file_read(vnode_t *file, size_t pos, void *buf,
@@ -167,6 +175,22 @@ static long chardev_file_flush_pframe(vnode_t *file, pframe_t *pf)
     return file->vn_dev.chardev->cd_ops->flush_pframe(file, pf);
 }
 
+static long chardev_file_poll(vnode_t *file, struct file *f, long events,
+                              struct poll_table *pt)
+{
+    // Defer to the underlying chardev's poll operation, if it has one
+    chardev_t *dev = file->vn_dev.chardev;
+    return dev->cd_ops->poll ? dev->cd_ops->poll(dev, events, pt)
+                             : POLLIN | POLLOUT;
+}
+
+static long chardev_file_ioctl(vnode_t *file, unsigned long cmd, void *arg)
+{
+    // Defer to the underlying chardev's ioctl operation, if it has one
+    chardev_t *dev = file->vn_dev.chardev;
+    return dev->cd_ops->ioctl ? dev->cd_ops->ioctl(dev, cmd, arg) : -ENOTTY;
+}
+
 static ssize_t blockdev_file_read(vnode_t *file, size_t pos, void *buf,
                                   size_t count)
 {
@@ -0,0 +1,358 @@
+/*
+ * The writeback daemon. Dirty file pages and filesystem blocks are otherwise
+ * only written when something flushes their memory object, which at the
+ * latest happens when the filesystem is unmounted. The daemon wakes every
+ * WRITEBACK_INTERVAL_SECS and writes back the pages that have been dirty
+ * for longer than WRITEBACK_EXPIRE_SECS, or all of them while too much of
+ * memory is dirty.
+ *
+ * Pages come off the dirty list kept by the pframe layer (see
+ * pframe_dirty_collect), a batch at a time. The whole batch is queued on
+ * the block devices at once, so that pages bound for consecutive blocks go
+ * out in single transfers (see blockdev.c).
+ *
+ * Everything the daemon locks is only tried, never waited for: the holder of
+ * a pframe may be waiting for the block cache the daemon is writing into, or
+ * for memory. Pages that are busy are left for the next pass. While a page
+ * is being written it is tagged MOBJ_TAG_WRITEBACK in its object's index.
+ */
+
+#include "errno.h"
+#include "globals.h"
+
+#include "drivers/blockdev.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/writeback.h"
+
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/time.h"
+#include "util/timer.h"
+
+/* jiffies are roughly milliseconds, see util/time.c */
+#define WRITEBACK_INTERVAL (WRITEBACK_INTERVAL_SECS * 1000UL)
+#define WRITEBACK_EXPIRE (WRITEBACK_EXPIRE_SECS * 1000UL)
+
+/* Pages taken off the dirty list at a time */
+#define WRITEBACK_BATCH 32
+
+typedef struct writeback_page
+{
+    pframe_t *wp_pf;
+    blockdev_t *wp_bd;
+} writeback_page_t;
+
+static kthread_t *writeback_thread;
+
+/* The daemon sleeps here between passes */
+static ktqueue_t writeback_wakeq = KTQUEUE_INITIALIZER(writeback_wakeq);
+
+/* Throttled writers sleep here until the end of a pass */
+static ktqueue_t writeback_doneq = KTQUEUE_INITIALIZER(writeback_doneq);
+
+/* Held for the duration of a pass, see writeback_pause */
+static kmutex_t writeback_mutex = KMUTEX_INITIALIZER(writeback_mutex);
+
+static size_t writeback_dirtyable()
+{
+    return page_free_count() + pframe_cache_count();
+}
+
+/*
+ * Returns the block device o's pages are written to, or NULL if they are not
+ * simply written to their pf_loc on one.
+ */
+static blockdev_t *_writeback_bdev(mobj_t *o)
+{
+    if (o->mo_type == MOBJ_FS)
+    {
+        return CONTAINER_OF(o, s5fs_t, s5f_mobj)->s5f_bdev;
+    }
+    if (o->mo_type == MOBJ_VNODE)
+    {
+        vnode_t *vn = CONTAINER_OF(o, vnode_t, vn_mobj);
+        if (vn->vn_fs && vn->vn_fs->fs_ops == &s5fs_fsops)
+        {
+            return FS_TO_S5FS(vn->vn_fs)->s5f_bdev;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Whether o is the block cache of a filesystem with a journal, whose blocks
+ * only its commits write (see s5fs_journal.c).
+ */
+static long _writeback_journaled(mobj_t *o)
+{
+    return o->mo_type == MOBJ_FS &&
+           s5_journal_enabled(CONTAINER_OF(o, s5fs_t, s5f_mobj));
+}
+
+/*
+ * Writes back the n pages of pages and marks them clean as they are written.
+ * Each is a request of its own, and they are all queued before any is waited
+ * for, so that the device's queue can merge those for consecutive blocks
+ * into single transfers.
+ */
+static void _writeback_write(writeback_page_t *pages, size_t n)
+{
+    blockdev_request_t reqs[WRITEBACK_BATCH];
+    for (size_t i = 0; i < n; i++)
+    {
+        reqs[i].br_buf = pages[i].wp_pf->pf_addr;
+        reqs[i].br_loc = (blocknum_t)pages[i].wp_pf->pf_loc;
+        reqs[i].br_count = 1;
+        reqs[i].br_write = 1;
+        reqs[i].br_callback = NULL;
+        blockdev_submit(pages[i].wp_bd, &reqs[i]);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        long ret = blockdev_wait(pages[i].wp_bd, &reqs[i]);
+        if (ret)
+        {
+            dbg(DBG_S5FS, "writeback of block %u failed: %ld\n",
+                reqs[i].br_loc, ret);
+            continue;
+        }
+        pframe_clear_dirty(pages[i].wp_pf);
+        MOBJ_STAT_INC(pages[i].wp_pf->pf_obj, ms_flushes);
+    }
+}
+
+/*
+ * Writes back the pages in refs, dropping the references. Returns how many
+ * were looked at but could not be locked or written.
+ *
+ * The objects stay locked until the pages have been written, since marking
+ * a page clean updates its object's index. Pages of one object may come up
+ * more than once in a batch, so an object the daemon already holds is not
+ * locked again.
+ */
+static size_t _writeback_batch(pframe_ref_t *refs, size_t nrefs)
+{
+    writeback_page_t pages[WRITEBACK_BATCH];
+    mobj_t *locked[WRITEBACK_BATCH];
+    size_t n = 0;
+    size_t nlocked = 0;
+    size_t skipped = 0;
+
+    for (size_t i = 0; i < nrefs; i++)
+    {
+        mobj_t *o = refs[i].pr_obj;
+        if (_writeback_journaled(o))
+        {
+            mobj_put(&refs[i].pr_obj);
+            continue;
+        }
+        if (kmutex_owns_mutex(&o->mo_mutex))
+        {
+            /* The first reference, in locked, keeps it alive */
+            mobj_put(&refs[i].pr_obj);
+        }
+        else if (kmutex_trylock(&o->mo_mutex))
+        {
+            locked[nlocked++] = o;
+        }
+        else
+        {
+            mobj_put(&refs[i].pr_obj);
+            skipped++;
+            continue;
+        }
+
+        pframe_t *pf = radix_tree_lookup(&o->mo_index, refs[i].pr_pagenum);
+        if (pf != refs[i].pr_pf || !kmutex_trylock(&pf->pf_mutex))
+        {
+            skipped++;
+            continue;
+        }
+        if (!pf->pf_dirty || !pf->pf_addr)
+        {
+            pframe_release(&pf);
+            continue;
+        }
+        blockdev_t *bd = _writeback_bdev(o);
+        if (!bd || !pf->pf_loc)
+        {
+            skipped += mobj_flush_pframe(o, pf) != 0;
+            pframe_release(&pf);
+            continue;
+        }
+        radix_tree_tag_set(&o->mo_index, pf->pf_pagenum, MOBJ_TAG_WRITEBACK);
+
+        /* Insertion sort by device, then block */
+        size_t j = n++;
+        while (j && (pages[j - 1].wp_bd > bd ||
+                     (pages[j - 1].wp_bd == bd &&
+                      pages[j - 1].wp_pf->pf_loc > pf->pf_loc)))
+        {
+            pages[j] = pages[j - 1];
+            j--;
+        }
+        pages[j].wp_pf = pf;
+        pages[j].wp_bd = bd;
+    }
+
+    _writeback_write(pages, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        pframe_t *pf = pages[i].wp_pf;
+        skipped += pf->pf_dirty != 0;
+        radix_tree_tag_clear(&pf->pf_obj->mo_index, pf->pf_pagenum,
+                             MOBJ_TAG_WRITEBACK);
+        pframe_release(&pf);
+    }
+    for (size_t i = 0; i < nlocked; i++)
+    {
+        mobj_put_locked(&locked[i]);
+    }
+    return skipped;
+}
+
+/* One pass over the dirty list */
+static void writeback_pass()
+{
+    pframe_ref_t refs[WRITEBACK_BATCH];
+    size_t written = 0;
+    size_t skipped = 0;
+
+    kmutex_lock(&writeback_mutex);
+    /* Every page on the list at the start is looked at no more than once
+     * or so, since pframe_dirty_collect rotates the list. */
+    for (size_t todo = pframe_dirty_count(); todo;)
+    {
+        uint64_t before;
+        if (pframe_dirty_count() * 100 >
+            writeback_dirtyable() * WRITEBACK_BACKGROUND_RATIO)
+        {
+            before = jiffies;
+        }
+        else if (jiffies >= WRITEBACK_EXPIRE)
+        {
+            before = jiffies - WRITEBACK_EXPIRE;
+        }
+        else
+        {
+            break;
+        }
+
+        size_t n = pframe_dirty_collect(refs, MIN(todo, WRITEBACK_BATCH), before);
+        if (!n)
+        {
+            break;
+        }
+        todo -= n;
+        size_t busy = _writeback_batch(refs, n);
+        written += n - busy;
+        skipped += busy;
+    }
+    /* The metadata of the blocks just allocated for the data, and more */
+    if (vfs_root_fs.fs_ops == &s5fs_fsops && vfs_root_fs.fs_i)
+    {
+        s5_journal_commit(FS_TO_S5FS(&vfs_root_fs));
+    }
+    kmutex_unlock(&writeback_mutex);
+
+    if (written || skipped)
+    {
+        dbg(DBG_S5FS, "wrote back %lu pages, %lu busy, %lu still dirty\n",
+            written, skipped, pframe_dirty_count());
+    }
+    sched_broadcast_on(&writeback_doneq);
+}
+
+static void writeback_timer_fire(uint64_t data)
+{
+    sched_broadcast_on(&writeback_wakeq);
+}
+
+static void *writeback_run(long arg1, void *arg2)
+{
+    timer_t timer;
+    timer_init(&timer);
+    timer.function = writeback_timer_fire;
+    while (1)
+    {
+        timer.expires = jiffies + WRITEBACK_INTERVAL;
+        timer_add(&timer);
+        sched_sleep_on(&writeback_wakeq);
+        timer_del(&timer);
+        writeback_pass();
+    }
+    return NULL;
+}
+
+/*
+ * Starts the writeback daemon. Its process is a child of the idle process,
+ * like init, so that init need not reap it and proc_kill_all leaves it be.
+ */
+void writeback_init()
+{
+    proc_t *proc = proc_create("writeback");
+    KASSERT(proc && "failed to create the writeback process");
+    writeback_thread = kthread_create_daemon(proc, writeback_run, 0, NULL);
+    KASSERT(writeback_thread && "failed to create the writeback thread");
+    sched_make_runnable(writeback_thread);
+}
+
+/* Starts a writeback pass now rather than at the end of the interval. */
+void writeback_wakeup() { sched_broadcast_on(&writeback_wakeq); }
+
+static long writeback_over_limit()
+{
+    return pframe_dirty_count() * 100 >
+           writeback_dirtyable() * WRITEBACK_THROTTLE_RATIO;
+}
+
+/*
+ * Called by writers before they dirty a page of locked, which they hold
+ * locked. If more than WRITEBACK_THROTTLE_RATIO percent of memory is dirty,
+ * the writer flushes locked itself, since the daemon can't while it is
+ * locked, and if that is not enough waits for a writeback pass. That way a
+ * single writer cannot fill memory with dirty pages faster than they can be
+ * written.
+ */
+void writeback_throttle(mobj_t *locked)
+{
+    if (!writeback_thread || curthr == writeback_thread ||
+        !writeback_over_limit())
+    {
+        return;
+    }
+    KASSERT(kmutex_owns_mutex(&locked->mo_mutex));
+    long ret = mobj_flush(locked);
+    if (ret)
+    {
+        dbg(DBG_S5FS, "throttled writer failed to flush: %ld\n", ret);
+    }
+    if (writeback_over_limit())
+    {
+        writeback_wakeup();
+        sched_sleep_on(&writeback_doneq);
+    }
+}
+
+/*
+ * Waits for any writeback pass in progress and keeps new ones from starting
+ * until writeback_resume. A filesystem must do this around freeing a memory
+ * object whose pages may be on the dirty list without waiting for its last
+ * reference to go away, as s5fs does with its block cache, since the daemon
+ * may be holding one.
+ */
+void writeback_pause() { kmutex_lock(&writeback_mutex); }
+
+void writeback_resume() { kmutex_unlock(&writeback_mutex); }
@@ -10,6 +10,8 @@ long copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 
 long copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+long clear_user(void *uaddr, size_t nbytes);
+
 long user_strdup(struct argstr *ustr, char **kstrp);
 
 long user_vecdup(struct argvec *uvec, char ***kvecp);
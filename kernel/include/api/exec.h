@@ -9,4 +9,6 @@ long do_execve(const char *filename, char *const *argv, char *const *envp,
 
 void kernel_execve(const char *filename, char *const *argv, char *const *envp);
 
+void kernel_enter_userland(uint64_t rip, uint64_t rsp);
+
 void userland_entry(struct regs regs);
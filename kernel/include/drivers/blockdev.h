@@ -12,11 +12,78 @@
 
 #include "mm/mobj.h"
 #include "mm/page.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
 
 #define BLOCK_SIZE PAGE_SIZE
 
+/* Most requests merged into a single transfer, see blockdev_ops_t.transfer */
+#define BLOCKDEV_MAX_SEGS 32
+
+/* Most blocks merged into a single transfer */
+#define BLOCKDEV_MAX_MERGE 256
+
+/* Jiffies a read, or a write, may wait in the queue before it is served ahead
+ * of the elevator's order */
+#define BLOCKDEV_READ_EXPIRE 50
+#define BLOCKDEV_WRITE_EXPIRE 500
+
+/* br_write, bi_write and the write argument of transfer are 0 for a read, 1
+ * for a write, or this for a forced unit access write: one that is only done
+ * once it is durable, rather than once it is in the device's write cache */
+#define BLOCKDEV_WRITE_FUA 3
+
+/* Number of log2 buckets in the request latency histogram reported by
+ * blockdev_info */
+#define BLOCKDEV_LAT_HIST_BUCKETS 16
+
 struct blockdev_ops;
 
+/*
+ * A request queued on a block device, see blockdev_submit. Requests are
+ * made by their submitters and must stay put until they are done: until
+ * blockdev_wait has returned for them or, for those with a br_callback,
+ * until it has been called.
+ */
+typedef struct blockdev_request
+{
+    list_link_t br_link; /* on bd_pending while queued */
+    char *br_buf;        /* page-aligned */
+    blocknum_t br_loc;
+    size_t br_count; /* blocks */
+    long br_write; /* 0, 1 or BLOCKDEV_WRITE_FUA */
+    /* Optional; called once the request is done, possibly from interrupt
+     * context, in which case no one may blockdev_wait for it. Only requests
+     * of up to BLOCKDEV_MAX_MERGE blocks may have one. */
+    void (*br_callback)(struct blockdev_request *req);
+    uint64_t br_submitted; /* jiffies */
+    uint64_t br_expires;
+    long br_done;
+    long br_ret; /* 0 or -errno, once br_done */
+} blockdev_request_t;
+
+/*
+ * Counters of a block device's queue, under bd_lock. Times are in jiffies.
+ */
+typedef struct blockdev_stats
+{
+    uint64_t bst_reads; /* requests done */
+    uint64_t bst_writes;
+    uint64_t bst_read_blocks;
+    uint64_t bst_write_blocks;
+    uint64_t bst_errors;    /* requests that failed */
+    uint64_t bst_transfers; /* commands the requests went out in */
+    uint64_t bst_merged;    /* requests that went out along with others */
+    size_t bst_queued;      /* requests waiting to be started */
+    size_t bst_max_queued;
+    size_t bst_inflight; /* transfers under way */
+    uint64_t bst_busy_since;
+    uint64_t bst_busy_ticks;     /* time with any transfer under way */
+    uint64_t bst_inflight_ticks; /* time each transfer was under way, summed */
+    /* requests by time from submission to done, log2 buckets */
+    uint64_t bst_latency[BLOCKDEV_LAT_HIST_BUCKETS];
+} blockdev_stats_t;
+
 /*
  * Represents a Weenix block device.
  */
@@ -27,10 +94,49 @@ typedef struct blockdev
 
     struct blockdev_ops *bd_ops;
 
+    /* Transfers the device can have under way at once; 1 if left 0 */
+    size_t bd_depth;
+
+    /* Blocks the device holds, or 0 if it does not know */
+    size_t bd_nblocks;
+
+    /* Whether submit carries out BLOCKDEV_WRITE_FUA writes; if not, they
+     * are carried out by their waiters, as a write followed by a flush */
+    long bd_fua;
+
     /* Link on the list of block-oriented devices */
     list_link_t bd_link;
+
+    /* The request queue, initialized by blockdev_register. bd_lock protects
+     * the rest of them, and is only taken at IPL_HIGH, since transfers
+     * finish in interrupt context. */
+    spinlock_t bd_lock;
+    list_t bd_pending;   /* requests not yet started, by block */
+    list_t bd_idle;      /* transfers not under way, bd_depth of them in all */
+    blocknum_t bd_head;  /* the block after the last one transferred */
+    ktqueue_t bd_waitq;  /* submitters, waiting for their requests */
+    blockdev_stats_t bd_stats;
 } blockdev_t;
 
+/* A piece of a transfer, see blockdev_ops_t.transfer */
+typedef struct blockdev_seg
+{
+    char *bs_buf; /* page-aligned */
+    size_t bs_count; /* blocks */
+} blockdev_seg_t;
+
+/* A transfer started with blockdev_ops_t.submit */
+typedef struct blockdev_io
+{
+    blockdev_seg_t bi_segs[BLOCKDEV_MAX_SEGS];
+    size_t bi_nsegs;
+    blocknum_t bi_loc;
+    long bi_write;
+    long bi_ret; /* 0 or -errno, once done */
+    /* Called from interrupt context once the transfer is done */
+    void (*bi_done)(struct blockdev_io *io);
+} blockdev_io_t;
+
 typedef struct blockdev_ops
 {
     /**
@@ -58,6 +164,55 @@ typedef struct blockdev_ops
      */
     long (*write_block)(blockdev_t *bdev, const char *buf, blocknum_t loc,
                         size_t block_count);
+
+    /**
+     * Reads or writes consecutive blocks to or from several buffers with a
+     * single command. This call will block. Optional: without it, requests
+     * are not merged.
+     *
+     * @param bdev the block device
+     * @param segs the buffers, in the order of the blocks
+     * @param nsegs the number of buffers, at most BLOCKDEV_MAX_SEGS
+     * @param loc the number of the block to start at
+     * @param write whether to write rather than read
+     * @return 0 on success, -errno on failure
+     */
+    long (*transfer)(blockdev_t *bdev, const blockdev_seg_t *segs,
+                     size_t nsegs, blocknum_t loc, long write);
+
+    /**
+     * Starts the transfer io describes and returns without waiting for it;
+     * io->bi_done is called once it is done. This call does not block, and
+     * may be made at IPL_HIGH or from interrupt context. Optional: without
+     * it, the thread that starts a transfer waits for it.
+     *
+     * @param bdev the block device
+     * @param io the transfer, which must stay put until it is done
+     * @return 0 if the transfer was started, -EBUSY if the device has no
+     *      room for another right now, or another -errno on failure
+     */
+    long (*submit)(blockdev_t *bdev, blockdev_io_t *io);
+
+    /**
+     * Tells the device of the transfers submit has started since the last
+     * call, all at once, for devices that are cheaper to tell of several
+     * than of each. Called, under the same conditions as submit, after
+     * submit has started one or more transfers. Optional: without it, submit
+     * must tell the device of each transfer itself.
+     *
+     * @param bdev the block device
+     */
+    void (*commit)(blockdev_t *bdev);
+
+    /**
+     * Writes back whatever the device holds in its write cache, so that
+     * every write done so far is durable. This call will block. Optional:
+     * without it, writes are taken to be durable once they are done.
+     *
+     * @param bdev the block device
+     * @return 0 on success, -errno on failure
+     */
+    long (*flush)(blockdev_t *bdev);
 } blockdev_ops_t;
 
 /**
@@ -81,6 +236,22 @@ long blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+void blockdev_submit(blockdev_t *bd, blockdev_request_t *req);
+
+void blockdev_unplug(blockdev_t *bd);
+
+long blockdev_wait(blockdev_t *bd, blockdev_request_t *req);
+
+long blockdev_read(blockdev_t *bd, char *buf, blocknum_t loc, size_t count);
+
+long blockdev_write(blockdev_t *bd, const char *buf, blocknum_t loc,
+                    size_t count);
+
+long blockdev_write_fua(blockdev_t *bd, const char *buf, blocknum_t loc,
+                        size_t count);
+
+long blockdev_barrier(blockdev_t *bd);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
@@ -89,6 +260,8 @@ blockdev_t *blockdev_lookup(devid_t id);
  */
 void blockdev_flush_all(blockdev_t *dev);
 
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+
 // restructure, perhaps, so that these don't have to be exported
 long blockdev_fill_pframe(mobj_t *mobj, pframe_t *pf);
 long blockdev_flush_pframe(mobj_t *mobj, pframe_t *pf);
\ No newline at end of file
@@ -8,6 +8,7 @@ struct pframe;
 
 struct chardev_ops;
 struct mobj;
+struct poll_table;
 
 typedef struct chardev
 {
@@ -27,6 +28,12 @@ typedef struct chardev_ops
     long (*fill_pframe)(struct vnode *file, struct pframe *pf);
 
     long (*flush_pframe)(struct vnode *file, struct pframe *pf);
+
+    /* See vn_ops->poll; NULL if the device is always ready */
+    long (*poll)(chardev_t *dev, long events, struct poll_table *pt);
+
+    /* See vn_ops->ioctl; NULL if the device has no requests */
+    long (*ioctl)(chardev_t *dev, unsigned long cmd, void *arg);
 } chardev_ops_t;
 
 /**
@@ -29,6 +29,13 @@
  *         - minor 0:          first disk device
  *         - minor 1:          second disk device
  *         - and so on...
+ *
+ *     - block major 2:        RAM disks
+ *         - minor 0:          /dev/ram0       The RAM disk, if there is one
+ *
+ *     - block major 3:        Striped devices
+ *         - minor 0:          /dev/md0        Disks 1 and on, striped, if
+ *                                             Config.mk asks for it
  */
 
 #define MINOR_BITS 8
@@ -41,9 +48,14 @@
 #define NULL_DEVID (MKDEVID(0, 0))
 #define MEM_NULL_DEVID (MKDEVID(1, 0))
 #define MEM_ZERO_DEVID (MKDEVID(1, 1))
+#define MEM_INFO_DEVID (MKDEVID(1, 2))
 
 #define DISK_MAJOR 1
+#define RAMDISK_MAJOR 2
+#define STRIPE_MAJOR 3
+#define VIRTIO_BLK_MAJOR 4
 
 #define MEM_MAJOR 1
 #define MEM_NULL_MINOR 0
 #define MEM_ZERO_MINOR 1
+#define MEM_INFO_MINOR 2
@@ -18,8 +18,10 @@
 #define AHCI_SECTORS_PER_PRDT (AHCI_MAX_PRDT_SIZE / ATA_SECTOR_SIZE)
 #define AHCI_MAX_SECTORS_PER_COMMAND \
     (1 << 16) /* FLAG: Where does this come from? */
-#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE \
-    (AHCI_MAX_SECTORS_PER_COMMAND / AHCI_SECTORS_PER_PRDT)
+/* Enough for a PRD per page of a transfer of BLOCKDEV_MAX_SEGS pages that are
+ * nowhere near each other, and to keep command_table_t a multiple of 128
+ * bytes, as it must be. */
+#define ACHI_NUM_PRDTS_PER_COMMAND_TABLE 56
 
 #define AHCI_MAX_NUM_PORTS 32
 #define AHCI_COMMAND_HEADERS_PER_LIST 32
@@ -66,6 +68,21 @@ typedef enum fis_type
 #define ATA_READ_FPDMA_QUEUED_COMMAND 0x60
 #define ATA_WRITE_FPDMA_QUEUED_COMMAND 0x61
 
+/* Forced unit access writes, which complete only once the data is on the
+ * media, and the commands that write back the device's cache, see 7.58,
+ * 7.10 and 7.11 of ATA Command Set 4. For an NCQ write, FUA is bit 7 of the
+ * device register instead. */
+#define ATA_WRITE_DMA_FUA_EXT_COMMAND 0x3d
+#define ATA_FLUSH_CACHE_COMMAND 0xe7
+#define ATA_FLUSH_CACHE_EXT_COMMAND 0xea
+#define ATA_DEVICE_FUA 0x80
+
+/* Commands Weenix only issues as it sets up a disk: IDENTIFY DEVICE, which
+ * reads 256 words describing it, and SET FEATURES, see 7.12 and 7.45. */
+#define ATA_IDENTIFY_DEVICE_COMMAND 0xec
+#define ATA_SET_FEATURES_COMMAND 0xef
+#define ATA_FEATURE_ENABLE_WRITE_CACHE 0x02
+
 /* 8-bit device setting for host-to-device FIS.
  * Bit 6 is specified as either obsolete or "shall be set to one" for all
  * commands used in Weenix. So, we can safely just default to this value for all
@@ -229,11 +246,33 @@ typedef union px_interrupt_enable {
     uint32_t value;
 } packed px_interrupt_enable_t;
 
+/* The interrupts a port raises as commands complete: DHRE, PSE, DSE, SDBE and
+ * DPE. These are turned off on ports whose completions are coalesced. */
+#define PX_INTERRUPT_ENABLE_COMPLETIONS 0x2f
+
 /* Weenix uses this to initialize all ports to enable all interrupts by default.
  */
 static px_interrupt_enable_t px_interrupt_enable_all_enabled = {
     .value = (uint32_t)-1};
 
+/* hba_ccc_ctl_t - Command Completion Coalescing Control: Has the HBA raise a
+ * single interrupt for several commands completing on the ports in
+ * hba_ghc_t->ccc_ports, rather than one each. More info in section 11 of
+ * 1.3.1. Written a whole register at a time. */
+typedef union hba_ccc_ctl {
+    struct
+    {
+        uint8_t en : 1; /* Enable: May only be set once cc and tv are. */
+        uint8_t : 2;
+        uint8_t intr : 5; /* Interrupt: Read-only. The bit of hba_ghc_t->is
+                             that is set for coalesced completions. */
+        uint8_t cc;       /* Command Completions: Interrupt after this many. */
+        uint16_t tv;      /* Timeout Value: Or this many milliseconds after the
+                             first of them, whichever comes first. */
+    } packed bits;
+    uint32_t value;
+} packed hba_ccc_ctl_t;
+
 /* hba_ghc_t - Generic Host Control: Information and control registers
  * pertaining to the entire HBA. More info in section 3.1 of 1.3.1.
  */
@@ -241,7 +280,10 @@ typedef struct hba_ghc
 {
     struct
     {
-        uint32_t : 30;
+        uint32_t : 7;
+        uint8_t cccs : 1; /* Supports Command Completion Coalescing. */
+        uint32_t ncs : 5; /* Number of Command Slots: per port, less one. */
+        uint32_t : 17;
         uint8_t sncq : 1; /* Supports Native Command Queueing. */
         uint8_t : 1;
     } packed cap;
@@ -258,7 +300,10 @@ typedef struct hba_ghc
                     interrupt. */
     uint32_t pi; /* Ports Implemented: If bit x is set, then port x is available
                     for use. */
-    uint32_t _omit[7];
+    uint32_t vs; /* Version. */
+    hba_ccc_ctl_t ccc_ctl; /* Command Completion Coalescing Control. */
+    uint32_t ccc_ports; /* Bit x is set if port x's completions are coalesced. */
+    uint32_t _omit[4];
 } packed hba_ghc_t;
 
 /* Signature for SATA devices. Compare this against hba_port_t->px_sig to
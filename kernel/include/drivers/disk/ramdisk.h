@@ -0,0 +1,10 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+
+/* Blocks of the RAM disk, one page each, or 0 for none (see Config.mk) */
+#ifndef __RAMDISK_BLOCKS__
+#define __RAMDISK_BLOCKS__ 2048
+#endif
+
+void ramdisk_init();
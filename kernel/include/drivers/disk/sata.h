@@ -7,6 +7,10 @@
 
 void sata_init();
 
+void sata_set_polling(blockdev_t *bdev, size_t spins);
+
+void sata_set_irq_affinity(uint8_t cores);
+
 typedef struct ata_disk
 {
     hba_port_t *port;
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+
+/* Disks striped together into the striped device, from disk 1 on, or 0 for
+ * none (see Config.mk) */
+#ifndef __STRIPE_DISKS__
+#define __STRIPE_DISKS__ 0
+#endif
+
+/* Blocks of each of them that the striped device is made of */
+#ifndef __STRIPE_BLOCKS__
+#define __STRIPE_BLOCKS__ 4096
+#endif
+
+/* Blocks of one disk the striped device holds before going on to the next */
+#ifndef __STRIPE_CHUNK__
+#define __STRIPE_CHUNK__ 16
+#endif
+
+void stripe_init();
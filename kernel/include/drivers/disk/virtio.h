@@ -0,0 +1,191 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Virtio devices over PCI, as of version 1.1 of the specification (OASIS,
+ * "Virtual I/O Device (VIRTIO) Version 1.1"), through the modern interface
+ * only, with split virtqueues. Section numbers below are the spec's. Every
+ * field is little-endian, as is x86.
+ */
+
+#define VIRTIO_PCI_VENDOR_ID 0x1af4
+/* 4.1.2.1: modern devices are 0x1040 plus their device type, transitional
+ * ones, which have the modern interface as well, are numbered from 0x1000 */
+#define VIRTIO_PCI_DEVICE_ID_MODERN(type) (0x1040 + (type))
+#define VIRTIO_PCI_DEVICE_ID_TRANSITIONAL_BLOCK 0x1001
+#define VIRTIO_ID_BLOCK 2
+
+/* 4.1.4: the vendor-specific capabilities of the device, one for each of
+ * its structures, which live in its BARs */
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+typedef struct virtio_pci_cap
+{
+    uint8_t cap_vndr; /* PCI_VENDOR_CAPABILITY_ID */
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type; /* one of the VIRTIO_PCI_CAP_*s */
+    uint8_t bar;
+    uint8_t padding[3];
+    uint32_t offset; /* of the structure, in the BAR */
+    uint32_t length;
+} packed virtio_pci_cap_t;
+
+/* 4.1.4.4: a virtqueue's notification register is at queue_notify_off of it
+ * times notify_off_multiplier from the start of the structure */
+typedef struct virtio_pci_notify_cap
+{
+    virtio_pci_cap_t cap;
+    uint32_t notify_off_multiplier;
+} packed virtio_pci_notify_cap_t;
+
+/* 4.1.4.3: the common configuration structure. The queue_* fields are those
+ * of the virtqueue queue_select picks. */
+typedef struct virtio_pci_common_cfg
+{
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    /* 64 bits wide, but written 32 bits at a time */
+    uint32_t queue_desc_lo;
+    uint32_t queue_desc_hi;
+    uint32_t queue_driver_lo;
+    uint32_t queue_driver_hi;
+    uint32_t queue_device_lo;
+    uint32_t queue_device_hi;
+} packed virtio_pci_common_cfg_t;
+
+/* queue_msix_vector and msix_config for no interrupt, or as read back when
+ * the device could not set up the vector asked for */
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+/* 2.1: bits of device_status */
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+/* 6: feature bits that are not the device type's own */
+#define VIRTIO_RING_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+
+/* 2.6.5: a buffer descriptor */
+#define VIRTQ_DESC_F_NEXT 1  /* the chain goes on at next */
+#define VIRTQ_DESC_F_WRITE 2 /* the device writes the buffer, not reads it */
+
+typedef struct virtq_desc
+{
+    uint64_t addr; /* physical */
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} packed virtq_desc_t;
+
+/* 2.6.6: the driver area, of the chains made available to the device. Its
+ * ring is followed by used_event, see VIRTQ_USED_EVENT. */
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+typedef struct virtq_avail
+{
+    uint16_t flags;
+    uint16_t idx; /* where the driver puts the next entry of ring, mod size */
+    uint16_t ring[];
+} packed virtq_avail_t;
+
+/* 2.6.8: the device area, of the chains the device is done with. Its ring is
+ * followed by avail_event, see VIRTQ_AVAIL_EVENT. */
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+typedef struct virtq_used_elem
+{
+    uint32_t id;  /* the chain's head descriptor */
+    uint32_t len; /* bytes the device wrote */
+} packed virtq_used_elem_t;
+
+typedef struct virtq_used
+{
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[];
+} packed virtq_used_t;
+
+/* 2.6.7, 2.6.10: with VIRTIO_RING_F_EVENT_IDX, the device only interrupts
+ * once it puts the used entry after used_event, and the driver only needs to
+ * notify it once it makes the available entry after avail_event available */
+#define VIRTQ_USED_EVENT(avail, size) ((avail)->ring[(size)])
+#define VIRTQ_AVAIL_EVENT(used, size) \
+    (*(volatile uint16_t *)&(used)->ring[(size)])
+
+/* Whether moving an index from old to new_idx takes it past event */
+static inline long virtq_need_event(uint16_t event, uint16_t new_idx,
+                                    uint16_t old)
+{
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/* 5.2.3: features of a block device */
+#define VIRTIO_BLK_F_SIZE_MAX 1 /* size_max is the most bytes per descriptor */
+#define VIRTIO_BLK_F_SEG_MAX 2  /* seg_max is the most data descriptors */
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_MQ 12 /* num_queues is the number of request queues */
+
+/* 5.2.4: a block device's configuration structure */
+typedef struct virtio_blk_config
+{
+    uint64_t capacity; /* in VIRTIO_BLK_SECTOR_SIZE sectors */
+    uint32_t size_max;
+    uint32_t seg_max;
+    struct
+    {
+        uint16_t cylinders;
+        uint8_t heads;
+        uint8_t sectors;
+    } packed geometry;
+    uint32_t blk_size;
+    struct
+    {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } packed topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
+} packed virtio_blk_config_t;
+
+/* 5.2.6: a request is a chain of its header, the data buffers, and a status
+ * byte the device writes */
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+typedef struct virtio_blk_req_hdr
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} packed virtio_blk_req_hdr_t;
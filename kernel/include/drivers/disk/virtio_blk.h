@@ -0,0 +1,80 @@
+#pragma once
+
+#include <drivers/blockdev.h>
+#include <drivers/disk/virtio.h>
+#include <main/apic.h>
+
+/* Most virtio-blk disks driven, numbered VIRTIO_BLK_MAJOR:0 on */
+#define VIRTIO_BLK_MAX_DISKS 8
+
+/* Most request virtqueues a disk is driven through: one for each core, which
+ * submits to its own, and whose interrupt goes to the cores that do. Queue
+ * q's interrupt is INTR_VIRTIO_BLK + q on every disk. */
+#define VIRTIO_BLK_MAX_QUEUES MAX_LAPICS
+
+/* Most descriptors a virtqueue is set up with */
+#define VIRTIO_BLK_MAX_QUEUE_SIZE 256
+
+/* Requests each virtqueue has under way at once, at most; each takes two
+ * descriptors besides those of its data, as many as it has physically
+ * contiguous pieces */
+#define VIRTIO_BLK_QUEUE_DEPTH 16
+
+void virtio_blk_init();
+
+/* The header and status of a request, which the device reads and writes */
+typedef struct virtio_blk_dma
+{
+    virtio_blk_req_hdr_t vm_hdr;
+    uint8_t vm_status;
+    uint8_t _pad[15];
+} packed virtio_blk_dma_t;
+
+/* A request slot of a virtqueue */
+typedef struct virtio_blk_req
+{
+    list_link_t vr_link;   /* on vq_idle while not in use */
+    virtio_blk_dma_t *vr_dma;
+    uint16_t vr_head;      /* the first descriptor of its chain */
+    /* The transfer started on it by virtio_blk_submit, or NULL if a thread
+     * is waiting for it on vr_waitq */
+    blockdev_io_t *vr_io;
+    ktqueue_t vr_waitq;
+    long vr_done;
+    long vr_ret;
+} virtio_blk_req_t;
+
+/*
+ * A request virtqueue. vq_lock protects all of it but the constant fields,
+ * and is only taken at IPL_HIGH.
+ */
+typedef struct virtio_blk_queue
+{
+    spinlock_t vq_lock;
+    uint16_t vq_index;
+    uint16_t vq_size; /* descriptors, a power of 2 */
+    virtq_desc_t *vq_desc;
+    volatile virtq_avail_t *vq_avail;
+    volatile virtq_used_t *vq_used;
+    volatile uint16_t *vq_notify; /* where the device is told of new chains */
+
+    uint16_t vq_free_head; /* descriptors not in a chain, linked by next */
+    uint16_t vq_nfree;
+    uint16_t vq_last_used; /* vq_used->idx as of the last completion */
+    uint16_t vq_notified;  /* vq_avail->idx as of the last notification */
+    list_t vq_idle;        /* request slots not in use */
+    ktqueue_t vq_slotq;    /* threads waiting for a slot or descriptors */
+    virtio_blk_req_t vq_reqs[VIRTIO_BLK_QUEUE_DEPTH];
+    /* The request each descriptor heads the chain of */
+    virtio_blk_req_t *vq_heads[VIRTIO_BLK_MAX_QUEUE_SIZE];
+} virtio_blk_queue_t;
+
+typedef struct virtio_blk_disk
+{
+    blockdev_t vd_bdev;
+    uint64_t vd_features; /* negotiated */
+    size_t vd_seg_max;    /* most data descriptors a request may have */
+    size_t vd_size_max;   /* most bytes each may have */
+    size_t vd_nqueues;
+    virtio_blk_queue_t *vd_queues;
+} virtio_blk_disk_t;
@@ -1,6 +1,29 @@
 #pragma once
 
+#include "types.h"
+
+struct file;
+
 /**
  * Initializes the memdevs subsystem.
  */
 void memdevs_init(void);
+
+/**
+ * Does a read(2) or write(2) of count bytes between file and the user buffer
+ * at ubuf without going through a kernel buffer, if file is the null or the
+ * zero device: writes to either are discarded without being copied in,
+ * reads of the null device are at their end and reads of the zero device
+ * zero ubuf in place (see clear_user). Neither device has a position.
+ *
+ * @param  file  the open file
+ * @param  ubuf  the user buffer
+ * @param  count the number of bytes to transfer
+ * @param  write whether to write rather than read
+ * @param  ret   set to the number of bytes transferred, or -EBADF if file is
+ *               not open for the transfer, -EINVAL if count overflows an
+ *               ssize_t, or -EFAULT
+ * @return       whether file is one of those devices, and ret was set
+ */
+long memdev_user_rw(struct file *file, void *ubuf, size_t count, long write,
+                    ssize_t *ret);
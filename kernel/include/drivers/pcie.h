@@ -8,6 +8,13 @@
 #define PCI_DEVICE_FUNCTION_SIZE 4096
 #define PCI_CAPABILITY_PTR_MASK (0b11111100)
 #define PCI_MSI_CAPABILITY_ID 0x5
+#define PCI_VENDOR_CAPABILITY_ID 0x9
+#define PCI_MSIX_CAPABILITY_ID 0x11
+
+/* Bits of the command register */
+#define PCI_COMMAND_MEMORY 0x2     /* decode accesses to memory BARs */
+#define PCI_COMMAND_BUS_MASTER 0x4 /* do DMA */
+#define PCI_COMMAND_INTX_DISABLE 0x400
 
 // Intel Vol 3A 10.11.1
 //#define MSI_BASE_ADDRESS 0x0FEE0000
@@ -48,6 +55,32 @@ typedef struct msi_capability
     } address_data;
 } packed msi_capability_t;
 
+/* PCI Local Bus 3.0, 6.8.2: MSI-X has a table of vectors in one of the BARs,
+ * each with an MSI address and data of its own */
+typedef struct msix_capability
+{
+    uint8_t id;
+    uint8_t next_cap;
+    uint16_t control; /* the table's size less 1 in bits 10:0 */
+    uint32_t table;   /* the BAR in bits 2:0, the offset in it in the rest */
+    uint32_t pba;
+} packed msix_capability_t;
+
+#define MSIX_CONTROL_ENABLE (1U << 15)
+#define MSIX_CONTROL_MASK_ALL (1U << 14)
+#define MSIX_TABLE_SIZE(control) (((control)&0x7ffU) + 1)
+#define MSIX_BIR_MASK 0x7U
+
+typedef struct msix_table_entry
+{
+    uint32_t addr_lo;
+    uint32_t addr_hi;
+    uint32_t data;
+    uint32_t control; /* MSIX_ENTRY_MASKED if masked */
+} packed msix_table_entry_t;
+
+#define MSIX_ENTRY_MASKED 0x1U
+
 typedef union pcie_device {
     struct
     {
@@ -105,8 +138,39 @@ typedef struct pcie_device_wrapper
     uint8_t interface;
     pcie_device_t *dev;
     list_link_t link;
+    /* Once pcie_msi_enable or pcie_msix_enable has turned it on, the
+     * capability the device interrupts through, and its MSI-X table */
+    msi_capability_t *msi;
+    msix_capability_t *msix;
+    volatile msix_table_entry_t *msix_table;
 } pcie_device_wrapper_t;
 
 void pci_init(void);
 
 pcie_device_t *pcie_lookup(uint8_t class, uint8_t subclass, uint8_t interface);
+
+pcie_device_t *pcie_lookup_next(pcie_device_t *prev, uint8_t class,
+                                uint8_t subclass, uint8_t interface);
+
+pci_capability_t *pcie_capability(pcie_device_t *dev, uint8_t id,
+                                  pci_capability_t *prev);
+
+uintptr_t pcie_map_bar(pcie_device_t *dev, uint8_t bar, uint32_t offset,
+                       uint32_t length);
+
+/*
+ * Message signalled interrupts: the device raises an interrupt by writing
+ * to a core's LAPIC itself, not through a shared line and the IOAPIC, so
+ * each of its vectors has a handler of its own (see intr_register) and goes
+ * to the cores it is sent to, a mask of APIC_CORE() bits, the one at the
+ * lowest priority of them taking each interrupt.
+ */
+
+long pcie_msi_enable(pcie_device_t *dev, uint8_t intr, uint8_t cores);
+
+void pcie_msi_set_cores(pcie_device_t *dev, uint8_t cores);
+
+long pcie_msix_enable(pcie_device_t *dev);
+
+long pcie_msix_set(pcie_device_t *dev, size_t entry, uint8_t intr,
+                   uint8_t cores);
@@ -1,9 +1,14 @@
 #pragma once
 
 #include "types.h"
+#include <fs/poll.h>
 #include <proc/kmutex.h>
 
-#define LDISC_BUFFER_SIZE 128
+#define LDISC_BUFFER_SIZE 4096
+
+/* The longest line that can be typed in canonical mode (POSIX MAX_CANON),
+ * not counting the newline that ends it */
+#define LDISC_LINE_MAX 255
 
 /**
  * The line discipline is implemented as a circular buffer containing two 
@@ -34,35 +39,49 @@
  * When incrementing the indices, make sure that you take the circularity of
  * the buffer into account! (Hint: using LDISC_BUFFER_SIZE macro will be helpful.) 
  * 
- * The field ldisc_full is used to indicate when the circular buffer has been
- * completely filled. This is necessary because there are two possible states
- * in which cooked == tail == head: 
- * 
- *      1) The buffer is empty, or 
- * 
- *      2) The buffer is full: head has wrapped around and is equal to tail. 
- * 
- * ldisc_full is used to differentiate between these two states.
+ * One byte of the buffer is always left unused, so that head == tail only
+ * when it is empty, and it is full when head is one behind tail.
+ *
+ * The buffer is a single-producer, single-consumer ring that needs no lock:
+ * ldisc_key_pressed(), in the keyboard interrupt, is the only writer of
+ * ldisc_head and ldisc_cooked, and the reader, under the tty's read mutex,
+ * is the only writer of ldisc_tail. Each side publishes its index with a
+ * release store once it is done with the characters it covers, and loads
+ * the other's with an acquire load, so the reader copies characters out
+ * with interrupts enabled. Only waiting for input needs the IPL raised.
+ *
+ * Without ICANON in ldisc_lflag (raw mode) nothing is edited: every
+ * character is cooked as it arrives, and the read(2) of a tty returns as
+ * ldisc_vmin and ldisc_vtime say, see termio_t in api/syscall.h.
  */
 typedef struct ldisc
 {
     size_t ldisc_cooked; // Cooked is the index after the most last or most recent '\n' in the buffer.
     size_t ldisc_tail;   // Tail is the index from which characters are read by processes
     size_t ldisc_head;   // Head is the index from which new characters are placed
-    char ldisc_full;     // Full identifies if the buffer is full
-                         // 1 -> full
-                         // 0 -> not full
+
+    unsigned int ldisc_lflag;  // ICANON and ECHO
+    unsigned char ldisc_vmin;  // raw mode: characters a read waits for
+    unsigned char ldisc_vtime; // raw mode: tenths of a second it waits
 
     ktqueue_t ldisc_read_queue; // Queue for threads waiting for data to be read
+    pollq_t ldisc_pollq;        // Callers of poll(2) waiting for the same
     char ldisc_buffer[LDISC_BUFFER_SIZE];
 } ldisc_t;
 
 void ldisc_init(ldisc_t *ldisc);
 
+long ldisc_readable(ldisc_t *ldisc);
+
 long ldisc_wait_read(ldisc_t *ldisc);
 
 size_t ldisc_read(ldisc_t *ldisc, char *buf, size_t count);
 
+ssize_t ldisc_read_raw(ldisc_t *ldisc, char *buf, size_t count);
+
+void ldisc_set_mode(ldisc_t *ldisc, unsigned int lflag, unsigned char vmin,
+                    unsigned char vtime);
+
 void ldisc_key_pressed(ldisc_t *ldisc, char c);
 
-size_t ldisc_get_current_line_raw(ldisc_t *ldisc, char *s);
\ No newline at end of file
+size_t ldisc_get_current_line_raw(ldisc_t *ldisc, char *s);
@@ -220,6 +220,13 @@ typedef struct vtconsole
 
     vtc_paint_handler_t on_paint;
     vtc_cursor_handler_t on_move;
+
+    /* While vtconsole_write runs, cells [dirty_start, dirty_end) and the
+     * cursor are only marked, and repainted once it is done. */
+    int deferred;
+    int dirty_start;
+    int dirty_end;
+    int cursor_moved;
 } vtconsole_t;
 
 typedef vtconsole_t vterminal_t;
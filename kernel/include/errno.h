@@ -3,10 +3,13 @@
 /* Kernel and user header (via symlink) */
 
 #ifndef __KERNEL__
+/* Each thread has its own errno; the first thread's is _libc_errno (see
+ * pthread.c in libc) */
 #ifndef errno
-#define errno _libc_errno
+#define errno (*__errno_location())
 #endif
 extern int _libc_errno;
+int *__errno_location(void);
 #endif
 
 #define EPERM 1    /* Operation not permitted */
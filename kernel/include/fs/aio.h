@@ -0,0 +1,19 @@
+#pragma once
+
+#include "types.h"
+
+/* Kernel threads that carry out asynchronous I/O requests, for all
+ * processes */
+#define AIO_WORKERS 4
+
+struct aio_cqe;
+struct aio_sqe;
+struct proc;
+
+void aio_init();
+
+long do_aio_submit(const struct aio_sqe *sqes, int nr);
+
+long do_aio_reap(struct aio_cqe *cqes, int min_nr, int nr);
+
+void aio_proc_exit(struct proc *proc);
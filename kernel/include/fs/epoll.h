@@ -0,0 +1,15 @@
+#pragma once
+
+#include "types.h"
+
+struct epoll_event;
+struct file;
+
+int do_epoll_create(void);
+
+long do_epoll_ctl(int epfd, int op, int fd, const struct epoll_event *event);
+
+long do_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+                   int timeout);
+
+void epoll_file_closed(struct file *file);
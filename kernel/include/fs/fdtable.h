@@ -0,0 +1,46 @@
+#pragma once
+
+#include "types.h"
+
+struct file;
+
+/* Descriptors a table has room for when it is first made, and the unit it
+ * grows by: one word of fdt_used. Tables grow up to NFILES. */
+#define FDTABLE_INIT_SIZE 64
+
+/*
+ * A process's file descriptor table, which maps each open descriptor to the
+ * file_t it refers to and holds one reference on it.
+ *
+ * fork() gives the child the parent's table itself rather than a copy;
+ * fdt_refcount counts the processes sharing it. The first change one of them
+ * makes (opening, closing or duplicating a descriptor) copies it first, see
+ * fdtable_reserve(), so a child that only uses the descriptors it was given,
+ * as most do between fork() and exit(), never pays for the copy.
+ *
+ * fdt_used has a bit for each descriptor, set while it is open, so that the
+ * lowest free one is found a word at a time.
+ *
+ * The table is only used by its process's thread, and is not locked.
+ */
+typedef struct fdtable
+{
+    size_t fdt_refcount;      /* processes using the table */
+    int fdt_size;             /* descriptors there is room for */
+    struct file **fdt_files;  /* fdt_size entries, NULL if closed */
+    uint64_t *fdt_used;       /* fdt_size bits */
+} fdtable_t;
+
+struct file *fdtable_lookup(fdtable_t *fdt, int fd);
+
+long fdtable_reserve(fdtable_t **fdtp, int fd);
+
+long fdtable_alloc(fdtable_t **fdtp, int *fd);
+
+void fdtable_install(fdtable_t *fdt, int fd, struct file *file);
+
+long fdtable_remove(fdtable_t **fdtp, int fd, struct file **filep);
+
+fdtable_t *fdtable_share(fdtable_t *fdt);
+
+void fdtable_put(fdtable_t **fdtp);
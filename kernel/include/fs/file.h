@@ -1,11 +1,18 @@
 #pragma once
 
+#include "proc/kmutex.h"
 #include "types.h"
+#include "util/list.h"
 
 #define FMODE_READ 1
 #define FMODE_WRITE 2
 #define FMODE_APPEND 4
-#define FMODE_MAX_VALUE (FMODE_READ | FMODE_WRITE | FMODE_APPEND)
+#define FMODE_DIRECT 8 /* opened with O_DIRECT */
+#define FMODE_MAX_VALUE (FMODE_READ | FMODE_WRITE | FMODE_APPEND | FMODE_DIRECT)
+
+/* Bounds on the read-ahead window of a file read sequentially, in pages */
+#define FILE_RA_INIT_PAGES 4
+#define FILE_RA_MAX_PAGES 32
 
 struct vnode;
 
@@ -35,6 +42,31 @@ typedef struct file
      * The vnode which corresponds to this file.
      */
     struct vnode *f_vnode;
+
+    /*
+     * Sequential read detection (see file_readahead): the f_pos a read
+     * continuing the last one would start at, and the number of pages
+     * currently read ahead of each read. The window doubles on every
+     * sequential read and closes on any other.
+     */
+    size_t f_ra_next;
+    size_t f_ra_pages;
+
+    /*
+     * Protects f_pos and the read-ahead state against the other users of
+     * this file_t (descriptors made by dup() or inherited through fork()).
+     * Descriptors opened separately each have their own, so they move their
+     * positions without contending for the vnode: reads and writes hold the
+     * vnode lock only around the transfer itself. Taken before the vnode
+     * lock, never while holding it.
+     */
+    kmutex_t f_pos_mutex;
+
+    /*
+     * The items of the epoll instances watching this file (see fs/epoll.c),
+     * which take themselves out as the last reference goes.
+     */
+    list_t f_epitems;
 } file_t;
 
 struct file *fcreate(int fd, struct vnode *vnode, unsigned int mode);
@@ -60,3 +92,5 @@ void fref(file_t *file);
  * The vnode release operation will also be called if it exists.
  */
 void fput(file_t **filep);
+
+void file_readahead(file_t *file, size_t len);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * The initramfs: a cpio archive, in the "newc" format that
+ * `cpio -o -H newc` writes, which the boot loader passes as a multiboot
+ * module. When there is one, the root filesystem is a ramfs rather than
+ * VFS_ROOTFS_DEV, and initproc fills it from the archive before it execs
+ * /sbin/init, so that booting reads nothing from disk.
+ */
+
+/* Returns whether the boot loader passed an initramfs */
+long initrd_present();
+
+/* Unpacks the initramfs into the root filesystem, once, and gives its
+ * pages to the page allocator. Returns the number of directories and files made, or
+ * -ENOENT if there is no initramfs (or it was unpacked already) or -EINVAL if it is malformed; each file
+ * that cannot be made is left out. */
+long initrd_unpack();
@@ -7,4 +7,18 @@
 
 #pragma once
 
+/* Most pages a pipe holds data in, which it gets as it fills up (see
+ * Config.mk) */
+#ifndef __PIPE_PAGES__
+#define __PIPE_PAGES__ 16
+#endif
+
+/* Writes to a pipe of up to this many bytes are never split up */
+#define PIPE_BUF 4096
+
+struct iovec;
+
 int do_pipe(int pipefd[2]);
+
+long do_vmsplice(int fd, const struct iovec *iov, int iovcnt,
+                 unsigned int flags);
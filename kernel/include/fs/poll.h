@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+#include "util/list.h"
+
+/*
+ * Something a caller can wait for a file to become ready on: the object
+ * behind the file (a pipe, a tty) keeps one, a vnode's poll operation
+ * registers the caller's poll table on it with poll_wait(), and whatever
+ * makes the object readable or writable calls pollq_wakeup() on it, which
+ * calls back each entry registered. Waking may be done from interrupt
+ * context, so the entries are added, removed and walked at IPL_HIGH.
+ */
+typedef struct pollq
+{
+    list_t pq_entries; /* of poll_entry_t */
+} pollq_t;
+
+#define POLLQ_INITIALIZER(pq)                               \
+    {                                                       \
+        .pq_entries = LIST_INITIALIZER((pq).pq_entries)     \
+    }
+
+/* A registration on a pollq, whose pe_wake is called when it is woken */
+typedef struct poll_entry
+{
+    list_link_t pe_link; /* on the pollq's pq_entries */
+    void (*pe_wake)(struct poll_entry *pe);
+} poll_entry_t;
+
+/*
+ * What a vnode's poll registers through: pt_register is given each pollq
+ * the file waits on, and adds an entry of the caller's to it. poll(2) and
+ * epoll (see fs/epoll.c) each embed one in state of their own.
+ */
+typedef struct poll_table
+{
+    void (*pt_register)(struct poll_table *pt, pollq_t *pq);
+} poll_table_t;
+
+struct file;
+struct pollfd;
+
+void pollq_init(pollq_t *pq);
+
+void poll_wait(poll_table_t *pt, pollq_t *pq);
+
+void pollq_add(pollq_t *pq, poll_entry_t *pe);
+
+void pollq_remove(poll_entry_t *pe);
+
+void pollq_wakeup(pollq_t *pq);
+
+short poll_file(struct file *file, short events, poll_table_t *pt);
+
+long do_poll(struct pollfd *fds, int nfds, int timeout);
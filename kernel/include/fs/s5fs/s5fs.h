@@ -17,21 +17,27 @@
 #include "fs/vnode.h"
 #include "mm/page.h"
 #include "proc/kmutex.h"
+#include "proc/spinlock.h"
 
 #endif
 
 #define S5_SUPER_BLOCK 0 /* the blockno of the superblock */
 #define S5_IS_SUPER(blkno) ((blkno) == S5_SUPER_BLOCK)
 
-#define S5_NBLKS_PER_FNODE 30
-
 #define S5_BLOCK_SIZE 4096
-#define S5_NDIRECT_BLOCKS 28
+#define S5_NEXTENTS 9
 #define S5_INODES_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS)
+/* The indirect blocks could map more, but s5_size has to hold the size */
+#define S5_MAX_FILE_BLOCKS (0xffffffffU / S5_BLOCK_SIZE)
 #define S5_MAX_FILE_SIZE (S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
 #define S5_NAME_LEN 28
+/* Bytes of file data an inode holds itself, which make it 256 bytes */
+#define S5_INLINE_SIZE 124
+#define S5_INLINE_DIRENTS (S5_INLINE_SIZE / sizeof(s5_dirent_t))
+
+/* s5_flags */
+#define S5_INODE_INLINE 0x1 /* the file's first bytes are in s5_inline */
 
 #define S5_TYPE_FREE 0x0
 #define S5_TYPE_DATA 0x1
@@ -40,9 +46,19 @@
 #define S5_TYPE_BLK 0x8
 
 #define S5_MAGIC 071177
-#define S5_CURRENT_VERSION 3
+#define S5_CURRENT_VERSION 8
+
+/* Most inode blocks read ahead for a block of a directory being listed */
+#define S5_INODE_RA_BLOCKS 8
+
+/* Files at least this many blocks long are freed by the reaper once they
+ * are gone, see s5fs_put_inode */
+#define S5_REAP_MIN_BLOCKS 256
+
+/* Threads s5fs_fsck starts to walk the directory tree with its caller */
+#define S5_FSCK_WORKERS 3
 
-/* Number of blocks stored in the indirect block */
+/* Number of blocks stored in an indirect block */
 #define S5_NIDIRECT_BLOCKS (S5_BLOCK_SIZE / sizeof(uint32_t))
 
 /* Given a file offset, returns the block number that it is in */
@@ -60,47 +76,138 @@
  */
 #define S5_INODE_OFFSET(inum) ((inum) % S5_INODES_PER_BLOCK)
 
+/* Disk blocks whose bits are in one block of the free block bitmap */
+#define S5_BITS_PER_BLOCK (S5_BLOCK_SIZE * 8)
+
+/* Given a disk block, tells the bitmap block and the bit that say whether it
+ * is in use */
+#define S5_BITMAP_BLOCK(super, blkno) \
+    ((super)->s5s_bitmap_block + (blkno) / S5_BITS_PER_BLOCK)
+#define S5_BITMAP_BYTE(blkno) ((blkno) % S5_BITS_PER_BLOCK / 8)
+#define S5_BITMAP_MASK(blkno) (1 << ((blkno) % 8))
+
+/* Disk blocks in an allocation group, see s5_group_t; a multiple of 8, so
+ * that no two groups share a byte of the bitmap */
+#define S5_GROUP_BLOCKS 512
+
+/* Given an inode number, tells the block of the inode bitmap with its bit;
+ * S5_BITMAP_BYTE and S5_BITMAP_MASK give the bit */
+#define S5_IBITMAP_BLOCK(super, inum) \
+    ((super)->s5s_ibitmap_block + (inum) / S5_BITS_PER_BLOCK)
+
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs) ((s5fs_t *)(fs)->fs_i)
 
-/* each node of the free block list looks like this: */
-/*
-typedef struct s5_fbl_node {
-        int free_blocks[S5_NBLKS_PER_FNODE-1];
-        int more;
-} s5_fbl_node_t;
-*/
-
 /* Note that all on-disk types need to have hard-coded sizes (to ensure
  * inter-machine compatibility of s5 disks) */
 
-/* The contents of the superblock, as stored on disk. */
+/*
+ * The contents of the superblock, as stored on disk.
+ *
+ * The disk is laid out as the super block, the inode blocks, then the
+ * s5s_bitmap_nblocks blocks of the free block bitmap, which has a bit for
+ * each block of the disk, set while the block is in use, then the
+ * s5s_ibitmap_nblocks blocks of the inode bitmap, which likewise has a bit
+ * for each inode, then the s5s_journal_nblocks blocks of the journal (see
+ * s5_journal_header_t), if there is one, and then the data blocks. The bits
+ * of the blocks before the data blocks, and of the blocks and inodes past
+ * the end that the last block of either bitmap has room for, are always
+ * set.
+ */
 typedef struct s5_super
 {
-    uint32_t s5s_magic;      /* the magic number */
-    uint32_t s5s_free_inode; /* the free inode pointer */
-    uint32_t s5s_nfree;      /* number of blocks currently in
-                              * s5s_free_blocks */
-    /* First "node" of free block list */
-    uint32_t s5s_free_blocks[S5_NBLKS_PER_FNODE];
+    uint32_t s5s_magic;          /* the magic number */
+    uint32_t s5s_nfree_inodes;   /* number of free inodes */
+    uint32_t s5s_nfree;          /* number of free blocks */
+    uint32_t s5s_num_blocks;     /* number of blocks on the disk */
+    uint32_t s5s_bitmap_block;   /* first block of the bitmap */
+    uint32_t s5s_bitmap_nblocks; /* number of blocks of the bitmap */
 
     uint32_t s5s_root_inode; /* root inode */
     uint32_t s5s_num_inodes; /* number of inodes */
     uint32_t s5s_version;    /* version of this disk format */
+
+    uint32_t s5s_journal_block;   /* first block of the journal */
+    uint32_t s5s_journal_nblocks; /* number of blocks of the journal, 0 if
+                                   * there is none */
+
+    uint32_t s5s_ibitmap_block;   /* first block of the inode bitmap */
+    uint32_t s5s_ibitmap_nblocks; /* number of blocks of the inode bitmap */
 } s5_super_t;
 
-/* The contents of an inode, as stored on disk. */
+#define S5_JOURNAL_MAGIC 0x6a726e6c
+
+/*
+ * The first block of the journal. Every other block of the disk whose
+ * contents are not file data, that is the super block, inode blocks, bitmap
+ * blocks, indirect blocks and directory blocks, is only written where it
+ * belongs once a copy of it has been: the copies of the blocks of a
+ * transaction go in the blocks after this one, then this block is written
+ * with s5j_nblocks set, which commits them, then the blocks are written
+ * home, and this block is written again with s5j_nblocks 0. A journal with
+ * s5j_nblocks set when the filesystem is mounted was interrupted, and is
+ * replayed. s5j_checksum covers s5j_seq and the copies, so that one whose
+ * copies did not all make it is recognized.
+ */
+typedef struct s5_journal_header
+{
+    uint32_t s5j_magic;    /* S5_JOURNAL_MAGIC, once anything is committed */
+    uint32_t s5j_seq;      /* sequence number of the transaction */
+    uint32_t s5j_nblocks;  /* blocks in it, 0 if there is nothing to replay */
+    uint32_t s5j_checksum; /* FNV-1a of s5j_seq and the copies */
+    uint32_t s5j_blocks[]; /* where each copy belongs */
+} s5_journal_header_t;
+
+/* The most blocks a transaction can have, given the size of the header */
+#define S5_JOURNAL_MAX_BLOCKS                                   \
+    ((S5_BLOCK_SIZE - sizeof(s5_journal_header_t)) / sizeof(uint32_t))
+
+/*
+ * A run of s5e_len file blocks, starting at file block s5e_block, that are
+ * stored in consecutive disk blocks starting at s5e_start. An extent with
+ * s5e_len 0 is unused.
+ */
+typedef struct s5_extent
+{
+    uint32_t s5e_block;
+    uint32_t s5e_start;
+    uint32_t s5e_len;
+} s5_extent_t;
+
+/*
+ * The contents of an inode, as stored on disk.
+ *
+ * A file block is found in s5_extents, which do not overlap and are in no
+ * particular order, or, failing that, in the indirect blocks: the first
+ * S5_NIDIRECT_BLOCKS file blocks are listed in s5_indirect_block, the rest in
+ * the indirect blocks that s5_dindirect_block lists. A block mapped by an
+ * extent is 0 in the indirect blocks. A block mapped by neither is sparse.
+ * New blocks extend the extent that ends just before them if they can be
+ * allocated right after it on the disk, or start a new extent while there
+ * is an unused one, so files written sequentially need few lookups in
+ * indirect blocks, or none.
+ *
+ * A file or directory with S5_INODE_INLINE set in s5_flags has the first
+ * S5_INLINE_SIZE bytes of its first block in s5_inline, and the rest of the
+ * block is zeros, instead of the block being mapped: a file no bigger than
+ * that, and a directory of no more than S5_INLINE_DIRENTS entries, takes no
+ * blocks at all, and is read along with its inode.
+ *
+ * For character and block devices, s5_indirect_block is the device id.
+ */
 typedef struct s5_inode
 {
     union {
-        uint32_t s5_next_free; /* inode free list ptr */
-        uint32_t s5_size;      /* file size */
+        uint32_t s5_size; /* file size */
     } s5_un;
     uint32_t s5_number;   /* this inode's number */
     uint16_t s5_type;     /* one of S5_TYPE_{FREE,DATA,DIR,CHR,BLK} */
     int16_t s5_linkcount; /* link count of this inode */
-    uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
+    s5_extent_t s5_extents[S5_NEXTENTS];
     uint32_t s5_indirect_block;
+    uint32_t s5_dindirect_block;
+    uint32_t s5_flags;
+    char s5_inline[S5_INLINE_SIZE];
 } s5_inode_t;
 
 typedef struct s5_node
@@ -108,6 +215,11 @@ typedef struct s5_node
     vnode_t vnode;
     s5_inode_t inode;
     long dirtied_inode;
+    s5_extent_t resv; /* blocks set aside for the pages being written back,
+                       * see s5_reserve_blocks */
+    size_t ndelayed;  /* written pages still without blocks, see
+                       * s5_delay_block */
+    struct s5_dirhash *dirhash; /* a big directory's index, or NULL */
 } s5_node_t;
 
 #define VNODE_TO_S5NODE(vn) CONTAINER_OF(vn, s5_node_t, vnode)
@@ -120,21 +232,69 @@ typedef struct s5_dirent
 } s5_dirent_t;
 
 #ifndef __FSMAKER__
+/*
+ * An allocation group: S5_GROUP_BLOCKS consecutive disk blocks, from a
+ * multiple of that, and s5f_group_inodes consecutive inodes, with their own
+ * lock for their bits of the bitmaps, so that threads allocating and
+ * freeing in different groups do not wait for each other. A file's inode
+ * goes in its directory's group, and its blocks in its inode's group, while
+ * they have room; see s5_alloc_inode and s5_alloc_blocks. The groups are
+ * not recorded on the disk, only counted up when it is mounted.
+ */
+typedef struct s5_group
+{
+    kmutex_t sg_mutex;
+    /* protected by sg_mutex, but read without it as a hint: */
+    uint32_t sg_nfree;        /* free blocks */
+    uint32_t sg_nfree_inodes; /* free inodes */
+    uint32_t sg_alloc_next;   /* where searches with no goal start */
+} s5_group_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs
 {
     blockdev_t *s5f_bdev;
-    s5_super_t s5f_super;
+    s5_super_t s5f_super;   /* the counts of free blocks and inodes are
+                             * changed atomically, under a group's lock */
     kmutex_t s5f_mutex;
     fs_t *s5f_fs;
     mobj_t s5f_mobj;
+    s5_group_t *s5f_groups;    /* the allocation groups */
+    uint32_t s5f_ngroups;
+    uint32_t s5f_group_inodes; /* inodes in a group, a multiple of
+                                * S5_INODES_PER_BLOCK */
+    /* protected by s5f_mutex: */
+    size_t s5f_ndelayed;     /* written pages still without blocks */
+    size_t s5f_nreserved;    /* blocks of the s5_node_t resv extents */
+    size_t s5f_nreaping;     /* inodes queued for the reaper, protected by
+                              * its lock (see s5fs.c) */
+    s5_extent_t *s5f_jfree;  /* blocks freed since the last commit */
+    size_t s5f_jnfree;       /* extents in s5f_jfree */
+    size_t s5f_jfree_size;   /* extents s5f_jfree has room for */
+
+    /* the journal, see s5fs_journal.c; protected by s5f_jlock: */
+    spinlock_t s5f_jlock;
+    size_t s5f_jhandles;     /* operations in progress */
+    long s5f_jcommitting;    /* set while a commit is in progress */
+    size_t s5f_jwanted;      /* threads waiting to commit */
+    ktqueue_t s5f_jwaitq;    /* for all of the above */
+    /* only used by the commit in progress: */
+    uint32_t s5f_jseq;       /* sequence number of the next transaction */
+    s5_journal_header_t *s5f_jhdr; /* a page for the header */
+    pframe_t **s5f_jpfs;     /* the blocks of the transaction */
 } s5fs_t;
 
 long s5fs_mount(struct fs *fs);
 
+long s5fs_fsck(struct fs *fs, long repair);
+
+extern fs_ops_t s5fs_fsops;
+
 void s5_get_meta_disk_block(s5fs_t *s5fs, uint64_t blocknum, long forwrite,
                        pframe_t **pfp);
 
+void s5_readahead_meta_blocks(s5fs_t *s5fs, uint64_t blocknum, size_t n);
+
 void s5_release_disk_block(pframe_t **pfp);
 
 #endif
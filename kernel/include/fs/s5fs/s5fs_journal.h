@@ -0,0 +1,22 @@
+#pragma once
+
+#include "mm/mobj.h"
+#include "mm/pframe.h"
+
+struct s5fs;
+
+long s5_journal_init(struct s5fs *s5fs);
+
+void s5_journal_destroy(struct s5fs *s5fs);
+
+long s5_journal_replay(struct s5fs *s5fs);
+
+void s5_journal_start(struct s5fs *s5fs);
+
+void s5_journal_stop(struct s5fs *s5fs);
+
+long s5_journal_commit(struct s5fs *s5fs);
+
+long s5_journal_enabled(struct s5fs *s5fs);
+
+long s5_journal_flush_pframe(mobj_t *mobj, pframe_t *pf);
@@ -13,12 +13,22 @@
 struct s5fs;
 struct s5_node;
 
-long s5_alloc_inode(struct s5fs *s5fs, uint16_t type, devid_t devid);
+long s5_groups_init(struct s5fs *s5fs);
+
+void s5_groups_destroy(struct s5fs *s5fs);
+
+long s5_alloc_inode(struct s5fs *s5fs, ino_t near, uint16_t type,
+                    devid_t devid);
 
 void s5_free_inode(struct s5fs *s5fs, ino_t ino);
 
+long s5_fsck_inodes(struct s5fs *s5fs, long repair);
+
 ssize_t s5_read_file(struct s5_node *sn, size_t pos, char *buf, size_t len);
 
+ssize_t s5_read_file_shared(struct s5_node *sn, size_t pos, char *buf,
+                            size_t len);
+
 ssize_t s5_write_file(struct s5_node *sn, size_t pos, const char *buf,
                       size_t len);
 
@@ -37,6 +47,32 @@ void s5_replace_dirent(struct s5_node *sn, const char *name, size_t namelen,
 long s5_file_block_to_disk_block(struct s5_node *sn, size_t file_blocknum,
                                  int alloc, int *new);
 
+long s5_file_block_run(struct s5_node *sn, size_t file_blocknum, size_t *runp);
+
+long s5_delay_block(struct s5_node *sn);
+
+void s5_undelay_blocks(struct s5_node *sn, size_t n);
+
+long s5_alloc_delayed_block(struct s5_node *sn, size_t file_blocknum);
+
+void s5_unreserve_blocks(struct s5_node *sn);
+
+long s5_prealloc_blocks(struct s5_node *sn, size_t file_blocknum,
+                        size_t nblocks);
+
+void s5_clear_unwritten(struct s5_node *sn, size_t oldlen, size_t newlen);
+
+void s5_dirhash_free(struct s5_node *sn);
+
+long s5_get_dirents(struct s5_node *sn, size_t pos, long forwrite,
+                    pframe_t **pfp, s5_dirent_t **direntsp);
+
+void s5_release_dirents(pframe_t **pfp);
+
+long s5_append_dirent(struct s5_node *sn, const s5_dirent_t *dirent);
+
+void s5_release_freed_blocks(struct s5fs *s5fs);
+
 long s5_inode_blocks(struct s5_node *vnode);
 
 void s5_remove_blocks(struct s5_node *vnode);
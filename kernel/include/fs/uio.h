@@ -0,0 +1,22 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+
+#include "sys/types.h"
+
+#endif
+
+/* One buffer of a readv() or writev(), which go through iov_len bytes at
+ * iov_base of each in turn */
+typedef struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+} iovec_t;
+
+/* Most buffers a single readv() or writev() takes */
+#define IOV_MAX 64
@@ -30,6 +30,15 @@ typedef struct fs_ops
      */
     void (*delete_vnode)(struct fs *fs, struct vnode *vn);
 
+    /*
+     * Optional. Called with the vnode locked when its reference count
+     * drops to 0, before delete_vnode. Return whether the vnode may stay
+     * cached for vget to find again, having written back what delete_vnode
+     * would have; delete_vnode is then only called once it is evicted. If
+     * not provided, every vnode is cached.
+     */
+    long (*cache_vnode)(struct fs *fs, struct vnode *vn);
+
     /*
      * Optional. Default behavior is to vput() fs_root.
      * Unmount the filesystem, performing any desired sanity checks
@@ -101,6 +110,8 @@ typedef struct fs
     struct slab_allocator *fs_vnode_allocator;
     list_t vnode_list;
     kmutex_t vnode_list_mutex;
+    long fs_vnode_nocache; /* set by vnode_cache_purge */
+    long fs_namev_nocache; /* names that change by themselves (procfs) */
     kmutex_t vnode_rename_mutex;
 
 } fs_t;
@@ -153,6 +164,26 @@ long namev_get_parent(struct vnode *dir, struct vnode **out);
 
 long namev_is_descendant(struct vnode *a, struct vnode *b);
 
+/* The cache of namev_lookup results (see namev.c). namev_cache_init is
+ * called once, before the root filesystem is mounted. Anything that adds,
+ * removes or renames an entry of dir must call namev_cache_invalidate for
+ * that name while it still has dir locked. namev_cache_purge forgets all
+ * of dir's entries, and those that resolve to it, for a vnode that is being
+ * freed. */
+void namev_cache_init();
+
+void namev_cache_invalidate(struct vnode *dir, const char *name,
+                            size_t namelen);
+
+/* namev_cache_invalidate for a name that may be a directory's, which is
+ * being renamed or removed, so that the paths of directories may change:
+ * namev_path_generation() changes with it. */
+void namev_cache_moved(struct vnode *dir, const char *name, size_t namelen);
+
+uint64_t namev_path_generation();
+
+void namev_cache_purge(struct vnode *dir);
+
 #ifdef __GETCWD__
 long lookup_name(struct vnode *dir, struct vnode *entry, char *buf,
                  size_t size);
@@ -160,3 +191,9 @@ long lookup_dirpath(struct vnode *dir, char *buf, size_t size);
 #endif /* __GETCWD__ */
 
 long mountfunc(fs_t *fs);
+
+#ifdef __MOUNTING__
+int vfs_mount(struct vnode *mtpt, fs_t *fs);
+
+int vfs_umount(fs_t *fs);
+#endif
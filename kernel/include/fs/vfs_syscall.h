@@ -7,6 +7,7 @@
 #include "fs/open.h"
 #include "fs/pipe.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 
 long do_close(int fd);
 
@@ -14,6 +15,29 @@ ssize_t do_read(int fd, void *buf, size_t len);
 
 ssize_t do_write(int fd, const void *buf, size_t len);
 
+struct file;
+
+ssize_t file_rw(struct file *file, const iovec_t *iov, int iovcnt, off_t off,
+                long write);
+
+ssize_t do_readv(int fd, const iovec_t *iov, int iovcnt);
+
+ssize_t do_writev(int fd, const iovec_t *iov, int iovcnt);
+
+ssize_t do_pread(int fd, void *buf, size_t len, off_t off);
+
+ssize_t do_pwrite(int fd, const void *buf, size_t len, off_t off);
+
+ssize_t do_direct_rw(int fd, void *ubuf, size_t len, off_t off, long write);
+
+ssize_t do_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+long do_fsync(int fd, long datasync);
+
+long do_fallocate(int fd, int mode, off_t off, off_t len);
+
+long do_ioctl(int fd, unsigned long cmd, void *arg);
+
 long do_dup(int fd);
 
 long do_dup2(int ofd, int nfd);
@@ -32,8 +56,24 @@ long do_rename(const char *oldpath, const char *newpath);
 
 long do_chdir(const char *path);
 
+#ifdef __GETCWD__
+long do_getcwd(char *buf, size_t size);
+#endif
+
 ssize_t do_getdent(int fd, struct dirent *dirp);
 
+ssize_t do_getdents(int fd, struct dirent *dirp, size_t count);
+
 off_t do_lseek(int fd, off_t offset, int whence);
 
 long do_stat(const char *path, struct stat *uf);
+
+long do_fstat(int fd, struct stat *buf);
+
+long do_fstatat(int dirfd, const char *path, struct stat *buf);
+
+#ifdef __MOUNTING__
+int do_mount(const char *source, const char *target, const char *type);
+
+int do_umount(const char *target);
+#endif
@@ -14,10 +14,12 @@
 #include "mm/mobj.h"
 #include "mm/pframe.h"
 #include "proc/kmutex.h"
+#include "proc/krwlock.h"
 #include "util/list.h"
 
 struct fs;
 struct dirent;
+struct poll_table;
 struct stat;
 struct file;
 struct vnode;
@@ -39,6 +41,9 @@ typedef struct vnode_ops
      * begins reading from the file at pos bytes into the file. On
      * success, it returns the number of bytes transferred, or 0 if the
      * end of the file has been reached (pos >= file->vn_len).
+     *
+     * read is called with vn_rwlock held shared and vn_mobj unlocked, so
+     * several reads of the same file may be in progress at once.
      */
     ssize_t (*read)(struct vnode *file, size_t pos, void *buf, size_t count);
 
@@ -128,6 +133,17 @@ typedef struct vnode_ops
      */
     ssize_t (*readdir)(struct vnode *dir, size_t pos, struct dirent *d);
 
+    /*
+     * Optional. getdents reads as many of dir's entries from offset pos on as
+     * fit in the count struct dirents at d, in one pass over the directory,
+     * and sets *nread to how many it read. Like readdir, it returns the
+     * amount offset should be increased by to get to the entry after the
+     * last one read, which is 0 (with *nread 0) at the end of the file.
+     * Without it, the VFS calls readdir for each entry.
+     */
+    ssize_t (*getdents)(struct vnode *dir, size_t pos, struct dirent *d,
+                        size_t count, size_t *nread);
+
     /* Operations that can be performed on any type of "file" (
      * includes normal file, directory, block/byte device */
     /*
@@ -172,8 +188,84 @@ typedef struct vnode_ops
     * Should only be used on regular files, not directories. 
     */
     void (*truncate_file)(struct vnode *vnode);
+
+    /*
+     * readahead brings npages pages of the file starting at pagenum into
+     * the page cache, if they are not there already, so that reads of them
+     * do not each have to wait for the disk. It is only a hint: failures
+     * are not reported. Called with vn_rwlock held shared.
+     */
+    void (*readahead)(struct vnode *vnode, size_t pagenum, size_t npages);
+
+    /*
+     * direct_io transfers the npages blocks of the file from pos, which is
+     * block-aligned, straight between the disk and pages (page-aligned
+     * kernel addresses of pinned pages) for O_DIRECT, instead of through
+     * the page cache; cached copies of the blocks are brought up to date
+     * first, and invalidated by a write. Reads stop at the end of the file,
+     * and writes extend it. Returns the number of bytes transferred, or
+     * -errno if none were. Called with vn_rwlock held shared for a read,
+     * and for a write with the vnode locked exclusive (vlock_exclusive).
+     * May be NULL; files of a filesystem without it cannot be opened with
+     * O_DIRECT.
+     */
+    ssize_t (*direct_io)(struct vnode *vnode, size_t pos, char **pages,
+                         size_t npages, long write);
+
+    /*
+     * page_is_hole tells vnode_read_cached whether page pagenum of the
+     * file is a hole with nothing cached for it, which reads see as zeros
+     * without it being given a page. Called with the vnode locked. May be
+     * NULL if files have no holes.
+     */
+    long (*page_is_hole)(struct vnode *vnode, size_t pagenum);
+
+    /*
+     * fsync writes the file's dirty pages, and what is needed to find them
+     * again, to the disk, and returns once they are there. Unless datasync
+     * is set the rest of the inode goes too; with it, the inode is only
+     * written if the data could not be found without it. Called with the
+     * vnode locked. May be NULL if nothing the file holds needs writing.
+     */
+    long (*fsync)(struct vnode *vnode, long datasync);
+
+    /*
+     * fallocate gives the file disk blocks for [pos, pos + len) ahead of
+     * its being written, as far as it has none there, so that later writes
+     * neither allocate nor fail for want of space. Blocks that were sparse
+     * read as zeros. Unless keep_size is set the file grows to pos + len if
+     * it is shorter. Returns 0, or -errno. Called with the vnode locked
+     * exclusive (vlock_exclusive). May be NULL if the filesystem cannot
+     * preallocate.
+     */
+    long (*fallocate)(struct vnode *vnode, size_t pos, size_t len,
+                      long keep_size);
+
+    /*
+     * poll returns which of POLLIN, POLLOUT, POLLERR and POLLHUP file, open
+     * on vnode, is ready for, and registers pt on the pollq that is woken
+     * when that changes with poll_wait() (see fs/poll.h). events are those
+     * the caller asked for, if that saves any work. Called at IPL_HIGH, so
+     * it must not sleep. May be NULL if the file is always ready, as
+     * regular files are.
+     */
+    long (*poll)(struct vnode *vnode, struct file *file, long events,
+                 struct poll_table *pt);
+
+    /*
+     * ioctl carries out request cmd of a device, with arg, a pointer into
+     * the caller's address space that the device copies to or from itself.
+     * Returns -ENOTTY for requests the device does not know. May be NULL if
+     * the file has none, as only ttys do.
+     */
+    long (*ioctl)(struct vnode *vnode, unsigned long cmd, void *arg);
 } vnode_ops_t;
 
+/*
+ * vn_ops, vn_vno, vn_mode, vn_len and the reference count in vn_mobj, which
+ * nearly every operation on a vnode reads, come first, to share a cache
+ * line (see vnode.c).
+ */
 typedef struct vnode
 {
     /*
@@ -189,22 +281,6 @@ typedef struct vnode
      */
     struct fs *vn_fs;
 
-#ifdef __MOUNTING__
-    /* This field is used only for implementing mount points (not required) */
-    /* This field points the the root of the file system mounted at
-     * this vnode. If no file system is mounted at this point this is a
-     * self pointer (i.e. vn->vn_mount = vn). See vget for why this is
-     * makes things easier for us. */
-    struct vnode *vn_mount;
-#endif
-
-    /*
-     * The object responsible for managing the memory where pages read
-     * from this file reside. The VFS subsystem may use this field, but it
-     * does not need to create it.
-     */
-    struct mobj vn_mobj;
-
     /*
      * A number which uniquely identifies this vnode within its filesystem.
      * (Similar and usually identical to what you might know as the inode
@@ -225,12 +301,43 @@ typedef struct vnode
      */
     size_t vn_len;
 
+#ifdef __MOUNTING__
+    /* This field is used only for implementing mount points (not required) */
+    /* This field points the the root of the file system mounted at
+     * this vnode. If no file system is mounted at this point this is a
+     * self pointer (i.e. vn->vn_mount = vn). See vget for why this is
+     * makes things easier for us. */
+    struct vnode *vn_mount;
+#endif
+
+    /*
+     * The object responsible for managing the memory where pages read
+     * from this file reside. The VFS subsystem may use this field, but it
+     * does not need to create it.
+     */
+    struct mobj vn_mobj;
+
+    /*
+     * Guards the contents and length of a regular file or device. Reads
+     * take it shared; anything that changes the contents or vn_len (write,
+     * truncate) takes it exclusive, in addition to locking vn_mobj.
+     */
+    krwlock_t vn_rwlock;
+
     /*
      * A generic pointer which the file system can use to store any extra
      * data it needs.
      */
     void *vn_i;
 
+    /*
+     * What the ELF loader has made of the file's headers, so that exec of
+     * it does not read them again (see api/elf.c). Protected by vn_rwlock:
+     * set under a shared hold, and dropped by vlock_exclusive, as the
+     * contents may be about to change.
+     */
+    void *vn_exec;
+
     /*
      * The device identifier.
      * Only relevant to vnodes representing device files.
@@ -256,7 +363,11 @@ typedef struct vnode
     } vn_dev;
 
     /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
-    list_link_t vn_link; /* link on system vnode list */
+    list_link_t vn_link;      /* link on system vnode list */
+    list_link_t vn_hash_link; /* link in its vget hash bucket */
+    list_link_t vn_lru_link;  /* link on the cache of unreferenced vnodes */
+    list_t vn_namecache;      /* name cache entries in this directory */
+    list_t vn_nameref;        /* name cache entries that resolve to it */
 } vnode_t;
 
 void init_special_vnode(vnode_t *vn);
@@ -287,6 +398,24 @@ void vlock(vnode_t *vn);
  */
 void vlock_in_order(vnode_t *a, vnode_t *b);
 
+/*
+ * Sets up the table vget looks vnodes up in. Called once, before the root
+ * filesystem is mounted.
+ */
+void vnode_cache_init();
+
+/*
+ * Frees the vnodes of fs that are only still around because they are
+ * cached, and stops caching them, for a filesystem about to be unmounted.
+ */
+void vnode_cache_purge(struct fs *fs);
+
+/*
+ * Slab constructor for vnodes. Every fs_vnode_allocator must be created with
+ * it (see slab_allocator_create_ctor); vget relies on it.
+ */
+void vnode_ctor(void *obj);
+
 /*
  * Acquires a vnode locked (see vget above)
  */
@@ -307,12 +436,35 @@ void vunlock(vnode_t *vn);
  */
 void vunlock_in_order(vnode_t *a, vnode_t *b);
 
+/**
+ * Takes a vnode's vn_rwlock shared, for reading its contents
+ */
+void vlock_shared(vnode_t *vn);
+
+/**
+ * Releases a shared hold on a vnode's vn_rwlock
+ */
+void vunlock_shared(vnode_t *vn);
+
+/**
+ * Takes a vnode's vn_rwlock exclusive and locks the vnode, for changing its
+ * contents or length
+ */
+void vlock_exclusive(vnode_t *vn);
+
+/**
+ * Undoes vlock_exclusive
+ */
+void vunlock_exclusive(vnode_t *vn);
+
 /*
  * Increments the reference count of the provided vnode
  * (i.e. the refcount of vn_mobj). 
  */
 void vref(vnode_t *vn);
 
+long vnode_tryref(vnode_t *vn);
+
 /*
  * This function decrements the reference count on this vnode 
  * (i.e. the refcount of vn_mobj).
@@ -327,6 +479,18 @@ void vref(vnode_t *vn);
  */
 void vput(vnode_t **vnp);
 
+/* Pages vnode_read_cached gets with one acquisition of the vnode lock, and
+ * vnode_write_cached writes between calls to writeback_throttle */
+#define VNODE_IO_BATCH 16
+
+ssize_t vnode_read_cached(vnode_t *vn, size_t pos, void *buf, size_t len,
+                          long locked);
+
+ssize_t vnode_write_cached(vnode_t *vn, size_t pos, const void *buf,
+                           size_t len);
+
+long vnode_get_cached_page(vnode_t *vn, size_t pagenum, pframe_t **pfp);
+
 /* Auxilliary: */
 
 /* Unmounting (shutting down the VFS) is the primary reason for the
@@ -0,0 +1,24 @@
+#pragma once
+
+/* Seconds between writeback passes, and the age at which a dirty page is
+ * written back during one. */
+#define WRITEBACK_INTERVAL_SECS 5
+#define WRITEBACK_EXPIRE_SECS 30
+
+/* Percentages of dirtyable memory (free pages plus the page cache). Over
+ * the background ratio, the daemon writes back dirty pages regardless of
+ * age; over the throttle ratio, writers wait for it. */
+#define WRITEBACK_BACKGROUND_RATIO 10
+#define WRITEBACK_THROTTLE_RATIO 20
+
+void writeback_init();
+
+void writeback_wakeup();
+
+struct mobj;
+
+void writeback_throttle(struct mobj *locked);
+
+void writeback_pause();
+
+void writeback_resume();
@@ -6,6 +6,13 @@
 
 #define CORE_SPECIFIC_DATA __attribute__((section(".csd"))) = {0}
 
-extern core_t curcore;
-extern proc_t *curproc;
-extern kthread_t *curthr;
+extern core_t csd_curcore;
+extern proc_t *csd_curproc;
+extern kthread_t *csd_curthr;
+
+/* This core, and the process and thread it is running. curproc and curthr
+ * are read in one access, since the thread may move between cores at any
+ * time; they are set with CSD_WRITE(). */
+#define curcore CSD(csd_curcore)
+#define curproc CSD_READ(csd_curproc)
+#define curthr CSD_READ(csd_curthr)
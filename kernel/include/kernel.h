@@ -44,6 +44,32 @@ extern void *kernel_phys_end;
 #define CONTAINER_OF(obj, type, member) \
     ((type *)((char *)(obj)-offsetof(type, member)))
 
+/* Fails the build unless cond, a constant expression, holds */
+#define STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+
+/*
+ * How much checking is compiled in, as set by PROFILE in Config.mk (see
+ * Global.mk). KASSERT()s are cheap and always on. KASSERT_DEBUG()s, and
+ * dbg() messages, are compiled out of release kernels. KASSERT_PARANOID()s
+ * are too costly for the hot paths they are on but in paranoid kernels.
+ */
+#define ASSERT_LEVEL_RELEASE 0
+#define ASSERT_LEVEL_DEBUG 1
+#define ASSERT_LEVEL_PARANOID 2
+#ifndef __ASSERT_LEVEL__
+#define __ASSERT_LEVEL__ ASSERT_LEVEL_DEBUG
+#endif
+
+/*
+ * Data written by one core and used by others should not share a cache
+ * line with anything else: a line written on one core is taken away from
+ * every other core holding it, whichever part of it they wanted. Per-core
+ * entries of the arrays indexed by core id are aligned, and so padded, to
+ * a line each.
+ */
+#define CACHE_LINE_SIZE 64
+#define CACHE_LINE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
 /* This truly atrocious macro hack taken from the wikipedia article on the C
  * preprocessor, use to "quote" the value (or name) of another macro:
  * QUOTE_BY_NAME(NTERMS) -> "NTERMS"
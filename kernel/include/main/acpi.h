@@ -18,3 +18,26 @@ typedef struct acpi_header
 void acpi_init();
 
 void *acpi_table(uint32_t signature, int index);
+
+/*
+ * A memory range and the proximity domain (node) it belongs to, as described
+ * by the ACPI System Resource Affinity Table.
+ */
+typedef struct acpi_mem_affinity
+{
+    uint64_t ama_base;
+    uint64_t ama_len;
+    uint32_t ama_node;
+} acpi_mem_affinity_t;
+
+/*
+ * Fills out with up to max enabled SRAT memory ranges and returns how many
+ * were found. Returns 0 if the firmware provides no SRAT.
+ */
+size_t acpi_srat_memory(acpi_mem_affinity_t *out, size_t max);
+
+/*
+ * Returns the node of the processor with the given local APIC id, or -1 if
+ * the SRAT does not say.
+ */
+long acpi_srat_apic_node(uint8_t apic_id);
@@ -26,9 +26,21 @@ long apic_current_id();
 /* Returns the largest known APIC ID */
 long apic_max_id();
 
-/* Maps the given IRQ to the given interrupt number. */
+/* Returns whether there is an enabled processor with the given APIC ID */
+long apic_processor_enabled(long apicid);
+
+/* Each core's logical APIC ID is the bit 1 << (its APIC ID), so a set of
+ * cores is a mask of those bits. */
+#define APIC_CORE(apicid) ((uint8_t)(1 << (apicid)))
+#define APIC_ALL_CORES ((uint8_t)0xff)
+
+/* Maps the given IRQ to the given interrupt number, to be taken by whichever
+ * core is at the lowest priority. */
 void apic_setredir(uint32_t irq, uint8_t intr);
 
+/* Sends the given IRQ only to the given set of cores (see APIC_CORE). */
+void apic_set_irq_affinity(uint32_t irq, uint8_t cores);
+
 void apic_enable();
 
 // timer interrupts arrive at a rate of (freq / 16) interrupts per millisecond
@@ -39,6 +51,15 @@ void apic_enable_periodic_timer(uint32_t freq);
 /* Stops the APIC timer */
 void apic_disable_periodic_timer();
 
+/* The longest one-shot interval, in microseconds */
+#define APIC_ONESHOT_MAX_USEC 10000000UL
+
+/* Replaces the periodic timer with one interrupt, usec from now */
+void apic_enable_oneshot_timer(uint64_t usec);
+
+/* Returns the TSC's frequency in Hz */
+uint64_t apic_tsc_frequency();
+
 /* Sets the interrupt to raise when a spurious
  * interrupt occurs. */
 void apic_setspur(uint8_t intr);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * The boot timeline. Each phase of boot, from kmain() to the first exec of
+ * /sbin/init, is bracketed by boottime_begin() and boottime_end(), which
+ * take TSC timestamps; phases may nest (sata_init() runs inside
+ * blockdev_init(), for instance). boottime_done() closes the phases still
+ * open, once the first user program has been loaded, and writes the
+ * timeline to the debug log, one
+ *
+ *   BOOT <ms since kmain> <us taken> <phase>
+ *
+ * line each, indented by depth. The TSC's rate is only known after
+ * core_init(), so the timestamps are kept as cycles and converted on output.
+ * Only the boot thread takes timestamps, so no lock is needed.
+ */
+
+#define BOOTTIME_PHASES 64
+
+/* Begins the named phase, which must be a string that lives forever, and
+ * returns the mark to end it with, or -1 if the timeline is full or done. */
+long boottime_begin(const char *phase);
+
+/* Ends the phase begun with mark */
+void boottime_end(long mark);
+
+/* Ends every open phase and writes the timeline to the debug log. Only the
+ * first call does anything. */
+void boottime_done();
+
+size_t boottime_info(const void *arg, char *buf, size_t osize);
@@ -33,15 +33,18 @@ enum
     CPUID_FEAT_ECX_CX16 = 1 << 13,
     CPUID_FEAT_ECX_ETPRD = 1 << 14,
     CPUID_FEAT_ECX_PDCM = 1 << 15,
+    CPUID_FEAT_ECX_PCID = 1 << 17,
     CPUID_FEAT_ECX_DCA = 1 << 18,
     CPUID_FEAT_ECX_SSE4_1 = 1 << 19,
     CPUID_FEAT_ECX_SSE4_2 = 1 << 20,
     CPUID_FEAT_ECX_x2APIC = 1 << 21,
     CPUID_FEAT_ECX_MOVBE = 1 << 22,
     CPUID_FEAT_ECX_POPCNT = 1 << 23,
+    CPUID_FEAT_ECX_TSC_DEADLINE = 1 << 24,
     CPUID_FEAT_ECX_XSAVE = 1 << 26,
     CPUID_FEAT_ECX_OSXSAVE = 1 << 27,
     CPUID_FEAT_ECX_AVX = 1 << 28,
+    CPUID_FEAT_ECX_HYPERVISOR = 1 << 31,
 
     CPUID_FEAT_EDX_FPU = 1 << 0,
     CPUID_FEAT_EDX_VME = 1 << 1,
@@ -72,7 +75,10 @@ enum
     CPUID_FEAT_EDX_HTT = 1 << 28,
     CPUID_FEAT_EDX_TM1 = 1 << 29,
     CPUID_FEAT_EDX_IA64 = 1 << 30,
-    CPUID_FEAT_EDX_PBE = 1 << 31
+    CPUID_FEAT_EDX_PBE = 1 << 31,
+
+    /* CPUID_GETEXTFEATURES, subleaf 0 */
+    CPUID_EXTFEAT_EBX_INVPCID = 1 << 10
 };
 
 enum cpuid_requests
@@ -81,6 +87,11 @@ enum cpuid_requests
     CPUID_GETFEATURES,
     CPUID_GETTLB,
     CPUID_GETSERIAL,
+    CPUID_GETEXTFEATURES = 7,
+    CPUID_GETTSCFREQ = 0x15, /* the TSC's ratio to the core crystal clock */
+
+    CPUID_HYPERVISOR = 0x40000000,
+    CPUID_HYPERVISORFREQ = 0x40000010, /* TSC and bus rates, in kHz */
 
     CPUID_INTELEXTENDED = 0x80000000,
     CPUID_INTELFEATURES,
@@ -97,6 +108,23 @@ static inline void cpuid(int request, uint32_t *a, uint32_t *b, uint32_t *c,
                      : "0"(request));
 }
 
+/* cpuid for the leaves that take a subleaf in ecx */
+static inline void cpuid_subleaf(int request, int subleaf, uint32_t *a,
+                                 uint32_t *b, uint32_t *c, uint32_t *d)
+{
+    __asm__ volatile("cpuid"
+                     : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d)
+                     : "0"(request), "2"(subleaf));
+}
+
+/* The base of the FS segment, which userland uses for thread-local data */
+#define MSR_FS_BASE 0xc0000100
+/* The GS base, which the kernel uses for core-specific data (see smp.h), and
+ * the one SWAPGS trades it with */
+#define MSR_GS_BASE 0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102
+#define MSR_TSC_DEADLINE 0x6e0
+
 static inline void cpuid_get_msr(uint32_t msr, uint32_t *lo, uint32_t *hi)
 {
     __asm__ volatile("rdmsr"
@@ -109,6 +137,14 @@ static inline void cpuid_set_msr(uint32_t msr, uint32_t lo, uint32_t hi)
     __asm__ volatile("wrmsr" ::"a"(lo), "d"(hi), "c"(msr));
 }
 
+/* The time stamp counter, which counts CPU cycles since reset */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 static inline void io_wait(void)
 {
     __asm__ volatile(
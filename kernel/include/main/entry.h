@@ -1,3 +1,10 @@
 /* entry.h */
 
 void kmain(void);
+
+struct regs;
+
+/* Where the SYSCALL instruction comes in (see entry/syscall_entry.c) */
+void syscall_entry(void);
+
+long syscall_fast_handler(struct regs *regs);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * The x87, SSE and, where the processor has it, AVX register state, kept
+ * per thread: see main/fpu.c. A thread that has used the registers has a
+ * kt_fpu. Its state is loaded lazily: CR0.TS is set whenever a thread is
+ * switched in, and the first SIMD or x87 instruction it runs traps (#NM)
+ * to load the state, unless this core's registers still hold it. The state
+ * is saved as the thread is switched out, but only if it used the registers
+ * in that time slice.
+ *
+ * The kernel is built without SSE, so that its own code never touches the
+ * user's registers; code that wants SIMD brackets it with kernel_fpu_begin()
+ * and kernel_fpu_end(), and must not sleep or be run from an interrupt
+ * handler in between.
+ */
+
+struct kthread;
+
+/* What a thread's kt_fpu points to */
+typedef struct fpu_thread
+{
+    long ft_core;   /* the core whose registers last held the state, or -1 */
+    void *ft_state; /* the saved state, an XSAVE or FXSAVE area in ft_buf */
+    char ft_buf[];
+} fpu_thread_t;
+
+/* Turns on the FPU and SSE (and XSAVE) for the current core. */
+void fpu_init();
+
+void fpu_switch_out(struct kthread *thr);
+
+long fpu_thread_copy(struct kthread *child, struct kthread *parent);
+
+void fpu_thread_free(struct kthread *thr);
+
+void kernel_fpu_begin();
+
+void kernel_fpu_end();
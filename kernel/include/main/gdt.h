@@ -7,10 +7,15 @@
 #define GDT_ZERO 0x00
 #define GDT_KERNEL_TEXT 0x08
 #define GDT_KERNEL_DATA 0x10
-#define GDT_USER_TEXT 0x18
-#define GDT_USER_DATA 0x20
+/* SYSRET loads the user segments from fixed offsets of one base selector,
+ * data 8 bytes above it and text 16, so they are in that order here */
+#define GDT_USER_DATA 0x18
+#define GDT_USER_TEXT 0x20
 #define GDT_TSS 0x28
 
+/* Interrupt stack table entry of the TSS that double faults run on */
+#define GDT_IST_DOUBLE_FAULT 1
+
 void gdt_init(void);
 
 void gdt_set_kernel_stack(void *addr);
@@ -8,6 +8,10 @@ extern void file_init();
 
 extern void pipe_init();
 
+extern void epoll_init();
+
+extern void futex_init();
+
 extern void vfs_init();
 
 extern void syscall_init();
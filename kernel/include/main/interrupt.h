@@ -7,13 +7,21 @@
 // intr_disk_priamry/seconday so that they are different task priority classes
 #define INTR_DIVIDE_BY_ZERO 0x00
 #define INTR_INVALID_OPCODE 0x06
+#define INTR_DEVICE_NOT_AVAILABLE 0x07 /* #NM, see main/fpu.c */
+#define INTR_DOUBLE_FAULT 0x08
 #define INTR_GPF 0x0d
 #define INTR_PAGE_FAULT 0x0e
+#define INTR_FPU_ERROR 0x10
+#define INTR_SIMD_ERROR 0x13
 
 #define INTR_APICTIMER 0xf0
+#define INTR_WAKEUP 0xf1 /* IPI sent to an idle core that has work */
+#define INTR_TLB_SHOOTDOWN 0xf2 /* IPI asking cores to invalidate mappings */
 #define INTR_KEYBOARD 0xe0
 
 #define INTR_DISK_PRIMARY 0xd0
+#define INTR_VIRTIO_BLK 0xc0 /* to 0xc7, see drivers/disk/virtio_blk.c */
+#define INTR_SERIAL 0xd8 /* COM1, see util/debug.c */
 #define INTR_SPURIOUS 0xfe
 #define INTR_APICERR 0xff
 #define INTR_SHUTDOWN 0xfd
@@ -78,6 +86,11 @@ intr_handler_t intr_register(uint8_t intr, intr_handler_t handler);
 
 int32_t intr_map(uint16_t irq, uint8_t intr);
 
+/* Sends the IRQ mapped to intr only to the given set of cores, a mask of
+ * APIC_CORE() bits; by default it goes to whichever core is at the lowest
+ * priority. Returns -EINVAL if no IRQ is mapped to intr. */
+long intr_set_affinity(uint8_t intr, uint8_t cores);
+
 static inline uint64_t intr_enabled()
 {
     uint64_t flags;
@@ -86,6 +99,18 @@ static inline uint64_t intr_enabled()
     return flags;
 }
 
+#ifdef __IPL_TRACE__
+
+/* Out of line, so that the interrupt latency tracer can tell where they were
+ * called from; see main/ipltrace.h */
+void intr_enable();
+
+void intr_disable();
+
+void intr_wait();
+
+#else
+
 static inline void intr_enable() { __asm__ volatile("sti"); }
 
 static inline void intr_disable() { __asm__ volatile("cli"); }
@@ -105,6 +130,8 @@ static inline void intr_wait()
     __asm__ volatile("sti; hlt");
 }
 
+#endif
+
 /* Sets the interrupt priority level for hardware interrupts.
  * At initialization time devices should detect their individual
  * IPLs and save them for use with this function. IPL_LOW allows
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * The interrupt latency tracer (IPL_TRACE=1). While it is on, it times each
+ * window in which a core has hardware interrupts masked, because interrupts
+ * are off (cli) or because the IPL is at IPL_HIGH or above, and keeps each
+ * core's IPLTRACE_WORST longest with where they began and ended: the callers
+ * of intr_disable() or intr_setipl() that masked interrupts, and of
+ * intr_enable() or intr_setipl() that unmasked them. An interrupt handler
+ * named in a window began or ended it by being taken or returning.
+ *
+ * ipltrace_dump() writes the windows to the debug log, one
+ *
+ *   IPLTRACE core=<id> cycles=<cycles> pid=<pid> start=<address> end=<address>
+ *
+ * line each, for python/weenix/ipltrace.py to symbolize against kernel.bin.
+ * A window opened before the tracer was started is not counted.
+ */
+
+#define IPLTRACE_WORST 8
+
+typedef struct ipltrace_window
+{
+    uint64_t iw_cycles;
+    void *iw_start; /* where interrupts were masked */
+    void *iw_end;   /* where they were unmasked */
+    pid_t iw_pid;   /* the process running when they were unmasked */
+} ipltrace_window_t;
+
+typedef struct ipltrace_stats
+{
+    uint64_t is_windows; /* windows timed */
+    uint64_t is_cycles;  /* the time in them */
+    ipltrace_window_t is_worst[IPLTRACE_WORST]; /* the longest, longest first */
+} ipltrace_stats_t;
+
+#ifdef __IPL_TRACE__
+
+/* Interrupts have just been masked, at site */
+void ipltrace_mask(void *site);
+
+/* Interrupts are about to be unmasked, at site */
+void ipltrace_unmask(void *site);
+
+#else
+
+#define ipltrace_mask(site) \
+    do                      \
+    {                       \
+    } while (0)
+#define ipltrace_unmask(site) \
+    do                        \
+    {                         \
+    } while (0)
+
+#endif
+
+long ipltrace_start();
+
+void ipltrace_stop();
+
+long ipltrace_stats(long core, ipltrace_stats_t *stats);
+
+size_t ipltrace_dump();
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "api/syscall.h"
+#include "types.h"
+
+/*
+ * Hardware performance counters, counted per thread: see main/pmu.c and
+ * perfctr(2) in api/syscall.h. A thread that has started counting has a
+ * kt_pmu; its counts are saved as it is switched out and its counters
+ * programmed again as it is switched in, so others' events are not counted.
+ */
+
+struct kthread;
+
+/* What a counting thread's kt_pmu points to */
+typedef struct pmu_thread
+{
+    uint32_t pt_events; /* mask of the events being counted */
+    uint64_t pt_counts[PERFCTR_EVENTS]; /* as of the last switch out */
+} pmu_thread_t;
+
+/* The number of general-purpose counters, or 0 if there is no PMU */
+long pmu_counters();
+
+long pmu_start(uint32_t events);
+
+long pmu_read(uint64_t *counts);
+
+void pmu_stop();
+
+void pmu_switch_out(struct kthread *thr);
+
+void pmu_switch_in(struct kthread *thr);
+
+void pmu_thread_free(struct kthread *thr);
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "boot/config.h"
 #include "mm/page.h"
 #include "proc/core.h"
@@ -8,12 +10,77 @@
 // threads, (mutex or spinlock) (SMP.4) other cores' interrupt handlers
 // (spinlock) mask interrupts + spinlock covers all 4 cases!
 
+/*
+ * Core-specific data (CORE_SPECIFIC_DATA, see globals.h) is linked into the
+ * .csd section, and core_init() gives each core a copy of its own, in the
+ * physmap. The GS base points at the running core's copy while in the
+ * kernel; SWAPGS trades it for the user's on the way in from userland and
+ * back (see syscall_entry and the interrupt stubs), so switching threads
+ * never has to touch a page table. The copy begins with a csd_head_t, which
+ * holds its own address, and what syscall_entry needs at fixed offsets.
+ */
+typedef struct csd_head
+{
+    uintptr_t ch_self;       /* This copy's address, at %gs:0 */
+    uint64_t ch_kernel_rsp;  /* The stack syscall_entry switches to */
+    uint64_t ch_user_rsp;    /* The user's stack meanwhile */
+} csd_head_t;
+
+#define CSD_HEAD_KERNEL_RSP 8
+#define CSD_HEAD_USER_RSP 16
+
+extern csd_head_t csd_head;
+
+extern void *csd_start;
+extern void *csd_end;
+#define CSD_START ((uintptr_t)&csd_start)
+#define CSD_END ((uintptr_t)&csd_end)
+
+/* Where var lies within any core's copy */
+#define CSD_OFFSET(var) ((uintptr_t)&(var) - CSD_START)
+
+/* The given core's copy of name, for reaching another core's data */
 #define GET_CSD(core, type, name) \
-    ((type *)(csd_vaddr_table[(core)] + PAGE_OFFSET(&(name))))
+    ((type *)(csd_vaddr_table[(core)] + CSD_OFFSET(name)))
+
+/* The running core's copy of var. The caller must not move to another core
+ * while it uses it: in an interrupt handler, or with interrupts or
+ * preemption off. */
+#define CSD_PTR(var) ((__typeof__(&(var)))(csd_base() + CSD_OFFSET(var)))
+#define CSD(var) (*CSD_PTR(var))
+
+/* Reads and writes the running core's copy of var, a 64-bit word, in a
+ * single %gs-relative access, which is safe whichever core the thread is
+ * moved to afterwards */
+#define CSD_READ(var) ((__typeof__(var))csd_read(CSD_OFFSET(var)))
+#define CSD_WRITE(var, val) csd_write(CSD_OFFSET(var), (uint64_t)(val))
+
+static inline uintptr_t csd_base()
+{
+    uintptr_t base;
+    __asm__ volatile("movq %%gs:0, %0"
+                     : "=r"(base));
+    return base;
+}
+
+static inline uint64_t csd_read(uintptr_t offset)
+{
+    uint64_t val;
+    __asm__ volatile("movq %%gs:(%1), %0"
+                     : "=r"(val)
+                     : "r"(offset));
+    return val;
+}
+
+static inline void csd_write(uintptr_t offset, uint64_t val)
+{
+    __asm__ volatile("movq %1, %%gs:(%0)" ::"r"(offset), "r"(val)
+                     : "memory");
+}
 
 extern uintptr_t csd_vaddr_table[];
 
-void map_in_core_specific_data(pml4_t *pml4);
+void csd_early_init();
 
 void smp_init();
 
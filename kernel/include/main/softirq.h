@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Deferred interrupt work. A device's interrupt handler (the top half) only
+ * acknowledges the device and notes what needs doing, then raises a softirq;
+ * the rest (the bottom half) runs once the interrupt is done, on the same
+ * core, with interrupts enabled.
+ *
+ * Softirqs run on the way out of an interrupt taken at IPL_LOW, or when a
+ * thread lowers the IPL back to IPL_LOW: so where an interrupt could have
+ * come in, and only there, as if each bottom half were still part of its
+ * top half. They never run nested in one another, and must not sleep.
+ */
+
+#define SOFTIRQ_DISK 0
+#define SOFTIRQ_KEYBOARD 1
+#define SOFTIRQ_VIRTIO_BLK 2
+#define SOFTIRQ_COUNT 3
+
+typedef void (*softirq_handler_t)();
+
+/* Sets the function that runs the given softirq. */
+void softirq_register(long softirq, softirq_handler_t handler);
+
+/* Has the given softirq run on the current core once it is able to. */
+void softirq_raise(long softirq);
+
+/* Runs the softirqs pending on the current core, unless it is running them
+ * already. Called only where an interrupt could come in at IPL_LOW, as they
+ * run with interrupts enabled. */
+void softirq_run();
@@ -2,6 +2,25 @@
 
 #include "types.h"
 
+/* Requests bigger than the largest slab size class (256KB) are served by
+ * vmalloc: such buffers are contiguous in virtual memory only. */
 void *kmalloc(size_t size);
 
 void kfree(void *addr);
+
+#ifdef __KMALLOC_PROFILE__
+/* What one caller of kmalloc has allocated (KMALLOC_PROFILE=1), in bytes
+ * asked for */
+typedef struct kmalloc_site
+{
+    void *ks_caller; /* the return address of its kmalloc calls */
+    uint64_t ks_allocs;
+    uint64_t ks_frees;
+    uint64_t ks_bytes; /* allocated in all */
+    uint64_t ks_live;  /* allocated and not yet freed */
+    uint64_t ks_peak;  /* the most ks_live has been */
+} kmalloc_site_t;
+
+size_t kmalloc_profile_top(kmalloc_site_t *out, size_t max,
+                           uint64_t *untracked);
+#endif
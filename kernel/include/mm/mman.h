@@ -23,3 +23,18 @@
  */
 #define MAP_FIXED 4
 #define MAP_ANON 8
+#define MAP_HUGE 16 /* back an anonymous mapping with 2MB pages */
+#define MAP_POPULATE 32 /* fault the whole mapping in up front */
+#define MAP_VDSO 64 /* the kernel's vDSO pages, not for mmap() */
+
+/* madvise() advice.
+ */
+#define MADV_NORMAL 0     /* No particular access pattern (the default). */
+#define MADV_RANDOM 1     /* Expect random access: no fault-around. */
+#define MADV_SEQUENTIAL 2 /* Expect sequential access: map and read ahead. */
+#define MADV_WILLNEED 3   /* Expect access soon: start reading it in. */
+#define MADV_DONTNEED 4   /* Done with it for now: unmap and discard. */
+
+/* mremap() flags.
+ */
+#define MREMAP_MAYMOVE 1 /* The mapping may move if it cannot grow in place. */
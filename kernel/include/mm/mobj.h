@@ -3,7 +3,7 @@
 #include "proc/kmutex.h"
 #include "util/atomic.h"
 #include "util/list.h"
-#include "util/btree.h"
+#include "util/radix.h"
 #include "mm/pframe.h"
 
 struct pframe;
@@ -18,6 +18,35 @@ typedef enum
     MOBJ_FS,
 } mobj_type_t;
 
+#define MOBJ_NTYPES (MOBJ_FS + 1)
+
+/*
+ * Page cache counters, kept for each type of memory object (see
+ * mobj_stats_info). Like the scheduler's accounting they are plain
+ * counters, updated by the thread doing the work.
+ */
+typedef struct mobj_stats
+{
+    uint64_t ms_hits;    /* lookups that found the page cached */
+    uint64_t ms_misses;  /* lookups that had to bring it in */
+    uint64_t ms_fills;   /* pages read in, or filled without the disk */
+    uint64_t ms_flushes; /* dirty pages written back */
+    uint64_t ms_dirty;   /* pages dirty right now */
+} mobj_stats_t;
+
+extern mobj_stats_t mobj_stats[MOBJ_NTYPES];
+
+#define MOBJ_STAT_INC(o, field) (mobj_stats[(o)->mo_type].field++)
+#define MOBJ_STAT_DEC(o, field) (mobj_stats[(o)->mo_type].field--)
+
+/* Tags on mo_index entries */
+#define MOBJ_TAG_DIRTY 0     /* pf_dirty is set */
+#define MOBJ_TAG_WRITEBACK 1 /* being written back, see fs/writeback.c */
+
+/* The forwrite of a mobj_get_pframe() whose caller is about to write all of
+ * the page's data, so that it need not be read in first; otherwise like 1 */
+#define MOBJ_OVERWRITE 2
+
 typedef struct mobj_ops
 {
     long (*get_pframe)(struct mobj *o, uint64_t pagenum, long forwrite,
@@ -27,21 +56,37 @@ typedef struct mobj_ops
 
     long (*flush_pframe)(struct mobj *o, struct pframe *pf);
 
+    /* Optional: whether page pagenum would read as zeros and is cached
+     * nowhere, so that read faults can map pframe_zero_page instead. */
+    long (*page_is_zero)(struct mobj *o, uint64_t pagenum);
+
+    /* Optional: look up an already resident page that a read of pagenum
+     * would be given, without waiting or reading anything in; see
+     * mobj_find_resident. */
+    long (*find_resident)(struct mobj *o, uint64_t pagenum,
+                          struct pframe **pfp);
+
     void (*destructor)(struct mobj *o);
 } mobj_ops_t;
 
+/* The reference count and the lock lead, as every mobj_ref()/mobj_put() and
+ * page lookup takes them, ahead of the operations table. */
 typedef struct mobj
 {
     long mo_type;
-    struct mobj_ops mo_ops;
     atomic_t mo_refcount;
-    list_t mo_pframes;
     kmutex_t mo_mutex;
-    btree_node_t *mo_btree;
+    radix_tree_t mo_index; /* pagenum -> pframe, for every pframe */
+    list_t mo_pframes;
+    struct mobj_ops mo_ops;
 } mobj_t;
 
 void mobj_init(mobj_t *o, long type, mobj_ops_t *ops);
 
+void mobj_ctor(mobj_t *o);
+
+void mobj_init_constructed(mobj_t *o, long type, mobj_ops_t *ops);
+
 void mobj_lock(mobj_t *o);
 
 void mobj_unlock(mobj_t *o);
@@ -57,17 +102,35 @@ long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
 
 void mobj_find_pframe(mobj_t *o, uint64_t pagenum, struct pframe **pfp);
 
+long mobj_find_pframe_lockless(mobj_t *o, uint64_t pagenum,
+                               struct pframe **pfp);
+
 long mobj_flush_pframe(mobj_t *o, struct pframe *pf);
 
+long mobj_page_is_zero(mobj_t *o, uint64_t pagenum);
+
+long mobj_find_resident(mobj_t *o, uint64_t pagenum, struct pframe **pfp);
+
 long mobj_flush(mobj_t *o);
 
 long mobj_free_pframe(mobj_t *o, struct pframe **pfp);
 
 void mobj_delete_pframe(mobj_t *o, size_t pagenum);
 
+void mobj_discard_range(mobj_t *o, uint64_t lopage, uint64_t hipage);
+
+long mobj_evict_pframe(mobj_t *o, uint64_t pagenum, struct pframe *expected);
+
+long mobj_trim_pframe(mobj_t *o, uint64_t pagenum, struct pframe *expected);
+
+long mobj_migrate_pframe(mobj_t *o, uint64_t pagenum, struct pframe *expected,
+                         void *page, long unmap);
+
 long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
                              struct pframe **pfp);
 
 void mobj_default_destructor(mobj_t *o);
 
+size_t mobj_stats_info(const void *arg, char *buf, size_t osize);
+
 void mobj_create_pframe(mobj_t *o, uint64_t pagenum, uint64_t loc, pframe_t **pfp);
@@ -2,6 +2,7 @@
 
 #ifdef __KERNEL__
 #include "types.h"
+#include "util/list.h"
 #else
 #include "sys/types.h"
 #endif
@@ -77,6 +78,15 @@ typedef struct page_status
     int mapped;
 } page_status_t;
 
+/* Physical memory zones. DMA32 holds the pages below 4GB, which are
+ * reachable by devices with 32-bit DMA addressing. */
+typedef enum page_zone
+{
+    PAGE_ZONE_DMA32,
+    PAGE_ZONE_NORMAL,
+    PAGE_NZONES
+} page_zone_t;
+
 /* Performs all initialization necessary for the
  * page allocation system. This should be called
  * only once at boot time before any other functions
@@ -96,6 +106,9 @@ void *physmap_end();
  * will return NULL. */
 void *page_alloc(void);
 
+/* Allocates a page below max_paddr (e.g. for DMA), taking the lowest
+ * free page. Allocations that are not bounded prefer pages above 4GB and,
+ * once page_numa_init has run, pages on the current core's node. */
 void *page_alloc_bounded(void *max_paddr);
 
 void page_free(void *addr);
@@ -118,6 +131,85 @@ void page_mark_reserved(void *paddr);
 
 void page_init_finish();
 
+/* Turns on the per-core caches of free pages used by page_alloc and
+ * page_free. Called once the local APIC is up, since caches are looked up
+ * by APIC id. */
+void page_pcp_init();
+
+/* Reads the memory affinity ranges from the ACPI SRAT, if the firmware
+ * provides one, so that allocations can prefer node-local memory. Called
+ * once after acpi_init. */
+void page_numa_init();
+
+/* Returns the number of free pages in the given zone, not counting pages
+ * held in the per-core caches. */
+size_t page_zone_free_count(page_zone_t zone);
+
+/* A shrinker gives memory back to the page allocator when free memory runs
+ * low. ps_shrink should try to free about target pages and return how many
+ * it freed. It is called from thread context with no locks held, and may
+ * block. */
+typedef struct page_shrinker
+{
+    size_t (*ps_shrink)(struct page_shrinker *shrinker, size_t target);
+    list_link_t ps_link;
+} page_shrinker_t;
+
+/* Adds shrinker to the set run by page_reclaim_point. */
+void page_shrinker_register(page_shrinker_t *shrinker);
+
+/* Removes shrinker, waiting for a reclaim in progress to finish. May only
+ * be called from thread context. */
+void page_shrinker_unregister(page_shrinker_t *shrinker);
+
+/* If free memory has fallen below the low watermark since the last reclaim,
+ * runs the shrinkers until it is back above the high watermark or they stop
+ * making progress. Then, if a multi-page allocation has failed since, has
+ * the compactor try again for a block of that size, this time moving mapped
+ * pages too. Called on the way back to user mode, where no kernel locks are
+ * held. */
+void page_reclaim_point();
+
+/* A compactor makes a free block of contiguous pages by moving the pages in
+ * use in one elsewhere, when page_alloc_n can find none of the size asked
+ * for. pc_compact should try to free a block of 2^order pages below
+ * max_paddr, and return whether it did. If unmap is not set it is being
+ * called from inside an allocation, whose caller may hold any locks; it
+ * must then only try locks, and leave pages that are mapped into user
+ * address spaces alone. The pages mapped ones get their turn later, from
+ * page_reclaim_point, where unmap is set and no locks are held. */
+typedef struct page_compactor
+{
+    long (*pc_compact)(struct page_compactor *compactor, size_t order,
+                       uintptr_t max_paddr, long unmap);
+} page_compactor_t;
+
+/* Makes compactor the one page_alloc_n falls back on. There is only one. */
+void page_compactor_register(page_compactor_t *compactor);
+
+/* Returns how many pages of the block of 2^order pages at physical address
+ * paddr, which must be aligned to its size, are free in the buddy tree. */
+size_t page_block_free(uintptr_t paddr, size_t order);
+
+/* Returns a page of zeros, from the pool idle cores keep filled if there is
+ * one there and otherwise by zeroing a fresh one, or NULL if the system is
+ * out of memory. Freed with page_free like any other. */
+void *page_alloc_zeroed();
+
+/* Zeroes one more page into the pool page_alloc_zeroed takes from, unless
+ * it is full or free memory is short. For the idle loop, which calls it
+ * with interrupts disabled; returns whether it did anything, so that the
+ * loop can check for work again before halting. */
+long page_zero_idle();
+
+/* Prints the free page counts (in total, per zone, and in the per-core
+ * caches), the size of the zeroed pool and how often it was used, the
+ * reclaim watermarks, the number of compactions tried and
+ * those that succeeded, and the number of free blocks of each order in the
+ * buddy tree. Follows the proc_info convention: arg must be
+ * NULL, and the number of bytes of buf left unused is returned. */
+size_t page_info(const void *arg, char *buf, size_t osize);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
@@ -75,6 +75,12 @@ pml4_t *pt_get();
 
 void pt_set(pml4_t *pml4);
 
+void pt_pcid_init();
+
+/* Invalidates, on this core, count pages at vaddr (all of them if count is
+ * 0) that pml4 may have left in the TLB under its PCID while not loaded. */
+void pt_pcid_flush(pml4_t *pml4, uintptr_t vaddr, size_t count);
+
 pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings);
 
 pml4_t *pt_create();
@@ -91,4 +97,12 @@ void pt_unmap(pml4_t *pml4, uintptr_t vaddr);
 
 void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
 
+long pt_is_mapped(pml4_t *pml4, uintptr_t vaddr);
+
+void pt_write_protect_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax);
+
+long pt_clear_accessed(pml4_t *pml4, uintptr_t vaddr, uintptr_t paddr);
+
+uintptr_t pt_user_phys(pml4_t *pml4, uintptr_t vaddr, long forwrite);
+
 void check_invalid_mappings(pml4_t *pml4, vmmap_t *vmmap, char *prompt);
@@ -3,21 +3,111 @@
 //#include "mm/mobj.h"
 #include "proc/kmutex.h"
 #include "types.h"
+#include "util/atomic.h"
 
+struct mobj;
+struct ksm_page;
+struct proc;
+
+/*
+ * The fields every lookup and pframe_get() touch lead, pf_addr and the lock
+ * of pf_mutex in the first cache line (see pframe.c). The links and the
+ * reclaimer's and ksmd's bookkeeping follow.
+ */
 typedef struct pframe
 {
-    size_t pf_pagenum;
-    size_t pf_loc;
     void *pf_addr;
-    long pf_dirty;
     kmutex_t pf_mutex;
+
+    size_t pf_pagenum;
+    struct mobj *pf_obj; /* owning memory object */
+    atomic_t pf_pincount; /* pframe_get()s not yet put */
+    long pf_dirty;
+    size_t pf_loc;
     list_link_t pf_link;
+
+    list_link_t pf_lru_link; /* link on the active or inactive list */
+    long pf_lru;             /* which LRU list pf is on, see pframe.c */
+    long pf_referenced;      /* looked up since the reclaimer last saw it */
+
+    list_link_t pf_dirty_link; /* link on the dirty list, see pframe.c */
+    uint64_t pf_dirtied;       /* jiffies when pf last became dirty */
+
+    long pf_mapcount;        /* user page table entries mapping pf_addr */
+    list_link_t pf_map_link; /* link in the mapped pframe hash, see pframe.c */
+    struct proc *pf_owner;     /* process charged for it while mapped */
+    list_link_t pf_owner_link; /* link on the owner's p_rss_pages */
+
+    size_t pf_swap; /* swap slot holding the contents, plus one, while the
+                       page is out (see mm/swap.c) */
+
+    struct ksm_page *pf_ksm; /* page shared with identical ones holding the
+                                contents, while merged (see vm/ksm.c) */
+    uint64_t pf_ksm_hash;    /* contents hash at the last ksmd sweep */
 } pframe_t;
 
+/*
+ * A pframe found on the dirty list by pframe_dirty_collect, together with a
+ * reference on its memory object. pr_pf may only be used after checking,
+ * with pr_obj locked, that it is still the pframe for page pr_pagenum.
+ */
+typedef struct pframe_ref
+{
+    struct mobj *pr_obj;
+    uint64_t pr_pagenum;
+    pframe_t *pr_pf;
+} pframe_ref_t;
+
+/* A page of zeros, shared by every reader of a page nobody has written:
+ * user mappings of it are read-only, and it belongs to no pframe. */
+extern void *pframe_zero_page;
+
 void pframe_init();
 
 pframe_t *pframe_create();
 
+void pframe_lru_add(pframe_t *pf);
+
+void pframe_lru_remove(pframe_t *pf);
+
+void pframe_set_dirty(pframe_t *pf);
+
+void pframe_clear_dirty(pframe_t *pf);
+
+size_t pframe_dirty_collect(pframe_ref_t *refs, size_t max,
+                            uint64_t dirtied_before);
+
+size_t pframe_dirty_count();
+
+size_t pframe_cache_count();
+
+/* Marks pf as recently used, which keeps it in the page cache longer. */
+static inline void pframe_mark_accessed(pframe_t *pf) { pf->pf_referenced = 1; }
+
 void pframe_release(pframe_t **pfp);
 
+pframe_t *pframe_get(pframe_t *pf);
+
+void pframe_put(pframe_t **pfp);
+
+/* Whether pf may be in use by someone not holding its mutex: it is pinned,
+ * or mapped into a user address space. Such pframes are not reclaimed. */
+static inline long pframe_pinned(pframe_t *pf)
+{
+    return *(volatile atomic_t *)&pf->pf_pincount ||
+           *(volatile long *)&pf->pf_mapcount;
+}
+
+void pframe_map(pframe_t *pf);
+
+void pframe_remapped(uintptr_t paddr);
+
+void pframe_unmapped(uintptr_t paddr);
+
+void pframe_disown(struct proc *proc);
+
+size_t pframe_rss_shared(const struct proc *proc);
+
+size_t pframe_rss_trim(struct proc *proc);
+
 void pframe_free(pframe_t **pfp);
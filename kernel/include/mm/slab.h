@@ -19,6 +19,10 @@
  */
 typedef struct slab_allocator slab_allocator_t;
 
+/* Object constructor and destructor, see slab_allocator_create_ctor. */
+typedef void (*slab_ctor_t)(void *obj);
+typedef void (*slab_dtor_t)(void *obj);
+
 /* Initializes the slab allocator subsystem. This should be done
  * only after the page subsystem has been initialized. Slab allocators
  * and kmalloc will not work until this function has been called. */
@@ -60,7 +64,27 @@ void slab_init();
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
 
 /**
- * Destroys a slab allocator.
+ * Creates a slab allocator whose free objects are kept constructed. ctor is
+ * run on every object when the slab holding it is allocated, and dtor (if not
+ * NULL) when that slab is given back to the page allocator. In between,
+ * objects must be freed in the state ctor left them in (mutexes unlocked,
+ * lists empty, ...), so that users only need to set up the rest after
+ * slab_obj_alloc. Both run with the allocator locked and interrupts
+ * disabled, so they must not block or allocate from the same allocator.
+ * 
+ * @param name The name of the allocator (for debugging)
+ * @param size The size (bytes) of objects that will be allocated from this allocator
+ * @param ctor The constructor
+ * @param dtor The destructor, or NULL
+ * @return slab_allocator_t* An allocator, or NULL on failure
+ */
+slab_allocator_t *slab_allocator_create_ctor(const char *name, size_t size,
+                                             slab_ctor_t ctor,
+                                             slab_dtor_t dtor);
+
+/**
+ * Destroys a slab allocator. Its slabs are given back to the page allocator,
+ * so all of its objects must have been freed.
  * 
  * @param allocator The allocator to destroy
  */
@@ -85,12 +109,21 @@ void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
 
 /**
- * Reclaims memory from unused slabs. 
- * 
- * NOTE: This is not currently implemented.
+ * Reclaims memory from unused slabs. Objects cached in the depot are returned
+ * to their slabs first. Also run automatically, as a page shrinker, when free
+ * memory runs low.
  * 
  * @param target Target number of pages to reclaim. If negative, reclaim as many
  *  as possible
  * @return long Number of pages freed
  */
-long slab_allocators_reclaim(long target);
\ No newline at end of file
+long slab_allocators_reclaim(long target);
+
+/**
+ * Prints a line per slab allocator: the object size (including red-zones),
+ * objects in use, objects in all of its slabs, free objects cached in
+ * magazines, slabs, pages, and bytes of the slabs that no object can use.
+ * Follows the proc_info convention: arg must be NULL, and the number of
+ * bytes of buf left unused is returned.
+ */
+size_t slab_info(const void *arg, char *buf, size_t osize);
\ No newline at end of file
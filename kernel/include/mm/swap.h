@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.h"
+
+/* Blocks of the swap disk used for swap, one page each (see Config.mk) */
+#ifndef __SWAP_BLOCKS__
+#define __SWAP_BLOCKS__ 16384
+#endif
+
+/* Whether the pages of an object are paged out to swap rather than dropped
+ * or written back: those of anonymous memory and of the copies private
+ * mappings make of it or of files. */
+#define MOBJ_SWAPPABLE(o) \
+    ((o)->mo_type == MOBJ_ANON || (o)->mo_type == MOBJ_SHADOW)
+
+struct mobj;
+struct pframe;
+
+void swap_init();
+
+long swap_enabled();
+
+long swap_out_pframe(struct mobj *o, struct pframe *pf);
+
+long swap_in_pframe(struct pframe *pf);
+
+void swap_discard_pframe(struct pframe *pf);
+
+size_t swap_info(const void *arg, char *buf, size_t osize);
@@ -24,7 +24,8 @@ static inline void tlb_flush_range(uintptr_t vaddr, size_t count)
     }
 }
 
-/* Invalidates the entire TLB. */
+/* Invalidates the entire TLB, except for global (kernel) entries. With
+ * PCIDs enabled only the current address space's entries go. */
 static inline void tlb_flush_all()
 {
     uintptr_t pdir;
@@ -33,3 +34,46 @@ static inline void tlb_flush_all()
     __asm__ volatile("movq %0, %%cr3" ::"r"(pdir)
                      : "memory");
 }
+
+/*
+ * The functions above only reach the TLB of the core they run on. When a
+ * mapping other cores may be caching changes -- any core running a thread of
+ * the same process, or of any process for kernel mappings -- they are told
+ * to invalidate it too with a shootdown IPI (INTR_TLB_SHOOTDOWN). Changes
+ * made together are collected into a tlb_batch_t so that one IPI covers them
+ * all; past TLB_SHOOTDOWN_MAX_PAGES pages a batch invalidates the whole TLB
+ * instead, which is cheaper than that many invlpgs.
+ */
+
+#define TLB_BATCH_RANGES 8
+#define TLB_SHOOTDOWN_MAX_PAGES 32
+
+struct pt;
+
+typedef struct tlb_batch
+{
+    struct pt *tb_pml4; /* address space the ranges are in, or NULL for
+                         * mappings every address space shares */
+    long tb_all;        /* invalidate everything rather than the ranges */
+    size_t tb_npages;
+    size_t tb_nranges;
+    struct
+    {
+        uintptr_t tr_vaddr;
+        size_t tr_count;
+    } tb_ranges[TLB_BATCH_RANGES];
+} tlb_batch_t;
+
+void tlb_batch_init(tlb_batch_t *batch, struct pt *pml4);
+
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t vaddr, size_t count);
+
+void tlb_batch_add_all(tlb_batch_t *batch);
+
+void tlb_batch_flush(tlb_batch_t *batch);
+
+void tlb_shootdown(struct pt *pml4, uintptr_t vaddr, size_t count);
+
+void tlb_shootdown_all(struct pt *pml4);
+
+void tlb_init();
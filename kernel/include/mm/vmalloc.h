@@ -0,0 +1,30 @@
+#pragma once
+
+#include "types.h"
+
+/* Kernel virtual addresses from which vmalloc allocates. The range takes up
+ * exactly one PML4 entry, whose page directory pointer table is shared by
+ * every page table (see clone_pml4), so a mapping made here shows up in all
+ * address spaces at once. */
+#define VMALLOC_START 0xffffc90000000000
+#define VMALLOC_END (VMALLOC_START + (1UL << 39))
+
+#define IS_VMALLOC_ADDR(a)                 \
+    ((uintptr_t)(a) >= VMALLOC_START && \
+     (uintptr_t)(a) < VMALLOC_END)
+
+void vmalloc_init();
+
+/* Allocates size bytes of memory that is contiguous in the kernel's virtual
+ * address space but backed by separately allocated physical pages. Use this
+ * instead of page_alloc_n for large buffers that don't need to be physically
+ * contiguous. Returns a page-aligned address, or NULL if memory runs out.
+ *
+ * The pages on either side of the memory are left unmapped: the one after
+ * it is its guard page, and the one before is the guard of the area below,
+ * or lies below VMALLOC_START. Kernel stacks, which grow down, rely on the
+ * latter. */
+void *vmalloc(size_t size);
+
+/* Frees memory returned by vmalloc. */
+void vfree(void *addr);
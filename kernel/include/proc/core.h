@@ -1,15 +1,24 @@
 #pragma once
 
+#include "kernel.h"
 #include "proc/context.h"
 #include "proc/sched.h"
 #include "proc/spinlock.h"
 
+/*
+ * Other cores take kc_lock and change kc_runq, to steal work or to queue a
+ * thread they have woken; they start on a cache line of their own so that
+ * doing so does not take away the line the core's own switches use.
+ */
 typedef struct core
 {
     long kc_id;
     context_t kc_ctx;
 
     ktqueue_t *kc_queue;
+    spinlock_t *kc_release; /* Dropped by core_switch() once curthr is queued */
 
-    uintptr_t kc_csdpaddr;
+    spinlock_t kc_lock CACHE_LINE_ALIGNED; /* Protects kc_runq against other
+                                            * cores (stealing) */
+    runq_t kc_runq;                        /* This core's run queue */
 } core_t;
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Futexes: waiting in the kernel on a user int, see proc/futex.c and
+ * futex(2) in api/syscall.h.
+ */
+
+/**
+ * Sleeps until woken by do_futex_wake() on the same futex, if *uaddr is
+ * val.
+ *
+ * @param uaddr the futex, which must be 4-byte aligned
+ * @param val the value it is expected to hold
+ * @return 0 once woken, or
+ *  - EAGAIN *uaddr is not val
+ *  - EINTR the thread was cancelled
+ *  - EINVAL uaddr is not aligned
+ *  - EFAULT uaddr is not mapped
+ */
+long do_futex_wait(const int *uaddr, int val);
+
+/**
+ * Wakes up to count of the threads waiting on the futex at uaddr, oldest
+ * first.
+ *
+ * @param uaddr the futex
+ * @param count the most threads to wake
+ * @return how many were woken, or EINVAL or EFAULT as for do_futex_wait()
+ */
+long do_futex_wake(const int *uaddr, int count);
@@ -7,19 +7,54 @@
  * Structures
  *==========*/
 
+#ifdef __KMUTEX_STATS__
+/*
+ * Contention statistics, kept for every mutex and updated under km_lock.
+ * Times are in jiffies. Only named mutexes (see kmutex_set_name) are listed
+ * by the kshell "lockstat" command.
+ */
+typedef struct kmutex_stats
+{
+    const char *ks_name;         /* NULL unless set by kmutex_set_name */
+    uint64_t ks_acquisitions;    /* times the mutex was taken */
+    uint64_t ks_contended;       /* ...of which it was already held */
+    uint64_t ks_wait_ticks;      /* total time spent waiting for it */
+    uint64_t ks_max_hold_ticks;  /* longest time any holder kept it */
+    uint64_t ks_acquired_at;     /* when the current holder took it */
+    list_link_t ks_link;         /* link on the list of named mutexes */
+} kmutex_stats_t;
+
+#define KMUTEX_STATS_INITIALIZER(mtx) \
+    .km_stats = {.ks_link = LIST_LINK_INITIALIZER((mtx).km_stats.ks_link)},
+#else
+#define KMUTEX_STATS_INITIALIZER(mtx)
+#endif
+
 typedef struct kmutex
 {
     ktqueue_t km_waitq;        /* wait queue */
     struct kthread *km_holder; /* current holder */
     list_link_t km_link;
+    spinlock_t km_lock;        /* protects km_waitq and km_holder */
+#ifdef __KMUTEX_STATS__
+    kmutex_stats_t km_stats;
+#endif
 } kmutex_t;
 
 #define KMUTEX_INITIALIZER(mtx)                                             \
     {                                                                       \
         .km_waitq = KTQUEUE_INITIALIZER((mtx).km_waitq), .km_holder = NULL, \
         .km_link = LIST_LINK_INITIALIZER((mtx).km_link),                    \
+        .km_lock = SPINLOCK_INITIALIZER((mtx).km_lock),                     \
+        KMUTEX_STATS_INITIALIZER(mtx)                                       \
     }
 
+/*
+ * A contender keeps polling the mutex, instead of sleeping, for as long as
+ * the holder is running on another core, up to this many times.
+ */
+#define KMUTEX_SPIN_MAX 10000
+
 /*==========
  * Functions
  *=========*/
@@ -32,7 +67,8 @@ typedef struct kmutex
 void kmutex_init(kmutex_t *mtx);
 
 /**
- * Locks the specified mutex.
+ * Locks the specified mutex. If the holder is running on another core the
+ * caller spins, expecting a prompt release; otherwise it sleeps.
  *
  * Note: This function may block.
  *
@@ -42,6 +78,16 @@ void kmutex_init(kmutex_t *mtx);
  */
 void kmutex_lock(kmutex_t *mtx);
 
+/**
+ * Locks the specified mutex if no thread holds it.
+ *
+ * Note: This function never blocks.
+ *
+ * @param mtx the mutex to lock
+ * @return true if mtx was locked, false if it is held by another thread
+ */
+long kmutex_trylock(kmutex_t *mtx);
+
 /**
  * Unlocks the specified mutex.
  *
@@ -49,6 +95,12 @@ void kmutex_lock(kmutex_t *mtx);
  */
 void kmutex_unlock(kmutex_t *mtx);
 
+/**
+ * Recomputes curthr's nice value from its own (kt_base_nice) and those of
+ * the threads waiting on the mutexes it holds; used when either changes.
+ */
+void kmutex_update_nice();
+
 /**
  * Indicates if a mutex has waiters.
  */
@@ -58,3 +110,25 @@ long kmutex_has_waiters(kmutex_t *mtx);
  * Indicates if curthr owns a mutex.
  */
 long kmutex_owns_mutex(kmutex_t *mtx);
+
+/**
+ * Tags a mutex with a name for the contention statistics and adds it to the
+ * list reported by kmutex_stats_top(). Only use this on mutexes that are
+ * never freed. Does nothing unless KMUTEX_STATS is enabled.
+ *
+ * @param mtx the mutex
+ * @param name a string that outlives the mutex
+ */
+void kmutex_set_name(kmutex_t *mtx, const char *name);
+
+#ifdef __KMUTEX_STATS__
+/**
+ * Copies the statistics of the most contended named mutexes into out,
+ * most contended first.
+ *
+ * @param out array to fill
+ * @param max length of out
+ * @return the number of entries filled in
+ */
+size_t kmutex_stats_top(kmutex_stats_t *out, size_t max);
+#endif
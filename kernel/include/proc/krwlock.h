@@ -0,0 +1,95 @@
+#pragma once
+
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+
+/*===========
+ * Structures
+ *==========*/
+
+/*
+ * A sleeping reader-writer lock. Any number of threads may hold it shared,
+ * or one thread may hold it exclusive. Writers are preferred: once a writer
+ * is waiting, new readers block until it has come and gone, so a steady
+ * stream of readers cannot starve it.
+ */
+typedef struct krwlock
+{
+    spinlock_t krw_lock;         /* protects the fields below */
+    long krw_readers;            /* number of threads holding it shared */
+    struct kthread *krw_writer;  /* thread holding it exclusive, or NULL */
+    long krw_writers_waiting;    /* number of threads in krw_writeq */
+    ktqueue_t krw_readq;         /* readers waiting for the writers to finish */
+    ktqueue_t krw_writeq;        /* writers waiting for exclusive access */
+} krwlock_t;
+
+#define KRWLOCK_INITIALIZER(rw)                                  \
+    {                                                            \
+        .krw_lock = SPINLOCK_INITIALIZER((rw).krw_lock),         \
+        .krw_readers = 0, .krw_writer = NULL,                    \
+        .krw_writers_waiting = 0,                                \
+        .krw_readq = KTQUEUE_INITIALIZER((rw).krw_readq),        \
+        .krw_writeq = KTQUEUE_INITIALIZER((rw).krw_writeq),      \
+    }
+
+/*==========
+ * Functions
+ *=========*/
+
+/**
+ * Initializes a reader-writer lock.
+ *
+ * @param rw the lock
+ */
+void krwlock_init(krwlock_t *rw);
+
+/**
+ * Acquires the lock shared.
+ *
+ * Note: This function may block.
+ *
+ * Note: The lock is not re-entrant; a reader must not take it again, since a
+ * writer queued in between would deadlock both.
+ *
+ * @param rw the lock
+ */
+void krwlock_read_lock(krwlock_t *rw);
+
+/**
+ * Acquires the lock shared if that can be done without blocking.
+ *
+ * @param rw the lock
+ * @return nonzero if the lock was acquired, 0 otherwise
+ */
+long krwlock_read_trylock(krwlock_t *rw);
+
+/**
+ * Releases a shared hold on the lock.
+ *
+ * @param rw the lock
+ */
+void krwlock_read_unlock(krwlock_t *rw);
+
+/**
+ * Acquires the lock exclusive.
+ *
+ * Note: This function may block.
+ *
+ * @param rw the lock
+ */
+void krwlock_write_lock(krwlock_t *rw);
+
+/**
+ * Releases an exclusive hold on the lock.
+ *
+ * @param rw the lock
+ */
+void krwlock_write_unlock(krwlock_t *rw);
+
+/**
+ * Checks if the current thread holds the lock exclusive.
+ *
+ * @param rw the lock
+ * @return true if curthr is the writer
+ */
+long krwlock_owns_write(krwlock_t *rw);
@@ -29,27 +29,52 @@ typedef enum
 
 /*
  * Thread descriptor.
+ *
+ * What a context switch and a sleep or wakeup touch comes first: kt_ctx and
+ * the fields after it up to kt_quantum fill the first two cache lines (see
+ * the assertions in kthread.c), and the rest is read far less often.
  */
 typedef struct kthread
 {
     context_t kt_ctx;     /* Thread context */
     char *kt_kstack;      /* Kernel stack */
-    void *kt_retval;      /* Return value */
-    long kt_errno;        /* Errno of most recent syscall */
     struct proc *kt_proc; /* Corresponding process */
 
-    long kt_cancelled;   /* Set if the thread has been cancelled */
-    ktqueue_t *kt_wchan; /* If blocking, the queue this thread is blocked on */
     kthread_state_t kt_state;
-
-    list_link_t kt_plink; /* Link on the process's thread list, p_threads */
+    ktqueue_t *kt_wchan; /* If blocking, the queue this thread is blocked on */
     list_link_t
-        kt_qlink; /* Link on some ktqueue if the thread is not running */
+        kt_qlink;        /* Link on some ktqueue if the thread is not running */
+    long kt_cancelled;   /* Set if the thread has been cancelled */
+    uint64_t kt_preemption_count;
+    long kt_need_resched; /* Set when the time slice runs out */
+    long kt_quantum;     /* Timer ticks left in the current time slice */
+
+    long kt_nice;        /* Scheduling priority, lower runs first */
+    long kt_base_nice;   /* kt_nice, less what it inherits from the waiters
+                          * on kt_mutexes; see kmutex.c */
+    long kt_recent_core; /* Core this thread last ran on, or -1 */
+    uint64_t kt_affinity; /* Cores it may run on; see sched_set_affinity() */
+    long kt_wait_exclusive; /* Set while in an exclusive wait on kt_wchan */
+    void *kt_retval;      /* Return value */
+    long kt_errno;        /* Errno of most recent syscall */
 
+    list_link_t kt_plink; /* Link on the process's thread list, p_threads */
     list_t kt_mutexes;   /* List of owned mutexes, for use in debugging */
-    // long kt_recent_core; /* For SMP */
 
-    uint64_t kt_preemption_count;
+    long kt_fs_handles;  /* Filesystem journal handles held, see
+                          * s5_journal_start */
+    pid_t kt_tid;        /* Thread ID, never reused; see gettid(2) */
+    uintptr_t kt_tls;    /* User TLS pointer, which core_switch() loads into
+                          * the FS base */
+    struct pmu_thread *kt_pmu; /* Performance counts, or NULL; see pmu.h */
+    struct fpu_thread *kt_fpu; /* FPU and SIMD state, or NULL; see fpu.h */
+
+    /* Scheduler accounting, in jiffies; see sched_info() */
+    uint64_t kt_run_ticks;   /* Time spent on a CPU */
+    uint64_t kt_wait_ticks;  /* Time spent runnable on a run queue */
+    uint64_t kt_nvcsw;       /* Switches away because the thread blocked */
+    uint64_t kt_nivcsw;      /* Switches away while still runnable */
+    uint64_t kt_switched_at; /* When last queued to run, or last dispatched */
 } kthread_t;
 
 /*==========
@@ -75,6 +100,13 @@ void kthread_init(void);
 kthread_t *kthread_create(struct proc *proc, kthread_func_t func, long arg1,
                           void *arg2);
 
+/**
+ * Creates a thread like kthread_create, with a smaller stack, for daemons
+ * that only ever run kernel code
+ */
+kthread_t *kthread_create_daemon(struct proc *proc, kthread_func_t func,
+                                 long arg1, void *arg2);
+
 /**
  * Creates a clone of the specified thread
  *
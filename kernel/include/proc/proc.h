@@ -2,7 +2,9 @@
 
 #include "config.h"
 #include "mm/pagetable.h"
+#include "proc/kmutex.h"
 #include "proc/kthread.h"
+#include "proc/workqueue.h"
 #include "types.h"
 #include "vm/vmmap.h"
 
@@ -14,8 +16,21 @@
  * Process resource information
  */
 #define PROC_MAX_COUNT 65536
+#define PROC_HASH_BUCKETS 256 /* of the pid hash; see proc_lookup() */
 #define PROC_NAME_LEN 256
 
+/*
+ * Most pages a process may have resident (see p_rss) before its own page
+ * faults start taking them back, or 0 for no limit, unless setrlimit(2)
+ * says otherwise. Set in Config.mk; children inherit their parent's limit.
+ */
+#ifndef __RSS_LIMIT__
+#define __RSS_LIMIT__ 0
+#endif
+
+/* do_waitpid() options */
+#define WNOHANG 1 /* return 0 rather than sleep if no child has exited */
+
 /* Process states */
 typedef enum
 {
@@ -30,11 +45,13 @@ typedef struct proc
     char p_name[PROC_NAME_LEN]; /* Process name */
 
     list_t p_threads;  /* Threads list */
-    list_t p_children; /* Children list */
+    list_t p_children; /* Children list, of those still running */
+    list_t p_zombies;  /* Children that have exited, not yet waited for */
     struct proc *p_pproc; /* Parent process */
 
     list_link_t p_list_link;  /* Link of list of all processes */
-    list_link_t p_child_link; /* Link on parent's list of children */
+    list_link_t p_child_link; /* Link on parent's children or zombies */
+    list_link_t p_hash_link;  /* Link on its bucket of the pid hash */
 
     long p_status;        /* Exit status */
     proc_state_t p_state; /* Process state */
@@ -42,15 +59,37 @@ typedef struct proc
     pml4_t *p_pml4; /* Page table. */
 
     /*
-     * If a parent is waiting on a child, the parent puts itself on its own
-     * p_wait queue. When a child terminates, it broadcasts on its parent's
-     * p_wait to wake it up.
+     * If a parent is waiting on any child, the parent puts itself on its own
+     * p_wait queue; if on a particular child, on that child's p_exitq. When a
+     * child terminates, it broadcasts on both, so that a parent waiting for
+     * one child is not woken by the others.
      */
     ktqueue_t p_wait;
+    ktqueue_t p_exitq;
+
+    /*
+     * p_thr_lock protects p_threads and its threads' exits: a thread that
+     * exits while others live just leaves itself on p_threads, KT_EXITED,
+     * and broadcasts on p_thrwait, where thr_join() and an exit() waiting
+     * for the other threads sleep. p_exiting is set while a thread is
+     * killing the others, for exit() or execve().
+     */
+    spinlock_t p_thr_lock;
+    ktqueue_t p_thrwait;
+    long p_exiting;
 
     /* VFS related */
-    struct file *p_files[NFILES]; /* Open files */
-    struct vnode *p_cwd;          /* Current working directory */
+    struct fdtable *p_fdtable; /* Open files, see fs/fdtable.h */
+    struct vnode *p_cwd;       /* Current working directory */
+#ifdef __GETCWD__
+    /* p_cwd's path, kmalloc'd, or NULL if it is not known. It is only good
+     * while namev_path_generation() is still p_cwd_gen; see do_getcwd().
+     * p_cwd_mutex protects both. */
+    char *p_cwd_path;
+    uint64_t p_cwd_gen;
+    kmutex_t p_cwd_mutex;
+#endif
+    struct aio_ctx *p_aio;     /* Asynchronous I/O, see fs/aio.c */
 
     /* VM related */
     /*
@@ -70,6 +109,23 @@ typedef struct proc
     void *p_start_brk;     /* Initial value of process break */
     struct vmmap *p_vmmap; /* List of areas mapped into process's
                               user address space. */
+    void *p_vdso;          /* The process's vDSO page, see vm/vdso.c */
+
+    /* Page fault accounting; see pagefault_info() */
+    uint64_t p_minflt;           /* Faults handled without sleeping */
+    uint64_t p_majflt;           /* Faults that slept, e.g. to read a page in */
+    uint64_t p_cowflt;           /* Pages copied for writes to private maps */
+    uint64_t p_zeroflt;          /* Anonymous pages filled with zeros */
+    uint64_t p_fault_cycles;     /* Time spent handling faults, TSC cycles */
+    uint64_t p_fault_max_cycles; /* Longest time spent on a single fault */
+
+    /* Resident set: the mapped pages charged to the process, on p_rss_pages;
+     * see pframe_map(). p_rss_limit is the most it may keep, or 0. */
+    size_t p_rss;
+    size_t p_rss_limit;
+    list_t p_rss_pages;
+
+    work_t p_reap_work; /* Frees the address space once waited for */
 } proc_t;
 
 /*==========
@@ -100,12 +156,27 @@ void initproc_finish();
 proc_t *proc_create(const char *name);
 
 /**
- * Frees all the resources associated with a process.
+ * Finds a process by its pid.
+ *
+ * @param pid the pid to look up
+ * @return the process, or NULL if there is none with that pid
+ */
+proc_t *proc_lookup(pid_t pid);
+
+/**
+ * Frees all the resources associated with a process. The address space, and
+ * the proc_t itself, may be left to the reaper (see proc.c).
  *
  * @param proc process to destroy
  */
 void proc_destroy(proc_t *proc);
 
+/**
+ * Waits until the reaper has freed the address space of every process
+ * destroyed so far.
+ */
+void proc_reaper_drain();
+
 /**
  * Handles exiting the current process.
  *
@@ -144,9 +215,10 @@ void do_exit(long status);
  *
  * @param pid the pid to wait on, or -1 to wait on any child
  * @param status used to return the exit status of the child
- * @param options only 0 is supported (no options)
+ * @param options 0 or WNOHANG
  *
- * @return the pid of the child process which was cleaned up, or
+ * @return the pid of the child process which was cleaned up, 0 if WNOHANG
+ * was given and it has not exited, or
  *  - ENOTSUP invalid input
  *  - ECHILD valid child could not be found
  */
@@ -160,6 +232,92 @@ pid_t do_waitpid(pid_t pid, int *status, int options);
 struct regs;
 long do_fork(struct regs *regs);
 
+/**
+ * This function implements the spawn(2) system call: fork and execve in one
+ * step, without copying the caller's address space.
+ *
+ * @param filename the program to run
+ * @param argv the program's arguments
+ * @param envp the program's environment
+ * @param dups pairs of {oldfd, newfd}: in the child, newfd is made a
+ *        duplicate of oldfd and oldfd is closed, in order, before the load
+ * @param ndups number of pairs in dups
+ * @return the child's process id, or the error that kept it from starting
+ */
+long do_spawn(const char *filename, char *const *argv, char *const *envp,
+              const int (*dups)[2], size_t ndups);
+
+/**
+ * This function implements thr_create(2): starts a new thread in curproc.
+ *
+ * @param entry where the thread starts running in userland
+ * @param arg the thread's first argument, in %rdi
+ * @param stack the thread's initial stack pointer
+ * @param tls the thread's TLS pointer, see kt_tls
+ * @return the new thread's tid, or
+ *  - EFAULT entry or stack is not a user address
+ *  - EINVAL tls is not a user address
+ *  - EINTR another thread is killing the process
+ *  - ENOMEM not enough memory
+ */
+long do_thr_create(uintptr_t entry, uintptr_t arg, uintptr_t stack,
+                   uintptr_t tls);
+
+/**
+ * This function implements thr_join(2): waits for thread tid of curproc to
+ * exit and frees it.
+ *
+ * @param tid the thread to wait for
+ * @param retval where to return the thread's exit value, or NULL
+ * @return 0, or
+ *  - EDEADLK tid is the current thread
+ *  - ESRCH curproc has no thread tid (or it has been joined already)
+ *  - EINTR the current thread was cancelled
+ */
+long do_thr_join(pid_t tid, void **retval);
+
+/**
+ * This function implements thr_cancel(2): cancels thread tid of curproc,
+ * which exits with PTHREAD_CANCELED ((void *)-1).
+ *
+ * @param tid the thread to cancel
+ * @return 0, or
+ *  - EDEADLK tid is the current thread
+ *  - ESRCH curproc has no running thread tid
+ */
+long do_thr_cancel(pid_t tid);
+
+/**
+ * Cancels the other threads of curproc and waits for them to exit, for
+ * exit() and execve().
+ *
+ * @param status the status the other threads exit with
+ * @return 0, or -EINTR if another thread is already doing so (the current
+ * thread is then being cancelled)
+ */
+long proc_kill_siblings(long status);
+
+/**
+ * Implements getrlimit(2) for curproc.
+ *
+ * @param resource the resource, which must be RLIMIT_RSS
+ * @param rlim where the limit is put
+ * @return 0, or -EINVAL for any other resource
+ */
+struct rlimit;
+long do_getrlimit(int resource, struct rlimit *rlim);
+
+/**
+ * Implements setrlimit(2) for curproc. Lowering the resident set limit
+ * below what the process has resident takes effect at its next page fault.
+ *
+ * @param resource the resource, which must be RLIMIT_RSS
+ * @param rlim the new limit
+ * @return 0, or -EINVAL for any other resource, or a soft limit above the
+ * hard one
+ */
+long do_setrlimit(int resource, const struct rlimit *rlim);
+
 /*===========
  * Miscellany
  *==========*/
@@ -175,6 +333,12 @@ long do_fork(struct regs *regs);
  */
 extern proc_t idleproc;
 
+/*
+ * List of all processes other than idleproc, linked through p_list_link.
+ * Only for walking in debugging code such as sched_info().
+ */
+extern list_t proc_list;
+
 /*=====================
  * Functions: Debugging
  *====================*/
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "proc/spinlock.h"
+#include "types.h"
 #include "util/list.h"
 
 /*===========
@@ -27,6 +28,54 @@ typedef struct ktqueue
         .tq_list = LIST_INITIALIZER((ktqueue).tq_list),             \
     }
 
+/*
+ * Scheduling priorities. Every thread has a nice value in
+ * [SCHED_NICE_MIN, SCHED_NICE_MAX]; lower values run first.
+ */
+#define SCHED_NICE_MIN (-20)
+#define SCHED_NICE_MAX 19
+#define SCHED_NICE_DEFAULT 0
+#define SCHED_NPRIO (SCHED_NICE_MAX - SCHED_NICE_MIN + 1)
+
+/*
+ * A woken thread goes back to the core it last ran on unless that core has
+ * more than this many threads queued beyond the waking core's run queue.
+ */
+#define SCHED_AFFINITY_SLACK 2
+
+/*
+ * CPU masks, as kept in kt_affinity and taken by sched_setaffinity(2), have a
+ * bit for each core id. A thread created by fork(), spawn() or thr_create()
+ * takes its creator's mask; any other starts out with SCHED_AFFINITY_DEFAULT,
+ * every core but those in __ISOLATED_CORES__ (set in Config.mk). Those are
+ * so kept free of general work: only threads put there with
+ * sched_setaffinity(2), and their children, run on them.
+ */
+#ifndef __ISOLATED_CORES__
+#define __ISOLATED_CORES__ 0
+#endif
+
+#define SCHED_CORE(id) (1UL << (id))
+#define SCHED_AFFINITY_DEFAULT (~(uint64_t)(__ISOLATED_CORES__))
+
+/*
+ * Number of log2 buckets in the run queue wait histogram reported by
+ * sched_info(); the last one collects every wait of 2^14 jiffies or more.
+ */
+#define SCHED_WAIT_HIST_BUCKETS 16
+
+/*
+ * A run queue holds one ktqueue per priority. Bit i of rq_bitmap is set iff
+ * rq_queues[i] is non-empty, so the highest runnable priority is found with a
+ * single bit scan.
+ */
+typedef struct runq
+{
+    ktqueue_t rq_queues[SCHED_NPRIO];
+    uint64_t rq_bitmap;
+    size_t rq_size;
+} runq_t;
+
 /*
  * kthread declaration to make function signatures happy
  */
@@ -60,6 +109,25 @@ void sched_yield();
  */
 void sched_make_runnable(struct kthread *thr);
 
+/**
+ * Changes a thread's priority at once, moving it to the right run queue if
+ * it is waiting on one; for priority inheritance, see kmutex.c.
+ *
+ * @param thr the thread
+ * @param nice its new nice value
+ */
+void sched_set_nice(struct kthread *thr, long nice);
+
+/**
+ * Sets the cores a thread may run on. One waiting on a run queue of a core it
+ * is no longer allowed on is moved at once; one running on such a core moves
+ * the next time it is preempted, or at once if it is the current thread.
+ *
+ * @param thr the thread
+ * @param mask its new CPU mask, which must allow an online core
+ */
+void sched_set_affinity(struct kthread *thr, uint64_t mask);
+
 /**
  * Causes the current thread to enter into an uncancellable sleep on
  * the given queue.
@@ -69,6 +137,16 @@ void sched_make_runnable(struct kthread *thr);
  */
 void sched_sleep_on(ktqueue_t *q);
 
+/**
+ * Like sched_sleep_on(), but the caller holds lock, which protects q. The
+ * lock is released only once the current thread is on q, so a wakeup issued
+ * under the same lock cannot slip in between and be missed.
+ *
+ * @param q the queue to sleep on
+ * @param lock the spinlock protecting q, released before this returns
+ */
+void sched_sleep_on_locked(ktqueue_t *q, spinlock_t *lock);
+
 /**
  * Causes the current thread to enter into a cancellable sleep on the
  * given queue.
@@ -79,6 +157,26 @@ void sched_sleep_on(ktqueue_t *q);
  */
 long sched_cancellable_sleep_on(ktqueue_t *queue);
 
+/**
+ * Like sched_sleep_on_locked(), but cancellable.
+ *
+ * @param q the queue to sleep on
+ * @param lock the spinlock protecting q, released before this returns
+ * @return -EINTR if the thread was cancelled and 0 otherwise
+ */
+long sched_cancellable_sleep_on_locked(ktqueue_t *q, spinlock_t *lock);
+
+/**
+ * Like sched_cancellable_sleep_on(), but gives up once jiffies reach
+ * expires.
+ *
+ * @param queue the queue to sleep on
+ * @param expires the deadline, in jiffies
+ * @return 0 if woken, -ETIMEDOUT if the deadline passed first, or -EINTR if
+ * the thread was cancelled
+ */
+long sched_sleep_on_timeout(ktqueue_t *queue, uint64_t expires);
+
 /**
  * Wakes up a thread from q.
  *
@@ -95,6 +193,31 @@ void sched_wakeup_on(ktqueue_t *q, struct kthread **thrp);
  */
 void sched_broadcast_on(ktqueue_t *q);
 
+/**
+ * Like sched_sleep_on(), but marks the wait exclusive: sched_wake_on() wakes
+ * only one exclusive waiter at a time. Use this when whatever the waiter is
+ * waiting for can only be consumed by one thread.
+ *
+ * @param q the queue to sleep on
+ */
+void sched_sleep_on_exclusive(ktqueue_t *q);
+
+/**
+ * Wakes every non-exclusive waiter on q and the longest waiting exclusive
+ * waiter, if any.
+ *
+ * @param q the queue to wake up threads from
+ */
+void sched_wake_on(ktqueue_t *q);
+
+/**
+ * Sets the current thread's TLS pointer, the FS base it runs in userland
+ * with.
+ *
+ * @param tls the new pointer
+ */
+void sched_set_tls(uintptr_t tls);
+
 /**
  * Cancel the given thread from the queue it sleeps on.
  *
@@ -117,6 +240,74 @@ void sched_queue_init(ktqueue_t *queue);
  */
 long sched_queue_empty(ktqueue_t *queue);
 
+/**
+ * Charges one timer tick to curthr's time slice. Called from the timer
+ * interrupt; when the slice runs out curthr is marked for rescheduling.
+ */
+void sched_tick();
+
+/**
+ * Yields the CPU if curthr's time slice has run out. Called on the way back
+ * to user mode, where no kernel locks are held.
+ */
+void sched_preempt_point();
+
+/**
+ * Yields the CPU if curthr's time slice has run out and it may be preempted.
+ * Called between the steps of long loops in kernel code, which must be able
+ * to sleep there, so that they do not hold up the other threads on the
+ * core until they are done. With __KPREEMPT__, kernel code is also
+ * preempted on the way out of interrupts, see sched_preempt_kernel().
+ */
+void cond_resched();
+
+#ifdef __KPREEMPT__
+void sched_preempt_kernel();
+#endif
+
+/**
+ * Implements the nice(2) system call: adds incr to the current thread's nice
+ * value, clamping the result to [SCHED_NICE_MIN, SCHED_NICE_MAX]. A priority
+ * the thread inherits through the mutexes it holds stays in force.
+ *
+ * @param incr amount to add to the nice value
+ * @return the new nice value
+ */
+long do_nice(long incr);
+
+/**
+ * Implements sched_setaffinity(2): allows every thread of the process with
+ * the given pid (the caller's if 0) on the cores in mask, and only them.
+ *
+ * @param pid the process
+ * @param mask the cores, with at least one of them online
+ * @return 0, -ESRCH if there is no such process, or -EINVAL if mask has no
+ * online core
+ */
+long do_sched_setaffinity(pid_t pid, uint64_t mask);
+
+/**
+ * Implements sched_getaffinity(2): the online cores the given process (the
+ * caller's if 0) may run on, those of any of its threads.
+ *
+ * @param pid the process
+ * @param maskp where the mask is put
+ * @return 0 or -ESRCH if there is no such process
+ */
+long do_sched_getaffinity(pid_t pid, uint64_t *maskp);
+
+/**
+ * Provides per-thread CPU accounting (run time, time spent waiting on a run
+ * queue, voluntary and involuntary switches) followed by a histogram of run
+ * queue wait times summed over all cores. All times are in jiffies.
+ *
+ * @param arg must be NULL
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the remaining size of the buffer
+ */
+size_t sched_info(const void *arg, char *buf, size_t osize);
+
 /**
  * Functions for managing the current thread's preemption status.
  */
@@ -34,4 +34,12 @@ void spinlock_lock(spinlock_t *lock);
  */
 void spinlock_unlock(spinlock_t *lock);
 
+/**
+ * Locks the specified spinlock if it is free, without spinning.
+ *
+ * @param lock the spinlock to lock
+ * @return nonzero if the lock was taken, 0 if it is held
+ */
+long spinlock_trylock(spinlock_t *lock);
+
 long spinlock_ownslock(spinlock_t *lock);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "util/list.h"
+#include "util/timer.h"
+
+struct work;
+struct worker;
+
+typedef void (*work_func_t)(struct work *work);
+
+/* A function for a worker thread to run. Work may be queued from interrupt
+ * context; it runs in thread context, and may sleep. */
+typedef struct work
+{
+    work_func_t w_func;
+    long w_pending;           /* queued and not yet started */
+    struct worker *w_worker;  /* the one it was last queued on */
+    list_link_t w_link;
+} work_t;
+
+/* Work that is queued once a timer fires */
+typedef struct delayed_work
+{
+    work_t dw_work;
+    timer_t dw_timer;
+} delayed_work_t;
+
+void work_init(work_t *work, work_func_t func);
+
+void delayed_work_init(delayed_work_t *dw, work_func_t func);
+
+long queue_work(work_t *work);
+
+long queue_delayed_work(delayed_work_t *dw, uint64_t delay);
+
+void flush_work(work_t *work);
+
+long cancel_delayed_work(delayed_work_t *dw);
+
+long workqueue_running();
+
+void workqueue_init();
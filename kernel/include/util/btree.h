@@ -15,12 +15,19 @@
  * Upper bound: each node has at most 2t-1 keys, at most 2t children
  * Height of the tree is bound by log_t(n + 1) / 2 where n is the number of nodes
  * 
- * Change it as needed for performance
+ * A search only looks at a node's header and keys, so the default of 4 is
+ * picked for those to take exactly one 64-byte cache line (8 bytes of
+ * header, 7 keys); the data and children arrays take two more. Define
+ * BTREE_BRANCHING_FACTOR to override it.
  */
 
-#define BRANCHING_FACTOR 2
-#define MAX_KEYS (2*BRANCHING_FACTOR) - 1
-#define MAX_CHILDREN 2*BRANCHING_FACTOR
+#ifndef BTREE_BRANCHING_FACTOR
+#define BTREE_BRANCHING_FACTOR 4
+#endif
+
+#define BRANCHING_FACTOR BTREE_BRANCHING_FACTOR
+#define MAX_KEYS (2 * BRANCHING_FACTOR - 1)
+#define MAX_CHILDREN (2 * BRANCHING_FACTOR)
 
 /*
  * btree_node is the core of our rough btree implementation here
@@ -37,9 +44,9 @@
 
 typedef struct btree_node
 {
-    unsigned int n_keys;
-    unsigned int n_children;
-    int is_leaf;
+    uint16_t n_keys;
+    uint16_t n_children;
+    uint16_t is_leaf;
     uint64_t keys[MAX_KEYS];
     void *data[MAX_KEYS];
     struct btree_node *children[MAX_CHILDREN];
@@ -60,4 +67,14 @@ void btree_node_free(btree_node_t **node);
 
 void btree_destroy(btree_node_t *root);
 
+long btree_bulk_load(btree_node_t **root, const uint64_t *keys,
+                     void *const *data, size_t n);
+
+/* Called by btree_iterate_range for each entry; a nonzero return stops the
+ * iteration and is passed back to its caller. */
+typedef long (*btree_visit_func_t)(uint64_t key, void *data, void *arg);
+
+long btree_iterate_range(btree_node_t *root, uint64_t lo, uint64_t hi,
+                         btree_visit_func_t visit, void *arg);
+
 void print_btree(btree_node_t *x);
\ No newline at end of file
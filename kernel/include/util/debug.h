@@ -1,6 +1,7 @@
 #pragma once
 
 #include "globals.h"
+#include "kernel.h"
 #include "main/interrupt.h"
 #include "mm/page.h"
 #include "proc/spinlock.h"
@@ -152,6 +153,10 @@ typedef size_t (*dbg_infofunc_t)(const void *data, char *buf, size_t size);
 
 void dbg_init(void);
 
+void dbg_async_init(void);
+
+void dbg_sync(void);
+
 void dbg_print(char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 void dbg_printinfo(dbg_infofunc_t func, const void *data);
@@ -160,7 +165,7 @@ const char *dbg_color(uint64_t d_mode);
 
 #if defined(__SMP__) || defined(__KPREEMPT__)
 #define DEBUG_ENTER                                                       \
-    uint8_t __ipl = apic_initialized() ? intr_setipl(IPL_HIGH) : IPL_LOW; \
+    uint8_t __ipl = apic_initialized() ? intr_setipl(IPL_HIGH) : IPL_LOW;
 #define DEBUG_EXIT                \
     if (apic_initialized())       \
         intr_setipl(__ipl);
@@ -175,7 +180,21 @@ const char *dbg_color(uint64_t d_mode);
     } while (0);
 #endif
 
-#ifndef NDEBUG
+/* Printed whatever the modes and the profile */
+#define dbg_force(mode, ...)                                     \
+    do                                                           \
+    {                                                            \
+        DEBUG_ENTER                                              \
+        dbg_print("%s", dbg_color(mode));                        \
+        dbg_print("C%ld P%ld ", curcore.kc_id,                   \
+                  curproc ? curproc->p_pid : -1L);               \
+        dbg_print("%s:%d %s(): ", __FILE__, __LINE__, __func__); \
+        dbg_print(__VA_ARGS__);                                  \
+        dbg_print("%s", _NORMAL_);                               \
+        DEBUG_EXIT                                               \
+    } while (0)
+
+#if __ASSERT_LEVEL__ >= ASSERT_LEVEL_DEBUG
 #define dbg(mode, ...)                                               \
     do                                                               \
     {                                                                \
@@ -192,19 +211,6 @@ const char *dbg_color(uint64_t d_mode);
         }                                                            \
     } while (0)
 
-#define dbg_force(mode, ...)                                     \
-    do                                                           \
-    {                                                            \
-        DEBUG_ENTER                                              \
-        dbg_print("%s", dbg_color(mode));                        \
-        dbg_print("C%ld P%ld ", curcore.kc_id,                   \
-                  curproc ? curproc->p_pid : -1L);               \
-        dbg_print("%s:%d %s(): ", __FILE__, __LINE__, __func__); \
-        dbg_print(__VA_ARGS__);                                  \
-        dbg_print("%s", _NORMAL_);                               \
-        DEBUG_EXIT                                               \
-    } while (0)
-
 #define dbgq(mode, ...)                                \
     do                                                 \
     {                                                  \
@@ -242,9 +248,21 @@ void dbg_add_mode(const char *mode);
 void dbg_add_modes(const char *modes);
 
 #else
-#define dbg(mode, ...)
-#define dbgq(mode, ...)
-#define dbginfo(mode, func, data)
+/* The arguments are still compiled, so that the variables only messages
+ * use are not left unused, but never evaluated */
+#define dbg(mode, ...)              \
+    do                              \
+    {                               \
+        if (0)                      \
+            dbg_print(__VA_ARGS__); \
+    } while (0)
+#define dbgq(mode, ...) dbg(mode, __VA_ARGS__)
+#define dbginfo(mode, func, data)          \
+    do                                     \
+    {                                      \
+        if (0)                             \
+            dbg_printinfo((func), (data)); \
+    } while (0)
 #define dbg_active(mode) 0
 #define dbg_add_mode(mode)
 #define dbg_add_modes(modes)
@@ -305,3 +323,14 @@ static long greaterthaneq(long l, long r) { return l >= r; }
 #define KASSERT_GREQ(l, r)
 #define KASSERT_LESSEQ(l, r)
 #endif
+
+/* Checks compiled in at or above an assertion level (see kernel.h); below
+ * it, x is still compiled, but never evaluated */
+#define KASSERT_LEVEL(level, x)          \
+    do                                   \
+    {                                    \
+        if (__ASSERT_LEVEL__ >= (level)) \
+            KASSERT(x);                  \
+    } while (0)
+#define KASSERT_DEBUG(x) KASSERT_LEVEL(ASSERT_LEVEL_DEBUG, x)
+#define KASSERT_PARANOID(x) KASSERT_LEVEL(ASSERT_LEVEL_PARANOID, x)
@@ -125,11 +125,16 @@ long list_empty(const list_t *list);
 
 /**
  * Assert that the internal state of a list is sane, and 
- * panic if it is not.
+ * panic if it is not. A debug-level check: compiled out of release
+ * kernels (see kernel.h).
  * 
  * @param list The list to check for sanity.
  */
+#if __ASSERT_LEVEL__ >= ASSERT_LEVEL_DEBUG
 void list_assert_sanity(const list_t *list);
+#else
+#define list_assert_sanity(list) ((void)(list))
+#endif
 
 /**
  * Insert a new link onto a list before another link.
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "types.h"
+
+struct regs;
+
+/*
+ * A sampling profiler. While it is on, each core's timer tick records where
+ * it interrupted (the RIP, and the pid of the process it was running) in a
+ * ring of its own; the newest PROFILE_SAMPLES are kept. profile_dump() writes
+ * them to the debug log, one
+ *
+ *   PROF core=<id> pid=<pid> rip=<address>
+ *
+ * line each, for python/weenix/profile.py to symbolize against weenix.dbg.
+ * Samples that land in the idle loop are not recorded.
+ */
+
+#define PROFILE_SAMPLES 8192
+
+long profile_start();
+
+void profile_stop();
+
+long profile_running();
+
+void profile_sample(struct regs *regs);
+
+size_t profile_dump();
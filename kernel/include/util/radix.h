@@ -0,0 +1,73 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * A radix tree mapping 64-bit keys to pointers, in the style of the Linux
+ * page cache index. Each node has RADIX_TREE_SLOTS slots, indexed by
+ * RADIX_TREE_SHIFT bits of the key, so a tree of height h holds the keys
+ * below 64^h and a lookup touches h nodes. The tree grows and shrinks in
+ * height with the largest key it holds.
+ *
+ * Every entry carries RADIX_TREE_NTAGS tag bits. A node has a tag set for a
+ * slot if any entry below that slot has it, which lets tagged entries be
+ * found without visiting the rest (see radix_tree_gang_lookup_tag).
+ *
+ * The tree does no locking of its own.
+ */
+
+#define RADIX_TREE_SHIFT 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK (RADIX_TREE_SLOTS - 1)
+#define RADIX_TREE_NTAGS 2
+
+/* Enough levels to cover a 64-bit key */
+#define RADIX_TREE_MAX_HEIGHT                                                  \
+    ((64 + RADIX_TREE_SHIFT - 1) / RADIX_TREE_SHIFT)
+
+typedef struct radix_node
+{
+    unsigned int rn_count;       /* number of non-NULL slots */
+    unsigned int rn_offset;      /* slot in rn_parent */
+    struct radix_node *rn_parent;
+    uint64_t rn_tags[RADIX_TREE_NTAGS];
+    void *rn_slots[RADIX_TREE_SLOTS];
+} radix_node_t;
+
+/* A zeroed radix_tree_t is an empty tree. */
+typedef struct radix_tree
+{
+    radix_node_t *rt_root;
+    unsigned int rt_height;
+} radix_tree_t;
+
+void radix_init();
+
+void radix_tree_init(radix_tree_t *tree);
+
+static inline long radix_tree_empty(const radix_tree_t *tree)
+{
+    return tree->rt_root == NULL;
+}
+
+long radix_tree_insert(radix_tree_t *tree, uint64_t key, void *item);
+
+void *radix_tree_lookup(const radix_tree_t *tree, uint64_t key);
+
+void *radix_tree_delete(radix_tree_t *tree, uint64_t key);
+
+void radix_tree_tag_set(radix_tree_t *tree, uint64_t key, unsigned int tag);
+
+void radix_tree_tag_clear(radix_tree_t *tree, uint64_t key, unsigned int tag);
+
+long radix_tree_tag_get(const radix_tree_t *tree, uint64_t key,
+                        unsigned int tag);
+
+long radix_tree_tagged(const radix_tree_t *tree, unsigned int tag);
+
+size_t radix_tree_gang_lookup(const radix_tree_t *tree, void **results,
+                              uint64_t first, size_t max);
+
+size_t radix_tree_gang_lookup_tag(const radix_tree_t *tree, void **results,
+                                  uint64_t first, size_t max,
+                                  unsigned int tag);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * An intrusive red-black tree. Like list_link_t, an rb_node_t is embedded
+ * in the structure that is being kept in the tree, and rb_entry() gets back
+ * from one to the other. The tree does not know the keys: to insert, the
+ * caller walks down from rbt_root to the NULL child pointer the new node
+ * belongs at and hands that to rbtree_insert(), as in
+ *
+ *     rb_node_t *parent = NULL, **link = &tree->rbt_root;
+ *     while (*link)
+ *     {
+ *         parent = *link;
+ *         link = key < rb_entry(parent, ...)->key ? &parent->rb_left
+ *                                                 : &parent->rb_right;
+ *     }
+ *     rbtree_insert(tree, parent, link, &item->node);
+ *
+ * Searches are done the same way, without the tree's help.
+ *
+ * A tree can be augmented with data each node keeps about its subtree (a
+ * maximum, a sum, ...). rbt_update, if set, is called to recompute a node's
+ * data from its own and its children's whenever the subtree below it
+ * changes; insertion and removal call it on O(log n) nodes. If the key or
+ * the augmented data of a node changes in place, call rbtree_update_path()
+ * on it.
+ *
+ * The tree does no locking of its own.
+ */
+
+typedef struct rb_node
+{
+    struct rb_node *rb_parent;
+    struct rb_node *rb_left;
+    struct rb_node *rb_right;
+    long rb_red;
+} rb_node_t;
+
+typedef void (*rb_update_func_t)(rb_node_t *node);
+
+typedef struct rbtree
+{
+    rb_node_t *rbt_root;
+    rb_update_func_t rbt_update;
+} rbtree_t;
+
+#define rb_entry(node, type, member) CONTAINER_OF(node, type, member)
+
+void rbtree_init(rbtree_t *tree, rb_update_func_t update);
+
+void rbtree_insert(rbtree_t *tree, rb_node_t *parent, rb_node_t **link,
+                   rb_node_t *node);
+
+void rbtree_remove(rbtree_t *tree, rb_node_t *node);
+
+void rbtree_update_path(rbtree_t *tree, rb_node_t *node);
+
+rb_node_t *rbtree_first(rbtree_t *tree);
+
+rb_node_t *rbtree_last(rbtree_t *tree);
+
+rb_node_t *rbtree_next(rb_node_t *node);
+
+rb_node_t *rbtree_prev(rb_node_t *node);
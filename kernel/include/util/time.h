@@ -3,6 +3,10 @@
 #include "types.h"
 #include "util/debug.h"
 
+#define TIME_APIC_TICK_FREQUENCY 16
+// this is pretty wrong...
+#define MICROSECONDS_PER_APIC_TICK (16 * 1000 / TIME_APIC_TICK_FREQUENCY)
+
 extern uint64_t timer_tickcount;
 extern uint64_t kernel_preempted_count;
 extern uint64_t user_preempted_count;
@@ -12,6 +16,12 @@ extern volatile uint64_t jiffies;
 
 void time_init();
 
+uint64_t time_usec();
+
+void time_idle_enter();
+
+void time_idle_exit();
+
 void time_spin(time_t ms);
 
 void time_sleep(time_t ms);
@@ -3,12 +3,15 @@
 
 #include "util/list.h"
 
+struct timer_wheel;
+
 typedef struct timer
 {
     void (*function)(uint64_t data);
     uint64_t data;
-    uint64_t expires;
+    uint64_t expires; /* in jiffies; fires once jiffies >= expires */
     list_link_t link;
+    struct timer_wheel *wheel; /* the one it is pending on, or NULL */
 } timer_t;
 
 void timer_init(timer_t *timer);
@@ -17,12 +20,16 @@ void timer_add(timer_t *timer);
 
 int timer_del(timer_t *timer);
 
-int timer_mod(timer_t *timer, int expires);
+int timer_mod(timer_t *timer, uint64_t expires);
 
 int timer_pending(timer_t *timer);
 
 int timer_del_sync(timer_t *timer);
 
+void timers_init();
+
+uint64_t timers_next_expiry();
+
 void __timers_fire();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Static tracepoints. TRACE(event, a0, a1) costs one load and branch unless
+ * the event is enabled, and then writes a fixed-size record (the TSC, the
+ * event, the current pid and two arguments) to the current core's ring, with
+ * no lock and no formatting; the newest TRACE_RECORDS of each core are kept.
+ * trace_dump() writes them to the debug log, one
+ *
+ *   TRACE core=<id> tsc=<tsc> ev=<name> pid=<pid> a0=<hex> a1=<hex>
+ *
+ * line each, after a "TRACE hz=<tsc rate>" line, for python/weenix/trace.py
+ * to merge across cores and put in order. Unlike dbg(), tracing the disk or
+ * the scheduler leaves their timing alone.
+ */
+
+#define TRACE_RECORDS 4096
+
+/* The arguments each event records are noted beside it */
+typedef enum trace_event
+{
+    TRACE_SCHED_SWITCH,   /* thread switched to, its tid */
+    TRACE_SCHED_STEAL,    /* thread stolen, core it was taken from */
+    TRACE_SCHED_PREEMPT,  /* thread preempted, its tid */
+    TRACE_DISK_ISSUE,     /* command slot, first sector; bit 63 if a write */
+    TRACE_DISK_COMPLETE,  /* command slot, first sector */
+    TRACE_PFRAME_FILL,    /* mobj, page number */
+    TRACE_PFRAME_FLUSH,   /* mobj, page number */
+    TRACE_SYSCALL_ENTER,  /* system call number, argument */
+    TRACE_SYSCALL_EXIT,   /* system call number, return value */
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+#define TRACE_ALL ((1UL << TRACE_EVENT_COUNT) - 1)
+
+extern volatile uint64_t trace_mask;
+
+#define TRACE(event, a0, a1)                                          \
+    do                                                                \
+    {                                                                 \
+        if (trace_mask & (1UL << (event)))                            \
+        {                                                             \
+            trace_record((event), (uint64_t)(a0), (uint64_t)(a1));    \
+        }                                                             \
+    } while (0)
+
+void trace_record(trace_event_t event, uint64_t a0, uint64_t a1);
+
+long trace_event_lookup(const char *name);
+
+long trace_start(uint64_t mask);
+
+void trace_stop();
+
+size_t trace_dump();
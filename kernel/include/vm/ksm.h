@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+/* Seconds between the sweeps of ksmd (KSM=1). A page is only merged once
+ * its contents have stayed the same from one sweep to the next. */
+#define KSM_INTERVAL_SECS 5
+
+struct pframe;
+struct vmmap;
+struct ksm_page;
+
+void ksm_init();
+
+long ksm_get_pframe(struct pframe *pf, struct pframe **pfp);
+
+long ksm_fill_pframe(struct pframe *pf);
+
+void ksm_discard_pframe(struct pframe *pf);
+
+long ksm_gift_page(struct vmmap *map, uintptr_t vaddr, struct ksm_page **kpp);
+
+long ksm_map_page(struct vmmap *map, uintptr_t vaddr, struct ksm_page *kp);
+
+long ksm_page_read(struct ksm_page *kp, size_t off, void *buf, size_t n);
+
+void ksm_page_release(struct ksm_page *kp);
+
+size_t ksm_info(const void *arg, char *buf, size_t osize);
+
+#ifdef __KSM__
+void ksmd_init();
+#endif
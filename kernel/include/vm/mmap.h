@@ -6,3 +6,10 @@ long do_munmap(void *addr, size_t len);
 
 long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
              void **ret);
+
+long do_mprotect(void *addr, size_t len, int prot);
+
+long do_madvise(void *addr, size_t len, int advice);
+
+long do_mremap(void *addr, size_t old_len, size_t new_len, int flags,
+               void **ret);
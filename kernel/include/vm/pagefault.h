@@ -8,4 +8,19 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC 0x10
 
+/* Faults the trace keeps, the latest over all processes (FAULT_TRACE=1) */
+#define PAGEFAULT_TRACE_ENTRIES 128
+
 void handle_pagefault(uintptr_t vaddr, uintptr_t cause);
+
+long pagefault_populate(uintptr_t vaddr, size_t npages, long forwrite);
+
+struct pframe;
+long pagefault_pin(uintptr_t vaddr, size_t npages, long forwrite,
+                   struct pframe **pfs);
+
+struct vnode;
+void pagefault_readahead(struct vnode *vn, size_t pagenum, size_t npages);
+
+struct proc;
+size_t pagefault_info(const struct proc *p, char *buf, size_t osize);
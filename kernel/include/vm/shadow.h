@@ -2,10 +2,29 @@
 
 #include "mm/mobj.h"
 
+/* fork flattens a private object's shadow chain rather than let it grow
+ * past this many shadow objects, see shadow_flatten */
+#define SHADOW_MAX_DEPTH 8
+
+/* Seconds between shadowd sweeps */
+#define SHADOWD_INTERVAL_SECS 10
+
 void shadow_init();
 
 mobj_t *shadow_create(mobj_t *shadowed);
 
 void shadow_collapse(mobj_t *o);
 
+long shadow_flatten(mobj_t *o);
+
+size_t shadow_depth(mobj_t *o);
+
+mobj_t *shadow_shadowed(mobj_t *o);
+
+mobj_t *shadow_bottom(mobj_t *o);
+
+#ifdef __SHADOWD__
+void shadowd_init();
+#endif
+
 extern int shadow_count;
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "types.h"
+
+struct proc;
+struct vmarea;
+struct vmmap;
+
+void vdso_init(void);
+
+void vdso_tick(uint64_t ticks);
+
+long vdso_map(struct vmmap *map);
+
+long vdso_fault(struct vmarea *vma, uintptr_t page);
+
+void vdso_proc_free(struct proc *proc);
@@ -2,11 +2,16 @@
 
 #include "types.h"
 
+#include "proc/krwlock.h"
 #include "util/list.h"
+#include "util/rbtree.h"
 
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
+/* How far past the break vmmap_brk reserves the heap */
+#define BRK_RESERVE_PAGES 32
+
 struct mobj;
 struct proc;
 struct vnode;
@@ -15,6 +20,10 @@ typedef struct vmmap
 {
     list_t vmm_list;       /* list of virtual memory areas */
     struct proc *vmm_proc; /* the process that corresponds to this vmmap */
+    krwlock_t vmm_lock;    /* shared for lookups (page faults), exclusive
+                              to change vmm_list */
+    rbtree_t vmm_tree;     /* the areas of vmm_list, by vma_start */
+    struct vmarea *vmm_cache; /* the area vmmap_lookup last found */
 } vmmap_t;
 
 /* Make sure you understand why mapping boundaries are in terms of frame
@@ -30,16 +39,29 @@ typedef struct vmarea
                          map pages 10-15 of a file, and vma_off would be 10. */
 
     int vma_prot;  /* permissions (protections) on mapping, see mman.h */
+    int vma_maxprot; /* what mprotect may raise vma_prot to */
     int vma_flags; /* either MAP_SHARED or MAP_PRIVATE. It can also specify 
                       MAP_ANON and MAP_FIXED */
+    int vma_advice; /* expected access pattern, an MADV_ value (madvise) */
 
     struct vmmap *vma_vmmap; /* address space that this area belongs to */
     struct mobj *vma_obj;    /* the memory object that corresponds to this address region */
     list_link_t vma_plink;   /* link on process vmmap maps list */
+
+    rb_node_t vma_tnode;   /* node in vmm_tree */
+    /* Over the subtree of vmm_tree below vma_tnode: the lowest vma_start,
+     * the highest vma_end, and the largest gap between two areas */
+    size_t vma_sub_start;
+    size_t vma_sub_end;
+    size_t vma_sub_gap;
 } vmarea_t;
 
 void vmmap_init(void);
 
+vmarea_t *vmarea_alloc(void);
+
+void vmarea_free(vmarea_t *vma);
+
 vmmap_t *vmmap_create(void);
 
 void vmmap_destroy(vmmap_t **mapp);
@@ -53,6 +75,20 @@ long vmmap_map(vmmap_t *map, struct vnode *file, size_t lopage, size_t npages,
 
 long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages);
 
+long vmmap_advise(vmmap_t *map, size_t lopage, size_t npages, int advice);
+
+long vmmap_protect(vmmap_t *map, size_t lopage, size_t npages, int prot);
+
+long vmmap_remap(vmmap_t *map, size_t lopage, size_t oldpages, size_t newpages,
+                 int flags, size_t *newlopage);
+
+long vmmap_brk(vmmap_t *map, size_t startvfn, size_t oldvfn, size_t newvfn);
+
+struct vnode *vmarea_vnode(vmarea_t *vma);
+
+long vmmap_unmap_pframe(struct mobj *o, uint64_t pagenum, uintptr_t paddr,
+                        long force);
+
 long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages);
 
 ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir);
@@ -68,4 +104,6 @@ size_t vmmap_mapping_info_helper(const void *map, char *buf, size_t size,
 
 size_t vmmap_mapping_info(const void *map, char *buf, size_t size);
 
-void vmmap_insert(vmmap_t *map, vmarea_t *new_vma);
\ No newline at end of file
+void vmmap_insert(vmmap_t *map, vmarea_t *new_vma);
+
+void vmmap_update_area(vmmap_t *map, vmarea_t *vma);
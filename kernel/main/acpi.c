@@ -10,6 +10,11 @@
 #define RSDT_SIGNATURE (*(uint32_t *)"RSDT")
 #define FACP_SIGNATURE (*(uint32_t *)"FACP")
 #define DSDT_SIGNATURE (*(uint32_t *)"DSDT")
+#define SRAT_SIGNATURE (*(uint32_t *)"SRAT")
+
+#define SRAT_TYPE_LAPIC 0
+#define SRAT_TYPE_MEMORY 1
+#define SRAT_ENABLED 0x1
 
 #define RSDP_ALIGN 16
 
@@ -47,6 +52,38 @@ typedef struct rsd_table
     uint64_t rt_other[];
 } packed rsd_table_t;
 
+typedef struct srat_table
+{
+    acpi_header_t st_header;
+    uint32_t st_reserved1;
+    uint64_t st_reserved2;
+} packed srat_table_t;
+
+typedef struct srat_lapic
+{
+    uint8_t sl_type;
+    uint8_t sl_size;
+    uint8_t sl_domain_lo;
+    uint8_t sl_apicid;
+    uint32_t sl_flags;
+    uint8_t sl_sapic_eid;
+    uint8_t sl_domain_hi[3];
+    uint32_t sl_clock_domain;
+} packed srat_lapic_t;
+
+typedef struct srat_memory
+{
+    uint8_t sm_type;
+    uint8_t sm_size;
+    uint32_t sm_domain;
+    uint16_t sm_reserved1;
+    uint64_t sm_base;
+    uint64_t sm_len;
+    uint32_t sm_reserved2;
+    uint32_t sm_flags;
+    uint64_t sm_reserved3;
+} packed srat_memory_t;
+
 static uint8_t __acpi_checksum(const uint8_t *buf, long size)
 {
     uint8_t sum = 0;
@@ -159,3 +196,68 @@ void *acpi_table(uint32_t signature, int index)
     }
     return NULL;
 }
+
+/*
+ * Returns the next SRAT entry of the given type after off (0 to start),
+ * or NULL at the end of the table, and advances off past it.
+ */
+static uint8_t *_srat_next(srat_table_t *srat, uint8_t type, size_t *off)
+{
+    uint8_t *ptr = (uint8_t *)srat;
+    if (!*off)
+        *off = sizeof(*srat);
+    while (*off + 2 <= srat->st_header.ah_size)
+    {
+        uint8_t *entry = ptr + *off;
+        if (!entry[1])
+            return NULL;
+        *off += entry[1];
+        if (entry[0] == type)
+            return entry;
+    }
+    return NULL;
+}
+
+size_t acpi_srat_memory(acpi_mem_affinity_t *out, size_t max)
+{
+    srat_table_t *srat = acpi_table(SRAT_SIGNATURE, 0);
+    if (!srat)
+        return 0;
+
+    size_t n = 0;
+    size_t off = 0;
+    srat_memory_t *mem;
+    while (n < max &&
+           (mem = (srat_memory_t *)_srat_next(srat, SRAT_TYPE_MEMORY, &off)))
+    {
+        if (!(mem->sm_flags & SRAT_ENABLED) || !mem->sm_len)
+            continue;
+        out[n].ama_base = mem->sm_base;
+        out[n].ama_len = mem->sm_len;
+        out[n].ama_node = mem->sm_domain;
+        dbgq(DBG_CORE, "SRAT memory [0x%p, 0x%p) node %u\n",
+             (void *)mem->sm_base, (void *)(mem->sm_base + mem->sm_len),
+             mem->sm_domain);
+        n++;
+    }
+    return n;
+}
+
+long acpi_srat_apic_node(uint8_t apic_id)
+{
+    srat_table_t *srat = acpi_table(SRAT_SIGNATURE, 0);
+    if (!srat)
+        return -1;
+
+    size_t off = 0;
+    srat_lapic_t *lapic;
+    while ((lapic = (srat_lapic_t *)_srat_next(srat, SRAT_TYPE_LAPIC, &off)))
+    {
+        if (lapic->sl_apicid != apic_id || !(lapic->sl_flags & SRAT_ENABLED))
+            continue;
+        return lapic->sl_domain_lo | (lapic->sl_domain_hi[0] << 8) |
+               (lapic->sl_domain_hi[1] << 16) |
+               ((long)lapic->sl_domain_hi[2] << 24);
+    }
+    return -1;
+}
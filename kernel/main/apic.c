@@ -79,6 +79,7 @@
 #define LOCAL_APIC_CPUFOCUS 0x200
 #define LOCAL_APIC_NMI (4 << 8)
 #define LOCAL_APIC_TMR_PERIODIC 0x20000
+#define LOCAL_APIC_TMR_TSC_DEADLINE 0x40000
 #define LOCAL_APIC_TMR_BASEDIV (1 << 20)
 
 #define APIC_ADDR (apic->at_addr + PHYS_OFFSET)
@@ -167,6 +168,13 @@ static long initialized = 0;
 // Returns the maximum APIC ID
 inline long apic_max_id() { return max_apicid; }
 
+// Returns whether the ACPI tables list an enabled processor with this APIC ID
+long apic_processor_enabled(long apicid)
+{
+    return apicid >= 0 && apicid < MAX_LAPICS && lapics[apicid] &&
+           (lapics[apicid]->at_flags & 0x1);
+}
+
 /* [APIC  ID------------------------] */
 inline static long __lapic_getid(void) { return (LAPICID >> 24) & 0xff; }
 
@@ -218,7 +226,18 @@ inline static uint32_t __ioapic_getmaxredir(void)
     return (ioapic_read(IOAPIC_VER) >> 16) & 0xff;
 }
 
-inline static void __ioapic_setredir(uint32_t irq, uint8_t intr)
+/* [DEST----------------------------]
+ * The destination is a set of logical APIC IDs: of the cores in it, the one
+ * at the lowest priority takes the interrupt. */
+inline static void __ioapic_setdest(uint32_t irq, uint8_t cores)
+{
+    uint32_t data = ioapic_read(IRQ_TO_OFFSET(irq, 1));
+    ((uint8_t *)&data)[3] = cores;
+    ioapic_write(IRQ_TO_OFFSET(irq, 1), data);
+}
+
+inline static void __ioapic_setredir(uint32_t irq, uint8_t intr,
+                                     uint8_t cores)
 {
     /* Read in the redirect table lower register first */
     uint32_t data = ioapic_read(IRQ_TO_OFFSET(irq, 0));
@@ -238,9 +257,7 @@ inline static void __ioapic_setredir(uint32_t irq, uint8_t intr)
     /* Write this value to the apic */
     ioapic_write(IRQ_TO_OFFSET(irq, 0), data);
     /* Now deal with the higher order register */
-    data = ioapic_read(IRQ_TO_OFFSET(irq, 1));
-    ((uint8_t *)&data)[3] = 0xff;
-    ioapic_write(IRQ_TO_OFFSET(irq, 1), data);
+    __ioapic_setdest(irq, cores);
 }
 
 inline static void __ioapic_setmask(uint32_t irq, int mask)
@@ -282,6 +299,7 @@ static uint32_t apic_get_base(void)
 static long __apic_err()
 {
     dbg(DBG_PRINT, "[+] APIC Error: 0x%d", LAPICESR);
+    dbg_sync();
     __asm__("cli; hlt");
     return 0;
 }
@@ -293,7 +311,7 @@ void apic_enable()
     LAPICDFR = 0xffffffff;
 
     KASSERT(apic_current_id() < 8);
-    __lapic_setlogicalid((uint8_t)(1 << apic_current_id()));
+    __lapic_setlogicalid(APIC_CORE(apic_current_id()));
     LAPICLVTTMR = LOCAL_APIC_DISABLE;
     LAPICLVTPERF = LOCAL_APIC_NMI;
     LAPICLVTLINT0 = LOCAL_APIC_DISABLE;
@@ -314,12 +332,60 @@ void apic_disable_periodic_timer()
     LAPICTPR = 0;
 }
 
-/* get_cpu_bus_frequency - Uses PIT to determine APIC frequency in Hz (ticks per
- * second). NOTE: NOT SMP FRIENDLY! Note: For more info, visit the osdev wiki
- * page on the Programmable Interval Timer. */
+/* The PIT's input clock, in Hz, and how long it times the others for when
+ * their rates are not reported */
+#define PIT_HZ 1193182
+#define PIT_CALIBRATE_MS 2
+#define PIT_CALIBRATE_COUNT (PIT_HZ * PIT_CALIBRATE_MS / 1000)
+
+static uint64_t tsc_freq = 0;
+
+/* cpuid_bus_frequency - The APIC timer's rate in Hz as reported by CPUID,
+ * setting tsc_freq along with it; or 0 if it is not reported. A hypervisor
+ * may give both in its timing leaf; otherwise leaf 0x15 gives the core
+ * crystal clock, which is what the APIC timer counts when the leaf is there
+ * (Intel Vol. 3A 10.5.4), and the TSC's ratio to it. */
+static uint32_t cpuid_bus_frequency()
+{
+    uint32_t a, b, c, d;
+    cpuid(CPUID_GETFEATURES, &a, &b, &c, &d);
+    if (c & CPUID_FEAT_ECX_HYPERVISOR)
+    {
+        cpuid(CPUID_HYPERVISOR, &a, &b, &c, &d);
+        if (a >= CPUID_HYPERVISORFREQ)
+        {
+            cpuid(CPUID_HYPERVISORFREQ, &a, &b, &c, &d);
+            if (a && b)
+            {
+                tsc_freq = (uint64_t)a * 1000;
+                return b * 1000;
+            }
+        }
+    }
+
+    cpuid(CPUID_GETVENDORSTRING, &a, &b, &c, &d);
+    if (a < CPUID_GETTSCFREQ)
+        return 0;
+    cpuid(CPUID_GETTSCFREQ, &a, &b, &c, &d);
+    if (!a || !b || !c)
+        return 0;
+    tsc_freq = (uint64_t)c * b / a;
+    return c;
+}
+
+/* get_cpu_bus_frequency - The APIC timer's rate in Hz (ticks per second),
+ * from CPUID if it is reported there, else timed against the PIT along with
+ * the TSC's. NOTE: the PIT is not SMP friendly, so the BSP finds the rates
+ * before the other cores ask. Note: For more info, visit the osdev wiki page
+ * on the Programmable Interval Timer. */
 static uint32_t get_cpu_bus_frequency()
 {
     static uint32_t freq = 0;
+    if (!freq && (freq = cpuid_bus_frequency()))
+    {
+        dbgq(DBG_CORE, "CPU Bus Freq: %u ticks per second (CPUID)\n", freq);
+        dbgq(DBG_CORE, "TSC Freq: %lu ticks per second (CPUID)\n", tsc_freq);
+    }
     if (!freq)
     {
         /* Division rate: 0b1011 corresponds to division by 1, which does
@@ -337,10 +403,10 @@ static uint32_t get_cpu_bus_frequency()
         outb(0x43, 0xb2);
 
         /* Not sure why there's an inb, but the two outb send the reload value:
-         * 0x2e9b = 11931, aka 1/100th of the PIT oscillator rate, aka 10 ms. */
-        outb(0x42, 0x9b);
+         * PIT_CALIBRATE_COUNT, PIT_CALIBRATE_MS of the PIT oscillator. */
+        outb(0x42, (uint8_t)PIT_CALIBRATE_COUNT);
         inb(0x60);
-        outb(0x42, 0x2e);
+        outb(0x42, (uint8_t)(PIT_CALIBRATE_COUNT >> 8));
 
         /* Reset the one-shot counter by clearing and resetting bit 0. */
         uint32_t tmp = (uint32_t)(inb(0x61) & 0xfe);
@@ -348,19 +414,32 @@ static uint32_t get_cpu_bus_frequency()
         outb(0x61, (uint8_t)(tmp | 1));
         /* Reset APIC's initial countdown value. */
         LAPICTIC = 0xffffffff;
+        /* The TSC is timed over the same interval. */
+        uint64_t tsc = rdtsc();
         /* PC speaker sets bit 5 when it hits 0. */
         while (!(inb(0x61) & 0x20))
             ;
+        tsc = rdtsc() - tsc;
         /* Stop the APIC timer */
         LAPICLVTTMR = LOCAL_APIC_DISABLE;
-        /* Subtract current count from the initial count to get total ticks per
-         * second. */
-        freq = (LAPICTIC - LAPICTCC) * 100;
+        /* Scale the ticks counted down over the interval to a second. */
+        freq = (uint32_t)((uint64_t)(LAPICTIC - LAPICTCC) * PIT_HZ /
+                          PIT_CALIBRATE_COUNT);
+        tsc_freq = tsc * PIT_HZ / PIT_CALIBRATE_COUNT;
         dbgq(DBG_CORE, "CPU Bus Freq: %u ticks per second\n", freq);
+        dbgq(DBG_CORE, "TSC Freq: %lu ticks per second\n", tsc_freq);
     }
     return freq;
 }
 
+/* Whether the current core's APIC timer can fire at a TSC deadline */
+static long apic_has_tsc_deadline()
+{
+    uint32_t a, b, c, d;
+    cpuid(CPUID_GETFEATURES, &a, &b, &c, &d);
+    return (c & CPUID_FEAT_ECX_TSC_DEADLINE) != 0;
+}
+
 /* apic_enable_periodic_timer - Starts the periodic timer (continuously send
  * interrupts) at a given frequency. For more information, refer to: Intel
  * System Programming Guide, Vol 3A Part 1, 10.5.4. */
@@ -418,15 +497,59 @@ void apic_enable_periodic_timer(uint32_t freq)
         div |= 0b1011; /* Set bit 3. */
     }
 
-    /* Set up three registers to configure timer:
-     * 1) Initial count: count down from this value, send interrupt upon hitting
-     * 0. */
-    LAPICTIC = tmp / freq;
-    /* 3) Divide config: calculated above to cut bus clock. */
-    LAPICTMRDIV = div;
-    /* 2) LVT timer: use a periodic timer and raise the provided interrupt
+    /* Set up three registers to configure timer. The mode comes first, as
+     * the initial count is ignored in TSC-deadline mode.
+     * 1) LVT timer: use a periodic timer and raise the provided interrupt
      * vector. */
     LAPICLVTTMR = LOCAL_APIC_TMR_PERIODIC | INTR_APICTIMER;
+    /* 2) Divide config: calculated above to cut bus clock. */
+    LAPICTMRDIV = div;
+    /* 3) Initial count: count down from this value, send interrupt upon
+     * hitting 0. */
+    LAPICTIC = tmp / freq;
+}
+
+/* apic_enable_oneshot_timer - Replaces the periodic timer with a single
+ * interrupt, raised usec microseconds from now: at a TSC deadline if the
+ * core can, which is as precise as the TSC; else with the bus clock divided
+ * by 16, which lets the 32-bit count reach tens of seconds. */
+void apic_enable_oneshot_timer(uint64_t usec)
+{
+    uint64_t per_sec = get_cpu_bus_frequency() / 16;
+    if (usec > APIC_ONESHOT_MAX_USEC)
+        usec = APIC_ONESHOT_MAX_USEC;
+
+    if (tsc_freq && apic_has_tsc_deadline())
+    {
+        uint64_t deadline = rdtsc() + tsc_freq * usec / 1000000;
+        LAPICLVTTMR = LOCAL_APIC_TMR_TSC_DEADLINE | INTR_APICTIMER;
+        /* The mode is set before the deadline is written (Intel Vol. 3A
+         * 10.5.4.1) */
+        __asm__ volatile("mfence" ::: "memory");
+        cpuid_set_msr(MSR_TSC_DEADLINE, (uint32_t)deadline,
+                      (uint32_t)(deadline >> 32));
+        return;
+    }
+
+    uint64_t count = per_sec * usec / 1000000;
+    if (!count)
+        count = 1;
+    if (count > 0xffffffff)
+        count = 0xffffffff;
+
+    /* The mode and divide come first, as writing the initial count starts
+     * the countdown. */
+    LAPICLVTTMR = INTR_APICTIMER;
+    LAPICTMRDIV = 0b0011;
+    LAPICTIC = (uint32_t)count;
+}
+
+/* apic_tsc_frequency - The TSC's rate in Hz, found along with the bus clock's,
+ * or 0 if it could not be. */
+uint64_t apic_tsc_frequency()
+{
+    get_cpu_bus_frequency();
+    return tsc_freq;
 }
 
 static void apic_disable_8259()
@@ -552,10 +675,17 @@ inline void apic_eoi() { LAPICEOI = 0x0; }
 void apic_setredir(uint32_t irq, uint8_t intr)
 {
     dbg(DBG_CORE, "redirecting irq %u to interrupt %u\n", irq, intr);
-    __ioapic_setredir(irq, intr);
+    __ioapic_setredir(irq, intr, APIC_ALL_CORES);
     __ioapic_setmask(irq, 0);
 }
 
+void apic_set_irq_affinity(uint32_t irq, uint8_t cores)
+{
+    KASSERT(cores && "an IRQ must go to some core");
+    dbg(DBG_CORE, "routing irq %u to cores 0x%.2x\n", irq, (uint32_t)cores);
+    __ioapic_setdest(irq, cores);
+}
+
 void apic_start_processor(uint8_t processor, uint8_t execution_page)
 {
     // [+] TODO FIX MAGIC NUMBERS
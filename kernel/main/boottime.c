@@ -0,0 +1,110 @@
+#include "main/boottime.h"
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "util/debug.h"
+#include "util/printf.h"
+
+typedef struct boottime_phase
+{
+    const char *bp_name;
+    uint64_t bp_begin;
+    uint64_t bp_end; /* 0 while the phase is open */
+    long bp_depth;
+} boottime_phase_t;
+
+static boottime_phase_t boottime_phases[BOOTTIME_PHASES];
+static long boottime_nphases;
+static long boottime_depth;
+static long boottime_finished;
+
+long boottime_begin(const char *phase)
+{
+    if (boottime_finished || boottime_nphases == BOOTTIME_PHASES)
+    {
+        return -1;
+    }
+    boottime_phase_t *bp = &boottime_phases[boottime_nphases];
+    bp->bp_name = phase;
+    bp->bp_depth = boottime_depth++;
+    bp->bp_end = 0;
+    bp->bp_begin = rdtsc();
+    return boottime_nphases++;
+}
+
+void boottime_end(long mark)
+{
+    uint64_t now = rdtsc();
+    if (mark < 0 || mark >= boottime_nphases || boottime_phases[mark].bp_end)
+    {
+        return;
+    }
+    boottime_phases[mark].bp_end = now;
+    boottime_depth = boottime_phases[mark].bp_depth;
+}
+
+/* Formats phase i as its BOOT line, less the prefix, into buf */
+static void boottime_format(long i, uint64_t hz, char *buf, size_t size)
+{
+    boottime_phase_t *bp = &boottime_phases[i];
+    uint64_t since = bp->bp_begin - boottime_phases[0].bp_begin;
+    uint64_t took = bp->bp_end - bp->bp_begin;
+    if (hz)
+    {
+        snprintf(buf, size, "%5lu.%03lu %10lu %*s%s\n", since * 1000 / hz,
+                 since * 1000000 / hz % 1000, took * 1000000 / hz,
+                 (int)bp->bp_depth * 2, "", bp->bp_name);
+    }
+    else
+    {
+        snprintf(buf, size, "%9lu %10lu %*s%s (cycles)\n", since, took,
+                 (int)bp->bp_depth * 2, "", bp->bp_name);
+    }
+}
+
+void boottime_done()
+{
+    if (boottime_finished || !boottime_nphases)
+    {
+        return;
+    }
+    uint64_t now = rdtsc();
+    for (long i = 0; i < boottime_nphases; i++)
+    {
+        if (!boottime_phases[i].bp_end)
+        {
+            boottime_phases[i].bp_end = now;
+        }
+    }
+    boottime_finished = 1;
+
+    /* The TSC counts from reset, so where it stood at kmain() is the time
+     * the firmware and the boot loader took */
+    uint64_t hz = apic_tsc_frequency();
+    dbg_print("BOOT hz=%lu before-kmain=%lu us\n", hz,
+              hz ? boottime_phases[0].bp_begin * 1000000 / hz : 0);
+    for (long i = 0; i < boottime_nphases; i++)
+    {
+        char line[96];
+        boottime_format(i, hz, line, sizeof(line));
+        dbg_print("BOOT %s", line);
+    }
+}
+
+size_t boottime_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    uint64_t hz = apic_tsc_frequency();
+    if (!boottime_finished)
+    {
+        iprintf(&buf, &size, "booting\n");
+        return size;
+    }
+    iprintf(&buf, &size, "%9s %10s %s\n", "MS", "US", "PHASE");
+    for (long i = 0; i < boottime_nphases; i++)
+    {
+        char line[96];
+        boottime_format(i, hz, line, sizeof(line));
+        iprintf(&buf, &size, "%s", line);
+    }
+    return size;
+}
@@ -0,0 +1,392 @@
+#include "main/fpu.h"
+#include "errno.h"
+#include "globals.h"
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * The state is saved with XSAVEOPT, or XSAVE, where the processor has them
+ * (Intel Vol. 1 13), and with FXSAVE otherwise. XSAVEOPT skips what has
+ * not changed since the XRSTOR that loaded it, which holds as long as
+ * nothing writes a thread's area but these instructions.
+ */
+
+#define CR0_MP 0x2
+#define CR0_EM 0x4
+#define CR0_TS 0x8
+#define CR0_NE 0x20
+#define CR4_OSFXSR 0x200
+#define CR4_OSXMMEXCPT 0x400
+#define CR4_OSXSAVE 0x40000
+
+#define CPUID_GETXSAVE 0xd
+#define CPUID_XSAVE_XSAVEOPT 0x1 /* CPUID.0xd subleaf 1, EAX */
+
+#define XCR0_X87 0x1
+#define XCR0_SSE 0x2
+#define XCR0_AVX 0x4
+
+#define FPU_FXSAVE_SIZE 512
+#define FPU_XSAVE_HEADER 64
+#define FPU_ALIGN 64 /* what XSAVE wants; FXSAVE wants 16 */
+
+/* The legacy area's FCW and MXCSR, and their values after reset */
+#define FPU_FCW_OFFSET 0
+#define FPU_MXCSR_OFFSET 24
+#define FPU_FCW_INIT 0x37f
+#define FPU_MXCSR_INIT 0x1f80
+
+typedef enum
+{
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT
+} fpu_save_t;
+
+static fpu_save_t fpu_save_kind;
+static uint64_t fpu_xcr0; /* the components XSAVE saves */
+static size_t fpu_size;   /* of a thread's area */
+
+/* A new thread's state: everything zero but the control words. An empty
+ * XSAVE header asks XRSTOR for the initial state of every component. */
+static char fpu_init_state[FPU_FXSAVE_SIZE + FPU_XSAVE_HEADER]
+    __attribute__((aligned(FPU_ALIGN)));
+
+/* The thread whose state this core's registers hold, if any */
+static struct kthread *fpu_owner CORE_SPECIFIC_DATA;
+
+/* Whether CR0.TS is clear for curthr, which then has used, and may have
+ * changed, the registers since it was switched in */
+static long fpu_used CORE_SPECIFIC_DATA;
+
+/* Whether the kernel is between kernel_fpu_begin() and kernel_fpu_end() */
+static long fpu_in_kernel CORE_SPECIFIC_DATA;
+
+static inline uintptr_t fpu_read_cr0()
+{
+    uintptr_t cr0;
+    __asm__ volatile("movq %%cr0, %0"
+                     : "=r"(cr0));
+    return cr0;
+}
+
+static inline void fpu_write_cr0(uintptr_t cr0)
+{
+    __asm__ volatile("movq %0, %%cr0" ::"r"(cr0));
+}
+
+static inline uintptr_t fpu_read_cr4()
+{
+    uintptr_t cr4;
+    __asm__ volatile("movq %%cr4, %0"
+                     : "=r"(cr4));
+    return cr4;
+}
+
+static inline void fpu_write_cr4(uintptr_t cr4)
+{
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4));
+}
+
+static inline void fpu_clts() { __asm__ volatile("clts"); }
+
+static inline void fpu_stts() { fpu_write_cr0(fpu_read_cr0() | CR0_TS); }
+
+static void fpu_save(void *area)
+{
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    switch (fpu_save_kind)
+    {
+    case FPU_XSAVEOPT:
+        __asm__ volatile("xsaveopt64 (%0)" ::"r"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    case FPU_XSAVE:
+        __asm__ volatile("xsave64 (%0)" ::"r"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    default:
+        __asm__ volatile("fxsave64 (%0)" ::"r"(area)
+                         : "memory");
+        break;
+    }
+}
+
+static void fpu_restore(void *area)
+{
+    uint32_t lo = (uint32_t)fpu_xcr0, hi = (uint32_t)(fpu_xcr0 >> 32);
+    if (fpu_save_kind == FPU_FXSAVE)
+    {
+        __asm__ volatile("fxrstor64 (%0)" ::"r"(area)
+                         : "memory");
+    }
+    else
+    {
+        __asm__ volatile("xrstor64 (%0)" ::"r"(area), "a"(lo), "d"(hi)
+                         : "memory");
+    }
+}
+
+static long fpu_thread_alloc(kthread_t *thr)
+{
+    fpu_thread_t *ft = kmalloc(sizeof(fpu_thread_t) + fpu_size + FPU_ALIGN);
+    if (!ft)
+    {
+        return -ENOMEM;
+    }
+    ft->ft_core = -1;
+    ft->ft_state = (void *)(((uintptr_t)ft->ft_buf + FPU_ALIGN - 1) &
+                            ~(uintptr_t)(FPU_ALIGN - 1));
+    memset(ft->ft_state, 0, fpu_size);
+    memcpy(ft->ft_state, fpu_init_state,
+           fpu_save_kind == FPU_FXSAVE ? FPU_FXSAVE_SIZE
+                                       : sizeof(fpu_init_state));
+    thr->kt_fpu = ft;
+    return 0;
+}
+
+/*
+ * #NM: curthr has used the registers for the first time since it was
+ * switched in. Turns them on, and loads its state unless they still hold it.
+ */
+static long fpu_unavailable_handler(regs_t *regs)
+{
+    if ((regs->r_cs & 0x3) != 0x3)
+    {
+        dump_registers(regs);
+        panic("\n\nThe kernel used the FPU outside kernel_fpu_begin()\n");
+    }
+    kthread_t *thr = curthr;
+    if (!thr->kt_fpu && fpu_thread_alloc(thr))
+    {
+        do_exit(ENOMEM);
+    }
+
+    fpu_clts();
+    CSD(fpu_used) = 1;
+    fpu_thread_t *ft = thr->kt_fpu;
+    if (CSD(fpu_owner) == thr && ft->ft_core == curcore.kc_id)
+    {
+        return 0;
+    }
+    fpu_restore(ft->ft_state);
+    CSD(fpu_owner) = thr;
+    ft->ft_core = curcore.kc_id;
+    return 0;
+}
+
+/* #MF and #XM, for a floating point exception the thread has unmasked */
+static long fpu_error_handler(regs_t *regs)
+{
+    if ((regs->r_cs & 0x3) == 0x3)
+    {
+        do_exit(EPERM);
+    }
+    dump_registers(regs);
+    panic("\n\nTriggered a floating point exception in the kernel\n");
+    return 0;
+}
+
+/* Works out how to save the state, and how big it is, on the first core */
+static void fpu_probe()
+{
+    uint32_t a, b, c, d;
+    cpuid(CPUID_GETFEATURES, &a, &b, &c, &d);
+    if (!(d & CPUID_FEAT_EDX_FXSR) || !(d & CPUID_FEAT_EDX_SSE2))
+    {
+        panic("the processor has no SSE2\n");
+    }
+
+    fpu_save_kind = FPU_FXSAVE;
+    fpu_size = FPU_FXSAVE_SIZE;
+    if (c & CPUID_FEAT_ECX_XSAVE)
+    {
+        fpu_size = 0; /* known once XCR0 is set, see fpu_init() */
+        uint32_t ecx, edx;
+        cpuid_subleaf(CPUID_GETXSAVE, 0, &a, &b, &ecx, &edx);
+        fpu_xcr0 = a & (XCR0_X87 | XCR0_SSE);
+        if (c & CPUID_FEAT_ECX_AVX)
+        {
+            fpu_xcr0 |= a & XCR0_AVX;
+        }
+        cpuid_subleaf(CPUID_GETXSAVE, 1, &a, &b, &ecx, &edx);
+        fpu_save_kind = a & CPUID_XSAVE_XSAVEOPT ? FPU_XSAVEOPT : FPU_XSAVE;
+    }
+
+    *(uint16_t *)(fpu_init_state + FPU_FCW_OFFSET) = FPU_FCW_INIT;
+    *(uint32_t *)(fpu_init_state + FPU_MXCSR_OFFSET) = FPU_MXCSR_INIT;
+}
+
+void fpu_init()
+{
+    static long probed = 0;
+    if (!probed)
+    {
+        probed = 1;
+        fpu_probe();
+    }
+
+    /* x87 errors as #MF, no emulation, and #NM until the first use */
+    uintptr_t cr0 = fpu_read_cr0();
+    cr0 &= ~(uintptr_t)CR0_EM;
+    fpu_write_cr0(cr0 | CR0_MP | CR0_NE | CR0_TS);
+
+    uintptr_t cr4 = fpu_read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_save_kind != FPU_FXSAVE)
+    {
+        fpu_write_cr4(cr4 | CR4_OSXSAVE);
+        __asm__ volatile("xsetbv" ::"c"(0), "a"((uint32_t)fpu_xcr0),
+                         "d"((uint32_t)(fpu_xcr0 >> 32)));
+        if (!fpu_size)
+        {
+            /* With XCR0 set, EBX is the size of an area for it */
+            uint32_t a, b, c, d;
+            cpuid_subleaf(CPUID_GETXSAVE, 0, &a, &b, &c, &d);
+            fpu_size = b;
+        }
+    }
+    else
+    {
+        fpu_write_cr4(cr4);
+    }
+
+    CSD(fpu_owner) = NULL;
+    CSD(fpu_used) = 0;
+    CSD(fpu_in_kernel) = 0;
+
+    intr_register(INTR_DEVICE_NOT_AVAILABLE, fpu_unavailable_handler);
+    intr_register(INTR_FPU_ERROR, fpu_error_handler);
+    intr_register(INTR_SIMD_ERROR, fpu_error_handler);
+    dbg(DBG_CORE, "FPU: %s, xcr0 0x%lx, %lu byte state\n",
+        fpu_save_kind == FPU_XSAVEOPT ? "xsaveopt"
+        : fpu_save_kind == FPU_XSAVE  ? "xsave"
+                                      : "fxsave",
+        fpu_xcr0, fpu_size);
+}
+
+/*
+ * Called as thr stops running, with interrupts off: saves its state if it
+ * used the registers, and turns them off for whoever runs next.
+ */
+void fpu_switch_out(kthread_t *thr)
+{
+    KASSERT(!CSD(fpu_in_kernel) && "slept inside kernel_fpu_begin()");
+    if (!CSD(fpu_used))
+    {
+        return;
+    }
+    KASSERT(CSD(fpu_owner) == thr);
+    fpu_save(thr->kt_fpu->ft_state);
+    fpu_stts();
+    CSD(fpu_used) = 0;
+}
+
+/*
+ * Gives child, a clone of parent (see kthread_clone), a copy of parent's
+ * state, if it has any. Returns 0, or -ENOMEM.
+ */
+long fpu_thread_copy(kthread_t *child, kthread_t *parent)
+{
+    if (!parent->kt_fpu)
+    {
+        return 0;
+    }
+    if (fpu_thread_alloc(child))
+    {
+        return -ENOMEM;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    if (parent == curthr && CSD(fpu_used))
+    {
+        fpu_save(parent->kt_fpu->ft_state);
+    }
+    memcpy(child->kt_fpu->ft_state, parent->kt_fpu->ft_state, fpu_size);
+    if (enabled)
+    {
+        intr_enable();
+    }
+    return 0;
+}
+
+/*
+ * Drops thr's state, which is either a thread being destroyed or curthr,
+ * starting over at execve(2); the next use gets the initial state. No core
+ * is left thinking its registers hold it, so that the registers are not
+ * taken for a later thread's at the same address.
+ */
+void fpu_thread_free(kthread_t *thr)
+{
+    fpu_thread_t *ft = thr->kt_fpu;
+    if (!ft)
+    {
+        return;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    if (thr == curthr && CSD(fpu_used))
+    {
+        fpu_stts();
+        CSD(fpu_used) = 0;
+    }
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (csd_vaddr_table[id])
+        {
+            __sync_bool_compare_and_swap(
+                GET_CSD(id, struct kthread *, fpu_owner), thr, NULL);
+        }
+    }
+    thr->kt_fpu = NULL;
+    if (enabled)
+    {
+        intr_enable();
+    }
+    kfree(ft);
+}
+
+/*
+ * Lets the kernel use the SIMD registers until kernel_fpu_end(), saving
+ * curthr's state first if they hold it. Disables preemption meanwhile.
+ */
+void kernel_fpu_begin()
+{
+    preemption_disable();
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    KASSERT(!CSD(fpu_in_kernel));
+    if (CSD(fpu_used))
+    {
+        fpu_save(curthr->kt_fpu->ft_state);
+    }
+    else
+    {
+        fpu_clts();
+    }
+    CSD(fpu_used) = 0;
+    CSD(fpu_owner) = NULL;
+    CSD(fpu_in_kernel) = 1;
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
+
+/* Ends kernel_fpu_begin(); the thread's next use reloads its own state. */
+void kernel_fpu_end()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    KASSERT(CSD(fpu_in_kernel));
+    CSD(fpu_in_kernel) = 0;
+    fpu_stts();
+    if (enabled)
+    {
+        intr_enable();
+    }
+    preemption_enable();
+}
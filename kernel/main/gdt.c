@@ -1,6 +1,9 @@
 #include "main/gdt.h"
 #include "globals.h"
 
+#include "main/cpuid.h"
+#include "main/entry.h"
+
 #include "util/debug.h"
 #include "util/printf.h"
 #include "util/string.h"
@@ -42,39 +45,81 @@ typedef struct gdt_location
     uint64_t gl_offset;
 } packed gdt_location_t;
 
-static gdt_location_t gdtl = {.gl_size = GDT_COUNT * sizeof(gdt_entry_t),
-                              .gl_offset = (uint64_t)&gdt};
-
 static tss_entry_t tss CORE_SPECIFIC_DATA;
 
+/* The stack double faults switch to. They are mostly a kernel stack overflow
+ * hitting the guard page below the stack (see alloc_stack in kthread.c), in
+ * which case the CPU has nowhere else to push the frame. */
+static char gdt_fault_stack[2 * PAGE_SIZE] __attribute__((aligned(16)))
+CORE_SPECIFIC_DATA;
+
+/* The MSRs that set up the SYSCALL instruction */
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_FMASK 0xC0000084
+
+#define EFER_SCE 0x1
+
+/* Flags SYSCALL clears: IF, so that nothing comes in on the user's stack
+ * before syscall_entry leaves it, and TF, DF and AC */
+#define SYSCALL_FMASK 0x40700
+
+static void gdt_syscall_init(void)
+{
+    uint32_t lo, hi;
+    cpuid_get_msr(MSR_EFER, &lo, &hi);
+    cpuid_set_msr(MSR_EFER, lo | EFER_SCE, hi);
+
+    /* SYSCALL loads the kernel text and data segments from the low base,
+     * SYSRET the user's from the high one (see GDT_USER_DATA) */
+    cpuid_set_msr(MSR_STAR, 0, GDT_KERNEL_TEXT | ((GDT_USER_DATA - 8) << 16));
+    uint64_t entry = (uint64_t)syscall_entry;
+    cpuid_set_msr(MSR_LSTAR, (uint32_t)entry, (uint32_t)(entry >> 32));
+    cpuid_set_msr(MSR_FMASK, SYSCALL_FMASK, 0);
+}
+
 void gdt_init(void)
 {
-    memset(gdt, 0, sizeof(gdt));
+    memset(CSD_PTR(gdt), 0, sizeof(gdt));
     gdt_set_entry(GDT_KERNEL_TEXT, 0x0, 0xFFFFF, 0, 1, 0, 1);
     gdt_set_entry(GDT_KERNEL_DATA, 0x0, 0xFFFFF, 0, 0, 0, 1);
     gdt_set_entry(GDT_USER_TEXT, 0x0, 0xFFFFF, 3, 1, 0, 1);
     gdt_set_entry(GDT_USER_DATA, 0x0, 0xFFFFF, 3, 0, 0, 1);
 
-    uintptr_t tss_pointer = (uintptr_t)&tss;
+    /* The GDT and the TSS are this core's copies, in the physmap */
+    uintptr_t tss_pointer = (uintptr_t)CSD_PTR(tss);
     gdt_set_entry(GDT_TSS, (uint32_t)tss_pointer, sizeof(tss), 0, 1, 0, 0);
-    gdt[GDT_TSS / 8].ge_access &= ~(0b10000);
-    gdt[GDT_TSS / 8].ge_access |= 0b1;
-    gdt[GDT_TSS / 8].ge_flags &= ~(0b10000000);
+    CSD(gdt)[GDT_TSS / 8].ge_access &= ~(0b10000);
+    CSD(gdt)[GDT_TSS / 8].ge_access |= 0b1;
+    CSD(gdt)[GDT_TSS / 8].ge_flags &= ~(0b10000000);
 
     uint64_t tss_higher_half = ((uint64_t)tss_pointer) >> 32;
-    memcpy(&gdt[GDT_TSS / 8 + 1], &tss_higher_half, 8);
+    memcpy(&CSD(gdt)[GDT_TSS / 8 + 1], &tss_higher_half, 8);
 
-    memset(&tss, 0, sizeof(tss));
-    tss.ts_iopb = sizeof(tss);
+    memset(CSD_PTR(tss), 0, sizeof(tss));
+    CSD(tss).ts_iopb = sizeof(tss);
+    CSD(tss).ts_ist1 =
+        (uint64_t)(CSD(gdt_fault_stack) + sizeof(gdt_fault_stack));
 
+    gdt_location_t gdtl = {.gl_size = GDT_COUNT * sizeof(gdt_entry_t),
+                           .gl_offset = (uint64_t)CSD_PTR(gdt)};
     gdt_location_t *data = &gdtl;
     int segment = GDT_TSS;
 
     dbg(DBG_CORE, "Installing GDT and TR\n");
     __asm__ volatile("lgdt (%0); ltr %1" ::"p"(data), "m"(segment));
+
+    gdt_syscall_init();
 }
 
-void gdt_set_kernel_stack(void *addr) { tss.ts_rsp0 = (uint64_t)addr; }
+void gdt_set_kernel_stack(void *addr)
+{
+    CSD(tss).ts_rsp0 = (uint64_t)addr;
+    /* SYSCALL does not switch stacks: syscall_entry (entry/syscall_entry.c)
+     * switches to this one, and keeps the user's in ch_user_rsp meanwhile */
+    CSD(csd_head).ch_kernel_rsp = (uint64_t)addr;
+}
 
 void gdt_set_entry(uint32_t segment, uint32_t base, uint32_t limit,
                    uint8_t ring, int exec, int dir, int rw)
@@ -84,36 +129,36 @@ void gdt_set_entry(uint32_t segment, uint32_t base, uint32_t limit,
     KASSERT(limit <= 0xFFFFF);
 
     int index = segment / 8;
-    gdt[index].ge_limitlo = (uint16_t)limit;
-    gdt[index].ge_baselo = (uint16_t)base;
-    gdt[index].ge_basemid = (uint8_t)(base >> 16);
-    gdt[index].ge_basehi = (uint8_t)(base >> 24);
+    CSD(gdt)[index].ge_limitlo = (uint16_t)limit;
+    CSD(gdt)[index].ge_baselo = (uint16_t)base;
+    CSD(gdt)[index].ge_basemid = (uint8_t)(base >> 16);
+    CSD(gdt)[index].ge_basehi = (uint8_t)(base >> 24);
 
     // For x86-64, set the L bit to indicate a 64-bit descriptor and clear Sz
     // Having both L and Sz set is reserved for future use
-    gdt[index].ge_flags = (uint8_t)(0b10100000 | (limit >> 16));
+    CSD(gdt)[index].ge_flags = (uint8_t)(0b10100000 | (limit >> 16));
 
-    gdt[index].ge_access = 0b10000000;
-    gdt[index].ge_access |= (ring << 5);
-    gdt[index].ge_access |= 0b10000;
+    CSD(gdt)[index].ge_access = 0b10000000;
+    CSD(gdt)[index].ge_access |= (ring << 5);
+    CSD(gdt)[index].ge_access |= 0b10000;
     if (exec)
     {
-        gdt[index].ge_access |= 0b1000;
+        CSD(gdt)[index].ge_access |= 0b1000;
     }
     if (dir)
     {
-        gdt[index].ge_access |= 0b100;
+        CSD(gdt)[index].ge_access |= 0b100;
     }
     if (rw)
     {
-        gdt[index].ge_access |= 0b10;
+        CSD(gdt)[index].ge_access |= 0b10;
     }
 }
 
 void gdt_clear(uint32_t segment)
 {
     KASSERT(segment < GDT_COUNT * 8 && 0 == segment % 8);
-    memset(&gdt[segment / 8], 0, sizeof(gdt[segment / 8]));
+    memset(&CSD(gdt)[segment / 8], 0, sizeof(gdt[segment / 8]));
 }
 
 size_t gdt_tss_info(const void *arg, char *buf, size_t osize)
@@ -123,7 +168,7 @@ size_t gdt_tss_info(const void *arg, char *buf, size_t osize)
     KASSERT(NULL == arg);
 
     iprintf(&buf, &size, "TSS:\n");
-    iprintf(&buf, &size, "kstack: 0x%p\n", (void *)tss.ts_rsp0);
+    iprintf(&buf, &size, "kstack: 0x%p\n", (void *)CSD(tss).ts_rsp0);
 
     return size;
 }
@@ -7,7 +7,12 @@
 #include "util/string.h"
 
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/gdt.h"
+#include "main/ipltrace.h"
+#include "main/softirq.h"
+
+#include "mm/page.h"
 
 #define MAX_INTERRUPTS 256
 
@@ -24,12 +29,48 @@
 
 #define INTR(isr) (__intr_handler##isr)
 
-#define INTR_ERRCODE(isr)                      \
+/*
+ * The interrupt stubs build a regs_t on the stack and pass it to
+ * interrupt_handler(). One that comes in from userland brings the user's GS
+ * base, so the stub swaps in the kernel's (see smp.h) for the handler and
+ * back out for the return; the saved CS, at 144(%rsp) once the registers
+ * are pushed, says which. An NMI or a double fault may come in after
+ * syscall_entry is in the kernel but before its SWAPGS, or after the one on
+ * its way out, so those go by the GS base itself, which is a kernel address
+ * only once swapped, and keep whether they swapped in %rbx, which
+ * interrupt_handler() preserves.
+ */
+#define INTR_SWAPGS_ENTER                      \
+    "testb $3, 144(%rsp)\n\t"                  \
+    "jz 1f\n\t"                                \
+    "swapgs\n"                                 \
+    "1:\n\t"
+#define INTR_SWAPGS_LEAVE                      \
+    "testb $3, 144(%rsp)\n\t"                  \
+    "jz 2f\n\t"                                \
+    "swapgs\n"                                 \
+    "2:\n\t"
+#define INTR_PARANOID_ENTER                    \
+    "movl $" QUOTE(MSR_GS_BASE) ", %ecx\n\t"   \
+    "rdmsr\n\t"                                \
+    "xorl %ebx, %ebx\n\t"                      \
+    "testl %edx, %edx\n\t"                     \
+    "js 1f\n\t"                                \
+    "swapgs\n\t"                               \
+    "movl $1, %ebx\n"                          \
+    "1:\n\t"
+#define INTR_PARANOID_LEAVE                    \
+    "testl %ebx, %ebx\n\t"                     \
+    "jz 2f\n\t"                                \
+    "swapgs\n"                                 \
+    "2:\n\t"
+
+#define INTR_STUB(isr, errcode, enter, leave)  \
     extern intr_handler_t __intr_handler##isr; \
     __asm__(".global __intr_handler" #isr      \
             "\n"                               \
             "__intr_handler" #isr              \
-            ":\n\t"                            \
+            ":\n\t" errcode                    \
             "pushq $" #isr                     \
             "\n\t"                             \
             "pushq %rdi\n\t"                   \
@@ -47,7 +88,7 @@
             "pushq %r13\n\t"                   \
             "pushq %r14\n\t"                   \
             "pushq %r15\n\t"                   \
-            "call interrupt_handler\n\t"       \
+            enter "call interrupt_handler\n\t" leave\
             "popq %r15\n\t"                    \
             "popq %r14\n\t"                    \
             "popq %r13\n\t"                    \
@@ -66,58 +107,24 @@
             "add $16, %rsp\n\t"                \
             "iretq\n");
 
+#define INTR_ERRCODE(isr)                      \
+    INTR_STUB(isr, "", INTR_SWAPGS_ENTER, INTR_SWAPGS_LEAVE)
 #define INTR_NOERRCODE(isr)                    \
-    extern intr_handler_t __intr_handler##isr; \
-    __asm__(".global __intr_handler" #isr      \
-            "\n"                               \
-            "__intr_handler" #isr              \
-            ":\n\t"                            \
-            "pushq $0x0\n\t"                   \
-            "pushq $" #isr                     \
-            "\n\t"                             \
-            "pushq %rdi\n\t"                   \
-            "pushq %rsi\n\t"                   \
-            "pushq %rdx\n\t"                   \
-            "pushq %rcx\n\t"                   \
-            "pushq %rax\n\t"                   \
-            "pushq %r8\n\t"                    \
-            "pushq %r9\n\t"                    \
-            "pushq %r10\n\t"                   \
-            "pushq %r11\n\t"                   \
-            "pushq %rbx\n\t"                   \
-            "pushq %rbp\n\t"                   \
-            "pushq %r12\n\t"                   \
-            "pushq %r13\n\t"                   \
-            "pushq %r14\n\t"                   \
-            "pushq %r15\n\t"                   \
-            "call interrupt_handler\n\t"       \
-            "popq %r15\n\t"                    \
-            "popq %r14\n\t"                    \
-            "popq %r13\n\t"                    \
-            "popq %r12\n\t"                    \
-            "popq %rbp\n\t"                    \
-            "popq %rbx\n\t"                    \
-            "popq %r11\n\t"                    \
-            "popq %r10\n\t"                    \
-            "popq %r9\n\t"                     \
-            "popq %r8\n\t"                     \
-            "popq %rax\n\t"                    \
-            "popq %rcx\n\t"                    \
-            "popq %rdx\n\t"                    \
-            "popq %rsi\n\t"                    \
-            "popq %rdi\n\t"                    \
-            "add $16, %rsp\n\t"                \
-            "iretq\n\t");
+    INTR_STUB(isr, "pushq $0x0\n\t", INTR_SWAPGS_ENTER, INTR_SWAPGS_LEAVE)
+#define INTR_ERRCODE_PARANOID(isr)             \
+    INTR_STUB(isr, "", INTR_PARANOID_ENTER, INTR_PARANOID_LEAVE)
+#define INTR_NOERRCODE_PARANOID(isr)           \
+    INTR_STUB(isr, "pushq $0x0\n\t", INTR_PARANOID_ENTER, INTR_PARANOID_LEAVE)
 
 INTR_NOERRCODE(0)
 INTR_NOERRCODE(1)
-INTR_NOERRCODE(2)
+INTR_NOERRCODE_PARANOID(2)
 INTR_NOERRCODE(3)
 INTR_NOERRCODE(4)
 INTR_NOERRCODE(5)
 INTR_NOERRCODE(6)
 INTR_NOERRCODE(7)
-INTR_ERRCODE(8)
+INTR_ERRCODE_PARANOID(8)
 INTR_NOERRCODE(9)
 INTR_ERRCODE(10)
 INTR_ERRCODE(11)
@@ -397,10 +404,57 @@ intr_info_t intr_data;
  * debuggers. */
 static regs_t *_intr_regs CORE_SPECIFIC_DATA;
 
+#ifdef __IPL_TRACE__
+
+void intr_enable()
+{
+    if (apic_getipl() < IPL_HIGH)
+    {
+        ipltrace_unmask(__builtin_return_address(0));
+    }
+    __asm__ volatile("sti");
+}
+
+void intr_disable()
+{
+    __asm__ volatile("cli");
+    ipltrace_mask(__builtin_return_address(0));
+}
+
+void intr_wait()
+{
+    if (apic_getipl() < IPL_HIGH)
+    {
+        ipltrace_unmask(__builtin_return_address(0));
+    }
+    __asm__ volatile("sti; hlt");
+}
+
+#endif
+
 inline uint8_t intr_setipl(uint8_t ipl)
 {
     uint8_t oldipl = apic_getipl();
+#ifdef __IPL_TRACE__
+    long masked = ipl >= IPL_HIGH || !intr_enabled();
+    if (!masked)
+    {
+        ipltrace_unmask(__builtin_return_address(0));
+    }
+#endif
     apic_setipl(ipl);
+#ifdef __IPL_TRACE__
+    if (masked)
+    {
+        ipltrace_mask(__builtin_return_address(0));
+    }
+#endif
+    /* An interrupt could come in now, and so could the softirqs deferred
+     * while it could not */
+    if (ipl == IPL_LOW && oldipl != IPL_LOW && intr_enabled())
+    {
+        softirq_run();
+    }
     return oldipl;
 }
 
@@ -409,7 +463,8 @@ inline uint8_t intr_getipl() { return apic_getipl(); }
 static __attribute__((used)) void interrupt_handler(regs_t regs)
 {
     intr_handler_t handler = intr_handlers[regs.r_intr];
-    _intr_regs = &regs;
+    ipltrace_mask((void *)handler);
+    CSD(_intr_regs) = &regs;
     if (handler)
     {
         if ((regs.r_cs & 0x3) == 0x3)
@@ -424,7 +479,32 @@ static __attribute__((used)) void interrupt_handler(regs_t regs)
     {
         panic("Unhandled interrupt 0x%x\n", (int)regs.r_intr);
     }
-    _intr_regs = NULL;
+    CSD(_intr_regs) = NULL;
+
+    /* Back to where the interrupt came in: if another could have, so may
+     * the bottom halves of this one */
+    if ((regs.r_rflags & 0x200) && apic_getipl() == IPL_LOW)
+        softirq_run();
+
+    if ((regs.r_cs & 0x3) == 0x3)
+        page_reclaim_point();
+
+#if defined(__UPREEMPT__) || defined(__KPREEMPT__)
+    if ((regs.r_cs & 0x3) == 0x3)
+        sched_preempt_point();
+#endif
+#ifdef __KPREEMPT__
+    /* Kernel code is preempted too, where it could have been interrupted */
+    if ((regs.r_cs & 0x3) == 0 && (regs.r_rflags & 0x200) &&
+        apic_getipl() == IPL_LOW)
+        sched_preempt_kernel();
+#endif
+
+#ifdef __IPL_TRACE__
+    /* The IRETQ back restores the interrupted context's IF */
+    if ((regs.r_rflags & 0x200) && apic_getipl() < IPL_HIGH)
+        ipltrace_unmask((void *)handler);
+#endif
 }
 
 int32_t intr_map(uint16_t irq, uint8_t intr)
@@ -437,6 +517,16 @@ int32_t intr_map(uint16_t irq, uint8_t intr)
     return oldirq;
 }
 
+long intr_set_affinity(uint8_t intr, uint8_t cores)
+{
+    if (intr_mappings[intr] < 0 || !cores)
+    {
+        return -EINVAL;
+    }
+    apic_set_irq_affinity((uint32_t)intr_mappings[intr], cores);
+    return 0;
+}
+
 intr_handler_t intr_register(uint8_t intr, intr_handler_t handler)
 {
     intr_handler_t old = intr_handlers[intr];
@@ -514,6 +604,25 @@ static long __intr_spurious(regs_t *regs)
     return 0;
 }
 
+/*
+ * Runs on a stack of its own (see gdt_init), as a double fault mostly means
+ * the current thread ran off the bottom of its kernel stack into the guard
+ * page below it, and the page fault could not be delivered there.
+ */
+static long __intr_double_fault_handler(regs_t *regs)
+{
+    dump_registers(regs);
+    uintptr_t stack = curthr ? (uintptr_t)curthr->kt_kstack : 0;
+    if (stack && regs->r_rsp >= stack - PAGE_SIZE &&
+        regs->r_rsp < stack + PAGE_SIZE)
+    {
+        panic("\n\nKernel stack overflow in thread 0x%p (stack at 0x%p)\n",
+              curthr, (void *)stack);
+    }
+    panic("\n\nTriggered a Double Fault\n");
+    return 0;
+}
+
 static void __intr_set_entry(uint8_t isr, uintptr_t addr, uint8_t seg,
                              uint8_t flags)
 {
@@ -547,6 +656,7 @@ void intr_init()
         memset(intr_mappings, -1, sizeof(intr_mappings));
 
         __intr_set_entries();
+        intr_table[INTR_DOUBLE_FAULT].ist = GDT_IST_DOUBLE_FAULT;
     }
     __asm__("lidt (%0)" ::"p"(data));
 
@@ -554,6 +664,7 @@ void intr_init()
     intr_register(INTR_DIVIDE_BY_ZERO, __intr_divide_by_zero_handler);
     intr_register(INTR_GPF, __intr_gpf_handler);
     intr_register(INTR_INVALID_OPCODE, __intr_inval_opcode_handler);
+    intr_register(INTR_DOUBLE_FAULT, __intr_double_fault_handler);
 }
 
 static void __intr_set_entries()
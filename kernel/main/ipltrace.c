@@ -0,0 +1,127 @@
+#include "main/ipltrace.h"
+#include "errno.h"
+#include "globals.h"
+#include "main/cpuid.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/* Each core's window in progress and the windows it has timed. Only the core
+ * itself writes its own, and only with interrupts masked, so that it needs
+ * no lock; ipltrace_stats() reads them as they are. */
+typedef struct ipltrace_core
+{
+    uint64_t ic_since; /* when the window in progress began, or 0 if none */
+    void *ic_site;     /* and where */
+    ipltrace_stats_t ic_stats;
+} CACHE_LINE_ALIGNED ipltrace_core_t;
+
+static ipltrace_core_t ipltrace_cores[MAX_LAPICS];
+static volatile long ipltrace_on;
+
+#ifdef __IPL_TRACE__
+
+void ipltrace_mask(void *site)
+{
+    if (!ipltrace_on)
+    {
+        return;
+    }
+    ipltrace_core_t *ic = &ipltrace_cores[curcore.kc_id];
+    if (!ic->ic_since)
+    {
+        ic->ic_since = rdtsc();
+        ic->ic_site = site;
+    }
+}
+
+void ipltrace_unmask(void *site)
+{
+    if (!ipltrace_on)
+    {
+        return;
+    }
+    ipltrace_core_t *ic = &ipltrace_cores[curcore.kc_id];
+    if (!ic->ic_since)
+    {
+        return;
+    }
+    uint64_t cycles = rdtsc() - ic->ic_since;
+    ic->ic_since = 0;
+
+    ipltrace_stats_t *is = &ic->ic_stats;
+    is->is_windows++;
+    is->is_cycles += cycles;
+    ipltrace_window_t *worst = is->is_worst;
+    if (cycles <= worst[IPLTRACE_WORST - 1].iw_cycles)
+    {
+        return;
+    }
+    long i = IPLTRACE_WORST - 1;
+    for (; i > 0 && worst[i - 1].iw_cycles < cycles; i--)
+    {
+        worst[i] = worst[i - 1];
+    }
+    worst[i].iw_cycles = cycles;
+    worst[i].iw_start = ic->ic_site;
+    worst[i].iw_end = site;
+    worst[i].iw_pid = curproc ? curproc->p_pid : -1;
+}
+
+#endif
+
+/* Starts timing on every core, dropping any earlier windows. */
+long ipltrace_start()
+{
+#ifdef __IPL_TRACE__
+    if (ipltrace_on)
+    {
+        return -EBUSY;
+    }
+    memset(ipltrace_cores, 0, sizeof(ipltrace_cores));
+    __sync_synchronize();
+    ipltrace_on = 1;
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/* Stops timing; the windows in progress are not counted. */
+void ipltrace_stop() { ipltrace_on = 0; }
+
+/* Copies core's windows to stats. Returns -ENODEV if the core is not up. */
+long ipltrace_stats(long core, ipltrace_stats_t *stats)
+{
+    if (core < 0 || core >= MAX_LAPICS || !csd_vaddr_table[core])
+    {
+        return -ENODEV;
+    }
+    memcpy(stats, &ipltrace_cores[core].ic_stats, sizeof(*stats));
+    return 0;
+}
+
+/* Writes each core's longest windows to the debug log, longest first.
+ * Returns the number written. */
+size_t ipltrace_dump()
+{
+    size_t total = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        ipltrace_stats_t stats;
+        if (ipltrace_stats(id, &stats))
+        {
+            continue;
+        }
+        for (long i = 0; i < IPLTRACE_WORST && stats.is_worst[i].iw_cycles;
+             i++)
+        {
+            ipltrace_window_t *w = &stats.is_worst[i];
+            dbg_print("IPLTRACE core=%ld cycles=%lu pid=%d start=0x%lx "
+                      "end=0x%lx\n",
+                      id, w->iw_cycles, w->iw_pid, (uintptr_t)w->iw_start,
+                      (uintptr_t)w->iw_end);
+            total++;
+        }
+    }
+    return total;
+}
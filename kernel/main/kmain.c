@@ -8,11 +8,15 @@
 #include <main/io.h>
 #include <mm/mm.h>
 #include <mm/slab.h>
+#include <mm/swap.h>
+#include <mm/tlb.h>
 #include <test/kshell/kshell.h>
 #include <test/proctest.h>
 #include <util/time.h>
 #include <vm/anon.h>
+#include <vm/ksm.h>
 #include <vm/shadow.h>
+#include <vm/vdso.h>
 
 #include "util/debug.h"
 #include "util/gdb.h"
@@ -21,22 +25,31 @@
 
 #include "main/acpi.h"
 #include "main/apic.h"
+#include "main/boottime.h"
+#include "main/cpuid.h"
 #include "main/inits.h"
 
+#include "drivers/blockdev.h"
 #include "drivers/dev.h"
 #include "drivers/pcie.h"
 
 #include "api/syscall.h"
 
+#include "fs/aio.h"
 #include "fs/fcntl.h"
+#include "fs/initrd.h"
+#include "fs/s5fs/s5fs.h"
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "fs/writeback.h"
 
 #include "test/driverstest.h"
 
 #include "util/btree.h"
 
+#include "proc/workqueue.h"
+
 // Forward declaration for vmtest
 long vmtest_main(long arg1, void* arg2);
 
@@ -49,49 +62,81 @@ GDB_DEFINE_HOOK(shutdown)
 static void initproc_start();
 
 typedef void (*init_func_t)();
-static init_func_t init_funcs[] = {
-    dbg_init,
-    intr_init,
-    page_init,
-    pt_init,
-    acpi_init,
-    apic_init,
-    core_init,
-    slab_init,
-    pframe_init,
-    pci_init,
-    vga_init,
+
+typedef struct init_func_entry
+{
+    init_func_t if_func;
+    const char *if_name;
+} init_func_entry_t;
+
+#define INIT_FUNC(func) {func, #func}
+
+static init_func_entry_t init_funcs[] = {
+    INIT_FUNC(dbg_init),
+    INIT_FUNC(intr_init),
+    INIT_FUNC(page_init),
+    INIT_FUNC(pt_init),
+    INIT_FUNC(acpi_init),
+    INIT_FUNC(page_numa_init),
+    INIT_FUNC(apic_init),
+    INIT_FUNC(core_init),
+    INIT_FUNC(dbg_async_init),
+    INIT_FUNC(tlb_init),
+    INIT_FUNC(slab_init),
+    INIT_FUNC(radix_init),
+    INIT_FUNC(pframe_init),
+    INIT_FUNC(pci_init),
+    INIT_FUNC(vga_init),
 #ifdef __VM__
-    anon_init,
-    shadow_init,
+    INIT_FUNC(anon_init),
+    INIT_FUNC(shadow_init),
+    INIT_FUNC(ksm_init),
 #endif
-    vmmap_init,
-    proc_init,
-    kthread_init,
+    INIT_FUNC(vmmap_init),
+    INIT_FUNC(proc_init),
+    INIT_FUNC(kthread_init),
 #ifdef __DRIVERS__
-    chardev_init,
-    blockdev_init,
+    INIT_FUNC(chardev_init),
+    INIT_FUNC(blockdev_init),
+    INIT_FUNC(swap_init),
+#endif
+    INIT_FUNC(kshell_init),
+    INIT_FUNC(file_init),
+    INIT_FUNC(pipe_init),
+    INIT_FUNC(epoll_init),
+    INIT_FUNC(futex_init),
+    INIT_FUNC(syscall_init),
+    INIT_FUNC(elf64_init),
+#ifdef __VM__
+    INIT_FUNC(vdso_init),
+#endif
+
+    INIT_FUNC(proc_idleproc_init),
+    INIT_FUNC(btree_init),
+#ifdef __SMP__
+    INIT_FUNC(smp_init),
 #endif
-    kshell_init,
-    file_init,
-    pipe_init,
-    syscall_init,
-    elf64_init,
-
-    proc_idleproc_init,
-    btree_init,
 };
 
+#define INIT_FUNC_COUNT (sizeof(init_funcs) / sizeof(init_funcs[0]))
+
 /*
  * Call the init functions (in order!), then run the init process
  * (initproc_start)
  */
 void kmain()
 {
+    csd_early_init();
     GDB_CALL_HOOK(boot);
 
-    for (size_t i = 0; i < sizeof(init_funcs) / sizeof(init_funcs[0]); i++)
-        init_funcs[i]();
+    /* Left open until the first exec (see boottime_done()) */
+    boottime_begin("boot");
+    for (size_t i = 0; i < INIT_FUNC_COUNT; i++)
+    {
+        long mark = boottime_begin(init_funcs[i].if_name);
+        init_funcs[i].if_func();
+        boottime_end(mark);
+    }
 
     initproc_start();
     panic("\nReturned to kmain()\n");
@@ -101,8 +146,12 @@ void kmain()
  * Make:
  * 1) /dev/null
  * 2) /dev/zero
- * 3) /dev/ttyX for 0 <= X < __NTERMS__
- * 4) /dev/hdaX for 0 <= X < __NDISKS__
+ * 3) /dev/meminfo
+ * 4) /dev/ttyX for 0 <= X < __NTERMS__
+ * 5) /dev/hdaX for 0 <= X < __NDISKS__
+ * 6) /dev/ram0, if there is a RAM disk
+ * 7) /dev/md0, if there is a striped device
+ * 8) /dev/vdX for each virtio-blk disk
  */
 static void make_devices()
 {
@@ -113,6 +162,8 @@ static void make_devices()
     KASSERT(!status || status == -EEXIST);
     status = do_mknod("/dev/zero", S_IFCHR, MEM_ZERO_DEVID);
     KASSERT(!status || status == -EEXIST);
+    status = do_mknod("/dev/meminfo", S_IFCHR, MEM_INFO_DEVID);
+    KASSERT(!status || status == -EEXIST);
 
     char path[32] = {0};
     for (long i = 0; i < __NTERMS__; i++)
@@ -130,8 +181,72 @@ static void make_devices()
         status = do_mknod(path, S_IFBLK, MKDEVID(DISK_MAJOR, i));
         KASSERT(!status || status == -EEXIST);
     }
+
+    if (blockdev_lookup(MKDEVID(RAMDISK_MAJOR, 0)))
+    {
+        status = do_mknod("/dev/ram0", S_IFBLK, MKDEVID(RAMDISK_MAJOR, 0));
+        KASSERT(!status || status == -EEXIST);
+    }
+
+    if (blockdev_lookup(MKDEVID(STRIPE_MAJOR, 0)))
+    {
+        status = do_mknod("/dev/md0", S_IFBLK, MKDEVID(STRIPE_MAJOR, 0));
+        KASSERT(!status || status == -EEXIST);
+    }
+
+    for (long i = 0; blockdev_lookup(MKDEVID(VIRTIO_BLK_MAJOR, i)); i++)
+    {
+        snprintf(path, sizeof(path), "/dev/vd%ld", i);
+        status = do_mknod(path, S_IFBLK, MKDEVID(VIRTIO_BLK_MAJOR, i));
+        KASSERT(!status || status == -EEXIST);
+    }
 }
 
+#ifdef __MOUNTING__
+/*
+ * Mounts a ramfs on /tmp, so that scratch files never touch the disk.
+ */
+static void mount_tmp()
+{
+    long status = do_mkdir("/tmp");
+    KASSERT(!status || status == -EEXIST);
+    status = do_mount(NULL, "/tmp", "ramfs");
+    if (status)
+    {
+        dbg(DBG_INIT, "Could not mount a ramfs on /tmp: %ld\n", status);
+    }
+}
+
+/*
+ * Mounts a ramfs on /dev/shm, where shm_open() keeps named shared memory
+ * objects: files whose pages are the memory that mmap() shares.
+ */
+static void mount_shm()
+{
+    long status = do_mkdir("/dev/shm");
+    KASSERT(!status || status == -EEXIST);
+    status = do_mount(NULL, "/dev/shm", "ramfs");
+    if (status)
+    {
+        dbg(DBG_INIT, "Could not mount a ramfs on /dev/shm: %ld\n", status);
+    }
+}
+
+/*
+ * Mounts a procfs on /proc, for programs to read the kernel's statistics.
+ */
+static void mount_proc()
+{
+    long status = do_mkdir("/proc");
+    KASSERT(!status || status == -EEXIST);
+    status = do_mount(NULL, "/proc", "procfs");
+    if (status)
+    {
+        dbg(DBG_INIT, "Could not mount a procfs on /proc: %ld\n", status);
+    }
+}
+#endif
+
 /*
  * The function executed by the init process. Finish up all initialization now 
  * that we have a proper thread context.
@@ -157,15 +272,40 @@ static void make_devices()
  */
 static void *initproc_run(long arg1, void *arg2)
 {
+    long mark;
 #ifdef __VFS__
     dbg(DBG_INIT, "Initializing VFS...\n");
+    mark = boottime_begin("vfs_init");
     vfs_init();
+    boottime_end(mark);
+    if (initrd_present())
+    {
+        mark = boottime_begin("initrd_unpack");
+        long made = initrd_unpack();
+        boottime_end(mark);
+        dbg(DBG_INIT, "Unpacked the initramfs: %ld\n", made);
+    }
+    mark = boottime_begin("make_devices");
     make_devices();
+    boottime_end(mark);
+#ifdef __MOUNTING__
+    mark = boottime_begin("mount_tmp");
+    mount_tmp();
+    boottime_end(mark);
+    mark = boottime_begin("mount_shm");
+    mount_shm();
+    boottime_end(mark);
+    mark = boottime_begin("mount_proc");
+    mount_proc();
+    boottime_end(mark);
+#endif
 #endif
 
     // Run VM tests first
     dbg(DBG_INIT, "Running VM tests...\n");
+    mark = boottime_begin("vmtest_main");
     long vmtest_result = vmtest_main(0, NULL);
+    boottime_end(mark);
     
     if (vmtest_result == 0) {
         dbg(DBG_INIT, "VM tests PASSED!\n");
@@ -178,7 +318,9 @@ static void *initproc_run(long arg1, void *arg2)
     dbg(DBG_INIT, "Running process and scheduler tests...\n");
     
     // Call the main test function from proctest.c
+    mark = boottime_begin("proctest_main");
     long test_result = proctest_main(0, NULL);
+    boottime_end(mark);
     
     if (test_result == 0) {
         dbg(DBG_INIT, "All tests PASSED!\n");
@@ -190,6 +332,8 @@ static void *initproc_run(long arg1, void *arg2)
     char *argv[] = {"/sbin/init", NULL};
     char *envp[] = {NULL};
     
+    /* Ended, with "boot", by kernel_execve() once it has loaded the binary */
+    boottime_begin("exec /sbin/init");
     kernel_execve("/sbin/init", argv, envp);
     
     dbg(DBG_PRINT, "kernel_execve returned, falling back to kshell...\n");
@@ -286,6 +430,17 @@ void initproc_start()
     KASSERT(init_thread && "Failed to create init thread");
     
     sched_make_runnable(init_thread);
+    workqueue_init();
+#ifdef __VFS__
+    writeback_init();
+    aio_init();
+#endif
+#ifdef __SHADOWD__
+    shadowd_init();
+#endif
+#ifdef __KSM__
+    ksmd_init();
+#endif
     context_make_active(&curcore.kc_ctx);
     
     panic("initproc_start: returned from context_make_active");
@@ -294,6 +449,8 @@ void initproc_start()
 void initproc_finish()
 {
 #ifdef __VFS__
+    /* The areas of processes still being reaped hold vnodes */
+    proc_reaper_drain();
     if (vfs_shutdown())
         panic("vfs shutdown FAILED!!\n");
 
@@ -302,6 +459,7 @@ void initproc_finish()
 #ifdef __DRIVERS__
     screen_print_shutdown();
 #endif
+    dbg_sync();
 
     /* sleep forever */
     while (1)
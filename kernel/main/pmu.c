@@ -0,0 +1,235 @@
+#include "main/pmu.h"
+#include "errno.h"
+#include "globals.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * The architectural performance monitoring of CPUID leaf 0xa (Intel Vol. 3B
+ * 18.2), through its general-purpose counters: each event counted takes the
+ * next free one, in PERFCTR_ order. Cycles, instructions and last level
+ * cache misses are architectural events; data TLB misses are counted with
+ * DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK, which means that on most Intel cores
+ * since Nehalem and may mean something else, or nothing, on others. Counts
+ * are in both rings, and only while the thread runs.
+ */
+
+#define CPUID_GETPERFMON 0xa
+
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PMC0 0xc1
+#define MSR_PERF_GLOBAL_CTRL 0x38f
+
+#define PERFEVTSEL_USR (1U << 16)
+#define PERFEVTSEL_OS (1U << 17)
+#define PERFEVTSEL_EN (1U << 22)
+#define PERFEVTSEL(event, umask) ((event) | ((umask) << 8))
+
+static const uint32_t pmu_event_sel[PERFCTR_EVENTS] = {
+    [PERFCTR_CYCLES] = PERFEVTSEL(0x3c, 0x00),
+    [PERFCTR_INSTRUCTIONS] = PERFEVTSEL(0xc0, 0x00),
+    [PERFCTR_LLC_MISSES] = PERFEVTSEL(0x2e, 0x41),
+    [PERFCTR_DTLB_MISSES] = PERFEVTSEL(0x08, 0x01),
+};
+
+/* CPUID.0xa:EBX bit for each architectural event, set if it is missing */
+static const int8_t pmu_event_arch_bit[PERFCTR_EVENTS] = {
+    [PERFCTR_CYCLES] = 0,
+    [PERFCTR_INSTRUCTIONS] = 1,
+    [PERFCTR_LLC_MISSES] = 4,
+    [PERFCTR_DTLB_MISSES] = -1,
+};
+
+static long pmu_ncounters = -1; /* until pmu_counters() looks */
+static long pmu_version;
+static uint64_t pmu_width_mask;
+static uint32_t pmu_missing; /* events the CPU says it cannot count */
+
+long pmu_counters()
+{
+    if (pmu_ncounters >= 0)
+    {
+        return pmu_ncounters;
+    }
+    uint32_t a, b, c, d;
+    cpuid(CPUID_GETVENDORSTRING, &a, &b, &c, &d);
+    long n = 0;
+    if (a >= CPUID_GETPERFMON)
+    {
+        cpuid(CPUID_GETPERFMON, &a, &b, &c, &d);
+        pmu_version = a & 0xff;
+        n = pmu_version ? (a >> 8) & 0xff : 0;
+        long width = (a >> 16) & 0xff;
+        pmu_width_mask = width >= 64 ? ~0UL : (1UL << width) - 1;
+        long known = (a >> 24) & 0xff; /* how much of EBX means anything */
+        for (long ev = 0; ev < PERFCTR_EVENTS; ev++)
+        {
+            long bit = pmu_event_arch_bit[ev];
+            if (bit >= 0 && (bit >= known || (b & (1U << bit))))
+            {
+                pmu_missing |= 1U << ev;
+            }
+        }
+    }
+    pmu_ncounters = n;
+    return n;
+}
+
+/* The number of events in the mask, and so of counters they take */
+static long pmu_event_count(uint32_t events)
+{
+    long n = 0;
+    for (; events; events &= events - 1)
+    {
+        n++;
+    }
+    return n;
+}
+
+static void pmu_wrmsr(uint32_t msr, uint64_t val)
+{
+    cpuid_set_msr(msr, (uint32_t)val, (uint32_t)(val >> 32));
+}
+
+static uint64_t pmu_rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    cpuid_get_msr(msr, &lo, &hi);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Adds what the current core's counters hold for pt to its counts. */
+static void pmu_accumulate(pmu_thread_t *pt, uint64_t *counts)
+{
+    long ctr = 0;
+    for (long ev = 0; ev < PERFCTR_EVENTS; ev++)
+    {
+        if (pt->pt_events & (1U << ev))
+        {
+            counts[ev] += pmu_rdmsr(MSR_PMC0 + (uint32_t)ctr) & pmu_width_mask;
+            ctr++;
+        }
+    }
+}
+
+/* Called as thr stops running, with interrupts off */
+void pmu_switch_out(kthread_t *thr)
+{
+    pmu_thread_t *pt = thr->kt_pmu;
+    if (!pt || !pt->pt_events)
+    {
+        return;
+    }
+    long n = pmu_event_count(pt->pt_events);
+    for (long ctr = 0; ctr < n; ctr++)
+    {
+        pmu_wrmsr(MSR_PERFEVTSEL0 + (uint32_t)ctr, 0);
+    }
+    pmu_accumulate(pt, pt->pt_counts);
+}
+
+/* Called as thr starts running, with interrupts off */
+void pmu_switch_in(kthread_t *thr)
+{
+    pmu_thread_t *pt = thr->kt_pmu;
+    if (!pt || !pt->pt_events)
+    {
+        return;
+    }
+    long ctr = 0;
+    for (long ev = 0; ev < PERFCTR_EVENTS; ev++)
+    {
+        if (pt->pt_events & (1U << ev))
+        {
+            pmu_wrmsr(MSR_PMC0 + (uint32_t)ctr, 0);
+            pmu_wrmsr(MSR_PERFEVTSEL0 + (uint32_t)ctr,
+                      pmu_event_sel[ev] | PERFEVTSEL_USR | PERFEVTSEL_OS |
+                          PERFEVTSEL_EN);
+            ctr++;
+        }
+    }
+    if (pmu_version >= 2)
+    {
+        pmu_wrmsr(MSR_PERF_GLOBAL_CTRL, (1UL << pmu_ncounters) - 1);
+    }
+}
+
+/* Starts counting the events in the mask for curthr, from 0. */
+long pmu_start(uint32_t events)
+{
+    if (!events || events >= 1U << PERFCTR_EVENTS)
+    {
+        return -EINVAL;
+    }
+    if (pmu_event_count(events) > pmu_counters() || events & pmu_missing)
+    {
+        return -ENODEV;
+    }
+    if (!curthr->kt_pmu && !(curthr->kt_pmu = kmalloc(sizeof(pmu_thread_t))))
+    {
+        return -ENOMEM;
+    }
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    pmu_switch_out(curthr);
+    pmu_thread_t *pt = curthr->kt_pmu;
+    pt->pt_events = events;
+    memset(pt->pt_counts, 0, sizeof(pt->pt_counts));
+    pmu_switch_in(curthr);
+    if (enabled)
+    {
+        intr_enable();
+    }
+    return 0;
+}
+
+/* Copies curthr's counts so far to counts[PERFCTR_EVENTS]. */
+long pmu_read(uint64_t *counts)
+{
+    pmu_thread_t *pt = curthr->kt_pmu;
+    if (!pt)
+    {
+        memset(counts, 0, PERFCTR_EVENTS * sizeof(*counts));
+        return 0;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    memcpy(counts, pt->pt_counts, PERFCTR_EVENTS * sizeof(*counts));
+    pmu_accumulate(pt, counts);
+    if (enabled)
+    {
+        intr_enable();
+    }
+    return 0;
+}
+
+/* Stops curthr's counting, keeping its counts for pmu_read(). */
+void pmu_stop()
+{
+    pmu_thread_t *pt = curthr->kt_pmu;
+    if (!pt)
+    {
+        return;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    pmu_switch_out(curthr);
+    pt->pt_events = 0;
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
+
+void pmu_thread_free(kthread_t *thr)
+{
+    if (thr->kt_pmu)
+    {
+        kfree(thr->kt_pmu);
+        thr->kt_pmu = NULL;
+    }
+}
@@ -3,6 +3,8 @@
 #include <main/gdt.h>
 
 #include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/fpu.h"
 #include "main/inits.h"
 
 #include "mm/tlb.h"
@@ -10,7 +12,7 @@
 #include "util/string.h"
 #include "util/time.h"
 
-static long smp_processor_count;
+static volatile long smp_processor_count;
 
 extern uintptr_t smp_initialization_start;
 extern uintptr_t smp_initialization_end;
@@ -19,34 +21,45 @@ extern uintptr_t smp_initialization_end;
 #define smp_initialization_size \
     (smp_initialization_end - smp_initialization_start)
 
-static void smp_start_processor(uint8_t apic_id);
 static long smp_stop_processor(regs_t *regs);
 
-extern void *csd_start;
-extern void *csd_end;
-#define CSD_START ((uintptr_t)&csd_start)
-#define CSD_END ((uintptr_t)&csd_end)
+/* The stack each application processor starts on, by APIC ID, or 0 for one
+ * that is not to start; read by smp_trampoline.S */
+#define SMP_BOOT_STACK_PAGES 1
+uintptr_t smp_ap_stacks[MAX_LAPICS];
+
+/* Set once the processors have checked in, to let them start scheduling */
+static volatile long smp_released;
+
+/* How long smp_init() waits for the processors to check in */
+#define SMP_BOOT_TIMEOUT_MS 1000
+
 #define CSD_PAGES (uintptr_t)((CSD_END - CSD_START) >> PAGE_SHIFT)
 
-core_t curcore CORE_SPECIFIC_DATA;
+/* First in the section (see link.ld); the linked copy points to itself for
+ * csd_early_init() */
+csd_head_t csd_head __attribute__((section(".csd.head"))) = {
+    .ch_self = (uintptr_t)&csd_head};
+
+core_t csd_curcore CORE_SPECIFIC_DATA;
 uintptr_t csd_vaddr_table[MAX_LAPICS] = {NULL};
 
-void map_in_core_specific_data(pml4_t *pml4)
+static void csd_set_base(uintptr_t base)
 {
-    pt_map_range(pml4, curcore.kc_csdpaddr, CSD_START, CSD_END,
-                 PT_PRESENT | PT_WRITE, PT_PRESENT | PT_WRITE);
-    uintptr_t mapped_paddr = pt_virt_to_phys_helper(pml4, (uintptr_t)&curcore);
-    uintptr_t expected_paddr =
-        (uintptr_t)GET_CSD(curcore.kc_id, core_t, curcore) - PHYS_OFFSET;
-    uintptr_t expected_paddr2 =
-        pt_virt_to_phys_helper(pt_get(), (uintptr_t)&curcore);
-    KASSERT(mapped_paddr == expected_paddr);
-    KASSERT(expected_paddr == expected_paddr2);
+    cpuid_set_msr(MSR_GS_BASE, (uint32_t)base, (uint32_t)(base >> 32));
+    cpuid_set_msr(MSR_KERNEL_GS_BASE, 0, 0);
 }
 
+/*
+ * Points the GS base at the core-specific data linked into the kernel, for
+ * a processor to use from the moment it enters C until core_init() gives it
+ * its own.
+ */
+void csd_early_init() { csd_set_base(CSD_START); }
+
 long is_core_specific_data(void *addr)
 {
-    return (uintptr_t)addr >= CSD_START && (uintptr_t)addr < CSD_END;
+    return (uintptr_t)addr - csd_base() < CSD_END - CSD_START;
 }
 
 void core_init()
@@ -55,28 +68,29 @@ void core_init()
     pt_init();
     pt_set(pt_create());
 
-    uintptr_t csd_paddr = (uintptr_t)page_alloc_n(CSD_PAGES);
-    if (!csd_paddr)
+    KASSERT((uintptr_t)&csd_head == CSD_START);
+    uintptr_t csd_vaddr = (uintptr_t)page_alloc_n(CSD_PAGES);
+    if (!csd_vaddr)
         panic("not enough memory for core-specific data!");
-    csd_vaddr_table[apic_current_id()] =
-        csd_paddr; // still in PHYSMAP region; still a VMA
-    csd_paddr -= PHYS_OFFSET;
+    uintptr_t csd_paddr = csd_vaddr - PHYS_OFFSET;
 
-    dbg(DBG_CORE, "mapping in core specific data to 0x%p\n", (void *)csd_paddr);
-    pt_map_range(pt_get(), csd_paddr, CSD_START, CSD_END, PT_PRESENT | PT_WRITE,
-                 PT_PRESENT | PT_WRITE);
-    tlb_flush_all();
-
-    memset((void *)CSD_START, 0, CSD_END - CSD_START);
+    dbg(DBG_CORE, "core specific data at 0x%p\n", (void *)csd_paddr);
+    memset((void *)csd_vaddr, 0, CSD_END - CSD_START);
+    ((csd_head_t *)csd_vaddr)->ch_self = csd_vaddr;
+    csd_set_base(csd_vaddr);
+    csd_vaddr_table[apic_current_id()] = csd_vaddr;
 
     curcore.kc_id = apic_current_id();
     curcore.kc_queue = NULL;
-    curcore.kc_csdpaddr = csd_paddr;
+    curcore.kc_release = NULL;
+    pt_pcid_init();
 
     intr_init();
     gdt_init();
+    fpu_init();
 
     apic_enable();
+    page_pcp_init();
     time_init();
     sched_init();
 
@@ -88,41 +102,72 @@ void core_init()
 
 void __attribute__((used)) smp_processor_entry()
 {
+    csd_early_init();
     core_init();
     dbg_force(DBG_CORE, "started C%ld!\n", curcore.kc_id);
-    smp_processor_count++;
 
     KASSERT(!intr_enabled());
     preemption_disable();
     proc_idleproc_init();
+
+    /* The boot barrier: check in, then wait for the others */
+    __sync_fetch_and_add(&smp_processor_count, 1);
+    while (!smp_released)
+        __asm__ volatile("pause" ::: "memory");
     context_make_active(&curcore.kc_ctx);
 }
 
-/*
- * Prepare for SMP by copying the real-mode trampoline code into the
- * first 1mb of memory.
- */
-void smp_init()
+/* Spins for usec microseconds */
+static void smp_delay(uint64_t usec)
 {
-    NOT_YET_IMPLEMENTED("SMP: smp_init");
+    uint64_t target = time_usec() + usec;
+    while (time_usec() < target)
+        __asm__ volatile("pause");
 }
 
-// Intel Vol. 3A 10-11, 10.4.7.3
-static void smp_start_processor(uint8_t apic_id)
+/*
+ * Starts the other processors, all at once: copies the real-mode trampoline
+ * into the first page of memory, gives each processor a boot stack, and
+ * broadcasts a single INIT-SIPI-SIPI sequence (Intel Vol. 3A 8.4.4.1). They
+ * then run core_init() alongside one another; once all have checked in, or
+ * SMP_BOOT_TIMEOUT_MS have passed, they are let go to schedule.
+ */
+void smp_init()
 {
-    // TODO: not necessarily true that apic_id == processor_id
-    dbg_force(DBG_CORE, "Booting C%d\n", apic_id);
-
     memcpy((void *)PHYS_OFFSET, (void *)smp_initialization_start,
            smp_initialization_size);
 
-    // First, send a INIT IPI
-
-    long prev_count = smp_processor_count;
-    apic_start_processor(apic_id, 0);
-
-    while (smp_processor_count == prev_count)
-        ;
+    long expected = 0;
+    for (long id = 0; id <= apic_max_id(); id++)
+    {
+        if (id == curcore.kc_id || !apic_processor_enabled(id))
+            continue;
+        void *stack = page_alloc_n(SMP_BOOT_STACK_PAGES);
+        KASSERT(stack && "not enough memory for a boot stack");
+        smp_ap_stacks[id] = (uintptr_t)stack + SMP_BOOT_STACK_PAGES * PAGE_SIZE;
+        expected++;
+    }
+    if (!expected)
+        return;
+
+    uint64_t start = time_usec();
+    apic_broadcast_ipi(DESTINATION_MODE_INIT, 0, 0);
+    apic_wait_ipi();
+    smp_delay(10000);
+    /* The second SIPI is for a processor that missed the first */
+    for (long i = 0; i < 2; i++)
+    {
+        apic_broadcast_ipi(DESTINATION_MODE_SIPI, 0, 0);
+        apic_wait_ipi();
+        smp_delay(200);
+    }
+
+    uint64_t deadline = start + SMP_BOOT_TIMEOUT_MS * 1000;
+    while (smp_processor_count < expected && time_usec() < deadline)
+        __asm__ volatile("pause" ::: "memory");
+    dbg_force(DBG_CORE, "started %ld of %ld processors in %lu us\n",
+              smp_processor_count, expected, time_usec() - start);
+    smp_released = 1;
 }
 
 static long smp_stop_processor(regs_t *regs)
@@ -131,6 +176,7 @@ static long smp_stop_processor(regs_t *regs)
     time_stats(buf, sizeof(buf));
 
     dbg_force(DBG_CORE, "\n%s\nhalted cleanly!\n\n", buf);
+    dbg_sync();
 
     __asm__ volatile("cli; hlt;");
 
@@ -0,0 +1,63 @@
+#include "main/softirq.h"
+#include "globals.h"
+#include "main/interrupt.h"
+#include "proc/sched.h"
+#include "util/debug.h"
+
+static softirq_handler_t softirq_handlers[SOFTIRQ_COUNT];
+
+/* The softirqs raised on this core that have yet to run, as a bitmap */
+static uint32_t softirq_pending CORE_SPECIFIC_DATA;
+
+/* Whether this core is running softirqs, so that an interrupt taken while it
+ * is leaves them to the loop in softirq_run() */
+static long softirq_running CORE_SPECIFIC_DATA;
+
+void softirq_register(long softirq, softirq_handler_t handler)
+{
+    KASSERT(softirq >= 0 && softirq < SOFTIRQ_COUNT);
+    softirq_handlers[softirq] = handler;
+}
+
+void softirq_raise(long softirq)
+{
+    KASSERT(softirq >= 0 && softirq < SOFTIRQ_COUNT);
+    __sync_fetch_and_or(CSD_PTR(softirq_pending), 1U << softirq);
+}
+
+void softirq_run()
+{
+    /* Like timers, not while the thread has asked not to be disturbed */
+    if (!CSD(softirq_pending) || CSD(softirq_running) ||
+        (curthr && !preemption_enabled()))
+    {
+        return;
+    }
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    CSD(softirq_running) = 1;
+    /* Not preempted away from this core's softirqs (see cond_resched()) */
+    preemption_disable();
+    /* Checked with interrupts off, so that none raised by a top half that
+     * came in meanwhile is left behind */
+    while (CSD(softirq_pending))
+    {
+        uint32_t pending = __sync_fetch_and_and(CSD_PTR(softirq_pending), 0);
+        intr_enable();
+        while (pending)
+        {
+            long softirq = __builtin_ctz(pending);
+            pending &= pending - 1;
+            KASSERT(softirq_handlers[softirq]);
+            softirq_handlers[softirq]();
+        }
+        intr_disable();
+    }
+    preemption_enable();
+    CSD(softirq_running) = 0;
+    if (enabled)
+    {
+        intr_enable();
+    }
+}
@@ -1,20 +1,42 @@
 #include "errno.h"
 
 #include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
 #include "mm/pframe.h"
+#include "mm/swap.h"
+#include "proc/sched.h"
+#include "vm/vmmap.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/trace.h"
 #include <util/string.h>
 
+mobj_stats_t mobj_stats[MOBJ_NTYPES];
+
+STATIC_ASSERT(offsetof(mobj_t, mo_mutex) + offsetof(kmutex_t, km_holder) <
+                  CACHE_LINE_SIZE,
+              "mo_refcount and mo_mutex's holder no longer share a line");
+
 /*
- * Initialize o according to type and ops. If ops do not specify a
- * get_pframe function, set it to the default, mobj_default_get_pframe.
- * Do the same with the destructor function pointer.
- *
- * Upon return, the refcount of the mobj should be 1.
+ * Initialize the parts of o that every user leaves the way it found them:
+ * the mutex (unlocked) and the pframe list (empty). Objects from a slab
+ * allocator with a constructor get this done once per slab rather than on
+ * every allocation, see mobj_init_constructed.
  */
-void mobj_init(mobj_t *o, long type, mobj_ops_t *ops)
+void mobj_ctor(mobj_t *o)
+{
+    kmutex_init(&o->mo_mutex);
+    list_init(&o->mo_pframes);
+}
+
+/*
+ * Like mobj_init, for an o that has already been through mobj_ctor.
+ */
+void mobj_init_constructed(mobj_t *o, long type, mobj_ops_t *ops)
 {
+    KASSERT(!kmutex_has_waiters(&o->mo_mutex) && list_empty(&o->mo_pframes));
     o->mo_type = type;
 
     memcpy(&o->mo_ops, ops, sizeof(mobj_ops_t));
@@ -30,12 +52,22 @@ void mobj_init(mobj_t *o, long type, mobj_ops_t *ops)
         o->mo_ops.destructor = mobj_default_destructor;
     }
 
-    kmutex_init(&o->mo_mutex);
-
     o->mo_refcount = ATOMIC_INIT(1);
-    list_init(&o->mo_pframes);
 
-    o->mo_btree = NULL;
+    radix_tree_init(&o->mo_index);
+}
+
+/*
+ * Initialize o according to type and ops. If ops do not specify a
+ * get_pframe function, set it to the default, mobj_default_get_pframe.
+ * Do the same with the destructor function pointer.
+ *
+ * Upon return, the refcount of the mobj should be 1.
+ */
+void mobj_init(mobj_t *o, long type, mobj_ops_t *ops)
+{
+    mobj_ctor(o);
+    mobj_init_constructed(o, type, ops);
 }
 
 /*
@@ -96,12 +128,11 @@ void mobj_find_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
     *pfp = NULL;
 
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    pframe_t *pf = NULL;
-    if (o->mo_btree)
-        pf = (pframe_t *)btree_search(o->mo_btree, pagenum);
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
     if (pf != NULL)
     {
         kmutex_lock(&pf->pf_mutex);
+        pframe_mark_accessed(pf);
         *pfp = pf;
         return;
     }
@@ -109,6 +140,50 @@ void mobj_find_pframe(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
     *pfp = NULL;
 }
 
+/*
+ * The cache hit path of mobj_find_pframe, without o's mutex: readers of
+ * different pages of one object do not serialize on it.
+ *
+ * Everything that changes o's index or frees its pframes holds mo_mutex and
+ * runs in thread context, and this kernel runs one thread at a time, so a
+ * walk done with preemption disabled and without sleeping sees the index
+ * exactly as some writer left it, much like an RCU read-side section. The
+ * pframe is therefore only try-locked: once we hold it, it cannot be freed
+ * or replaced until we let it go.
+ *
+ * Returns 0 with *pfp set to the pframe, locked and filled, or, with *pfp
+ * NULL:
+ *  - ENOENT: the page is not cached
+ *  - EAGAIN: the page is cached, but its pframe is busy
+ * In both cases callers fall back to doing the work with mo_mutex held.
+ */
+long mobj_find_pframe_lockless(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
+{
+    long ret = -ENOENT;
+    preemption_disable();
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
+    if (pf)
+    {
+        ret = -EAGAIN;
+        if (kmutex_trylock(&pf->pf_mutex))
+        {
+            if (pf->pf_addr)
+            {
+                pframe_mark_accessed(pf);
+                MOBJ_STAT_INC(o, ms_hits);
+                ret = 0;
+            }
+            else
+            {
+                kmutex_unlock(&pf->pf_mutex);
+            }
+        }
+    }
+    preemption_enable();
+    *pfp = ret ? NULL : pf;
+    return ret;
+}
+
 /*
  * Wrapper around the memory object's get_pframe function
  * Assert a sane state of the world surrounding the call to get_pframe
@@ -123,6 +198,32 @@ long mobj_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
     return ret;
 }
 
+/*
+ * Whether page pagenum of o, which must be locked, has never been written
+ * and has no page of its own, in which case it can be mapped as the shared
+ * zero page until the first write.
+ */
+long mobj_page_is_zero(mobj_t *o, uint64_t pagenum)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    return o->mo_ops.page_is_zero ? o->mo_ops.page_is_zero(o, pagenum) : 0;
+}
+
+/*
+ * Finds the resident page a read of page pagenum of o, which must be locked,
+ * would be given, for mapping it ahead of a fault. Returns as
+ * mobj_find_pframe_lockless does; nothing is waited for or read in.
+ */
+long mobj_find_resident(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    if (o->mo_ops.find_resident)
+    {
+        return o->mo_ops.find_resident(o, pagenum, pfp);
+    }
+    return mobj_find_pframe_lockless(o, pagenum, pfp);
+}
+
 /*
  * Create and initialize a pframe and add it to the mobj's mo_pframes list.
  * Upon successful return, the pframe's pf_mutex is locked.
@@ -137,8 +238,20 @@ void mobj_create_pframe(mobj_t *o, uint64_t pagenum, uint64_t loc, pframe_t **pf
 
         pf->pf_pagenum = pagenum;
         pf->pf_loc = loc;
+        pf->pf_obj = o;
+        if (radix_tree_insert(&o->mo_index, pagenum, pf))
+        {
+            pframe_free(&pf);
+            *pfp = NULL;
+            return;
+        }
         list_insert_tail(&o->mo_pframes, &pf->pf_link);
-        btree_insert(&o->mo_btree, pagenum, (void *)pf);
+        /* Only pages that can be read back in are ever reclaimed. */
+        if (o->mo_type == MOBJ_VNODE || o->mo_type == MOBJ_FS ||
+            (MOBJ_SWAPPABLE(o) && swap_enabled()))
+        {
+            pframe_lru_add(pf);
+        }
     }
     KASSERT(!pf || kmutex_owns_mutex(&pf->pf_mutex));
     *pfp = pf;
@@ -172,8 +285,13 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
     *pfp = NULL;
     pframe_t *pf = NULL;
     mobj_find_pframe(o, pagenum, &pf);
-    if (!pf)
+    if (pf)
+    {
+        MOBJ_STAT_INC(o, ms_hits);
+    }
+    else
     {
+        MOBJ_STAT_INC(o, ms_misses);
         mobj_create_pframe(o, pagenum, 0, &pf);  // XXX is zero correct???
     }
     if (!pf)
@@ -185,14 +303,16 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
     {
         KASSERT(!pf->pf_dirty &&
                 "dirtied page doesn't have a physical address");
-        pf->pf_addr = page_alloc();
+        // Anonymous pages that were never swapped out or merged start out as
+        // zeros, so they come from the pool idle cores zero ahead of time.
+        long zeroed = o->mo_type == MOBJ_ANON && !pf->pf_swap && !pf->pf_ksm;
+        pf->pf_addr = zeroed ? page_alloc_zeroed() : page_alloc();
         if (!pf->pf_addr)
         {
             return -ENOMEM;
         }
 
-        dbg(DBG_PFRAME, "filling pframe 0x%p (mobj 0x%p page %lu)\n", pf, o,
-            pf->pf_pagenum);
+        TRACE(TRACE_PFRAME_FILL, o, pf->pf_pagenum);
         KASSERT(o->mo_ops.fill_pframe);
         long ret = o->mo_ops.fill_pframe(o, pf);
         if (ret)
@@ -202,8 +322,12 @@ long mobj_default_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
             kmutex_unlock(&pf->pf_mutex);
             return ret;
         }
+        MOBJ_STAT_INC(o, ms_fills);
+    }
+    if (forwrite)
+    {
+        pframe_set_dirty(pf);
     }
-    pf->pf_dirty |= forwrite;
     *pfp = pf;
     return 0;
 }
@@ -220,14 +344,15 @@ long mobj_flush_pframe(mobj_t *o, pframe_t *pf)
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
     KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
     KASSERT(pf->pf_addr && "cannot flush a frame not in memory!");
-    dbg(DBG_PFRAME, "pf 0x%p, mobj 0x%p, page %lu\n", pf, o, pf->pf_pagenum);
+    TRACE(TRACE_PFRAME_FLUSH, o, pf->pf_pagenum);
     if (pf->pf_dirty)
     {
         KASSERT(o->mo_ops.flush_pframe);
         long ret = o->mo_ops.flush_pframe(o, pf);
         if (ret)
             return ret;
-        pf->pf_dirty = 0;
+        pframe_clear_dirty(pf);
+        MOBJ_STAT_INC(o, ms_flushes);
     }
     KASSERT(!pf->pf_dirty);
     return 0;
@@ -243,14 +368,25 @@ long mobj_flush(mobj_t *o)
 {
     long ret = 0;
     KASSERT(kmutex_owns_mutex(&o->mo_mutex));
-    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    /* Only the dirty pframes need looking at, and the index finds them
+     * without going through the rest. */
+    pframe_t *batch[16];
+    uint64_t next = 0;
+    size_t n;
+    while ((n = radix_tree_gang_lookup_tag(&o->mo_index, (void **)batch, next,
+                                           16, MOBJ_TAG_DIRTY)))
     {
-        kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
-        if (pf->pf_addr)
+        for (size_t i = 0; i < n; i++)
         {
-            ret |= mobj_flush_pframe(o, pf);
+            pframe_t *pf = batch[i];
+            next = pf->pf_pagenum + 1;
+            kmutex_lock(&pf->pf_mutex); // get the pframe (lock it)
+            if (pf->pf_addr)
+            {
+                ret |= mobj_flush_pframe(o, pf);
+            }
+            pframe_release(&pf);
         }
-        pframe_release(&pf);
     }
     return ret;
 }
@@ -285,29 +421,191 @@ long mobj_free_pframe(mobj_t *o, pframe_t **pfp)
     *pfp = NULL;
     list_remove(&pf->pf_link);
 
-    btree_delete(&o->mo_btree, pf->pf_pagenum);
+    radix_tree_delete(&o->mo_index, pf->pf_pagenum);
 
     pframe_free(&pf);
     return 0;
 }
 
+/*
+ * Called by the page cache reclaimer to evict page pagenum of o, provided
+ * it is still held by the pframe expected. The caller must hold a reference
+ * on o, but neither o nor the pframe may be locked: the reclaimer runs from
+ * inside page_alloc, whose caller may hold either one, so both are only
+ * tried rather than waited for. The pages of swappable objects are paged
+ * out rather than freed with their pframes (see swap_out_pframe).
+ *
+ * Returns 1 if a page of memory was freed and 0 otherwise.
+ */
+long mobj_evict_pframe(mobj_t *o, uint64_t pagenum, pframe_t *expected)
+{
+    long freed = 0;
+    if (!kmutex_trylock(&o->mo_mutex))
+    {
+        return 0;
+    }
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
+    if (pf == expected && kmutex_trylock(&pf->pf_mutex))
+    {
+        if (MOBJ_SWAPPABLE(o))
+        {
+            freed = swap_out_pframe(o, pf);
+            pframe_release(&pf);
+            mobj_unlock(o);
+            return freed;
+        }
+        /* New pins and mappings need the pframe locked, so this holds. */
+        if (pframe_pinned(pf))
+        {
+            pframe_release(&pf);
+            mobj_unlock(o);
+            return 0;
+        }
+        long resident = pf->pf_addr != NULL;
+        if (mobj_free_pframe(o, &pf))
+        {
+            pframe_release(&pf);
+        }
+        else
+        {
+            freed = resident;
+        }
+    }
+    mobj_unlock(o);
+    return freed;
+}
+
+/*
+ * Called by pframe_rss_trim, for a process over its resident set limit, to
+ * take page pagenum of o, provided it is still held by the pframe expected,
+ * out of the address spaces that map it; those of swappable objects are
+ * paged out too, and otherwise left to the page cache reclaimer. As in
+ * mobj_evict_pframe, o and the pframe are only tried, and mappings used
+ * since the last look are kept.
+ *
+ * Returns 1 if the page is no longer mapped and 0 otherwise.
+ */
+long mobj_trim_pframe(mobj_t *o, uint64_t pagenum, pframe_t *expected)
+{
+    long trimmed = 0;
+    if (!kmutex_trylock(&o->mo_mutex))
+    {
+        return 0;
+    }
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
+    if (pf == expected && kmutex_trylock(&pf->pf_mutex))
+    {
+        if (MOBJ_SWAPPABLE(o))
+        {
+            swap_out_pframe(o, pf);
+        }
+        else if (pf->pf_addr && pf->pf_mapcount && !pf->pf_pincount)
+        {
+            vmmap_unmap_pframe(o, pagenum,
+                               pt_virt_to_phys((uintptr_t)pf->pf_addr), 0);
+        }
+        trimmed = !pf->pf_mapcount;
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+    return trimmed;
+}
+
+/*
+ * Called by compaction (see pframe_compact) to move the contents of page
+ * pagenum of o, provided it is still held by the pframe expected, into
+ * page, a free page. The caller holds a reference on o. As in
+ * mobj_evict_pframe, o and the pframe are only tried, and here the caller
+ * may even hold them already.
+ *
+ * Pinned pframes stay where they are. Mapped ones are only moved if unmap is
+ * set, once they have been taken out of every address space (see
+ * vmmap_unmap_pframe); their next access faults the new page in. The old
+ * page goes straight back to the buddy tree rather than to a per-core
+ * cache, for it to coalesce with its free neighbours.
+ *
+ * Returns 0 if the contents were moved, and page is now in use, or -EBUSY.
+ */
+long mobj_migrate_pframe(mobj_t *o, uint64_t pagenum, pframe_t *expected,
+                         void *page, long unmap)
+{
+    long ret = -EBUSY;
+    if (kmutex_owns_mutex(&o->mo_mutex) || !kmutex_trylock(&o->mo_mutex))
+    {
+        return ret;
+    }
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
+    if (pf == expected && !kmutex_owns_mutex(&pf->pf_mutex) &&
+        kmutex_trylock(&pf->pf_mutex))
+    {
+        if (pf->pf_addr && pf->pf_mapcount && !pf->pf_pincount && unmap)
+        {
+            vmmap_unmap_pframe(o, pagenum,
+                               pt_virt_to_phys((uintptr_t)pf->pf_addr), 1);
+        }
+        /* New pins and mappings need the pframe locked, so this holds. */
+        if (pf->pf_addr && !pframe_pinned(pf))
+        {
+            memcpy(page, pf->pf_addr, PAGE_SIZE);
+            page_free_n(pf->pf_addr, 1);
+            pf->pf_addr = page;
+            ret = 0;
+        }
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+    return ret;
+}
+
+/* Discards pf, which is locked, from o, which is locked too. */
+static void _mobj_discard_pframe(mobj_t *o, pframe_t *pf)
+{
+    pframe_clear_dirty(pf);
+    list_remove(&pf->pf_link);
+    radix_tree_delete(&o->mo_index, pf->pf_pagenum);
+    if (pf->pf_addr)
+    {
+        page_free(pf->pf_addr);
+        pf->pf_addr = NULL;
+    }
+    pframe_free(&pf);
+}
+
+/*
+ * Discards page pagenum of o, dirty or not. o must be locked.
+ */
 void mobj_delete_pframe(mobj_t *o, size_t pagenum)
 {
-    pframe_t *pf = (pframe_t *)btree_search(o->mo_btree, pagenum);
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
     if (pf)
     {
         kmutex_lock(&pf->pf_mutex);
-        list_remove(&pf->pf_link);
-        btree_delete(&o->mo_btree, pf->pf_pagenum);
-        pf->pf_dirty = 0;
-        if (pf->pf_addr)
+        _mobj_discard_pframe(o, pf);
+    }
+}
+
+/*
+ * Discards the pages of o in [lopage, hipage) that are neither pinned nor
+ * mapped, dirty or not. o must be locked.
+ */
+void mobj_discard_range(mobj_t *o, uint64_t lopage, uint64_t hipage)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+    {
+        if (pf->pf_pagenum < lopage || pf->pf_pagenum >= hipage)
         {
-            page_free(pf->pf_addr);
-            pf->pf_addr = NULL;
+            continue;
+        }
+        kmutex_lock(&pf->pf_mutex);
+        if (pframe_pinned(pf))
+        {
+            pframe_release(&pf);
+            continue;
         }
-        pframe_free(&pf);
+        _mobj_discard_pframe(o, pf);
     }
-    
 }
 
 /*
@@ -325,7 +623,7 @@ void mobj_default_destructor(mobj_t *o)
         ret |= mobj_free_pframe(o, &pf);
     }
 
-    KASSERT(!o->mo_btree);
+    KASSERT(radix_tree_empty(&o->mo_index));
 
     if (ret)
     {
@@ -333,8 +631,49 @@ void mobj_default_destructor(mobj_t *o)
             "WARNING: flushing pframes in mobj destructor failed for one or "
             "more frames\n"
             "This means the memory for the pframe will be leaked!");
+        list_init(&o->mo_pframes);
     }
 
     KASSERT(!kmutex_has_waiters(&o->mo_mutex));
     mobj_unlock(o);
 }
+
+/*
+ * Prints the page cache counters of each type of memory object, and their
+ * totals. Follows the proc_info convention: arg must be NULL, and the
+ * number of bytes of buf left unused is returned.
+ */
+size_t mobj_stats_info(const void *arg, char *buf, size_t osize)
+{
+    static const char *names[MOBJ_NTYPES] = {[MOBJ_VNODE] = "vnode",
+                                             [MOBJ_SHADOW] = "shadow",
+                                             [MOBJ_ANON] = "anon",
+                                             [MOBJ_FS] = "fs"};
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    mobj_stats_t total = {0};
+    iprintf(&buf, &size, "\n%-8s %10s %10s %10s %10s %10s %5s\n", "CACHE",
+            "HITS", "MISSES", "FILLS", "FLUSHES", "DIRTY", "HIT%");
+    for (long type = 0; type <= MOBJ_NTYPES; type++)
+    {
+        mobj_stats_t *ms = type < MOBJ_NTYPES ? &mobj_stats[type] : &total;
+        if (type < MOBJ_NTYPES)
+        {
+            if (!names[type])
+                continue;
+            total.ms_hits += ms->ms_hits;
+            total.ms_misses += ms->ms_misses;
+            total.ms_fills += ms->ms_fills;
+            total.ms_flushes += ms->ms_flushes;
+            total.ms_dirty += ms->ms_dirty;
+        }
+        uint64_t lookups = ms->ms_hits + ms->ms_misses;
+        iprintf(&buf, &size, "%-8s %10lu %10lu %10lu %10lu %10lu %5lu\n",
+                type < MOBJ_NTYPES ? names[type] : "total", ms->ms_hits,
+                ms->ms_misses, ms->ms_fills, ms->ms_flushes, ms->ms_dirty,
+                lookups ? 100 * ms->ms_hits / lookups : 0);
+    }
+    return size;
+}
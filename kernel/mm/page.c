@@ -6,11 +6,19 @@
 
 #include "boot/config.h"
 
+#include "main/acpi.h"
+#include "main/apic.h"
+#include "main/interrupt.h"
+
 #include "mm/mm.h"
 #include "mm/page.h"
 
+#include "proc/kmutex.h"
+#include "proc/spinlock.h"
+
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "multiboot.h"
@@ -76,10 +84,13 @@ typedef uintptr_t btree_word;
 
 #define BTREE_IS_AVAILABLE(idx) \
     (btree[BTREE_WORD_POS(idx)] & BTREE_AVAILABILITY_MASK(idx))
-#define BTREE_MARK_AVAILABLE(idx) \
-    (btree[BTREE_WORD_POS(idx)] |= BTREE_AVAILABILITY_MASK(idx))
-#define BTREE_MARK_UNAVAILABLE(idx) \
-    (btree[BTREE_WORD_POS(idx)] &= ~BTREE_AVAILABILITY_MASK(idx))
+#define BTREE_MARK_AVAILABLE(idx) _btree_mark_available_bit(idx)
+#define BTREE_MARK_UNAVAILABLE(idx) _btree_mark_unavailable_bit(idx)
+
+// the summary has one bit per word of the tree, set iff that word is nonzero,
+// laid out the same way (same word/bit macros, indexed by word number)
+#define BTREE_SUMMARY_IS_SET(w) \
+    (btree_summary[BTREE_WORD_POS(w)] & BTREE_AVAILABILITY_MASK(w))
 
 // potential optimization: use these when clearing pairs. something about the
 // following is apparently buggy though (causes fault) #define
@@ -102,9 +113,159 @@ static size_t
 static size_t max_order; // max depth of binary tree
 
 static btree_word *btree;
+static btree_word *btree_summary;
+static size_t btree_nwords; // number of words in btree
 static uintptr_t *min_available_idx_by_order;
 static size_t *count_available_by_order;
 
+/*
+ * The buddy tree and its metadata are shared by all cores and protected by
+ * page_lock, taken with interrupts disabled.
+ *
+ * In front of the tree, each core keeps a cache of free single pages, linked
+ * through the pages themselves. page_alloc() and page_free() work on the
+ * local cache alone; only when it runs dry (or over PAGE_PCP_HIGH) is the
+ * tree locked, and then PAGE_PCP_BATCH pages move at once. Freed pages go on
+ * the head of the cache and allocations are made from the head, so a page
+ * that was just freed, and is likely still in this core's cache, is handed
+ * out first. Pages pulled in from the tree go on the tail, which is also the
+ * end a drain returns to the tree.
+ */
+#define PAGE_PCP_HIGH 64
+#define PAGE_PCP_BATCH 16
+
+typedef struct page_pcp
+{
+    list_t pc_pages; /* free pages, hottest first */
+    size_t pc_count; /* length of pc_pages */
+} CACHE_LINE_ALIGNED page_pcp_t;
+
+static spinlock_t page_lock = SPINLOCK_INITIALIZER(page_lock);
+static page_pcp_t page_pcp[MAX_LAPICS];
+static long page_pcp_online;          /* set once apic_current_id() works */
+static volatile size_t page_pcp_count; /* pages held in all the caches */
+
+/*
+ * Free pages are also counted per zone: DMA32 is everything below 4GB, which
+ * devices with 32-bit DMA addressing can reach, and normal is the rest.
+ * Ordinary allocations take normal memory while there is any, leaving DMA32
+ * for page_alloc_bounded() and friends.
+ *
+ * If the firmware provides an SRAT, the ranges of each node are remembered
+ * too, and ordinary allocations try the current core's node first. The
+ * nodes share the one buddy tree; a node is just a range to search first.
+ */
+#define PAGE_DMA32_LIMIT (1UL << 32)
+#define PAGE_MAX_NODE_RANGES 16
+
+typedef struct page_node_range
+{
+    uintptr_t pn_start; /* physical address of the first byte */
+    uintptr_t pn_end;   /* physical address past the last byte */
+    long pn_node;
+} page_node_range_t;
+
+static size_t page_zone_freecount[PAGE_NZONES];
+static page_node_range_t page_node_ranges[PAGE_MAX_NODE_RANGES];
+static size_t page_node_nranges;
+static long page_apic_node[MAX_LAPICS]; /* node of each core, or -1 */
+
+/*
+ * Shrinkers are run by page_reclaim_point() once an allocation has left the
+ * free count below page_low_watermark; they then run until it is back above
+ * page_high_watermark. The gap between the two keeps a workload hovering near
+ * the low mark from reclaiming on every allocation. page_shrinker_lock
+ * protects the list; page_reclaim_mutex is held while shrinkers run.
+ */
+#define PAGE_MAX_SHRINKERS 8
+
+static size_t page_low_watermark;
+static size_t page_high_watermark;
+static volatile long page_reclaim_wanted;
+static list_t page_shrinkers = LIST_INITIALIZER(page_shrinkers);
+static spinlock_t page_shrinker_lock = SPINLOCK_INITIALIZER(page_shrinker_lock);
+static kmutex_t page_reclaim_mutex = KMUTEX_INITIALIZER(page_reclaim_mutex);
+
+/*
+ * When a multi-page allocation fails even after the per-core cache has been
+ * drained, the compactor is asked to empty a block of that size and the
+ * allocation is tried once more; the compactor is never reentered, since it
+ * allocates pages itself. The largest order it failed for is remembered in
+ * page_compact_order, and page_reclaim_point has the compactor try again
+ * for it there, where pages may be unmapped to be moved.
+ */
+static page_compactor_t *page_compactor;
+static volatile long page_compacting;
+static volatile size_t page_compact_order;
+/*
+ * Pages that have already been zeroed, for page_alloc_zeroed(). Idle cores
+ * fill the pool from core_switch() while free memory is above the high
+ * watermark, so zeroing is done when there is nothing else to do rather
+ * than on the fault path; reclaim empties it again. The pages are linked
+ * through their first word, which is cleared when one is taken out.
+ * page_zero_lock protects the pool and is taken with interrupts disabled.
+ */
+#define PAGE_ZERO_POOL_MAX 64
+
+static void *page_zero_pool;
+static volatile size_t page_zero_count;
+static spinlock_t page_zero_lock = SPINLOCK_INITIALIZER(page_zero_lock);
+static size_t page_zero_hits; /* page_alloc_zeroed calls the pool served */
+
+static size_t page_ncompact;    /* compactions tried */
+static size_t page_ncompact_ok; /* compactions that made a free block */
+
+static void _page_add_range(void *start, void *end);
+static void _page_mark_reserved(void *paddr);
+
+static inline void _btree_mark_available_bit(uintptr_t idx)
+{
+    uintptr_t w = BTREE_WORD_POS(idx);
+    btree[w] |= BTREE_AVAILABILITY_MASK(idx);
+    btree_summary[BTREE_WORD_POS(w)] |= BTREE_AVAILABILITY_MASK(w);
+}
+
+static inline void _btree_mark_unavailable_bit(uintptr_t idx)
+{
+    uintptr_t w = BTREE_WORD_POS(idx);
+    btree[w] &= ~BTREE_AVAILABILITY_MASK(idx);
+    if (!btree[w])
+        btree_summary[BTREE_WORD_POS(w)] &= ~BTREE_AVAILABILITY_MASK(w);
+}
+
+// Returns the lowest available index in [from, end), or end if there is none.
+// Skips runs of empty words using the summary, so a search costs at most a
+// walk over btree_nwords / 64 summary words rather than the whole row.
+static uintptr_t _btree_find_available(uintptr_t from, uintptr_t end)
+{
+    if (from >= end)
+        return end;
+
+    uintptr_t w = BTREE_WORD_POS(from);
+    btree_word bits = btree[w] & (~(btree_word)0 >> BTREE_BIT_POS(from));
+    if (!bits)
+    {
+        uintptr_t s = w + 1;
+        if (s >= btree_nwords)
+            return end;
+        uintptr_t sw = BTREE_WORD_POS(s);
+        btree_word sbits =
+            btree_summary[sw] & (~(btree_word)0 >> BTREE_BIT_POS(s));
+        while (!sbits)
+        {
+            if (++sw * BTREE_NUM_BITS >= btree_nwords)
+                return end;
+            sbits = btree_summary[sw];
+        }
+        w = sw * BTREE_NUM_BITS + __builtin_clzl(sbits);
+        bits = btree[w];
+        KASSERT(bits);
+    }
+
+    uintptr_t idx = w * BTREE_NUM_BITS + __builtin_clzl(bits);
+    return idx < end ? idx : end;
+}
+
 static char *type_strings[] = {"ERROR: type = 0", "Available", "Reserved",
                                "ACPI Reclaimable", "ACPI NVS", "GRUB Bad Ram"};
 static size_t type_count = sizeof(type_strings) / sizeof(type_strings[0]);
@@ -116,11 +277,9 @@ inline void *physmap_end()
     return (void *)(PHYS_OFFSET + (max_pages << PAGE_SHIFT));
 }
 
-#undef DEBUG_PHYSICAL_PAGING
-
 static inline void _btree_expensive_sanity_check()
 {
-#ifdef DEBUG_PHYSICAL_PAGING
+#if __ASSERT_LEVEL__ >= ASSERT_LEVEL_PARANOID
     size_t available = 0;
     for (unsigned order = 0; order <= max_order; order++)
     {
@@ -139,28 +298,63 @@ static inline void _btree_expensive_sanity_check()
                 }
                 available += (1 << order);
                 order_count++;
-                KASSERT(BTREE_INDEX_TO_ADDR(idx + 1, order) <= physmap_end());
+                KASSERT(BTREE_INDEX_TO_ADDR(idx + 1, order) <=
+                        ((uintptr_t)max_pages << PAGE_SHIFT));
             }
         }
         if (!checked_first)
         {
             KASSERT(min_available_idx_by_order[order] == max);
         }
+        KASSERT(_btree_find_available(BTREE_ROW_START_INDEX(order), max) ==
+                min_available_idx_by_order[order]);
         KASSERT(count_available_by_order[order] == order_count);
     }
     KASSERT(available == page_freecount);
+    KASSERT(page_zone_freecount[PAGE_ZONE_DMA32] +
+                page_zone_freecount[PAGE_ZONE_NORMAL] ==
+            page_freecount);
+    for (uintptr_t w = 0; w < btree_nwords; w++)
+    {
+        KASSERT(!btree[w] == !BTREE_SUMMARY_IS_SET(w));
+    }
 #endif
 }
 
+/*
+ * Returns where the boot loader's data after the kernel ends: the multiboot
+ * information, which it puts right after the kernel, and any modules (an
+ * initramfs), which it may put there too. It is at least a page past the
+ * kernel, and the page allocator's own metadata goes there.
+ */
+static uintptr_t page_boot_end()
+{
+    /* the information begins with its total size */
+    uintptr_t end = (uintptr_t)mb_tag + *(uint32_t *)mb_tag;
+    end = MAX(end, KERNEL_PHYS_END + PAGE_SIZE);
+    for (struct multiboot_tag *tag = mb_tag + 1;
+         tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
+    {
+        if (tag->type == MULTIBOOT_TAG_TYPE_MODULE)
+        {
+            struct multiboot_tag_module *mod =
+                (struct multiboot_tag_module *)tag;
+            end = MAX(end, (uintptr_t)mod->mod_end);
+        }
+    }
+    return (uintptr_t)PAGE_ALIGN_UP(end);
+}
+
 void page_init()
 {
     uintptr_t ram = 0;
     uintptr_t memory_available_for_use = 0;
 
     // detect amount of RAM and memory available for use immediately after
-    // kernel before any reserved region
+    // kernel and the boot loader's data before any reserved region
 
-    KASSERT(PAGE_ALIGNED(mb_tag) && (uintptr_t)mb_tag == KERNEL_PHYS_END);
+    KASSERT(PAGE_ALIGNED(mb_tag) && (uintptr_t)mb_tag >= KERNEL_PHYS_END);
+    uintptr_t boot_end = page_boot_end();
 
     for (struct multiboot_tag *tag = mb_tag + 1;
          tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
@@ -186,10 +380,10 @@ void page_init()
             }
 
             if (entry->addr < KERNEL_PHYS_END &&
-                entry->addr + entry->len > KERNEL_PHYS_END)
+                entry->addr + entry->len > boot_end)
             {
                 memory_available_for_use =
-                    entry->addr + entry->len - KERNEL_PHYS_END;
+                    entry->addr + entry->len - boot_end;
             }
 
             if (entry->addr + entry->len > ram)
@@ -215,13 +409,18 @@ void page_init()
     // that fits (this can obviously be done more intelligently, but this also
     // works)
     size_t btree_size;
+    size_t summary_size;
     size_t metadata_size;
     while (max_order)
     {
         // we need 2^(max_order+1) pages, and one byte maps 8 pages, so we need
         // 2^(max_order-2) bytes for the binary tree
         btree_size = 1UL << (max_order - 2);
-        metadata_size = sizeof(uintptr_t) * (max_order + 1) +
+        // one summary bit per tree word, rounded up to whole words
+        summary_size = ((btree_size / sizeof(btree_word) + BTREE_NUM_BITS - 1) /
+                        BTREE_NUM_BITS) *
+                       sizeof(btree_word);
+        metadata_size = summary_size + sizeof(uintptr_t) * (max_order + 1) +
                         sizeof(size_t) * (max_order + 1);
 
         if (memory_available_for_use >= btree_size + metadata_size)
@@ -247,26 +446,28 @@ void page_init()
             (void *)(max_pages << PAGE_SHIFT));
     }
 
-    btree = (btree_word
-                 *)(KERNEL_PHYS_END +
-                    PAGE_SIZE); // 1 page padding for the multiboot information
+    btree = (btree_word *)boot_end;
     memset(btree, 0, btree_size);
+    btree_nwords = btree_size / sizeof(btree_word);
 
-    min_available_idx_by_order = (uintptr_t *)((uintptr_t)btree + btree_size);
+    btree_summary = (btree_word *)((uintptr_t)btree + btree_size);
+    memset(btree_summary, 0, summary_size);
+
+    min_available_idx_by_order =
+        (uintptr_t *)((uintptr_t)btree_summary + summary_size);
     for (unsigned order = 0; order <= max_order; order++)
     {
         min_available_idx_by_order[order] = BTREE_ROW_END_INDEX(order);
     }
 
     count_available_by_order =
-        min_available_idx_by_order + sizeof(uintptr_t) * (max_order + 1);
+        (size_t *)(min_available_idx_by_order + (max_order + 1));
     memset(count_available_by_order, 0, sizeof(size_t) * (max_order + 1));
 
     page_freecount = 0;
 
     uintptr_t reserved_ram_start = KERNEL_PHYS_BASE;
-    uintptr_t reserved_ram_end =
-        KERNEL_PHYS_END + PAGE_SIZE + btree_size + metadata_size;
+    uintptr_t reserved_ram_end = boot_end + btree_size + metadata_size;
 
     for (struct multiboot_tag *tag = mb_tag + 1;
          tag->type != MULTIBOOT_TAG_TYPE_END; tag += TAG_SIZE(tag->size))
@@ -306,11 +507,11 @@ void page_init()
                 continue;
             }
 
-            page_add_range((void *)addr, (void *)(addr + len));
+            _page_add_range((void *)addr, (void *)(addr + len));
         }
     }
 
-    page_mark_reserved(0); // don't allocate the first page of memory
+    _page_mark_reserved(0); // don't allocate the first page of memory
 
     size_t bytes = page_freecount << PAGE_SHIFT;
     size_t gigabytes = (bytes >> 30);
@@ -321,6 +522,9 @@ void page_init()
     bytes -= (kilobytes << 10);
     KASSERT(bytes == 0);
 
+    page_low_watermark = MAX(page_freecount / 64, 2 * PAGE_PCP_HIGH);
+    page_high_watermark = 2 * page_low_watermark;
+
     dbg(DBG_PAGEALLOC,
         "Amount of physical memory available for use: %lu GB, %lu MB, and %lu "
         "KB; [0x%p, 0x%p)\n",
@@ -331,6 +535,7 @@ void page_init()
 void page_init_finish()
 {
     btree = (btree_word *)((uintptr_t)btree + PHYS_OFFSET);
+    btree_summary = (btree_word *)((uintptr_t)btree_summary + PHYS_OFFSET);
     min_available_idx_by_order =
         (uintptr_t *)((uintptr_t)min_available_idx_by_order + PHYS_OFFSET);
     count_available_by_order =
@@ -339,53 +544,14 @@ void page_init_finish()
 
 static void _btree_update_metadata_after_removal(size_t order, size_t idx)
 {
-    // [+] TODO Intel-specific optimizations, see BSF, BSR, REPE CMPS/SCAS
     if (count_available_by_order[order])
     {
+        // idx was the first available node of this row and has just been
+        // marked unavailable, so the new first one lies after it
         if (idx == min_available_idx_by_order[order])
         {
-            uintptr_t word_idx = BTREE_WORD_POS(idx);
-            if (btree[word_idx] &&
-                word_idx == BTREE_WORD_POS(BTREE_ROW_START_INDEX(order)))
-            {
-                // mask off bits to the left of BTREE_BIT_POS(idx); i.e.
-                // consider only positions > than BTREE_BIT_POS(idx) in
-                // btree[word_idx] when idx is the old index of the first
-                // available node for the given order. This is to avoid setting
-                // min available for an order x to be an index that actually
-                // belongs to order (x + 1) (in the row above).
-                btree_word copy =
-                    btree[word_idx] &
-                    ((1UL << (BTREE_NUM_BITS - BTREE_BIT_POS(idx))) - 1);
-                unsigned bit_idx = BTREE_NUM_BITS;
-                while (copy != 0 && bit_idx > BTREE_BIT_POS(idx))
-                {
-                    bit_idx--;
-                    copy = copy >> 1;
-                }
-                if (BTREE_IS_AVAILABLE(word_idx * BTREE_NUM_BITS + bit_idx))
-                {
-                    min_available_idx_by_order[order] =
-                        word_idx * BTREE_NUM_BITS + bit_idx;
-                    return;
-                }
-                word_idx++;
-            }
-            while (!btree[word_idx])
-                word_idx++;
-            btree_word copy = btree[word_idx];
-            unsigned bit_idx = BTREE_NUM_BITS;
-            while (copy != 0)
-            {
-                bit_idx--;
-                copy = copy >> 1;
-            }
-            uintptr_t min_available = word_idx * BTREE_NUM_BITS + bit_idx;
-            if (min_available > BTREE_ROW_END_INDEX(order))
-            {
-                min_available = BTREE_ROW_END_INDEX(order);
-            }
-            min_available_idx_by_order[order] = min_available;
+            min_available_idx_by_order[order] =
+                _btree_find_available(idx + 1, BTREE_ROW_END_INDEX(order));
         }
     }
     else
@@ -451,7 +617,30 @@ static void _btree_mark_range_available(uintptr_t leaf_idx, size_t npages)
     }
 }
 
-void page_add_range(void *start, void *end)
+/*
+ * Moves npages pages starting at paddr into (taken == 0) or out of
+ * (taken == 1) the per-zone free counts.
+ */
+static void _page_zone_account(uintptr_t paddr, size_t npages, long taken)
+{
+    uintptr_t end = paddr + (npages << PAGE_SHIFT);
+    size_t low = 0;
+    if (paddr < PAGE_DMA32_LIMIT)
+        low = (MIN(end, PAGE_DMA32_LIMIT) - paddr) >> PAGE_SHIFT;
+
+    if (taken)
+    {
+        page_zone_freecount[PAGE_ZONE_DMA32] -= low;
+        page_zone_freecount[PAGE_ZONE_NORMAL] -= npages - low;
+    }
+    else
+    {
+        page_zone_freecount[PAGE_ZONE_DMA32] += low;
+        page_zone_freecount[PAGE_ZONE_NORMAL] += npages - low;
+    }
+}
+
+static void _page_add_range(void *start, void *end)
 {
     dbg(DBG_MM, "Page system adding range [0x%p, 0x%p)\n", start, end);
     KASSERT(end > start);
@@ -468,17 +657,10 @@ void page_add_range(void *start, void *end)
     size_t npages = ((uintptr_t)end - (uintptr_t)start) >> PAGE_SHIFT;
     _btree_mark_range_available(BTREE_ADDR_TO_LEAF_INDEX(start), npages);
     page_freecount += npages;
+    _page_zone_account((uintptr_t)start, npages, 0);
     _btree_expensive_sanity_check();
 }
 
-void *page_alloc() { return page_alloc_n(1); }
-
-void *page_alloc_bounded(void *max_paddr)
-{
-    return page_alloc_n_bounded(1, max_paddr);
-}
-
-void page_free(void *addr) { page_free_n(addr, 1); }
 
 static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
                           size_t actual_order)
@@ -536,6 +718,7 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
     page_freecount -= npages;
 
     uintptr_t addr = BTREE_LEAF_INDEX_TO_ADDR(allocated_idx);
+    _page_zone_account(addr, npages, 1);
     dbgq(DBG_MM, "page_alloc_n(%lu): [0x%p, 0x%p)\t\t%lu pages remain\n",
          npages, (void *)(PHYS_OFFSET + addr),
          (void *)(PHYS_OFFSET + addr + (npages << PAGE_SHIFT)), page_freecount);
@@ -543,27 +726,24 @@ static void *_btree_alloc(size_t npages, uintptr_t idx, size_t smallest_order,
     return (void *)(addr + PHYS_OFFSET);
 }
 
-void *page_alloc_n(size_t npages)
-{
-    return page_alloc_n_bounded(npages, (void *)~0UL);
-}
-
-// this is really only used for setting up initial page tables
+// allocates the lowest suitable block lying within [min_paddr, max_paddr]
 // this memory will be immediately overriden, so no need to poison the memory
-void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+static void *_page_alloc_n_range(size_t npages, uintptr_t min_paddr,
+                                 uintptr_t max_paddr)
 {
     KASSERT(npages > 0 && npages <= (1UL << max_order));
-    if (npages > page_freecount)
+    if (npages > page_freecount || (max_paddr >> PAGE_SHIFT) + 1 < npages)
     {
         return 0;
     }
+    uintptr_t min_page_number =
+        (uintptr_t)PAGE_ALIGN_UP(min_paddr) >> PAGE_SHIFT;
     // a note on max_pages: so long as we never mark a page that is beyond our
     // RAM as available, we will never allocate it. So put all those checks at
     // the free and map functions
 
     // find the smallest order that will fit npages
-    uintptr_t max_page_number =
-        ((uintptr_t)max_paddr >> PAGE_SHIFT) - npages + 1;
+    uintptr_t max_page_number = (max_paddr >> PAGE_SHIFT) - npages + 1;
 
     // [+] TODO intel-specific optimization possible here?
     size_t smallest_order = 0;
@@ -580,6 +760,22 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
         uintptr_t idx = min_available_idx_by_order[actual_order];
         KASSERT(idx >= BTREE_ROW_START_INDEX(actual_order) &&
                 idx < BTREE_ROW_END_INDEX(actual_order));
+        if (min_page_number)
+        {
+            // first block of this order starting at or above min_paddr
+            uintptr_t first =
+                BTREE_ROW_START_INDEX(actual_order) +
+                ((min_page_number + (1UL << actual_order) - 1) >> actual_order);
+            if (idx < first)
+            {
+                idx = _btree_find_available(first,
+                                            BTREE_ROW_END_INDEX(actual_order));
+                if (idx == BTREE_ROW_END_INDEX(actual_order))
+                {
+                    continue;
+                }
+            }
+        }
         if ((idx - BTREE_ROW_START_INDEX(actual_order)) * (1 << actual_order) <
             max_page_number)
         {
@@ -596,21 +792,83 @@ void *page_alloc_n_bounded(size_t npages, void *max_paddr)
     return 0;
 }
 
-void page_free_n(void *addr, size_t npages)
+/*
+ * Returns the node of the current core, or -1 if nodes are unknown.
+ */
+static long _page_local_node()
+{
+    if (!page_node_nranges || !page_pcp_online)
+        return -1;
+    return page_apic_node[apic_current_id()];
+}
+
+/*
+ * Allocates npages for ordinary use: normal memory before DMA32, and within
+ * each, memory on the current core's node before that of other nodes.
+ */
+static void *_page_alloc_n_preferred(size_t npages)
+{
+    long node = _page_local_node();
+    for (long zone = PAGE_ZONE_NORMAL; zone >= PAGE_ZONE_DMA32; zone--)
+    {
+        // the DMA32 pass doubles as the fallback, so it is not bounded above
+        uintptr_t lo = zone == PAGE_ZONE_NORMAL ? PAGE_DMA32_LIMIT : 0;
+        if (zone == PAGE_ZONE_NORMAL && page_zone_freecount[zone] < npages)
+        {
+            continue;
+        }
+
+        void *ret;
+        for (size_t i = 0; node >= 0 && i < page_node_nranges; i++)
+        {
+            page_node_range_t *range = &page_node_ranges[i];
+            if (range->pn_node != node || range->pn_end <= lo)
+            {
+                continue;
+            }
+            ret = _page_alloc_n_range(npages, MAX(range->pn_start, lo),
+                                      range->pn_end - 1);
+            if (ret)
+            {
+                return ret;
+            }
+        }
+        if ((ret = _page_alloc_n_range(npages, lo, ~0UL)))
+        {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Unbounded requests (max_paddr of ~0) follow the zone and node preferences;
+ * bounded ones take the lowest memory that fits.
+ */
+static void *_page_alloc_n(size_t npages, void *max_paddr)
+{
+    if ((uintptr_t)max_paddr == ~0UL)
+    {
+        return _page_alloc_n_preferred(npages);
+    }
+    return _page_alloc_n_range(npages, 0, (uintptr_t)max_paddr);
+}
+
+static void _page_free_n(void *addr, size_t npages)
 {
     dbgq(DBG_MM, "page_free_n(%lu): [0x%p, 0x%p)\t\t%lu pages remain\n", npages,
          addr, (void *)((uintptr_t)addr + (npages << PAGE_SHIFT)),
          page_freecount);
-    GDB_CALL_HOOK(page_free, addr, npages);
     KASSERT(npages > 0 && npages <= (1UL << max_order) && PAGE_ALIGNED(addr));
     uintptr_t idx = BTREE_ADDR_TO_LEAF_INDEX((uintptr_t)addr - PHYS_OFFSET);
     KASSERT(idx + npages - BTREE_LEAF_START_INDEX <= max_pages);
     _btree_mark_range_available(idx, npages);
     page_freecount += npages;
+    _page_zone_account((uintptr_t)addr - PHYS_OFFSET, npages, 0);
     _btree_expensive_sanity_check();
 }
 
-void page_mark_reserved(void *paddr)
+static void _page_mark_reserved(void *paddr)
 {
     if ((uintptr_t)paddr > (max_pages << PAGE_SHIFT))
         return;
@@ -651,8 +909,471 @@ void page_mark_reserved(void *paddr)
         still_available_leaf_idx_end - unavailable_leaf_idx - 1);
 
     page_freecount--;
+    _page_zone_account((uintptr_t)paddr, 1, 1);
 
     _btree_expensive_sanity_check();
 }
 
-size_t page_free_count() { return page_freecount; }
+/* The number of free pages in the subtree at idx, of the given order. */
+static size_t _btree_subtree_free(uintptr_t idx, size_t order)
+{
+    if (BTREE_IS_AVAILABLE(idx))
+        return 1UL << order;
+    if (!order)
+        return 0;
+    return _btree_subtree_free(BTREE_LEFT_CHILD(idx), order - 1) +
+           _btree_subtree_free(BTREE_RIGHT_CHILD(idx), order - 1);
+}
+
+static long page_lock_tree()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&page_lock);
+    return enabled;
+}
+
+static void page_unlock_tree(long enabled)
+{
+    spinlock_unlock(&page_lock);
+    if (enabled)
+        intr_enable();
+}
+
+void page_add_range(void *start, void *end)
+{
+    long enabled = page_lock_tree();
+    _page_add_range(start, end);
+    page_unlock_tree(enabled);
+}
+
+void page_mark_reserved(void *paddr)
+{
+    long enabled = page_lock_tree();
+    _page_mark_reserved(paddr);
+    page_unlock_tree(enabled);
+}
+
+/*
+ * Returns the current core's page cache. Interrupts must be disabled.
+ */
+static page_pcp_t *page_pcp_local()
+{
+    page_pcp_t *pcp = &page_pcp[apic_current_id()];
+    if (!pcp->pc_pages.l_next)
+        list_init(&pcp->pc_pages);
+    return pcp;
+}
+
+/*
+ * Moves up to PAGE_PCP_BATCH pages from the buddy tree to the tail of pcp.
+ */
+static void page_pcp_refill(page_pcp_t *pcp)
+{
+    spinlock_lock(&page_lock);
+    size_t n;
+    for (n = 0; n < PAGE_PCP_BATCH; n++)
+    {
+        list_link_t *link = _page_alloc_n_preferred(1);
+        if (!link)
+            break;
+        list_link_init(link);
+        list_insert_tail(&pcp->pc_pages, link);
+    }
+    spinlock_unlock(&page_lock);
+    pcp->pc_count += n;
+    __sync_fetch_and_add(&page_pcp_count, n);
+}
+
+/*
+ * Returns up to count of the coldest pages of pcp to the buddy tree.
+ */
+static void page_pcp_drain(page_pcp_t *pcp, size_t count)
+{
+    count = MIN(count, pcp->pc_count);
+    spinlock_lock(&page_lock);
+    for (size_t n = 0; n < count; n++)
+    {
+        list_link_t *link = pcp->pc_pages.l_prev;
+        list_remove(link);
+        _page_free_n(link, 1);
+    }
+    spinlock_unlock(&page_lock);
+    pcp->pc_count -= count;
+    __sync_fetch_and_sub(&page_pcp_count, count);
+}
+
+void page_pcp_init() { page_pcp_online = 1; }
+
+/*
+ * Asks for a reclaim if free memory has fallen below the low watermark.
+ */
+static inline void page_check_watermark()
+{
+    if (page_freecount + page_pcp_count < page_low_watermark)
+        page_reclaim_wanted = 1;
+}
+
+void *page_alloc()
+{
+    if (!page_pcp_online)
+        return page_alloc_n(1);
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    page_pcp_t *pcp = page_pcp_local();
+    if (!pcp->pc_count)
+        page_pcp_refill(pcp);
+
+    void *page = NULL;
+    if (pcp->pc_count)
+    {
+        list_link_t *link = pcp->pc_pages.l_next;
+        list_remove(link);
+        pcp->pc_count--;
+        __sync_fetch_and_sub(&page_pcp_count, 1);
+        page = link;
+    }
+    if (enabled)
+        intr_enable();
+    page_check_watermark();
+    return page;
+}
+
+/* Cached pages may lie anywhere, so bounded requests go to the tree. */
+void *page_alloc_bounded(void *max_paddr)
+{
+    return page_alloc_n_bounded(1, max_paddr);
+}
+
+void page_free(void *addr)
+{
+    if (!page_pcp_online)
+    {
+        page_free_n(addr, 1);
+        return;
+    }
+
+    GDB_CALL_HOOK(page_free, addr, 1);
+    KASSERT(PAGE_ALIGNED(addr));
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    page_pcp_t *pcp = page_pcp_local();
+    list_link_t *link = addr;
+    list_link_init(link);
+    list_insert_head(&pcp->pc_pages, link);
+    pcp->pc_count++;
+    __sync_fetch_and_add(&page_pcp_count, 1);
+    if (pcp->pc_count > PAGE_PCP_HIGH)
+        page_pcp_drain(pcp, PAGE_PCP_BATCH);
+    if (enabled)
+        intr_enable();
+}
+
+void *page_alloc_zeroed()
+{
+    void *page = NULL;
+    if (page_zero_count)
+    {
+        long enabled = intr_enabled() != 0;
+        intr_disable();
+        spinlock_lock(&page_zero_lock);
+        if ((page = page_zero_pool))
+        {
+            page_zero_pool = *(void **)page;
+            page_zero_count--;
+            page_zero_hits++;
+        }
+        spinlock_unlock(&page_zero_lock);
+        if (enabled)
+            intr_enable();
+    }
+    if (page)
+    {
+        *(void **)page = NULL;
+        return page;
+    }
+    if ((page = page_alloc()))
+        memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+long page_zero_idle()
+{
+    KASSERT(!intr_enabled());
+    if (!page_pcp_online || page_zero_count >= PAGE_ZERO_POOL_MAX ||
+        page_free_count() < page_high_watermark)
+        return 0;
+    void *page = page_alloc();
+    if (!page)
+        return 0;
+    memset(page, 0, PAGE_SIZE);
+    spinlock_lock(&page_zero_lock);
+    *(void **)page = page_zero_pool;
+    page_zero_pool = page;
+    page_zero_count++;
+    spinlock_unlock(&page_zero_lock);
+    return 1;
+}
+
+/* Gives the pages of the zero pool back, returning how many there were. */
+static size_t _page_zero_drain()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&page_zero_lock);
+    void *pool = page_zero_pool;
+    size_t count = page_zero_count;
+    page_zero_pool = NULL;
+    page_zero_count = 0;
+    spinlock_unlock(&page_zero_lock);
+    if (enabled)
+        intr_enable();
+
+    while (pool)
+    {
+        void *next = *(void **)pool;
+        page_free(pool);
+        pool = next;
+    }
+    return count;
+}
+
+void page_compactor_register(page_compactor_t *compactor)
+{
+    KASSERT(!page_compactor);
+    page_compactor = compactor;
+}
+
+size_t page_block_free(uintptr_t paddr, size_t order)
+{
+    KASSERT(!(ADDR_TO_PN(paddr) & ((1UL << order) - 1)));
+    if (order > max_order || ADDR_TO_PN(paddr) + (1UL << order) > max_pages)
+        return 0;
+
+    long enabled = page_lock_tree();
+    uintptr_t idx = BTREE_ADDR_TO_INDEX(paddr, order);
+    size_t free = _btree_subtree_free(idx, order);
+    // or the block may be part of a larger free one
+    for (uintptr_t up = idx; !free && up; )
+    {
+        up = BTREE_PARENT(up);
+        if (BTREE_IS_AVAILABLE(up))
+            free = 1UL << order;
+    }
+    page_unlock_tree(enabled);
+    return free;
+}
+
+/*
+ * Has the compactor, if there is one and it is not busy, free up a block for
+ * npages, and retries the allocation. Interrupts must be enabled.
+ */
+static void *_page_alloc_n_compact(size_t npages, void *max_paddr)
+{
+    size_t order = 0;
+    while ((1UL << order) < npages)
+        order++;
+    if (order > page_compact_order)
+    {
+        page_compact_order = order;
+        page_reclaim_wanted = 1;
+    }
+    if (!page_compactor || __sync_lock_test_and_set(&page_compacting, 1))
+        return NULL;
+
+    void *ret = NULL;
+    page_ncompact++;
+    if (page_compactor->pc_compact(page_compactor, order,
+                                   (uintptr_t)max_paddr, 0))
+    {
+        page_ncompact_ok++;
+        long enabled = page_lock_tree();
+        ret = _page_alloc_n(npages, max_paddr);
+        page_unlock_tree(enabled);
+    }
+    __sync_lock_release(&page_compacting);
+    return ret;
+}
+
+void *page_alloc_n(size_t npages)
+{
+    return page_alloc_n_bounded(npages, (void *)~0UL);
+}
+
+/*
+ * If the tree alone cannot satisfy the request, the pages cached on this core
+ * are handed back to it (possibly coalescing into larger blocks) and the
+ * allocation is retried once. If that fails too, requests for more than one
+ * page made with interrupts enabled (so from thread context, without
+ * spinlocks held) go on to compaction.
+ */
+void *page_alloc_n_bounded(size_t npages, void *max_paddr)
+{
+    long enabled = page_lock_tree();
+    void *ret = _page_alloc_n(npages, max_paddr);
+    spinlock_unlock(&page_lock);
+
+    if (!ret && page_pcp_online)
+    {
+        page_pcp_t *pcp = page_pcp_local();
+        if (pcp->pc_count)
+        {
+            page_pcp_drain(pcp, pcp->pc_count);
+            spinlock_lock(&page_lock);
+            ret = _page_alloc_n(npages, max_paddr);
+            spinlock_unlock(&page_lock);
+        }
+    }
+    if (enabled)
+        intr_enable();
+    if (!ret && npages > 1 && enabled)
+        ret = _page_alloc_n_compact(npages, max_paddr);
+    page_check_watermark();
+    return ret;
+}
+
+void page_free_n(void *addr, size_t npages)
+{
+    GDB_CALL_HOOK(page_free, addr, npages);
+    long enabled = page_lock_tree();
+    _page_free_n(addr, npages);
+    page_unlock_tree(enabled);
+}
+
+/* Pages held in the per-core caches count as free. */
+size_t page_free_count() { return page_freecount + page_pcp_count; }
+
+void page_shrinker_register(page_shrinker_t *shrinker)
+{
+    list_link_init(&shrinker->ps_link);
+    spinlock_lock(&page_shrinker_lock);
+    list_insert_tail(&page_shrinkers, &shrinker->ps_link);
+    spinlock_unlock(&page_shrinker_lock);
+}
+
+void page_shrinker_unregister(page_shrinker_t *shrinker)
+{
+    kmutex_lock(&page_reclaim_mutex);
+    spinlock_lock(&page_shrinker_lock);
+    list_remove(&shrinker->ps_link);
+    spinlock_unlock(&page_shrinker_lock);
+    kmutex_unlock(&page_reclaim_mutex);
+}
+
+void page_reclaim_point()
+{
+    if (!page_reclaim_wanted || !kmutex_trylock(&page_reclaim_mutex))
+        return;
+
+    page_shrinker_t *shrinkers[PAGE_MAX_SHRINKERS];
+    size_t n = 0;
+    spinlock_lock(&page_shrinker_lock);
+    list_iterate(&page_shrinkers, shrinker, page_shrinker_t, ps_link)
+    {
+        if (n < PAGE_MAX_SHRINKERS)
+            shrinkers[n++] = shrinker;
+    }
+    spinlock_unlock(&page_shrinker_lock);
+
+    page_reclaim_wanted = 0;
+    size_t freed = _page_zero_drain();
+    long progress = 1;
+    while (progress && page_free_count() < page_high_watermark)
+    {
+        progress = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t free = page_free_count();
+            if (free >= page_high_watermark)
+                break;
+            size_t got =
+                shrinkers[i]->ps_shrink(shrinkers[i], page_high_watermark - free);
+            freed += got;
+            progress |= got != 0;
+        }
+    }
+    dbg(DBG_PAGEALLOC, "reclaimed %lu pages, %lu free\n", freed,
+        page_free_count());
+
+    size_t order = page_compact_order;
+    page_compact_order = 0;
+    if (order && page_compactor &&
+        !__sync_lock_test_and_set(&page_compacting, 1))
+    {
+        page_ncompact++;
+        if (page_compactor->pc_compact(page_compactor, order, ~0UL, 1))
+            page_ncompact_ok++;
+        __sync_lock_release(&page_compacting);
+    }
+    kmutex_unlock(&page_reclaim_mutex);
+}
+
+size_t page_zone_free_count(page_zone_t zone)
+{
+    KASSERT(zone >= 0 && zone < PAGE_NZONES);
+    return page_zone_freecount[zone];
+}
+
+size_t page_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    size_t nblocks[sizeof(uintptr_t) * 8];
+    size_t zone_free[PAGE_NZONES];
+
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    long enabled = page_lock_tree();
+    size_t norders = MIN(max_order + 1, sizeof(nblocks) / sizeof(nblocks[0]));
+    memcpy(nblocks, count_available_by_order, norders * sizeof(size_t));
+    memcpy(zone_free, page_zone_freecount, sizeof(zone_free));
+    size_t tree_free = page_freecount;
+    size_t cached = page_pcp_count;
+    page_unlock_tree(enabled);
+    size_t zeroed = page_zero_count;
+
+    iprintf(&buf, &size, "free pages:     %10lu\n", tree_free + cached);
+    iprintf(&buf, &size, "  in the tree:  %10lu\n", tree_free);
+    iprintf(&buf, &size, "  core caches:  %10lu\n", cached);
+    iprintf(&buf, &size, "  DMA32 zone:   %10lu\n", zone_free[PAGE_ZONE_DMA32]);
+    iprintf(&buf, &size, "  normal zone:  %10lu\n",
+            zone_free[PAGE_ZONE_NORMAL]);
+    iprintf(&buf, &size, "zeroed pool:    %10lu %10lu\n", zeroed,
+            page_zero_hits);
+    iprintf(&buf, &size, "watermarks:     %10lu %10lu\n", page_low_watermark,
+            page_high_watermark);
+    iprintf(&buf, &size, "compactions:    %10lu %10lu\n", page_ncompact,
+            page_ncompact_ok);
+    iprintf(&buf, &size, "\n%5s %10s %10s\n", "ORDER", "KB", "FREE");
+    for (size_t order = 0; order < norders; order++)
+    {
+        iprintf(&buf, &size, "%5lu %10lu %10lu\n", order,
+                (PAGE_SIZE << order) >> 10, nblocks[order]);
+    }
+    return size;
+}
+
+void page_numa_init()
+{
+    acpi_mem_affinity_t ranges[PAGE_MAX_NODE_RANGES];
+    size_t n = acpi_srat_memory(ranges, PAGE_MAX_NODE_RANGES);
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        page_apic_node[id] = acpi_srat_apic_node((uint8_t)id);
+    }
+
+    long enabled = page_lock_tree();
+    for (size_t i = 0; i < n; i++)
+    {
+        page_node_ranges[i].pn_start = ranges[i].ama_base;
+        page_node_ranges[i].pn_end = ranges[i].ama_base + ranges[i].ama_len;
+        page_node_ranges[i].pn_node = ranges[i].ama_node;
+    }
+    page_node_nranges = n;
+    page_unlock_tree(enabled);
+
+    dbg(DBG_PAGEALLOC, "%lu SRAT memory ranges; free pages: %lu DMA32, %lu "
+        "normal\n", n, page_zone_freecount[PAGE_ZONE_DMA32],
+        page_zone_freecount[PAGE_ZONE_NORMAL]);
+}
@@ -6,6 +6,13 @@
 #include "mm/mm.h"
 #include "mm/pframe.h"
 #include "mm/mobj.h"
+#include "mm/vmalloc.h"
+
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "proc/spinlock.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -22,10 +29,170 @@ typedef enum
 
 static pml4_t *global_kernel_only_pml4;
 
+/*
+ * Process-context identifiers. With CR4.PCIDE set the TLB tags its entries
+ * with the PCID in the low bits of CR3, so loading CR3 need not throw away
+ * the entries of every other address space. Each core hands its PCID_SLOTS
+ * ids out to the page tables it ran most recently, taking back the least
+ * recently used one when it runs out: switching to a page table that still
+ * holds an id keeps its entries (CR3_NOFLUSH), while one that is given an id
+ * flushes whatever that id's last holder left behind. The kernel's own
+ * mappings are global (PT_GLOBAL, CR4.PGE), so they survive every switch.
+ * PCID 0 is never handed out.
+ */
+#define CR4_PGE 0x80
+#define CR4_PCIDE 0x20000
+#define CR3_NOFLUSH (1UL << 63)
+#define CR3_PCID_MASK 0xfffUL
+
+#define PCID_SLOTS 16
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+
+static long pcid_invpcid;
+static pml4_t *pcid_owner[PCID_SLOTS] CORE_SPECIFIC_DATA;
+static uint64_t pcid_used[PCID_SLOTS] CORE_SPECIFIC_DATA;
+static uint64_t pcid_clock CORE_SPECIFIC_DATA;
+
+static inline uintptr_t _read_cr4()
+{
+    uintptr_t cr4;
+    __asm__ volatile("movq %%cr4, %0"
+                     : "=r"(cr4));
+    return cr4;
+}
+
+static inline void _invpcid(uintptr_t type, uintptr_t pcid, uintptr_t vaddr)
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t vaddr;
+    } desc = {pcid, vaddr};
+    __asm__ volatile("invpcid %0, %1" ::"m"(desc), "r"(type)
+                     : "memory");
+}
+
+/*
+ * Returns the PCID bits to load into CR3 along with pml4, giving it one of
+ * this core's ids if it does not hold one.
+ */
+static uintptr_t _pcid_assign(pml4_t *pml4)
+{
+    size_t victim = 0;
+    for (size_t i = 0; i < PCID_SLOTS; i++)
+    {
+        if (CSD(pcid_owner)[i] == pml4)
+        {
+            CSD(pcid_used)[i] = ++CSD(pcid_clock);
+            return (i + 1) | CR3_NOFLUSH;
+        }
+        if (CSD(pcid_used)[i] < CSD(pcid_used)[victim])
+        {
+            victim = i;
+        }
+    }
+    CSD(pcid_owner)[victim] = pml4;
+    CSD(pcid_used)[victim] = ++CSD(pcid_clock);
+    return victim + 1;
+}
+
+/*
+ * Takes pml4's ids back on every core, before its pages can be reused for
+ * another page table that would otherwise inherit its TLB entries.
+ */
+static void _pcid_release(pml4_t *pml4)
+{
+    if (!(_read_cr4() & CR4_PCIDE))
+    {
+        return;
+    }
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (!csd_vaddr_table[id])
+        {
+            continue;
+        }
+        pml4_t **owner = GET_CSD(id, pml4_t *, pcid_owner);
+        for (size_t i = 0; i < PCID_SLOTS; i++)
+        {
+            __sync_bool_compare_and_swap(&owner[i], pml4, NULL);
+        }
+    }
+}
+
+void pt_pcid_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_GETFEATURES, &eax, &ebx, &ecx, &edx);
+    uintptr_t cr4 = _read_cr4();
+    if (edx & CPUID_FEAT_EDX_PGE)
+    {
+        cr4 |= CR4_PGE;
+    }
+    uintptr_t cr3;
+    __asm__ volatile("movq %%cr3, %0"
+                     : "=r"(cr3));
+    // PCIDE can only be turned on while running with PCID 0
+    if ((ecx & CPUID_FEAT_ECX_PCID) && !(cr3 & CR3_PCID_MASK))
+    {
+        cr4 |= CR4_PCIDE;
+        cpuid(CPUID_GETVENDORSTRING, &eax, &ebx, &ecx, &edx);
+        if (eax >= CPUID_GETEXTFEATURES)
+        {
+            cpuid_subleaf(CPUID_GETEXTFEATURES, 0, &eax, &ebx, &ecx, &edx);
+            pcid_invpcid = (ebx & CPUID_EXTFEAT_EBX_INVPCID) != 0;
+        }
+    }
+    __asm__ volatile("movq %0, %%cr4" ::"r"(cr4)
+                     : "memory");
+    dbg(DBG_MM, "global pages %s, PCID %s%s\n",
+        (cr4 & CR4_PGE) ? "on" : "off", (cr4 & CR4_PCIDE) ? "on" : "off",
+        pcid_invpcid ? " with INVPCID" : "");
+}
+
+void pt_pcid_flush(pml4_t *pml4, uintptr_t vaddr, size_t count)
+{
+    if (!(_read_cr4() & CR4_PCIDE))
+    {
+        return;
+    }
+    for (size_t i = 0; i < PCID_SLOTS; i++)
+    {
+        if (CSD(pcid_owner)[i] != pml4)
+        {
+            continue;
+        }
+        if (!pcid_invpcid)
+        {
+            // Flushed when the id is next handed out
+            CSD(pcid_owner)[i] = NULL;
+            CSD(pcid_used)[i] = 0;
+        }
+        else if (!count)
+        {
+            _invpcid(INVPCID_CONTEXT, i + 1, 0);
+        }
+        else
+        {
+            for (size_t j = 0; j < count; j++, vaddr += PAGE_SIZE)
+            {
+                _invpcid(INVPCID_ADDRESS, i + 1, vaddr);
+            }
+        }
+        return;
+    }
+}
+
 void pt_set(pml4_t *pml4)
 {
     KASSERT((void *)pml4 >= physmap_start());
     uintptr_t phys_addr = pt_virt_to_phys((uintptr_t)pml4);
+    if (_read_cr4() & CR4_PCIDE)
+    {
+        phys_addr |= _pcid_assign(pml4);
+    }
     __asm__ volatile("movq %0, %%cr3" ::"r"(phys_addr)
                      : "memory");
 }
@@ -41,7 +208,7 @@ inline pml4_t *pt_get()
     uintptr_t pml4;
     __asm__ volatile("movq %%cr3, %0"
                      : "=r"(pml4));
-    return (pml4_t *)(pml4 + PHYS_OFFSET);
+    return (pml4_t *)((pml4 & ~CR3_PCID_MASK) + PHYS_OFFSET);
 }
 
 vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
@@ -89,6 +256,14 @@ vaddr_map_status _vaddr_status(pml4_t *pml4, uintptr_t vaddr)
     return PAGE_4KB;
 }
 
+/*
+ * Whether anything is mapped at vaddr in pml4.
+ */
+long pt_is_mapped(pml4_t *pml4, uintptr_t vaddr)
+{
+    return _vaddr_status(pml4, vaddr) != UNMAPPED;
+}
+
 uintptr_t pt_virt_to_phys_helper(pml4_t *table, uintptr_t vaddr)
 {
     if (vaddr >= (uintptr_t)physmap_start() &&
@@ -148,7 +323,8 @@ void _fill_pt(pt_t *pt, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax)
     for (uintptr_t idx = PTE(vaddr); idx < PT_ENTRY_COUNT && vaddr < vmax;
          idx++, paddr += PAGE_SIZE, vaddr += PAGE_SIZE)
     {
-        pt->phys[idx] = (uintptr_t)paddr | PT_PRESENT | PT_WRITE;
+        pt->phys[idx] =
+            (uintptr_t)paddr | PT_PRESENT | PT_WRITE | PT_GLOBAL;
     }
 }
 
@@ -162,7 +338,8 @@ long _fill_pd(pd_t *pd, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
 #if USE_2MB_PAGES
         if (vmax - vaddr >= PT_VADDR_SIZE)
         {
-            pd->phys[idx] = paddr | PT_PRESENT | PT_WRITE | PT_SIZE;
+            pd->phys[idx] =
+                paddr | PT_PRESENT | PT_WRITE | PT_SIZE | PT_GLOBAL;
             continue;
         }
 #endif
@@ -191,7 +368,8 @@ long _fill_pdp(pdp_t *pdp, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
 #if USE_1GB_PAGES
         if (vmax - vaddr >= PD_VADDR_SIZE)
         {
-            pdp->phys[idx] = paddr | PT_PRESENT | PT_WRITE | PT_SIZE;
+            pdp->phys[idx] =
+                paddr | PT_PRESENT | PT_WRITE | PT_SIZE | PT_GLOBAL;
             continue;
         }
 #endif
@@ -238,6 +416,72 @@ long _fill_pml4(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr, uintptr_t vmax,
     return 0;
 }
 
+/*
+ * Pages of paging structures freed by pt_destroy are kept for the next ones
+ * pt_map_range and the clones need, up to PT_TABLE_CACHE_MAX of them, linked
+ * through their first word. They are cleared on the way in, while the
+ * address space is being torn down, so that taking one out only has to clear
+ * the link. Past the cache, tables come zeroed from page_alloc_zeroed. The
+ * boot-time tables below 4GB (see _fill_pml4) are allocated directly.
+ * pt_table_lock protects the cache and is taken with interrupts disabled.
+ */
+#define PT_TABLE_CACHE_MAX 16
+
+static void *pt_table_cache;
+static size_t pt_table_ncached;
+static spinlock_t pt_table_lock = SPINLOCK_INITIALIZER(pt_table_lock);
+
+/* Returns a zeroed page for a paging structure, or NULL. */
+static void *_pt_table_alloc()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pt_table_lock);
+    void *table = pt_table_cache;
+    if (table)
+    {
+        pt_table_cache = *(void **)table;
+        pt_table_ncached--;
+    }
+    spinlock_unlock(&pt_table_lock);
+    if (enabled)
+        intr_enable();
+
+    if (!table)
+    {
+        return page_alloc_zeroed();
+    }
+    *(void **)table = NULL;
+    return table;
+}
+
+static void _pt_table_free(void *table)
+{
+    if (pt_table_ncached >= PT_TABLE_CACHE_MAX)
+    {
+        page_free(table);
+        return;
+    }
+    memset(table, 0, PAGE_SIZE);
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pt_table_lock);
+    if (pt_table_ncached < PT_TABLE_CACHE_MAX)
+    {
+        *(void **)table = pt_table_cache;
+        pt_table_cache = table;
+        pt_table_ncached++;
+        table = NULL;
+    }
+    spinlock_unlock(&pt_table_lock);
+    if (enabled)
+        intr_enable();
+    if (table)
+    {
+        page_free(table);
+    }
+}
+
 long pt_map(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr, uint32_t pdflags,
             uint32_t ptflags)
 {
@@ -265,12 +509,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
 
         if (!IS_PRESENT(table->phys[idx]))
         {
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)_pt_table_alloc();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             KASSERT(pt_virt_to_phys(page) == page - PHYS_OFFSET);
             KASSERT(*(uintptr_t *)page == 0);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
@@ -288,7 +531,8 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         if (!IS_PRESENT(table->phys[idx]))
         {
 #if USE_1GB_PAGES
-            if (PAGE_ALIGNED_1GB(vaddr) && size > PAGE_SIZE_1GB)
+            if (PAGE_ALIGNED_1GB(vaddr) && PAGE_ALIGNED_1GB(paddr) &&
+                size >= PAGE_SIZE_1GB)
             {
                 table->phys[idx] = (uintptr_t)paddr | ptflags | PT_SIZE;
                 paddr += PAGE_SIZE_1GB;
@@ -296,12 +540,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
                 continue;
             }
 #endif
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)_pt_table_alloc();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
         }
         else if (IS_1GB_PAGE(table->phys[idx]))
@@ -339,7 +582,8 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
         if (!IS_PRESENT(table->phys[idx]))
         {
 #if USE_2MB_PAGES
-            if (PAGE_ALIGNED_2MB(vaddr) && size > PAGE_SIZE_2MB)
+            if (PAGE_ALIGNED_2MB(vaddr) && PAGE_ALIGNED_2MB(paddr) &&
+                size >= PAGE_SIZE_2MB)
             {
                 table->phys[idx] = (uintptr_t)paddr | ptflags | PT_SIZE;
                 paddr += PAGE_SIZE_2MB;
@@ -347,12 +591,11 @@ long pt_map_range(pml4_t *pml4, uintptr_t paddr, uintptr_t vaddr,
                 continue;
             }
 #endif
-            uintptr_t page = (uintptr_t)page_alloc();
+            uintptr_t page = (uintptr_t)_pt_table_alloc();
             if (!page)
             {
                 return -ENOMEM;
             }
-            memset((void *)page, 0, PAGE_SIZE);
             table->phys[idx] = (page - PHYS_OFFSET) | pdflags;
         }
         else if (IS_2MB_PAGE(table->phys[idx]))
@@ -462,7 +705,7 @@ void pt_init()
 
 pt_t *clone_pt(pt_t *pt)
 {
-    pt_t *clone = page_alloc();
+    pt_t *clone = _pt_table_alloc();
     dbg(DBG_PRINT, "cloning pt at 0x%p to 0x%p\n", pt, clone);
     if (clone)
     {
@@ -473,14 +716,13 @@ pt_t *clone_pt(pt_t *pt)
 
 pd_t *clone_pd(pd_t *pd)
 {
-    pd_t *clone = page_alloc();
+    // zeroed, in case the clone fails and we need to know what we allocated
+    pd_t *clone = _pt_table_alloc();
     dbg(DBG_PRINT, "cloning pd at 0x%p to 0x%p\n", pd, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
     for (unsigned i = 0; i < PT_ENTRY_COUNT; i++)
     {
         // dbg(DBG_PRINT, "checking pd i = %u\n", i);
@@ -510,14 +752,13 @@ pd_t *clone_pd(pd_t *pd)
 
 pdp_t *clone_pdp(pdp_t *pdp)
 {
-    pdp_t *clone = page_alloc();
+    // zeroed, in case the clone fails and we need to know what we allocated
+    pdp_t *clone = _pt_table_alloc();
     dbg(DBG_PRINT, "cloning pdp at 0x%p to 0x%p\n", pdp, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
     for (unsigned i = 0; i < PT_ENTRY_COUNT; i++)
     {
         // dbg(DBG_PRINT, "checking pdp i = %u\n", i);
@@ -545,21 +786,96 @@ pdp_t *clone_pdp(pdp_t *pdp)
     return clone;
 }
 
+/*
+ * Tell the pframe code about every user page the user half of a freshly
+ * cloned pml4 maps, so the mapcounts include the clone's entries.
+ */
+static void _pt_remapped_user(pml4_t *pml4)
+{
+    for (uintptr_t i = 0; i < PT_ENTRY_COUNT / 2; i++)
+    {
+        if (!IS_PRESENT(pml4->phys[i]))
+        {
+            continue;
+        }
+        pdp_t *pdp = (pdp_t *)((pml4->phys[i] & PAGE_MASK) + PHYS_OFFSET);
+        for (uintptr_t j = 0; j < PT_ENTRY_COUNT; j++)
+        {
+            uint64_t pdpe = pdp->phys[j];
+            if (!IS_PRESENT(pdpe))
+            {
+                continue;
+            }
+            if (IS_1GB_PAGE(pdpe))
+            {
+                if (pdpe & PT_USER)
+                {
+                    for (uint64_t n = 0; n < PAGE_SIZE_1GB / PAGE_SIZE; n++)
+                    {
+                        pframe_remapped((pdpe & PAGE_MASK) + n * PAGE_SIZE);
+                    }
+                }
+                continue;
+            }
+            pd_t *pd = (pd_t *)((pdpe & PAGE_MASK) + PHYS_OFFSET);
+            for (uintptr_t k = 0; k < PT_ENTRY_COUNT; k++)
+            {
+                uint64_t pde = pd->phys[k];
+                if (!IS_PRESENT(pde))
+                {
+                    continue;
+                }
+                if (IS_2MB_PAGE(pde))
+                {
+                    if (pde & PT_USER)
+                    {
+                        for (uint64_t n = 0; n < PT_ENTRY_COUNT; n++)
+                        {
+                            pframe_remapped((pde & PAGE_MASK) + n * PAGE_SIZE);
+                        }
+                    }
+                    continue;
+                }
+                pt_t *pt = (pt_t *)((pde & PAGE_MASK) + PHYS_OFFSET);
+                for (uintptr_t l = 0; l < PT_ENTRY_COUNT; l++)
+                {
+                    if (IS_PRESENT(pt->phys[l]) && (pt->phys[l] & PT_USER))
+                    {
+                        pframe_remapped(pt->phys[l] & PAGE_MASK);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+ * The kernel half is the same in every page table: the tables below its
+ * slots (the kernel image, the physmap, vmalloc) are shared by all page
+ * tables rather than copied, and are never freed. Core-specific data needs
+ * no mapping of its own, as each core reaches its copy in the physmap
+ * through the GS base (see main/smp.h).
+ */
+static long _pml4e_shared(uintptr_t idx) { return idx >= PT_ENTRY_COUNT / 2; }
+
 pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
 {
-    pml4_t *clone = page_alloc();
+    // zeroed, in case the clone fails and we need to know what we allocated
+    pml4_t *clone = _pt_table_alloc();
     dbg(DBG_PRINT, "cloning pml4 at 0x%p to 0x%p\n", pml4, clone);
     if (!clone)
     {
         return NULL;
     }
-    memset(clone, 0, PAGE_SIZE); // in case the clone fails, need to know what
-                                 // we have allocated
     for (uintptr_t i = include_user_mappings ? 0 : PT_ENTRY_COUNT / 2;
          i < PT_ENTRY_COUNT; i++)
     {
         // dbg(DBG_PRINT, "checking pml4 i = %u\n", i);
-        if (pml4->phys[i])
+        if (_pml4e_shared(i))
+        {
+            clone->phys[i] = pml4->phys[i];
+        }
+        else if (pml4->phys[i])
         {
             pdp_t *cloned_pdp =
                 clone_pdp((pdp_t *)((pml4->phys[i] & PAGE_MASK) + PHYS_OFFSET));
@@ -576,6 +892,10 @@ pml4_t *clone_pml4(pml4_t *pml4, long include_user_mappings)
             clone->phys[i] = 0;
         }
     }
+    if (include_user_mappings)
+    {
+        _pt_remapped_user(clone);
+    }
     return clone;
 }
 
@@ -592,22 +912,49 @@ void pt_destroy_helper(pt_t *pt, long depth)
             {
                 continue;
             }
+            if (depth == 4 && _pml4e_shared(i))
+            {
+                // shared by all page tables, see clone_pml4
+                pt->phys[i] = 0;
+                continue;
+            }
             KASSERT(IS_PRESENT(pt->phys[i]) && (pt->phys[i] & PAGE_MASK));
             pt_destroy_helper((pt_t *)((pt->phys[i] & PAGE_MASK) + PHYS_OFFSET),
                               depth - 1);
             pt->phys[i] = 0;
         }
     }
-    page_free(pt);
+    _pt_table_free(pt);
 }
 
-void pt_destroy(pml4_t *pml4) { pt_destroy_helper(pml4, 4); }
+void pt_destroy(pml4_t *pml4)
+{
+    _pcid_release(pml4);
+    pt_destroy_helper(pml4, 4);
+}
 
 void pt_unmap(pml4_t *pml4, uintptr_t vaddr)
 {
     pt_unmap_range(pml4, vaddr, vaddr + PAGE_SIZE);
 }
 
+/*
+ * Tell the pframe code that pages [first, end) of what the leaf entry
+ * maps are no longer mapped, if it is a user mapping (see pframe_map).
+ */
+static void _pt_unmapped_user(uint64_t entry, uint64_t first, uint64_t end)
+{
+    if (!(entry & PT_USER))
+    {
+        return;
+    }
+    uintptr_t paddr = entry & PAGE_MASK;
+    for (uint64_t i = first; i < end; i++)
+    {
+        pframe_unmapped(paddr + i * PAGE_SIZE);
+    }
+}
+
 void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
 {
     // TODO reclaim pages on-the-fly?
@@ -668,7 +1015,7 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
                 memset(&pd->phys[unmap_start], 0,
                        sizeof(uint64_t) * (unmap_end - unmap_start));
                 vaddr += (unmap_end - unmap_start) * PAGE_SIZE_2MB;
-                for (uintptr_t i = unmap_end; unmap_end < PT_ENTRY_COUNT; i++)
+                for (uintptr_t i = unmap_end; i < PT_ENTRY_COUNT; i++)
                 {
                     pd->phys[i] = table->phys[idx] +
                                   i * PAGE_SIZE_2MB; // keeps all flags,
@@ -692,6 +1039,7 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
         {
             if (PAGE_ALIGNED_2MB(vaddr) && size >= PAGE_SIZE_2MB)
             {
+                _pt_unmapped_user(table->phys[idx], 0, PT_ENTRY_COUNT);
                 table->phys[idx] = 0;
                 vaddr += PAGE_SIZE_2MB;
             }
@@ -707,6 +1055,7 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
                 uint64_t unmap_start = PTE(vaddr);
                 uint64_t unmap_end =
                     PAGE_SAME_2MB(vaddr, vmax) ? PTE(vmax) : 512;
+                _pt_unmapped_user(table->phys[idx], unmap_start, unmap_end);
                 for (unsigned i = 0; i < unmap_start; i++)
                 {
                     pt->phys[i] = table->phys[idx] + i * PAGE_SIZE -
@@ -715,7 +1064,7 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
                 memset(&pt->phys[unmap_start], 0,
                        sizeof(uint64_t) * (unmap_end - unmap_start));
                 vaddr += (unmap_end - unmap_start) * PAGE_SIZE;
-                for (uintptr_t i = unmap_end; unmap_end < PT_ENTRY_COUNT; i++)
+                for (uintptr_t i = unmap_end; i < PT_ENTRY_COUNT; i++)
                 {
                     pt->phys[i] = table->phys[idx] + i * PAGE_SIZE -
                                   PT_SIZE; // remove PT_SIZE flag
@@ -735,6 +1084,7 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
             vaddr += PAGE_SIZE;
             continue;
         }
+        _pt_unmapped_user(table->phys[idx], 0, 1);
         table->phys[idx] = 0;
 
         vaddr += PAGE_SIZE;
@@ -742,6 +1092,196 @@ void pt_unmap_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
     KASSERT(_vaddr_status(pml4, vaddr_start) == UNMAPPED);
 }
 
+/*
+ * Clear PT_WRITE on every leaf entry mapping [vaddr, vmax), so that the next
+ * write to any of those pages faults. Used by fork to set up copy-on-write
+ * without throwing away the mappings. Large pages are write protected whole;
+ * the fault handler splits them when it remaps the faulting page. The caller
+ * is responsible for flushing the TLB.
+ */
+void pt_write_protect_range(pml4_t *pml4, uintptr_t vaddr, uintptr_t vmax)
+{
+    dbg(DBG_PGTBL, "virt[0x%p, 0x%p); pml4: 0x%p\n", (void *)vaddr,
+        (void *)vmax, pml4);
+    KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(vmax) && vmax > vaddr);
+
+    while (vaddr < vmax)
+    {
+        uint64_t idx = PML4E(vaddr);
+        pml4_t *table = pml4;
+
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_512GB(vaddr + 1);
+            continue;
+        }
+        table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        // PDP (1GB pages)
+        idx = PDPE(vaddr);
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_1GB(vaddr + 1);
+            continue;
+        }
+        if (IS_1GB_PAGE(table->phys[idx]))
+        {
+            table->phys[idx] &= ~(uint64_t)PT_WRITE;
+            vaddr = PAGE_ALIGN_UP_1GB(vaddr + 1);
+            continue;
+        }
+        table = (pd_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        // PD (2MB pages)
+        idx = PDE(vaddr);
+        if (!IS_PRESENT(table->phys[idx]))
+        {
+            vaddr = PAGE_ALIGN_UP_2MB(vaddr + 1);
+            continue;
+        }
+        if (IS_2MB_PAGE(table->phys[idx]))
+        {
+            table->phys[idx] &= ~(uint64_t)PT_WRITE;
+            vaddr = PAGE_ALIGN_UP_2MB(vaddr + 1);
+            continue;
+        }
+        table = (pt_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+        // PT (4KB pages)
+        idx = PTE(vaddr);
+        table->phys[idx] &= ~(uint64_t)PT_WRITE;
+        vaddr += PAGE_SIZE;
+    }
+}
+
+/*
+ * If the page vaddr is in is mapped in pml4 to the physical page paddr,
+ * clears the accessed bit of the leaf entry mapping it and returns whether
+ * it was set (for the swapper, see vmmap_unmap_pframe). Returns -1 if it is
+ * mapped to something else, or not at all. A large page's bit stands for
+ * all of it. The TLB is left alone: at worst the CPU goes on using the page
+ * without setting the bit again, and it is taken to be unused.
+ */
+long pt_clear_accessed(pml4_t *pml4, uintptr_t vaddr, uintptr_t paddr)
+{
+    pml4_t *table = pml4;
+    uint64_t idx = PML4E(vaddr);
+    if (!IS_PRESENT(table->phys[idx]))
+    {
+        return -1;
+    }
+    table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    // PDP (1GB pages)
+    idx = PDPE(vaddr);
+    uint64_t *entry = &table->phys[idx];
+    uintptr_t mapped;
+    if (!IS_PRESENT(*entry))
+    {
+        return -1;
+    }
+    if (IS_1GB_PAGE(*entry))
+    {
+        mapped = PAGE_ALIGN_DOWN_1GB(*entry) + PAGE_OFFSET_1GB(vaddr);
+        goto leaf;
+    }
+    table = (pd_t *)((*entry & PAGE_MASK) + PHYS_OFFSET);
+
+    // PD (2MB pages)
+    idx = PDE(vaddr);
+    entry = &table->phys[idx];
+    if (!IS_PRESENT(*entry))
+    {
+        return -1;
+    }
+    if (IS_2MB_PAGE(*entry))
+    {
+        mapped = PAGE_ALIGN_DOWN_2MB(*entry) + PAGE_OFFSET_2MB(vaddr);
+        goto leaf;
+    }
+    table = (pt_t *)((*entry & PAGE_MASK) + PHYS_OFFSET);
+
+    // PT (4KB pages)
+    idx = PTE(vaddr);
+    entry = &table->phys[idx];
+    if (!IS_PRESENT(*entry))
+    {
+        return -1;
+    }
+    mapped = (uintptr_t)PAGE_ALIGN_DOWN(*entry) + PAGE_OFFSET(vaddr);
+
+leaf:
+    if (ADDR_TO_PN(mapped) != ADDR_TO_PN(paddr))
+    {
+        return -1;
+    }
+    long accessed = (*entry & PT_ACCESSED) != 0;
+    *entry &= ~(uint64_t)PT_ACCESSED;
+    return accessed;
+}
+
+/*
+ * The physical address vaddr is mapped to in pml4, if it is mapped for user
+ * access (and for writing as well, if forwrite is set), or 0 otherwise. For
+ * copying to and from user memory through the physical map instead of
+ * faulting or going to the page's object (see vmmap_read). The accessed bit
+ * of the leaf entry gets set, and for writes its dirty bit, as the CPU would
+ * have done.
+ */
+uintptr_t pt_user_phys(pml4_t *pml4, uintptr_t vaddr, long forwrite)
+{
+    uint64_t need = PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0);
+    pml4_t *table = pml4;
+    uint64_t idx = PML4E(vaddr);
+    if ((table->phys[idx] & need) != need)
+    {
+        return 0;
+    }
+    table = (pdp_t *)((table->phys[idx] & PAGE_MASK) + PHYS_OFFSET);
+
+    // PDP (1GB pages)
+    idx = PDPE(vaddr);
+    uint64_t *entry = &table->phys[idx];
+    uintptr_t paddr;
+    if ((*entry & need) != need)
+    {
+        return 0;
+    }
+    if (IS_1GB_PAGE(*entry))
+    {
+        paddr = PAGE_ALIGN_DOWN_1GB(*entry) + PAGE_OFFSET_1GB(vaddr);
+        goto leaf;
+    }
+    table = (pd_t *)((*entry & PAGE_MASK) + PHYS_OFFSET);
+
+    // PD (2MB pages)
+    idx = PDE(vaddr);
+    entry = &table->phys[idx];
+    if ((*entry & need) != need)
+    {
+        return 0;
+    }
+    if (IS_2MB_PAGE(*entry))
+    {
+        paddr = PAGE_ALIGN_DOWN_2MB(*entry) + PAGE_OFFSET_2MB(vaddr);
+        goto leaf;
+    }
+    table = (pt_t *)((*entry & PAGE_MASK) + PHYS_OFFSET);
+
+    // PT (4KB pages)
+    idx = PTE(vaddr);
+    entry = &table->phys[idx];
+    if ((*entry & need) != need)
+    {
+        return 0;
+    }
+    paddr = (uintptr_t)PAGE_ALIGN_DOWN(*entry) + PAGE_OFFSET(vaddr);
+
+leaf:
+    *entry |= PT_ACCESSED | (forwrite ? PT_DIRTY : 0);
+    return paddr;
+}
+
 static char *entry_strings[] = {
     "4KB",
     "2MB",
@@ -1,17 +1,137 @@
 #include "globals.h"
 
+#include "main/interrupt.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
+#include "proc/proc.h"
+#include "proc/spinlock.h"
+#include "vm/ksm.h"
 
+#include "util/atomic.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/time.h"
+
+STATIC_ASSERT(offsetof(pframe_t, pf_mutex.km_lock) + sizeof(spinlock_t) <=
+                  CACHE_LINE_SIZE,
+              "pf_addr and pf_mutex's lock no longer share the first line");
 
 static slab_allocator_t *pframe_allocator;
 
+void *pframe_zero_page;
+
+/*
+ * The page cache LRU. The pframes of memory objects whose contents can be
+ * read back in (vnodes and filesystem block caches, and anonymous and
+ * shadow objects once there is swap; see mobj_create_pframe) sit on one of
+ * two global lists, in the spirit of the CLOCK-Pro / Linux two-list scheme:
+ *
+ * - New pframes go on the tail of the inactive list.
+ * - A lookup only sets pf_referenced, so cache hits take no lock.
+ * - The reclaimer takes pframes off the head of the inactive list. Those
+ *   referenced since it last looked are promoted to the active list, and
+ *   the rest are written back if dirty and freed.
+ * - Whenever the inactive list grows shorter than the active one, pframes
+ *   from the head of the active list move to the inactive one, unless they
+ *   have been referenced, in which case they get another round.
+ *
+ * Dirty pframes on the LRU are also on pframe_dirty, oldest first, for the
+ * writeback daemon (see fs/writeback.c). Those of swappable objects are
+ * not: they are written out when they are evicted, and not before.
+ *
+ * All three lists and their lengths are protected by pframe_lru_lock, taken
+ * with interrupts disabled; pf_lru, pf_lru_link and pf_dirty_link belong to
+ * it too. pf_lru only changes from or to PFRAME_LRU_NONE with the pframe
+ * locked, so the pframe's owner may test it without pframe_lru_lock.
+ */
+#define PFRAME_LRU_NONE 0
+#define PFRAME_LRU_ACTIVE 1
+#define PFRAME_LRU_INACTIVE 2
+
+/* Most active pframes looked at per call to _pframe_lru_balance. */
+#define PFRAME_LRU_BALANCE_BATCH 32
+
+static list_t pframe_active = LIST_INITIALIZER(pframe_active);
+static list_t pframe_inactive = LIST_INITIALIZER(pframe_inactive);
+static list_t pframe_dirty = LIST_INITIALIZER(pframe_dirty);
+static size_t pframe_nactive;
+static size_t pframe_ninactive;
+static size_t pframe_ndirty;
+static spinlock_t pframe_lru_lock = SPINLOCK_INITIALIZER(pframe_lru_lock);
+
+/*
+ * Pframes mapped into user address spaces, hashed by physical page. The
+ * page tables only know the physical address of what they map, so this is
+ * how pt_unmap_range finds the pframe whose pf_mapcount to drop (see
+ * pframe_unmapped). pf_mapcount and pf_map_link are protected by
+ * pframe_map_lock, taken with interrupts disabled.
+ *
+ * A mapped pframe is also charged to a process, the first to map it
+ * (pf_owner), for as long as it stays mapped, even if only by others
+ * sharing it by then; the charge of one whose owner has gone falls to the
+ * next process to map it. A process's charged pframes, its resident set,
+ * are on its p_rss_pages, oldest charge first, and counted by p_rss. The
+ * owner fields, the list and the count are protected by pframe_map_lock
+ * too.
+ */
+#define PFRAME_MAP_BUCKETS 256
+#define PFRAME_MAP_HASH(paddr) (ADDR_TO_PN(paddr) % PFRAME_MAP_BUCKETS)
+
+static list_t pframe_mapped[PFRAME_MAP_BUCKETS];
+static spinlock_t pframe_map_lock = SPINLOCK_INITIALIZER(pframe_map_lock);
+
+static size_t pframe_shrink(page_shrinker_t *shrinker, size_t target);
+static page_shrinker_t pframe_shrinker = {.ps_shrink = pframe_shrink};
+
+/*
+ * Compaction: when page_alloc_n cannot find a free block of 2^order pages,
+ * pframe_compact empties one by moving the pages of the pframes in it
+ * elsewhere (see mobj_migrate_pframe). Pframes are only found through the
+ * LRU, so what can be moved is the page cache, and anonymous memory when
+ * there is swap to put it on the LRU. The blocks of the first
+ * PFRAME_COMPACT_CANDIDATES pframes of the LRU, coldest first, are the
+ * candidates; of those whose pages are all either free or such pframes, the
+ * one with the most free pages is emptied, which takes the fewest copies.
+ */
+#define PFRAME_COMPACT_CANDIDATES 8
+
+static long pframe_compact(page_compactor_t *compactor, size_t order,
+                           uintptr_t max_paddr, long unmap);
+static page_compactor_t pframe_compactor = {.pc_compact = pframe_compact};
+
+/*
+ * Slab constructor for pframes. pframe_free hands pframes back with the
+ * mutex unlocked and the link unlinked, so these stay set up across reuse.
+ */
+static void pframe_ctor(void *obj)
+{
+    pframe_t *pf = obj;
+    memset(pf, 0, sizeof(pframe_t));
+    kmutex_init(&pf->pf_mutex);
+    list_link_init(&pf->pf_link);
+    list_link_init(&pf->pf_lru_link);
+    list_link_init(&pf->pf_dirty_link);
+    list_link_init(&pf->pf_map_link);
+    list_link_init(&pf->pf_owner_link);
+}
+
 void pframe_init()
 {
-    pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
+    pframe_allocator = slab_allocator_create_ctor("pframe", sizeof(pframe_t),
+                                                  pframe_ctor, NULL);
     KASSERT(pframe_allocator);
+    pframe_zero_page = page_alloc();
+    KASSERT(pframe_zero_page);
+    memset(pframe_zero_page, 0, PAGE_SIZE);
+    for (size_t i = 0; i < PFRAME_MAP_BUCKETS; i++)
+    {
+        list_init(&pframe_mapped[i]);
+    }
+    page_shrinker_register(&pframe_shrinker);
+    page_compactor_register(&pframe_compactor);
 }
 
 /*
@@ -24,17 +144,475 @@ pframe_t *pframe_create()
     {
         return NULL;
     }
-    memset(pf, 0, sizeof(pframe_t));
-    kmutex_init(&pf->pf_mutex);
-    list_link_init(&pf->pf_link);
+    KASSERT(!kmutex_has_waiters(&pf->pf_mutex));
+    KASSERT(!list_link_is_linked(&pf->pf_link));
+    KASSERT(pf->pf_lru == PFRAME_LRU_NONE);
+    KASSERT(!pf->pf_pincount && !pf->pf_mapcount);
+    pf->pf_pagenum = 0;
+    pf->pf_loc = 0;
+    pf->pf_addr = NULL;
+    pf->pf_dirty = 0;
+    pf->pf_obj = NULL;
+    pf->pf_referenced = 0;
+    pf->pf_swap = 0;
+    pf->pf_ksm = NULL;
+    pf->pf_ksm_hash = 0;
     return pf;
 }
 
+/*
+ * Puts pf on the page cache LRU, making it a candidate for reclaim. pf_obj
+ * must be set.
+ */
+void pframe_lru_add(pframe_t *pf)
+{
+    KASSERT(pf->pf_obj);
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    KASSERT(pf->pf_lru == PFRAME_LRU_NONE);
+    list_insert_tail(&pframe_inactive, &pf->pf_lru_link);
+    pf->pf_lru = PFRAME_LRU_INACTIVE;
+    pframe_ninactive++;
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/* Whether pf belongs on the dirty list while it is dirty */
+static long _pframe_writeback(pframe_t *pf)
+{
+    return pf->pf_lru != PFRAME_LRU_NONE && !MOBJ_SWAPPABLE(pf->pf_obj);
+}
+
+/*
+ * Marks pf dirty, and tags it so in its object's index. If pf is on the LRU,
+ * it also goes on the tail of the dirty list, where the writeback daemon
+ * will find it.
+ *
+ * pf and its object must be locked.
+ */
+void pframe_set_dirty(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (pf->pf_dirty)
+    {
+        return;
+    }
+    pf->pf_dirty = 1;
+    KASSERT(kmutex_owns_mutex(&pf->pf_obj->mo_mutex));
+    MOBJ_STAT_INC(pf->pf_obj, ms_dirty);
+    radix_tree_tag_set(&pf->pf_obj->mo_index, pf->pf_pagenum, MOBJ_TAG_DIRTY);
+    if (!_pframe_writeback(pf))
+    {
+        return;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    pf->pf_dirtied = jiffies;
+    list_insert_tail(&pframe_dirty, &pf->pf_dirty_link);
+    pframe_ndirty++;
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Marks pf clean, taking it off the dirty list.
+ *
+ * pf and its object must be locked.
+ */
+void pframe_clear_dirty(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (!pf->pf_dirty)
+    {
+        return;
+    }
+    pf->pf_dirty = 0;
+    KASSERT(kmutex_owns_mutex(&pf->pf_obj->mo_mutex));
+    MOBJ_STAT_DEC(pf->pf_obj, ms_dirty);
+    radix_tree_tag_clear(&pf->pf_obj->mo_index, pf->pf_pagenum, MOBJ_TAG_DIRTY);
+    if (!_pframe_writeback(pf))
+    {
+        return;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    list_remove(&pf->pf_dirty_link);
+    pframe_ndirty--;
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Fills in refs with up to max dirty pframes that became dirty no later than
+ * dirtied_before, taking a reference on each one's memory object. Returns
+ * how many were found.
+ *
+ * The pframes looked at are rotated to the tail of the dirty list, so that
+ * ones the caller fails to clean do not hide the rest on the next call.
+ */
+size_t pframe_dirty_collect(pframe_ref_t *refs, size_t max,
+                            uint64_t dirtied_before)
+{
+    size_t n = 0;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    for (size_t scan = pframe_ndirty; scan && n < max; scan--)
+    {
+        pframe_t *pf = list_head(&pframe_dirty, pframe_t, pf_dirty_link);
+        list_remove(&pf->pf_dirty_link);
+        list_insert_tail(&pframe_dirty, &pf->pf_dirty_link);
+        if (pf->pf_dirtied > dirtied_before ||
+            !atomic_inc_not_zero(&pf->pf_obj->mo_refcount))
+        {
+            continue;
+        }
+        refs[n].pr_obj = pf->pf_obj;
+        refs[n].pr_pagenum = pf->pf_pagenum;
+        refs[n].pr_pf = pf;
+        n++;
+    }
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+    return n;
+}
+
+/* Returns the number of dirty pframes on the LRU. */
+size_t pframe_dirty_count() { return pframe_ndirty; }
+
+/* Returns the number of pframes on the LRU. */
+size_t pframe_cache_count() { return pframe_nactive + pframe_ninactive; }
+
+/* pframe_lru_lock must be held */
+static void _pframe_lru_remove(pframe_t *pf)
+{
+    if (pf->pf_lru == PFRAME_LRU_ACTIVE)
+    {
+        pframe_nactive--;
+    }
+    else
+    {
+        KASSERT(pf->pf_lru == PFRAME_LRU_INACTIVE);
+        pframe_ninactive--;
+    }
+    list_remove(&pf->pf_lru_link);
+    pf->pf_lru = PFRAME_LRU_NONE;
+}
+
+/*
+ * Takes pf, which is locked, off the LRU, if it is on it.
+ */
+void pframe_lru_remove(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (pf->pf_lru == PFRAME_LRU_NONE)
+    {
+        return;
+    }
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    _pframe_lru_remove(pf);
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Refills the inactive list from the head of the active list, giving
+ * referenced pframes a second round instead.
+ *
+ * pframe_lru_lock must be held
+ */
+static void _pframe_lru_balance()
+{
+    for (long i = 0;
+         i < PFRAME_LRU_BALANCE_BATCH && pframe_ninactive < pframe_nactive; i++)
+    {
+        pframe_t *pf = list_head(&pframe_active, pframe_t, pf_lru_link);
+        list_remove(&pf->pf_lru_link);
+        if (pf->pf_referenced)
+        {
+            pf->pf_referenced = 0;
+            list_insert_tail(&pframe_active, &pf->pf_lru_link);
+        }
+        else
+        {
+            list_insert_tail(&pframe_inactive, &pf->pf_lru_link);
+            pf->pf_lru = PFRAME_LRU_INACTIVE;
+            pframe_nactive--;
+            pframe_ninactive++;
+        }
+    }
+}
+
+/*
+ * Frees up to target resident pages from the page cache LRU. Returns the
+ * number of pages freed.
+ *
+ * Called with no locks held; eviction locks the pframe's memory object.
+ */
+static size_t pframe_lru_reclaim(size_t target)
+{
+    size_t freed = 0;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    /* Every pframe is looked at about twice at most, once on each list. */
+    size_t budget = 2 * (pframe_nactive + pframe_ninactive);
+    while (freed < target && budget--)
+    {
+        _pframe_lru_balance();
+        if (list_empty(&pframe_inactive))
+        {
+            break;
+        }
+        pframe_t *pf = list_head(&pframe_inactive, pframe_t, pf_lru_link);
+        list_remove(&pf->pf_lru_link);
+        if (pf->pf_referenced)
+        {
+            pf->pf_referenced = 0;
+            list_insert_tail(&pframe_active, &pf->pf_lru_link);
+            pf->pf_lru = PFRAME_LRU_ACTIVE;
+            pframe_ninactive--;
+            pframe_nactive++;
+            continue;
+        }
+        /* Rotated, so that if it can't be evicted now it is tried last. */
+        list_insert_tail(&pframe_inactive, &pf->pf_lru_link);
+
+        /* While pf is on the list its object has not been destroyed, but
+         * it may be in the middle of it. */
+        mobj_t *o = pf->pf_obj;
+        uint64_t pagenum = pf->pf_pagenum;
+        if (!atomic_inc_not_zero(&o->mo_refcount))
+        {
+            continue;
+        }
+        spinlock_unlock(&pframe_lru_lock);
+        if (enabled)
+            intr_enable();
+
+        freed += mobj_evict_pframe(o, pagenum, pf);
+        mobj_put(&o);
+
+        intr_disable();
+        spinlock_lock(&pframe_lru_lock);
+    }
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+    return freed;
+}
+
+static size_t pframe_shrink(page_shrinker_t *shrinker, size_t target)
+{
+    size_t freed = pframe_lru_reclaim(target);
+    dbg(DBG_PFRAME, "evicted %lu pages from the page cache\n", freed);
+    return freed;
+}
+
+/* Whether pf, on the LRU, has its page in [start, end) and can be moved. */
+static long _pframe_compact_movable(pframe_t *pf, uintptr_t start,
+                                    uintptr_t end, long unmap)
+{
+    uintptr_t paddr = (uintptr_t)pf->pf_addr - PHYS_OFFSET;
+    return pf->pf_addr && paddr >= start && paddr < end &&
+           (unmap || !pf->pf_mapcount);
+}
+
+/*
+ * Counts the movable pframes on the LRU whose pages are in [start, end) or,
+ * if refp is set, instead finds the first one, taking a reference on its
+ * object. pframe_lru_lock must be held.
+ */
+static size_t _pframe_compact_scan(uintptr_t start, uintptr_t end, long unmap,
+                                   pframe_ref_t *refp)
+{
+    size_t n = 0;
+    list_t *lists[] = {&pframe_inactive, &pframe_active};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        list_iterate(lists[i], pf, pframe_t, pf_lru_link)
+        {
+            if (!_pframe_compact_movable(pf, start, end, unmap))
+            {
+                continue;
+            }
+            if (!refp)
+            {
+                n++;
+                continue;
+            }
+            if (!atomic_inc_not_zero(&pf->pf_obj->mo_refcount))
+            {
+                return 0;
+            }
+            refp->pr_obj = pf->pf_obj;
+            refp->pr_pagenum = pf->pf_pagenum;
+            refp->pr_pf = pf;
+            return 1;
+        }
+    }
+    return n;
+}
+
+/*
+ * Fills in blocks with the distinct blocks of 2^order pages below max_paddr
+ * that the pages of the coldest pframes lie in. Returns how many there are.
+ */
+static size_t _pframe_compact_candidates(uintptr_t *blocks, size_t order,
+                                         uintptr_t max_paddr)
+{
+    size_t n = 0;
+    uintptr_t size = PAGE_SIZE << order;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_lru_lock);
+    list_t *lists[] = {&pframe_inactive, &pframe_active};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        list_iterate(lists[i], pf, pframe_t, pf_lru_link)
+        {
+            if (n == PFRAME_COMPACT_CANDIDATES)
+            {
+                goto done;
+            }
+            if (!pf->pf_addr)
+            {
+                continue;
+            }
+            uintptr_t block =
+                ((uintptr_t)pf->pf_addr - PHYS_OFFSET) & ~(size - 1);
+            if (block + size - 1 > max_paddr)
+            {
+                continue;
+            }
+            size_t j = 0;
+            while (j < n && blocks[j] != block)
+            {
+                j++;
+            }
+            if (j == n)
+            {
+                blocks[n++] = block;
+            }
+        }
+    }
+done:
+    spinlock_unlock(&pframe_lru_lock);
+    if (enabled)
+        intr_enable();
+    return n;
+}
+
+/*
+ * Moves every pframe in the block of 2^order pages at block out of it, and
+ * returns whether the block is free afterwards. Gives up at the first
+ * pframe that cannot be moved, since the block then stays in use anyway.
+ */
+static long _pframe_compact_block(uintptr_t block, size_t order, long unmap)
+{
+    uintptr_t end = block + (PAGE_SIZE << order);
+    /* Free pages of the block handed out for a copy, held until the end. */
+    list_t held = LIST_INITIALIZER(held);
+    long ok = 1;
+    while (ok)
+    {
+        pframe_ref_t ref;
+        long enabled = intr_enabled() != 0;
+        intr_disable();
+        spinlock_lock(&pframe_lru_lock);
+        size_t found = _pframe_compact_scan(block, end, unmap, &ref);
+        spinlock_unlock(&pframe_lru_lock);
+        if (enabled)
+            intr_enable();
+        if (!found)
+        {
+            break;
+        }
+
+        void *page;
+        while ((page = page_alloc()) &&
+               (uintptr_t)page - PHYS_OFFSET >= block &&
+               (uintptr_t)page - PHYS_OFFSET < end)
+        {
+            list_link_t *link = page;
+            list_link_init(link);
+            list_insert_tail(&held, link);
+        }
+        ok = page && !mobj_migrate_pframe(ref.pr_obj, ref.pr_pagenum,
+                                          ref.pr_pf, page, unmap);
+        if (page && !ok)
+        {
+            page_free(page);
+        }
+        mobj_put(&ref.pr_obj);
+    }
+    while (!list_empty(&held))
+    {
+        list_link_t *link = held.l_next;
+        list_remove(link);
+        page_free_n(link, 1);
+    }
+    return page_block_free(block, order) == 1UL << order;
+}
+
+static long pframe_compact(page_compactor_t *compactor, size_t order,
+                           uintptr_t max_paddr, long unmap)
+{
+    if (!curthr)
+    {
+        return 0;
+    }
+    uintptr_t blocks[PFRAME_COMPACT_CANDIDATES];
+    size_t n = _pframe_compact_candidates(blocks, order, max_paddr);
+
+    uintptr_t best = 0;
+    size_t best_free = 0;
+    long found = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t free = page_block_free(blocks[i], order);
+        long enabled = intr_enabled() != 0;
+        intr_disable();
+        spinlock_lock(&pframe_lru_lock);
+        size_t movable = _pframe_compact_scan(
+            blocks[i], blocks[i] + (PAGE_SIZE << order), unmap, NULL);
+        spinlock_unlock(&pframe_lru_lock);
+        if (enabled)
+            intr_enable();
+        if (free + movable == 1UL << order && (!found || free > best_free))
+        {
+            best = blocks[i];
+            best_free = free;
+            found = 1;
+        }
+    }
+    if (!found)
+    {
+        return 0;
+    }
+    long ok = _pframe_compact_block(best, order, unmap);
+    dbg(DBG_PFRAME, "compaction %s a block of %lu pages at 0x%p\n",
+        ok ? "freed" : "failed to free", 1UL << order, (void *)best);
+    return ok;
+}
+
 /*
  * Free the pframe (don't forget to unlock the mutex) and set *pfp = NULL
  *
  * The pframe must be locked, its contents not in memory (pf->pf_addr == NULL),
- * have a pincount of 0, and not be linked into a memory object's list.
+ * have a pincount of 0, and not be linked into a memory object's list. Its
+ * swap slot, if it has one, is freed, and so is its share of a merged page.
  */
 void pframe_free(pframe_t **pfp)
 {
@@ -42,6 +620,10 @@ void pframe_free(pframe_t **pfp)
     KASSERT(!(*pfp)->pf_addr);
     KASSERT(!(*pfp)->pf_dirty);
     KASSERT(!list_link_is_linked(&(*pfp)->pf_link));
+    KASSERT(!(*pfp)->pf_pincount && !(*pfp)->pf_mapcount);
+    pframe_lru_remove(*pfp);
+    swap_discard_pframe(*pfp);
+    ksm_discard_pframe(*pfp);
     kmutex_unlock(&(*pfp)->pf_mutex);
     slab_obj_free(pframe_allocator, *pfp);
     *pfp = NULL;
@@ -57,3 +639,214 @@ void pframe_release(pframe_t **pfp)
     *pfp = NULL;
     kmutex_unlock(&pf->pf_mutex);
 }
+
+/*
+ * Pin pf, which must be locked, and return it. A pinned pframe is neither
+ * reclaimed nor freed, and its page stays where it is, so the pin can be
+ * kept past pframe_release: by a fault handler between finding a page and
+ * mapping it, or by a driver while a device transfers to or from it. What
+ * the pin does not give is exclusive use of the contents; that still takes
+ * pf_mutex.
+ */
+pframe_t *pframe_get(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_addr);
+    atomic_inc(&pf->pf_pincount);
+    return pf;
+}
+
+/*
+ * Drop a pin taken by pframe_get and set *pfp = NULL. pf need not be locked.
+ */
+void pframe_put(pframe_t **pfp)
+{
+    pframe_t *pf = *pfp;
+    KASSERT(pf->pf_pincount > 0);
+    *pfp = NULL;
+    __sync_sub_and_fetch(&pf->pf_pincount, 1);
+}
+
+/* pframe_map_lock must be held */
+static void _pframe_uncharge(pframe_t *pf)
+{
+    KASSERT(pf->pf_owner->p_rss > 0);
+    pf->pf_owner->p_rss--;
+    list_remove(&pf->pf_owner_link);
+    pf->pf_owner = NULL;
+}
+
+/*
+ * Record that a user page table entry of curproc now maps pf's page. pf
+ * must be locked or pinned. Undone by pframe_unmapped when the entry goes
+ * away.
+ */
+void pframe_map(pframe_t *pf)
+{
+    KASSERT(pf->pf_addr);
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    if (!pf->pf_mapcount++)
+    {
+        uintptr_t paddr = (uintptr_t)pf->pf_addr - PHYS_OFFSET;
+        list_insert_head(&pframe_mapped[PFRAME_MAP_HASH(paddr)],
+                         &pf->pf_map_link);
+    }
+    if (!pf->pf_owner)
+    {
+        pf->pf_owner = curproc;
+        list_insert_tail(&curproc->p_rss_pages, &pf->pf_owner_link);
+        curproc->p_rss++;
+    }
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Called by the page table code for each user page a copied page table maps
+ * (see clone_pml4). Bumps the mapcount of the pframe holding the page at
+ * paddr, if it is mapped already; pages not tracked by pframe_map are left
+ * alone.
+ */
+void pframe_remapped(uintptr_t paddr)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    list_t *bucket = &pframe_mapped[PFRAME_MAP_HASH(paddr)];
+    list_iterate(bucket, pf, pframe_t, pf_map_link)
+    {
+        if ((uintptr_t)pf->pf_addr - PHYS_OFFSET == paddr)
+        {
+            KASSERT(pf->pf_mapcount > 0);
+            pf->pf_mapcount++;
+            break;
+        }
+    }
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Called by the page table code for each user page it unmaps. Drops the
+ * mapcount of the pframe holding the page at paddr, if there is one.
+ */
+void pframe_unmapped(uintptr_t paddr)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    list_t *bucket = &pframe_mapped[PFRAME_MAP_HASH(paddr)];
+    list_iterate(bucket, pf, pframe_t, pf_map_link)
+    {
+        if ((uintptr_t)pf->pf_addr - PHYS_OFFSET == paddr)
+        {
+            KASSERT(pf->pf_mapcount > 0);
+            if (!--pf->pf_mapcount)
+            {
+                list_remove(&pf->pf_map_link);
+                if (pf->pf_owner)
+                    _pframe_uncharge(pf);
+            }
+            break;
+        }
+    }
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Drops the charges of the pframes proc is still charged for, which are
+ * those other processes map, before proc is freed. Its own mappings must be
+ * gone already.
+ */
+void pframe_disown(proc_t *proc)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    list_iterate(&proc->p_rss_pages, pf, pframe_t, pf_owner_link)
+    {
+        _pframe_uncharge(pf);
+    }
+    KASSERT(!proc->p_rss);
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Returns how many of the pframes charged to proc are mapped more than
+ * once, for proc_info(): shared with another process, or with itself.
+ */
+size_t pframe_rss_shared(const proc_t *proc)
+{
+    size_t shared = 0;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    list_iterate(&proc->p_rss_pages, pf, pframe_t, pf_owner_link)
+    {
+        shared += pf->pf_mapcount > 1;
+    }
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+    return shared;
+}
+
+/*
+ * Brings proc's resident set back down to p_rss_limit, once a user fault
+ * has taken it past (see handle_pagefault): its oldest charged pages are
+ * taken out of the address spaces that map them, and those of anonymous
+ * memory paged out, which only they need to leave memory. As with the
+ * swapper, pages used since they were last looked at get another round
+ * first. Returns how many pages proc was relieved of.
+ *
+ * Called with no locks held; the pages' memory objects are only tried.
+ */
+size_t pframe_rss_trim(proc_t *proc)
+{
+    size_t trimmed = 0;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pframe_map_lock);
+    /* Every pframe is looked at about twice at most. */
+    size_t budget = 2 * proc->p_rss;
+    while (proc->p_rss_limit && proc->p_rss > proc->p_rss_limit && budget--)
+    {
+        pframe_t *pf = list_head(&proc->p_rss_pages, pframe_t, pf_owner_link);
+        /* Rotated, so that if it stays mapped now it is tried last. */
+        list_remove(&pf->pf_owner_link);
+        list_insert_tail(&proc->p_rss_pages, &pf->pf_owner_link);
+
+        /* A mapped pframe is not freed, so its object is still there, but
+         * it may be in the middle of being destroyed. */
+        mobj_t *o = pf->pf_obj;
+        uint64_t pagenum = pf->pf_pagenum;
+        if (!atomic_inc_not_zero(&o->mo_refcount))
+        {
+            continue;
+        }
+        spinlock_unlock(&pframe_map_lock);
+        if (enabled)
+            intr_enable();
+
+        trimmed += mobj_trim_pframe(o, pagenum, pf);
+        mobj_put(&o);
+
+        intr_disable();
+        spinlock_lock(&pframe_map_lock);
+    }
+    spinlock_unlock(&pframe_map_lock);
+    if (enabled)
+        intr_enable();
+    dbg(DBG_PFRAME, "trimmed %lu pages of P%d, now at %lu\n", trimmed,
+        proc->p_pid, proc->p_rss);
+    return trimmed;
+}
@@ -13,14 +13,27 @@
  * preemptible kernels!
  *
  * darmanio: ^ lol, look at me now :D
+ *
+ * Each allocator is protected by its sa_lock, taken with interrupts
+ * disabled. In front of the slabs sits a magazine layer (Bonwick & Adams,
+ * "Magazines and Vmem", USENIX 2001): every core holds two magazines of
+ * free objects for each allocator and allocates from and frees to them
+ * without taking the lock. Only when both are empty (or both full) does the
+ * core exchange a whole magazine with the allocator's depot.
  */
 
+#include "globals.h"
 #include "types.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 #include "mm/slab.h"
+#include "mm/vmalloc.h"
+#include "proc/spinlock.h"
 #include "util/debug.h"
 #include "util/gdb.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #ifdef SLAB_REDZONE
@@ -50,6 +63,30 @@ struct slab
     void *s_addr;        /* start address */
 };
 
+/*
+ * Number of objects a magazine holds, and the number of full magazines an
+ * allocator's depot keeps before frees go straight back to the slabs.
+ */
+#define SLAB_MAGAZINE_SIZE 15
+#define SLAB_DEPOT_FULL_MAX 8
+
+/* Number of completely free slabs an allocator keeps through a reclaim. */
+#define SLAB_RECLAIM_KEEP 1
+
+typedef struct slab_magazine
+{
+    struct slab_magazine *sm_next;    /* link on a depot list */
+    size_t sm_rounds;                 /* number of objects held */
+    void *sm_objs[SLAB_MAGAZINE_SIZE]; /* objects, as laid out in the slab */
+} slab_magazine_t;
+
+/* A core's magazines for one allocator. Either may be NULL. */
+typedef struct slab_cpu
+{
+    slab_magazine_t *sc_loaded;   /* allocated from and freed to first */
+    slab_magazine_t *sc_previous; /* swapped with sc_loaded when that runs out */
+} slab_cpu_t;
+
 typedef struct slab_allocator
 {
     const char *sa_name;            /* user-provided name */
@@ -58,6 +95,16 @@ typedef struct slab_allocator
     size_t sa_order;                /* npages = (1 << order) */
     size_t sa_slab_nobjs;           /* number of objs per slab */
     struct slab_allocator *sa_next; /* link on global list of allocators */
+    uint8_t sa_kmalloc_class;       /* 1 + kmalloc size class, else 0 */
+    slab_ctor_t sa_ctor;            /* run on each object of a new slab */
+    slab_dtor_t sa_dtor;            /* run on each object of a freed slab */
+
+    spinlock_t sa_lock;              /* protects the slabs and the depot */
+    long sa_magazines;               /* set if the magazine layer is used */
+    slab_magazine_t *sa_depot_full;  /* depot of full magazines */
+    slab_magazine_t *sa_depot_empty; /* depot of empty magazines */
+    size_t sa_depot_nfull;           /* length of sa_depot_full */
+    slab_cpu_t sa_cpu[MAX_LAPICS];   /* per-core magazines, by core id */
 } slab_allocator_t;
 
 /* Stored at the end of every object to keep track of the 
@@ -92,10 +139,19 @@ GDB_DEFINE_HOOK(slab_obj_free, void *addr, slab_allocator_t *allocator)
 
 /* Head of global list of slab allocators. This is used in the python gdb script */
 static slab_allocator_t *slab_allocators = NULL;
+static spinlock_t slab_allocators_lock =
+    SPINLOCK_INITIALIZER(slab_allocators_lock);
 
 /* Special case - allocator for allocation of slab_allocator objects. */
 static slab_allocator_t slab_allocator_allocator;
 
+/* Allocator for magazines. Neither of these two uses magazines itself. */
+static slab_allocator_t slab_magazine_allocator;
+
+static void _slab_obj_free_slab(slab_allocator_t *allocator, void *obj);
+static void _kmalloc_mark_pages(slab_allocator_t *allocator, void *addr,
+                                uint8_t class);
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -189,7 +245,7 @@ static void _calc_slab_size(slab_allocator_t *allocator)
  * Initializes a given allocator using the name and size passed in. 
 */
 static void _allocator_init(slab_allocator_t *allocator, const char *name,
-                            size_t size)
+                            size_t size, long magazines)
 {
 #ifdef SLAB_REDZONE
     /*
@@ -206,12 +262,27 @@ static void _allocator_init(slab_allocator_t *allocator, const char *name,
     allocator->sa_name = name;
     allocator->sa_objsize = size;
     allocator->sa_slabs = NULL;
+    allocator->sa_kmalloc_class = 0;
+    allocator->sa_ctor = NULL;
+    allocator->sa_dtor = NULL;
+    spinlock_init(&allocator->sa_lock);
+    allocator->sa_magazines = magazines;
+    allocator->sa_depot_full = NULL;
+    allocator->sa_depot_empty = NULL;
+    allocator->sa_depot_nfull = 0;
+    memset(allocator->sa_cpu, 0, sizeof(allocator->sa_cpu));
     // this will set the fields sa_order and the number of objects per slab
     _calc_slab_size(allocator);
 
     /* Add cache to global cache list. */
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&slab_allocators_lock);
     allocator->sa_next = slab_allocators;
     slab_allocators = allocator;
+    spinlock_unlock(&slab_allocators_lock);
+    if (enabled)
+        intr_enable();
 
     dbg(DBG_MM, "Initialized new slab allocator:\n");
     dbgq(DBG_MM, "  Name:          \"%s\" (0x%p)\n", allocator->sa_name,
@@ -236,15 +307,181 @@ slab_allocator_t *slab_allocator_create(const char *name, size_t size)
         return NULL;
     }
 
-    _allocator_init(allocator, name, size);
+    _allocator_init(allocator, name, size, 1);
     return allocator;
 }
 
+slab_allocator_t *slab_allocator_create_ctor(const char *name, size_t size,
+                                             slab_ctor_t ctor,
+                                             slab_dtor_t dtor)
+{
+    slab_allocator_t *allocator = slab_allocator_create(name, size);
+    if (allocator)
+    {
+        allocator->sa_ctor = ctor;
+        allocator->sa_dtor = dtor;
+    }
+    return allocator;
+}
+
+/*
+ * Returns the objects in mag to their slabs and frees mag.
+ *
+ * allocator must be locked
+ */
+static void _slab_magazine_destroy(slab_allocator_t *allocator,
+                                   slab_magazine_t *mag)
+{
+    while (mag->sm_rounds)
+    {
+        _slab_obj_free_slab(allocator, mag->sm_objs[--mag->sm_rounds]);
+    }
+    slab_obj_free(&slab_magazine_allocator, mag);
+}
+
+/*
+ * Runs the destructor, if any, on every object of slab, which must be
+ * completely free.
+ */
+static void _slab_destruct(slab_allocator_t *allocator, struct slab *slab)
+{
+    if (!allocator->sa_dtor)
+    {
+        return;
+    }
+    void *obj = slab->s_addr;
+    for (size_t i = 0; i < allocator->sa_slab_nobjs; i++)
+    {
+#ifdef SLAB_REDZONE
+        allocator->sa_dtor((void *)((uintptr_t)obj + sizeof(uintptr_t)));
+#else
+        allocator->sa_dtor(obj);
+#endif
+        obj = next_obj(allocator, obj);
+    }
+}
+
+/*
+ * Frees the completely free slabs of allocator beyond the first keep of them,
+ * stopping once target pages have been freed (never, if target is negative).
+ * Returns the number of pages freed.
+ *
+ * allocator must be locked
+ */
+static long _slab_allocator_reclaim(slab_allocator_t *allocator, size_t keep,
+                                    long target)
+{
+    long npages_freed = 0;
+    long npages = 1L << allocator->sa_order;
+    struct slab **prev = &allocator->sa_slabs;
+    struct slab *slab = allocator->sa_slabs;
+    while (slab && (target < 0 || npages_freed < target))
+    {
+        struct slab *next = slab->s_next;
+        if (!slab->s_inuse && !keep)
+        {
+            *prev = next;
+            _slab_destruct(allocator, slab);
+            _kmalloc_mark_pages(allocator, slab->s_addr, 0);
+            page_free_n(slab->s_addr, (size_t)npages);
+            npages_freed += npages;
+        }
+        else
+        {
+            if (!slab->s_inuse)
+                keep--;
+            prev = &slab->s_next;
+        }
+        slab = next;
+    }
+    if (npages_freed)
+    {
+        dbg(DBG_MM, "Reclaimed %ld pages from \"%s\" (0x%p)\n", npages_freed,
+            allocator->sa_name, allocator);
+    }
+    return npages_freed;
+}
+
+/*
+ * Returns the objects in a core's magazines to their slabs and frees the
+ * magazines.
+ *
+ * allocator must be locked
+ */
+static void _slab_cpu_drain(slab_allocator_t *allocator, slab_cpu_t *cpu)
+{
+    if (cpu->sc_loaded)
+        _slab_magazine_destroy(allocator, cpu->sc_loaded);
+    if (cpu->sc_previous)
+        _slab_magazine_destroy(allocator, cpu->sc_previous);
+    cpu->sc_loaded = cpu->sc_previous = NULL;
+}
+
+/*
+ * Returns the objects in the depot to their slabs and frees the depot's
+ * magazines, so that reclaim can find the slabs they kept busy.
+ *
+ * allocator must be locked
+ */
+static void _slab_depot_drain(slab_allocator_t *allocator)
+{
+    slab_magazine_t *lists[] = {allocator->sa_depot_full,
+                                allocator->sa_depot_empty};
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        while (lists[i])
+        {
+            slab_magazine_t *next = lists[i]->sm_next;
+            _slab_magazine_destroy(allocator, lists[i]);
+            lists[i] = next;
+        }
+    }
+    allocator->sa_depot_full = allocator->sa_depot_empty = NULL;
+    allocator->sa_depot_nfull = 0;
+}
+
+/*
+ * Empties the magazines of every core and the depot back into the slabs, and
+ * frees every slab left with no objects in use. Only safe while no other core
+ * is using the allocator.
+ */
+static void _slab_magazines_drain(slab_allocator_t *allocator)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&allocator->sa_lock);
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        _slab_cpu_drain(allocator, &allocator->sa_cpu[id]);
+    }
+    _slab_depot_drain(allocator);
+    _slab_allocator_reclaim(allocator, 0, -1);
+    spinlock_unlock(&allocator->sa_lock);
+    if (enabled)
+        intr_enable();
+}
+
 /*
  * Free a given allocator. 
 */
 void slab_allocator_destroy(slab_allocator_t *allocator)
 {
+    _slab_magazines_drain(allocator);
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&allocator->sa_lock);
+    _slab_allocator_reclaim(allocator, 0, -1);
+    spinlock_unlock(&allocator->sa_lock);
+    spinlock_lock(&slab_allocators_lock);
+    slab_allocator_t **prev = &slab_allocators;
+    while (*prev != allocator)
+        prev = &(*prev)->sa_next;
+    *prev = allocator->sa_next;
+    spinlock_unlock(&slab_allocators_lock);
+    if (enabled)
+        intr_enable();
+
     slab_obj_free(&slab_allocator_allocator, allocator);
 }
 
@@ -298,10 +535,17 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
 #ifdef SLAB_REDZONE
         front_rz(obj) = SLAB_REDZONE;
         rear_rz(allocator, obj) = SLAB_REDZONE;
+        if (allocator->sa_ctor)
+            allocator->sa_ctor((void *)((uintptr_t)obj + sizeof(uintptr_t)));
+#else
+        if (allocator->sa_ctor)
+            allocator->sa_ctor(obj);
 #endif
         obj = next_obj(allocator, obj);
     }
 
+    _kmalloc_mark_pages(allocator, addr, allocator->sa_kmalloc_class);
+
     dbg(DBG_MM, "Growing cache \"%s\" (0x%p), new slab 0x%p (%lu pages)\n",
         allocator->sa_name, allocator, slab, 1UL << allocator->sa_order);
 
@@ -313,9 +557,12 @@ static long _slab_allocator_grow(slab_allocator_t *allocator)
 }
 
 /*
- * Given an allocator, will allocate an object.  
-*/
-void *slab_obj_alloc(slab_allocator_t *allocator)
+ * Takes an object off a slab of allocator, growing the allocator if no slab
+ * has a free one. Returns NULL if memory runs out.
+ *
+ * allocator must be locked
+ */
+static void *_slab_obj_alloc_slab(slab_allocator_t *allocator)
 {
     struct slab *slab;
     void *obj;
@@ -344,9 +591,6 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
     obj = slab->s_free;
     slab->s_free = obj_bufctl(allocator, obj)->sb_next;
     obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-    obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
 
     slab->s_inuse++;
 
@@ -354,6 +598,159 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
         "Allocated object 0x%p from \"%s\" (0x%p), "
         "slab 0x%p, inuse %lu\n",
         obj, allocator->sa_name, allocator, allocator, slab->s_inuse);
+    return obj;
+}
+
+/*
+ * Puts obj back on the free list of its slab.
+ *
+ * allocator must be locked
+ */
+static void _slab_obj_free_slab(slab_allocator_t *allocator, void *obj)
+{
+    struct slab *slab = obj_bufctl(allocator, obj)->sb_slab;
+
+    /* Place this object back on the slab's free list. */
+    obj_bufctl(allocator, obj)->sb_next = slab->s_free;
+    slab->s_free = obj;
+
+    slab->s_inuse--;
+
+    dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %lu\n",
+        obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+/*
+ * Takes an object from the current core's magazines, refilling them from the
+ * depot if both are empty. Returns NULL if the depot has no full magazine
+ * either. Interrupts must be disabled.
+ */
+static void *_slab_magazine_alloc(slab_allocator_t *allocator)
+{
+    slab_cpu_t *cpu = &allocator->sa_cpu[curcore.kc_id];
+    if (!cpu->sc_loaded || !cpu->sc_loaded->sm_rounds)
+    {
+        if (cpu->sc_previous && cpu->sc_previous->sm_rounds)
+        {
+            slab_magazine_t *mag = cpu->sc_loaded;
+            cpu->sc_loaded = cpu->sc_previous;
+            cpu->sc_previous = mag;
+        }
+        else
+        {
+            spinlock_lock(&allocator->sa_lock);
+            slab_magazine_t *full = allocator->sa_depot_full;
+            if (full)
+            {
+                allocator->sa_depot_full = full->sm_next;
+                allocator->sa_depot_nfull--;
+                if (cpu->sc_previous)
+                {
+                    cpu->sc_previous->sm_next = allocator->sa_depot_empty;
+                    allocator->sa_depot_empty = cpu->sc_previous;
+                }
+            }
+            spinlock_unlock(&allocator->sa_lock);
+            if (!full)
+            {
+                return NULL;
+            }
+            cpu->sc_previous = cpu->sc_loaded;
+            cpu->sc_loaded = full;
+        }
+    }
+    return cpu->sc_loaded->sm_objs[--cpu->sc_loaded->sm_rounds];
+}
+
+/*
+ * Puts obj into the current core's magazines, trading a full one for an
+ * empty one with the depot if both are full. Returns 0 if the object could
+ * not be cached, in which case the caller frees it to its slab. Interrupts
+ * must be disabled.
+ */
+static long _slab_magazine_free(slab_allocator_t *allocator, void *obj)
+{
+    slab_cpu_t *cpu = &allocator->sa_cpu[curcore.kc_id];
+    if (!cpu->sc_loaded || cpu->sc_loaded->sm_rounds == SLAB_MAGAZINE_SIZE)
+    {
+        if (cpu->sc_previous && !cpu->sc_previous->sm_rounds)
+        {
+            slab_magazine_t *mag = cpu->sc_loaded;
+            cpu->sc_loaded = cpu->sc_previous;
+            cpu->sc_previous = mag;
+        }
+        else
+        {
+            spinlock_lock(&allocator->sa_lock);
+            if (cpu->sc_previous &&
+                allocator->sa_depot_nfull >= SLAB_DEPOT_FULL_MAX)
+            {
+                spinlock_unlock(&allocator->sa_lock);
+                return 0;
+            }
+            slab_magazine_t *empty = allocator->sa_depot_empty;
+            if (empty)
+            {
+                allocator->sa_depot_empty = empty->sm_next;
+            }
+            spinlock_unlock(&allocator->sa_lock);
+
+            if (!empty)
+            {
+                empty = slab_obj_alloc(&slab_magazine_allocator);
+                if (!empty)
+                {
+                    return 0;
+                }
+                empty->sm_rounds = 0;
+            }
+
+            if (cpu->sc_previous)
+            {
+                spinlock_lock(&allocator->sa_lock);
+                cpu->sc_previous->sm_next = allocator->sa_depot_full;
+                allocator->sa_depot_full = cpu->sc_previous;
+                allocator->sa_depot_nfull++;
+                spinlock_unlock(&allocator->sa_lock);
+            }
+            cpu->sc_previous = cpu->sc_loaded;
+            cpu->sc_loaded = empty;
+        }
+    }
+    cpu->sc_loaded->sm_objs[cpu->sc_loaded->sm_rounds++] = obj;
+    return 1;
+}
+
+/*
+ * Given an allocator, will allocate an object.  
+*/
+void *slab_obj_alloc(slab_allocator_t *allocator)
+{
+    void *obj = NULL;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    if (allocator->sa_magazines)
+    {
+        obj = _slab_magazine_alloc(allocator);
+    }
+    if (!obj)
+    {
+        spinlock_lock(&allocator->sa_lock);
+        obj = _slab_obj_alloc_slab(allocator);
+        spinlock_unlock(&allocator->sa_lock);
+    }
+    if (enabled)
+        intr_enable();
+    if (!obj)
+    {
+        return NULL;
+    }
+
+#ifdef SLAB_CHECK_FREE
+    KASSERT(obj_bufctl(allocator, obj)->sb_free);
+    obj_bufctl(allocator, obj)->sb_free = 0;
+#endif
 
 #ifdef SLAB_REDZONE
     VERIFY_REDZONES(allocator, obj);
@@ -370,7 +767,6 @@ void *slab_obj_alloc(slab_allocator_t *allocator)
 
 void slab_obj_free(slab_allocator_t *allocator, void *obj)
 {
-    struct slab *slab;
     GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
 #ifdef SLAB_REDZONE
@@ -385,104 +781,394 @@ void slab_obj_free(slab_allocator_t *allocator, void *obj)
     obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
-    slab = obj_bufctl(allocator, obj)->sb_slab;
-
-    /* Place this object back on the slab's free list. */
-    obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-    slab->s_free = obj;
-
-    slab->s_inuse--;
-
-    dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %lu\n",
-        obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    if (!allocator->sa_magazines || !_slab_magazine_free(allocator, obj))
+    {
+        spinlock_lock(&allocator->sa_lock);
+        _slab_obj_free_slab(allocator, obj);
+        spinlock_unlock(&allocator->sa_lock);
+    }
+    if (enabled)
+        intr_enable();
 }
 
 /*
  * Reclaims as much memory (up to a target) from
- * unused slabs as possible
+ * unused slabs as possible. Objects cached in the depot and in the current
+ * core's magazines are returned to their slabs first, while the other cores'
+ * magazines are left alone. Each allocator keeps SLAB_RECLAIM_KEEP free
+ * slabs, so an allocator whose usage dips briefly does not give its memory
+ * back only to ask for it again.
  * @param target - target number of pages to reclaim. If negative,
  * try to reclaim as many pages as possible
  * @return number of pages freed
  */
 long slab_allocators_reclaim(long target)
 {
-    panic("slab_allocators_reclaim NYI for SMP");
-    // spinlock_lock(&allocator->sa_lock);
-    //     int npages_freed = 0, npages;
-
-    //     slab_allocator_t *a;
-    //     struct slab *s, **prev;
-
-    //     /* Go through all caches */
-    //     for (a = slab_allocators; NULL != a; a = a->sa_next) {
-    //             prev = &(a->sa_slabs);
-    //             s = a->sa_slabs;
-    //             while (NULL != s) {
-    //                     struct slab *next = s->s_next;
-    //                     if (0 == s->s_inuse) {
-    //                             /* Free Slab */
-    //                             (*prev) = next;
-    //                             npages = 1 << a->sa_order;
-
-    //                             page_free_n(s->s_addr, npages);
-    //                             npages_freed += npages;
-    //                     } else {
-    //                             prev = &(s->s_next);
-    //                     }
-    //                     /* Check if target was met */
-    //                     if ((target > 0) && (npages_freed >= target)) {
-    //                             return npages_freed;
-    //                     }
-    //                     s = next;
-    //             }
-    //     }
-    // spinlock_unlock(&allocator->sa_lock);
-    //     return npages_freed;
-}
-
-#define KMALLOC_SIZE_MIN_ORDER (6)
-#define KMALLOC_SIZE_MAX_ORDER (18)
-
-static slab_allocator_t
-    *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
-
-/* Note that kmalloc_allocator_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+    long npages_freed = 0;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&slab_allocators_lock);
+    for (slab_allocator_t *a = slab_allocators;
+         a && (target < 0 || npages_freed < target); a = a->sa_next)
+    {
+        spinlock_lock(&a->sa_lock);
+        /* Other cores' magazines are theirs to use without the lock */
+        _slab_cpu_drain(a, &a->sa_cpu[curcore.kc_id]);
+        _slab_depot_drain(a);
+        npages_freed += _slab_allocator_reclaim(
+            a, SLAB_RECLAIM_KEEP, target < 0 ? -1 : target - npages_freed);
+        spinlock_unlock(&a->sa_lock);
+    }
+    spinlock_unlock(&slab_allocators_lock);
+    if (enabled)
+        intr_enable();
+    return npages_freed;
+}
+
+/*
+ * Number of objects held in the magazines of allocator. The other cores'
+ * magazines are read without their owners' cooperation, so this is only a
+ * snapshot.
+ *
+ * allocator must be locked
+ */
+static size_t _slab_cached_objs(slab_allocator_t *allocator)
+{
+    size_t cached = 0;
+    for (slab_magazine_t *mag = allocator->sa_depot_full; mag;
+         mag = mag->sm_next)
+    {
+        cached += mag->sm_rounds;
+    }
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        slab_cpu_t *cpu = &allocator->sa_cpu[id];
+        if (cpu->sc_loaded)
+            cached += cpu->sc_loaded->sm_rounds;
+        if (cpu->sc_previous)
+            cached += cpu->sc_previous->sm_rounds;
+    }
+    return cached;
+}
+
+size_t slab_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    iprintf(&buf, &size, "%-16s %7s %8s %8s %7s %6s %7s %8s\n", "NAME",
+            "OBJSIZE", "INUSE", "TOTAL", "CACHED", "SLABS", "PAGES", "WASTE");
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&slab_allocators_lock);
+    for (slab_allocator_t *a = slab_allocators; a; a = a->sa_next)
+    {
+        size_t nslabs = 0, inuse = 0;
+        spinlock_lock(&a->sa_lock);
+        for (struct slab *slab = a->sa_slabs; slab; slab = slab->s_next)
+        {
+            nslabs++;
+            inuse += slab->s_inuse;
+        }
+        size_t cached = _slab_cached_objs(a);
+        spinlock_unlock(&a->sa_lock);
+
+        iprintf(&buf, &size, "%-16s %7lu %8lu %8lu %7lu %6lu %7lu %8lu\n",
+                a->sa_name, a->sa_objsize, inuse - MIN(inuse, cached),
+                nslabs * a->sa_slab_nobjs, cached, nslabs,
+                nslabs << a->sa_order,
+                nslabs * _slab_waste(a->sa_objsize, a->sa_order));
+    }
+    spinlock_unlock(&slab_allocators_lock);
+    if (enabled)
+        intr_enable();
+    return size;
+}
+
+static size_t slab_shrink(page_shrinker_t *shrinker, size_t target)
+{
+    return (size_t)slab_allocators_reclaim((long)target);
+}
+
+static page_shrinker_t slab_shrinker = {.ps_shrink = slab_shrink};
+
+/*
+ * kmalloc size classes. Between the powers of two sit classes at 1.5 times
+ * the one below, so that a request wastes at most a third of its object.
+ * Note that kmalloc_allocator_names should be modified to remain consistent
+ * with kmalloc_sizes.
  */
+static const size_t kmalloc_sizes[] = {
+    16,    32,    48,    64,    96,    128,   192,    256,    384,
+    512,   768,   1024,  1536,  2048,  3072,  4096,   8192,   16384,
+    32768, 65536, 131072, 262144};
 static const char *kmalloc_allocator_names[] = {
-    "size-64", "size-128", "size-256", "size-512", "size-1024",
-    "size-2048", "size-4096", "size-8192", "size-16384", "size-32768",
-    "size-65536", "size-131072", "size-262144"};
+    "size-16",     "size-32",    "size-48",    "size-64",    "size-96",
+    "size-128",    "size-192",   "size-256",   "size-384",   "size-512",
+    "size-768",    "size-1024",  "size-1536",  "size-2048",  "size-3072",
+    "size-4096",   "size-8192",  "size-16384", "size-32768", "size-65536",
+    "size-131072", "size-262144"};
+#define KMALLOC_NCLASSES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
 
-void *kmalloc(size_t size)
+static slab_allocator_t *kmalloc_allocators[KMALLOC_NCLASSES];
+
+/*
+ * Requests up to KMALLOC_SMALL_MAX bytes find their class with one lookup in
+ * kmalloc_small_class, indexed by the size in KMALLOC_SMALL_ALIGN-byte units
+ * (rounded up). Larger ones search the remaining classes.
+ */
+#define KMALLOC_SMALL_ALIGN 16
+#define KMALLOC_SMALL_MAX 1024
+static uint8_t kmalloc_small_class[KMALLOC_SMALL_MAX / KMALLOC_SMALL_ALIGN + 1];
+
+/*
+ * Objects handed out by kmalloc carry no header. Instead, every physical page
+ * backing a kmalloc slab is tagged here with 1 + the size class of its
+ * allocator (0 for all other pages), which is how kfree finds the allocator.
+ * The tags of a slab are written when it is grown and cleared when it is
+ * reclaimed, both under its allocator's lock; a page's tag cannot change
+ * while kmalloc'd objects live on it, so kfree reads it without a lock.
+ */
+static uint8_t *kmalloc_page_class;
+
+static inline size_t _kmalloc_page_index(void *addr)
 {
-    size += sizeof(slab_allocator_t *);
+    return ((uintptr_t)addr - (uintptr_t)physmap_start()) >> PAGE_SHIFT;
+}
 
-    /*
-     * Find the first power of two bucket bigger than the
-     * requested size, and allocate from it.
-     */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
+static void _kmalloc_mark_pages(slab_allocator_t *allocator, void *addr,
+                                uint8_t class)
+{
+    if (allocator->sa_kmalloc_class)
+    {
+        memset(&kmalloc_page_class[_kmalloc_page_index(addr)], class,
+               1UL << allocator->sa_order);
+    }
+}
+
+static inline size_t _kmalloc_class(size_t size)
+{
+    if (size <= KMALLOC_SMALL_MAX)
+    {
+        return kmalloc_small_class[(size + KMALLOC_SMALL_ALIGN - 1) /
+                                   KMALLOC_SMALL_ALIGN];
+    }
+    size_t class = kmalloc_small_class[KMALLOC_SMALL_MAX / KMALLOC_SMALL_ALIGN];
+    while (class < KMALLOC_NCLASSES && kmalloc_sizes[class] < size)
+    {
+        class++;
+    }
+    return class;
+}
+
+#ifdef __KMALLOC_PROFILE__
+/*
+ * The kmalloc profiler (KMALLOC_PROFILE=1) counts what each caller of kmalloc
+ * allocates and frees. kmalloc_sites is a hash table from the caller's
+ * return address to its counters, the first entry standing for every caller
+ * that did not fit; kmalloc_objs is one from the address of each live object
+ * to its size and caller, so that kfree can tell whose it was. Both use
+ * linear probing: the sites are never removed, the objects are removed by
+ * shifting the entries after them back, and an object that finds the table
+ * three quarters full is not tracked (kmalloc_untracked), its free being
+ * ignored. Both are protected by kmalloc_profile_lock, taken with interrupts
+ * disabled.
+ */
+#define KMALLOC_PROFILE_SITES 1024
+#define KMALLOC_PROFILE_OBJS 65536
+
+typedef struct kmalloc_obj
+{
+    uintptr_t ko_addr; /* 0 if the entry is free */
+    uint32_t ko_size;
+    uint32_t ko_site; /* index into kmalloc_sites */
+} kmalloc_obj_t;
+
+static kmalloc_site_t *kmalloc_sites;
+static kmalloc_obj_t *kmalloc_objs;
+static size_t kmalloc_nobjs;
+static uint64_t kmalloc_untracked;
+static spinlock_t kmalloc_profile_lock =
+    SPINLOCK_INITIALIZER(kmalloc_profile_lock);
+
+#define KMALLOC_SITES_PAGES \
+    ADDR_TO_PN(PAGE_ALIGN_UP(KMALLOC_PROFILE_SITES * sizeof(kmalloc_site_t)))
+#define KMALLOC_OBJS_PAGES \
+    ADDR_TO_PN(PAGE_ALIGN_UP(KMALLOC_PROFILE_OBJS * sizeof(kmalloc_obj_t)))
+
+static inline size_t _kmalloc_profile_hash(uintptr_t key, size_t nentries)
+{
+    return (size_t)((key * 0x9e3779b97f4a7c15UL) >> 32) & (nentries - 1);
+}
+
+static void _kmalloc_profile_init()
+{
+    kmalloc_sites = page_alloc_n(KMALLOC_SITES_PAGES);
+    kmalloc_objs = page_alloc_n(KMALLOC_OBJS_PAGES);
+    if (!kmalloc_sites || !kmalloc_objs)
     {
-        if ((1UL << order) >= size)
+        panic("Couldn't allocate the kmalloc profile!\n");
+    }
+    memset(kmalloc_sites, 0, KMALLOC_PROFILE_SITES * sizeof(kmalloc_site_t));
+    memset(kmalloc_objs, 0, KMALLOC_PROFILE_OBJS * sizeof(kmalloc_obj_t));
+}
+
+/* The index of caller's counters, or 0 if there is no room for them */
+static uint32_t _kmalloc_profile_site(void *caller)
+{
+    size_t i = _kmalloc_profile_hash((uintptr_t)caller, KMALLOC_PROFILE_SITES);
+    for (size_t n = 0; n < KMALLOC_PROFILE_SITES; n++)
+    {
+        if (i && kmalloc_sites[i].ks_caller == caller)
+        {
+            return (uint32_t)i;
+        }
+        if (i && !kmalloc_sites[i].ks_caller)
         {
-            void *addr = slab_obj_alloc(*cs);
-            if (!addr)
+            kmalloc_sites[i].ks_caller = caller;
+            return (uint32_t)i;
+        }
+        i = (i + 1) & (KMALLOC_PROFILE_SITES - 1);
+    }
+    return 0;
+}
+
+static void _kmalloc_profile_alloc(void *addr, size_t size, void *caller)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&kmalloc_profile_lock);
+
+    uint32_t site = _kmalloc_profile_site(caller);
+    kmalloc_site_t *ks = &kmalloc_sites[site];
+    ks->ks_allocs++;
+    ks->ks_bytes += size;
+    if (kmalloc_nobjs < KMALLOC_PROFILE_OBJS / 4 * 3)
+    {
+        size_t i =
+            _kmalloc_profile_hash((uintptr_t)addr, KMALLOC_PROFILE_OBJS);
+        while (kmalloc_objs[i].ko_addr)
+        {
+            i = (i + 1) & (KMALLOC_PROFILE_OBJS - 1);
+        }
+        kmalloc_objs[i].ko_addr = (uintptr_t)addr;
+        kmalloc_objs[i].ko_size = (uint32_t)size;
+        kmalloc_objs[i].ko_site = site;
+        kmalloc_nobjs++;
+        ks->ks_live += size;
+        ks->ks_peak = MAX(ks->ks_peak, ks->ks_live);
+    }
+    else
+    {
+        kmalloc_untracked++;
+    }
+
+    spinlock_unlock(&kmalloc_profile_lock);
+    if (enabled)
+        intr_enable();
+}
+
+static void _kmalloc_profile_free(void *addr)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&kmalloc_profile_lock);
+
+    size_t mask = KMALLOC_PROFILE_OBJS - 1;
+    size_t i = _kmalloc_profile_hash((uintptr_t)addr, KMALLOC_PROFILE_OBJS);
+    while (kmalloc_objs[i].ko_addr && kmalloc_objs[i].ko_addr != (uintptr_t)addr)
+    {
+        i = (i + 1) & mask;
+    }
+    if (kmalloc_objs[i].ko_addr)
+    {
+        kmalloc_site_t *ks = &kmalloc_sites[kmalloc_objs[i].ko_site];
+        ks->ks_frees++;
+        ks->ks_live -= kmalloc_objs[i].ko_size;
+        kmalloc_nobjs--;
+
+        /* Move back each later entry of the run that may now sit in i */
+        for (size_t j = (i + 1) & mask; kmalloc_objs[j].ko_addr;
+             j = (j + 1) & mask)
+        {
+            size_t home = _kmalloc_profile_hash(kmalloc_objs[j].ko_addr,
+                                                KMALLOC_PROFILE_OBJS);
+            if (((j - home) & mask) >= ((j - i) & mask))
             {
-                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                return NULL;
+                kmalloc_objs[i] = kmalloc_objs[j];
+                i = j;
             }
-#ifdef MM_POISON
-            memset(addr, MM_POISON_ALLOC, size);
-#endif /* MM_POISON */
-            *((slab_allocator_t **)addr) = *cs;
-            return (void *)(((slab_allocator_t **)addr) + 1);
         }
+        kmalloc_objs[i].ko_addr = 0;
     }
 
-    panic("size bigger than maxorder %ld\n", size);
+    spinlock_unlock(&kmalloc_profile_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Copies the counters of the callers with the most bytes live into out,
+ * most first, and sets *untracked to the allocations there was no room to
+ * track. A caller of NULL stands for all those that did not fit.
+ */
+size_t kmalloc_profile_top(kmalloc_site_t *out, size_t max,
+                           uint64_t *untracked)
+{
+    size_t n = 0;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&kmalloc_profile_lock);
+    for (size_t s = 0; s < KMALLOC_PROFILE_SITES; s++)
+    {
+        kmalloc_site_t *ks = &kmalloc_sites[s];
+        if (!ks->ks_allocs)
+        {
+            continue;
+        }
+        /* insertion sort into out[], dropping whatever falls off the end */
+        size_t i = n < max ? n++ : max;
+        while (i > 0 && out[i - 1].ks_live < ks->ks_live)
+        {
+            if (i < max)
+                out[i] = out[i - 1];
+            i--;
+        }
+        if (i < max)
+            out[i] = *ks;
+    }
+    *untracked = kmalloc_untracked;
+    spinlock_unlock(&kmalloc_profile_lock);
+    if (enabled)
+        intr_enable();
+    return n;
+}
+#endif /* __KMALLOC_PROFILE__ */
+
+void *kmalloc(size_t size)
+{
+    size_t class = _kmalloc_class(size);
+    void *addr = class < KMALLOC_NCLASSES
+                     ? slab_obj_alloc(kmalloc_allocators[class])
+                     : vmalloc(size);
+    if (!addr)
+    {
+        dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+        return NULL;
+    }
+#ifdef __KMALLOC_PROFILE__
+    _kmalloc_profile_alloc(addr, size, __builtin_return_address(0));
+#endif
+#ifdef MM_POISON
+    memset(addr, MM_POISON_ALLOC, size);
+#endif /* MM_POISON */
+    return addr;
 }
 
 __attribute__((used)) static void *malloc(size_t size)
@@ -495,8 +1181,21 @@ __attribute__((used)) static void *malloc(size_t size)
 
 void kfree(void *addr)
 {
-    addr = (void *)(((slab_allocator_t **)addr) - 1);
-    slab_allocator_t *sa = *(slab_allocator_t **)addr;
+#ifdef __KMALLOC_PROFILE__
+    /* Before the object can be handed out again */
+    _kmalloc_profile_free(addr);
+#endif
+
+    if (IS_VMALLOC_ADDR(addr))
+    {
+        vfree(addr);
+        return;
+    }
+
+    KASSERT(addr >= physmap_start() && addr < physmap_end());
+    uint8_t class = kmalloc_page_class[_kmalloc_page_index(addr)];
+    KASSERT(class && "kfree of memory not from kmalloc");
+    slab_allocator_t *sa = kmalloc_allocators[class - 1];
 
 #ifdef MM_POISON
     /* If poisoning is enabled, wipe the memory given in
@@ -525,22 +1224,47 @@ void slab_init()
     /* Special case initialization of the allocator for `slab_allocator_t`s */
     /* In other words, initializes a slab allocator for other slab allocators. */
     _allocator_init(&slab_allocator_allocator, "slab_allocators",
-                    sizeof(slab_allocator_t));
+                    sizeof(slab_allocator_t), 0);
+    _allocator_init(&slab_magazine_allocator, "slab_magazines",
+                    sizeof(slab_magazine_t), 0);
+    page_shrinker_register(&slab_shrinker);
+
+    size_t npages = ADDR_TO_PN((uintptr_t)physmap_end() -
+                               (uintptr_t)physmap_start());
+    kmalloc_page_class = page_alloc_n(ADDR_TO_PN(PAGE_ALIGN_UP(npages)));
+    if (!kmalloc_page_class)
+    {
+        panic("Couldn't allocate the kmalloc page tags!\n");
+    }
+    memset(kmalloc_page_class, 0, npages);
+#ifdef __KMALLOC_PROFILE__
+    _kmalloc_profile_init();
+#endif
 
     /*
-     * Allocate the power of two buckets for generic
-     * kmalloc/kfree.
+     * Allocate the size classes for generic kmalloc/kfree.
      */
-    slab_allocator_t **cs = kmalloc_allocators;
-    for (size_t order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER;
-         order++, cs++)
-    {
-        if (NULL ==
-            (*cs = slab_allocator_create(
-                 kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER],
-                 (1UL << order))))
+    size_t class = 0;
+    for (size_t i = 0; i <= KMALLOC_SMALL_MAX / KMALLOC_SMALL_ALIGN; i++)
+    {
+        while (kmalloc_sizes[class] < i * KMALLOC_SMALL_ALIGN)
+        {
+            class++;
+        }
+        kmalloc_small_class[i] = (uint8_t)class;
+    }
+    for (class = 0; class < KMALLOC_NCLASSES; class++)
+    {
+        slab_allocator_t *sa = slab_allocator_create(
+            kmalloc_allocator_names[class], kmalloc_sizes[class]);
+        if (!sa)
         {
             panic("Couldn't create kmalloc allocators!\n");
         }
+        sa->sa_kmalloc_class = (uint8_t)(class + 1);
+        kmalloc_allocators[class] = sa;
     }
+
+    /* Requests bigger than the largest class go to vmalloc. */
+    vmalloc_init();
 }
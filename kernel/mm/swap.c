@@ -0,0 +1,229 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/stripe.h"
+#include "main/interrupt.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/swap.h"
+#include "proc/spinlock.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+/*
+ * Swap: when memory runs short, the page cache reclaimer (see pframe.c)
+ * pages out anonymous and shadow object pages as well as file pages. They
+ * go to the first __SWAP_BLOCKS__ blocks of the last disk, which is only
+ * used this way when there is more than one.
+ *
+ * A paged out pframe stays in its object with pf_addr NULL and pf_swap the
+ * slot that holds its contents, plus one. The next get_pframe finds it
+ * there and has the object's fill_pframe read it back in, through
+ * swap_in_pframe, which frees the slot again: a page has a slot only while
+ * it is out, so the copy in memory never has to be compared with one on
+ * the disk.
+ *
+ * swap_map has a bit for each slot, set while the slot is taken. It and
+ * the counters are protected by swap_lock, taken with interrupts disabled.
+ */
+static blockdev_t *swap_dev;
+static size_t swap_nslots;
+static uint64_t *swap_map;
+static size_t swap_nused;
+static size_t swap_next; /* where the search for a free slot starts */
+static spinlock_t swap_lock = SPINLOCK_INITIALIZER(swap_lock);
+
+static uint64_t swap_nouts; /* pages written out */
+static uint64_t swap_nins;  /* pages read back in */
+
+#define SWAP_MAP_BITS (sizeof(uint64_t) * 8)
+
+void swap_init()
+{
+#ifdef __SWAP__
+    if (__NDISKS__ < 2 || __NDISKS__ - 1 <= __STRIPE_DISKS__)
+    {
+        return; /* no disk to spare, or it is striped */
+    }
+    swap_dev = blockdev_lookup(MKDEVID(DISK_MAJOR, __NDISKS__ - 1));
+    if (!swap_dev)
+    {
+        dbg(DBG_INIT, "no swap disk, anonymous memory stays in memory\n");
+        return;
+    }
+    swap_nslots = __SWAP_BLOCKS__;
+    size_t size = (swap_nslots + SWAP_MAP_BITS - 1) / SWAP_MAP_BITS *
+                  sizeof(uint64_t);
+    swap_map = kmalloc(size);
+    KASSERT(swap_map && "failed to allocate the swap map");
+    memset(swap_map, 0, size);
+    dbg(DBG_INIT, "swapping to disk %d, %lu pages\n", __NDISKS__ - 1,
+        swap_nslots);
+#endif
+}
+
+/* Whether there is a swap area. Decided once and for all by swap_init. */
+long swap_enabled() { return swap_dev != NULL; }
+
+/* Takes a free slot, or returns -ENOSPC if there is none. */
+static ssize_t _swap_slot_alloc()
+{
+    ssize_t slot = -ENOSPC;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&swap_lock);
+    for (size_t n = 0; swap_nused < swap_nslots && n < swap_nslots; n++)
+    {
+        size_t i = (swap_next + n) % swap_nslots;
+        uint64_t bit = 1UL << (i % SWAP_MAP_BITS);
+        if (!(swap_map[i / SWAP_MAP_BITS] & bit))
+        {
+            swap_map[i / SWAP_MAP_BITS] |= bit;
+            swap_nused++;
+            swap_next = i + 1;
+            slot = (ssize_t)i;
+            break;
+        }
+    }
+    spinlock_unlock(&swap_lock);
+    if (enabled)
+        intr_enable();
+    return slot;
+}
+
+static void _swap_slot_free(size_t slot)
+{
+    KASSERT(slot < swap_nslots);
+    uint64_t bit = 1UL << (slot % SWAP_MAP_BITS);
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&swap_lock);
+    KASSERT(swap_map[slot / SWAP_MAP_BITS] & bit);
+    swap_map[slot / SWAP_MAP_BITS] &= ~bit;
+    swap_nused--;
+    spinlock_unlock(&swap_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Called by mobj_evict_pframe to page out pf, a pframe of o, which is an
+ * anonymous or shadow object. Both are locked. First pf is taken out of
+ * the address spaces that map it (see vmmap_unmap_pframe); if it is in use
+ * there, it is left for a later pass. Otherwise its contents are written
+ * to a free slot, its page is freed, and it leaves the LRU until it is
+ * read back in.
+ *
+ * Returns 1 if a page of memory was freed and 0 otherwise.
+ */
+long swap_out_pframe(mobj_t *o, pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(MOBJ_SWAPPABLE(o));
+    if (!swap_dev || !pf->pf_addr || pf->pf_pincount)
+    {
+        return 0;
+    }
+    if (pf->pf_mapcount &&
+        vmmap_unmap_pframe(o, pf->pf_pagenum,
+                           pt_virt_to_phys((uintptr_t)pf->pf_addr), 0))
+    {
+        return 0;
+    }
+    /* Mappings the walk could not get at keep the page where it is. */
+    if (pframe_pinned(pf))
+    {
+        return 0;
+    }
+
+    ssize_t slot = _swap_slot_alloc();
+    if (slot < 0)
+    {
+        return 0;
+    }
+    long ret = blockdev_write(swap_dev, pf->pf_addr, (blocknum_t)slot, 1);
+    if (ret)
+    {
+        dbg(DBG_PFRAME, "writing page %lu of mobj 0x%p to swap failed: %ld\n",
+            pf->pf_pagenum, o, ret);
+        _swap_slot_free((size_t)slot);
+        return 0;
+    }
+    pframe_clear_dirty(pf);
+    pframe_lru_remove(pf);
+    page_free(pf->pf_addr);
+    pf->pf_addr = NULL;
+    pf->pf_swap = (size_t)slot + 1;
+    swap_nouts++;
+    return 1;
+}
+
+/*
+ * Reads the contents of pf, which is locked, back in from its slot, into
+ * the page pf_addr now points to, and frees the slot. For the fill_pframe
+ * of swappable objects, when they find pf_swap set. pf goes back on the
+ * LRU.
+ *
+ * Returns 0 on success, or the error reading the block, in which case pf
+ * keeps its slot.
+ */
+long swap_in_pframe(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_swap && pf->pf_addr);
+    size_t slot = pf->pf_swap - 1;
+    long ret = blockdev_read(swap_dev, pf->pf_addr, (blocknum_t)slot, 1);
+    if (ret)
+    {
+        return ret;
+    }
+    pf->pf_swap = 0;
+    _swap_slot_free(slot);
+    pframe_lru_add(pf);
+    swap_nins++;
+    return 0;
+}
+
+/*
+ * Frees the slot of pf, which is locked, if it has one, for a pframe that
+ * is going away without being read back in.
+ */
+void swap_discard_pframe(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (pf->pf_swap)
+    {
+        _swap_slot_free(pf->pf_swap - 1);
+        pf->pf_swap = 0;
+    }
+}
+
+/*
+ * Prints how much of the swap area is in use and how many pages have gone
+ * out and come back in. Follows the proc_info convention: arg must be NULL,
+ * and the number of bytes of buf left unused is returned.
+ */
+size_t swap_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    if (!swap_dev)
+    {
+        iprintf(&buf, &size, "\nSWAP: none\n");
+        return size;
+    }
+    iprintf(&buf, &size, "\nSWAP: %lu of %lu pages used, %lu out, %lu in\n",
+            swap_nused, swap_nslots, swap_nouts, swap_nins);
+    return size;
+}
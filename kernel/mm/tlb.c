@@ -0,0 +1,160 @@
+#include "globals.h"
+#include "types.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+#include "util/debug.h"
+
+/*
+ * One shootdown is in flight at a time. Its initiator holds tlb_lock,
+ * publishes the batch in tlb_request and the cores that have to act on it in
+ * tlb_pending, broadcasts the IPI and spins until every one of them has
+ * cleared its bit. The batch lives on the initiator's stack, which is safe
+ * because nobody looks at it once their bit is clear.
+ */
+static spinlock_t tlb_lock = SPINLOCK_INITIALIZER(tlb_lock);
+static const tlb_batch_t *tlb_request;
+static volatile uint64_t tlb_pending;
+
+void tlb_batch_init(tlb_batch_t *batch, pml4_t *pml4)
+{
+    batch->tb_pml4 = pml4;
+    batch->tb_all = 0;
+    batch->tb_npages = 0;
+    batch->tb_nranges = 0;
+}
+
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t vaddr, size_t count)
+{
+    if (batch->tb_all || !count)
+    {
+        return;
+    }
+    batch->tb_npages += count;
+    if (batch->tb_npages > TLB_SHOOTDOWN_MAX_PAGES ||
+        batch->tb_nranges == TLB_BATCH_RANGES)
+    {
+        tlb_batch_add_all(batch);
+        return;
+    }
+    batch->tb_ranges[batch->tb_nranges].tr_vaddr = vaddr;
+    batch->tb_ranges[batch->tb_nranges].tr_count = count;
+    batch->tb_nranges++;
+}
+
+void tlb_batch_add_all(tlb_batch_t *batch)
+{
+    batch->tb_all = 1;
+    batch->tb_nranges = 0;
+}
+
+/* Applies batch to this core's TLB, if this core can be caching it. */
+static void tlb_batch_flush_local(const tlb_batch_t *batch)
+{
+    if (batch->tb_pml4 && batch->tb_pml4 != pt_get())
+    {
+        // Entries from when it last ran here may still be tagged with its
+        // PCID
+        if (batch->tb_all)
+        {
+            pt_pcid_flush(batch->tb_pml4, 0, 0);
+        }
+        for (size_t i = 0; i < batch->tb_nranges; i++)
+        {
+            pt_pcid_flush(batch->tb_pml4, batch->tb_ranges[i].tr_vaddr,
+                          batch->tb_ranges[i].tr_count);
+        }
+        return;
+    }
+    if (batch->tb_all)
+    {
+        tlb_flush_all();
+        return;
+    }
+    for (size_t i = 0; i < batch->tb_nranges; i++)
+    {
+        tlb_flush_range(batch->tb_ranges[i].tr_vaddr,
+                        batch->tb_ranges[i].tr_count);
+    }
+}
+
+static void tlb_shootdown_ack()
+{
+    uint64_t bit = 1UL << curcore.kc_id;
+    if (tlb_pending & bit)
+    {
+        tlb_batch_flush_local(tlb_request);
+        __sync_fetch_and_and(&tlb_pending, ~bit);
+    }
+}
+
+static long tlb_shootdown_handler(regs_t *regs)
+{
+    tlb_shootdown_ack();
+    return 0;
+}
+
+void tlb_batch_flush(tlb_batch_t *batch)
+{
+    if (!batch->tb_all && !batch->tb_nranges)
+    {
+        return;
+    }
+    tlb_batch_flush_local(batch);
+
+    uint64_t others = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (id != curcore.kc_id && csd_vaddr_table[id])
+        {
+            others |= 1UL << id;
+        }
+    }
+    if (others)
+    {
+        long enabled = intr_enabled() != 0;
+        intr_disable();
+        // Another core's shootdown may be waiting on this one, so keep
+        // answering it while waiting for the lock
+        while (!spinlock_trylock(&tlb_lock))
+        {
+            tlb_shootdown_ack();
+            __asm__ volatile("pause");
+        }
+        tlb_request = batch;
+        __sync_synchronize();
+        tlb_pending = others;
+        apic_broadcast_ipi(DESTINATION_MODE_FIXED, INTR_TLB_SHOOTDOWN, 0);
+        while (tlb_pending)
+        {
+            __asm__ volatile("pause");
+        }
+        tlb_request = NULL;
+        spinlock_unlock(&tlb_lock);
+        if (enabled)
+        {
+            intr_enable();
+        }
+    }
+    tlb_batch_init(batch, batch->tb_pml4);
+}
+
+void tlb_shootdown(pml4_t *pml4, uintptr_t vaddr, size_t count)
+{
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+    tlb_batch_add(&batch, vaddr, count);
+    tlb_batch_flush(&batch);
+}
+
+void tlb_shootdown_all(pml4_t *pml4)
+{
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, pml4);
+    tlb_batch_add_all(&batch);
+    tlb_batch_flush(&batch);
+}
+
+void tlb_init() { intr_register(INTR_TLB_SHOOTDOWN, tlb_shootdown_handler); }
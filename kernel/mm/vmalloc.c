@@ -0,0 +1,184 @@
+/*
+ * vmalloc.c - virtually contiguous kernel memory
+ *
+ * Large kernel buffers are built out of individual pages mapped side by side
+ * in [VMALLOC_START, VMALLOC_END), so that they don't depend on the buddy
+ * allocator finding a physically contiguous block. An unmapped guard page
+ * follows every area to catch overruns, which, since areas are packed
+ * together, also leaves one below every area to catch underruns.
+ */
+
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+#include "main/interrupt.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/slab.h"
+#include "mm/tlb.h"
+#include "mm/vmalloc.h"
+#include "proc/spinlock.h"
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+
+typedef struct vmalloc_area
+{
+    uintptr_t va_start; /* first address of the area */
+    size_t va_npages;   /* number of pages mapped, not counting the guard */
+    list_link_t va_link; /* link on vmalloc_areas */
+} vmalloc_area_t;
+
+/* All areas, sorted by address, protected by vmalloc_lock. */
+static list_t vmalloc_areas = LIST_INITIALIZER(vmalloc_areas);
+static spinlock_t vmalloc_lock = SPINLOCK_INITIALIZER(vmalloc_lock);
+
+static slab_allocator_t *vmalloc_area_allocator;
+
+void vmalloc_init()
+{
+    vmalloc_area_allocator =
+        slab_allocator_create("vmalloc_area", sizeof(vmalloc_area_t));
+    KASSERT(vmalloc_area_allocator);
+
+    /* Every page table made from here on is a clone of this one and links to
+     * the same table for the vmalloc range. */
+    pml4_t *pml4 = pt_get();
+    KASSERT(!IS_PRESENT(pml4->phys[PML4E(VMALLOC_START)]));
+    pdp_t *pdp = page_alloc();
+    if (!pdp)
+    {
+        panic("Couldn't allocate the vmalloc page table!\n");
+    }
+    memset(pdp, 0, PAGE_SIZE);
+    pml4->phys[PML4E(VMALLOC_START)] =
+        ((uintptr_t)pdp - PHYS_OFFSET) | PT_PRESENT | PT_WRITE;
+}
+
+/*
+ * Reserves npages pages of virtual address space (plus a guard page) for
+ * area, first fit.
+ */
+static long _vmalloc_reserve(vmalloc_area_t *area, size_t npages)
+{
+    long ret = -ENOMEM;
+    uintptr_t start = VMALLOC_START;
+    size_t len = (npages + 1) << PAGE_SHIFT;
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vmalloc_lock);
+    list_iterate(&vmalloc_areas, cur, vmalloc_area_t, va_link)
+    {
+        if (cur->va_start - start >= len)
+        {
+            area->va_start = start;
+            list_insert_before(&cur->va_link, &area->va_link);
+            ret = 0;
+            break;
+        }
+        start = cur->va_start + ((cur->va_npages + 1) << PAGE_SHIFT);
+    }
+    if (ret && VMALLOC_END - start >= len)
+    {
+        area->va_start = start;
+        list_insert_tail(&vmalloc_areas, &area->va_link);
+        ret = 0;
+    }
+    area->va_npages = npages;
+    spinlock_unlock(&vmalloc_lock);
+    if (enabled)
+        intr_enable();
+    return ret;
+}
+
+/*
+ * Unmaps and frees the first npages pages of area, then gives its address
+ * range back.
+ */
+static void _vmalloc_release(vmalloc_area_t *area, size_t npages)
+{
+    pml4_t *pml4 = pt_get();
+    uintptr_t vaddr = area->va_start;
+    for (size_t i = 0; i < npages; i++, vaddr += PAGE_SIZE)
+    {
+        uintptr_t paddr = pt_virt_to_phys_helper(pml4, vaddr);
+        pt_unmap(pml4, vaddr);
+        tlb_flush(vaddr);
+        page_free((void *)(paddr + PHYS_OFFSET));
+    }
+
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vmalloc_lock);
+    list_remove(&area->va_link);
+    spinlock_unlock(&vmalloc_lock);
+    if (enabled)
+        intr_enable();
+    slab_obj_free(vmalloc_area_allocator, area);
+}
+
+void *vmalloc(size_t size)
+{
+    size_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+    KASSERT(npages);
+
+    vmalloc_area_t *area = slab_obj_alloc(vmalloc_area_allocator);
+    if (!area)
+    {
+        return NULL;
+    }
+    list_link_init(&area->va_link);
+    if (_vmalloc_reserve(area, npages))
+    {
+        slab_obj_free(vmalloc_area_allocator, area);
+        return NULL;
+    }
+
+    pml4_t *pml4 = pt_get();
+    uintptr_t vaddr = area->va_start;
+    for (size_t i = 0; i < npages; i++, vaddr += PAGE_SIZE)
+    {
+        void *page = page_alloc();
+        if (!page || pt_map(pml4, (uintptr_t)page - PHYS_OFFSET, vaddr,
+                            PT_PRESENT | PT_WRITE,
+                            PT_PRESENT | PT_WRITE | PT_GLOBAL))
+        {
+            if (page)
+            {
+                page_free(page);
+            }
+            _vmalloc_release(area, i);
+            dbg(DBG_MM, "WARNING: vmalloc out of memory\n");
+            return NULL;
+        }
+    }
+
+    dbg(DBG_MM, "vmalloc'd %lu pages at 0x%p\n", npages,
+        (void *)area->va_start);
+    return (void *)area->va_start;
+}
+
+void vfree(void *addr)
+{
+    KASSERT(IS_VMALLOC_ADDR(addr) && PAGE_ALIGNED(addr));
+
+    vmalloc_area_t *area = NULL;
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&vmalloc_lock);
+    list_iterate(&vmalloc_areas, cur, vmalloc_area_t, va_link)
+    {
+        if (cur->va_start == (uintptr_t)addr)
+        {
+            area = cur;
+            break;
+        }
+    }
+    spinlock_unlock(&vmalloc_lock);
+    if (enabled)
+        intr_enable();
+
+    KASSERT(area && "vfree of memory not from vmalloc");
+    _vmalloc_release(area, area->va_npages);
+}
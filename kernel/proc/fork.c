@@ -10,12 +10,16 @@
 #include "mm/pframe.h"
 #include "mm/tlb.h"
 
+#include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
 #include "vm/shadow.h"
 
+#include "api/binfmt.h"
 #include "api/exec.h"
 
+#include "main/gdt.h"
+
 /* Pushes the appropriate things onto the kernel stack of a newly forked thread
  * so that it can begin execution in userland_entry.
  * regs: registers the new thread should have on execution
@@ -50,8 +54,9 @@ static uintptr_t fork_setup_stack(const regs_t *regs, void *kstack)
  *    c) Before the process begins execution in userland_entry, 
  *       we need to push all registers onto the kernel stack of the kthread. 
  *       Use fork_setup_stack to do this, and set RSP accordingly. 
- *    d) Use pt_unmap_range and tlb_flush_all on the parent in advance of
- *       copy-on-write.
+ *    d) Shadow the private mappings on both sides and write protect the
+ *       parent's pages (see pt_write_protect_range) for copy-on-write. The
+ *       child's page table starts out empty and is filled in by faults.
  * 5) Prepare the child process to be run on the CPU.
  * 6) Return the child's process id to the parent.
  */
@@ -81,27 +86,83 @@ long do_fork(struct regs *regs)
         proc_destroy(child_proc);
         return -ENOMEM;
     }
+    vmmap_destroy(&child_proc->p_vmmap);
     child_proc->p_vmmap = child_vmmap;
-    
-    // Set up copy-on-write for shared memory objects
+    child_vmmap->vmm_proc = child_proc;
+
+    // Set up copy-on-write for private mappings. Both sides get a fresh
+    // shadow object on top of the old one, so neither sees the other's
+    // writes, and the parent's pages are write protected rather than
+    // unmapped so that reads keep hitting the existing mappings.
+    long ret = 0;
+    vmmap_t *map = curproc->p_vmmap;
+    krwlock_write_lock(&map->vmm_lock);
+    list_link_t *clink = child_vmmap->vmm_list.l_next;
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, curproc->p_pml4);
     vmarea_t *vma;
-    list_iterate(&child_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-        if (!(vma->vma_flags & MAP_SHARED)) {
-            // Create shadow objects for private mappings
-            mobj_t *shadow_obj = shadow_create(vma->vma_obj);
-            if (!shadow_obj) {
-                vmmap_destroy(&child_vmmap);
-                kthread_destroy(child_thread);
-                proc_destroy(child_proc);
-                return -ENOMEM;
+    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        vmarea_t *child_vma = list_item(clink, vmarea_t, vma_plink);
+        clink = clink->l_next;
+        if (vma->vma_flags & MAP_SHARED) {
+            continue;
+        }
+
+        // Keep the chain the new shadows go on top of short: fold in what
+        // nothing else shares, and copy out the rest if still too deep
+        long flattened = 0;
+        if (vma->vma_obj->mo_type == MOBJ_SHADOW) {
+            mobj_lock(vma->vma_obj);
+            shadow_collapse(vma->vma_obj);
+            if (shadow_depth(vma->vma_obj) >= SHADOW_MAX_DEPTH) {
+                flattened = !shadow_flatten(vma->vma_obj);
+            }
+            mobj_unlock(vma->vma_obj);
+        }
+
+        mobj_t *psh = shadow_create(vma->vma_obj);
+        mobj_t *csh = psh ? shadow_create(vma->vma_obj) : NULL;
+        if (!csh) {
+            if (psh) {
+                mobj_put(&psh);
             }
-            
-            // Replace the original object with shadow object
-            mobj_ref(shadow_obj);
-            vma->vma_obj = shadow_obj;
+            ret = -ENOMEM;
+            break;
         }
+        mobj_t *old = vma->vma_obj;
+        vma->vma_obj = psh;
+        mobj_put(&old);
+        old = child_vma->vma_obj;
+        child_vma->vma_obj = csh;
+        mobj_put(&old);
+        if (flattened) {
+            pt_unmap_range(curproc->p_pml4,
+                           (uintptr_t)PN_TO_ADDR(vma->vma_start),
+                           (uintptr_t)PN_TO_ADDR(vma->vma_end));
+        } else {
+            pt_write_protect_range(curproc->p_pml4,
+                                   (uintptr_t)PN_TO_ADDR(vma->vma_start),
+                                   (uintptr_t)PN_TO_ADDR(vma->vma_end));
+        }
+        tlb_batch_add(&batch, (uintptr_t)PN_TO_ADDR(vma->vma_start),
+                      vma->vma_end - vma->vma_start);
     }
-    
+
+    krwlock_write_unlock(&map->vmm_lock);
+    // Threads of this process on other cores must not go on writing through
+    // stale writable entries
+    tlb_batch_flush(&batch);
+    if (ret) {
+        kthread_destroy(child_thread);
+        proc_destroy(child_proc);
+        return ret;
+    }
+    // The child keeps the page table proc_create() gave it, with nothing
+    // mapped in the user half: its pages are faulted in from the shadows on
+    // first touch (a neighbourhood at a time, see _fault_around), so a child
+    // that goes on to exec never pays for copying the parent's tables.
+    child_thread->kt_ctx.c_pml4 = child_proc->p_pml4;
+
     // Set up the child's registers
     regs_t child_regs = *regs;
     child_regs.r_rax = 0;  // Child returns 0
@@ -110,20 +171,172 @@ long do_fork(struct regs *regs)
     uintptr_t child_rsp = fork_setup_stack(&child_regs, child_thread->kt_kstack);
     child_thread->kt_ctx.c_rsp = child_rsp;
     child_thread->kt_ctx.c_rip = (uintptr_t)userland_entry;
-    
-    // Unmap the parent's pages to trigger copy-on-write
-    vmarea_t *parent_vma;
-    list_iterate(&curproc->p_vmmap->vmm_list, parent_vma, vmarea_t, vma_plink) {
-        if (!(parent_vma->vma_flags & MAP_SHARED)) {
-            pt_unmap_range(curproc->p_pml4, 
-                          (uintptr_t)PN_TO_ADDR(parent_vma->vma_start),
-                          (uintptr_t)PN_TO_ADDR(parent_vma->vma_end - parent_vma->vma_start));
-        }
-    }
-    tlb_flush_all();
-    
+
     // Add the child thread to the scheduler
     sched_make_runnable(child_thread);
     
     return child_proc->p_pid;
 }
+
+#ifdef __MTP__
+/*
+ * Starts a thread in curproc, entering userland at entry with arg in %rdi,
+ * its stack pointer at stack and its FS base at tls. It is a clone of curthr,
+ * like a forked thread, but shares everything with it but the registers.
+ */
+long do_thr_create(uintptr_t entry, uintptr_t arg, uintptr_t stack,
+                   uintptr_t tls)
+{
+    if (entry < USER_MEM_LOW || entry >= USER_MEM_HIGH ||
+        stack <= USER_MEM_LOW || stack > USER_MEM_HIGH)
+    {
+        return -EFAULT;
+    }
+    if (tls >= USER_MEM_HIGH)
+    {
+        return -EINVAL;
+    }
+
+    kthread_t *thr = kthread_clone(curthr);
+    if (!thr)
+    {
+        return -ENOMEM;
+    }
+    thr->kt_proc = curproc;
+    thr->kt_cancelled = 0;
+    thr->kt_tls = tls;
+    thr->kt_ctx.c_pml4 = curproc->p_pml4;
+
+    regs_t regs;
+    memset(&regs, 0, sizeof(regs));
+    regs.r_cs = GDT_USER_TEXT | 0x3;
+    regs.r_ss = GDT_USER_DATA | 0x3;
+    regs.r_rip = entry;
+    regs.r_rsp = stack;
+    regs.r_rdi = arg;
+    regs.r_rflags = 0x202;
+    thr->kt_ctx.c_rsp = fork_setup_stack(&regs, thr->kt_kstack);
+    thr->kt_ctx.c_rip = (uintptr_t)userland_entry;
+
+    // Not while another thread is killing the rest, or it would miss this one
+    spinlock_lock(&curproc->p_thr_lock);
+    if (curproc->p_exiting)
+    {
+        spinlock_unlock(&curproc->p_thr_lock);
+        thr->kt_state = KT_EXITED;
+        kthread_destroy(thr);
+        return -EINTR;
+    }
+    list_insert_tail(&curproc->p_threads, &thr->kt_plink);
+    spinlock_unlock(&curproc->p_thr_lock);
+
+    pid_t tid = thr->kt_tid;
+    sched_make_runnable(thr);
+    return tid;
+}
+#endif
+
+/*
+ * A spawn in progress. It lives on the parent's stack: the parent sleeps
+ * until the child has loaded its program, or failed to, and says so here.
+ */
+typedef struct spawn_req
+{
+    const char *sr_filename;
+    char *const *sr_argv;
+    char *const *sr_envp;
+    const int (*sr_dups)[2];
+    size_t sr_ndups;
+
+    spinlock_t sr_lock; /* Protects sr_done and sr_waitq */
+    long sr_done;
+    long sr_ret;
+    ktqueue_t sr_waitq;
+} spawn_req_t;
+
+static void *spawn_entry(long arg1, void *arg2)
+{
+    spawn_req_t *req = arg2;
+    long ret = 0;
+    for (size_t i = 0; i < req->sr_ndups && ret >= 0; i++)
+    {
+        int oldfd = req->sr_dups[i][0], newfd = req->sr_dups[i][1];
+        ret = do_dup2(oldfd, newfd);
+        if (ret >= 0 && oldfd != newfd)
+        {
+            ret = do_close(oldfd);
+        }
+    }
+
+    // The child's vmmap is built straight from the binary: there is nothing
+    // of the parent's in it to tear down first
+    uint64_t rip, rsp;
+    if (ret >= 0)
+    {
+        ret = binfmt_load(req->sr_filename, req->sr_argv, req->sr_envp, &rip,
+                          &rsp);
+    }
+
+    // The parent is free to go (and req with it) once this is unlocked
+    spinlock_lock(&req->sr_lock);
+    req->sr_ret = ret < 0 ? ret : 0;
+    req->sr_done = 1;
+    sched_broadcast_on(&req->sr_waitq);
+    spinlock_unlock(&req->sr_lock);
+
+    if (ret < 0)
+    {
+        do_exit(-ret);
+    }
+    kernel_enter_userland(rip, rsp);
+    panic("returned from userland entry");
+    return NULL;
+}
+
+long do_spawn(const char *filename, char *const *argv, char *const *envp,
+              const int (*dups)[2], size_t ndups)
+{
+    proc_t *child_proc = proc_create("spawned");
+    if (!child_proc)
+    {
+        return -ENOMEM;
+    }
+    pid_t pid = child_proc->p_pid;
+
+    spawn_req_t req = {.sr_filename = filename,
+                       .sr_argv = argv,
+                       .sr_envp = envp,
+                       .sr_dups = dups,
+                       .sr_ndups = ndups,
+                       .sr_done = 0,
+                       .sr_ret = 0};
+    spinlock_init(&req.sr_lock);
+    sched_queue_init(&req.sr_waitq);
+
+    kthread_t *child_thread =
+        kthread_create(child_proc, spawn_entry, 0, &req);
+    if (!child_thread)
+    {
+        proc_destroy(child_proc);
+        return -ENOMEM;
+    }
+    child_thread->kt_affinity = curthr->kt_affinity;
+    sched_make_runnable(child_thread);
+
+    spinlock_lock(&req.sr_lock);
+    while (!req.sr_done)
+    {
+        sched_sleep_on_locked(&req.sr_waitq, &req.sr_lock);
+        spinlock_lock(&req.sr_lock);
+    }
+    spinlock_unlock(&req.sr_lock);
+
+    // A child that never got to run its program is reaped here, so the
+    // caller only ever sees the error
+    if (req.sr_ret < 0)
+    {
+        do_waitpid(pid, NULL, 0);
+        return req.sr_ret;
+    }
+    return pid;
+}
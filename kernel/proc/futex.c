@@ -0,0 +1,206 @@
+#include "proc/futex.h"
+#include "api/access.h"
+#include "errno.h"
+#include "globals.h"
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "main/inits.h"
+#include "mm/mobj.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "util/debug.h"
+#include "util/list.h"
+#include "vm/vmmap.h"
+
+/*
+ * A futex is a user int that threads wait on while it holds some value,
+ * until another thread wakes them. The kernel only keeps the waiters, in a
+ * hash table keyed by what the address refers to: for a shared mapping the
+ * mobj and the offset in it, so that processes mapping the same object at
+ * different addresses meet; for a private one the vmmap and the address, as
+ * a private mapping's object is replaced by a shadow at each fork.
+ *
+ * A waiter goes on its bucket before it reads the futex's value, and reads
+ * it without the bucket lock held (the read may fault and sleep). A waker
+ * changes the value before waking, so either the waiter sees the new value
+ * or the waker finds it queued. Each waiter sleeps on a ktqueue_t of its own,
+ * so that waking one does not touch the others in its bucket.
+ */
+
+#define FUTEX_HASH_BUCKETS 64
+
+typedef struct futex_key
+{
+    const void *fk_base; /* the mobj for a shared mapping, else the vmmap */
+    uintptr_t fk_off;    /* byte offset in the mobj, else the address */
+} futex_key_t;
+
+typedef struct futex_waiter
+{
+    futex_key_t fw_key;
+    long fw_woken;     /* taken off the bucket by a waker */
+    ktqueue_t fw_waitq;
+    list_link_t fw_link;
+} futex_waiter_t;
+
+typedef struct futex_bucket
+{
+    spinlock_t fb_lock;
+    list_t fb_waiters;
+} futex_bucket_t;
+
+static futex_bucket_t futex_buckets[FUTEX_HASH_BUCKETS];
+
+void futex_init()
+{
+    for (long i = 0; i < FUTEX_HASH_BUCKETS; i++)
+    {
+        spinlock_init(&futex_buckets[i].fb_lock);
+        list_init(&futex_buckets[i].fb_waiters);
+    }
+}
+
+static futex_bucket_t *futex_bucket(const futex_key_t *key)
+{
+    uint64_t h = ((uintptr_t)key->fk_base >> 4) ^ (key->fk_off >> 2);
+    h *= 0x9e3779b97f4a7c15UL;
+    return &futex_buckets[h >> 58];
+}
+
+/*
+ * Works out the key of the futex at uaddr in curproc. For a shared mapping a
+ * reference is taken on the mobj, which *ref is set to (else NULL), to be
+ * put once the key is no longer needed.
+ */
+static long futex_key_get(const int *uaddr, futex_key_t *key, mobj_t **ref)
+{
+    uintptr_t addr = (uintptr_t)uaddr;
+    if (addr & (sizeof(int) - 1))
+    {
+        return -EINVAL;
+    }
+    if (addr < USER_MEM_LOW || addr > USER_MEM_HIGH - sizeof(int))
+    {
+        return -EFAULT;
+    }
+
+    vmmap_t *map = curproc->p_vmmap;
+    krwlock_read_lock(&map->vmm_lock);
+    vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(addr));
+    if (!vma)
+    {
+        krwlock_read_unlock(&map->vmm_lock);
+        return -EFAULT;
+    }
+    if (vma->vma_flags & MAP_SHARED)
+    {
+        key->fk_base = vma->vma_obj;
+        key->fk_off = ((ADDR_TO_PN(addr) - vma->vma_start + vma->vma_off)
+                       << PAGE_SHIFT) +
+                      PAGE_OFFSET(addr);
+        mobj_ref(vma->vma_obj);
+        *ref = vma->vma_obj;
+    }
+    else
+    {
+        key->fk_base = map;
+        key->fk_off = addr;
+        *ref = NULL;
+    }
+    krwlock_read_unlock(&map->vmm_lock);
+    return 0;
+}
+
+static inline long futex_key_eq(const futex_key_t *a, const futex_key_t *b)
+{
+    return a->fk_base == b->fk_base && a->fk_off == b->fk_off;
+}
+
+long do_futex_wait(const int *uaddr, int val)
+{
+    futex_waiter_t fw;
+    mobj_t *ref;
+    long ret = futex_key_get(uaddr, &fw.fw_key, &ref);
+    if (ret)
+    {
+        return ret;
+    }
+    fw.fw_woken = 0;
+    sched_queue_init(&fw.fw_waitq);
+    list_link_init(&fw.fw_link);
+
+    futex_bucket_t *fb = futex_bucket(&fw.fw_key);
+    spinlock_lock(&fb->fb_lock);
+    list_insert_tail(&fb->fb_waiters, &fw.fw_link);
+    spinlock_unlock(&fb->fb_lock);
+
+    int cur;
+    ret = copy_from_user(&cur, uaddr, sizeof(cur));
+    if (!ret && cur != val)
+    {
+        ret = -EAGAIN;
+    }
+
+    spinlock_lock(&fb->fb_lock);
+    if (!ret && !fw.fw_woken)
+    {
+        ret = sched_cancellable_sleep_on_locked(&fw.fw_waitq, &fb->fb_lock);
+        spinlock_lock(&fb->fb_lock);
+    }
+    if (fw.fw_woken)
+    {
+        /* A wakeup counted against this waiter is reported as such */
+        if (ret != -EFAULT)
+        {
+            ret = 0;
+        }
+    }
+    else
+    {
+        list_remove(&fw.fw_link);
+    }
+    spinlock_unlock(&fb->fb_lock);
+
+    if (ref)
+    {
+        mobj_put(&ref);
+    }
+    return ret;
+}
+
+long do_futex_wake(const int *uaddr, int count)
+{
+    futex_key_t key;
+    mobj_t *ref;
+    long ret = futex_key_get(uaddr, &key, &ref);
+    if (ret)
+    {
+        return ret;
+    }
+
+    long woken = 0;
+    futex_bucket_t *fb = futex_bucket(&key);
+    spinlock_lock(&fb->fb_lock);
+    list_iterate(&fb->fb_waiters, fw, futex_waiter_t, fw_link)
+    {
+        if (woken >= count)
+        {
+            break;
+        }
+        if (futex_key_eq(&fw->fw_key, &key))
+        {
+            list_remove(&fw->fw_link);
+            fw->fw_woken = 1;
+            sched_broadcast_on(&fw->fw_waitq);
+            woken++;
+        }
+    }
+    spinlock_unlock(&fb->fb_lock);
+
+    if (ref)
+    {
+        mobj_put(&ref);
+    }
+    return woken;
+}
@@ -0,0 +1,314 @@
+#include "globals.h"
+#include "main/interrupt.h"
+#include "proc/kmutex.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#ifdef __KMUTEX_STATS__
+static list_t kmutex_named_list = LIST_INITIALIZER(kmutex_named_list);
+static spinlock_t kmutex_named_lock = SPINLOCK_INITIALIZER(kmutex_named_lock);
+#endif
+
+/*
+ * IMPORTANT: Mutexes can _NEVER_ be locked or unlocked from an
+ * interrupt context. Mutexes are _ONLY_ lock or unlocked from a
+ * thread context.
+ */
+
+/*
+ * Checks for the specific deadlock case where:
+ *  curthr wants mtx, but the owner of mtx is waiting on a mutex that curthr is
+ * holding
+ */
+#define DEBUG_DEADLOCKS 1
+void detect_deadlocks(kmutex_t *mtx)
+{
+#if DEBUG_DEADLOCKS
+    list_iterate(&curthr->kt_mutexes, held, kmutex_t, km_link)
+    {
+        list_iterate(&held->km_waitq.tq_list, waiter, kthread_t, kt_qlink)
+        {
+            if (waiter == mtx->km_holder)
+            {
+                panic(
+                    "detected deadlock between P%d and P%d (mutexes 0x%p, "
+                    "0x%p)\n",
+                    curproc->p_pid, waiter->kt_proc->p_pid, held, mtx);
+            }
+        }
+    }
+#endif
+}
+
+/*
+ * Initializes the members of mtx
+ */
+void kmutex_init(kmutex_t *mtx)
+{
+    mtx->km_holder = NULL;
+    sched_queue_init(&mtx->km_waitq);
+    list_link_init(&mtx->km_link);
+    spinlock_init(&mtx->km_lock);
+#ifdef __KMUTEX_STATS__
+    memset(&mtx->km_stats, 0, sizeof(mtx->km_stats));
+    list_link_init(&mtx->km_stats.ks_link);
+#endif
+}
+
+void kmutex_set_name(kmutex_t *mtx, const char *name)
+{
+#ifdef __KMUTEX_STATS__
+    spinlock_lock(&kmutex_named_lock);
+    mtx->km_stats.ks_name = name;
+    if (!list_link_is_linked(&mtx->km_stats.ks_link))
+        list_insert_tail(&kmutex_named_list, &mtx->km_stats.ks_link);
+    spinlock_unlock(&kmutex_named_lock);
+#endif
+}
+
+#ifdef __KMUTEX_STATS__
+/*
+ * Records that curthr just took mtx, having waited since start if contended.
+ *
+ * mtx->km_lock must be held
+ */
+static void kmutex_stats_acquired(kmutex_t *mtx, long contended, uint64_t start)
+{
+    kmutex_stats_t *ks = &mtx->km_stats;
+    ks->ks_acquisitions++;
+    ks->ks_acquired_at = jiffies;
+    if (contended)
+    {
+        ks->ks_contended++;
+        ks->ks_wait_ticks += jiffies - start;
+    }
+}
+
+/*
+ * Records that the holder of mtx is giving it up.
+ *
+ * mtx->km_lock must be held
+ */
+static void kmutex_stats_released(kmutex_t *mtx)
+{
+    kmutex_stats_t *ks = &mtx->km_stats;
+    uint64_t held = jiffies - ks->ks_acquired_at;
+    if (held > ks->ks_max_hold_ticks)
+        ks->ks_max_hold_ticks = held;
+}
+
+size_t kmutex_stats_top(kmutex_stats_t *out, size_t max)
+{
+    size_t n = 0;
+    spinlock_lock(&kmutex_named_lock);
+    list_iterate(&kmutex_named_list, ks, kmutex_stats_t, ks_link)
+    {
+        /* insertion sort into out[], dropping whatever falls off the end */
+        size_t i = n < max ? n++ : max;
+        while (i > 0 && out[i - 1].ks_contended < ks->ks_contended)
+        {
+            if (i < max)
+                out[i] = out[i - 1];
+            i--;
+        }
+        if (i < max)
+            out[i] = *ks;
+    }
+    spinlock_unlock(&kmutex_named_lock);
+    return n;
+}
+#else
+#define kmutex_stats_acquired(mtx, contended, start) ((void)(start))
+#define kmutex_stats_released(mtx)
+#endif
+
+/*
+ * Makes curthr the holder of mtx.
+ *
+ * mtx->km_lock must be held
+ */
+static void kmutex_acquire(kmutex_t *mtx)
+{
+    mtx->km_holder = curthr;
+    list_insert_tail(&curthr->kt_mutexes, &mtx->km_link);
+}
+
+/*
+ * Returns the lowest of nice and the nice values of mtx's waiters.
+ *
+ * mtx->km_lock must be held
+ */
+static long kmutex_waiters_nice(kmutex_t *mtx, long nice)
+{
+    list_iterate(&mtx->km_waitq.tq_list, waiter, kthread_t, kt_qlink)
+    {
+        nice = MIN(nice, waiter->kt_nice);
+    }
+    return nice;
+}
+
+/*
+ * Priority inheritance: a thread holding a mutex runs at the priority of the
+ * most urgent thread waiting for it, if that is higher than its own, so that
+ * a waiter is not held up by threads of middling priority preempting the
+ * holder. kmutex_lock() raises the holder's priority as a waiter arrives,
+ * and kmutex_unlock() lets the old holder fall back to what it still
+ * inherits from the other mutexes it holds.
+ *
+ * This only goes one level deep: a holder that blocks on a second mutex
+ * passes its raised priority on to that one's holder, but the raise is not
+ * carried further when the first waiter's own priority changes later.
+ */
+void kmutex_update_nice()
+{
+    long nice = curthr->kt_base_nice;
+    list_iterate(&curthr->kt_mutexes, held, kmutex_t, km_link)
+    {
+        spinlock_lock(&held->km_lock);
+        nice = kmutex_waiters_nice(held, nice);
+        spinlock_unlock(&held->km_lock);
+    }
+    curthr->kt_nice = nice;
+}
+
+/*
+ * Spins while the holder of mtx is running on another core, in the hope that
+ * it releases mtx before a sleep and a wakeup would have completed. Returns
+ * true if mtx was acquired.
+ *
+ * mtx->km_lock must be held; it is dropped while polling.
+ */
+static long kmutex_spin(kmutex_t *mtx)
+{
+    for (long spins = 0; spins < KMUTEX_SPIN_MAX; spins++)
+    {
+        kthread_t *holder = mtx->km_holder;
+        if (!holder)
+        {
+            kmutex_acquire(mtx);
+            return 1;
+        }
+        if (holder->kt_state != KT_ON_CPU || !sched_queue_empty(&mtx->km_waitq))
+        {
+            /* Blocked holder, or a sleeper already queued for a hand-off */
+            return 0;
+        }
+
+        spinlock_unlock(&mtx->km_lock);
+        __asm__ volatile("pause");
+        spinlock_lock(&mtx->km_lock);
+    }
+    return 0;
+}
+
+/*
+ * Obtains a mutex, blocking if necessary.
+ *
+ * Notes:
+ * Check for deadlocks using detect_deadlocks().
+ * The mutex is handed directly to a sleeping waiter by kmutex_unlock(), so a
+ * thread that wakes up from km_waitq already owns it. A thread that is
+ * spinning rather than sleeping competes for the mutex each time it polls.
+ */
+void kmutex_lock(kmutex_t *mtx)
+{
+    dbg(DBG_ERROR, "locked mutex: %p\n", mtx);
+    KASSERT(curthr && "need thread context to lock mutex");
+    KASSERT(!kmutex_owns_mutex(mtx) && "already owner");
+
+    spinlock_lock(&mtx->km_lock);
+    if (!mtx->km_holder)
+    {
+        kmutex_acquire(mtx);
+        kmutex_stats_acquired(mtx, 0, 0);
+        spinlock_unlock(&mtx->km_lock);
+        return;
+    }
+
+    uint64_t start = jiffies;
+    if (kmutex_spin(mtx))
+    {
+        kmutex_stats_acquired(mtx, 1, start);
+        spinlock_unlock(&mtx->km_lock);
+        return;
+    }
+
+    detect_deadlocks(mtx);
+    if (curthr->kt_nice < mtx->km_holder->kt_nice)
+        sched_set_nice(mtx->km_holder, curthr->kt_nice);
+    sched_sleep_on_locked(&mtx->km_waitq, &mtx->km_lock);
+    KASSERT(kmutex_owns_mutex(mtx));
+#ifdef __KMUTEX_STATS__
+    spinlock_lock(&mtx->km_lock);
+    kmutex_stats_acquired(mtx, 1, start);
+    spinlock_unlock(&mtx->km_lock);
+#endif
+}
+
+/*
+ * Obtains mtx if it is free, without blocking. Returns true on success.
+ */
+long kmutex_trylock(kmutex_t *mtx)
+{
+    KASSERT(curthr && "need thread context to lock mutex");
+    KASSERT(!kmutex_owns_mutex(mtx) && "already owner");
+
+    spinlock_lock(&mtx->km_lock);
+    long acquired = !mtx->km_holder;
+    if (acquired)
+    {
+        kmutex_acquire(mtx);
+        kmutex_stats_acquired(mtx, 0, 0);
+    }
+    spinlock_unlock(&mtx->km_lock);
+    return acquired;
+}
+
+/*
+ * Releases a mutex. If a thread is sleeping on the mutex it becomes the new
+ * holder and is made runnable.
+ *
+ * Notes:
+ * Moves the mutex from curthr's list of held mutexes to the new holder's,
+ * along with the priority that the remaining waiters lend to its holder.
+ */
+void kmutex_unlock(kmutex_t *mtx)
+{
+    dbg(DBG_ERROR, "unlocked mutex: %p\n", mtx);
+    KASSERT(curthr && (curthr == mtx->km_holder) &&
+            "unlocking a mutex we don\'t own");
+
+    spinlock_lock(&mtx->km_lock);
+    kmutex_stats_released(mtx);
+    sched_wakeup_on(&mtx->km_waitq, &mtx->km_holder);
+    KASSERT(!kmutex_owns_mutex(mtx));
+    list_remove(&mtx->km_link);
+    kthread_t *holder = mtx->km_holder;
+    if (holder)
+    {
+        list_insert_tail(&holder->kt_mutexes, &mtx->km_link);
+        long nice = kmutex_waiters_nice(mtx, holder->kt_nice);
+        if (nice < holder->kt_nice)
+            sched_set_nice(holder, nice);
+    }
+    spinlock_unlock(&mtx->km_lock);
+
+    if (curthr->kt_nice != curthr->kt_base_nice)
+        kmutex_update_nice();
+}
+
+/*
+ * Checks if mtx's wait queue is empty.
+ */
+long kmutex_has_waiters(kmutex_t *mtx)
+{
+    return !sched_queue_empty(&mtx->km_waitq);
+}
+
+/*
+ * Checks if the current thread owns mtx.
+ */
+inline long kmutex_owns_mutex(kmutex_t *mtx)
+{
+    return curthr && mtx->km_holder == curthr;
+}
@@ -0,0 +1,106 @@
+#include "globals.h"
+#include "proc/krwlock.h"
+#include "util/debug.h"
+
+/*
+ * Like kmutexes, reader-writer locks may only be taken from thread context.
+ *
+ * All state lives under krw_lock. Sleepers go to sleep through
+ * sched_sleep_on_locked(), so a wakeup issued by an unlocking thread on
+ * another core cannot fall between a waiter's check and its sleep. Woken
+ * threads always recheck the state, so a spurious wakeup is harmless.
+ */
+
+void krwlock_init(krwlock_t *rw)
+{
+    spinlock_init(&rw->krw_lock);
+    rw->krw_readers = 0;
+    rw->krw_writer = NULL;
+    rw->krw_writers_waiting = 0;
+    sched_queue_init(&rw->krw_readq);
+    sched_queue_init(&rw->krw_writeq);
+}
+
+void krwlock_read_lock(krwlock_t *rw)
+{
+    KASSERT(curthr && "need thread context to lock rwlock");
+    KASSERT(rw->krw_writer != curthr && "already the writer");
+
+    spinlock_lock(&rw->krw_lock);
+    while (rw->krw_writer || rw->krw_writers_waiting)
+    {
+        sched_sleep_on_locked(&rw->krw_readq, &rw->krw_lock);
+        spinlock_lock(&rw->krw_lock);
+    }
+    rw->krw_readers++;
+    spinlock_unlock(&rw->krw_lock);
+}
+
+long krwlock_read_trylock(krwlock_t *rw)
+{
+    KASSERT(curthr && "need thread context to lock rwlock");
+    KASSERT(rw->krw_writer != curthr && "already the writer");
+
+    long acquired = 0;
+    spinlock_lock(&rw->krw_lock);
+    if (!rw->krw_writer && !rw->krw_writers_waiting)
+    {
+        rw->krw_readers++;
+        acquired = 1;
+    }
+    spinlock_unlock(&rw->krw_lock);
+    return acquired;
+}
+
+void krwlock_read_unlock(krwlock_t *rw)
+{
+    spinlock_lock(&rw->krw_lock);
+    KASSERT(rw->krw_readers > 0 && !rw->krw_writer);
+    if (!--rw->krw_readers && rw->krw_writers_waiting)
+    {
+        sched_wakeup_on(&rw->krw_writeq, NULL);
+    }
+    spinlock_unlock(&rw->krw_lock);
+}
+
+void krwlock_write_lock(krwlock_t *rw)
+{
+    KASSERT(curthr && "need thread context to lock rwlock");
+    KASSERT(rw->krw_writer != curthr && "already the writer");
+
+    spinlock_lock(&rw->krw_lock);
+    rw->krw_writers_waiting++;
+    while (rw->krw_writer || rw->krw_readers)
+    {
+        sched_sleep_on_locked(&rw->krw_writeq, &rw->krw_lock);
+        spinlock_lock(&rw->krw_lock);
+    }
+    rw->krw_writers_waiting--;
+    rw->krw_writer = curthr;
+    spinlock_unlock(&rw->krw_lock);
+}
+
+/*
+ * Hands the lock to the next writer if there is one; readers that queued up
+ * behind the writers are only let in once none are left.
+ */
+void krwlock_write_unlock(krwlock_t *rw)
+{
+    spinlock_lock(&rw->krw_lock);
+    KASSERT(krwlock_owns_write(rw) && "unlocking a rwlock we don't own");
+    rw->krw_writer = NULL;
+    if (rw->krw_writers_waiting)
+    {
+        sched_wakeup_on(&rw->krw_writeq, NULL);
+    }
+    else
+    {
+        sched_broadcast_on(&rw->krw_readq);
+    }
+    spinlock_unlock(&rw->krw_lock);
+}
+
+inline long krwlock_owns_write(krwlock_t *rw)
+{
+    return curthr && rw->krw_writer == curthr;
+}
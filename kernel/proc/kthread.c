@@ -1,6 +1,9 @@
 #include "config.h"
 #include "globals.h"
+#include "main/fpu.h"
+#include "main/pmu.h"
 #include "mm/slab.h"
+#include "mm/vmalloc.h"
 #include "util/debug.h"
 #include "util/string.h"
 
@@ -11,29 +14,44 @@
 /*
  * Global variable maintaining the current thread on the cpu
  */
-kthread_t *curthr CORE_SPECIFIC_DATA;
+kthread_t *csd_curthr CORE_SPECIFIC_DATA;
+
+/* See the layout note on kthread_t */
+STATIC_ASSERT(offsetof(kthread_t, kt_quantum) + sizeof(long) <=
+                  2 * CACHE_LINE_SIZE,
+              "kthread_t's switch and sleep fields spill past two lines");
 
 /*
  * Private slab for kthread structs
  */
 static slab_allocator_t *kthread_allocator = NULL;
 
+/*
+ * The last thread ID handed out
+ */
+static pid_t kthread_last_tid = 0;
+
 /*=================
  * Helper functions
  *================*/
 
 /*
- * Allocates a new kernel stack. Returns null when not enough memory.
+ * Allocates a new kernel stack of npages pages. Returns null when not enough
+ * memory.
+ *
+ * Stacks come from vmalloc, so they are built from single pages rather than
+ * a physically contiguous block, and the page below each one is never mapped
+ * (see vmalloc.h). A thread that overflows its stack faults on that guard
+ * page instead of scribbling over whatever lies below; since the CPU cannot
+ * push the fault's frame there either, this ends up as a double fault, which
+ * has a stack of its own (see gdt_init).
  */
-static char *alloc_stack() { return page_alloc_n(DEFAULT_STACK_SIZE_PAGES); }
+static char *alloc_stack(size_t npages) { return vmalloc(npages << PAGE_SHIFT); }
 
 /*
  * Frees an existing kernel stack.
  */
-static void free_stack(char *stack)
-{
-    page_free_n(stack, DEFAULT_STACK_SIZE_PAGES);
-}
+static void free_stack(char *stack) { vfree(stack); }
 
 /*==========
  * Functions
@@ -44,8 +62,6 @@ static void free_stack(char *stack)
  */
 void kthread_init()
 {
-    KASSERT(__builtin_popcount(DEFAULT_STACK_SIZE_PAGES) == 1 &&
-            "stack size should be a power of 2 pages to reduce fragmentation");
     kthread_allocator = slab_allocator_create("kthread", sizeof(kthread_t));
     KASSERT(kthread_allocator);
 }
@@ -58,26 +74,28 @@ void kthread_init()
  * Use kthread_allocator to allocate a kthread
  * Use alloc_stack() to allocate a kernel stack
  * Use context_setup() to set up the thread's context - 
- *  also use DEFAULT_STACK_SIZE and the process's pagetable (p_pml4)
+ *  also use the stack's size and the process's pagetable (p_pml4)
  * Remember to initialize all the thread's fields
  * Remember to add the thread to proc's threads list
  * Initialize the thread's kt_state to KT_NO_STATE
  * Initialize the thread's kt_recent_core to ~0UL (unsigned -1)
  */
-kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, void *arg2)
+static kthread_t *_kthread_create(proc_t *proc, kthread_func_t func,
+                                  long arg1, void *arg2, size_t stack_pages)
 {
     kthread_t *thr = slab_obj_alloc(kthread_allocator);
     if (!thr) {
         return NULL;
     }
 
-    char *stack = alloc_stack();
+    char *stack = alloc_stack(stack_pages);
     if (!stack) {
         slab_obj_free(kthread_allocator, thr);
         return NULL;
     }
 
-    context_setup(&thr->kt_ctx, func, arg1, arg2, stack, DEFAULT_STACK_SIZE, proc->p_pml4);
+    context_setup(&thr->kt_ctx, func, arg1, arg2, stack,
+                  stack_pages << PAGE_SHIFT, proc->p_pml4);
 
     thr->kt_kstack = stack;
     thr->kt_retval = NULL;
@@ -86,7 +104,24 @@ kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, void *ar
     thr->kt_cancelled = 0;
     thr->kt_wchan = NULL;
     thr->kt_state = KT_NO_STATE;
+    thr->kt_nice = SCHED_NICE_DEFAULT;
+    thr->kt_base_nice = SCHED_NICE_DEFAULT;
+    thr->kt_recent_core = ~0UL;
+    thr->kt_affinity = SCHED_AFFINITY_DEFAULT;
+    thr->kt_quantum = 0;
+    thr->kt_need_resched = 0;
+    thr->kt_wait_exclusive = 0;
+    thr->kt_fs_handles = 0;
+    thr->kt_tid = __sync_add_and_fetch(&kthread_last_tid, 1);
+    thr->kt_tls = 0;
+    thr->kt_pmu = NULL;
+    thr->kt_fpu = NULL;
     thr->kt_preemption_count = 0;
+    thr->kt_run_ticks = 0;
+    thr->kt_wait_ticks = 0;
+    thr->kt_nvcsw = 0;
+    thr->kt_nivcsw = 0;
+    thr->kt_switched_at = 0;
 
     list_link_init(&thr->kt_plink);
     list_link_init(&thr->kt_qlink);
@@ -97,6 +132,26 @@ kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, void *ar
     return thr;
 }
 
+/*
+ * Creates a thread with a stack of DEFAULT_STACK_SIZE, see _kthread_create.
+ */
+kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, void *arg2)
+{
+    return _kthread_create(proc, func, arg1, arg2, DEFAULT_STACK_SIZE_PAGES);
+}
+
+/*
+ * Like kthread_create, but with a stack of only DAEMON_STACK_SIZE_PAGES
+ * pages, for the kernel's own daemons: threads that never enter userland,
+ * and so never run system calls (or forks, which assume the default size,
+ * see fork_setup_stack) on their stack.
+ */
+kthread_t *kthread_create_daemon(proc_t *proc, kthread_func_t func, long arg1,
+                                 void *arg2)
+{
+    return _kthread_create(proc, func, arg1, arg2, DAEMON_STACK_SIZE_PAGES);
+}
+
 /*
  * Creates and initializes a thread that is a clone of thr.
  * Returns a new kthread, or null on failure.
@@ -106,8 +161,9 @@ kthread_t *kthread_create(proc_t *proc, kthread_func_t func, long arg1, void *ar
  * Hints:
  * The only parts of the context that must be initialized are c_kstack and
  * c_kstacksz. The thread's process should be set outside of this function. Copy
- * over thr's retval, errno, and cancelled; other fields should be freshly
- * initialized. See kthread_create() for more hints.
+ * over thr's retval, errno, cancelled, nice and TLS pointer; other fields
+ * should be freshly initialized (the clone gets a tid of its own). See
+ * kthread_create() for more hints.
  */
 kthread_t *kthread_clone(kthread_t *thr)
 {
@@ -120,7 +176,7 @@ kthread_t *kthread_clone(kthread_t *thr)
     }
     
     // Allocate a new stack
-    char *stack = alloc_stack();
+    char *stack = alloc_stack(DEFAULT_STACK_SIZE_PAGES);
     if (!stack) {
         slab_obj_free(kthread_allocator, new_thr);
         return NULL;
@@ -133,10 +189,23 @@ kthread_t *kthread_clone(kthread_t *thr)
     new_thr->kt_retval = thr->kt_retval;
     new_thr->kt_errno = thr->kt_errno;
     new_thr->kt_cancelled = thr->kt_cancelled;
+    new_thr->kt_nice = thr->kt_base_nice;
+    new_thr->kt_base_nice = thr->kt_base_nice;
+    new_thr->kt_tls = thr->kt_tls;
+    new_thr->kt_tid = __sync_add_and_fetch(&kthread_last_tid, 1);
+    new_thr->kt_recent_core = ~0UL;
+    new_thr->kt_affinity = thr->kt_affinity;
     new_thr->kt_kstack = stack;
     new_thr->kt_state = KT_NO_STATE;
     new_thr->kt_preemption_count = 0;
     new_thr->kt_wchan = NULL;
+
+    // The clone starts out with the registers as they were
+    if (fpu_thread_copy(new_thr, thr)) {
+        free_stack(stack);
+        slab_obj_free(kthread_allocator, new_thr);
+        return NULL;
+    }
     
     // Initialize list links
     list_link_init(&new_thr->kt_plink);
@@ -163,6 +232,8 @@ void kthread_destroy(kthread_t *thr)
     if (thr->kt_state != KT_EXITED)
         panic("destroying thread in state %d\n", thr->kt_state);
     free_stack(thr->kt_kstack);
+    pmu_thread_free(thr);
+    fpu_thread_free(thr);
     if (list_link_is_linked(&thr->kt_plink))
         list_remove(&thr->kt_plink);
 
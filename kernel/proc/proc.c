@@ -1,10 +1,16 @@
+#include "api/syscall.h"
 #include "config.h"
 #include "errno.h"
+#include "fs/aio.h"
+#include "fs/fdtable.h"
 #include "fs/file.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "globals.h"
 #include "kernel.h"
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/pframe.h"
 #include "mm/slab.h"
 #include "util/debug.h"
 #include "util/printf.h"
@@ -13,6 +19,8 @@
 #include <drivers/screen.h>
 #include <fs/vfs_syscall.h>
 #include <main/apic.h>
+#include <vm/pagefault.h>
+#include <vm/vdso.h>
 
 /*==========
  * Variables
@@ -21,12 +29,20 @@
 /*
  * Global variable that maintains the current process
  */
-proc_t *curproc CORE_SPECIFIC_DATA;
+proc_t *csd_curproc CORE_SPECIFIC_DATA;
 
 /*
  * Global list of all processes (except for the idle process) and its lock
  */
-static list_t proc_list = LIST_INITIALIZER(proc_list);
+list_t proc_list = LIST_INITIALIZER(proc_list);
+
+/*
+ * Processes on proc_list by pid, for proc_lookup(), and a bit for each pid,
+ * set while a process has it, so that _proc_getid() finds a free one a word
+ * at a time. Pid 0 is the idle processes'.
+ */
+static list_t proc_hash[PROC_HASH_BUCKETS];
+static uint64_t proc_pidmap[PROC_MAX_COUNT / 64] = {[0] = 1};
 
 /*
  * Allocator for process descriptors
@@ -56,6 +72,10 @@ void proc_init()
 {
     proc_allocator = slab_allocator_create("proc", sizeof(proc_t));
     KASSERT(proc_allocator);
+    for (size_t i = 0; i < PROC_HASH_BUCKETS; i++)
+    {
+        list_init(&proc_hash[i]);
+    }
 }
 
 /*
@@ -64,27 +84,42 @@ void proc_init()
  */
 void proc_idleproc_init()
 {
-    proc_t *proc = &idleproc;
+    proc_t *proc = CSD_PTR(idleproc);
 
     proc->p_pid = 0;
     list_init(&proc->p_threads);
     list_init(&proc->p_children);
+    list_init(&proc->p_zombies);
     proc->p_pproc = NULL;
 
     list_link_init(&proc->p_child_link);
     list_link_init(&proc->p_list_link);
+    list_link_init(&proc->p_hash_link);
 
     proc->p_status = 0;
     proc->p_state = PROC_RUNNING;
 
     memset(&proc->p_wait, 0, sizeof(ktqueue_t)); // should not be used
+    memset(&proc->p_exitq, 0, sizeof(ktqueue_t));
+    spinlock_init(&proc->p_thr_lock);
+    sched_queue_init(&proc->p_thrwait);
+    proc->p_exiting = 0;
 
     proc->p_pml4 = pt_get();
     proc->p_vmmap = vmmap_create();
 
     proc->p_cwd = NULL;
+#ifdef __GETCWD__
+    proc->p_cwd_path = NULL;
+    kmutex_init(&proc->p_cwd_mutex);
+#endif
 
-    memset(proc->p_files, 0, sizeof(proc->p_files));
+    proc->p_fdtable = NULL;
+    proc->p_aio = NULL;
+    proc->p_vdso = NULL;
+    proc->p_rss = 0;
+    proc->p_rss_limit = __RSS_LIMIT__;
+    list_init(&proc->p_rss_pages);
 
     char name[8];
     snprintf(name, sizeof(name), "idle%ld", curcore.kc_id);
@@ -92,8 +127,8 @@ void proc_idleproc_init()
     proc->p_name[PROC_NAME_LEN - 1] = '\0';
 
     dbg(DBG_PROC, "created %s\n", proc->p_name);
-    curproc = &idleproc;
-    curthr = NULL;
+    CSD_WRITE(csd_curproc, proc);
+    CSD_WRITE(csd_curthr, NULL);
 }
 
 /*=================
@@ -101,44 +136,68 @@ void proc_idleproc_init()
  *================*/
 
 /*
- * Gets the next available process ID (pid).
+ * Returns the lowest pid in [from, to) that is free in proc_pidmap, or -1.
+ */
+static pid_t _proc_pid_scan(pid_t from, pid_t to)
+{
+    for (pid_t pid = from; pid < to; pid = (pid | 63) + 1)
+    {
+        uint64_t free = ~proc_pidmap[pid / 64] & (~0UL << (pid % 64));
+        if (free)
+        {
+            pid_t found = (pid & ~63) + __builtin_ctzll(free);
+            return found < to ? found : -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Gets the next available process ID (pid), which is the first free one
+ * from where the last search stopped, wrapping around, so that pids are not
+ * reused sooner than they must be. Returns -1 if all are in use.
  */
 static pid_t next_pid = 1;
 static pid_t _proc_getid()
 {
-    pid_t pid = next_pid;
-restart:
-    list_iterate(&proc_list, p, proc_t, p_list_link)
+    pid_t pid = _proc_pid_scan(next_pid, PROC_MAX_COUNT);
+    if (pid == -1)
     {
-        if (p->p_pid == pid)
+        pid = _proc_pid_scan(1, next_pid);
+        if (pid == -1)
         {
-            pid = pid + 1 == PROC_MAX_COUNT ? 1 : pid + 1;
-            if (pid == next_pid)
-            {
-                return -1;
-            }
-            else
-            {
-                goto restart;
-            }
+            return -1;
         }
     }
+    proc_pidmap[pid / 64] |= 1UL << (pid % 64);
     next_pid = pid + 1 == PROC_MAX_COUNT ? 1 : pid + 1;
     KASSERT(pid);
     return pid;
 }
 
 /*
- * Searches the global process list for the process descriptor corresponding to
- * a pid.
+ * Frees a pid got from _proc_getid().
+ */
+static void _proc_putid(pid_t pid)
+{
+    KASSERT(pid > 0 && pid < PROC_MAX_COUNT);
+    proc_pidmap[pid / 64] &= ~(1UL << (pid % 64));
+}
+
+/*
+ * Looks up the process descriptor corresponding to a pid in the pid hash.
  */
 proc_t *proc_lookup(pid_t pid)
 {
     if (pid == 0)
     {
-        return &idleproc;
+        return CSD_PTR(idleproc);
     }
-    list_iterate(&proc_list, p, proc_t, p_list_link)
+    if (pid < 0 || pid >= PROC_MAX_COUNT)
+    {
+        return NULL;
+    }
+    list_iterate(&proc_hash[pid % PROC_HASH_BUCKETS], p, proc_t, p_hash_link)
     {
         if (p->p_pid == pid)
         {
@@ -181,6 +240,7 @@ proc_t *proc_create(const char *name)
     // Allocate a new process struct
     proc_t *proc = slab_obj_alloc(proc_allocator);
     if (!proc) {
+        _proc_putid(pid);
         return NULL;
     }
 
@@ -188,6 +248,7 @@ proc_t *proc_create(const char *name)
     pml4_t *pml4 = pt_create();
     if (!pml4) {
         slab_obj_free(proc_allocator, proc);
+        _proc_putid(pid);
         return NULL;
     }
 
@@ -199,6 +260,7 @@ proc_t *proc_create(const char *name)
     // Initialize lists
     list_init(&proc->p_threads);
     list_init(&proc->p_children);
+    list_init(&proc->p_zombies);
     
     // Set parent process
     proc->p_pproc = curproc;
@@ -206,15 +268,26 @@ proc_t *proc_create(const char *name)
     // Initialize list links
     list_link_init(&proc->p_list_link);
     list_link_init(&proc->p_child_link);
+    list_link_init(&proc->p_hash_link);
     proc->p_status = 0;
     proc->p_state = PROC_RUNNING;
 
-    // Initialize wait queue
+    // Initialize wait queues
     sched_queue_init(&proc->p_wait);
+    sched_queue_init(&proc->p_exitq);
+    spinlock_init(&proc->p_thr_lock);
+    sched_queue_init(&proc->p_thrwait);
+    proc->p_exiting = 0;
 
     // Set page table and VM mapping
     proc->p_pml4 = pml4;
     proc->p_vmmap = vmmap_create(); 
+    proc->p_minflt = proc->p_majflt = 0;
+    proc->p_cowflt = proc->p_zeroflt = 0;
+    proc->p_fault_cycles = proc->p_fault_max_cycles = 0;
+    proc->p_rss = 0;
+    proc->p_rss_limit = curproc ? curproc->p_rss_limit : __RSS_LIMIT__;
+    list_init(&proc->p_rss_pages);
     
     // VFS setup: inherit current working directory and files from parent
     if (curproc && curproc->p_cwd) {
@@ -223,24 +296,39 @@ proc_t *proc_create(const char *name)
     } else {
         proc->p_cwd = NULL;
     }
-    
-    // Clone file descriptors from parent process
-    memset(proc->p_files, 0, sizeof(proc->p_files));
-    if (curproc) {
-        for (int i = 0; i < NFILES; i++) {
-            if (curproc->p_files[i]) {
-                proc->p_files[i] = curproc->p_files[i];
-                fref(proc->p_files[i]);  // Add reference to the file
+#ifdef __GETCWD__
+    // And its path, if it is known; a child that cannot have it looks it up
+    kmutex_init(&proc->p_cwd_mutex);
+    proc->p_cwd_path = NULL;
+    if (curproc && curproc->p_cwd)
+    {
+        kmutex_lock(&curproc->p_cwd_mutex);
+        if (curproc->p_cwd_path)
+        {
+            size_t len = strlen(curproc->p_cwd_path) + 1;
+            proc->p_cwd_path = kmalloc(len);
+            if (proc->p_cwd_path)
+            {
+                memcpy(proc->p_cwd_path, curproc->p_cwd_path, len);
+                proc->p_cwd_gen = curproc->p_cwd_gen;
             }
         }
+        kmutex_unlock(&curproc->p_cwd_mutex);
     }
+#endif
+    
+    // Share the parent's descriptors; the first change copies them
+    proc->p_fdtable = curproc ? fdtable_share(curproc->p_fdtable) : NULL;
+    proc->p_aio = NULL;
 
     // Initialize VM fields  
     proc->p_brk = NULL;
     proc->p_start_brk = NULL;
+    proc->p_vdso = NULL;
 
-    // Add to global process list and parent's children list
+    // Add to global process list, the pid hash and parent's children list
     list_insert_tail(&proc_list, &proc->p_list_link);
+    list_insert_head(&proc_hash[pid % PROC_HASH_BUCKETS], &proc->p_hash_link);
     if (proc->p_pproc) {
         list_insert_tail(&proc->p_pproc->p_children, &proc->p_child_link);
     }
@@ -275,25 +363,27 @@ proc_t *proc_create(const char *name)
  */
 void proc_cleanup(long status)
 {
-    // Set the process state to DEAD and the status
-    curproc->p_state = PROC_DEAD;
+    // Set the status; the state is set once the process is on its parent's
+    // zombies, below
     curproc->p_status = status;
 
     // Clean up VFS resources immediately when process begins cleanup
     // This is crucial for halt to work cleanly
 #ifdef __VFS__
-    for (int fd = 0; fd < NFILES; fd++)
-    {
-        if (curproc->p_files[fd]) {
-            fput(curproc->p_files + fd);
-            curproc->p_files[fd] = NULL;  // Prevent double-free in proc_destroy
-        }
-    }
+    aio_proc_exit(curproc);  // before the files its requests may be using
+    fdtable_put(&curproc->p_fdtable);  // NULL, so proc_destroy skips it
     if (curproc->p_cwd)
     {
         vput(&curproc->p_cwd);
         curproc->p_cwd = NULL;  // Prevent double-free in proc_destroy
     }
+#ifdef __GETCWD__
+    if (curproc->p_cwd_path)
+    {
+        kfree(curproc->p_cwd_path);
+        curproc->p_cwd_path = NULL;
+    }
+#endif
 #endif
 
     // Initiate shutdown if this is the init process
@@ -301,25 +391,65 @@ void proc_cleanup(long status)
         initproc_finish();
     }
 
-    // Reparent all child processes to the init process
-    if (!list_empty(&curproc->p_children)) {
-        list_iterate(&curproc->p_children, child, proc_t, p_child_link) {
+    // Reparent all child processes to the init process, the dead ones to its
+    // zombies, waking it if there are any
+    list_iterate(&curproc->p_children, child, proc_t, p_child_link) {
+        list_remove(&child->p_child_link);
+        child->p_pproc = proc_initproc;
+        if (proc_initproc) {
+            list_insert_tail(&proc_initproc->p_children, &child->p_child_link);
+        }
+    }
+    if (!list_empty(&curproc->p_zombies)) {
+        list_iterate(&curproc->p_zombies, child, proc_t, p_child_link) {
             list_remove(&child->p_child_link);
-            
             child->p_pproc = proc_initproc;
-            
             if (proc_initproc) {
-                list_insert_tail(&proc_initproc->p_children, &child->p_child_link);
+                list_insert_tail(&proc_initproc->p_zombies, &child->p_child_link);
             }
         }
+        if (proc_initproc) {
+            sched_broadcast_on(&proc_initproc->p_wait);
+        }
     }
 
-    // Broadcast on parent's wait queue to notify parent that this process is exiting
+    // Move to the parent's zombies, then wake only those waiting for this
+    // process in particular and those waiting for any child
+    curproc->p_state = PROC_DEAD;
     if (curproc->p_pproc) {
+        list_remove(&curproc->p_child_link);
+        list_insert_tail(&curproc->p_pproc->p_zombies, &curproc->p_child_link);
+        sched_broadcast_on(&curproc->p_exitq);
         sched_broadcast_on(&curproc->p_pproc->p_wait);
     }
 }
 
+#ifdef __MTP__
+/* Returns how many of proc's threads have not exited; p_thr_lock is held. */
+static long _proc_live_threads(proc_t *proc)
+{
+    long live = 0;
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        live += thr->kt_state != KT_EXITED;
+    }
+    return live;
+}
+
+/* Returns curproc's thread tid, or NULL; p_thr_lock is held. */
+static kthread_t *_proc_find_thread(pid_t tid)
+{
+    list_iterate(&curproc->p_threads, thr, kthread_t, kt_plink)
+    {
+        if (thr->kt_tid == tid)
+        {
+            return thr;
+        }
+    }
+    return NULL;
+}
+#endif
+
 /*
  * Cleans up the current process and the current thread, broadcasts on its
  * parent's p_wait, then forces a context switch. After this, the process is
@@ -336,6 +466,22 @@ void proc_cleanup(long status)
  */
 void proc_thread_exiting(void *retval)
 {
+#ifdef __MTP__
+    // Unless it is the last, the thread exits alone, to be joined; the lock
+    // is dropped once it is off its stack, which the joiner frees
+    spinlock_lock(&curproc->p_thr_lock);
+    if (_proc_live_threads(curproc) > 1)
+    {
+        curthr->kt_state = KT_EXITED;
+        curthr->kt_retval = retval;
+        sched_broadcast_on(&curproc->p_thrwait);
+        curcore.kc_release = &curproc->p_thr_lock;
+        sched_switch(NULL);
+        panic("proc_thread_exiting: returned from sched_switch");
+    }
+    spinlock_unlock(&curproc->p_thr_lock);
+#endif
+
     // Clean up the current process
     proc_cleanup((long)retval);
     
@@ -359,10 +505,15 @@ void proc_kill(proc_t *proc, long status)
 {
     KASSERT(proc != curproc);
     
-    // Cancel each thread with the status cast to void*
+    // Cancel each thread with the status cast to void*; those that have
+    // exited keep the value they are to be joined with
+    spinlock_lock(&proc->p_thr_lock);
     list_iterate(&proc->p_threads, thr, kthread_t, kt_plink) {
-        kthread_cancel(thr, (void *)status);
+        if (thr->kt_state != KT_EXITED) {
+            kthread_cancel(thr, (void *)status);
+        }
     }
+    spinlock_unlock(&proc->p_thr_lock);
 }
 
 /*
@@ -393,6 +544,57 @@ void proc_kill_all()
     do_exit(-1);
 }
 
+/*
+ * The reaper: work that tears down the address space of a process that has
+ * been waited for, so that do_waitpid does not wait for every area's
+ * objects to be put and the page tables to be freed, which for a big heap
+ * takes a while. The proc_t, off every list and with its pid free, stays
+ * allocated until then.
+ *
+ * proc_reap_lock protects proc_nreaping; it is only taken in thread context.
+ */
+static spinlock_t proc_reap_lock = SPINLOCK_INITIALIZER(proc_reap_lock);
+static ktqueue_t proc_reap_doneq = KTQUEUE_INITIALIZER(proc_reap_doneq);
+static long proc_nreaping;
+
+/* Frees proc's address space, then proc itself */
+static void proc_free_vm(proc_t *proc)
+{
+#ifdef __VM__
+    /* Unmap the user pages first, as their objects may go with the vmmap. */
+    pt_unmap_range(proc->p_pml4, USER_MEM_LOW, USER_MEM_HIGH);
+    if (proc->p_vmmap)
+        vmmap_destroy(&proc->p_vmmap);
+    vdso_proc_free(proc);
+#endif
+    pframe_disown(proc);
+
+    KASSERT(proc->p_pml4);
+    pt_destroy(proc->p_pml4);
+    slab_obj_free(proc_allocator, proc);
+}
+
+static void proc_reap_run(work_t *work)
+{
+    proc_free_vm(CONTAINER_OF(work, proc_t, p_reap_work));
+
+    spinlock_lock(&proc_reap_lock);
+    proc_nreaping--;
+    sched_broadcast_on(&proc_reap_doneq);
+    spinlock_unlock(&proc_reap_lock);
+}
+
+void proc_reaper_drain()
+{
+    spinlock_lock(&proc_reap_lock);
+    while (proc_nreaping)
+    {
+        sched_sleep_on_locked(&proc_reap_doneq, &proc_reap_lock);
+        spinlock_lock(&proc_reap_lock);
+    }
+    spinlock_unlock(&proc_reap_lock);
+}
+
 /*
  * Destroy / free everything from proc. Be sure to remember reference counting
  * when working on VFS.
@@ -404,6 +606,12 @@ void proc_kill_all()
 void proc_destroy(proc_t *proc)
 {
     list_remove(&proc->p_list_link);
+    list_remove(&proc->p_hash_link);
+    if (list_link_is_linked(&proc->p_child_link))
+    {
+        /* a child whose fork() failed, rather than one waited for */
+        list_remove(&proc->p_child_link);
+    }
 
     list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
     {
@@ -411,28 +619,32 @@ void proc_destroy(proc_t *proc)
     }
 
 #ifdef __VFS__
-    for (int fd = 0; fd < NFILES; fd++)
-    {
-        if (proc->p_files[fd])
-            fput(proc->p_files + fd);
-    }
+    fdtable_put(&proc->p_fdtable);
     if (proc->p_cwd)
     {
         vput(&proc->p_cwd);
     }
+#ifdef __GETCWD__
+    if (proc->p_cwd_path)
+    {
+        kfree(proc->p_cwd_path);
+    }
 #endif
-
-#ifdef __VM__
-    if (proc->p_vmmap)
-        vmmap_destroy(&proc->p_vmmap);
 #endif
 
     dbg(DBG_THR, "destroying P%d\n", proc->p_pid);
+    _proc_putid(proc->p_pid);
 
-    KASSERT(proc->p_pml4);
-    pt_destroy(proc->p_pml4);
-
-    slab_obj_free(proc_allocator, proc);
+    if (!workqueue_running())
+    {
+        proc_free_vm(proc);
+        return;
+    }
+    spinlock_lock(&proc_reap_lock);
+    proc_nreaping++;
+    spinlock_unlock(&proc_reap_lock);
+    work_init(&proc->p_reap_work, proc_reap_run);
+    queue_work(&proc->p_reap_work);
 }
 
 /*=============
@@ -446,9 +658,13 @@ void proc_destroy(proc_t *proc)
  * If pid is a positive integer, tries to clean up the process specified by pid.
  * If pid is -1, cleans up any child process of curproc that exits.
  *
+ * With WNOHANG in options, returns 0 rather than sleeping when no child
+ * that would be cleaned up has exited yet, so init can reap whatever has
+ * exited and go on.
+ *
  * Returns the pid of the child process that exited, or error cases:
  *  - ENOTSUP: pid is 0, a negative number not equal to -1,
- *      or options are specified (options does not equal 0)
+ *      or options other than WNOHANG are specified
  *  - ECHILD: pid is a positive integer but not a child of curproc, or
  *      pid is -1 and the process has no children
  *
@@ -466,7 +682,7 @@ void proc_destroy(proc_t *proc)
 pid_t do_waitpid(pid_t pid, int *status, int options)
 {
     // Check for invalid options
-    if (options != 0) {
+    if (options & ~WNOHANG) {
         return -ENOTSUP;
     }
     
@@ -477,22 +693,24 @@ pid_t do_waitpid(pid_t pid, int *status, int options)
     
     // Handle waiting for a specific child process
     if (pid > 0) {
-        proc_t *child = NULL;
-        list_iterate(&curproc->p_children, c, proc_t, p_child_link) {
-            if (c->p_pid == pid) {
-                child = c;
-                break;
-            }
-        }
+        proc_t *child = proc_lookup(pid);
         
         // Check if child is found
-        if (!child) {
+        if (!child || child->p_pproc != curproc) {
             return -ECHILD;
         }
         
-        // Wait for the child to exit
+        // Wait for the child to exit, on its own queue so that other children
+        // exiting do not wake us. Another of our threads may reap it first.
         while (child->p_state != PROC_DEAD) {
-            sched_sleep_on(&curproc->p_wait);
+            if (options & WNOHANG) {
+                return 0;
+            }
+            sched_sleep_on(&child->p_exitq);
+            child = proc_lookup(pid);
+            if (!child || child->p_pproc != curproc) {
+                return -ECHILD;
+            }
         }
         
         // Set status if provided   
@@ -512,24 +730,17 @@ pid_t do_waitpid(pid_t pid, int *status, int options)
     
     // Handle waiting for any child process
     else if (pid == -1) {
-        if (list_empty(&curproc->p_children)) {
-            return -ECHILD;
-        }
-        
-        // Wait until any child exits
-        proc_t *dead_child = NULL;
-        while (!dead_child) {
-            list_iterate(&curproc->p_children, c, proc_t, p_child_link) {
-                if (c->p_state == PROC_DEAD) {
-                    dead_child = c;
-                    break;
-                }
+        // Wait until any child exits, taking the first of the zombies
+        while (list_empty(&curproc->p_zombies)) {
+            if (list_empty(&curproc->p_children)) {
+                return -ECHILD;
             }
-            
-            if (!dead_child) {
-                sched_sleep_on(&curproc->p_wait);
+            if (options & WNOHANG) {
+                return 0;
             }
+            sched_sleep_on(&curproc->p_wait);
         }
+        proc_t *dead_child = list_head(&curproc->p_zombies, proc_t, p_child_link);
         
         // Set status if provided
         if (status) {
@@ -554,9 +765,131 @@ pid_t do_waitpid(pid_t pid, int *status, int options)
  */
 void do_exit(long status)
 {
+#ifdef __MTP__
+    // If another thread is killing the process already, we are among those
+    // it waits for
+    proc_kill_siblings(status);
+#endif
     kthread_exit((void *)status);
 }
 
+long do_getrlimit(int resource, rlimit_t *rlim)
+{
+    if (resource != RLIMIT_RSS)
+    {
+        return -EINVAL;
+    }
+    size_t limit = curproc->p_rss_limit;
+    rlim->rlim_cur = limit ? limit << PAGE_SHIFT : RLIM_INFINITY;
+    rlim->rlim_max = rlim->rlim_cur;
+    return 0;
+}
+
+/*
+ * The limit is kept in pages, rounded down, but at least one.
+ */
+long do_setrlimit(int resource, const rlimit_t *rlim)
+{
+    if (resource != RLIMIT_RSS || rlim->rlim_cur > rlim->rlim_max)
+    {
+        return -EINVAL;
+    }
+    size_t limit = rlim->rlim_cur == RLIM_INFINITY
+                       ? 0
+                       : MAX(rlim->rlim_cur >> PAGE_SHIFT, 1UL);
+    curproc->p_rss_limit = limit;
+    dbg(DBG_PROC, "P%d may now keep %lu pages resident\n", curproc->p_pid,
+        limit);
+    return 0;
+}
+
+#ifdef __MTP__
+long proc_kill_siblings(long status)
+{
+    proc_t *p = curproc;
+    spinlock_lock(&p->p_thr_lock);
+    if (p->p_exiting)
+    {
+        spinlock_unlock(&p->p_thr_lock);
+        return -EINTR;
+    }
+    p->p_exiting = 1;
+    list_iterate(&p->p_threads, thr, kthread_t, kt_plink)
+    {
+        if (thr != curthr && thr->kt_state != KT_EXITED)
+        {
+            kthread_cancel(thr, (void *)status);
+        }
+    }
+    while (_proc_live_threads(p) > 1)
+    {
+        sched_sleep_on_locked(&p->p_thrwait, &p->p_thr_lock);
+        spinlock_lock(&p->p_thr_lock);
+    }
+    p->p_exiting = 0;
+    spinlock_unlock(&p->p_thr_lock);
+    return 0;
+}
+
+long do_thr_join(pid_t tid, void **retval)
+{
+    if (tid == curthr->kt_tid)
+    {
+        return -EDEADLK;
+    }
+
+    // Looked up afresh after each wakeup: another joiner may have freed it
+    proc_t *p = curproc;
+    spinlock_lock(&p->p_thr_lock);
+    kthread_t *thr;
+    while ((thr = _proc_find_thread(tid)) && thr->kt_state != KT_EXITED)
+    {
+        long ret = sched_cancellable_sleep_on_locked(&p->p_thrwait,
+                                                     &p->p_thr_lock);
+        if (ret)
+        {
+            return ret;
+        }
+        spinlock_lock(&p->p_thr_lock);
+    }
+    if (thr)
+    {
+        list_remove(&thr->kt_plink);
+    }
+    spinlock_unlock(&p->p_thr_lock);
+
+    if (!thr)
+    {
+        return -ESRCH;
+    }
+    if (retval)
+    {
+        *retval = thr->kt_retval;
+    }
+    kthread_destroy(thr);
+    return 0;
+}
+
+long do_thr_cancel(pid_t tid)
+{
+    if (tid == curthr->kt_tid)
+    {
+        return -EDEADLK;
+    }
+
+    long ret = -ESRCH;
+    spinlock_lock(&curproc->p_thr_lock);
+    kthread_t *thr = _proc_find_thread(tid);
+    if (thr && thr->kt_state != KT_EXITED)
+    {
+        kthread_cancel(thr, (void *)-1);
+        ret = 0;
+    }
+    spinlock_unlock(&curproc->p_thr_lock);
+    return ret;
+}
+#endif
+
 /*==========
  * Debugging
  *=========*/
@@ -582,7 +915,7 @@ size_t proc_info(const void *arg, char *buf, size_t osize)
         iprintf(&buf, &size, "parent:       -\n");
     }
 
-    if (list_empty(&p->p_children))
+    if (list_empty(&p->p_children) && list_empty(&p->p_zombies))
     {
         iprintf(&buf, &size, "children:     -\n");
     }
@@ -594,6 +927,11 @@ size_t proc_info(const void *arg, char *buf, size_t osize)
     {
         iprintf(&buf, &size, "     %i (%s)\n", child->p_pid, child->p_name);
     }
+    list_iterate(&p->p_zombies, child, proc_t, p_child_link)
+    {
+        iprintf(&buf, &size, "     %i (%s, exited)\n", child->p_pid,
+                child->p_name);
+    }
 
     iprintf(&buf, &size, "status:       %ld\n", p->p_status);
     iprintf(&buf, &size, "state:        %i\n", p->p_state);
@@ -616,6 +954,13 @@ size_t proc_info(const void *arg, char *buf, size_t osize)
 #ifdef __VM__
     iprintf(&buf, &size, "start brk:    0x%p\n", p->p_start_brk);
     iprintf(&buf, &size, "brk:          0x%p\n", p->p_brk);
+    iprintf(&buf, &size, "resident:     %lu pages, %lu shared\n", p->p_rss,
+            pframe_rss_shared(p));
+    if (p->p_rss_limit)
+        iprintf(&buf, &size, "rss limit:    %lu pages\n", p->p_rss_limit);
+    else
+        iprintf(&buf, &size, "rss limit:    -\n");
+    size = pagefault_info(p, buf, size);
 #endif
 
     return size;
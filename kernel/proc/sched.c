@@ -3,9 +3,18 @@
 #include "fs/vfs.h"
 #include "globals.h"
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/inits.h"
+#include "main/fpu.h"
+#include "main/pmu.h"
+#include "main/softirq.h"
+#include "mm/page.h"
+#include "proc/kmutex.h"
 #include "types.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/timer.h"
+#include "util/trace.h"
 #include <util/time.h>
 
 /*==========
@@ -13,15 +22,49 @@
  *=========*/
 
 /*
- * The run queue of threads waiting to be run.
+ * Bitmask of cores halted in core_switch() waiting for work. Bit i is set by
+ * core i itself; other cores read it to decide whether to send a wakeup IPI.
  */
-static ktqueue_t kt_runq CORE_SPECIFIC_DATA;
+static volatile uint64_t sched_idle_cores = 0;
+
+/*
+ * The FS base this core last loaded, so that switching between threads with
+ * the same TLS pointer (kt_tls) costs no MSR write.
+ */
+static uintptr_t sched_tls CORE_SPECIFIC_DATA;
+
+static void sched_load_tls(uintptr_t tls)
+{
+    CSD(sched_tls) = tls;
+    cpuid_set_msr(MSR_FS_BASE, (uint32_t)tls, (uint32_t)(tls >> 32));
+}
+
+/*
+ * Sets curthr's TLS pointer, for set_tls(2) and execve(). Interrupts are off
+ * so the core cannot switch threads between the two.
+ */
+void sched_set_tls(uintptr_t tls)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    curthr->kt_tls = tls;
+    sched_load_tls(tls);
+    if (enabled)
+        intr_enable();
+}
 
 /*
  * Helper tracking most recent thread context before a context_switch().
  */
 static context_t *last_thread_context CORE_SPECIFIC_DATA;
 
+/*
+ * Histogram of how long threads sat on this core's run queue before being
+ * dispatched. Bucket 0 counts waits of zero jiffies; bucket i > 0 counts
+ * waits in [2^(i-1), 2^i), and the last bucket also takes everything longer.
+ */
+static uint64_t sched_wait_hist[SCHED_WAIT_HIST_BUCKETS] CORE_SPECIFIC_DATA;
+
 /*===================
  * Preemption helpers
  *==================*/
@@ -38,6 +81,12 @@ inline void preemption_enable()
     {
         KASSERT(curthr->kt_preemption_count);
         curthr->kt_preemption_count--;
+        /* Run the softirqs that came in meanwhile, if they can run now */
+        if (!curthr->kt_preemption_count && intr_enabled() &&
+            intr_getipl() == IPL_LOW)
+        {
+            softirq_run();
+        }
     }
 }
 
@@ -132,16 +181,325 @@ static void ktqueue_remove(ktqueue_t *queue, kthread_t *thr)
  */
 inline long sched_queue_empty(ktqueue_t *queue) { return queue->tq_size == 0; }
 
+/*===================
+ * Run queue functions
+ *==================*/
+
+/*
+ * Returns the core_t of the given core through its physmap alias. Run queues
+ * must always be accessed this way: the list pointers then stay valid no
+ * matter which core walks them, which is what makes stealing possible.
+ */
+static inline core_t *sched_core(long id)
+{
+    return GET_CSD(id, core_t, csd_curcore);
+}
+
+/*
+ * Locks a core's run queue. The timer interrupt is above IPL_HIGH and may
+ * make threads runnable, so interrupts are disabled entirely while the
+ * spinlock is held. Returns whether interrupts were previously enabled.
+ */
+static long runq_lock(core_t *core)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&core->kc_lock);
+    return enabled;
+}
+
+static void runq_unlock(core_t *core, long enabled)
+{
+    spinlock_unlock(&core->kc_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Returns the index into rq_queues that thr is queued on.
+ */
+static inline long runq_prio(kthread_t *thr)
+{
+    KASSERT(thr->kt_nice >= SCHED_NICE_MIN && thr->kt_nice <= SCHED_NICE_MAX);
+    return thr->kt_nice - SCHED_NICE_MIN;
+}
+
+/*
+ * Returns true if queue is one of the per-priority queues of rq.
+ */
+static inline long runq_contains(runq_t *rq, ktqueue_t *queue)
+{
+    return queue >= rq->rq_queues && queue < rq->rq_queues + SCHED_NPRIO;
+}
+
+/*
+ * Removes a thread from the highest-priority non-empty queue of rq, using
+ * take to pick which end of that queue. Returns NULL if rq is empty.
+ *
+ * rq must be locked
+ */
+static kthread_t *runq_take(runq_t *rq, kthread_t *(*take)(ktqueue_t *))
+{
+    if (!rq->rq_bitmap)
+        return NULL;
+
+    long prio = __builtin_ctzll(rq->rq_bitmap);
+    ktqueue_t *queue = &rq->rq_queues[prio];
+    kthread_t *thr = take(queue);
+    KASSERT(thr);
+
+    if (sched_queue_empty(queue))
+        rq->rq_bitmap &= ~(1ULL << prio);
+    rq->rq_size--;
+    return thr;
+}
+
+/*
+ * Removes thr from the run queue rq it waits on.
+ *
+ * rq must be locked
+ */
+static void runq_remove(runq_t *rq, kthread_t *thr)
+{
+    ktqueue_t *queue = thr->kt_wchan;
+    KASSERT(runq_contains(rq, queue));
+    ktqueue_remove(queue, thr);
+    if (sched_queue_empty(queue))
+        rq->rq_bitmap &= ~(1ULL << runq_prio(thr));
+    rq->rq_size--;
+}
+
+/*
+ * Adds thr to the given core's run queue.
+ */
+static void runq_enqueue(core_t *core, kthread_t *thr)
+{
+    long enabled = runq_lock(core);
+    runq_t *rq = &core->kc_runq;
+    long prio = runq_prio(thr);
+    thr->kt_switched_at = jiffies;
+    ktqueue_enqueue(&rq->rq_queues[prio], thr);
+    rq->rq_bitmap |= 1ULL << prio;
+    rq->rq_size++;
+    runq_unlock(core, enabled);
+}
+
+/*
+ * Removes the next thread to run from the given core's run queue, or returns
+ * NULL if the queue is empty.
+ */
+static kthread_t *runq_dequeue(core_t *core)
+{
+    long enabled = runq_lock(core);
+    kthread_t *thr = runq_take(&core->kc_runq, ktqueue_dequeue);
+    runq_unlock(core, enabled);
+    return thr;
+}
+
+/*
+ * Returns true if id names a core that has been brought up.
+ */
+static inline long sched_core_online(long id)
+{
+    return id >= 0 && id < MAX_LAPICS && csd_vaddr_table[id];
+}
+
+/*
+ * Returns the CPU mask of the cores that have been brought up.
+ */
+static uint64_t sched_online_cores()
+{
+    uint64_t online = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (sched_core_online(id))
+            online |= SCHED_CORE(id);
+    }
+    return online;
+}
+
+/*
+ * Returns the mask of the online cores thr may run on. A thread whose mask
+ * has none, which only happens if every online core is isolated, may run on
+ * any of them rather than on none.
+ */
+static uint64_t sched_allowed(kthread_t *thr)
+{
+    uint64_t online = sched_online_cores();
+    uint64_t allowed = thr->kt_affinity & online;
+    return allowed ? allowed : online;
+}
+
+/*
+ * Chooses the core whose run queue a newly runnable thread should join: the
+ * core it last ran on, so that it finds its cache and TLB state warm, unless
+ * that core is noticeably busier than the current one. Only the cores thr is
+ * allowed on are considered; if neither of those two is, the least busy of
+ * the others is taken.
+ */
+static core_t *runq_select(kthread_t *thr)
+{
+    uint64_t allowed = sched_allowed(thr);
+    core_t *local = NULL;
+    if (allowed & SCHED_CORE(curcore.kc_id))
+        local = sched_core(curcore.kc_id);
+
+    long id = thr->kt_recent_core;
+    if (id == curcore.kc_id || !sched_core_online(id) ||
+        !(allowed & SCHED_CORE(id)))
+    {
+        if (local)
+            return local;
+        core_t *least = NULL;
+        for (id = 0; id < MAX_LAPICS; id++)
+        {
+            if (!(allowed & SCHED_CORE(id)))
+                continue;
+            core_t *core = sched_core(id);
+            if (!least || core->kc_runq.rq_size < least->kc_runq.rq_size)
+                least = core;
+        }
+        return least;
+    }
+
+    core_t *recent = sched_core(id);
+    if (local && recent->kc_runq.rq_size >
+                     local->kc_runq.rq_size + SCHED_AFFINITY_SLACK)
+        return local;
+    return recent;
+}
+
+/*
+ * Called after thr has been queued on target. If target is halted, sends it
+ * an IPI so it picks thr up immediately instead of at its next timer tick.
+ * If thr was queued here while this core is busy, kicks some idle core it is
+ * allowed on so that core can steal the thread instead.
+ */
+static void sched_kick(core_t *target, kthread_t *thr)
+{
+    /* Order the enqueue before reading the mask; pairs with the idle loop */
+    __sync_synchronize();
+    uint64_t idle = sched_idle_cores & ~(1UL << curcore.kc_id);
+    if (target->kc_id == curcore.kc_id)
+        idle &= sched_allowed(thr);
+
+    long id = -1;
+    if (target->kc_id != curcore.kc_id)
+    {
+        if (idle & (1UL << target->kc_id))
+            id = target->kc_id;
+    }
+    else if (curthr && idle)
+    {
+        id = __builtin_ctzll(idle);
+    }
+
+    if (id >= 0)
+    {
+        apic_send_ipi((uint8_t)id, DESTINATION_MODE_FIXED, INTR_WAKEUP);
+    }
+}
+
+/*
+ * The wakeup IPI only needs to bring its target out of hlt; core_switch()
+ * then finds the new work on its own.
+ */
+static long sched_wakeup_ipi_handler(regs_t *regs) { return 0; }
+
+/*
+ * Removes and returns the thread of rq that would otherwise be run last among
+ * those allowed on the current core, or NULL if there is none: the tail of
+ * the highest priority that has one.
+ *
+ * rq must be locked
+ */
+static kthread_t *runq_take_allowed(runq_t *rq)
+{
+    for (uint64_t bits = rq->rq_bitmap; bits; bits &= bits - 1)
+    {
+        ktqueue_t *queue = &rq->rq_queues[__builtin_ctzll(bits)];
+        list_iterate(&queue->tq_list, thr, kthread_t, kt_qlink)
+        {
+            if (sched_allowed(thr) & SCHED_CORE(curcore.kc_id))
+            {
+                runq_remove(rq, thr);
+                return thr;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Steals a thread from another core's run queue, or returns NULL if no other
+ * core has a runnable thread that may run here. The busiest core is tried
+ * first, and the next busiest if it has none. The queue sizes are read
+ * without locking; they only guide the choice of victim.
+ */
+static kthread_t *runq_steal()
+{
+    uint64_t tried = SCHED_CORE(curcore.kc_id);
+    while (1)
+    {
+        core_t *victim = NULL;
+        size_t most = 0;
+        for (long id = 0; id < MAX_LAPICS; id++)
+        {
+            if ((tried & SCHED_CORE(id)) || !sched_core_online(id))
+                continue;
+            core_t *core = sched_core(id);
+            if (core->kc_runq.rq_size > most)
+            {
+                most = core->kc_runq.rq_size;
+                victim = core;
+            }
+        }
+        if (!victim)
+            return NULL;
+        tried |= SCHED_CORE(victim->kc_id);
+
+        long enabled = runq_lock(victim);
+        kthread_t *thr = runq_take_allowed(&victim->kc_runq);
+        runq_unlock(victim, enabled);
+
+        if (thr)
+        {
+            TRACE(TRACE_SCHED_STEAL, thr, victim->kc_id);
+            return thr;
+        }
+    }
+}
+
+/*
+ * Returns the sched_wait_hist bucket for a run queue wait of the given length.
+ */
+static inline long sched_wait_bucket(uint64_t ticks)
+{
+    if (!ticks)
+        return 0;
+    long bucket = 64 - __builtin_clzll(ticks);
+    return MIN(bucket, SCHED_WAIT_HIST_BUCKETS - 1);
+}
+
 /*==========
  * Functions
  *=========*/
 
 /*
- * Initializes the run queue.
+ * Initializes the current core's run queue.
  */
 void sched_init(void)
 {
-    sched_queue_init(GET_CSD(curcore.kc_id, ktqueue_t, kt_runq));
+    core_t *core = sched_core(curcore.kc_id);
+    for (long prio = 0; prio < SCHED_NPRIO; prio++)
+    {
+        sched_queue_init(&core->kc_runq.rq_queues[prio]);
+    }
+    core->kc_runq.rq_bitmap = 0;
+    core->kc_runq.rq_size = 0;
+    spinlock_init(&core->kc_lock);
+
+    intr_register(INTR_WAKEUP, sched_wakeup_ipi_handler);
 }
 
 /*
@@ -175,6 +533,60 @@ long sched_cancellable_sleep_on(ktqueue_t *queue)
     return curthr->kt_cancelled ? -EINTR : 0;
 }
 
+typedef struct sched_timeout
+{
+    kthread_t *st_thr;
+    ktqueue_t *st_queue;
+    long st_timed_out; /* set if the timer woke st_thr */
+} sched_timeout_t;
+
+static void sched_timeout_fire(uint64_t data)
+{
+    sched_timeout_t *st = (sched_timeout_t *)data;
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    kthread_t *thr = st->st_thr;
+    if (thr->kt_state == KT_SLEEP_CANCELLABLE && thr->kt_wchan == st->st_queue)
+    {
+        st->st_timed_out = 1;
+        ktqueue_remove(st->st_queue, thr);
+        sched_make_runnable(thr);
+    }
+    intr_setipl(old_ipl);
+}
+
+/*
+ * Like sched_cancellable_sleep_on(), but also wakes curthr once jiffies
+ * reach expires. A timer on the current core's wheel does the waking, so the
+ * core is free (or idle) until then.
+ *
+ * The timer is added at IPL_HIGH, so that it cannot fire before curthr is on
+ * queue; one already due fires with the next tick.
+ *
+ * Returns 0 if woken from queue, -ETIMEDOUT if the deadline came first, or
+ * -EINTR if curthr was cancelled.
+ */
+long sched_sleep_on_timeout(ktqueue_t *queue, uint64_t expires)
+{
+    sched_timeout_t st = {.st_thr = curthr, .st_queue = queue};
+    timer_t timer;
+    timer_init(&timer);
+    timer.function = sched_timeout_fire;
+    timer.data = (uint64_t)&st;
+    timer.expires = expires;
+
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    timer_add(&timer);
+    long ret = sched_cancellable_sleep_on(queue);
+    intr_setipl(old_ipl);
+    timer_del(&timer);
+
+    if (ret)
+    {
+        return ret;
+    }
+    return st.st_timed_out ? -ETIMEDOUT : 0;
+}
+
 /*
  * If the given thread is in a cancellable sleep, removes it from whatever queue 
  * it is sleeping on and makes the thread runnable again.
@@ -240,8 +652,20 @@ void sched_switch(ktqueue_t *queue)
     // Set the current core's queue to the new queue
     curcore.kc_queue = queue;
     
+    // Charge the time slice that is ending
+    curthr->kt_run_ticks += jiffies - curthr->kt_switched_at;
+    if (curthr->kt_state == KT_RUNNABLE)
+        curthr->kt_nivcsw++;
+    else
+        curthr->kt_nvcsw++;
+
+    if (curthr->kt_pmu)
+        pmu_switch_out(curthr);
+    if (curthr->kt_fpu)
+        fpu_switch_out(curthr);
+
     // Save the current thread's context
-    last_thread_context = &curthr->kt_ctx;
+    CSD(last_thread_context) = &curthr->kt_ctx;
     
     // Switch to the core's context
     context_switch(&curthr->kt_ctx, &curcore.kc_ctx);
@@ -261,12 +685,13 @@ void sched_yield()
 {
     KASSERT(curthr->kt_state == KT_ON_CPU);
     curthr->kt_state = KT_RUNNABLE;
-    sched_switch(&kt_runq);
+    runq_t *rq = &sched_core(curcore.kc_id)->kc_runq;
+    sched_switch(&rq->rq_queues[runq_prio(curthr)]);
 }
 
 /*
- * Makes the given thread runnable by setting its state and enqueuing it in the 
- * run queue (kt_runq).
+ * Makes the given thread runnable by setting its state and enqueuing it in a
+ * core's run queue (kc_runq), preferring the core it last ran on.
  *
  * Hints:
  * Cannot be called on curthr (it is already running).
@@ -283,10 +708,244 @@ void sched_make_runnable(kthread_t *thr)
 
     thr->kt_state = KT_RUNNABLE;
     
-    ktqueue_enqueue(&kt_runq, thr);
+    core_t *target = runq_select(thr);
+    runq_enqueue(target, thr);
+    sched_kick(target, thr);
+    intr_setipl(old_ipl);
+}
+
+/*
+ * Sets thr's nice value to nice. A thread waiting on a run queue is moved to
+ * its new priority's queue there; one running or asleep picks the new value
+ * up when it is next queued. The run queues are searched for thr one at a
+ * time, so a thread that is being moved meanwhile may keep its old place
+ * until then.
+ */
+void sched_set_nice(kthread_t *thr, long nice)
+{
+    KASSERT(nice >= SCHED_NICE_MIN && nice <= SCHED_NICE_MAX);
+    for (long id = 0; thr->kt_state == KT_RUNNABLE && id < MAX_LAPICS; id++)
+    {
+        if (!sched_core_online(id))
+            continue;
+        core_t *core = sched_core(id);
+        long enabled = runq_lock(core);
+        runq_t *rq = &core->kc_runq;
+        ktqueue_t *queue = thr->kt_wchan;
+        if (thr->kt_state == KT_RUNNABLE && runq_contains(rq, queue))
+        {
+            ktqueue_remove(queue, thr);
+            if (sched_queue_empty(queue))
+                rq->rq_bitmap &= ~(1ULL << runq_prio(thr));
+            thr->kt_nice = nice;
+            long prio = runq_prio(thr);
+            ktqueue_enqueue(&rq->rq_queues[prio], thr);
+            rq->rq_bitmap |= 1ULL << prio;
+            runq_unlock(core, enabled);
+            return;
+        }
+        runq_unlock(core, enabled);
+    }
+    thr->kt_nice = nice;
+}
+
+/*
+ * Sets thr's CPU mask to mask. A thread waiting on the run queue of a core it
+ * is no longer allowed on is moved to one it is, found as for a thread made
+ * runnable; curthr moves by yielding, and a thread running elsewhere is
+ * marked to yield at its next preemption point. As with sched_set_nice(), a
+ * thread being queued meanwhile may be missed, and then only moves the next
+ * time it yields on a core it is not allowed on.
+ */
+void sched_set_affinity(kthread_t *thr, uint64_t mask)
+{
+    thr->kt_affinity = mask;
+    if (thr == curthr)
+    {
+        if (!(sched_allowed(thr) & SCHED_CORE(curcore.kc_id)))
+            sched_yield();
+        return;
+    }
+
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    for (long id = 0; thr->kt_state == KT_RUNNABLE && id < MAX_LAPICS; id++)
+    {
+        if (!sched_core_online(id))
+            continue;
+        core_t *core = sched_core(id);
+        long enabled = runq_lock(core);
+        runq_t *rq = &core->kc_runq;
+        if (thr->kt_state == KT_RUNNABLE && runq_contains(rq, thr->kt_wchan))
+        {
+            long moved = !(sched_allowed(thr) & SCHED_CORE(id));
+            if (moved)
+                runq_remove(rq, thr);
+            runq_unlock(core, enabled);
+            if (moved)
+            {
+                core_t *target = runq_select(thr);
+                runq_enqueue(target, thr);
+                sched_kick(target, thr);
+            }
+            intr_setipl(old_ipl);
+            return;
+        }
+        runq_unlock(core, enabled);
+    }
+    if (thr->kt_state == KT_ON_CPU)
+        thr->kt_need_resched = 1;
     intr_setipl(old_ipl);
 }
 
+/*
+ * Returns the length of thr's time slice in timer ticks. The slice scales with
+ * priority: nice -20 gets about twice the default, nice 19 gets a single tick.
+ */
+static long sched_quantum(kthread_t *thr)
+{
+    long quantum = SCHED_QUANTUM_TICKS * (SCHED_NICE_MAX + 1 - thr->kt_nice) /
+                   (SCHED_NICE_MAX + 1);
+    return MAX(quantum, 1);
+}
+
+/*
+ * Charges the current tick to curthr. The reschedule itself is deferred to
+ * sched_preempt_point(), since the interrupted code may hold locks.
+ */
+void sched_tick()
+{
+    if (curthr && --curthr->kt_quantum <= 0)
+    {
+        curthr->kt_need_resched = 1;
+    }
+}
+
+/*
+ * Whether curthr has been marked by sched_tick() and may give up the core:
+ * preemption is enabled, and it is not already on its way to sleep (the
+ * state is set before the switch).
+ */
+static long sched_resched_due()
+{
+    return curthr && curthr->kt_need_resched && preemption_enabled() &&
+           curthr->kt_state == KT_ON_CPU;
+}
+
+/*
+ * If curthr has been marked by sched_tick(), puts it at the back of its run
+ * queue. A cancelled thread exits here instead, so a process that never makes
+ * a system call can still be killed.
+ */
+void sched_preempt_point()
+{
+    if (!curthr || !curthr->kt_need_resched || !preemption_enabled())
+        return;
+
+    curthr->kt_need_resched = 0;
+    if (curthr->kt_cancelled)
+        kthread_exit(curthr->kt_retval);
+
+    TRACE(TRACE_SCHED_PREEMPT, curthr, curthr->kt_tid);
+    sched_yield();
+}
+
+/*
+ * Like sched_preempt_point(), but in kernel code that could sleep: there is
+ * no exiting for a cancelled thread, which may hold locks, and nothing is
+ * done with interrupts masked.
+ */
+void cond_resched()
+{
+    if (!intr_enabled() || intr_getipl() != IPL_LOW || !sched_resched_due())
+        return;
+
+    curthr->kt_need_resched = 0;
+    TRACE(TRACE_SCHED_PREEMPT, curthr, curthr->kt_tid);
+    sched_yield();
+}
+
+#ifdef __KPREEMPT__
+/*
+ * Called on the way out of an interrupt that came in on kernel code with
+ * interrupts enabled and at IPL_LOW, which is then preempted as by
+ * cond_resched() if it may be: holding a spinlock or having called
+ * preemption_disable() keeps it running.
+ */
+void sched_preempt_kernel()
+{
+    if (!sched_resched_due())
+        return;
+
+    curthr->kt_need_resched = 0;
+    TRACE(TRACE_SCHED_PREEMPT, curthr, curthr->kt_tid);
+    sched_yield();
+}
+#endif
+
+/*
+ * Adds incr to the nice value of curthr. The new value takes effect the next
+ * time the thread is put on a run queue.
+ */
+long do_nice(long incr)
+{
+    long nice = curthr->kt_base_nice + incr;
+    nice = MAX(SCHED_NICE_MIN, MIN(SCHED_NICE_MAX, nice));
+    curthr->kt_base_nice = nice;
+    kmutex_update_nice();
+    dbg(DBG_SCHED, "thread 0x%p of P%d now has nice %ld\n", curthr,
+        curproc->p_pid, nice);
+    return nice;
+}
+
+/*
+ * Applies mask to every thread of the process pid names, or of curproc if
+ * pid is 0.
+ */
+long do_sched_setaffinity(pid_t pid, uint64_t mask)
+{
+    proc_t *proc = pid ? proc_lookup(pid) : curproc;
+    if (!proc || proc == CSD_PTR(idleproc) || proc->p_state == PROC_DEAD)
+        return -ESRCH;
+    if (!(sched_online_cores() & mask))
+        return -EINVAL;
+
+    spinlock_lock(&proc->p_thr_lock);
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        if (thr != curthr && thr->kt_state != KT_EXITED)
+            sched_set_affinity(thr, mask);
+    }
+    spinlock_unlock(&proc->p_thr_lock);
+
+    /* Last, since curthr may move to another core */
+    if (proc == curproc)
+        sched_set_affinity(curthr, mask);
+    dbg(DBG_SCHED, "P%d may now run on cores 0x%lx\n", proc->p_pid, mask);
+    return 0;
+}
+
+/*
+ * Puts in *maskp the online cores any thread of the process pid names, or of
+ * curproc if pid is 0, may run on.
+ */
+long do_sched_getaffinity(pid_t pid, uint64_t *maskp)
+{
+    proc_t *proc = pid ? proc_lookup(pid) : curproc;
+    if (!proc || proc == CSD_PTR(idleproc) || proc->p_state == PROC_DEAD)
+        return -ESRCH;
+
+    uint64_t mask = 0;
+    spinlock_lock(&proc->p_thr_lock);
+    list_iterate(&proc->p_threads, thr, kthread_t, kt_plink)
+    {
+        if (thr->kt_state != KT_EXITED)
+            mask |= sched_allowed(thr);
+    }
+    spinlock_unlock(&proc->p_thr_lock);
+    *maskp = mask;
+    return 0;
+}
+
 /*
  * Places curthr in an uninterruptible sleep on q. I.e. if the thread is cancelled
  * while sleeping, it will NOT notice until it is woken up by the event it's 
@@ -309,6 +968,44 @@ void sched_sleep_on(ktqueue_t *q)
     sched_switch(q);
 }
 
+/*
+ * Places curthr in an uninterruptible sleep on q, where q is protected by
+ * lock and lock is held. core_switch() drops the lock right after queueing
+ * curthr, once it is safe for another core to wake it.
+ */
+void sched_sleep_on_locked(ktqueue_t *q, spinlock_t *lock)
+{
+    KASSERT(spinlock_ownslock(lock));
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    curthr->kt_state = KT_SLEEP;
+    curcore.kc_release = lock;
+    intr_setipl(old_ipl);
+    sched_switch(q);
+}
+
+/*
+ * Like sched_sleep_on_locked(), but the sleep is cancellable, as with
+ * sched_cancellable_sleep_on(). Returns -EINTR if curthr was cancelled,
+ * before or during the sleep, and 0 otherwise; lock is released either way.
+ * A sched_cancel() made under the same lock cannot catch curthr cancellable
+ * but not yet on q.
+ */
+long sched_cancellable_sleep_on_locked(ktqueue_t *q, spinlock_t *lock)
+{
+    KASSERT(spinlock_ownslock(lock));
+    if (curthr->kt_cancelled)
+    {
+        spinlock_unlock(lock);
+        return -EINTR;
+    }
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    curthr->kt_state = KT_SLEEP_CANCELLABLE;
+    curcore.kc_release = lock;
+    intr_setipl(old_ipl);
+    sched_switch(q);
+    return curthr->kt_cancelled ? -EINTR : 0;
+}
+
 /*
  * Wakes up a thread on the given queue by taking it off the queue and 
  * making it runnable. If given an empty queue, do nothing.
@@ -340,6 +1037,40 @@ void sched_wakeup_on(ktqueue_t *q, kthread_t **ktp)
     sched_make_runnable(woken_thread);
 }
 
+/*
+ * Places curthr in an uninterruptible, exclusive sleep on q. The flag is only
+ * looked at by sched_wake_on() while curthr is on q.
+ */
+void sched_sleep_on_exclusive(ktqueue_t *q)
+{
+    curthr->kt_wait_exclusive = 1;
+    sched_sleep_on(q);
+    curthr->kt_wait_exclusive = 0;
+}
+
+/*
+ * Wakes the non-exclusive waiters on q, and the exclusive waiter that has
+ * waited longest. Threads are removed from the tail of the queue, where the
+ * oldest waiters are.
+ */
+void sched_wake_on(ktqueue_t *q)
+{
+    uint8_t old_ipl = intr_setipl(IPL_HIGH);
+    long woke_exclusive = 0;
+    list_iterate_reverse(&q->tq_list, thr, kthread_t, kt_qlink)
+    {
+        if (thr->kt_wait_exclusive)
+        {
+            if (woke_exclusive)
+                continue;
+            woke_exclusive = 1;
+        }
+        ktqueue_remove(q, thr);
+        sched_make_runnable(thr);
+    }
+    intr_setipl(old_ipl);
+}
+
 /*
  * Wake up all the threads on the given queue by making them all runnable.
  */
@@ -359,12 +1090,18 @@ void sched_broadcast_on(ktqueue_t *q)
  * You will want to (in this exact order):
  *  1) perform the operations on curcore.kc_queue and curcore.kc_lock
  *  2) set curproc to idleproc, and curthr to NULL
- *  3) try to get the next thread to run by dequeuing from the runqueue.
- * If there is no next thread, then the core is idle, so wait for an interrupt using
+ *  3) try to get the next thread to run by dequeuing from the runqueue; it
+ * picks the highest-priority runnable thread.
+ * If the local runqueue is empty, try to steal a thread allowed here from
+ * another core.
+ * If there is no next thread, then the core is idle: it zeroes a page for
+ * page_alloc_zeroed() if one is wanted and looks again, and otherwise
+ * advertises that in
+ * sched_idle_cores (so other cores send a wakeup IPI) and wait for an interrupt using
  * intr_wait(). Note that you will need to re-disable interrupts after returning
- * from intr_wait(). 4) ensure the context's PML4 for the selected thread is
- * correctly setup with curcore's core-specific data. Use kt_recent_core and
- * map_in_core_specific_data. 5) set curthr and curproc 6) context_switch out
+ * from intr_wait(). 4) record in kt_recent_core that the thread ran here,
+ * for runq_select(). 5) refill the time slice if it was used up,
+ * set curthr and curproc 6) context_switch out
  */
 void core_switch()
 {
@@ -373,44 +1110,147 @@ void core_switch()
         KASSERT(!intr_enabled());
         KASSERT(!curthr || curthr->kt_state != KT_ON_CPU);
 
-        if (curcore.kc_queue)
+        core_t *core = sched_core(curcore.kc_id);
+        if (runq_contains(&core->kc_runq, curcore.kc_queue))
+        {
+            /* A thread no longer allowed here moves on as it yields */
+            if (sched_allowed(curthr) & SCHED_CORE(curcore.kc_id))
+            {
+                runq_enqueue(core, curthr);
+            }
+            else
+            {
+                core_t *target = runq_select(curthr);
+                runq_enqueue(target, curthr);
+                sched_kick(target, curthr);
+            }
+        }
+        else if (curcore.kc_queue)
         {
             ktqueue_enqueue(curcore.kc_queue, curthr);
         }
+        if (curcore.kc_release)
+        {
+            spinlock_unlock(curcore.kc_release);
+            curcore.kc_release = NULL;
+        }
 
-        curproc = &idleproc;
-        curthr = NULL;
+        CSD_WRITE(csd_curproc, CSD_PTR(idleproc));
+        CSD_WRITE(csd_curthr, NULL);
 
         kthread_t *next_thread = NULL;
         while (1)
         {
-            next_thread = ktqueue_dequeue(&kt_runq);
+            next_thread = runq_dequeue(core);
+            if (!next_thread)
+                next_thread = runq_steal();
 
             if (next_thread)
                 break;
 
-            intr_wait();
-            intr_disable();
+            /* Spare time goes to zeroing pages for faults to use later;
+             * the queues are checked again between pages. */
+            if (page_zero_idle())
+                continue;
+
+            /* Recheck after advertising, or a wakeup racing with the checks
+             * above would find us not yet idle and send no IPI. */
+            uint64_t self = 1UL << curcore.kc_id;
+            __sync_fetch_and_or(&sched_idle_cores, self);
+            next_thread = runq_dequeue(core);
+            if (!next_thread)
+            {
+                time_idle_enter(); /* no ticks until a timer is due */
+                intr_wait();
+                intr_disable();
+                time_idle_exit();
+            }
+            __sync_fetch_and_and(&sched_idle_cores, ~self);
+
+            if (next_thread)
+                break;
         }
 
         KASSERT(next_thread->kt_state == KT_RUNNABLE);
         KASSERT(next_thread->kt_proc);
 
-        // if (curcore.kc_id != next_thread->kt_recent_core)
-        // {
-        map_in_core_specific_data(next_thread->kt_ctx.c_pml4);
-            // next_thread->kt_recent_core = curcore.kc_id;
-        // }
+        next_thread->kt_recent_core = curcore.kc_id;
 
-        uintptr_t mapped_paddr = pt_virt_to_phys_helper(
-            next_thread->kt_ctx.c_pml4, (uintptr_t)&next_thread);
-        uintptr_t expected_paddr =
-            pt_virt_to_phys_helper(pt_get(), (uintptr_t)&next_thread);
-        KASSERT(mapped_paddr == expected_paddr);
+        // Two page table walks on every switch
+        KASSERT_PARANOID(
+            pt_virt_to_phys_helper(next_thread->kt_ctx.c_pml4,
+                                   (uintptr_t)&next_thread) ==
+            pt_virt_to_phys_helper(pt_get(), (uintptr_t)&next_thread));
 
-        curthr = next_thread;
+        if (next_thread->kt_quantum <= 0)
+        {
+            next_thread->kt_quantum = sched_quantum(next_thread);
+        }
+        next_thread->kt_need_resched = 0;
+
+        uint64_t waited = jiffies - next_thread->kt_switched_at;
+        next_thread->kt_wait_ticks += waited;
+        next_thread->kt_switched_at = jiffies;
+        CSD(sched_wait_hist)[sched_wait_bucket(waited)]++;
+
+        if (next_thread->kt_tls != CSD(sched_tls))
+        {
+            sched_load_tls(next_thread->kt_tls);
+        }
+
+        CSD_WRITE(csd_curthr, next_thread);
+        if (next_thread->kt_pmu)
+            pmu_switch_in(next_thread);
+        TRACE(TRACE_SCHED_SWITCH, next_thread, next_thread->kt_tid);
         curthr->kt_state = KT_ON_CPU;
-        curproc = curthr->kt_proc;
+        CSD_WRITE(csd_curproc, curthr->kt_proc);
         context_switch(&curcore.kc_ctx, &curthr->kt_ctx);
     }
 }
+
+/*==========
+ * Debugging
+ *=========*/
+
+size_t sched_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+    iprintf(&buf, &size, "%5s %-13s %-18s %10s %10s %8s %8s\n", "PID", "NAME",
+            "THREAD", "RUN", "WAIT", "VCSW", "IVCSW");
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        list_iterate(&p->p_threads, thr, kthread_t, kt_plink)
+        {
+            iprintf(&buf, &size, " %3i  %-13s 0x%p %10lu %10lu %8lu %8lu\n",
+                    p->p_pid, p->p_name, thr, thr->kt_run_ticks,
+                    thr->kt_wait_ticks, thr->kt_nvcsw, thr->kt_nivcsw);
+        }
+    }
+
+    uint64_t hist[SCHED_WAIT_HIST_BUCKETS] = {0};
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (!sched_core_online(id))
+            continue;
+        uint64_t *core_hist = GET_CSD(id, uint64_t, sched_wait_hist);
+        for (long i = 0; i < SCHED_WAIT_HIST_BUCKETS; i++)
+            hist[i] += core_hist[i];
+    }
+
+    iprintf(&buf, &size, "\nrun queue wait (jiffies):\n");
+    for (long i = 0; i < SCHED_WAIT_HIST_BUCKETS; i++)
+    {
+        if (!i)
+            iprintf(&buf, &size, "%10s %10lu\n", "0", hist[i]);
+        else if (i == SCHED_WAIT_HIST_BUCKETS - 1)
+            iprintf(&buf, &size, "%8lu+  %10lu\n", 1UL << (i - 1), hist[i]);
+        else
+            iprintf(&buf, &size, "%5lu-%-4lu %10lu\n", 1UL << (i - 1),
+                    (1UL << i) - 1, hist[i]);
+    }
+    return size;
+}
@@ -1,21 +1,52 @@
 #include "globals.h"
 #include "main/apic.h"
+#include "proc/sched.h"
 
 void spinlock_init(spinlock_t *lock) { lock->s_locked = 0; }
 
+/*
+ * With __KPREEMPT__, a thread holding a spinlock is not preempted (see
+ * cond_resched()): another thread spinning for the lock on the core would
+ * wait out the holder's whole time away. The count is the holder's, so a
+ * lock must be released by the thread that took it, as core_switch() does
+ * for sched_sleep_on_locked().
+ */
 inline void spinlock_lock(spinlock_t *lock)
 {
-// __sync_bool_compare_and_swap is a GCC intrinsic for atomic compare-and-swap
-// If lock->locked is 0, then it is set to 1 and __sync_bool_compare_and_swap
-// returns true Otherwise, lock->locked is left at 1 and
-// __sync_bool_compare_and_swap returns false
+#ifdef __KPREEMPT__
+    preemption_disable();
+#endif
+    // __sync_bool_compare_and_swap is a GCC intrinsic for atomic compare-and-swap
+    // If lock->locked is 0, then it is set to 1 and __sync_bool_compare_and_swap
+    // returns true Otherwise, lock->locked is left at 1 and
+    // __sync_bool_compare_and_swap returns false
+    while (!__sync_bool_compare_and_swap(&lock->s_locked, 0, 1))
+    {
+        while (lock->s_locked)
+            __asm__ volatile("pause");
+    }
 }
 
 inline void spinlock_unlock(spinlock_t *lock)
 {
+    KASSERT(lock->s_locked);
+    __sync_lock_release(&lock->s_locked);
+#ifdef __KPREEMPT__
+    preemption_enable();
+#endif
+}
+
+inline long spinlock_trylock(spinlock_t *lock)
+{
+    long locked = __sync_bool_compare_and_swap(&lock->s_locked, 0, 1);
+#ifdef __KPREEMPT__
+    if (locked)
+        preemption_disable();
+#endif
+    return locked;
 }
 
 inline long spinlock_ownslock(spinlock_t *lock)
 {
-    return 1;
+    return lock->s_locked;
 }
@@ -0,0 +1,250 @@
+#include "proc/workqueue.h"
+#include "globals.h"
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/spinlock.h"
+#include "util/debug.h"
+#include "util/time.h"
+
+/*
+ * Work queues: functions handed to a background thread to run. Each core
+ * has a worker, a daemon thread with a list of its own, and work goes on the
+ * list of the core that queues it, so that queueing from many cores does not
+ * contend for one lock; the scheduler tends to run each worker where it last
+ * ran. A worker runs its work in the order it was queued, one at a time.
+ *
+ * A worker's lock is taken with interrupts off, as timers queue delayed work
+ * from the timer interrupt.
+ */
+
+typedef struct worker
+{
+    spinlock_t wk_lock;
+    list_t wk_list;         /* work queued and not yet started */
+    work_t *wk_running;     /* the work whose function is running, or NULL */
+    ktqueue_t wk_waitq;     /* the worker, waiting for work */
+    ktqueue_t wk_flushq;    /* threads waiting for work to finish */
+    kthread_t *wk_thread;   /* or NULL if the core has no worker */
+} CACHE_LINE_ALIGNED worker_t;
+
+static worker_t workers[MAX_LAPICS];
+static long workqueue_started;
+
+static long worker_lock(worker_t *wk)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&wk->wk_lock);
+    return enabled;
+}
+
+static void worker_unlock(worker_t *wk, long enabled)
+{
+    spinlock_unlock(&wk->wk_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/* The current core's worker, or the first core's if it has none */
+static worker_t *worker_local()
+{
+    KASSERT(workqueue_started && "work queued before the workers started");
+    worker_t *wk = &workers[curcore.kc_id];
+    if (wk->wk_thread)
+    {
+        return wk;
+    }
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (workers[id].wk_thread)
+        {
+            return &workers[id];
+        }
+    }
+    panic("no workers");
+}
+
+static void *worker_run(long arg1, void *arg2)
+{
+    worker_t *wk = &workers[arg1];
+    while (1)
+    {
+        long enabled = worker_lock(wk);
+        while (list_empty(&wk->wk_list))
+        {
+            /* Comes back with interrupts on, see sched_switch() */
+            sched_sleep_on_locked(&wk->wk_waitq, &wk->wk_lock);
+            worker_lock(wk);
+        }
+        work_t *work = list_head(&wk->wk_list, work_t, w_link);
+        list_remove(&work->w_link);
+        work->w_pending = 0;
+        wk->wk_running = work;
+        worker_unlock(wk, enabled);
+
+        /* work may be freed, or queued again, by its own function */
+        work->w_func(work);
+
+        enabled = worker_lock(wk);
+        wk->wk_running = NULL;
+        sched_broadcast_on(&wk->wk_flushq);
+        worker_unlock(wk, enabled);
+    }
+    return NULL;
+}
+
+void work_init(work_t *work, work_func_t func)
+{
+    work->w_func = func;
+    work->w_pending = 0;
+    work->w_worker = NULL;
+    list_link_init(&work->w_link);
+}
+
+/*
+ * Queues work on the current core's worker. Returns 1 if it was queued, and
+ * 0 if it was already waiting to run, in which case it runs once for both.
+ */
+long queue_work(work_t *work)
+{
+    worker_t *wk = worker_local();
+    long enabled = worker_lock(wk);
+    if (!__sync_bool_compare_and_swap(&work->w_pending, 0, 1))
+    {
+        worker_unlock(wk, enabled);
+        return 0;
+    }
+    work->w_worker = wk;
+    list_insert_tail(&wk->wk_list, &work->w_link);
+    sched_wakeup_on(&wk->wk_waitq, NULL);
+    worker_unlock(wk, enabled);
+    return 1;
+}
+
+/*
+ * Waits until work, as last queued, has run: it is neither waiting to run
+ * nor running.
+ */
+void flush_work(work_t *work)
+{
+    while (1)
+    {
+        worker_t *wk = work->w_worker;
+        if (!wk)
+        {
+            return; /* never queued */
+        }
+        long enabled = worker_lock(wk);
+        if (work->w_worker != wk)
+        {
+            /* queued again on another since we looked */
+            worker_unlock(wk, enabled);
+            continue;
+        }
+        if (!work->w_pending && wk->wk_running != work)
+        {
+            worker_unlock(wk, enabled);
+            return;
+        }
+        sched_sleep_on_locked(&wk->wk_flushq, &wk->wk_lock);
+        if (!enabled)
+        {
+            intr_disable();
+        }
+    }
+}
+
+static void delayed_work_fire(uint64_t data)
+{
+    queue_work(&((delayed_work_t *)data)->dw_work);
+}
+
+void delayed_work_init(delayed_work_t *dw, work_func_t func)
+{
+    work_init(&dw->dw_work, func);
+    timer_init(&dw->dw_timer);
+    dw->dw_timer.function = delayed_work_fire;
+    dw->dw_timer.data = (uint64_t)dw;
+}
+
+/*
+ * Queues dw's work once delay jiffies have passed, on the worker of the core
+ * whose timer fires then. Returns 1 if it was queued, and 0 if it was already
+ * waiting, for its timer or to run.
+ */
+long queue_delayed_work(delayed_work_t *dw, uint64_t delay)
+{
+    if (!delay)
+    {
+        return queue_work(&dw->dw_work);
+    }
+    if (timer_pending(&dw->dw_timer) || dw->dw_work.w_pending)
+    {
+        return 0;
+    }
+    timer_mod(&dw->dw_timer, jiffies + delay);
+    return 1;
+}
+
+/*
+ * Stops dw's work from running if it has yet to start, whether it is waiting
+ * for its timer or to run. Returns 1 if it was stopped. It may still be
+ * running once this returns; see flush_work().
+ */
+long cancel_delayed_work(delayed_work_t *dw)
+{
+    if (timer_del(&dw->dw_timer))
+    {
+        return 1;
+    }
+    work_t *work = &dw->dw_work;
+    worker_t *wk = work->w_worker;
+    if (!wk)
+    {
+        return 0;
+    }
+    long ret = 0;
+    long enabled = worker_lock(wk);
+    if (work->w_worker == wk && work->w_pending)
+    {
+        list_remove(&work->w_link);
+        work->w_pending = 0;
+        ret = 1;
+    }
+    worker_unlock(wk, enabled);
+    return ret;
+}
+
+/* Whether work can be queued yet */
+long workqueue_running() { return workqueue_started; }
+
+/*
+ * Starts a worker for each core that is up. Their process is a child of the
+ * idle process, like the writeback daemon's.
+ */
+void workqueue_init()
+{
+    proc_t *proc = proc_create("kworker");
+    KASSERT(proc && "failed to create the worker process");
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        worker_t *wk = &workers[id];
+        spinlock_init(&wk->wk_lock);
+        list_init(&wk->wk_list);
+        wk->wk_running = NULL;
+        sched_queue_init(&wk->wk_waitq);
+        sched_queue_init(&wk->wk_flushq);
+        wk->wk_thread = NULL;
+        if (!csd_vaddr_table[id])
+        {
+            continue;
+        }
+        wk->wk_thread = kthread_create_daemon(proc, worker_run, id, NULL);
+        KASSERT(wk->wk_thread && "failed to create a worker");
+        sched_make_runnable(wk->wk_thread);
+    }
+    workqueue_started = 1;
+}
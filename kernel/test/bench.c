@@ -0,0 +1,424 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "fs/vfs.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "proc/kmutex.h"
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "vm/anon.h"
+
+#include "test/kshell/io.h"
+#include "test/kshell/kshell.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+/*
+ * Microbenchmarks, timed with the TSC: each runs its operation some number of
+ * times and reports the average cycles (and nanoseconds) per operation, so
+ * that a change can be measured the same way before and after. The numbers
+ * are only comparable between runs on the same machine and configuration.
+ */
+
+#define BENCH_MAX_ITERS 1000000
+#define BENCH_SLAB_BATCH 64
+#define BENCH_DEPTH 8
+
+typedef struct bench
+{
+    const char *b_name;
+    size_t b_iters; /* iterations when none are given */
+    /* Runs iters operations, setting *cycles to the TSC cycles they took */
+    long (*b_run)(size_t iters, uint64_t *cycles);
+} bench_t;
+
+static volatile long bench_stop;
+static kmutex_t bench_mtx;
+
+/* Starts func in a process of its own, as the pipe test does. */
+static long bench_partner(char *name, kthread_func_t func, long arg)
+{
+    proc_t *proc = proc_create(name);
+    if (!proc)
+    {
+        return -ENOMEM;
+    }
+    kthread_t *thr = kthread_create(proc, func, arg, NULL);
+    if (!thr)
+    {
+        return -ENOMEM;
+    }
+    sched_make_runnable(thr);
+    return 0;
+}
+
+static void *bench_yielder(long arg1, void *arg2)
+{
+    while (!bench_stop)
+    {
+        sched_yield();
+    }
+    return NULL;
+}
+
+/* A yield to a thread that yields straight back: one context switch each */
+static long bench_yield(size_t iters, uint64_t *cycles)
+{
+    bench_stop = 0;
+    long ret = bench_partner("bench_yield", bench_yielder, 0);
+    if (ret)
+    {
+        return ret;
+    }
+    sched_yield();
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < iters; i++)
+    {
+        sched_yield();
+    }
+    *cycles = rdtsc() - start;
+
+    bench_stop = 1;
+    do_waitpid(-1, NULL, 0);
+    return 0;
+}
+
+static long bench_mutex(size_t iters, uint64_t *cycles)
+{
+    kmutex_init(&bench_mtx);
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < iters; i++)
+    {
+        kmutex_lock(&bench_mtx);
+        kmutex_unlock(&bench_mtx);
+    }
+    *cycles = rdtsc() - start;
+    return 0;
+}
+
+/* Holds the mutex across a yield, so that each lock by the other waits */
+static void *bench_mutex_holder(long arg1, void *arg2)
+{
+    for (long i = 0; i < arg1; i++)
+    {
+        kmutex_lock(&bench_mtx);
+        sched_yield();
+        kmutex_unlock(&bench_mtx);
+    }
+    return NULL;
+}
+
+/* A lock that has to wait for the holder, and the handoff on its unlock */
+static long bench_mutex_contended(size_t iters, uint64_t *cycles)
+{
+    kmutex_init(&bench_mtx);
+    long ret = bench_partner("bench_mutex", bench_mutex_holder, (long)iters);
+    if (ret)
+    {
+        return ret;
+    }
+
+    uint64_t start = rdtsc();
+    bench_mutex_holder((long)iters, NULL);
+    *cycles = rdtsc() - start;
+
+    do_waitpid(-1, NULL, 0);
+    return 0;
+}
+
+/* A page_alloc() and its page_free() */
+static long bench_page(size_t iters, uint64_t *cycles)
+{
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < iters; i++)
+    {
+        void *page = page_alloc();
+        if (!page)
+        {
+            return -ENOMEM;
+        }
+        page_free(page);
+    }
+    *cycles = rdtsc() - start;
+    return 0;
+}
+
+/* A slab_obj_alloc() and its slab_obj_free(), in batches, so that the
+ * allocator has to move between slabs as it would under load */
+static long bench_slab(size_t iters, uint64_t *cycles)
+{
+    static slab_allocator_t *allocator;
+    if (!allocator &&
+        !(allocator = slab_allocator_create("bench", 2 * sizeof(long))))
+    {
+        return -ENOMEM;
+    }
+
+    void *objs[BENCH_SLAB_BATCH];
+    uint64_t total = 0;
+    for (size_t done = 0; done < iters;)
+    {
+        size_t n = MIN(iters - done, BENCH_SLAB_BATCH);
+        uint64_t start = rdtsc();
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!(objs[i] = slab_obj_alloc(allocator)))
+            {
+                while (i--)
+                {
+                    slab_obj_free(allocator, objs[i]);
+                }
+                return -ENOMEM;
+            }
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            slab_obj_free(allocator, objs[i]);
+        }
+        total += rdtsc() - start;
+        done += n;
+    }
+    *cycles = total;
+    return 0;
+}
+
+/* Gets page pagenum of o for each iteration, o being locked. With same, it
+ * is the same page each time, which is resident after the first. */
+static long bench_pframe(mobj_t *o, size_t iters, long same, uint64_t *cycles)
+{
+    long ret = 0;
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < iters; i++)
+    {
+        pframe_t *pf;
+        if ((ret = mobj_get_pframe(o, same ? 0 : i, 0, &pf)))
+        {
+            break;
+        }
+        pframe_release(&pf);
+    }
+    *cycles = rdtsc() - start;
+    return ret;
+}
+
+/* mobj_get_pframe() of a resident page */
+static long bench_pframe_hit(size_t iters, uint64_t *cycles)
+{
+    mobj_t *o = anon_create();
+    if (!o)
+    {
+        return -ENOMEM;
+    }
+    pframe_t *pf;
+    long ret = mobj_get_pframe(o, 0, 0, &pf);
+    if (!ret)
+    {
+        pframe_release(&pf);
+        ret = bench_pframe(o, iters, 1, cycles);
+    }
+    mobj_put_locked(&o);
+    return ret;
+}
+
+/* mobj_get_pframe() of a page not yet in memory: an anonymous one, which is
+ * filled with zeros; the disk itself is timed by read_block */
+static long bench_pframe_miss(size_t iters, uint64_t *cycles)
+{
+    mobj_t *o = anon_create();
+    if (!o)
+    {
+        return -ENOMEM;
+    }
+    long ret = bench_pframe(o, iters, 0, cycles);
+    mobj_put_locked(&o);
+    return ret;
+}
+
+#ifdef __VFS__
+
+/* namev_resolve() of a path BENCH_DEPTH directories deep */
+static long bench_namev(size_t iters, uint64_t *cycles)
+{
+    char path[sizeof("/bench") + 2 * BENCH_DEPTH] = "/bench";
+    long ret = 0;
+    size_t depth = 0;
+    while (depth < BENCH_DEPTH)
+    {
+        ret = do_mkdir(path);
+        if (ret && ret != -EEXIST)
+        {
+            break;
+        }
+        ret = 0;
+        if (++depth < BENCH_DEPTH)
+        {
+            strcat(path, "/d");
+        }
+    }
+
+    if (!ret)
+    {
+        uint64_t start = rdtsc();
+        for (size_t i = 0; i < iters; i++)
+        {
+            vnode_t *vn;
+            if ((ret = namev_resolve(NULL, path, &vn)))
+            {
+                break;
+            }
+            vput(&vn);
+        }
+        *cycles = rdtsc() - start;
+    }
+
+    /* The directories made, deepest first */
+    for (size_t len = strlen(path); len >= sizeof("/bench") - 1; len -= 2)
+    {
+        path[len] = '\0';
+        do_rmdir(path);
+    }
+    return ret;
+}
+
+#endif
+
+/* read_block() of one block of the first disk, bypassing the page cache */
+static long bench_read_block(size_t iters, uint64_t *cycles)
+{
+    blockdev_t *bd = blockdev_lookup(MKDEVID(DISK_MAJOR, 0));
+    if (!bd)
+    {
+        return -ENODEV;
+    }
+    char *buf = page_alloc();
+    if (!buf)
+    {
+        return -ENOMEM;
+    }
+
+    long ret = 0;
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < iters; i++)
+    {
+        if ((ret = bd->bd_ops->read_block(bd, buf, (blocknum_t)i, 1)))
+        {
+            break;
+        }
+    }
+    *cycles = rdtsc() - start;
+    page_free(buf);
+    return ret;
+}
+
+static const bench_t benches[] = {
+    {"yield", 10000, bench_yield},
+    {"mutex", 100000, bench_mutex},
+    {"mutex_contended", 1000, bench_mutex_contended},
+    {"page", 100000, bench_page},
+    {"slab", 100000, bench_slab},
+    {"pframe_hit", 100000, bench_pframe_hit},
+    {"pframe_miss", 256, bench_pframe_miss},
+#ifdef __VFS__
+    {"namev", 10000, bench_namev},
+#endif
+    {"read_block", 256, bench_read_block},
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static void bench_run(kshell_t *ksh, const bench_t *b, size_t iters)
+{
+    if (!iters)
+    {
+        iters = b->b_iters;
+    }
+    uint64_t cycles = 0;
+    long ret = b->b_run(iters, &cycles);
+    if (ret)
+    {
+        kprintf(ksh, "%-16s %s\n", b->b_name, strerror((int)-ret));
+        return;
+    }
+
+    uint64_t per_op = cycles / iters;
+    uint64_t tsc_hz = apic_tsc_frequency();
+    uint64_t ns = tsc_hz ? per_op * 1000000000 / tsc_hz : 0;
+    kprintf(ksh, "%-16s %10lu %12lu %10lu\n", b->b_name, iters, per_op, ns);
+}
+
+/*
+ * bench [name [iterations]]: runs the named microbenchmark, or all of them,
+ * and prints the TSC cycles and nanoseconds each operation took on average.
+ */
+long kshell_bench(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc > 3)
+    {
+        kprintf(ksh, "usage: bench [name [iterations]]\n");
+        return 0;
+    }
+
+    size_t iters = 0;
+    if (argc == 3)
+    {
+        for (char *c = argv[2]; *c; c++)
+        {
+            if (*c < '0' || *c > '9')
+            {
+                iters = 0;
+                break;
+            }
+            iters = MIN(iters * 10 + (size_t)(*c - '0'), BENCH_MAX_ITERS);
+        }
+        if (!iters)
+        {
+            kprintf(ksh, "bench: invalid iterations: %s\n", argv[2]);
+            return 0;
+        }
+    }
+
+    const bench_t *only = NULL;
+    if (argc >= 2)
+    {
+        for (size_t i = 0; i < BENCH_COUNT && !only; i++)
+        {
+            if (!strcmp(argv[1], benches[i].b_name))
+            {
+                only = &benches[i];
+            }
+        }
+        if (!only)
+        {
+            kprintf(ksh, "bench: no such benchmark: %s; one of:", argv[1]);
+            for (size_t i = 0; i < BENCH_COUNT; i++)
+            {
+                kprintf(ksh, " %s", benches[i].b_name);
+            }
+            kprintf(ksh, "\n");
+            return 0;
+        }
+    }
+
+    kprintf(ksh, "%-16s %10s %12s %10s\n", "benchmark", "ops", "cycles/op",
+            "ns/op");
+    for (size_t i = 0; i < BENCH_COUNT; i++)
+    {
+        if (!only || only == &benches[i])
+        {
+            bench_run(ksh, &benches[i], iters);
+        }
+    }
+    return 0;
+}
@@ -12,6 +12,7 @@
 #include "proc/kthread.h"
 #include "proc/sched.h"
 
+#include "api/syscall.h"
 #include "drivers/tty/tty.h"
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
@@ -24,7 +25,7 @@
 #define NUM_PROCS 3
 #define BLOCK_NUM 1
 
-// Keep LDISC_BUFFER_SIZE at 128 for these tests
+// The line discipline tests expect the tty to be in canonical mode
 
 // TODO: need to change to using the MOD macro 
 
@@ -279,18 +280,30 @@ long test_full_line_discipline() {
     chardev_t* cd = chardev_lookup(MKDEVID(TTY_MAJOR, 0)); 
     tty_t* tty = cd_to_tty(cd); 
     ldisc_t* ldisc = &tty->tty_ldisc;
-    for (int i = 0; i < LDISC_BUFFER_SIZE; i++) {
+    for (int i = 0; i < LDISC_LINE_MAX + 8; i++) {
         ldisc_key_pressed(ldisc, 't'); 
     }
 
-    test_assert(ldisc->ldisc_head == LDISC_BUFFER_SIZE - 1, "ldisc should leave keep one byte left for new line character"); 
+    test_assert(ldisc->ldisc_head == LDISC_LINE_MAX, "a line should stop growing at LDISC_LINE_MAX characters"); 
 
     ldisc_key_pressed(ldisc, '\n'); 
-    test_assert(ldisc->ldisc_head == 0, "ldisc_head should wrap back to 0");
+    test_assert(ldisc->ldisc_head == LDISC_LINE_MAX + 1, "the newline should still fit after a full line");
     test_assert(ldisc->ldisc_cooked == ldisc->ldisc_head, "ldisc_cooked should be equal to ldisc_head"); 
 
+    // Emulate a reader that has fallen behind, leaving three free bytes
+    ldisc->ldisc_tail = 0;
+    ldisc->ldisc_head = ldisc->ldisc_cooked = LDISC_BUFFER_SIZE - 3;
+    ldisc_key_pressed(ldisc, 't');
+    ldisc_key_pressed(ldisc, 't');
+    test_assert(ldisc->ldisc_head == LDISC_BUFFER_SIZE - 2, "ldisc should leave keep one byte left for new line character"); 
+
+    ldisc_key_pressed(ldisc, '\n');
+    test_assert(ldisc->ldisc_head == LDISC_BUFFER_SIZE - 1, "the newline should take the last byte");
+    ldisc_key_pressed(ldisc, '\n');
+    test_assert(ldisc->ldisc_head == LDISC_BUFFER_SIZE - 1, "a full ldisc should ignore input");
+
     // reset line discipline for other tests before returning 
-    ldisc->ldisc_head = ldisc->ldisc_cooked = ldisc->ldisc_tail = ldisc->ldisc_full = 0; 
+    ldisc->ldisc_head = ldisc->ldisc_cooked = ldisc->ldisc_tail = 0; 
     return 0; 
 }
 
@@ -301,26 +314,47 @@ long test_line_discipline_wrap() {
     chardev_t* cd = chardev_lookup(MKDEVID(TTY_MAJOR, 0)); 
     tty_t* tty = cd_to_tty(cd); 
     ldisc_t* ldisc = &tty->tty_ldisc;
-    for (int i = 0; i < LDISC_BUFFER_SIZE/2; i++) {
-        ldisc_key_pressed(ldisc, 't'); 
-    }
+    // Start near the end, as if the lines before had been read
+    ldisc->ldisc_head = ldisc->ldisc_cooked = ldisc->ldisc_tail = LDISC_BUFFER_SIZE - 2;
 
-    test_assert(ldisc->ldisc_head == LDISC_BUFFER_SIZE/2, "ldisc_head should be incremented to half the ldisc size"); 
-    size_t previous_head_val = ldisc->ldisc_head; 
+    ldisc_key_pressed(ldisc, 'z'); 
+    ldisc_key_pressed(ldisc, 'z'); 
+    test_assert(ldisc->ldisc_head == 0, "ldisc_head should wrap back to 0");
     ldisc_key_pressed(ldisc, '\n'); 
-    test_assert(ldisc->ldisc_head == previous_head_val + 1, "ldisc_head should have been incremented past newline character");
+
+    test_assert(ldisc->ldisc_head == 1, "ldisc_head should wrap around"); 
     test_assert(ldisc->ldisc_cooked == ldisc->ldisc_head, "ldisc_cooked should be equal to ldisc_head");
 
-    ldisc->ldisc_tail = ldisc->ldisc_cooked; // Emulate reading the cooked portion of the buffer
+    char buf[4] = {0};
+    test_assert(ldisc_read(ldisc, buf, sizeof(buf)) == 3, "the wrapped line should be read whole");
+    test_assert(!strncmp(buf, "zz\n", 3), "the wrapped line should be read in order");
 
-    for (int i = 0; i < LDISC_BUFFER_SIZE/2 - 1; i++) {
-        ldisc_key_pressed(ldisc, 'z'); 
-    }
-    ldisc_key_pressed(ldisc, '\n'); 
+    // reset line discipline for other tests before returning 
+    ldisc->ldisc_head = ldisc->ldisc_cooked = ldisc->ldisc_tail = 0; 
+    return 0; 
+}
 
-    test_assert(ldisc->ldisc_head == 1, "ldisc_head should wrap around"); 
+/*
+    Tests raw mode: nothing is edited, and characters are readable at once
+*/
+long test_raw_line_discipline() {
+    chardev_t* cd = chardev_lookup(MKDEVID(TTY_MAJOR, 0)); 
+    tty_t* tty = cd_to_tty(cd); 
+    ldisc_t* ldisc = &tty->tty_ldisc;
+    ldisc_set_mode(ldisc, 0, 0, 0);
 
-    // reset line discipline for other tests before returning 
+    ldisc_key_pressed(ldisc, 'r');
+    test_assert(ldisc_readable(ldisc), "a raw character should be readable at once");
+    ldisc_key_pressed(ldisc, BS);
+    ldisc_key_pressed(ldisc, EOT);
+
+    char buf[8] = {0};
+    ssize_t n = cd->cd_ops->read(cd, 0, buf, sizeof(buf));
+    test_assert(n == 3, "raw reads should return what there is");
+    test_assert(buf[0] == 'r' && buf[1] == BS && buf[2] == EOT, "raw mode should not edit");
+    test_assert(cd->cd_ops->read(cd, 0, buf, sizeof(buf)) == 0, "with VMIN and VTIME 0 a read should not wait");
+
+    ldisc_set_mode(ldisc, ICANON | ECHO, 1, 0);
     ldisc->ldisc_head = ldisc->ldisc_cooked = ldisc->ldisc_tail = 0; 
     return 0; 
 }
@@ -337,6 +371,7 @@ long driverstest_main(long arg1, void* arg2)
     test_disk_write_and_read();
     test_full_line_discipline();
     test_line_discipline_wrap();
+    test_raw_line_discipline();
     test_concurrent_reads(); 
     test_concurrent_writes(); 
 
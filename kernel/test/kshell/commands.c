@@ -6,6 +6,8 @@
 #ifdef __VFS__
 
 #include "fs/fcntl.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
@@ -13,8 +15,23 @@
 
 #include "test/kshell/io.h"
 
+#include "drivers/blockdev.h"
+
+#include "main/apic.h"
+#include "main/ipltrace.h"
+#include "main/pmu.h"
+#include "mm/kmalloc.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/swap.h"
+#include "proc/sched.h"
+#include "vm/ksm.h"
+
 #include "util/debug.h"
+#include "util/profile.h"
 #include "util/string.h"
+#include "util/trace.h"
 
 list_t kshell_commands_list = LIST_INITIALIZER(kshell_commands_list);
 
@@ -57,6 +74,355 @@ long kshell_halt(kshell_t *ksh, size_t argc, char **argv)
     return 0;
 }
 
+#ifdef __KMUTEX_STATS__
+#define LOCKSTAT_DEFAULT 10
+#define LOCKSTAT_MAX 32
+
+/*
+ * lockstat [count]: prints the contention statistics of the count (default
+ * 10) most contended named mutexes. Times are in jiffies.
+ */
+long kshell_lockstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    size_t count = LOCKSTAT_DEFAULT;
+    if (argc > 2)
+    {
+        kprintf(ksh, "usage: lockstat [count]\n");
+        return 0;
+    }
+    if (argc == 2)
+    {
+        size_t n = 0;
+        for (char *c = argv[1]; *c; c++)
+        {
+            if (*c < '0' || *c > '9')
+            {
+                n = 0;
+                break;
+            }
+            n = MIN(n * 10 + (size_t)(*c - '0'), LOCKSTAT_MAX);
+        }
+        if (!n)
+        {
+            kprintf(ksh, "lockstat: invalid count: %s\n", argv[1]);
+            return 0;
+        }
+        count = n;
+    }
+
+    kmutex_stats_t stats[LOCKSTAT_MAX];
+    size_t n = kmutex_stats_top(stats, count);
+    kprintf(ksh, "%-20s %10s %10s %10s %10s\n", "name", "acquired",
+            "contended", "wait", "max hold");
+    for (size_t i = 0; i < n; i++)
+    {
+        kprintf(ksh, "%-20s %10lu %10lu %10lu %10lu\n", stats[i].ks_name,
+                stats[i].ks_acquisitions, stats[i].ks_contended,
+                stats[i].ks_wait_ticks, stats[i].ks_max_hold_ticks);
+    }
+    return 0;
+}
+#endif
+
+#ifdef __KMALLOC_PROFILE__
+#define KMALLOCSTAT_DEFAULT 10
+#define KMALLOCSTAT_MAX 32
+
+/*
+ * kmallocstat [count]: prints what the count (default 10) callers of kmalloc
+ * with the most bytes live have allocated. Callers are return addresses, for
+ * addr2line -f -e kernel.bin.
+ */
+long kshell_kmallocstat(kshell_t *ksh, size_t argc, char **argv)
+{
+    size_t count = KMALLOCSTAT_DEFAULT;
+    if (argc > 2)
+    {
+        kprintf(ksh, "usage: kmallocstat [count]\n");
+        return 0;
+    }
+    if (argc == 2)
+    {
+        size_t n = 0;
+        for (char *c = argv[1]; *c; c++)
+        {
+            if (*c < '0' || *c > '9')
+            {
+                n = 0;
+                break;
+            }
+            n = MIN(n * 10 + (size_t)(*c - '0'), KMALLOCSTAT_MAX);
+        }
+        if (!n)
+        {
+            kprintf(ksh, "kmallocstat: invalid count: %s\n", argv[1]);
+            return 0;
+        }
+        count = n;
+    }
+
+    kmalloc_site_t sites[KMALLOCSTAT_MAX];
+    uint64_t untracked;
+    size_t n = kmalloc_profile_top(sites, count, &untracked);
+    kprintf(ksh, "%-18s %10s %10s %12s %12s %12s\n", "caller", "allocs",
+            "frees", "live", "peak", "total");
+    for (size_t i = 0; i < n; i++)
+    {
+        kmalloc_site_t *ks = &sites[i];
+        if (ks->ks_caller)
+        {
+            kprintf(ksh, "0x%p", ks->ks_caller);
+        }
+        else
+        {
+            kprintf(ksh, "%-18s", "(other)");
+        }
+        kprintf(ksh, " %10lu %10lu %12lu %12lu %12lu\n", ks->ks_allocs,
+                ks->ks_frees, ks->ks_live, ks->ks_peak, ks->ks_bytes);
+    }
+    if (untracked)
+    {
+        kprintf(ksh, "%lu allocations not tracked: the table was full\n",
+                untracked);
+    }
+    return 0;
+}
+#endif
+
+#ifdef __IPL_TRACE__
+/*
+ * ipltrace start|stop|show|dump: controls the interrupt latency tracer. show
+ * prints each core's longest windows with interrupts masked; dump writes them
+ * to the debug log, for python/weenix/ipltrace.py; see ipltrace.h.
+ */
+long kshell_ipltrace(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc != 2)
+    {
+        kprintf(ksh, "usage: ipltrace start|stop|show|dump\n");
+        return 0;
+    }
+    if (!strcmp(argv[1], "start"))
+    {
+        long ret = ipltrace_start();
+        if (ret)
+        {
+            kprintf(ksh, "ipltrace: %s\n", strerror((int)-ret));
+        }
+    }
+    else if (!strcmp(argv[1], "stop"))
+    {
+        ipltrace_stop();
+    }
+    else if (!strcmp(argv[1], "show"))
+    {
+        uint64_t mhz = apic_tsc_frequency() / 1000000;
+        for (long id = 0; id < MAX_LAPICS; id++)
+        {
+            ipltrace_stats_t stats;
+            if (ipltrace_stats(id, &stats))
+            {
+                continue;
+            }
+            kprintf(ksh, "core %ld: %lu windows, %lu cycles masked\n", id,
+                    stats.is_windows, stats.is_cycles);
+            for (long i = 0; i < IPLTRACE_WORST && stats.is_worst[i].iw_cycles;
+                 i++)
+            {
+                ipltrace_window_t *w = &stats.is_worst[i];
+                kprintf(ksh,
+                        "  %12lu cycles %8lu us  pid %-4d 0x%lx -> 0x%lx\n",
+                        w->iw_cycles, mhz ? w->iw_cycles / mhz : 0, w->iw_pid,
+                        (uintptr_t)w->iw_start, (uintptr_t)w->iw_end);
+            }
+        }
+    }
+    else if (!strcmp(argv[1], "dump"))
+    {
+        kprintf(ksh, "ipltrace: %lu windows written to the debug log\n",
+                ipltrace_dump());
+    }
+    else
+    {
+        kprintf(ksh, "usage: ipltrace start|stop|show|dump\n");
+    }
+    return 0;
+}
+#endif
+
+/*
+ * schedinfo: prints per-thread CPU accounting and the run queue wait
+ * histogram; see sched_info().
+ */
+long kshell_schedinfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    static char buf[PAGE_SIZE];
+    sched_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    return 0;
+}
+
+/*
+ * meminfo: prints free pages by zone and order, then per-slab usage, swap
+ * usage and merged pages; see page_info(), slab_info(), swap_info() and
+ * ksm_info().
+ */
+long kshell_meminfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    static char buf[4 * PAGE_SIZE];
+    size_t left = page_info(NULL, buf, sizeof(buf));
+    left = slab_info(NULL, buf + (sizeof(buf) - left), left);
+    left = swap_info(NULL, buf + (sizeof(buf) - left), left);
+    ksm_info(NULL, buf + (sizeof(buf) - left), left);
+    kprintf(ksh, "%s", buf);
+    return 0;
+}
+
+/*
+ * cacheinfo: prints page cache hits, misses, fills, flushes and dirty pages
+ * for each type of memory object; see mobj_stats_info().
+ */
+long kshell_cacheinfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    static char buf[PAGE_SIZE];
+    mobj_stats_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    return 0;
+}
+
+/*
+ * diskinfo: prints the request counters, queue depth, busy time and request
+ * latency histogram of each block device; see blockdev_info().
+ */
+long kshell_diskinfo(kshell_t *ksh, size_t argc, char **argv)
+{
+    static char buf[PAGE_SIZE];
+    blockdev_info(NULL, buf, sizeof(buf));
+    kprintf(ksh, "%s", buf);
+    return 0;
+}
+
+/*
+ * profile start|stop|dump: controls the sampling profiler. dump writes the
+ * samples to the debug log, for python/weenix/profile.py; see profile.h.
+ */
+long kshell_profile(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc != 2)
+    {
+        kprintf(ksh, "usage: profile start|stop|dump\n");
+        return 0;
+    }
+    if (!strcmp(argv[1], "start"))
+    {
+        long ret = profile_start();
+        if (ret)
+        {
+            kprintf(ksh, "profile: %s\n", strerror((int)-ret));
+        }
+    }
+    else if (!strcmp(argv[1], "stop"))
+    {
+        profile_stop();
+    }
+    else if (!strcmp(argv[1], "dump"))
+    {
+        kprintf(ksh, "profile: %lu samples written to the debug log\n",
+                profile_dump());
+    }
+    else
+    {
+        kprintf(ksh, "usage: profile start|stop|dump\n");
+    }
+    return 0;
+}
+
+/*
+ * trace start [event...]|stop|dump: controls the tracepoints, all of them
+ * unless events are named. dump writes the records to the debug log, for
+ * python/weenix/trace.py; see trace.h.
+ */
+long kshell_trace(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc >= 2 && !strcmp(argv[1], "start"))
+    {
+        uint64_t mask = argc == 2 ? TRACE_ALL : 0;
+        for (size_t i = 2; i < argc; i++)
+        {
+            long ev = trace_event_lookup(argv[i]);
+            if (ev < 0)
+            {
+                kprintf(ksh, "trace: no such event: %s\n", argv[i]);
+                return 0;
+            }
+            mask |= 1UL << ev;
+        }
+        long ret = trace_start(mask);
+        if (ret)
+        {
+            kprintf(ksh, "trace: %s\n", strerror((int)-ret));
+        }
+    }
+    else if (argc == 2 && !strcmp(argv[1], "stop"))
+    {
+        trace_stop();
+    }
+    else if (argc == 2 && !strcmp(argv[1], "dump"))
+    {
+        kprintf(ksh, "trace: %lu records written to the debug log\n",
+                trace_dump());
+    }
+    else
+    {
+        kprintf(ksh, "usage: trace start [event...]|stop|dump\n");
+    }
+    return 0;
+}
+
+/*
+ * perf start|read|stop: counts hardware events while this shell's thread
+ * runs, as perfctr(2) does, so that "perf start", a command, and "perf read"
+ * give the events the command caused.
+ */
+long kshell_perf(kshell_t *ksh, size_t argc, char **argv)
+{
+    if (argc == 2 && !strcmp(argv[1], "start"))
+    {
+        /* Whichever of the events the CPU can count */
+        long ret = -ENODEV;
+        for (uint32_t events = (1U << PERFCTR_EVENTS) - 1; events && ret;
+             events >>= 1)
+        {
+            ret = pmu_start(events);
+        }
+        if (ret)
+        {
+            kprintf(ksh, "perf: %s\n", strerror((int)-ret));
+        }
+    }
+    else if (argc == 2 && !strcmp(argv[1], "read"))
+    {
+        uint64_t counts[PERFCTR_EVENTS];
+        pmu_read(counts);
+        uint64_t cycles = counts[PERFCTR_CYCLES];
+        uint64_t insns = counts[PERFCTR_INSTRUCTIONS];
+        kprintf(ksh, "cycles %lu, instructions %lu (%lu.%02lu per cycle)\n",
+                cycles, insns, cycles ? insns / cycles : 0,
+                cycles ? insns * 100 / cycles % 100 : 0);
+        kprintf(ksh, "llc misses %lu, dtlb misses %lu\n",
+                counts[PERFCTR_LLC_MISSES], counts[PERFCTR_DTLB_MISSES]);
+    }
+    else if (argc == 2 && !strcmp(argv[1], "stop"))
+    {
+        pmu_stop();
+    }
+    else
+    {
+        kprintf(ksh, "usage: perf start|read|stop\n");
+    }
+    return 0;
+}
+
 long kshell_echo(kshell_t *ksh, size_t argc, char **argv)
 {
     if (argc == 1)
@@ -401,4 +767,28 @@ long kshell_s5fstest(kshell_t *ksh, size_t argc, char **argv)
     return ret;
 }
 
+long kshell_fsck(kshell_t *ksh, size_t argc, char **argv)
+{
+    long repair = argc == 2 && !strcmp(argv[1], "-r");
+    if (argc > 2 || (argc == 2 && !repair))
+    {
+        kprintf(ksh, "usage: fsck [-r]\n");
+        return 0;
+    }
+    if (vfs_root_fs.fs_ops != &s5fs_fsops)
+    {
+        kprintf(ksh, "fsck: the root filesystem is not s5fs\n");
+        return 0;
+    }
+    long ret = s5fs_fsck(&vfs_root_fs, repair);
+    if (ret < 0)
+    {
+        kprintf(ksh, "fsck: %s\n", strerror((int)-ret));
+        return 0;
+    }
+    kprintf(ksh, "fsck: %ld problems found%s, see the console\n", ret,
+            ret && repair ? " and repaired" : "");
+    return 0;
+}
+
 #endif
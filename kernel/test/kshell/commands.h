@@ -15,6 +15,28 @@ KSHELL_CMD(echo);
 
 KSHELL_CMD(clear);
 
+KSHELL_CMD(schedinfo);
+
+KSHELL_CMD(meminfo);
+KSHELL_CMD(cacheinfo);
+KSHELL_CMD(diskinfo);
+KSHELL_CMD(bench);
+KSHELL_CMD(profile);
+KSHELL_CMD(trace);
+KSHELL_CMD(perf);
+
+#ifdef __KMUTEX_STATS__
+KSHELL_CMD(lockstat);
+#endif
+
+#ifdef __KMALLOC_PROFILE__
+KSHELL_CMD(kmallocstat);
+#endif
+
+#ifdef __IPL_TRACE__
+KSHELL_CMD(ipltrace);
+#endif
+
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -29,4 +51,9 @@ KSHELL_CMD(vfs_test);
 
 #ifdef __S5FS__
 KSHELL_CMD(s5fstest);
+KSHELL_CMD(fsck);
+#endif
+
+#ifdef __PIPES__
+KSHELL_CMD(pipes_test);
 #endif
@@ -52,6 +52,34 @@ void kshell_init()
                        "prints a list of available commands");
     kshell_add_command("echo", kshell_echo, "display a line of text");
     kshell_add_command("clear", kshell_clear, "clears the screen");
+    kshell_add_command("schedinfo", kshell_schedinfo,
+                       "prints per-thread scheduler accounting");
+    kshell_add_command("meminfo", kshell_meminfo,
+                       "prints page and slab allocator usage");
+    kshell_add_command("cacheinfo", kshell_cacheinfo,
+                       "prints page cache hit and writeback counters");
+    kshell_add_command("diskinfo", kshell_diskinfo,
+                       "prints block device request and latency counters");
+    kshell_add_command("bench", kshell_bench,
+                       "runs timed microbenchmarks, printing cycles per op");
+    kshell_add_command("profile", kshell_profile,
+                       "starts, stops or dumps the sampling profiler");
+    kshell_add_command("trace", kshell_trace,
+                       "starts, stops or dumps the tracepoint buffers");
+    kshell_add_command("perf", kshell_perf,
+                       "counts cycles, instructions and misses for the shell");
+#ifdef __KMUTEX_STATS__
+    kshell_add_command("lockstat", kshell_lockstat,
+                       "lists the most contended named mutexes");
+#endif
+#ifdef __KMALLOC_PROFILE__
+    kshell_add_command("kmallocstat", kshell_kmallocstat,
+                       "lists the callers of kmalloc with the most memory");
+#endif
+#ifdef __IPL_TRACE__
+    kshell_add_command("ipltrace", kshell_ipltrace,
+                       "times the windows with interrupts masked");
+#endif
 #ifdef __VFS__
     kshell_add_command("cat", kshell_cat,
                        "concatenate files and print on the standard output");
@@ -68,6 +96,12 @@ void kshell_init()
 
 #ifdef __S5FS__
     kshell_add_command("s5fstest", kshell_s5fstest, "runs S5FS tests");
+    kshell_add_command("fsck", kshell_fsck,
+                       "checks the root filesystem, repairing it with -r");
+#endif
+
+#ifdef __PIPES__
+    kshell_add_command("test_pipes", kshell_pipes_test, "run pipe tests");
 #endif
 
     kshell_add_command("halt", kshell_halt, "halts the systems");
@@ -126,17 +126,23 @@ static void test_running_out_of_inodes()
     test_assert(do_unlink("file") == 0, "Could not remove file");
 }
 
+// The largest file is far bigger than the disk, so only its last bytes are
+// written
 static void test_filling_file()
 {
     long res = 0;
     int fd = (int)do_open("hugefile", O_RDWR | O_CREAT);
     KASSERT(fd >= 0);
 
-    res = write_until_fail(fd);
-    test_assert(res == 0, "Did not write to entire file");
+    char buf[BIG_BUFSIZE] = {0};
+    off_t off = (off_t)S5_MAX_FILE_SIZE - (off_t)sizeof(buf);
+    test_assert(do_lseek(fd, off, SEEK_SET) == off, "Could not seek");
+    res = do_write(fd, buf, sizeof(buf));
+    test_assert(res == sizeof(buf), "Could not write the end of the file");
+    test_assert(do_lseek(fd, 0, SEEK_END) == S5_MAX_FILE_SIZE,
+                "Wrong file size");
 
     // make sure all other writes are unsuccessful/dont complete
-    char buf[BIG_BUFSIZE] = {0};
     res = do_write(fd, buf, sizeof(buf));
     test_assert(res < 0, "Able to write although the file is full");
     test_assert(res == -EFBIG || res == -EINVAL, "Wrong error code");
@@ -145,9 +151,8 @@ static void test_filling_file()
     test_assert(do_unlink("hugefile") == 0, "couldnt unlink hugefile");
 }
 
-// Fill up the disk. Apparently to do this, we should need to fill up one
-// entire file, then start to fill up another. We should eventually get
-// the ENOSPC error
+// Fill up the disk. A single file can outgrow the disk, so it alone should
+// eventually get the ENOSPC error, and another file none of the space
 static void test_running_out_of_blocks()
 {
     long res = 0;
@@ -155,17 +160,18 @@ static void test_running_out_of_blocks()
     int fd1 = (int)do_open("fullfile", O_RDWR | O_CREAT);
 
     res = write_until_fail(fd1);
-    test_assert(res == 0, "Ran out of space quicker than we expected");
+    test_assert(res == -ENOSPC, "Did not get nospc error");
     test_assert(do_close(fd1) == 0, "could not close");
 
-    int fd2 = (int)do_open("partiallyfullfile", O_RDWR | O_CREAT);
+    int fd2 = (int)do_open("emptyfile", O_RDWR | O_CREAT);
     res = write_until_fail(fd2);
     test_assert(res == -ENOSPC, "Did not get nospc error");
+    test_assert(do_lseek(fd2, 0, SEEK_END) == 0, "Wrote to a full disk");
 
     test_assert(do_close(fd2) == 0, "could not close");
 
     test_assert(do_unlink("fullfile") == 0, "couldnt do_unlink file");
-    test_assert(do_unlink("partiallyfullfile") == 0, "couldnt do_unlink file");
+    test_assert(do_unlink("emptyfile") == 0, "couldnt do_unlink file");
 }
 
 // Open a new file, write to some random address in the file,
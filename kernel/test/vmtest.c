@@ -40,9 +40,8 @@ long test_vmmap() {
         ssize_t start = vmmap_find_range(map, num_pages_per_vmarea, VMMAP_DIR_HILO);
         test_assert(start + num_pages_per_vmarea == prev_start, "Incorrect return value from vmmap_find_range");
         
-        vmarea_t *vma = kmalloc(sizeof(vmarea_t));
+        vmarea_t *vma = vmarea_alloc();
         KASSERT(vma && "Unable to alloc the vmarea");
-        memset(vma, 0, sizeof(vmarea_t));
 
         vma->vma_start = start;
         vma->vma_end = start + num_pages_per_vmarea;
@@ -60,10 +59,29 @@ long test_vmmap() {
     // LP --> the lowest possible userland page number 
     // section start --> HP - (num_vmareas * num_pages_per_vmarea) 
     
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        list_remove(&vma->vma_plink); 
-        kfree(vma);
+    for (size_t i = 0; i < num_vmareas; i++) {
+        size_t vfn = prev_start + i * num_pages_per_vmarea;
+        test_assert(vmmap_lookup(map, vfn + 1)->vma_start == vfn,
+                    "Incorrect vmarea found by vmmap_lookup");
     }
+    test_assert(vmmap_find_range(map, num_pages_per_vmarea, VMMAP_DIR_LOHI) ==
+                    (ssize_t)startvfn,
+                "Incorrect return value from vmmap_find_range");
+
+    // Punch a hole in the middle area; the highest fit for it is the hole
+    size_t hole = prev_start + 2 * num_pages_per_vmarea + 4;
+    vmmap_remove(map, hole, 4);
+    test_assert(!vmmap_lookup(map, hole), "Removed page still mapped");
+    test_assert(vmmap_lookup(map, hole + 4)->vma_start == hole + 4,
+                "Incorrect vmarea after splitting");
+    test_assert(vmmap_is_range_empty(map, hole, 4) == 0 &&
+                    vmmap_is_range_empty(map, hole - 1, 2) != 0,
+                "Incorrect return value from vmmap_is_range_empty");
+    test_assert(vmmap_find_range(map, 4, VMMAP_DIR_HILO) == (ssize_t)hole,
+                "Incorrect return value from vmmap_find_range");
+
+    vmmap_remove(map, startvfn, npages);
+    KASSERT(list_empty(&map->vmm_list));
     
     return 0; 
 }
@@ -1,9 +1,10 @@
+#include "errno.h"
 #include "globals.h"
 
 #include "util/btree.h"
 
+#include "mm/kmalloc.h"
 #include "mm/slab.h"
-#include "mm/pframe.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -11,9 +12,9 @@
 static slab_allocator_t *btree_node_allocator;
 
 // Array helpers
-static int btree_pop_key(btree_node_t *x, unsigned int i, void **d);
-static void btree_append_key(btree_node_t *x, int k, void *d);
-static void btree_insert_key(btree_node_t *x, int k, int i, void *d);
+static uint64_t btree_pop_key(btree_node_t *x, unsigned int i, void **d);
+static void btree_append_key(btree_node_t *x, uint64_t k, void *d);
+static void btree_insert_key(btree_node_t *x, uint64_t k, int i, void *d);
 static btree_node_t *btree_pop_child(btree_node_t *x, unsigned int i);
 static void btree_append_child(btree_node_t *x, btree_node_t *addr);
 static void btree_insert_child(btree_node_t *x, btree_node_t *c, int i);
@@ -27,22 +28,40 @@ static void btree_fill_node(btree_node_t *x, unsigned int i);
 static void btree_merge(btree_node_t *x, unsigned int i);
 static void btree_take_prev(btree_node_t *x, unsigned int i);
 static void btree_take_next(btree_node_t *x, unsigned int i);
-static int btree_get_predecessor(btree_node_t *x, unsigned int i, void **d);
-static int btree_get_successor(btree_node_t *x, unsigned int i, void **d);
-static void btree_delete_internal(btree_node_t **root, btree_node_t *x, int key, unsigned int i);
+static uint64_t btree_get_predecessor(btree_node_t *x, unsigned int i, void **d);
+static uint64_t btree_get_successor(btree_node_t *x, unsigned int i, void **d);
+static void btree_delete_internal(btree_node_t **root, btree_node_t *x, uint64_t key, unsigned int i);
 static void btree_delete_helper(btree_node_t **root, btree_node_t *x, uint64_t key);
 
 static void print_btree_helper(btree_node_t *x, int level);
 
 static void btree_assert_sanity(btree_node_t *root);
 
-static int btree_pop_key(btree_node_t *x, unsigned int i, void **d)
+/*
+ * Returns the index of the first key in x that is >= key, or x->n_keys.
+ * Binary search, so that larger branching factors stay cheap.
+ */
+static unsigned int btree_lower_bound(const btree_node_t *x, uint64_t key)
+{
+    unsigned int lo = 0, hi = x->n_keys;
+    while (lo < hi)
+    {
+        unsigned int mid = (lo + hi) / 2;
+        if (x->keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static uint64_t btree_pop_key(btree_node_t *x, unsigned int i, void **d)
 {
     KASSERT(i < MAX_KEYS);
     KASSERT(i < x->n_keys);
     KASSERT(x->n_keys > 0);
 
-    int ret = x->keys[i];
+    uint64_t ret = x->keys[i];
     if (d != NULL) 
         *d = x->data[i];
 
@@ -58,7 +77,7 @@ static int btree_pop_key(btree_node_t *x, unsigned int i, void **d)
     return ret;
 }
 
-static void btree_append_key(btree_node_t *x, int k, void *d)
+static void btree_append_key(btree_node_t *x, uint64_t k, void *d)
 {
     KASSERT(x->n_keys < MAX_KEYS && "Adding key to full node");
     x->keys[x->n_keys] = k;
@@ -66,7 +85,7 @@ static void btree_append_key(btree_node_t *x, int k, void *d)
     x->n_keys++;
 }
 
-static void btree_insert_key(btree_node_t *x, int k, int i, void *d)
+static void btree_insert_key(btree_node_t *x, uint64_t k, int i, void *d)
 {
     KASSERT(x->n_keys < MAX_KEYS && "Inserting key to full node");
     for (int j = MAX_KEYS-1; j > i; j--)
@@ -135,13 +154,14 @@ static void btree_split_child(btree_node_t *root, unsigned int child_ind)
 
     // insert median of child as new key in parent
     void *d;
-    int k = btree_pop_key(to_split, BRANCHING_FACTOR-1, &d);
+    uint64_t k = btree_pop_key(to_split, BRANCHING_FACTOR-1, &d);
     btree_insert_key(root, k, child_ind, d);
 
-    // give new_child the second half of to_split's keys
-    for (unsigned int i = BRANCHING_FACTOR-1; i < MAX_KEYS-1; i++)
+    // give new_child the second half of to_split's keys, which each move
+    // down into the median's old position in turn
+    for (unsigned int i = 0; i < BRANCHING_FACTOR-1; i++)
     {
-        k = btree_pop_key(to_split, i, &d);
+        k = btree_pop_key(to_split, BRANCHING_FACTOR-1, &d);
         btree_append_key(new_child, k, d);
     }
 
@@ -196,15 +216,15 @@ static void btree_insert_nonfull(btree_node_t *x, uint64_t k, void *data)
 }
 
 //DONE
-static void btree_delete_internal(btree_node_t **root, btree_node_t *x, int key, unsigned int i)
+static void btree_delete_internal(btree_node_t **root, btree_node_t *x, uint64_t key, unsigned int i)
 {
-    KASSERT(i < x->n_keys && i < x->n_children-1);
-    int k = x->keys[i];
+    KASSERT(i < x->n_keys && i + 1U < x->n_children);
+    uint64_t k = x->keys[i];
 
     if (x->children[i]->n_keys >= BRANCHING_FACTOR)
     {
         void *d;
-        int k = btree_get_predecessor(x, i, &d);
+        uint64_t k = btree_get_predecessor(x, i, &d);
         x->keys[i] = k;
         x->data[i] = d;
         btree_delete(&x->children[i], k);
@@ -212,7 +232,7 @@ static void btree_delete_internal(btree_node_t **root, btree_node_t *x, int key,
     else if (x->children[i+1]->n_keys >= BRANCHING_FACTOR)
     {
         void *d;
-        int k = btree_get_successor(x, i, &d);
+        uint64_t k = btree_get_successor(x, i, &d);
         x->keys[i] = k;
         x->data[i] = d;
         btree_delete(&x->children[i+1], k);
@@ -224,7 +244,7 @@ static void btree_delete_internal(btree_node_t **root, btree_node_t *x, int key,
     }
 }
 
-static int btree_get_predecessor(btree_node_t *x, unsigned int i, void **d)
+static uint64_t btree_get_predecessor(btree_node_t *x, unsigned int i, void **d)
 {
     btree_node_t *cur = x->children[i];
     while (!cur->is_leaf)
@@ -234,7 +254,7 @@ static int btree_get_predecessor(btree_node_t *x, unsigned int i, void **d)
     return cur->keys[cur->n_keys-1];
 }
 
-static int btree_get_successor(btree_node_t *x, unsigned int i, void **d)
+static uint64_t btree_get_successor(btree_node_t *x, unsigned int i, void **d)
 {
     btree_node_t *cur = x->children[i+1];
     while (!cur->is_leaf)
@@ -251,9 +271,7 @@ static int btree_get_successor(btree_node_t *x, unsigned int i, void **d)
  */
 static void btree_delete_helper(btree_node_t **root, btree_node_t *x, uint64_t key)
 {
-    unsigned int i = 0;
-
-    while (i < x->n_keys && key > x->keys[i]) i++;
+    unsigned int i = btree_lower_bound(x, key);
 
     // Simplest deletion case. most keys in a btree are in leaves, so we hit this often
     if (x->is_leaf)
@@ -290,7 +308,7 @@ static void btree_take_prev(btree_node_t *x, unsigned int i)
     btree_node_t *s = x->children[i-1];
     
     void *d;
-    int k = btree_pop_key(x, i-1, &d);
+    uint64_t k = btree_pop_key(x, i-1, &d);
     btree_insert_key(c, k, 0, d);
 
     if (!c->is_leaf)
@@ -302,12 +320,12 @@ static void btree_take_prev(btree_node_t *x, unsigned int i)
 
 static void btree_take_next(btree_node_t *x, unsigned int i)
 {
-    KASSERT(i < x->n_children-1);
+    KASSERT(i + 1U < x->n_children);
     btree_node_t *c = x->children[i];
     btree_node_t *s = x->children[i+1];
 
     void *d;
-    int k = btree_pop_key(x, i, &d);
+    uint64_t k = btree_pop_key(x, i, &d);
     btree_append_key(c, k, d);
 
     if (!c->is_leaf)
@@ -335,12 +353,12 @@ static void btree_fill_node(btree_node_t *x, unsigned int i)
 
 static void btree_merge(btree_node_t *x, unsigned int i)
 {
-    KASSERT(i < x->n_children-1);
+    KASSERT(i + 1U < x->n_children);
     btree_node_t *c = x->children[i];
     btree_node_t *s = x->children[i+1];
 
     void *d;
-    int k = btree_pop_key(x, i, &d);
+    uint64_t k = btree_pop_key(x, i, &d);
     btree_append_key(c, k, d);
 
     for (unsigned int j = 0; j < s->n_keys; j++)
@@ -397,8 +415,7 @@ void *btree_search(btree_node_t *root, uint64_t key)
 {
     if (!root)
         return NULL;
-    unsigned int ind = 0;
-    while (ind < root->n_keys && key > root->keys[ind]) ind++;
+    unsigned int ind = btree_lower_bound(root, key);
 
     if (ind < root->n_keys && key == root->keys[ind]) return root->data[ind];
     // if (ind < root->n_keys && key == root->keys[ind]) return (void *)0xdeadbeef;
@@ -456,16 +473,152 @@ void btree_node_free(btree_node_t **node)
     *node = NULL;
 }
 
+/*
+ * Frees every node of the tree. The data pointers are the caller's to free.
+ */
 void btree_destroy(btree_node_t *root)
 {
     if (root)
     {
-        // Recursively free nodes
-        // ...
-        // free(tree);
+        for (unsigned int i = 0; i < root->n_children; i++)
+            btree_destroy(root->children[i]);
+        btree_node_free(&root);
     }
 }
 
+/* Number of nodes in each level of a tree bulk loaded from n entries, from
+ * the leaves up: each level is as full as it can be, and passes one entry
+ * per gap between its nodes up to the next. */
+static size_t btree_level_nodes(size_t n)
+{
+    return (n + 1 + MAX_CHILDREN - 1) / MAX_CHILDREN;
+}
+
+/*
+ * Builds a tree in *root, which must be empty, from the n entries in keys
+ * and data. The keys must be sorted and unique. The nodes are filled evenly
+ * rather than left half-empty as inserting in order would, and all of them
+ * are allocated up front, so on failure nothing has changed.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+long btree_bulk_load(btree_node_t **root, const uint64_t *keys,
+                     void *const *data, size_t n)
+{
+    KASSERT(!*root);
+    if (!n)
+        return 0;
+
+    size_t total = 0;
+    for (size_t m = n;;)
+    {
+        size_t nodes = btree_level_nodes(m);
+        total += nodes;
+        if (nodes == 1)
+            break;
+        m = nodes - 1;
+    }
+
+    /* pool holds every node; seps and level are the entries passed up and
+     * the nodes built by the previous level, overwritten in place since a
+     * level writes no further than it has read. */
+    size_t nleaves = btree_level_nodes(n);
+    btree_node_t **pool = kmalloc(total * sizeof(btree_node_t *));
+    btree_node_t **level = kmalloc(nleaves * sizeof(btree_node_t *));
+    uint64_t *sep_keys = kmalloc(nleaves * sizeof(uint64_t));
+    void **sep_data = kmalloc(nleaves * sizeof(void *));
+    size_t allocated = 0;
+    if (pool && level && sep_keys && sep_data)
+    {
+        while (allocated < total && (pool[allocated] = btree_node_create()))
+            allocated++;
+    }
+    if (allocated < total)
+    {
+        while (allocated)
+            btree_node_free(&pool[--allocated]);
+        kfree(pool);
+        kfree(level);
+        kfree(sep_keys);
+        kfree(sep_data);
+        return -ENOMEM;
+    }
+
+    const uint64_t *lkeys = keys;
+    void *const *ldata = data;
+    btree_node_t **children = NULL;
+    size_t m = n;
+    size_t next = 0;
+    while (1)
+    {
+        size_t nodes = btree_level_nodes(m);
+        size_t per = (m - (nodes - 1)) / nodes;
+        size_t extra = (m - (nodes - 1)) % nodes;
+        size_t e = 0;
+        for (size_t i = 0; i < nodes; i++)
+        {
+            btree_node_t *x = pool[next++];
+            size_t cnt = per + (i < extra);
+            KASSERT(nodes == 1 || cnt >= BRANCHING_FACTOR - 1);
+            for (size_t j = 0; j < cnt; j++)
+            {
+                if (children)
+                    btree_append_child(x, children[e + j]);
+                btree_append_key(x, lkeys[e + j], ldata[e + j]);
+            }
+            if (children)
+                btree_append_child(x, children[e + cnt]);
+            e += cnt;
+            if (i + 1 < nodes)
+            {
+                sep_keys[i] = lkeys[e];
+                sep_data[i] = ldata[e];
+                e++;
+            }
+            level[i] = x;
+        }
+        if (nodes == 1)
+            break;
+        lkeys = sep_keys;
+        ldata = sep_data;
+        children = level;
+        m = nodes - 1;
+    }
+    KASSERT(next == total);
+    *root = level[0];
+
+    kfree(pool);
+    kfree(level);
+    kfree(sep_keys);
+    kfree(sep_data);
+    btree_assert_sanity(*root);
+    return 0;
+}
+
+/*
+ * Calls visit on each entry with lo <= key <= hi, in key order, skipping
+ * the subtrees that are out of range. Stops early if visit returns nonzero,
+ * and returns that; otherwise returns 0.
+ */
+long btree_iterate_range(btree_node_t *root, uint64_t lo, uint64_t hi,
+                         btree_visit_func_t visit, void *arg)
+{
+    if (!root)
+        return 0;
+    for (unsigned int i = btree_lower_bound(root, lo); i <= root->n_keys; i++)
+    {
+        long ret;
+        if (!root->is_leaf &&
+            (ret = btree_iterate_range(root->children[i], lo, hi, visit, arg)))
+            return ret;
+        if (i == root->n_keys || root->keys[i] > hi)
+            break;
+        if ((ret = visit(root->keys[i], root->data[i], arg)))
+            return ret;
+    }
+    return 0;
+}
+
 void print_btree(btree_node_t *x)
 {
     print_btree_helper(x, 0);
@@ -493,15 +646,20 @@ static void print_btree_helper(btree_node_t *x, int level)
     }
 }
 
+/*
+ * Checks the structure of the whole tree. That takes time linear in its size,
+ * so it is only done on every update when BTREE_CHECK is defined.
+ */
 void btree_assert_sanity(btree_node_t *root)
 {
+#ifdef BTREE_CHECK
     if (!root) return;
 
     KASSERT(root->n_keys > 0);
 
-    for (unsigned int i = 0; i < root->n_keys; i++)
+    for (unsigned int i = 1; i < root->n_keys; i++)
     {
-        KASSERT(((pframe_t *)root->data[i])->pf_pagenum == root->keys[i]);
+        KASSERT(root->keys[i - 1] < root->keys[i]);
     }
 
     if (root->n_children == 0 || root->is_leaf)
@@ -510,6 +668,8 @@ void btree_assert_sanity(btree_node_t *root)
         return;
     }
 
+    KASSERT(root->n_children == root->n_keys + 1U);
     for (unsigned int i = 0; i < root->n_children; i++)
         btree_assert_sanity(root->children[i]);
-}
\ No newline at end of file
+#endif
+}
@@ -1,4 +1,6 @@
+#include "globals.h"
 #include "main/apic.h"
+#include "main/interrupt.h"
 #include "main/io.h"
 #include "util/printf.h"
 #include "util/string.h"
@@ -21,14 +23,41 @@
  */
 #define INIT_DBG_MODES "-all,print,test,vfs,s5fs"
 
-/* Below is a truly terrible poll-driven serial driver that we use for debugging
- * purposes - it outputs to COM1, but
- * this can be easily changed. It does not use interrupts, and cannot read input
- * */
+/* Below is the serial driver that we use for debugging purposes - it outputs
+ * to COM1, but this can be easily changed. It cannot read input.
+ *
+ * Until dbg_async_init() runs, and again once dbg_sync() has, each byte is
+ * written by polling the port. In between, output is queued in dbg_ring and
+ * the UART's transmit interrupt moves it to the FIFO a FIFO's worth at a
+ * time, so a message costs its caller a copy rather than the time to send it
+ * at 38400 baud. If the ring fills, the oldest of it is written out by
+ * polling to make room, so output is never dropped. The ring is locked with
+ * interrupts off by a lock of its own rather than a spinlock_t, which may
+ * itself panic: a core that comes back to dbg_puts() while holding it, as
+ * when a panic interrupts a message, writes by polling instead.
+ */
 /* This port is COM1 */
 #define PORT 0x3f8
-/* Corresponding interrupt vector */
-#define PORT_INTR 0x0d
+/* Corresponding ISA interrupt line */
+#define PORT_IRQ 4
+
+#define UART_IER (PORT + 1) /* interrupt enable */
+#define UART_IIR (PORT + 2) /* interrupt identification, when read */
+#define UART_MCR (PORT + 4) /* modem control */
+#define UART_LSR (PORT + 5) /* line status */
+#define UART_IER_THRE 0x02  /* interrupt when the transmit FIFO empties */
+#define UART_MCR_OUT2 0x08  /* connects the interrupt line on a PC */
+#define UART_LSR_THRE 0x20  /* the transmit FIFO is empty */
+#define UART_FIFO_SIZE 16
+
+#define DBG_RING_SIZE (16 * 1024)
+
+static char dbg_ring[DBG_RING_SIZE];
+static size_t dbg_ring_head; /* free-running, like the tail */
+static size_t dbg_ring_tail;
+static volatile long dbg_async;     /* output is being queued */
+static long dbg_tx_active;          /* the transmit interrupt is enabled */
+static volatile long dbg_ring_owner = -1; /* core holding the ring's lock */
 
 uint64_t dbg_modes;
 
@@ -66,14 +95,135 @@ const char *dbg_color(uint64_t d_mode)
     panic("Unknown debug mode 0x%lx\n", d_mode);
 }
 
+static void dbg_putc_sync(char c)
+{
+    /* Wait until the port is free */
+    while (!(inb(UART_LSR) & UART_LSR_THRE))
+        ;
+    outb(PORT, (uint8_t)c);
+}
+
+/* Locks the ring with interrupts off. Returns whether they were on, or -1
+ * (with them as they were) if the current core holds it already. */
+static long dbg_ring_lock()
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    long id = curcore.kc_id;
+    if (dbg_ring_owner == id)
+    {
+        if (enabled)
+            intr_enable();
+        return -1;
+    }
+    while (!__sync_bool_compare_and_swap(&dbg_ring_owner, -1, id))
+        __asm__ volatile("pause");
+    return enabled;
+}
+
+static void dbg_ring_unlock(long enabled)
+{
+    __sync_synchronize();
+    dbg_ring_owner = -1;
+    if (enabled)
+        intr_enable();
+}
+
+/* Moves as much of the ring to the transmit FIFO as it has room for, which
+ * is all or nothing. The ring must be locked. */
+static void dbg_tx_fill()
+{
+    if (!(inb(UART_LSR) & UART_LSR_THRE))
+        return;
+    for (long n = 0; n < UART_FIFO_SIZE && dbg_ring_head != dbg_ring_tail; n++)
+        outb(PORT, (uint8_t)dbg_ring[dbg_ring_head++ % DBG_RING_SIZE]);
+}
+
+static long dbg_serial_intr(regs_t *regs)
+{
+    long enabled = dbg_ring_lock();
+    inb(UART_IIR); /* acknowledges the interrupt */
+    dbg_tx_fill();
+    if (dbg_ring_head == dbg_ring_tail)
+    {
+        outb(UART_IER, 0);
+        dbg_tx_active = 0;
+    }
+    dbg_ring_unlock(enabled);
+    return 0;
+}
+
 static void dbg_puts(char *c)
 {
-    while (*c != '\0')
+    long enabled = dbg_async ? dbg_ring_lock() : -1;
+    if (enabled >= 0 && !dbg_async)
+    {
+        /* dbg_sync() ran while we waited for the lock */
+        dbg_ring_unlock(enabled);
+        enabled = -1;
+    }
+    if (enabled < 0)
+    {
+        while (*c != '\0')
+            dbg_putc_sync(*c++);
+        return;
+    }
+
+    for (; *c != '\0'; c++)
+    {
+        if (dbg_ring_tail - dbg_ring_head == DBG_RING_SIZE)
+            dbg_putc_sync(dbg_ring[dbg_ring_head++ % DBG_RING_SIZE]);
+        dbg_ring[dbg_ring_tail++ % DBG_RING_SIZE] = *c;
+    }
+    if (!dbg_tx_active)
+    {
+        dbg_tx_fill();
+        dbg_tx_active = 1;
+        outb(UART_IER, UART_IER_THRE);
+    }
+    dbg_ring_unlock(enabled);
+}
+
+/*
+ * Starts queueing output for the transmit interrupt to send. Called once the
+ * I/O APIC is up; the interrupt goes to the core that calls it.
+ */
+void dbg_async_init()
+{
+    outb(UART_IER, 0);
+    outb(UART_MCR, (uint8_t)(inb(UART_MCR) | UART_MCR_OUT2));
+    intr_map(PORT_IRQ, INTR_SERIAL);
+    intr_set_affinity(INTR_SERIAL, APIC_CORE(apic_current_id()));
+    intr_register(INTR_SERIAL, dbg_serial_intr);
+    dbg_async = 1;
+}
+
+/*
+ * Stops queueing output, and writes out what is queued, for when the
+ * transmit interrupt may not come again: a panic, or a halt. A core that
+ * holds the ring's lock without letting it go is waited for only so long.
+ */
+void dbg_sync()
+{
+    if (!dbg_async)
+        return;
+    dbg_async = 0;
+    long id = curcore.kc_id;
+    long locked = 0;
+    for (long tries = 0; tries < 1000000 && dbg_ring_owner != id; tries++)
+    {
+        if ((locked = __sync_bool_compare_and_swap(&dbg_ring_owner, -1, id)))
+            break;
+        __asm__ volatile("pause");
+    }
+    outb(UART_IER, 0);
+    dbg_tx_active = 0;
+    while (dbg_ring_head != dbg_ring_tail)
+        dbg_putc_sync(dbg_ring[dbg_ring_head++ % DBG_RING_SIZE]);
+    if (locked)
     {
-        /* Wait until the port is free */
-        while (!(inb(PORT + 5) & 0x20))
-            ;
-        outb(PORT, (uint8_t)*c++);
+        __sync_synchronize();
+        dbg_ring_owner = -1;
     }
 }
 
@@ -105,7 +255,7 @@ void dbg_printinfo(dbg_infofunc_t func, const void *data)
     dbg_puts(buf);
 }
 
-#ifndef NDEBUG
+#if __ASSERT_LEVEL__ >= ASSERT_LEVEL_DEBUG
 /**
  * searches for <code>name</code> in the list of known
  * debugging modes specified above and, if it
@@ -223,6 +373,7 @@ noreturn void dbg_panic(const char *file, int line, const char *func,
     va_list args;
     va_start(args, fmt);
 
+    dbg_sync();
     DEBUG_ENTER
     dbg_print("C%ld P%ld panic in %s:%u %s(): ", curcore.kc_id,
               curproc ? curproc->p_pid : -1L, file, line, func);
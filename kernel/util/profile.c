@@ -0,0 +1,96 @@
+#include "util/profile.h"
+#include "errno.h"
+#include "globals.h"
+#include "main/interrupt.h"
+#include "mm/page.h"
+#include "util/debug.h"
+
+typedef struct profile_sample
+{
+    uintptr_t ps_rip;
+    pid_t ps_pid;
+} profile_sample_t;
+
+#define PROFILE_RING_PAGES \
+    ((PROFILE_SAMPLES * sizeof(profile_sample_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* Each core's ring, allocated the first time the profiler is started, and
+ * the samples it has taken since then: the newest PROFILE_SAMPLES of them are
+ * in the ring. Only the core itself writes either, and each core's pair has
+ * a cache line of its own. */
+typedef struct profile_core
+{
+    profile_sample_t *pc_ring;
+    uint64_t pc_count;
+} CACHE_LINE_ALIGNED profile_core_t;
+
+static profile_core_t profile_cores[MAX_LAPICS];
+static volatile long profile_on;
+
+/* Starts sampling on every core that is up, dropping any earlier samples. */
+long profile_start()
+{
+    if (profile_on)
+    {
+        return -EBUSY;
+    }
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (csd_vaddr_table[id] && !profile_cores[id].pc_ring &&
+            !(profile_cores[id].pc_ring = page_alloc_n(PROFILE_RING_PAGES)))
+        {
+            return -ENOMEM;
+        }
+        profile_cores[id].pc_count = 0;
+    }
+    __sync_synchronize();
+    profile_on = 1;
+    return 0;
+}
+
+/* Stops sampling; a tick already taking a sample finishes it. */
+void profile_stop() { profile_on = 0; }
+
+long profile_running() { return profile_on; }
+
+/* Called from the timer tick, with interrupts off */
+void profile_sample(regs_t *regs)
+{
+    profile_sample_t *ring = profile_cores[curcore.kc_id].pc_ring;
+    if (!profile_on || !ring || !curthr)
+    {
+        return;
+    }
+    uint64_t n = profile_cores[curcore.kc_id].pc_count++;
+    profile_sample_t *ps = &ring[n % PROFILE_SAMPLES];
+    ps->ps_rip = regs->r_rip;
+    ps->ps_pid = curproc->p_pid;
+}
+
+/*
+ * Writes each core's samples to the debug log, oldest first, stopping the
+ * profiler if it is running. Returns the number written.
+ */
+size_t profile_dump()
+{
+    profile_stop();
+    size_t total = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        profile_sample_t *ring = profile_cores[id].pc_ring;
+        if (!ring)
+        {
+            continue;
+        }
+        uint64_t count = profile_cores[id].pc_count;
+        uint64_t first = count > PROFILE_SAMPLES ? count - PROFILE_SAMPLES : 0;
+        for (uint64_t n = first; n < count; n++)
+        {
+            profile_sample_t *ps = &ring[n % PROFILE_SAMPLES];
+            dbg_print("PROF core=%ld pid=%d rip=0x%lx\n", id, ps->ps_pid,
+                      ps->ps_rip);
+        }
+        total += count - first;
+    }
+    return total;
+}
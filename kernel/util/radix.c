@@ -0,0 +1,340 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "util/radix.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+static slab_allocator_t *radix_node_allocator;
+
+void radix_init()
+{
+    radix_node_allocator =
+        slab_allocator_create("radix_node", sizeof(radix_node_t));
+    KASSERT(radix_node_allocator);
+}
+
+void radix_tree_init(radix_tree_t *tree)
+{
+    tree->rt_root = NULL;
+    tree->rt_height = 0;
+}
+
+static radix_node_t *_radix_node_alloc(radix_node_t *parent,
+                                       unsigned int offset)
+{
+    radix_node_t *node = slab_obj_alloc(radix_node_allocator);
+    if (node)
+    {
+        memset(node, 0, sizeof(radix_node_t));
+        node->rn_parent = parent;
+        node->rn_offset = offset;
+    }
+    return node;
+}
+
+/* The largest key a tree of the given height can hold */
+static uint64_t _radix_maxkey(unsigned int height)
+{
+    if (height * RADIX_TREE_SHIFT >= 64)
+    {
+        return ~0UL;
+    }
+    return (1UL << (height * RADIX_TREE_SHIFT)) - 1;
+}
+
+/* Adds levels above the root until key fits in the tree. */
+static long _radix_extend(radix_tree_t *tree, uint64_t key)
+{
+    if (!tree->rt_root)
+    {
+        tree->rt_height = 1;
+        while (key > _radix_maxkey(tree->rt_height))
+        {
+            tree->rt_height++;
+        }
+        return 0;
+    }
+    while (key > _radix_maxkey(tree->rt_height))
+    {
+        radix_node_t *root = _radix_node_alloc(NULL, 0);
+        if (!root)
+        {
+            return -ENOMEM;
+        }
+        radix_node_t *old = tree->rt_root;
+        root->rn_slots[0] = old;
+        root->rn_count = 1;
+        for (unsigned int tag = 0; tag < RADIX_TREE_NTAGS; tag++)
+        {
+            root->rn_tags[tag] = old->rn_tags[tag] ? 1 : 0;
+        }
+        old->rn_parent = root;
+        old->rn_offset = 0;
+        tree->rt_root = root;
+        tree->rt_height++;
+    }
+    return 0;
+}
+
+/*
+ * Frees node if it is empty, and then its ancestors as they become empty.
+ * Then removes levels from the top of the tree for as long as all keys fit
+ * under slot 0 of the root.
+ */
+static void _radix_prune(radix_tree_t *tree, radix_node_t *node)
+{
+    while (node && !node->rn_count)
+    {
+        radix_node_t *parent = node->rn_parent;
+        if (parent)
+        {
+            parent->rn_slots[node->rn_offset] = NULL;
+            parent->rn_count--;
+        }
+        else
+        {
+            tree->rt_root = NULL;
+            tree->rt_height = 0;
+        }
+        slab_obj_free(radix_node_allocator, node);
+        node = parent;
+    }
+
+    radix_node_t *root = tree->rt_root;
+    while (root && tree->rt_height > 1 && root->rn_count == 1 &&
+           root->rn_slots[0])
+    {
+        radix_node_t *child = root->rn_slots[0];
+        child->rn_parent = NULL;
+        child->rn_offset = 0;
+        slab_obj_free(radix_node_allocator, root);
+        tree->rt_root = root = child;
+        tree->rt_height--;
+    }
+}
+
+/*
+ * Returns the bottom-level node that would hold key, setting *offp to key's
+ * slot in it, or NULL if there is no such node.
+ */
+static radix_node_t *_radix_lookup_node(const radix_tree_t *tree, uint64_t key,
+                                        unsigned int *offp)
+{
+    if (!tree->rt_root || key > _radix_maxkey(tree->rt_height))
+    {
+        return NULL;
+    }
+    radix_node_t *node = tree->rt_root;
+    for (unsigned int shift = (tree->rt_height - 1) * RADIX_TREE_SHIFT; shift;
+         shift -= RADIX_TREE_SHIFT)
+    {
+        node = node->rn_slots[(key >> shift) & RADIX_TREE_MASK];
+        if (!node)
+        {
+            return NULL;
+        }
+    }
+    *offp = key & RADIX_TREE_MASK;
+    return node;
+}
+
+/*
+ * Inserts item (which must not be NULL) at key. Returns 0 on success,
+ * -EEXIST if key is already present, or -ENOMEM.
+ */
+long radix_tree_insert(radix_tree_t *tree, uint64_t key, void *item)
+{
+    KASSERT(item);
+    long ret = _radix_extend(tree, key);
+    if (ret)
+    {
+        return ret;
+    }
+    if (!tree->rt_root)
+    {
+        tree->rt_root = _radix_node_alloc(NULL, 0);
+        if (!tree->rt_root)
+        {
+            tree->rt_height = 0;
+            return -ENOMEM;
+        }
+    }
+
+    radix_node_t *node = tree->rt_root;
+    for (unsigned int shift = (tree->rt_height - 1) * RADIX_TREE_SHIFT; shift;
+         shift -= RADIX_TREE_SHIFT)
+    {
+        unsigned int off = (key >> shift) & RADIX_TREE_MASK;
+        radix_node_t *child = node->rn_slots[off];
+        if (!child)
+        {
+            child = _radix_node_alloc(node, off);
+            if (!child)
+            {
+                _radix_prune(tree, node);
+                return -ENOMEM;
+            }
+            node->rn_slots[off] = child;
+            node->rn_count++;
+        }
+        node = child;
+    }
+
+    unsigned int off = key & RADIX_TREE_MASK;
+    if (node->rn_slots[off])
+    {
+        return -EEXIST;
+    }
+    node->rn_slots[off] = item;
+    node->rn_count++;
+    return 0;
+}
+
+void *radix_tree_lookup(const radix_tree_t *tree, uint64_t key)
+{
+    unsigned int off;
+    radix_node_t *node = _radix_lookup_node(tree, key, &off);
+    return node ? node->rn_slots[off] : NULL;
+}
+
+/* Clears tag for slot off of node, and upwards for as long as it was the
+ * only tagged entry below. */
+static void _radix_tag_clear_node(radix_node_t *node, unsigned int off,
+                                  unsigned int tag)
+{
+    while (node)
+    {
+        node->rn_tags[tag] &= ~(1UL << off);
+        if (node->rn_tags[tag])
+        {
+            break;
+        }
+        off = node->rn_offset;
+        node = node->rn_parent;
+    }
+}
+
+/* Removes key from the tree, returning the item it held or NULL. */
+void *radix_tree_delete(radix_tree_t *tree, uint64_t key)
+{
+    unsigned int off;
+    radix_node_t *node = _radix_lookup_node(tree, key, &off);
+    if (!node || !node->rn_slots[off])
+    {
+        return NULL;
+    }
+    void *item = node->rn_slots[off];
+    for (unsigned int tag = 0; tag < RADIX_TREE_NTAGS; tag++)
+    {
+        _radix_tag_clear_node(node, off, tag);
+    }
+    node->rn_slots[off] = NULL;
+    node->rn_count--;
+    _radix_prune(tree, node);
+    return item;
+}
+
+/* Sets tag on key, which must be present. */
+void radix_tree_tag_set(radix_tree_t *tree, uint64_t key, unsigned int tag)
+{
+    KASSERT(tag < RADIX_TREE_NTAGS);
+    unsigned int off;
+    radix_node_t *node = _radix_lookup_node(tree, key, &off);
+    KASSERT(node && node->rn_slots[off]);
+    while (node && !(node->rn_tags[tag] & (1UL << off)))
+    {
+        node->rn_tags[tag] |= 1UL << off;
+        off = node->rn_offset;
+        node = node->rn_parent;
+    }
+}
+
+void radix_tree_tag_clear(radix_tree_t *tree, uint64_t key, unsigned int tag)
+{
+    KASSERT(tag < RADIX_TREE_NTAGS);
+    unsigned int off;
+    radix_node_t *node = _radix_lookup_node(tree, key, &off);
+    if (node)
+    {
+        _radix_tag_clear_node(node, off, tag);
+    }
+}
+
+long radix_tree_tag_get(const radix_tree_t *tree, uint64_t key,
+                        unsigned int tag)
+{
+    KASSERT(tag < RADIX_TREE_NTAGS);
+    unsigned int off;
+    radix_node_t *node = _radix_lookup_node(tree, key, &off);
+    return node && (node->rn_tags[tag] & (1UL << off));
+}
+
+/* Returns whether any entry in the tree has tag set. */
+long radix_tree_tagged(const radix_tree_t *tree, unsigned int tag)
+{
+    KASSERT(tag < RADIX_TREE_NTAGS);
+    return tree->rt_root && tree->rt_root->rn_tags[tag];
+}
+
+/*
+ * Appends to results[n..max) the items under node, whose slots cover keys
+ * base + (i << shift), that are at or after first (which is at least base)
+ * and, if tag is not negative, have it set. Returns the new n.
+ */
+static size_t _radix_gang(const radix_node_t *node, unsigned int shift,
+                          uint64_t base, uint64_t first, void **results,
+                          size_t n, size_t max, long tag)
+{
+    for (unsigned int off = (first - base) >> shift;
+         off < RADIX_TREE_SLOTS && n < max; off++)
+    {
+        void *slot = node->rn_slots[off];
+        if (!slot || (tag >= 0 && !(node->rn_tags[tag] & (1UL << off))))
+        {
+            continue;
+        }
+        if (!shift)
+        {
+            results[n++] = slot;
+            continue;
+        }
+        uint64_t start = base + ((uint64_t)off << shift);
+        n = _radix_gang(slot, shift - RADIX_TREE_SHIFT, start,
+                        first > start ? first : start, results, n, max, tag);
+    }
+    return n;
+}
+
+/*
+ * Fills results with up to max items in key order, starting at key first.
+ * Returns the number found.
+ */
+size_t radix_tree_gang_lookup(const radix_tree_t *tree, void **results,
+                              uint64_t first, size_t max)
+{
+    if (!tree->rt_root || first > _radix_maxkey(tree->rt_height))
+    {
+        return 0;
+    }
+    return _radix_gang(tree->rt_root, (tree->rt_height - 1) * RADIX_TREE_SHIFT,
+                       0, first, results, 0, max, -1);
+}
+
+/* Like radix_tree_gang_lookup, but only returns items with tag set. */
+size_t radix_tree_gang_lookup_tag(const radix_tree_t *tree, void **results,
+                                  uint64_t first, size_t max,
+                                  unsigned int tag)
+{
+    KASSERT(tag < RADIX_TREE_NTAGS);
+    if (!radix_tree_tagged(tree, tag) ||
+        first > _radix_maxkey(tree->rt_height))
+    {
+        return 0;
+    }
+    return _radix_gang(tree->rt_root, (tree->rt_height - 1) * RADIX_TREE_SHIFT,
+                       0, first, results, 0, max, tag);
+}
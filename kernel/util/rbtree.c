@@ -0,0 +1,336 @@
+#include "util/rbtree.h"
+
+#include "util/debug.h"
+
+/*
+ * Insertion and removal follow Introduction to Algorithms (Cormen,
+ * Leiserson, Rivest, Stein), with NULL standing in for the black leaves.
+ */
+
+void rbtree_init(rbtree_t *tree, rb_update_func_t update)
+{
+    tree->rbt_root = NULL;
+    tree->rbt_update = update;
+}
+
+static void _rb_update(rbtree_t *tree, rb_node_t *node)
+{
+    if (tree->rbt_update)
+    {
+        tree->rbt_update(node);
+    }
+}
+
+void rbtree_update_path(rbtree_t *tree, rb_node_t *node)
+{
+    if (!tree->rbt_update)
+    {
+        return;
+    }
+    for (; node; node = node->rb_parent)
+    {
+        tree->rbt_update(node);
+    }
+}
+
+/* Puts new where old is in old's parent (or at the root) */
+static void _rb_replace_child(rbtree_t *tree, rb_node_t *old, rb_node_t *new)
+{
+    rb_node_t *parent = old->rb_parent;
+    if (!parent)
+    {
+        tree->rbt_root = new;
+    }
+    else if (parent->rb_left == old)
+    {
+        parent->rb_left = new;
+    }
+    else
+    {
+        parent->rb_right = new;
+    }
+    if (new)
+    {
+        new->rb_parent = parent;
+    }
+}
+
+/*
+ * The subtree node heads keeps the same nodes through a rotation, so only
+ * the two nodes that trade places need their data recomputed, lowest first.
+ */
+static void _rb_rotate_left(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *right = node->rb_right;
+    node->rb_right = right->rb_left;
+    if (right->rb_left)
+    {
+        right->rb_left->rb_parent = node;
+    }
+    _rb_replace_child(tree, node, right);
+    right->rb_left = node;
+    node->rb_parent = right;
+    _rb_update(tree, node);
+    _rb_update(tree, right);
+}
+
+static void _rb_rotate_right(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *left = node->rb_left;
+    node->rb_left = left->rb_right;
+    if (left->rb_right)
+    {
+        left->rb_right->rb_parent = node;
+    }
+    _rb_replace_child(tree, node, left);
+    left->rb_right = node;
+    node->rb_parent = left;
+    _rb_update(tree, node);
+    _rb_update(tree, left);
+}
+
+static long _rb_is_red(rb_node_t *node) { return node && node->rb_red; }
+
+/*
+ * Links node in at *link, a NULL child pointer of parent (or the root
+ * pointer, with parent NULL), and rebalances.
+ */
+void rbtree_insert(rbtree_t *tree, rb_node_t *parent, rb_node_t **link,
+                   rb_node_t *node)
+{
+    KASSERT(!*link);
+    node->rb_parent = parent;
+    node->rb_left = node->rb_right = NULL;
+    node->rb_red = 1;
+    *link = node;
+    rbtree_update_path(tree, node);
+
+    while (_rb_is_red(node->rb_parent))
+    {
+        parent = node->rb_parent;
+        rb_node_t *grandparent = parent->rb_parent;
+        if (parent == grandparent->rb_left)
+        {
+            rb_node_t *uncle = grandparent->rb_right;
+            if (_rb_is_red(uncle))
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grandparent->rb_red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->rb_right)
+            {
+                _rb_rotate_left(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grandparent->rb_red = 1;
+            _rb_rotate_right(tree, grandparent);
+        }
+        else
+        {
+            rb_node_t *uncle = grandparent->rb_left;
+            if (_rb_is_red(uncle))
+            {
+                parent->rb_red = uncle->rb_red = 0;
+                grandparent->rb_red = 1;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->rb_left)
+            {
+                _rb_rotate_right(tree, parent);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_red = 0;
+            grandparent->rb_red = 1;
+            _rb_rotate_left(tree, grandparent);
+        }
+    }
+    tree->rbt_root->rb_red = 0;
+}
+
+/*
+ * Restores the black heights after a black node was taken out from above
+ * node, which may be NULL, leaving it one black short. parent is node's
+ * parent.
+ */
+static void _rb_remove_fixup(rbtree_t *tree, rb_node_t *node,
+                             rb_node_t *parent)
+{
+    while (node != tree->rbt_root && !_rb_is_red(node))
+    {
+        if (node == parent->rb_left)
+        {
+            rb_node_t *sibling = parent->rb_right;
+            if (_rb_is_red(sibling))
+            {
+                sibling->rb_red = 0;
+                parent->rb_red = 1;
+                _rb_rotate_left(tree, parent);
+                sibling = parent->rb_right;
+            }
+            if (!_rb_is_red(sibling->rb_left) &&
+                !_rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_red = 1;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (!_rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_left->rb_red = 0;
+                sibling->rb_red = 1;
+                _rb_rotate_right(tree, sibling);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            sibling->rb_right->rb_red = 0;
+            _rb_rotate_left(tree, parent);
+        }
+        else
+        {
+            rb_node_t *sibling = parent->rb_left;
+            if (_rb_is_red(sibling))
+            {
+                sibling->rb_red = 0;
+                parent->rb_red = 1;
+                _rb_rotate_right(tree, parent);
+                sibling = parent->rb_left;
+            }
+            if (!_rb_is_red(sibling->rb_left) &&
+                !_rb_is_red(sibling->rb_right))
+            {
+                sibling->rb_red = 1;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (!_rb_is_red(sibling->rb_left))
+            {
+                sibling->rb_right->rb_red = 0;
+                sibling->rb_red = 1;
+                _rb_rotate_left(tree, sibling);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_red = parent->rb_red;
+            parent->rb_red = 0;
+            sibling->rb_left->rb_red = 0;
+            _rb_rotate_right(tree, parent);
+        }
+        node = tree->rbt_root;
+        break;
+    }
+    if (node)
+    {
+        node->rb_red = 0;
+    }
+}
+
+void rbtree_remove(rbtree_t *tree, rb_node_t *node)
+{
+    rb_node_t *child, *parent;
+    long removed_red;
+    if (!node->rb_left || !node->rb_right)
+    {
+        // node has at most one child, which takes its place
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        removed_red = node->rb_red;
+        _rb_replace_child(tree, node, child);
+    }
+    else
+    {
+        // node's successor, which has no left child, takes its place
+        rb_node_t *next = node->rb_right;
+        while (next->rb_left)
+        {
+            next = next->rb_left;
+        }
+        removed_red = next->rb_red;
+        child = next->rb_right;
+        if (next->rb_parent == node)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = next->rb_parent;
+            _rb_replace_child(tree, next, child);
+            next->rb_right = node->rb_right;
+            next->rb_right->rb_parent = next;
+        }
+        _rb_replace_child(tree, node, next);
+        next->rb_left = node->rb_left;
+        next->rb_left->rb_parent = next;
+        next->rb_red = node->rb_red;
+    }
+    // Everything whose subtree lost node lies on the path up from parent
+    rbtree_update_path(tree, parent);
+    if (!removed_red)
+    {
+        _rb_remove_fixup(tree, child, parent);
+    }
+    node->rb_parent = node->rb_left = node->rb_right = NULL;
+}
+
+rb_node_t *rbtree_first(rbtree_t *tree)
+{
+    rb_node_t *node = tree->rbt_root;
+    while (node && node->rb_left)
+    {
+        node = node->rb_left;
+    }
+    return node;
+}
+
+rb_node_t *rbtree_last(rbtree_t *tree)
+{
+    rb_node_t *node = tree->rbt_root;
+    while (node && node->rb_right)
+    {
+        node = node->rb_right;
+    }
+    return node;
+}
+
+rb_node_t *rbtree_next(rb_node_t *node)
+{
+    if (node->rb_right)
+    {
+        node = node->rb_right;
+        while (node->rb_left)
+        {
+            node = node->rb_left;
+        }
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_right)
+    {
+        node = node->rb_parent;
+    }
+    return node->rb_parent;
+}
+
+rb_node_t *rbtree_prev(rb_node_t *node)
+{
+    if (node->rb_left)
+    {
+        node = node->rb_left;
+        while (node->rb_right)
+        {
+            node = node->rb_right;
+        }
+        return node;
+    }
+    while (node->rb_parent && node == node->rb_parent->rb_left)
+    {
+        node = node->rb_parent;
+    }
+    return node->rb_parent;
+}
@@ -23,31 +23,128 @@ int memcmp(const void *cs, const void *ct, size_t count)
     return ((ret & 1) ? ((ret >> 8) ? -1 : 1) : 0);
 }
 
+/*
+ * memcpy and memset pick a way to move the bytes by size. Short runs are
+ * done a byte at a time with rep movsb/stosb, whose startup cost the
+ * alternatives would not win back. From STRING_WIDE_MIN bytes the head is
+ * done bytewise up to an 8-byte boundary of the destination, and the rest
+ * with rep movsq/stosq. From STRING_NT_MIN bytes (a page: COW copies,
+ * zeroing, block buffers) 32 bytes are moved per iteration with movnti,
+ * which writes around the cache, so that a copy the size of a page does not
+ * push out the working set of whoever is running; an sfence afterwards
+ * orders those stores before whatever follows, such as mapping the page.
+ *
+ * Only general purpose registers are used: the kernel does not save the
+ * SSE or AVX state of user threads, so it must not touch it.
+ */
+#define STRING_WIDE_MIN 64
+#define STRING_NT_MIN 4096
+
+static inline void _rep_movsb(void **dest, const void **src, size_t count)
+{
+    __asm__ volatile("cld\n\t"
+                     "rep movsb"
+                     : "+D"(*dest), "+S"(*src), "+c"(count)
+                     :
+                     : "cc", "memory");
+}
+
+static inline void _rep_stosb(void **s, uint64_t v, size_t count)
+{
+    __asm__ volatile("cld\n\t"
+                     "rep stosb"
+                     : "+D"(*s), "+c"(count)
+                     : "a"(v)
+                     : "cc", "memory");
+}
+
+/* Copies 32 * nblocks bytes without going through the cache. */
+static inline void _movnti_copy(void **dest, const void **src, size_t nblocks)
+{
+    __asm__ volatile("1:\n\t"
+                     "movq (%1), %%r8\n\t"
+                     "movq 8(%1), %%r9\n\t"
+                     "movq 16(%1), %%r10\n\t"
+                     "movq 24(%1), %%r11\n\t"
+                     "movnti %%r8, (%0)\n\t"
+                     "movnti %%r9, 8(%0)\n\t"
+                     "movnti %%r10, 16(%0)\n\t"
+                     "movnti %%r11, 24(%0)\n\t"
+                     "addq $32, %1\n\t"
+                     "addq $32, %0\n\t"
+                     "decq %2\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(*dest), "+r"(*src), "+r"(nblocks)
+                     :
+                     : "r8", "r9", "r10", "r11", "cc", "memory");
+}
+
+/* Fills 32 * nblocks bytes with v without going through the cache. */
+static inline void _movnti_fill(void **s, uint64_t v, size_t nblocks)
+{
+    __asm__ volatile("1:\n\t"
+                     "movnti %2, (%0)\n\t"
+                     "movnti %2, 8(%0)\n\t"
+                     "movnti %2, 16(%0)\n\t"
+                     "movnti %2, 24(%0)\n\t"
+                     "addq $32, %0\n\t"
+                     "decq %1\n\t"
+                     "jnz 1b\n\t"
+                     "sfence"
+                     : "+r"(*s), "+r"(nblocks)
+                     : "r"(v)
+                     : "cc", "memory");
+}
+
 void *memcpy(void *dest, const void *src, size_t count)
 {
-    /* Move %ecx bytes from %esi to %edi */
-    __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
-        "rep\n\t"
-        "movsb"
-        : /* No output */
-        : "S"(src), "D"(dest), "c"(count)
-        : "cc" /* We overwrite condition codes - i.e., flags */
-    );
+    void *d = dest;
+    if (count >= STRING_WIDE_MIN)
+    {
+        size_t head = -(uintptr_t)d & 7;
+        _rep_movsb(&d, &src, head);
+        count -= head;
+        if (count >= STRING_NT_MIN && !((uintptr_t)src & 7))
+        {
+            _movnti_copy(&d, &src, count / 32);
+            count %= 32;
+        }
+        size_t nquads = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep movsq"
+                         : "+D"(d), "+S"(src), "+c"(nquads)
+                         :
+                         : "cc", "memory");
+        count %= 8;
+    }
+    _rep_movsb(&d, &src, count);
     return dest;
 }
 
 void *memset(void *s, int c, size_t count)
 {
-    /* Fill %ecx bytes at %edi with %eax (actually %al) */
-    __asm__ volatile(
-        "cld\n\t" /* Make sure direction is forwards */
-        "rep\n\t"
-        "stosb"
-        : /* No output */
-        : "a"(c), "D"(s), "c"(count)
-        : "cc" /* Overwrite flags */
-    );
+    void *d = s;
+    uint64_t v = (uint8_t)c * 0x0101010101010101UL;
+    if (count >= STRING_WIDE_MIN)
+    {
+        size_t head = -(uintptr_t)d & 7;
+        _rep_stosb(&d, v, head);
+        count -= head;
+        if (count >= STRING_NT_MIN)
+        {
+            _movnti_fill(&d, v, count / 32);
+            count %= 32;
+        }
+        size_t nquads = count / 8;
+        __asm__ volatile("cld\n\t"
+                         "rep stosq"
+                         : "+D"(d), "+c"(nquads)
+                         : "a"(v)
+                         : "cc", "memory");
+        count %= 8;
+    }
+    _rep_stosb(&d, v, count);
     return s;
 }
 
@@ -1,15 +1,15 @@
 #include "util/time.h"
 #include "drivers/cmos.h"
+#include "errno.h"
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "proc/sched.h"
 #include "util/printf.h"
+#include "util/profile.h"
 #include "util/timer.h"
+#include "vm/vdso.h"
 #include <drivers/screen.h>
 
-#define TIME_APIC_TICK_FREQUENCY 16
-// this is pretty wrong...
-#define MICROSECONDS_PER_APIC_TICK (16 * 1000 / TIME_APIC_TICK_FREQUENCY)
-
 volatile uint64_t jiffies;
 uint64_t timer_tickcount CORE_SPECIFIC_DATA;
 uint64_t kernel_preempted_count CORE_SPECIFIC_DATA;
@@ -17,65 +17,177 @@ uint64_t user_preempted_count CORE_SPECIFIC_DATA;
 uint64_t not_preempted_count CORE_SPECIFIC_DATA;
 uint64_t idle_count CORE_SPECIFIC_DATA;
 
+/* Time is kept by the TSC, which runs at a constant rate on every core, and
+ * jiffies follow it rather than counting core 0's ticks, so that they keep
+ * moving while cores sleep through their ticks. */
+static uint64_t time_tsc_base;
+static uint64_t time_tsc_hz; /* 0 if the TSC could not be timed */
+/* Whether the core's periodic tick is off while it is idle */
+static long time_tickless CORE_SPECIFIC_DATA;
+
+/* Microseconds since boot. */
+uint64_t time_usec()
+{
+    if (!time_tsc_hz)
+    {
+        return jiffies * MICROSECONDS_PER_APIC_TICK;
+    }
+    uint64_t tsc = rdtsc();
+    uint64_t elapsed = tsc > time_tsc_base ? tsc - time_tsc_base : 0;
+    return (elapsed / time_tsc_hz) * 1000000 +
+           (elapsed % time_tsc_hz) * 1000000 / time_tsc_hz;
+}
+
+/* The first jiffy at least usec from now, so sleeps never end early. */
+static uint64_t time_deadline(uint64_t usec)
+{
+    return (time_usec() + usec + MICROSECONDS_PER_APIC_TICK - 1) /
+           MICROSECONDS_PER_APIC_TICK;
+}
+
+/* Brings jiffies up to the TSC. Any core may, so jiffies only move forward;
+ * the vDSO's copy is written by whichever core moves them. */
+static void time_update_jiffies()
+{
+    if (!time_tsc_hz)
+    {
+        if (curcore.kc_id == 0)
+        {
+            jiffies = CSD(timer_tickcount);
+            vdso_tick(jiffies);
+        }
+        return;
+    }
+
+    uint64_t now = time_usec() / MICROSECONDS_PER_APIC_TICK;
+    uint64_t old = jiffies;
+    while (old < now)
+    {
+        if (__sync_bool_compare_and_swap(&jiffies, old, now))
+        {
+            vdso_tick(now);
+            break;
+        }
+        old = jiffies;
+    }
+}
+
 // (freq / 16) interrupts per millisecond
 static long timer_tick_handler(regs_t *regs)
 {
-    timer_tickcount++;
+    CSD(timer_tickcount)++;
+    profile_sample(regs);
 
 #ifdef __VGABUF__
-    if (timer_tickcount % 128 == 0)
+    if (CSD(timer_tickcount) % 128 == 0)
         screen_flush();
 #endif
 
-    if (curcore.kc_id == 0)
-    {
-        jiffies = timer_tickcount;
-        __timers_fire();
-    }
-
-#ifdef __KPREEMPT__ // if (preemption_enabled()) {
-    (regs->r_cs & 0x3) ? user_preempted_count++ : kernel_preempted_count++;
-    apic_eoi();
-    if (regs->r_cs & 0x3 && curthr->kt_cancelled)
-        kthread_exit((void *)-1);
-    sched_yield();
-    return 1;
+    time_update_jiffies();
+    __timers_fire(); /* each core fires its own timers */
 
+#if defined(__UPREEMPT__) || defined(__KPREEMPT__)
+    sched_tick();
 #endif
-#ifndef __KPREEMPT__ //} else {
-    curthr ? not_preempted_count++ : idle_count++;
-    return 0;
-#endif //}
 
+    /* The switch itself is made on the way out of the interrupt, once the
+     * interrupted code is known to be preemptible (see interrupt_handler()) */
+#ifdef __KPREEMPT__
+    if (!curthr)
+        CSD(idle_count)++;
+    else
+        (regs->r_cs & 0x3) ? CSD(user_preempted_count)++
+                            : CSD(kernel_preempted_count)++;
+#else
+    curthr ? CSD(not_preempted_count)++ : CSD(idle_count)++;
+#endif
     return 0;
 }
 
 void time_init()
 {
-    timer_tickcount = 0;
+    if (curcore.kc_id == 0)
+    {
+        time_tsc_hz = apic_tsc_frequency();
+        time_tsc_base = rdtsc();
+    }
+    CSD(timer_tickcount) = 0;
+    timers_init();
     intr_register(INTR_APICTIMER, timer_tick_handler);
     apic_enable_periodic_timer(TIME_APIC_TICK_FREQUENCY);
 }
 
+/*
+ * Called by an idle core, with interrupts off, just before it halts. Unless
+ * one of its timers is already due, the core's periodic tick is swapped for a
+ * single interrupt at its next timer deadline (or APIC_ONESHOT_MAX_USEC out if
+ * it has none), so an idle core is neither woken every tick nor late for its
+ * timers.
+ */
+void time_idle_enter()
+{
+    if (!time_tsc_hz)
+    {
+        return;
+    }
+
+    uint64_t usec = APIC_ONESHOT_MAX_USEC;
+    uint64_t next = timers_next_expiry();
+    if (next != (uint64_t)-1)
+    {
+        uint64_t now = time_usec();
+        uint64_t deadline = next * MICROSECONDS_PER_APIC_TICK;
+        if (deadline <= now)
+        {
+            return; /* the next tick fires it */
+        }
+        if (deadline - now < usec)
+        {
+            usec = deadline - now;
+        }
+    }
+    apic_enable_oneshot_timer(usec);
+    CSD(time_tickless) = 1;
+}
+
+/*
+ * Called by an idle core, with interrupts off, once it wakes: puts back the
+ * periodic tick and catches jiffies up.
+ */
+void time_idle_exit()
+{
+    if (!CSD(time_tickless))
+    {
+        return;
+    }
+    CSD(time_tickless) = 0;
+    apic_enable_periodic_timer(TIME_APIC_TICK_FREQUENCY);
+    time_update_jiffies();
+}
+
 void time_spin(uint64_t ms)
 {
-    uint64_t ticks_to_wait = ms * TIME_APIC_TICK_FREQUENCY / 16;
-    uint64_t target = timer_tickcount + ticks_to_wait;
-    dbg(DBG_SCHED, "spinning for %lu ms (%lu APIC ticks)\n", ms, ticks_to_wait);
-    while (timer_tickcount < target)
+    uint64_t target = time_usec() + ms * 1000;
+    dbg(DBG_SCHED, "spinning for %lu ms\n", ms);
+    while (time_usec() < target)
         ;
 }
 
+/* Sleeps for at least ms milliseconds, or until curthr is cancelled. Spins
+ * instead before there are threads to sleep. */
 void time_sleep(uint64_t ms)
 {
-    // TODO make curthr runnable and place on runqueue
-    time_spin(ms);
+    if (!curthr)
+    {
+        time_spin(ms);
+        return;
+    }
+    ktqueue_t waitq;
+    sched_queue_init(&waitq);
+    sched_sleep_on_timeout(&waitq, time_deadline(ms * 1000));
 }
 
-inline time_t core_uptime()
-{
-    return (MICROSECONDS_PER_APIC_TICK * timer_tickcount) / 1000;
-}
+inline time_t core_uptime() { return time_usec() / 1000; }
 
 static int mdays[] = {0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334};
 
@@ -129,66 +241,49 @@ static size_t percentage(char *buf, size_t size, uint64_t numerator,
 
 size_t time_stats(char *buf, size_t len)
 {
+    uint64_t ticks = CSD(timer_tickcount);
+    uint64_t idle = CSD(idle_count);
+    uint64_t kernel = CSD(kernel_preempted_count);
+    uint64_t user = CSD(user_preempted_count);
+    uint64_t running = CSD(not_preempted_count);
+
     size_t off = 0;
     off += snprintf(buf + off, len - off, "core uptime:\t");
-    off += human_readable_format(buf + off, len - off, timer_tickcount);
+    off += human_readable_format(buf + off, len - off, ticks);
     off += snprintf(buf + off, len - off, "\nidle time:\t");
-    off += human_readable_format(buf + off, len - off, idle_count);
+    off += human_readable_format(buf + off, len - off, idle);
     off += snprintf(buf + off, len - off, "\t");
-    off += percentage(buf + off, len - off, idle_count, timer_tickcount);
+    off += percentage(buf + off, len - off, idle, ticks);
 
-    KASSERT(not_preempted_count + user_preempted_count +
-                kernel_preempted_count + idle_count - timer_tickcount <=
-            2);
+    KASSERT(running + user + kernel + idle - ticks <= 2);
 
     off += snprintf(buf + off, len - off, "\n\ntotal tick count       = %lu",
-                    timer_tickcount);
+                    ticks);
     off += snprintf(buf + off, len - off, "\nidle count             = %lu",
-                    idle_count);
+                    idle);
     off += snprintf(buf + off, len - off, "\t");
-    off += percentage(buf + off, len - off, idle_count, timer_tickcount);
+    off += percentage(buf + off, len - off, idle, ticks);
     off += snprintf(buf + off, len - off, "\nkernel preempted count = %lu",
-                    kernel_preempted_count);
+                    kernel);
     off += snprintf(buf + off, len - off, "\t");
-    off += percentage(buf + off, len - off, kernel_preempted_count,
-                      timer_tickcount);
+    off += percentage(buf + off, len - off, kernel, ticks);
     off += snprintf(buf + off, len - off, "\nuser preempted count   = %lu",
-                    user_preempted_count);
+                    user);
     off += snprintf(buf + off, len - off, "\t");
-    off +=
-        percentage(buf + off, len - off, user_preempted_count, timer_tickcount);
+    off += percentage(buf + off, len - off, user, ticks);
     off += snprintf(buf + off, len - off, "\nnot preempted count    = %lu",
-                    not_preempted_count);
+                    running);
     off += snprintf(buf + off, len - off, "\t");
-    off +=
-        percentage(buf + off, len - off, not_preempted_count, timer_tickcount);
+    off += percentage(buf + off, len - off, running, ticks);
 
     return off;
 }
 
-static void do_wakeup(uint64_t arg)
-{
-    kthread_t *thr = (kthread_t *)arg;
-
-    if (thr->kt_wchan)
-    {
-        sched_broadcast_on(thr->kt_wchan);
-    }
-}
-
 long do_usleep(useconds_t usec)
 {
     ktqueue_t waitq;
     sched_queue_init(&waitq);
 
-    timer_t timer;
-    timer_init(&timer);
-    timer.function = do_wakeup;
-    timer.data = (uint64_t)curthr;
-    timer.expires = jiffies + (usec / MICROSECONDS_PER_APIC_TICK);
-
-    timer_add(&timer);
-    long ret = sched_cancellable_sleep_on(&waitq);
-    timer_del(&timer);
-    return ret;
-}
\ No newline at end of file
+    long ret = sched_sleep_on_timeout(&waitq, time_deadline(usec));
+    return ret == -ETIMEDOUT ? 0 : ret;
+}
@@ -1,80 +1,217 @@
 #include "util/timer.h"
+#include "globals.h"
+#include "main/apic.h"
+#include "main/interrupt.h"
+#include "proc/sched.h"
 #include "proc/spinlock.h"
+#include "util/debug.h"
 #include "util/time.h"
 
-static timer_t *timer_running = NULL;
-static uint64_t timer_next_expiry = -1;
-static list_t timers_primary = LIST_INITIALIZER(timers_primary);
-static list_t timers_secondary = LIST_INITIALIZER(timers_secondary);
-static int timers_firing = 0;
+/*
+ * Timers are kept on hierarchical timing wheels, one for each core, so that
+ * adding and deleting a timer are O(1) and a tick only looks at the timers
+ * that are due.
+ *
+ * A wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. A timer due within
+ * TIMER_SLOTS jiffies of tw_clock is on level 0, in the slot for its expiry;
+ * one due later is on the first level whose slots are wide enough to hold
+ * it, in the slot covering its expiry. Each time tw_clock wraps around a
+ * level's slots, the next slot of the level above is emptied and its timers
+ * put back, each now landing on a lower level (cascading). A timer further
+ * out than the wheel spans goes in the top level's farthest slot and is
+ * cascaded around until it is in reach.
+ *
+ * A timer goes on the wheel of the core that adds it, and is fired by that
+ * core's tick. Each wheel has a lock, taken with interrupts off, as its tick
+ * runs in the timer interrupt; a timer may be deleted or moved from any
+ * core. Callbacks run in the timer interrupt, without the lock held.
+ */
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 5
+/* The furthest a timer can be put from tw_clock */
+#define TIMER_SPAN ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+typedef struct timer_wheel
+{
+    spinlock_t tw_lock;
+    uint64_t tw_clock;     /* the next jiffy whose timers are to fire */
+    size_t tw_count;       /* timers on the wheel */
+    timer_t *tw_running;   /* whose callback is running, or NULL */
+    list_t tw_slots[TIMER_LEVELS][TIMER_SLOTS];
+} CACHE_LINE_ALIGNED timer_wheel_t;
+
+static timer_wheel_t timer_wheels[MAX_LAPICS];
+
+static long timer_wheel_lock(timer_wheel_t *tw)
+{
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&tw->tw_lock);
+    return enabled;
+}
+
+static void timer_wheel_unlock(timer_wheel_t *tw, long enabled)
+{
+    spinlock_unlock(&tw->tw_lock);
+    if (enabled)
+        intr_enable();
+}
+
+/*
+ * Initializes the current core's wheel.
+ */
+void timers_init()
+{
+    KASSERT(curcore.kc_id >= 0 && curcore.kc_id < MAX_LAPICS);
+    timer_wheel_t *tw = &timer_wheels[curcore.kc_id];
+    spinlock_init(&tw->tw_lock);
+    tw->tw_clock = jiffies;
+    tw->tw_count = 0;
+    tw->tw_running = NULL;
+    for (long level = 0; level < TIMER_LEVELS; level++)
+    {
+        for (long slot = 0; slot < TIMER_SLOTS; slot++)
+        {
+            list_init(&tw->tw_slots[level][slot]);
+        }
+    }
+}
 
 void timer_init(timer_t *timer)
 {
     timer->expires = -1;
     list_link_init(&timer->link);
+    timer->wheel = NULL;
 }
 
 void timer_add(timer_t *timer) { timer_mod(timer, timer->expires); }
 
-int __timer_del(timer_t *timer)
+/* Puts timer, which is on no wheel, on tw, whose lock is held. */
+static void __timer_insert(timer_wheel_t *tw, timer_t *timer)
 {
-    int ret = 0;
-    if (list_link_is_linked(&timer->link))
+    uint64_t expires = timer->expires;
+    if (expires < tw->tw_clock)
     {
-        list_remove(&timer->link);
-        ret = 1;
+        expires = tw->tw_clock; /* overdue: fire with the next tick */
+    }
+    else if (expires - tw->tw_clock > TIMER_SPAN)
+    {
+        expires = tw->tw_clock + TIMER_SPAN; /* cascaded until in reach */
     }
-    return ret;
-}
 
-int timer_del(timer_t *timer)
-{
-    int ret = __timer_del(timer);
+    uint64_t delta = expires - tw->tw_clock;
+    long level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+           delta >= (1UL << (TIMER_BITS * (level + 1))))
+    {
+        level++;
+    }
+    long slot = (expires >> (TIMER_BITS * level)) & TIMER_MASK;
 
-    return ret;
+    list_insert_tail(&tw->tw_slots[level][slot], &timer->link);
+    timer->wheel = tw;
+    tw->tw_count++;
 }
 
-void __timer_add(timer_t *timer)
+/* Takes timer off its wheel if it is on one. Returns 1 if it was. */
+static int __timer_del(timer_t *timer)
 {
-    KASSERT(!list_link_is_linked(&timer->link));
-    list_t *list = timers_firing ? &timers_secondary : &timers_primary;
-    list_insert_head(list, &timer->link);
+    while (1)
+    {
+        timer_wheel_t *tw = timer->wheel;
+        if (!tw)
+        {
+            return 0;
+        }
+        long enabled = timer_wheel_lock(tw);
+        if (timer->wheel != tw)
+        {
+            /* fired or moved since we looked */
+            timer_wheel_unlock(tw, enabled);
+            continue;
+        }
+        list_remove(&timer->link);
+        timer->wheel = NULL;
+        tw->tw_count--;
+        timer_wheel_unlock(tw, enabled);
+        return 1;
+    }
 }
 
-int timer_mod(timer_t *timer, int expires)
+/* Waits for timer's callback to finish, if another core is running it. */
+static void __timer_wait(timer_t *timer)
 {
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (id == curcore.kc_id)
+        {
+            continue; /* not while we are running */
+        }
+        while (timer_wheels[id].tw_running == timer)
+        {
+            __asm__ volatile("pause" ::: "memory");
+        }
+    }
+}
 
-    timer->expires = expires;
+/*
+ * Takes timer off its wheel. Returns 1 if it was pending. Once this returns
+ * its callback is not running on another core either, so a timer on the
+ * stack may go out of scope.
+ */
+int timer_del(timer_t *timer)
+{
     int ret = __timer_del(timer);
-    __timer_add(timer);
-    timer_next_expiry = MIN(timer_next_expiry, timer->expires);
-
+    __timer_wait(timer);
     return ret;
 }
 
-int timer_pending(timer_t *timer)
+/*
+ * (Re)starts timer to fire once jiffies reaches expires, on the current
+ * core's wheel. Returns 1 if it was pending.
+ */
+int timer_mod(timer_t *timer, uint64_t expires)
 {
-    int ret = list_link_is_linked(&timer->link);
+    int ret = __timer_del(timer);
+
+    timer_wheel_t *tw = &timer_wheels[curcore.kc_id];
+    long enabled = timer_wheel_lock(tw);
+    timer->expires = expires;
+    __timer_insert(tw, timer);
+    timer_wheel_unlock(tw, enabled);
+
     return ret;
 }
 
-int timer_del_sync(timer_t *timer)
+int timer_pending(timer_t *timer) { return timer->wheel != NULL; }
+
+int timer_del_sync(timer_t *timer) { return timer_del(timer); }
+
+/* Puts the timers in slot of level back on tw, whose lock is held. They are
+ * taken off first, as one may land in the same slot again. */
+static void __timer_cascade(timer_wheel_t *tw, long level, long slot)
 {
-    /* Not great performance wise... */
-    while (timer_running == timer)
+    list_t moving = LIST_INITIALIZER(moving);
+    list_iterate(&tw->tw_slots[level][slot], timer, timer_t, link)
     {
-        sched_yield();
+        list_remove(&timer->link);
+        list_insert_tail(&moving, &timer->link);
+    }
+    list_iterate(&moving, timer, timer_t, link)
+    {
+        list_remove(&timer->link);
+        tw->tw_count--;
+        __timer_insert(tw, timer);
     }
-
-    int ret = __timer_del(timer);
-
-    return ret;
 }
 
-/* Note: using a linked-list rather than some priority is terribly inefficient
- * Also this implementation is just bad. Sorry.
+/*
+ * Fires the timers on the current core's wheel that are due, advancing its
+ * clock a jiffy at a time up to jiffies.
  */
-int ready = 0;
 void __timers_fire()
 {
     if (curthr && !preemption_enabled())
@@ -82,40 +219,84 @@ void __timers_fire()
         return;
     }
 
-    timers_firing = 1;
-
-    //dbg(DBG_PRINT, "next expiry: %d\n", timer_next_expiry);
-    if (jiffies < timer_next_expiry)
+    timer_wheel_t *tw = &timer_wheels[curcore.kc_id];
+    long enabled = timer_wheel_lock(tw);
+    while (tw->tw_clock <= jiffies)
     {
-        timers_firing = 0;
-        return;
-    }
+        if (!tw->tw_count)
+        {
+            /* nothing to cascade or fire on the way */
+            tw->tw_clock = jiffies + 1;
+            break;
+        }
 
-    uint64_t min_expiry = 0;
+        /* Entering a new slot of level 0 at its first slot enters a new
+         * slot of level 1, whose timers are spread out below; and so on */
+        long slot = tw->tw_clock & TIMER_MASK;
+        for (long level = 1; !slot && level < TIMER_LEVELS; level++)
+        {
+            long above = (tw->tw_clock >> (TIMER_BITS * level)) & TIMER_MASK;
+            __timer_cascade(tw, level, above);
+            if (above)
+            {
+                break;
+            }
+        }
+        tw->tw_clock++;
 
-    list_iterate(&timers_primary, timer, timer_t, link)
-    {
-        if (jiffies >= timer->expires)
+        list_t *list = &tw->tw_slots[0][slot];
+        while (!list_empty(list))
         {
+            timer_t *timer = list_head(list, timer_t, link);
             list_remove(&timer->link);
-            timer_running = timer;
+            timer->wheel = NULL;
+            tw->tw_count--;
+            tw->tw_running = timer;
+            timer_wheel_unlock(tw, 0);
             timer->function(timer->data);
-            timer_running = NULL;
-        }
-        else
-        {
-            min_expiry = MIN(min_expiry, timer->expires);
+            timer_wheel_lock(tw);
+            tw->tw_running = NULL;
         }
     }
+    timer_wheel_unlock(tw, enabled);
+}
 
-    /* migrate from the backup list to the primary list */
-    list_iterate(&timers_secondary, timer, timer_t, link)
+/*
+ * Returns the jiffy by which the current core's wheel next needs a tick: the
+ * expiry of its soonest timer on level 0, or the next cascade if that could
+ * bring one down sooner. Returns -1 if the wheel is empty.
+ */
+uint64_t timers_next_expiry()
+{
+    timer_wheel_t *tw = &timer_wheels[curcore.kc_id];
+    long enabled = timer_wheel_lock(tw);
+    uint64_t next = (uint64_t)-1;
+    if (tw->tw_count)
     {
-        min_expiry = MIN(min_expiry, timer->expires);
-        list_remove(&timer->link);
-        list_insert_head(&timers_primary, &timer->link);
-    }
+        for (long k = 0; k < TIMER_SLOTS; k++)
+        {
+            uint64_t when = tw->tw_clock + k;
+            if (!list_empty(&tw->tw_slots[0][when & TIMER_MASK]))
+            {
+                next = when;
+                break;
+            }
+        }
 
-    timer_next_expiry = min_expiry;
-    timers_firing = 0;
+        /* the next jiffy that enters a level 0 slot at its first slot */
+        uint64_t cascade = (tw->tw_clock + TIMER_MASK) & ~(uint64_t)TIMER_MASK;
+        for (long level = 1; next > cascade && level < TIMER_LEVELS; level++)
+        {
+            for (long slot = 0; slot < TIMER_SLOTS; slot++)
+            {
+                if (!list_empty(&tw->tw_slots[level][slot]))
+                {
+                    next = cascade;
+                    break;
+                }
+            }
+        }
+    }
+    timer_wheel_unlock(tw, enabled);
+    return next;
 }
@@ -0,0 +1,133 @@
+#include "util/trace.h"
+#include "errno.h"
+#include "globals.h"
+#include "main/apic.h"
+#include "main/cpuid.h"
+#include "mm/page.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+typedef struct trace_rec
+{
+    uint64_t tr_tsc;
+    uint32_t tr_event;
+    pid_t tr_pid;
+    uint64_t tr_args[2];
+} trace_rec_t;
+
+#define TRACE_RING_PAGES \
+    ((TRACE_RECORDS * sizeof(trace_rec_t) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+/* Each core's ring, allocated the first time tracing is started, and the
+ * records written to it since: the newest TRACE_RECORDS are in the ring. The
+ * count is bumped atomically, so that an interrupt's record, or one from a
+ * thread that moved to another core partway through, gets a slot of its own;
+ * it is only ever bumped on one core otherwise, and so is not contended,
+ * as long as each core's count has a cache line to itself. */
+typedef struct trace_core
+{
+    trace_rec_t *tc_ring;
+    uint64_t tc_count;
+} CACHE_LINE_ALIGNED trace_core_t;
+
+static trace_core_t trace_cores[MAX_LAPICS];
+
+volatile uint64_t trace_mask;
+
+static const char *trace_names[TRACE_EVENT_COUNT] = {
+    [TRACE_SCHED_SWITCH] = "sched_switch",
+    [TRACE_SCHED_STEAL] = "sched_steal",
+    [TRACE_SCHED_PREEMPT] = "sched_preempt",
+    [TRACE_DISK_ISSUE] = "disk_issue",
+    [TRACE_DISK_COMPLETE] = "disk_complete",
+    [TRACE_PFRAME_FILL] = "pframe_fill",
+    [TRACE_PFRAME_FLUSH] = "pframe_flush",
+    [TRACE_SYSCALL_ENTER] = "syscall_enter",
+    [TRACE_SYSCALL_EXIT] = "syscall_exit",
+};
+
+void trace_record(trace_event_t event, uint64_t a0, uint64_t a1)
+{
+    long id = curcore.kc_id;
+    trace_rec_t *ring = trace_cores[id].tc_ring;
+    if (!ring)
+    {
+        return;
+    }
+    uint64_t n = __sync_fetch_and_add(&trace_cores[id].tc_count, 1);
+    trace_rec_t *tr = &ring[n % TRACE_RECORDS];
+    tr->tr_tsc = rdtsc();
+    tr->tr_event = event;
+    tr->tr_pid = curproc ? curproc->p_pid : -1;
+    tr->tr_args[0] = a0;
+    tr->tr_args[1] = a1;
+}
+
+/* The event with the given name, or -EINVAL */
+long trace_event_lookup(const char *name)
+{
+    for (long ev = 0; ev < TRACE_EVENT_COUNT; ev++)
+    {
+        if (!strcmp(name, trace_names[ev]))
+        {
+            return ev;
+        }
+    }
+    return -EINVAL;
+}
+
+/* Starts tracing the events in mask (bit i for event i) on every core that
+ * is up, dropping any earlier records. */
+long trace_start(uint64_t mask)
+{
+    trace_mask = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        if (csd_vaddr_table[id] && !trace_cores[id].tc_ring &&
+            !(trace_cores[id].tc_ring = page_alloc_n(TRACE_RING_PAGES)))
+        {
+            return -ENOMEM;
+        }
+        trace_cores[id].tc_count = 0;
+    }
+    __sync_synchronize();
+    trace_mask = mask & TRACE_ALL;
+    return 0;
+}
+
+/* Stops tracing; a record already being written is finished. */
+void trace_stop() { trace_mask = 0; }
+
+/*
+ * Writes each core's records to the debug log, oldest first, stopping
+ * tracing if it is on. Returns the number written.
+ */
+size_t trace_dump()
+{
+    trace_stop();
+    dbg_print("TRACE hz=%lu\n", apic_tsc_frequency());
+    size_t total = 0;
+    for (long id = 0; id < MAX_LAPICS; id++)
+    {
+        trace_rec_t *ring = trace_cores[id].tc_ring;
+        if (!ring)
+        {
+            continue;
+        }
+        uint64_t count = trace_cores[id].tc_count;
+        uint64_t first = count > TRACE_RECORDS ? count - TRACE_RECORDS : 0;
+        for (uint64_t n = first; n < count; n++)
+        {
+            trace_rec_t *tr = &ring[n % TRACE_RECORDS];
+            if (tr->tr_event >= TRACE_EVENT_COUNT)
+            {
+                continue; /* still being written when tracing stopped */
+            }
+            dbg_print("TRACE core=%ld tsc=%lu ev=%s pid=%d a0=0x%lx a1=0x%lx\n",
+                      id, tr->tr_tsc, trace_names[tr->tr_event], tr->tr_pid,
+                      tr->tr_args[0], tr->tr_args[1]);
+        }
+        total += count - first;
+    }
+    return total;
+}
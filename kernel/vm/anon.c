@@ -1,7 +1,10 @@
+#include "globals.h"
 #include "mm/mobj.h"
 #include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
+#include "vm/ksm.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -11,23 +14,32 @@ int anon_count = 0;
 
 static slab_allocator_t *anon_allocator;
 
+static long anon_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
+                            pframe_t **pfp);
+
 static long anon_fill_pframe(mobj_t *o, pframe_t *pf);
 
 static long anon_flush_pframe(mobj_t *o, pframe_t *pf);
 
+static long anon_page_is_zero(mobj_t *o, uint64_t pagenum);
+
 static void anon_destructor(mobj_t *o);
 
-static mobj_ops_t anon_mobj_ops = {.get_pframe = NULL,
+static mobj_ops_t anon_mobj_ops = {.get_pframe = anon_get_pframe,
                                    .fill_pframe = anon_fill_pframe,
                                    .flush_pframe = anon_flush_pframe,
+                                   .page_is_zero = anon_page_is_zero,
                                    .destructor = anon_destructor};
 
+static void anon_ctor(void *obj) { mobj_ctor(obj); }
+
 /*
  * Initialize anon_allocator using the slab allocator.
  */
 void anon_init()
 {
-    anon_allocator = slab_allocator_create("anon", sizeof(mobj_t));
+    anon_allocator =
+        slab_allocator_create_ctor("anon", sizeof(mobj_t), anon_ctor, NULL);
     KASSERT(anon_allocator);
 }
 
@@ -47,7 +59,7 @@ mobj_t *anon_create()
     }
     
     // Initialize the mobj with anonymous operations
-    mobj_init(obj, MOBJ_ANON, &anon_mobj_ops);
+    mobj_init_constructed(obj, MOBJ_ANON, &anon_mobj_ops);
     
     // Lock the mobj before returning
     mobj_lock(obj);
@@ -59,12 +71,50 @@ mobj_t *anon_create()
  * This function is not complicated -- think about what the pframe should look
  * like for an anonymous object 
  */
+/*
+ * Anonymous pages that have no pframe have never been touched, and so are
+ * all zeros.
+ */
+static long anon_page_is_zero(mobj_t *o, uint64_t pagenum)
+{
+    return !radix_tree_lookup(&o->mo_index, pagenum);
+}
+
+/*
+ * Reads of a page merged with identical ones are given the shared copy
+ * (see vm/ksm.c); everything else is as usual.
+ */
+static long anon_get_pframe(mobj_t *o, uint64_t pagenum, long forwrite,
+                            pframe_t **pfp)
+{
+    pframe_t *pf = radix_tree_lookup(&o->mo_index, pagenum);
+    if (!forwrite && pf && pf->pf_ksm)
+    {
+        kmutex_lock(&pf->pf_mutex);
+        long ret = ksm_get_pframe(pf, pfp);
+        pframe_release(&pf);
+        return ret;
+    }
+    return mobj_default_get_pframe(o, pagenum, forwrite, pfp);
+}
+
 static long anon_fill_pframe(mobj_t *o, pframe_t *pf)
 {
     KASSERT(o && pf);
+
+    // A page that has been touched is only ever missing if it is in swap,
+    // or merged with identical ones
+    if (pf->pf_swap) {
+        return swap_in_pframe(pf);
+    }
+    if (pf->pf_ksm) {
+        return ksm_fill_pframe(pf);
+    }
     
-    // For anonymous objects, we fill the pframe with zeros
-    memset(pf->pf_addr, 0, PAGE_SIZE);
+    // Otherwise it reads as zeros, which mobj_default_get_pframe got it
+    // from page_alloc_zeroed already
+    if (curproc)
+        curproc->p_zeroflt++;
     
     return 0;
 }
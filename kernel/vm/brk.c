@@ -4,6 +4,7 @@
 #include "util/debug.h"
 
 #include "mm/mman.h"
+#include "vm/anon.h"
 
 /*
  * This function implements the brk(2) system call.
@@ -90,76 +91,17 @@ long do_brk(void *addr, void **ret)
     uintptr_t current_page = ADDR_TO_PN(PAGE_ALIGN_UP(current_brk));
     uintptr_t new_page = ADDR_TO_PN(PAGE_ALIGN_UP(new_brk));
     
-    // Find existing heap vmarea
-    vmarea_t *heap_vma = NULL;
-    vmarea_t *vma;
-    list_iterate(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-        if (vma->vma_start == start_page) {
-            heap_vma = vma;
-            break;
-        }
-    }
-    
     if (new_brk == current_brk) {
         // No change needed
         *ret = (void *)new_brk;
         return 0;
     }
     
-    if (new_brk > current_brk) {
-        // Expanding heap
-        uintptr_t expand_start = PAGE_ALIGN_UP(current_brk);
-        uintptr_t expand_end = PAGE_ALIGN_UP(new_brk);
-        size_t expand_pages = ADDR_TO_PN(expand_end - expand_start);
-        
-        if (expand_pages > 0) {
-            // Check if the expansion range is empty
-            if (vmmap_is_range_empty(curproc->p_vmmap, ADDR_TO_PN(expand_start), expand_pages) != 0) {
-                return -ENOMEM;
-            }
-            
-            if (heap_vma) {
-                // Extend existing heap vmarea
-                heap_vma->vma_end = new_page;
-            } else {
-                // Create new heap vmarea
-                vmarea_t *new_vma = vmarea_alloc();
-                if (!new_vma) {
-                    return -ENOMEM;
-                }
-                
-                new_vma->vma_start = start_page;
-                new_vma->vma_end = new_page;
-                new_vma->vma_off = 0;
-                new_vma->vma_prot = PROT_READ | PROT_WRITE;
-                new_vma->vma_flags = MAP_PRIVATE | MAP_ANON;
-                new_vma->vma_vmmap = curproc->p_vmmap;
-                new_vma->vma_obj = anon_create();
-                
-                if (!new_vma->vma_obj) {
-                    vmarea_free(new_vma);
-                    return -ENOMEM;
-                }
-                
-                vmmap_insert(curproc->p_vmmap, new_vma);
-            }
-        }
-        // If expand_pages is 0, just update the break without creating vmarea
-    } else {
-        // Shrinking heap
-        if (heap_vma) {
-            uintptr_t shrink_start = PAGE_ALIGN_UP(new_brk);
-            uintptr_t shrink_end = PAGE_ALIGN_UP(current_brk);
-            size_t shrink_pages = ADDR_TO_PN(shrink_end - shrink_start);
-            
-            if (shrink_pages > 0) {
-                // Remove the shrunk portion
-                vmmap_remove(curproc->p_vmmap, ADDR_TO_PN(shrink_start), shrink_pages);
-                
-                // Update heap vmarea end
-                heap_vma->vma_end = new_page;
-            }
-        }
+    // The heap area is only touched when the break crosses a page; it is
+    // kept reserved past the break, so that is rarely (see vmmap_brk)
+    long err = vmmap_brk(curproc->p_vmmap, start_page, current_page, new_page);
+    if (err) {
+        return err;
     }
     
     // Update the process break
@@ -0,0 +1,748 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mman.h"
+#include "mm/mobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/swap.h"
+#include "mm/tlb.h"
+#include "proc/proc.h"
+#include "vm/anon.h"
+#include "vm/ksm.h"
+#include "vm/vmmap.h"
+
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/rbtree.h"
+#include "util/string.h"
+
+#ifdef __KSM__
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "util/time.h"
+#include "util/timer.h"
+#endif
+
+/*
+ * Same-page merging: the ksmd daemon (KSM=1) looks for private anonymous
+ * and shadow pages with identical contents and keeps one copy of them,
+ * read-only, for all of them. Processes running the same program end up
+ * with many such pages (zeroed heaps, data the loader relocated the same
+ * way).
+ *
+ * The shared copies are the pages of ksm_mobj, an anonymous object of its
+ * own, one per ksm_page_t. A merged pframe stays in its object much like a
+ * paged out one: pf_addr is NULL, and pf_ksm points to the ksm_page_t with
+ * its contents. Reads of the page (see anon_get_pframe and
+ * shadow_get_pframe) are given the pframe of the shared copy itself, which
+ * faults map read-only. The first write fills the pframe again, through
+ * ksm_fill_pframe, with a copy of its own; so sharing is broken on write by
+ * the same path copy-on-write takes.
+ *
+ * The same shared pages carry the pages vmsplice(2) gifts to a pipe (see
+ * fs/pipe.c): ksm_gift_page moves the page of the writer's pframe into
+ * ksm_mobj, without copying it, and leaves the pframe merged into it; the
+ * pipe holds a reference of its own, which ksm_map_page hands on to a
+ * pframe of the reader's. Gifted pages are never in ksm_tree, so nothing
+ * else is merged into them.
+ *
+ * pf_ksm is set and cleared with both the pframe and its object locked, so
+ * either keeps it from changing. ksm_tree, ksm_dead and every ksm_page_t
+ * are protected by ksm_mobj's mutex, which comes after the objects of
+ * merged pages in the lock order.
+ */
+
+/* What the trees below are sorted by: the hash of the page contents */
+typedef struct ksm_node
+{
+    rb_node_t kn_node;
+    uint64_t kn_hash; /* 0 for a gifted page, which is in no tree */
+} ksm_node_t;
+
+typedef struct ksm_page
+{
+    ksm_node_t kp_node;       /* in ksm_tree, while kp_refs > 0 */
+    size_t kp_refs;           /* pframes merged into this page, and pipes */
+    uint64_t kp_pagenum;      /* the page of ksm_mobj holding the contents */
+    list_link_t kp_dead_link; /* on ksm_dead, once kp_refs drops to 0 */
+} ksm_page_t;
+
+static mobj_t *ksm_mobj;
+static rbtree_t ksm_tree;
+static uint64_t ksm_next_pagenum;
+
+/* Shared pages no pframe refers to any more, still mapped somewhere */
+static list_t ksm_dead = LIST_INITIALIZER(ksm_dead);
+
+static size_t ksm_npages;  /* shared pages, dead ones included */
+static size_t ksm_nmerged; /* pframes merged into them */
+
+/* Finds the node for hash in tree, or returns NULL and, if parentp is set,
+ * where one would be inserted (see rbtree.h). */
+static ksm_node_t *_ksm_tree_find(rbtree_t *tree, uint64_t hash,
+                                  rb_node_t **parentp, rb_node_t ***linkp)
+{
+    rb_node_t *parent = NULL, **link = &tree->rbt_root;
+    while (*link)
+    {
+        parent = *link;
+        ksm_node_t *node = rb_entry(parent, ksm_node_t, kn_node);
+        if (hash == node->kn_hash)
+        {
+            return node;
+        }
+        link = hash < node->kn_hash ? &parent->rb_left : &parent->rb_right;
+    }
+    if (parentp)
+    {
+        *parentp = parent;
+        *linkp = link;
+    }
+    return NULL;
+}
+
+/* FNV-1a over the words of a page; never 0, which pf_ksm_hash uses for
+ * "not hashed yet" */
+static uint64_t _ksm_hash(const void *page)
+{
+    const uint64_t *words = page;
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0x100000001b3UL;
+    }
+    return hash ? hash : 1;
+}
+
+/*
+ * Frees the pages on ksm_dead that are no longer mapped or pinned. Those
+ * that are stay for the next call. ksm_mobj must be locked.
+ */
+static void _ksm_reap()
+{
+    list_iterate(&ksm_dead, kp, ksm_page_t, kp_dead_link)
+    {
+        pframe_t *pf = radix_tree_lookup(&ksm_mobj->mo_index, kp->kp_pagenum);
+        if (pf)
+        {
+            if (!kmutex_trylock(&pf->pf_mutex))
+            {
+                continue;
+            }
+            long pinned = pframe_pinned(pf);
+            pframe_release(&pf);
+            if (pinned)
+            {
+                continue;
+            }
+            mobj_delete_pframe(ksm_mobj, kp->kp_pagenum);
+        }
+        list_remove(&kp->kp_dead_link);
+        ksm_npages--;
+        kfree(kp);
+    }
+}
+
+/* Drops a reference on kp. ksm_mobj must be locked. */
+static void _ksm_page_unref(ksm_page_t *kp)
+{
+    KASSERT(kmutex_owns_mutex(&ksm_mobj->mo_mutex));
+    KASSERT(kp->kp_refs);
+    if (--kp->kp_refs)
+    {
+        return;
+    }
+    if (kp->kp_node.kn_hash)
+    {
+        rbtree_remove(&ksm_tree, &kp->kp_node.kn_node);
+    }
+    list_insert_tail(&ksm_dead, &kp->kp_dead_link);
+    _ksm_reap();
+}
+
+/* Drops a reference on kp, for a pframe that no longer shares it.
+ * ksm_mobj must be locked. */
+static void _ksm_page_put(ksm_page_t *kp)
+{
+    ksm_nmerged--;
+    _ksm_page_unref(kp);
+}
+
+/*
+ * Takes pf, a pframe of o, out of the address spaces that map it, to be
+ * merged. Both are locked. Returns 1 if nothing maps or pins pf any more,
+ * and 0 if some address space was busy or the page is in use by the kernel.
+ */
+static long _ksm_unmap(mobj_t *o, pframe_t *pf)
+{
+    if (pf->pf_mapcount)
+    {
+        vmmap_unmap_pframe(o, pf->pf_pagenum,
+                           pt_virt_to_phys((uintptr_t)pf->pf_addr), 1);
+    }
+    return !pframe_pinned(pf);
+}
+
+/*
+ * Gets the pframe holding the shared contents of pf, which is merged, for
+ * reading. pf or its object must be locked. The pframe returned is locked,
+ * as get_pframe returns them. Returns 0, or the error reading the shared
+ * page back in from swap.
+ */
+long ksm_get_pframe(pframe_t *pf, pframe_t **pfp)
+{
+    KASSERT(pf->pf_ksm);
+    mobj_lock(ksm_mobj);
+    long ret = mobj_get_pframe(ksm_mobj, pf->pf_ksm->kp_pagenum, 0, pfp);
+    mobj_unlock(ksm_mobj);
+    return ret;
+}
+
+/*
+ * For the fill_pframe of anonymous and shadow objects, when they find
+ * pf_ksm set: copies the shared contents into the page pf_addr now points
+ * to, which unmerges pf. pf and its object are locked. Returns 0, or the
+ * error getting the shared page, in which case pf stays merged.
+ */
+long ksm_fill_pframe(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    KASSERT(pf->pf_ksm && pf->pf_addr);
+    pframe_t *shared;
+    mobj_lock(ksm_mobj);
+    long ret = mobj_get_pframe(ksm_mobj, pf->pf_ksm->kp_pagenum, 0, &shared);
+    if (!ret)
+    {
+        memcpy(pf->pf_addr, shared->pf_addr, PAGE_SIZE);
+        pframe_release(&shared);
+        _ksm_page_put(pf->pf_ksm);
+        pf->pf_ksm = NULL;
+    }
+    mobj_unlock(ksm_mobj);
+    if (!ret && swap_enabled())
+    {
+        pframe_lru_add(pf);
+    }
+    return ret;
+}
+
+/*
+ * Lets go of the shared page of pf, which is locked, if it is merged, for
+ * a pframe that is going away.
+ */
+void ksm_discard_pframe(pframe_t *pf)
+{
+    KASSERT(kmutex_owns_mutex(&pf->pf_mutex));
+    if (pf->pf_ksm)
+    {
+        mobj_lock(ksm_mobj);
+        _ksm_page_put(pf->pf_ksm);
+        mobj_unlock(ksm_mobj);
+        pf->pf_ksm = NULL;
+    }
+}
+
+/*
+ * The object of the private anonymous or shadow area of map at vaddr, with
+ * the page there set in *pagenump, or NULL if vaddr is not in such an area
+ * or the area lacks prot. map must be locked.
+ */
+static mobj_t *_ksm_area_obj(vmmap_t *map, uintptr_t vaddr, int prot,
+                             uint64_t *pagenump)
+{
+    vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(vaddr));
+    if (!vma || !(vma->vma_flags & MAP_PRIVATE) ||
+        (vma->vma_flags & MAP_HUGE) || (vma->vma_prot & prot) != prot ||
+        !MOBJ_SWAPPABLE(vma->vma_obj))
+    {
+        return NULL;
+    }
+    *pagenump = ADDR_TO_PN(vaddr) - vma->vma_start + vma->vma_off;
+    return vma->vma_obj;
+}
+
+/*
+ * Gifts the page of map at vaddr, which is page-aligned: its contents go
+ * into a new shared page, without being copied, and the pframe they were in
+ * is merged into it, so the next write to the page takes a copy of its
+ * own. *kpp is set to the shared page, with a reference for the caller. A
+ * page that is merged already is shared as it is.
+ *
+ * Returns 0, or:
+ *  - EINVAL: vaddr is not in a private anonymous or readable private
+ *    mapping
+ *  - EBUSY: some other address space mapping the page was busy, or the
+ *    kernel is using the page
+ *  - ENOMEM: out of memory
+ *  - the error reading the page in
+ */
+long ksm_gift_page(vmmap_t *map, uintptr_t vaddr, ksm_page_t **kpp)
+{
+    KASSERT(PAGE_ALIGNED(vaddr));
+    uint64_t pagenum;
+    long ret = 0;
+    krwlock_read_lock(&map->vmm_lock);
+    mobj_t *o = _ksm_area_obj(map, vaddr, PROT_READ, &pagenum);
+    if (!o)
+    {
+        krwlock_read_unlock(&map->vmm_lock);
+        return -EINVAL;
+    }
+    mobj_lock(o);
+    pframe_t *pf;
+    mobj_find_pframe(o, pagenum, &pf);
+    if (!pf || !pf->pf_ksm)
+    {
+        // Get the page a copy of its own in o, if it does not have one
+        if (pf)
+        {
+            pframe_release(&pf);
+        }
+        ret = mobj_get_pframe(o, pagenum, 1, &pf);
+    }
+    if (ret)
+    {
+        mobj_unlock(o);
+        krwlock_read_unlock(&map->vmm_lock);
+        return ret;
+    }
+
+    if (pf->pf_ksm)
+    {
+        mobj_lock(ksm_mobj);
+        pf->pf_ksm->kp_refs++;
+        *kpp = pf->pf_ksm;
+        mobj_unlock(ksm_mobj);
+        goto out;
+    }
+    // vaddr may still map the page of an object below o, or the zero page
+    pt_unmap(map->vmm_proc->p_pml4, vaddr);
+    tlb_shootdown(map->vmm_proc->p_pml4, vaddr, 1);
+    ksm_page_t *kp = kmalloc(sizeof(ksm_page_t));
+    if (!kp || !_ksm_unmap(o, pf))
+    {
+        ret = kp ? -EBUSY : -ENOMEM;
+        goto out;
+    }
+    mobj_lock(ksm_mobj);
+    pframe_t *shared;
+    mobj_create_pframe(ksm_mobj, ksm_next_pagenum, 0, &shared);
+    if (!shared)
+    {
+        mobj_unlock(ksm_mobj);
+        ret = -ENOMEM;
+        goto out;
+    }
+    shared->pf_addr = pf->pf_addr;
+    pframe_release(&shared);
+    kp->kp_node.kn_hash = 0;
+    kp->kp_refs = 1;
+    kp->kp_pagenum = ksm_next_pagenum++;
+    list_link_init(&kp->kp_dead_link);
+    ksm_npages++;
+
+    pframe_clear_dirty(pf);
+    pframe_lru_remove(pf);
+    pf->pf_addr = NULL;
+    pf->pf_ksm = kp;
+    pf->pf_ksm_hash = 0;
+    kp->kp_refs++;
+    ksm_nmerged++;
+    mobj_unlock(ksm_mobj);
+    *kpp = kp;
+    kp = NULL;
+
+out:
+    if (kp)
+    {
+        kfree(kp);
+    }
+    pframe_release(&pf);
+    mobj_unlock(o);
+    krwlock_read_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Makes the page of map at vaddr, which is page-aligned, share kp, whose
+ * contents it then reads as; the caller's reference on kp passes to the
+ * page. What the page held before is dropped, and the next write to it
+ * takes a copy of its own.
+ *
+ * Returns 0, or, with the caller keeping its reference:
+ *  - EINVAL: vaddr is not in a writable private anonymous mapping
+ *  - EBUSY: some other address space mapping the page was busy, or the
+ *    kernel is using the page
+ *  - ENOMEM: out of memory
+ */
+long ksm_map_page(vmmap_t *map, uintptr_t vaddr, ksm_page_t *kp)
+{
+    KASSERT(PAGE_ALIGNED(vaddr));
+    uint64_t pagenum;
+    krwlock_read_lock(&map->vmm_lock);
+    mobj_t *o = _ksm_area_obj(map, vaddr, PROT_WRITE, &pagenum);
+    if (!o)
+    {
+        krwlock_read_unlock(&map->vmm_lock);
+        return -EINVAL;
+    }
+    mobj_lock(o);
+    pframe_t *pf;
+    mobj_find_pframe(o, pagenum, &pf);
+    if (pf && pf->pf_addr)
+    {
+        if (!_ksm_unmap(o, pf))
+        {
+            pframe_release(&pf);
+            mobj_unlock(o);
+            krwlock_read_unlock(&map->vmm_lock);
+            return -EBUSY;
+        }
+        pframe_clear_dirty(pf);
+        page_free(pf->pf_addr);
+        pf->pf_addr = NULL;
+    }
+    else if (!pf)
+    {
+        mobj_create_pframe(o, pagenum, 0, &pf);
+        if (!pf)
+        {
+            mobj_unlock(o);
+            krwlock_read_unlock(&map->vmm_lock);
+            return -ENOMEM;
+        }
+    }
+    pframe_lru_remove(pf);
+    swap_discard_pframe(pf);
+    ksm_discard_pframe(pf);
+    // vaddr may still map the page of an object below o, or the zero page
+    pt_unmap(map->vmm_proc->p_pml4, vaddr);
+    tlb_shootdown(map->vmm_proc->p_pml4, vaddr, 1);
+
+    mobj_lock(ksm_mobj);
+    pf->pf_ksm = kp;
+    pf->pf_ksm_hash = 0;
+    ksm_nmerged++;
+    mobj_unlock(ksm_mobj);
+    pframe_release(&pf);
+    mobj_unlock(o);
+    krwlock_read_unlock(&map->vmm_lock);
+    return 0;
+}
+
+/*
+ * Copies n bytes at off into kp out to buf, a kernel buffer. Returns 0, or
+ * the error reading the shared page back in from swap.
+ */
+long ksm_page_read(ksm_page_t *kp, size_t off, void *buf, size_t n)
+{
+    KASSERT(off + n <= PAGE_SIZE);
+    pframe_t *pf;
+    mobj_lock(ksm_mobj);
+    long ret = mobj_get_pframe(ksm_mobj, kp->kp_pagenum, 0, &pf);
+    if (!ret)
+    {
+        memcpy(buf, (char *)pf->pf_addr + off, n);
+        pframe_release(&pf);
+    }
+    mobj_unlock(ksm_mobj);
+    return ret;
+}
+
+/* Drops a reference on kp taken by ksm_gift_page. */
+void ksm_page_release(ksm_page_t *kp)
+{
+    mobj_lock(ksm_mobj);
+    _ksm_page_unref(kp);
+    mobj_unlock(ksm_mobj);
+}
+
+/*
+ * Prints how many shared pages there are and how many pages were merged
+ * into them. Follows the proc_info convention: arg must be NULL, and the
+ * number of bytes of buf left unused is returned.
+ */
+size_t ksm_info(const void *arg, char *buf, size_t osize)
+{
+    size_t size = osize;
+    KASSERT(NULL == arg);
+    KASSERT(NULL != buf);
+
+#ifdef __KSM__
+    iprintf(&buf, &size, "\nKSM: %lu shared pages, %lu pages merged into them\n",
+            ksm_npages, ksm_nmerged);
+#else
+    // The only shared pages are those gifted to pipes
+    iprintf(&buf, &size, "\nKSM: off, %lu gifted pages shared by %lu pages\n",
+            ksm_npages, ksm_nmerged);
+#endif
+    return size;
+}
+
+/* Makes the object for the shared pages. */
+void ksm_init()
+{
+    ksm_mobj = anon_create();
+    KASSERT(ksm_mobj && "failed to create the ksm object");
+    mobj_unlock(ksm_mobj);
+    rbtree_init(&ksm_tree, NULL);
+}
+
+#ifdef __KSM__
+/*
+ * The ksmd daemon wakes every KSM_INTERVAL_SECS and hashes the resident
+ * pages of the private anonymous and shadow areas of every process. A page
+ * whose hash has not changed since the last sweep is merged into the
+ * shared page with the same contents, if there is one. Otherwise it is
+ * remembered as a candidate for the rest of the sweep; the first page found
+ * to match it gets a shared page made for the two of them.
+ *
+ * Like shadowd, ksmd never waits for an address space or an object: busy
+ * ones are left for the next sweep.
+ */
+
+/* jiffies are roughly milliseconds, see util/time.c */
+#define KSM_INTERVAL (KSM_INTERVAL_SECS * 1000UL)
+
+/* A page seen this sweep that nothing matched yet, with a reference on its
+ * object */
+typedef struct ksm_cand
+{
+    ksm_node_t kc_node;
+    mobj_t *kc_obj;
+    uint64_t kc_pagenum;
+} ksm_cand_t;
+
+/* The candidates, by hash. Only ksmd uses it. */
+static rbtree_t ksm_candidates;
+
+static ktqueue_t ksmd_wakeq = KTQUEUE_INITIALIZER(ksmd_wakeq);
+
+/* Merges pf, which _ksm_unmap let go of, into kp. pf and its object are
+ * locked, and so is ksm_mobj. */
+static void _ksm_merge(pframe_t *pf, ksm_page_t *kp)
+{
+    pframe_clear_dirty(pf);
+    pframe_lru_remove(pf);
+    page_free(pf->pf_addr);
+    pf->pf_addr = NULL;
+    pf->pf_ksm = kp;
+    pf->pf_ksm_hash = 0;
+    kp->kp_refs++;
+    ksm_nmerged++;
+}
+
+/* Whether kp holds the same contents as page. ksm_mobj must be locked. */
+static long _ksm_page_same(ksm_page_t *kp, const void *page)
+{
+    pframe_t *pf;
+    if (mobj_get_pframe(ksm_mobj, kp->kp_pagenum, 0, &pf))
+    {
+        return 0;
+    }
+    long same = !memcmp(pf->pf_addr, page, PAGE_SIZE);
+    pframe_release(&pf);
+    return same;
+}
+
+/* Makes a shared page with a copy of page, whose hash is given, and no
+ * references yet. ksm_mobj must be locked. Returns NULL if out of memory. */
+static ksm_page_t *_ksm_page_create(const void *page, uint64_t hash)
+{
+    rb_node_t *parent, **link;
+    KASSERT(!_ksm_tree_find(&ksm_tree, hash, &parent, &link));
+    ksm_page_t *kp = kmalloc(sizeof(ksm_page_t));
+    if (!kp)
+    {
+        return NULL;
+    }
+    pframe_t *pf;
+    mobj_create_pframe(ksm_mobj, ksm_next_pagenum, 0, &pf);
+    if (!pf)
+    {
+        kfree(kp);
+        return NULL;
+    }
+    if (!(pf->pf_addr = page_alloc()))
+    {
+        pframe_release(&pf);
+        mobj_delete_pframe(ksm_mobj, ksm_next_pagenum);
+        kfree(kp);
+        return NULL;
+    }
+    memcpy(pf->pf_addr, page, PAGE_SIZE);
+    pframe_release(&pf);
+
+    kp->kp_node.kn_hash = hash;
+    kp->kp_refs = 0;
+    kp->kp_pagenum = ksm_next_pagenum++;
+    list_link_init(&kp->kp_dead_link);
+    rbtree_insert(&ksm_tree, parent, link, &kp->kp_node.kn_node);
+    ksm_npages++;
+    return kp;
+}
+
+/*
+ * pf, a pframe of o, matches the hash of kc. If the candidate's page still
+ * has the same contents, makes a shared page for the two of them. o and pf
+ * are locked; the candidate's object is only tried.
+ */
+static void _ksm_merge_candidate(mobj_t *o, pframe_t *pf, ksm_cand_t *kc)
+{
+    mobj_t *other = kc->kc_obj;
+    if (other != o && !kmutex_trylock(&other->mo_mutex))
+    {
+        return;
+    }
+    pframe_t *opf = radix_tree_lookup(&other->mo_index, kc->kc_pagenum);
+    if (opf && opf != pf && kmutex_trylock(&opf->pf_mutex))
+    {
+        if (opf->pf_addr && !memcmp(opf->pf_addr, pf->pf_addr, PAGE_SIZE) &&
+            _ksm_unmap(o, pf) && _ksm_unmap(other, opf))
+        {
+            mobj_lock(ksm_mobj);
+            ksm_page_t *kp = _ksm_page_create(pf->pf_addr, kc->kc_node.kn_hash);
+            if (kp)
+            {
+                _ksm_merge(pf, kp);
+                _ksm_merge(opf, kp);
+            }
+            mobj_unlock(ksm_mobj);
+        }
+        pframe_release(&opf);
+    }
+    if (other != o)
+    {
+        mobj_unlock(other);
+    }
+}
+
+/* Looks at pf, a resident pframe of o, for this sweep. Both are locked. */
+static void _ksm_scan_pframe(mobj_t *o, pframe_t *pf)
+{
+    uint64_t hash = _ksm_hash(pf->pf_addr);
+    if (hash != pf->pf_ksm_hash)
+    {
+        // New, or written since the last sweep: wait for it to settle
+        pf->pf_ksm_hash = hash;
+        return;
+    }
+
+    mobj_lock(ksm_mobj);
+    ksm_page_t *kp = (ksm_page_t *)_ksm_tree_find(&ksm_tree, hash, NULL, NULL);
+    if (kp)
+    {
+        if (_ksm_page_same(kp, pf->pf_addr) && _ksm_unmap(o, pf))
+        {
+            _ksm_merge(pf, kp);
+        }
+        mobj_unlock(ksm_mobj);
+        return;
+    }
+    mobj_unlock(ksm_mobj);
+
+    rb_node_t *parent, **link;
+    ksm_cand_t *kc =
+        (ksm_cand_t *)_ksm_tree_find(&ksm_candidates, hash, &parent, &link);
+    if (kc)
+    {
+        _ksm_merge_candidate(o, pf, kc);
+    }
+    else if ((kc = kmalloc(sizeof(ksm_cand_t))))
+    {
+        kc->kc_node.kn_hash = hash;
+        mobj_ref(o);
+        kc->kc_obj = o;
+        kc->kc_pagenum = pf->pf_pagenum;
+        rbtree_insert(&ksm_candidates, parent, link, &kc->kc_node.kn_node);
+    }
+}
+
+static void ksmd_sweep()
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        vmmap_t *map = p->p_vmmap;
+        if (!map || !krwlock_read_trylock(&map->vmm_lock))
+        {
+            continue;
+        }
+        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            // 2MB pages are left whole
+            mobj_t *o = vma->vma_obj;
+            if (!(vma->vma_flags & MAP_PRIVATE) ||
+                (vma->vma_flags & MAP_HUGE) || !MOBJ_SWAPPABLE(o) ||
+                !kmutex_trylock(&o->mo_mutex))
+            {
+                continue;
+            }
+            list_iterate(&o->mo_pframes, pf, pframe_t, pf_link)
+            {
+                if (!kmutex_trylock(&pf->pf_mutex))
+                {
+                    continue;
+                }
+                if (pf->pf_addr && !pf->pf_pincount)
+                {
+                    _ksm_scan_pframe(o, pf);
+                }
+                pframe_release(&pf);
+            }
+            mobj_unlock(o);
+        }
+        krwlock_read_unlock(&map->vmm_lock);
+    }
+
+    // Candidates only last a sweep; a page that matched nothing may be
+    // merged with one seen in the next
+    while (ksm_candidates.rbt_root)
+    {
+        ksm_cand_t *kc =
+            (ksm_cand_t *)rb_entry(ksm_candidates.rbt_root, ksm_node_t, kn_node);
+        rbtree_remove(&ksm_candidates, &kc->kc_node.kn_node);
+        mobj_put(&kc->kc_obj);
+        kfree(kc);
+    }
+
+    mobj_lock(ksm_mobj);
+    _ksm_reap();
+    mobj_unlock(ksm_mobj);
+}
+
+static void ksmd_timer_fire(uint64_t data)
+{
+    sched_broadcast_on(&ksmd_wakeq);
+}
+
+static void *ksmd_run(long arg1, void *arg2)
+{
+    timer_t timer;
+    timer_init(&timer);
+    timer.function = ksmd_timer_fire;
+    while (1)
+    {
+        timer.expires = jiffies + KSM_INTERVAL;
+        timer_add(&timer);
+        sched_sleep_on(&ksmd_wakeq);
+        timer_del(&timer);
+        ksmd_sweep();
+    }
+    return NULL;
+}
+
+/* Starts the ksmd daemon, as a child of the idle process like shadowd. */
+void ksmd_init()
+{
+    rbtree_init(&ksm_candidates, NULL);
+
+    proc_t *proc = proc_create("ksmd");
+    KASSERT(proc && "failed to create the ksmd process");
+    kthread_t *thr = kthread_create_daemon(proc, ksmd_run, 0, NULL);
+    KASSERT(thr && "failed to create the ksmd thread");
+    sched_make_runnable(thr);
+}
+#endif
@@ -8,11 +8,30 @@
 #include "mm/mman.h"
 #include "mm/tlb.h"
 #include "util/debug.h"
+#include "vm/pagefault.h"
+
+/*
+ * Faults in a new mapping now if MAP_POPULATE asked for it. Private writable
+ * mappings are faulted in for writing, so that they get their own pages up
+ * front. Failing to populate does not fail the mmap: whatever was not faulted
+ * in here is faulted in on first use.
+ */
+static void _mmap_populate(size_t vfn, size_t npages, int prot, int flags)
+{
+    if (!(flags & MAP_POPULATE) || !(prot & (PROT_READ | PROT_WRITE))) {
+        return;
+    }
+    long forwrite = (prot & PROT_WRITE) && (flags & MAP_PRIVATE);
+    pagefault_populate((uintptr_t)PN_TO_ADDR(vfn), npages, forwrite);
+}
 
 /*
  * This function implements the mmap(2) syscall: Add a mapping to the current
  * process's address space. Supports the following flags: MAP_SHARED,
- * MAP_PRIVATE, MAP_FIXED, and MAP_ANON.
+ * MAP_PRIVATE, MAP_FIXED, MAP_ANON, MAP_HUGE and MAP_POPULATE. The length of
+ * a MAP_HUGE mapping is rounded up to a multiple of 2MB; handle_pagefault()
+ * then backs each 2MB-aligned block of it with a single 2MB page when it can.
+ * A MAP_POPULATE mapping is faulted in before do_mmap() returns.
  *
  *  ret - If provided, on success, *ret must point to the start of the mapped area
  *
@@ -31,6 +50,7 @@
  *     - off is not page aligned
  *     - len is <= 0 or off < 0
  *     - flags do not contain MAP_PRIVATE or MAP_SHARED
+ *     - MAP_HUGE is set but MAP_ANON is not
  *  - ENODEV:
  *     - The underlying filesystem of the specified file does not
  *       support memory mapping or in other words, the file's vnode's mmap
@@ -65,6 +85,10 @@ long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
     if (!(flags & MAP_PRIVATE) && !(flags & MAP_SHARED)) {
         return -EINVAL;
     }
+
+    if (flags & MAP_VDSO) {
+        return -EINVAL;
+    }
     
     if (flags & MAP_FIXED) {
         if (!PAGE_ALIGNED((uintptr_t)addr)) {
@@ -82,6 +106,15 @@ long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
     // Calculate page-aligned length
     size_t page_len = PAGE_ALIGN_UP(len);
     size_t npages = ADDR_TO_PN(page_len);
+
+    // Huge mappings are anonymous only and cover whole 2MB pages
+    if (flags & MAP_HUGE) {
+        if (!(flags & MAP_ANON)) {
+            return -EINVAL;
+        }
+        page_len = PAGE_ALIGN_UP_2MB(page_len);
+        npages = ADDR_TO_PN(page_len);
+    }
     
     // Handle anonymous mapping
     if (flags & MAP_ANON) {
@@ -103,6 +136,7 @@ long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
         
         // Flush TLB for the new mapping
         tlb_flush_range((void *)PN_TO_ADDR(new_vma->vma_start), page_len);
+        _mmap_populate(new_vma->vma_start, npages, prot, flags);
         
         return 0;
     }
@@ -156,6 +190,7 @@ long do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off,
     
     // Flush TLB for the new mapping
     tlb_flush_range((void *)PN_TO_ADDR(new_vma->vma_start), page_len);
+    _mmap_populate(new_vma->vma_start, npages, prot, flags);
     
     return 0;
 }
@@ -209,4 +244,155 @@ long do_munmap(void *addr, size_t len)
     tlb_flush_range(addr, page_len);
     
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * MADV_WILLNEED: reads the file pages mapped in [lopage, hipage) into the
+ * page cache. Anonymous memory is left alone. The map is held only to find
+ * each area, not while reading.
+ */
+static long _madvise_willneed(size_t lopage, size_t hipage)
+{
+    vmmap_t *map = curproc->p_vmmap;
+    for (size_t vfn = lopage; vfn < hipage;) {
+        krwlock_read_lock(&map->vmm_lock);
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (!vma) {
+            krwlock_read_unlock(&map->vmm_lock);
+            return -ENOMEM;
+        }
+        size_t end = MIN(hipage, vma->vma_end);
+        size_t pagenum = vfn - vma->vma_start + vma->vma_off;
+        vnode_t *vn = vmarea_vnode(vma);
+        if (vn) {
+            vref(vn);
+        }
+        krwlock_read_unlock(&map->vmm_lock);
+
+        if (vn) {
+            // The file system reads at most this much per call
+            for (size_t n = 0; n < end - vfn; n += FILE_RA_MAX_PAGES) {
+                pagefault_readahead(vn, pagenum + n,
+                                    MIN(end - vfn - n, FILE_RA_MAX_PAGES));
+            }
+            vput(&vn);
+        }
+        vfn = end;
+    }
+    return 0;
+}
+
+/*
+ * This function implements the mprotect(2) syscall: sets the protection of
+ * the pages of [addr, addr + len) to prot (see vmmap_protect()).
+ *
+ * Return 0 on success, or:
+ *  - EINVAL:
+ *     - addr is not aligned on a page boundary
+ *     - the range is out of range of the user address space
+ *     - prot has bits other than PROT_READ, PROT_WRITE and PROT_EXEC
+ *  - Propagate errors from vmmap_protect()
+ */
+long do_mprotect(void *addr, size_t len, int prot)
+{
+    KASSERT(curproc);
+
+    if (!PAGE_ALIGNED((uintptr_t)addr) ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+        return -EINVAL;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW || (uintptr_t)addr >= USER_MEM_HIGH ||
+        len > USER_MEM_HIGH - (uintptr_t)addr) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    return vmmap_protect(curproc->p_vmmap, ADDR_TO_PN((uintptr_t)addr),
+                         ADDR_TO_PN(PAGE_ALIGN_UP(len)), prot);
+}
+
+/*
+ * This function implements the madvise(2) syscall: tells the kernel how the
+ * range [addr, addr + len) is going to be used (see the MADV_ values in
+ * mman.h and vmmap_advise()).
+ *
+ * Return 0 on success, or:
+ *  - EINVAL:
+ *     - addr is not aligned on a page boundary
+ *     - the range is out of range of the user address space
+ *     - advice is not one of the MADV_ values
+ *  - ENOMEM:
+ *     - part of the range is not mapped
+ */
+long do_madvise(void *addr, size_t len, int advice)
+{
+    KASSERT(curproc);
+
+    if (!PAGE_ALIGNED((uintptr_t)addr)) {
+        return -EINVAL;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW || (uintptr_t)addr >= USER_MEM_HIGH ||
+        len > USER_MEM_HIGH - (uintptr_t)addr) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t lopage = ADDR_TO_PN((uintptr_t)addr);
+    size_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(len));
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+    case MADV_DONTNEED:
+        return vmmap_advise(curproc->p_vmmap, lopage, npages, advice);
+    case MADV_WILLNEED:
+        return _madvise_willneed(lopage, lopage + npages);
+    default:
+        return -EINVAL;
+    }
+}
+
+/*
+ * This function implements the mremap(2) syscall: resizes the mapping of
+ * [addr, addr + old_len) to new_len bytes, growing it in place where the
+ * pages after it are free and, with MREMAP_MAYMOVE, moving it elsewhere
+ * where they are not (see vmmap_remap()). The pages are never copied.
+ * Sets *ret to where the mapping now starts.
+ *
+ * Return 0 on success, or:
+ *  - EINVAL:
+ *     - addr is not aligned on a page boundary
+ *     - either range is out of range of the user address space
+ *     - old_len or new_len is 0
+ *     - flags has bits other than MREMAP_MAYMOVE
+ *  - Propagate errors from vmmap_remap()
+ */
+long do_mremap(void *addr, size_t old_len, size_t new_len, int flags,
+               void **ret)
+{
+    KASSERT(curproc);
+
+    if (!PAGE_ALIGNED((uintptr_t)addr) || !old_len || !new_len ||
+        (flags & ~MREMAP_MAYMOVE)) {
+        return -EINVAL;
+    }
+    if ((uintptr_t)addr < USER_MEM_LOW || (uintptr_t)addr >= USER_MEM_HIGH ||
+        old_len > USER_MEM_HIGH - (uintptr_t)addr ||
+        new_len > USER_MEM_HIGH - USER_MEM_LOW) {
+        return -EINVAL;
+    }
+
+    size_t newlopage;
+    long err = vmmap_remap(curproc->p_vmmap, ADDR_TO_PN((uintptr_t)addr),
+                           ADDR_TO_PN(PAGE_ALIGN_UP(old_len)),
+                           ADDR_TO_PN(PAGE_ALIGN_UP(new_len)), flags,
+                           &newlopage);
+    if (err) {
+        return err;
+    }
+    *ret = PN_TO_ADDR(newlopage);
+    return 0;
+}
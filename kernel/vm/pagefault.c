@@ -1,13 +1,207 @@
 #include "vm/pagefault.h"
 #include "errno.h"
+#include "fs/vnode.h"
 #include "globals.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mobj.h"
 #include "mm/pframe.h"
+#include "mm/page.h"
 #include "mm/tlb.h"
 #include "types.h"
+#include "proc/spinlock.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "vm/vdso.h"
+
+/* Read faults on file and shadow backed areas also map the resident pages
+ * of the aligned block of this many pages around the faulting one */
+#define FAULT_AROUND_PAGES 16
+
+/* In MADV_SEQUENTIAL areas, read faults instead map the resident pages in
+ * this many pages from the faulting one on, and read twice as far ahead in
+ * the file, so that the next fault finds its whole window resident */
+#define FAULT_AHEAD_PAGES 16
+
+#ifdef __FAULT_TRACE__
+/*
+ * The last PAGEFAULT_TRACE_ENTRIES faults handled, over all processes, in a
+ * ring: entry pagefault_trace_next % PAGEFAULT_TRACE_ENTRIES is the next to
+ * be overwritten. Both are protected by pagefault_trace_lock, taken with
+ * interrupts disabled.
+ */
+typedef struct pagefault_trace
+{
+    pid_t pt_pid;
+    uintptr_t pt_vaddr;
+    uintptr_t pt_cause;
+    long pt_major;
+    uint64_t pt_cycles;
+} pagefault_trace_t;
+
+static pagefault_trace_t pagefault_trace[PAGEFAULT_TRACE_ENTRIES];
+static uint64_t pagefault_trace_next;
+static spinlock_t pagefault_trace_lock =
+    SPINLOCK_INITIALIZER(pagefault_trace_lock);
+#endif
+
+/*
+ * Maps, read-only, the pages of the fault-around block around vfn that are
+ * resident in vma's object but not mapped yet, so that reading through a
+ * cached file (e.g. the text of a program just exec'd) does not take a
+ * fault per page. Only pages that can be had without waiting are mapped.
+ * The caller holds the map shared and has mapped vfn itself.
+ */
+static void _fault_around(vmarea_t *vma, size_t vfn)
+{
+    mobj_t *o = vma->vma_obj;
+    if ((o->mo_type != MOBJ_VNODE && o->mo_type != MOBJ_SHADOW) ||
+        vma->vma_advice == MADV_RANDOM)
+    {
+        return;
+    }
+    size_t lo, hi;
+    if (vma->vma_advice == MADV_SEQUENTIAL)
+    {
+        lo = vfn;
+        hi = MIN(vfn + FAULT_AHEAD_PAGES, vma->vma_end);
+    }
+    else
+    {
+        size_t block = vfn & ~(size_t)(FAULT_AROUND_PAGES - 1);
+        lo = MAX(block, vma->vma_start);
+        hi = MIN(block + FAULT_AROUND_PAGES, vma->vma_end);
+    }
+
+    mobj_lock(o);
+    for (size_t pn = lo; pn < hi; pn++)
+    {
+        uintptr_t page = (uintptr_t)PN_TO_ADDR(pn);
+        if (pn == vfn || pt_is_mapped(curproc->p_pml4, page))
+        {
+            continue;
+        }
+        pframe_t *pf;
+        if (mobj_find_resident(o, pn - vma->vma_start + vma->vma_off, &pf))
+        {
+            continue;
+        }
+        if (pt_map(curproc->p_pml4, pt_virt_to_phys((uintptr_t)pf->pf_addr),
+                   page, PT_PRESENT | PT_WRITE | PT_USER,
+                   PT_PRESENT | PT_USER) >= 0)
+        {
+            pframe_map(pf);
+        }
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+}
+
+/*
+ * Backs the 2MB-aligned block around vaddr with one 2MB page, for a MAP_HUGE
+ * area. This only works while the block lies entirely inside vma, vma's
+ * object is still the anonymous object it was created with (not a shadow
+ * object, as after a fork), and no page of the block has been touched yet.
+ * The block is then entered into the object as 512 ordinary pframes, so
+ * that everything else (munmap, fork, exit) can treat it a page at a time;
+ * pt_unmap_range() splits the 2MB mapping when needed.
+ *
+ * Returns 0 if the block was mapped. Otherwise nothing is mapped, and the
+ * caller should fall back to a single page.
+ */
+static long _map_huge_page(vmarea_t *vma, uintptr_t vaddr)
+{
+    uintptr_t block = PAGE_ALIGN_DOWN_2MB(vaddr);
+    size_t bfn = ADDR_TO_PN(block);
+    mobj_t *o = vma->vma_obj;
+    if (bfn < vma->vma_start || bfn + PT_ENTRY_COUNT > vma->vma_end ||
+        o->mo_type != MOBJ_ANON)
+    {
+        return -EINVAL;
+    }
+    size_t pagenum = bfn - vma->vma_start + vma->vma_off;
+
+    mobj_lock(o);
+    pframe_t *pf;
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+    {
+        mobj_find_pframe(o, pagenum + i, &pf);
+        if (pf)
+        {
+            pframe_release(&pf);
+            mobj_unlock(o);
+            return -EEXIST;
+        }
+    }
+
+    /* Buddy blocks are aligned to their size. */
+    char *pages = page_alloc_n(PT_ENTRY_COUNT);
+    if (!pages)
+    {
+        mobj_unlock(o);
+        return -ENOMEM;
+    }
+    KASSERT(PAGE_ALIGNED_2MB(pt_virt_to_phys((uintptr_t)pages)));
+    memset(pages, 0, PAGE_SIZE_2MB);
+
+    long writable = (vma->vma_prot & PROT_WRITE) != 0;
+    for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+    {
+        mobj_create_pframe(o, pagenum + i, 0, &pf);
+        if (!pf)
+        {
+            /* The pframes made so far keep their (zeroed) pages. */
+            for (; i < PT_ENTRY_COUNT; i++)
+            {
+                page_free(pages + i * PAGE_SIZE);
+            }
+            mobj_unlock(o);
+            return -ENOMEM;
+        }
+        pf->pf_addr = pages + i * PAGE_SIZE;
+        if (writable)
+            pframe_set_dirty(pf);
+        pframe_map(pf);
+        pframe_release(&pf);
+    }
+    mobj_unlock(o);
+
+    /* Unlike single pages, the whole block is made writable up front if the
+     * area is: a later write fault would split the mapping. */
+    long ret = pt_map_range(curproc->p_pml4,
+                            pt_virt_to_phys((uintptr_t)pages), block,
+                            block + PAGE_SIZE_2MB, PT_PRESENT | PT_WRITE | PT_USER,
+                            PT_PRESENT | PT_USER | (writable ? PT_WRITE : 0));
+    if (ret)
+    {
+        /* The pages now belong to the object; fault them in one at a time. */
+        for (size_t i = 0; i < PT_ENTRY_COUNT; i++)
+        {
+            pframe_unmapped(pt_virt_to_phys((uintptr_t)pages + i * PAGE_SIZE));
+        }
+        return ret;
+    }
+    tlb_flush_range(block, PT_ENTRY_COUNT);
+    return 0;
+}
+
+/*
+ * Reads npages pages of vn from pagenum on into its page cache, for a
+ * mapping of it. The caller holds a reference on vn but no vmmap: read(2)
+ * locks vnodes first and faults on the user buffer while holding them.
+ */
+void pagefault_readahead(vnode_t *vn, size_t pagenum, size_t npages)
+{
+    if (vn->vn_ops->readahead)
+    {
+        vlock_shared(vn);
+        vn->vn_ops->readahead(vn, pagenum, npages);
+        vunlock_shared(vn);
+    }
+}
 
 /*
  * Respond to a user mode pagefault by setting up the desired page.
@@ -44,8 +238,14 @@
  *    _pt_fault_handler() to get a sense of what's going on.
  * 2) If you run into any errors, you should segfault by calling
  *    do_exit(EFAULT).
+ *
+ * The work is done by _pagefault(), which returns the error instead (-EFAULT
+ * for an access the area does not allow), so that pagefault_populate() can
+ * use it too. With pinp, as for pagefault_pin(), the page is also left
+ * pinned in *pinp; such a fault always gets the page its own pframe, rather
+ * than a huge page or the shared zero page, and fails on the vDSO.
  */
-void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
+static long _pagefault(uintptr_t vaddr, uintptr_t cause, pframe_t **pinp)
 {
     dbg(DBG_VM, "vaddr = 0x%p (0x%p), cause = %lu\n", (void *)vaddr,
         PAGE_ALIGN_DOWN(vaddr), cause);
@@ -55,12 +255,16 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
     // Convert virtual address to page number
     size_t vfn = ADDR_TO_PN(vaddr);
     
-    // Find the vmarea that contains this virtual address
-    vmarea_t *vma = vmmap_lookup(curproc->p_vmmap, vfn);
+    // Find the vmarea that contains this virtual address. The map is held
+    // shared until the page is mapped, so faults on other threads of this
+    // process proceed in parallel while mmap/munmap wait for them.
+    vmmap_t *map = curproc->p_vmmap;
+    krwlock_read_lock(&map->vmm_lock);
+    vmarea_t *vma = vmmap_lookup(map, vfn);
     if (!vma) {
         // No vmarea found for this address
-        do_exit(EFAULT);
-        return;
+        krwlock_read_unlock(&map->vmm_lock);
+        return -EFAULT;
     }
     
     // Check permissions
@@ -76,28 +280,72 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
     
     // Check if the vmarea allows the required access
     if ((vma->vma_prot & required_prot) != required_prot) {
-        do_exit(EFAULT);
-        return;
+        krwlock_read_unlock(&map->vmm_lock);
+        return -EFAULT;
     }
     
+    if (!pinp && (vma->vma_flags & MAP_HUGE) && !_map_huge_page(vma, vaddr)) {
+        krwlock_read_unlock(&map->vmm_lock);
+        return 0;
+    }
+
+    if (vma->vma_flags & MAP_VDSO) {
+        long ret = pinp ? -EFAULT
+                        : vdso_fault(vma, (uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+        krwlock_read_unlock(&map->vmm_lock);
+        return ret < 0 ? ret : 0;
+    }
+
     // Calculate the offset into the memory object
     size_t obj_offset = vfn - vma->vma_start + vma->vma_off;
     
     // Determine if this is a write operation
     long forwrite = (cause & FAULT_WRITE) ? 1 : 0;
+    uintptr_t page = (uintptr_t)PAGE_ALIGN_DOWN(vaddr);
+    int pdflags = PT_PRESENT | PT_WRITE | PT_USER;
     
     // Get the pframe from the memory object
-    pframe_t *pf = mobj_get_pframe(vma->vma_obj, obj_offset, forwrite, 0);
-    if (!pf) {
-        do_exit(EFAULT);
-        return;
+    // Read faults on pages already in the object skip its lock
+    pframe_t *pf;
+    long ret = 0;
+    if (forwrite || mobj_find_pframe_lockless(vma->vma_obj, obj_offset, &pf))
+    {
+        mobj_lock(vma->vma_obj);
+        if (!forwrite && !pinp && !(vma->vma_flags & MAP_SHARED) &&
+            mobj_page_is_zero(vma->vma_obj, obj_offset))
+        {
+            // Untouched memory is read through the shared zero page until a
+            // write fault gives it a page of its own. The object stays
+            // locked so that no such write can be mapped over. Not in a
+            // shared area: the page a write elsewhere (another process's
+            // mapping, or write(2)) puts in the object would not replace
+            // the zero page here.
+            pt_unmap(curproc->p_pml4, page);
+            pt_map(curproc->p_pml4,
+                   pt_virt_to_phys((uintptr_t)pframe_zero_page), page,
+                   pdflags, PT_PRESENT | PT_USER);
+            mobj_unlock(vma->vma_obj);
+            krwlock_read_unlock(&map->vmm_lock);
+            tlb_shootdown(curproc->p_pml4, page, 1);
+            return 0;
+        }
+        ret = mobj_get_pframe(vma->vma_obj, obj_offset, forwrite, &pf);
+        mobj_unlock(vma->vma_obj);
     }
-    
+    if (ret < 0) {
+        krwlock_read_unlock(&map->vmm_lock);
+        return ret;
+    }
+
+    // Pin the page rather than keep it locked while the page tables are
+    // updated
+    pframe_t *pinned = pframe_get(pf);
+    pframe_release(&pf);
+
     // Get the physical address
-    uintptr_t paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+    uintptr_t paddr = pt_virt_to_phys((uintptr_t)pinned->pf_addr);
     
     // Set up page table flags
-    int pdflags = PT_PRESENT | PT_WRITE | PT_USER;
     int ptflags = PT_PRESENT | PT_USER;
     
     // Add write permission if the vmarea allows it and this is a write fault
@@ -105,9 +353,186 @@ void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
         ptflags |= PT_WRITE;
     }
     
-    // Map the page
-    pt_map(curproc->p_pml4, paddr, (uintptr_t)PAGE_ALIGN_DOWN(vaddr), pdflags, ptflags);
+    // Map the page, in place of whatever page was mapped there before (e.g.
+    // the shadowed copy a first write fault replaces)
+    pt_unmap(curproc->p_pml4, page);
+    if (pt_map(curproc->p_pml4, paddr, page, pdflags, ptflags) >= 0)
+        pframe_map(pinned);
+    if (pinp)
+        *pinp = pinned;
+    else
+        pframe_put(&pinned);
+
+    // A sequential reader of a file gets the pages after this one read in
+    // for its next faults, once the map is let go of
+    vnode_t *ahead = NULL;
+    if (!forwrite) {
+        _fault_around(vma, vfn);
+        if (vma->vma_advice == MADV_SEQUENTIAL && (ahead = vmarea_vnode(vma)))
+            vref(ahead);
+    }
+    krwlock_read_unlock(&map->vmm_lock);
     
-    // Flush the TLB
-    tlb_flush_range((uintptr_t)PAGE_ALIGN_DOWN(vaddr), PAGE_SIZE);
+    // Flush the TLB, on every core that may hold the replaced mapping
+    tlb_shootdown(curproc->p_pml4, page, 1);
+
+    if (ahead) {
+        pagefault_readahead(ahead, obj_offset, 2 * FAULT_AHEAD_PAGES);
+        vput(&ahead);
+    }
+    return 0;
+}
+
+/*
+ * A fault from user mode that finds no free memory reclaims some (paging
+ * out anonymous memory, if there is swap) and tries again, this many times,
+ * before the process is killed. Faults from the kernel may hold locks the
+ * reclaimer needs, so they fail at once. For the same reason, only faults
+ * from user mode bring a process that has gone past its resident set limit
+ * back under it (see pframe_rss_trim).
+ */
+#define PAGEFAULT_RECLAIM_TRIES 4
+
+/*
+ * Charges a fault at vaddr that took cycles TSC cycles to curproc, and
+ * traces it. A fault is major if the thread slept while handling it, which
+ * it does to wait for a page to be read in, by itself or by another thread.
+ */
+static void _pagefault_account(uintptr_t vaddr, uintptr_t cause,
+                               uint64_t cycles, long major)
+{
+    if (major)
+        curproc->p_majflt++;
+    else
+        curproc->p_minflt++;
+    curproc->p_fault_cycles += cycles;
+    curproc->p_fault_max_cycles = MAX(curproc->p_fault_max_cycles, cycles);
+
+#ifdef __FAULT_TRACE__
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pagefault_trace_lock);
+    pagefault_trace_t *t =
+        &pagefault_trace[pagefault_trace_next++ % PAGEFAULT_TRACE_ENTRIES];
+    t->pt_pid = curproc->p_pid;
+    t->pt_vaddr = vaddr;
+    t->pt_cause = cause;
+    t->pt_major = major;
+    t->pt_cycles = cycles;
+    spinlock_unlock(&pagefault_trace_lock);
+    if (enabled)
+        intr_enable();
+#else
+    (void)vaddr;
+    (void)cause;
+#endif
+}
+
+void handle_pagefault(uintptr_t vaddr, uintptr_t cause)
+{
+    uint64_t start = rdtsc();
+    uint64_t nvcsw = curthr->kt_nvcsw;
+    long ret = _pagefault(vaddr, cause, NULL);
+    for (long tries = 0; ret == -ENOMEM && (cause & FAULT_USER) &&
+                         tries < PAGEFAULT_RECLAIM_TRIES;
+         tries++)
+    {
+        page_reclaim_point();
+        ret = _pagefault(vaddr, cause, NULL);
+    }
+    if ((cause & FAULT_USER) && curproc->p_rss_limit &&
+        curproc->p_rss > curproc->p_rss_limit)
+        pframe_rss_trim(curproc);
+    _pagefault_account(vaddr, cause, rdtsc() - start,
+                       curthr->kt_nvcsw != nvcsw);
+    if (ret < 0)
+        do_exit(EFAULT);
+}
+
+/*
+ * Faults in the npages pages at vaddr ahead of their first use, for
+ * MAP_POPULATE: for writing, if forwrite is set, so that private pages get
+ * their own copies now rather than on first write. Stops at the first page
+ * that cannot be faulted in and returns its error.
+ */
+long pagefault_populate(uintptr_t vaddr, size_t npages, long forwrite)
+{
+    uintptr_t cause = FAULT_USER | (forwrite ? FAULT_WRITE : 0);
+    for (size_t i = 0; i < npages; i++, vaddr += PAGE_SIZE)
+    {
+        // Read faults map whole blocks at a time (see _fault_around)
+        if (!forwrite && pt_is_mapped(curproc->p_pml4, vaddr))
+            continue;
+        long ret = _pagefault(vaddr, cause, NULL);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/*
+ * Faults in the npages pages at vaddr, which is page-aligned, as a user
+ * access would (a write, if forwrite is set), and pins each one's pframe
+ * into pfs, so that a device can transfer to or from their pages (see
+ * do_direct_rw). The caller drops the pins with pframe_put. Stops at the
+ * first page that cannot be had, unpins the others, and returns its error.
+ */
+long pagefault_pin(uintptr_t vaddr, size_t npages, long forwrite,
+                   pframe_t **pfs)
+{
+    uintptr_t cause = FAULT_USER | (forwrite ? FAULT_WRITE : 0);
+    for (size_t i = 0; i < npages; i++)
+    {
+        long ret = _pagefault(vaddr + i * PAGE_SIZE, cause, &pfs[i]);
+        if (ret < 0)
+        {
+            while (i--)
+                pframe_put(&pfs[i]);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Prints p's page fault counters and, with FAULT_TRACE=1, its faults among
+ * the last ones traced, oldest first. For proc_info(); returns the number
+ * of bytes of buf left unused.
+ */
+size_t pagefault_info(const proc_t *p, char *buf, size_t osize)
+{
+    size_t size = osize;
+    uint64_t nfaults = p->p_minflt + p->p_majflt;
+
+    iprintf(&buf, &size, "faults:       %lu minor, %lu major\n", p->p_minflt,
+            p->p_majflt);
+    iprintf(&buf, &size, "fault fills:  %lu copy-on-write, %lu zero\n",
+            p->p_cowflt, p->p_zeroflt);
+    iprintf(&buf, &size, "fault cycles: %lu avg, %lu max\n",
+            nfaults ? p->p_fault_cycles / nfaults : 0, p->p_fault_max_cycles);
+
+#ifdef __FAULT_TRACE__
+    iprintf(&buf, &size, "recent faults:\n");
+    long enabled = intr_enabled() != 0;
+    intr_disable();
+    spinlock_lock(&pagefault_trace_lock);
+    uint64_t i = pagefault_trace_next > PAGEFAULT_TRACE_ENTRIES
+                     ? pagefault_trace_next - PAGEFAULT_TRACE_ENTRIES
+                     : 0;
+    for (; i < pagefault_trace_next; i++)
+    {
+        pagefault_trace_t *t = &pagefault_trace[i % PAGEFAULT_TRACE_ENTRIES];
+        if (t->pt_pid != p->p_pid)
+            continue;
+        iprintf(&buf, &size, "     0x%p %c%c%c %s %10lu cycles\n",
+                (void *)t->pt_vaddr, t->pt_cause & FAULT_PRESENT ? 'p' : '-',
+                t->pt_cause & FAULT_WRITE ? 'w' : '-',
+                t->pt_cause & FAULT_EXEC ? 'x' : '-',
+                t->pt_major ? "major" : "minor", t->pt_cycles);
+    }
+    spinlock_unlock(&pagefault_trace_lock);
+    if (enabled)
+        intr_enable();
+#endif
+    return size;
 }
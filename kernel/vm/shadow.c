@@ -1,10 +1,21 @@
 #include "vm/shadow.h"
+#include "errno.h"
+#include "globals.h"
 #include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/slab.h"
+#include "mm/swap.h"
+#include "vm/ksm.h"
 #include "util/debug.h"
 #include "util/string.h"
 
+#ifdef __SHADOWD__
+#include "proc/proc.h"
+#include "proc/workqueue.h"
+#include "util/time.h"
+#include "vm/vmmap.h"
+#endif
+
 #define SHADOW_SINGLETON_THRESHOLD 5
 
 typedef struct mobj_shadow
@@ -19,6 +30,9 @@ typedef struct mobj_shadow
     // this should NEVER be a shadow object (i.e. it should have some type other
     // than MOBJ_SHADOW)
     mobj_t *bottom_mobj;
+    // number of shadow objects from this one down to bottom_mobj, counting
+    // this one; see shadow_depth
+    size_t depth;
 } mobj_shadow_t;
 
 #define MOBJ_TO_SO(o) CONTAINER_OF(o, mobj_shadow_t, mobj)
@@ -29,11 +43,16 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
                               pframe_t **pfp);
 static long shadow_fill_pframe(mobj_t *o, pframe_t *pf);
 static long shadow_flush_pframe(mobj_t *o, pframe_t *pf);
+static long shadow_page_is_zero(mobj_t *o, uint64_t pagenum);
+static long shadow_find_resident(mobj_t *o, uint64_t pagenum,
+                                 pframe_t **pfp);
 static void shadow_destructor(mobj_t *o);
 
 static mobj_ops_t shadow_mobj_ops = {.get_pframe = shadow_get_pframe,
                                      .fill_pframe = shadow_fill_pframe,
                                      .flush_pframe = shadow_flush_pframe,
+                                     .page_is_zero = shadow_page_is_zero,
+                                     .find_resident = shadow_find_resident,
                                      .destructor = shadow_destructor};
 
 /*
@@ -77,7 +96,7 @@ mobj_t *shadow_create(mobj_t *shadowed)
     atomic_set(&shadow->mobj.mo_refcount, 1);
     kmutex_init(&shadow->mobj.mo_mutex);
     list_init(&shadow->mobj.mo_pframes);
-    shadow->mobj.mo_btree = NULL;
+    radix_tree_init(&shadow->mobj.mo_index);
     
     // Set up the shadowed object
     shadow->shadowed = shadowed;
@@ -89,15 +108,85 @@ mobj_t *shadow_create(mobj_t *shadowed)
         mobj_shadow_t *shadowed_so = MOBJ_TO_SO(shadowed);
         shadow->bottom_mobj = shadowed_so->bottom_mobj;
         mobj_ref(shadow->bottom_mobj);
+        shadow->depth = shadowed_so->depth + 1;
     } else {
         // If shadowed is not a shadow object, it is the bottom object
         shadow->bottom_mobj = shadowed;
         mobj_ref(shadow->bottom_mobj);
+        shadow->depth = 1;
     }
     
     return &shadow->mobj;
 }
 
+/*
+ * Move the pframes of from, which o shadows directly, up into o, for
+ * shadow_collapse. Copies o already has hide from's, and are dropped. Both
+ * objects must be locked. Nothing is waited for; returns 0 once from is
+ * empty, or a negative error if it could not be emptied, in which case the
+ * pages moved so far stay in o, where they are found just the same.
+ */
+static long _shadow_migrate(mobj_t *o, mobj_t *from)
+{
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+    KASSERT(kmutex_owns_mutex(&from->mo_mutex));
+
+    list_iterate(&from->mo_pframes, pf, pframe_t, pf_link)
+    {
+        uint64_t pagenum = pf->pf_pagenum;
+        if (!kmutex_trylock(&pf->pf_mutex))
+        {
+            return -EAGAIN;
+        }
+
+        // A pframe of o that never got its contents hides nothing; one whose
+        // contents are in swap or merged does
+        pframe_t *opf = radix_tree_lookup(&o->mo_index, pagenum);
+        if (opf && !opf->pf_addr && !opf->pf_swap && !opf->pf_ksm)
+        {
+            if (!kmutex_trylock(&opf->pf_mutex))
+            {
+                pframe_release(&pf);
+                return -EAGAIN;
+            }
+            pframe_release(&opf);
+            mobj_delete_pframe(o, pagenum);
+            opf = NULL;
+        }
+
+        if (opf || (!pf->pf_addr && !pf->pf_swap && !pf->pf_ksm))
+        {
+            if (pframe_pinned(pf))
+            {
+                pframe_release(&pf);
+                return -EBUSY;
+            }
+            pframe_release(&pf);
+            mobj_delete_pframe(from, pagenum);
+            continue;
+        }
+
+        if (radix_tree_insert(&o->mo_index, pagenum, pf))
+        {
+            pframe_release(&pf);
+            return -ENOMEM;
+        }
+        long dirty = pf->pf_dirty;
+        pframe_clear_dirty(pf);
+        radix_tree_delete(&from->mo_index, pagenum);
+        list_remove(&pf->pf_link);
+        list_insert_tail(&o->mo_pframes, &pf->pf_link);
+        pf->pf_obj = o;
+        if (dirty)
+        {
+            pframe_set_dirty(pf);
+        }
+        pframe_release(&pf);
+    }
+    KASSERT(radix_tree_empty(&from->mo_index));
+    return 0;
+}
+
 /*
  * Given a shadow object o, collapse its shadow chain as far as you can.
  *
@@ -116,46 +205,147 @@ mobj_t *shadow_create(mobj_t *shadowed)
  *  but the general idea is the migration of pframes to the top mobj, which is
  *  always the one directly above the mobj you are checking the refcount of, and that you
  *  collapse the mobj if its refcount is 1
+ *
+ * o must be locked. Nothing else is waited for: whatever is busy is left for
+ * the next attempt. Shadow objects are collapsed as soon as a fault finds
+ * the object below them unshared (see shadow_get_pframe), by fork before it
+ * adds another level, and by the shadowd daemon when it is configured in.
  */
 void shadow_collapse(mobj_t *o)
 {
     KASSERT(o && o->mo_type == MOBJ_SHADOW);
-    
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+
     mobj_shadow_t *shadow = MOBJ_TO_SO(o);
-    mobj_t *shadowed = shadow->shadowed;
-    
-    // Can only collapse if shadowed is also a shadow object
-    if (shadowed->mo_type != MOBJ_SHADOW) {
-        return;
-    }
-    
-    mobj_shadow_t *shadowed_so = MOBJ_TO_SO(shadowed);
-    
-    // Lock both objects
-    mobj_lock(o);
-    mobj_lock(shadowed);
-    
-    // Check if we can collapse (shadowed refcount should be 1)
-    if (shadowed->mo_refcount > 1) {
+    while (shadow->shadowed->mo_type == MOBJ_SHADOW &&
+           shadow->shadowed->mo_refcount == 1)
+    {
+        // Only o refers to shadowed, and every walk down o's chain holds o
+        // locked, so nothing else can be looking at shadowed's pages
+        mobj_t *shadowed = shadow->shadowed;
+        if (!kmutex_trylock(&shadowed->mo_mutex))
+        {
+            return;
+        }
+        if (_shadow_migrate(o, shadowed))
+        {
+            mobj_unlock(shadowed);
+            return;
+        }
+        mobj_shadow_t *shadowed_so = MOBJ_TO_SO(shadowed);
+        shadow->shadowed = shadowed_so->shadowed;
+        mobj_ref(shadow->shadowed);
+        shadow->depth = shadowed_so->depth;
         mobj_unlock(shadowed);
-        mobj_unlock(o);
-        return;
+
+        // Drops the last reference, destroying shadowed
+        mobj_put(&shadowed);
     }
-    
-    // Migrate pframes from shadowed to o
-    // This is a simplified version - in practice you'd need to iterate through all pframes
-    // For now, we'll just set up the structure for collapse
-    
-    // Update o's shadowed pointer to point to shadowed's shadowed
-    shadow->shadowed = shadowed_so->shadowed;
-    mobj_ref(shadow->shadowed);
-    
-    // Unref the old shadowed object
-    mobj_put(&shadowed);
-    
-    // Unlock objects
-    mobj_unlock(shadowed);
-    mobj_unlock(o);
+}
+
+/*
+ * Copy every page o's chain holds above the bottom object into o itself and
+ * make o shadow the bottom object directly, so that its depth is 1 however
+ * many processes still share the objects in between. o must be locked.
+ *
+ * The caller must unmap whatever o's pages are mapped at, since mappings of
+ * the old chain's pages are not kept track of once o no longer refers to it.
+ *
+ * Returns 0 on success, or -ENOMEM (or the error reading a page back in
+ * from swap), in which case o keeps its chain.
+ */
+long shadow_flatten(mobj_t *o)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    KASSERT(kmutex_owns_mutex(&o->mo_mutex));
+
+    mobj_shadow_t *shadow = MOBJ_TO_SO(o);
+    mobj_t *current = shadow->shadowed;
+    while (current->mo_type == MOBJ_SHADOW)
+    {
+        // Higher objects are copied from first; they hide the lower copies
+        mobj_lock(current);
+        list_iterate(&current->mo_pframes, pf, pframe_t, pf_link)
+        {
+            if (radix_tree_lookup(&o->mo_index, pf->pf_pagenum) ||
+                (!pf->pf_addr && !pf->pf_swap && !pf->pf_ksm))
+            {
+                continue;
+            }
+            pframe_t *copy;
+            mobj_create_pframe(o, pf->pf_pagenum, 0, &copy);
+            if (!copy)
+            {
+                mobj_unlock(current);
+                return -ENOMEM;
+            }
+            copy->pf_addr = page_alloc();
+            if (!copy->pf_addr)
+            {
+                pframe_release(&copy);
+                mobj_delete_pframe(o, pf->pf_pagenum);
+                mobj_unlock(current);
+                return -ENOMEM;
+            }
+            // Brings pf back in if it is in swap; a merged page is copied
+            // from the shared one
+            pframe_t *src;
+            long ret = pf->pf_ksm ? ksm_get_pframe(pf, &src)
+                                  : mobj_default_get_pframe(current,
+                                                            pf->pf_pagenum, 0,
+                                                            &src);
+            if (ret)
+            {
+                pframe_release(&copy);
+                mobj_delete_pframe(o, pf->pf_pagenum);
+                mobj_unlock(current);
+                return ret;
+            }
+            memcpy(copy->pf_addr, src->pf_addr, PAGE_SIZE);
+            pframe_release(&src);
+            pframe_set_dirty(copy);
+            pframe_release(&copy);
+        }
+        mobj_unlock(current);
+        current = MOBJ_TO_SO(current)->shadowed;
+    }
+
+    KASSERT(current == shadow->bottom_mobj);
+    mobj_t *old = shadow->shadowed;
+    mobj_ref(current);
+    shadow->shadowed = current;
+    shadow->depth = 1;
+    mobj_put(&old);
+    return 0;
+}
+
+/*
+ * Number of shadow objects between o and its bottom object, counting o.
+ * o must be a shadow object.
+ */
+size_t shadow_depth(mobj_t *o)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    return MOBJ_TO_SO(o)->depth;
+}
+
+/*
+ * The object o shadows directly. o must be a shadow object, held locked or
+ * by a map that holds it, so that its chain stays put.
+ */
+mobj_t *shadow_shadowed(mobj_t *o)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    return MOBJ_TO_SO(o)->shadowed;
+}
+
+/*
+ * The object at the bottom of o's chain. o must be a shadow object.
+ */
+mobj_t *shadow_bottom(mobj_t *o)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    return MOBJ_TO_SO(o)->bottom_mobj;
 }
 
 /*
@@ -187,6 +377,14 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
                               pframe_t **pfp)
 {
     KASSERT(o && o->mo_type == MOBJ_SHADOW);
+
+    // The processes that shared the object below o have gone away since
+    // the last fault; fold it into o rather than walking it from now on
+    mobj_shadow_t *shadow = MOBJ_TO_SO(o);
+    if (shadow->shadowed->mo_type == MOBJ_SHADOW &&
+        shadow->shadowed->mo_refcount == 1) {
+        shadow_collapse(o);
+    }
     
     if (forwrite) {
         // For write access, use default behavior
@@ -196,17 +394,48 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
     // For read access, check if we already have the frame
     pframe_t *pf;
     mobj_find_pframe(o, pagenum, &pf);
+    if (pf && pf->pf_ksm) {
+        // Our copy is merged with identical pages; read the shared one
+        long ret = ksm_get_pframe(pf, pfp);
+        pframe_release(&pf);
+        return ret;
+    }
+    if (pf && !pf->pf_addr) {
+        // Our copy is in swap (or failed to fill); bring it in
+        pframe_release(&pf);
+        return mobj_default_get_pframe(o, pagenum, 0, pfp);
+    }
     if (pf) {
         *pfp = pf;
         return 0;
     }
     
     // Traverse shadow chain to find the frame
-    mobj_shadow_t *shadow = MOBJ_TO_SO(o);
     mobj_t *current = shadow->shadowed;
     
     while (current) {
-        mobj_find_pframe(current, pagenum, &pf);
+        // Objects deeper in the chain are locked only if the page is busy;
+        // locking top-down matches shadow_collapse
+        if (mobj_find_pframe_lockless(current, pagenum, &pf) == -EAGAIN) {
+            mobj_lock(current);
+            mobj_find_pframe(current, pagenum, &pf);
+            if (pf && pf->pf_ksm) {
+                long ret = ksm_get_pframe(pf, pfp);
+                pframe_release(&pf);
+                mobj_unlock(current);
+                return ret;
+            }
+            if (pf && !pf->pf_addr) {
+                // A copy in swap still hides the ones below it
+                pframe_release(&pf);
+                long ret = current->mo_type == MOBJ_SHADOW
+                               ? mobj_default_get_pframe(current, pagenum, 0, pfp)
+                               : mobj_get_pframe(current, pagenum, 0, pfp);
+                mobj_unlock(current);
+                return ret;
+            }
+            mobj_unlock(current);
+        }
         if (pf) {
             // Found the frame in a shadow object
             *pfp = pf;
@@ -227,6 +456,50 @@ static long shadow_get_pframe(mobj_t *o, size_t pagenum, long forwrite,
     return mobj_get_pframe(shadow->bottom_mobj, pagenum, forwrite, pfp);
 }
 
+/*
+ * A shadow object's page reads as zeros if no object in the chain has a copy
+ * and the bottom object says its page is zero. Busy pages are taken to be
+ * non-zero, which only costs a real page.
+ */
+static long shadow_page_is_zero(mobj_t *o, uint64_t pagenum)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    if (radix_tree_lookup(&o->mo_index, pagenum))
+        return 0;
+
+    mobj_t *current = MOBJ_TO_SO(o)->shadowed;
+    while (current->mo_type == MOBJ_SHADOW) {
+        pframe_t *pf;
+        long ret = mobj_find_pframe_lockless(current, pagenum, &pf);
+        if (!ret)
+            pframe_release(&pf);
+        if (ret != -ENOENT)
+            return 0;
+        current = MOBJ_TO_SO(current)->shadowed;
+    }
+
+    mobj_lock(current);
+    long zero = mobj_page_is_zero(current, pagenum);
+    mobj_unlock(current);
+    return zero;
+}
+
+/*
+ * The nearest copy of the page in o's chain, bottom object included, if one
+ * is resident and free; see mobj_find_resident.
+ */
+static long shadow_find_resident(mobj_t *o, uint64_t pagenum, pframe_t **pfp)
+{
+    KASSERT(o && o->mo_type == MOBJ_SHADOW);
+    mobj_t *current = o;
+    while (1) {
+        long ret = mobj_find_pframe_lockless(current, pagenum, pfp);
+        if (ret != -ENOENT || current->mo_type != MOBJ_SHADOW)
+            return ret;
+        current = MOBJ_TO_SO(current)->shadowed;
+    }
+}
+
 /*
  * Use the given mobj's shadow chain to fill the given pframe.
  *
@@ -252,29 +525,58 @@ static long shadow_fill_pframe(mobj_t *o, pframe_t *pf)
 {
     KASSERT(o && o->mo_type == MOBJ_SHADOW);
     
+    // Our own copy, paged out or merged with identical pages
+    if (pf->pf_swap) {
+        return swap_in_pframe(pf);
+    }
+    if (pf->pf_ksm) {
+        return ksm_fill_pframe(pf);
+    }
+
     mobj_shadow_t *shadow = MOBJ_TO_SO(o);
     size_t pagenum = pf->pf_pagenum;
     
     // Traverse shadow chain to find a copy of the frame
     mobj_t *current = shadow->shadowed;
     
-    while (current) {
+    while (current->mo_type == MOBJ_SHADOW) {
         pframe_t *source_pf;
+        mobj_lock(current);
         mobj_find_pframe(current, pagenum, &source_pf);
-        if (source_pf) {
+        if (source_pf && source_pf->pf_ksm) {
+            pframe_t *shared;
+            long ret = ksm_get_pframe(source_pf, &shared);
+            pframe_release(&source_pf);
+            if (ret) {
+                mobj_unlock(current);
+                return ret;
+            }
+            source_pf = shared;
+        }
+        else if (source_pf && !source_pf->pf_addr && source_pf->pf_swap) {
+            // A copy in swap still hides the ones below it
+            pframe_release(&source_pf);
+            long ret = mobj_default_get_pframe(current, pagenum, 0, &source_pf);
+            if (ret) {
+                mobj_unlock(current);
+                return ret;
+            }
+        }
+        mobj_unlock(current);
+        if (source_pf && source_pf->pf_addr) {
             // Found the frame, copy its contents
             memcpy(pf->pf_addr, source_pf->pf_addr, PAGE_SIZE);
+            pframe_release(&source_pf);
+            if (curproc)
+                curproc->p_cowflt++;
             return 0;
         }
+        if (source_pf) {
+            pframe_release(&source_pf);
+        }
         
         // Move to next shadow object in chain
-        if (current->mo_type == MOBJ_SHADOW) {
-            mobj_shadow_t *current_shadow = MOBJ_TO_SO(current);
-            current = current_shadow->shadowed;
-        } else {
-            // Reached bottom object
-            break;
-        }
+        current = MOBJ_TO_SO(current)->shadowed;
     }
     
     // Frame not found in shadow chain, get from bottom object
@@ -287,6 +589,8 @@ static long shadow_fill_pframe(mobj_t *o, pframe_t *pf)
     // Copy contents from bottom object
     memcpy(pf->pf_addr, bottom_pf->pf_addr, PAGE_SIZE);
     pframe_release(&bottom_pf);
+    if (curproc)
+        curproc->p_cowflt++;
     
     return 0;
 }
@@ -310,6 +614,7 @@ static long shadow_flush_pframe(mobj_t *o, pframe_t *pf)
  * Clean up a shadow object when its reference count reaches 0.
  *
  * Hints:
+ *  - Free the object's pframes.
  *  - Unref the shadowed object and the bottom object.
  *  - Free the shadow object itself.
  */
@@ -318,6 +623,9 @@ static void shadow_destructor(mobj_t *o)
     KASSERT(o && o->mo_type == MOBJ_SHADOW);
     
     mobj_shadow_t *shadow = MOBJ_TO_SO(o);
+
+    // Free the pages only this object had copies of
+    mobj_default_destructor(o);
     
     // Unref the shadowed object
     if (shadow->shadowed) {
@@ -332,3 +640,55 @@ static void shadow_destructor(mobj_t *o)
     // Free the shadow object
     slab_obj_free(shadow_allocator, shadow);
 }
+
+#ifdef __SHADOWD__
+/*
+ * The shadowd sweep. Faults and fork only collapse the chains of the
+ * processes that run; shadowd runs every SHADOWD_INTERVAL_SECS, as delayed
+ * work, to collapse those of the ones that don't. It never waits for a lock,
+ * so that the process list cannot change under it during a sweep: busy
+ * address spaces and objects are left for the next one.
+ */
+
+/* jiffies are roughly milliseconds, see util/time.c */
+#define SHADOWD_INTERVAL (SHADOWD_INTERVAL_SECS * 1000UL)
+
+static delayed_work_t shadowd_work;
+
+static void shadowd_sweep()
+{
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        vmmap_t *map = p->p_vmmap;
+        if (!map || !krwlock_read_trylock(&map->vmm_lock))
+        {
+            continue;
+        }
+        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            mobj_t *o = vma->vma_obj;
+            if (o->mo_type == MOBJ_SHADOW && kmutex_trylock(&o->mo_mutex))
+            {
+                shadow_collapse(o);
+                mobj_unlock(o);
+            }
+        }
+        krwlock_read_unlock(&map->vmm_lock);
+    }
+}
+
+static void shadowd_run(work_t *work)
+{
+    shadowd_sweep();
+    queue_delayed_work(&shadowd_work, SHADOWD_INTERVAL);
+}
+
+/*
+ * Schedules the first shadowd sweep. The workers must be running.
+ */
+void shadowd_init()
+{
+    delayed_work_init(&shadowd_work, shadowd_run);
+    queue_delayed_work(&shadowd_work, SHADOWD_INTERVAL);
+}
+#endif
@@ -0,0 +1,99 @@
+#include "errno.h"
+#include "globals.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "vm/vdso.h"
+#include "vm/vmmap.h"
+
+#include "api/syscall.h"
+
+/*
+ * The vDSO pages (see api/syscall.h): VDSO_ADDR is mapped read-only in every
+ * process a program is loaded into, its first page to vdso_data, which is
+ * shared by all of them, and its second to a page of the process's own,
+ * made the first time it is touched, so that fork() needs nothing done.
+ *
+ * The area is a MAP_VDSO one, which the page fault handler hands to
+ * vdso_fault(): its pages belong to no pframe, like pframe_zero_page, so
+ * nothing reclaims or writes them back.
+ */
+
+#define VDSO_NPAGES 2
+
+static vdso_data_t *vdso_data;
+
+void vdso_init(void)
+{
+    vdso_data = page_alloc();
+    KASSERT(vdso_data && "failed to allocate the vDSO page");
+    memset(vdso_data, 0, PAGE_SIZE);
+    vdso_data->vd_usec_per_tick = MICROSECONDS_PER_APIC_TICK;
+    vdso_data->vd_jiffies = jiffies;
+    vdso_data->vd_boot_time =
+        do_time() - (time_t)(jiffies * MICROSECONDS_PER_APIC_TICK / 1000000);
+}
+
+/* Called from the timer interrupt of the core that moved jiffies, with them. */
+void vdso_tick(uint64_t ticks)
+{
+    if (vdso_data)
+    {
+        vdso_data->vd_jiffies = ticks;
+    }
+}
+
+/* Maps the vDSO pages into map, which is to be a process's. */
+long vdso_map(vmmap_t *map)
+{
+    return vmmap_map(map, NULL, ADDR_TO_PN(VDSO_ADDR), VDSO_NPAGES, PROT_READ,
+                     MAP_PRIVATE | MAP_FIXED | MAP_VDSO, 0, 0, NULL);
+}
+
+/*
+ * Maps the vDSO page at page (an address in vma, a MAP_VDSO area of curproc)
+ * in curproc's page table.
+ */
+long vdso_fault(vmarea_t *vma, uintptr_t page)
+{
+    KASSERT(vma->vma_flags & MAP_VDSO);
+    void *kpage = vdso_data;
+    if (page == VDSO_PROC_ADDR)
+    {
+        if (!curproc->p_vdso)
+        {
+            vdso_proc_t *vp = page_alloc();
+            if (!vp)
+            {
+                return -ENOMEM;
+            }
+            memset(vp, 0, PAGE_SIZE);
+            vp->vp_pid = curproc->p_pid;
+            /* Another thread's fault may have got there first */
+            if (!__sync_bool_compare_and_swap(&curproc->p_vdso, NULL, vp))
+            {
+                page_free(vp);
+            }
+        }
+        kpage = curproc->p_vdso;
+    }
+    pt_unmap(curproc->p_pml4, page);
+    return pt_map(curproc->p_pml4, pt_virt_to_phys((uintptr_t)kpage), page,
+                  PT_PRESENT | PT_WRITE | PT_USER, PT_PRESENT | PT_USER);
+}
+
+/* Frees proc's own vDSO page, once nothing maps it. */
+void vdso_proc_free(proc_t *proc)
+{
+    if (proc->p_vdso)
+    {
+        page_free(proc->p_vdso);
+        proc->p_vdso = NULL;
+    }
+}
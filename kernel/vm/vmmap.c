@@ -16,6 +16,7 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/slab.h"
+#include "mm/tlb.h"
 #include "util/list.h"
 #include "mm/pframe.h"
 
@@ -72,6 +73,75 @@ void vmarea_free(vmarea_t *vma)
     slab_obj_free(vmarea_allocator, vma);
 }
 
+/*
+ * Recomputes the subtree data of the area at node in vmm_tree from its
+ * children's, so that vmmap_find_range can tell which subtrees have a large
+ * enough gap without visiting them.
+ */
+static void _vmarea_tree_update(rb_node_t *node)
+{
+    vmarea_t *vma = rb_entry(node, vmarea_t, vma_tnode);
+    vma->vma_sub_start = vma->vma_start;
+    vma->vma_sub_end = vma->vma_end;
+    vma->vma_sub_gap = 0;
+    if (node->rb_left)
+    {
+        vmarea_t *left = rb_entry(node->rb_left, vmarea_t, vma_tnode);
+        vma->vma_sub_start = left->vma_sub_start;
+        vma->vma_sub_gap = MAX(left->vma_sub_gap,
+                               vma->vma_start - left->vma_sub_end);
+    }
+    if (node->rb_right)
+    {
+        vmarea_t *right = rb_entry(node->rb_right, vmarea_t, vma_tnode);
+        vma->vma_sub_end = right->vma_sub_end;
+        vma->vma_sub_gap = MAX(vma->vma_sub_gap,
+                               MAX(right->vma_sub_gap,
+                                   right->vma_sub_start - vma->vma_end));
+    }
+}
+
+static vmarea_t *_vmarea_tree_child(rb_node_t *node)
+{
+    return node ? rb_entry(node, vmarea_t, vma_tnode) : NULL;
+}
+
+/*
+ * The lowest area of map that ends after vfn, or NULL if there is none.
+ */
+static vmarea_t *_vmmap_lower_bound(vmmap_t *map, size_t vfn)
+{
+    vmarea_t *found = NULL;
+    rb_node_t *node = map->vmm_tree.rbt_root;
+    while (node)
+    {
+        vmarea_t *vma = rb_entry(node, vmarea_t, vma_tnode);
+        if (vma->vma_end > vfn)
+        {
+            found = vma;
+            node = node->rb_left;
+        }
+        else
+        {
+            node = node->rb_right;
+        }
+    }
+    return found;
+}
+
+/*
+ * Takes vma out of map, without freeing it.
+ */
+static void _vmmap_unlink(vmmap_t *map, vmarea_t *vma)
+{
+    rbtree_remove(&map->vmm_tree, &vma->vma_tnode);
+    list_remove(&vma->vma_plink);
+    if (map->vmm_cache == vma)
+    {
+        map->vmm_cache = NULL;
+    }
+}
+
 /*
  * Create and initialize a new vmmap. Initialize all the fields of vmmap_t.
  */
@@ -91,6 +161,10 @@ vmmap_t *vmmap_create(void)
     // Initialize the process pointer to NULL
     map->vmm_proc = NULL;
     
+    krwlock_init(&map->vmm_lock);
+    rbtree_init(&map->vmm_tree, _vmarea_tree_update);
+    map->vmm_cache = NULL;
+    
     return map;
 }
 
@@ -129,6 +203,8 @@ void vmmap_destroy(vmmap_t **mapp)
  * Can the ending page be higher than USER_MEM_HIGH? Can the start > end?
  * You don't need to explicitly handle these cases, but it may help to 
  * use KASSERTs to catch these aforementioned errors.
+ *
+ * The caller holds map->vmm_lock exclusive, unless no one else can see map yet.
  */
 void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
 {
@@ -141,24 +217,37 @@ void vmmap_insert(vmmap_t *map, vmarea_t *new_vma)
     // Set the vmmap pointer
     new_vma->vma_vmmap = map;
     
-    // If the list is empty, just add it
-    if (list_empty(&map->vmm_list)) {
-        list_insert_head(&map->vmm_list, &new_vma->vma_plink);
-        return;
+    // Find new_vma's place in the tree (kept sorted by start address)
+    rb_node_t *parent = NULL, **link = &map->vmm_tree.rbt_root;
+    while (*link) {
+        parent = *link;
+        vmarea_t *vma = rb_entry(parent, vmarea_t, vma_tnode);
+        KASSERT(new_vma->vma_end <= vma->vma_start ||
+                new_vma->vma_start >= vma->vma_end);
+        link = new_vma->vma_start < vma->vma_start ? &parent->rb_left
+                                                   : &parent->rb_right;
     }
-    
-    // Find the correct position to insert (keep sorted by start address)
-    vmarea_t *vma;
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        if (new_vma->vma_start < vma->vma_start) {
-            // Insert before this vma
-            list_insert_before(&vma->vma_plink, &new_vma->vma_plink);
-            return;
-        }
+    rbtree_insert(&map->vmm_tree, parent, link, &new_vma->vma_tnode);
+
+    // The list stays in the same order, for walking the areas in turn
+    rb_node_t *next = rbtree_next(&new_vma->vma_tnode);
+    if (next) {
+        list_insert_before(&rb_entry(next, vmarea_t, vma_tnode)->vma_plink,
+                           &new_vma->vma_plink);
+    } else {
+        list_insert_tail(&map->vmm_list, &new_vma->vma_plink);
     }
-    
-    // If we get here, insert at the end
-    list_insert_tail(&map->vmm_list, &new_vma->vma_plink);
+}
+
+/*
+ * Call after moving the start or end of vma, an area of map, in place,
+ * without making it overlap another area. The caller holds map->vmm_lock
+ * exclusive.
+ */
+void vmmap_update_area(vmmap_t *map, vmarea_t *vma)
+{
+    KASSERT(vma->vma_start < vma->vma_end);
+    rbtree_update_path(&map->vmm_tree, &vma->vma_tnode);
 }
 
 /*
@@ -180,102 +269,70 @@ ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir)
 {
     KASSERT(map);
     KASSERT(dir == VMMAP_DIR_LOHI || dir == VMMAP_DIR_HILO);
-    
-    if (npages == 0) {
+
+    size_t low = ADDR_TO_PN(USER_MEM_LOW);
+    size_t high = ADDR_TO_PN(USER_MEM_HIGH);
+    if (npages == 0 || npages > high - low) {
         return -1;
     }
-    
-    // If no vmareas exist, return the appropriate starting address
-    if (list_empty(&map->vmm_list)) {
-        if (dir == VMMAP_DIR_HILO) {
-            // Start from high address
-            size_t start = ADDR_TO_PN(USER_MEM_HIGH) - npages;
-            return start;
-        } else {
-            // Start from low address
-            size_t start = ADDR_TO_PN(USER_MEM_LOW);
-            return start;
-        }
+
+    rb_node_t *root = map->vmm_tree.rbt_root;
+    if (!root) {
+        return dir == VMMAP_DIR_HILO ? (ssize_t)(high - npages) : (ssize_t)low;
     }
-    
-    // Find gaps between existing vmareas
-    vmarea_t *vma;
-    size_t gap_start, gap_end;
-    
-    if (dir == VMMAP_DIR_HILO) {
-        // Check gap before the first vma (at high address)
-        vma = list_head(&map->vmm_list, vmarea_t, vma_plink);
-        size_t high_start = ADDR_TO_PN(USER_MEM_HIGH) - npages;
-        
-        // If the first vma starts after our desired high address, we can use the high address
-        if (vma->vma_start > high_start) {
-            return high_start;
-        }
-        
-        // Check if there's a gap before the first vma that's big enough
-        if (vma->vma_start >= npages) {
-            size_t candidate_start = vma->vma_start - npages;
-            return candidate_start;
+    vmarea_t *top = rb_entry(root, vmarea_t, vma_tnode);
+
+    if (dir == VMMAP_DIR_LOHI) {
+        // Below the lowest area, then between areas, then above the highest
+        if (top->vma_sub_start - low >= npages) {
+            return low;
         }
-        
-        // Check gaps between vmareas
-        vmarea_t *prev_vma = NULL;
-        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-            if (prev_vma) {
-                gap_start = prev_vma->vma_end;
-                gap_end = vma->vma_start;
-                
-                if (gap_end - gap_start >= npages) {
-                    // Found a gap big enough
-                    size_t candidate_start = gap_end - npages;
-                    return candidate_start;
+        if (top->vma_sub_gap >= npages) {
+            // Go to the lowest subtree or gap that is large enough; the
+            // subtree data says which one that is at every step
+            vmarea_t *vma = top;
+            while (1) {
+                vmarea_t *left = _vmarea_tree_child(vma->vma_tnode.rb_left);
+                vmarea_t *right = _vmarea_tree_child(vma->vma_tnode.rb_right);
+                if (left && left->vma_sub_gap >= npages) {
+                    vma = left;
+                } else if (left && vma->vma_start - left->vma_sub_end >= npages) {
+                    return left->vma_sub_end;
+                } else if (right && right->vma_sub_start - vma->vma_end >= npages) {
+                    return vma->vma_end;
+                } else {
+                    KASSERT(right && right->vma_sub_gap >= npages);
+                    vma = right;
                 }
             }
-            prev_vma = vma;
         }
-        
-        // Check gap after the last vma
-        if (prev_vma) {
-            gap_start = prev_vma->vma_end;
-            gap_end = ADDR_TO_PN(USER_MEM_HIGH);
-            
-            if (gap_end - gap_start >= npages) {
-                size_t candidate_start = gap_end - npages;
-                return candidate_start;
-            }
+        if (high - top->vma_sub_end >= npages) {
+            return top->vma_sub_end;
         }
     } else {
-        // VMMAP_DIR_LOHI - start from low address
-        // Check gap before the first vma
-        vma = list_head(&map->vmm_list, vmarea_t, vma_plink);
-        size_t low_start = ADDR_TO_PN(USER_MEM_LOW);
-        if (vma->vma_start >= low_start + npages) {
-            return low_start;
+        // The same, from the top down
+        if (high - top->vma_sub_end >= npages) {
+            return high - npages;
         }
-        
-        // Check gaps between vmareas
-        vmarea_t *prev_vma = NULL;
-        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-            if (prev_vma) {
-                gap_start = prev_vma->vma_end;
-                gap_end = vma->vma_start;
-                
-                if (gap_end - gap_start >= npages) {
-                    // Found a gap big enough
-                    return gap_start;
+        if (top->vma_sub_gap >= npages) {
+            vmarea_t *vma = top;
+            while (1) {
+                vmarea_t *left = _vmarea_tree_child(vma->vma_tnode.rb_left);
+                vmarea_t *right = _vmarea_tree_child(vma->vma_tnode.rb_right);
+                if (right && right->vma_sub_gap >= npages) {
+                    vma = right;
+                } else if (right && right->vma_sub_start - vma->vma_end >= npages) {
+                    return right->vma_sub_start - npages;
+                } else if (left && vma->vma_start - left->vma_sub_end >= npages) {
+                    return vma->vma_start - npages;
+                } else {
+                    KASSERT(left && left->vma_sub_gap >= npages);
+                    vma = left;
                 }
             }
-            prev_vma = vma;
         }
-        
-        // Check gap after the last vma
-        if (prev_vma) {
-            gap_start = prev_vma->vma_end;
-            gap_end = ADDR_TO_PN(USER_MEM_HIGH);
-            
-            if (gap_end - gap_start >= npages) {
-                return gap_start;
-            }
+        if (top->vma_sub_start - low >= npages) {
+            return top->vma_sub_start - npages;
         }
     }
     
@@ -285,14 +342,30 @@ ssize_t vmmap_find_range(vmmap_t *map, size_t npages, int dir)
 /*
  * Look up the vmarea that contains the given virtual frame number.
  * Returns NULL if no such vmarea exists.
+ *
+ * The caller holds map->vmm_lock (shared is enough) for as long as it uses
+ * the vmarea.
  */
 vmarea_t *vmmap_lookup(vmmap_t *map, size_t vfn)
 {
     KASSERT(map);
-    
-    vmarea_t *vma;
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        if (vfn >= vma->vma_start && vfn < vma->vma_end) {
+
+    // Faults tend to come in runs on the same area. Shared holders of the
+    // lock may race to set the cache, which only costs a tree walk later.
+    vmarea_t *vma = map->vmm_cache;
+    if (vma && vfn >= vma->vma_start && vfn < vma->vma_end) {
+        return vma;
+    }
+
+    rb_node_t *node = map->vmm_tree.rbt_root;
+    while (node) {
+        vma = rb_entry(node, vmarea_t, vma_tnode);
+        if (vfn < vma->vma_start) {
+            node = node->rb_left;
+        } else if (vfn >= vma->vma_end) {
+            node = node->rb_right;
+        } else {
+            map->vmm_cache = vma;
             return vma;
         }
     }
@@ -330,10 +403,12 @@ vmmap_t *vmmap_clone(vmmap_t *map)
     }
     
     // Copy each vmarea from the original map
+    krwlock_read_lock(&map->vmm_lock);
     vmarea_t *vma;
     list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
         vmarea_t *new_vma = vmarea_alloc();
         if (!new_vma) {
+            krwlock_read_unlock(&map->vmm_lock);
             vmmap_destroy(&new_map);
             return NULL;
         }
@@ -350,17 +425,21 @@ vmmap_t *vmmap_clone(vmmap_t *map)
         
         // Insert into the new map
         vmmap_insert(new_map, new_vma);
+
+        // A big address space is not copied in one go
+        cond_resched();
     }
+    krwlock_read_unlock(&map->vmm_lock);
     
     return new_map;
 }
 
 /*
- * Map a file or anonymous memory into the address space.
- * This is the core function used by mmap() system call.
+ * vmmap_map with map->vmm_lock held exclusive.
  */
-long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
-               int prot, int flags, off_t off, int dir, vmarea_t **new_vma)
+static long vmmap_map_locked(vmmap_t *map, vnode_t *file, size_t lopage,
+                             size_t npages, int prot, int flags, off_t off,
+                             int dir, vmarea_t **new_vma)
 {
     KASSERT(map);
     
@@ -387,6 +466,20 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
     vma->vma_prot = prot;
     vma->vma_flags = flags;
     vma->vma_vmmap = map;
+    // What mprotect() may grant later: anything, for anonymous memory, but
+    // no more of a file than was asked for, as the file was only checked
+    // for that, except that a private mapping that can be read can be
+    // written too, since its writes go to its shadow object
+    vma->vma_maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    if (!(flags & MAP_ANON)) {
+        vma->vma_maxprot = prot;
+        if (prot & (PROT_READ | PROT_EXEC)) {
+            vma->vma_maxprot |= PROT_READ | PROT_EXEC;
+            if (flags & MAP_PRIVATE) {
+                vma->vma_maxprot |= PROT_WRITE;
+            }
+        }
+    }
     
     // Create the appropriate memory object
     if (flags & MAP_ANON) {
@@ -409,6 +502,18 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
             vmarea_free(vma);
             return result;
         }
+
+        // Writes to a private mapping go to a shadow object of the file's
+        // (a device's mmap makes an object of its own, which needs none)
+        if ((flags & MAP_PRIVATE) && S_ISREG(file->vn_mode)) {
+            mobj_t *shadow = shadow_create(vma->vma_obj);
+            mobj_put(&vma->vma_obj);
+            if (!shadow) {
+                vmarea_free(vma);
+                return -ENOMEM;
+            }
+            vma->vma_obj = shadow;
+        }
     } else {
         // Should not happen
         vmarea_free(vma);
@@ -426,10 +531,48 @@ long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
 }
 
 /*
- * Remove the virtual memory areas that overlap with the range [lopage, lopage + npages).
- * This may require splitting or truncating existing vmareas.
+ * Map a file or anonymous memory into the address space.
+ * This is the core function used by mmap() system call.
  */
-long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
+long vmmap_map(vmmap_t *map, vnode_t *file, size_t lopage, size_t npages,
+               int prot, int flags, off_t off, int dir, vmarea_t **new_vma)
+{
+    krwlock_write_lock(&map->vmm_lock);
+    long ret = vmmap_map_locked(map, file, lopage, npages, prot, flags, off,
+                                dir, new_vma);
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * vmmap_remove with map->vmm_lock held exclusive.
+ */
+/*
+ * Splits vma at vfn, which must lie strictly inside it: vma keeps
+ * [vma_start, vfn), and the area returned, now in map too, gets
+ * [vfn, vma_end) of the same object. Returns NULL if out of memory.
+ */
+static vmarea_t *_vmmap_split(vmmap_t *map, vmarea_t *vma, size_t vfn)
+{
+    KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+    vmarea_t *high_vma = vmarea_alloc();
+    if (!high_vma) {
+        return NULL;
+    }
+    *high_vma = *vma;
+    high_vma->vma_start = vfn;
+    high_vma->vma_off = vma->vma_off + (vfn - vma->vma_start);
+    list_link_init(&high_vma->vma_plink);
+    if (high_vma->vma_obj) {
+        mobj_ref(high_vma->vma_obj);
+    }
+    vma->vma_end = vfn;
+    vmmap_update_area(map, vma);
+    vmmap_insert(map, high_vma);
+    return high_vma;
+}
+
+static long vmmap_remove_locked(vmmap_t *map, size_t lopage, size_t npages)
 {
     KASSERT(map);
     
@@ -438,59 +581,523 @@ long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
     }
     
     size_t hipage = lopage + npages;
+
+    // The pages mapped in the range go with the areas, so that their
+    // objects never free a page that is still mapped (see pframe_map)
+    if (map->vmm_proc) {
+        pt_unmap_range(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(lopage),
+                       (uintptr_t)PN_TO_ADDR(hipage));
+        tlb_shootdown(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(lopage),
+                      npages);
+    }
     
-    vmarea_t *vma, *next_vma;
-    list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        // Check if this vma overlaps with the range to remove
-        if (vma->vma_end <= lopage || vma->vma_start >= hipage) {
-            // No overlap, skip this vma
-            continue;
-        }
+    // Areas are visited in order, from the first one the range reaches
+    vmarea_t *vma = _vmmap_lower_bound(map, lopage);
+    while (vma && vma->vma_start < hipage) {
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vmarea_t *next = next_node ? rb_entry(next_node, vmarea_t, vma_tnode)
+                                   : NULL;
         
         // There is overlap, need to handle it
         if (vma->vma_start < lopage && vma->vma_end > hipage) {
-            // The vma completely contains the range to remove
-            // Split into two vmareas
-            
-            // Create new vma for the high part
-            vmarea_t *high_vma = vmarea_alloc();
+            // The vma completely contains the range to remove: split off
+            // the part above it, then truncate the original
+            vmarea_t *high_vma = _vmmap_split(map, vma, hipage);
             KASSERT(high_vma);
-            
-            // Copy properties to high vma
-            *high_vma = *vma;
-            high_vma->vma_start = hipage;
-            high_vma->vma_off = vma->vma_off + (hipage - vma->vma_start);
-            list_link_init(&high_vma->vma_plink);
-            
-            // Truncate the original vma
             vma->vma_end = lopage;
-            
-            // Insert the high vma after the original
-            list_insert_before(&vma->vma_plink, &high_vma->vma_plink);
+            vmmap_update_area(map, vma);
             
         } else if (vma->vma_start < lopage) {
             // The vma overlaps with the low end of the range
             // Truncate the vma
             vma->vma_end = lopage;
+            vmmap_update_area(map, vma);
             
         } else if (vma->vma_end > hipage) {
             // The vma overlaps with the high end of the range
-            // Adjust the vma
-            vma->vma_off += (lopage - vma->vma_start);
-            vma->vma_start = lopage;
-            vma->vma_end = hipage;
+            // Move its start past the range
+            vma->vma_off += (hipage - vma->vma_start);
+            vma->vma_start = hipage;
+            vmmap_update_area(map, vma);
             
         } else {
             // The vma is completely contained in the range to remove
             // Remove it entirely
-            list_remove(&vma->vma_plink);
+            _vmmap_unlink(map, vma);
             vmarea_free(vma);
         }
+        vma = next;
     }
     
     return 0;
 }
 
+/*
+ * Remove the virtual memory areas that overlap with the range [lopage, lopage + npages).
+ * This may require splitting or truncating existing vmareas.
+ */
+long vmmap_remove(vmmap_t *map, size_t lopage, size_t npages)
+{
+    krwlock_write_lock(&map->vmm_lock);
+    long ret = vmmap_remove_locked(map, lopage, npages);
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Applies madvise(2) advice to [lopage, lopage + npages), which must be
+ * mapped throughout; returns -ENOMEM if it is not, or if an area cannot be
+ * split.
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are recorded in the areas
+ * (splitting the ones the range only partly covers), where handle_pagefault
+ * finds them. MADV_DONTNEED unmaps the range and, in private areas, throws
+ * away the copies of the pages the area's own object holds, so that they
+ * are faulted in again from beneath it (zeroes, for anonymous memory).
+ * MADV_WILLNEED is not handled here (see do_madvise).
+ */
+long vmmap_advise(vmmap_t *map, size_t lopage, size_t npages, int advice)
+{
+    size_t hipage = lopage + npages;
+    krwlock_write_lock(&map->vmm_lock);
+
+    // The range has to be mapped without holes
+    vmarea_t *first = _vmmap_lower_bound(map, lopage);
+    vmarea_t *vma = first;
+    size_t vfn = lopage;
+    while (vfn < hipage) {
+        if (!vma || vma->vma_start > vfn) {
+            krwlock_write_unlock(&map->vmm_lock);
+            return -ENOMEM;
+        }
+        vfn = vma->vma_end;
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+    }
+
+    if (advice == MADV_DONTNEED) {
+        if (map->vmm_proc) {
+            pt_unmap_range(map->vmm_proc->p_pml4,
+                           (uintptr_t)PN_TO_ADDR(lopage),
+                           (uintptr_t)PN_TO_ADDR(hipage));
+            tlb_shootdown(map->vmm_proc->p_pml4,
+                          (uintptr_t)PN_TO_ADDR(lopage), npages);
+        }
+        for (vma = first; vma && vma->vma_start < hipage;) {
+            mobj_t *o = vma->vma_obj;
+            if ((vma->vma_flags & MAP_PRIVATE) && o->mo_type != MOBJ_VNODE) {
+                size_t lo = MAX(lopage, vma->vma_start);
+                size_t hi = MIN(hipage, vma->vma_end);
+                mobj_lock(o);
+                mobj_discard_range(o, lo - vma->vma_start + vma->vma_off,
+                                   hi - vma->vma_start + vma->vma_off);
+                mobj_unlock(o);
+            }
+            rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+            vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+        }
+        krwlock_write_unlock(&map->vmm_lock);
+        return 0;
+    }
+
+    long ret = 0;
+    for (vma = first; vma && vma->vma_start < hipage;) {
+        if (vma->vma_start < lopage) {
+            if (!_vmmap_split(map, vma, lopage)) {
+                ret = -ENOMEM;
+                break;
+            }
+            // Carry on with the part in the range
+        } else {
+            if (vma->vma_end > hipage && !_vmmap_split(map, vma, hipage)) {
+                ret = -ENOMEM;
+                break;
+            }
+            vma->vma_advice = advice;
+        }
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+    }
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Merges vma, an area of map, into the area just below it, if that ends where
+ * vma starts and maps the pages of the same object just before vma's in the
+ * same way. Returns whichever area now holds vma's pages.
+ */
+static vmarea_t *_vmmap_merge(vmmap_t *map, vmarea_t *vma)
+{
+    rb_node_t *prev_node = rbtree_prev(&vma->vma_tnode);
+    vmarea_t *prev = prev_node ? rb_entry(prev_node, vmarea_t, vma_tnode)
+                               : NULL;
+    if (!prev || prev->vma_end != vma->vma_start ||
+        prev->vma_obj != vma->vma_obj ||
+        prev->vma_off + (prev->vma_end - prev->vma_start) != vma->vma_off ||
+        prev->vma_prot != vma->vma_prot ||
+        prev->vma_maxprot != vma->vma_maxprot ||
+        prev->vma_flags != vma->vma_flags ||
+        prev->vma_advice != vma->vma_advice) {
+        return vma;
+    }
+    size_t end = vma->vma_end;
+    _vmmap_unlink(map, vma);
+    vmarea_free(vma);
+    prev->vma_end = end;
+    vmmap_update_area(map, prev);
+    return prev;
+}
+
+/*
+ * Sets the protection of [lopage, lopage + npages), which must be mapped
+ * throughout, to prot, for mprotect(2). The areas the range only partly
+ * covers are split, and the areas in the range are then merged with their
+ * neighbours where they match again.
+ *
+ * Permission that is taken away goes from the page tables in one walk of
+ * the range followed by one TLB shootdown: PROT_NONE unmaps the pages,
+ * which stay in their objects to be faulted in again, and dropping
+ * PROT_WRITE write protects them. Permission that is granted is left to
+ * the next fault on each page, as a page is only mapped writable by a write
+ * fault anyway. Without an NX bit in the page tables, PROT_EXEC is only
+ * checked by the fault handler.
+ *
+ * Returns -ENOMEM if the range is not mapped throughout or an area cannot be
+ * split, -EACCES if prot is more than an area allows (see vma_maxprot), and
+ * -EINVAL for a MAP_VDSO area, or a MAP_HUGE area the range does not cover
+ * in whole 2MB pages. Nothing is changed unless the range passes all of
+ * these checks.
+ */
+long vmmap_protect(vmmap_t *map, size_t lopage, size_t npages, int prot)
+{
+    size_t hipage = lopage + npages;
+    long ret = 0;
+    krwlock_write_lock(&map->vmm_lock);
+
+    vmarea_t *first = _vmmap_lower_bound(map, lopage);
+    vmarea_t *vma = first;
+    size_t vfn = lopage;
+    while (vfn < hipage) {
+        if (!vma || vma->vma_start > vfn) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        if ((prot & vma->vma_maxprot) != prot) {
+            ret = -EACCES;
+            goto out;
+        }
+        if ((vma->vma_flags & MAP_VDSO) ||
+            ((vma->vma_flags & MAP_HUGE) &&
+             (MAX(lopage, vma->vma_start) % PT_ENTRY_COUNT ||
+              MIN(hipage, vma->vma_end) % PT_ENTRY_COUNT))) {
+            ret = -EINVAL;
+            goto out;
+        }
+        vfn = vma->vma_end;
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+    }
+
+    int taken = 0;
+    for (vma = first; vma && vma->vma_start < hipage;) {
+        if (vma->vma_start < lopage) {
+            if (!_vmmap_split(map, vma, lopage)) {
+                ret = -ENOMEM;
+                break;
+            }
+            // Carry on with the part in the range
+        } else {
+            if (vma->vma_end > hipage && !_vmmap_split(map, vma, hipage)) {
+                ret = -ENOMEM;
+                break;
+            }
+            taken |= vma->vma_prot & ~prot;
+            vma->vma_prot = prot;
+            vma = _vmmap_merge(map, vma);
+        }
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+    }
+    // The area after the range may match the last one in it now
+    if (vma && vma->vma_start == hipage) {
+        _vmmap_merge(map, vma);
+    }
+
+    if (taken && map->vmm_proc) {
+        uintptr_t lo = (uintptr_t)PN_TO_ADDR(lopage);
+        uintptr_t hi = (uintptr_t)PN_TO_ADDR(hipage);
+        if (!(prot & (PROT_READ | PROT_WRITE | PROT_EXEC))) {
+            pt_unmap_range(map->vmm_proc->p_pml4, lo, hi);
+        } else if (taken & PROT_WRITE) {
+            pt_write_protect_range(map->vmm_proc->p_pml4, lo, hi);
+        }
+        tlb_shootdown(map->vmm_proc->p_pml4, lo, npages);
+    }
+
+out:
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Resizes the mapping of [lopage, lopage + oldpages), which must lie in one
+ * area, to newpages pages, for mremap(2). Shrinking removes the pages past
+ * the new end. Growing extends the area in place when the range ends the
+ * area and the pages after it are free; otherwise, with MREMAP_MAYMOVE in
+ * flags, the range is split off into an area of its own and moved,
+ * whole, to a free range found as vmmap_map() would: the area keeps its
+ * object and offset, so nothing is copied, and only the page table entries
+ * of the old range go, to be faulted in again at the new one. Sets
+ * *newlopage to where the mapping now starts.
+ *
+ * Returns -EFAULT if the range is not within one area, -EINVAL for a
+ * MAP_HUGE or MAP_VDSO area (2MB pages and the vDSO cannot move), and
+ * -ENOMEM if the mapping can neither grow in place nor move.
+ */
+long vmmap_remap(vmmap_t *map, size_t lopage, size_t oldpages, size_t newpages,
+                 int flags, size_t *newlopage)
+{
+    KASSERT(oldpages && newpages);
+    size_t hipage = lopage + oldpages;
+    long ret = 0;
+    krwlock_write_lock(&map->vmm_lock);
+
+    vmarea_t *vma = vmmap_lookup(map, lopage);
+    if (!vma || vma->vma_end < hipage) {
+        ret = -EFAULT;
+        goto out;
+    }
+    if (vma->vma_flags & (MAP_HUGE | MAP_VDSO)) {
+        ret = -EINVAL;
+        goto out;
+    }
+    *newlopage = lopage;
+    if (newpages <= oldpages) {
+        ret = vmmap_remove_locked(map, lopage + newpages, oldpages - newpages);
+        goto out;
+    }
+
+    size_t grow = newpages - oldpages;
+    if (vma->vma_end == hipage &&
+        hipage + grow <= ADDR_TO_PN(USER_MEM_HIGH) &&
+        !vmmap_is_range_empty(map, hipage, grow)) {
+        vma->vma_end = hipage + grow;
+        vmmap_update_area(map, vma);
+        goto out;
+    }
+    if (!(flags & MREMAP_MAYMOVE)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ssize_t to = vmmap_find_range(map, newpages, VMMAP_DIR_HILO);
+    if (to < 0) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (vma->vma_start < lopage && !(vma = _vmmap_split(map, vma, lopage))) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (vma->vma_end > hipage && !_vmmap_split(map, vma, hipage)) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    if (map->vmm_proc) {
+        pt_unmap_range(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(lopage),
+                       (uintptr_t)PN_TO_ADDR(hipage));
+        tlb_shootdown(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(lopage),
+                      oldpages);
+    }
+    _vmmap_unlink(map, vma);
+    vma->vma_start = to;
+    vma->vma_end = to + newpages;
+    vmmap_insert(map, vma);
+    *newlopage = to;
+
+out:
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * Moves the end of the heap of map, which starts at startvfn, from oldvfn
+ * to newvfn. The heap is private anonymous memory: the area below oldvfn,
+ * or the one at startvfn while the heap is empty.
+ *
+ * The heap area is grown BRK_RESERVE_PAGES past newvfn where there is room
+ * for it, so that most calls to brk(2) find the pages already there and
+ * leave the map alone; nothing is faulted in until it is touched. Shrinking
+ * drops the pages past newvfn from the heap's object in one pass and keeps
+ * the area for up to BRK_RESERVE_PAGES past the new break, to grow back
+ * into. After a fork the heap's object is a shadow, and the pages beneath
+ * it cannot be dropped, so a shadowed heap is cut back at newvfn instead
+ * and grows back in a new area.
+ *
+ * Returns -ENOMEM if the heap cannot grow to newvfn.
+ */
+long vmmap_brk(vmmap_t *map, size_t startvfn, size_t oldvfn, size_t newvfn)
+{
+    KASSERT(startvfn <= oldvfn && startvfn <= newvfn);
+    KASSERT(newvfn <= ADDR_TO_PN(USER_MEM_HIGH));
+    if (newvfn == oldvfn) {
+        return 0;
+    }
+    size_t reserve = MIN(newvfn + BRK_RESERVE_PAGES, ADDR_TO_PN(USER_MEM_HIGH));
+
+    long ret = 0;
+    krwlock_write_lock(&map->vmm_lock);
+    vmarea_t *heap = vmmap_lookup(map, oldvfn > startvfn ? oldvfn - 1
+                                                         : startvfn);
+    if (heap && (heap->vma_flags & (MAP_PRIVATE | MAP_ANON)) !=
+                    (MAP_PRIVATE | MAP_ANON)) {
+        heap = NULL;
+    }
+
+    if (newvfn > oldvfn) {
+        size_t from = heap ? heap->vma_end : startvfn;
+        if (newvfn <= from) {
+            goto out;
+        }
+        size_t end = reserve;
+        if (vmmap_is_range_empty(map, from, end - from)) {
+            end = newvfn;
+            if (vmmap_is_range_empty(map, from, end - from)) {
+                ret = -ENOMEM;
+                goto out;
+            }
+        }
+        if (heap && heap->vma_obj->mo_type == MOBJ_ANON) {
+            heap->vma_end = end;
+            vmmap_update_area(map, heap);
+            goto out;
+        }
+        vmarea_t *vma = vmarea_alloc();
+        if (!vma) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        vma->vma_start = from;
+        vma->vma_end = end;
+        vma->vma_prot = PROT_READ | PROT_WRITE;
+        vma->vma_maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+        vma->vma_flags = MAP_PRIVATE | MAP_ANON;
+        vma->vma_obj = anon_create();
+        if (!vma->vma_obj) {
+            vmarea_free(vma);
+            ret = -ENOMEM;
+            goto out;
+        }
+        mobj_unlock(vma->vma_obj);
+        vmmap_insert(map, vma);
+        goto out;
+    }
+
+    // Shrinking: everything from newvfn to the end of the heap's area goes
+    size_t hipage = heap ? MAX(heap->vma_end, oldvfn) : oldvfn;
+    if (map->vmm_proc) {
+        pt_unmap_range(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(newvfn),
+                       (uintptr_t)PN_TO_ADDR(hipage));
+        tlb_shootdown(map->vmm_proc->p_pml4, (uintptr_t)PN_TO_ADDR(newvfn),
+                      hipage - newvfn);
+    }
+    size_t cut = MIN(reserve, hipage);
+    for (vmarea_t *vma = _vmmap_lower_bound(map, newvfn);
+         vma && vma->vma_start < hipage;) {
+        size_t lo = MAX(newvfn, vma->vma_start);
+        if (vma->vma_obj->mo_type == MOBJ_ANON &&
+            (vma->vma_flags & MAP_PRIVATE)) {
+            mobj_lock(vma->vma_obj);
+            mobj_discard_range(vma->vma_obj, lo - vma->vma_start + vma->vma_off,
+                               vma->vma_end - vma->vma_start + vma->vma_off);
+            mobj_unlock(vma->vma_obj);
+        } else {
+            cut = MIN(cut, lo);
+        }
+        rb_node_t *next_node = rbtree_next(&vma->vma_tnode);
+        vma = next_node ? rb_entry(next_node, vmarea_t, vma_tnode) : NULL;
+    }
+    vmmap_remove_locked(map, cut, hipage - cut);
+
+out:
+    krwlock_write_unlock(&map->vmm_lock);
+    return ret;
+}
+
+/*
+ * For the swapper (see swap_out_pframe): takes page pagenum of o, held at
+ * physical address paddr, out of the address spaces that map it. Any area
+ * whose object is o, or has o in its shadow chain, may map it. Unless force
+ * is set, mappings the CPU has used since the last look (their accessed bit
+ * is set) are kept instead, and their bit cleared, so that pages in use get
+ * another round.
+ *
+ * The caller holds o and the page's pframe locked, so the page cannot be
+ * mapped anew meanwhile. Since maps come before objects in the lock order,
+ * they are only tried: busy address spaces keep their mappings, which the
+ * caller can tell from pf_mapcount.
+ *
+ * Returns 1 if a mapping was found in use and 0 otherwise.
+ */
+long vmmap_unmap_pframe(mobj_t *o, uint64_t pagenum, uintptr_t paddr,
+                        long force)
+{
+    long used = 0;
+    list_iterate(&proc_list, p, proc_t, p_list_link)
+    {
+        vmmap_t *map = p->p_vmmap;
+        if (!map || !krwlock_read_trylock(&map->vmm_lock))
+        {
+            continue;
+        }
+        list_iterate(&map->vmm_list, vma, vmarea_t, vma_plink)
+        {
+            if (pagenum < vma->vma_off ||
+                pagenum - vma->vma_off >= vma->vma_end - vma->vma_start)
+            {
+                continue;
+            }
+            mobj_t *cur = vma->vma_obj;
+            while (cur != o && cur->mo_type == MOBJ_SHADOW)
+            {
+                cur = shadow_shadowed(cur);
+            }
+            if (cur != o)
+            {
+                continue;
+            }
+            uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vma->vma_start + pagenum -
+                                                    vma->vma_off);
+            long accessed = pt_clear_accessed(p->p_pml4, vaddr, paddr);
+            if (accessed > 0 && !force)
+            {
+                used = 1;
+            }
+            else if (accessed >= 0)
+            {
+                pt_unmap(p->p_pml4, vaddr);
+                tlb_shootdown(p->p_pml4, vaddr, 1);
+            }
+        }
+        krwlock_read_unlock(&map->vmm_lock);
+    }
+    return used;
+}
+
+/*
+ * The file vma maps, directly or beneath the shadow objects of a private
+ * mapping, or NULL if it is anonymous memory. The caller holds the map.
+ */
+vnode_t *vmarea_vnode(vmarea_t *vma)
+{
+    mobj_t *o = vma->vma_obj;
+    if (o->mo_type == MOBJ_SHADOW) {
+        o = shadow_bottom(o);
+    }
+    return o->mo_type == MOBJ_VNODE ? CONTAINER_OF(o, vnode_t, vn_mobj) : NULL;
+}
+
 /*
  * Check if the range [startvfn, startvfn + npages) is empty (i.e., no vmarea
  * overlaps with this range). Returns 0 if the range is empty, -1 if it overlaps
@@ -506,22 +1113,61 @@ long vmmap_is_range_empty(vmmap_t *map, size_t startvfn, size_t npages)
 
     size_t endvfn = startvfn + npages;
 
-    list_link_t *link;
-    list_t *list = &map->vmm_list;
-    for (link = list->l_next; link != list; link = link->l_next) {
-        vmarea_t *vma = list_item(link, vmarea_t, vma_plink);
-        if (!(endvfn <= vma->vma_start || startvfn >= vma->vma_end)) {
-            return -1;
-        }
+    // Only the first area ending past startvfn can overlap first
+    vmarea_t *vma = _vmmap_lower_bound(map, startvfn);
+    if (vma && vma->vma_start < endvfn) {
+        return -1;
     }
 
     return 0;
 }
 
+/*
+ * Copies count bytes, which do not cross a page boundary, between buf and
+ * vaddr through the mapping the page tables of map already have for vaddr,
+ * if there is one (a writable one, for writes). Returns whether it did.
+ *
+ * The page is reached through the physical map, so the copy cannot fault.
+ * The walk and the copy are done with preemption disabled and without
+ * sleeping, so the page cannot be paged out, merged or freed meanwhile (see
+ * mobj_find_pframe_lockless). A write sets the entry's dirty bit, like one
+ * through the mapping; pframes mapped writable are already dirty. A write
+ * from a NULL buf writes zeros.
+ */
+static long _vmmap_copy_mapped(vmmap_t *map, uintptr_t vaddr, void *buf,
+                               size_t count, long forwrite)
+{
+    if (!map->vmm_proc)
+    {
+        return 0;
+    }
+    preemption_disable();
+    uintptr_t paddr = pt_user_phys(map->vmm_proc->p_pml4, vaddr, forwrite);
+    if (paddr)
+    {
+        char *page = (char *)(paddr + PHYS_OFFSET);
+        if (forwrite && !buf)
+        {
+            memset(page, 0, count);
+        }
+        else if (forwrite)
+        {
+            memcpy(page, buf, count);
+        }
+        else
+        {
+            memcpy(buf, page, count);
+        }
+    }
+    preemption_enable();
+    return paddr != 0;
+}
+
 /*
  * Read data from a virtual memory address range into a kernel buffer.
- * This function handles page faults by accessing the memory through the
- * corresponding memory objects for each vmarea.
+ * Pages the process has mapped are copied straight through its page tables
+ * (see _vmmap_copy_mapped); the others are read through the corresponding
+ * memory objects of their vmareas, which handles what a page fault would.
  */
 long vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
 {
@@ -536,16 +1182,9 @@ long vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
     size_t bytes_read = 0;
     
     // Read data page by page
+    krwlock_read_lock(&map->vmm_lock);
     uintptr_t current_addr = start_addr;
     while (current_addr < end_addr) {
-        // Find the vmarea for this address
-        size_t vfn = ADDR_TO_PN(current_addr);
-        vmarea_t *vma = vmmap_lookup(map, vfn);
-        
-        if (!vma) {
-            return -EFAULT;
-        }
-        
         // Calculate how much to read from this page
         uintptr_t page_start = PAGE_ALIGN_DOWN(current_addr);
         uintptr_t page_end = PAGE_ALIGN_UP(current_addr + 1);
@@ -556,34 +1195,59 @@ long vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
             bytes_in_page = end_addr - current_addr;
         }
         
+        if (_vmmap_copy_mapped(map, current_addr, (char *)buf + bytes_read,
+                               bytes_in_page, 0)) {
+            current_addr += bytes_in_page;
+            bytes_read += bytes_in_page;
+            continue;
+        }
+        
+        // Not mapped: find the vmarea for this address
+        size_t vfn = ADDR_TO_PN(current_addr);
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        
+        if (!vma) {
+            krwlock_read_unlock(&map->vmm_lock);
+            return -EFAULT;
+        }
+        
         // Calculate offset into the memory object
         size_t obj_offset = vfn - vma->vma_start + vma->vma_off;
         
         // Get the pframe from the memory object
-        pframe_t *pf = mobj_get_pframe(vma->vma_obj, obj_offset, 0, 0);
-        if (!pf) {
-            return -EFAULT;
+        pframe_t *pf;
+        mobj_lock(vma->vma_obj);
+        long ret = mobj_get_pframe(vma->vma_obj, obj_offset, 0, &pf);
+        mobj_unlock(vma->vma_obj);
+        if (ret < 0) {
+            krwlock_read_unlock(&map->vmm_lock);
+            return ret;
         }
         
         // Copy data from the pframe to the buffer
         memcpy((char *)buf + bytes_read, (char *)pf->pf_addr + page_offset, bytes_in_page);
+        pframe_release(&pf);
         
         // Move to next page
         current_addr += bytes_in_page;
         bytes_read += bytes_in_page;
     }
+    krwlock_read_unlock(&map->vmm_lock);
     
     return bytes_read;
 }
 
 /*
  * Write data from a kernel buffer to a virtual memory address range.
- * This function handles page faults by accessing the memory through the
- * corresponding memory objects for each vmarea.
+ * Pages the process has mapped writable are copied straight through its
+ * page tables (see _vmmap_copy_mapped); the others are written through the
+ * corresponding memory objects of their vmareas, which handles what a page
+ * fault would, copy-on-write included. If buf is NULL, the range is
+ * zeroed instead.
  */
 long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
 {
-    KASSERT(map && buf);
+    KASSERT(map);
     
     if (count == 0) {
         return 0;
@@ -594,16 +1258,9 @@ long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
     size_t bytes_written = 0;
     
     // Write data page by page
+    krwlock_read_lock(&map->vmm_lock);
     uintptr_t current_addr = start_addr;
     while (current_addr < end_addr) {
-        // Find the vmarea for this address
-        size_t vfn = ADDR_TO_PN(current_addr);
-        vmarea_t *vma = vmmap_lookup(map, vfn);
-        
-        if (!vma) {
-            return -EFAULT;
-        }
-        
         // Calculate how much to write to this page
         uintptr_t page_start = PAGE_ALIGN_DOWN(current_addr);
         uintptr_t page_end = PAGE_ALIGN_UP(current_addr + 1);
@@ -614,25 +1271,52 @@ long vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
             bytes_in_page = end_addr - current_addr;
         }
         
+        if (_vmmap_copy_mapped(map, current_addr,
+                               buf ? (char *)buf + bytes_written : NULL,
+                               bytes_in_page, 1)) {
+            current_addr += bytes_in_page;
+            bytes_written += bytes_in_page;
+            continue;
+        }
+        
+        // Not mapped writable: find the vmarea for this address
+        size_t vfn = ADDR_TO_PN(current_addr);
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        
+        if (!vma) {
+            krwlock_read_unlock(&map->vmm_lock);
+            return -EFAULT;
+        }
+        
         // Calculate offset into the memory object
         size_t obj_offset = vfn - vma->vma_start + vma->vma_off;
         
         // Get the pframe from the memory object
-        pframe_t *pf = mobj_get_pframe(vma->vma_obj, obj_offset, 0, 0);
-        if (!pf) {
-            return -EFAULT;
+        pframe_t *pf;
+        mobj_lock(vma->vma_obj);
+        long ret = mobj_get_pframe(vma->vma_obj, obj_offset, 1, &pf);
+        mobj_unlock(vma->vma_obj);
+        if (ret < 0) {
+            krwlock_read_unlock(&map->vmm_lock);
+            return ret;
         }
         
         // Copy data from the buffer to the pframe
-        memcpy((char *)pf->pf_addr + page_offset, (char *)buf + bytes_written, bytes_in_page);
+        if (buf) {
+            memcpy((char *)pf->pf_addr + page_offset,
+                   (char *)buf + bytes_written, bytes_in_page);
+        } else {
+            memset((char *)pf->pf_addr + page_offset, 0, bytes_in_page);
+        }
         
-        // Mark the pframe as dirty
-        pf->pf_dirty = 1;
+        // mobj_get_pframe already marked the pframe dirty (forwrite)
+        pframe_release(&pf);
         
         // Move to next page
         current_addr += bytes_in_page;
         bytes_written += bytes_in_page;
     }
+    krwlock_read_unlock(&map->vmm_lock);
     
     return bytes_written;
 }
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Symbolizes the interrupt latency tracer's windows against kernel.bin.
+
+Build with IPL_TRACE=1, start the tracer with the kshell's `ipltrace start`
+and write out each core's longest windows with interrupts masked with
+`ipltrace dump`: the debug log then has one
+"IPLTRACE core=<id> cycles=<cycles> pid=<pid> start=<address> end=<address>"
+line per window (see kernel/include/main/ipltrace.h). Given that log, this
+prints the windows, longest first, with the functions and source lines that
+masked and unmasked interrupts:
+
+    python3 python/weenix/ipltrace.py [-e kernel/kernel.bin] [--mhz MHZ] LOG...
+
+It runs on the host, outside gdb, and uses binutils' nm and addr2line.
+"""
+
+import argparse
+import collections
+import os
+import re
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from profile import Symbols  # noqa: E402
+
+_WINDOW = re.compile(r"IPLTRACE core=(\d+) cycles=(\d+) pid=(-?\d+) "
+                     r"start=0x([0-9a-fA-F]+) end=0x([0-9a-fA-F]+)")
+
+Window = collections.namedtuple("Window", "cycles core pid start end")
+
+
+def windows(paths):
+    """Yields each window in the given logs."""
+    for path in paths:
+        with open(path, errors="replace") as log:
+            for line in log:
+                m = _WINDOW.search(line)
+                if m:
+                    yield Window(int(m.group(2)), int(m.group(1)),
+                                 int(m.group(3)), int(m.group(4), 16),
+                                 int(m.group(5), 16))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("logs", nargs="+", metavar="LOG")
+    parser.add_argument("-e", "--elf", default="kernel/kernel.bin")
+    parser.add_argument("--mhz", type=float,
+                        help="the TSC rate, to print microseconds")
+    args = parser.parse_args()
+
+    found = sorted(windows(args.logs), reverse=True)
+    if not found:
+        print("no windows found", file=sys.stderr)
+        return 1
+
+    symbols = Symbols(args.elf)
+    where = symbols.lines([w.start for w in found] + [w.end for w in found])
+
+    def site(rip):
+        return "%s (%s)" % (symbols.function(rip), where.get(rip, "?"))
+
+    for w in found:
+        if args.mhz:
+            length = "%10.1fus" % (w.cycles / args.mhz)
+        else:
+            length = "%12d" % w.cycles
+        print("%s C%d P%-4d %s\n    -> %s" % (length, w.core, w.pid,
+                                            site(w.start), site(w.end)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
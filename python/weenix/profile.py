@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Symbolizes the kernel's profiler samples against kernel.bin.
+
+Start the profiler with the kshell's `profile start` and write out its
+samples with `profile dump`: the debug log then has one
+"PROF core=<id> pid=<pid> rip=<address>" line per sample (see
+kernel/include/util/profile.h). Given that log, this prints the functions
+the samples landed in, most sampled first:
+
+    python3 python/weenix/profile.py [-e kernel/kernel.bin] [-n 30]
+                                     [--lines] [--pid PID] LOG...
+
+It runs on the host, outside gdb, and uses binutils' nm and addr2line.
+"""
+
+import argparse
+import bisect
+import collections
+import re
+import subprocess
+import sys
+
+_SAMPLE = re.compile(r"PROF core=(\d+) pid=(-?\d+) rip=0x([0-9a-fA-F]+)")
+_KERNEL_BASE = 0xffff800000000000
+
+
+def samples(paths, pid=None):
+    """Yields (core, pid, rip) for each sample in the given logs."""
+    for path in paths:
+        with open(path, errors="replace") as log:
+            for line in log:
+                m = _SAMPLE.search(line)
+                if m and (pid is None or int(m.group(2)) == pid):
+                    yield int(m.group(1)), int(m.group(2)), int(m.group(3), 16)
+
+
+class Symbols:
+    """The function symbols of an ELF file, for looking up addresses."""
+
+    def __init__(self, elf):
+        out = subprocess.run(["nm", "-n", "--defined-only", elf],
+                             capture_output=True, text=True, check=True)
+        self._addrs = []
+        self._names = []
+        for line in out.stdout.splitlines():
+            fields = line.split()
+            if len(fields) == 3 and fields[1] in "tTwW":
+                self._addrs.append(int(fields[0], 16))
+                self._names.append(fields[2])
+        self._elf = elf
+
+    def function(self, rip):
+        if rip < _KERNEL_BASE:
+            return "[user]"
+        i = bisect.bisect_right(self._addrs, rip) - 1
+        return self._names[i] if i >= 0 else "[unknown]"
+
+    def lines(self, rips):
+        """Maps each kernel address in rips to its file:line."""
+        rips = [r for r in rips if r >= _KERNEL_BASE]
+        if not rips:
+            return {}
+        out = subprocess.run(["addr2line", "-e", self._elf] +
+                             ["0x%x" % r for r in rips],
+                             capture_output=True, text=True, check=True)
+        return dict(zip(rips, out.stdout.splitlines()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("logs", nargs="+", metavar="LOG")
+    parser.add_argument("-e", "--elf", default="kernel/kernel.bin")
+    parser.add_argument("-n", "--top", type=int, default=30,
+                        help="how many entries to print")
+    parser.add_argument("--lines", action="store_true",
+                        help="count source lines rather than functions")
+    parser.add_argument("--pid", type=int, help="only samples from this pid")
+    args = parser.parse_args()
+
+    symbols = Symbols(args.elf)
+    by_rip = collections.Counter()
+    by_core = collections.Counter()
+    for core, _, rip in samples(args.logs, args.pid):
+        by_rip[rip] += 1
+        by_core[core] += 1
+    total = sum(by_rip.values())
+    if not total:
+        print("no samples found", file=sys.stderr)
+        return 1
+
+    counts = collections.Counter()
+    if args.lines:
+        where = symbols.lines(list(by_rip))
+        for rip, n in by_rip.items():
+            counts["%s %s" % (symbols.function(rip),
+                              where.get(rip, ""))] += n
+    else:
+        for rip, n in by_rip.items():
+            counts[symbols.function(rip)] += n
+
+    print("%d samples (%s)" % (total, ", ".join(
+        "core %d: %d" % c for c in sorted(by_core.items()))))
+    for name, n in counts.most_common(args.top):
+        print("%8d %6.2f%%  %s" % (n, 100.0 * n / total, name))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
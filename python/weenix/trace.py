@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Puts the kernel's tracepoint records in order.
+
+Start tracing with the kshell's `trace start [event...]` and write out the
+records with `trace dump`: the debug log then has a "TRACE hz=<rate>" line
+and one "TRACE core=<id> tsc=<tsc> ev=<name> pid=<pid> a0=<hex> a1=<hex>"
+line per record (see kernel/include/util/trace.h). Given that log, this
+merges the cores' records by timestamp and prints them with the time since
+the first:
+
+    python3 python/weenix/trace.py [--event NAME]... [--pid PID] LOG...
+
+with --summary printing the count of each event instead. It runs on the
+host, outside gdb.
+"""
+
+import argparse
+import collections
+import re
+import sys
+
+_HZ = re.compile(r"TRACE hz=(\d+)")
+_RECORD = re.compile(r"TRACE core=(\d+) tsc=(\d+) ev=(\w+) pid=(-?\d+) "
+                     r"a0=0x([0-9a-fA-F]+) a1=0x([0-9a-fA-F]+)")
+
+Record = collections.namedtuple("Record", "tsc core event pid a0 a1")
+
+
+def parse(paths):
+    """Returns the TSC rate (or 0) and the records in the given logs."""
+    hz = 0
+    records = []
+    for path in paths:
+        with open(path, errors="replace") as log:
+            for line in log:
+                m = _RECORD.search(line)
+                if m:
+                    records.append(Record(int(m.group(2)), int(m.group(1)),
+                                          m.group(3), int(m.group(4)),
+                                          int(m.group(5), 16),
+                                          int(m.group(6), 16)))
+                    continue
+                m = _HZ.search(line)
+                if m:
+                    hz = int(m.group(1))
+    return hz, records
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("logs", nargs="+", metavar="LOG")
+    parser.add_argument("--event", action="append",
+                        help="only this event (may be repeated)")
+    parser.add_argument("--pid", type=int, help="only records from this pid")
+    parser.add_argument("--summary", action="store_true",
+                        help="count each event rather than listing records")
+    args = parser.parse_args()
+
+    hz, records = parse(args.logs)
+    records = [r for r in records
+               if (not args.event or r.event in args.event) and
+               (args.pid is None or r.pid == args.pid)]
+    if not records:
+        print("no records found", file=sys.stderr)
+        return 1
+    records.sort()
+
+    if args.summary:
+        counts = collections.Counter(r.event for r in records)
+        for event, n in counts.most_common():
+            print("%10d  %s" % (n, event))
+        return 0
+
+    start = records[0].tsc
+    for r in records:
+        if hz:
+            when = "%12.3fus" % ((r.tsc - start) * 1e6 / hz)
+        else:
+            when = "%14d" % (r.tsc - start)
+        print("%s C%d P%-4d %-14s 0x%x 0x%x" % (when, r.core, r.pid, r.event,
+                                               r.a0, r.a1))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
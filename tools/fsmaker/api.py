@@ -3,18 +3,27 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 8
 S5_BLOCK_SIZE = 4096
 
-S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
+# blocks of the metadata journal, header included, on a disk big enough
+S5_JOURNAL_NBLOCKS = 64
+
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
+S5_NEXTENTS = 9
+S5_EXTENT_SIZE = 12
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE // 4
+# the indirect blocks could map more, but the size is 32 bits
+S5_MAX_FILE_BLOCKS = 0xffffffff // S5_BLOCK_SIZE
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+# bytes of file data an inode holds itself, see S5_INODE_INLINE
+S5_INLINE_SIZE = 124
+S5_INODE_SIZE = 24 + S5_NEXTENTS * S5_EXTENT_SIZE + S5_INLINE_SIZE
+S5_INODE_INLINE = 0x1
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
 S5_TYPE_FREE = 0x0
@@ -68,15 +77,7 @@ class Block:
             self._simdisk._simfile.write(b'\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
-            self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
-            self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
-        else:
-            for i in range(S5_NBLKS_PER_FNODE - 1):
-                self.write(i * 4, struct.pack("I", self._simdisk.get_free_block(i)))
-            self.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self._simdisk.get_last_free_block()))
-            self._simdisk.set_last_free_block(self._blockno)
-            self._simdisk.set_nfree(0)
+        self._simdisk.set_block_used(self._blockno, False)
 
 class Dirent:
     
@@ -97,12 +98,6 @@ class Inode:
         self._number = number
         self._offset = offset
 
-    def get_next_free(self):
-        return self.get_size()
-
-    def set_next_free(self, val):
-        return self.set_size(val)
-
     def get_size(self):
         self._simfile.seek(int(self._offset))
         return struct.unpack("I", self._simfile.read(4))[0]
@@ -135,28 +130,174 @@ class Inode:
         self._simfile.seek(int(self._offset + 10))
         self._simfile.write(struct.pack("h", val))
 
-    def get_direct_blockno(self, index):
-        if (index < S5_NDIRECT_BLOCKS):
-            self._simfile.seek(int(self._offset + 12 + index * 4))
-            return struct.unpack("I", self._simfile.read(4))[0]
+    # The block map, see s5_inode_t in kernel/include/fs/s5fs/s5fs.h: extents of
+    # (first file block, first disk block, length), then the indirect block
+    # for the first S5_NIDIRECT_BLOCKS file blocks and the double indirect
+    # block for the rest.
+
+    def get_extent(self, index):
+        if (index < S5_NEXTENTS):
+            self._simfile.seek(int(self._offset + 12 + index * S5_EXTENT_SIZE))
+            return struct.unpack("III", self._simfile.read(S5_EXTENT_SIZE))
         else:
-            raise S5fsException("direct block index {0} greater than max {1}".format(index, S5_NDIRECT_BLOCKS))
+            raise S5fsException("extent index {0} greater than max {1}".format(index, S5_NEXTENTS - 1))
 
-    def set_direct_blockno(self, index, val):
-        if (index < S5_NDIRECT_BLOCKS):
-            self._simfile.seek(int(self._offset + 12 + index * 4))
-            self._simfile.write(struct.pack("I", val))
+    def set_extent(self, index, block, start, length):
+        if (index < S5_NEXTENTS):
+            self._simfile.seek(int(self._offset + 12 + index * S5_EXTENT_SIZE))
+            self._simfile.write(struct.pack("III", block, start, length))
         else:
-            raise S5fsException("direct block index {0} greater than max {1}".format(index, S5_NDIRECT_BLOCKS))
+            raise S5fsException("extent index {0} greater than max {1}".format(index, S5_NEXTENTS - 1))
 
     def get_indirect_blockno(self):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+        self._simfile.seek(int(self._offset + 12 + S5_NEXTENTS * S5_EXTENT_SIZE))
         return struct.unpack("I", self._simfile.read(4))[0]
 
     def set_indirect_blockno(self, val):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+        self._simfile.seek(int(self._offset + 12 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        self._simfile.write(struct.pack("I", val))
+
+    def get_dindirect_blockno(self):
+        self._simfile.seek(int(self._offset + 16 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_dindirect_blockno(self, val):
+        self._simfile.seek(int(self._offset + 16 + S5_NEXTENTS * S5_EXTENT_SIZE))
         self._simfile.write(struct.pack("I", val))
 
+    # A file with S5_INODE_INLINE set has the first S5_INLINE_SIZE bytes of its
+    # first block in the inode instead, and the rest of that block is zeros.
+    # Files are only written here with blocks; an inline one is moved out to
+    # a block first.
+
+    def get_flags(self):
+        self._simfile.seek(int(self._offset + 20 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_flags(self, val):
+        self._simfile.seek(int(self._offset + 20 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        self._simfile.write(struct.pack("I", val))
+
+    def get_inline(self):
+        self._simfile.seek(int(self._offset + 24 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        return self._simfile.read(S5_INLINE_SIZE)
+
+    def set_inline(self, data):
+        self._simfile.seek(int(self._offset + 24 + S5_NEXTENTS * S5_EXTENT_SIZE))
+        self._simfile.write(data + b"\0" * (S5_INLINE_SIZE - len(data)))
+
+    def is_inline(self):
+        return self.get_flags() & S5_INODE_INLINE != 0
+
+    def _uninline(self):
+        data = self.get_inline()[:self.get_size()]
+        self.set_flags(self.get_flags() & ~S5_INODE_INLINE)
+        self.set_inline(b"")
+        self._alloc_file_block(0).write(0, data)
+
+    def clear_block_map(self):
+        for i in range(S5_NEXTENTS):
+            self.set_extent(i, 0, 0, 0)
+        self.set_indirect_blockno(0)
+        self.set_dindirect_blockno(0)
+        self.set_flags(0)
+        self.set_inline(b"")
+
+    def _indirect_slot(self, blockloc, alloc=False):
+        # returns the indirect block and the offset in it of the entry for
+        # file block blockloc, or None if there is no such block yet
+        if (blockloc < S5_NIDIRECT_BLOCKS):
+            get, put, index = self.get_indirect_blockno, self.set_indirect_blockno, blockloc
+        else:
+            index = blockloc - S5_NIDIRECT_BLOCKS
+            dindirect = self.get_dindirect_blockno()
+            if (dindirect == 0):
+                if (not alloc):
+                    return None
+                block = self._simdisk.alloc_block()
+                block.zero()
+                dindirect = block.get_blockno()
+                self.set_dindirect_blockno(dindirect)
+            dblock = self._simdisk.get_block(dindirect)
+            doff = (index // S5_NIDIRECT_BLOCKS) * 4
+            get = lambda: struct.unpack("I", dblock.read(doff, 4))[0]
+            put = lambda val: dblock.write(doff, struct.pack("I", val))
+            index %= S5_NIDIRECT_BLOCKS
+        if (get() == 0):
+            if (not alloc):
+                return None
+            block = self._simdisk.alloc_block()
+            block.zero()
+            put(block.get_blockno())
+        return (self._simdisk.get_block(get()), index * 4)
+
+    def map_block(self, blockloc):
+        # returns the disk block file block blockloc is stored in, 0 if sparse
+        for i in range(S5_NEXTENTS):
+            (block, start, length) = self.get_extent(i)
+            if (block <= blockloc < block + length):
+                return start + blockloc - block
+        slot = self._indirect_slot(blockloc)
+        if (slot == None):
+            return 0
+        return struct.unpack("I", slot[0].read(slot[1], 4))[0]
+
+    def _alloc_file_block(self, blockloc):
+        # allocates file block blockloc, which is sparse, the way the kernel
+        # does in s5_file_block_to_disk_block
+        prev = None
+        unused = None
+        for i in range(S5_NEXTENTS):
+            (block, start, length) = self.get_extent(i)
+            if (length == 0):
+                unused = i if unused == None else unused
+            elif (block + length == blockloc):
+                prev = i
+        goal = None
+        if (prev != None):
+            (block, start, length) = self.get_extent(prev)
+            goal = start + length
+        new = self._simdisk.alloc_block(goal)
+        new.zero()
+        if (goal != None and new.get_blockno() == goal):
+            self.set_extent(prev, block, start, length + 1)
+        elif (unused != None):
+            self.set_extent(unused, blockloc, new.get_blockno(), 1)
+        else:
+            slot = self._indirect_slot(blockloc, alloc=True)
+            slot[0].write(slot[1], struct.pack("I", new.get_blockno()))
+        return new
+
+    def write_packed(self, data):
+        # writes all of an empty file at once the way the packed layout wants
+        # it: in the inode if it fits, otherwise in one run of blocks mapped
+        # by a single extent, or block by block if there is no such run
+        if (self.get_size() != 0 or self.is_inline()):
+            raise S5fsException("cannot pack data into inode {0}, it is not empty".format(self._number))
+        if (len(data) == 0):
+            return
+        if (len(data) <= S5_INLINE_SIZE):
+            self.set_inline(data)
+            self.set_flags(self.get_flags() | S5_INODE_INLINE)
+            self.set_size(len(data))
+            return
+        count = math.ceil(len(data) / S5_BLOCK_SIZE)
+        start = self._simdisk.alloc_run(count)
+        if (start == None):
+            self.write(0, data)
+            return
+        self._simdisk._simfile.seek(start * S5_BLOCK_SIZE)
+        self._simdisk._simfile.write(data + b"\0" * (count * S5_BLOCK_SIZE - len(data)))
+        self.set_extent(0, 0, start, count)
+        self.set_size(len(data))
+
+    def _free_indirect_if_empty(self, blockno):
+        block = self._simdisk.get_block(blockno)
+        if (block.read() != b"\0" * S5_BLOCK_SIZE):
+            return False
+        block.free()
+        return True
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -187,16 +328,15 @@ class Inode:
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
-            res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
-            for i in range(S5_NDIRECT_BLOCKS):
-                res += " {0:5}".format(self.get_direct_blockno(i))
-                if ((i + 1) % 4 == 0):
-                    res += "\n"
-            if (res[-1] != "\n"):
-                res += "\n"
+            res += "extents ({0}):\n".format(S5_NEXTENTS)
+            for i in range(S5_NEXTENTS):
+                (block, start, length) = self.get_extent(i)
+                if (length != 0):
+                    res += "  blocks {0}-{1} at {2}-{3}\n".format(block, block + length - 1, start, start + length - 1)
+            if (self.is_inline()):
+                res += "inline data: {0} bytes\n".format(min(self.get_size(), S5_INLINE_SIZE))
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
-        elif (self.get_type() == S5_TYPE_FREE):
-            res += "next free: {0}\n".format(self.get_next_free())
+            res += "double indirect block: {0}\n".format(self.get_dindirect_blockno())
         res = res[:-1]
         return res
 
@@ -211,18 +351,14 @@ class Inode:
             blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             amount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
+            if (blockno == 0 and self.is_inline()):
+                res += (self.get_inline() + b"\0" * S5_BLOCK_SIZE)[blockoff:blockoff + amount]
+                offset += amount
+                size -= amount
+                continue
+            blockno = self.map_block(blockno)
             if (blockno == 0):
-                for i in range(amount):
-                    res += '\0'
+                res += b"\0" * amount
             else:
                 res += self._simdisk.get_block(blockno).read(blockoff, amount)
             offset += amount
@@ -234,30 +370,16 @@ class Inode:
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
         if (offset + len(data) > S5_MAX_FILE_SIZE):
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
+        if (self.is_inline() and len(data) > 0):
+            self._uninline()
         remaining = len(data)
         while (remaining > 0):
             blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             amount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
+            blockno = self.map_block(blockloc)
             if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
+                block = self._alloc_file_block(blockloc)
             else:
                 block = self._simdisk.get_block(blockno)
             if (remaining == amount):
@@ -270,36 +392,40 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        if (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_indirect_blockno(0)
-            else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+        if (self.is_inline()):
+            if (size == 0):
+                self.set_flags(self.get_flags() & ~S5_INODE_INLINE)
+            self.set_inline(self.get_inline()[:size])
+        # frees every block from file block target on
+        target = math.ceil(size / S5_BLOCK_SIZE)
+        for i in range(S5_NEXTENTS):
+            (block, start, length) = self.get_extent(i)
+            keep = min(length, max(0, target - block))
+            for j in range(keep, length):
+                self._simdisk.get_block(start + j).free()
+            if (keep == 0):
+                self.set_extent(i, 0, 0, 0)
+            elif (keep < length):
+                self.set_extent(i, block, start, keep)
+        end = math.ceil(self.get_size() / S5_BLOCK_SIZE)
+        for curr in range(target, end):
+            slot = self._indirect_slot(curr)
+            if (slot == None):
+                continue
+            blockno = struct.unpack("I", slot[0].read(slot[1], 4))[0]
+            if (blockno != 0):
+                self._simdisk.get_block(blockno).free()
+                slot[0].write(slot[1], struct.pack("I", 0))
+        if (self.get_dindirect_blockno() != 0):
+            dblock = self._simdisk.get_block(self.get_dindirect_blockno())
+            for i in range(S5_NIDIRECT_BLOCKS):
+                blockno = struct.unpack("I", dblock.read(i * 4, 4))[0]
+                if (blockno != 0 and self._free_indirect_if_empty(blockno)):
+                    dblock.write(i * 4, struct.pack("I", 0))
+            if (self._free_indirect_if_empty(self.get_dindirect_blockno())):
+                self.set_dindirect_blockno(0)
+        if (self.get_indirect_blockno() != 0 and self._free_indirect_if_empty(self.get_indirect_blockno())):
+            self.set_indirect_blockno(0)
         self.set_size(size)
 
     def _find_dirent(self, name, types=S5_TYPES):
@@ -382,9 +508,7 @@ class Inode:
             inode.set_type(S5_TYPE_DATA)
             inode.set_size(0)
             inode.set_link_count(1)
-            for i in range(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.clear_block_map()
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -397,9 +521,7 @@ class Inode:
             inode.set_type(S5_TYPE_DIR)
             inode.set_size(0)
             inode.set_link_count(2)
-            for i in range(S5_NDIRECT_BLOCKS):
-                inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            inode.clear_block_map()
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -465,8 +587,8 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
-        self.set_next_free(self._simdisk.get_free_inode())
-        self._simdisk.set_free_inode(self._number)
+        self._simdisk._set_ibit(self._number, False)
+        self._simdisk.set_nfree_inodes(self._simdisk.get_nfree_inodes() + 1)
 
 class Simdisk:
 
@@ -481,11 +603,11 @@ class Simdisk:
         self._simfile.seek(0)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_inode(self):
+    def get_nfree_inodes(self):
         self._simfile.seek(4)
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_free_inode(self, val):
+    def set_nfree_inodes(self, val):
         self._simfile.seek(4)
         self._simfile.write(struct.pack("I", val))
 
@@ -497,46 +619,80 @@ class Simdisk:
         self._simfile.seek(8)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_block(self, index):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            return struct.unpack("I", self._simfile.read(4))[0]
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
+    def get_num_blocks(self):
+        self._simfile.seek(12)
+        return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_free_block(self, index, val):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            self._simfile.write(struct.pack("I", val))
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
+    def set_num_blocks(self, val):
+        self._simfile.seek(12)
+        self._simfile.write(struct.pack("I", val))
 
-    def get_last_free_block(self):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
+    def get_bitmap_block(self):
+        self._simfile.seek(16)
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_last_free_block(self, val):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
+    def set_bitmap_block(self, val):
+        self._simfile.seek(16)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_nblocks(self):
+        self._simfile.seek(20)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_nblocks(self, val):
+        self._simfile.seek(20)
         self._simfile.write(struct.pack("I", val))
 
     def get_root_inode(self):
-        self._simfile.seek(12 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.seek(24)
         return struct.unpack("I", self._simfile.read(4))[0]
 
     def get_num_inodes(self):
-        self._simfile.seek(16 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.seek(28)
         return struct.unpack("I", self._simfile.read(4))[0]
 
     def set_num_inodes(self, val):
-        self._simfile.seek(16 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.seek(28)
         self._simfile.write(struct.pack("I", val))
 
     def get_version(self):
-        self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.seek(32)
         return struct.unpack("I", self._simfile.read(4))[0]
 
     def set_version(self, val):
-        self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.seek(32)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_block(self):
+        self._simfile.seek(36)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_block(self, val):
+        self._simfile.seek(36)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_nblocks(self):
+        self._simfile.seek(40)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_nblocks(self, val):
+        self._simfile.seek(40)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_ibitmap_block(self):
+        self._simfile.seek(44)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_ibitmap_block(self, val):
+        self._simfile.seek(44)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_ibitmap_nblocks(self):
+        self._simfile.seek(48)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_ibitmap_nblocks(self, val):
+        self._simfile.seek(48)
         self._simfile.write(struct.pack("I", val))
 
     def get_super_block_summary(self):
@@ -544,16 +700,16 @@ class Simdisk:
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
         res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
-        res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
+        res += "free inodes: {0}{1}\n".format(self.get_nfree_inodes(), "" if self.get_nfree_inodes() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
-        res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
-        for i in range(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
-            res += "  {0}".format(self.get_free_block(i))
-            if ((i + 1) % 10 == 0):
-                res += "\n"
-        if (res[-1] != "\n"):
-            res += "\n"
-        res += "  last free block: {0}\n".format(self.get_last_free_block())
+        res += "num blocks: {0}\n".format(self.get_num_blocks())
+        res += "free blocks: {0}{1}\n".format(self.get_nfree(), "" if self.get_nfree() < self.get_num_blocks() else " (INVALID)")
+        res += "bitmap:     blocks {0}-{1}\n".format(self.get_bitmap_block(), self.get_bitmap_block() + self.get_bitmap_nblocks() - 1)
+        res += "inode bitmap: blocks {0}-{1}\n".format(self.get_ibitmap_block(), self.get_ibitmap_block() + self.get_ibitmap_nblocks() - 1)
+        if (self.get_journal_nblocks()):
+            res += "journal:    blocks {0}-{1}\n".format(self.get_journal_block(), self.get_journal_block() + self.get_journal_nblocks() - 1)
+        else:
+            res += "journal:    none\n"
         return res
 
     def format(self, inodes, size):
@@ -576,29 +732,38 @@ class Simdisk:
             inode = self.get_inode(i)
             inode.set_number(i)
             inode.set_type(S5_TYPE_FREE)
-            inode.set_next_free(i + 1)
-        inode.set_next_free(0xffffffff)
-        self.set_free_inode(0)
-
-        self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in range(iblocks+1, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in range(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+            inode.set_size(0)
+        self.set_nfree_inodes(inodes)
+
+        # every block before the data blocks, and every bit past the end of
+        # the disk, is in use
+        bblocks = int(math.floor((blocks - 1) / S5_BITS_PER_BLOCK) + 1)
+        ibblocks = int(math.floor((inodes - 1) / S5_BITS_PER_BLOCK) + 1)
+        if (iblocks + bblocks + ibblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes and bitmaps require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bblocks + ibblocks) * S5_BLOCK_SIZE))
+        self.set_num_blocks(blocks)
+        self.set_bitmap_block(iblocks + 1)
+        self.set_bitmap_nblocks(bblocks)
+        self.set_ibitmap_block(iblocks + 1 + bblocks)
+        self.set_ibitmap_nblocks(ibblocks)
+        # the journal comes right after the bitmap, and takes up to a
+        # quarter of the data blocks; the kernel does without one if there
+        # is no room for a header and a block
+        first = iblocks + 1 + bblocks + ibblocks
+        jblocks = min(S5_JOURNAL_NBLOCKS, (blocks - first) // 4)
+        jblocks = jblocks if jblocks >= 2 else 0
+        self.set_journal_block(first if jblocks else 0)
+        self.set_journal_nblocks(jblocks)
+        for num in range(iblocks + 1, first + jblocks):
+            self.get_block(num).zero()
+        for num in list(range(first + jblocks)) + list(range(blocks, bblocks * S5_BITS_PER_BLOCK)):
+            self._set_bit(num, True)
+        for num in range(inodes, ibblocks * S5_BITS_PER_BLOCK):
+            self._set_ibit(num, True)
+        self.set_nfree(blocks - first - jblocks)
 
         root = self.alloc_inode()
-        for i in range(S5_NDIRECT_BLOCKS):
-            root.set_direct_blockno(i, 0)
-        root.set_indirect_blockno(0)
+        root.clear_block_map()
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(2)
@@ -606,14 +771,9 @@ class Simdisk:
         root._make_dirent(root.get_number(), "..")
 
     def free_inodes(self):
-        inext = self.get_free_inode()
-        while (inext != 0xffffffff):
-            try:
-                curr = self.get_inode(inext)
-                yield inext
-                inext = curr.get_free_inode()
-            except S5fsException as e:
-                raise S5fsException("error encountered while iterating free inodes: {0}".format(str(e)))
+        for num in range(self.get_num_inodes()):
+            if (not self._get_ibit(num)):
+                yield num
 
     def get_inode(self, index):
         offset = S5_BLOCK_SIZE * (1 + math.floor(index / S5_INODES_PER_BLOCK)) + S5_INODE_SIZE * (index % S5_INODES_PER_BLOCK)
@@ -622,32 +782,87 @@ class Simdisk:
         return Inode(self, index, offset)
 
     def alloc_inode(self):
-        if (self.get_free_inode() == 0xffffffff):
-            raise S5fsException("disk is out of inodes")
-        inode = self.get_inode(self.get_free_inode())
-        self.set_free_inode(inode.get_next_free())
-        return inode
+        # the first free inode; the kernel looks near the parent first, see
+        # s5_alloc_inode, but here the inodes are handed out in order anyway
+        for num in self.free_inodes():
+            self._set_ibit(num, True)
+            self.set_nfree_inodes(self.get_nfree_inodes() - 1)
+            return self.get_inode(num)
+        raise S5fsException("disk is out of inodes")
 
     def get_block(self, index):
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
-        if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
-            raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
+    def _bit_offset(self, num):
+        return (self.get_bitmap_block() + num // S5_BITS_PER_BLOCK) * S5_BLOCK_SIZE + (num % S5_BITS_PER_BLOCK) // 8
+
+    def _get_bit(self, num):
+        self._simfile.seek(self._bit_offset(num))
+        return (self._simfile.read(1)[0] >> (num % 8)) & 1 == 1
+
+    def _set_bit(self, num, used):
+        self._simfile.seek(self._bit_offset(num))
+        byte = self._simfile.read(1)[0]
+        byte = (byte | (1 << (num % 8))) if used else (byte & ~(1 << (num % 8)))
+        self._simfile.seek(self._bit_offset(num))
+        self._simfile.write(bytes([byte]))
+
+    def _ibit_offset(self, num):
+        return (self.get_ibitmap_block() + num // S5_BITS_PER_BLOCK) * S5_BLOCK_SIZE + (num % S5_BITS_PER_BLOCK) // 8
+
+    def _get_ibit(self, num):
+        self._simfile.seek(self._ibit_offset(num))
+        return (self._simfile.read(1)[0] >> (num % 8)) & 1 == 1
+
+    def _set_ibit(self, num, used):
+        self._simfile.seek(self._ibit_offset(num))
+        byte = self._simfile.read(1)[0]
+        byte = (byte | (1 << (num % 8))) if used else (byte & ~(1 << (num % 8)))
+        self._simfile.seek(self._ibit_offset(num))
+        self._simfile.write(bytes([byte]))
+
+    def set_block_used(self, num, used):
+        if (num < self.get_bitmap_block() + self.get_bitmap_nblocks() or num >= self.get_num_blocks()):
+            raise S5fsException("block {0} is not a data block".format(num))
+        if (self._get_bit(num) == used):
+            raise S5fsException("block {0} is already {1}".format(num, "in use" if used else "free"))
+        self._set_bit(num, used)
+        self.set_nfree(self.get_nfree() + (-1 if used else 1))
+
+    def alloc_block(self, goal=None):
+        # hands out goal if it is free, otherwise the first free block after
+        # it, like s5_alloc_block
         if (self.get_nfree() == 0):
-            if (self.get_last_free_block() == 0xffffffff):
-                raise S5fsDiskSpaceException()
-            else:
-                block = self.get_block(self.get_last_free_block())
-                for i in range(S5_NBLKS_PER_FNODE - 1):
-                    self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
-                self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
-                self.set_nfree(S5_NBLKS_PER_FNODE - 1)
-            return block
-        else:
-            self.set_nfree(self.get_nfree() - 1)
-            return self.get_block(self.get_free_block(self.get_nfree()))
+            raise S5fsDiskSpaceException()
+        first = self.get_bitmap_block() + self.get_bitmap_nblocks()
+        ndata = self.get_num_blocks() - first
+        start = goal if (goal != None and first <= goal < self.get_num_blocks()) else first
+        for i in range(ndata):
+            num = first + (start - first + i) % ndata
+            if (not self._get_bit(num)):
+                self.set_block_used(num, True)
+                return self.get_block(num)
+        raise S5fsDiskSpaceException()
+
+    def alloc_run(self, count):
+        # allocates count consecutive free blocks and returns the first, or
+        # None if there is no such run; the search starts where the last run
+        # ended, so that runs allocated one after another follow each other
+        first = self.get_bitmap_block() + self.get_bitmap_nblocks()
+        end = self.get_num_blocks()
+        hint = getattr(self, "_run_hint", first)
+        for (lo, hi) in ((hint, end), (first, min(end, hint + count - 1))):
+            run = 0
+            for num in range(lo, hi):
+                run = 0 if self._get_bit(num) else run + 1
+                if (run == count):
+                    start = num - count + 1
+                    for b in range(start, num + 1):
+                        self.set_block_used(b, True)
+                    self._run_hint = num + 1
+                    return start
+        return None
 
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
@@ -70,6 +70,8 @@ class FsmakerShell(cmd.Cmd):
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
                                       help="initializes the disk with the contents of the specified directory")
+        self._parse_format.add_option("-p", "--packed", action="store_true", default=False,
+                                      help="with -d, lays the files out for reading: each directory's inodes together, each file in one run of blocks (or in its inode if it is small) right after its directory's entries")
 
     def open(self, path, create=False):
         if (path.startswith("/")):
@@ -650,7 +652,11 @@ class FsmakerShell(cmd.Cmd):
                 size = options.blocks * api.S5_BLOCK_SIZE
             self._simdisk.format(options.inodes, size)
 
-        if (options.directory):
+        if (options.directory and options.packed):
+            root = self._simdisk.get_inode(self._simdisk.get_root_inode())
+            root.truncate()
+            self.pack_dir(options.directory, root, root)
+        elif (options.directory):
             q = queue.Queue()
             q.put(".")
             while(not q.empty()):
@@ -668,6 +674,38 @@ class FsmakerShell(cmd.Cmd):
                     dest = self.open(os.path.join("/", curr), create=True)
                     self.getfile(source, dest)
 
+    def pack_dir(self, real, directory, parent):
+        # fills the empty directory with the contents of the real one: the
+        # inodes of all of its entries first, so they are numbered together,
+        # then its entries in one go, then each file's data, then each
+        # subdirectory the same way
+        children = []
+        for name in sorted(os.listdir(real)):
+            if (len(name) >= api.S5_NAME_LEN):
+                raise api.S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, api.S5_NAME_LEN - 1))
+            path = os.path.join(real, name)
+            inode = self._simdisk.alloc_inode()
+            inode.clear_block_map()
+            inode.set_size(0)
+            if (stat.S_ISDIR(os.stat(path).st_mode)):
+                inode.set_type(api.S5_TYPE_DIR)
+                inode.set_link_count(2)
+                directory.set_link_count(directory.get_link_count() + 1)
+            else:
+                inode.set_type(api.S5_TYPE_DATA)
+                inode.set_link_count(1)
+            children.append((name, path, inode))
+        entries = [(".", directory), ("..", parent)] + [(name, inode) for (name, path, inode) in children]
+        directory.write_packed(b"".join(struct.pack("I", inode.get_number()) + name.encode("utf8").ljust(api.S5_NAME_LEN, b"\0")
+                                        for (name, inode) in entries))
+        for (name, path, inode) in children:
+            if (inode.get_type() == api.S5_TYPE_DATA):
+                with open(path, 'rb') as source:
+                    inode.write_packed(source.read())
+        for (name, path, inode) in children:
+            if (inode.get_type() == api.S5_TYPE_DIR):
+                self.pack_dir(path, inode, directory)
+
     def default(self, line):
         if (line.strip() == "EOF"):
             print("\n")
@@ -7,6 +7,56 @@
 
 #define LINE_LEN 16
 
+/* Input is read a chunk at a time, and a chunk's lines are formatted into
+ * one buffer and written together. A line of output takes at most
+ * 10 + 3 * LINE_LEN + 1 + 1 + LINE_LEN + 2 bytes. */
+#define CHUNK_LEN (4096 * LINE_LEN)
+#define OUT_LINE_LEN 80
+
+static char chunk[CHUNK_LEN];
+static char out[CHUNK_LEN / LINE_LEN * OUT_LINE_LEN + 16];
+static const char hex[] = "0123456789abcdef";
+
+/* Formats x as eight hex digits at p and returns the end */
+static char *put_offset(char *p, unsigned int x)
+{
+    int i;
+    for (i = 7; i >= 0; --i)
+    {
+        p[i] = hex[x & 0xf];
+        x >>= 4;
+    }
+    return p + 8;
+}
+
+/* Fills chunk as far as read() allows, so that only the very end of the
+ * input makes a short line. Returns the bytes read, or -1. */
+static int fill(int fd)
+{
+    int len = 0, bytes;
+    while (len < CHUNK_LEN &&
+           (bytes = read(fd, chunk + len, CHUNK_LEN - len)) > 0)
+    {
+        len += bytes;
+    }
+    return len ? len : bytes;
+}
+
+static int flush_out(char *end)
+{
+    size_t len = end - out, done = 0;
+    while (done < len)
+    {
+        ssize_t bytes = write(1, out + done, len - done);
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        done += bytes;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     int readfd = 0;
@@ -26,61 +76,74 @@ int main(int argc, char **argv)
     }
 
     char lastbuf[LINE_LEN];
-    char curbuf[LINE_LEN];
-    int off = 0;
+    unsigned int off = 0;
     int lastrep = 0;
-    int bytes;
+    int len;
 
-    int i;
-    while ((bytes = read(readfd, curbuf, LINE_LEN)) > 0)
+    int i, pos;
+    while ((len = fill(readfd)) > 0)
     {
-        if (off > 0 && !memcmp(lastbuf, curbuf, LINE_LEN))
+        char *p = out;
+        for (pos = 0; pos < len; pos += LINE_LEN)
         {
-            if (!lastrep)
+            char *curbuf = chunk + pos;
+            int bytes = len - pos < LINE_LEN ? len - pos : LINE_LEN;
+            if (off > 0 && bytes == LINE_LEN &&
+                !memcmp(lastbuf, curbuf, LINE_LEN))
             {
-                printf("*\n");
-                lastrep = 1;
+                if (!lastrep)
+                {
+                    *p++ = '*';
+                    *p++ = '\n';
+                    lastrep = 1;
+                }
+                off += bytes;
+                continue;
             }
+            lastrep = 0;
+            p = put_offset(p, off);
+            *p++ = ' ';
+            *p++ = ' ';
             off += bytes;
-            continue;
-        }
-        lastrep = 0;
-        printf("%08x  ", off);
-        off += bytes;
-        /* print bytes */
-        for (i = 0; i < LINE_LEN; ++i)
-        {
-            if (i < bytes)
+            /* print bytes */
+            for (i = 0; i < LINE_LEN; ++i)
             {
-                printf("%02x ", (unsigned char)curbuf[i]);
+                if (i < bytes)
+                {
+                    unsigned char c = curbuf[i];
+                    *p++ = hex[c >> 4];
+                    *p++ = hex[c & 0xf];
+                }
+                else
+                {
+                    *p++ = ' ';
+                    *p++ = ' ';
+                }
+                *p++ = ' ';
+                if (i == 7)
+                {
+                    *p++ = ' ';
+                }
             }
-            else
+            /* show printable characters */
+            *p++ = '|';
+            for (i = 0; i < bytes; ++i)
             {
-                printf("   ");
-            }
-            if (i == 7)
-            {
-                printf(" ");
+                char c = curbuf[i];
+                *p++ = (c < 32 || c > 126) ? '.' : c;
             }
+            *p++ = '|';
+            *p++ = '\n';
+            memcpy(lastbuf, curbuf, LINE_LEN);
         }
-        /* show printable characters */
-        printf("|");
-        for (i = 0; i < bytes; ++i)
+        if (flush_out(p) < 0)
         {
-            char c = curbuf[i];
-            if (c < 32 || c > 126)
-            {
-                printf(".");
-            }
-            else
-            {
-                printf("%c", c);
-            }
+            return 1;
         }
-        printf("|\n");
-        memcpy(lastbuf, curbuf, LINE_LEN);
     }
-    printf("%08x\n", off);
+    char *p = put_offset(out, off);
+    *p++ = '\n';
+    flush_out(p);
 
     if (readfd > 0)
     {
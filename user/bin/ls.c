@@ -10,10 +10,12 @@ static int do_ls(const char *dir)
     int fd;
     struct dirent *dirent;
     int nbytes;
-    char tmpbuf[256];
     stat_t sbuf;
 
-    union {
+    /* Each getdents() fills as many entries as fit, a page's worth at most,
+     * and each entry is stated relative to fd rather than by the whole path
+     * from here */
+    static union {
         struct dirent dirent;
         char buf[4096];
     } lsb;
@@ -42,8 +44,7 @@ static int do_ls(const char *dir)
             int reclen;
             int size;
 
-            snprintf(tmpbuf, sizeof(tmpbuf), "%s/%s", dir, dirent->d_name);
-            if (0 == stat(tmpbuf, &sbuf))
+            if (0 == fstatat(fd, dirent->d_name, &sbuf))
             {
                 size = sbuf.st_size;
             }
@@ -87,6 +87,8 @@ DECL_CMD(parallel);
 
 DECL_CMD(time);
 
+DECL_CMD(hash);
+
 typedef struct
 {
     const char *cmd_name;
@@ -117,6 +119,7 @@ static cmd_t builtin_cmds[] = {
     {"repeat", cmd_repeat, "repeat a command"},
     {"parallel", cmd_parallel, "run multiple commands in parallel"},
     {"time", cmd_time, "time a command"},
+    {"hash", cmd_hash, "list (or, with -r, forget) where commands were found"},
     {NULL, NULL, NULL}};
 
 #define builtin_stdin (&io->io_map_file[0])
@@ -1407,27 +1410,171 @@ DECL_CMD(time)
     return ret;
 }
 
-static int do_redirect(redirect_map_t *map)
+/*
+ * Where commands were found, so that each name is looked for in the search
+ * directories once rather than tried there with a failing spawn() each
+ * time it is run. Entries are added as commands are first found, and one is
+ * dropped when its binary turns out to be gone.
+ */
+#define HASH_BUCKETS 64
+
+typedef struct hash_entry
 {
-    int ii;
-    int newfd, oldfd;
+    char *he_name;
+    char *he_path;
+    unsigned he_hits;
+    struct hash_entry *he_next;
+} hash_entry_t;
 
-    for (ii = 0; ii < map->rm_nfds; ii++)
+static hash_entry_t *cmd_hash_table[HASH_BUCKETS];
+
+static const char *search_directories[] = {"/usr/bin/", "/bin/", "/sbin/"};
+
+static hash_entry_t **hash_bucket(const char *name)
+{
+    unsigned h = 5381;
+    while (*name)
+    {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return &cmd_hash_table[h % HASH_BUCKETS];
+}
+
+static hash_entry_t **hash_find(const char *name)
+{
+    hash_entry_t **hep;
+    for (hep = hash_bucket(name); *hep; hep = &(*hep)->he_next)
     {
-        oldfd = map->rm_redir[ii].r_sfd;
-        newfd = map->rm_redir[ii].r_dfd;
+        if (!strcmp((*hep)->he_name, name))
+        {
+            break;
+        }
+    }
+    return hep;
+}
 
-        dbg((stderr, "do_redirect: dup2(%d,%d)\n", oldfd, newfd));
+static void hash_remove(hash_entry_t **hep)
+{
+    hash_entry_t *he = *hep;
+    *hep = he->he_next;
+    free(he->he_name);
+    free(he->he_path);
+    free(he);
+}
+
+static int is_file(const char *path)
+{
+    struct stat st;
+    return !stat(path, &st) && S_ISREG(st.st_mode);
+}
 
-        if (dup2(oldfd, newfd) < 0)
+/*
+ * Where to find the command name: the name itself if it has a slash or
+ * names a file here, otherwise where the hash table says or the first of
+ * the search directories that has it, which is then hashed. Sets *hashed
+ * to whether the table was used. Returns NULL if there is no such command.
+ */
+static const char *lookup_command(const char *name, int *hashed)
+{
+    *hashed = 0;
+    if (strchr(name, '/'))
+    {
+        return name;
+    }
+    hash_entry_t **hep = hash_find(name);
+    if (*hep)
+    {
+        (*hep)->he_hits++;
+        *hashed = 1;
+        return (*hep)->he_path;
+    }
+    if (is_file(name))
+    {
+        return name;
+    }
+
+    char buf[256];
+    for (unsigned i = 0; i < sizeof(search_directories) / sizeof(char *); i++)
+    {
+        snprintf(buf, sizeof(buf), "%s%s", search_directories[i], name);
+        if (!is_file(buf))
         {
-            fprintf(stderr,
-                    "do_redirect: dup2() failed: "
-                    "%s\n",
-                    strerror(errno));
-            return -1;
+            continue;
+        }
+        hash_entry_t *he = malloc(sizeof(*he));
+        if (!he || !(he->he_name = strdup(name)))
+        {
+            free(he);
+            return NULL;
+        }
+        if (!(he->he_path = strdup(buf)))
+        {
+            free(he->he_name);
+            free(he);
+            return NULL;
+        }
+        he->he_hits = 1;
+        he->he_next = NULL;
+        *hep = he;
+        *hashed = 1;
+        return he->he_path;
+    }
+    return NULL;
+}
+
+/*
+ * Starts path with dups applied on its side, by spawn() or, on a kernel
+ * without it, fork() and execve(). Returns its pid, or -1 with errno set.
+ */
+static int start_command(const char *path, char *argv[], int ndups,
+                         int dups[][2])
+{
+    int pid = spawn(path, argv, my_envp, ndups, dups);
+    if (pid >= 0 || errno != ENOSYS)
+    {
+        return pid;
+    }
+    if (!(pid = fork()))
+    {
+        for (int ii = 0; ii < ndups; ii++)
+        {
+            if (dups[ii][0] != dups[ii][1])
+            {
+                dup2(dups[ii][0], dups[ii][1]);
+                close(dups[ii][0]);
+            }
+        }
+        execve(path, argv, my_envp);
+        _Exit(errno); /* the shell's unflushed output is not the child's */
+    }
+    return pid;
+}
+
+DECL_CMD(hash)
+{
+    if (argc == 2 && !strcmp(argv[1], "-r"))
+    {
+        for (unsigned i = 0; i < HASH_BUCKETS; i++)
+        {
+            while (cmd_hash_table[i])
+            {
+                hash_remove(&cmd_hash_table[i]);
+            }
+        }
+        return 0;
+    }
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: hash [-r]\n");
+        return 1;
+    }
+    fprintf(stdout, "hits    command\n");
+    for (unsigned i = 0; i < HASH_BUCKETS; i++)
+    {
+        for (hash_entry_t *he = cmd_hash_table[i]; he; he = he->he_next)
+        {
+            fprintf(stdout, "%4u    %s\n", he->he_hits, he->he_path);
         }
-        close(oldfd);
     }
     return 0;
 }
@@ -1494,25 +1641,38 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
         return 0;
     }
 
-    if (!(pid = fork()))
+    /* The child is started straight from the binary, with the redirections
+     * applied on its side, rather than forking a copy of the shell only to
+     * throw it away in execve. */
+    int dups[REDIR_MAX][2];
+    for (int ii = 0; ii < map->rm_nfds; ii++)
     {
-        if (do_redirect(map) < 0)
+        dups[ii][0] = map->rm_redir[ii].r_sfd;
+        dups[ii][1] = map->rm_redir[ii].r_dfd;
+    }
+    int hashed;
+    const char *path = lookup_command(argv[0], &hashed);
+    if (!path)
+    {
+        errno = ENOENT;
+        pid = -1;
+    }
+    else if ((pid = start_command(path, argv, map->rm_nfds, dups)) < 0 &&
+             errno == ENOENT && hashed)
+    {
+        /* It has gone since it was hashed: look again */
+        hash_remove(hash_find(argv[0]));
+        if ((path = lookup_command(argv[0], &hashed)))
         {
-            exit(1);
+            pid = start_command(path, argv, map->rm_nfds, dups);
         }
-
-        execve(argv[0], argv, my_envp);
-
-        char *search_directories[] = {"/usr/bin/", "/bin/", "/sbin/"};
-        char buf[256];
-
-        for (unsigned i = 0;
-             errno == ENOENT && i < sizeof(search_directories) / sizeof(char *);
-             i++)
+        else
         {
-            snprintf(buf, sizeof(buf), "%s/%s", search_directories[i], argv[0]);
-            execve(buf, argv, my_envp);
+            errno = ENOENT;
         }
+    }
+    if (pid < 0)
+    {
         if (errno == ENOENT)
         {
             fprintf(stderr, "sh: command not found: %s\n", argv[0]);
@@ -1522,14 +1682,9 @@ static int execute(int argc, char *argv[], redirect_map_t *map)
             fprintf(stderr, "sh: exec failed for %s: %s\n", argv[0],
                     strerror(errno));
         }
-        exit(errno);
-    }
-    else
-    {
-        if (0 > pid)
-        {
-            fprintf(stderr, "sh: fork failed errno = %d\n", errno);
-        }
+        status = errno;
+        cleanup_redirects(map);
+        return status;
     }
 
     cleanup_redirects(map);
@@ -16,3 +16,12 @@
 #define O_CREAT 0x100  /* Create file if non-existent. */
 #define O_TRUNC 0x200  /* Truncate to zero length. */
 #define O_APPEND 0x400 /* Append to file. */
+#define O_DIRECT 0x800 /* Transfer between the disk and the user's buffer,
+                          bypassing the page cache; see do_direct_rw(). */
+
+/* Flags for fallocate(). */
+#define FALLOC_FL_KEEP_SIZE 0x01 /* Leave the size alone, preallocating past
+                                    the end of the file. */
+
+/* The dirfd for the *at() calls that means the working directory */
+#define AT_FDCWD (-100)
@@ -34,6 +34,8 @@ int pthread_detach(pthread_t thr);
 
 int pthread_equal(pthread_t, pthread_t);
 
+pthread_t pthread_self(void);
+
 void pthread_exit(void *retval);
 
 int pthread_join(pthread_t thr, void **retval);
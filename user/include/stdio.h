@@ -5,8 +5,13 @@
 #include "stddef.h"
 #include "sys/types.h"
 
-/* Output not buffered */
-#define __IONBF 1
+/* Buffering modes, for setvbuf() */
+#define _IOFBF 0 /* written out when the buffer fills */
+#define _IOLBF 1 /* written out at each newline, too */
+#define _IONBF 2 /* written out at once */
+
+/* The size of a stream's buffer, unless setvbuf() says otherwise */
+#define BUFSIZ 8192
 
 #ifndef EOF
 #define EOF (-1)
@@ -16,18 +21,72 @@
 #define NULL 0
 #endif
 
-/* For now, just store a file descriptor */
-typedef struct
+/*
+ * A buffered stream on a file descriptor (see lib/libc/stream.c). Files are
+ * fully buffered, ttys line buffered and stderr unbuffered; a stream is
+ * either reading or writing at a time, and switching flushes its buffer.
+ * Streams are not locked: threads must not share one without their own
+ * lock.
+ */
+typedef struct __FILE
 {
     int fd;
-    int offset;
-    char buffer[8192];
+    int flags;            /* __S* in stream.c */
+    int mode;             /* _IOFBF, _IOLBF or _IONBF, or -1 until first use */
+    char *buf;            /* bufsize bytes, or NULL until first use */
+    size_t bufsize;
+    size_t rpos;          /* reading: buf[rpos, rlen) is yet to be read */
+    size_t rlen;
+    size_t wlen;          /* writing: buf[0, wlen) is yet to be written */
+    char onebuf;          /* the buffer of an unbuffered stream */
+    struct __FILE *next;  /* on the list of open streams */
 } FILE;
 typedef off_t fpos_t;
 extern FILE *stdin;
 extern FILE *stdout;
 extern FILE *stderr;
 
+FILE *fopen(const char *path, const char *mode) __attribute__((__nonnull__));
+
+FILE *fdopen(int fd, const char *mode) __attribute__((__nonnull__(2)));
+
+int fclose(FILE *stream) __attribute__((__nonnull__));
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+    __attribute__((__nonnull__(1, 4)));
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+    __attribute__((__nonnull__(1, 4)));
+
+int setvbuf(FILE *stream, char *buf, int mode, size_t size)
+    __attribute__((__nonnull__(1)));
+
+void setbuf(FILE *stream, char *buf) __attribute__((__nonnull__(1)));
+
+int fgetc(FILE *stream) __attribute__((__nonnull__));
+
+char *fgets(char *s, int size, FILE *stream) __attribute__((__nonnull__));
+
+int ungetc(int c, FILE *stream) __attribute__((__nonnull__));
+
+int fputc(int c, FILE *stream) __attribute__((__nonnull__));
+
+int fputs(const char *s, FILE *stream) __attribute__((__nonnull__));
+
+int fseek(FILE *stream, long offset, int whence) __attribute__((__nonnull__));
+
+long ftell(FILE *stream) __attribute__((__nonnull__));
+
+void rewind(FILE *stream) __attribute__((__nonnull__));
+
+int feof(FILE *stream) __attribute__((__nonnull__));
+
+int ferror(FILE *stream) __attribute__((__nonnull__));
+
+void clearerr(FILE *stream) __attribute__((__nonnull__));
+
+int fileno(FILE *stream) __attribute__((__nonnull__));
+
 /* ANSI C89 */
 int printf(const char *fmt, ...) __attribute__((__format__(printf, 1, 2)))
 __attribute__((__nonnull__(1)));
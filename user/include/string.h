@@ -4,7 +4,7 @@
 #include "stddef.h"
 
 /* ANSI C89 */
-void *memchr(const void *, int, size_t); /* NYI */
+void *memchr(const void *, int, size_t);
 int memcmp(const void *cs, const void *ct, size_t count);
 
 void *memcpy(void *dest, const void *src, size_t count);
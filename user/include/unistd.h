@@ -14,6 +14,8 @@
 #endif
 
 struct dirent;
+struct iovec;
+struct rlimit;
 
 /* User exec-related */
 int fork(void);
@@ -23,25 +25,77 @@ int execle(const char *filename, const char *arg, ...); /* NYI */
 int execv(const char *filename, char *const argv[]);    /* NYI */
 int execve(const char *filename, char *const argv[], char *const envp[]);
 
+/* fork() and execve() in one step. In the child, each dups[i][1] is made a
+ * duplicate of dups[i][0], which is then closed, before filename is loaded.
+ * Returns the child's pid, or -1 with errno set if it could not be started.
+ * The caller's address space is never copied. */
+pid_t spawn(const char *filename, char *const argv[], char *const envp[],
+            int ndups, const int dups[][2]);
+
 /* Kern-related */
 pid_t wait(int *status);
 
+/* waitpid() options */
+#define WNOHANG 1 /* return 0 rather than block if no child has exited */
+
 pid_t waitpid(pid_t pid, int *status, int options);
 
 void thr_exit(int status);
 
+/* Starts a thread at entry(arg), on stack (its initial stack pointer) and
+ * with its FS base at tls; see weenix/syscall.h. Returns its tid. */
+pid_t thr_create(void (*entry)(void *), void *arg, void *stack, void *tls);
+
+int thr_join(pid_t tid, void **retval);
+
+int thr_cancel(pid_t tid);
+
+pid_t gettid(void);
+
+/* Sets the calling thread's FS base */
+int set_tls(void *tls);
+
+/* FUTEX_WAIT sleeps while *addr is val; FUTEX_WAKE wakes up to val of the
+ * threads sleeping on addr and returns how many it woke. */
+int futex(int *addr, int op, int val);
+
+/* Counts hardware events while the calling thread runs, see perfctr(2) in
+ * weenix/syscall.h */
+int perfctr(int op, int events, uint64_t *counts);
+
 int thr_errno(void);
 
 void thr_set_errno(int n);
 
 int sched_yield(void);
 
+int nice(int incr);
+
+/* Limits the threads of process pid (0 for the caller's) to the cores in
+ * *mask, or gets those they may run on; see sched_setaffinity(2) in
+ * weenix/syscall.h */
+int sched_setaffinity(pid_t pid, size_t len, const unsigned long *mask);
+int sched_getaffinity(pid_t pid, size_t len, unsigned long *mask);
+
+/* Gets or sets a limit on the calling process's resources, see getrlimit(2)
+ * in weenix/syscall.h */
+int getrlimit(int resource, struct rlimit *rlim);
+int setrlimit(int resource, const struct rlimit *rlim);
+
+/* Puts the path of the working directory in buf, see getcwd(2) in
+ * weenix/syscall.h; returns buf, or NULL */
+char *getcwd(char *buf, size_t size);
+
 pid_t getpid(void);
 
 int halt(void);
 
 void sync(void);
 
+int fsync(int fd);
+
+int fdatasync(int fd);
+
 size_t get_free_mem(void);
 
 /* VFS-related */
@@ -53,6 +107,47 @@ ssize_t read(int fd, void *buf, size_t count);
 
 ssize_t write(int fd, const void *buf, size_t count);
 
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+int fallocate(int fd, int mode, off_t offset, off_t len);
+
+ssize_t vmsplice(int fd, const struct iovec *iov, int iovcnt,
+                 unsigned int flags);
+
+struct pollfd;
+
+int poll(struct pollfd *fds, int nfds, int timeout);
+
+int ioctl(int fd, unsigned long cmd, void *arg);
+
+int isatty(int fd);
+
+struct epoll_event;
+
+int epoll_create(void);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+struct aio_sqe;
+struct aio_cqe;
+
+int aio_submit(const struct aio_sqe *sqes, int nr);
+
+int aio_reap(struct aio_cqe *cqes, int min_nr, int nr);
+
+struct batch_entry;
+
+int batch(struct batch_entry *entries, int nentries, int flags);
+
 off_t lseek(int fd, off_t offset, int whence);
 
 int dup(int fd);
@@ -74,6 +169,8 @@ int chdir(const char *path);
 int getdents(int fd, struct dirent *dir, size_t size);
 
 int stat(const char *path, struct stat *buf);
+int fstat(int fd, struct stat *buf);
+int fstatat(int dirfd, const char *path, struct stat *buf);
 
 int pipe(int pipefd[2]);
 
@@ -82,18 +179,30 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 
 int munmap(void *addr, size_t len);
 
+void *mremap(void *addr, size_t old_len, size_t new_len, int flags);
+
+int mprotect(void *addr, size_t len, int prot);
+
+int madvise(void *addr, size_t len, int advice);
+
+int shm_open(const char *name, int flags, int mode);
+
+int shm_unlink(const char *name);
+
 int brk(void *addr);
 
 void *sbrk(intptr_t incr);
 
 /* Mounting */
-int mount(const char *source, const char *target, const char *filesystemtype,
-          unsigned long mountflags, const void *data);
+int mount(const char *source, const char *target, const char *filesystemtype);
 
 int umount(const char *target);
 
 time_t time(time_t *tloc);
 
+/* Milliseconds since boot */
+unsigned long uptime(void);
+
 long usleep(useconds_t usec);
 
 #define STDIN_FILENO 0
@@ -15,6 +15,16 @@
 #define DEFAULT_STACK_SIZE (DEFAULT_STACK_SIZE_PAGES << PAGE_SHIFT)
 #define TICK_MSECS 10 /* msecs between clock interrupts */
 
+/*
+ * Scheduler time slice for a nice 0 thread, in APIC timer ticks. Set QUANTUM
+ * in Config.mk to override.
+ */
+#ifdef __QUANTUM__
+#define SCHED_QUANTUM_TICKS __QUANTUM__
+#else
+#define SCHED_QUANTUM_TICKS 10
+#endif
+
 /*
  * Memory-management-related:
  */
@@ -37,7 +47,7 @@
 #define MAX_VFS 8       /* max # of vfses */
 #define MAX_VNODES 1024 /* max number of in-core vnodes */
 #define NAME_LEN 28     /* maximum directory entry length */
-#define NFILES 32       /* maximum number of open files */
+#define NFILES 1024     /* maximum number of open files */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV "disk0" /* device containing root filesystem */
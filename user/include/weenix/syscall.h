@@ -13,6 +13,42 @@
 /* Trap number for syscalls */
 #define INTR_SYSCALL 0x2e
 
+/*
+ * System calls come in either by int $INTR_SYSCALL, with the call number in
+ * %rax and its argument in %rdx, or by the SYSCALL instruction, with the
+ * number in %rax and the argument in %rdi. Either way the argument is a
+ * pointer to the call's _args_t structure below, or the one value it takes.
+ * The result comes back in %rax.
+ *
+ * SYSCALL also hands back the thread's errno in %rdx, so that a failing call
+ * takes a single trip, and passes the arguments of read(), write(), pread(),
+ * pwrite(), lseek() and dup2() in registers rather than in a structure to be
+ * copied in: their fields in order in %rdi, %rsi, %rdx and %r10. It
+ * clobbers %rcx and %r11.
+ */
+
+/*
+ * The vDSO pages: two read-only pages the kernel maps at VDSO_ADDR in every
+ * process it loads a program into, from which libc answers time(),
+ * uptime() and getpid() without a system call. The first holds a
+ * vdso_data_t, shared by every process and kept up to date by the timer
+ * interrupt; the second the process's own vdso_proc_t.
+ */
+#define VDSO_ADDR 0x7fffffffe000UL
+#define VDSO_PROC_ADDR (VDSO_ADDR + 0x1000)
+
+typedef struct vdso_data
+{
+    volatile uint64_t vd_jiffies; /* timer ticks since boot */
+    uint64_t vd_usec_per_tick;    /* how long a tick is */
+    time_t vd_boot_time;          /* unix time at tick 0 */
+} vdso_data_t;
+
+typedef struct vdso_proc
+{
+    pid_t vp_pid;
+} vdso_proc_t;
+
 /* Keep all lists IN ORDER! */
 
 #define SYS_syscall 0
@@ -33,21 +69,21 @@
 #define SYS_nuke 16 /* NYI */
 #define SYS_dup 17
 #define SYS_pipe 18
-#define SYS_ioctl 19 /* NYI */
+#define SYS_ioctl 19
 #define SYS_rmdir 21
 #define SYS_mkdir 22
 #define SYS_getdents 23
 #define SYS_mmap 24
-#define SYS_mprotect 25 /* NYI */
+#define SYS_mprotect 25
 #define SYS_munmap 26
 #define SYS_rename 27 /* NYI */
 #define SYS_uname 28
-#define SYS_thr_create 29 /* NYI */
+#define SYS_thr_create 29
 #define SYS_thr_cancel 30
 #define SYS_thr_exit 31
 #define SYS_sched_yield 32
-#define SYS_thr_join 33 /* NYI */
-#define SYS_gettid 34   /* NYI */
+#define SYS_thr_join 33
+#define SYS_gettid 34
 #define SYS_getpid 35
 #define SYS_errno 39
 #define SYS_halt 40
@@ -60,6 +96,36 @@
 #define SYS_stat 47
 #define SYS_time 48
 #define SYS_usleep 49
+#define SYS_nice 50
+#define SYS_spawn 51
+#define SYS_madvise 52
+#define SYS_readv 53
+#define SYS_writev 54
+#define SYS_pread 55
+#define SYS_pwrite 56
+#define SYS_sendfile 57
+#define SYS_aio_submit 58
+#define SYS_aio_reap 59
+#define SYS_fsync 60
+#define SYS_fdatasync 61
+#define SYS_vmsplice 62
+#define SYS_poll 63
+#define SYS_epoll_create 64
+#define SYS_epoll_ctl 65
+#define SYS_epoll_wait 66
+#define SYS_batch 67
+#define SYS_set_tls 68
+#define SYS_futex 69
+#define SYS_perfctr 70
+#define SYS_mremap 71
+#define SYS_fstatat 72
+#define SYS_fstat 73
+#define SYS_fallocate 74
+#define SYS_sched_setaffinity 75
+#define SYS_sched_getaffinity 76
+#define SYS_getrlimit 77
+#define SYS_setrlimit 78
+#define SYS_getcwd 79
 
 /*
  * ... what does the scouter say about his syscall?
@@ -71,6 +137,7 @@
 
 struct regs;
 struct stat;
+struct iovec;
 
 typedef struct argstr
 {
@@ -107,6 +174,28 @@ typedef struct munmap_args
     size_t len;
 } munmap_args_t;
 
+typedef struct mprotect_args
+{
+    void *addr;
+    size_t len;
+    int prot;
+} mprotect_args_t;
+
+typedef struct madvise_args
+{
+    void *addr;
+    size_t len;
+    int advice;
+} madvise_args_t;
+
+typedef struct mremap_args
+{
+    void *addr;
+    size_t old_len;
+    size_t new_len;
+    int flags;
+} mremap_args_t;
+
 typedef struct open_args
 {
     argstr_t filename;
@@ -128,6 +217,352 @@ typedef struct write_args
     size_t nbytes;
 } write_args_t;
 
+typedef struct readv_args
+{
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+} readv_args_t;
+
+typedef struct writev_args
+{
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+} writev_args_t;
+
+typedef struct pread_args
+{
+    int fd;
+    void *buf;
+    size_t nbytes;
+    off_t offset;
+} pread_args_t;
+
+typedef struct pwrite_args
+{
+    int fd;
+    void *buf;
+    size_t nbytes;
+    off_t offset;
+} pwrite_args_t;
+
+typedef struct sendfile_args
+{
+    int out_fd;
+    int in_fd;
+    off_t *offset; /* may be NULL, see sendfile(2) */
+    size_t count;
+} sendfile_args_t;
+
+typedef struct fallocate_args
+{
+    int fd;
+    int mode; /* 0 or FALLOC_FL_KEEP_SIZE */
+    off_t offset;
+    off_t len;
+} fallocate_args_t;
+
+/*
+ * Asynchronous I/O, see aio_submit(2): each request is described by an
+ * aio_sqe_t and, once it is done, reported by an aio_cqe_t carrying back its
+ * user_data.
+ */
+#define AIO_READ 0
+#define AIO_WRITE 1
+
+/* Requests a process may have submitted and not yet reaped */
+#define AIO_MAX_INFLIGHT 64
+
+typedef struct aio_sqe
+{
+    int fd;
+    int op; /* AIO_READ or AIO_WRITE */
+    void *buf;
+    size_t nbytes;
+    off_t offset; /* -1 to use and move the file position */
+    uint64_t user_data;
+} aio_sqe_t;
+
+typedef struct aio_cqe
+{
+    uint64_t user_data;
+    ssize_t res; /* what read(2) or write(2) would have returned, or -errno */
+} aio_cqe_t;
+
+typedef struct aio_submit_args
+{
+    const aio_sqe_t *sqes;
+    int nr;
+} aio_submit_args_t;
+
+typedef struct aio_reap_args
+{
+    aio_cqe_t *cqes;
+    int min_nr;
+    int nr;
+} aio_reap_args_t;
+
+/*
+ * vmsplice(2) moves data between the buffers of iov and a pipe. With
+ * SPLICE_F_GIFT, whole pages of private anonymous memory are handed over
+ * rather than copied: the writer's become the pipe's, copy-on-write, and a
+ * reader's are replaced by them.
+ */
+#define SPLICE_F_GIFT 0x08
+
+typedef struct vmsplice_args
+{
+    int fd;
+    const struct iovec *iov;
+    int iovcnt;
+    unsigned int flags;
+} vmsplice_args_t;
+
+/*
+ * poll(2) waits for any of an array of files to be ready for the events
+ * asked for of it, and reports those it is ready for in revents; POLLERR,
+ * POLLHUP and POLLNVAL are reported whether they were asked for or not.
+ */
+#define POLLIN 0x01   /* reading would not block */
+#define POLLOUT 0x04  /* writing would not block */
+#define POLLERR 0x08  /* the write end of a pipe has no readers */
+#define POLLHUP 0x10  /* the read end of a pipe has no writers */
+#define POLLNVAL 0x20 /* fd is not open */
+
+typedef struct pollfd
+{
+    int fd; /* skipped if negative */
+    short events;
+    short revents;
+} pollfd_t;
+
+typedef struct poll_args
+{
+    pollfd_t *fds;
+    int nfds;
+    int timeout; /* milliseconds, or negative to wait forever */
+} poll_args_t;
+
+/*
+ * An epoll instance (see epoll_create(2)) keeps a set of files it watches
+ * for the poll events asked of each, and epoll_wait(2) reports those that
+ * are ready, with the data given for them. Files are watched level-
+ * triggered, reported as long as they are ready, unless EPOLLET asks for
+ * them to be reported only once per wakeup, or EPOLLONESHOT only once
+ * until they are modified again.
+ */
+#define EPOLLIN POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+#define EPOLLONESHOT (1U << 30)
+#define EPOLLET (1U << 31)
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef struct epoll_event
+{
+    uint32_t events;
+    uint64_t data; /* returned with the file's events */
+} epoll_event_t;
+
+typedef struct epoll_ctl_args
+{
+    int epfd;
+    int op;
+    int fd;
+    epoll_event_t *event; /* unused by EPOLL_CTL_DEL */
+} epoll_ctl_args_t;
+
+typedef struct epoll_wait_args
+{
+    int epfd;
+    epoll_event_t *events;
+    int maxevents;
+    int timeout; /* milliseconds, or negative to wait forever */
+} epoll_wait_args_t;
+
+/*
+ * batch(2) makes the calls in an array of batch_entry_t one after the
+ * other, in a single trip into the kernel. Each entry's be_sysnum and
+ * be_args are what its call would be made with on its own (a pointer to
+ * its _args_t, or its one value), and be_ret and be_errno are set to what it
+ * returned and, if that was -1, its errno. With BATCH_STOP_ON_ERROR the
+ * batch stops after the first call to return -1.
+ *
+ * batch(2) returns how many entries were run, including one it stopped
+ * after. fork(), execve(), exit(), thr_exit() and batch() itself cannot be
+ * batched, and fail with EINVAL.
+ */
+#define BATCH_STOP_ON_ERROR 0x1
+
+#define BATCH_MAX 64 /* entries in one batch */
+
+typedef struct batch_entry
+{
+    long be_sysnum;
+    uintptr_t be_args;
+    long be_ret;
+    long be_errno;
+} batch_entry_t;
+
+typedef struct batch_args
+{
+    batch_entry_t *entries;
+    int nentries;
+    int flags;
+} batch_args_t;
+
+/*
+ * thr_create(2) starts a thread in the calling process at tca_entry, with
+ * tca_arg in %rdi and its stack pointer at tca_stack (which, as at a call,
+ * should be 8 off a 16-byte boundary). The entry function must not return;
+ * the thread ends with thr_exit(), or with the process. Its FS base is
+ * tca_tls, which set_tls(2) can change for the calling thread. Returns the
+ * new thread's tid, as gettid(2) would in it.
+ */
+typedef struct thr_create_args
+{
+    void (*tca_entry)(void *);
+    void *tca_arg;
+    void *tca_stack;
+    void *tca_tls;
+} thr_create_args_t;
+
+/*
+ * thr_join(2) waits for thread tja_tid of the calling process to exit, and
+ * stores its exit value (what it gave thr_exit()) in *tja_retval if that is
+ * not NULL. A thread can be joined once.
+ */
+typedef struct thr_join_args
+{
+    pid_t tja_tid;
+    void **tja_retval;
+} thr_join_args_t;
+
+/*
+ * futex(2) on the int at fa_addr, which must be 4-byte aligned. FUTEX_WAIT
+ * sleeps until a FUTEX_WAKE on the same int, but only if it holds fa_val
+ * (else it fails with EAGAIN); FUTEX_WAKE wakes up to fa_val waiters and
+ * returns how many it woke. Waiters on a shared mapping are found from every
+ * process that maps the same object. Nothing is kept for an int no one
+ * waits on, so an uncontended lock never needs to call in.
+ */
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+typedef struct futex_args
+{
+    int *fa_addr;
+    int fa_op;
+    int fa_val;
+} futex_args_t;
+
+/*
+ * perfctr(2) counts hardware events while the calling thread runs, in the
+ * kernel as well as in userland. PERFCTR_START zeroes and starts a count of
+ * each event in the pa_events mask (bit PERFCTR_CYCLES and so on);
+ * PERFCTR_READ copies the counts so far to pa_counts[PERFCTR_EVENTS], those
+ * of events not counted being 0; PERFCTR_STOP stops counting, leaving the
+ * counts to be read. Fails with ENODEV if the CPU has no architectural
+ * performance counters, or fewer than the events asked for.
+ */
+#define PERFCTR_START 0
+#define PERFCTR_READ 1
+#define PERFCTR_STOP 2
+
+#define PERFCTR_CYCLES 0
+#define PERFCTR_INSTRUCTIONS 1
+#define PERFCTR_LLC_MISSES 2
+#define PERFCTR_DTLB_MISSES 3
+#define PERFCTR_EVENTS 4
+
+typedef struct perfctr_args
+{
+    int pa_op;
+    int pa_events;
+    uint64_t *pa_counts;
+} perfctr_args_t;
+
+/*
+ * sched_setaffinity(2) lets every thread of process sa_pid (the caller's if
+ * 0) run only on the cores in *sa_mask, bit i standing for core i; it fails
+ * with EINVAL if none of them is online. sched_getaffinity(2) puts in
+ * *sa_mask the online cores they may run on. sa_len is the size of the mask,
+ * which must be at least that of an unsigned long, of which only the first is
+ * used. Either fails with ESRCH if there is no such process.
+ */
+typedef struct sched_affinity_args
+{
+    pid_t sa_pid;
+    size_t sa_len;
+    unsigned long *sa_mask;
+} sched_affinity_args_t;
+
+/*
+ * getrlimit(2) and setrlimit(2) get and set a limit on the calling process's
+ * use of a resource, which its children inherit. The only one is RLIMIT_RSS,
+ * the most bytes of memory it may have resident: mapped into its address
+ * space, and into no other before. Past it, each page fault from userland
+ * takes its oldest pages back out of the address spaces that map them,
+ * paging anonymous memory out if there is swap. RLIM_INFINITY is no limit.
+ * rlim_cur is the limit kept, and both read back as it.
+ */
+#define RLIMIT_RSS 5
+#define RLIM_INFINITY (~0UL)
+
+typedef struct rlimit
+{
+    unsigned long rlim_cur;
+    unsigned long rlim_max;
+} rlimit_t;
+
+typedef struct rlimit_args
+{
+    int ra_resource;
+    struct rlimit *ra_rlim;
+} rlimit_args_t;
+
+/* getcwd(2) puts the path of the working directory, null-terminated, in the
+ * size bytes at buf, or fails with ERANGE if they are too few; it is only
+ * there with GETCWD */
+typedef struct getcwd_args
+{
+    char *buf;
+    size_t size;
+} getcwd_args_t;
+
+/*
+ * ioctl(2) on a tty gets (TCGETA) or sets (TCSETA) its termio_t. Without
+ * ICANON, input is not edited or split into lines, and read(2) returns once
+ * c_vmin characters have arrived, or c_vtime tenths of a second after the
+ * last one did (or after the read began, if c_vmin is 0), as with POSIX VMIN
+ * and VTIME; with both 0 it returns what there is at once. Without ECHO,
+ * what is typed is not echoed.
+ */
+#define TCGETA 0x5405
+#define TCSETA 0x5406
+
+#define ICANON 0x0002
+#define ECHO 0x0008
+
+typedef struct termio
+{
+    unsigned int c_lflag;
+    unsigned char c_vmin;
+    unsigned char c_vtime;
+} termio_t;
+
+typedef struct ioctl_args
+{
+    int fd;
+    unsigned long cmd;
+    void *arg;
+} ioctl_args_t;
+
 typedef struct mkdir_args
 {
     argstr_t path;
@@ -147,6 +582,17 @@ typedef struct execve_args
     argvec_t envp;
 } execve_args_t;
 
+#define SPAWN_MAX_DUPS 16
+
+typedef struct spawn_args
+{
+    argstr_t filename;
+    argvec_t argv;
+    argvec_t envp;
+    int ndups;
+    int dups[SPAWN_MAX_DUPS][2]; /* {oldfd, newfd}, see spawn(2) */
+} spawn_args_t;
+
 typedef struct rename_args
 {
     argstr_t oldpath;
@@ -188,6 +634,19 @@ typedef struct stat_args
     struct stat *buf;
 } stat_args_t;
 
+typedef struct fstat_args
+{
+    int fd;
+    struct stat *buf;
+} fstat_args_t;
+
+typedef struct fstatat_args
+{
+    int dirfd;
+    argstr_t path;
+    struct stat *buf;
+} fstatat_args_t;
+
 typedef struct usleep_args
 {
     useconds_t usec;
@@ -8,19 +8,39 @@
 #define TRAP_INTR_STRING QUOTE(INTR_SYSCALL)
 
 /* ssize_t will be 32 bits or 64 bits wide as appropriate.
-   args are passed via %(r/e)ax and %(r/e)dx, so they need
-   to be the size of a register.  */
+   Calls go in by the SYSCALL instruction, with the number in %rax and the
+   argument in %rdi, and the kernel hands back errno in %rdx (see
+   weenix/syscall.h), so they need to be the size of a register. errno is
+   only set by a call that fails. */
 
 static inline ssize_t trap(ssize_t num, ssize_t arg)
 {
-    ssize_t ret;
-    __asm__ volatile("int $" TRAP_INTR_STRING
-                     : "=a"(ret)
-                     : "a"(num), "d"(arg));
+    ssize_t ret, err;
+    __asm__ volatile("syscall"
+                     : "=a"(ret), "=d"(err)
+                     : "a"(num), "D"(arg)
+                     : "rcx", "r11", "memory");
+    if (ret == -1)
+    {
+        errno = (int)err;
+    }
+    return ret;
+}
 
-    /* Copy in errno */
-    __asm__ volatile("int $" TRAP_INTR_STRING
-                     : "=a"(errno)
-                     : "a"(SYS_errno));
+/* For the calls that take their arguments in registers: read(), write(),
+ * pread(), pwrite(), lseek() and dup2() */
+static inline ssize_t trap4(ssize_t num, ssize_t arg0, ssize_t arg1,
+                            ssize_t arg2, ssize_t arg3)
+{
+    ssize_t ret;
+    register ssize_t r10 __asm__("r10") = arg3;
+    __asm__ volatile("syscall"
+                     : "=a"(ret), "+d"(arg2)
+                     : "a"(num), "D"(arg0), "S"(arg1), "r"(r10)
+                     : "rcx", "r11", "memory");
+    if (ret == -1)
+    {
+        errno = (int)arg2;
+    }
     return ret;
 }
@@ -43,6 +43,24 @@ void _ldainit(unsigned long pagesize, unsigned long pages)
  * our memory pool.  The memory is word-aligned, and cannot be freed. */
 
 void *_ldalloc(unsigned long size)
+{
+    void *next;
+
+    if (!(next = _ldtryalloc(size)))
+    {
+        fprintf(stderr,
+                "ld.so.1: panic - unable to allocate %lu bytes (_ldalloc)\n",
+                size);
+        exit(1);
+    }
+
+    return next;
+}
+
+/* Like _ldalloc, but for memory the linker can do without: returns NULL
+ * rather than exiting if the pool is used up. */
+
+void *_ldtryalloc(unsigned long size)
 {
     unsigned long next;
 
@@ -53,10 +71,7 @@ void *_ldalloc(unsigned long size)
 
     if (pos + size > amount)
     {
-        fprintf(stderr,
-                "ld.so.1: panic - unable to allocate %lu bytes (_ldalloc)\n",
-                size);
-        exit(1);
+        return NULL;
     }
 
     next = start + pos;
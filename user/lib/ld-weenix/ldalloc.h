@@ -2,3 +2,4 @@
 
 void _ldainit(unsigned long pagesize, unsigned long pages);
 void *_ldalloc(unsigned long size);
+void *_ldtryalloc(unsigned long size);
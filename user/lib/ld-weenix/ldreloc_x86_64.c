@@ -112,15 +112,15 @@ void _ldrelocobj(module_t *module)
             break;
         case R_X86_64_JUMP_SLOT:
         case R_X86_64_GLOB_DAT:
-            symbol = _ldresolve(module, name, -1, 0, 0);
+            symbol = _ldresolvesym(module, sym);
             *(Elf64_Addr *)addr = (Elf64_Addr)symbol;
             break;
         case R_X86_64_32:
-            symbol = _ldresolve(module, name, -1, 0, 0);
+            symbol = _ldresolvesym(module, sym);
             *(Elf64_Addr *)addr = (Elf64_Addr)symbol + rel.r_addend;
             break;
         case R_X86_64_PC32:
-            symbol = _ldresolve(module, name, -1, 0, 0);
+            symbol = _ldresolvesym(module, sym);
             *(Elf64_Addr *)addr =
                 (Elf64_Addr)symbol + rel.r_addend - (Elf64_Addr)addr;
             break;
@@ -168,7 +168,6 @@ void _ldbindnow(module_t *module)
 
         uint64_t sym = ELF64_R_SYM(rel.r_info);
         uint64_t type = ELF64_R_TYPE(rel.r_info);
-        const char *name = module->dynstr + module->dynsym[sym].st_name;
         void *addr = (void *)(base + rel.r_offset);
 
         if (type != R_X86_64_JUMP_SLOT)
@@ -178,7 +177,7 @@ void _ldbindnow(module_t *module)
             exit(1);
         }
 
-        ldsym_t symbol = _ldresolve(module, name, -1, 0, 0);
+        ldsym_t symbol = _ldresolvesym(module, sym);
         *(Elf64_Addr *)addr = (Elf64_Addr)symbol;
     }
 }
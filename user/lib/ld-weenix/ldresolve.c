@@ -12,6 +12,7 @@
 
 #include "string.h"
 
+#include "ldalloc.h"
 #include "ldresolve.h"
 #include "ldutil.h"
 
@@ -19,22 +20,77 @@
 #define H_nchain 1
 #define H_bucket 2
 
-/* This function looks up the specified symbol in the specified
- * module.  If the symbol is present, it returns the symbol's index in
- * the dynamic symbol table, otherwise STN_UNDEF is returned. */
+#define G_nbucket 0
+#define G_symoffset 1
+#define G_bloomsize 2
+#define G_bloomshift 3
+#define G_bloom 4
 
-int _ldlookup(module_t *module, const char *name)
+/* A name being looked up, with its hashes, so that they are computed
+ * once however many modules it is looked up in. */
+typedef struct ldkey
+{
+    const char *name;
+    unsigned long elfhash;
+    unsigned long gnuhash;
+} ldkey_t;
+
+static void _ldkey_init(ldkey_t *key, const char *name)
 {
-    unsigned long hashval;
-    unsigned long y;
+    key->name = name;
+    key->elfhash = _ldelfhash(name);
+    key->gnuhash = _ldgnuhash(name);
+}
 
-    hashval = _ldelfhash(name);
-    hashval %= module->hash[H_nbucket];
+static const Elf64_Word *_ldgnubuckets(const Elf64_Word *g)
+{
+    /* the bloom filter is of 64-bit words */
+    return g + G_bloom + 2 * g[G_bloomsize];
+}
 
-    y = module->hash[H_bucket + hashval];
+/* Looks key up in module's GNU-style hash table. Its bloom filter turns
+ * most names a module does not define away without touching the
+ * symbol table, which is most lookups, since every module before the one
+ * that defines a symbol is searched for it first. Only defined symbols
+ * are in the table. */
+
+static int _ldgnulookup(module_t *module, const ldkey_t *key)
+{
+    const Elf64_Word *g = module->gnuhash;
+    const uint64_t *bloom = (const uint64_t *)(g + G_bloom);
+    unsigned long h = key->gnuhash;
+
+    uint64_t word = bloom[(h / 64) % g[G_bloomsize]];
+    uint64_t mask = (1UL << (h % 64)) | (1UL << ((h >> g[G_bloomshift]) % 64));
+    if ((word & mask) != mask)
+        return STN_UNDEF;
+
+    const Elf64_Word *buckets = _ldgnubuckets(g);
+    const Elf64_Word *chain = buckets + g[G_nbucket];
+    Elf64_Word y = buckets[h % g[G_nbucket]];
+    if (y < g[G_symoffset])
+        return STN_UNDEF;
+
+    for (;; y++)
+    {
+        Elf64_Word h2 = chain[y - g[G_symoffset]];
+        if ((h | 1) == (h2 | 1) &&
+            !strcmp(module->dynstr + module->dynsym[y].st_name, key->name))
+            return y;
+        if (h2 & 1)
+            return STN_UNDEF;
+    }
+}
+
+/* Looks key up in module's SysV hash table, which has every symbol. */
+
+static int _ldelflookup(module_t *module, const ldkey_t *key)
+{
+    unsigned long y = module->hash[H_bucket +
+                                   key->elfhash % module->hash[H_nbucket]];
 
     while ((y != STN_UNDEF) &&
-           strcmp(module->dynstr + module->dynsym[y].st_name, name))
+           strcmp(module->dynstr + module->dynsym[y].st_name, key->name))
     {
         y = module->hash[H_bucket + module->hash[H_nbucket] + y];
     }
@@ -42,20 +98,39 @@ int _ldlookup(module_t *module, const char *name)
     return y;
 }
 
-/* This looks up the specified symbol in the given module, subject to
- * the provided binding and type restrictions (a value of -1 will
- * function as a wildcard for both the 'binding' and 'type'
- * parameters).  The symbol's size will be placed in the memory
- * location pointed to by 'size', if it is non-null.  0 is returned if
- * a symbol matching all the requirements is not found. */
+/* Uses the GNU-style table if the module has one, unless a local
+ * symbol is wanted, which only the SysV table holds. */
 
-ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
-                  Elf64_Word *size)
+static int _ldkeylookup(module_t *module, const ldkey_t *key, int local)
 {
-    int result;
+    if (module->gnuhash && (!local || !module->hash))
+        return _ldgnulookup(module, key);
+    if (module->hash)
+        return _ldelflookup(module, key);
+    return STN_UNDEF;
+}
+
+/* This function looks up the specified symbol in the specified
+ * module.  If the symbol is present, it returns the symbol's index in
+ * the dynamic symbol table, otherwise STN_UNDEF is returned. */
 
+int _ldlookup(module_t *module, const char *name)
+{
+    ldkey_t key;
+
+    _ldkey_init(&key, name);
+    return _ldkeylookup(module, &key, 1);
+}
+
+/* Returns the address of symbol number result of module if it is
+ * defined and has the given binding and type (-1 for any), filling in
+ * its size if size is non-null, otherwise 0. */
+
+static ldsym_t _ldsymval(module_t *module, int result, int binding, int type,
+                         Elf64_Word *size)
+{
     /* LINTED */
-    if (((result = _ldlookup(module, name)) != STN_UNDEF) &&
+    if ((result != STN_UNDEF) &&
         ((binding < 0) ||
          (ELF64_ST_BIND(module->dynsym[result].st_info) == binding)) &&
         ((type < 0) ||
@@ -71,49 +146,129 @@ ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
     return 0;
 }
 
+/* This looks up the specified symbol in the given module, subject to
+ * the provided binding and type restrictions (a value of -1 will
+ * function as a wildcard for both the 'binding' and 'type'
+ * parameters).  The symbol's size will be placed in the memory
+ * location pointed to by 'size', if it is non-null.  0 is returned if
+ * a symbol matching all the requirements is not found. */
+
+ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
+                  Elf64_Word *size)
+{
+    ldkey_t key;
+
+    _ldkey_init(&key, name);
+    return _ldsymval(module, _ldkeylookup(module, &key, binding == STB_LOCAL),
+                     binding, type, size);
+}
+
 /* Given a module and a symbol name, this function attempts to find the
  * symbol through the process' link chain.  It first checks for its
  * presence as a global symbol, then as a weak symbol, and finally as a
  * local symbol in the specified module.  A type restriction can be
  * specified, and if 'size' is non-null, the memory location to which
  * it points will hold the size of the resolved symbol.  0 is returned
- * if the symbol cannot be found. */
+ * if the symbol cannot be found.
+ *
+ * The chain is walked once, looking the name up once in each module;
+ * the first weak definition is kept in case no module has a global
+ * one. */
 
 ldsym_t _ldresolve(module_t *module, const char *name, int type,
                    Elf64_Word *size, int exclude)
 {
     module_t *curmod;
     ldsym_t sym;
+    ldsym_t weak = 0;
+    Elf64_Word weaksize = 0;
+    ldkey_t key;
+
+    _ldkey_init(&key, name);
 
-    curmod = module->first;
+    for (curmod = module->first; curmod; curmod = curmod->next)
+    {
+        int result = _ldkeylookup(curmod, &key, 0);
+        if (result == STN_UNDEF)
+            continue;
+        if ((!exclude || curmod != module) &&
+            (sym = _ldsymval(curmod, result, STB_GLOBAL, type, size)))
+            return sym;
+        if (!weak)
+            weak = _ldsymval(curmod, result, STB_WEAK, type, &weaksize);
+    }
 
-    while (curmod)
+    if (weak)
     {
-        if (!exclude || curmod != module)
-        {
-            if ((sym = _ldsymbol(curmod, name, STB_GLOBAL, type, size)))
-                return sym;
-        }
-        curmod = curmod->next;
+        if (size)
+            *size = weaksize;
+        return weak;
     }
 
-    curmod = module->first;
-    while (curmod)
+    return _ldsymval(module, _ldkeylookup(module, &key, 1), STB_LOCAL, type,
+                     size);
+}
+
+/* Counts the entries of module's dynamic symbol table, which the
+ * dynamic section does not give: the SysV hash table has a chain entry
+ * for each, and the GNU-style one ends with the last symbol it holds. */
+
+static size_t _ldnsyms(module_t *module)
+{
+    if (module->hash)
+        return module->hash[H_nchain];
+    if (!module->gnuhash)
+        return 0;
+
+    const Elf64_Word *g = module->gnuhash;
+    const Elf64_Word *buckets = _ldgnubuckets(g);
+    const Elf64_Word *chain = buckets + g[G_nbucket];
+    Elf64_Word last = 0;
+    for (Elf64_Word i = 0; i < g[G_nbucket]; i++)
     {
-        if ((sym = _ldsymbol(curmod, name, STB_WEAK, type, size)))
-            return sym;
-        curmod = curmod->next;
+        if (buckets[i] > last)
+            last = buckets[i];
     }
+    if (last < g[G_symoffset])
+        return g[G_symoffset];
+    while (!(chain[last - g[G_symoffset]] & 1))
+        last++;
+    return last + 1;
+}
+
+/* Sets up the cache of module's resolved symbols, if there is room for
+ * it; without one every reference is looked up afresh. */
+
+void _ldsymcache_init(module_t *module)
+{
+    module->nsyms = _ldnsyms(module);
+    module->symcache = _ldtryalloc(module->nsyms * sizeof(ldsym_t));
+    if (module->symcache)
+        memset(module->symcache, 0, module->nsyms * sizeof(ldsym_t));
+}
+
+/* Resolves symbol number sym of module's dynamic symbol table as
+ * _ldresolve(module, name, -1, 0, 0) would, remembering the answer, so
+ * that the GOT entry and the PLT slot of a function, or every lazy
+ * binding of it, cost one search between them. */
+
+ldsym_t _ldresolvesym(module_t *module, Elf64_Word sym)
+{
+    if (module->symcache && sym < module->nsyms && module->symcache[sym])
+        return module->symcache[sym];
 
-    return _ldsymbol(module, name, STB_LOCAL, type, size);
+    ldsym_t symbol =
+        _ldresolve(module, module->dynstr + module->dynsym[sym].st_name, -1,
+                   0, 0);
+    if (module->symcache && sym < module->nsyms)
+        module->symcache[sym] = symbol;
+    return symbol;
 }
 
 Elf64_Addr _rtresolve(module_t *mod, Elf64_Word reloff)
 {
     Elf64_Rela *rel = mod->pltreloc + reloff;
-    int sym = ELF64_R_SYM(rel->r_info);
-    const char *name = mod->dynstr + mod->dynsym[sym].st_name;
-    ldsym_t symbol = _ldresolve(mod, name, -1, 0, 0);
+    ldsym_t symbol = _ldresolvesym(mod, ELF64_R_SYM(rel->r_info));
     *(Elf64_Addr *)(mod->base + rel->r_offset) = (Elf64_Addr)symbol;
     return (Elf64_Addr)symbol;
 }
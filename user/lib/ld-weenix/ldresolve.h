@@ -27,6 +27,8 @@ extern "C"
                        Elf64_Word *size, int copy);
     ldsym_t _ldexresolve(module_t *module, const char *name, int type,
                          Elf64_Word *size);
+    void _ldsymcache_init(module_t *module);
+    ldsym_t _ldresolvesym(module_t *module, Elf64_Word sym);
 
 #ifdef __cplusplus
 }
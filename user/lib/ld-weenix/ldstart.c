@@ -26,6 +26,7 @@
 
 #include "ldalloc.h"
 #include "ldnames.h"
+#include "ldresolve.h"
 #include "ldutil.h"
 
 #ifndef DEFAULT_RUNPATH
@@ -122,6 +123,9 @@ static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
         case DT_HASH:
             info->hash = (void *)(info->base + curdyn->d_un.d_ptr);
             break;
+        case DT_GNU_HASH:
+            info->gnuhash = (void *)(info->base + curdyn->d_un.d_ptr);
+            break;
         case DT_SYMTAB:
             info->dynsym = (void *)(info->base + curdyn->d_un.d_ptr);
             break;
@@ -191,6 +195,8 @@ static module_t *_ldlinkobj(module_t *info, const char *baseaddr,
         _ldpltgot_init(info);
     }
 
+    _ldsymcache_init(info);
+
     /* create modules for dependencies */
     for (curdyn = dyn; curdyn->d_tag != DT_NULL; curdyn++)
     {
@@ -504,7 +510,7 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
     pagesize = abuf[AT_PAGESZ];
 
     /* Set up memory pool */
-    _ldainit(pagesize, 1);
+    _ldainit(pagesize, 4);
 
     _ldenv_init(environ);
     /* Load the executable and all of it's dependencies */
@@ -40,6 +40,7 @@ typedef struct module
 
     unsigned long base; /* base address of module       */
     Elf64_Word *hash;   /* the module's hash table      */
+    Elf64_Word *gnuhash; /* its GNU-style hash, or NULL */
     Elf64_Sym *dynsym;  /* the dynamic symbol table     */
     char *dynstr;       /* the dynamic string table     */
 
@@ -55,6 +56,9 @@ typedef struct module
     struct module *next;  /* the next module in the chain */
     struct module *first; /* the first module             */
     Elf64_Addr *pltgot;   /* base of plt                  */
+
+    size_t nsyms;       /* entries in dynsym            */
+    ldsym_t *symcache;  /* dynsym[i] as resolved, or 0  */
 } module_t;
 
 #endif /* _ldtypes.h_ */
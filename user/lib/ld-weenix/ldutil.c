@@ -70,3 +70,16 @@ unsigned long _ldelfhash(const char *name)
 
     return h;
 }
+
+/* This is the hash used for the GNU-style (DT_GNU_HASH) table, which the
+ * linker emits alongside the SysV one: Bernstein's h * 33 + c. */
+
+unsigned long _ldgnuhash(const char *name)
+{
+    uint32_t h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+
+    return h;
+}
@@ -22,6 +22,7 @@ extern "C"
     int _ldzero();
 
     unsigned long _ldelfhash(const char *name);
+    unsigned long _ldgnuhash(const char *name);
     int _ldtryopen(const char *filename, const char *path);
     void _ldmapsect(int fd, unsigned long baseaddr, Elf64_Phdr *phdr, int textrel);
     void _ldloadobj(module_t *module);
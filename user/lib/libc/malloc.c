@@ -98,6 +98,7 @@ struct pgfree
     void *page;          /* pointer to free pages */
     void *end;           /* pointer to end of free pages */
     size_t size;         /* number of bytes free */
+    int dirty;           /* holds pages not yet given back with madvise() */
 };
 
 /*
@@ -141,12 +142,17 @@ struct pgfree
 #define pageround(foo) (((foo) + (malloc_pagemask)) & (~(malloc_pagemask)))
 #define ptr2index(foo) (((u_long)(foo) >> malloc_pageshift) - malloc_origo)
 
+/* Threads take turns, yielding while another holds the lock */
+static volatile int malloc_lock;
+
 #ifndef THREAD_LOCK
-#define THREAD_LOCK()
+#define THREAD_LOCK()                                 \
+    while (__sync_lock_test_and_set(&malloc_lock, 1)) \
+    sched_yield()
 #endif
 
 #ifndef THREAD_UNLOCK
-#define THREAD_UNLOCK()
+#define THREAD_UNLOCK() __sync_lock_release(&malloc_lock)
 #endif
 
 #ifndef MMAP_FD
@@ -166,6 +172,29 @@ static int malloc_active;
 /* Number of free pages we cache */
 static unsigned malloc_cache = 16;
 
+/*
+ * Allocations of this many bytes or more get a mapping of their own rather
+ * than pages of the heap, so that realloc() can resize them with mremap(2)
+ * instead of copying them. They are outside the page directory: each has a
+ * struct hugeblk on huge_list instead.
+ */
+#define MALLOC_HUGE (32 << malloc_pageshift)
+
+struct hugeblk
+{
+    struct hugeblk *next;
+    void *page;
+    size_t size;
+};
+
+static struct hugeblk *huge_list;
+
+/* Bytes of free pages, past which they are given back to the kernel */
+#define MALLOC_PURGE (64 << malloc_pageshift)
+
+/* Bytes freed to the free list since it was last given back */
+static size_t malloc_unpurged;
+
 /* The offset from pagenumber to index into the page directory */
 static u_long malloc_origo;
 
@@ -370,8 +399,14 @@ static int extend_pgdir(u_long index)
     old = page_dir;
     page_dir = new;
 
-    /* Now free the old stuff */
-    munmap((char *)old, oldlen);
+    /*
+     * The old directory is kept: free() reads the directory without the
+     * lock (see mcache_free), and may still be looking at it. It is a page
+     * per 4MB of arena, and each directory is twice the last, so this costs
+     * no more than the directory itself.
+     */
+    (void)old;
+    (void)oldlen;
     return 1;
 }
 
@@ -788,6 +823,54 @@ static void *malloc_bytes(size_t size)
     return (u_char *)bp->page + k;
 }
 
+/*
+ * Allocate a mapping of its own
+ */
+static void *malloc_huge(size_t size)
+{
+    struct hugeblk *hb;
+    void *p;
+
+    hb = imalloc(sizeof *hb);
+    if (!hb)
+        return 0;
+    size = pageround(size);
+    p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        ifree(hb);
+        return 0;
+    }
+    hb->page = p;
+    hb->size = size;
+    hb->next = huge_list;
+    huge_list = hb;
+
+    if (malloc_junk)
+        memset(p, SOME_JUNK, size);
+    return p;
+}
+
+/* The link to ptr's hugeblk, or 0 if it is not a huge allocation */
+static struct hugeblk **huge_find(void *ptr)
+{
+    struct hugeblk **hbp;
+
+    for (hbp = &huge_list; *hbp; hbp = &(*hbp)->next)
+        if ((*hbp)->page == ptr)
+            return hbp;
+    return 0;
+}
+
+static void free_huge(struct hugeblk **hbp)
+{
+    struct hugeblk *hb = *hbp;
+
+    *hbp = hb->next;
+    munmap(hb->page, hb->size);
+    ifree(hb);
+}
+
 /*
  * Allocate a piece of memory
  */
@@ -806,6 +889,10 @@ static void *imalloc(size_t size)
     {
         result = malloc_bytes(size);
     }
+    else if (size >= MALLOC_HUGE)
+    {
+        result = malloc_huge(size);
+    }
     else
     {
         result = malloc_pages(size);
@@ -832,6 +919,7 @@ static void *irealloc(void *ptr, size_t size)
     void *p;
     u_long osize, index;
     struct pginfo **mp;
+    struct hugeblk **hbp;
     int i;
 
     if (suicide)
@@ -839,6 +927,32 @@ static void *irealloc(void *ptr, size_t size)
 
     index = ptr2index(ptr);
 
+    if ((index < malloc_pageshift || index > last_index) &&
+        (hbp = huge_find(ptr)))
+    {
+        /* Resized where it is, or moved without a copy */
+        osize = (*hbp)->size;
+        if (!malloc_realloc && size >= MALLOC_HUGE)
+        {
+            size_t nsize = pageround(size);
+            if (nsize == osize)
+                return ptr;
+            p = mremap(ptr, osize, nsize, MREMAP_MAYMOVE);
+            if (p == MAP_FAILED)
+                return 0;
+            (*hbp)->page = p;
+            (*hbp)->size = nsize;
+            return p;
+        }
+        p = imalloc(size);
+        if (p)
+        {
+            memcpy(p, ptr, osize < size ? osize : size);
+            free_huge(hbp);
+        }
+        return p;
+    }
+
     if (index < malloc_pageshift)
     {
         wrtwarning("junk pointer, too low to make sense.\n");
@@ -933,6 +1047,26 @@ static void *irealloc(void *ptr, size_t size)
     return p;
 }
 
+/*
+ * Give the free pages back to the kernel, a batch at a time rather than a
+ * madvise() on each free(): they stay on the free list, and read back as
+ * zeroes when they are next used.
+ */
+static void purge_pages()
+{
+    struct pgfree *pf;
+
+    for (pf = free_list.next; pf; pf = pf->next)
+    {
+        if (pf->dirty)
+        {
+            madvise(pf->page, pf->size, MADV_DONTNEED);
+            pf->dirty = 0;
+        }
+    }
+    malloc_unpurged = 0;
+}
+
 /*
  * Free a sequence of pages
  */
@@ -1055,6 +1189,9 @@ static __inline__ void free_pages(void *ptr, int index, struct pginfo *info)
         }
     }
 
+    pf->dirty = 1;
+    malloc_unpurged += l;
+
     /* Return something to OS ? */
     if (!pf->next &&               /* If we're the last one, */
         pf->size > malloc_cache && /* ..and the cache is full, */
@@ -1082,6 +1219,9 @@ static __inline__ void free_pages(void *ptr, int index, struct pginfo *info)
     }
     if (pt)
         ifree(pt);
+
+    if (malloc_unpurged >= MALLOC_PURGE)
+        purge_pages();
 }
 
 /*
@@ -1161,7 +1301,8 @@ static __inline__ void free_bytes(void *ptr, int index, struct pginfo *info)
 static void ifree(void *ptr)
 {
     struct pginfo *info;
-    unsigned int index;
+    u_long index;
+    struct hugeblk **hbp;
 
     /* This is legal */
     if (!ptr)
@@ -1183,6 +1324,13 @@ static void ifree(void *ptr)
 
     index = ptr2index(ptr);
 
+    if ((index < malloc_pageshift || index > last_index) &&
+        (hbp = huge_find(ptr)))
+    {
+        free_huge(hbp);
+        return;
+    }
+
     if (index < malloc_pageshift)
     {
         wrtwarning("junk pointer, too low to make sense.\n");
@@ -1208,6 +1356,140 @@ static void ifree(void *ptr)
     return;
 }
 
+/*
+ * Per-thread caches of chunks. Each thread keeps up to MCACHE_MAX free
+ * chunks of each bucket's size, which malloc() and free() take and put back
+ * without the lock; the cache is filled from, and emptied to, the buckets
+ * MCACHE_BATCH chunks at a time, under one taking of the lock. To the rest
+ * of malloc a cached chunk is still allocated. With junk or zero filling
+ * on, the caches are not used, as every chunk must pass through
+ * malloc_bytes() and free_bytes().
+ */
+
+#define MCACHE_MAX 32
+#define MCACHE_BATCH 16
+
+struct mcache_bin
+{
+    void *head;   /* chunks, linked through their first word */
+    u_int count;
+};
+
+struct mcache
+{
+    struct mcache_bin bins[malloc_pageshift];
+};
+
+/* The calling thread's cache pointer (see pthread.c) */
+void **_pthread_mcache(void);
+
+/* The bucket that size bytes come from */
+static __inline__ int mcache_bucket(size_t size)
+{
+    int j = 1;
+    size_t i = (size < malloc_minsize ? malloc_minsize : size) - 1;
+    while (i >>= 1)
+        j++;
+    return j;
+}
+
+/* The calling thread's cache, made if it has none, or NULL */
+static struct mcache *mcache_get()
+{
+    struct mcache **slot = (struct mcache **)_pthread_mcache();
+    if (!*slot)
+    {
+        THREAD_LOCK();
+        *slot = imalloc(sizeof(struct mcache));
+        THREAD_UNLOCK();
+        if (*slot)
+            memset(*slot, 0, sizeof(struct mcache));
+    }
+    return *slot;
+}
+
+static void *mcache_malloc(struct mcache *mc, size_t size)
+{
+    int j = mcache_bucket(size);
+    struct mcache_bin *bin = &mc->bins[j];
+    if (!bin->head)
+    {
+        THREAD_LOCK();
+        while (bin->count < MCACHE_BATCH)
+        {
+            void **p = malloc_bytes(1U << j);
+            if (!p)
+                break;
+            *p = bin->head;
+            bin->head = p;
+            bin->count++;
+        }
+        THREAD_UNLOCK();
+        if (!bin->head)
+            return 0;
+    }
+    void **p = bin->head;
+    bin->head = *p;
+    bin->count--;
+    return p;
+}
+
+/* Empties count chunks from bin back to the buckets; the lock is held */
+static void mcache_drain(struct mcache_bin *bin, u_int count)
+{
+    while (count-- && bin->head)
+    {
+        void **p = bin->head;
+        bin->head = *p;
+        bin->count--;
+        ifree(p);
+    }
+}
+
+/*
+ * Caches ptr if it is a chunk. Returns 0 if it is not, for ifree() to deal
+ * with. The page directory is read without the lock: the page holding an
+ * allocated chunk cannot change hands, and extend_pgdir() never unmaps an
+ * old directory.
+ */
+static int mcache_free(struct mcache *mc, void *ptr)
+{
+    u_long index = ptr2index(ptr);
+    struct pginfo **dir = *(struct pginfo **volatile *)&page_dir;
+    if (index < malloc_pageshift || index > last_index)
+        return 0;
+    struct pginfo *info = dir[index];
+    if (info < MALLOC_MAGIC || ((u_long)ptr & (info->size - 1)))
+        return 0;
+
+    struct mcache_bin *bin = &mc->bins[info->shift];
+    if (bin->count == MCACHE_MAX)
+    {
+        THREAD_LOCK();
+        mcache_drain(bin, MCACHE_BATCH);
+        THREAD_UNLOCK();
+    }
+    *(void **)ptr = bin->head;
+    bin->head = ptr;
+    bin->count++;
+    return 1;
+}
+
+/* Empties the calling thread's cache as it exits (see pthread_exit). */
+void _malloc_thread_exit(void)
+{
+    struct mcache **slot = (struct mcache **)_pthread_mcache();
+    struct mcache *mc = *slot;
+    if (!mc)
+        return;
+    *slot = 0;
+    THREAD_LOCK();
+    for (u_int j = 0; j < malloc_pageshift; j++)
+        mcache_drain(&mc->bins[j], MCACHE_MAX);
+    ifree(mc);
+    THREAD_UNLOCK();
+}
+
 /*
  * These are the public exported interface routines.
  */
@@ -1215,6 +1497,13 @@ static void ifree(void *ptr)
 void *malloc(size_t size)
 {
     register void *r;
+    struct mcache *mc;
+
+    if (malloc_started && !malloc_junk && size && size <= malloc_maxsize &&
+        (mc = mcache_get()) && (r = mcache_malloc(mc, size)))
+    {
+        return r;
+    }
 
     THREAD_LOCK();
     malloc_func = " in malloc():";
@@ -1222,6 +1511,7 @@ void *malloc(size_t size)
     {
         wrtwarning("recursive call.\n");
         malloc_active--;
+        THREAD_UNLOCK();
         return (0);
     }
     if (!malloc_started)
@@ -1248,12 +1538,21 @@ void *malloc(size_t size)
 
 void free(void *ptr)
 {
+    struct mcache *mc;
+
+    if (ptr && malloc_started && !malloc_junk && (mc = mcache_get()) &&
+        mcache_free(mc, ptr))
+    {
+        return;
+    }
+
     THREAD_LOCK();
     malloc_func = " in free():";
     if (malloc_active++)
     {
         wrtwarning("recursive call.\n");
         malloc_active--;
+        THREAD_UNLOCK();
         return;
     }
     else
@@ -1276,6 +1575,7 @@ void *realloc(void *ptr, size_t size)
     {
         wrtwarning("recursive call.\n");
         malloc_active--;
+        THREAD_UNLOCK();
         return (0);
     }
     if (ptr && !malloc_started)
@@ -115,20 +115,12 @@ int vfprintf(FILE *stream, const char *fmt, va_list args)
     int ret = vsnprintf(buf, __LIBC_PRINTF_BUFSIZE, fmt, args);
     if (ret > 0)
     {
-        //   write(stream->fd, buf, ret);
-
-#if 1
-        /* slow but simple */
-        for (int i = 0; i < ret; i++)
+        size_t len = ret < __LIBC_PRINTF_BUFSIZE ? (size_t)ret
+                                                 : __LIBC_PRINTF_BUFSIZE - 1;
+        if (fwrite(buf, 1, len, stream) != len)
         {
-            stream->buffer[stream->offset++] = buf[i];
-            if (stream->offset == sizeof(stream->buffer) || buf[i] == '\n')
-            {
-                // flush
-                fflush(stream);
-            }
+            return -1;
         }
-#endif
     }
     return ret;
 }
@@ -137,33 +129,3 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 {
     return vsnprintf(buf, 0xffffffffUL, fmt, args);
 }
-
-void __do_fflush(FILE *stream)
-{
-    if (!stream)
-    {
-        return;
-    }
-
-    if (stream->offset > 0)
-    {
-        write(stream->fd, stream->buffer, stream->offset);
-        stream->offset = 0;
-    }
-}
-
-int fflush(FILE *stream)
-{
-    if (!stream)
-    {
-        __do_fflush(stdin);
-        __do_fflush(stdout);
-        __do_fflush(stderr);
-    }
-    else
-    {
-        __do_fflush(stream);
-    }
-
-    return 0;
-}
@@ -0,0 +1,361 @@
+#include "errno.h"
+#include "limits.h"
+#include "pthread/pthread.h"
+#include "stdlib.h"
+#include "sys/mman.h"
+#include "sys/types.h"
+#include "unistd.h"
+#include "weenix/trap.h"
+
+/*
+ * Threads are the kernel's (see thr_create(2)). Each one's TLS pointer, its
+ * FS base, points at its struct pthread, whose first word points back at it,
+ * so that %fs:0 is pthread_self(). The first thread gets one only when it
+ * first creates another: until then errno is _libc_errno without looking at
+ * %fs, and so it stays for the first thread.
+ *
+ * Mutexes and condition variables sleep on futexes (see futex(2)). A mutex
+ * is 0 when unlocked, 1 when locked and 2 when locked with threads maybe
+ * waiting, so that an unlock only makes a system call if there might be one.
+ * A condition variable's futex is a sequence number bumped by each signal or
+ * broadcast, so that a waiter can tell it missed one.
+ */
+
+#define PTHREAD_STACK_SIZE (256 * 1024)
+
+typedef struct pthread_cleanup
+{
+    void (*pc_routine)(void *);
+    void *pc_arg;
+    struct pthread_cleanup *pc_next;
+} pthread_cleanup_t;
+
+struct pthread
+{
+    struct pthread *pt_self; /* at %fs:0 */
+    int *pt_errnop;
+    int pt_errno;
+    pid_t pt_tid;
+    void *(*pt_func)(void *);
+    void *pt_arg;
+    void *pt_stack; /* mapped by pthread_create(), or NULL */
+    int pt_detached;
+    volatile int pt_done; /* set once it is exiting */
+    pthread_cleanup_t *pt_cleanup;
+    struct pthread *pt_next; /* on _pthread_detached */
+    void *pt_mcache;         /* its cache of malloc chunks (see malloc.c) */
+};
+
+struct pthread_mutex
+{
+    volatile int pm_locked; /* 0, 1, or 2 if there may be waiters */
+};
+
+struct pthread_cond
+{
+    volatile int pc_seq; /* bumped by each signal or broadcast */
+};
+
+static struct pthread _pthread_main;
+static int _pthread_started;
+
+/* Detached threads, freed once done by the next pthread_create() */
+static struct pthread *_pthread_detached;
+static volatile int _pthread_lock;
+
+static void _pthread_lock_take(void)
+{
+    while (__sync_lock_test_and_set(&_pthread_lock, 1))
+    {
+        sched_yield();
+    }
+}
+
+static void _pthread_lock_give(void) { __sync_lock_release(&_pthread_lock); }
+
+int *__errno_location(void)
+{
+    if (!_pthread_started)
+    {
+        return &_libc_errno;
+    }
+    struct pthread *self;
+    __asm__ volatile("movq %%fs:0, %0" : "=r"(self));
+    return self->pt_errnop;
+}
+
+pthread_t pthread_self(void)
+{
+    if (!_pthread_started)
+    {
+        return &_pthread_main;
+    }
+    struct pthread *self;
+    __asm__ volatile("movq %%fs:0, %0" : "=r"(self));
+    return self;
+}
+
+/* Gives back the calling thread's malloc cache (see malloc.c) */
+void _malloc_thread_exit(void);
+
+void **_pthread_mcache(void) { return &pthread_self()->pt_mcache; }
+
+static void _pthread_free(struct pthread *thr)
+{
+    if (thr->pt_stack)
+    {
+        munmap(thr->pt_stack, PTHREAD_STACK_SIZE);
+    }
+    free(thr);
+}
+
+/* Joins and frees the detached threads that are done. */
+static void _pthread_reap(void)
+{
+    _pthread_lock_take();
+    struct pthread **link = &_pthread_detached;
+    struct pthread *done = NULL;
+    while (*link)
+    {
+        struct pthread *thr = *link;
+        if (thr->pt_done)
+        {
+            *link = thr->pt_next;
+            thr->pt_next = done;
+            done = thr;
+        }
+        else
+        {
+            link = &thr->pt_next;
+        }
+    }
+    _pthread_lock_give();
+
+    while (done)
+    {
+        struct pthread *thr = done;
+        done = thr->pt_next;
+        thr_join(thr->pt_tid, NULL);
+        _pthread_free(thr);
+    }
+}
+
+static void _pthread_start(void *arg)
+{
+    struct pthread *self = arg;
+    self->pt_tid = gettid();
+    pthread_exit(self->pt_func(self->pt_arg));
+}
+
+int pthread_create(pthread_t *thr, const pthread_attr_t *attr,
+                   void *(*func)(void *), void *arg)
+{
+    if (!_pthread_started)
+    {
+        _pthread_main.pt_self = &_pthread_main;
+        _pthread_main.pt_errnop = &_libc_errno;
+        _pthread_main.pt_tid = gettid();
+        if (set_tls(&_pthread_main) < 0)
+        {
+            return errno;
+        }
+        _pthread_started = 1;
+    }
+    _pthread_reap();
+
+    struct pthread *t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        return ENOMEM;
+    }
+    t->pt_stack = mmap(NULL, PTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (t->pt_stack == MAP_FAILED)
+    {
+        free(t);
+        return ENOMEM;
+    }
+    t->pt_self = t;
+    t->pt_errnop = &t->pt_errno;
+    t->pt_func = func;
+    t->pt_arg = arg;
+
+    /* As if _pthread_start had been called: 8 off a 16-byte boundary */
+    uintptr_t top = (uintptr_t)t->pt_stack + PTHREAD_STACK_SIZE - 8;
+    pid_t tid = thr_create(_pthread_start, t, (void *)top, t);
+    if (tid < 0)
+    {
+        int err = errno;
+        _pthread_free(t);
+        return err;
+    }
+    t->pt_tid = tid;
+    *thr = t;
+    return 0;
+}
+
+void pthread_exit(void *retval)
+{
+    struct pthread *self = pthread_self();
+    while (self->pt_cleanup)
+    {
+        pthread_cleanup_pop(1);
+    }
+    _malloc_thread_exit();
+    self->pt_done = 1;
+    trap(SYS_thr_exit, (ssize_t)retval);
+    __builtin_unreachable();
+}
+
+int pthread_join(pthread_t thr, void **retval)
+{
+    if (thr == pthread_self())
+    {
+        return EDEADLK;
+    }
+    if (thr->pt_detached)
+    {
+        return EINVAL;
+    }
+    if (thr_join(thr->pt_tid, retval) < 0)
+    {
+        return errno;
+    }
+    if (thr != &_pthread_main)
+    {
+        _pthread_free(thr);
+    }
+    return 0;
+}
+
+int pthread_detach(pthread_t thr)
+{
+    if (thr->pt_detached)
+    {
+        return EINVAL;
+    }
+    if (thr == &_pthread_main)
+    {
+        thr->pt_detached = 1; /* never freed: there is nothing to free */
+        return 0;
+    }
+    _pthread_lock_take();
+    thr->pt_detached = 1;
+    thr->pt_next = _pthread_detached;
+    _pthread_detached = thr;
+    _pthread_lock_give();
+    return 0;
+}
+
+int pthread_equal(pthread_t a, pthread_t b) { return a == b; }
+
+void pthread_yield(void) { sched_yield(); }
+
+/* The thread exits at its next system call or preemption, without running
+ * its cleanup routines. */
+int pthread_cancel(pthread_t thr)
+{
+    return thr_cancel(thr->pt_tid) < 0 ? errno : 0;
+}
+
+void pthread_cleanup_push(void (*routine)(void *), void *routine_arg)
+{
+    pthread_cleanup_t *pc = malloc(sizeof(*pc));
+    if (!pc)
+    {
+        return;
+    }
+    struct pthread *self = pthread_self();
+    pc->pc_routine = routine;
+    pc->pc_arg = routine_arg;
+    pc->pc_next = self->pt_cleanup;
+    self->pt_cleanup = pc;
+}
+
+void pthread_cleanup_pop(int execute)
+{
+    struct pthread *self = pthread_self();
+    pthread_cleanup_t *pc = self->pt_cleanup;
+    if (!pc)
+    {
+        return;
+    }
+    self->pt_cleanup = pc->pc_next;
+    if (execute)
+    {
+        pc->pc_routine(pc->pc_arg);
+    }
+    free(pc);
+}
+
+int pthread_mutex_init(pthread_mutex_t *mtx, const pthread_mutexattr_t *attr)
+{
+    *mtx = calloc(1, sizeof(**mtx));
+    return *mtx ? 0 : ENOMEM;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mtx)
+{
+    struct pthread_mutex *m = *mtx;
+    if (__sync_bool_compare_and_swap(&m->pm_locked, 0, 1))
+    {
+        return 0;
+    }
+    while (__sync_lock_test_and_set(&m->pm_locked, 2))
+    {
+        futex((int *)&m->pm_locked, FUTEX_WAIT, 2);
+    }
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mtx)
+{
+    return __sync_bool_compare_and_swap(&(*mtx)->pm_locked, 0, 1) ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mtx)
+{
+    struct pthread_mutex *m = *mtx;
+    if (__sync_fetch_and_sub(&m->pm_locked, 1) != 1)
+    {
+        m->pm_locked = 0;
+        futex((int *)&m->pm_locked, FUTEX_WAKE, 1);
+    }
+    return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    *cond = calloc(1, sizeof(**cond));
+    return *cond ? 0 : ENOMEM;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    free(*cond);
+    *cond = NULL;
+    return 0;
+}
+
+/* Woken by any signal or broadcast after mtx is released */
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx)
+{
+    int seq = (*cond)->pc_seq;
+    pthread_mutex_unlock(mtx);
+    futex((int *)&(*cond)->pc_seq, FUTEX_WAIT, seq);
+    return pthread_mutex_lock(mtx);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __sync_fetch_and_add(&(*cond)->pc_seq, 1);
+    futex((int *)&(*cond)->pc_seq, FUTEX_WAKE, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    __sync_fetch_and_add(&(*cond)->pc_seq, 1);
+    futex((int *)&(*cond)->pc_seq, FUTEX_WAKE, INT_MAX);
+    return 0;
+}
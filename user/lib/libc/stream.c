@@ -1,11 +1,520 @@
+/*
+ * Buffered streams. Each stream has one buffer, which holds either what has
+ * been read ahead of the caller or what has been written but not yet passed
+ * to write(2), depending on which the stream last did. A write that would
+ * not fit in the buffer flushes it, and one as big as the buffer goes
+ * straight to write(2); likewise a read as big as the buffer goes straight
+ * to read(2). Whether a stream is line buffered is decided at its first use,
+ * by asking whether it is on a tty. Every open stream is on a list, which
+ * fflush(NULL) and exit() flush.
+ */
+
+#include "errno.h"
+#include "fcntl.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+
+#define __SRD 0x01  /* the buffer holds data read ahead */
+#define __SWR 0x02  /* the buffer holds data to be written */
+#define __SEOF 0x04 /* read(2) has returned 0 */
+#define __SERR 0x08 /* read(2) or write(2) has failed */
+#define __SMBF 0x10 /* buf was malloc()ed here */
+#define __SSTD 0x20 /* one of stdstreams, not malloc()ed */
+
+static char stdinbuf[BUFSIZ];
+static char stdoutbuf[BUFSIZ];
 
 static FILE stdstreams[3] = {
-    {.fd = 0, .offset = 0},
-    {.fd = 1, .offset = 0},
-    {.fd = 2, .offset = 0},
+    {.fd = 0,
+     .flags = __SSTD,
+     .mode = -1,
+     .buf = stdinbuf,
+     .bufsize = BUFSIZ,
+     .next = &stdstreams[1]},
+    {.fd = 1,
+     .flags = __SSTD,
+     .mode = -1,
+     .buf = stdoutbuf,
+     .bufsize = BUFSIZ,
+     .next = &stdstreams[2]},
+    {.fd = 2, .flags = __SSTD, .mode = _IONBF, .buf = &stdstreams[2].onebuf,
+     .bufsize = 1},
 };
 
 FILE *stdin = &stdstreams[0];
 FILE *stdout = &stdstreams[1];
 FILE *stderr = &stdstreams[2];
+
+static FILE *streams = &stdstreams[0];
+
+/* Decides the stream's buffering and gets its buffer, if that has not been
+ * done yet. A stream that cannot have a buffer is made unbuffered. */
+static void __stream_setup(FILE *stream)
+{
+    if (stream->mode < 0)
+    {
+        stream->mode = isatty(stream->fd) ? _IOLBF : _IOFBF;
+    }
+    if (stream->mode == _IONBF)
+    {
+        stream->buf = &stream->onebuf;
+        stream->bufsize = 1;
+    }
+    else if (!stream->buf)
+    {
+        if (!stream->bufsize)
+        {
+            stream->bufsize = BUFSIZ;
+        }
+        if ((stream->buf = malloc(stream->bufsize)))
+        {
+            stream->flags |= __SMBF;
+        }
+        else
+        {
+            stream->mode = _IONBF;
+            stream->buf = &stream->onebuf;
+            stream->bufsize = 1;
+        }
+    }
+}
+
+/* Writes all of buf, whatever write(2) takes each time. Returns how much was
+ * written, which is less than len only on an error. */
+static size_t __stream_write(FILE *stream, const char *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = write(stream->fd, buf + done, len - done);
+        if (ret <= 0)
+        {
+            stream->flags |= __SERR;
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/* Writes out what has been written to the stream. Returns 0 or EOF. */
+static int __stream_flush_write(FILE *stream)
+{
+    size_t len = stream->wlen;
+    stream->wlen = 0;
+    return __stream_write(stream, stream->buf, len) == len ? 0 : EOF;
+}
+
+/* Drops what has been read ahead, moving the file offset back over it, if
+ * the file has one. Returns 0, or EOF if it has none, in which case what was
+ * read ahead is kept. */
+static int __stream_drop_read(FILE *stream)
+{
+    size_t ahead = stream->rlen - stream->rpos;
+    if (ahead && lseek(stream->fd, -(off_t)ahead, SEEK_CUR) < 0)
+    {
+        return EOF;
+    }
+    stream->rpos = stream->rlen = 0;
+    return 0;
+}
+
+/* Makes the stream ready to write. Returns 0 or EOF. */
+static int __stream_to_write(FILE *stream)
+{
+    __stream_setup(stream);
+    if (stream->flags & __SRD)
+    {
+        if (__stream_drop_read(stream))
+        {
+            stream->flags |= __SERR;
+            return EOF;
+        }
+        stream->flags &= ~__SRD;
+    }
+    stream->flags |= __SWR;
+    return 0;
+}
+
+/* Makes the stream ready to read. Returns 0 or EOF. */
+static int __stream_to_read(FILE *stream)
+{
+    __stream_setup(stream);
+    if (stream->flags & __SWR)
+    {
+        if (__stream_flush_write(stream))
+        {
+            return EOF;
+        }
+        stream->flags &= ~__SWR;
+    }
+    stream->flags |= __SRD;
+    return 0;
+}
+
+/* Reads at most len bytes into buf with one read(2). Before waiting on a
+ * tty, the line buffered streams are written out, so that a prompt is seen
+ * before its answer is read. */
+static ssize_t __stream_read(FILE *stream, char *buf, size_t len)
+{
+    if (stream->mode == _IOLBF)
+    {
+        for (FILE *f = streams; f; f = f->next)
+        {
+            if (f->mode == _IOLBF && (f->flags & __SWR) && f->wlen)
+            {
+                __stream_flush_write(f);
+            }
+        }
+    }
+    ssize_t ret = read(stream->fd, buf, len);
+    if (ret == 0)
+    {
+        stream->flags |= __SEOF;
+    }
+    else if (ret < 0)
+    {
+        stream->flags |= __SERR;
+    }
+    return ret;
+}
+
+FILE *fdopen(int fd, const char *mode)
+{
+    if (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a')
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    FILE *stream = calloc(1, sizeof(FILE));
+    if (!stream)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    stream->fd = fd;
+    stream->mode = -1;
+    stream->next = streams;
+    streams = stream;
+    return stream;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+    int plus = mode[0] && (mode[1] == '+' || (mode[1] && mode[2] == '+'));
+    int flags;
+    switch (mode[0])
+    {
+    case 'r':
+        flags = plus ? O_RDWR : O_RDONLY;
+        break;
+    case 'w':
+        flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+        break;
+    case 'a':
+        flags = (plus ? O_RDWR : O_WRONLY) | O_CREAT | O_APPEND;
+        break;
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, flags, 0666);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    FILE *stream = fdopen(fd, mode);
+    if (!stream)
+    {
+        close(fd);
+    }
+    return stream;
+}
+
+int fclose(FILE *stream)
+{
+    int ret = fflush(stream);
+    if (close(stream->fd) < 0)
+    {
+        ret = EOF;
+    }
+    for (FILE **f = &streams; *f; f = &(*f)->next)
+    {
+        if (*f == stream)
+        {
+            *f = stream->next;
+            break;
+        }
+    }
+    if (stream->flags & __SMBF)
+    {
+        free(stream->buf);
+    }
+    if (!(stream->flags & __SSTD))
+    {
+        free(stream);
+    }
+    return ret;
+}
+
+int setvbuf(FILE *stream, char *buf, int mode, size_t size)
+{
+    if ((stream->flags & (__SRD | __SWR)) ||
+        (mode != _IOFBF && mode != _IOLBF && mode != _IONBF))
+    {
+        return EOF;
+    }
+    if (stream->flags & __SMBF)
+    {
+        free(stream->buf);
+        stream->flags &= ~__SMBF;
+    }
+    stream->mode = mode;
+    stream->buf = mode == _IONBF ? NULL : buf;
+    stream->bufsize = mode == _IONBF || !size ? BUFSIZ : size;
+    return 0;
+}
+
+void setbuf(FILE *stream, char *buf)
+{
+    setvbuf(stream, buf, buf ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    size_t len = size * nmemb;
+    if (!len || __stream_to_write(stream))
+    {
+        return 0;
+    }
+    const char *data = ptr;
+    size_t done;
+    if (len > stream->bufsize - stream->wlen || stream->mode == _IONBF)
+    {
+        if (stream->wlen && __stream_flush_write(stream))
+        {
+            return 0;
+        }
+    }
+    if (len >= stream->bufsize)
+    {
+        done = __stream_write(stream, data, len);
+    }
+    else
+    {
+        memcpy(stream->buf + stream->wlen, data, len);
+        stream->wlen += len;
+        done = len;
+        if (stream->mode == _IOLBF && memchr(data, '\n', len) &&
+            __stream_flush_write(stream))
+        {
+            done = 0;
+        }
+    }
+    return done / size;
+}
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    size_t len = size * nmemb;
+    if (!len || __stream_to_read(stream))
+    {
+        return 0;
+    }
+    char *data = ptr;
+    size_t done = 0;
+    while (done < len)
+    {
+        size_t ahead = stream->rlen - stream->rpos;
+        if (ahead)
+        {
+            size_t n = ahead < len - done ? ahead : len - done;
+            memcpy(data + done, stream->buf + stream->rpos, n);
+            stream->rpos += n;
+            done += n;
+            continue;
+        }
+        ssize_t ret;
+        if (len - done >= stream->bufsize)
+        {
+            if ((ret = __stream_read(stream, data + done, len - done)) <= 0)
+            {
+                break;
+            }
+            done += ret;
+        }
+        else
+        {
+            if ((ret = __stream_read(stream, stream->buf, stream->bufsize)) <=
+                0)
+            {
+                break;
+            }
+            stream->rpos = 0;
+            stream->rlen = ret;
+        }
+    }
+    return done / size;
+}
+
+int fgetc(FILE *stream)
+{
+    if ((stream->flags & __SRD) && stream->rpos < stream->rlen)
+    {
+        return (unsigned char)stream->buf[stream->rpos++];
+    }
+    unsigned char c;
+    return fread(&c, 1, 1, stream) ? c : EOF;
+}
+
+char *fgets(char *s, int size, FILE *stream)
+{
+    int i = 0;
+    while (i < size - 1)
+    {
+        int c = fgetc(stream);
+        if (c == EOF)
+        {
+            break;
+        }
+        s[i++] = (char)c;
+        if (c == '\n')
+        {
+            break;
+        }
+    }
+    if (!i || (stream->flags & __SERR))
+    {
+        return NULL;
+    }
+    s[i] = '\0';
+    return s;
+}
+
+int ungetc(int c, FILE *stream)
+{
+    if (c == EOF || __stream_to_read(stream))
+    {
+        return EOF;
+    }
+    if (!stream->rpos)
+    {
+        if (stream->rlen)
+        {
+            return EOF;
+        }
+        stream->rpos = stream->rlen = 1;
+    }
+    stream->buf[--stream->rpos] = (char)c;
+    stream->flags &= ~__SEOF;
+    return (unsigned char)c;
+}
+
+int fputc(int c, FILE *stream)
+{
+    unsigned char ch = (unsigned char)c;
+    if ((stream->flags & __SWR) && stream->mode == _IOFBF &&
+        stream->wlen < stream->bufsize)
+    {
+        stream->buf[stream->wlen++] = (char)ch;
+        return ch;
+    }
+    return fwrite(&ch, 1, 1, stream) ? ch : EOF;
+}
+
+int fputs(const char *s, FILE *stream)
+{
+    size_t len = strlen(s);
+    return fwrite(s, 1, len, stream) == len ? 0 : EOF;
+}
+
+/* With no stream, writes out every stream that is writing; reading streams
+ * are left alone, so that nothing typed ahead is lost. */
+int fflush(FILE *stream)
+{
+    if (!stream)
+    {
+        int ret = 0;
+        for (FILE *f = streams; f; f = f->next)
+        {
+            if ((f->flags & __SWR) && f->wlen && __stream_flush_write(f))
+            {
+                ret = EOF;
+            }
+        }
+        return ret;
+    }
+    if (stream->flags & __SWR)
+    {
+        return __stream_flush_write(stream);
+    }
+    if (stream->flags & __SRD)
+    {
+        __stream_drop_read(stream);
+    }
+    return 0;
+}
+
+int fseek(FILE *stream, long offset, int whence)
+{
+    if (stream->flags & __SWR)
+    {
+        if (__stream_flush_write(stream))
+        {
+            return -1;
+        }
+    }
+    else if (stream->flags & __SRD)
+    {
+        if (whence == SEEK_CUR)
+        {
+            offset -= (long)(stream->rlen - stream->rpos);
+        }
+        stream->rpos = stream->rlen = 0;
+    }
+    if (lseek(stream->fd, offset, whence) < 0)
+    {
+        return -1;
+    }
+    stream->flags &= ~(__SRD | __SWR | __SEOF);
+    return 0;
+}
+
+long ftell(FILE *stream)
+{
+    off_t pos = lseek(stream->fd, 0, SEEK_CUR);
+    if (pos < 0)
+    {
+        return -1;
+    }
+    if (stream->flags & __SWR)
+    {
+        return (long)(pos + stream->wlen);
+    }
+    if (stream->flags & __SRD)
+    {
+        return (long)(pos - (stream->rlen - stream->rpos));
+    }
+    return (long)pos;
+}
+
+void rewind(FILE *stream)
+{
+    fseek(stream, 0, SEEK_SET);
+    stream->flags &= ~__SERR;
+}
+
+int feof(FILE *stream) { return !!(stream->flags & __SEOF); }
+
+int ferror(FILE *stream) { return !!(stream->flags & __SERR); }
+
+void clearerr(FILE *stream) { stream->flags &= ~(__SEOF | __SERR); }
+
+int fileno(FILE *stream) { return stream->fd; }
+
+/* With DYNAMIC=1, a program whose main() returns leaves through ld-weenix's
+ * own exit(), which knows nothing of these streams; it calls this (DT_FINI)
+ * on the way out. */
+void _fini(void) { fflush(NULL); }
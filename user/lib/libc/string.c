@@ -3,6 +3,27 @@
 #include "sys/types.h"
 #include <stdlib.h>
 
+/*
+ * memcpy, memset, memchr, strlen and strcmp work a word at a time once the
+ * pointers are aligned, with the ends done bytewise. A word holds a zero
+ * byte exactly when WORD_HAS_ZERO is nonzero, which is how the string
+ * functions find their terminators (and memchr its byte, after XORing it
+ * away) eight bytes at a time. An aligned word never straddles a page, so
+ * reading the whole of the one a string ends in is safe.
+ *
+ * The kernel does not save SSE state across context switches, so there
+ * are no SIMD variants: XMM registers are not ours to rely on.
+ */
+typedef unsigned long __attribute__((__may_alias__)) word_t;
+/* For the x86's unaligned loads, where only the destination is aligned */
+typedef unsigned long __attribute__((__may_alias__, __aligned__(1))) uword_t;
+
+#define WORD_SIZE sizeof(word_t)
+#define WORD_ONES 0x0101010101010101UL
+#define WORD_HIGHS 0x8080808080808080UL
+#define WORD_HAS_ZERO(w) (((w)-WORD_ONES) & ~(w)&WORD_HIGHS)
+#define WORD_ALIGNED(p) (!((uintptr_t)(p) & (WORD_SIZE - 1)))
+
 int memcmp(const void *cs, const void *ct, size_t count)
 {
     const unsigned char *su1, *su2;
@@ -23,12 +44,54 @@ void *memcpy(void *dest, const void *src, size_t count)
     char *tmp = (char *)dest;
     const char *s = src;
 
+    for (; count && !WORD_ALIGNED(tmp); count--)
+        *tmp++ = *s++;
+    for (; count >= 4 * WORD_SIZE; count -= 4 * WORD_SIZE)
+    {
+        ((word_t *)tmp)[0] = ((const uword_t *)s)[0];
+        ((word_t *)tmp)[1] = ((const uword_t *)s)[1];
+        ((word_t *)tmp)[2] = ((const uword_t *)s)[2];
+        ((word_t *)tmp)[3] = ((const uword_t *)s)[3];
+        tmp += 4 * WORD_SIZE;
+        s += 4 * WORD_SIZE;
+    }
+    for (; count >= WORD_SIZE; count -= WORD_SIZE)
+    {
+        *(word_t *)tmp = *(const uword_t *)s;
+        tmp += WORD_SIZE;
+        s += WORD_SIZE;
+    }
     while (count--)
         *tmp++ = *s++;
 
     return dest;
 }
 
+void *memchr(const void *s, int c, size_t count)
+{
+    const unsigned char *sc = s;
+    unsigned char ch = (unsigned char)c;
+
+    for (; count && !WORD_ALIGNED(sc); count--, sc++)
+    {
+        if (*sc == ch)
+            return (void *)sc;
+    }
+    word_t pattern = ch * WORD_ONES;
+    for (; count >= WORD_SIZE; count -= WORD_SIZE, sc += WORD_SIZE)
+    {
+        word_t w = *(const word_t *)sc ^ pattern;
+        if (WORD_HAS_ZERO(w))
+            break;
+    }
+    for (; count; count--, sc++)
+    {
+        if (*sc == ch)
+            return (void *)sc;
+    }
+    return NULL;
+}
+
 int strncmp(const char *cs, const char *ct, size_t count)
 {
     register signed char __res = 0;
@@ -49,6 +112,25 @@ int strcmp(const char *cs, const char *ct)
 {
     register signed char __res;
 
+    if (((uintptr_t)cs & (WORD_SIZE - 1)) == ((uintptr_t)ct & (WORD_SIZE - 1)))
+    {
+        for (; !WORD_ALIGNED(cs); cs++, ct++)
+        {
+            if ((__res = *cs - *ct) != 0 || !*cs)
+                return __res;
+        }
+        // Skip the words that match and end no string; the byte loop below
+        // finds the difference or the end in the word that stops this one
+        while (1)
+        {
+            word_t w = *(const word_t *)cs;
+            if (w != *(const word_t *)ct || WORD_HAS_ZERO(w))
+                break;
+            cs += WORD_SIZE;
+            ct += WORD_SIZE;
+        }
+    }
+
     while (1)
     {
         if ((__res = *cs - *ct++) != 0 || !*cs++)
@@ -88,6 +170,22 @@ void *memset(void *s, int c, size_t count)
 {
     char *xs = (char *)s;
 
+    for (; count && !WORD_ALIGNED(xs); count--)
+        *xs++ = c;
+    word_t pattern = (unsigned char)c * WORD_ONES;
+    for (; count >= 4 * WORD_SIZE; count -= 4 * WORD_SIZE)
+    {
+        ((word_t *)xs)[0] = pattern;
+        ((word_t *)xs)[1] = pattern;
+        ((word_t *)xs)[2] = pattern;
+        ((word_t *)xs)[3] = pattern;
+        xs += 4 * WORD_SIZE;
+    }
+    for (; count >= WORD_SIZE; count -= WORD_SIZE)
+    {
+        *(word_t *)xs = pattern;
+        xs += WORD_SIZE;
+    }
     while (count--)
         *xs++ = c;
 
@@ -121,10 +219,16 @@ size_t strlen(const char *s)
 {
     const char *sc;
 
-    for (sc = s; *sc != '\0'; ++sc)
+    for (sc = s; !WORD_ALIGNED(sc); ++sc)
     {
-        /* nothing */}
-        return sc - s;
+        if (*sc == '\0')
+            return sc - s;
+    }
+    while (!WORD_HAS_ZERO(*(const word_t *)sc))
+        sc += WORD_SIZE;
+    while (*sc != '\0')
+        ++sc;
+    return sc - s;
 }
 
 char *strchr(const char *s, int c)
@@ -102,6 +102,8 @@ void _Exit(int status)
 
 int sched_yield(void) { return (int)trap(SYS_sched_yield, NULL); }
 
+int nice(int incr) { return (int)trap(SYS_nice, (uintptr_t)incr); }
+
 pid_t wait(int *status)
 {
     waitpid_args_t args;
@@ -126,7 +128,113 @@ pid_t waitpid(pid_t pid, int *status, int options)
 
 void thr_exit(int status) { trap(SYS_thr_exit, (ssize_t)status); }
 
-pid_t getpid(void) { return (int)trap(SYS_getpid, 0); }
+pid_t thr_create(void (*entry)(void *), void *arg, void *stack, void *tls)
+{
+    thr_create_args_t args;
+
+    args.tca_entry = entry;
+    args.tca_arg = arg;
+    args.tca_stack = stack;
+    args.tca_tls = tls;
+
+    return (pid_t)trap(SYS_thr_create, (uintptr_t)&args);
+}
+
+int thr_join(pid_t tid, void **retval)
+{
+    thr_join_args_t args;
+
+    args.tja_tid = tid;
+    args.tja_retval = retval;
+
+    return (int)trap(SYS_thr_join, (uintptr_t)&args);
+}
+
+int thr_cancel(pid_t tid) { return (int)trap(SYS_thr_cancel, (ssize_t)tid); }
+
+pid_t gettid(void) { return (pid_t)trap(SYS_gettid, 0); }
+
+int set_tls(void *tls) { return (int)trap(SYS_set_tls, (uintptr_t)tls); }
+
+int futex(int *addr, int op, int val)
+{
+    futex_args_t args;
+
+    args.fa_addr = addr;
+    args.fa_op = op;
+    args.fa_val = val;
+
+    return (int)trap(SYS_futex, (uintptr_t)&args);
+}
+
+int perfctr(int op, int events, uint64_t *counts)
+{
+    perfctr_args_t args;
+
+    args.pa_op = op;
+    args.pa_events = events;
+    args.pa_counts = counts;
+
+    return (int)trap(SYS_perfctr, (uintptr_t)&args);
+}
+
+int sched_setaffinity(pid_t pid, size_t len, const unsigned long *mask)
+{
+    sched_affinity_args_t args;
+
+    args.sa_pid = pid;
+    args.sa_len = len;
+    args.sa_mask = (unsigned long *)mask;
+
+    return (int)trap(SYS_sched_setaffinity, (uintptr_t)&args);
+}
+
+int sched_getaffinity(pid_t pid, size_t len, unsigned long *mask)
+{
+    sched_affinity_args_t args;
+
+    args.sa_pid = pid;
+    args.sa_len = len;
+    args.sa_mask = mask;
+
+    return (int)trap(SYS_sched_getaffinity, (uintptr_t)&args);
+}
+
+int getrlimit(int resource, struct rlimit *rlim)
+{
+    rlimit_args_t args;
+
+    args.ra_resource = resource;
+    args.ra_rlim = rlim;
+
+    return (int)trap(SYS_getrlimit, (uintptr_t)&args);
+}
+
+int setrlimit(int resource, const struct rlimit *rlim)
+{
+    rlimit_args_t args;
+
+    args.ra_resource = resource;
+    args.ra_rlim = (struct rlimit *)rlim;
+
+    return (int)trap(SYS_setrlimit, (uintptr_t)&args);
+}
+
+char *getcwd(char *buf, size_t size)
+{
+    getcwd_args_t args;
+
+    args.buf = buf;
+    args.size = size;
+
+    return trap(SYS_getcwd, (uintptr_t)&args) < 0 ? NULL : buf;
+}
+
+/* The kernel's vDSO pages, see weenix/syscall.h */
+#define VDSO_DATA ((const vdso_data_t *)VDSO_ADDR)
+#define VDSO_PROC ((const vdso_proc_t *)VDSO_PROC_ADDR)
+
+pid_t getpid(void) { return VDSO_PROC->vp_pid; }
 
 int halt(void) { return (int)trap(SYS_halt, 0); }
 
@@ -154,6 +262,70 @@ int munmap(void *addr, size_t len)
     return (int)trap(SYS_munmap, (uintptr_t)&args);
 }
 
+void *mremap(void *addr, size_t old_len, size_t new_len, int flags)
+{
+    mremap_args_t args;
+    args.addr = addr;
+    args.old_len = old_len;
+    args.new_len = new_len;
+    args.flags = flags;
+    return (void *)trap(SYS_mremap, (uintptr_t)&args);
+}
+
+int mprotect(void *addr, size_t len, int prot)
+{
+    mprotect_args_t args;
+    args.addr = addr;
+    args.len = len;
+    args.prot = prot;
+    return (int)trap(SYS_mprotect, (uintptr_t)&args);
+}
+
+int madvise(void *addr, size_t len, int advice)
+{
+    madvise_args_t args;
+    args.addr = addr;
+    args.len = len;
+    args.advice = advice;
+    return (int)trap(SYS_madvise, (uintptr_t)&args);
+}
+
+/*
+ * Named shared memory objects are files in the ramfs on /dev/shm: mapping
+ * one with MAP_SHARED maps the pages of the file itself, so every process
+ * that opens it by name shares them. fallocate() gives a new object its
+ * size. name is "/" and a name of no more than NAME_LEN - 1 characters.
+ */
+#define SHM_DIR "/dev/shm"
+
+static int shm_path(const char *name, char *path, size_t size)
+{
+    if (name[0] != '/' || !name[1] || strchr(name + 1, '/') ||
+        strlen(name) > NAME_LEN)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(path, size, "%s%s", SHM_DIR, name);
+    return 0;
+}
+
+int shm_open(const char *name, int flags, int mode)
+{
+    char path[sizeof(SHM_DIR) + NAME_LEN];
+    if (shm_path(name, path, sizeof(path)))
+        return -1;
+    return open(path, flags, mode);
+}
+
+int shm_unlink(const char *name)
+{
+    char path[sizeof(SHM_DIR) + NAME_LEN];
+    if (shm_path(name, path, sizeof(path)))
+        return -1;
+    return unlink(path);
+}
+
 int debug(const char *str)
 {
     argstr_t argstr;
@@ -164,6 +336,22 @@ int debug(const char *str)
 
 void sync(void) { trap(SYS_sync, NULL); }
 
+int fsync(int fd) { return (int)trap(SYS_fsync, (ssize_t)fd); }
+
+int fdatasync(int fd) { return (int)trap(SYS_fdatasync, (ssize_t)fd); }
+
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    fallocate_args_t args;
+
+    args.fd = fd;
+    args.mode = mode;
+    args.offset = offset;
+    args.len = len;
+
+    return (int)trap(SYS_fallocate, (uintptr_t)&args);
+}
+
 int open(const char *filename, int flags, int mode)
 {
     open_args_t args;
@@ -178,35 +366,165 @@ int open(const char *filename, int flags, int mode)
 
 off_t lseek(int fd, off_t offset, int whence)
 {
-    lseek_args_t args;
+    return (off_t)trap4(SYS_lseek, fd, offset, whence, 0);
+}
+
+ssize_t read(int fd, void *buf, size_t nbytes)
+{
+    return trap4(SYS_read, fd, (ssize_t)buf, (ssize_t)nbytes, 0);
+}
+
+ssize_t write(int fd, const void *buf, size_t nbytes)
+{
+    return trap4(SYS_write, fd, (ssize_t)buf, (ssize_t)nbytes, 0);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    readv_args_t args;
+
+    args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_readv, (uintptr_t)&args);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    writev_args_t args;
 
     args.fd = fd;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+
+    return trap(SYS_writev, (uintptr_t)&args);
+}
+
+ssize_t pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+    return trap4(SYS_pread, fd, (ssize_t)buf, (ssize_t)nbytes, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+    return trap4(SYS_pwrite, fd, (ssize_t)buf, (ssize_t)nbytes, offset);
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    sendfile_args_t args;
+
+    args.out_fd = out_fd;
+    args.in_fd = in_fd;
     args.offset = offset;
-    args.whence = whence;
+    args.count = count;
 
-    return (int)trap(SYS_lseek, (uintptr_t)&args);
+    return trap(SYS_sendfile, (uintptr_t)&args);
 }
 
-ssize_t read(int fd, void *buf, size_t nbytes)
+ssize_t vmsplice(int fd, const struct iovec *iov, int iovcnt,
+                 unsigned int flags)
 {
-    read_args_t args;
+    vmsplice_args_t args;
 
     args.fd = fd;
-    args.buf = buf;
-    args.nbytes = nbytes;
+    args.iov = iov;
+    args.iovcnt = iovcnt;
+    args.flags = flags;
 
-    return trap(SYS_read, (uintptr_t)&args);
+    return trap(SYS_vmsplice, (uintptr_t)&args);
 }
 
-ssize_t write(int fd, const void *buf, size_t nbytes)
+int poll(struct pollfd *fds, int nfds, int timeout)
 {
-    write_args_t args;
+    poll_args_t args;
+
+    args.fds = fds;
+    args.nfds = nfds;
+    args.timeout = timeout;
+
+    return (int)trap(SYS_poll, (uintptr_t)&args);
+}
+
+int ioctl(int fd, unsigned long cmd, void *arg)
+{
+    ioctl_args_t args;
 
     args.fd = fd;
-    args.buf = (void *)buf;
-    args.nbytes = nbytes;
+    args.cmd = cmd;
+    args.arg = arg;
+
+    return (int)trap(SYS_ioctl, (uintptr_t)&args);
+}
+
+/* A tty is what answers TCGETA */
+int isatty(int fd)
+{
+    termio_t tio;
+    return ioctl(fd, TCGETA, &tio) == 0;
+}
+
+int epoll_create(void)
+{
+    return (int)trap(SYS_epoll_create, 0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    epoll_ctl_args_t args;
+
+    args.epfd = epfd;
+    args.op = op;
+    args.fd = fd;
+    args.event = event;
+
+    return (int)trap(SYS_epoll_ctl, (uintptr_t)&args);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout)
+{
+    epoll_wait_args_t args;
+
+    args.epfd = epfd;
+    args.events = events;
+    args.maxevents = maxevents;
+    args.timeout = timeout;
+
+    return (int)trap(SYS_epoll_wait, (uintptr_t)&args);
+}
+
+int aio_submit(const struct aio_sqe *sqes, int nr)
+{
+    aio_submit_args_t args;
+
+    args.sqes = sqes;
+    args.nr = nr;
+
+    return (int)trap(SYS_aio_submit, (uintptr_t)&args);
+}
+
+int aio_reap(struct aio_cqe *cqes, int min_nr, int nr)
+{
+    aio_reap_args_t args;
+
+    args.cqes = cqes;
+    args.min_nr = min_nr;
+    args.nr = nr;
+
+    return (int)trap(SYS_aio_reap, (uintptr_t)&args);
+}
 
-    return trap(SYS_write, (uintptr_t)&args);
+int batch(struct batch_entry *entries, int nentries, int flags)
+{
+    batch_args_t args;
+
+    args.entries = entries;
+    args.nentries = nentries;
+    args.flags = flags;
+
+    return (int)trap(SYS_batch, (uintptr_t)&args);
 }
 
 int close(int fd) { return (int)trap(SYS_close, (ssize_t)fd); }
@@ -215,12 +533,7 @@ int dup(int fd) { return (int)trap(SYS_dup, (ssize_t)fd); }
 
 int dup2(int ofd, int nfd)
 {
-    dup2_args_t args;
-
-    args.ofd = ofd;
-    args.nfd = nfd;
-
-    return (int)trap(SYS_dup2, (uintptr_t)&args);
+    return (int)trap4(SYS_dup2, ofd, nfd, 0, 0);
 }
 
 int mkdir(const char *path, int mode)
@@ -325,6 +638,57 @@ int execve(const char *filename, char *const argv[], char *const envp[])
     return (int)trap(SYS_execve, (uintptr_t)&args);
 }
 
+/* Builds the kernel's view of a NULL-terminated string vector. The caller
+ * frees vec->av_vec. */
+static int build_argvec(argvec_t *vec, char *const strs[])
+{
+    size_t i;
+    for (i = 0; strs[i] != NULL; i++)
+        ;
+    vec->av_len = i;
+    vec->av_vec = malloc((vec->av_len + 1) * sizeof(argstr_t));
+    if (!vec->av_vec)
+        return -1;
+    for (i = 0; strs[i] != NULL; i++)
+    {
+        vec->av_vec[i].as_len = strlen(strs[i]);
+        vec->av_vec[i].as_str = strs[i];
+    }
+    vec->av_vec[i].as_len = 0;
+    vec->av_vec[i].as_str = NULL;
+    return 0;
+}
+
+pid_t spawn(const char *filename, char *const argv[], char *const envp[],
+            int ndups, const int dups[][2])
+{
+    spawn_args_t args;
+
+    args.filename.as_len = strlen(filename);
+    args.filename.as_str = filename;
+
+    if (ndups < 0 || ndups > SPAWN_MAX_DUPS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    args.ndups = ndups;
+    memcpy(args.dups, dups, ndups * sizeof(dups[0]));
+
+    if (build_argvec(&args.argv, argv))
+        return -1;
+    if (build_argvec(&args.envp, envp))
+    {
+        free(args.argv.av_vec);
+        return -1;
+    }
+
+    pid_t pid = (pid_t)trap(SYS_spawn, (uintptr_t)&args);
+    free(args.argv.av_vec);
+    free(args.envp.av_vec);
+    return pid;
+}
+
 void thr_set_errno(int n) { trap(SYS_set_errno, (ssize_t)n); }
 
 int thr_errno(void) { return (int)trap(SYS_errno, 0); }
@@ -345,7 +709,7 @@ int mount(const char *spec, const char *dir, const char *fstype)
 {
     mount_args_t args;
 
-    args.spec.as_len = strlen(spec);
+    args.spec.as_len = spec ? strlen(spec) : 0;
     args.spec.as_str = spec;
     args.dir.as_len = strlen(dir);
     args.dir.as_str = dir;
@@ -377,11 +741,47 @@ int stat(const char *path, stat_t *buf)
     return (int)trap(SYS_stat, (uintptr_t)&args);
 }
 
+int fstat(int fd, stat_t *buf)
+{
+    fstat_args_t args;
+
+    args.fd = fd;
+    args.buf = buf;
+
+    return (int)trap(SYS_fstat, (uintptr_t)&args);
+}
+
+int fstatat(int dirfd, const char *path, stat_t *buf)
+{
+    fstatat_args_t args;
+
+    args.dirfd = dirfd;
+    args.path.as_len = strlen(path);
+    args.path.as_str = path;
+    args.buf = buf;
+
+    return (int)trap(SYS_fstatat, (uintptr_t)&args);
+}
+
 int pipe(int pipefd[2]) { return (int)trap(SYS_pipe, (uintptr_t)pipefd); }
 
 int uname(struct utsname *buf) { return (int)trap(SYS_uname, (uintptr_t)buf); }
 
-time_t time(time_t *tloc) { return (time_t)trap(SYS_time, (uintptr_t)tloc); }
+time_t time(time_t *tloc)
+{
+    time_t t = VDSO_DATA->vd_boot_time + (time_t)(uptime() / 1000);
+    if (tloc)
+    {
+        *tloc = t;
+    }
+    return t;
+}
+
+unsigned long uptime(void)
+{
+    return (unsigned long)(VDSO_DATA->vd_jiffies *
+                           VDSO_DATA->vd_usec_per_tick / 1000);
+}
 
 long usleep(useconds_t usec)
 {
@@ -1,7 +1,18 @@
 /*
- * Forks a shell for each terminal and waits for them.
+ * Starts the services listed in /etc/init.conf, all at once, and reaps
+ * them as they exit. With no list, it forks a shell for each terminal.
  * This is the final thing you should be executing
  * (with kernel_execve) in kernel-land once everything works.
+ *
+ * Each line of the list names a terminal in /dev, or * for every one, and
+ * the program to run there with its arguments:
+ *
+ *   # terminal  program  arguments...
+ *   *  /bin/sh
+ *
+ * Every service is forked before any is waited for, so that none waits on
+ * another to start, and the children are reaped with waitpid(WNOHANG)
+ * after each wakeup so that several exiting together cost one sleep.
  */
 
 #include <dirent.h>
@@ -13,10 +24,33 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#define SERVICES 32
+#define SERVICE_ARGS 16
+#define RUNNING 64
+
+typedef struct service
+{
+    char *sv_tty; /* a terminal in /dev, or "*" for each */
+    char *sv_argv[SERVICE_ARGS + 1];
+} service_t;
+
+typedef struct running
+{
+    pid_t rn_pid; /* 0 if the slot is free */
+    char rn_tty[NAME_LEN];
+    const char *rn_prog;
+} running_t;
+
+static service_t services[SERVICES];
+static int nservices;
+static running_t running[RUNNING];
+static char conf_buf[4096];
+
 char *empty[] = {NULL};
 
-const char *hi = "init: starting shell on ";
-const char *sh = "/bin/sh";
+const char *hi = "init: starting ";
+const char *conf = "/etc/init.conf";
+char *sh_argv[] = {"/bin/sh", NULL};
 const char *ttystr = "tty";
 const char *home = "/";
 const char *alldone = "init: no remaining processes\n";
@@ -43,9 +77,10 @@ static int open_tty(char *tty)
 
 static int canary = 0x12345678;
 
-static void spawn_shell_on(char *tty)
+static void start_service(service_t *sv, char *tty)
 {
-    if (!fork())
+    pid_t pid = fork();
+    if (!pid)
     {
         close(0);
         close(1);
@@ -57,17 +92,107 @@ static void spawn_shell_on(char *tty)
 
         chdir(home);
 
-        printf("%s%s\n", hi, tty);
+        printf("%s%s on %s\n", hi, sv->sv_argv[0], tty);
 
-        execve(sh, empty, empty);
+        execve(sv->sv_argv[0], sv->sv_argv, empty);
         fprintf(stderr, "exec failed!\n");
+        exit(1);
+    }
+    if (pid < 0)
+    {
+        printf("init: fork for %s: %s\n", sv->sv_argv[0], strerror(errno));
+        return;
+    }
+    for (int ii = 0; ii < RUNNING; ii++)
+    {
+        if (!running[ii].rn_pid)
+        {
+            running[ii].rn_pid = pid;
+            strncpy(running[ii].rn_tty, tty, NAME_LEN - 1);
+            running[ii].rn_prog = sv->sv_argv[0];
+            break;
+        }
+    }
+}
+
+/* Reads the service list into services, or makes it a shell on each
+ * terminal if there is none */
+static void read_services()
+{
+    int fd = open(conf, O_RDONLY, 0);
+    ssize_t len = fd < 0 ? -1 : read(fd, conf_buf, sizeof(conf_buf) - 1);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (len <= 0)
+    {
+        services[0].sv_tty = "*";
+        memcpy(services[0].sv_argv, sh_argv, sizeof(sh_argv));
+        nservices = 1;
+        return;
+    }
+    conf_buf[len] = '\0';
+
+    char *line = conf_buf;
+    while (line && nservices < SERVICES)
+    {
+        char *next = strchr(line, '\n');
+        if (next)
+        {
+            *next++ = '\0';
+        }
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+
+        service_t *sv = &services[nservices];
+        int argc = 0;
+        char *word = strtok(line, " \t");
+        if (word)
+        {
+            sv->sv_tty = word;
+            while (argc < SERVICE_ARGS && (word = strtok(NULL, " \t")))
+            {
+                sv->sv_argv[argc++] = word;
+            }
+            sv->sv_argv[argc] = NULL;
+        }
+        if (argc)
+        {
+            nservices++;
+        }
+        line = next;
     }
 }
 
+/* Reports how the child pid ended and frees its slot */
+static void reaped(pid_t pid, int status)
+{
+    for (int ii = 0; ii < RUNNING; ii++)
+    {
+        if (running[ii].rn_pid == pid)
+        {
+            if (EFAULT == status)
+            {
+                printf("init: %s on %s (process %i) faulted\n",
+                       running[ii].rn_prog, running[ii].rn_tty, pid);
+            }
+            running[ii].rn_pid = 0;
+            return;
+        }
+    }
+    if (EFAULT == status)
+    {
+        printf("process %i faulted\n", pid);
+    }
+}
 int main(int argc, char **argv, char **envp)
 {
-    int devdir, ii;
-    dirent_t d;
+    int devdir, ii, nbytes;
+    dirent_t d[16];
     int status;
 
     for (ii = 0; ii < NFILES; ii++)
@@ -82,26 +207,43 @@ int main(int argc, char **argv, char **envp)
     }
 
     chdir("/dev");
+    read_services();
 
     devdir = open("/dev", O_RDONLY, 0);
-    while (getdents(devdir, &d, sizeof(d)) > 0)
+    while ((nbytes = getdents(devdir, d, sizeof(d))) > 0)
     {
-        if (0 == strncmp(d.d_name, ttystr, strlen(ttystr)))
+        for (ii = 0; ii < nbytes / (int)sizeof(d[0]); ii++)
         {
-            spawn_shell_on(d.d_name);
+            if (strncmp(d[ii].d_name, ttystr, strlen(ttystr)))
+            {
+                continue;
+            }
+            for (int sv = 0; sv < nservices; sv++)
+            {
+                if (!strcmp(services[sv].sv_tty, "*"))
+                {
+                    start_service(&services[sv], d[ii].d_name);
+                }
+            }
         }
     }
     close(devdir);
+    for (int sv = 0; sv < nservices; sv++)
+    {
+        if (strcmp(services[sv].sv_tty, "*"))
+        {
+            start_service(&services[sv], services[sv].sv_tty);
+        }
+    }
 
     int pid;
     while (0 <= (pid = wait(&status)))
     {
-        if (EFAULT == status)
+        do
         {
-            printf("process %i faulted\n", pid);
-        }
+            reaped(pid, status);
+        } while (0 < (pid = waitpid(-1, &status, WNOHANG)));
     }
-
     if (ECHILD != errno)
     {
         printf("error: wait: %s\n", strerror(errno));
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <weenix/syscall.h>
+
+/*
+ * Shared by the benchmark programs (forkbench, faultbench, filebench,
+ * pipebench and dirbench). Each result is one line on stdout:
+ *
+ *   BENCH name=<name> ops=<n> cycles_per_op=<n> ms=<n> [bytes=<n> kb_per_sec=<n>]
+ *         [ipc_x100=<n> llc_misses_per_kop=<n> dtlb_misses_per_kop=<n>]
+ *
+ * whose keys do not change between builds, so that results can be scraped
+ * from the serial log. Cycles are the TSC's; milliseconds come from uptime()
+ * and are only as fine as the timer tick, so runs should take a while. The
+ * last three keys come from the performance counters (see perfctr(2)), when
+ * the CPU has them, and count only the benchmark's own thread.
+ */
+
+#define BENCH_EVENTS                                                        \
+    (1 << PERFCTR_CYCLES | 1 << PERFCTR_INSTRUCTIONS | 1 << PERFCTR_LLC_MISSES | \
+     1 << PERFCTR_DTLB_MISSES)
+
+typedef struct bench_timer
+{
+    uint64_t bt_cycles;
+    unsigned long bt_ms;
+    int bt_counting; /* the performance counters were started */
+} bench_timer_t;
+
+static inline uint64_t bench_rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void bench_start(bench_timer_t *t)
+{
+    t->bt_counting = perfctr(PERFCTR_START, BENCH_EVENTS, NULL) == 0;
+    t->bt_ms = uptime();
+    t->bt_cycles = bench_rdtsc();
+}
+
+/* Prints the result of ops operations timed since bench_start(t), which
+ * moved bytes bytes in all if bytes is nonzero. */
+static inline void bench_report(const char *name, const bench_timer_t *t,
+                                unsigned long ops, unsigned long bytes)
+{
+    uint64_t cycles = bench_rdtsc() - t->bt_cycles;
+    unsigned long ms = uptime() - t->bt_ms;
+    uint64_t counts[PERFCTR_EVENTS];
+    int counted = t->bt_counting && !perfctr(PERFCTR_READ, 0, counts);
+    printf("BENCH name=%s ops=%lu cycles_per_op=%lu ms=%lu", name, ops,
+           (unsigned long)(ops ? cycles / ops : 0), ms);
+    if (bytes)
+    {
+        printf(" bytes=%lu kb_per_sec=%lu", bytes,
+               ms ? bytes / 1024 * 1000 / ms : 0);
+    }
+    if (counted)
+    {
+        uint64_t c = counts[PERFCTR_CYCLES];
+        printf(" ipc_x100=%lu llc_misses_per_kop=%lu dtlb_misses_per_kop=%lu",
+               (unsigned long)(c ? counts[PERFCTR_INSTRUCTIONS] * 100 / c : 0),
+               (unsigned long)(ops ? counts[PERFCTR_LLC_MISSES] * 1000 / ops
+                                   : 0),
+               (unsigned long)(ops ? counts[PERFCTR_DTLB_MISSES] * 1000 / ops
+                                   : 0));
+        perfctr(PERFCTR_STOP, 0, NULL);
+    }
+    printf("\n");
+}
+
+/* The argument at i as a count, or dflt if there is none */
+static inline unsigned long bench_arg(int argc, char **argv, int i,
+                                      unsigned long dflt)
+{
+    if (argc <= i)
+    {
+        return dflt;
+    }
+    long n = atol(argv[i]);
+    return n > 0 ? (unsigned long)n : dflt;
+}
@@ -0,0 +1,124 @@
+/*
+ * dirbench [files]: directory operations over a directory of many empty
+ * files: creating them, listing it with getdents, stat of each by name, and
+ * unlinking them.
+ */
+
+#include "bench.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIRBENCH_PATH "/tmp/dirbench"
+#define DIRBENCH_FILES 512
+#define DIRBENCH_PASSES 8
+
+static dirent_t dirents[32];
+
+static void file_path(char *path, size_t len, unsigned long i)
+{
+    snprintf(path, len, "%s/f%lu", DIRBENCH_PATH, i);
+}
+
+static int create_files(unsigned long files)
+{
+    char path[64];
+    bench_timer_t t;
+    bench_start(&t);
+    for (unsigned long i = 0; i < files; i++)
+    {
+        file_path(path, sizeof(path), i);
+        int fd = open(path, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            fprintf(stderr, "dirbench: %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        close(fd);
+    }
+    bench_report("dir_create", &t, files, 0);
+    return 0;
+}
+
+/* Lists the directory DIRBENCH_PASSES times; an op is one entry read */
+static int list_files(void)
+{
+    unsigned long entries = 0;
+    bench_timer_t t;
+    bench_start(&t);
+    for (int pass = 0; pass < DIRBENCH_PASSES; pass++)
+    {
+        int fd = open(DIRBENCH_PATH, O_RDONLY, 0);
+        if (fd < 0)
+        {
+            return 1;
+        }
+        int n;
+        while ((n = getdents(fd, dirents, sizeof(dirents))) > 0)
+        {
+            entries += (unsigned long)n / sizeof(dirent_t);
+        }
+        close(fd);
+        if (n < 0)
+        {
+            fprintf(stderr, "dirbench: getdents: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    bench_report("dir_getdents", &t, entries, 0);
+    return 0;
+}
+
+static int stat_files(unsigned long files)
+{
+    char path[64];
+    struct stat sb;
+    bench_timer_t t;
+    bench_start(&t);
+    for (int pass = 0; pass < DIRBENCH_PASSES; pass++)
+    {
+        for (unsigned long i = 0; i < files; i++)
+        {
+            file_path(path, sizeof(path), i);
+            if (stat(path, &sb) < 0)
+            {
+                fprintf(stderr, "dirbench: stat %s: %s\n", path,
+                        strerror(errno));
+                return 1;
+            }
+        }
+    }
+    bench_report("dir_stat", &t, files * DIRBENCH_PASSES, 0);
+    return 0;
+}
+
+static void unlink_files(unsigned long files)
+{
+    char path[64];
+    bench_timer_t t;
+    bench_start(&t);
+    for (unsigned long i = 0; i < files; i++)
+    {
+        file_path(path, sizeof(path), i);
+        unlink(path);
+    }
+    bench_report("dir_unlink", &t, files, 0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long files = bench_arg(argc, argv, 1, DIRBENCH_FILES);
+    if (mkdir(DIRBENCH_PATH, 0755) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "dirbench: %s: %s\n", DIRBENCH_PATH, strerror(errno));
+        return 1;
+    }
+    int ret = create_files(files) || list_files() || stat_files(files);
+    unlink_files(files);
+    rmdir(DIRBENCH_PATH);
+    return ret;
+}
@@ -0,0 +1,52 @@
+/*
+ * faultbench [megabytes]: page fault throughput over a fresh anonymous
+ * mapping, first touching each page with a write and then, in another
+ * mapping, with a read (which may map the shared zero page).
+ */
+
+#include "bench.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FAULTBENCH_MB 16
+#define FAULTBENCH_PAGE 4096
+
+static int run(const char *name, size_t len, int write)
+{
+    volatile char *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "faultbench: mmap: %s\n", strerror(errno));
+        return 1;
+    }
+    bench_timer_t t;
+    bench_start(&t);
+    for (size_t off = 0; off < len; off += FAULTBENCH_PAGE)
+    {
+        if (write)
+        {
+            mem[off] = 1;
+        }
+        else
+        {
+            (void)mem[off];
+        }
+    }
+    bench_report(name, &t, len / FAULTBENCH_PAGE, len);
+    munmap((void *)mem, len);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = bench_arg(argc, argv, 1, FAULTBENCH_MB) * 1024 * 1024;
+    if (run("fault_write", len, 1) || run("fault_read", len, 0))
+    {
+        return 1;
+    }
+    return 0;
+}
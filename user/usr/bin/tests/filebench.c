@@ -0,0 +1,80 @@
+/*
+ * filebench [megabytes]: file bandwidth in page-sized chunks: a sequential
+ * write (with an fsync, so that the disk is part of it), a sequential read,
+ * then reads and writes of chunks picked at random.
+ */
+
+#include "bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILEBENCH_PATH "/tmp/filebench"
+#define FILEBENCH_MB 4
+#define FILEBENCH_CHUNK 4096
+
+static char buf[FILEBENCH_CHUNK];
+static uint64_t seed = 1;
+
+static size_t next_chunk(size_t chunks)
+{
+    seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+    return (size_t)(seed >> 33) % chunks;
+}
+
+/* Reads or writes chunks chunks of fd, at random or in order */
+static int run(const char *name, int fd, size_t chunks, int write_,
+               int random)
+{
+    if (lseek(fd, 0, SEEK_SET) < 0)
+    {
+        return 1;
+    }
+    bench_timer_t t;
+    bench_start(&t);
+    for (size_t i = 0; i < chunks; i++)
+    {
+        if (random && lseek(fd, (off_t)(next_chunk(chunks) * FILEBENCH_CHUNK),
+                            SEEK_SET) < 0)
+        {
+            return 1;
+        }
+        ssize_t n = write_ ? write(fd, buf, FILEBENCH_CHUNK)
+                           : read(fd, buf, FILEBENCH_CHUNK);
+        if (n != FILEBENCH_CHUNK)
+        {
+            fprintf(stderr, "filebench: %s: %s\n", name,
+                    n < 0 ? strerror(errno) : "short transfer");
+            return 1;
+        }
+    }
+    if (write_ && fsync(fd) < 0)
+    {
+        return 1;
+    }
+    bench_report(name, &t, chunks, chunks * FILEBENCH_CHUNK);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunks =
+        bench_arg(argc, argv, 1, FILEBENCH_MB) * 1024 * 1024 / FILEBENCH_CHUNK;
+    memset(buf, 'w', sizeof(buf));
+    int fd = open(FILEBENCH_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "filebench: %s: %s\n", FILEBENCH_PATH,
+                strerror(errno));
+        return 1;
+    }
+    int ret = run("file_seq_write", fd, chunks, 1, 0) ||
+              run("file_seq_read", fd, chunks, 0, 0) ||
+              run("file_rand_read", fd, chunks, 0, 1) ||
+              run("file_rand_write", fd, chunks, 1, 1);
+    close(fd);
+    unlink(FILEBENCH_PATH);
+    return ret;
+}
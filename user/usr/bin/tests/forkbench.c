@@ -0,0 +1,62 @@
+/*
+ * forkbench [iterations]: the latency of fork and wait, with and without an
+ * exec in between. The exec'd program is this one, which exits at once.
+ */
+
+#include "bench.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FORKBENCH_PATH "/usr/bin/forkbench"
+#define FORKBENCH_ITERS 200
+
+static int run(const char *name, unsigned long iters, int do_exec,
+               char **envp)
+{
+    char *args[] = {"forkbench", "-child", NULL};
+    bench_timer_t t;
+    bench_start(&t);
+    for (unsigned long i = 0; i < iters; i++)
+    {
+        int pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "forkbench: fork: %s\n", strerror(errno));
+            return 1;
+        }
+        if (!pid)
+        {
+            if (do_exec)
+            {
+                execve(FORKBENCH_PATH, args, envp);
+            }
+            exit(do_exec);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || status)
+        {
+            fprintf(stderr, "forkbench: child %d failed\n", pid);
+            return 1;
+        }
+    }
+    bench_report(name, &t, iters, 0);
+    return 0;
+}
+
+int main(int argc, char **argv, char **envp)
+{
+    if (argc > 1 && !strcmp(argv[1], "-child"))
+    {
+        return 0;
+    }
+    unsigned long iters = bench_arg(argc, argv, 1, FORKBENCH_ITERS);
+    if (run("fork_wait", iters, 0, envp) ||
+        run("fork_exec_wait", iters, 1, envp))
+    {
+        return 1;
+    }
+    return 0;
+}
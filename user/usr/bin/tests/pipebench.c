@@ -0,0 +1,71 @@
+/*
+ * pipebench [megabytes]: pipe throughput from a child writing in page-sized
+ * chunks to its parent reading them.
+ */
+
+#include "bench.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PIPEBENCH_MB 16
+#define PIPEBENCH_CHUNK 4096
+
+static char buf[PIPEBENCH_CHUNK];
+
+int main(int argc, char **argv)
+{
+    size_t len = bench_arg(argc, argv, 1, PIPEBENCH_MB) * 1024 * 1024;
+    int fds[2];
+    if (pipe(fds) < 0)
+    {
+        fprintf(stderr, "pipebench: pipe: %s\n", strerror(errno));
+        return 1;
+    }
+
+    bench_timer_t t;
+    bench_start(&t);
+    int pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "pipebench: fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if (!pid)
+    {
+        close(fds[0]);
+        for (size_t done = 0; done < len;)
+        {
+            ssize_t n = write(fds[1], buf, PIPEBENCH_CHUNK);
+            if (n <= 0)
+            {
+                exit(1);
+            }
+            done += (size_t)n;
+        }
+        exit(0);
+    }
+
+    close(fds[1]);
+    size_t total = 0;
+    unsigned long reads = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf, PIPEBENCH_CHUNK)) > 0)
+    {
+        total += (size_t)n;
+        reads++;
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n < 0 || status || total < len)
+    {
+        fprintf(stderr, "pipebench: moved %lu of %lu bytes\n",
+                (unsigned long)total, (unsigned long)len);
+        return 1;
+    }
+    bench_report("pipe", &t, reads, total);
+    return 0;
+}
@@ -44,7 +44,7 @@
 #define do_rmdir rmdir
 
 #define S5_BLOCK_SIZE 4096
-#define S5_MAX_FILE_BLOCKS 1052
+#define S5_MAX_FILE_BLOCKS (0xffffffffU / S5_BLOCK_SIZE)
 
 #define KASSERT(x) test_assert(x, NULL)
 #define dbg(code, fmt, args...) printf(fmt, ##args)
@@ -54,7 +54,7 @@
 #define BUFSIZE 256
 #define BIG_BUFSIZE 2056
 
-#define S5_MAX_FILE_SIZE S5_BLOCK_SIZE *S5_MAX_FILE_BLOCKS
+#define S5_MAX_FILE_SIZE ((size_t)S5_BLOCK_SIZE * S5_MAX_FILE_BLOCKS)
 
 static void get_file_name(char *buf, size_t sz, int fileno)
 {
@@ -173,17 +173,23 @@ static void test_running_out_of_inodes()
     test_assert(do_unlink("file") == 0, "Could not remove file");
 }
 
+// The largest file is far bigger than the disk, so only its last bytes are
+// written
 static void test_filling_file()
 {
     int res = 0;
     int fd = do_open("hugefile", O_RDWR | O_CREAT);
     KASSERT(fd >= 0);
 
-    res = write_until_fail(fd);
-    test_assert(res == 0, "Did not write to entire file");
+    char buf[BIG_BUFSIZE] = {0};
+    off_t off = (off_t)S5_MAX_FILE_SIZE - (off_t)sizeof(buf);
+    test_assert(do_lseek(fd, off, SEEK_SET) == off, "Could not seek");
+    res = do_write(fd, buf, sizeof(buf));
+    test_assert(res == sizeof(buf), "Could not write the end of the file");
+    test_assert(do_lseek(fd, 0, SEEK_END) == (off_t)S5_MAX_FILE_SIZE,
+                "Wrong file size");
 
     // make sure all other writes are unsuccessful/dont complete
-    char buf[BIG_BUFSIZE] = {0};
     res = do_write(fd, buf, sizeof(buf));
     test_assert(res < 0, "Able to write although the file is full");
 #ifdef __KERNEL__
@@ -196,9 +202,8 @@ static void test_filling_file()
     test_assert(do_unlink("hugefile") == 0, "couldnt unlink hugefile");
 }
 
-// Fill up the disk. Apparently to do this, we should need to fill up one
-// entire file, then start to fill up another. We should eventually get
-// the ENOSPC error
+// Fill up the disk. A single file can outgrow the disk, so it alone should
+// eventually get the ENOSPC error, and another file none of the space
 static void test_running_out_of_blocks()
 {
     int res = 0;
@@ -206,21 +211,26 @@ static void test_running_out_of_blocks()
     int fd1 = do_open("fullfile", O_RDWR | O_CREAT);
 
     res = write_until_fail(fd1);
-    test_assert(res == 0, "Ran out of space quicker than we expected");
+#ifdef __KERNEL__
+    test_assert(res == -ENOSPC, "Did not get nospc error");
+#else
+    test_assert(res < 0 && errno == ENOSPC, "Did not get nospc error");
+#endif
 
-    int fd2 = do_open("partiallyfullfile", O_RDWR | O_CREAT);
+    int fd2 = do_open("emptyfile", O_RDWR | O_CREAT);
     res = write_until_fail(fd2);
 #ifdef __KERNEL__
     test_assert(res == -ENOSPC, "Did not get nospc error");
 #else
-    test_assert(errno == ENOSPC, "Did not get nospc error");
+    test_assert(res < 0 && errno == ENOSPC, "Did not get nospc error");
 #endif
+    test_assert(do_lseek(fd2, 0, SEEK_END) == 0, "Wrote to a full disk");
 
     test_assert(do_close(fd1) == 0, "could not close");
     test_assert(do_close(fd2) == 0, "could not close");
 
     test_assert(do_unlink("fullfile") == 0, "couldnt do_unlink file");
-    test_assert(do_unlink("partiallyfullfile") == 0, "couldnt do_unlink file");
+    test_assert(do_unlink("emptyfile") == 0, "couldnt do_unlink file");
 }
 
 // Open a new file, write to some random address in the file,